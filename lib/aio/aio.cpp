@@ -1,7 +1,9 @@
 #include "../libfilezilla/aio/aio.hpp"
 #include "../libfilezilla/event_handler.hpp"
 #include "../libfilezilla/logger.hpp"
+#include "../libfilezilla/string.hpp"
 #include "../libfilezilla/util.hpp"
+#include "../tracepoints.hpp"
 
 #ifdef FZ_WINDOWS
 #include "../libfilezilla/glue/windows.hpp"
@@ -11,8 +13,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 #endif
 
+#include <atomic>
+#include <limits>
 
 namespace {
 size_t get_page_size()
@@ -24,14 +31,34 @@ size_t get_page_size()
 #endif
 	return page_size;
 }
+
+// Memory available to all elastic pools for growing beyond their initial size
+std::atomic<uint64_t> elastic_memory_limit{std::numeric_limits<uint64_t>::max()};
+std::atomic<uint64_t> elastic_memory_used{};
+
+bool reserve_elastic_memory(uint64_t size)
+{
+	uint64_t used = elastic_memory_used.load(std::memory_order_relaxed);
+	do {
+		if (used + size > elastic_memory_limit.load(std::memory_order_relaxed)) {
+			return false;
+		}
+	} while (!elastic_memory_used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+	return true;
+}
+
+void release_elastic_memory(uint64_t size)
+{
+	elastic_memory_used.fetch_sub(size, std::memory_order_relaxed);
+}
 }
 
 namespace fz {
 
 buffer_lease::buffer_lease(buffer_lease && op) noexcept
 {
-	pool_ = op.pool_;
-	op.pool_ = nullptr;
+	source_ = op.source_;
+	op.source_ = nullptr;
 	buffer_ = std::move(op.buffer_);
 }
 
@@ -39,8 +66,8 @@ buffer_lease& buffer_lease::operator=(buffer_lease && op) noexcept
 {
 	if (this != &op) {
 		release();
-		pool_ = op.pool_;
-		op.pool_ = nullptr;
+		source_ = op.source_;
+		op.source_ = nullptr;
 		buffer_ = std::move(op.buffer_);
 	}
 	return *this;
@@ -48,9 +75,9 @@ buffer_lease& buffer_lease::operator=(buffer_lease && op) noexcept
 
 void buffer_lease::release()
 {
-	if (pool_) {
-		pool_->release(std::move(buffer_));
-		pool_ = nullptr;
+	if (source_) {
+		source_->release(std::move(buffer_));
+		source_ = nullptr;
 	}
 }
 
@@ -58,24 +85,28 @@ void buffer_lease::release()
 void aio_waitable::add_waiter(aio_waiter & h)
 {
 	scoped_lock l(m_);
-	waiting_.emplace_back(&h);
+	if (std::find_if(waiting_.cbegin(), waiting_.cend(), [&](waiter const& w) { return w.waiter_ == &h; }) == waiting_.cend()) {
+		waiting_.push_back({&h, nullptr});
+	}
 }
 
 void aio_waitable::add_waiter(event_handler & h)
 {
 	scoped_lock l(m_);
-	waiting_handlers_.emplace_back(&h);
+	if (std::find_if(waiting_.cbegin(), waiting_.cend(), [&](waiter const& w) { return w.handler_ == &h; }) == waiting_.cend()) {
+		waiting_.push_back({nullptr, &h});
+	}
 }
 
 void aio_waitable::remove_waiter(aio_waiter & h)
 {
 	scoped_lock l(m_);
-	while (active_signalling_ == &h) {
+	while (std::find(active_signalling_.cbegin(), active_signalling_.cend(), &h) != active_signalling_.cend()) {
 		l.unlock();
 		yield();
 		l.lock();
 	}
-	waiting_.erase(std::remove(waiting_.begin(), waiting_.end(), &h), waiting_.end());
+	waiting_.erase(std::remove_if(waiting_.begin(), waiting_.end(), [&](waiter const& w) { return w.waiter_ == &h; }), waiting_.end());
 }
 
 namespace {
@@ -90,7 +121,7 @@ void remove_pending_events(event_handler& h, aio_waitable & w)
 		}
 		return false;
 	};
-	h.event_loop_.filter_events(event_filter);
+	h.get_event_loop().filter_events(event_filter);
 }
 }
 
@@ -98,40 +129,42 @@ void aio_waitable::remove_waiter(event_handler & h)
 {
 	scoped_lock l(m_);
 	remove_pending_events(h, *this);
-	waiting_handlers_.erase(std::remove(waiting_handlers_.begin(), waiting_handlers_.end(), &h), waiting_handlers_.end());
+	waiting_.erase(std::remove_if(waiting_.begin(), waiting_.end(), [&](waiter const& w) { return w.handler_ == &h; }), waiting_.end());
 }
 
 void aio_waitable::remove_waiters()
 {
 	scoped_lock l(m_);
-	while (active_signalling_) {
+	while (!active_signalling_.empty()) {
 		l.unlock();
 		yield();
 		l.lock();
 	}
-	waiting_.clear();
 
-	for (auto * h : waiting_handlers_) {
-		remove_pending_events(*h, *this);
+	for (auto const& w : waiting_) {
+		if (w.handler_) {
+			remove_pending_events(*w.handler_, *this);
+		}
 	}
-	waiting_handlers_.clear();
+	waiting_.clear();
 }
 
-void aio_waitable::signal_availibility()
+void aio_waitable::signal_availibility(size_t count)
 {
 	scoped_lock l(m_);
-	if (!waiting_.empty()) {
-		active_signalling_ = waiting_.back();
-		waiting_.pop_back();
-		l.unlock();
-		active_signalling_->on_buffer_availability(this);
-		l.lock();
-		active_signalling_ = nullptr;
-		return;
-	}
-	if (!waiting_handlers_.empty()) {
-		waiting_handlers_.back()->send_event<aio_buffer_event>(this);
-		waiting_handlers_.pop_back();
+	for (; count && !waiting_.empty(); --count) {
+		waiter const w = waiting_.front();
+		waiting_.pop_front();
+		if (w.handler_) {
+			w.handler_->send_event<aio_buffer_event>(this);
+		}
+		else {
+			active_signalling_.push_back(w.waiter_);
+			l.unlock();
+			w.waiter_->on_buffer_availability(this);
+			l.lock();
+			active_signalling_.erase(std::find(active_signalling_.begin(), active_signalling_.end(), w.waiter_));
+		}
 	}
 }
 
@@ -140,14 +173,95 @@ void aio_waitable::signal_availibility()
 aio_buffer_pool::shm_handle const aio_buffer_pool::shm_handle_default{INVALID_HANDLE_VALUE};
 #endif
 
+namespace {
+aio_buffer_pool_options make_options(size_t buffer_count, size_t buffer_size, bool use_shm)
+{
+	aio_buffer_pool_options options;
+	options.buffer_count = buffer_count;
+	options.buffer_size = buffer_size;
+	options.use_shm = use_shm;
+	return options;
+}
+
+#if !FZ_WINDOWS
+std::string read_small_file(char const* path)
+{
+	std::string ret;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		char buf[4096];
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r > 0) {
+			ret.assign(buf, static_cast<size_t>(r));
+		}
+		close(fd);
+	}
+	return ret;
+}
+#endif
+
+// Size of explicitly reserved huge pages, 0 if unsupported
+size_t get_huge_page_size()
+{
+#if FZ_WINDOWS
+	return GetLargePageMinimum();
+#elif defined(MAP_HUGETLB)
+	static size_t const huge_page_size = []() -> size_t {
+		std::string const meminfo = read_small_file("/proc/meminfo");
+		auto pos = meminfo.find("Hugepagesize:");
+		if (pos == std::string::npos) {
+			return 0;
+		}
+		return static_cast<size_t>(to_integral<uint64_t>(trimmed(meminfo.substr(pos + 13, meminfo.find("kB", pos) - pos - 13)))) * 1024;
+	}();
+	return huge_page_size;
+#else
+	return 0;
+#endif
+}
+
+#if defined(__linux__) && defined(SYS_mbind)
+// From linux/mempolicy.h
+int const mpol_bind = 2;
+int const mpol_interleave = 3;
+
+std::vector<unsigned int> online_numa_nodes()
+{
+	// Format is a list of ranges, e.g. 0-3,6
+	std::vector<unsigned int> ret;
+	std::string const online = trimmed(read_small_file("/sys/devices/system/node/online"));
+	for (auto const& range : strtok_view(online, ",")) {
+		auto const dash = range.find('-');
+		unsigned int const first = to_integral<unsigned int>(range.substr(0, dash));
+		unsigned int const last = dash == std::string_view::npos ? first : to_integral<unsigned int>(range.substr(dash + 1));
+		for (unsigned int node = first; node <= last; ++node) {
+			ret.push_back(node);
+		}
+	}
+	return ret;
+}
+#endif
+}
+
 #if FZ_MAC
 aio_buffer_pool::aio_buffer_pool(logger_interface & logger, size_t buffer_count, size_t buffer_size, bool use_shm, std::string_view application_group_id)
+	: aio_buffer_pool(logger, [&]{
+		auto options = make_options(buffer_count, buffer_size, use_shm);
+		options.application_group_id = application_group_id;
+		return options;
+	}())
 #else
 aio_buffer_pool::aio_buffer_pool(logger_interface & logger, size_t buffer_count, size_t buffer_size, bool use_shm)
+	: aio_buffer_pool(logger, make_options(buffer_count, buffer_size, use_shm))
 #endif
+{
+}
+
+aio_buffer_pool::aio_buffer_pool(logger_interface & logger, aio_buffer_pool_options const& options)
 	: logger_{logger}
-	, buffer_count_{buffer_count}
+	, buffer_count_{options.buffer_count}
 {
+	size_t buffer_size = options.buffer_size;
 	if (!buffer_size) {
 		buffer_size = 256*1024;
 	}
@@ -161,104 +275,205 @@ aio_buffer_pool::aio_buffer_pool(logger_interface & logger, size_t buffer_count,
 
 	// Since different threads/processes operate on different buffers at the same time
 	// seperate them with a padding page to prevent false sharing due to automatic prefetching.
-	memory_size_ = (adjusted_buffer_size + psz) * buffer_count + psz;
+	memory_size_ = (adjusted_buffer_size + psz) * buffer_count_ + psz;
+
+	bool hugetlb = options.huge_pages == aio_huge_pages::hugetlb;
+	if (hugetlb) {
+		size_t const hsz = get_huge_page_size();
+		if (!hsz) {
+			logger_.log(logmsg::debug_warning, "Huge pages are not supported");
+			hugetlb = false;
+		}
+		else if (memory_size_ % hsz) {
+			memory_size_ += hsz - memory_size_ % hsz;
+		}
+	}
 
-	if (use_shm) {
-#if FZ_WINDOWS
-		shm_ = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(memory_size_), nullptr);
-		if (!shm_ || shm_ == INVALID_HANDLE_VALUE) {
-			shm_ = INVALID_HANDLE_VALUE;
-			DWORD err = GetLastError();
-			logger_.log(logmsg::debug_warning, "CreateFileMapping failed with error %u", err);
-			return;
+	if (options.use_shm) {
+		if (!create_shm(options, hugetlb) && hugetlb) {
+			logger_.log(logmsg::debug_warning, "Falling back to regular pages");
+			unmap_memory();
+			create_shm(options, false);
 		}
-		memory_ = static_cast<uint8_t*>(MapViewOfFile(reinterpret_cast<HANDLE>(shm_), FILE_MAP_ALL_ACCESS, 0, 0, memory_size_));
-		if (!memory_) {
-			DWORD err = GetLastError();
-			logger_.log(logmsg::debug_warning, "MapViewOfFile failed with error %u", err);
-			return;
+	}
+	else if (hugetlb || options.huge_pages == aio_huge_pages::transparent || options.numa_policy != aio_numa_policy::none) {
+		if (!map_memory(hugetlb, options) && hugetlb) {
+			logger_.log(logmsg::debug_warning, "Falling back to regular pages");
+			map_memory(false, options);
 		}
+	}
+	else {
+		// Page-aligned, as needed for unbuffered I/O
+		allocation_ = new(std::nothrow) uint8_t[memory_size_ + psz];
+		if (allocation_) {
+			memory_ = allocation_ + (psz - reinterpret_cast<uintptr_t>(allocation_) % psz) % psz;
+		}
+	}
+	if (memory_) {
+		apply_memory_policy(options);
+
+		buffer_size_ = buffer_size;
+		buffer_stride_ = adjusted_buffer_size + psz;
+		buffers_.reserve(buffer_count_);
+		auto *p = memory_ + psz;
+		for (size_t i = 0; i < buffer_count_; ++i, p += buffer_stride_) {
+			buffers_.emplace_back(p, buffer_size);
+		}
+		max_buffer_count_ = buffer_count_;
+		stats_.buffers = buffer_count_;
+	}
+}
+
+bool aio_buffer_pool::create_shm(aio_buffer_pool_options const& options, bool hugetlb)
+{
+#if FZ_WINDOWS
+	DWORD protect = PAGE_READWRITE;
+	DWORD access = FILE_MAP_ALL_ACCESS;
+	if (hugetlb) {
+		protect |= SEC_COMMIT | SEC_LARGE_PAGES;
+		access |= FILE_MAP_LARGE_PAGES;
+	}
+	shm_ = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, protect, static_cast<DWORD>(memory_size_ >> 32), static_cast<DWORD>(memory_size_), nullptr);
+	if (!shm_ || shm_ == INVALID_HANDLE_VALUE) {
+		shm_ = INVALID_HANDLE_VALUE;
+		DWORD err = GetLastError();
+		logger_.log(logmsg::debug_warning, "CreateFileMapping failed with error %u", err);
+		return false;
+	}
+	if (options.numa_policy == aio_numa_policy::bind && !options.numa_nodes.empty()) {
+		memory_ = static_cast<uint8_t*>(MapViewOfFileExNuma(reinterpret_cast<HANDLE>(shm_), access, 0, 0, memory_size_, nullptr, options.numa_nodes.front()));
+	}
+	else {
+		memory_ = static_cast<uint8_t*>(MapViewOfFile(reinterpret_cast<HANDLE>(shm_), access, 0, 0, memory_size_));
+	}
+	if (!memory_) {
+		DWORD err = GetLastError();
+		logger_.log(logmsg::debug_warning, "MapViewOfFile failed with error %u", err);
+		return false;
+	}
 #else
 #if HAVE_MEMFD_CREATE
-		shm_ = memfd_create("aio_buffer_pool", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	unsigned int flags = MFD_CLOEXEC|MFD_ALLOW_SEALING;
+	if (hugetlb) {
+#ifdef MFD_HUGETLB
+		flags |= MFD_HUGETLB;
 #else
-		std::string name;
+		logger_.log(logmsg::debug_warning, "Huge pages are not supported for shared memory");
+		return false;
+#endif
+	}
+	shm_ = memfd_create("aio_buffer_pool", flags);
+#else
+	if (hugetlb) {
+		logger_.log(logmsg::debug_warning, "Huge pages are not supported for shared memory");
+		return false;
+	}
+
+	std::string name;
 #if FZ_MAC
-		// See https://developer.apple.com/library/archive/documentation/Security/Conceptual/AppSandboxDesignGuide/AppSandboxInDepth/AppSandboxInDepth.html#//apple_ref/doc/uid/TP40011183-CH3-SW24
-		if (!application_group_id.empty()) {
-			name = std::string(application_group_id) + "/" + base32_encode(random_bytes(10), base32_type::locale_safe, false);
-		}
-		else
+	// See https://developer.apple.com/library/archive/documentation/Security/Conceptual/AppSandboxDesignGuide/AppSandboxInDepth/AppSandboxInDepth.html#//apple_ref/doc/uid/TP40011183-CH3-SW24
+	if (!options.application_group_id.empty()) {
+		name = options.application_group_id + "/" + base32_encode(random_bytes(10), base32_type::locale_safe, false);
+	}
+	else
 #endif
-		{
-			name = "/" + base32_encode(random_bytes(16), base32_type::locale_safe, false);
-		}
+	{
+		name = "/" + base32_encode(random_bytes(16), base32_type::locale_safe, false);
+	}
 
-		shm_ = shm_open(name.c_str(), O_CREAT|O_EXCL|O_RDWR, S_IRUSR|S_IWUSR);
-		if (shm_ != -1) {
-			shm_unlink(name.c_str());
-		}
+	shm_ = shm_open(name.c_str(), O_CREAT|O_EXCL|O_RDWR, S_IRUSR|S_IWUSR);
+	if (shm_ != -1) {
+		shm_unlink(name.c_str());
+	}
 #endif
-		if (shm_ == -1) {
-			int err = errno;
-			logger_.log(logmsg::debug_warning, L"Could not create shm_fd_, errno=%d", err);
-			return;
-		}
+	if (shm_ == -1) {
+		int err = errno;
+		logger_.log(logmsg::debug_warning, L"Could not create shm_fd_, errno=%d", err);
+		return false;
+	}
 
 #if FZ_MAC
-		// There's a bug on macOS: ftruncate can only be called _once_ on a shared memory object.
-		// The manpages do not cover this bug, only XNU's bsd/kern/posix_shm.c mentions it.
-		struct stat s;
-		if (fstat(shm_, &s) != 0) {
-			int err = errno;
-			logger_.log(logmsg::debug_warning, "fstat failed with error %d", err);
-			return;
-		}
+	// There's a bug on macOS: ftruncate can only be called _once_ on a shared memory object.
+	// The manpages do not cover this bug, only XNU's bsd/kern/posix_shm.c mentions it.
+	struct stat s;
+	if (fstat(shm_, &s) != 0) {
+		int err = errno;
+		logger_.log(logmsg::debug_warning, "fstat failed with error %d", err);
+		return false;
+	}
 
-		if (s.st_size < 0 || static_cast<size_t>(s.st_size) < memory_size_)
+	if (s.st_size < 0 || static_cast<size_t>(s.st_size) < memory_size_)
 #endif
-		{
-			if (ftruncate(shm_, memory_size_) != 0) {
-				int err = errno;
-				logger_.log(logmsg::debug_warning, "ftruncate failed with error %d", err);
-				return;
-			}
+	{
+		if (ftruncate(shm_, memory_size_) != 0) {
+			int err = errno;
+			logger_.log(logmsg::debug_warning, "ftruncate failed with error %d", err);
+			return false;
 		}
+	}
 
 #if HAVE_MEMFD_CREATE
-		if (fcntl(shm_, F_ADD_SEALS, F_SEAL_SHRINK)) {
-			int err = errno;
-			logger_.log(logmsg::debug_warning, "sealing failed with error %d", err);
-			return;
-		}
+	if (fcntl(shm_, F_ADD_SEALS, F_SEAL_SHRINK)) {
+		int err = errno;
+		logger_.log(logmsg::debug_warning, "sealing failed with error %d", err);
+		return false;
+	}
 #endif
 
-		memory_ = static_cast<uint8_t*>(mmap(nullptr, memory_size_, PROT_READ|PROT_WRITE, MAP_SHARED, shm_, 0));
-		if (!memory_ || memory_ == MAP_FAILED) {
-			int err = errno;
-			logger_.log(logmsg::debug_warning, "mmap failed with error %d", err);
-			return;
-		}
+	void* m = mmap(nullptr, memory_size_, PROT_READ|PROT_WRITE, MAP_SHARED, shm_, 0);
+	if (!m || m == MAP_FAILED) {
+		int err = errno;
+		logger_.log(logmsg::debug_warning, "mmap failed with error %d", err);
+		return false;
+	}
+	memory_ = static_cast<uint8_t*>(m);
 #endif
+	(void)options;
+	return true;
+}
+
+bool aio_buffer_pool::map_memory(bool hugetlb, aio_buffer_pool_options const& options)
+{
+#if FZ_WINDOWS
+	DWORD type = MEM_RESERVE | MEM_COMMIT;
+	if (hugetlb) {
+		type |= MEM_LARGE_PAGES;
+	}
+	if (options.numa_policy == aio_numa_policy::bind && !options.numa_nodes.empty()) {
+		memory_ = static_cast<uint8_t*>(VirtualAllocExNuma(GetCurrentProcess(), nullptr, memory_size_, type, PAGE_READWRITE, options.numa_nodes.front()));
 	}
 	else {
-		memory_ = new(std::nothrow) uint8_t[memory_size_];
+		memory_ = static_cast<uint8_t*>(VirtualAlloc(nullptr, memory_size_, type, PAGE_READWRITE));
 	}
-	if (memory_) {
-		buffers_.reserve(buffer_count);
-		auto *p = memory_ + psz;
-		for (size_t i = 0; i < buffer_count; ++i, p += adjusted_buffer_size + psz) {
-			buffers_.emplace_back(p, buffer_size);
-		}
+	if (!memory_) {
+		DWORD err = GetLastError();
+		logger_.log(logmsg::debug_warning, "VirtualAlloc failed with error %u", err);
+		return false;
+	}
+#else
+	(void)options;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (hugetlb) {
+#ifdef MAP_HUGETLB
+		flags |= MAP_HUGETLB;
+#else
+		return false;
+#endif
+	}
+	void* m = mmap(nullptr, memory_size_, PROT_READ|PROT_WRITE, flags, -1, 0);
+	if (!m || m == MAP_FAILED) {
+		int err = errno;
+		logger_.log(logmsg::debug_warning, "mmap failed with error %d", err);
+		return false;
 	}
+	memory_ = static_cast<uint8_t*>(m);
+#endif
+	mapped_ = true;
+	return true;
 }
 
-aio_buffer_pool::~aio_buffer_pool() noexcept
+void aio_buffer_pool::unmap_memory()
 {
-	scoped_lock l(mtx_);
-	if (memory_ && buffers_.size() != buffer_count_) {
-		abort();
-	}
 	if (shm_ != shm_handle_default) {
 #if FZ_WINDOWS
 		if (memory_) {
@@ -270,25 +485,88 @@ aio_buffer_pool::~aio_buffer_pool() noexcept
 			munmap(memory_, memory_size_);
 		}
 		close(shm_);
+#endif
+		shm_ = shm_handle_default;
+	}
+	else if (mapped_) {
+#if FZ_WINDOWS
+		VirtualFree(memory_, 0, MEM_RELEASE);
+#else
+		munmap(memory_, memory_size_);
 #endif
 	}
 	else {
-		delete [] memory_;
+		delete [] allocation_;
+		allocation_ = nullptr;
 	}
+	memory_ = nullptr;
+	mapped_ = false;
 }
 
-buffer_lease aio_buffer_pool::get_buffer(aio_waiter & h)
+void aio_buffer_pool::apply_memory_policy(aio_buffer_pool_options const& options)
 {
-	buffer_lease ret;
+	// Memory has not been touched yet, so the policy still applies to all pages
+	if (options.huge_pages == aio_huge_pages::transparent) {
+#ifdef MADV_HUGEPAGE
+		if (madvise(memory_, memory_size_, MADV_HUGEPAGE) != 0) {
+			int err = errno;
+			logger_.log(logmsg::debug_warning, "madvise failed with error %d", err);
+		}
+#endif
+	}
+
+	if (options.numa_policy == aio_numa_policy::none) {
+		return;
+	}
+#if defined(__linux__) && defined(SYS_mbind)
+	std::vector<unsigned int> nodes = options.numa_nodes;
+	if (nodes.empty() && options.numa_policy == aio_numa_policy::interleave) {
+		nodes = online_numa_nodes();
+	}
 
+	unsigned long mask[16]{};
+	size_t const mask_bits = sizeof(mask) * 8;
+	for (auto node : nodes) {
+		if (node < mask_bits) {
+			mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+		}
+	}
+	if (nodes.empty()) {
+		logger_.log(logmsg::debug_warning, "No NUMA nodes to bind to");
+		return;
+	}
+
+	int const mode = options.numa_policy == aio_numa_policy::bind ? mpol_bind : mpol_interleave;
+	if (syscall(SYS_mbind, memory_, memory_size_, mode, mask, mask_bits + 1, 0) != 0) {
+		int err = errno;
+		logger_.log(logmsg::debug_warning, "mbind failed with error %d", err);
+	}
+#elif FZ_WINDOWS
+	// Binding has been done on allocation
+	if (options.numa_policy == aio_numa_policy::interleave) {
+		logger_.log(logmsg::debug_warning, "Interleaving memory across NUMA nodes is not supported");
+	}
+#endif
+}
+
+aio_buffer_pool::~aio_buffer_pool() noexcept
+{
 	scoped_lock l(mtx_);
-	if (buffers_.empty()) {
-		l.unlock();
-		add_waiter(h);
+	if (memory_ && buffers_.size() != stats_.buffers) {
+		abort();
 	}
-	else {
-		ret = buffer_lease(buffers_.back(), this);
-		buffers_.pop_back();
+	for (auto const& extra : extra_buffers_) {
+		delete [] extra.second;
+		release_elastic_memory(buffer_size_ + get_page_size());
+	}
+	unmap_memory();
+}
+
+buffer_lease aio_buffer_pool::get_buffer(aio_waiter & h)
+{
+	buffer_lease ret;
+	if (!try_get_buffer(ret, &h)) {
+		add_waiter(h);
 	}
 	return ret;
 }
@@ -296,31 +574,189 @@ buffer_lease aio_buffer_pool::get_buffer(aio_waiter & h)
 buffer_lease aio_buffer_pool::get_buffer(event_handler & h)
 {
 	buffer_lease ret;
+	if (!try_get_buffer(ret, &h)) {
+		add_waiter(h);
+	}
+	return ret;
+}
 
+bool aio_buffer_pool::try_get_buffer(buffer_lease & lease, void const* waiter)
+{
 	scoped_lock l(mtx_);
+	if (buffers_.empty() && stats_.buffers < max_buffer_count_) {
+		// Grow. Over-allocate so that the buffer can be page-aligned like those in the initial region.
+		size_t const psz = get_page_size();
+		if (!reserve_elastic_memory(buffer_size_ + psz)) {
+			++stats_.limited;
+		}
+		else {
+			uint8_t* memory = new(std::nothrow) uint8_t[buffer_size_ + psz];
+			if (!memory) {
+				release_elastic_memory(buffer_size_ + psz);
+			}
+			else {
+				uint8_t* p = memory + (psz - reinterpret_cast<uintptr_t>(memory) % psz) % psz;
+				extra_buffers_.emplace(p, memory);
+				buffers_.emplace_back(p, buffer_size_);
+				++stats_.buffers;
+			}
+		}
+	}
+
+	auto it = std::find_if(waiting_since_.begin(), waiting_since_.end(), [&](auto const& w) { return w.first == waiter; });
 	if (buffers_.empty()) {
-		l.unlock();
-		add_waiter(h);
+		++stats_.waits;
+		FZ_TRACE2(aio_buffer_wait, this, waiter);
+		if (it == waiting_since_.end()) {
+			waiting_since_.emplace_back(waiter, monotonic_clock::coarse_now());
+		}
+		return false;
 	}
-	else {
-		ret = buffer_lease(buffers_.back(), this);
-		buffers_.pop_back();
+
+	lease = buffer_lease_source::lease(buffers_.back());
+	buffers_.pop_back();
+
+	++stats_.leased;
+	stats_.peak_leased = std::max(stats_.peak_leased, stats_.leased);
+	FZ_TRACE3(aio_buffer_lease, this, lease->get(), stats_.leased);
+	if (it != waiting_since_.end()) {
+		stats_.wait_time += monotonic_clock::coarse_now() - it->second;
+		waiting_since_.erase(it);
+	}
+
+	return true;
+}
+
+uint8_t* aio_buffer_pool::buffer_start(uint8_t* p) const
+{
+	if (!p) {
+		return nullptr;
 	}
+
+	size_t const psz = get_page_size();
+	if (p >= memory_ + psz && p < memory_ + memory_size_) {
+		size_t const index = static_cast<size_t>(p - memory_ - psz) / buffer_stride_;
+		return memory_ + psz + index * buffer_stride_;
+	}
+
+	scoped_lock l(mtx_);
+	auto it = extra_buffers_.upper_bound(p);
+	if (it != extra_buffers_.begin()) {
+		--it;
+		if (p < it->first + buffer_size_) {
+			return it->first;
+		}
+	}
+	return nullptr;
+}
+
+buffer aio_buffer_pool::adopt(buffer_lease && lease)
+{
+	if (lease.source_ != this) {
+		return {};
+	}
+
+	// The lease may have consumed data at the front, get back to the start of its memory
+	uint8_t* p = lease->get();
+	uint8_t* start = buffer_start(p);
+	if (!start) {
+		return {};
+	}
+
+	buffer ret(start, buffer_size_, static_cast<size_t>(p - start), lease->size(), lease_allocator_);
+	lease.source_ = nullptr;
+	lease.buffer_ = nonowning_buffer();
 	return ret;
 }
 
+unsigned char* aio_buffer_pool::lease_allocator::allocate(size_t & capacity)
+{
+	return new unsigned char[capacity];
+}
+
+void aio_buffer_pool::lease_allocator::deallocate(unsigned char* p, size_t capacity) noexcept
+{
+	if (pool_.buffer_start(p) == p) {
+		pool_.release(nonowning_buffer(p, capacity));
+	}
+	else {
+		delete[] p;
+	}
+}
+
 void aio_buffer_pool::release(nonowning_buffer && b)
 {
 	{
 		scoped_lock l(mtx_);
-		auto p = b.get();
-		if (p) {
-			b.clear();
+		do_release(b);
+	}
+
+	signal_availibility();
+}
+
+void aio_buffer_pool::do_release(nonowning_buffer & b)
+{
+	auto p = b.get();
+	if (p) {
+		--stats_.leased;
+		FZ_TRACE3(aio_buffer_release, this, p, stats_.leased);
+		b.clear();
+
+		auto it = extra_buffers_.find(b.get());
+		if (it != extra_buffers_.end() && buffers_.size() >= stats_.leased) {
+			// Shrink, enough idle buffers left
+			delete [] it->second;
+			extra_buffers_.erase(it);
+			--stats_.buffers;
+			release_elastic_memory(buffer_size_ + get_page_size());
+		}
+		else {
 			buffers_.emplace_back(b);
 		}
 	}
+}
+
+void aio_buffer_pool::release_leases(std::list<buffer_lease> & leases)
+{
+	size_t released{};
+	{
+		scoped_lock l(mtx_);
+		for (auto & lease : leases) {
+			if (lease.source_ == this) {
+				do_release(lease.buffer_);
+				lease.source_ = nullptr;
+				++released;
+			}
+		}
+	}
 
-	signal_availibility();
+	// Releases the leases of other sources
+	leases.clear();
+
+	if (released) {
+		signal_availibility(released);
+	}
+}
+
+bool aio_buffer_pool::set_max_buffer_count(size_t max)
+{
+	scoped_lock l(mtx_);
+	if (!memory_ || shm_ != shm_handle_default) {
+		return false;
+	}
+	max_buffer_count_ = std::max(max, buffer_count_);
+	return true;
+}
+
+void aio_buffer_pool::set_memory_limit(uint64_t octets)
+{
+	elastic_memory_limit = octets;
+}
+
+aio_buffer_pool_stats aio_buffer_pool::get_stats() const
+{
+	scoped_lock l(mtx_);
+	return stats_;
 }
 
 std::tuple<aio_buffer_pool::shm_handle, uint8_t const*, size_t> aio_buffer_pool::shared_memory_info() const
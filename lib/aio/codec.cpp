@@ -0,0 +1,319 @@
+#include "../libfilezilla/aio/codec.hpp"
+#include "../libfilezilla/logger.hpp"
+
+namespace fz {
+
+codec_reader::codec_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, thread_pool & tpool, std::unique_ptr<stream_codec> && codec, size_t max_buffers) noexcept
+	: threaded_reader(reader ? reader->name() : std::wstring(), pool, max_buffers)
+	, reader_(std::move(reader))
+	, codec_(std::move(codec))
+	, thread_pool_(tpool)
+{
+	scoped_lock l(mtx_);
+	if (!reader_ || !codec_) {
+		error_ = true;
+	}
+	else if (!seek(0)) {
+		error_ = true;
+	}
+}
+
+codec_reader::~codec_reader() noexcept
+{
+	close();
+}
+
+datetime codec_reader::mtime() const
+{
+	return reader_ ? reader_->mtime() : datetime();
+}
+
+void codec_reader::do_close(scoped_lock & l)
+{
+	quit_ = true;
+	cond_.signal(l);
+	l.unlock();
+	task_.join();
+	if (reader_) {
+		reader_->close();
+	}
+	l.lock();
+}
+
+bool codec_reader::do_seek(scoped_lock &)
+{
+	// Not seekable, only reached for the initial seek to the start.
+	task_ = thread_pool_.spawn([this]{ entry(); });
+	return task_.operator bool();
+}
+
+void codec_reader::on_buffer_availability(aio_waitable const* w)
+{
+	scoped_lock l(mtx_);
+	if (w == reader_.get()) {
+		reader_waiting_ = false;
+	}
+	cond_.signal(l);
+}
+
+void codec_reader::entry()
+{
+	scoped_lock l(mtx_);
+
+	buffer_lease in;
+	bool in_eof{};
+	buffer_lease out;
+
+	while (!quit_ && !error_) {
+		bool const have_input = in && !in->empty();
+		if (codec_->done()) {
+			if (have_input) {
+				logger_.log(logmsg::error, L"Unexpected data after the end of the stream in '%s'", name_);
+				error_ = true;
+				break;
+			}
+			if (in_eof) {
+				eof_ = true;
+				break;
+			}
+		}
+
+		if (!have_input && !in_eof) {
+			if (reader_waiting_) {
+				cond_.wait(l);
+				continue;
+			}
+
+			// Set beforehand, the wrapped reader might signal us before it returns
+			reader_waiting_ = true;
+			l.unlock();
+			auto [r, b] = reader_->get_buffer(static_cast<aio_waiter&>(*this));
+			l.lock();
+			if (quit_) {
+				return;
+			}
+			if (r != aio_result::wait) {
+				reader_waiting_ = false;
+			}
+			if (r == aio_result::error) {
+				error_ = true;
+			}
+			else if (r == aio_result::ok) {
+				in = std::move(b);
+				in_eof = !in;
+			}
+			continue;
+		}
+
+		if (!out) {
+			if (buffers_.size() == max_buffers_) {
+				cond_.wait(l);
+				continue;
+			}
+			out = buffer_pool_.get_buffer(*this);
+			if (!out) {
+				cond_.wait(l);
+			}
+			continue;
+		}
+
+		size_t in_len = have_input ? in->size() : 0;
+		size_t out_len = out->capacity() - out->size();
+		uint8_t const* p = have_input ? in->get() : nullptr;
+		uint8_t* q = out->get(out_len);
+
+		l.unlock();
+		bool const ok = codec_->process(p, in_len, q, out_len, in_eof);
+		l.lock();
+		if (quit_) {
+			return;
+		}
+		if (!ok) {
+			logger_.log(logmsg::error, L"Could not process data from '%s'", name_);
+			error_ = true;
+			break;
+		}
+
+		if (have_input) {
+			in->consume(in_len);
+		}
+		out->add(out_len);
+		if (out->size() == out->capacity() || (codec_->done() && !out->empty())) {
+			buffers_.emplace_back(std::move(out));
+			if (buffers_.size() == 1) {
+				signal_availibility();
+			}
+		}
+	}
+
+	if ((eof_ || error_) && !quit_ && buffers_.empty()) {
+		signal_availibility();
+	}
+}
+
+
+codec_writer::codec_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, thread_pool & tpool, std::unique_ptr<stream_codec> && codec, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+	: threaded_writer(name, pool, std::move(progress_cb), max_buffers)
+	, writer_(std::move(writer))
+	, codec_(std::move(codec))
+{
+	if (writer_ && codec_) {
+		task_ = tpool.spawn([this]{ entry(); });
+	}
+	if (!task_) {
+		error_ = true;
+	}
+}
+
+codec_writer::~codec_writer() noexcept
+{
+	close();
+}
+
+bool codec_writer::set_mtime(datetime const& t)
+{
+	return writer_ && writer_->set_mtime(t);
+}
+
+void codec_writer::do_close(scoped_lock & l)
+{
+	threaded_writer::do_close(l);
+	output_.release();
+	if (writer_) {
+		l.unlock();
+		writer_->close();
+		l.lock();
+	}
+}
+
+aio_result codec_writer::continue_finalize(scoped_lock & l)
+{
+	// The codec needs to be flushed in any case
+	wakeup(l);
+	return aio_result::wait;
+}
+
+void codec_writer::on_buffer_availability(aio_waitable const* w)
+{
+	scoped_lock l(mtx_);
+	if (w == writer_.get()) {
+		writer_waiting_ = false;
+	}
+	cond_.signal(l);
+}
+
+bool codec_writer::flush_output(scoped_lock & l)
+{
+	buffer_lease b = std::move(output_);
+
+	// Set beforehand, the wrapped writer might signal us before it returns
+	writer_waiting_ = true;
+	l.unlock();
+	auto const r = writer_->add_buffer(std::move(b), static_cast<aio_waiter&>(*this));
+	l.lock();
+	if (r != aio_result::wait) {
+		writer_waiting_ = false;
+	}
+	if (r == aio_result::error) {
+		error_ = true;
+	}
+	return !quit_ && !error_;
+}
+
+void codec_writer::entry()
+{
+	scoped_lock l(mtx_);
+	while (!quit_ && !error_) {
+		if (writer_waiting_) {
+			cond_.wait(l);
+			continue;
+		}
+
+		if (output_ && (output_->size() == output_->capacity() || (codec_->done() && !output_->empty()))) {
+			if (!flush_output(l)) {
+				break;
+			}
+			continue;
+		}
+
+		bool const finish = buffers_.empty() && finalizing_ == 1;
+		if (buffers_.empty() && !finish) {
+			cond_.wait(l);
+			continue;
+		}
+
+		if (codec_->done()) {
+			if (!finish) {
+				buffer_pool_.logger().log(logmsg::error, L"Unexpected data after the end of the stream for '%s'", name_);
+				error_ = true;
+				break;
+			}
+
+			writer_waiting_ = true;
+			l.unlock();
+			auto const r = writer_->finalize(static_cast<aio_waiter&>(*this));
+			l.lock();
+			if (quit_) {
+				return;
+			}
+			if (r != aio_result::wait) {
+				writer_waiting_ = false;
+			}
+			if (r == aio_result::error) {
+				error_ = true;
+			}
+			else if (r == aio_result::ok) {
+				finalizing_ = 2;
+				signal_availibility();
+				return;
+			}
+			continue;
+		}
+
+		if (!output_) {
+			output_ = buffer_pool_.get_buffer(*this);
+			if (!output_) {
+				cond_.wait(l);
+			}
+			continue;
+		}
+
+		size_t in_len = finish ? 0 : buffers_.front()->size();
+		uint8_t const* p = finish ? nullptr : buffers_.front()->get();
+		size_t out_len = output_->capacity() - output_->size();
+		uint8_t* q = output_->get(out_len);
+
+		l.unlock();
+		bool const ok = codec_->process(p, in_len, q, out_len, finish);
+		l.lock();
+		if (quit_) {
+			return;
+		}
+		if (!ok) {
+			buffer_pool_.logger().log(logmsg::error, L"Could not process data for '%s'", name_);
+			error_ = true;
+			break;
+		}
+
+		output_->add(out_len);
+		if (!finish) {
+			auto & b = buffers_.front();
+			b->consume(in_len);
+			if (progress_cb_) {
+				progress_cb_(this, static_cast<uint64_t>(in_len));
+			}
+			if (b->empty()) {
+				bool const signal = buffers_.size() == max_buffers_;
+				buffers_.erase(buffers_.begin());
+				if (signal) {
+					signal_availibility();
+				}
+			}
+		}
+	}
+
+	if (error_ && !quit_) {
+		signal_availibility();
+	}
+}
+}
@@ -0,0 +1,142 @@
+#include "../libfilezilla/aio/compression.hpp"
+#include "../libfilezilla/logger.hpp"
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <limits>
+
+namespace fz {
+
+class compression_codec final : public stream_codec
+{
+public:
+	compression_codec(compression_mode mode, int level);
+	~compression_codec();
+
+	compression_codec(compression_codec const&) = delete;
+	compression_codec& operator=(compression_codec const&) = delete;
+
+	bool valid() const { return valid_; }
+
+	virtual bool done() const override { return done_; }
+	virtual bool process(uint8_t const* in, size_t & in_len, uint8_t* out, size_t & out_len, bool finish) override;
+
+private:
+	compression_mode const mode_;
+	bool valid_{};
+	bool done_{};
+
+#if HAVE_ZLIB
+	z_stream stream_{};
+#endif
+};
+
+#if HAVE_ZLIB
+compression_codec::compression_codec(compression_mode mode, int level)
+	: mode_(mode)
+{
+	if (mode_ == compression_mode::compress) {
+		if (level < 1 || level > 9) {
+			level = Z_DEFAULT_COMPRESSION;
+		}
+		valid_ = deflateInit(&stream_, level) == Z_OK;
+	}
+	else {
+		valid_ = inflateInit(&stream_) == Z_OK;
+	}
+}
+
+compression_codec::~compression_codec()
+{
+	if (valid_) {
+		if (mode_ == compression_mode::compress) {
+			deflateEnd(&stream_);
+		}
+		else {
+			inflateEnd(&stream_);
+		}
+	}
+}
+
+bool compression_codec::process(uint8_t const* in, size_t & in_len, uint8_t* out, size_t & out_len, bool finish)
+{
+	if (!valid_ || done_) {
+		return false;
+	}
+
+	size_t const max = std::numeric_limits<uInt>::max();
+	size_t const avail_in = std::min(in_len, max);
+	size_t const avail_out = std::min(out_len, max);
+
+	stream_.next_in = const_cast<Bytef*>(in);
+	stream_.avail_in = static_cast<uInt>(avail_in);
+	stream_.next_out = out;
+	stream_.avail_out = static_cast<uInt>(avail_out);
+
+	int res;
+	if (mode_ == compression_mode::compress) {
+		res = deflate(&stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+	}
+	else {
+		res = inflate(&stream_, Z_NO_FLUSH);
+	}
+
+	in_len = avail_in - stream_.avail_in;
+	out_len = avail_out - stream_.avail_out;
+
+	if (res == Z_STREAM_END) {
+		done_ = true;
+		return true;
+	}
+	else if (res == Z_OK) {
+		return true;
+	}
+	else if (res == Z_BUF_ERROR) {
+		// No progress possible. Once all input has been passed, this means the stream got truncated.
+		return !finish || !avail_out;
+	}
+	return false;
+}
+#else
+compression_codec::compression_codec(compression_mode mode, int)
+	: mode_(mode)
+{
+}
+
+compression_codec::~compression_codec()
+{
+}
+
+bool compression_codec::process(uint8_t const*, size_t &, uint8_t*, size_t &, bool)
+{
+	return false;
+}
+#endif
+
+
+namespace {
+std::unique_ptr<stream_codec> create_codec(compression_mode mode, int level, logger_interface & logger, std::wstring_view name)
+{
+	auto codec = std::make_unique<compression_codec>(mode, level);
+	if (!codec->valid()) {
+		logger.log(logmsg::error, L"Could not initialize compression for '%s'", name);
+		codec.reset();
+	}
+	return codec;
+}
+}
+
+compression_reader::compression_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, thread_pool & tpool, compression_mode mode, int level, size_t max_buffers) noexcept
+	: codec_reader(pool, std::move(reader), tpool, create_codec(mode, level, pool.logger(), reader ? reader->name() : std::wstring()), max_buffers)
+{
+}
+
+compression_writer::compression_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, thread_pool & tpool, compression_mode mode, int level, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+	: codec_writer(name, pool, std::move(writer), tpool, create_codec(mode, level, pool.logger(), name), std::move(progress_cb), max_buffers)
+{
+}
+
+}
@@ -0,0 +1,120 @@
+#include "../libfilezilla/aio/directory_reader.hpp"
+
+namespace fz {
+
+directory_reader::directory_reader(thread_pool & pool, native_string const& path, dir_entry_fields fields, bool dirs_only, bool query_symlink_targets, size_t max_batches, size_t batch_size)
+	: max_batches_(max_batches ? max_batches : 1)
+	, batch_size_(batch_size ? batch_size : 1)
+{
+	scoped_lock l(mtx_);
+	task_ = pool.spawn([this, path, fields, dirs_only, query_symlink_targets] { entry(path, fields, dirs_only, query_symlink_targets); }, "directory reader");
+	if (!task_) {
+		result_ = {result::other};
+	}
+}
+
+directory_reader::~directory_reader()
+{
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	task_.join();
+	remove_waiters();
+}
+
+aio_result directory_reader::get_entries(std::vector<local_filesys::dir_entry> & entries, aio_waiter & h)
+{
+	scoped_lock l(mtx_);
+	auto ret = do_get_entries(l, entries);
+	if (ret == aio_result::wait) {
+		add_waiter(h);
+	}
+	return ret;
+}
+
+aio_result directory_reader::get_entries(std::vector<local_filesys::dir_entry> & entries, event_handler & h)
+{
+	scoped_lock l(mtx_);
+	auto ret = do_get_entries(l, entries);
+	if (ret == aio_result::wait) {
+		add_waiter(h);
+	}
+	return ret;
+}
+
+aio_result directory_reader::do_get_entries(scoped_lock & l, std::vector<local_filesys::dir_entry> & entries)
+{
+	if (batches_.empty()) {
+		if (!result_) {
+			return aio_result::error;
+		}
+		else if (eof_) {
+			entries.clear();
+			return aio_result::ok;
+		}
+		return aio_result::wait;
+	}
+
+	bool const full = batches_.size() == max_batches_;
+	std::swap(entries, batches_.front());
+	spare_ = std::move(batches_.front());
+	batches_.pop_front();
+	if (full) {
+		cond_.signal(l);
+	}
+	return aio_result::ok;
+}
+
+result directory_reader::error() const
+{
+	scoped_lock l(mtx_);
+	return result_;
+}
+
+void directory_reader::entry(native_string const& path, dir_entry_fields fields, bool dirs_only, bool query_symlink_targets)
+{
+	local_filesys fs;
+	auto res = fs.begin_find_files(path, dirs_only, query_symlink_targets);
+
+	scoped_lock l(mtx_);
+	if (!res) {
+		result_ = res;
+		if (!quit_) {
+			signal_availibility();
+		}
+		return;
+	}
+
+	while (!quit_) {
+		if (batches_.size() == max_batches_) {
+			cond_.wait(l);
+			continue;
+		}
+
+		std::vector<local_filesys::dir_entry> batch = std::move(spare_);
+		spare_.clear();
+		l.unlock();
+		bool const more = fs.get_next_files(batch, batch_size_, fields);
+		l.lock();
+		if (quit_) {
+			break;
+		}
+
+		if (!batch.empty()) {
+			batches_.emplace_back(std::move(batch));
+		}
+		if (!more) {
+			eof_ = true;
+		}
+		if (batches_.size() == 1 || (eof_ && batches_.empty())) {
+			signal_availibility();
+		}
+		if (eof_) {
+			break;
+		}
+	}
+}
+
+}
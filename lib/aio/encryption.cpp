@@ -0,0 +1,114 @@
+#include "../libfilezilla/aio/encryption.hpp"
+#include "../libfilezilla/buffer.hpp"
+#include "../libfilezilla/logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace fz {
+
+namespace {
+class encryption_codec final : public stream_codec
+{
+public:
+	encryption_codec(symmetric_key const& key, encryption_mode mode)
+		: mode_(mode)
+		, encryptor_(key)
+		, decryptor_(key)
+	{
+	}
+
+	bool valid() const {
+		return mode_ == encryption_mode::encrypt ? static_cast<bool>(encryptor_) : static_cast<bool>(decryptor_);
+	}
+
+	virtual bool done() const override
+	{
+		return finalized_ && output_.empty();
+	}
+
+	virtual bool process(uint8_t const* in, size_t & in_len, uint8_t* out, size_t & out_len, bool finish) override
+	{
+		// The encryptor and decryptor produce whole chunks, hand them out piecewise
+		size_t consumed{};
+		size_t produced{};
+		while (true) {
+			if (!output_.empty()) {
+				size_t const n = std::min(output_.size(), out_len - produced);
+				if (n) {
+					memcpy(out + produced, output_.get(), n);
+					output_.consume(n);
+					produced += n;
+				}
+				if (!output_.empty()) {
+					break;
+				}
+			}
+
+			bool ok;
+			if (consumed < in_len) {
+				if (finalized_) {
+					return false;
+				}
+				size_t const n = std::min(in_len - consumed, size_t(stream_encryptor::encrypted_chunk_size));
+				if (mode_ == encryption_mode::encrypt) {
+					ok = encryptor_.encrypt(in + consumed, n, output_);
+				}
+				else {
+					ok = decryptor_.decrypt(in + consumed, n, output_);
+				}
+				consumed += n;
+			}
+			else if (finish && !finalized_) {
+				if (mode_ == encryption_mode::encrypt) {
+					ok = encryptor_.finalize(output_);
+				}
+				else {
+					ok = decryptor_.finalize(output_);
+				}
+				finalized_ = true;
+			}
+			else {
+				break;
+			}
+			if (!ok) {
+				return false;
+			}
+		}
+
+		in_len = consumed;
+		out_len = produced;
+		return true;
+	}
+
+private:
+	encryption_mode const mode_;
+	stream_encryptor encryptor_;
+	stream_decryptor decryptor_;
+
+	buffer output_;
+	bool finalized_{};
+};
+
+std::unique_ptr<stream_codec> create_codec(symmetric_key const& key, encryption_mode mode, logger_interface & logger, std::wstring_view name)
+{
+	auto codec = std::make_unique<encryption_codec>(key, mode);
+	if (!codec->valid()) {
+		logger.log(logmsg::error, L"Could not initialize encryption for '%s', invalid key", name);
+		codec.reset();
+	}
+	return codec;
+}
+}
+
+encryption_reader::encryption_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, thread_pool & tpool, symmetric_key const& key, encryption_mode mode, size_t max_buffers) noexcept
+	: codec_reader(pool, std::move(reader), tpool, create_codec(key, mode, pool.logger(), reader ? reader->name() : std::wstring()), max_buffers)
+{
+}
+
+encryption_writer::encryption_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, thread_pool & tpool, symmetric_key const& key, encryption_mode mode, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+	: codec_writer(name, pool, std::move(writer), tpool, create_codec(key, mode, pool.logger(), name), std::move(progress_cb), max_buffers)
+{
+}
+
+}
@@ -0,0 +1,306 @@
+#include "../libfilezilla/aio/hashing.hpp"
+
+#include <algorithm>
+
+namespace fz {
+
+namespace {
+void create_accumulators(std::vector<std::unique_ptr<hash_accumulator>> & accumulators, std::vector<hash_algorithm> const& algorithms)
+{
+	accumulators.reserve(algorithms.size());
+	for (auto const& algorithm : algorithms) {
+		accumulators.emplace_back(std::make_unique<hash_accumulator>(algorithm));
+	}
+}
+
+void finish_digests(std::vector<std::unique_ptr<hash_accumulator>> & accumulators, std::vector<std::vector<uint8_t>> & digests)
+{
+	digests.clear();
+	for (auto & accumulator : accumulators) {
+		digests.emplace_back(accumulator->digest());
+	}
+}
+}
+
+hashing_reader::hashing_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, std::vector<hash_algorithm> const& algorithms, uint64_t offset)
+	: reader_base(reader ? reader->name() : std::wstring(), pool, 1)
+	, reader_(std::move(reader))
+{
+	create_accumulators(accumulators_, algorithms);
+
+	// Range checks are left to the wrapped reader
+	if (reader_) {
+		start_offset_ = offset;
+		size_ = remaining_ = reader_->size();
+	}
+	else {
+		error_ = true;
+	}
+}
+
+hashing_reader::~hashing_reader() noexcept
+{
+	close();
+}
+
+bool hashing_reader::seekable() const
+{
+	return reader_ && reader_->seekable();
+}
+
+datetime hashing_reader::mtime() const
+{
+	return reader_ ? reader_->mtime() : datetime();
+}
+
+std::vector<uint8_t> hashing_reader::digest(size_t index) const
+{
+	scoped_lock l(mtx_);
+	if (index < digests_.size()) {
+		return digests_[index];
+	}
+	return {};
+}
+
+void hashing_reader::do_close(scoped_lock & l)
+{
+	if (reader_) {
+		// The wrapped reader might be signalling us, which needs our lock
+		l.unlock();
+		reader_->close();
+		l.lock();
+	}
+}
+
+bool hashing_reader::do_seek(scoped_lock & l)
+{
+	uint64_t const offset = start_offset_;
+	uint64_t const size = size_;
+
+	l.unlock();
+	bool const ret = reader_->seek(offset, size);
+	l.lock();
+
+	for (auto & accumulator : accumulators_) {
+		accumulator->reinit();
+	}
+	digests_.clear();
+
+	if (!ret) {
+		return false;
+	}
+	size_ = remaining_ = reader_->size();
+	eof_ = false;
+	return true;
+}
+
+std::pair<aio_result, buffer_lease> hashing_reader::do_get_buffer(scoped_lock & l)
+{
+	if (error_) {
+		return {aio_result::error, buffer_lease()};
+	}
+	else if (eof_) {
+		return {aio_result::ok, buffer_lease()};
+	}
+
+	l.unlock();
+	auto ret = reader_->get_buffer(static_cast<aio_waiter&>(*this));
+	l.lock();
+
+	if (ret.first == aio_result::error) {
+		error_ = true;
+	}
+	else if (ret.first == aio_result::ok) {
+		if (ret.second) {
+			for (auto & accumulator : accumulators_) {
+				accumulator->update(ret.second->get(), ret.second->size());
+			}
+			if (remaining_ != nosize) {
+				remaining_ -= std::min(remaining_, static_cast<uint64_t>(ret.second->size()));
+			}
+			get_buffer_called_ = true;
+		}
+		else {
+			eof_ = true;
+			finish_digests(accumulators_, digests_);
+		}
+	}
+	return ret;
+}
+
+void hashing_reader::on_buffer_availability(aio_waitable const*)
+{
+	// Taking the lock makes sure the consumer has been added as waiter
+	scoped_lock l(mtx_);
+	signal_availibility();
+}
+
+
+tree_hashing_reader::tree_hashing_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, tree_hash_accumulator & acc, uint64_t offset)
+	: reader_base(reader ? reader->name() : std::wstring(), pool, 1)
+	, reader_(std::move(reader))
+	, acc_(acc)
+	, offset_(offset)
+{
+	if (reader_) {
+		start_offset_ = offset;
+		size_ = remaining_ = reader_->size();
+	}
+	else {
+		error_ = true;
+	}
+}
+
+tree_hashing_reader::~tree_hashing_reader() noexcept
+{
+	close();
+}
+
+datetime tree_hashing_reader::mtime() const
+{
+	return reader_ ? reader_->mtime() : datetime();
+}
+
+void tree_hashing_reader::do_close(scoped_lock & l)
+{
+	if (reader_) {
+		l.unlock();
+		reader_->close();
+		l.lock();
+	}
+}
+
+std::pair<aio_result, buffer_lease> tree_hashing_reader::do_get_buffer(scoped_lock & l)
+{
+	if (error_) {
+		return {aio_result::error, buffer_lease()};
+	}
+	else if (eof_) {
+		return {aio_result::ok, buffer_lease()};
+	}
+
+	l.unlock();
+	auto ret = reader_->get_buffer(static_cast<aio_waiter&>(*this));
+	if (ret.first == aio_result::ok && ret.second) {
+		// Other readers may be feeding the accumulator at the same time, don't hold the lock
+		if (!acc_.update(offset_, ret.second->get(), ret.second->size())) {
+			ret = {aio_result::error, buffer_lease()};
+		}
+	}
+	l.lock();
+
+	if (ret.first == aio_result::error) {
+		error_ = true;
+	}
+	else if (ret.first == aio_result::ok) {
+		if (ret.second) {
+			offset_ += ret.second->size();
+			if (remaining_ != nosize) {
+				remaining_ -= std::min(remaining_, static_cast<uint64_t>(ret.second->size()));
+			}
+			get_buffer_called_ = true;
+		}
+		else {
+			eof_ = true;
+		}
+	}
+	return ret;
+}
+
+void tree_hashing_reader::on_buffer_availability(aio_waitable const*)
+{
+	scoped_lock l(mtx_);
+	signal_availibility();
+}
+
+
+hashing_writer::hashing_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, std::vector<hash_algorithm> const& algorithms)
+	: writer_base(name, pool, nullptr, 1)
+	, writer_(std::move(writer))
+{
+	create_accumulators(accumulators_, algorithms);
+	if (!writer_) {
+		error_ = true;
+	}
+}
+
+hashing_writer::~hashing_writer() noexcept
+{
+	close();
+}
+
+aio_result hashing_writer::preallocate(uint64_t size)
+{
+	return writer_ ? writer_->preallocate(size) : aio_result::error;
+}
+
+bool hashing_writer::set_mtime(datetime const& t)
+{
+	return writer_ && writer_->set_mtime(t);
+}
+
+std::vector<uint8_t> hashing_writer::digest(size_t index)
+{
+	scoped_lock l(mtx_);
+	if (index < digests_.size()) {
+		return digests_[index];
+	}
+	return {};
+}
+
+void hashing_writer::do_close(scoped_lock & l)
+{
+	if (writer_) {
+		l.unlock();
+		writer_->close();
+		l.lock();
+	}
+}
+
+aio_result hashing_writer::do_add_buffer(scoped_lock & l, buffer_lease && b)
+{
+	for (auto & accumulator : accumulators_) {
+		accumulator->update(b->get(), b->size());
+	}
+
+	l.unlock();
+	auto const r = writer_->add_buffer(std::move(b), static_cast<aio_waiter&>(*this));
+	l.lock();
+
+	if (r == aio_result::error) {
+		error_ = true;
+	}
+	return r;
+}
+
+aio_result hashing_writer::do_finalize(scoped_lock & l)
+{
+	if (error_) {
+		return aio_result::error;
+	}
+	if (finalizing_ == 2) {
+		return aio_result::ok;
+	}
+	finalizing_ = 1;
+
+	l.unlock();
+	auto const r = writer_->finalize(static_cast<aio_waiter&>(*this));
+	l.lock();
+
+	if (r == aio_result::error) {
+		error_ = true;
+	}
+	else if (r == aio_result::ok) {
+		finalizing_ = 2;
+		finish_digests(accumulators_, digests_);
+	}
+	return r;
+}
+
+void hashing_writer::on_buffer_availability(aio_waitable const*)
+{
+	scoped_lock l(mtx_);
+	signal_availibility();
+}
+
+}
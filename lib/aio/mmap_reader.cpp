@@ -0,0 +1,332 @@
+#include "../libfilezilla/aio/mmap_reader.hpp"
+#include "../libfilezilla/local_filesys.hpp"
+#include "../libfilezilla/logger.hpp"
+
+#ifdef FZ_WINDOWS
+#include "../libfilezilla/glue/windows.hpp"
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+namespace fz {
+
+namespace {
+// Number of chunks ahead of the current position to advise as needed
+uint64_t const readahead_chunks = 4;
+
+#if !FZ_WINDOWS
+size_t get_page_size()
+{
+	static size_t const page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	return page_size;
+}
+#endif
+}
+
+class file_mapping final : public buffer_lease_source
+{
+public:
+	file_mapping(native_string const& path, datetime const& mtime)
+		: path_(path)
+		, mtime_(mtime)
+	{}
+
+	bool map(logger_interface & logger);
+
+	void ref() {
+		++refs_;
+	}
+
+	void unref() {
+		if (refs_.fetch_sub(1) == 1) {
+			delete this;
+		}
+	}
+
+	// Each lease holds a reference to the mapping
+	buffer_lease view(uint64_t offset, size_t len) {
+		ref();
+		return lease(nonowning_buffer(data_ + offset, len, len));
+	}
+
+	native_string const path_;
+	datetime const mtime_;
+	uint64_t size_{};
+	uint8_t* data_{};
+
+private:
+	virtual ~file_mapping();
+
+	virtual void release(nonowning_buffer &&) override {
+		unref();
+	}
+
+	std::atomic<size_t> refs_{1};
+};
+
+bool file_mapping::map(logger_interface & logger)
+{
+	file f(path_, file::reading, file::existing);
+	if (!f) {
+		return false;
+	}
+
+	int64_t const size = f.size();
+	if (size < 0 || static_cast<uint64_t>(size) > std::numeric_limits<size_t>::max()) {
+		return false;
+	}
+	size_ = static_cast<uint64_t>(size);
+	if (!size_) {
+		// Nothing to map
+		return true;
+	}
+
+#if FZ_WINDOWS
+	HANDLE mapping = CreateFileMapping(f.fd(), nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) {
+		DWORD err = GetLastError();
+		logger.log(logmsg::debug_warning, "CreateFileMapping failed with error %u", err);
+		return false;
+	}
+	// The view keeps the mapping alive
+	data_ = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if (!data_) {
+		DWORD err = GetLastError();
+		logger.log(logmsg::debug_warning, "MapViewOfFile failed with error %u", err);
+		return false;
+	}
+#else
+	void* m = mmap(nullptr, static_cast<size_t>(size_), PROT_READ, MAP_SHARED, f.fd(), 0);
+	if (m == MAP_FAILED) {
+		int err = errno;
+		logger.log(logmsg::debug_warning, "mmap failed with error %d", err);
+		return false;
+	}
+	data_ = static_cast<uint8_t*>(m);
+#ifdef MADV_SEQUENTIAL
+	madvise(m, static_cast<size_t>(size_), MADV_SEQUENTIAL);
+#endif
+#endif
+
+	return true;
+}
+
+file_mapping::~file_mapping()
+{
+	if (data_) {
+#if FZ_WINDOWS
+		UnmapViewOfFile(data_);
+#else
+		munmap(data_, static_cast<size_t>(size_));
+#endif
+	}
+}
+
+
+mmap_cache::mmap_cache(size_t max_mappings)
+	: max_mappings_(max_mappings)
+{
+}
+
+mmap_cache::~mmap_cache()
+{
+	clear();
+}
+
+size_t mmap_cache::size() const
+{
+	scoped_lock l(mtx_);
+	return lru_.size();
+}
+
+void mmap_cache::clear()
+{
+	scoped_lock l(mtx_);
+	for (auto * m : lru_) {
+		m->unref();
+	}
+	lru_.clear();
+	mappings_.clear();
+}
+
+file_mapping* mmap_cache::get(native_string const& path, logger_interface & logger)
+{
+	bool is_link{};
+	int64_t size{};
+	datetime mtime;
+	if (local_filesys::get_file_info(path, is_link, &size, &mtime, nullptr) != local_filesys::file) {
+		return nullptr;
+	}
+
+	scoped_lock l(mtx_);
+
+	auto it = mappings_.find(path);
+	if (it != mappings_.end()) {
+		file_mapping* m = *it->second;
+		if (m->mtime_ == mtime && static_cast<int64_t>(m->size_) == size) {
+			lru_.splice(lru_.begin(), lru_, it->second);
+			m->ref();
+			return m;
+		}
+
+		// Stale
+		lru_.erase(it->second);
+		mappings_.erase(it);
+		m->unref();
+	}
+
+	auto * m = new file_mapping(path, mtime);
+	if (!m->map(logger)) {
+		m->unref();
+		return nullptr;
+	}
+
+	if (static_cast<int64_t>(m->size_) != size) {
+		// Modified in the meantime, do not cache
+		return m;
+	}
+
+	m->ref();
+	lru_.push_front(m);
+	mappings_[path] = lru_.begin();
+	while (lru_.size() > max_mappings_) {
+		file_mapping* old = lru_.back();
+		mappings_.erase(old->path_);
+		lru_.pop_back();
+		old->unref();
+	}
+
+	return m;
+}
+
+
+mmap_reader::mmap_reader(std::wstring const& name, aio_buffer_pool & pool, file_mapping & mapping, size_t chunk_size) noexcept
+	: reader_base(name, pool, 1)
+	, mapping_(&mapping)
+	, chunk_size_(chunk_size ? chunk_size : 1024 * 1024)
+{
+	size_ = max_size_ = remaining_ = mapping.size_;
+	if (!remaining_) {
+		eof_ = true;
+	}
+}
+
+mmap_reader::~mmap_reader() noexcept
+{
+	close();
+	mapping_->unref();
+}
+
+void mmap_reader::do_close(scoped_lock &)
+{
+}
+
+datetime mmap_reader::mtime() const
+{
+	return mapping_->mtime_;
+}
+
+std::pair<aio_result, buffer_lease> mmap_reader::do_get_buffer(scoped_lock &)
+{
+	if (error_) {
+		return {aio_result::error, buffer_lease()};
+	}
+	else if (eof_) {
+		return {aio_result::ok, buffer_lease()};
+	}
+
+	uint64_t const offset = (start_offset_ == nosize ? 0 : start_offset_) + size_ - remaining_;
+	size_t len = chunk_size_;
+	if (remaining_ < len) {
+		len = static_cast<size_t>(remaining_);
+	}
+
+	advise(offset);
+
+	auto b = mapping_->view(offset, len);
+	remaining_ -= len;
+	if (!remaining_) {
+		eof_ = true;
+	}
+	get_buffer_called_ = true;
+
+	return {aio_result::ok, std::move(b)};
+}
+
+void mmap_reader::advise(uint64_t offset)
+{
+	uint64_t const end = std::min(offset + readahead_chunks * chunk_size_, mapping_->size_);
+	uint64_t start = std::max(offset, advised_);
+	if (start >= end) {
+		return;
+	}
+	advised_ = end;
+
+#if defined(MADV_WILLNEED)
+	uint64_t const psz = get_page_size();
+	start -= start % psz;
+	madvise(mapping_->data_ + start, static_cast<size_t>(end - start), MADV_WILLNEED);
+#endif
+}
+
+bool mmap_reader::do_seek(scoped_lock &)
+{
+	advised_ = start_offset_;
+	return true;
+}
+
+void mmap_reader::on_buffer_availability(aio_waitable const*)
+{
+	signal_availibility();
+}
+
+
+mmap_reader_factory::mmap_reader_factory(std::wstring const& file, mmap_cache & cache, size_t chunk_size)
+	: reader_factory(file)
+	, cache_(cache)
+	, chunk_size_(chunk_size)
+{
+}
+
+std::unique_ptr<reader_base> mmap_reader_factory::open(aio_buffer_pool & pool, uint64_t offset, uint64_t size, size_t)
+{
+	file_mapping* m = cache_.get(to_native(name()), pool.logger());
+	if (!m) {
+		return {};
+	}
+
+	std::unique_ptr<mmap_reader> reader(new mmap_reader(name(), pool, *m, chunk_size_));
+	if (!reader->seek(offset, size)) {
+		return {};
+	}
+	return reader;
+}
+
+std::unique_ptr<reader_factory> mmap_reader_factory::clone() const
+{
+	return std::make_unique<mmap_reader_factory>(*this);
+}
+
+uint64_t mmap_reader_factory::size() const
+{
+	auto s = local_filesys::get_size(to_native(name()));
+	if (s < 0) {
+		return reader_base::nosize;
+	}
+	else {
+		return static_cast<uint64_t>(s);
+	}
+}
+
+datetime mmap_reader_factory::mtime() const
+{
+	return local_filesys::get_modification_time(to_native(name()));
+}
+
+}
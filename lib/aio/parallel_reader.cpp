@@ -0,0 +1,220 @@
+#include "../libfilezilla/aio/parallel_reader.hpp"
+#include "../libfilezilla/local_filesys.hpp"
+
+#include <algorithm>
+
+namespace fz {
+
+parallel_file_reader::parallel_file_reader(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, size_t threads, uint64_t offset, uint64_t size, size_t max_buffers) noexcept
+	: reader_base(name, pool, max_buffers)
+	, file_(std::move(f))
+	, thread_pool_(tpool)
+	, threads_(std::clamp<size_t>(threads, 1, max_buffers_))
+	, block_size_(pool.buffer_size())
+{
+	scoped_lock l(mtx_);
+	if (file_ && block_size_) {
+		auto s = file_.size();
+		if (s >= 0) {
+			max_size_ = static_cast<uint64_t>(s);
+			if (!seek(offset, size)) {
+				error_ = true;
+			}
+		}
+	}
+	if (!file_ || max_size_ == nosize || !block_size_) {
+		error_ = true;
+	}
+}
+
+parallel_file_reader::~parallel_file_reader() noexcept
+{
+	close();
+}
+
+void parallel_file_reader::wakeup(scoped_lock & l)
+{
+	for (auto & w : workers_) {
+		w.cond_.signal(l);
+	}
+}
+
+void parallel_file_reader::stop(scoped_lock & l)
+{
+	quit_ = true;
+	wakeup(l);
+	l.unlock();
+	for (auto & w : workers_) {
+		w.task_.join();
+	}
+	l.lock();
+	workers_.clear();
+	quit_ = false;
+}
+
+void parallel_file_reader::do_close(scoped_lock & l)
+{
+	stop(l);
+	ready_.clear();
+	file_.close();
+}
+
+bool parallel_file_reader::do_seek(scoped_lock & l)
+{
+	stop(l);
+	ready_.clear();
+
+	if (size_ == nosize) {
+		return false;
+	}
+
+	block_count_ = (size_ + block_size_ - 1) / block_size_;
+	next_block_ = 0;
+	next_delivery_ = 0;
+
+	if (!eof_) {
+		for (size_t i = 0; i < threads_; ++i) {
+			auto & w = workers_.emplace_back();
+			w.task_ = thread_pool_.spawn([this, &w]{ entry(w.cond_); }, "file reader");
+			if (!w.task_) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+std::pair<aio_result, buffer_lease> parallel_file_reader::do_get_buffer(scoped_lock & l)
+{
+	if (error_) {
+		return {aio_result::error, buffer_lease()};
+	}
+
+	if (!ready_.empty() && ready_.begin()->first == next_delivery_) {
+		buffer_lease b = std::move(ready_.begin()->second);
+		ready_.erase(ready_.begin());
+		remaining_ -= b->size();
+		if (++next_delivery_ == block_count_) {
+			eof_ = true;
+		}
+		get_buffer_called_ = true;
+
+		// A slot has become free
+		wakeup(l);
+		return {aio_result::ok, std::move(b)};
+	}
+
+	if (eof_) {
+		return {aio_result::ok, buffer_lease()};
+	}
+	return {aio_result::wait, buffer_lease()};
+}
+
+void parallel_file_reader::on_buffer_availability(aio_waitable const*)
+{
+	scoped_lock l(mtx_);
+	wakeup(l);
+}
+
+void parallel_file_reader::entry(condition & cond)
+{
+	scoped_lock l(mtx_);
+	while (!quit_ && !error_) {
+		if (next_block_ >= block_count_) {
+			break;
+		}
+		if (next_block_ - next_delivery_ >= max_buffers_) {
+			cond.wait(l);
+			continue;
+		}
+		auto b = buffer_pool_.get_buffer(*this);
+		if (!b) {
+			cond.wait(l);
+			continue;
+		}
+
+		uint64_t const block = next_block_++;
+		uint64_t const offset = block * block_size_;
+		size_t const len = static_cast<size_t>(std::min(block_size_, size_ - offset));
+		int64_t const start = static_cast<int64_t>(start_offset_ + offset);
+
+		l.unlock();
+		bool failed{};
+		while (b->size() < len) {
+			size_t const to_read = len - b->size();
+			int64_t r = file_.read_at(b->get(to_read), static_cast<int64_t>(to_read), start + static_cast<int64_t>(b->size()));
+			if (r <= 0) {
+				// Read error, or the file got shorter
+				failed = true;
+				break;
+			}
+			b->add(static_cast<size_t>(r));
+		}
+		l.lock();
+
+		if (quit_ || error_) {
+			return;
+		}
+		if (failed) {
+			error_ = true;
+			signal_availibility();
+			break;
+		}
+
+		ready_.emplace(block, std::move(b));
+		if (block == next_delivery_) {
+			signal_availibility();
+		}
+	}
+}
+
+
+parallel_file_reader_factory::parallel_file_reader_factory(std::wstring const& file, thread_pool & tpool, size_t threads)
+	: reader_factory(file)
+	, thread_pool_(tpool)
+	, threads_(threads ? threads : 1)
+{
+}
+
+std::unique_ptr<reader_base> parallel_file_reader_factory::open(aio_buffer_pool & pool, uint64_t offset, uint64_t size, size_t max_buffers)
+{
+	if (!max_buffers) {
+		max_buffers = preferred_buffer_count();
+	}
+
+	auto f = file(to_native(name()), file::reading, file::existing);
+	if (!f) {
+		return {};
+	}
+
+	auto reader = std::make_unique<parallel_file_reader>(name(), pool, std::move(f), thread_pool_, threads_, offset, size, max_buffers);
+	if (reader->error()) {
+		return {};
+	}
+
+	return reader;
+}
+
+std::unique_ptr<reader_factory> parallel_file_reader_factory::clone() const
+{
+	return std::make_unique<parallel_file_reader_factory>(*this);
+}
+
+uint64_t parallel_file_reader_factory::size() const
+{
+	auto s = local_filesys::get_size(to_native(name()));
+	if (s < 0) {
+		return reader_base::nosize;
+	}
+	else {
+		return static_cast<uint64_t>(s);
+	}
+}
+
+datetime parallel_file_reader_factory::mtime() const
+{
+	return local_filesys::get_modification_time(to_native(name()));
+}
+
+}
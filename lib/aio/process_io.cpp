@@ -0,0 +1,425 @@
+#include "../libfilezilla/aio/process_io.hpp"
+#include "../libfilezilla/logger.hpp"
+#include "../libfilezilla/process.hpp"
+
+#include <iterator>
+
+#ifdef FZ_WINDOWS
+#include "../libfilezilla/glue/windows.hpp"
+#else
+#include <sys/mman.h>
+#endif
+
+namespace fz {
+
+namespace {
+// Requests sent by the parent. The child answers each with the status in op,
+// the offset of the request and the number of octets processed.
+struct message final
+{
+	uint64_t op{};
+	uint64_t offset{};
+	uint64_t size{};
+};
+
+uint64_t const op_fill = 1;
+uint64_t const op_drain = 2;
+uint64_t const op_finish = 3;
+
+uint64_t const status_ok = 0;
+uint64_t const status_failed = 1;
+
+bool send_message(process & p, message const& m)
+{
+	return static_cast<bool>(p.write(&m, sizeof(m)));
+}
+
+bool receive_message(process & p, message & m)
+{
+	auto* out = reinterpret_cast<uint8_t*>(&m);
+	size_t received{};
+	while (received < sizeof(m)) {
+		auto r = p.read(out + received, sizeof(m) - received);
+		if (!r || !r.value_) {
+			return false;
+		}
+		received += r.value_;
+	}
+	return true;
+}
+
+// Returns 1 on success, 0 on eof, -1 on error
+int read_message(file & f, message & m)
+{
+	auto* out = reinterpret_cast<uint8_t*>(&m);
+	size_t received{};
+	while (received < sizeof(m)) {
+		int64_t r = f.read(out + received, static_cast<int64_t>(sizeof(m) - received));
+		if (r < 0) {
+			return -1;
+		}
+		else if (!r) {
+			return received ? -1 : 0;
+		}
+		received += static_cast<size_t>(r);
+	}
+	return 1;
+}
+
+bool write_all(file & f, uint8_t const* p, size_t len)
+{
+	while (len) {
+		int64_t w = f.write(p, static_cast<int64_t>(len));
+		if (w <= 0) {
+			return false;
+		}
+		p += w;
+		len -= static_cast<size_t>(w);
+	}
+	return true;
+}
+}
+
+process_reader::process_reader(std::wstring_view name, aio_buffer_pool & pool, process & p, thread_pool & tpool, size_t max_buffers) noexcept
+	: threaded_reader(name, pool, max_buffers)
+	, process_(p)
+	, thread_pool_(tpool)
+{
+	auto const [shm, base, size] = pool.shared_memory_info();
+	base_ = base;
+	shm_size_ = static_cast<size_t>(size);
+
+	scoped_lock l(mtx_);
+	if (shm == aio_buffer_pool::shm_handle_default || !base_) {
+		logger_.log(logmsg::error, L"The buffer pool used for '%s' does not use shared memory", name_);
+		error_ = true;
+	}
+	else if (!seek(0)) {
+		error_ = true;
+	}
+}
+
+process_reader::~process_reader() noexcept
+{
+	close();
+}
+
+void process_reader::do_close(scoped_lock & l)
+{
+	quit_ = true;
+	cond_.signal(l);
+	l.unlock();
+	task_.join();
+	l.lock();
+}
+
+bool process_reader::do_seek(scoped_lock &)
+{
+	// Not seekable, only reached for the initial seek to the start.
+	task_ = thread_pool_.spawn([this]{ entry(); });
+	return task_.operator bool();
+}
+
+void process_reader::on_buffer_availability(aio_waitable const*)
+{
+	scoped_lock l(mtx_);
+	cond_.signal(l);
+}
+
+void process_reader::entry()
+{
+	scoped_lock l(mtx_);
+	for (;;) {
+		// Even if stopping, the buffers the child is filling must not be released before it is done with them
+		bool const stop = quit_ || error_ || eof_;
+		if (!stop && pending_.size() + buffers_.size() < max_buffers_) {
+			auto b = buffer_pool_.get_buffer(*this);
+			if (b) {
+				message const m{op_fill, static_cast<uint64_t>(b->get() - base_), b->capacity()};
+				l.unlock();
+				bool const sent = send_message(process_, m);
+				l.lock();
+				if (sent) {
+					pending_.emplace_back(std::move(b));
+				}
+				else {
+					logger_.log(logmsg::error, L"Could not send request to the process reading '%s'", name_);
+					error_ = true;
+				}
+				continue;
+			}
+		}
+
+		if (pending_.empty()) {
+			if (stop) {
+				break;
+			}
+			cond_.wait(l);
+			continue;
+		}
+
+		message m;
+		l.unlock();
+		bool const received = receive_message(process_, m);
+		l.lock();
+
+		buffer_lease b = std::move(pending_.front());
+		pending_.pop_front();
+		if (!received) {
+			// The child is gone
+			logger_.log(logmsg::error, L"Could not receive data from the process reading '%s'", name_);
+			error_ = true;
+			pending_.clear();
+			continue;
+		}
+		if (quit_ || error_ || eof_) {
+			continue;
+		}
+		if (m.op != status_ok || m.offset != static_cast<uint64_t>(b->get() - base_) || m.size > b->capacity()) {
+			logger_.log(logmsg::error, L"The process reading '%s' has failed", name_);
+			error_ = true;
+			continue;
+		}
+		if (!m.size) {
+			eof_ = true;
+			continue;
+		}
+
+		b->add(static_cast<size_t>(m.size));
+		buffers_.emplace_back(std::move(b));
+		if (buffers_.size() == 1) {
+			signal_availibility();
+		}
+	}
+
+	if ((eof_ || error_) && !quit_ && buffers_.empty()) {
+		signal_availibility();
+	}
+}
+
+
+process_writer::process_writer(std::wstring_view name, aio_buffer_pool & pool, process & p, thread_pool & tpool, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+	: threaded_writer(name, pool, std::move(progress_cb), max_buffers)
+	, process_(p)
+{
+	auto const [shm, base, size] = pool.shared_memory_info();
+	base_ = base;
+	shm_size_ = static_cast<size_t>(size);
+
+	if (shm == aio_buffer_pool::shm_handle_default || !base_) {
+		buffer_pool_.logger().log(logmsg::error, L"The buffer pool used for '%s' does not use shared memory", name_);
+	}
+	else {
+		task_ = tpool.spawn([this]{ entry(); });
+	}
+	if (!task_) {
+		error_ = true;
+	}
+}
+
+process_writer::~process_writer() noexcept
+{
+	close();
+}
+
+aio_result process_writer::do_add_buffer(scoped_lock & l, buffer_lease && b)
+{
+	uintptr_t const start = reinterpret_cast<uintptr_t>(b->get());
+	uintptr_t const base = reinterpret_cast<uintptr_t>(base_);
+	if (start < base || start - base > shm_size_ || b->size() > shm_size_ - (start - base)) {
+		buffer_pool_.logger().log(logmsg::error, L"Buffer passed to the writer for '%s' does not reside in shared memory", name_);
+		error_ = true;
+		return aio_result::error;
+	}
+	return threaded_writer::do_add_buffer(l, std::move(b));
+}
+
+aio_result process_writer::continue_finalize(scoped_lock & l)
+{
+	// The child needs to confirm it is done
+	wakeup(l);
+	return aio_result::wait;
+}
+
+void process_writer::entry()
+{
+	scoped_lock l(mtx_);
+	for (;;) {
+		if (!quit_ && !error_ && sent_ < buffers_.size()) {
+			auto const& b = *std::next(buffers_.begin(), static_cast<std::ptrdiff_t>(sent_));
+			message const m{op_drain, static_cast<uint64_t>(b->get() - base_), b->size()};
+			l.unlock();
+			bool const sent = send_message(process_, m);
+			l.lock();
+			if (sent) {
+				++sent_;
+			}
+			else {
+				buffer_pool_.logger().log(logmsg::error, L"Could not send data to the process writing '%s'", name_);
+				error_ = true;
+			}
+			continue;
+		}
+
+		// Even if stopping, the buffers the child is processing must not be released before it is done with them
+		if (sent_) {
+			message m;
+			l.unlock();
+			bool const received = receive_message(process_, m);
+			l.lock();
+			if (!received) {
+				buffer_pool_.logger().log(logmsg::error, L"Could not receive status from the process writing '%s'", name_);
+				error_ = true;
+				sent_ = 0;
+				continue;
+			}
+			--sent_;
+
+			auto & b = buffers_.front();
+			if (m.op != status_ok || m.size != b->size()) {
+				buffer_pool_.logger().log(logmsg::error, L"The process writing '%s' has failed", name_);
+				error_ = true;
+			}
+			else if (progress_cb_) {
+				progress_cb_(this, m.size);
+			}
+			bool const signal = buffers_.size() == max_buffers_;
+			buffers_.pop_front();
+			if (signal && !quit_ && !error_) {
+				signal_availibility();
+			}
+			continue;
+		}
+
+		if (quit_ || error_) {
+			break;
+		}
+
+		if (finalizing_ == 1 && buffers_.empty()) {
+			message m{op_finish, 0, 0};
+			l.unlock();
+			bool const ok = send_message(process_, m) && receive_message(process_, m) && m.op == status_ok;
+			l.lock();
+			if (quit_) {
+				return;
+			}
+			if (ok) {
+				finalizing_ = 2;
+			}
+			else {
+				buffer_pool_.logger().log(logmsg::error, L"The process writing '%s' could not complete", name_);
+				error_ = true;
+			}
+			signal_availibility();
+			return;
+		}
+
+		cond_.wait(l);
+	}
+
+	if (error_ && !quit_) {
+		signal_availibility();
+	}
+}
+
+
+process_buffer_peer::process_buffer_peer(aio_buffer_pool::shm_handle shm, size_t size)
+{
+	if (!size) {
+		return;
+	}
+#if FZ_WINDOWS
+	void* p = MapViewOfFile(shm, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (p) {
+		memory_ = static_cast<uint8_t*>(p);
+		size_ = size;
+	}
+#else
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+	if (p != MAP_FAILED) {
+		memory_ = static_cast<uint8_t*>(p);
+		size_ = size;
+	}
+#endif
+}
+
+process_buffer_peer::~process_buffer_peer()
+{
+	if (memory_) {
+#if FZ_WINDOWS
+		UnmapViewOfFile(memory_);
+#else
+		munmap(memory_, size_);
+#endif
+	}
+}
+
+bool process_buffer_peer::serve(file & f)
+{
+	if (!memory_) {
+		return false;
+	}
+
+#if FZ_WINDOWS
+	file in(GetStdHandle(STD_INPUT_HANDLE));
+	file out(GetStdHandle(STD_OUTPUT_HANDLE));
+#else
+	file in(0);
+	file out(1);
+#endif
+
+	bool ret{};
+	for (;;) {
+		message m;
+		int const r = read_message(in, m);
+		if (r <= 0) {
+			// Parent is done if it has closed the pipe
+			ret = !r;
+			break;
+		}
+
+		message reply{status_ok, m.offset, 0};
+		if (m.offset > size_ || m.size > size_ - m.offset) {
+			reply.op = status_failed;
+		}
+		else if (m.op == op_fill) {
+			uint8_t* p = memory_ + m.offset;
+			while (reply.size < m.size) {
+				int64_t read = f.read(p + reply.size, static_cast<int64_t>(m.size - reply.size));
+				if (read < 0) {
+					reply.op = status_failed;
+					break;
+				}
+				else if (!read) {
+					break;
+				}
+				reply.size += static_cast<uint64_t>(read);
+			}
+		}
+		else if (m.op == op_drain) {
+			if (write_all(f, memory_ + m.offset, static_cast<size_t>(m.size))) {
+				reply.size = m.size;
+			}
+			else {
+				reply.op = status_failed;
+			}
+		}
+		else if (m.op != op_finish) {
+			reply.op = status_failed;
+		}
+
+		if (!write_all(out, reinterpret_cast<uint8_t const*>(&reply), sizeof(reply))) {
+			break;
+		}
+		if (m.op == op_finish) {
+			ret = true;
+			break;
+		}
+	}
+
+	in.detach();
+	out.detach();
+	return ret;
+}
+
+}
@@ -1,17 +1,74 @@
 #include "../libfilezilla/aio/reader.hpp"
+#include "../libfilezilla/file_handle_cache.hpp"
 #include "../libfilezilla/local_filesys.hpp"
 #include "../libfilezilla/logger.hpp"
 #include "../libfilezilla/translate.hpp"
 
+#include <algorithm>
+#include <atomic>
+
+#include <string.h>
+
 namespace fz {
 
+namespace {
+// Bounds of file_reader's readahead window
+uint64_t const min_readahead = 256 * 1024;
+uint64_t const max_readahead = 16 * 1024 * 1024;
+
+// Leases of zero-copy view_readers, the viewed memory outlives them
+class view_lease_source final : public buffer_lease_source
+{
+public:
+	buffer_lease view(char const* data, size_t len) {
+		return lease(nonowning_buffer(reinterpret_cast<uint8_t*>(const_cast<char*>(data)), len, len));
+	}
+
+private:
+	virtual void release(nonowning_buffer &&) override {}
+};
+
+view_lease_source view_leases;
+}
+
+class string_reader_data final : public buffer_lease_source
+{
+public:
+	explicit string_reader_data(std::string && data)
+		: data_(std::move(data))
+	{}
+
+	void unref() {
+		if (refs_.fetch_sub(1) == 1) {
+			delete this;
+		}
+	}
+
+	// Each lease holds a reference to the data
+	buffer_lease view(size_t offset, size_t len) {
+		++refs_;
+		return lease(nonowning_buffer(reinterpret_cast<uint8_t*>(const_cast<char*>(data_.data())) + offset, len, len));
+	}
+
+	std::string const data_;
+
+private:
+	virtual ~string_reader_data() = default;
+
+	virtual void release(nonowning_buffer &&) override {
+		unref();
+	}
+
+	std::atomic<size_t> refs_{1};
+};
+
 void reader_base::close()
 {
 	scoped_lock l(mtx_);
 	do_close(l);
 	buffer_pool_.remove_waiter(*this);
 	remove_waiters();
-	buffers_.clear();
+	buffer_pool_.release_leases(buffers_);
 }
 
 bool reader_base::rewind()
@@ -81,7 +138,7 @@ bool reader_base::seek(uint64_t offset, uint64_t size)
 
 	buffer_pool_.remove_waiter(*this);
 	remove_waiters();
-	buffers_.clear();
+	buffer_pool_.release_leases(buffers_);
 
 	// Set the offset and sizes
 	start_offset_ = offset;
@@ -127,6 +184,39 @@ std::pair<aio_result, buffer_lease> reader_base::get_buffer(event_handler & h)
 	return ret;
 }
 
+aio_result reader_base::get_buffers(std::vector<buffer_lease> & buffers, size_t max, aio_waiter & h)
+{
+	scoped_lock l(mtx_);
+	auto ret = do_get_buffers(l, buffers, max ? max : 1);
+	if (ret == aio_result::wait) {
+		add_waiter(h);
+	}
+	return ret;
+}
+
+aio_result reader_base::get_buffers(std::vector<buffer_lease> & buffers, size_t max, event_handler & h)
+{
+	scoped_lock l(mtx_);
+	auto ret = do_get_buffers(l, buffers, max ? max : 1);
+	if (ret == aio_result::wait) {
+		add_waiter(h);
+	}
+	return ret;
+}
+
+aio_result reader_base::do_get_buffers(scoped_lock & l, std::vector<buffer_lease> & buffers, size_t max)
+{
+	for (size_t i = 0; i < max; ++i) {
+		auto [r, b] = do_get_buffer(l);
+		if (r != aio_result::ok || !b) {
+			// What has already been taken gets returned first
+			return i ? aio_result::ok : r;
+		}
+		buffers.emplace_back(std::move(b));
+	}
+	return aio_result::ok;
+}
+
 reader_factory_holder::reader_factory_holder(reader_factory_holder const& op)
 {
 	if (op.impl_) {
@@ -205,15 +295,41 @@ std::pair<aio_result, buffer_lease> threaded_reader::do_get_buffer(scoped_lock &
 	}
 }
 
+aio_result threaded_reader::do_get_buffers(scoped_lock & l, std::vector<buffer_lease> & buffers, size_t max)
+{
+	if (buffers_.empty()) {
+		// Lets derived readers handle eof, errors and waiting
+		auto [r, b] = do_get_buffer(l);
+		if (b) {
+			buffers.emplace_back(std::move(b));
+		}
+		return r;
+	}
 
-file_reader::file_reader(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset, uint64_t size, size_t max_buffers) noexcept
+	bool const w = buffers_.size() == max_buffers_;
+	for (size_t i = 0; i < max && !buffers_.empty(); ++i) {
+		buffers.emplace_back(std::move(buffers_.front()));
+		buffers_.pop_front();
+	}
+	if (w) {
+		wakeup(l);
+	}
+	get_buffer_called_ = true;
+	return aio_result::ok;
+}
+
+
+file_reader::file_reader(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset, uint64_t size, size_t max_buffers, file_reader_flags flags) noexcept
 	: threaded_reader(name, pool, max_buffers)
-    , file_(std::move(f))
+    , file_(std::make_shared<file>(std::move(f)))
     , thread_pool_(tpool)
+    , direct_(flags & file_reader_flags::direct)
+    , drop_behind_(flags & file_reader_flags::drop_behind)
+    , sparse_(flags & file_reader_flags::sparse)
 {
 	scoped_lock l(mtx_);
-	if (file_) {
-		auto s = file_.size();
+	if (*file_) {
+		auto s = file_->size();
 		if (s >= 0) {
 			max_size_ = static_cast<uint64_t>(s);
 		}
@@ -226,17 +342,23 @@ file_reader::file_reader(std::wstring && name, aio_buffer_pool & pool, file && f
 	}
 }
 
-file_reader::file_reader(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset, uint64_t size, size_t max_buffers) noexcept
+file_reader::file_reader(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset, uint64_t size, size_t max_buffers, file_reader_flags flags) noexcept
+	: file_reader(name, pool, std::make_shared<file>(std::move(f)), tpool, offset, size, max_buffers, flags)
+{
+}
+
+file_reader::file_reader(std::wstring_view name, aio_buffer_pool & pool, std::shared_ptr<file> const& f, thread_pool & tpool, uint64_t offset, uint64_t size, size_t max_buffers, file_reader_flags flags) noexcept
 	: threaded_reader(name, pool, max_buffers)
-    , file_(std::move(f))
+    , file_(f)
     , thread_pool_(tpool)
+    , direct_(flags & file_reader_flags::direct)
+    , drop_behind_(flags & file_reader_flags::drop_behind)
+    , sparse_(flags & file_reader_flags::sparse)
 {
 	scoped_lock l(mtx_);
-	if (file_) {
-		auto s = file_.size();
-		if (s >= 0) {
-			max_size_ = static_cast<uint64_t>(s);
-		}
+	bool const opened = file_ && *file_;
+	if (opened) {
+		auto s = file_->size();
 		if (s >= 0) {
 			max_size_ = static_cast<uint64_t>(s);
 		}
@@ -244,7 +366,7 @@ file_reader::file_reader(std::wstring_view name, aio_buffer_pool & pool, file &&
 			error_ = true;
 		}
 	}
-	if (!file_ || !task_) {
+	if (!opened || !task_) {
 		error_ = true;
 	}
 }
@@ -266,7 +388,7 @@ void file_reader::do_close(scoped_lock & l)
 	l.unlock();
 	task_.join();
 	l.lock();
-	file_.close();
+	file_.reset();
 }
 
 bool file_reader::do_seek(scoped_lock & l)
@@ -279,14 +401,17 @@ bool file_reader::do_seek(scoped_lock & l)
 	l.lock();
 	quit_ = false;
 
-	// Step 2
-	if (file_.seek(start_offset_, file::begin) != static_cast<int64_t>(start_offset_)) {
+	// Step 2, in direct mode start reading at the preceding aligned offset
+	skip_ = direct_ ? static_cast<size_t>(start_offset_ % file::direct_io_alignment) : 0;
+	if (!file_) {
 		return false;
 	}
+	pos_ = advised_ = dropped_ = region_end_ = start_offset_ - skip_;
+	readahead_ = min_readahead;
 
 	// Re-start thread if needed
 	if (!eof_) {
-		task_ = thread_pool_.spawn([this]{ entry(); });
+		task_ = thread_pool_.spawn([this]{ entry(); }, "file reader");
 		return task_.operator bool();
 	}
 	else {
@@ -294,6 +419,92 @@ bool file_reader::do_seek(scoped_lock & l)
 	}
 }
 
+int64_t file_reader::read(uint8_t* p, size_t len)
+{
+	if (!sparse_ || direct_) {
+		return file_->read_at(p, static_cast<int64_t>(len), static_cast<int64_t>(pos_));
+	}
+
+	if (pos_ >= region_end_) {
+		int64_t const pos = static_cast<int64_t>(pos_);
+		int64_t const data = file_->next_data(pos);
+		if (data < 0) {
+			// Only a hole, if anything, remains
+			int64_t const s = file_->size();
+			if (s <= pos) {
+				return s < 0 ? -1 : 0;
+			}
+			in_hole_ = true;
+			region_end_ = static_cast<uint64_t>(s);
+		}
+		else if (data > pos) {
+			in_hole_ = true;
+			region_end_ = static_cast<uint64_t>(data);
+		}
+		else {
+			int64_t const hole = file_->next_hole(pos);
+			if (hole <= pos) {
+				return hole < 0 ? -1 : 0;
+			}
+			in_hole_ = false;
+			region_end_ = static_cast<uint64_t>(hole);
+		}
+	}
+
+	len = static_cast<size_t>(std::min(static_cast<uint64_t>(len), region_end_ - pos_));
+	if (in_hole_) {
+		memset(p, 0, len);
+		return static_cast<int64_t>(len);
+	}
+	return file_->read_at(p, static_cast<int64_t>(len), static_cast<int64_t>(pos_));
+}
+
+std::pair<aio_result, buffer_lease> file_reader::do_get_buffer(scoped_lock & l)
+{
+	auto ret = threaded_reader::do_get_buffer(l);
+	if (ret.first == aio_result::wait && readahead_ < max_readahead) {
+		// Reading does not keep up with the consumer
+		readahead_ *= 2;
+	}
+	return ret;
+}
+
+bool file_reader::give_hints(scoped_lock & l)
+{
+	uint64_t end = pos_ + readahead_;
+	if (remaining_ != nosize) {
+		end = std::min(end, pos_ + remaining_);
+	}
+	// Advise in batches of half the window
+	uint64_t need_start{};
+	uint64_t need_end{};
+	if (advised_ < end && end - advised_ >= readahead_ / 2) {
+		need_start = std::max(advised_, pos_);
+		need_end = end;
+		advised_ = end;
+	}
+	uint64_t drop_start{};
+	uint64_t drop_end{};
+	if (drop_behind_ && pos_ - dropped_ >= min_readahead) {
+		drop_start = dropped_;
+		drop_end = pos_;
+		dropped_ = pos_;
+	}
+	if (need_start == need_end && drop_start == drop_end) {
+		return true;
+	}
+
+	l.unlock();
+	if (need_start != need_end) {
+		file_->advise(static_cast<int64_t>(need_start), static_cast<int64_t>(need_end - need_start), file::willneed);
+	}
+	if (drop_start != drop_end) {
+		file_->advise(static_cast<int64_t>(drop_start), static_cast<int64_t>(drop_end - drop_start), file::dontneed);
+	}
+	l.lock();
+	return !quit_ && !error_;
+}
+
 void file_reader::on_buffer_availability(aio_waitable const*)
 {
 	scoped_lock l(mtx_);
@@ -313,13 +524,32 @@ void file_reader::entry()
 			cond_.wait(l);
 			continue;
 		}
+		if (!direct_ && !give_hints(l)) {
+			return;
+		}
+
+		// Bytes at the front of the buffer preceding the requested data
+		size_t skipped{};
 		while (b->size() < b->capacity()) {
-			l.unlock();
 			size_t to_read = b->capacity() - b->size();
-			if (remaining_ != nosize && to_read > remaining_) {
-				to_read = remaining_;
+			if (remaining_ != nosize && to_read > remaining_ + skip_) {
+				to_read = static_cast<size_t>(remaining_ + skip_);
+			}
+			if (direct_ && to_read) {
+				// Read whole blocks only, the excess gets discarded below
+				size_t const align = file::direct_io_alignment;
+				size_t const room = (b->capacity() - b->size()) / align * align;
+				if (!room) {
+					if (b->empty()) {
+						logger_.log(logmsg::error, L"Buffers too small for unbuffered reading from '%s'", name_);
+						error_ = true;
+					}
+					break;
+				}
+				to_read = std::min(room, (to_read + align - 1) / align * align);
 			}
-			int64_t r = to_read ? file_.read(b->get(to_read), to_read) : 0;
+			l.unlock();
+			int64_t r = to_read ? read(b->get(to_read), to_read) : 0;
 			l.lock();
 			if (quit_ || error_) {
 				return;
@@ -337,11 +567,31 @@ void file_reader::entry()
 				}
 				break;
 			}
-			b->add(r);
+
+			pos_ += static_cast<uint64_t>(r);
+
+			uint64_t useful = static_cast<uint64_t>(r);
+			if (skip_) {
+				size_t const s = static_cast<size_t>(std::min(useful, static_cast<uint64_t>(skip_)));
+				skip_ -= s;
+				skipped += s;
+				useful -= s;
+			}
+			if (remaining_ != nosize && useful > remaining_) {
+				// Read past the requested range
+				r -= static_cast<int64_t>(useful - remaining_);
+				useful = remaining_;
+			}
+			b->add(static_cast<size_t>(r));
 			if (remaining_ != nosize) {
-				remaining_ -= r;
+				remaining_ -= useful;
+			}
+			if (direct_ && static_cast<size_t>(r) % file::direct_io_alignment) {
+				// Short read, the next read would be unaligned
+				break;
 			}
 		}
+		b->consume(skipped);
 
 		if (!b->empty()) {
 			buffers_.emplace_back(std::move(b));
@@ -357,9 +607,11 @@ void file_reader::entry()
 }
 
 
-file_reader_factory::file_reader_factory(std::wstring const& file, thread_pool & tpool)
+file_reader_factory::file_reader_factory(std::wstring const& file, thread_pool & tpool, file_reader_flags flags, file_handle_cache * cache)
 	: reader_factory(file)
 	, thread_pool_(tpool)
+	, flags_(flags)
+	, cache_(cache)
 {
 }
 
@@ -369,12 +621,19 @@ std::unique_ptr<reader_base> file_reader_factory::open(aio_buffer_pool & pool, u
 		max_buffers = preferred_buffer_count();
 	}
 
-	auto f = file(to_native(name()), file::reading, file::existing);
-	if (!f) {
+	bool const direct = flags_ & file_reader_flags::direct;
+	std::shared_ptr<file> f;
+	if (cache_ && !direct) {
+		f = cache_->open(to_native(name()));
+	}
+	else {
+		f = std::make_shared<file>(to_native(name()), file::reading, direct ? (file::existing | file::direct) : file::existing);
+	}
+	if (!f || !*f) {
 		return {};
 	}
 
-	auto reader = std::make_unique<file_reader>(name(), pool, std::move(f), thread_pool_, offset, size, max_buffers);
+	auto reader = std::make_unique<file_reader>(name(), pool, f, thread_pool_, offset, size, max_buffers, flags_);
 	if (reader->error()) {
 		return {};
 	}
@@ -403,10 +662,12 @@ datetime file_reader_factory::mtime() const
 }
 
 
-view_reader::view_reader(std::wstring && name, aio_buffer_pool & pool, std::string_view data) noexcept
+view_reader::view_reader(std::wstring && name, aio_buffer_pool & pool, std::string_view data, bool zero_copy) noexcept
 	: reader_base(name, pool, 1)
 	, view_(data)
+	, zero_copy_(zero_copy)
 {
+	start_offset_ = 0;
 	size_ = max_size_ = remaining_ = view_.size();
 	if (!remaining_) {
 		eof_ = true;
@@ -431,16 +692,22 @@ std::pair<aio_result, buffer_lease> view_reader::do_get_buffer(scoped_lock &)
 		return {aio_result::ok, buffer_lease()};
 	}
 
-	auto b = buffer_pool_.get_buffer(*this);
-	if (!b) {
-		return {aio_result::wait, buffer_lease()};
-	}
-
-	size_t to_read = b->capacity();
+	size_t const offset = static_cast<size_t>(start_offset_ + size_ - remaining_);
+	buffer_lease b;
+	size_t to_read = buffer_pool_.buffer_size();
 	if (remaining_ != nosize && remaining_ < to_read) {
 		to_read = remaining_;
 	}
-	b->append(reinterpret_cast<uint8_t const*>(view_.data()) + start_offset_ + size_ - remaining_, to_read);
+	if (zero_copy_) {
+		b = view_leases.view(view_.data() + offset, to_read);
+	}
+	else {
+		b = buffer_pool_.get_buffer(*this);
+		if (!b) {
+			return {aio_result::wait, buffer_lease()};
+		}
+		b->append(reinterpret_cast<uint8_t const*>(view_.data()) + offset, to_read);
+	}
 	remaining_ -= to_read;
 	if (!remaining_) {
 		eof_ = true;
@@ -462,7 +729,7 @@ bool view_reader::do_seek(scoped_lock &)
 
 std::unique_ptr<reader_base> view_reader_factory::open(aio_buffer_pool & pool, uint64_t offset, uint64_t size, size_t)
 {
-	auto ret = std::make_unique<view_reader>(name(), pool, view_);
+	auto ret = std::make_unique<view_reader>(name(), pool, view_, zero_copy_);
 	if (offset || size != reader_base::nosize) {
 		if (!ret->seek(offset, size)) {
 			return {};
@@ -474,25 +741,22 @@ std::unique_ptr<reader_base> view_reader_factory::open(aio_buffer_pool & pool, u
 
 std::unique_ptr<reader_factory> view_reader_factory::clone() const
 {
-	return std::make_unique<view_reader_factory>(name_, view_);
+	return std::make_unique<view_reader_factory>(name_, view_, zero_copy_);
 }
 
 
-string_reader::string_reader(std::wstring && name, aio_buffer_pool & pool, std::string const& data) noexcept
-	: reader_base(name, pool, 1)
-	, data_(data)
+string_reader::string_reader(std::wstring && name, aio_buffer_pool & pool, std::string const& data, bool zero_copy) noexcept
+	: string_reader(std::move(name), pool, std::string(data), zero_copy)
 {
-	size_ = max_size_ = remaining_ = data_.size();
-	if (!remaining_) {
-		eof_ = true;
-	}
 }
 
-string_reader::string_reader(std::wstring && name, aio_buffer_pool & pool, std::string && data) noexcept
+string_reader::string_reader(std::wstring && name, aio_buffer_pool & pool, std::string && data, bool zero_copy) noexcept
 	: reader_base(name, pool, 1)
-	, data_(std::move(data))
+	, data_(new string_reader_data(std::move(data)))
+	, zero_copy_(zero_copy)
 {
-	size_ = max_size_ = remaining_ = data_.size();
+	start_offset_ = 0;
+	size_ = max_size_ = remaining_ = data_->data_.size();
 	if (!remaining_) {
 		eof_ = true;
 	}
@@ -501,6 +765,7 @@ string_reader::string_reader(std::wstring && name, aio_buffer_pool & pool, std::
 string_reader::~string_reader() noexcept
 {
 	close();
+	data_->unref();
 }
 
 void string_reader::do_close(scoped_lock &)
@@ -516,16 +781,22 @@ std::pair<aio_result, buffer_lease> string_reader::do_get_buffer(scoped_lock &)
 		return {aio_result::ok, buffer_lease()};
 	}
 
-	auto b = buffer_pool_.get_buffer(*this);
-	if (!b) {
-		return {aio_result::wait, buffer_lease()};
-	}
-
-	size_t to_read = b->capacity();
+	size_t const offset = static_cast<size_t>(start_offset_ + size_ - remaining_);
+	buffer_lease b;
+	size_t to_read = buffer_pool_.buffer_size();
 	if (remaining_ != nosize && remaining_ < to_read) {
 		to_read = remaining_;
 	}
-	b->append(reinterpret_cast<uint8_t const*>(data_.data()) + start_offset_ + size_ - remaining_, to_read);
+	if (zero_copy_) {
+		b = data_->view(offset, to_read);
+	}
+	else {
+		b = buffer_pool_.get_buffer(*this);
+		if (!b) {
+			return {aio_result::wait, buffer_lease()};
+		}
+		b->append(reinterpret_cast<uint8_t const*>(data_->data_.data()) + offset, to_read);
+	}
 	remaining_ -= to_read;
 	if (!remaining_) {
 		eof_ = true;
@@ -547,7 +818,7 @@ bool string_reader::do_seek(scoped_lock &)
 
 std::unique_ptr<reader_base> string_reader_factory::open(aio_buffer_pool & pool, uint64_t offset, uint64_t size, size_t)
 {
-	auto ret = std::make_unique<string_reader>(name(), pool, data_);
+	auto ret = std::make_unique<string_reader>(name(), pool, data_, zero_copy_);
 	if (offset || size != reader_base::nosize) {
 		if (!ret->seek(offset, size)) {
 			return {};
@@ -559,7 +830,7 @@ std::unique_ptr<reader_base> string_reader_factory::open(aio_buffer_pool & pool,
 
 std::unique_ptr<reader_factory> string_reader_factory::clone() const
 {
-	return std::make_unique<string_reader_factory>(name_, data_);
+	return std::make_unique<string_reader_factory>(name_, data_, zero_copy_);
 }
 
 }
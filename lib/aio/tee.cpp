@@ -0,0 +1,248 @@
+#include "../libfilezilla/aio/tee.hpp"
+#include "../libfilezilla/event_handler.hpp"
+
+#include <atomic>
+
+namespace fz {
+
+namespace {
+// Hands out leases referring to the same buffer, releases it once all are gone
+class shared_buffer final : public buffer_lease_source
+{
+public:
+	explicit shared_buffer(buffer_lease && b)
+		: buffer_(std::move(b))
+	{}
+
+	buffer_lease share() {
+		++refs_;
+		return lease(nonowning_buffer(buffer_->get(), buffer_->size(), buffer_->size()));
+	}
+
+	void unref() {
+		if (refs_.fetch_sub(1) == 1) {
+			delete this;
+		}
+	}
+
+private:
+	virtual ~shared_buffer() = default;
+
+	virtual void release(nonowning_buffer &&) override {
+		unref();
+	}
+
+	buffer_lease buffer_;
+	std::atomic<size_t> refs_{1};
+};
+}
+
+tee::tee(thread_pool & tpool, std::unique_ptr<reader_base> && reader, std::vector<std::unique_ptr<writer_base>> && writers, event_handler * handler)
+	: reader_(std::move(reader))
+	, handler_(handler)
+{
+	branches_.resize(writers.size());
+	for (size_t i = 0; i < writers.size(); ++i) {
+		branches_[i].writer_ = std::move(writers[i]);
+		if (!branches_[i].writer_) {
+			branches_[i].result_ = aio_result::error;
+		}
+	}
+
+	if (reader_) {
+		task_ = tpool.spawn([this]{ entry(); });
+	}
+	if (!task_) {
+		scoped_lock l(mtx_);
+		for (auto & b : branches_) {
+			b.result_ = aio_result::error;
+		}
+		done_ = true;
+	}
+}
+
+tee::~tee() noexcept
+{
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	task_.join();
+
+	reader_.reset();
+	branches_.clear();
+}
+
+bool tee::done() const
+{
+	scoped_lock l(mtx_);
+	return done_;
+}
+
+std::vector<aio_result> tee::results() const
+{
+	scoped_lock l(mtx_);
+	std::vector<aio_result> ret;
+	ret.reserve(branches_.size());
+	for (auto const& b : branches_) {
+		ret.push_back(b.result_);
+	}
+	return ret;
+}
+
+writer_base * tee::writer(size_t index) const
+{
+	return index < branches_.size() ? branches_[index].writer_.get() : nullptr;
+}
+
+void tee::on_buffer_availability(aio_waitable const* w)
+{
+	scoped_lock l(mtx_);
+	if (w == reader_.get()) {
+		reader_waiting_ = false;
+	}
+	else {
+		for (auto & b : branches_) {
+			if (w == b.writer_.get()) {
+				b.waiting_ = false;
+			}
+		}
+	}
+	cond_.signal(l);
+}
+
+void tee::fail(scoped_lock & l, size_t index)
+{
+	auto & b = branches_[index];
+	b.result_ = aio_result::error;
+	b.waiting_ = false;
+
+	// The writer might be signalling us, which needs the lock
+	l.unlock();
+	b.writer_->close();
+	l.lock();
+}
+
+void tee::distribute(scoped_lock & l, buffer_lease && b)
+{
+	auto * shared = new shared_buffer(std::move(b));
+	for (size_t i = 0; i < branches_.size() && !quit_; ++i) {
+		auto & branch = branches_[i];
+		if (branch.result_ != aio_result::wait) {
+			continue;
+		}
+
+		// Set beforehand, the writer might signal us before it returns
+		branch.waiting_ = true;
+		buffer_lease lease = shared->share();
+		l.unlock();
+		auto const r = branch.writer_->add_buffer(std::move(lease), static_cast<aio_waiter&>(*this));
+		l.lock();
+		if (r != aio_result::wait) {
+			branch.waiting_ = false;
+		}
+		if (r == aio_result::error && !quit_) {
+			fail(l, i);
+		}
+	}
+	shared->unref();
+}
+
+void tee::finalize(scoped_lock & l)
+{
+	for (size_t i = 0; i < branches_.size() && !quit_; ++i) {
+		auto & branch = branches_[i];
+		if (branch.result_ != aio_result::wait || branch.waiting_) {
+			continue;
+		}
+
+		branch.waiting_ = true;
+		l.unlock();
+		auto const r = branch.writer_->finalize(static_cast<aio_waiter&>(*this));
+		l.lock();
+		if (r != aio_result::wait) {
+			branch.waiting_ = false;
+		}
+		if (r == aio_result::ok) {
+			branch.result_ = aio_result::ok;
+		}
+		else if (r == aio_result::error && !quit_) {
+			fail(l, i);
+		}
+	}
+}
+
+void tee::entry()
+{
+	scoped_lock l(mtx_);
+
+	bool eof{};
+	while (!quit_) {
+		bool active{};
+		bool waiting{};
+		bool ready{};
+		for (auto const& b : branches_) {
+			if (b.result_ == aio_result::wait) {
+				active = true;
+				waiting |= b.waiting_;
+				ready |= !b.waiting_;
+			}
+		}
+		if (!active) {
+			break;
+		}
+
+		if (eof) {
+			if (ready) {
+				finalize(l);
+			}
+			else {
+				cond_.wait(l);
+			}
+			continue;
+		}
+
+		// Wait for the slowest writer before reading the next buffer
+		if (waiting || reader_waiting_) {
+			cond_.wait(l);
+			continue;
+		}
+
+		reader_waiting_ = true;
+		l.unlock();
+		auto [r, b] = reader_->get_buffer(static_cast<aio_waiter&>(*this));
+		l.lock();
+		if (quit_) {
+			return;
+		}
+		if (r != aio_result::wait) {
+			reader_waiting_ = false;
+		}
+
+		if (r == aio_result::error) {
+			for (size_t i = 0; i < branches_.size(); ++i) {
+				if (branches_[i].result_ == aio_result::wait) {
+					fail(l, i);
+				}
+			}
+		}
+		else if (r == aio_result::ok) {
+			if (b) {
+				distribute(l, std::move(b));
+			}
+			else {
+				eof = true;
+			}
+		}
+	}
+
+	if (!quit_) {
+		done_ = true;
+		if (handler_) {
+			handler_->send_event<tee_event>(this);
+		}
+	}
+}
+
+}
@@ -0,0 +1,1249 @@
+#include "../libfilezilla/aio/uring.hpp"
+#include "../libfilezilla/local_filesys.hpp"
+#include "../libfilezilla/logger.hpp"
+#include "../libfilezilla/translate.hpp"
+
+#if FZ_WINDOWS
+#define FZ_IOCP 1
+#elif defined(HAVE_IO_URING)
+#define FZ_URING 1
+#endif
+
+#if FZ_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+namespace fz {
+
+/// \private
+class uring_request
+{
+public:
+	virtual ~uring_request() = default;
+
+	// Called in the engine's completion thread, res is the number of bytes transferred or a negative errno value.
+	virtual void on_completion(int res) = 0;
+
+	void set(uint8_t opcode, file::file_t fd, uint64_t offset, uint8_t * buf = nullptr, size_t len = 0)
+	{
+		opcode_ = opcode;
+		fd_ = fd;
+		offset_ = offset;
+#if FZ_URING
+		iov_.iov_base = buf;
+		iov_.iov_len = len;
+#elif FZ_IOCP
+		buf_ = buf;
+		len_ = len;
+#else
+		(void)buf;
+		(void)len;
+#endif
+	}
+
+	uint8_t opcode_{};
+	file::file_t fd_{};
+	uint64_t offset_{};
+#if FZ_URING
+	iovec iov_{};
+#elif FZ_IOCP
+	struct overlapped final : OVERLAPPED
+	{
+		uring_request * request_{};
+	};
+	overlapped overlapped_{};
+
+	uint8_t * buf_{};
+	size_t len_{};
+
+	// Result of operations not completed by the kernel, posted to the port by the engine itself
+	int result_{};
+#endif
+};
+
+#if FZ_URING
+namespace {
+int sys_io_uring_setup(unsigned entries, io_uring_params * p)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+uint8_t const op_read = IORING_OP_READV;
+uint8_t const op_write = IORING_OP_WRITEV;
+uint8_t const op_fsync = IORING_OP_FSYNC;
+uint8_t const op_nop = IORING_OP_NOP;
+}
+
+class uring_engine_impl final
+{
+public:
+	uring_engine_impl() = default;
+	~uring_engine_impl();
+
+	uring_engine_impl(uring_engine_impl const&) = delete;
+	uring_engine_impl& operator=(uring_engine_impl const&) = delete;
+
+	bool init(thread_pool & pool, unsigned int entries);
+	void stop();
+
+	bool associate(file::file_t) {
+		return true;
+	}
+
+	// All or nothing, returns false if the engine is not running.
+	bool submit(uring_request * const* requests, size_t count);
+	bool submit(uring_request & r) {
+		uring_request * p = &r;
+		return submit(&p, 1);
+	}
+
+	bool running_{};
+
+private:
+	void entry();
+
+	// Moves queued requests into the submission queue and hands them to the kernel.
+	void flush(scoped_lock & l);
+
+	int fd_{-1};
+
+	void * sq_ring_{MAP_FAILED};
+	size_t sq_ring_size_{};
+	void * cq_ring_{MAP_FAILED};
+	size_t cq_ring_size_{};
+	io_uring_sqe * sqes_{static_cast<io_uring_sqe*>(MAP_FAILED)};
+	size_t sqes_size_{};
+
+	unsigned * sq_head_{};
+	unsigned * sq_tail_{};
+	unsigned * sq_array_{};
+	unsigned sq_mask_{};
+	unsigned sq_entries_{};
+
+	unsigned * cq_head_{};
+	unsigned * cq_tail_{};
+	io_uring_cqe * cqes_{};
+	unsigned cq_mask_{};
+	unsigned cq_entries_{};
+
+	mutex mutex_{false};
+
+	// Requests which did not fit into the submission queue or exceed what
+	// the completion queue can hold.
+	std::deque<uring_request*> queue_;
+	size_t in_flight_{};
+	unsigned unsubmitted_{};
+	bool quit_{};
+
+	async_task thread_;
+};
+
+uring_engine_impl::~uring_engine_impl()
+{
+	stop();
+
+	if (sqes_ != MAP_FAILED) {
+		munmap(sqes_, sqes_size_);
+	}
+	if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+		munmap(cq_ring_, cq_ring_size_);
+	}
+	if (sq_ring_ != MAP_FAILED) {
+		munmap(sq_ring_, sq_ring_size_);
+	}
+	if (fd_ != -1) {
+		::close(fd_);
+	}
+}
+
+bool uring_engine_impl::init(thread_pool & pool, unsigned int entries)
+{
+	io_uring_params p{};
+	fd_ = sys_io_uring_setup(entries ? entries : 1, &p);
+	if (fd_ == -1) {
+		return false;
+	}
+
+	sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool const single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+	}
+
+	sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sq_ring_ == MAP_FAILED) {
+		return false;
+	}
+	if (single) {
+		cq_ring_ = sq_ring_;
+	}
+	else {
+		cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cq_ring_ == MAP_FAILED) {
+			return false;
+		}
+	}
+	sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+	sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+	if (sqes_ == MAP_FAILED) {
+		return false;
+	}
+
+	auto * sq = static_cast<uint8_t*>(sq_ring_);
+	sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_entries_ = p.sq_entries;
+
+	auto * cq = static_cast<uint8_t*>(cq_ring_);
+	cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+	cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cq_entries_ = p.cq_entries;
+
+	thread_ = pool.spawn([this]{ entry(); });
+	running_ = static_cast<bool>(thread_);
+	return running_;
+}
+
+void uring_engine_impl::stop()
+{
+	scoped_lock l(mutex_);
+	if (!thread_) {
+		return;
+	}
+	quit_ = true;
+
+	// A null request wakes up and terminates the completion thread
+	queue_.push_back(nullptr);
+	flush(l);
+	l.unlock();
+
+	thread_.join();
+}
+
+bool uring_engine_impl::submit(uring_request * const* requests, size_t count)
+{
+	scoped_lock l(mutex_);
+	if (quit_ || !running_) {
+		return false;
+	}
+
+	queue_.insert(queue_.end(), requests, requests + count);
+	flush(l);
+	return true;
+}
+
+void uring_engine_impl::flush(scoped_lock &)
+{
+	unsigned tail = *sq_tail_;
+	unsigned const head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+
+	// Never have more operations in flight than the completion queue can hold, it cannot overflow that way.
+	while (!queue_.empty() && in_flight_ < cq_entries_ && tail - head < sq_entries_) {
+		uring_request * r = queue_.front();
+		queue_.pop_front();
+
+		unsigned const idx = tail & sq_mask_;
+		io_uring_sqe & sqe = sqes_[idx];
+		memset(&sqe, 0, sizeof(sqe));
+		if (r) {
+			sqe.opcode = r->opcode_;
+			sqe.fd = r->fd_;
+			sqe.off = r->offset_;
+			if (r->opcode_ == op_read || r->opcode_ == op_write) {
+				sqe.addr = reinterpret_cast<uint64_t>(&r->iov_);
+				sqe.len = 1;
+			}
+		}
+		else {
+			sqe.opcode = IORING_OP_NOP;
+		}
+		sqe.user_data = reinterpret_cast<uint64_t>(r);
+		sq_array_[idx] = idx;
+
+		++tail;
+		++unsubmitted_;
+		++in_flight_;
+	}
+	__atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+	while (unsubmitted_) {
+		int const ret = sys_io_uring_enter(fd_, unsubmitted_, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// Typically EAGAIN or EBUSY, retried once some operations have completed.
+			break;
+		}
+		if (!ret) {
+			break;
+		}
+		unsubmitted_ -= static_cast<unsigned>(ret);
+	}
+}
+
+void uring_engine_impl::entry()
+{
+	std::vector<std::pair<uring_request*, int>> completions;
+	completions.reserve(cq_entries_);
+
+	bool quit{};
+	while (!quit) {
+		int const ret = sys_io_uring_enter(fd_, 0, 1, IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			break;
+		}
+
+		unsigned head = *cq_head_;
+		unsigned const tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			io_uring_cqe const& cqe = cqes_[head & cq_mask_];
+			completions.emplace_back(reinterpret_cast<uring_request*>(cqe.user_data), cqe.res);
+		}
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+		if (completions.empty()) {
+			continue;
+		}
+
+		{
+			scoped_lock l(mutex_);
+			in_flight_ -= completions.size();
+			flush(l);
+		}
+
+		// The request may be destroyed by its completion handler, don't touch it afterwards.
+		for (auto const& c : completions) {
+			if (c.first) {
+				c.first->on_completion(c.second);
+			}
+			else {
+				quit = true;
+			}
+		}
+		completions.clear();
+	}
+}
+
+#elif FZ_IOCP
+
+namespace {
+uint8_t const op_read = 0;
+uint8_t const op_write = 1;
+uint8_t const op_fsync = 2;
+uint8_t const op_nop = 3;
+
+// Completion keys telling apart completed I/O from results posted by the engine
+ULONG_PTR const key_io = 0;
+ULONG_PTR const key_posted = 1;
+}
+
+class uring_engine_impl final
+{
+public:
+	uring_engine_impl() = default;
+	~uring_engine_impl();
+
+	uring_engine_impl(uring_engine_impl const&) = delete;
+	uring_engine_impl& operator=(uring_engine_impl const&) = delete;
+
+	bool init(thread_pool & pool, unsigned int entries);
+	void stop();
+
+	// Binds a file opened with file::overlapped to the port, needed once before submitting requests for it.
+	bool associate(file::file_t fd);
+
+	// Returns false if the engine is not running. Operations failing right away complete with their error.
+	bool submit(uring_request * const* requests, size_t count);
+	bool submit(uring_request & r) {
+		uring_request * p = &r;
+		return submit(&p, 1);
+	}
+
+	bool running_{};
+
+private:
+	void entry();
+
+	void start(uring_request & r);
+	void post(uring_request & r, int result);
+
+	HANDLE port_{};
+	thread_pool * pool_{};
+	unsigned int entries_{};
+
+	mutex mutex_{false};
+	bool quit_{};
+
+	async_task thread_;
+};
+
+uring_engine_impl::~uring_engine_impl()
+{
+	stop();
+
+	if (port_) {
+		CloseHandle(port_);
+	}
+}
+
+bool uring_engine_impl::init(thread_pool & pool, unsigned int entries)
+{
+	port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+	if (!port_) {
+		return false;
+	}
+
+	pool_ = &pool;
+	entries_ = entries ? entries : 1;
+
+	thread_ = pool.spawn([this]{ entry(); });
+	running_ = static_cast<bool>(thread_);
+	return running_;
+}
+
+void uring_engine_impl::stop()
+{
+	{
+		scoped_lock l(mutex_);
+		if (!thread_ || quit_) {
+			return;
+		}
+		quit_ = true;
+	}
+
+	// A packet without overlapped structure terminates the completion thread
+	if (PostQueuedCompletionStatus(port_, 0, key_posted, nullptr)) {
+		thread_.join();
+	}
+}
+
+bool uring_engine_impl::associate(file::file_t fd)
+{
+	if (!CreateIoCompletionPort(fd, port_, key_io, 0)) {
+		return false;
+	}
+
+	// Nobody waits on the file handle itself
+	SetFileCompletionNotificationModes(fd, FILE_SKIP_SET_EVENT_ON_HANDLE);
+	return true;
+}
+
+bool uring_engine_impl::submit(uring_request * const* requests, size_t count)
+{
+	{
+		scoped_lock l(mutex_);
+		if (quit_ || !running_) {
+			return false;
+		}
+	}
+
+	// Unlike io_uring, the port has no submission queue that could fill up, issue everything right away.
+	for (size_t i = 0; i < count; ++i) {
+		start(*requests[i]);
+	}
+	return true;
+}
+
+void uring_engine_impl::post(uring_request & r, int result)
+{
+	r.result_ = result;
+	if (!PostQueuedCompletionStatus(port_, 0, key_posted, &r.overlapped_)) {
+		// Cannot happen short of running out of non-paged pool. Nothing sensible can be done about it.
+		std::abort();
+	}
+}
+
+void uring_engine_impl::start(uring_request & r)
+{
+	static_cast<OVERLAPPED&>(r.overlapped_) = OVERLAPPED{};
+	r.overlapped_.request_ = &r;
+	r.overlapped_.Offset = static_cast<DWORD>(r.offset_);
+	r.overlapped_.OffsetHigh = static_cast<DWORD>(r.offset_ >> 32);
+
+	if (r.opcode_ == op_read || r.opcode_ == op_write) {
+		DWORD const len = static_cast<DWORD>(std::min(r.len_, size_t(0x80000000u)));
+		BOOL const res = (r.opcode_ == op_read) ?
+			ReadFile(r.fd_, r.buf_, len, nullptr, &r.overlapped_) :
+			WriteFile(r.fd_, r.buf_, len, nullptr, &r.overlapped_);
+
+		// Completion gets queued to the port even if the operation finished synchronously
+		if (!res) {
+			DWORD const err = GetLastError();
+			if (err != ERROR_IO_PENDING) {
+				post(r, err == ERROR_HANDLE_EOF ? 0 : -static_cast<int>(err));
+			}
+		}
+	}
+	else if (r.opcode_ == op_fsync) {
+		// There is no overlapped flush, don't hold up the completion thread with it
+		uring_request * p = &r;
+		auto task = pool_->spawn([this, p] {
+			post(*p, FlushFileBuffers(p->fd_) ? 0 : -static_cast<int>(GetLastError()));
+		});
+		if (task) {
+			task.detach();
+		}
+		else {
+			post(r, -static_cast<int>(ERROR_NOT_ENOUGH_MEMORY));
+		}
+	}
+	else {
+		post(r, 0);
+	}
+}
+
+void uring_engine_impl::entry()
+{
+	std::vector<OVERLAPPED_ENTRY> entries(entries_);
+	std::vector<std::pair<uring_request*, int>> completions;
+	completions.reserve(entries_);
+
+	bool quit{};
+	while (!quit) {
+		ULONG n{};
+		if (!GetQueuedCompletionStatusEx(port_, entries.data(), static_cast<ULONG>(entries.size()), &n, INFINITE, FALSE)) {
+			if (GetLastError() == WAIT_TIMEOUT) {
+				continue;
+			}
+			break;
+		}
+
+		for (ULONG i = 0; i < n; ++i) {
+			OVERLAPPED_ENTRY const& e = entries[i];
+			if (!e.lpOverlapped) {
+				quit = true;
+				continue;
+			}
+
+			uring_request & r = *static_cast<uring_request::overlapped*>(e.lpOverlapped)->request_;
+			int res{};
+			if (e.lpCompletionKey == key_posted) {
+				res = r.result_;
+			}
+			else {
+				DWORD transferred{};
+				if (GetOverlappedResult(r.fd_, e.lpOverlapped, &transferred, FALSE)) {
+					res = static_cast<int>(transferred);
+				}
+				else {
+					DWORD const err = GetLastError();
+					res = (err == ERROR_HANDLE_EOF) ? 0 : -static_cast<int>(err);
+				}
+			}
+			completions.emplace_back(&r, res);
+		}
+
+		// The request may be destroyed by its completion handler, don't touch it afterwards.
+		for (auto const& c : completions) {
+			c.first->on_completion(c.second);
+		}
+		completions.clear();
+	}
+}
+
+#else
+
+namespace {
+uint8_t const op_read = 0;
+uint8_t const op_write = 1;
+uint8_t const op_fsync = 2;
+uint8_t const op_nop = 3;
+}
+
+class uring_engine_impl final
+{
+public:
+	bool init(thread_pool &, unsigned int) {
+		return false;
+	}
+
+	bool submit(uring_request * const*, size_t) {
+		return false;
+	}
+	bool submit(uring_request &) {
+		return false;
+	}
+
+	bool associate(file::file_t) {
+		return false;
+	}
+
+	bool running_{};
+};
+
+#endif
+
+uring_engine::uring_engine(thread_pool & pool, unsigned int entries)
+	: pool_(pool)
+	, impl_(std::make_unique<uring_engine_impl>())
+{
+	impl_->init(pool, entries);
+}
+
+uring_engine::~uring_engine()
+{
+}
+
+bool uring_engine::available() const
+{
+	return impl_->running_;
+}
+
+
+class uring_file_reader::read_request final : public uring_request
+{
+public:
+	read_request(uring_file_reader & reader, buffer_lease && b, uint64_t offset, size_t len)
+		: reader_(reader)
+		, buffer_(std::move(b))
+		, requested_(len)
+	{
+		set(op_read, reader_.file_.fd(), offset, buffer_->get(len), len);
+	}
+
+	virtual void on_completion(int res) override {
+		reader_.on_read(*this, res);
+	}
+
+	uring_file_reader & reader_;
+	buffer_lease buffer_;
+	size_t requested_{};
+	bool done_{};
+	bool eof_{};
+};
+
+class uring_file_reader::refill_request final : public uring_request
+{
+public:
+	explicit refill_request(uring_file_reader & reader)
+		: reader_(reader)
+	{
+		set(op_nop, file::file_t(), 0);
+	}
+
+	virtual void on_completion(int) override {
+		reader_.on_refill();
+	}
+
+	uring_file_reader & reader_;
+};
+
+uring_file_reader::uring_file_reader(std::wstring const& name, aio_buffer_pool & pool, file && f, uring_engine & engine, uint64_t offset, uint64_t size, size_t max_buffers) noexcept
+	: reader_base(name, pool, max_buffers)
+	, file_(std::move(f))
+	, engine_(engine)
+	, refill_request_(std::make_unique<refill_request>(*this))
+{
+	scoped_lock l(mtx_);
+	if (file_ && engine_.available() && engine_.impl_->associate(file_.fd())) {
+		auto s = file_.size();
+		if (s >= 0) {
+			max_size_ = static_cast<uint64_t>(s);
+		}
+		if (!seek(offset, size)) {
+			error_ = true;
+		}
+	}
+	else {
+		error_ = true;
+	}
+}
+
+uring_file_reader::~uring_file_reader() noexcept
+{
+	close();
+}
+
+bool uring_file_reader::seekable() const
+{
+	return max_size_ != nosize;
+}
+
+void uring_file_reader::drain(scoped_lock & l)
+{
+	quit_ = true;
+	while (in_flight_) {
+		cond_.wait(l);
+	}
+	requests_.clear();
+}
+
+void uring_file_reader::do_close(scoped_lock & l)
+{
+	drain(l);
+	file_.close();
+}
+
+bool uring_file_reader::do_seek(scoped_lock & l)
+{
+	drain(l);
+	quit_ = false;
+
+	next_offset_ = start_offset_;
+	unrequested_ = remaining_;
+	submit_reads(l);
+
+	return !error_;
+}
+
+void uring_file_reader::on_buffer_availability(aio_waitable const*)
+{
+	scoped_lock l(mtx_);
+	if (quit_ || error_ || refill_pending_) {
+		return;
+	}
+
+	// Must not call into the buffer pool from here, continue in the completion thread instead.
+	if (engine_.impl_->submit(*refill_request_)) {
+		refill_pending_ = true;
+		++in_flight_;
+	}
+	else {
+		error_ = true;
+		signal_availibility();
+	}
+}
+
+void uring_file_reader::on_refill()
+{
+	scoped_lock l(mtx_);
+	refill_pending_ = false;
+	--in_flight_;
+	if (quit_) {
+		if (!in_flight_) {
+			cond_.signal(l);
+		}
+		return;
+	}
+	submit_reads(l);
+}
+
+void uring_file_reader::submit_reads(scoped_lock &)
+{
+	if (quit_ || error_ || eof_) {
+		return;
+	}
+
+	std::vector<uring_request*> batch;
+	while (unrequested_ && buffers_.size() + requests_.size() < max_buffers_) {
+		auto b = buffer_pool_.get_buffer(*this);
+		if (!b) {
+			break;
+		}
+
+		size_t len = b->capacity();
+		if (unrequested_ != nosize && len > unrequested_) {
+			len = static_cast<size_t>(unrequested_);
+		}
+		auto r = std::make_unique<read_request>(*this, std::move(b), next_offset_, len);
+		next_offset_ += len;
+		if (unrequested_ != nosize) {
+			unrequested_ -= len;
+		}
+		batch.push_back(r.get());
+		requests_.emplace_back(std::move(r));
+	}
+
+	if (!batch.empty()) {
+		if (engine_.impl_->submit(batch.data(), batch.size())) {
+			in_flight_ += batch.size();
+		}
+		else {
+			requests_.resize(requests_.size() - batch.size());
+			error_ = true;
+		}
+	}
+}
+
+void uring_file_reader::on_read(read_request & r, int res)
+{
+	scoped_lock l(mtx_);
+	if (!quit_ && !error_) {
+		if (res < 0) {
+			logger_.log(logmsg::debug_warning, L"Reading from '%s' failed with error %d", name_, -res);
+			error_ = true;
+		}
+		else if (!res) {
+			r.done_ = true;
+			r.eof_ = true;
+		}
+		else {
+			r.buffer_->add(static_cast<size_t>(res));
+			r.requested_ -= static_cast<size_t>(res);
+			if (r.requested_) {
+				// Short read, request the rest.
+				r.set(op_read, file_.fd(), r.offset_ + res, r.buffer_->get(r.requested_), r.requested_);
+				if (engine_.impl_->submit(r)) {
+					return;
+				}
+				error_ = true;
+			}
+			else {
+				r.done_ = true;
+			}
+		}
+	}
+
+	--in_flight_;
+	if (quit_) {
+		if (!in_flight_) {
+			cond_.signal(l);
+		}
+		return;
+	}
+
+	// Hand out data in file order
+	bool const was_empty = buffers_.empty();
+	while (!error_ && !requests_.empty() && requests_.front()->done_) {
+		auto & front = *requests_.front();
+		if (!eof_ && !front.buffer_->empty()) {
+			if (remaining_ != nosize) {
+				remaining_ -= front.buffer_->size();
+			}
+			buffers_.emplace_back(std::move(front.buffer_));
+		}
+		if (front.eof_ && !eof_) {
+			if (remaining_ != nosize && remaining_) {
+				// File got truncated
+				error_ = true;
+			}
+			else {
+				eof_ = true;
+			}
+			unrequested_ = 0;
+		}
+		requests_.pop_front();
+	}
+	if (!error_ && !eof_ && !remaining_ && requests_.empty()) {
+		eof_ = true;
+	}
+
+	if (was_empty && !buffers_.empty()) {
+		signal_availibility();
+	}
+	else if ((error_ || eof_) && buffers_.empty()) {
+		signal_availibility();
+	}
+
+	submit_reads(l);
+}
+
+std::pair<aio_result, buffer_lease> uring_file_reader::do_get_buffer(scoped_lock & l)
+{
+	if (buffers_.empty()) {
+		if (error_) {
+			return {aio_result::error, buffer_lease()};
+		}
+		else if (eof_) {
+			return {aio_result::ok, buffer_lease()};
+		}
+		return {aio_result::wait, buffer_lease()};
+	}
+
+	buffer_lease b = std::move(buffers_.front());
+	buffers_.pop_front();
+	get_buffer_called_ = true;
+	submit_reads(l);
+	return {aio_result::ok, std::move(b)};
+}
+
+
+uring_file_reader_factory::uring_file_reader_factory(std::wstring const& file, uring_engine & engine)
+	: reader_factory(file)
+	, engine_(engine)
+{
+}
+
+std::unique_ptr<reader_base> uring_file_reader_factory::open(aio_buffer_pool & pool, uint64_t offset, uint64_t size, size_t max_buffers)
+{
+	if (!max_buffers) {
+		max_buffers = preferred_buffer_count();
+	}
+
+	bool const available = engine_.available();
+	auto f = file(to_native(name()), file::reading, available ? (file::existing | file::overlapped) : file::existing);
+	if (!f) {
+		return {};
+	}
+
+	std::unique_ptr<reader_base> reader;
+	if (available) {
+		reader = std::make_unique<uring_file_reader>(name(), pool, std::move(f), engine_, offset, size, max_buffers);
+	}
+	else {
+		reader = std::make_unique<file_reader>(name(), pool, std::move(f), engine_.pool(), offset, size, max_buffers);
+	}
+	if (reader->error()) {
+		return {};
+	}
+	return reader;
+}
+
+std::unique_ptr<reader_factory> uring_file_reader_factory::clone() const
+{
+	return std::make_unique<uring_file_reader_factory>(*this);
+}
+
+uint64_t uring_file_reader_factory::size() const
+{
+	auto s = local_filesys::get_size(to_native(name()));
+	if (s < 0) {
+		return reader_base::nosize;
+	}
+	else {
+		return static_cast<uint64_t>(s);
+	}
+}
+
+datetime uring_file_reader_factory::mtime() const
+{
+	return local_filesys::get_modification_time(to_native(name()));
+}
+
+
+class uring_file_writer::write_request final : public uring_request
+{
+public:
+	write_request(uring_file_writer & writer, buffer_lease && b, uint64_t offset)
+		: writer_(writer)
+		, buffer_(std::move(b))
+	{
+		set(op_write, writer_.file_.fd(), offset, buffer_->get(), buffer_->size());
+	}
+
+	virtual void on_completion(int res) override {
+		writer_.on_write(*this, res);
+	}
+
+	uring_file_writer & writer_;
+	buffer_lease buffer_;
+};
+
+class uring_file_writer::fsync_request final : public uring_request
+{
+public:
+	explicit fsync_request(uring_file_writer & writer)
+		: writer_(writer)
+	{
+		set(op_fsync, writer_.file_.fd(), 0);
+	}
+
+	virtual void on_completion(int res) override {
+		writer_.on_fsync(res);
+	}
+
+	uring_file_writer & writer_;
+};
+
+uring_file_writer::uring_file_writer(std::wstring const& name, aio_buffer_pool & pool, file && f, uring_engine & engine, bool fsync, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+	: writer_base(name, pool, std::move(progress_cb), max_buffers)
+	, file_(std::move(f))
+	, engine_(engine)
+	, fsync_(fsync)
+{
+	if (file_ && engine_.available() && engine_.impl_->associate(file_.fd())) {
+		auto pos = file_.position();
+		if (pos >= 0) {
+			next_offset_ = static_cast<uint64_t>(pos);
+		}
+		else {
+			error_ = true;
+		}
+	}
+	else {
+		error_ = true;
+	}
+	if (error_) {
+		file_.close();
+	}
+}
+
+uring_file_writer::~uring_file_writer()
+{
+	close();
+}
+
+aio_result uring_file_writer::do_add_buffer(scoped_lock &, buffer_lease && b)
+{
+	if (finalizing_) {
+		return aio_result::error;
+	}
+
+	size_t const s = b->size();
+	requests_.emplace_back(std::make_unique<write_request>(*this, std::move(b), next_offset_));
+	if (!engine_.impl_->submit(*requests_.back())) {
+		requests_.pop_back();
+		error_ = true;
+		return aio_result::error;
+	}
+	next_offset_ += s;
+	++in_flight_;
+
+	if (in_flight_ >= max_buffers_) {
+		return aio_result::wait;
+	}
+	return aio_result::ok;
+}
+
+void uring_file_writer::on_write(write_request & r, int res)
+{
+	scoped_lock l(mtx_);
+	if (!error_) {
+		if (res > 0) {
+			r.buffer_->consume(static_cast<size_t>(res));
+			if (progress_cb_) {
+				progress_cb_(this, static_cast<uint64_t>(res));
+			}
+			if (!r.buffer_->empty()) {
+				// Short write, submit the rest.
+				r.set(op_write, file_.fd(), r.offset_ + res, r.buffer_->get(), r.buffer_->size());
+				if (engine_.impl_->submit(r)) {
+					return;
+				}
+				error_ = true;
+			}
+		}
+		else {
+			buffer_pool_.logger().log(logmsg::debug_warning, L"Writing to '%s' failed with error %d", name_, -res);
+			error_ = true;
+		}
+	}
+
+	bool const was_full = in_flight_ >= max_buffers_;
+	--in_flight_;
+	for (auto it = requests_.begin(); it != requests_.end(); ++it) {
+		if (it->get() == &r) {
+			requests_.erase(it);
+			break;
+		}
+	}
+
+	if (error_) {
+		signal_availibility();
+	}
+	else if (!in_flight_ && finalizing_ == 1) {
+		complete_finalize(l);
+	}
+	else if (was_full) {
+		signal_availibility();
+	}
+
+	if (!in_flight_) {
+		cond_.signal(l);
+	}
+}
+
+void uring_file_writer::on_fsync(int res)
+{
+	scoped_lock l(mtx_);
+	--in_flight_;
+	if (res < 0) {
+		buffer_pool_.logger().log(logmsg::error, fztranslate("Could not sync '%s' to disk."), name_);
+		error_ = true;
+	}
+	finalizing_ = 2;
+	signal_availibility();
+	cond_.signal(l);
+}
+
+void uring_file_writer::complete_finalize(scoped_lock &)
+{
+	if (fsync_) {
+		fsync_request_ = std::make_unique<fsync_request>(*this);
+		if (engine_.impl_->submit(*fsync_request_)) {
+			++in_flight_;
+			return;
+		}
+		error_ = true;
+	}
+	else {
+		finalizing_ = 2;
+	}
+	signal_availibility();
+}
+
+aio_result uring_file_writer::do_finalize(scoped_lock &)
+{
+	if (error_) {
+		return aio_result::error;
+	}
+	if (finalizing_ == 2) {
+		return aio_result::ok;
+	}
+	if (finalizing_ == 1) {
+		return aio_result::wait;
+	}
+
+	finalizing_ = 1;
+	if (in_flight_) {
+		// Continued once the last write has completed
+		return aio_result::wait;
+	}
+	if (!fsync_) {
+		finalizing_ = 2;
+		return aio_result::ok;
+	}
+	fsync_request_ = std::make_unique<fsync_request>(*this);
+	if (!engine_.impl_->submit(*fsync_request_)) {
+		error_ = true;
+		return aio_result::error;
+	}
+	++in_flight_;
+	return aio_result::wait;
+}
+
+void uring_file_writer::do_close(scoped_lock & l)
+{
+	while (in_flight_) {
+		cond_.wait(l);
+	}
+	requests_.clear();
+	fsync_request_.reset();
+
+	if (file_) {
+		bool remove{};
+		if (!finalizing_ && !next_offset_) {
+			// Freshly created file to which nothing has been written.
+			remove = true;
+		}
+		else if (preallocated_) {
+			// See file_writer::do_close
+			if (file_.seek(static_cast<int64_t>(next_offset_), file::begin) == static_cast<int64_t>(next_offset_)) {
+				file_.truncate();
+			}
+		}
+		file_.close();
+
+		if (remove) {
+			buffer_pool_.logger().log(logmsg::debug_verbose, L"Deleting empty file '%s'", name_);
+			remove_file(to_native(name_));
+		}
+	}
+}
+
+aio_result uring_file_writer::preallocate(uint64_t size)
+{
+	scoped_lock l(mtx_);
+	if (error_ || in_flight_ || finalizing_) {
+		return aio_result::error;
+	}
+
+	buffer_pool_.logger().log(logmsg::debug_info, L"Preallocating %d bytes for the file \"%s\"", size, name_);
+
+	auto const seek_offset = static_cast<int64_t>(next_offset_ + size);
+	if (file_.seek(seek_offset, file::begin) == seek_offset) {
+		if (!file_.truncate()) {
+			buffer_pool_.logger().log(logmsg::debug_warning, L"Could not preallocate the file");
+		}
+	}
+	preallocated_ = true;
+
+	return aio_result::ok;
+}
+
+bool uring_file_writer::set_mtime(datetime const& t)
+{
+	scoped_lock l(mtx_);
+	if (error_ || finalizing_ != 2 || !file_) {
+		return false;
+	}
+
+	return file_.set_modification_time(t);
+}
+
+
+uring_file_writer_factory::uring_file_writer_factory(std::wstring const& file, uring_engine & engine, file_writer_flags flags)
+	: writer_factory(file)
+	, engine_(engine)
+	, flags_(flags)
+{
+}
+
+std::unique_ptr<writer_base> uring_file_writer_factory::open(aio_buffer_pool & pool, uint64_t offset, writer_base::progress_cb_t progress_cb, size_t max_buffers)
+{
+	if (!engine_.available()) {
+		return file_writer_factory(name(), engine_.pool(), flags_).open(pool, offset, std::move(progress_cb), max_buffers);
+	}
+
+	if (!max_buffers) {
+		max_buffers = preferred_buffer_count();
+	}
+
+	file::creation_flags flags = (offset ? file::existing : file::empty) | file::overlapped;
+	if (flags_ & file_writer_flags::permissions_current_user_only) {
+		flags |= file::current_user_only;
+	}
+	else if (flags_ & file_writer_flags::permissions_current_user_and_admins_only) {
+		flags |= file::current_user_and_admins_only;
+	}
+	auto f = file(to_native(name()), file::writing, flags);
+	if (!f) {
+		return {};
+	}
+
+	if (offset) {
+		auto seek = static_cast<int64_t>(offset);
+		auto new_pos = f.seek(seek, file::begin);
+		if (new_pos != seek) {
+			pool.logger().log(logmsg::error, fztranslate("Could not seek to offset %d within '%s'."), seek, name());
+			return {};
+		}
+		if (!f.truncate()) {
+			pool.logger().log(logmsg::error, fztranslate("Could not truncate '%s' to offset %d."), name(), offset);
+			return {};
+		}
+	}
+
+	return std::make_unique<uring_file_writer>(name(), pool, std::move(f), engine_, flags_ & file_writer_flags::fsync, std::move(progress_cb), max_buffers);
+}
+
+std::unique_ptr<writer_factory> uring_file_writer_factory::clone() const
+{
+	return std::make_unique<uring_file_writer_factory>(*this);
+}
+
+uint64_t uring_file_writer_factory::size() const
+{
+	auto s = local_filesys::get_size(to_native(name()));
+	if (s < 0) {
+		return writer_base::nosize;
+	}
+	else {
+		return static_cast<uint64_t>(s);
+	}
+}
+
+datetime uring_file_writer_factory::mtime() const
+{
+	return local_filesys::get_modification_time(to_native(name()));
+}
+
+bool uring_file_writer_factory::set_mtime(datetime const& t)
+{
+	return local_filesys::set_modification_time(to_native(name()), t);
+}
+
+}
@@ -1,17 +1,67 @@
 #include "../libfilezilla/aio/writer.hpp"
 #include "../libfilezilla/buffer.hpp"
+#include "../libfilezilla/buffer_chain.hpp"
+#include "../libfilezilla/fsync_coordinator.hpp"
 #include "../libfilezilla/local_filesys.hpp"
 #include "../libfilezilla/logger.hpp"
 #include "../libfilezilla/translate.hpp"
 
+#include <algorithm>
+#include <new>
+
+#include <string.h>
+
 namespace fz {
 
+namespace {
+// Size of the staging area used in direct mode, a multiple of file::direct_io_alignment
+size_t const staging_size = 256 * 1024;
+
+// Granularity of holes in sparse mode
+size_t const sparse_block_size = 4096;
+
+// In coalescing mode, buffers smaller than this are merged. Merged data is written in
+// multiples of the block size once it reaches the target, or after the latency at the latest.
+size_t const coalesce_max_buffer = 64 * 1024;
+size_t const coalesce_target = 1024 * 1024;
+size_t const coalesce_block_size = 4096;
+duration const coalesce_latency = duration::from_milliseconds(100);
+
+bool is_zero(uint8_t const* p, size_t len)
+{
+	return !p[0] && !memcmp(p, p + 1, len - 1);
+}
+
+// Length of the run of whole zero blocks at the start of the data, which is at offset pos in the file
+size_t zero_run(uint8_t const* p, size_t len, uint64_t pos)
+{
+	if (pos % sparse_block_size) {
+		return 0;
+	}
+	size_t run{};
+	while (len - run >= sparse_block_size && is_zero(p + run, sparse_block_size)) {
+		run += sparse_block_size;
+	}
+	return run;
+}
+
+// Length of the data up to the next run of zero blocks
+size_t data_run(uint8_t const* p, size_t len, uint64_t pos)
+{
+	size_t run = sparse_block_size - pos % sparse_block_size;
+	while (run < len && !zero_run(p + run, len - run, pos + run)) {
+		run += sparse_block_size;
+	}
+	return std::min(run, len);
+}
+}
+
 void writer_base::close()
 {
 	scoped_lock l(mtx_);
 	do_close(l);
 	remove_waiters();
-	buffers_.clear();
+	buffer_pool_.release_leases(buffers_);
 }
 
 aio_result writer_base::add_buffer(buffer_lease && buffer, aio_waiter & h)
@@ -46,6 +96,44 @@ aio_result writer_base::add_buffer(buffer_lease && buffer, event_handler & h)
 	return r;
 }
 
+aio_result writer_base::add_buffers(std::vector<buffer_lease> & buffers, aio_waiter & h)
+{
+	scoped_lock l(mtx_);
+	auto r = do_add_buffers(l, buffers);
+	if (r == aio_result::wait) {
+		add_waiter(h);
+	}
+	return r;
+}
+
+aio_result writer_base::add_buffers(std::vector<buffer_lease> & buffers, event_handler & h)
+{
+	scoped_lock l(mtx_);
+	auto r = do_add_buffers(l, buffers);
+	if (r == aio_result::wait) {
+		add_waiter(h);
+	}
+	return r;
+}
+
+aio_result writer_base::do_add_buffers(scoped_lock & l, std::vector<buffer_lease> & buffers)
+{
+	if (error_) {
+		return aio_result::error;
+	}
+
+	auto r = aio_result::ok;
+	auto it = buffers.begin();
+	while (it != buffers.end() && r == aio_result::ok) {
+		auto & b = *it++;
+		if (b && *b) {
+			r = do_add_buffer(l, std::move(b));
+		}
+	}
+	buffers.erase(buffers.begin(), it);
+	return r;
+}
+
 aio_result writer_base::finalize(aio_waiter & h)
 {
 	scoped_lock l(mtx_);
@@ -158,10 +246,14 @@ aio_result file_writer::continue_finalize(scoped_lock & l)
 		return aio_result::error;
 	}
 
-	if (fsync_ && buffers_.empty()) {
+	// In direct mode the writer thread needs to write out the staged tail,
+	// in sparse mode it might need to extend the file over a trailing hole.
+	// With coalescing, merged data may be left to write.
+	bool const sync = fsync_ || direct_ || sparse_ || coalesce_;
+	if (sync && buffers_.empty()) {
 		wakeup(l);
 	}
-	if (!buffers_.empty() || fsync_) {
+	if (!buffers_.empty() || sync) {
 		return aio_result::wait;
 	}
 	return aio_result::ok;
@@ -176,27 +268,66 @@ void threaded_writer::do_close(scoped_lock & l)
 	l.lock();
 }
 
-file_writer::file_writer(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+file_writer::file_writer(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync, progress_cb_t && progress_cb, size_t max_buffers, file_writer_flags flags, fsync_coordinator * coordinator) noexcept
 	: threaded_writer(name, pool, std::move(progress_cb), max_buffers)
     , file_(std::move(f))
-	, fsync_(fsync)
+	, fsync_(fsync || (flags & file_writer_flags::fsync))
+	, direct_(flags & file_writer_flags::direct)
+	, sparse_((flags & file_writer_flags::sparse) && !direct_)
+	, coalesce_((flags & file_writer_flags::coalesce) && !direct_ && !sparse_)
+	, coordinator_(coordinator)
 {
-	if (file_) {
-		task_ = tpool.spawn([this]{ entry(); });
-	}
-	if (!file_ || !task_) {
-		file_.close();
-		error_ = true;
-	}
+	init(tpool);
 }
 
-file_writer::file_writer(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync, progress_cb_t && progress_cb, size_t max_buffers) noexcept
+file_writer::file_writer(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync, progress_cb_t && progress_cb, size_t max_buffers, file_writer_flags flags, fsync_coordinator * coordinator) noexcept
 	: threaded_writer(name, pool, std::move(progress_cb), max_buffers)
     , file_(std::move(f))
-	, fsync_(fsync)
+	, fsync_(fsync || (flags & file_writer_flags::fsync))
+	, direct_(flags & file_writer_flags::direct)
+	, sparse_((flags & file_writer_flags::sparse) && !direct_)
+	, coalesce_((flags & file_writer_flags::coalesce) && !direct_ && !sparse_)
+	, coordinator_(coordinator)
 {
+	init(tpool);
+}
+
+void file_writer::init(thread_pool & tpool)
+{
+	if (file_ && direct_) {
+		size_t const align = file::direct_io_alignment;
+		staging_memory_.reset(new (std::nothrow) uint8_t[staging_size + align]);
+		if (!staging_memory_) {
+			file_.close();
+		}
+		else {
+			staging_ = staging_memory_.get() + (align - reinterpret_cast<uintptr_t>(staging_memory_.get()) % align) % align;
+
+			// Writes can only start at an aligned position, load the partial block in front of it.
+			int64_t const pos = file_.position();
+			size_t const head = pos > 0 ? static_cast<size_t>(pos % align) : 0;
+			if (pos < 0) {
+				file_.close();
+			}
+			else if (head) {
+				int64_t const block = pos - static_cast<int64_t>(head);
+				if (file_.seek(block, file::begin) != block || file_.read(staging_, align) < static_cast<int64_t>(head) || file_.seek(block, file::begin) != block) {
+					buffer_pool_.logger().log(logmsg::error, fztranslate("Could not read from '%s'."), name_);
+					file_.close();
+				}
+				staged_ = head;
+			}
+		}
+	}
+	if (file_ && (sparse_ || coalesce_)) {
+		int64_t const pos = file_.position();
+		if (pos < 0) {
+			file_.close();
+		}
+		pos_ = static_cast<uint64_t>(pos);
+	}
 	if (file_) {
-		task_ = tpool.spawn([this]{ entry(); });
+		task_ = tpool.spawn([this]{ entry(); }, "file writer");
 	}
 	if (!file_ || !task_) {
 		file_.close();
@@ -214,7 +345,7 @@ void file_writer::do_close(scoped_lock & l)
 	threaded_writer::do_close(l);
 	if (file_) {
 		bool remove{};
-		if (!finalizing_&& !file_.position()) {
+		if (!finalizing_&& !file_.position() && !staged_) {
 			// Freshly created file to which nothing has been written.
 			remove = true;
 		}
@@ -237,10 +368,38 @@ void file_writer::entry()
 	scoped_lock l(mtx_);
 	while (!quit_ && !error_) {
 		if (buffers_.empty()) {
+			if (!coalesced_.empty()) {
+				auto const age = monotonic_clock::now() - coalesced_since_;
+				if (finalizing_ == 1 || age >= coalesce_latency) {
+					if (!flush_coalesced(l, false)) {
+						return;
+					}
+				}
+				else {
+					cond_.wait(l, coalesce_latency - age);
+				}
+				continue;
+			}
 			if (finalizing_ == 1) {
 				finalizing_ = 2;
-				if (fsync_) {
-					if (!file_.fsync()) {
+				if ((staged_ && !flush_tail()) || (trailing_hole_ && !file_.truncate())) {
+					buffer_pool_.logger().log(logmsg::error, fztranslate("Could not write to '%s'."), name_);
+					error_ = true;
+				}
+				else if (fsync_) {
+					bool synced;
+					if (coordinator_) {
+						l.unlock();
+						synced = coordinator_->sync(file_);
+						l.lock();
+						if (quit_) {
+							return;
+						}
+					}
+					else {
+						synced = file_.fsync();
+					}
+					if (!synced) {
 						buffer_pool_.logger().log(logmsg::error, fztranslate("Could not sync '%s' to disk."), name_);
 						error_ = true;
 					}
@@ -253,20 +412,104 @@ void file_writer::entry()
 			continue;
 		}
 		auto & b = buffers_.front();
+		if (coalesce_) {
+			if (b->size() < coalesce_max_buffer) {
+				if (coalesced_.empty()) {
+					coalesced_since_ = monotonic_clock::now();
+				}
+				coalesced_.append(b->get(), b->size());
+				b->clear();
+
+				if (coalesced_.size() >= coalesce_target || monotonic_clock::now() - coalesced_since_ >= coalesce_latency) {
+					if (!flush_coalesced(l, coalesced_.size() >= coalesce_target)) {
+						return;
+					}
+				}
+			}
+			else if (!coalesced_.empty()) {
+				// Keep the order
+				if (!flush_coalesced(l, false)) {
+					return;
+				}
+				continue;
+			}
+		}
 		while (!b->empty()) {
+			uint8_t const* data = b->get();
+			size_t len = b->size();
+			size_t consumed{};
+			if (direct_) {
+				size_t const align = file::direct_io_alignment;
+				if (!staged_ && len >= align && !(reinterpret_cast<uintptr_t>(data) % align)) {
+					// Whole blocks can be written straight from the buffer
+					len -= len % align;
+					consumed = len;
+				}
+				else {
+					consumed = std::min(len, staging_size - staged_);
+					memcpy(staging_ + staged_, data, consumed);
+					staged_ += consumed;
+					if (staged_ < staging_size) {
+						b->consume(consumed);
+						if (progress_cb_) {
+							progress_cb_(this, static_cast<uint64_t>(consumed));
+						}
+						continue;
+					}
+					data = staging_;
+					len = staging_size;
+				}
+			}
+			else if (sparse_) {
+				size_t const zeros = zero_run(data, len, pos_);
+				if (zeros) {
+					// Leave a hole
+					l.unlock();
+					if (preallocated_) {
+						file_.punch_hole(static_cast<int64_t>(pos_), static_cast<int64_t>(zeros));
+					}
+					bool const seeked = file_.seek(static_cast<int64_t>(zeros), file::current) >= 0;
+					l.lock();
+					if (quit_ || error_) {
+						return;
+					}
+					if (!seeked) {
+						error_ = true;
+						return;
+					}
+					pos_ += zeros;
+					trailing_hole_ = true;
+					b->consume(zeros);
+					if (progress_cb_) {
+						progress_cb_(this, static_cast<uint64_t>(zeros));
+					}
+					continue;
+				}
+				len = data_run(data, len, pos_);
+			}
 			l.unlock();
-			int64_t written = file_.write(b->get(), b->size());
+			int64_t written = file_.write(data, len);
 			l.lock();
 			if (quit_ || error_) {
 				return;
 			}
-			if (written <= 0) {
+			if (written <= 0 || (direct_ && static_cast<size_t>(written) != len)) {
 				error_ = true;
 				return;
 			}
-			b->consume(static_cast<size_t>(written));
+			if (direct_) {
+				if (data == staging_) {
+					staged_ = 0;
+				}
+			}
+			else {
+				consumed = static_cast<size_t>(written);
+				pos_ += consumed;
+				trailing_hole_ = false;
+			}
+			b->consume(consumed);
 			if (progress_cb_) {
-				progress_cb_(this, static_cast<uint64_t>(written));
+				progress_cb_(this, static_cast<uint64_t>(consumed));
 			}
 		}
 		bool const signal = buffers_.size() == max_buffers_;
@@ -277,10 +520,65 @@ void file_writer::entry()
 	}
 }
 
+bool file_writer::flush_coalesced(scoped_lock & l, bool partial)
+{
+	size_t len = coalesced_.size();
+	if (partial) {
+		size_t const aligned = static_cast<size_t>((pos_ + len) % coalesce_block_size);
+		if (aligned < len) {
+			len -= aligned;
+		}
+	}
+
+	// Only this thread modifies the coalesced data
+	uint8_t const* data = coalesced_.get();
+	size_t written{};
+	l.unlock();
+	while (written < len) {
+		int64_t const res = file_.write(data + written, len - written);
+		if (res <= 0) {
+			break;
+		}
+		written += static_cast<size_t>(res);
+	}
+	l.lock();
+	if (quit_ || error_) {
+		return false;
+	}
+	if (written < len) {
+		error_ = true;
+		return false;
+	}
+
+	pos_ += len;
+	// What is left keeps the time of the oldest data, it gets written early rather than late
+	coalesced_.consume(len);
+	if (progress_cb_) {
+		progress_cb_(this, static_cast<uint64_t>(len));
+	}
+	return true;
+}
+
+bool file_writer::flush_tail()
+{
+	size_t const align = file::direct_io_alignment;
+	size_t const len = (staged_ + align - 1) / align * align;
+	memset(staging_ + staged_, 0, len - staged_);
+
+	int64_t const pos = file_.position();
+	if (pos < 0 || file_.write(staging_, len) != static_cast<int64_t>(len)) {
+		return false;
+	}
+
+	int64_t const end = pos + static_cast<int64_t>(staged_);
+	staged_ = 0;
+	return file_.seek(end, file::begin) == end && file_.truncate();
+}
+
 aio_result file_writer::preallocate(uint64_t size)
 {
 	scoped_lock l(mtx_);
-	if (error_ || !buffers_.empty() || finalizing_) {
+	if (error_ || !buffers_.empty() || !coalesced_.empty() || finalizing_) {
 		return aio_result::error;
 	}
 
@@ -291,7 +589,13 @@ aio_result file_writer::preallocate(uint64_t size)
 		return aio_result::error;
 	}
 
-	auto seek_offet = static_cast<int64_t>(oldPos + size);
+	// Prefer reserving the space without changing the size of the file
+	if (file_.allocate(static_cast<int64_t>(oldPos + staged_), static_cast<int64_t>(size))) {
+		preallocated_ = true;
+		return aio_result::ok;
+	}
+
+	auto seek_offet = static_cast<int64_t>(oldPos + staged_ + size);
 	if (file_.seek(seek_offet, file::begin) == seek_offet) {
 		if (!file_.truncate()) {
 			buffer_pool_.logger().log(logmsg::debug_warning, L"Could not preallocate the file");
@@ -317,10 +621,11 @@ bool file_writer::set_mtime(datetime const& t)
 	return file_.set_modification_time(t);
 }
 
-file_writer_factory::file_writer_factory(std::wstring const& file, thread_pool & tpool, file_writer_flags flags)
+file_writer_factory::file_writer_factory(std::wstring const& file, thread_pool & tpool, file_writer_flags flags, fsync_coordinator * coordinator)
 	: writer_factory(file)
 	, thread_pool_(tpool)
 	, flags_(flags)
+	, coordinator_(coordinator)
 {
 }
 
@@ -337,7 +642,12 @@ std::unique_ptr<writer_base> file_writer_factory::open(aio_buffer_pool & pool, u
 	else if (flags_ & file_writer_flags::permissions_current_user_and_admins_only) {
 		flags |= file::current_user_and_admins_only;
 	}
-	auto f = file(to_native(name()), file::writing, flags);
+	bool const direct = flags_ & file_writer_flags::direct;
+	if (direct) {
+		flags |= file::direct;
+	}
+	// In direct mode, partial blocks in front of the offset need to be read back
+	auto f = file(to_native(name()), (direct && offset) ? file::readwrite : file::writing, flags);
 	if (!f) {
 		return {};
 	}
@@ -355,7 +665,7 @@ std::unique_ptr<writer_base> file_writer_factory::open(aio_buffer_pool & pool, u
 		}
 	}
 
-	return std::make_unique<file_writer>(name(), pool, std::move(f), thread_pool_, flags_ & file_writer_flags::fsync, std::move(progress_cb), max_buffers);
+	return std::make_unique<file_writer>(name(), pool, std::move(f), thread_pool_, flags_ & file_writer_flags::fsync, std::move(progress_cb), max_buffers, flags_, coordinator_);
 }
 
 std::unique_ptr<writer_factory> file_writer_factory::clone() const
@@ -387,29 +697,53 @@ bool file_writer_factory::set_mtime(datetime const& t)
 
 buffer_writer::buffer_writer(buffer & buffer, std::wstring const& name, aio_buffer_pool & pool, size_t size_limit, progress_cb_t && progress_cb)
 	: writer_base(name, pool, std::move(progress_cb), 1)
-	, buffer_(buffer)
+	, buffer_(&buffer)
+	, size_limit_(size_limit)
+{
+}
+
+buffer_writer::buffer_writer(buffer_chain & chain, std::wstring const& name, aio_buffer_pool & pool, size_t size_limit, progress_cb_t && progress_cb)
+	: writer_base(name, pool, std::move(progress_cb), 1)
+	, chain_(&chain)
 	, size_limit_(size_limit)
 {
 }
 
+size_t buffer_writer::size() const
+{
+	return buffer_ ? buffer_->size() : chain_->size();
+}
+
 aio_result buffer_writer::preallocate(uint64_t size)
 {
-	if (size > size_limit_) {
+	scoped_lock l(mtx_);
+	size_t const current = this->size();
+	if (current > size_limit_ || size > size_limit_ - current) {
 		return aio_result::error;
 	}
 
-	buffer_.reserve(size);
+	// Chains never reallocate, nothing to do for them
+	if (buffer_) {
+		buffer_->reserve(current + static_cast<size_t>(size));
+	}
 
 	return aio_result::ok;
 }
 
 aio_result buffer_writer::do_add_buffer(scoped_lock &, buffer_lease && b)
 {
-	if (size_limit_ - buffer_.size() < b->size()) {
+	size_t const current = size();
+	if (current > size_limit_ || size_limit_ - current < b->size()) {
 		error_ = true;
 		return aio_result::error;
 	}
-	buffer_.append(b->get(), b->size());
+	if (buffer_) {
+		buffer_->append(b->get(), b->size());
+	}
+	else {
+		// The lease goes back to the pool, so the data gets copied into segments of the chain.
+		chain_->append(b->get(), b->size());
+	}
 	if (progress_cb_) {
 		progress_cb_(this, static_cast<uint64_t>(b->size()));
 	}
@@ -417,9 +751,17 @@ aio_result buffer_writer::do_add_buffer(scoped_lock &, buffer_lease && b)
 	return aio_result::ok;
 }
 
-buffer_writer_factory::buffer_writer_factory(buffer & b, std::wstring const& name, size_t size_limit)
+buffer_writer_factory::buffer_writer_factory(buffer & b, std::wstring const& name, size_t size_limit, uint64_t size_hint)
 	: writer_factory(name)
-	, buffer_(b)
+	, buffer_(&b)
+	, size_limit_(size_limit)
+	, size_hint_(size_hint)
+{
+}
+
+buffer_writer_factory::buffer_writer_factory(buffer_chain & c, std::wstring const& name, size_t size_limit)
+	: writer_factory(name)
+	, chain_(&c)
 	, size_limit_(size_limit)
 {
 }
@@ -429,12 +771,23 @@ std::unique_ptr<writer_base> buffer_writer_factory::open(aio_buffer_pool & pool,
 	if (offset) {
 		return {};
 	}
-	return std::make_unique<buffer_writer>(buffer_, name(), pool, size_limit_, std::move(progress_cb));
+	if (chain_) {
+		return std::make_unique<buffer_writer>(*chain_, name(), pool, size_limit_, std::move(progress_cb));
+	}
+
+	auto ret = std::make_unique<buffer_writer>(*buffer_, name(), pool, size_limit_, std::move(progress_cb));
+	if (size_hint_ != aio_base::nosize && size_hint_ <= size_limit_) {
+		ret->preallocate(size_hint_);
+	}
+	return ret;
 }
 
 std::unique_ptr<writer_factory> buffer_writer_factory::clone() const
 {
-	return std::make_unique<buffer_writer_factory>(buffer_, name(), size_limit_);
+	if (chain_) {
+		return std::make_unique<buffer_writer_factory>(*chain_, name(), size_limit_);
+	}
+	return std::make_unique<buffer_writer_factory>(*buffer_, name(), size_limit_, size_hint_);
 }
 
 }
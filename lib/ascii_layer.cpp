@@ -1,6 +1,69 @@
 #include "libfilezilla/ascii_layer.hpp"
 
+#include <string.h>
+
 namespace fz {
+
+namespace {
+// While corked, converted data is passed on once this much has accumulated
+size_t const cork_limit = 64 * 1024;
+
+// Both conversions search for the line endings using memchr, which scans many bytes at
+// once, and copy the runs in between in bulk. Data without line endings is left as-is.
+
+// Removes CRs followed by LF in place, stray CRs are kept. Returns the new size.
+size_t remove_crlf(uint8_t* data, size_t size)
+{
+	auto * const end = data + size;
+	auto * in = static_cast<uint8_t*>(memchr(data, '\r', size));
+	if (!in) {
+		return size;
+	}
+
+	auto * out = in;
+	while (in != end) {
+		// in points to a CR
+		if (in + 1 != end && in[1] == '\n') {
+			++in;
+		}
+		auto * next = static_cast<uint8_t*>(memchr(in + 1, '\r', end - in - 1));
+		if (!next) {
+			next = end;
+		}
+		memmove(out, in, next - in);
+		out += next - in;
+		in = next;
+	}
+
+	return out - data;
+}
+
+// Converts LFs not preceded by CR into CRLF. The output needs room for twice the input.
+uint8_t* add_crlf(uint8_t* out, uint8_t const* in, size_t size, bool & was_cr)
+{
+	auto const* const end = in + size;
+	while (in != end) {
+		auto const* lf = static_cast<uint8_t const*>(memchr(in, '\n', end - in));
+		if (!lf) {
+			memcpy(out, in, end - in);
+			out += end - in;
+			was_cr = end[-1] == '\r';
+			break;
+		}
+
+		size_t const run = lf - in;
+		memcpy(out, in, run);
+		out += run;
+		if (!(run ? lf[-1] == '\r' : was_cr)) {
+			*out++ = '\r';
+		}
+		*out++ = '\n';
+		was_cr = false;
+		in = lf + 1;
+	}
+	return out;
+}
+}
 ascii_layer::ascii_layer(event_loop& loop, event_handler* handler, socket_interface& next_layer)
 	: socket_layer{handler, next_layer, false}
 	, event_handler(loop)
@@ -83,25 +146,9 @@ repeat_read:
 
 	// Invariant: read > 0
 
-	auto end = begin + read;
+	read = static_cast<int>(remove_crlf(begin, static_cast<size_t>(read)));
 
-	// Use std algos to eliminate CRs followed by LF. Stray CRs are kept.
-
-	static constexpr uint8_t const crlf_begin[] = { '\r', '\n' };
-	static constexpr uint8_t const* const crlf_end = crlf_begin + 2;
-	int crlf_count{};
-
-	if (auto crlf_it1 = std::search(begin, end, crlf_begin, crlf_end); crlf_it1 != end) {
-		do {
-			auto crlf_it2 = std::search(crlf_it1 + 2, end, crlf_begin, crlf_end);
-			std::copy(crlf_it1 + 1, crlf_it2, crlf_it1 - crlf_count++);
-			crlf_it1 = crlf_it2;
-		} while (crlf_it1 != end);
-	}
-
-	read -= crlf_count;
-
-	// Invariant: read > 0, still, because crlf_count <= read/2
+	// Invariant: read > 0, still, as at most every second byte gets removed
 
 	if (begin[read - 1] == '\r') {
 		--read;
@@ -125,11 +172,49 @@ int ascii_layer::write(void const* buffer, unsigned int size, int& error)
 		return -1;
 	}
 
+	socket_const_iovec const v{buffer, size};
+	return writev(&v, 1, error);
+}
+
+int ascii_layer::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+	// Limit to what can be returned
+	size_t size{};
+	size_t n{};
+	for (; n < count; ++n) {
+		if (buffers[n].size > static_cast<size_t>(std::numeric_limits<int>::max()) - size) {
+			break;
+		}
+		size += buffers[n].size;
+	}
+	if (!size) {
+		error = EINVAL;
+		return -1;
+	}
+
 	if (write_blocked_by_send_buffer_) {
 		error = EAGAIN;
 		return -1;
 	}
 
+	if (corked_) {
+		auto * const start = buffer_.get(size * 2);
+		auto * out = start;
+		for (size_t i = 0; i < n; ++i) {
+			out = add_crlf(out, reinterpret_cast<uint8_t const*>(buffers[i].data), buffers[i].size, was_cr_);
+		}
+		buffer_.add(out - start);
+
+		if (buffer_.size() >= cork_limit) {
+			int res = flush_buffer();
+			if (res && res != EAGAIN) {
+				error = res;
+				return -1;
+			}
+		}
+		return static_cast<int>(size);
+	}
+
 	while (!buffer_.empty()) {
 		int written = next_layer_.write(buffer_.get(), buffer_.size(), error);
 		if (written <= 0) {
@@ -141,17 +226,40 @@ int ascii_layer::write(void const* buffer, unsigned int size, int& error)
 		buffer_.consume(written);
 	}
 
-	auto const* in = reinterpret_cast<uint8_t const*>(buffer);
-	auto const* end = in + size;
-	auto * out = buffer_.get(size * 2);
-	while (in != end) {
-		auto const ch = *in++;
-		if (ch == '\n' && was_cr_) {
-			*out++ = '\r';
+	bool has_lf{};
+	for (size_t i = 0; i < n && !has_lf; ++i) {
+		has_lf = buffers[i].size && memchr(buffers[i].data, '\n', buffers[i].size);
+	}
+	if (!has_lf) {
+		// Nothing to convert, pass the data on without copying
+		int written = next_layer_.writev(buffers, n, error);
+		if (written <= 0) {
+			if (written < 0 && error == EAGAIN) {
+				write_blocked_by_send_buffer_ = true;
+			}
+			return written;
 		}
-		was_cr_ = ch == '\r';
 
-		*out++ = ch;
+		// Remember whether the last byte written was a CR
+		size_t left = static_cast<size_t>(written);
+		for (size_t i = 0; i < n; ++i) {
+			if (buffers[i].size >= left) {
+				if (left) {
+					was_cr_ = reinterpret_cast<uint8_t const*>(buffers[i].data)[left - 1] == '\r';
+				}
+				break;
+			}
+			left -= buffers[i].size;
+			if (buffers[i].size) {
+				was_cr_ = reinterpret_cast<uint8_t const*>(buffers[i].data)[buffers[i].size - 1] == '\r';
+			}
+		}
+		return written;
+	}
+
+	auto * out = buffer_.get(size * 2);
+	for (size_t i = 0; i < n; ++i) {
+		out = add_crlf(out, reinterpret_cast<uint8_t const*>(buffers[i].data), buffers[i].size, was_cr_);
 	}
 	buffer_.add(out - buffer_.get());
 
@@ -160,14 +268,54 @@ int ascii_layer::write(void const* buffer, unsigned int size, int& error)
 		if (written <= 0) {
 			if (error == EAGAIN) {
 				write_blocked_by_send_buffer_ = true;
-				return size;
+				return static_cast<int>(size);
 			}
 			return -1;
 		}
 		buffer_.consume(written);
 	}
 
-	return size;
+	return static_cast<int>(size);
+}
+
+int ascii_layer::flush_buffer()
+{
+	while (!buffer_.empty()) {
+		int error;
+		int written = next_layer_.write(buffer_.get(), buffer_.size(), error);
+		if (written <= 0) {
+			if (!written) {
+				return ECONNABORTED;
+			}
+			if (error == EAGAIN) {
+				write_blocked_by_send_buffer_ = true;
+			}
+			return error;
+		}
+		buffer_.consume(written);
+	}
+	return 0;
+}
+
+void ascii_layer::cork()
+{
+	corked_ = true;
+	next_layer_.cork();
+}
+
+int ascii_layer::uncork()
+{
+	if (corked_) {
+		corked_ = false;
+		if (!write_blocked_by_send_buffer_) {
+			// If blocked, the rest follows on the next write event
+			int res = flush_buffer();
+			if (res && res != EAGAIN) {
+				return res;
+			}
+		}
+	}
+	return next_layer_.uncork();
 }
 
 int ascii_layer::shutdown()
@@ -203,9 +351,7 @@ void ascii_layer::operator()(event_base const& ev)
 void ascii_layer::on_socket_event(socket_event_source*, socket_event_flag t, int error)
 {
 	if (error) {
-		if (event_handler_) {
-			event_handler_->send_event<fz::socket_event>(this, t, error);
-		}
+		signal_socket_event(*this, t, error);
 		return;
 	}
 
@@ -214,8 +360,8 @@ void ascii_layer::on_socket_event(socket_event_source*, socket_event_flag t, int
 			int error;
 			int written = next_layer_.write(buffer_.get(), buffer_.size(), error);
 			if (written <= 0) {
-				if (error != EAGAIN && event_handler_) {
-					event_handler_->send_event<fz::socket_event>(this, socket_event_flag::write, error);
+				if (error != EAGAIN) {
+					signal_socket_event(*this, socket_event_flag::write, error);
 				}
 				return;
 			}
@@ -223,14 +369,14 @@ void ascii_layer::on_socket_event(socket_event_source*, socket_event_flag t, int
 		}
 		if (write_blocked_by_send_buffer_) {
 			write_blocked_by_send_buffer_ = false;
-			event_handler_->send_event<fz::socket_event>(this, socket_event_flag::write, 0);
+			signal_socket_event(*this, socket_event_flag::write, 0);
 		}
 	}
 	else {
 		if (t == socket_event_flag::read) {
 			waiting_read_ = false;
 		}
-		event_handler_->send_event<fz::socket_event>(this, t, 0);
+		signal_socket_event(*this, t, 0);
 	}
 }
 
@@ -251,4 +397,18 @@ void ascii_layer::set_event_handler(event_handler* handler, fz::socket_event_fla
 		}
 	}
 }
+
+void ascii_layer::get_memory_usage(std::vector<socket_memory_usage> & usage) const
+{
+	usage.push_back({"ascii_layer", sizeof(ascii_layer), buffer_.heap_size()});
+	next_layer_.get_memory_usage(usage);
+}
+
+void ascii_layer::hibernate()
+{
+	if (buffer_.empty()) {
+		buffer_.shrink_to_fit();
+	}
+	next_layer_.hibernate();
+}
 }
@@ -0,0 +1,282 @@
+#include "libfilezilla/async_logger.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#include <atomic>
+
+namespace fz {
+
+// Bounded multi-producer single-consumer queue after Dmitry Vyukov's bounded MPMC queue.
+// Each cell has a sequence number telling whether it is free for the producer claiming
+// position pos (seq == pos) or holds the message at position pos (seq == pos + 1).
+class async_logger::impl final
+{
+public:
+	impl(logger_interface & target, thread_pool & pool, size_t capacity, overflow_policy policy);
+	~impl();
+
+	bool push(logmsg::type t, std::wstring & msg, deferred_log_message & deferred);
+	void log(logmsg::type t, std::wstring && msg, deferred_log_message && deferred);
+	void entry();
+
+	// Passes queued messages to the target, returns whether there were any
+	bool drain();
+
+	void wake_consumer();
+
+	struct cell final
+	{
+		std::atomic<size_t> seq_;
+		logmsg::type type_{};
+
+		// Only one of the two is set
+		std::wstring msg_;
+		deferred_log_message deferred_;
+	};
+
+	logger_interface & target_;
+	overflow_policy const policy_;
+
+	size_t const mask_;
+	std::unique_ptr<cell[]> cells_;
+
+	alignas(64) std::atomic<size_t> enqueue_pos_{};
+
+	// Only touched by the consumer
+	alignas(64) size_t dequeue_pos_{};
+	uint64_t reported_{};
+
+	// Number of messages passed to the target, for flush
+	std::atomic<size_t> done_{};
+
+	std::atomic<uint64_t> dropped_{};
+
+	// The consumer only sleeps if it has announced it here
+	std::atomic<bool> sleeping_{};
+	std::atomic<size_t> blocked_{};
+	std::atomic<size_t> flushing_{};
+
+	mutex mtx_{false};
+	condition work_;
+	condition space_;
+	condition flushed_;
+	bool quit_{};
+
+	async_task task_;
+};
+
+namespace {
+size_t round_capacity(size_t capacity)
+{
+	size_t ret = 2;
+	while (ret < capacity && ret < (size_t(1) << (sizeof(size_t) * 8 - 2))) {
+		ret <<= 1;
+	}
+	return ret;
+}
+}
+
+async_logger::impl::impl(logger_interface & target, thread_pool & pool, size_t capacity, overflow_policy policy)
+	: target_(target)
+	, policy_(policy)
+	, mask_(round_capacity(capacity) - 1)
+	, cells_(new cell[mask_ + 1])
+{
+	for (size_t i = 0; i <= mask_; ++i) {
+		cells_[i].seq_.store(i, std::memory_order_relaxed);
+	}
+	task_ = pool.spawn([this]{ entry(); });
+}
+
+async_logger::impl::~impl()
+{
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		work_.signal(l);
+	}
+	task_.join();
+}
+
+bool async_logger::impl::push(logmsg::type t, std::wstring & msg, deferred_log_message & deferred)
+{
+	size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+	cell * c;
+	for (;;) {
+		c = &cells_[pos & mask_];
+		size_t const seq = c->seq_.load(std::memory_order_acquire);
+		auto const diff = static_cast<std::make_signed_t<size_t>>(seq - pos);
+		if (!diff) {
+			if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			// Full
+			return false;
+		}
+		else {
+			pos = enqueue_pos_.load(std::memory_order_relaxed);
+		}
+	}
+
+	c->type_ = t;
+	c->msg_ = std::move(msg);
+	c->deferred_ = std::move(deferred);
+	c->seq_.store(pos + 1, std::memory_order_release);
+
+	wake_consumer();
+	return true;
+}
+
+void async_logger::impl::wake_consumer()
+{
+	// Pairs with the fence in entry, either the consumer sees the message or we see it sleeping
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping_.load(std::memory_order_relaxed)) {
+		scoped_lock l(mtx_);
+		work_.signal(l);
+	}
+}
+
+bool async_logger::impl::drain()
+{
+	bool any{};
+	for (;;) {
+		cell & c = cells_[dequeue_pos_ & mask_];
+		if (c.seq_.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+			break;
+		}
+
+		auto const t = c.type_;
+		std::wstring msg = std::move(c.msg_);
+		c.msg_ = std::wstring();
+		deferred_log_message deferred = std::move(c.deferred_);
+		c.seq_.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+		++dequeue_pos_;
+		any = true;
+
+		if (blocked_.load(std::memory_order_relaxed)) {
+			scoped_lock l(mtx_);
+			space_.signal(l);
+		}
+
+		if (deferred) {
+			target_.do_log_deferred(t, std::move(deferred));
+		}
+		else {
+			target_.do_log(t, std::move(msg));
+		}
+		done_.store(dequeue_pos_, std::memory_order_release);
+	}
+
+	if (policy_ == overflow_policy::count) {
+		uint64_t const dropped = dropped_.load(std::memory_order_relaxed);
+		if (dropped != reported_) {
+			target_.do_log(logmsg::debug_warning, fz::sprintf(L"%u log messages have been dropped", dropped - reported_));
+			reported_ = dropped;
+		}
+	}
+
+	if (any && flushing_.load(std::memory_order_relaxed)) {
+		scoped_lock l(mtx_);
+		flushed_.signal(l);
+	}
+
+	return any;
+}
+
+void async_logger::impl::entry()
+{
+	scoped_lock l(mtx_);
+	while (true) {
+		l.unlock();
+		while (drain()) {
+		}
+		l.lock();
+
+		if (quit_) {
+			break;
+		}
+
+		sleeping_.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (cells_[dequeue_pos_ & mask_].seq_.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+			work_.wait(l);
+		}
+		sleeping_.store(false, std::memory_order_relaxed);
+	}
+	l.unlock();
+	drain();
+}
+
+void async_logger::impl::log(logmsg::type t, std::wstring && msg, deferred_log_message && deferred)
+{
+	if (!task_) {
+		// Could not spawn the thread, nothing would drain the queue
+		if (deferred) {
+			target_.do_log_deferred(t, std::move(deferred));
+		}
+		else {
+			target_.do_log(t, std::move(msg));
+		}
+		return;
+	}
+
+	if (push(t, msg, deferred)) {
+		return;
+	}
+
+	if (policy_ != overflow_policy::block) {
+		++dropped_;
+		wake_consumer();
+		return;
+	}
+
+	++blocked_;
+	while (!push(t, msg, deferred)) {
+		scoped_lock l(mtx_);
+		// Timed, a signal may have gone to another blocked thread
+		space_.wait(l, duration::from_milliseconds(1));
+	}
+	--blocked_;
+}
+
+async_logger::async_logger(logger_interface & target, thread_pool & pool, size_t capacity, overflow_policy policy)
+	: impl_(std::make_unique<impl>(target, pool, capacity, policy))
+{
+	deferred_formatting_ = true;
+}
+
+async_logger::~async_logger()
+{
+}
+
+void async_logger::do_log(logmsg::type t, std::wstring && msg)
+{
+	impl_->log(t, std::move(msg), deferred_log_message());
+}
+
+void async_logger::do_log_deferred(logmsg::type t, deferred_log_message && msg)
+{
+	impl_->log(t, std::wstring(), std::move(msg));
+}
+
+void async_logger::flush()
+{
+	size_t const target = impl_->enqueue_pos_.load(std::memory_order_acquire);
+
+	++impl_->flushing_;
+	while (static_cast<std::make_signed_t<size_t>>(impl_->done_.load(std::memory_order_acquire) - target) < 0) {
+		scoped_lock l(impl_->mtx_);
+		impl_->flushed_.wait(l, duration::from_milliseconds(10));
+	}
+	--impl_->flushing_;
+}
+
+uint64_t async_logger::dropped() const
+{
+	return impl_->dropped_.load(std::memory_order_relaxed);
+}
+
+}
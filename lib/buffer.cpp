@@ -13,27 +13,95 @@ buffer::buffer(size_t capacity)
 	reserve(capacity);
 }
 
+buffer::buffer(size_t capacity, buffer_allocator & allocator)
+	: allocator_(&allocator)
+{
+	reserve(capacity);
+}
+
+buffer::buffer(unsigned char* data, size_t capacity, size_t offset, size_t size, buffer_allocator & allocator)
+	: data_(data)
+	, pos_(data + offset)
+	, size_(size)
+	, capacity_(capacity)
+	, allocator_(&allocator)
+{
+	if (!data || offset > capacity || size > capacity - offset) {
+		std::abort();
+	}
+}
+
 buffer::buffer(buffer const& buf)
 {
 	if (buf.size_) {
-		data_ = new unsigned char[buf.capacity_];
+		if (buf.size_ > inline_capacity) {
+			capacity_ = buf.capacity_;
+			data_ = allocate(capacity_);
+			pos_ = data_;
+		}
 		memcpy(data_, buf.pos_, buf.size_);
 		size_ = buf.size_;
-		capacity_ = buf.capacity_;
-		pos_ = data_;
 	}
 }
 
 buffer::buffer(buffer && buf) noexcept
 {
-	data_ = buf.data_;
-	buf.data_ = nullptr;
-	pos_ = buf.pos_;
-	buf.pos_ = nullptr;
+	steal(buf);
+}
+
+void buffer::steal(buffer & buf) noexcept
+{
+	if (buf.is_inline()) {
+		// Nothing to take over, copy the few bytes instead
+		if (buf.size_) {
+			memcpy(inline_, buf.pos_, buf.size_);
+		}
+		data_ = inline_;
+		pos_ = inline_;
+		capacity_ = inline_capacity;
+	}
+	else {
+		data_ = buf.data_;
+		pos_ = buf.pos_;
+		capacity_ = buf.capacity_;
+	}
 	size_ = buf.size_;
+	allocator_ = buf.allocator_;
+
+	buf.data_ = buf.inline_;
+	buf.pos_ = buf.inline_;
 	buf.size_ = 0;
-	capacity_ = buf.capacity_;
-	buf.capacity_ = 0;
+	buf.capacity_ = inline_capacity;
+}
+
+unsigned char* buffer::allocate(size_t & cap)
+{
+	if (allocator_) {
+		return allocator_->allocate(cap);
+	}
+	return new unsigned char[cap];
+}
+
+void buffer::deallocate(unsigned char* p, size_t cap) noexcept
+{
+	if (allocator_) {
+		allocator_->deallocate(p, cap);
+	}
+	else {
+		delete[] p;
+	}
+}
+
+void buffer::reallocate(size_t cap)
+{
+	unsigned char* d = allocate(cap);
+	if (size_) {
+		memcpy(d, pos_, size_);
+	}
+	release();
+	capacity_ = cap;
+	data_ = d;
+	pos_ = d;
 }
 
 unsigned char* buffer::get(size_t write_size)
@@ -47,15 +115,7 @@ unsigned char* buffer::get(size_t write_size)
 			if (std::numeric_limits<size_t>::max() - capacity_ < write_size) {
 				std::abort();
 			}
-			size_t const cap = std::max({ size_t(1024), capacity_ * 2, capacity_ + write_size });
-			unsigned char* d = new unsigned char[cap];
-			if (size_) {
-				memcpy(d, pos_, size_);
-			}
-			delete[] data_;
-			capacity_ = cap;
-			data_ = d;
-			pos_ = d;
+			reallocate(std::max({ size_t(1024), capacity_ * 2, capacity_ + write_size }));
 		}
 	}
 	return pos_ + size_;
@@ -64,15 +124,17 @@ unsigned char* buffer::get(size_t write_size)
 buffer& buffer::operator=(buffer const& buf)
 {
 	if (this != &buf) {
-		unsigned char* d{};
+		if (buf.size_ > capacity_) {
+			size_t cap = buf.capacity_;
+			unsigned char* d = allocate(cap);
+			release();
+			data_ = d;
+			capacity_ = cap;
+		}
 		if (buf.size_) {
-			d = new unsigned char[buf.capacity_];
-			memcpy(d, buf.pos_, buf.size_);
+			memcpy(data_, buf.pos_, buf.size_);
 		}
-		delete[] data_;
-		data_ = d;
 		size_ = buf.size_;
-		capacity_ = buf.capacity_;
 		pos_ = data_;
 	}
 
@@ -82,15 +144,8 @@ buffer& buffer::operator=(buffer const& buf)
 buffer& buffer::operator=(buffer && buf) noexcept
 {
 	if (this != &buf) {
-		delete[] data_;
-		data_ = buf.data_;
-		buf.data_ = nullptr;
-		pos_ = buf.pos_;
-		buf.pos_ = nullptr;
-		size_ = buf.size_;
-		buf.size_ = 0;
-		capacity_ = buf.capacity_;
-		buf.capacity_ = 0;
+		release();
+		steal(buf);
 	}
 
 	return *this;
@@ -132,6 +187,7 @@ void buffer::append(unsigned char const* data, size_t len)
 	// Do the same initially as buffer::get would do, but don't delete the old pointer
 	// until after appending in case of append from own memory
 	unsigned char* old{};
+	size_t old_capacity{};
 	if (capacity_ - (pos_ - data_) - size_ < len) {
 		if (capacity_ - size_ >= len) {
 			// Also offset data in case of self-assignment
@@ -146,12 +202,15 @@ void buffer::append(unsigned char const* data, size_t len)
 			if (std::numeric_limits<size_t>::max() - capacity_ < len) {
 				std::abort();
 			}
-			size_t const cap = std::max({ size_t(1024), capacity_ * 2, capacity_ + len });
-			unsigned char* d = new unsigned char[cap];
+			size_t cap = std::max({ size_t(1024), capacity_ * 2, capacity_ + len });
+			unsigned char* d = allocate(cap);
 			if (size_) {
 				memcpy(d, pos_, size_);
 			}
-			old = data_;
+			if (!is_inline()) {
+				old = data_;
+				old_capacity = capacity_;
+			}
 			capacity_ = cap;
 			data_ = d;
 			pos_ = d;
@@ -163,7 +222,9 @@ void buffer::append(unsigned char const* data, size_t len)
 		size_ += len;
 	}
 
-	delete [] old;
+	if (old) {
+		deallocate(old, old_capacity);
+	}
 }
 
 void buffer::append(std::string_view const& str)
@@ -198,15 +259,27 @@ void buffer::reserve(size_t capacity)
 		return;
 	}
 
-	size_t const cap = std::max(size_t(1024), capacity);
-	unsigned char* d = new unsigned char[cap];
-	if (size_) {
-		memcpy(d, pos_, size_);
+	reallocate(std::max(size_t(1024), capacity));
+}
+
+void buffer::shrink_to_fit()
+{
+	if (is_inline()) {
+		return;
+	}
+
+	if (size_ <= inline_capacity) {
+		if (size_) {
+			memcpy(inline_, pos_, size_);
+		}
+		release();
+		data_ = inline_;
+		pos_ = inline_;
+		capacity_ = inline_capacity;
+	}
+	else if (capacity_ > size_) {
+		reallocate(size_);
 	}
-	delete[] data_;
-	data_ = d;
-	capacity_ = cap;
-	pos_ = data_;
 }
 
 void buffer::resize(size_t size)
@@ -0,0 +1,256 @@
+#include "libfilezilla/buffer_chain.hpp"
+#include "libfilezilla/nonowning_buffer.hpp"
+#include "libfilezilla/socket.hpp"
+
+#include <limits>
+
+#include <string.h>
+
+namespace fz {
+
+namespace {
+// Small buffers are copied instead of adopted, saving an allocation
+size_t const adopt_threshold = 512;
+
+size_t const max_write_iovecs = 64;
+}
+
+buffer_chain::buffer_chain(buffer_chain && c) noexcept
+	: views_(std::move(c.views_))
+	, size_(c.size_)
+{
+	c.views_.clear();
+	c.size_ = 0;
+}
+
+buffer_chain& buffer_chain::operator=(buffer_chain && c) noexcept
+{
+	if (this != &c) {
+		views_ = std::move(c.views_);
+		size_ = c.size_;
+		c.views_.clear();
+		c.size_ = 0;
+	}
+	return *this;
+}
+
+void buffer_chain::append(unsigned char const* data, size_t len)
+{
+	while (len) {
+		if (!views_.empty()) {
+			auto & v = views_.back();
+			auto & segment = *v.segment_;
+			if (v.owned_ && v.segment_.use_count() == 1 && v.offset_ + v.size_ == segment.size()) {
+				size_t const n = std::min(len, segment.capacity() - segment.size());
+				if (n) {
+					segment.append(data, n);
+					v.size_ += n;
+					size_ += n;
+					data += n;
+					len -= n;
+					continue;
+				}
+			}
+		}
+
+		view v;
+		v.segment_ = std::make_shared<buffer>(segment_size);
+		v.owned_ = true;
+		views_.emplace_back(std::move(v));
+	}
+}
+
+void buffer_chain::append(std::string_view const& str)
+{
+	append(reinterpret_cast<unsigned char const*>(str.data()), str.size());
+}
+
+void buffer_chain::append(buffer && b)
+{
+	if (b.size() <= adopt_threshold) {
+		append(b.get(), b.size());
+		b.clear();
+		return;
+	}
+
+	view v;
+	v.size_ = b.size();
+	v.segment_ = std::make_shared<buffer>(std::move(b));
+	size_ += v.size_;
+	views_.emplace_back(std::move(v));
+}
+
+void buffer_chain::append(buffer_chain && c)
+{
+	if (&c == this) {
+		append(static_cast<buffer_chain const&>(c));
+		return;
+	}
+	if (views_.empty()) {
+		*this = std::move(c);
+		return;
+	}
+
+	for (auto & v : c.views_) {
+		views_.emplace_back(std::move(v));
+	}
+	size_ += c.size_;
+	c.clear();
+}
+
+void buffer_chain::append(buffer_chain const& c)
+{
+	size_t const n = c.views_.size();
+	for (size_t i = 0; i < n; ++i) {
+		views_.push_back(c.views_[i]);
+	}
+	size_ += c.size_;
+}
+
+buffer_chain buffer_chain::slice(size_t offset, size_t len) const
+{
+	buffer_chain ret;
+	for (auto const& v : views_) {
+		if (!len) {
+			break;
+		}
+		if (offset >= v.size_) {
+			offset -= v.size_;
+			continue;
+		}
+
+		view s = v;
+		s.offset_ += offset;
+		s.size_ = std::min(v.size_ - offset, len);
+		offset = 0;
+
+		len -= s.size_;
+		ret.size_ += s.size_;
+		ret.views_.emplace_back(std::move(s));
+	}
+	return ret;
+}
+
+buffer_chain buffer_chain::split(size_t n)
+{
+	buffer_chain ret;
+	while (n && !views_.empty()) {
+		auto & v = views_.front();
+		if (v.size_ <= n) {
+			n -= v.size_;
+			size_ -= v.size_;
+			ret.size_ += v.size_;
+			ret.views_.emplace_back(std::move(v));
+			views_.pop_front();
+		}
+		else {
+			view s = v;
+			s.size_ = n;
+			v.offset_ += n;
+			v.size_ -= n;
+			size_ -= n;
+			ret.size_ += n;
+			ret.views_.emplace_back(std::move(s));
+			n = 0;
+		}
+	}
+	return ret;
+}
+
+void buffer_chain::consume(size_t consumed)
+{
+	size_ -= consumed;
+	while (consumed) {
+		auto & v = views_.front();
+		if (v.size_ > consumed) {
+			v.offset_ += consumed;
+			v.size_ -= consumed;
+			break;
+		}
+		consumed -= v.size_;
+		views_.pop_front();
+	}
+}
+
+void buffer_chain::clear()
+{
+	views_.clear();
+	size_ = 0;
+}
+
+size_t buffer_chain::get_iovecs(socket_const_iovec * iovecs, size_t max) const
+{
+	size_t n{};
+	for (auto const& v : views_) {
+		if (n >= max) {
+			break;
+		}
+
+		iovecs[n].data = v.segment_->get() + v.offset_;
+		if (v.size_ > std::numeric_limits<unsigned int>::max()) {
+			iovecs[n++].size = std::numeric_limits<unsigned int>::max();
+			break;
+		}
+		iovecs[n++].size = static_cast<unsigned int>(v.size_);
+	}
+	return n;
+}
+
+size_t buffer_chain::copy_to(unsigned char* out, size_t len, size_t offset) const
+{
+	size_t copied{};
+	for (auto const& v : views_) {
+		if (copied >= len) {
+			break;
+		}
+		if (offset >= v.size_) {
+			offset -= v.size_;
+			continue;
+		}
+
+		size_t const n = std::min(v.size_ - offset, len - copied);
+		memcpy(out + copied, v.segment_->get() + v.offset_ + offset, n);
+		copied += n;
+		offset = 0;
+	}
+	return copied;
+}
+
+int buffer_chain::write_to(socket_interface & s, int & error)
+{
+	socket_const_iovec iovecs[max_write_iovecs];
+	size_t const n = get_iovecs(iovecs, max_write_iovecs);
+	if (!n) {
+		error = 0;
+		return 0;
+	}
+
+	int res = s.writev(iovecs, n, error);
+	if (res > 0) {
+		consume(static_cast<size_t>(res));
+	}
+	return res;
+}
+
+size_t buffer_chain::consume_into(nonowning_buffer & b)
+{
+	size_t const room = std::min(b.capacity() - b.size(), size_);
+	if (!room) {
+		return 0;
+	}
+
+	size_t const n = copy_to(b.get(room), room);
+	b.add(n);
+	consume(n);
+	return n;
+}
+
+buffer buffer_chain::flatten() const
+{
+	buffer ret(size_);
+	copy_to(ret.get(size_), size_);
+	ret.add(size_);
+	return ret;
+}
+
+}
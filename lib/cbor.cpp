@@ -0,0 +1,607 @@
+#include "libfilezilla/buffer.hpp"
+#include "libfilezilla/encode.hpp"
+#include "libfilezilla/json.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <limits>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace fz {
+
+namespace {
+unsigned char const major_unsigned = 0;
+unsigned char const major_negative = 1;
+unsigned char const major_bytes = 2;
+unsigned char const major_text = 3;
+unsigned char const major_array = 4;
+unsigned char const major_map = 5;
+unsigned char const major_tag = 6;
+unsigned char const major_simple = 7;
+
+unsigned char const info_indefinite = 31;
+unsigned char const break_code = 0xff;
+
+void append_head(buffer & out, unsigned char major, uint64_t v)
+{
+	unsigned char* p = out.get(9);
+	size_t n{};
+	if (v < 24) {
+		p[0] = static_cast<unsigned char>((major << 5) | v);
+		out.add(1);
+		return;
+	}
+	else if (v <= 0xff) {
+		p[0] = static_cast<unsigned char>((major << 5) | 24);
+		n = 1;
+	}
+	else if (v <= 0xffff) {
+		p[0] = static_cast<unsigned char>((major << 5) | 25);
+		n = 2;
+	}
+	else if (v <= 0xffffffff) {
+		p[0] = static_cast<unsigned char>((major << 5) | 26);
+		n = 4;
+	}
+	else {
+		p[0] = static_cast<unsigned char>((major << 5) | 27);
+		n = 8;
+	}
+	for (size_t i = n; i > 0; --i) {
+		p[i] = static_cast<unsigned char>(v);
+		v >>= 8;
+	}
+	out.add(n + 1);
+}
+
+void append_string(buffer & out, unsigned char major, std::string_view const& s)
+{
+	append_head(out, major, s.size());
+	out.append(s);
+}
+
+void append_number(buffer & out, std::string_view const& text, double d)
+{
+	// Integers keep their exact value if they fit
+	bool const negative = !text.empty() && text[0] == '-';
+	auto const digits = text.substr(negative ? 1 : 0);
+	uint64_t v{};
+	auto const r = std::from_chars(digits.data(), digits.data() + digits.size(), v);
+	if (!digits.empty() && r.ec == std::errc() && r.ptr == digits.data() + digits.size()) {
+		if (!negative || !v) {
+			append_head(out, major_unsigned, v);
+		}
+		else {
+			append_head(out, major_negative, v - 1);
+		}
+		return;
+	}
+
+	if (std::isnan(d) || std::isinf(d) || (std::fabs(d) <= std::numeric_limits<float>::max() && static_cast<double>(static_cast<float>(d)) == d)) {
+		float const f = static_cast<float>(d);
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		unsigned char* p = out.get(5);
+		p[0] = (major_simple << 5) | 26;
+		for (size_t i = 4; i > 0; --i) {
+			p[i] = static_cast<unsigned char>(bits);
+			bits >>= 8;
+		}
+		out.add(5);
+	}
+	else {
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(bits));
+		unsigned char* p = out.get(9);
+		p[0] = (major_simple << 5) | 27;
+		for (size_t i = 8; i > 0; --i) {
+			p[i] = static_cast<unsigned char>(bits);
+			bits >>= 8;
+		}
+		out.add(9);
+	}
+}
+
+// Reads the initial byte and the argument of a data item. For indefinite lengths, arg is zero.
+bool read_head(unsigned char const*& p, unsigned char const* end, unsigned char & major, unsigned char & info, uint64_t & arg)
+{
+	if (p == end) {
+		return false;
+	}
+	major = *p >> 5;
+	info = *p & 0x1f;
+	++p;
+
+	arg = 0;
+	if (info < 24) {
+		arg = info;
+	}
+	else if (info <= 27) {
+		size_t const n = size_t(1) << (info - 24);
+		if (static_cast<size_t>(end - p) < n) {
+			return false;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			arg = (arg << 8) | *p++;
+		}
+		if (major == major_simple && info == 24 && arg < 32) {
+			// Not well-formed, these simple values need to be encoded in the initial byte
+			return false;
+		}
+	}
+	else if (info != info_indefinite || major < major_bytes || major == major_tag) {
+		return false;
+	}
+	return true;
+}
+
+bool read_string(unsigned char const*& p, unsigned char const* end, unsigned char major, unsigned char info, uint64_t arg, std::string & out)
+{
+	if (info != info_indefinite) {
+		if (static_cast<uint64_t>(end - p) < arg) {
+			return false;
+		}
+		out.append(reinterpret_cast<char const*>(p), static_cast<size_t>(arg));
+		p += arg;
+		return true;
+	}
+
+	// Concatenation of definite-length chunks of the same type
+	while (true) {
+		if (p == end) {
+			return false;
+		}
+		if (*p == break_code) {
+			++p;
+			return true;
+		}
+		unsigned char chunk_major{};
+		unsigned char chunk_info{};
+		if (!read_head(p, end, chunk_major, chunk_info, arg) || chunk_major != major || chunk_info == info_indefinite) {
+			return false;
+		}
+		if (static_cast<uint64_t>(end - p) < arg) {
+			return false;
+		}
+		out.append(reinterpret_cast<char const*>(p), static_cast<size_t>(arg));
+		p += arg;
+	}
+}
+
+// Reads a map key, which must be a text string. Tags are skipped.
+bool read_key(unsigned char const*& p, unsigned char const* end, std::string & out)
+{
+	unsigned char major{};
+	unsigned char info{};
+	uint64_t arg{};
+	do {
+		if (!read_head(p, end, major, info, arg)) {
+			return false;
+		}
+	} while (major == major_tag);
+
+	return major == major_text && read_string(p, end, major, info, arg, out);
+}
+
+double half_to_double(uint16_t h)
+{
+	int const exp = (h >> 10) & 0x1f;
+	int const mant = h & 0x3ff;
+	double v;
+	if (!exp) {
+		v = std::ldexp(mant, -24);
+	}
+	else if (exp != 31) {
+		v = std::ldexp(mant + 1024, exp - 25);
+	}
+	else {
+		v = mant ? std::numeric_limits<double>::quiet_NaN() : std::numeric_limits<double>::infinity();
+	}
+	return (h & 0x8000) ? -v : v;
+}
+
+std::string double_to_text(double d)
+{
+	char buf[32];
+#if defined(__cpp_lib_to_chars)
+	// Shortest representation that round-trips, locale-independent
+	auto const r = std::to_chars(buf, buf + sizeof(buf), d);
+	if (r.ec == std::errc()) {
+		return std::string(buf, r.ptr);
+	}
+#endif
+	int const n = snprintf(buf, sizeof(buf), "%.17g", d);
+	if (n <= 0 || static_cast<size_t>(n) >= sizeof(buf)) {
+		return "0";
+	}
+	std::string ret(buf, static_cast<size_t>(n));
+	for (auto & c : ret) {
+		if ((c < '0' || c > '9') && c != '-' && c != '+' && c != 'e') {
+			// The locale's radix character
+			c = '.';
+		}
+	}
+	return ret;
+}
+}
+
+void json::to_cbor(buffer & out) const
+{
+	switch (type()) {
+	case json_type::object: {
+		auto const& children = *std::get_if<std::size_t(json_type::object)>(&value_);
+		size_t n{};
+		for (auto const& c : children) {
+			if (c.second) {
+				++n;
+			}
+		}
+		append_head(out, major_map, n);
+		for (auto const& c : children) {
+			if (c.second) {
+				append_string(out, major_text, c.first);
+				c.second.to_cbor(out);
+			}
+		}
+		break;
+	}
+	case json_type::array: {
+		auto const& children = *std::get_if<std::size_t(json_type::array)>(&value_);
+		append_head(out, major_array, children.size());
+		for (auto const& c : children) {
+			if (!c) {
+				out.append(static_cast<unsigned char>((major_simple << 5) | 22));
+			}
+			else {
+				c.to_cbor(out);
+			}
+		}
+		break;
+	}
+	case json_type::boolean:
+		out.append(static_cast<unsigned char>((major_simple << 5) | (*std::get_if<std::size_t(json_type::boolean)>(&value_) ? 21 : 20)));
+		break;
+	case json_type::number: {
+		auto const& v = *std::get_if<std::size_t(json_type::number)>(&value_);
+		append_number(out, v.text_, v.double_);
+		break;
+	}
+	case json_type::null:
+		out.append(static_cast<unsigned char>((major_simple << 5) | 22));
+		break;
+	case json_type::string:
+		append_string(out, major_text, *std::get_if<std::size_t(json_type::string)>(&value_));
+		break;
+	case json_type::none:
+		break;
+	}
+}
+
+json json::parse_cbor(std::string_view const& v, size_t max_depth)
+{
+	auto p = reinterpret_cast<unsigned char const*>(v.data());
+	auto const end = p + v.size();
+	auto j = parse_cbor(p, end, max_depth);
+	if (p != end) {
+		return {};
+	}
+	return j;
+}
+
+json json::parse_cbor(buffer const& b, size_t max_depth)
+{
+	return parse_cbor(b.to_view(), max_depth);
+}
+
+json json::parse_cbor(unsigned char const*& p, unsigned char const* end, size_t max_depth)
+{
+	unsigned char major{};
+	unsigned char info{};
+	uint64_t arg{};
+	do {
+		if (!read_head(p, end, major, info, arg)) {
+			return {};
+		}
+	} while (major == major_tag);
+
+	json j;
+	switch (major) {
+	case major_unsigned: {
+		auto & n = j.value_.emplace<std::size_t(json_type::number)>();
+		n.text_ = fz::to_string(arg);
+		n.integer_ = arg;
+		n.double_ = static_cast<double>(arg);
+		break;
+	}
+	case major_negative: {
+		// The value is -1 - arg
+		auto & n = j.value_.emplace<std::size_t(json_type::number)>();
+		if (arg <= static_cast<uint64_t>(std::numeric_limits<int64_t>::max())) {
+			n.text_ = fz::to_string(-1 - static_cast<int64_t>(arg));
+		}
+		else if (arg == std::numeric_limits<uint64_t>::max()) {
+			n.text_ = "-18446744073709551616";
+		}
+		else {
+			n.text_ = "-" + fz::to_string(arg + 1);
+		}
+		n.integer_ = ~arg;
+		n.double_ = -1.0 - static_cast<double>(arg);
+		break;
+	}
+	case major_bytes: {
+		std::string s;
+		if (!read_string(p, end, major, info, arg, s)) {
+			return {};
+		}
+		j.value_.emplace<std::size_t(json_type::string)>(base64_encode(s, base64_type::url, false));
+		break;
+	}
+	case major_text: {
+		auto & s = j.value_.emplace<std::size_t(json_type::string)>();
+		if (!read_string(p, end, major, info, arg, s)) {
+			return {};
+		}
+		break;
+	}
+	case major_array: {
+		if (!max_depth) {
+			return {};
+		}
+		auto & children = j.value_.emplace<std::size_t(json_type::array)>();
+		if (info == info_indefinite) {
+			while (true) {
+				if (p == end) {
+					return {};
+				}
+				if (*p == break_code) {
+					++p;
+					break;
+				}
+				auto c = parse_cbor(p, end, max_depth - 1);
+				if (!c) {
+					return {};
+				}
+				children.emplace_back(std::move(c));
+			}
+		}
+		else {
+			// Each element takes at least one byte, do not trust the length further than that
+			if (arg > static_cast<uint64_t>(end - p)) {
+				return {};
+			}
+			children.reserve(static_cast<size_t>(arg));
+			for (uint64_t i = 0; i < arg; ++i) {
+				auto c = parse_cbor(p, end, max_depth - 1);
+				if (!c) {
+					return {};
+				}
+				children.emplace_back(std::move(c));
+			}
+		}
+		break;
+	}
+	case major_map: {
+		if (!max_depth) {
+			return {};
+		}
+		auto & children = j.value_.emplace<std::size_t(json_type::object)>();
+		for (uint64_t i = 0; info == info_indefinite || i < arg; ++i) {
+			if (info == info_indefinite) {
+				if (p == end) {
+					return {};
+				}
+				if (*p == break_code) {
+					++p;
+					break;
+				}
+			}
+			std::string name;
+			if (!read_key(p, end, name)) {
+				return {};
+			}
+			auto c = parse_cbor(p, end, max_depth - 1);
+			if (!c) {
+				return {};
+			}
+			if (!children.emplace(std::move(name), std::move(c)).second) {
+				return {};
+			}
+		}
+		break;
+	}
+	case major_simple: {
+		double d{};
+		switch (info) {
+		case 20:
+		case 21:
+			j.value_ = info == 21;
+			return j;
+		case 25:
+			d = half_to_double(static_cast<uint16_t>(arg));
+			break;
+		case 26: {
+			uint32_t const bits = static_cast<uint32_t>(arg);
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			d = f;
+			break;
+		}
+		case 27:
+			memcpy(&d, &arg, sizeof(d));
+			break;
+		case info_indefinite:
+			// Unexpected break
+			return {};
+		default:
+			// null, undefined and unassigned simple values
+			j.value_.emplace<std::size_t(json_type::null)>();
+			return j;
+		}
+		if (std::isnan(d) || std::isinf(d)) {
+			j.value_.emplace<std::size_t(json_type::null)>();
+		}
+		else {
+			auto & n = j.value_.emplace<std::size_t(json_type::number)>();
+			n.text_ = double_to_text(d);
+			n.double_ = d;
+			n.integer_ = static_cast<uint64_t>(d);
+		}
+		break;
+	}
+	}
+
+	return j;
+}
+
+namespace {
+uint64_t const unknown_length = static_cast<uint64_t>(-1);
+
+// Marks an indefinite-length string, its chunks do not count towards the nesting depth
+uint64_t const string_chunks = static_cast<uint64_t>(-2);
+}
+
+cbor_decoder::cbor_decoder(size_t max_depth)
+	: max_depth_(max_depth)
+{
+}
+
+void cbor_decoder::reset()
+{
+	stack_.clear();
+	scanned_ = 0;
+	complete_ = false;
+	failed_ = false;
+}
+
+void cbor_decoder::item_done()
+{
+	while (true) {
+		if (stack_.empty()) {
+			complete_ = true;
+			return;
+		}
+		auto & remaining = stack_.back();
+		if (remaining == unknown_length || remaining == string_chunks) {
+			return;
+		}
+		if (--remaining) {
+			return;
+		}
+		stack_.pop_back();
+	}
+}
+
+json cbor_decoder::decode(buffer & in)
+{
+	if (failed_) {
+		return {};
+	}
+
+	unsigned char const* const data = in.get();
+	unsigned char const* const end = data + in.size();
+
+	// Only find the end of the item here, without decoding anything
+	while (!complete_) {
+		unsigned char const* p = data + scanned_;
+		if (p == end) {
+			return {};
+		}
+
+		if (*p == break_code) {
+			if (stack_.empty() || (stack_.back() != unknown_length && stack_.back() != string_chunks)) {
+				failed_ = true;
+				return {};
+			}
+			stack_.pop_back();
+			++scanned_;
+			item_done();
+			continue;
+		}
+
+		unsigned char const info = *p & 0x1f;
+		if (info >= 24 && info <= 27 && static_cast<size_t>(end - p) < 1 + (size_t(1) << (info - 24))) {
+			return {};
+		}
+
+		unsigned char major{};
+		uint64_t arg{};
+		unsigned char ignored{};
+		if (!read_head(p, end, major, ignored, arg)) {
+			failed_ = true;
+			return {};
+		}
+		size_t const head = static_cast<size_t>(p - (data + scanned_));
+
+		if (!stack_.empty() && stack_.back() == string_chunks && (info == info_indefinite || (major != major_bytes && major != major_text))) {
+			failed_ = true;
+			return {};
+		}
+
+		switch (major) {
+		case major_bytes:
+		case major_text:
+			if (info == info_indefinite) {
+				stack_.push_back(string_chunks);
+				scanned_ += head;
+			}
+			else {
+				if (static_cast<uint64_t>(end - p) < arg) {
+					return {};
+				}
+				scanned_ += head + static_cast<size_t>(arg);
+				item_done();
+			}
+			break;
+		case major_array:
+		case major_map:
+			scanned_ += head;
+			if (info == info_indefinite) {
+				stack_.push_back(unknown_length);
+			}
+			else if (!arg) {
+				item_done();
+			}
+			else {
+				if (major == major_map) {
+					if (arg > std::numeric_limits<uint64_t>::max() / 4) {
+						failed_ = true;
+						return {};
+					}
+					arg *= 2;
+				}
+				stack_.push_back(arg);
+			}
+			if (stack_.size() > max_depth_) {
+				failed_ = true;
+				return {};
+			}
+			break;
+		case major_tag:
+			// Applies to the next item
+			scanned_ += head;
+			break;
+		default:
+			scanned_ += head;
+			item_done();
+			break;
+		}
+	}
+
+	auto p = data;
+	auto const item_end = data + scanned_;
+	json j = json::parse_cbor(p, item_end, max_depth_);
+	size_t const size = scanned_;
+	scanned_ = 0;
+	complete_ = false;
+	if (!j || p != item_end) {
+		failed_ = true;
+		return {};
+	}
+	in.consume(size);
+	return j;
+}
+
+}
@@ -0,0 +1,628 @@
+#include "libfilezilla/libfilezilla.hpp"
+
+#include "libfilezilla/hash.hpp"
+#include "checksum_impl.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define FZ_CHECKSUM_SSE2 1
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace fz {
+
+namespace {
+uint64_t read_le64(uint8_t const* p)
+{
+	return static_cast<uint64_t>(p[0]) | (static_cast<uint64_t>(p[1]) << 8) | (static_cast<uint64_t>(p[2]) << 16) | (static_cast<uint64_t>(p[3]) << 24) |
+		(static_cast<uint64_t>(p[4]) << 32) | (static_cast<uint64_t>(p[5]) << 40) | (static_cast<uint64_t>(p[6]) << 48) | (static_cast<uint64_t>(p[7]) << 56);
+}
+
+uint32_t read_le32(uint8_t const* p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/*
+ * CRC-32C
+ *
+ * Reflected Castagnoli polynomial. Without CPU support, slicing-by-8 is used.
+ * With the CRC32 instruction, large inputs are processed as three interleaved
+ * streams to hide the latency of the instruction. The CRCs of the streams are
+ * then combined using tables that shift a CRC over a run of zeroes.
+ */
+uint32_t const crc32c_poly = 0x82f63b78;
+
+constexpr auto crc32c_table = []() {
+	std::array<std::array<uint32_t, 256>, 8> t{};
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? (c >> 1) ^ crc32c_poly : c >> 1;
+		}
+		t[0][i] = c;
+	}
+	for (size_t i = 0; i < 256; ++i) {
+		for (size_t k = 1; k < 8; ++k) {
+			t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+		}
+	}
+	return t;
+}();
+
+uint32_t crc32c_sw(uint32_t crc, uint8_t const* p, size_t size)
+{
+	auto const& t = crc32c_table;
+	while (size >= 8) {
+		uint64_t const v = read_le64(p) ^ crc;
+		crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+			t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+	}
+	return crc;
+}
+
+#if (defined(__GNUC__) && defined(__x86_64__)) || (defined(__ARM_FEATURE_CRC32) && defined(__aarch64__) && !defined(__AARCH64EB__))
+size_t const crc32c_long = 8192;
+size_t const crc32c_short = 256;
+
+// Multiplies the 32x32 GF(2) matrix with the vector
+uint32_t gf2_times(uint32_t const* mat, uint32_t vec)
+{
+	uint32_t sum{};
+	while (vec) {
+		if (vec & 1) {
+			sum ^= *mat;
+		}
+		vec >>= 1;
+		++mat;
+	}
+	return sum;
+}
+
+void gf2_square(uint32_t* square, uint32_t const* mat)
+{
+	for (int n = 0; n < 32; ++n) {
+		square[n] = gf2_times(mat, mat[n]);
+	}
+}
+
+typedef std::array<std::array<uint32_t, 256>, 4> crc32c_shift_table;
+
+// Table for the operator appending len zero octets to a CRC
+crc32c_shift_table make_shift_table(size_t len)
+{
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	// Operator for a single zero bit
+	odd[0] = crc32c_poly;
+	uint32_t row = 1;
+	for (int n = 1; n < 32; ++n) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_square(even, odd); // Two bits
+	gf2_square(odd, even); // Four bits
+
+	// Squaring doubles the number of bits, start with a byte
+	uint32_t const* op = odd;
+	do {
+		gf2_square(even, odd);
+		len >>= 1;
+		op = even;
+		if (!len) {
+			break;
+		}
+		gf2_square(odd, even);
+		len >>= 1;
+		op = odd;
+	} while (len);
+
+	crc32c_shift_table t{};
+	for (uint32_t n = 0; n < 256; ++n) {
+		t[0][n] = gf2_times(op, n);
+		t[1][n] = gf2_times(op, n << 8);
+		t[2][n] = gf2_times(op, n << 16);
+		t[3][n] = gf2_times(op, n << 24);
+	}
+	return t;
+}
+
+uint32_t crc32c_shift(crc32c_shift_table const& t, uint32_t crc)
+{
+	return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+crc32c_shift_table const& long_shift()
+{
+	static crc32c_shift_table const t = make_shift_table(crc32c_long);
+	return t;
+}
+
+crc32c_shift_table const& short_shift()
+{
+	static crc32c_shift_table const t = make_shift_table(crc32c_short);
+	return t;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FZ_CRC32C_TARGET __attribute__((target("sse4.2")))
+FZ_CRC32C_TARGET inline uint64_t crc32c_u64(uint64_t crc, uint64_t v) { return _mm_crc32_u64(crc, v); }
+FZ_CRC32C_TARGET inline uint32_t crc32c_u8(uint32_t crc, uint8_t v) { return _mm_crc32_u8(crc, v); }
+
+bool has_crc32c_hw()
+{
+	static bool const sse42 = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.2") != 0;
+	}();
+	return sse42;
+}
+#else
+#define FZ_CRC32C_TARGET
+inline uint64_t crc32c_u64(uint64_t crc, uint64_t v) { return __crc32cd(static_cast<uint32_t>(crc), v); }
+inline uint32_t crc32c_u8(uint32_t crc, uint8_t v) { return __crc32cb(crc, v); }
+
+bool has_crc32c_hw()
+{
+	return true;
+}
+#endif
+
+// Only little-endian platforms get here
+inline uint64_t load64(uint8_t const* p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+// Three streams of n octets each
+FZ_CRC32C_TARGET
+uint32_t crc32c_hw_3way(uint32_t crc, uint8_t const*& data, size_t& size, size_t n, crc32c_shift_table const& shift)
+{
+	uint8_t const* p = data;
+	while (size >= n * 3) {
+		uint64_t c0 = crc, c1 = 0, c2 = 0;
+		uint8_t const* const end = p + n;
+		do {
+			c0 = crc32c_u64(c0, load64(p));
+			c1 = crc32c_u64(c1, load64(p + n));
+			c2 = crc32c_u64(c2, load64(p + 2 * n));
+			p += 8;
+		} while (p < end);
+		crc = crc32c_shift(shift, static_cast<uint32_t>(c0)) ^ static_cast<uint32_t>(c1);
+		crc = crc32c_shift(shift, crc) ^ static_cast<uint32_t>(c2);
+		p += n * 2;
+		size -= n * 3;
+	}
+	data = p;
+	return crc;
+}
+
+FZ_CRC32C_TARGET
+uint32_t crc32c_hw(uint32_t crc, uint8_t const* p, size_t size)
+{
+	crc = crc32c_hw_3way(crc, p, size, crc32c_long, long_shift());
+	crc = crc32c_hw_3way(crc, p, size, crc32c_short, short_shift());
+
+	uint64_t c = crc;
+	while (size >= 8) {
+		c = crc32c_u64(c, load64(p));
+		p += 8;
+		size -= 8;
+	}
+	crc = static_cast<uint32_t>(c);
+	while (size--) {
+		crc = crc32c_u8(crc, *p++);
+	}
+	return crc;
+}
+#define FZ_CRC32C_HW 1
+#endif
+
+/*
+ * XXH3, 64-bit variant
+ *
+ * Inputs of up to 240 octets are hashed by dedicated functions. Longer inputs
+ * are processed in stripes of 64 octets, each accumulated into eight 64-bit
+ * lanes. After each block of 16 stripes, the lanes get scrambled.
+ */
+uint32_t const xxh_prime32_1 = 0x9e3779b1u;
+uint32_t const xxh_prime32_2 = 0x85ebca77u;
+uint32_t const xxh_prime32_3 = 0xc2b2ae3du;
+uint64_t const xxh_prime64_1 = 0x9e3779b185ebca87ull;
+uint64_t const xxh_prime64_2 = 0xc2b2ae3d27d4eb4full;
+uint64_t const xxh_prime64_3 = 0x165667b19e3779f9ull;
+uint64_t const xxh_prime64_4 = 0x85ebca77c2b2ae63ull;
+uint64_t const xxh_prime64_5 = 0x27d4eb2f165667c5ull;
+uint64_t const xxh_prime_mx1 = 0x165667919e3779f9ull;
+uint64_t const xxh_prime_mx2 = 0x9fb21c651e98df25ull;
+
+size_t const xxh_stripe_len = 64;
+size_t const xxh_secret_size = 192;
+size_t const xxh_stripes_per_block = (xxh_secret_size - xxh_stripe_len) / 8;
+
+alignas(64) uint8_t const xxh_secret[xxh_secret_size] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+uint64_t rotl64(uint64_t v, int n)
+{
+	return (v << n) | (v >> (64 - n));
+}
+
+uint64_t swap64(uint64_t v)
+{
+	v = ((v & 0x00ff00ff00ff00ffull) << 8) | ((v >> 8) & 0x00ff00ff00ff00ffull);
+	v = ((v & 0x0000ffff0000ffffull) << 16) | ((v >> 16) & 0x0000ffff0000ffffull);
+	return (v << 32) | (v >> 32);
+}
+
+uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 const p = static_cast<unsigned __int128>(a) * b;
+	return static_cast<uint64_t>(p) ^ static_cast<uint64_t>(p >> 64);
+#else
+	uint64_t const lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+	uint64_t const hi_lo = (a >> 32) * (b & 0xffffffff);
+	uint64_t const lo_hi = (a & 0xffffffff) * (b >> 32);
+	uint64_t const hi_hi = (a >> 32) * (b >> 32);
+	uint64_t const cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+	uint64_t const upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+	uint64_t const lower = (cross << 32) | (lo_lo & 0xffffffff);
+	return lower ^ upper;
+#endif
+}
+
+uint64_t xxh64_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= xxh_prime64_2;
+	h ^= h >> 29;
+	h *= xxh_prime64_3;
+	return h ^ (h >> 32);
+}
+
+uint64_t xxh3_avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= xxh_prime_mx1;
+	return h ^ (h >> 32);
+}
+
+uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= rotl64(h, 49) ^ rotl64(h, 24);
+	h *= xxh_prime_mx2;
+	h ^= (h >> 35) + len;
+	h *= xxh_prime_mx2;
+	return h ^ (h >> 28);
+}
+
+uint64_t xxh3_mix16(uint8_t const* p, uint8_t const* secret)
+{
+	return mul128_fold64(read_le64(p) ^ read_le64(secret), read_le64(p + 8) ^ read_le64(secret + 8));
+}
+
+uint64_t xxh3_short(uint8_t const* p, size_t len)
+{
+	uint8_t const* const s = xxh_secret;
+	if (!len) {
+		return xxh64_avalanche(read_le64(s + 56) ^ read_le64(s + 64));
+	}
+	if (len <= 3) {
+		uint32_t const combined = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[len >> 1]) << 24) | p[len - 1] | (static_cast<uint32_t>(len) << 8);
+		uint64_t const bitflip = read_le32(s) ^ read_le32(s + 4);
+		return xxh64_avalanche(combined ^ bitflip);
+	}
+	if (len <= 8) {
+		uint64_t const bitflip = read_le64(s + 8) ^ read_le64(s + 16);
+		uint64_t const in = read_le32(p + len - 4) + (static_cast<uint64_t>(read_le32(p)) << 32);
+		return xxh3_rrmxmx(in ^ bitflip, len);
+	}
+	if (len <= 16) {
+		uint64_t const lo = read_le64(p) ^ (read_le64(s + 24) ^ read_le64(s + 32));
+		uint64_t const hi = read_le64(p + len - 8) ^ (read_le64(s + 40) ^ read_le64(s + 48));
+		return xxh3_avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+	}
+
+	uint64_t acc = len * xxh_prime64_1;
+	if (len <= 128) {
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += xxh3_mix16(p + 48, s + 96);
+					acc += xxh3_mix16(p + len - 64, s + 112);
+				}
+				acc += xxh3_mix16(p + 32, s + 64);
+				acc += xxh3_mix16(p + len - 48, s + 80);
+			}
+			acc += xxh3_mix16(p + 16, s + 32);
+			acc += xxh3_mix16(p + len - 32, s + 48);
+		}
+		acc += xxh3_mix16(p, s);
+		acc += xxh3_mix16(p + len - 16, s + 16);
+		return xxh3_avalanche(acc);
+	}
+
+	// Up to 240 octets
+	size_t const rounds = len / 16;
+	for (size_t i = 0; i < 8; ++i) {
+		acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+	}
+	acc = xxh3_avalanche(acc);
+	for (size_t i = 8; i < rounds; ++i) {
+		acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+	}
+	acc += xxh3_mix16(p + len - 16, s + 136 - 17);
+	return xxh3_avalanche(acc);
+}
+
+void xxh3_accumulate_scalar(uint64_t* acc, uint8_t const* p, uint8_t const* key)
+{
+	for (size_t i = 0; i < 8; ++i) {
+		uint64_t const v = read_le64(p + 8 * i);
+		uint64_t const k = v ^ read_le64(key + 8 * i);
+		acc[i ^ 1] += v;
+		acc[i] += (k & 0xffffffff) * (k >> 32);
+	}
+}
+
+#if !FZ_CHECKSUM_SSE2
+void xxh3_stripes_scalar(uint64_t* acc, size_t& stripes, uint8_t const* p, size_t n)
+{
+	for (; n; --n, p += xxh_stripe_len) {
+		xxh3_accumulate_scalar(acc, p, xxh_secret + stripes * 8);
+		if (++stripes == xxh_stripes_per_block) {
+			stripes = 0;
+			uint8_t const* key = xxh_secret + xxh_secret_size - xxh_stripe_len;
+			for (size_t i = 0; i < 8; ++i) {
+				uint64_t a = acc[i];
+				a ^= a >> 47;
+				a ^= read_le64(key + 8 * i);
+				acc[i] = a * xxh_prime32_1;
+			}
+		}
+	}
+}
+
+#else
+void xxh3_stripes_sse2(uint64_t* acc, size_t& stripes, uint8_t const* p, size_t n)
+{
+	__m128i a[4];
+	for (int i = 0; i < 4; ++i) {
+		a[i] = _mm_load_si128(reinterpret_cast<__m128i const*>(acc) + i);
+	}
+	size_t s = stripes;
+	__m128i const prime = _mm_set1_epi32(static_cast<int>(xxh_prime32_1));
+	for (; n; --n, p += xxh_stripe_len) {
+		uint8_t const* key = xxh_secret + s * 8;
+		for (int i = 0; i < 4; ++i) {
+			__m128i const d = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p) + i);
+			__m128i const dk = _mm_xor_si128(d, _mm_loadu_si128(reinterpret_cast<__m128i const*>(key) + i));
+			__m128i const product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+		}
+		if (++s == xxh_stripes_per_block) {
+			s = 0;
+			for (int i = 0; i < 4; ++i) {
+				__m128i x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+				x = _mm_xor_si128(x, _mm_loadu_si128(reinterpret_cast<__m128i const*>(xxh_secret + xxh_secret_size - xxh_stripe_len) + i));
+				__m128i const lo = _mm_mul_epu32(x, prime);
+				__m128i const hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+				a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+			}
+		}
+	}
+	for (int i = 0; i < 4; ++i) {
+		_mm_store_si128(reinterpret_cast<__m128i*>(acc) + i, a[i]);
+	}
+	stripes = s;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("avx2")))
+void xxh3_stripes_avx2(uint64_t* acc, size_t& stripes, uint8_t const* p, size_t n)
+{
+	__m256i a0 = _mm256_load_si256(reinterpret_cast<__m256i const*>(acc));
+	__m256i a1 = _mm256_load_si256(reinterpret_cast<__m256i const*>(acc) + 1);
+	size_t s = stripes;
+	__m256i const prime = _mm256_set1_epi32(static_cast<int>(xxh_prime32_1));
+	for (; n; --n, p += xxh_stripe_len) {
+		uint8_t const* key = xxh_secret + s * 8;
+
+		__m256i const d0 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+		__m256i const dk0 = _mm256_xor_si256(d0, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(key)));
+		__m256i const product0 = _mm256_mul_epu32(dk0, _mm256_shuffle_epi32(dk0, _MM_SHUFFLE(0, 3, 0, 1)));
+		a0 = _mm256_add_epi64(a0, _mm256_add_epi64(product0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+
+		__m256i const d1 = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p) + 1);
+		__m256i const dk1 = _mm256_xor_si256(d1, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(key) + 1));
+		__m256i const product1 = _mm256_mul_epu32(dk1, _mm256_shuffle_epi32(dk1, _MM_SHUFFLE(0, 3, 0, 1)));
+		a1 = _mm256_add_epi64(a1, _mm256_add_epi64(product1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+
+		if (++s == xxh_stripes_per_block) {
+			s = 0;
+			__m256i const* scramble = reinterpret_cast<__m256i const*>(xxh_secret + xxh_secret_size - xxh_stripe_len);
+
+			__m256i x = _mm256_xor_si256(_mm256_xor_si256(a0, _mm256_srli_epi64(a0, 47)), _mm256_loadu_si256(scramble));
+			a0 = _mm256_add_epi64(_mm256_mul_epu32(x, prime), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime), 32));
+
+			x = _mm256_xor_si256(_mm256_xor_si256(a1, _mm256_srli_epi64(a1, 47)), _mm256_loadu_si256(scramble + 1));
+			a1 = _mm256_add_epi64(_mm256_mul_epu32(x, prime), _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime), 32));
+		}
+	}
+	_mm256_store_si256(reinterpret_cast<__m256i*>(acc), a0);
+	_mm256_store_si256(reinterpret_cast<__m256i*>(acc) + 1, a1);
+	stripes = s;
+}
+#endif
+#endif
+
+void xxh3_stripes(uint64_t* acc, size_t& stripes, uint8_t const* p, size_t n)
+{
+#if FZ_CHECKSUM_SSE2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	static bool const avx2 = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	}();
+	if (avx2) {
+		xxh3_stripes_avx2(acc, stripes, p, n);
+		return;
+	}
+#endif
+	xxh3_stripes_sse2(acc, stripes, p, n);
+#else
+	xxh3_stripes_scalar(acc, stripes, p, n);
+#endif
+}
+
+void xxh3_init_acc(uint64_t* acc)
+{
+	acc[0] = xxh_prime32_3;
+	acc[1] = xxh_prime64_1;
+	acc[2] = xxh_prime64_2;
+	acc[3] = xxh_prime64_3;
+	acc[4] = xxh_prime64_4;
+	acc[5] = xxh_prime32_2;
+	acc[6] = xxh_prime64_5;
+	acc[7] = xxh_prime32_1;
+}
+
+// Accumulates the last 64 octets of the input once more, then merges the lanes
+uint64_t xxh3_finish_long(uint64_t* acc, uint8_t const* last_stripe, uint64_t len)
+{
+	xxh3_accumulate_scalar(acc, last_stripe, xxh_secret + xxh_secret_size - xxh_stripe_len - 7);
+
+	uint64_t result = len * xxh_prime64_1;
+	for (size_t i = 0; i < 4; ++i) {
+		uint8_t const* key = xxh_secret + 11 + 16 * i;
+		result += mul128_fold64(acc[2 * i] ^ read_le64(key), acc[2 * i + 1] ^ read_le64(key + 8));
+	}
+	return xxh3_avalanche(result);
+}
+}
+
+uint32_t crc32c(std::basic_string_view<uint8_t> const& data, uint32_t crc)
+{
+	crc = ~crc;
+#if FZ_CRC32C_HW
+	if (has_crc32c_hw()) {
+		return ~crc32c_hw(crc, data.data(), data.size());
+	}
+#endif
+	return ~crc32c_sw(crc, data.data(), data.size());
+}
+
+uint32_t crc32c(std::string_view const& data, uint32_t crc)
+{
+	return crc32c(std::basic_string_view<uint8_t>(reinterpret_cast<uint8_t const*>(data.data()), data.size()), crc);
+}
+
+uint64_t xxh3_64(std::basic_string_view<uint8_t> const& data)
+{
+	uint8_t const* p = data.data();
+	size_t const len = data.size();
+	if (len <= 240) {
+		return xxh3_short(p, len);
+	}
+
+	alignas(32) uint64_t acc[8];
+	xxh3_init_acc(acc);
+	size_t stripes{};
+	xxh3_stripes(acc, stripes, p, (len - 1) / xxh_stripe_len);
+	return xxh3_finish_long(acc, p + len - xxh_stripe_len, len);
+}
+
+uint64_t xxh3_64(std::string_view const& data)
+{
+	return xxh3_64(std::basic_string_view<uint8_t>(reinterpret_cast<uint8_t const*>(data.data()), data.size()));
+}
+
+void xxh3_state::reset()
+{
+	xxh3_init_acc(acc_);
+	total_ = 0;
+	stripes_ = 0;
+	buffered_ = 0;
+}
+
+void xxh3_state::update(uint8_t const* p, size_t size)
+{
+	total_ += size;
+	if (buffered_ + size <= buffer_size) {
+		if (size) {
+			memcpy(buffer_ + buffered_, p, size);
+			buffered_ += size;
+		}
+		return;
+	}
+
+	// A stripe only gets processed once it is known not to be the last one
+	if (buffered_) {
+		size_t const fill = buffer_size - buffered_;
+		memcpy(buffer_ + buffered_, p, fill);
+		p += fill;
+		size -= fill;
+		xxh3_stripes(acc_, stripes_, buffer_, buffer_size / xxh_stripe_len);
+		buffered_ = 0;
+	}
+	if (size > buffer_size) {
+		size_t const n = (size - 1) / xxh_stripe_len;
+		xxh3_stripes(acc_, stripes_, p, n);
+		p += n * xxh_stripe_len;
+		size -= n * xxh_stripe_len;
+		memcpy(buffer_ + buffer_size - xxh_stripe_len, p - xxh_stripe_len, xxh_stripe_len);
+	}
+	memcpy(buffer_, p, size);
+	buffered_ = size;
+}
+
+uint64_t xxh3_state::digest() const
+{
+	if (total_ <= 240) {
+		return xxh3_short(buffer_, static_cast<size_t>(total_));
+	}
+
+	alignas(32) uint64_t acc[8];
+	memcpy(acc, acc_, sizeof(acc));
+	if (buffered_ >= xxh_stripe_len) {
+		size_t stripes = stripes_;
+		xxh3_stripes(acc, stripes, buffer_, (buffered_ - 1) / xxh_stripe_len);
+		return xxh3_finish_long(acc, buffer_ + buffered_ - xxh_stripe_len, total_);
+	}
+
+	// The last stripe starts in the previously processed data
+	uint8_t last[xxh_stripe_len];
+	size_t const prev = xxh_stripe_len - buffered_;
+	memcpy(last, buffer_ + buffer_size - prev, prev);
+	memcpy(last + prev, buffer_, buffered_);
+	return xxh3_finish_long(acc, last, total_);
+}
+
+}
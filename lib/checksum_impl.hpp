@@ -0,0 +1,30 @@
+#ifndef LIBFILEZILLA_CHECKSUM_IMPL_HEADER
+#define LIBFILEZILLA_CHECKSUM_IMPL_HEADER
+
+#include "libfilezilla/libfilezilla.hpp"
+
+namespace fz {
+
+// Streaming state of the 64-bit XXH3 hash, using the default secret and a seed of 0
+struct xxh3_state final
+{
+	static constexpr size_t buffer_size = 256;
+
+	void reset();
+	void update(uint8_t const* data, size_t size);
+	uint64_t digest() const;
+
+	alignas(32) uint64_t acc_[8];
+	uint64_t total_{};
+
+	// Stripes processed in the current block
+	size_t stripes_{};
+
+	// Once data has been processed, the last processed stripe is kept at the end of the buffer
+	size_t buffered_{};
+	uint8_t buffer_[buffer_size];
+};
+
+}
+
+#endif
@@ -0,0 +1,287 @@
+#include "libfilezilla/connection_pool.hpp"
+#include "libfilezilla/tls_layer.hpp"
+
+#include <tuple>
+
+namespace fz {
+
+namespace {
+// Bounds the remembered sessions if many different keys get used
+size_t const max_sessions = 1000;
+
+// Attempts to close established connections cleanly, with TLS that sends the closure alert
+void shut_down(pooled_connection & conn)
+{
+	if (conn.top().get_state() == socket_state::connected) {
+		conn.top().shutdown();
+	}
+}
+}
+
+bool connection_pool_key::operator<(connection_pool_key const& op) const
+{
+	return std::tie(host, port, tls, required_certificate, profile) < std::tie(op.host, op.port, op.tls, op.required_certificate, op.profile);
+}
+
+bool connection_pool_key::operator==(connection_pool_key const& op) const
+{
+	return std::tie(host, port, tls, required_certificate, profile) == std::tie(op.host, op.port, op.tls, op.required_certificate, op.profile);
+}
+
+pooled_connection::pooled_connection(connection_pool_key const& key)
+	: key_(key)
+{
+}
+
+pooled_connection::~pooled_connection()
+{
+	// Layers need to go first
+	tls_.reset();
+	socket_.reset();
+}
+
+socket_interface& pooled_connection::top()
+{
+	if (tls_) {
+		return *tls_;
+	}
+	return *socket_;
+}
+
+connection_pool::connection_pool(event_loop & loop, thread_pool & pool, logger_interface & logger, tls_system_trust_store * trust_store, size_t max_idle, duration const& idle_timeout)
+	: event_handler(loop)
+	, pool_(pool)
+	, logger_(logger)
+	, trust_store_(trust_store)
+	, max_idle_(max_idle)
+	, idle_timeout_(idle_timeout)
+{
+}
+
+connection_pool::~connection_pool()
+{
+	remove_handler();
+	clear();
+}
+
+std::unique_ptr<pooled_connection> connection_pool::acquire(connection_pool_key const& key, event_handler * handler, int & error, setup_function const& setup)
+{
+	std::vector<uint8_t> session;
+	{
+		// Declared before the lock so that closing happens after unlocking,
+		// destroying the layers may wait for their handlers.
+		std::vector<std::unique_ptr<pooled_connection>> discarded;
+
+		scoped_lock l(mtx_);
+		auto it = idle_.find(key);
+		if (it != idle_.end()) {
+			auto & conns = it->second;
+			while (!conns.empty()) {
+				auto conn = std::move(conns.back());
+				conns.pop_back();
+				if (conn->top().get_state() != socket_state::connected) {
+					discarded.push_back(std::move(conn));
+					continue;
+				}
+
+				if (conns.empty()) {
+					idle_.erase(it);
+				}
+				conn->reused_ = true;
+				conn->top().set_event_handler(handler);
+				error = 0;
+				return conn;
+			}
+			idle_.erase(it);
+		}
+
+		if (key.tls) {
+			auto sit = sessions_.find(key);
+			if (sit != sessions_.end()) {
+				session = sit->second;
+			}
+		}
+	}
+
+	std::unique_ptr<pooled_connection> conn(new pooled_connection(key));
+	conn->socket_ = std::make_unique<socket>(pool_, key.tls ? nullptr : handler);
+	if (key.tls) {
+		conn->tls_ = std::make_unique<tls_layer>(event_loop_, handler, *conn->socket_, trust_store_, logger_);
+	}
+	if (setup) {
+		setup(*conn->socket_, conn->tls_.get());
+	}
+
+	if (conn->tls_) {
+		if (!conn->tls_->client_handshake(key.required_certificate, session, key.host)) {
+			error = ECONNABORTED;
+			return nullptr;
+		}
+	}
+
+	error = conn->top().connect(key.host, key.port);
+	if (error) {
+		return nullptr;
+	}
+
+	return conn;
+}
+
+void connection_pool::release(std::unique_ptr<pooled_connection> && conn)
+{
+	if (!conn) {
+		return;
+	}
+
+	std::unique_ptr<pooled_connection> discarded;
+
+	scoped_lock l(mtx_);
+
+	remember_session(*conn);
+
+	if (!max_idle_ || conn->top().get_state() != socket_state::connected) {
+		discarded = std::move(conn);
+		return;
+	}
+
+	auto & conns = idle_[conn->key_];
+	if (conns.size() >= max_idle_) {
+		shut_down(*conns.front());
+		discarded = std::move(conns.front());
+		conns.erase(conns.begin());
+	}
+
+	conn->idle_since_ = monotonic_clock::now();
+	conn->top().set_event_handler(this);
+	conns.push_back(std::move(conn));
+
+	if (!timer_) {
+		// The sweep need not be precise
+		auto const interval = std::max(idle_timeout_ / 2, duration::from_seconds(1));
+		timer_ = add_timer(interval, false, interval / 2);
+	}
+}
+
+void connection_pool::remember_session(pooled_connection & conn)
+{
+	if (!conn.tls_) {
+		return;
+	}
+
+	auto session = conn.tls_->get_session_parameters();
+	if (!session.empty()) {
+		if (sessions_.size() >= max_sessions && sessions_.find(conn.key_) == sessions_.end()) {
+			sessions_.clear();
+		}
+		sessions_[conn.key_] = std::move(session);
+	}
+}
+
+size_t connection_pool::idle_count() const
+{
+	scoped_lock l(mtx_);
+
+	size_t ret{};
+	for (auto const& conns : idle_) {
+		ret += conns.second.size();
+	}
+	return ret;
+}
+
+void connection_pool::clear()
+{
+	decltype(idle_) discarded;
+
+	scoped_lock l(mtx_);
+	std::swap(discarded, idle_);
+	for (auto & conns : discarded) {
+		for (auto & conn : conns.second) {
+			shut_down(*conn);
+		}
+	}
+	if (timer_) {
+		stop_timer(timer_);
+		timer_ = 0;
+	}
+}
+
+void connection_pool::operator()(event_base const& ev)
+{
+	dispatch<socket_event, timer_event>(ev, this,
+		&connection_pool::on_socket_event,
+		&connection_pool::on_timer);
+}
+
+void connection_pool::on_socket_event(socket_event_source * source, socket_event_flag type, int error)
+{
+	std::unique_ptr<pooled_connection> discarded;
+
+	scoped_lock l(mtx_);
+
+	for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+		auto & conns = it->second;
+		for (auto cit = conns.begin(); cit != conns.end(); ++cit) {
+			auto & top = (*cit)->top();
+			if (&top != source) {
+				continue;
+			}
+
+			if (!error) {
+				if (type != socket_event_flag::read) {
+					return;
+				}
+
+				// Idle connections are not supposed to receive anything, the server has either
+				// closed the connection or the protocol is out of sync.
+				unsigned char c;
+				int r = top.read(&c, 1, error);
+				if (r < 0 && error == EAGAIN) {
+					return;
+				}
+				if (!r) {
+					shut_down(**cit);
+				}
+			}
+
+			// With TLS 1.3, session tickets may have arrived in the meantime
+			remember_session(**cit);
+
+			discarded = std::move(*cit);
+			conns.erase(cit);
+			if (conns.empty()) {
+				idle_.erase(it);
+			}
+			return;
+		}
+	}
+}
+
+void connection_pool::on_timer(timer_id const&)
+{
+	std::vector<std::unique_ptr<pooled_connection>> discarded;
+
+	scoped_lock l(mtx_);
+
+	auto const now = monotonic_clock::now();
+	for (auto it = idle_.begin(); it != idle_.end(); ) {
+		auto & conns = it->second;
+		size_t expired{};
+		while (expired < conns.size() && now - conns[expired]->idle_since_ >= idle_timeout_) {
+			shut_down(*conns[expired]);
+			discarded.push_back(std::move(conns[expired++]));
+		}
+		conns.erase(conns.begin(), conns.begin() + expired);
+		if (conns.empty()) {
+			it = idle_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+
+	if (idle_.empty() && timer_) {
+		stop_timer(timer_);
+		timer_ = 0;
+	}
+}
+}
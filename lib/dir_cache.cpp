@@ -0,0 +1,353 @@
+#include "libfilezilla/dir_cache.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#if defined(__linux__)
+#include "unix/poller.hpp"
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <list>
+#include <unordered_map>
+
+namespace fz {
+
+class dir_cache_impl final
+{
+public:
+	dir_cache_impl(thread_pool & pool, size_t max_entries, duration const& max_age);
+	~dir_cache_impl();
+
+	result get(native_string const& path, dir_cache::listing & out);
+	void invalidate(native_string const& path);
+	void clear();
+
+	bool watching() const { return watch_fd_ != -1; }
+
+private:
+	struct entry final
+	{
+		dir_cache::listing data_;
+		monotonic_clock stored_;
+		int wd_{-1};
+
+		// Incremented on invalidation, tells readers not to store what they have read
+		uint64_t generation_{};
+		size_t readers_{};
+
+		std::list<native_string>::iterator lru_;
+	};
+	typedef std::unordered_map<native_string, entry>::iterator entry_iterator;
+
+	void drop(entry_iterator it);
+	void remove(entry_iterator it);
+	void evict();
+
+#if defined(__linux__)
+	void run();
+	void process_events(scoped_lock & l);
+
+	poller poller_;
+	async_task task_;
+	bool quit_{};
+#endif
+
+	mutex mtx_{false};
+
+	size_t const max_entries_;
+	duration const max_age_;
+	int watch_fd_{-1};
+
+	std::unordered_map<native_string, entry> entries_;
+	std::unordered_map<int, native_string> watches_;
+
+	// Cached listings, most recently used first
+	std::list<native_string> lru_;
+	size_t total_{};
+};
+
+namespace {
+#if defined(__linux__)
+uint32_t const watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+#endif
+
+dir_cache::listing read_dir(native_string const& path, result & res)
+{
+	local_filesys fs;
+	res = fs.begin_find_files(path);
+	if (!res) {
+		return {};
+	}
+
+	auto data = std::make_shared<std::vector<local_filesys::dir_entry>>();
+	std::vector<local_filesys::dir_entry> batch;
+	while (fs.get_next_files(batch)) {
+		data->insert(data->end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+	}
+	return data;
+}
+
+native_string normalize(native_string path)
+{
+	if (path.size() > 1 && local_filesys::is_separator(path.back())) {
+		path.pop_back();
+	}
+	return path;
+}
+}
+
+dir_cache_impl::dir_cache_impl(thread_pool & pool, size_t max_entries, duration const& max_age)
+	: max_entries_(max_entries)
+	, max_age_(max_age)
+{
+#if defined(__linux__)
+	watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd_ != -1) {
+		if (!poller_.init()) {
+			task_ = pool.spawn([this]{ run(); });
+		}
+		if (!task_) {
+			close(watch_fd_);
+			watch_fd_ = -1;
+		}
+	}
+#else
+	(void)pool;
+#endif
+}
+
+dir_cache_impl::~dir_cache_impl()
+{
+#if defined(__linux__)
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		if (task_) {
+			poller_.interrupt(l);
+		}
+	}
+	task_.join();
+
+	if (watch_fd_ != -1) {
+		close(watch_fd_);
+	}
+#endif
+}
+
+result dir_cache_impl::get(native_string const& p, dir_cache::listing & out)
+{
+	native_string const path = normalize(p);
+
+	scoped_lock l(mtx_);
+
+	if (watch_fd_ == -1 && !max_age_) {
+		l.unlock();
+		result res;
+		out = read_dir(path, res);
+		return res;
+	}
+
+	auto it = entries_.find(path);
+	if (it != entries_.end() && it->second.data_) {
+		auto & e = it->second;
+		if (watch_fd_ != -1 || monotonic_clock::now() - e.stored_ < max_age_) {
+			lru_.splice(lru_.begin(), lru_, e.lru_);
+			out = e.data_;
+			return result{result::ok};
+		}
+		drop(it);
+	}
+
+	if (it == entries_.end()) {
+		int wd = -1;
+#if defined(__linux__)
+		if (watch_fd_ != -1) {
+			// Watch before reading, so that no change can get lost
+			wd = inotify_add_watch(watch_fd_, path.c_str(), watch_mask);
+			if (wd == -1 || watches_.count(wd)) {
+				// Out of watches, or the same directory under another path
+				l.unlock();
+				result res;
+				out = read_dir(path, res);
+				return res;
+			}
+		}
+#endif
+		it = entries_.emplace(path, entry()).first;
+		it->second.wd_ = wd;
+		if (wd != -1) {
+			watches_.emplace(wd, path);
+		}
+	}
+
+	uint64_t const generation = it->second.generation_;
+	++it->second.readers_;
+
+	l.unlock();
+	result res;
+	auto data = read_dir(path, res);
+	l.lock();
+
+	// Cannot have been removed while reading
+	it = entries_.find(path);
+	auto & e = it->second;
+	--e.readers_;
+	if (data && !e.data_ && e.generation_ == generation) {
+		e.data_ = data;
+		e.stored_ = monotonic_clock::now();
+		lru_.push_front(path);
+		e.lru_ = lru_.begin();
+		total_ += data->size() + 1;
+		evict();
+	}
+	else if (!e.data_ && !e.readers_) {
+		remove(it);
+	}
+
+	out = std::move(data);
+	return res;
+}
+
+void dir_cache_impl::invalidate(native_string const& path)
+{
+	scoped_lock l(mtx_);
+	auto it = entries_.find(normalize(path));
+	if (it != entries_.end()) {
+		++it->second.generation_;
+		drop(it);
+	}
+}
+
+void dir_cache_impl::clear()
+{
+	scoped_lock l(mtx_);
+	for (auto it = entries_.begin(); it != entries_.end(); ) {
+		auto cur = it++;
+		++cur->second.generation_;
+		drop(cur);
+	}
+}
+
+void dir_cache_impl::drop(entry_iterator it)
+{
+	auto & e = it->second;
+	if (e.data_) {
+		total_ -= e.data_->size() + 1;
+		e.data_.reset();
+		lru_.erase(e.lru_);
+	}
+	if (!e.readers_) {
+		remove(it);
+	}
+}
+
+void dir_cache_impl::remove(entry_iterator it)
+{
+	auto & e = it->second;
+	if (e.wd_ != -1) {
+#if defined(__linux__)
+		inotify_rm_watch(watch_fd_, e.wd_);
+#endif
+		watches_.erase(e.wd_);
+	}
+	entries_.erase(it);
+}
+
+void dir_cache_impl::evict()
+{
+	while (total_ > max_entries_ && !lru_.empty()) {
+		drop(entries_.find(lru_.back()));
+	}
+}
+
+#if defined(__linux__)
+void dir_cache_impl::run()
+{
+	scoped_lock l(mtx_);
+	while (!quit_) {
+		pollfd fds[2]{};
+		fds[0].fd = watch_fd_;
+		fds[0].events = POLLIN;
+		if (!poller_.wait(fds, 1, l)) {
+			break;
+		}
+		if (quit_) {
+			break;
+		}
+		if (fds[0].revents) {
+			process_events(l);
+		}
+	}
+}
+
+void dir_cache_impl::process_events(scoped_lock &)
+{
+	alignas(inotify_event) char buf[16 * 1024];
+	while (true) {
+		ssize_t r = read(watch_fd_, buf, sizeof(buf));
+		if (r <= 0) {
+			break;
+		}
+
+		for (char const* p = buf; p < buf + r; ) {
+			auto const& ev = *reinterpret_cast<inotify_event const*>(p);
+			p += sizeof(inotify_event) + ev.len;
+
+			if (ev.mask & IN_Q_OVERFLOW) {
+				// Events got lost, nothing can be trusted anymore
+				for (auto it = entries_.begin(); it != entries_.end(); ) {
+					auto cur = it++;
+					++cur->second.generation_;
+					drop(cur);
+				}
+				continue;
+			}
+
+			auto const wit = watches_.find(ev.wd);
+			if (wit == watches_.end()) {
+				continue;
+			}
+			auto it = entries_.find(wit->second);
+			if (ev.mask & IN_IGNORED) {
+				// The kernel has already removed the watch
+				watches_.erase(wit);
+				it->second.wd_ = -1;
+			}
+			++it->second.generation_;
+			drop(it);
+		}
+	}
+}
+#endif
+
+
+dir_cache::dir_cache(thread_pool & pool, size_t max_entries, duration const& max_age)
+	: impl_(std::make_unique<dir_cache_impl>(pool, max_entries, max_age))
+{
+}
+
+dir_cache::~dir_cache()
+{
+}
+
+result dir_cache::get(native_string const& path, listing & out)
+{
+	return impl_->get(path, out);
+}
+
+void dir_cache::invalidate(native_string const& path)
+{
+	impl_->invalidate(path);
+}
+
+void dir_cache::clear()
+{
+	impl_->clear();
+}
+
+bool dir_cache::watching() const
+{
+	return impl_->watching();
+}
+
+}
@@ -1,171 +1,702 @@
 #include "libfilezilla/buffer.hpp"
 #include "libfilezilla/encode.hpp"
 
+#include <array>
+#include <cstring>
+
+// The NEON kernels have not been run on aarch64 yet, so the scalar code is used unless FZ_USE_NEON is defined.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+#include <arm_neon.h>
+#endif
+
 namespace fz {
 
 namespace {
-template<typename DataContainer>
-void base64_encode_impl(std::string & out, DataContainer const& in, base64_type type, bool pad)
+char const base64_standard_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+char const base64_url_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// The block functions process as many whole blocks as possible and return the
+// amount of input consumed, the scalar loops take care of the rest.
+// Decoding only consumes blocks consisting entirely of valid characters.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+inline __m128i in_range(__m128i v, char first, char last)
 {
-	static_assert(sizeof(typename DataContainer::value_type) == 1, "Bad container type");
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(first - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(last + 1)));
+}
 
-	std::string::value_type const* const base64_chars =
-		 (type == base64_type::standard)
-			? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
-			: "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+size_t hex_encode_blocks(char* out, unsigned char const* in, size_t n, bool lowercase)
+{
+	__m128i const nibble = _mm_set1_epi8(0x0f);
+	__m128i const nine = _mm_set1_epi8(9);
+	__m128i const zero = _mm_set1_epi8('0');
+	__m128i const letter = _mm_set1_epi8((lowercase ? 'a' : 'A') - '0' - 10);
+	auto const to_chars = [&](__m128i v) {
+		return _mm_add_epi8(_mm_add_epi8(v, zero), _mm_and_si128(_mm_cmpgt_epi8(v, nine), letter));
+	};
 
-	size_t len = in.size();
-	size_t pos{};
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i));
+		__m128i const high = to_chars(_mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+		__m128i const low = to_chars(_mm_and_si128(v, nibble));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), _mm_unpacklo_epi8(high, low));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+	}
+	return i;
+}
 
-	size_t const newcap = out.size() + ((len + 2) / 3) * 4;
-	if (out.capacity() < newcap) {
-		out.reserve(newcap);
+inline bool hex_values(__m128i c, __m128i & v)
+{
+	__m128i const digit = in_range(c, '0', '9');
+	__m128i const upper = in_range(c, 'A', 'F');
+	__m128i const lower = in_range(c, 'a', 'f');
+	if (_mm_movemask_epi8(_mm_or_si128(digit, _mm_or_si128(upper, lower))) != 0xffff) {
+		return false;
 	}
+	__m128i const offset = _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(-'0')),
+		_mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(10 - 'A')), _mm_and_si128(lower, _mm_set1_epi8(10 - 'a'))));
+	v = _mm_add_epi8(c, offset);
+	return true;
+}
 
-	while (len >= 3) {
-		len -= 3;
-		auto const c1 = static_cast<unsigned char>(in[pos++]);
-		auto const c2 = static_cast<unsigned char>(in[pos++]);
-		auto const c3 = static_cast<unsigned char>(in[pos++]);
+size_t hex_decode_blocks(unsigned char* out, char const* in, size_t n)
+{
+	// In each 16-bit lane, the first byte holds the high nibble and the second one the low nibble
+	__m128i const first = _mm_set1_epi16(0x00ff);
+	auto const combine = [&](__m128i v) {
+		return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, first), 4), _mm_srli_epi16(v, 8));
+	};
 
-		out += base64_chars[(c1 >> 2) & 0x3fu];
-		out += base64_chars[((c1 & 0x3u) << 4) | ((c2 >> 4) & 0xfu)];
-		out += base64_chars[((c2 & 0xfu) << 2) | ((c3 >> 6) & 0x3u)];
-		out += base64_chars[(c3 & 0x3fu)];
+	size_t i{};
+	for (; i + 32 <= n; i += 32) {
+		__m128i a, b;
+		if (!hex_values(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i)), a) ||
+			!hex_values(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i + 16)), b))
+		{
+			break;
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i / 2), _mm_packus_epi16(combine(a), combine(b)));
 	}
-	if (len) {
-		auto const c1 = static_cast<unsigned char>(in[pos++]);
-		out += base64_chars[(c1 >> 2) & 0x3fu];
-		if (len == 2) {
-			auto const c2 = static_cast<unsigned char>(in[pos++]);
-			out += base64_chars[((c1 & 0x3u) << 4) | ((c2 >> 4) & 0xfu)];
-			out += base64_chars[(c2 & 0xfu) << 2];
+	return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Base64 needs pshufb, so it is only vectorized if SSSE3 is available at runtime.
+// Encoding splits each group of three bytes into four 6-bit indices using multiplications,
+// those are turned into characters by adding an offset looked up from the range of the index.
+inline __m128i base64_offsets(bool url)
+{
+	return _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		url ? '-' - 62 : '+' - 62, url ? '_' - 63 : '/' - 63, 'A', 0, 0);
+}
+
+__attribute__((target("ssse3")))
+size_t base64_encode_blocks_ssse3(char* out, unsigned char const* in, size_t n, bool url)
+{
+	__m128i const spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m128i const offsets = base64_offsets(url);
+
+	size_t i{};
+	for (; i + 16 <= n; i += 12) {
+		__m128i const v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i)), spread);
+		__m128i const a = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+		__m128i const b = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+		__m128i const indices = _mm_or_si128(a, b);
+
+		__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range)));
+		out += 16;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+size_t base64_encode_blocks_avx2(char* out, unsigned char const* in, size_t n, bool url)
+{
+	__m256i const spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m256i const offsets = _mm256_broadcastsi128_si256(base64_offsets(url));
+
+	size_t i{};
+	for (; i + 28 <= n; i += 24) {
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i))),
+			_mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i + 12)), 1);
+		v = _mm256_shuffle_epi8(v, spread);
+		__m256i const a = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i const b = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		__m256i const indices = _mm256_or_si256(a, b);
+
+		__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range)));
+		out += 32;
+	}
+	return i;
+}
+
+// Accepts both alphabets like the scalar decoder
+inline bool base64_values(__m128i c, __m128i & v)
+{
+	__m128i const alnum = _mm_or_si128(_mm_or_si128(in_range(c, 'A', 'Z'), in_range(c, 'a', 'z')), in_range(c, '0', '9'));
+	__m128i const c62 = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('+')), _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+	__m128i const c63 = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('/')), _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+	if (_mm_movemask_epi8(_mm_or_si128(alnum, _mm_or_si128(c62, c63))) != 0xffff) {
+		return false;
+	}
+	__m128i const offset = _mm_or_si128(_mm_and_si128(in_range(c, 'A', 'Z'), _mm_set1_epi8(-'A')),
+		_mm_or_si128(_mm_and_si128(in_range(c, 'a', 'z'), _mm_set1_epi8(26 - 'a')), _mm_and_si128(in_range(c, '0', '9'), _mm_set1_epi8(52 - '0'))));
+	v = _mm_or_si128(_mm_and_si128(_mm_add_epi8(c, offset), alnum),
+		_mm_or_si128(_mm_and_si128(c62, _mm_set1_epi8(62)), _mm_and_si128(c63, _mm_set1_epi8(63))));
+	return true;
+}
+
+// Decoding merges pairs of 6-bit values into 12 bits, pairs of those into 24 bits, and then
+// drops the unused byte of each 32-bit lane. Stores 4 bytes past the decoded data.
+__attribute__((target("ssse3")))
+size_t base64_decode_blocks_ssse3(unsigned char* out, char const* in, size_t n)
+{
+	__m128i const pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		__m128i v;
+		if (!base64_values(_mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i)), v)) {
+			break;
+		}
+		__m128i const merged = _mm_madd_epi16(_mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(merged, pack));
+		out += 12;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+inline __m256i in_range_avx2(__m256i v, char first, char last)
+{
+	return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(first - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(last + 1), v));
+}
+
+// Stores 8 bytes past the decoded data
+__attribute__((target("avx2")))
+size_t base64_decode_blocks_avx2(unsigned char* out, char const* in, size_t n)
+{
+	__m256i const pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	__m256i const lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+	size_t i{};
+	for (; i + 32 <= n; i += 32) {
+		__m256i const c = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(in + i));
+		__m256i const upper = in_range_avx2(c, 'A', 'Z');
+		__m256i const lower = in_range_avx2(c, 'a', 'z');
+		__m256i const digit = in_range_avx2(c, '0', '9');
+		__m256i const c62 = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('+')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')));
+		__m256i const c63 = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('/')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('_')));
+		__m256i const alnum = _mm256_or_si256(_mm256_or_si256(upper, lower), digit);
+		if (static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(alnum, _mm256_or_si256(c62, c63)))) != 0xffffffffu) {
+			break;
+		}
+		__m256i const offset = _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+			_mm256_or_si256(_mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')), _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0'))));
+		__m256i const v = _mm256_or_si256(_mm256_and_si256(_mm256_add_epi8(c, offset), alnum),
+			_mm256_or_si256(_mm256_and_si256(c62, _mm256_set1_epi8(62)), _mm256_and_si256(c63, _mm256_set1_epi8(63))));
+
+		__m256i const merged = _mm256_madd_epi16(_mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), lanes));
+		out += 24;
+	}
+	return i;
+}
+
+bool has_ssse3()
+{
+	static bool const ssse3 = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("ssse3") != 0;
+	}();
+	return ssse3;
+}
+
+bool has_avx2()
+{
+	static bool const avx2 = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	}();
+	return avx2;
+}
+
+size_t base64_encode_blocks(char* out, unsigned char const* in, size_t n, bool url)
+{
+	size_t i{};
+	if (n >= 16 && has_ssse3()) {
+		if (has_avx2()) {
+			i = base64_encode_blocks_avx2(out, in, n, url);
+		}
+		i += base64_encode_blocks_ssse3(out + i / 3 * 4, in + i, n - i, url);
+	}
+	return i;
+}
+
+size_t base64_decode_blocks(unsigned char* out, char const* in, size_t n)
+{
+	size_t i{};
+	if (n >= 16 && has_ssse3()) {
+		if (has_avx2()) {
+			i = base64_decode_blocks_avx2(out, in, n);
+		}
+		i += base64_decode_blocks_ssse3(out + i / 4 * 3, in + i, n - i);
+	}
+	return i;
+}
+#else
+size_t base64_encode_blocks(char*, unsigned char const*, size_t, bool)
+{
+	return 0;
+}
+
+size_t base64_decode_blocks(unsigned char*, char const*, size_t)
+{
+	return 0;
+}
+#endif
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+size_t hex_encode_blocks(char* out, unsigned char const* in, size_t n, bool lowercase)
+{
+	uint8x16_t const digits = vld1q_u8(reinterpret_cast<uint8_t const*>(lowercase ? "0123456789abcdef" : "0123456789ABCDEF"));
+
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t const v = vld1q_u8(in + i);
+		uint8x16x2_t r;
+		r.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+		r.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+		vst2q_u8(reinterpret_cast<uint8_t*>(out + 2 * i), r);
+	}
+	return i;
+}
+
+size_t hex_decode_blocks(unsigned char* out, char const* in, size_t n)
+{
+	size_t i{};
+	for (; i + 32 <= n; i += 32) {
+		uint8x16x2_t c = vld2q_u8(reinterpret_cast<uint8_t const*>(in + i));
+		uint8x16_t valid = vdupq_n_u8(0xff);
+		for (auto & v : c.val) {
+			uint8x16_t const folded = vorrq_u8(v, vdupq_n_u8(0x20));
+			uint8x16_t const digit = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+			uint8x16_t const letter = vcltq_u8(vsubq_u8(folded, vdupq_n_u8('a')), vdupq_n_u8(6));
+			valid = vandq_u8(valid, vorrq_u8(digit, letter));
+			v = vorrq_u8(vandq_u8(digit, vsubq_u8(v, vdupq_n_u8('0'))), vandq_u8(letter, vsubq_u8(folded, vdupq_n_u8('a' - 10))));
+		}
+		if (vminvq_u8(valid) != 0xff) {
+			break;
+		}
+		vst1q_u8(out + i / 2, vorrq_u8(vshlq_n_u8(c.val[0], 4), c.val[1]));
+	}
+	return i;
+}
+
+size_t base64_encode_blocks(char* out, unsigned char const* in, size_t n, bool url)
+{
+	auto const chars = reinterpret_cast<uint8_t const*>(url ? base64_url_chars : base64_standard_chars);
+	uint8x16x4_t table;
+	for (size_t k = 0; k < 4; ++k) {
+		table.val[k] = vld1q_u8(chars + 16 * k);
+	}
+	uint8x16_t const mask = vdupq_n_u8(0x3f);
+
+	size_t i{};
+	for (; i + 48 <= n; i += 48) {
+		uint8x16x3_t const v = vld3q_u8(in + i);
+		uint8x16x4_t r;
+		r.val[0] = vshrq_n_u8(v.val[0], 2);
+		r.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4), vshrq_n_u8(v.val[1], 4)), mask);
+		r.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2), vshrq_n_u8(v.val[2], 6)), mask);
+		r.val[3] = vandq_u8(v.val[2], mask);
+		for (auto & c : r.val) {
+			c = vqtbl4q_u8(table, c);
+		}
+		vst4q_u8(reinterpret_cast<uint8_t*>(out), r);
+		out += 64;
+	}
+	return i;
+}
+
+size_t base64_decode_blocks(unsigned char* out, char const* in, size_t n)
+{
+	size_t i{};
+	for (; i + 64 <= n; i += 64) {
+		uint8x16x4_t c = vld4q_u8(reinterpret_cast<uint8_t const*>(in + i));
+		uint8x16_t valid = vdupq_n_u8(0xff);
+		for (auto & v : c.val) {
+			uint8x16_t const upper = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+			uint8x16_t const lower = vcltq_u8(vsubq_u8(v, vdupq_n_u8('a')), vdupq_n_u8(26));
+			uint8x16_t const digit = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+			uint8x16_t const c62 = vorrq_u8(vceqq_u8(v, vdupq_n_u8('+')), vceqq_u8(v, vdupq_n_u8('-')));
+			uint8x16_t const c63 = vorrq_u8(vceqq_u8(v, vdupq_n_u8('/')), vceqq_u8(v, vdupq_n_u8('_')));
+			valid = vandq_u8(valid, vorrq_u8(vorrq_u8(vorrq_u8(upper, lower), digit), vorrq_u8(c62, c63)));
+			v = vorrq_u8(vorrq_u8(vandq_u8(upper, vsubq_u8(v, vdupq_n_u8('A'))), vandq_u8(lower, vsubq_u8(v, vdupq_n_u8('a' - 26)))),
+				vorrq_u8(vandq_u8(digit, vaddq_u8(v, vdupq_n_u8(52 - '0'))), vorrq_u8(vandq_u8(c62, vdupq_n_u8(62)), vandq_u8(c63, vdupq_n_u8(63)))));
+		}
+		if (vminvq_u8(valid) != 0xff) {
+			break;
+		}
+		uint8x16x3_t r;
+		r.val[0] = vorrq_u8(vshlq_n_u8(c.val[0], 2), vshrq_n_u8(c.val[1], 4));
+		r.val[1] = vorrq_u8(vshlq_n_u8(c.val[1], 4), vshrq_n_u8(c.val[2], 2));
+		r.val[2] = vorrq_u8(vshlq_n_u8(c.val[2], 6), c.val[3]);
+		vst3q_u8(out, r);
+		out += 48;
+	}
+	return i;
+}
+#else
+size_t hex_encode_blocks(char*, unsigned char const*, size_t, bool)
+{
+	return 0;
+}
+
+size_t hex_decode_blocks(unsigned char*, char const*, size_t)
+{
+	return 0;
+}
+
+size_t base64_encode_blocks(char*, unsigned char const*, size_t, bool)
+{
+	return 0;
+}
+
+size_t base64_decode_blocks(unsigned char*, char const*, size_t)
+{
+	return 0;
+}
+#endif
+
+// The block functions may write this much past the decoded data
+size_t const base64_decode_slack = 8;
+
+// Upper bound for the decoded size of n characters, plus those of an incomplete group
+size_t base64_decoded_bound(size_t n)
+{
+	return (n + 3) / 4 * 3 + base64_decode_slack;
+}
+
+char* append_space(std::string & out, size_t n)
+{
+	size_t const old = out.size();
+	out.resize(old + n);
+	return out.data() + old;
+}
+
+char* append_space(fz::buffer & out, size_t n)
+{
+	auto p = out.get(n);
+	out.add(n);
+	return reinterpret_cast<char*>(p);
+}
+}
+
+char* base64_encode_to(char* out, unsigned char const* in, size_t len, base64_type type, bool pad)
+{
+	bool const url = type == base64_type::url;
+	char const* const base64_chars = url ? base64_url_chars : base64_standard_chars;
+
+	size_t pos = base64_encode_blocks(out, in, len, url);
+	out += pos / 3 * 4;
+
+	for (; len - pos >= 3; pos += 3) {
+		auto const c1 = in[pos];
+		auto const c2 = in[pos + 1];
+		auto const c3 = in[pos + 2];
+
+		*out++ = base64_chars[(c1 >> 2) & 0x3fu];
+		*out++ = base64_chars[((c1 & 0x3u) << 4) | ((c2 >> 4) & 0xfu)];
+		*out++ = base64_chars[((c2 & 0xfu) << 2) | ((c3 >> 6) & 0x3u)];
+		*out++ = base64_chars[(c3 & 0x3fu)];
+	}
+	if (pos < len) {
+		auto const c1 = in[pos];
+		*out++ = base64_chars[(c1 >> 2) & 0x3fu];
+		if (len - pos == 2) {
+			auto const c2 = in[pos + 1];
+			*out++ = base64_chars[((c1 & 0x3u) << 4) | ((c2 >> 4) & 0xfu)];
+			*out++ = base64_chars[(c2 & 0xfu) << 2];
 		}
 		else {
-			out += base64_chars[(c1 & 0x3u) << 4];
+			*out++ = base64_chars[(c1 & 0x3u) << 4];
 			if (pad) {
-				out += '=';
+				*out++ = '=';
 			}
 		}
 		if (pad) {
-			out += '=';
+			*out++ = '=';
 		}
 	}
+	return out;
+}
+
+namespace {
+template<typename Out>
+void base64_encode_impl(Out & out, void const* in, size_t len, base64_type type, bool pad)
+{
+	base64_encode_to(append_space(out, base64_encoded_size(len, pad)), static_cast<unsigned char const*>(in), len, type, pad);
 }
 }
 
 std::string base64_encode(std::string_view const& in, base64_type type, bool pad)
 {
 	std::string ret;
-	base64_encode_impl(ret, in, type, pad);
+	base64_encode_impl(ret, in.data(), in.size(), type, pad);
 	return ret;
 }
 
 std::string base64_encode(std::vector<uint8_t> const& in, base64_type type, bool pad)
 {
 	std::string ret;
-	base64_encode_impl(ret, in, type, pad);
+	base64_encode_impl(ret, in.data(), in.size(), type, pad);
 	return ret;
 }
 
 std::string base64_encode(fz::buffer const& in, base64_type type, bool pad)
 {
 	std::string ret;
-	base64_encode_impl(ret, in.to_view(), type, pad);
+	base64_encode_impl(ret, in.get(), in.size(), type, pad);
 	return ret;
 }
 
 void base64_encode_append(std::string& result, std::string_view const& in, base64_type type, bool pad)
 {
-	base64_encode_impl(result, in, type, pad);
+	base64_encode_impl(result, in.data(), in.size(), type, pad);
 }
 
-namespace {
-template<typename Ret, typename View>
-Ret base64_decode_impl(View const& in)
+void base64_encode_append(fz::buffer& result, std::string_view const& in, base64_type type, bool pad)
 {
-	using Unsigned = std::make_unsigned_t<typename View::value_type>;
+	base64_encode_impl(result, in.data(), in.size(), type, pad);
+}
 
-	unsigned char const chars[256] =
-	{
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x80, 0x80, 0xff, 0x80, 0x80, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0x80, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0x3e, 0xff, 0x3f,
-	    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0x40, 0xff, 0xff,
-	    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
-	    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
-	    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
-	    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
-	};
+base64_encoder::base64_encoder(base64_type type, bool pad)
+	: type_(type)
+	, pad_(pad)
+{
+}
 
-	Ret ret;
-	ret.reserve((in.size() / 4) * 3);
+template<typename Out>
+void base64_encoder::do_encode(std::string_view const& in, Out & out)
+{
+	auto p = reinterpret_cast<unsigned char const*>(in.data());
+	size_t n = in.size();
+	if (pending_size_) {
+		while (pending_size_ < 3 && n) {
+			pending_[pending_size_++] = *p++;
+			--n;
+		}
+		if (pending_size_ < 3) {
+			return;
+		}
+		base64_encode_impl(out, pending_, 3, type_, false);
+		pending_size_ = 0;
+	}
 
-	size_t pos{};
-	size_t len = in.size();
+	size_t const whole = n - n % 3;
+	if (whole) {
+		base64_encode_impl(out, p, whole, type_, false);
+	}
+	pending_size_ = n - whole;
+	if (pending_size_) {
+		memcpy(pending_, p + whole, pending_size_);
+	}
+}
 
-	// Trim trailing whitespace
-	while (len && static_cast<Unsigned>(in[len - 1]) <= 255 && chars[static_cast<unsigned char>(in[len - 1])] == 0x80) {
-		--len;
+template<typename Out>
+void base64_encoder::do_finalize(Out & out)
+{
+	if (pending_size_) {
+		base64_encode_impl(out, pending_, pending_size_, type_, pad_);
+		pending_size_ = 0;
+	}
+}
+
+void base64_encoder::encode(std::string_view const& in, std::string & out)
+{
+	do_encode(in, out);
+}
+
+void base64_encoder::encode(std::string_view const& in, fz::buffer & out)
+{
+	do_encode(in, out);
+}
+
+void base64_encoder::finalize(std::string & out)
+{
+	do_finalize(out);
+}
+
+void base64_encoder::finalize(fz::buffer & out)
+{
+	do_finalize(out);
+}
+
+namespace {
+// 0x80 marks whitespace, 0x40 padding and 0xff invalid characters
+unsigned char const base64_values_table[256] =
+{
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x80, 0x80, 0xff, 0x80, 0x80, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x80, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0x3e, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0x40, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+// Decodes a complete group of four values. Padding may only fill the last one or two.
+bool base64_decode_group(unsigned char const (&group)[4], unsigned char *& out, bool & padded)
+{
+	auto const c1 = group[0];
+	auto const c2 = group[1];
+	auto const c3 = group[2];
+	auto const c4 = group[3];
+	if (c1 == 0x40 || c2 == 0x40) {
+		return false;
 	}
 
-	auto next = [&]() {
-		while (pos < len) {
-			auto const u = static_cast<Unsigned>(in[pos++]);
-			unsigned char c = (u <= 255) ? chars[u] : 0xffu;
-			if (c != 0x80u) {
-				return c;
-			}
+	*out++ = (c1 << 2) | ((c2 >> 4) & 0x3);
+	if (c4 == 0x40) {
+		padded = true;
+		if (c3 != 0x40) {
+			*out++ = ((c2 & 0xf) << 4) | ((c3 >> 2) & 0xf);
 		}
-		return static_cast<unsigned char>(0x40u);
+	}
+	else {
+		if (c3 == 0x40) {
+			return false;
+		}
+		*out++ = ((c2 & 0xf) << 4) | ((c3 >> 2) & 0xf);
+		*out++ = ((c3 & 0x3) << 6) | c4;
+	}
+	return true;
+}
+
+// Decodes the input into out, which needs to have room for base64_decoded_bound(in.size()) bytes.
+// Continues the incomplete group from the previous input, if any, and leaves an incomplete
+// group at the end of the input in group for the next call.
+//
+// Whitespace is skipped. Nothing but whitespace may follow a group containing padding.
+template<typename View>
+bool base64_decode_run(View const& in, unsigned char *& out, unsigned char (&group)[4], size_t & size, bool & padded)
+{
+	using Unsigned = std::make_unsigned_t<typename View::value_type>;
+	auto const value = [&in](size_t pos) -> unsigned char {
+		auto const u = static_cast<Unsigned>(in[pos]);
+		return (u <= 255) ? base64_values_table[u] : 0xffu;
 	};
 
-	while (pos < len) {
-		auto c1 = next();
-		auto c2 = next();
-		auto c3 = next();
-		auto c4 = next();
-
-		if (c1 == 0xff || c1 == 0x40 ||
-		    c2 == 0xff || c2 == 0x40 ||
-		    c3 == 0xff || c4 == 0xff)
-		{
-			// Bad input
-			return Ret();
-		}
+	// Work on copies, the compiler cannot know that the output does not alias them
+	unsigned char* o = out;
+	size_t n = size;
 
-		if (c4 == 0x40) {
-			// Pad
-			if (pos < len) {
-				// Not at end of string
-				return Ret();
+	size_t const len = in.size();
+	size_t pos{};
+	bool blocks{true};
+	while (pos < len) {
+		if (!n && !padded) {
+			if constexpr (sizeof(typename View::value_type) == 1) {
+				if (blocks) {
+					size_t const consumed = base64_decode_blocks(o, in.data() + pos, len - pos);
+					pos += consumed;
+					o += consumed / 4 * 3;
+					// Stopped at whitespace, padding or invalid characters. Only whitespace
+					// allows continuing, try again once past it.
+					blocks = false;
+				}
 			}
-			ret.push_back((c1 << 2) | ((c2 >> 4) & 0x3));
 
-			if (c3 != 0x40) {
-				ret.push_back(((c2 & 0xf) << 4) | ((c3 >> 2) & 0xf));
+			// Complete groups without whitespace or padding
+			while (len - pos >= 4) {
+				auto const c1 = value(pos);
+				auto const c2 = value(pos + 1);
+				auto const c3 = value(pos + 2);
+				auto const c4 = value(pos + 3);
+				if ((c1 | c2 | c3 | c4) & 0xc0u) {
+					break;
+				}
+				o[0] = (c1 << 2) | (c2 >> 4);
+				o[1] = ((c2 & 0xf) << 4) | (c3 >> 2);
+				o[2] = ((c3 & 0x3) << 6) | c4;
+				o += 3;
+				pos += 4;
 			}
-		}
-		else {
-			if (c3 == 0x40) {
-				// Bad input
-				return Ret();
+			if (pos == len) {
+				break;
 			}
+		}
 
-			ret.push_back((c1 << 2) | ((c2 >> 4) & 0x3));
-			ret.push_back(((c2 & 0xf) << 4) | ((c3 >> 2) & 0xf));
-			ret.push_back(((c3 & 0x3) << 6) | c4);
+		unsigned char const c = value(pos++);
+		if (c == 0x80u) {
+			blocks = true;
+			continue;
 		}
+		if (c == 0xffu || padded) {
+			out = o;
+			return false;
+		}
+		group[n++] = c;
+		if (n == 4) {
+			n = 0;
+			if (!base64_decode_group(group, o, padded)) {
+				out = o;
+				return false;
+			}
+		}
+	}
+
+	out = o;
+	size = n;
+	return true;
+}
+
+// At the end of input, missing padding is implied
+bool base64_decode_finish(unsigned char *& out, unsigned char (&group)[4], size_t & size, bool & padded)
+{
+	if (!size) {
+		return true;
+	}
+	if (size == 1) {
+		return false;
+	}
+	while (size < 4) {
+		group[size++] = 0x40;
 	}
+	size = 0;
+	return base64_decode_group(group, out, padded);
+}
 
+template<typename Ret, typename View>
+Ret base64_decode_impl(View const& in)
+{
+	Ret ret;
+	ret.resize(base64_decoded_bound(in.size()));
+
+	unsigned char group[4];
+	size_t size{};
+	bool padded{};
+	auto const begin = reinterpret_cast<unsigned char*>(ret.data());
+	auto out = begin;
+	if (!base64_decode_run(in, out, group, size, padded) || !base64_decode_finish(out, group, size, padded)) {
+		return Ret();
+	}
+	ret.resize(static_cast<size_t>(out - begin));
 	return ret;
 }
 }
@@ -200,6 +731,115 @@ std::string base64_decode_s(fz::buffer const& in)
 	return base64_decode_impl<std::string>(in.to_view());
 }
 
+bool base64_decode_append(fz::buffer& result, std::string_view const& in)
+{
+	unsigned char group[4];
+	size_t size{};
+	bool padded{};
+	auto const begin = result.get(base64_decoded_bound(in.size()));
+	auto out = begin;
+	if (!base64_decode_run(in, out, group, size, padded) || !base64_decode_finish(out, group, size, padded)) {
+		return false;
+	}
+	result.add(static_cast<size_t>(out - begin));
+	return true;
+}
+
+bool base64_decoder::decode(std::string_view const& in, fz::buffer & out)
+{
+	if (failed_) {
+		return false;
+	}
+	auto const begin = out.get(base64_decoded_bound(in.size()));
+	auto p = begin;
+	if (!base64_decode_run(in, p, group_, size_, padded_)) {
+		failed_ = true;
+		return false;
+	}
+	out.add(static_cast<size_t>(p - begin));
+	return true;
+}
+
+bool base64_decoder::finalize(fz::buffer & out)
+{
+	bool ret = !failed_;
+	if (ret) {
+		auto const begin = out.get(3);
+		auto p = begin;
+		ret = base64_decode_finish(p, group_, size_, padded_);
+		if (ret) {
+			out.add(static_cast<size_t>(p - begin));
+		}
+	}
+	reset();
+	return ret;
+}
+
+void base64_decoder::reset()
+{
+	size_ = 0;
+	padded_ = false;
+	failed_ = false;
+}
+
+char* hex_encode_to(char* out, unsigned char const* in, size_t len, bool lowercase)
+{
+	size_t const i = hex_encode_blocks(out, in, len, lowercase);
+	out += 2 * i;
+	if (lowercase) {
+		for (size_t j = i; j < len; ++j) {
+			*out++ = int_to_hex_char<char, true>(in[j] >> 4);
+			*out++ = int_to_hex_char<char, true>(in[j] & 0xf);
+		}
+	}
+	else {
+		for (size_t j = i; j < len; ++j) {
+			*out++ = int_to_hex_char<char, false>(in[j] >> 4);
+			*out++ = int_to_hex_char<char, false>(in[j] & 0xf);
+		}
+	}
+	return out;
+}
+
+unsigned char* hex_decode_to(unsigned char* out, char const* in, size_t len)
+{
+	if (len % 2) {
+		return nullptr;
+	}
+	size_t const i = hex_decode_blocks(out, in, len);
+	out += i / 2;
+	for (size_t j = i; j < len; j += 2) {
+		int const high = hex_char_to_int(in[j]);
+		int const low = hex_char_to_int(in[j + 1]);
+		if (high == -1 || low == -1) {
+			return nullptr;
+		}
+		*out++ = static_cast<unsigned char>((high << 4) + low);
+	}
+	return out;
+}
+
+void hex_encode_append(std::string& result, std::string_view const& in, bool lowercase)
+{
+	hex_encode_to(append_space(result, in.size() * 2), reinterpret_cast<unsigned char const*>(in.data()), in.size(), lowercase);
+}
+
+void hex_encode_append(fz::buffer& result, std::string_view const& in, bool lowercase)
+{
+	hex_encode_to(append_space(result, in.size() * 2), reinterpret_cast<unsigned char const*>(in.data()), in.size(), lowercase);
+}
+
+bool hex_decode_append(fz::buffer& result, std::string_view const& in)
+{
+	auto const begin = result.get(in.size() / 2);
+	auto const end = hex_decode_to(begin, in.data(), in.size());
+	if (!end) {
+		return false;
+	}
+	result.add(static_cast<size_t>(end - begin));
+	return true;
+}
+
 
 namespace {
 template<typename DataContainer>
@@ -478,35 +1118,85 @@ std::string base32_decode_s(fz::buffer const& in, base32_type type)
 }
 
 
-std::string percent_encode(std::string_view const& s, bool keep_slashes)
-{
-	std::string ret;
-	ret.reserve(s.size());
+namespace {
+// Characters not needing percent-encoding: 1 for unreserved characters, 2 for the slash
+constexpr auto percent_safe_chars = []() {
+	std::array<unsigned char, 256> ret{};
+	for (unsigned char c = '0'; c <= '9'; ++c) {
+		ret[c] = 1;
+	}
+	for (unsigned char c = 'a'; c <= 'z'; ++c) {
+		ret[c] = 1;
+		ret[c - 'a' + 'A'] = 1;
+	}
+	ret['-'] = 1;
+	ret['.'] = 1;
+	ret['_'] = 1;
+	ret['~'] = 1;
+	ret['/'] = 2;
+	return ret;
+}();
 
-	for (auto const& c : s) {
-		if (!c) {
-			break;
-		}
-		else if ((c >= '0' && c <= '9') ||
-		    (c >= 'a' && c <= 'z') ||
-		    (c >= 'A' && c <= 'Z') ||
-		    c == '-' || c == '.' || c == '_' || c == '~')
-		{
-			ret += c;
+// Writes the encoding of s starting at pos, s.size() + 2 * unsafe bytes in total
+void percent_encode_to(char* out, std::string_view const& s, size_t pos, unsigned char safe)
+{
+	while (pos < s.size()) {
+		size_t run = pos;
+		while (run < s.size() && (percent_safe_chars[static_cast<unsigned char>(s[run])] & safe)) {
+			++run;
 		}
-		else if (c == '/' && keep_slashes) {
-			ret += c;
+		memcpy(out, s.data() + pos, run - pos);
+		out += run - pos;
+		for (pos = run; pos < s.size() && !(percent_safe_chars[static_cast<unsigned char>(s[pos])] & safe); ++pos) {
+			auto const c = static_cast<unsigned char>(s[pos]);
+			*out++ = '%';
+			*out++ = int_to_hex_char<char, false>(c >> 4);
+			*out++ = int_to_hex_char<char, false>(c & 0xf);
 		}
-		else {
-			ret += '%';
-			ret += int_to_hex_char<char, false>(static_cast<unsigned char>(c) >> 4);
-			ret += int_to_hex_char<char, false>(c & 0xf);
+	}
+}
+
+void percent_encode_append_impl(std::string & out, std::string_view s, bool keep_slashes)
+{
+	// Input ends at the first null character
+	s = s.substr(0, s.find('\0'));
+
+	unsigned char const safe = keep_slashes ? 3 : 1;
+	size_t pos{};
+	while (pos < s.size() && (percent_safe_chars[static_cast<unsigned char>(s[pos])] & safe)) {
+		++pos;
+	}
+	if (pos == s.size()) {
+		out += s;
+		return;
+	}
+
+	size_t unsafe{};
+	for (size_t i = pos; i < s.size(); ++i) {
+		if (!(percent_safe_chars[static_cast<unsigned char>(s[i])] & safe)) {
+			++unsafe;
 		}
 	}
 
+	size_t const old = out.size();
+	out.resize(old + s.size() + 2 * unsafe);
+	memcpy(out.data() + old, s.data(), pos);
+	percent_encode_to(out.data() + old + pos, s, pos, safe);
+}
+}
+
+std::string percent_encode(std::string_view const& s, bool keep_slashes)
+{
+	std::string ret;
+	percent_encode_append_impl(ret, s, keep_slashes);
 	return ret;
 }
 
+void percent_encode_append(std::string& result, std::string_view const& s, bool keep_slashes)
+{
+	percent_encode_append_impl(result, s, keep_slashes);
+}
+
 std::string percent_encode(std::wstring_view const& s, bool keep_slashes)
 {
 	return percent_encode(to_utf8(s), keep_slashes);
@@ -518,8 +1208,59 @@ std::wstring percent_encode_w(std::wstring_view const& s, bool keep_slashes)
 }
 
 namespace {
-template<typename Ret, typename View>
-Ret percent_decode_impl(View const & s, bool allow_embedded_null)
+size_t const percent_decode_failed = size_t(-1);
+
+// Returns the decoded size or percent_decode_failed. The output may be the input itself.
+size_t percent_decode_to(char* out, char const* in, size_t len, bool allow_embedded_null)
+{
+	char* const begin = out;
+	char const* const end = in + len;
+	while (in != end) {
+		// Copy everything up to the next percent sign in one go
+		auto const* percent = static_cast<char const*>(memchr(in, '%', static_cast<size_t>(end - in)));
+		size_t const run = static_cast<size_t>((percent ? percent : end) - in);
+		if (!allow_embedded_null && memchr(in, 0, run)) {
+			return percent_decode_failed;
+		}
+		if (out != in) {
+			memmove(out, in, run);
+		}
+		out += run;
+		in += run;
+		if (in == end) {
+			break;
+		}
+
+		if (end - in < 3) {
+			return percent_decode_failed;
+		}
+		int const high = hex_char_to_int(in[1]);
+		int const low = hex_char_to_int(in[2]);
+		if (high == -1 || low == -1 || (!high && !low && !allow_embedded_null)) {
+			return percent_decode_failed;
+		}
+		*out++ = static_cast<char>((high << 4) + low);
+		in += 3;
+	}
+
+	return static_cast<size_t>(out - begin);
+}
+
+template<typename Ret>
+Ret percent_decode_impl(std::string_view const& s, bool allow_embedded_null)
+{
+	Ret ret;
+	ret.resize(s.size());
+	size_t const size = percent_decode_to(reinterpret_cast<char*>(ret.data()), s.data(), s.size(), allow_embedded_null);
+	if (size == percent_decode_failed) {
+		return Ret();
+	}
+	ret.resize(size);
+	return ret;
+}
+
+template<typename Ret>
+Ret percent_decode_impl(std::wstring_view const& s, bool allow_embedded_null)
 {
 	Ret ret;
 	ret.reserve(s.size());
@@ -552,7 +1293,7 @@ Ret percent_decode_impl(View const & s, bool allow_embedded_null)
 			if (!*c && !allow_embedded_null) {
 				return Ret();
 			}
-			using Unsigned = std::make_unsigned_t<typename View::value_type>;
+			using Unsigned = std::make_unsigned_t<wchar_t>;
 			auto const u = static_cast<Unsigned>(*c);
 			if (u > 255) {
 				return Ret();
@@ -586,4 +1327,15 @@ std::string percent_decode_s(std::wstring_view const& s, bool allow_embedded_nul
 	return percent_decode_impl<std::string>(s, allow_embedded_null);
 }
 
+bool percent_decode_inplace(std::string& s, bool allow_embedded_null)
+{
+	size_t const size = percent_decode_to(s.data(), s.data(), s.size(), allow_embedded_null);
+	if (size == percent_decode_failed) {
+		s.clear();
+		return false;
+	}
+	s.resize(size);
+	return true;
+}
+
 }
@@ -1,9 +1,12 @@
 #include "libfilezilla/encryption.hpp"
 
+#include "libfilezilla/buffer.hpp"
 #include "libfilezilla/encode.hpp"
 #include "libfilezilla/hash.hpp"
+#include "libfilezilla/key_derivation.hpp"
 #include "libfilezilla/util.hpp"
 
+#include <algorithm>
 #include <cstring>
 
 #include <nettle/aes.h>
@@ -84,13 +87,23 @@ public_key private_key::pubkey() const
 	return ret;
 }
 
-private_key private_key::from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations)
+namespace {
+std::vector<uint8_t> derive_from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations, key_derivation_cache * cache)
+{
+	if (cache) {
+		return cache->pbkdf2_hmac_sha256(std::basic_string_view<uint8_t>(password.data(), password.size()), std::basic_string_view<uint8_t>(salt.data(), salt.size()), 32, iterations);
+	}
+	return pbkdf2_hmac_sha256(password, salt, 32, iterations);
+}
+}
+
+private_key private_key::from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations, key_derivation_cache * cache)
 {
 	private_key ret;
 
 	if (!password.empty() && salt.size() == salt_size && iterations >= min_iterations) {
 
-		std::vector<uint8_t> key = pbkdf2_hmac_sha256(password, salt, 32, iterations);
+		std::vector<uint8_t> key = derive_from_password(password, salt, iterations, cache);
 		key[0] &= 248;
 		key[31] &= 127;
 		key[31] |= 64;
@@ -342,12 +355,12 @@ symmetric_key symmetric_key::generate()
 	return ret;
 }
 
-symmetric_key symmetric_key::from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations)
+symmetric_key symmetric_key::from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations, key_derivation_cache * cache)
 {
 	symmetric_key ret;
 
 	if (!password.empty() && salt.size() == salt_size && iterations >= min_iterations) {
-		std::vector<uint8_t> key = pbkdf2_hmac_sha256(password, salt, 32, iterations);
+		std::vector<uint8_t> key = derive_from_password(password, salt, iterations, cache);
 		ret.key_ = std::move(key);
 		ret.salt_ = salt;
 	}
@@ -440,42 +453,128 @@ size_t symmetric_key::encryption_overhead()
 	return symmetric_key::salt_size + GCM_DIGEST_SIZE;
 }
 
-std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size)
+size_t symmetric_key::encryption_prefix_size()
 {
-	std::vector<uint8_t> ret;
+	return symmetric_key::salt_size;
+}
 
-	if (key) {
-		// Generate per-message nonce
-		auto nonce = random_bytes(symmetric_key::salt_size);
+namespace {
+// Derive AES256 key and IV from symmetric key and nonce
+void derive_symmetric(symmetric_key const& key, uint8_t const* nonce, gcm_aes256_ctx & ctx)
+{
+	auto const derive = [&](uint8_t type, uint8_t * out, size_t size) {
+		sha256_ctx sha;
+		nettle_sha256_init(&sha);
+		nettle_sha256_update(&sha, key.salt().size(), key.salt().data());
+		nettle_sha256_update(&sha, 1, &type);
+		nettle_sha256_update(&sha, key.key().size(), key.key().data());
+		nettle_sha256_update(&sha, symmetric_key::salt_size, nonce);
+		nettle_sha256_digest(&sha, size, out);
+	};
+
+	uint8_t aes_key[SHA256_DIGEST_SIZE];
+	derive(3, aes_key, sizeof(aes_key));
+	nettle_gcm_aes256_set_key(&ctx, aes_key);
+
+	static_assert(SHA256_DIGEST_SIZE >= GCM_IV_SIZE, "iv too small");
+	uint8_t iv[GCM_IV_SIZE];
+	derive(4, iv, sizeof(iv));
+	nettle_gcm_aes256_set_iv(&ctx, GCM_IV_SIZE, iv);
+}
 
-		// Derive AES2556 key and IV from symmetric key and nonce
-		std::vector<uint8_t> const aes_key = hash_accumulator(hash_algorithm::sha256) << key.salt() << 3 << key.key() << nonce;
-		std::vector<uint8_t> iv = hash_accumulator(hash_algorithm::sha256) << key.salt() << 4 << key.key() << nonce;
-		static_assert(SHA256_DIGEST_SIZE >= GCM_IV_SIZE, "iv too small");
-		iv.resize(GCM_IV_SIZE);
+// Out receives nonce||ciphertext||tag. The plaintext may already be in place.
+void encrypt_symmetric(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t* out, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	// Generate per-message nonce
+	random_bytes(symmetric_key::salt_size, out);
 
-		gcm_aes256_ctx ctx;
-		nettle_gcm_aes256_set_key(&ctx, aes_key.data());
-		nettle_gcm_aes256_set_iv(&ctx, GCM_IV_SIZE, iv.data());
+	gcm_aes256_ctx ctx;
+	derive_symmetric(key, out, ctx);
 
-		if (authenticated_data_size) {
-			nettle_gcm_aes256_update(&ctx, authenticated_data_size, authenticated_data);
-		}
+	if (authenticated_data_size) {
+		nettle_gcm_aes256_update(&ctx, authenticated_data_size, authenticated_data);
+	}
 
-		// Encrypt plaintext with AES256-GCM
-		ret.resize(symmetric_key::salt_size + size + GCM_DIGEST_SIZE);
-		if (size) {
-			nettle_gcm_aes256_encrypt(&ctx, size, ret.data() + symmetric_key::salt_size, plain);
+	// Encrypt plaintext with AES256-GCM
+	if (size) {
+		nettle_gcm_aes256_encrypt(&ctx, size, out + symmetric_key::salt_size, plain);
+	}
+	nettle_gcm_aes256_digest(&ctx, GCM_DIGEST_SIZE, out + symmetric_key::salt_size + size);
+}
+
+// Out receives the plaintext and may point to the ciphertext within the cipher. Size has to include the overhead.
+bool decrypt_symmetric(uint8_t const* cipher, size_t size, symmetric_key const& key, uint8_t* out, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	size_t const message_size = size - symmetric_key::encryption_overhead();
+
+	gcm_aes256_ctx ctx;
+	derive_symmetric(key, cipher, ctx);
+
+	if (authenticated_data_size) {
+		nettle_gcm_aes256_update(&ctx, authenticated_data_size, authenticated_data);
+	}
+
+	// Decrypt ciphertext with AES256-GCM
+	if (message_size) {
+		nettle_gcm_aes256_decrypt(&ctx, message_size, out, cipher + symmetric_key::salt_size);
+	}
+
+	// Last but not least, verify the tag
+	uint8_t tag[GCM_DIGEST_SIZE];
+	nettle_gcm_aes256_digest(&ctx, GCM_DIGEST_SIZE, tag);
+	if (!nettle_memeql_sec(tag, cipher + size - GCM_DIGEST_SIZE, GCM_DIGEST_SIZE)) {
+		// Do not leave unauthenticated plaintext behind
+		if (message_size) {
+			memset(out, 0, message_size);
 		}
+		return false;
+	}
+	return true;
+}
+}
+
+std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	std::vector<uint8_t> ret;
 
+	if (key) {
 		// Return nonce||ciphertext||tag
-		memcpy(ret.data(), nonce.data(), symmetric_key::salt_size);
-		nettle_gcm_aes256_digest(&ctx, GCM_DIGEST_SIZE, ret.data() + symmetric_key::salt_size + size);
+		ret.resize(size + symmetric_key::encryption_overhead());
+		encrypt_symmetric(plain, size, key, ret.data(), authenticated_data, authenticated_data_size);
 	}
 
 	return ret;
 }
 
+bool encrypt_into(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t* out, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	if (!key || !out) {
+		return false;
+	}
+	encrypt_symmetric(plain, size, key, out, authenticated_data, authenticated_data_size);
+	return true;
+}
+
+bool encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, buffer & out, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	if (!key) {
+		return false;
+	}
+	size_t const total = size + symmetric_key::encryption_overhead();
+	encrypt_symmetric(plain, size, key, out.get(total), authenticated_data, authenticated_data_size);
+	out.add(total);
+	return true;
+}
+
+bool encrypt_in_place(uint8_t* data, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	if (!key || !data) {
+		return false;
+	}
+	encrypt_symmetric(data + symmetric_key::salt_size, size, key, data, authenticated_data, authenticated_data_size);
+	return true;
+}
+
 std::vector<uint8_t> encrypt(uint8_t const* plain, size_t size, symmetric_key const& key)
 {
 	return encrypt(plain, size, key, nullptr, 0);
@@ -508,35 +607,8 @@ std::vector<uint8_t> decrypt(uint8_t const* cipher, size_t size, symmetric_key c
 
 	size_t const overhead = symmetric_key::encryption_overhead();
 	if (key && size >= overhead && cipher) {
-		size_t const message_size = size - overhead;
-
-		// Extract per-message nonce from cipher
-		std::basic_string_view<uint8_t> const nonce(cipher, symmetric_key::salt_size);
-
-		// Derive AES2556 key and IV from symmetric key and nonce
-		std::vector<uint8_t> const aes_key = hash_accumulator(hash_algorithm::sha256) << key.salt() << 3 << key.key() << nonce;
-		std::vector<uint8_t> iv = hash_accumulator(hash_algorithm::sha256) << key.salt() << 4 << key.key() << nonce;
-		static_assert(SHA256_DIGEST_SIZE >= GCM_IV_SIZE, "iv too small");
-		iv.resize(GCM_IV_SIZE);
-
-		gcm_aes256_ctx ctx;
-		nettle_gcm_aes256_set_key(&ctx, aes_key.data());
-		nettle_gcm_aes256_set_iv(&ctx, GCM_IV_SIZE, iv.data());
-
-		if (authenticated_data_size) {
-			nettle_gcm_aes256_update(&ctx, authenticated_data_size, authenticated_data);
-		}
-
-		// Decrypt ciphertext with AES256-GCM
-		ret.resize(message_size);
-		if (message_size) {
-			nettle_gcm_aes256_decrypt(&ctx, message_size, ret.data(), cipher + symmetric_key::salt_size);
-		}
-
-		// Last but not least, verify the tag
-		uint8_t tag[GCM_DIGEST_SIZE];
-		nettle_gcm_aes256_digest(&ctx, GCM_DIGEST_SIZE, tag);
-		if (!nettle_memeql_sec(tag, cipher + size - GCM_DIGEST_SIZE, GCM_DIGEST_SIZE)) {
+		ret.resize(size - overhead);
+		if (!decrypt_symmetric(cipher, size, key, ret.data(), authenticated_data, authenticated_data_size)) {
 			ret.clear();
 		}
 	}
@@ -545,6 +617,35 @@ std::vector<uint8_t> decrypt(uint8_t const* cipher, size_t size, symmetric_key c
 	return ret;
 }
 
+bool decrypt_into(uint8_t const* cipher, size_t size, symmetric_key const& key, uint8_t* out, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	if (!key || size < symmetric_key::encryption_overhead() || !cipher || !out) {
+		return false;
+	}
+	return decrypt_symmetric(cipher, size, key, out, authenticated_data, authenticated_data_size);
+}
+
+bool decrypt(uint8_t const* cipher, size_t size, symmetric_key const& key, buffer & out, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	if (!key || size < symmetric_key::encryption_overhead() || !cipher) {
+		return false;
+	}
+	size_t const message_size = size - symmetric_key::encryption_overhead();
+	if (!decrypt_symmetric(cipher, size, key, out.get(message_size), authenticated_data, authenticated_data_size)) {
+		return false;
+	}
+	out.add(message_size);
+	return true;
+}
+
+bool decrypt_in_place(uint8_t* data, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size)
+{
+	if (!key || size < symmetric_key::encryption_overhead() || !data) {
+		return false;
+	}
+	return decrypt_symmetric(data, size, key, data + symmetric_key::salt_size, authenticated_data, authenticated_data_size);
+}
+
 std::vector<uint8_t> decrypt(uint8_t const* cipher, size_t size, symmetric_key const& key)
 {
 	return decrypt(cipher, size, key, nullptr, 0);
@@ -570,4 +671,402 @@ std::vector<uint8_t> decrypt(std::string_view const& cipher, symmetric_key const
 	return decrypt(reinterpret_cast<uint8_t const*>(cipher.data()), cipher.size(), key, reinterpret_cast<uint8_t const*>(authenticated_data.data()), authenticated_data.size());
 }
 
+
+namespace {
+size_t const chunk_size = stream_encryptor::chunk_size;
+size_t const header_size = stream_encryptor::header_size;
+size_t const tag_size = stream_encryptor::tag_size;
+size_t const encrypted_chunk_size = stream_encryptor::encrypted_chunk_size;
+
+static_assert(tag_size == GCM_DIGEST_SIZE, "Wrong tag size");
+
+// AES256-GCM with the per-chunk IVs of the streaming format
+class chunk_cipher final
+{
+public:
+	void init(symmetric_key const& key, uint8_t const* nonce)
+	{
+		std::vector<uint8_t> const aes_key = hash_accumulator(hash_algorithm::sha256) << key.salt() << 5 << key.key() << std::basic_string_view<uint8_t>(nonce, header_size);
+		nettle_gcm_aes256_set_key(&ctx_, aes_key.data());
+	}
+
+	// Writes the ciphertext followed by the tag. Out may be equal to in.
+	void encrypt(uint8_t * out, uint8_t const* in, size_t size, uint64_t index, bool final)
+	{
+		set_iv(index, final);
+		if (size) {
+			nettle_gcm_aes256_encrypt(&ctx_, size, out, in);
+		}
+		nettle_gcm_aes256_digest(&ctx_, tag_size, out + size);
+	}
+
+	// Out may be equal to in
+	bool decrypt(uint8_t * out, uint8_t const* in, size_t size, uint8_t const* tag, uint64_t index, bool final)
+	{
+		set_iv(index, final);
+		if (size) {
+			nettle_gcm_aes256_decrypt(&ctx_, size, out, in);
+		}
+		uint8_t computed[tag_size];
+		nettle_gcm_aes256_digest(&ctx_, tag_size, computed);
+		return nettle_memeql_sec(tag, computed, tag_size);
+	}
+
+private:
+	void set_iv(uint64_t index, bool final)
+	{
+		uint8_t iv[GCM_IV_SIZE]{};
+		for (size_t i = 0; i < 8; ++i) {
+			iv[i] = static_cast<uint8_t>(index >> (56 - i * 8));
+		}
+		iv[11] = final ? 1 : 0;
+		nettle_gcm_aes256_set_iv(&ctx_, GCM_IV_SIZE, iv);
+	}
+
+	gcm_aes256_ctx ctx_;
+};
+}
+
+class stream_encryptor::impl final
+{
+public:
+	explicit impl(symmetric_key const& key)
+		: key_(key)
+	{
+	}
+
+	void init()
+	{
+		if (nonce_.empty()) {
+			nonce_ = random_bytes(header_size);
+			cipher_.init(key_, nonce_.data());
+		}
+	}
+
+	void write_header(buffer & out)
+	{
+		init();
+		if (!header_written_) {
+			out.append(nonce_);
+			header_written_ = true;
+		}
+	}
+
+	void encrypt_chunk(uint8_t const* data, size_t size, bool final, buffer & out)
+	{
+		cipher_.encrypt(out.get(size + tag_size), data, size, index_++, final);
+		out.add(size + tag_size);
+	}
+
+	symmetric_key const key_;
+	std::vector<uint8_t> nonce_;
+	chunk_cipher cipher_;
+	uint64_t index_{};
+
+	// Plaintext not filling a chunk yet
+	buffer pending_;
+
+	bool header_written_{};
+	bool finalized_{};
+};
+
+stream_encryptor::stream_encryptor(symmetric_key const& key)
+	: impl_(std::make_unique<impl>(key))
+{
+}
+
+stream_encryptor::~stream_encryptor()
+{
+}
+
+stream_encryptor::operator bool() const
+{
+	return impl_->key_ && !impl_->finalized_;
+}
+
+uint64_t stream_encryptor::encrypted_size(uint64_t plain_size)
+{
+	return header_size + plain_size + (plain_size / chunk_size + 1) * tag_size;
+}
+
+bool stream_encryptor::encrypt(uint8_t const* data, size_t size, buffer & out)
+{
+	if (!*this) {
+		return false;
+	}
+	impl_->write_header(out);
+
+	auto & pending = impl_->pending_;
+	if (!pending.empty()) {
+		size_t const n = std::min(size, chunk_size - pending.size());
+		pending.append(data, n);
+		data += n;
+		size -= n;
+		if (pending.size() < chunk_size) {
+			return true;
+		}
+		impl_->encrypt_chunk(pending.get(), chunk_size, false, out);
+		pending.clear();
+	}
+
+	while (size >= chunk_size) {
+		impl_->encrypt_chunk(data, chunk_size, false, out);
+		data += chunk_size;
+		size -= chunk_size;
+	}
+
+	if (size) {
+		pending.append(data, size);
+	}
+	return true;
+}
+
+bool stream_encryptor::finalize(buffer & out)
+{
+	if (!*this) {
+		return false;
+	}
+	impl_->write_header(out);
+	impl_->encrypt_chunk(impl_->pending_.get(), impl_->pending_.size(), true, out);
+	impl_->pending_.clear();
+	impl_->finalized_ = true;
+	return true;
+}
+
+bool stream_encryptor::encrypt(buffer & data, bool final)
+{
+	if (!*this) {
+		data.clear();
+		return false;
+	}
+
+	if (!impl_->pending_.empty()) {
+		buffer out;
+		bool const ok = encrypt(data.get(), data.size(), out) && (!final || finalize(out));
+		data.clear();
+		data.append(out);
+		return ok;
+	}
+
+	impl_->init();
+
+	size_t const chunks = data.size() / chunk_size;
+	size_t const rest = data.size() % chunk_size;
+	if (!final && rest) {
+		impl_->pending_.append(data.get() + chunks * chunk_size, rest);
+	}
+
+	size_t const header = impl_->header_written_ ? 0 : static_cast<size_t>(header_size);
+	size_t const in_size = chunks * chunk_size + (final ? rest : 0);
+	size_t const out_size = header + chunks * encrypted_chunk_size + (final ? rest + tag_size : 0);
+	data.resize(in_size);
+	if (out_size > in_size) {
+		data.get(out_size - in_size);
+		data.add(out_size - in_size);
+	}
+
+	// Starting with the last chunk, move each chunk to its final position and encrypt it there.
+	// Chunks only move towards the end, so none gets overwritten before having been moved.
+	uint8_t* p = data.get();
+	uint64_t const first = impl_->index_;
+	if (final) {
+		uint8_t* dest = p + header + chunks * encrypted_chunk_size;
+		memmove(dest, p + chunks * chunk_size, rest);
+		impl_->cipher_.encrypt(dest, dest, rest, first + chunks, true);
+	}
+	for (size_t i = chunks; i--; ) {
+		uint8_t* dest = p + header + i * encrypted_chunk_size;
+		memmove(dest, p + i * chunk_size, chunk_size);
+		impl_->cipher_.encrypt(dest, dest, chunk_size, first + i, false);
+	}
+	if (header) {
+		memcpy(p, impl_->nonce_.data(), header_size);
+		impl_->header_written_ = true;
+	}
+
+	impl_->index_ += chunks + (final ? 1 : 0);
+	impl_->finalized_ = final;
+	return true;
+}
+
+
+class stream_decryptor::impl final
+{
+public:
+	explicit impl(symmetric_key const& key)
+		: key_(key)
+	{
+	}
+
+	void read_header(uint8_t const* nonce)
+	{
+		cipher_.init(key_, nonce);
+		header_read_ = true;
+	}
+
+	// Size includes the tag
+	bool decrypt_chunk(uint8_t const* data, size_t size, bool final, buffer & out)
+	{
+		size_t const plain = size - tag_size;
+		if (!cipher_.decrypt(out.get(plain), data, plain, data + plain, index_++, final)) {
+			failed_ = true;
+			return false;
+		}
+		out.add(plain);
+		return true;
+	}
+
+	symmetric_key const key_;
+	chunk_cipher cipher_;
+	uint64_t index_{};
+
+	// Header or chunk not complete yet
+	buffer pending_;
+
+	bool header_read_{};
+	bool finalized_{};
+	bool failed_{};
+};
+
+stream_decryptor::stream_decryptor(symmetric_key const& key)
+	: impl_(std::make_unique<impl>(key))
+{
+}
+
+stream_decryptor::~stream_decryptor()
+{
+}
+
+stream_decryptor::operator bool() const
+{
+	return impl_->key_ && !impl_->finalized_ && !impl_->failed_;
+}
+
+bool stream_decryptor::decrypt(uint8_t const* data, size_t size, buffer & out)
+{
+	if (!*this) {
+		return false;
+	}
+
+	auto & pending = impl_->pending_;
+	if (!impl_->header_read_) {
+		size_t const n = std::min(size, header_size - pending.size());
+		pending.append(data, n);
+		data += n;
+		size -= n;
+		if (pending.size() < header_size) {
+			return true;
+		}
+		impl_->read_header(pending.get());
+		pending.clear();
+	}
+
+	if (!pending.empty()) {
+		size_t const n = std::min(size, encrypted_chunk_size - pending.size());
+		pending.append(data, n);
+		data += n;
+		size -= n;
+		if (pending.size() < encrypted_chunk_size) {
+			return true;
+		}
+		if (!impl_->decrypt_chunk(pending.get(), encrypted_chunk_size, false, out)) {
+			return false;
+		}
+		pending.clear();
+	}
+
+	// A complete chunk is never the last one, the last chunk is shorter
+	while (size >= encrypted_chunk_size) {
+		if (!impl_->decrypt_chunk(data, encrypted_chunk_size, false, out)) {
+			return false;
+		}
+		data += encrypted_chunk_size;
+		size -= encrypted_chunk_size;
+	}
+
+	if (size) {
+		pending.append(data, size);
+	}
+	return true;
+}
+
+bool stream_decryptor::finalize(buffer & out)
+{
+	if (!*this) {
+		return false;
+	}
+
+	auto & pending = impl_->pending_;
+	if (!impl_->header_read_ || pending.size() < tag_size) {
+		impl_->failed_ = true;
+		return false;
+	}
+	if (!impl_->decrypt_chunk(pending.get(), pending.size(), true, out)) {
+		return false;
+	}
+	pending.clear();
+	impl_->finalized_ = true;
+	return true;
+}
+
+bool stream_decryptor::decrypt(buffer & data, bool final)
+{
+	if (!*this) {
+		data.clear();
+		return false;
+	}
+
+	if (!impl_->header_read_ && impl_->pending_.empty() && data.size() >= header_size) {
+		impl_->read_header(data.get());
+		data.consume(header_size);
+	}
+
+	if (!impl_->header_read_ || !impl_->pending_.empty()) {
+		buffer out;
+		bool const ok = decrypt(data.get(), data.size(), out) && (!final || finalize(out));
+		data.clear();
+		if (ok) {
+			data.append(out);
+		}
+		return ok;
+	}
+
+	size_t const chunks = data.size() / encrypted_chunk_size;
+	size_t const rest = data.size() % encrypted_chunk_size;
+	if (final && rest < tag_size) {
+		impl_->failed_ = true;
+		data.clear();
+		return false;
+	}
+	if (!final && rest) {
+		impl_->pending_.append(data.get() + chunks * encrypted_chunk_size, rest);
+	}
+
+	// Move each chunk towards the start to its final position, then decrypt it there.
+	// The moved ciphertext ends before the tag of the chunk, so the tag remains intact.
+	uint8_t* p = data.get();
+	bool ok = true;
+	for (size_t i = 0; i < chunks && ok; ++i) {
+		uint8_t* dest = p + i * chunk_size;
+		uint8_t const* src = p + i * encrypted_chunk_size;
+		memmove(dest, src, chunk_size);
+		ok = impl_->cipher_.decrypt(dest, dest, chunk_size, src + chunk_size, impl_->index_++, false);
+	}
+	if (ok && final) {
+		size_t const plain = rest - tag_size;
+		uint8_t* dest = p + chunks * chunk_size;
+		uint8_t const* src = p + chunks * encrypted_chunk_size;
+		memmove(dest, src, plain);
+		ok = impl_->cipher_.decrypt(dest, dest, plain, src + plain, impl_->index_++, true);
+	}
+	if (!ok) {
+		impl_->failed_ = true;
+		data.clear();
+		return false;
+	}
+
+	data.resize(chunks * chunk_size + (final ? rest - tag_size : 0));
+	impl_->finalized_ = final;
+	return true;
+}
 }
@@ -2,6 +2,7 @@
 #include "libfilezilla/mutex.hpp"
 
 #include <map>
+#include <vector>
 
 namespace fz {
 
@@ -25,4 +26,232 @@ size_t get_unique_type_id(std::type_info const& id)
 	}
 }
 
+namespace {
+// Size classes are multiples of the granularity, larger events use the global allocator.
+size_t const granularity = 16;
+size_t const size_classes = 16;
+
+// Blocks are moved between a thread's free list and the shared depot in batches.
+size_t const batch_size = 64;
+size_t const cache_limit = 4 * batch_size;
+size_t const depot_limit = 64;
+
+struct free_block final
+{
+	free_block* next_;
+};
+
+class thread_cache;
+
+struct allocator_state final
+{
+	mutex m_{false};
+
+	// Each entry is a chain of exactly batch_size blocks
+	std::vector<free_block*> depot_[size_classes];
+
+	std::vector<thread_cache*> caches_;
+	uint64_t allocations_{};
+	uint64_t cache_hits_{};
+};
+
+allocator_state& state()
+{
+	// Intentionally leaked, events may still get freed during static destruction
+	static allocator_state* s = new allocator_state;
+	return *s;
+}
+
+void free_chain(free_block* b)
+{
+	while (b) {
+		free_block* next = b->next_;
+		::operator delete(b);
+		b = next;
+	}
+}
+
+class thread_cache final
+{
+public:
+	thread_cache();
+	~thread_cache();
+
+	void* allocate(size_t c);
+	void deallocate(void* p, size_t c);
+
+	// Only written by the owning thread, atomic so that they can be read concurrently
+	std::atomic<uint64_t> allocations_{};
+	std::atomic<uint64_t> cache_hits_{};
+
+private:
+	void refill(size_t c);
+	void flush(size_t c);
+
+	free_block* lists_[size_classes]{};
+	size_t counts_[size_classes]{};
+};
+
+thread_local thread_cache* current_cache{};
+thread_local bool cache_destroyed{};
+
+thread_cache* get_cache()
+{
+	if (!current_cache && !cache_destroyed) {
+		static thread_local thread_cache cache;
+		current_cache = &cache;
+	}
+	return current_cache;
+}
+
+thread_cache::thread_cache()
+{
+	auto & s = state();
+	scoped_lock l(s.m_);
+	s.caches_.push_back(this);
+}
+
+thread_cache::~thread_cache()
+{
+	current_cache = nullptr;
+	cache_destroyed = true;
+
+	for (auto * list : lists_) {
+		free_chain(list);
+	}
+
+	auto & s = state();
+	scoped_lock l(s.m_);
+	s.allocations_ += allocations_;
+	s.cache_hits_ += cache_hits_;
+	for (size_t i = 0; i < s.caches_.size(); ++i) {
+		if (s.caches_[i] == this) {
+			s.caches_[i] = s.caches_.back();
+			s.caches_.pop_back();
+			break;
+		}
+	}
+}
+
+void* thread_cache::allocate(size_t c)
+{
+	allocations_.store(allocations_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	if (!lists_[c]) {
+		refill(c);
+		if (!lists_[c]) {
+			return ::operator new((c + 1) * granularity);
+		}
+	}
+
+	cache_hits_.store(cache_hits_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	free_block* b = lists_[c];
+	lists_[c] = b->next_;
+	--counts_[c];
+	return b;
+}
+
+void thread_cache::deallocate(void* p, size_t c)
+{
+	auto * b = static_cast<free_block*>(p);
+	b->next_ = lists_[c];
+	lists_[c] = b;
+	if (++counts_[c] > cache_limit) {
+		flush(c);
+	}
+}
+
+void thread_cache::refill(size_t c)
+{
+	auto & s = state();
+	scoped_lock l(s.m_);
+	if (!s.depot_[c].empty()) {
+		lists_[c] = s.depot_[c].back();
+		counts_[c] = batch_size;
+		s.depot_[c].pop_back();
+	}
+}
+
+void thread_cache::flush(size_t c)
+{
+	free_block* chain = lists_[c];
+	free_block* last = chain;
+	for (size_t i = 1; i < batch_size; ++i) {
+		last = last->next_;
+	}
+	lists_[c] = last->next_;
+	last->next_ = nullptr;
+	counts_[c] -= batch_size;
+
+	auto & s = state();
+	{
+		scoped_lock l(s.m_);
+		if (s.depot_[c].size() < depot_limit) {
+			s.depot_[c].push_back(chain);
+			return;
+		}
+	}
+	free_chain(chain);
+}
+}
+
+void* event_base::operator new(size_t size)
+{
+	size_t const c = size ? (size - 1) / granularity : 0;
+	if (c >= size_classes) {
+		return ::operator new(size);
+	}
+
+	auto * cache = get_cache();
+	if (!cache) {
+		return ::operator new((c + 1) * granularity);
+	}
+	return cache->allocate(c);
+}
+
+void event_base::operator delete(void* p, size_t size) noexcept
+{
+	if (!p) {
+		return;
+	}
+
+	size_t const c = size ? (size - 1) / granularity : 0;
+	if (c >= size_classes) {
+		::operator delete(p);
+		return;
+	}
+
+	auto * cache = get_cache();
+	if (!cache) {
+		::operator delete(p);
+		return;
+	}
+	cache->deallocate(p, c);
+}
+
+void* event_base::operator new(size_t size, std::align_val_t align)
+{
+	return ::operator new(size, align);
+}
+
+void event_base::operator delete(void* p, size_t, std::align_val_t align) noexcept
+{
+	::operator delete(p, align);
+}
+
+event_allocation_stats get_event_allocation_stats()
+{
+	auto & s = state();
+	scoped_lock l(s.m_);
+
+	event_allocation_stats ret;
+	ret.allocations = s.allocations_;
+	ret.cache_hits = s.cache_hits_;
+	for (auto const* c : s.caches_) {
+		ret.allocations += c->allocations_.load(std::memory_order_relaxed);
+		ret.cache_hits += c->cache_hits_.load(std::memory_order_relaxed);
+	}
+	return ret;
+}
+
 }
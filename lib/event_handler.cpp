@@ -6,12 +6,17 @@ namespace fz {
 
 event_handler::event_handler(event_loop& loop)
 	: event_loop_(loop)
+	, loop_(&loop)
 {
+	++loop.handlers_;
 }
 
 event_handler::event_handler(event_handler const& h)
-	: event_loop_(h.event_loop_)
+	: event_loop_(h.get_event_loop())
+	, loop_(&h.get_event_loop())
+	, priority_(h.get_priority())
 {
+	++event_loop_.handlers_;
 }
 
 event_handler::~event_handler()
@@ -21,32 +26,32 @@ event_handler::~event_handler()
 
 void event_handler::remove_handler()
 {
-	event_loop_.remove_handler(this);
+	loop_.load()->remove_handler(this);
 }
 
-timer_id event_handler::add_timer(duration const& interval, bool one_shot)
+timer_id event_handler::add_timer(duration const& interval, bool one_shot, duration const& slack)
 {
-	return event_loop_.add_timer(this, monotonic_clock::now() + interval, one_shot ? duration() : interval);
+	return loop_.load()->add_timer(this, monotonic_clock::now() + interval, one_shot ? duration() : interval, slack);
 }
 
-timer_id event_handler::add_timer(monotonic_clock const& deadline, duration const& interval)
+timer_id event_handler::add_timer(monotonic_clock const& deadline, duration const& interval, duration const& slack)
 {
-	return event_loop_.add_timer(this, deadline, interval);
+	return loop_.load()->add_timer(this, deadline, interval, slack);
 }
 
 void event_handler::stop_timer(timer_id id)
 {
-	event_loop_.stop_timer(id);
+	loop_.load()->stop_timer(this, id);
 }
 
-timer_id event_handler::stop_add_timer(timer_id id, duration const& interval, bool one_shot)
+timer_id event_handler::stop_add_timer(timer_id id, duration const& interval, bool one_shot, duration const& slack)
 {
-	return event_loop_.stop_add_timer(id, this, monotonic_clock::now() + interval, one_shot ? duration() : interval);
+	return loop_.load()->stop_add_timer(id, this, monotonic_clock::now() + interval, one_shot ? duration() : interval, slack);
 }
 
-timer_id event_handler::stop_add_timer(timer_id id, monotonic_clock const& deadline, duration const& interval)
+timer_id event_handler::stop_add_timer(timer_id id, monotonic_clock const& deadline, duration const& interval, duration const& slack)
 {
-	return event_loop_.stop_add_timer(id, this, deadline, interval);
+	return loop_.load()->stop_add_timer(id, this, deadline, interval, slack);
 }
 
 }
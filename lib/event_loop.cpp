@@ -2,8 +2,20 @@
 #include "libfilezilla/event_handler.hpp"
 #include "libfilezilla/thread_pool.hpp"
 #include "libfilezilla/util.hpp"
+#include "tracepoints.hpp"
+
+#include "libfilezilla/logger.hpp"
+
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#else
+#include "libfilezilla/glue/unix.hpp"
+#include <errno.h>
+#include <unistd.h>
+#endif
 
 #include <algorithm>
+#include <chrono>
 
 #ifdef LFZ_EVENT_DEBUG
 #include <assert.h>
@@ -14,33 +26,133 @@
 
 namespace fz {
 
+namespace {
+// A lane with waiting events is served at the latest after this many dispatches from other lanes
+size_t const starvation_limit = 16;
+
+int64_t steady_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Rounds the deadline up to the largest power of two milliseconds not exceeding the slack.
+// Granularities are multiples of each other, so timers with differing slack share deadlines too.
+monotonic_clock apply_slack(monotonic_clock const& deadline, duration const& slack)
+{
+	int64_t const ms = slack.get_milliseconds();
+	if (ms < 2) {
+		return deadline;
+	}
+
+	int64_t granularity = 1;
+	while (granularity <= ms / 2) {
+		granularity *= 2;
+	}
+
+	// Any fixed reference point will do, buckets are relative to it so that
+	// timers in the same bucket get the exact same deadline.
+	static monotonic_clock const epoch = monotonic_clock::now();
+	int64_t const offset = (deadline - epoch).get_milliseconds();
+	int64_t bucket = offset / granularity;
+	if (offset < 0 && offset % granularity) {
+		--bucket;
+	}
+
+	auto ret = epoch + duration::from_milliseconds(bucket * granularity);
+	if (ret < deadline) {
+		ret += duration::from_milliseconds(granularity);
+	}
+	return ret;
+}
+
+// Placeholder node that keeps the queue from ever becoming empty
+class queue_stub_event final : public event_base
+{
+public:
+	virtual size_t derived_type() const override {
+		return static_cast<size_t>(-1);
+	}
+};
+}
+
+struct event_loop::instrumentation final
+{
+	std::unordered_map<size_t, event_type_stats> types_;
+	size_t peak_pending_{};
+	uint64_t slow_{};
+
+	int64_t slow_threshold_ns_{};
+	logger_interface * logger_{};
+};
+
+event_base* event_loop::make_queue_stub()
+{
+	return new queue_stub_event;
+}
+
 event_loop::event_loop()
-	: sync_(false)
+	: sync_(mutex::adaptive)
 	, thread_(std::make_unique<thread>())
 {
 	thread_->run([this] { entry(); });
 }
 
+event_loop::event_loop(thread_placement const& placement)
+	: sync_(mutex::adaptive)
+	, thread_(std::make_unique<thread>())
+{
+	thread_->run([this] { entry(); }, placement);
+}
+
 event_loop::event_loop(thread_pool & pool)
-	: sync_(false)
+	: sync_(mutex::adaptive)
 {
-	task_ = std::make_unique<async_task>(pool.spawn([this] { entry(); }));
+	task_ = std::make_unique<async_task>(pool.spawn([this] { entry(); }, "event loop"));
 }
 
-event_loop::event_loop(event_loop::loop_option)
-	: sync_(false)
+event_loop::event_loop(event_loop::loop_option option)
+	: sync_(mutex::adaptive)
 {
+	if (option == embedded) {
+		embedded_ = true;
+
+		// Nothing processes events until the first wakeup
+		sleeping_ = true;
+#ifdef FZ_WINDOWS
+		wakeup_handle_ = CreateEvent(nullptr, true, false, nullptr);
+#else
+		create_pipe(wakeup_fds_);
+#endif
+	}
 }
 
 event_loop::~event_loop()
 {
 	stop(true);
+
+#ifdef FZ_WINDOWS
+	if (wakeup_handle_) {
+		CloseHandle(wakeup_handle_);
+	}
+#else
+	for (int fd : wakeup_fds_) {
+		if (fd != -1) {
+			::close(fd);
+		}
+	}
+#endif
 }
 
 bool event_loop::running() const
 {
 	scoped_lock lock(sync_);
-	return task_ || thread_ || threadless_;
+	return task_ || thread_ || threadless_ || (embedded_ && !quit_);
+}
+
+bool event_loop::dispatching(event_handler const& handler) const
+{
+	// Both are only modified by the loop's thread itself
+	return thread::own_id() == thread_id_ && active_handler_ == &handler;
 }
 
 void event_loop::send_event(event_handler* handler, event_base* evt)
@@ -48,48 +160,214 @@ void event_loop::send_event(event_handler* handler, event_base* evt)
 	event_assert(handler);
 	event_assert(evt);
 
-	{
+	if (instrumented_.load(std::memory_order_relaxed)) {
+		evt->link_.sent_ = steady_ns();
+	}
+
+	void const* key = evt->coalesce_key();
+	if (key) {
+		// Coalescing events need the index, so they take the lock instead of the lock-free path
 		scoped_lock lock(sync_);
-		if (!handler->removing_) {
-			if (pending_events_.empty()) {
-				cond_.signal(lock);
-			}
-			pending_events_.emplace_back(handler, evt);
+		if (handler->removing_) {
+			lock.unlock();
+			delete evt;
+			return;
+		}
+
+		if (handler->loop_ != this) {
+			// Migrated in the meantime
+			lock.unlock();
+			handler->loop_.load()->send_event(handler, evt);
+			return;
+		}
+
+		auto const [it, inserted] = coalescing_.try_emplace(coalesce_key{handler, evt->derived_type(), key}, evt);
+		if (!inserted) {
+			it->second->merge(*evt);
+			lock.unlock();
+			delete evt;
 			return;
 		}
+
+		evt->link_.handler_ = handler;
+		push_event(evt);
+		if (sleeping_ && sleeping_.exchange(false)) {
+			wakeup(lock);
+		}
+		return;
+	}
+
+	// remove_handler waits for sending_ to drop to zero after setting removing_,
+	// so once it has passed that point, no further events for the handler get queued.
+	++handler->sending_;
+	if (handler->removing_) {
+		--handler->sending_;
+		delete evt;
+		return;
+	}
+	if (handler->loop_ != this) {
+		// migrate waits for sending_ as well after changing loop_
+		--handler->sending_;
+		handler->loop_.load()->send_event(handler, evt);
+		return;
+	}
+
+	evt->link_.handler_ = handler;
+	push_event(evt);
+	--handler->sending_;
+
+	// Only the producer that clears the flag needs to wake up the loop
+	if (sleeping_ && sleeping_.exchange(false)) {
+		scoped_lock lock(sync_);
+		wakeup(lock);
+	}
+}
+
+void event_loop::push_event(event_base* evt)
+{
+	evt->link_.next_ = nullptr;
+	event_base* prev = queue_head_.exchange(evt);
+	prev->link_.next_ = evt;
+}
+
+event_base* event_loop::pop_event()
+{
+	event_base* tail = queue_tail_;
+	event_base* next = tail->link_.next_;
+	if (tail == queue_stub_.get()) {
+		if (!next) {
+			return nullptr;
+		}
+		queue_tail_ = next;
+		tail = next;
+		next = next->link_.next_;
+	}
+
+	if (next) {
+		queue_tail_ = next;
+		return tail;
+	}
+
+	if (tail != queue_head_) {
+		// A producer is in the middle of pushing
+		return nullptr;
+	}
+
+	push_event(queue_stub_.get());
+
+	next = tail->link_.next_;
+	if (next) {
+		queue_tail_ = next;
+		return tail;
+	}
+
+	return nullptr;
+}
+
+void event_loop::drain_queue(scoped_lock &, bool complete)
+{
+	for (;;) {
+		while (event_base* evt = pop_event()) {
+			auto const lane = static_cast<size_t>(evt->link_.handler_->priority_.load(std::memory_order_relaxed));
+			enqueue_event(lane, evt->link_.handler_, evt);
+		}
+
+		if (instrumentation_) {
+			size_t const pending = pending_count();
+			if (instrumentation_->peak_pending_ < pending) {
+				instrumentation_->peak_pending_ = pending;
+			}
+		}
+
+		if (!complete || queue_tail_ == queue_head_) {
+			break;
+		}
+
+		// Some producer has not yet finished linking its event
+		yield();
 	}
+}
+
+void event_loop::enqueue_event(size_t lane, event_handler* handler, event_base* evt)
+{
+	auto & entry = pending_events_[lane].emplace_back(handler, evt);
+	evt->link_.entry_ = &entry;
+	link_event(handler, evt);
+}
 
-	delete evt;
+void event_loop::link_event(event_handler* handler, event_base* evt)
+{
+	evt->link_.handler_prev_ = nullptr;
+	evt->link_.handler_next_ = handler->pending_head_;
+	if (handler->pending_head_) {
+		handler->pending_head_->link_.handler_prev_ = evt;
+	}
+	handler->pending_head_ = evt;
+}
+
+void event_loop::unlink_event(event_handler* handler, event_base* evt)
+{
+	auto & link = evt->link_;
+	if (link.handler_prev_) {
+		link.handler_prev_->link_.handler_next_ = link.handler_next_;
+	}
+	else {
+		handler->pending_head_ = link.handler_next_;
+	}
+	if (link.handler_next_) {
+		link.handler_next_->link_.handler_prev_ = link.handler_prev_;
+	}
+	link.handler_prev_ = nullptr;
+	link.handler_next_ = nullptr;
+	link.entry_ = nullptr;
+}
+
+void event_loop::relink_lane(Events & lane)
+{
+	for (auto & v : lane) {
+		if (v.second) {
+			v.second->link_.entry_ = &v;
+		}
+	}
 }
 
 void event_loop::remove_handler(event_handler* handler)
 {
 	scoped_lock l(sync_);
 
-	handler->removing_ = true;
+	if (!handler->removing_.exchange(true)) {
+		--handlers_;
+	}
+	while (handler->sending_) {
+		yield();
+	}
+	drain_queue(l, true);
 
-	pending_events_.erase(
-		std::remove_if(pending_events_.begin(), pending_events_.end(),
-			[&](Events::value_type const& v) {
-				if (v.first == handler) {
-					delete v.second;
-				}
-				return v.first == handler;
-			}
-		),
-		pending_events_.end()
-	);
-
-	timers_.erase(
-		std::remove_if(timers_.begin(), timers_.end(),
-			[&](timer_data const& v) {
-				return v.handler_ == handler;
+	// Leave tombstones in the lanes instead of searching them
+	for (event_base* evt = handler->pending_head_; evt; ) {
+		event_base* next = evt->link_.handler_next_;
+		auto * entry = evt->link_.entry_;
+		entry->first = nullptr;
+		entry->second = nullptr;
+		++tombstones_;
+		if (!coalescing_.empty()) {
+			unindex_event(handler, evt);
+		}
+		delete evt;
+		evt = next;
+	}
+	handler->pending_head_ = nullptr;
+
+	if (!handler->timers_.empty()) {
+		auto const ids = std::move(handler->timers_);
+		handler->timers_.clear();
+		for (auto const id : ids) {
+			auto it = timer_index_.find(id);
+			if (it != timer_index_.end()) {
+				remove_timer(it->second);
 			}
-		),
-		timers_.end()
-	);
-	if (timers_.empty()) {
-		deadline_ = monotonic_clock();
+		}
+		deadline_ = timers_.empty() ? monotonic_clock() : timers_.front().deadline_;
 	}
 
 	if (active_handler_ == handler) {
@@ -103,25 +381,121 @@ void event_loop::remove_handler(event_handler* handler)
 	}
 }
 
+bool event_loop::migrate(event_handler & handler, event_loop & target)
+{
+	if (&target == this) {
+		return true;
+	}
+
+	// Lock both loops in a consistent order
+	scoped_lock l(this < &target ? sync_ : target.sync_);
+	scoped_lock tl(this < &target ? target.sync_ : sync_);
+
+	if (handler.loop_ != this || handler.removing_ || active_handler_ == &handler) {
+		return false;
+	}
+	if (!handler.timers_.empty()) {
+		// Timer ids are only unique within a loop
+		return false;
+	}
+
+	// From here on, new events and timers go to the target loop. Events already
+	// being sent to this loop get moved along with the other pending events.
+	handler.loop_ = &target;
+	while (handler.sending_) {
+		yield();
+	}
+	scoped_lock & own = this < &target ? l : tl;
+	drain_queue(own, true);
+
+	// The target loop cannot have drained any event for the handler yet, as it has been
+	// locked the whole time. Appending them keeps them ahead of all newer ones.
+	bool moved{};
+	for (size_t i = 0; i < priority_count; ++i) {
+		auto & lane = pending_events_[i];
+		lane.erase(
+			std::remove_if(lane.begin(), lane.end(),
+				[&](Events::value_type const& v) {
+					if (v.first != &handler) {
+						return false;
+					}
+					if (!coalescing_.empty()) {
+						unindex_event(v.first, v.second);
+					}
+					void const* key = v.second->coalesce_key();
+					if (key) {
+						target.coalescing_.try_emplace(coalesce_key{v.first, v.second->derived_type(), key}, v.second);
+					}
+					auto & entry = target.pending_events_[i].emplace_back(v);
+					v.second->link_.entry_ = &entry;
+					moved = true;
+					return true;
+				}
+			),
+			lane.end()
+		);
+		relink_lane(lane);
+	}
+
+	--handlers_;
+	++target.handlers_;
+
+	if (moved && target.sleeping_.exchange(false)) {
+		target.wakeup(this < &target ? tl : l);
+	}
+
+	return true;
+}
+
 void event_loop::filter_events(std::function<bool(Events::value_type &)> const& filter)
 {
 	scoped_lock l(sync_);
 
-	pending_events_.erase(
-		std::remove_if(pending_events_.begin(), pending_events_.end(),
-			[&](Events::value_type & v) {
-				bool const remove = filter(v);
-				if (remove) {
-					delete v.second;
+	drain_queue(l, true);
+
+	// Events passed to another handler stay in their lane. Tombstones get dropped along the way.
+	for (auto & lane : pending_events_) {
+		lane.erase(
+			std::remove_if(lane.begin(), lane.end(),
+				[&](Events::value_type & v) {
+					if (!v.first) {
+						return true;
+					}
+					event_handler* const old_handler = v.first;
+					bool const remove = filter(v);
+					if (remove || v.first != old_handler) {
+						unlink_event(old_handler, v.second);
+						if (!remove) {
+							link_event(v.first, v.second);
+						}
+					}
+					if (!coalescing_.empty()) {
+						if (remove || v.first != old_handler) {
+							unindex_event(old_handler, v.second);
+						}
+						if (!remove && v.first != old_handler) {
+							void const* key = v.second->coalesce_key();
+							if (key) {
+								// If the new handler already has a matching event queued, this one
+								// simply stays unindexed and gets dispatched separately.
+								coalescing_.try_emplace(coalesce_key{v.first, v.second->derived_type(), key}, v.second);
+							}
+						}
+					}
+					if (remove) {
+						delete v.second;
+					}
+					return remove;
 				}
-				return remove;
-			}
-		),
-		pending_events_.end()
-	);
+			),
+			lane.end()
+		);
+		relink_lane(lane);
+	}
+	tombstones_ = 0;
 }
 
-timer_id event_loop::add_timer(event_handler* handler, monotonic_clock const &deadline, duration const& interval)
+timer_id event_loop::add_timer(event_handler* handler, monotonic_clock const &deadline, duration const& interval, duration const& slack)
 {
 	timer_id id = 0;
 	
@@ -129,111 +503,326 @@ timer_id event_loop::add_timer(event_handler* handler, monotonic_clock const &de
 		timer_data d;
 
 		scoped_lock lock(sync_);
-		
-		id = setup_timer(lock, d, handler, deadline, interval);
+		if (handler->loop_ != this) {
+			lock.unlock();
+			return handler->loop_.load()->add_timer(handler, deadline, interval, slack);
+		}
+
+		id = setup_timer(lock, d, handler, deadline, interval, slack);
 
 		if (id) {
-			timers_.push_back(std::move(d));
+			push_timer(std::move(d));
+			update_deadline(lock);
 		}
 	}
 	
 	return id;
 }
 
-void event_loop::stop_timer(timer_id id)
+void event_loop::stop_timer(event_handler* handler, timer_id id)
 {
 	if (id) {
 		scoped_lock lock(sync_);
-		for (auto it = timers_.begin(); it != timers_.end(); ++it) {
-			if (it->id_ == id) {
-				if (&*it != &timers_.back()) {
-					*it = std::move(timers_.back());
-				}
-				timers_.pop_back();
-
-				if (timers_.empty()) {
-					deadline_ = monotonic_clock();
-				}
-				break;
-			}
+		if (handler->loop_ != this) {
+			lock.unlock();
+			handler->loop_.load()->stop_timer(handler, id);
+			return;
+		}
+		auto it = timer_index_.find(id);
+		if (it != timer_index_.end() && timers_[it->second].handler_ == handler) {
+			remove_timer(it->second);
+			update_deadline(lock);
 		}
 	}
 }
 
-timer_id event_loop::stop_add_timer(timer_id id, event_handler* handler, monotonic_clock const &deadline, duration const& interval)
+timer_id event_loop::stop_add_timer(timer_id id, event_handler* handler, monotonic_clock const &deadline, duration const& interval, duration const& slack)
 {
 	scoped_lock lock(sync_);
-	
+	if (handler->loop_ != this) {
+		lock.unlock();
+		return handler->loop_.load()->stop_add_timer(id, handler, deadline, interval, slack);
+	}
+
 	if (id) {
-		for (auto it = timers_.begin(); it != timers_.end(); ++it) {
-			if (it->id_ == id) {
-				return setup_timer(lock, *it, handler, deadline, interval);
+		auto it = timer_index_.find(id);
+		if (it != timer_index_.end() && timers_[it->second].handler_ == handler) {
+			size_t const pos = it->second;
+			id = setup_timer(lock, timers_[pos], handler, deadline, interval, slack);
+			if (id) {
+				handler->timers_[timers_[pos].handler_pos_] = id;
+				timer_index_.erase(it);
+				timer_index_[id] = pos;
+				sift_timer(pos);
+				update_deadline(lock);
 			}
+			return id;
 		}
 	}
 
 	timer_data d;
 
-	id = setup_timer(lock, d, handler, deadline, interval);
+	id = setup_timer(lock, d, handler, deadline, interval, slack);
 
 	if (id) {
-		timers_.push_back(std::move(d));
+		push_timer(std::move(d));
+		update_deadline(lock);
 	}
 
 	return id;
 }
 
-timer_id event_loop::setup_timer(scoped_lock &lock, timer_data &d, event_handler* handler,  monotonic_clock const& deadline, duration const& interval)
+timer_id event_loop::setup_timer(scoped_lock &, timer_data &d, event_handler* handler,  monotonic_clock const& deadline, duration const& interval, duration const& slack)
 {
 	if (handler->removing_) {
 		return 0;
 	}
 
 	d.interval_ = interval;
-	d.deadline_ = deadline;
+	d.slack_ = slack;
+	d.deadline_ = apply_slack(deadline, slack);
 	d.handler_ = handler;
 	d.id_ = ++next_timer_id_; // 64bit, can this really ever overflow?
 
-	if (!deadline_ || d.deadline_ < deadline_) {
-		// Our new time is the next timer to trigger
-		deadline_ = d.deadline_;
-		cond_.signal(lock);
+	return d.id_;
+}
+
+void event_loop::update_deadline(scoped_lock & lock)
+{
+	if (timers_.empty()) {
+		deadline_ = monotonic_clock();
+		return;
 	}
 
-	return d.id_;
+	auto const& next = timers_.front().deadline_;
+	if (!deadline_ || next < deadline_) {
+		// Our new time is the next timer to trigger. While an embedded loop is processing,
+		// the host picks up the new deadline once done.
+		if (!processing_) {
+			wakeup(lock);
+		}
+	}
+	deadline_ = next;
+}
+
+void event_loop::push_timer(timer_data && d)
+{
+	size_t const pos = timers_.size();
+	d.handler_pos_ = d.handler_->timers_.size();
+	d.handler_->timers_.push_back(d.id_);
+	timer_index_[d.id_] = pos;
+	timers_.push_back(std::move(d));
+	sift_timer_up(pos);
+}
+
+void event_loop::remove_timer(size_t pos)
+{
+	// Swap-and-pop from the handler's list. It is empty if the handler is being removed.
+	auto & ids = timers_[pos].handler_->timers_;
+	size_t const handler_pos = timers_[pos].handler_pos_;
+	if (handler_pos < ids.size()) {
+		if (handler_pos + 1 != ids.size()) {
+			ids[handler_pos] = ids.back();
+			timers_[timer_index_[ids[handler_pos]]].handler_pos_ = handler_pos;
+		}
+		ids.pop_back();
+	}
+
+	timer_index_.erase(timers_[pos].id_);
+
+	size_t const last = timers_.size() - 1;
+	if (pos != last) {
+		timers_[pos] = std::move(timers_[last]);
+		timer_index_[timers_[pos].id_] = pos;
+		timers_.pop_back();
+		sift_timer(pos);
+	}
+	else {
+		timers_.pop_back();
+	}
+}
+
+void event_loop::sift_timer(size_t pos)
+{
+	if (!sift_timer_up(pos)) {
+		sift_timer_down(pos);
+	}
+}
+
+bool event_loop::sift_timer_up(size_t pos)
+{
+	size_t const orig = pos;
+	while (pos) {
+		size_t const parent = (pos - 1) / 2;
+		if (!(timers_[pos].deadline_ < timers_[parent].deadline_)) {
+			break;
+		}
+		swap_timers(pos, parent);
+		pos = parent;
+	}
+	return pos != orig;
+}
+
+void event_loop::sift_timer_down(size_t pos)
+{
+	size_t const size = timers_.size();
+	for (;;) {
+		size_t smallest = pos;
+		size_t const left = pos * 2 + 1;
+		size_t const right = left + 1;
+		if (left < size && timers_[left].deadline_ < timers_[smallest].deadline_) {
+			smallest = left;
+		}
+		if (right < size && timers_[right].deadline_ < timers_[smallest].deadline_) {
+			smallest = right;
+		}
+		if (smallest == pos) {
+			break;
+		}
+		swap_timers(pos, smallest);
+		pos = smallest;
+	}
+}
+
+void event_loop::swap_timers(size_t a, size_t b)
+{
+	std::swap(timers_[a], timers_[b]);
+	timer_index_[timers_[a].id_] = a;
+	timer_index_[timers_[b].id_] = b;
+}
+
+void event_loop::unindex_event(event_handler* handler, event_base* evt)
+{
+	void const* key = evt->coalesce_key();
+	if (!key) {
+		return;
+	}
+
+	auto it = coalescing_.find(coalesce_key{handler, evt->derived_type(), key});
+	if (it != coalescing_.end() && it->second == evt) {
+		coalescing_.erase(it);
+	}
 }
 
 bool event_loop::process_event(scoped_lock & l)
 {
-	Events::value_type ev{};
+	// Always pick up newly sent events, they may be of higher priority
+	drain_queue(l, false);
 
-	if (pending_events_.empty()) {
+	size_t const lane = next_lane();
+	if (lane == priority_count) {
 		return false;
 	}
-	ev = pending_events_.front();
-	pending_events_.pop_front();
+
+	Events::value_type const ev = pending_events_[lane].front();
+	pending_events_[lane].pop_front();
+	unlink_event(ev.first, ev.second);
 
 	event_assert(ev.first);
 	event_assert(ev.second);
 	event_assert(!ev.first->removing_);
 
+	// Once dispatch begins, further events must no longer be merged into this one
+	if (!coalescing_.empty()) {
+		unindex_event(ev.first, ev.second);
+	}
+
 	active_handler_ = ev.first;
 
-	l.unlock();
-	(*ev.first)(*ev.second);
-	delete ev.second;
-	l.lock();
+	FZ_TRACE3(event_dispatch, this, ev.first, ev.second->derived_type());
+
+	bool const bulk = lane == static_cast<size_t>(event_priority::bulk);
+	int64_t const bulk_start = bulk ? steady_ns() : 0;
+
+	if (instrumented_) {
+		size_t const type = ev.second->derived_type();
+		int64_t const sent = ev.second->link_.sent_;
+		int64_t const start = steady_ns();
+
+		l.unlock();
+		(*ev.first)(*ev.second);
+		delete ev.second;
+		l.lock();
+
+		record_dispatch(l, ev.first, type, sent, start);
+	}
+	else {
+		l.unlock();
+		(*ev.first)(*ev.second);
+		delete ev.second;
+		l.lock();
+	}
 
 	active_handler_ = nullptr;
 
+	if (bulk) {
+		bulk_ns_ += steady_ns() - bulk_start;
+		if (bulk_ns_ >= bulk_budget_ns_) {
+			bulk_ns_ = 0;
+			recheck_ = true;
+		}
+	}
+
 	return true;
 }
 
+size_t event_loop::next_lane()
+{
+	if (tombstones_) {
+		for (auto & l : pending_events_) {
+			while (!l.empty() && !l.front().first) {
+				l.pop_front();
+				--tombstones_;
+			}
+		}
+	}
+
+	size_t lane = priority_count;
+	for (size_t i = 0; i < priority_count; ++i) {
+		if (pending_events_[i].empty()) {
+			continue;
+		}
+		if (lane == priority_count) {
+			lane = i;
+		}
+		else if (passed_over_[i] >= starvation_limit) {
+			lane = i;
+			break;
+		}
+	}
+
+	if (lane != priority_count) {
+		for (size_t i = 0; i < priority_count; ++i) {
+			if (i != lane && !pending_events_[i].empty()) {
+				++passed_over_[i];
+			}
+		}
+		passed_over_[lane] = 0;
+	}
+
+	return lane;
+}
+
+size_t event_loop::pending_count() const
+{
+	size_t ret{};
+	for (auto const& lane : pending_events_) {
+		ret += lane.size();
+	}
+	return ret - tombstones_;
+}
+
+void event_loop::set_bulk_budget(duration const& budget)
+{
+	scoped_lock l(sync_);
+	bulk_budget_ns_ = budget.get_milliseconds() * 1000000;
+}
+
 void event_loop::run()
 {
 	{
 		scoped_lock l(sync_);
-		if (threadless_ || task_ || thread_ || thread_id_ != thread::id()) {
+		if (threadless_ || embedded_ || task_ || thread_ || thread_id_ != thread::id()) {
 			return;
 		}
 		threadless_ = true;
@@ -251,95 +840,322 @@ void event_loop::entry()
 {
 	thread_id_ = thread::own_id();
 
-	monotonic_clock now;
+	// Once the precise clock has been read, all timers due at that time fire
+	// before waiting again, even while the coarse clock lags behind.
+	monotonic_clock due;
 
 	scoped_lock l(sync_);
 	while (!quit_) {
-		if (process_timers(l, now)) {
+		if (recheck_) {
+			// Bulk events have used up their budget
+			recheck_ = false;
+			due = monotonic_clock::now();
+		}
+
+		// While busy with events, timers get checked once per event. The coarse
+		// clock is good enough for that, it never runs ahead of the precise one.
+		auto const coarse = monotonic_clock::coarse_now();
+		if (process_timers(l, coarse < due ? due : coarse)) {
 			continue;
 		}
 		if (process_event(l)) {
 			continue;
 		}
 
-		// Nothing to do, now we wait
+		// Nothing to do, now we wait. Producers only signal if they
+		// observe sleeping_, so check the queue once more after setting it.
+		sleeping_ = true;
+		drain_queue(l, false);
+		if (pending_count()) {
+			sleeping_ = false;
+			continue;
+		}
+
 		if (deadline_) {
+			// The coarse clock may lag behind, don't wait for nothing
+			auto const now = monotonic_clock::now();
+			if (now >= deadline_) {
+				sleeping_ = false;
+				due = now;
+				process_timers(l, now);
+				continue;
+			}
 			cond_.wait(l, deadline_ - now);
 		}
 		else {
 			cond_.wait(l);
 		}
+		sleeping_ = false;
 	}
 }
 
-bool event_loop::process_timers(scoped_lock & l, monotonic_clock & now)
+void event_loop::wakeup(scoped_lock & l)
+{
+	cond_.signal(l);
+
+	if (!embedded_ || wakeup_pending_) {
+		return;
+	}
+	wakeup_pending_ = true;
+
+#ifdef FZ_WINDOWS
+	if (wakeup_handle_) {
+		SetEvent(wakeup_handle_);
+	}
+#else
+	if (wakeup_fds_[1] != -1) {
+		char const c = 0;
+		int res;
+		do {
+			res = ::write(wakeup_fds_[1], &c, 1);
+		} while (res == -1 && errno == EINTR);
+	}
+#endif
+}
+
+#ifdef FZ_WINDOWS
+void* event_loop::wakeup_handle() const
+{
+	return wakeup_handle_;
+}
+#else
+int event_loop::wakeup_fd() const
+{
+	return wakeup_fds_[0];
+}
+#endif
+
+size_t event_loop::process(size_t max_dispatches)
+{
+	scoped_lock l(sync_);
+	if (!embedded_ || quit_ || processing_) {
+		return 0;
+	}
+
+	if (wakeup_pending_) {
+		wakeup_pending_ = false;
+#ifdef FZ_WINDOWS
+		ResetEvent(wakeup_handle_);
+#else
+		char c;
+		int res;
+		do {
+			res = ::read(wakeup_fds_[0], &c, 1);
+		} while (res == -1 && errno == EINTR);
+#endif
+	}
+
+	thread_id_ = thread::own_id();
+	processing_ = true;
+	sleeping_ = false;
+
+	// See entry
+	monotonic_clock due;
+
+	size_t dispatched{};
+	while (!quit_ && (!max_dispatches || dispatched < max_dispatches)) {
+		if (recheck_) {
+			recheck_ = false;
+			due = monotonic_clock::now();
+		}
+
+		auto const coarse = monotonic_clock::coarse_now();
+		if (process_timers(l, coarse < due ? due : coarse) || process_event(l)) {
+			++dispatched;
+			continue;
+		}
+
+		// Same as in entry, producers that do not see sleeping_ set have
+		// their events picked up here.
+		sleeping_ = true;
+		drain_queue(l, false);
+		if (pending_count()) {
+			sleeping_ = false;
+			continue;
+		}
+
+		// The coarse clock may lag behind
+		if (deadline_) {
+			auto const now = monotonic_clock::now();
+			if (now >= deadline_) {
+				sleeping_ = false;
+				due = now;
+				process_timers(l, now);
+				++dispatched;
+				continue;
+			}
+		}
+		break;
+	}
+
+	processing_ = false;
+	if (!sleeping_ && !quit_) {
+		// Stopped early, there's more to do
+		wakeup(l);
+	}
+
+	return dispatched;
+}
+
+monotonic_clock event_loop::next_deadline() const
+{
+	scoped_lock l(sync_);
+	return deadline_;
+}
+
+bool event_loop::process_timers(scoped_lock & l, monotonic_clock const& now)
 {
 	if (!deadline_) {
 		// There's no deadline
 		return false;
 	}
 
-	now = monotonic_clock::now();
 	if (now < deadline_) {
 		// Deadline has not yet expired
 		return false;
 	}
 
-	// Update deadline_, stop at first expired timer
-	deadline_ = monotonic_clock();
-	auto it = timers_.begin();
-	for (; it != timers_.end(); ++it) {
-		if (!deadline_ || it->deadline_ < deadline_) {
-			if (it->deadline_ <= now) {
-				break;
-			}
-			deadline_ = it->deadline_;
-		}
+	// Interval timers get rescheduled relative to the precise time
+	auto const precise = monotonic_clock::now();
+
+	// The earliest timer is at the top of the heap and has expired
+	auto & top = timers_.front();
+	event_handler *const handler = top.handler_;
+	auto const id = top.id_;
+	monotonic_clock const expired = top.deadline_;
+
+	// Update the expired timer
+	if (!top.interval_) {
+		// Remove one-shot timer
+		remove_timer(0);
+	}
+	else {
+		top.deadline_ = apply_slack(precise + top.interval_, top.slack_);
+		sift_timer_down(0);
 	}
+	deadline_ = timers_.empty() ? monotonic_clock() : timers_.front().deadline_;
 
-	if (it != timers_.end()) {
-		// 'it' is now expired
-		// deadline_ has been updated with prior timers
-		// go through remaining elements to update deadline_
-		for (auto it2 = std::next(it); it2 != timers_.end(); ++it2) {
-			if (!deadline_ || it2->deadline_ < deadline_) {
-				deadline_ = it2->deadline_;
-			}
-		}
+	// Call event handler
+	event_assert(!handler->removing_);
 
-		event_handler *const handler = it->handler_;
-		auto const id = it->id_;
+	active_handler_ = handler;
 
-		// Update the expired timer
-		if (!it->interval_) {
-			// Remove one-shot timer
-			if (&*it != &timers_.back()) {
-				*it = std::move(timers_.back());
-			}
-			timers_.pop_back();
-		}
-		else {
-			it->deadline_ = now + it->interval_;
-			if (!deadline_ || it->deadline_ < deadline_) {
-				deadline_ = it->deadline_;
-			}
-		}
+	FZ_TRACE3(timer_fire, this, handler, id);
 
-		// Call event handler
-		event_assert(!handler->removing_);
+	if (instrumented_) {
+		// For timers, the queueing delay is the time since the deadline
+		int64_t const start = steady_ns();
+		int64_t const sent = start - (precise - expired).get_milliseconds() * 1000000;
 
-		active_handler_ = handler;
+		l.unlock();
+		(*handler)(timer_event(id));
+		l.lock();
 
+		record_dispatch(l, handler, timer_event::type(), sent, start);
+	}
+	else {
 		l.unlock();
 		(*handler)(timer_event(id));
 		l.lock();
+	}
 
-		active_handler_ = nullptr;
+	active_handler_ = nullptr;
 
-		return true;
+	return true;
+}
+
+void latency_histogram::add(uint64_t us)
+{
+	size_t bucket = 0;
+	while (bucket + 1 < bucket_count && (uint64_t(1) << bucket) <= us) {
+		++bucket;
+	}
+	++buckets[bucket];
+	++count;
+	total_us += us;
+	if (us > max_us) {
+		max_us = us;
+	}
+}
+
+uint64_t latency_histogram::percentile(double p) const
+{
+	if (!count) {
+		return 0;
+	}
+
+	uint64_t const rank = static_cast<uint64_t>(p * static_cast<double>(count - 1));
+	uint64_t seen{};
+	for (size_t i = 0; i < bucket_count; ++i) {
+		seen += buckets[i];
+		if (seen > rank) {
+			return i + 1 < bucket_count ? (uint64_t(1) << i) : max_us;
+		}
+	}
+	return max_us;
+}
+
+void event_loop::enable_instrumentation(bool enable, duration const& slow_threshold, logger_interface * logger)
+{
+	scoped_lock l(sync_);
+	if (enable) {
+		if (!instrumentation_) {
+			instrumentation_ = std::make_unique<instrumentation>();
+		}
+		instrumentation_->slow_threshold_ns_ = logger ? slow_threshold.get_milliseconds() * 1000000 : 0;
+		instrumentation_->logger_ = logger;
+	}
+	else if (instrumentation_) {
+		instrumentation_->slow_threshold_ns_ = 0;
+		instrumentation_->logger_ = nullptr;
+	}
+	instrumented_ = enable;
+}
+
+event_loop_stats event_loop::get_stats() const
+{
+	event_loop_stats ret;
+
+	scoped_lock l(sync_);
+	ret.pending = pending_count();
+	if (instrumentation_) {
+		ret.peak_pending = instrumentation_->peak_pending_;
+		ret.slow = instrumentation_->slow_;
+		ret.types.insert(instrumentation_->types_.begin(), instrumentation_->types_.end());
+	}
+	return ret;
+}
+
+void event_loop::reset_stats()
+{
+	scoped_lock l(sync_);
+	if (instrumentation_) {
+		instrumentation_->types_.clear();
+		instrumentation_->peak_pending_ = pending_count();
+		instrumentation_->slow_ = 0;
+	}
+}
+
+void event_loop::record_dispatch(scoped_lock & l, event_handler* handler, size_t type, int64_t sent, int64_t start)
+{
+	int64_t const end = steady_ns();
+	int64_t const run = end - start;
+
+	auto & stats = instrumentation_->types_[type];
+	stats.run_time.add(static_cast<uint64_t>(run / 1000));
+	if (sent && sent <= start) {
+		stats.queue_delay.add(static_cast<uint64_t>((start - sent) / 1000));
 	}
 
-	return false;
+	if (instrumentation_->slow_threshold_ns_ > 0 && run > instrumentation_->slow_threshold_ns_) {
+		++instrumentation_->slow_;
+
+		// Do not call into the logger with the loop locked
+		auto * logger = instrumentation_->logger_;
+		l.unlock();
+		logger->log(logmsg::debug_warning, L"Event handler %p took %d us to process event of type %d", static_cast<void*>(handler), run / 1000, type);
+		l.lock();
+	}
 }
 
 void event_loop::stop(bool join)
@@ -347,7 +1163,7 @@ void event_loop::stop(bool join)
 	{
 		scoped_lock l(sync_);
 		quit_ = true;
-		cond_.signal(l);
+		wakeup(l);
 	}
 
 	if (join) {
@@ -355,12 +1171,24 @@ void event_loop::stop(bool join)
 		task_.reset();
 
 		scoped_lock lock(sync_);
-		for (auto & v : pending_events_) {
-			delete v.second;
+		drain_queue(lock, true);
+		for (auto & lane : pending_events_) {
+			for (auto & v : lane) {
+				if (v.first) {
+					v.first->pending_head_ = nullptr;
+				}
+				delete v.second;
+			}
+			lane.clear();
 		}
-		pending_events_.clear();
+		tombstones_ = 0;
+		coalescing_.clear();
 
+		for (auto & t : timers_) {
+			t.handler_->timers_.clear();
+		}
 		timers_.clear();
+		timer_index_.clear();
 		deadline_ = monotonic_clock();
 	}
 }
@@ -0,0 +1,76 @@
+#include "libfilezilla/event_loop_group.hpp"
+#include "libfilezilla/event_handler.hpp"
+
+#include <thread>
+
+namespace fz {
+
+namespace {
+size_t loop_count(size_t loops)
+{
+	if (!loops) {
+		loops = std::thread::hardware_concurrency();
+		if (!loops) {
+			loops = 1;
+		}
+	}
+	return loops;
+}
+}
+
+event_loop_group::event_loop_group(size_t loops, policy p)
+	: policy_(p)
+{
+	loops = loop_count(loops);
+	for (size_t i = 0; i < loops; ++i) {
+		loops_.emplace_back(std::make_unique<event_loop>());
+	}
+}
+
+event_loop_group::event_loop_group(thread_pool & pool, size_t loops, policy p)
+	: policy_(p)
+{
+	loops = loop_count(loops);
+	for (size_t i = 0; i < loops; ++i) {
+		loops_.emplace_back(std::make_unique<event_loop>(pool));
+	}
+}
+
+event_loop_group::~event_loop_group()
+{
+}
+
+event_loop & event_loop_group::assign()
+{
+	if (policy_ == policy::least_loaded) {
+		// Ties are broken round-robin so that a burst of new handlers gets spread out
+		size_t const start = next_++;
+		size_t best = start % loops_.size();
+		for (size_t i = 1; i < loops_.size(); ++i) {
+			size_t const candidate = (start + i) % loops_.size();
+			if (loops_[candidate]->handler_count() < loops_[best]->handler_count()) {
+				best = candidate;
+			}
+		}
+		return *loops_[best];
+	}
+
+	return *loops_[next_++ % loops_.size()];
+}
+
+event_loop & event_loop_group::assign(size_t key)
+{
+	// Mix the bits, keys are often pointers or sequential numbers
+	uint64_t h = static_cast<uint64_t>(key);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return *loops_[h % loops_.size()];
+}
+
+bool event_loop_group::migrate(event_handler & handler, event_loop & target)
+{
+	return handler.get_event_loop().migrate(handler, target);
+}
+
+}
@@ -1,24 +1,52 @@
 #include "libfilezilla/libfilezilla.hpp"
 #include "libfilezilla/file.hpp"
+#include "libfilezilla/path_builder.hpp"
 #include "libfilezilla/time.hpp"
 
 #ifdef FZ_WINDOWS
 #include "windows/security_descriptor_builder.hpp"
+
+#include <winioctl.h>
 #else
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+
 namespace fz {
 
+#ifndef FZ_WINDOWS
+namespace {
+// Segments passed to a single vectored call, well below any system's IOV_MAX
+size_t const max_segments = 64;
+}
+#endif
+
 file::file(native_string const& f, mode m, creation_flags d)
 {
 	open(f, m, d);
 }
 
+file::file(path_builder const& f, mode m, creation_flags d)
+{
+	open(f, m, d);
+}
+
+result file::open(native_string const& f, mode m, creation_flags d)
+{
+	return do_open(f.c_str(), m, d);
+}
+
+result file::open(path_builder const& f, mode m, creation_flags d)
+{
+	return do_open(f.c_str(), m, d);
+}
+
 file::file(file::file_t fd)
 	: fd_(fd)
 {
@@ -46,11 +74,11 @@ file& file::operator=(file && op) noexcept
 	return *this;
 }
 
-result file::open(native_string const& f, mode m, creation_flags d)
+result file::do_open(native_string::value_type const* f, mode m, creation_flags d)
 {
 	close();
 
-	if (f.empty()) {
+	if (!*f) {
 		return {result::invalid};
 	}
 
@@ -95,7 +123,11 @@ result file::open(native_string const& f, mode m, creation_flags d)
 	if (m != reading) {
 		access |= GENERIC_WRITE;
 	}
-	fd_ = CreateFileW(f.c_str(), access, shareMode, &attr, dispositionFlags, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	DWORD flags = (d & direct) ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+	if (d & overlapped) {
+		flags |= FILE_FLAG_OVERLAPPED;
+	}
+	fd_ = CreateFileW(f, access, shareMode, &attr, dispositionFlags, flags, nullptr);
 
 	if (fd_ == INVALID_HANDLE_VALUE) {
 		auto const err = GetLastError();
@@ -165,6 +197,95 @@ bool file::truncate()
 	return !!SetEndOfFile(fd_);
 }
 
+bool file::allocate(int64_t offset, int64_t length)
+{
+	if (offset < 0 || length < 0) {
+		return false;
+	}
+
+	// Only sets the allocation size, not the end of the file
+	FILE_STANDARD_INFO info{};
+	if (!GetFileInformationByHandleEx(fd_, FileStandardInfo, &info, sizeof(info))) {
+		return false;
+	}
+	if (info.AllocationSize.QuadPart >= offset + length) {
+		return true;
+	}
+
+	FILE_ALLOCATION_INFO alloc{};
+	alloc.AllocationSize.QuadPart = offset + length;
+	return SetFileInformationByHandle(fd_, FileAllocationInfo, &alloc, sizeof(alloc)) != 0;
+}
+
+bool file::punch_hole(int64_t offset, int64_t length)
+{
+	if (offset < 0 || length < 0) {
+		return false;
+	}
+
+	DWORD ret{};
+	FILE_SET_SPARSE_BUFFER sparse{};
+	sparse.SetSparse = TRUE;
+	if (!DeviceIoControl(fd_, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), nullptr, 0, &ret, nullptr)) {
+		return false;
+	}
+
+	FILE_ZERO_DATA_INFORMATION zero{};
+	zero.FileOffset.QuadPart = offset;
+	zero.BeyondFinalZero.QuadPart = offset + length;
+	return DeviceIoControl(fd_, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), nullptr, 0, &ret, nullptr) != 0;
+}
+
+namespace {
+// Gets the first allocated range at or after offset. Returns false if there is none.
+bool first_allocated_range(HANDLE fd, int64_t offset, int64_t size, FILE_ALLOCATED_RANGE_BUFFER & out)
+{
+	FILE_ALLOCATED_RANGE_BUFFER in{};
+	in.FileOffset.QuadPart = offset;
+	in.Length.QuadPart = size - offset;
+
+	DWORD ret{};
+	if (!DeviceIoControl(fd, FSCTL_QUERY_ALLOCATED_RANGES, &in, sizeof(in), &out, sizeof(out), &ret, nullptr) && GetLastError() != ERROR_MORE_DATA) {
+		// Cannot detect holes, treat everything as data
+		out.FileOffset.QuadPart = offset;
+		out.Length.QuadPart = size - offset;
+		return true;
+	}
+	return ret >= sizeof(out);
+}
+}
+
+int64_t file::next_data(int64_t offset)
+{
+	int64_t const s = size();
+	if (offset < 0 || s < 0 || offset >= s) {
+		return -1;
+	}
+
+	FILE_ALLOCATED_RANGE_BUFFER range{};
+	if (!first_allocated_range(fd_, offset, s, range)) {
+		return -1;
+	}
+	return std::max(offset, static_cast<int64_t>(range.FileOffset.QuadPart));
+}
+
+int64_t file::next_hole(int64_t offset)
+{
+	int64_t const s = size();
+	if (offset < 0 || s < 0) {
+		return -1;
+	}
+	if (offset >= s) {
+		return s;
+	}
+
+	FILE_ALLOCATED_RANGE_BUFFER range{};
+	if (!first_allocated_range(fd_, offset, s, range) || range.FileOffset.QuadPart > offset) {
+		return offset;
+	}
+	return std::min(s, static_cast<int64_t>(range.FileOffset.QuadPart + range.Length.QuadPart));
+}
+
 int64_t file::read(void *buf, int64_t count)
 {
 	int64_t ret = -1;
@@ -177,6 +298,42 @@ int64_t file::read(void *buf, int64_t count)
 	return ret;
 }
 
+int64_t file::read_at(void *buf, int64_t count, int64_t offset)
+{
+	int64_t ret = -1;
+
+	OVERLAPPED o{};
+	o.Offset = static_cast<DWORD>(offset);
+	o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD read = 0;
+	if (ReadFile(fd_, buf, static_cast<DWORD>(count), &read, &o)) {
+		ret = static_cast<int64_t>(read);
+	}
+	else if (GetLastError() == ERROR_HANDLE_EOF) {
+		ret = 0;
+	}
+
+	return ret;
+}
+
+int64_t file::readv_at(read_segment const* segments, size_t count, int64_t offset)
+{
+	int64_t ret = 0;
+	for (size_t i = 0; i < count; ++i) {
+		int64_t r = read_at(segments[i].buf, static_cast<int64_t>(segments[i].size), offset + ret);
+		if (r < 0) {
+			return ret ? ret : r;
+		}
+		ret += r;
+		if (static_cast<size_t>(r) < segments[i].size) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
 int64_t file::write(void const* buf, int64_t count)
 {
 	int64_t ret = -1;
@@ -189,20 +346,55 @@ int64_t file::write(void const* buf, int64_t count)
 	return ret;
 }
 
+int64_t file::write_at(void const* buf, int64_t count, int64_t offset)
+{
+	int64_t ret = -1;
+
+	OVERLAPPED o{};
+	o.Offset = static_cast<DWORD>(offset);
+	o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD written = 0;
+	if (WriteFile(fd_, buf, static_cast<DWORD>(count), &written, &o)) {
+		ret = static_cast<int64_t>(written);
+	}
+
+	return ret;
+}
+
+int64_t file::writev_at(write_segment const* segments, size_t count, int64_t offset)
+{
+	int64_t ret = 0;
+	for (size_t i = 0; i < count; ++i) {
+		int64_t w = write_at(segments[i].buf, static_cast<int64_t>(segments[i].size), offset + ret);
+		if (w < 0) {
+			return ret ? ret : w;
+		}
+		ret += w;
+		if (static_cast<size_t>(w) < segments[i].size) {
+			break;
+		}
+	}
+
+	return ret;
+}
+
 bool file::opened() const
 {
 	return fd_ != INVALID_HANDLE_VALUE;
 }
 
-bool remove_file(native_string const& name)
+namespace {
+bool do_remove_file(native_string::value_type const* name)
 {
-	bool ret = DeleteFileW(name.c_str()) != 0;
+	bool ret = DeleteFileW(name) != 0;
 	if (!ret && GetLastError() == ERROR_FILE_NOT_FOUND) {
 		ret = true;
 	}
 
 	return ret;
 }
+}
 
 bool file::fsync()
 {
@@ -223,6 +415,11 @@ bool file::set_modification_time(datetime const& t)
 	return SetFileTime(fd_, nullptr, &ft, &ft) == TRUE;
 }
 
+bool file::advise(int64_t, int64_t, access_advice)
+{
+	return false;
+}
+
 #else
 
 file::file(file && op) noexcept
@@ -241,11 +438,11 @@ file& file::operator=(file && op) noexcept
 	return *this;
 }
 
-result file::open(native_string const& f, mode m, creation_flags d)
+result file::do_open(native_string::value_type const* f, mode m, creation_flags d)
 {
 	close();
 
-	if (f.empty()) {
+	if (!*f) {
 		return {result::invalid};
 	}
 
@@ -264,7 +461,19 @@ result file::open(native_string const& f, mode m, creation_flags d)
 	if (!(d & (current_user_only | current_user_and_admins_only))) {
 		mode |= S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
 	}
-	fd_ = ::open(f.c_str(), flags, mode);
+#ifdef O_DIRECT
+	if (d & direct) {
+		fd_ = ::open(f, flags | O_DIRECT, mode);
+		if (fd_ == -1 && errno == EINVAL) {
+			// File system does not support it
+			fd_ = ::open(f, flags, mode);
+		}
+	}
+	else
+#endif
+	{
+		fd_ = ::open(f, flags, mode);
+	}
 	if (fd_ == -1) {
 		int const err = errno;
 		switch (err) {
@@ -278,8 +487,14 @@ result file::open(native_string const& f, mode m, creation_flags d)
 		}
 	}
 
+#if defined(F_NOCACHE)
+	if (d & direct) {
+		fcntl(fd_, F_NOCACHE, 1);
+	}
+#endif
+
 #if HAVE_POSIX_FADVISE
-	(void)posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+	(void)posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
 
 	return {result::ok};
@@ -346,6 +561,97 @@ bool file::truncate()
 	return ret;
 }
 
+bool file::allocate(int64_t offset, int64_t length)
+{
+	if (offset < 0 || length < 0) {
+		return false;
+	}
+	if (!length) {
+		return true;
+	}
+#if HAVE_FALLOCATE && defined(FALLOC_FL_KEEP_SIZE)
+	int res;
+	do {
+		res = fallocate(fd_, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length));
+	} while (res == -1 && errno == EINTR);
+	return res == 0;
+#elif defined(F_PREALLOCATE)
+	fstore_t store{};
+	store.fst_flags = F_ALLOCATECONTIG;
+	store.fst_posmode = F_VOLPOSMODE;
+	store.fst_offset = static_cast<off_t>(offset);
+	store.fst_length = static_cast<off_t>(length);
+	if (fcntl(fd_, F_PREALLOCATE, &store) == -1) {
+		// Contiguous space not available, try again without
+		store.fst_flags = F_ALLOCATEALL;
+		if (fcntl(fd_, F_PREALLOCATE, &store) == -1) {
+			return false;
+		}
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool file::punch_hole(int64_t offset, int64_t length)
+{
+	if (offset < 0 || length < 0) {
+		return false;
+	}
+	if (!length) {
+		return true;
+	}
+#if HAVE_FALLOCATE && defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	int res;
+	do {
+		res = fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length));
+	} while (res == -1 && errno == EINTR);
+	return res == 0;
+#elif defined(F_PUNCHHOLE)
+	fpunchhole_t hole{};
+	hole.fp_offset = static_cast<off_t>(offset);
+	hole.fp_length = static_cast<off_t>(length);
+	return fcntl(fd_, F_PUNCHHOLE, &hole) == 0;
+#else
+	return false;
+#endif
+}
+
+int64_t file::next_data(int64_t offset)
+{
+	if (offset < 0) {
+		return -1;
+	}
+#ifdef SEEK_DATA
+	auto ret = lseek(fd_, static_cast<off_t>(offset), SEEK_DATA);
+	if (ret != static_cast<off_t>(-1) || errno == ENXIO) {
+		return ret;
+	}
+	// Not supported by the file system
+#endif
+	int64_t const s = size();
+	return (s >= 0 && offset < s) ? offset : -1;
+}
+
+int64_t file::next_hole(int64_t offset)
+{
+	if (offset < 0) {
+		return -1;
+	}
+	int64_t const s = size();
+	if (s >= 0 && offset >= s) {
+		return s;
+	}
+#ifdef SEEK_HOLE
+	auto ret = lseek(fd_, static_cast<off_t>(offset), SEEK_HOLE);
+	if (ret != static_cast<off_t>(-1)) {
+		return ret;
+	}
+#endif
+	return s;
+}
+
 int64_t file::read(void *buf, int64_t count)
 {
 	int64_t ret;
@@ -356,6 +662,49 @@ int64_t file::read(void *buf, int64_t count)
 	return ret;
 }
 
+int64_t file::read_at(void *buf, int64_t count, int64_t offset)
+{
+	int64_t ret;
+	do {
+		ret = ::pread(fd_, buf, count, static_cast<off_t>(offset));
+	} while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+	return ret;
+}
+
+int64_t file::readv_at(read_segment const* segments, size_t count, int64_t offset)
+{
+#if HAVE_PREADV
+	iovec iov[max_segments];
+	count = std::min(count, max_segments);
+	for (size_t i = 0; i < count; ++i) {
+		iov[i].iov_base = segments[i].buf;
+		iov[i].iov_len = segments[i].size;
+	}
+
+	int64_t ret;
+	do {
+		ret = ::preadv(fd_, iov, static_cast<int>(count), static_cast<off_t>(offset));
+	} while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+	return ret;
+#else
+	int64_t ret = 0;
+	for (size_t i = 0; i < count; ++i) {
+		int64_t r = read_at(segments[i].buf, static_cast<int64_t>(segments[i].size), offset + ret);
+		if (r < 0) {
+			return ret ? ret : r;
+		}
+		ret += r;
+		if (static_cast<size_t>(r) < segments[i].size) {
+			break;
+		}
+	}
+
+	return ret;
+#endif
+}
+
 int64_t file::write(void const* buf, int64_t count)
 {
 	int64_t ret;
@@ -366,19 +715,64 @@ int64_t file::write(void const* buf, int64_t count)
 	return ret;
 }
 
+int64_t file::write_at(void const* buf, int64_t count, int64_t offset)
+{
+	int64_t ret;
+	do {
+		ret = ::pwrite(fd_, buf, count, static_cast<off_t>(offset));
+	} while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+	return ret;
+}
+
+int64_t file::writev_at(write_segment const* segments, size_t count, int64_t offset)
+{
+#if HAVE_PWRITEV
+	iovec iov[max_segments];
+	count = std::min(count, max_segments);
+	for (size_t i = 0; i < count; ++i) {
+		iov[i].iov_base = const_cast<void*>(segments[i].buf);
+		iov[i].iov_len = segments[i].size;
+	}
+
+	int64_t ret;
+	do {
+		ret = ::pwritev(fd_, iov, static_cast<int>(count), static_cast<off_t>(offset));
+	} while (ret == -1 && (errno == EAGAIN || errno == EINTR));
+
+	return ret;
+#else
+	int64_t ret = 0;
+	for (size_t i = 0; i < count; ++i) {
+		int64_t w = write_at(segments[i].buf, static_cast<int64_t>(segments[i].size), offset + ret);
+		if (w < 0) {
+			return ret ? ret : w;
+		}
+		ret += w;
+		if (static_cast<size_t>(w) < segments[i].size) {
+			break;
+		}
+	}
+
+	return ret;
+#endif
+}
+
 bool file::opened() const
 {
 	return fd_ != -1;
 }
 
-bool remove_file(native_string const& name)
+namespace {
+bool do_remove_file(native_string::value_type const* name)
 {
-	bool ret = unlink(name.c_str()) == 0;
+	bool ret = unlink(name) == 0;
 	if (!ret && errno == ENOENT) {
 		ret = true;
 	}
 	return ret;
 }
+}
 
 bool file::fsync()
 {
@@ -402,6 +796,46 @@ bool file::set_modification_time(datetime const& t)
 	return futimens(fd_, times) == 0;
 }
 
+bool file::advise(int64_t offset, int64_t length, access_advice advice)
+{
+#if HAVE_POSIX_FADVISE
+	if (offset < 0 || length < 0) {
+		return false;
+	}
+
+	int a{};
+	switch (advice) {
+	case sequential:
+		a = POSIX_FADV_SEQUENTIAL;
+		break;
+	case willneed:
+		a = POSIX_FADV_WILLNEED;
+		break;
+	case dontneed:
+		a = POSIX_FADV_DONTNEED;
+		break;
+	default:
+		return false;
+	}
+	return posix_fadvise(fd_, static_cast<off_t>(offset), static_cast<off_t>(length), a) == 0;
+#else
+	(void)offset;
+	(void)length;
+	(void)advice;
+	return false;
+#endif
+}
+
 #endif
 
+bool remove_file(native_string const& name)
+{
+	return do_remove_file(name.c_str());
+}
+
+bool remove_file(path_builder const& name)
+{
+	return do_remove_file(name.c_str());
+}
+
 }
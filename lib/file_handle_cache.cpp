@@ -0,0 +1,183 @@
+#include "libfilezilla/file_handle_cache.hpp"
+
+#if FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#else
+#include <sys/stat.h>
+#endif
+
+namespace fz {
+
+namespace {
+#if FZ_WINDOWS
+int64_t to_int(FILETIME const& ft)
+{
+	return static_cast<int64_t>((static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime);
+}
+
+bool get_identity(native_string const& path, file_handle_cache::identity & id)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data{};
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data) || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		return false;
+	}
+	id = {};
+	id.size = static_cast<int64_t>((static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow);
+	id.mtime = to_int(data.ftLastWriteTime);
+	return true;
+}
+
+bool get_identity(file & f, file_handle_cache::identity & id)
+{
+	BY_HANDLE_FILE_INFORMATION info{};
+	if (!GetFileInformationByHandle(f.fd(), &info)) {
+		return false;
+	}
+	id = {};
+	id.size = static_cast<int64_t>((static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow);
+	id.mtime = to_int(info.ftLastWriteTime);
+	return true;
+}
+#else
+int64_t to_ns(struct timespec const& ts)
+{
+	return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void to_identity(struct stat const& buf, file_handle_cache::identity & id)
+{
+	id.dev = static_cast<uint64_t>(buf.st_dev);
+	id.ino = static_cast<uint64_t>(buf.st_ino);
+	id.size = static_cast<int64_t>(buf.st_size);
+#if defined(__APPLE__)
+	id.mtime = to_ns(buf.st_mtimespec);
+	id.ctime = to_ns(buf.st_ctimespec);
+#else
+	id.mtime = to_ns(buf.st_mtim);
+	id.ctime = to_ns(buf.st_ctim);
+#endif
+}
+
+bool get_identity(native_string const& path, file_handle_cache::identity & id)
+{
+	struct stat buf{};
+	if (stat(path.c_str(), &buf) || !S_ISREG(buf.st_mode)) {
+		return false;
+	}
+	to_identity(buf, id);
+	return true;
+}
+
+bool get_identity(file & f, file_handle_cache::identity & id)
+{
+	struct stat buf{};
+	if (fstat(f.fd(), &buf)) {
+		return false;
+	}
+	to_identity(buf, id);
+	return true;
+}
+#endif
+}
+
+bool file_handle_cache::identity::operator==(identity const& op) const
+{
+	return dev == op.dev && ino == op.ino && size == op.size && mtime == op.mtime && ctime == op.ctime;
+}
+
+file_handle_cache::file_handle_cache(size_t max_handles)
+	: max_handles_(max_handles)
+{
+}
+
+file_handle_cache::~file_handle_cache()
+{
+}
+
+std::shared_ptr<file> file_handle_cache::open(native_string const& path)
+{
+	identity current;
+	if (!get_identity(path, current)) {
+		invalidate(path);
+		return {};
+	}
+
+	{
+		scoped_lock l(mtx_);
+		auto it = index_.find(path);
+		if (it != index_.end()) {
+			if (it->second->id_ == current) {
+				++hits_;
+				lru_.splice(lru_.begin(), lru_, it->second);
+				return it->second->file_;
+			}
+			lru_.erase(it->second);
+			index_.erase(it);
+		}
+		++misses_;
+	}
+
+	// Opening can be slow, do it without holding the lock
+	auto f = std::make_shared<file>(path, file::reading, file::existing);
+	identity id;
+	if (!f->opened() || !get_identity(*f, id)) {
+		return {};
+	}
+
+	// The file might have changed between the checks, the handle's own metadata is authoritative
+	// Declared before the lock so that closing happens after unlocking
+	std::list<entry> discarded;
+
+	scoped_lock l(mtx_);
+	auto it = index_.find(path);
+	if (it != index_.end()) {
+		discarded.splice(discarded.end(), lru_, it->second);
+		index_.erase(it);
+	}
+	if (max_handles_) {
+		lru_.push_front(entry{path, f, id});
+		index_[path] = lru_.begin();
+		while (lru_.size() > max_handles_) {
+			index_.erase(lru_.back().path_);
+			discarded.splice(discarded.end(), lru_, std::prev(lru_.end()));
+		}
+	}
+
+	return f;
+}
+
+void file_handle_cache::invalidate(native_string const& path)
+{
+	scoped_lock l(mtx_);
+	auto it = index_.find(path);
+	if (it != index_.end()) {
+		lru_.erase(it->second);
+		index_.erase(it);
+	}
+}
+
+void file_handle_cache::clear()
+{
+	scoped_lock l(mtx_);
+	index_.clear();
+	lru_.clear();
+}
+
+size_t file_handle_cache::size() const
+{
+	scoped_lock l(mtx_);
+	return lru_.size();
+}
+
+uint64_t file_handle_cache::hits() const
+{
+	scoped_lock l(mtx_);
+	return hits_;
+}
+
+uint64_t file_handle_cache::misses() const
+{
+	scoped_lock l(mtx_);
+	return misses_;
+}
+}
@@ -0,0 +1,120 @@
+#include "libfilezilla/libfilezilla.hpp"
+#include "libfilezilla/fsync_coordinator.hpp"
+
+#if HAVE_SYNCFS
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#endif
+
+namespace fz {
+
+struct fsync_coordinator::request final
+{
+	explicit request(file & f)
+		: f_(f)
+	{}
+
+	file & f_;
+	condition cond_;
+	bool done_{};
+	bool result_{};
+};
+
+fsync_coordinator::fsync_coordinator(duration const& latency)
+	: latency_(latency)
+{
+}
+
+bool fsync_coordinator::sync(file & f)
+{
+	request r(f);
+
+	scoped_lock l(mtx_);
+	++stats_.requests;
+	pending_.push_back(&r);
+	if (leader_) {
+		// Someone else flushes the batch
+		while (!r.done_) {
+			r.cond_.wait(l);
+		}
+		return r.result_;
+	}
+
+	// Give other files the chance to join the batch
+	leader_ = true;
+	monotonic_clock const deadline = monotonic_clock::now() + latency_;
+	condition cond;
+	for (duration left = latency_; left > duration(); left = deadline - monotonic_clock::now()) {
+		cond.wait(l, left);
+	}
+
+	std::vector<request*> batch;
+	batch.swap(pending_);
+	leader_ = false;
+	++stats_.batches;
+
+	l.unlock();
+	flush(batch);
+	l.lock();
+
+	for (auto * p : batch) {
+		p->done_ = true;
+		if (p != &r) {
+			p->cond_.signal(l);
+		}
+	}
+
+	return r.result_;
+}
+
+void fsync_coordinator::flush(std::vector<request*> const& batch)
+{
+	uint64_t flushes{};
+
+#if HAVE_SYNCFS
+	// One syncfs per file system flushes all files residing on it
+	std::map<dev_t, std::vector<request*>> devices;
+	for (auto * r : batch) {
+		struct stat buf;
+		if (fstat(r->f_.fd(), &buf) == 0) {
+			devices[buf.st_dev].push_back(r);
+		}
+		else {
+			r->result_ = r->f_.fsync();
+			++flushes;
+		}
+	}
+
+	for (auto const& device : devices) {
+		auto const& requests = device.second;
+		if (requests.size() == 1) {
+			requests.front()->result_ = requests.front()->f_.fsync();
+		}
+		else {
+			bool const result = syncfs(requests.front()->f_.fd()) == 0;
+			for (auto * r : requests) {
+				r->result_ = result;
+			}
+		}
+		++flushes;
+	}
+#else
+	for (auto * r : batch) {
+		r->result_ = r->f_.fsync();
+		++flushes;
+	}
+#endif
+
+	scoped_lock l(mtx_);
+	stats_.flushes += flushes;
+}
+
+fsync_coordinator_stats fsync_coordinator::get_stats() const
+{
+	scoped_lock l(mtx_);
+	return stats_;
+}
+
+}
@@ -1,6 +1,10 @@
 #include "libfilezilla/libfilezilla.hpp"
 
 #include "libfilezilla/hash.hpp"
+#include "libfilezilla/util.hpp"
+#include "checksum_impl.hpp"
+
+#include <algorithm>
 
 #include <nettle/hmac.h>
 #include <nettle/md5.h>
@@ -23,8 +27,88 @@ public:
 	virtual void update(uint8_t const* data, size_t size) = 0;
 	virtual void reinit() = 0;
 	virtual std::vector<uint8_t> digest() = 0;
+
+	virtual std::vector<uint8_t> export_state() const = 0;
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) = 0;
 };
 
+namespace {
+/* Exported state, all numbers big-endian:
+ * - Format version
+ * - The hash_algorithm
+ * - Number of processed blocks, 128 bit
+ * - The state words
+ * - Number of buffered octets, followed by these octets
+ */
+uint8_t const state_version = 1;
+
+template<typename Word>
+void append_be(std::vector<uint8_t> & out, Word w)
+{
+	for (size_t i = sizeof(Word); i; --i) {
+		out.push_back(static_cast<uint8_t>(w >> ((i - 1) * 8)));
+	}
+}
+
+template<typename Word>
+Word read_be(uint8_t const*& p)
+{
+	Word w{};
+	for (size_t i = 0; i < sizeof(Word); ++i) {
+		w = static_cast<Word>((w << 8) | *p++);
+	}
+	return w;
+}
+
+template<typename Word, size_t N>
+std::vector<uint8_t> export_ctx(hash_algorithm algorithm, Word const (&state)[N], uint64_t count_high, uint64_t count_low, uint8_t const* block, size_t index)
+{
+	std::vector<uint8_t> ret;
+	ret.reserve(2 + 16 + N * sizeof(Word) + 1 + index);
+	ret.push_back(state_version);
+	ret.push_back(static_cast<uint8_t>(algorithm));
+	append_be(ret, count_high);
+	append_be(ret, count_low);
+	for (auto const w : state) {
+		append_be(ret, w);
+	}
+	ret.push_back(static_cast<uint8_t>(index));
+	ret.insert(ret.end(), block, block + index);
+	return ret;
+}
+
+// Does not touch the context unless the state is valid
+template<typename Word, size_t N, size_t BlockSize>
+bool import_ctx(std::basic_string_view<uint8_t> const& in, hash_algorithm algorithm, Word (&state)[N], uint64_t * count_high, uint64_t & count_low, uint8_t (&block)[BlockSize], unsigned int & index)
+{
+	size_t const fixed = 2 + 16 + N * sizeof(Word) + 1;
+	if (in.size() < fixed || in[0] != state_version || in[1] != static_cast<uint8_t>(algorithm)) {
+		return false;
+	}
+	size_t const buffered = in[fixed - 1];
+	if (buffered >= BlockSize || in.size() != fixed + buffered) {
+		return false;
+	}
+
+	uint8_t const* p = in.data() + 2;
+	uint64_t const high = read_be<uint64_t>(p);
+	if (high && !count_high) {
+		return false;
+	}
+	if (count_high) {
+		*count_high = high;
+	}
+	count_low = read_be<uint64_t>(p);
+	for (auto & w : state) {
+		w = read_be<Word>(p);
+	}
+	++p;
+	std::copy(p, p + buffered, block);
+	index = static_cast<unsigned int>(buffered);
+	return true;
+}
+}
+
 class hash_accumulator_md5 final : public hash_accumulator::impl
 {
 public:
@@ -46,6 +130,16 @@ public:
 		return ret;
 	}
 
+	virtual std::vector<uint8_t> export_state() const override
+	{
+		return export_ctx(hash_algorithm::md5, ctx_.state, 0, ctx_.count, ctx_.block, ctx_.index);
+	}
+
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) override
+	{
+		return import_ctx(state, hash_algorithm::md5, ctx_.state, nullptr, ctx_.count, ctx_.block, ctx_.index);
+	}
+
 private:
 	md5_ctx ctx_;
 };
@@ -71,6 +165,16 @@ public:
 		return ret;
 	}
 
+	virtual std::vector<uint8_t> export_state() const override
+	{
+		return export_ctx(hash_algorithm::sha1, ctx_.state, 0, ctx_.count, ctx_.block, ctx_.index);
+	}
+
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) override
+	{
+		return import_ctx(state, hash_algorithm::sha1, ctx_.state, nullptr, ctx_.count, ctx_.block, ctx_.index);
+	}
+
 private:
 	sha1_ctx ctx_;
 };
@@ -96,6 +200,16 @@ public:
 		return ret;
 	}
 
+	virtual std::vector<uint8_t> export_state() const override
+	{
+		return export_ctx(hash_algorithm::sha256, ctx_.state, 0, ctx_.count, ctx_.block, ctx_.index);
+	}
+
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) override
+	{
+		return import_ctx(state, hash_algorithm::sha256, ctx_.state, nullptr, ctx_.count, ctx_.block, ctx_.index);
+	}
+
 private:
 	sha256_ctx ctx_;
 };
@@ -121,10 +235,127 @@ public:
 		return ret;
 	}
 
+	virtual std::vector<uint8_t> export_state() const override
+	{
+		return export_ctx(hash_algorithm::sha512, ctx_.state, ctx_.count_high, ctx_.count_low, ctx_.block, ctx_.index);
+	}
+
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) override
+	{
+		return import_ctx(state, hash_algorithm::sha512, ctx_.state, &ctx_.count_high, ctx_.count_low, ctx_.block, ctx_.index);
+	}
+
 private:
 	sha512_ctx ctx_;
 };
 
+class hash_accumulator_crc32c final : public hash_accumulator::impl
+{
+public:
+	virtual void update(uint8_t const* data, size_t size) override
+	{
+		crc_ = crc32c(std::basic_string_view<uint8_t>(data, size), crc_);
+	}
+
+	virtual void reinit() override
+	{
+		crc_ = 0;
+	}
+
+	virtual std::vector<uint8_t> digest() override
+	{
+		std::vector<uint8_t> ret;
+		append_be(ret, crc_);
+		crc_ = 0;
+		return ret;
+	}
+
+	virtual std::vector<uint8_t> export_state() const override
+	{
+		std::vector<uint8_t> ret{state_version, static_cast<uint8_t>(hash_algorithm::crc32c)};
+		append_be(ret, crc_);
+		return ret;
+	}
+
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) override
+	{
+		if (state.size() != 6 || state[0] != state_version || state[1] != static_cast<uint8_t>(hash_algorithm::crc32c)) {
+			return false;
+		}
+		uint8_t const* p = state.data() + 2;
+		crc_ = read_be<uint32_t>(p);
+		return true;
+	}
+
+private:
+	uint32_t crc_{};
+};
+
+class hash_accumulator_xxh3 final : public hash_accumulator::impl
+{
+public:
+	virtual void update(uint8_t const* data, size_t size) override
+	{
+		state_.update(data, size);
+	}
+
+	virtual void reinit() override
+	{
+		state_.reset();
+	}
+
+	virtual std::vector<uint8_t> digest() override
+	{
+		std::vector<uint8_t> ret;
+		append_be(ret, state_.digest());
+		state_.reset();
+		return ret;
+	}
+
+	// Besides the usual fields, the entire buffer is needed as it may hold
+	// the end of the previously processed data.
+	virtual std::vector<uint8_t> export_state() const override
+	{
+		std::vector<uint8_t> ret{state_version, static_cast<uint8_t>(hash_algorithm::xxh3)};
+		append_be(ret, state_.total_);
+		for (auto const acc : state_.acc_) {
+			append_be(ret, acc);
+		}
+		ret.push_back(static_cast<uint8_t>(state_.stripes_));
+		append_be(ret, static_cast<uint16_t>(state_.buffered_));
+		ret.insert(ret.end(), state_.buffer_, state_.buffer_ + xxh3_state::buffer_size);
+		return ret;
+	}
+
+	virtual bool import_state(std::basic_string_view<uint8_t> const& state) override
+	{
+		if (state.size() != 2 + 8 + 64 + 1 + 2 + xxh3_state::buffer_size || state[0] != state_version || state[1] != static_cast<uint8_t>(hash_algorithm::xxh3)) {
+			return false;
+		}
+		uint8_t const* p = state.data() + 2;
+		uint64_t const total = read_be<uint64_t>(p);
+		p += 64;
+		size_t const stripes = *p++;
+		size_t const buffered = read_be<uint16_t>(p);
+		if (stripes >= 16 || buffered > xxh3_state::buffer_size || buffered > total || (total > xxh3_state::buffer_size && !buffered)) {
+			return false;
+		}
+
+		p = state.data() + 10;
+		state_.total_ = total;
+		for (auto & acc : state_.acc_) {
+			acc = read_be<uint64_t>(p);
+		}
+		state_.stripes_ = stripes;
+		state_.buffered_ = buffered;
+		std::copy(p + 3, p + 3 + xxh3_state::buffer_size, state_.buffer_);
+		return true;
+	}
+
+private:
+	xxh3_state state_;
+};
+
 hash_accumulator::hash_accumulator(hash_algorithm algorithm)
 {
 	switch (algorithm) {
@@ -140,6 +371,12 @@ hash_accumulator::hash_accumulator(hash_algorithm algorithm)
 	case hash_algorithm::sha512:
 		impl_ = new hash_accumulator_sha512;
 		break;
+	case hash_algorithm::crc32c:
+		impl_ = new hash_accumulator_crc32c;
+		break;
+	case hash_algorithm::xxh3:
+		impl_ = new hash_accumulator_xxh3;
+		break;
 	}
 
 	impl_->reinit();
@@ -186,6 +423,21 @@ std::vector<uint8_t> hash_accumulator::digest()
 	return impl_->digest();
 }
 
+std::vector<uint8_t> hash_accumulator::export_state() const
+{
+	return impl_->export_state();
+}
+
+bool hash_accumulator::import_state(std::basic_string_view<uint8_t> const& state)
+{
+	return impl_->import_state(state);
+}
+
+bool hash_accumulator::import_state(std::vector<uint8_t> const& state)
+{
+	return impl_->import_state(std::basic_string_view<uint8_t>(state.data(), state.size()));
+}
+
 namespace {
 // In C++17, require ContiguousContainer
 template<typename DataContainer>
@@ -363,6 +615,156 @@ std::vector<uint8_t> hmac_sha256(std::string_view const& key, std::vector<uint8_
 	return hmac_sha256_impl(key, data);
 }
 
+class hmac_accumulator::impl
+{
+public:
+	virtual ~impl() = default;
+
+	virtual std::unique_ptr<impl> clone() const = 0;
+	virtual void update(uint8_t const* data, size_t size) = 0;
+	virtual void reinit() = 0;
+	virtual std::vector<uint8_t> digest() = 0;
+};
+
+namespace {
+template<typename Ctx, void (*SetKey)(Ctx*, size_t, uint8_t const*), void (*Update)(Ctx*, size_t, uint8_t const*), void (*Digest)(Ctx*, size_t, uint8_t*), size_t DigestSize>
+class hmac_accumulator_nettle final : public hmac_accumulator::impl
+{
+public:
+	hmac_accumulator_nettle() = default;
+
+	explicit hmac_accumulator_nettle(std::basic_string_view<uint8_t> const& key)
+	{
+		SetKey(&ctx_, key.size(), key.empty() ? nullptr : key.data());
+	}
+
+	virtual std::unique_ptr<hmac_accumulator::impl> clone() const override
+	{
+		// Only the precomputed keys are read, the state may be in use by another thread
+		auto ret = std::make_unique<hmac_accumulator_nettle>();
+		ret->ctx_.outer = ctx_.outer;
+		ret->ctx_.inner = ctx_.inner;
+		ret->ctx_.state = ctx_.inner;
+		return ret;
+	}
+
+	virtual void update(uint8_t const* data, size_t size) override
+	{
+		Update(&ctx_, size, data);
+	}
+
+	virtual void reinit() override
+	{
+		ctx_.state = ctx_.inner;
+	}
+
+	virtual std::vector<uint8_t> digest() override
+	{
+		// Nettle resets the state to the inner key afterwards
+		std::vector<uint8_t> ret;
+		ret.resize(DigestSize);
+		Digest(&ctx_, ret.size(), ret.data());
+		return ret;
+	}
+
+private:
+	Ctx ctx_;
+};
+
+std::unique_ptr<hmac_accumulator::impl> create_hmac(hash_algorithm algorithm, std::basic_string_view<uint8_t> const& key)
+{
+	switch (algorithm) {
+	case hash_algorithm::md5:
+		return std::make_unique<hmac_accumulator_nettle<hmac_md5_ctx, nettle_hmac_md5_set_key, nettle_hmac_md5_update, nettle_hmac_md5_digest, MD5_DIGEST_SIZE>>(key);
+	case hash_algorithm::sha1:
+		return std::make_unique<hmac_accumulator_nettle<hmac_sha1_ctx, nettle_hmac_sha1_set_key, nettle_hmac_sha1_update, nettle_hmac_sha1_digest, SHA1_DIGEST_SIZE>>(key);
+	case hash_algorithm::sha256:
+		return std::make_unique<hmac_accumulator_nettle<hmac_sha256_ctx, nettle_hmac_sha256_set_key, nettle_hmac_sha256_update, nettle_hmac_sha256_digest, SHA256_DIGEST_SIZE>>(key);
+	case hash_algorithm::sha512:
+		return std::make_unique<hmac_accumulator_nettle<hmac_sha512_ctx, nettle_hmac_sha512_set_key, nettle_hmac_sha512_update, nettle_hmac_sha512_digest, SHA512_DIGEST_SIZE>>(key);
+	default:
+		return nullptr;
+	}
+}
+}
+
+hmac_accumulator::hmac_accumulator(hash_algorithm algorithm, std::basic_string_view<uint8_t> const& key)
+	: impl_(create_hmac(algorithm, key))
+{
+}
+
+hmac_accumulator::hmac_accumulator(hash_algorithm algorithm, std::string_view const& key)
+	: impl_(create_hmac(algorithm, std::basic_string_view<uint8_t>(reinterpret_cast<uint8_t const*>(key.data()), key.size())))
+{
+}
+
+hmac_accumulator::hmac_accumulator(hash_algorithm algorithm, std::vector<uint8_t> const& key)
+	: impl_(create_hmac(algorithm, std::basic_string_view<uint8_t>(key.data(), key.size())))
+{
+}
+
+hmac_accumulator::hmac_accumulator(std::unique_ptr<impl> && impl)
+	: impl_(std::move(impl))
+{
+}
+
+hmac_accumulator::~hmac_accumulator() = default;
+hmac_accumulator::hmac_accumulator(hmac_accumulator &&) noexcept = default;
+hmac_accumulator& hmac_accumulator::operator=(hmac_accumulator &&) noexcept = default;
+
+hmac_accumulator hmac_accumulator::clone() const
+{
+	return hmac_accumulator(impl_ ? impl_->clone() : nullptr);
+}
+
+void hmac_accumulator::reinit()
+{
+	if (impl_) {
+		impl_->reinit();
+	}
+}
+
+void hmac_accumulator::update(std::string_view const& data)
+{
+	update(reinterpret_cast<uint8_t const*>(data.data()), data.size());
+}
+
+void hmac_accumulator::update(std::basic_string_view<uint8_t> const& data)
+{
+	update(data.data(), data.size());
+}
+
+void hmac_accumulator::update(std::vector<uint8_t> const& data)
+{
+	update(data.data(), data.size());
+}
+
+void hmac_accumulator::update(uint8_t const* data, size_t size)
+{
+	if (impl_ && size) {
+		impl_->update(data, size);
+	}
+}
+
+std::vector<uint8_t> hmac_accumulator::digest()
+{
+	if (!impl_) {
+		return {};
+	}
+	return impl_->digest();
+}
+
+bool hmac_accumulator::verify(std::basic_string_view<uint8_t> const& mac)
+{
+	auto const own = digest();
+	return !own.empty() && equal_consttime(std::basic_string_view<uint8_t>(own.data(), own.size()), mac);
+}
+
+bool hmac_accumulator::verify(std::vector<uint8_t> const& mac)
+{
+	return verify(std::basic_string_view<uint8_t>(mac.data(), mac.size()));
+}
+
 std::vector<uint8_t> pbkdf2_hmac_sha256(std::basic_string_view<uint8_t> const& password, std::basic_string_view<uint8_t> const& salt, size_t length, unsigned int iterations)
 {
 	std::vector<uint8_t> ret;
@@ -0,0 +1,774 @@
+#include "libfilezilla/libfilezilla.hpp"
+
+#include "libfilezilla/hash.hpp"
+
+#include <nettle/md5.h>
+#include <nettle/sha1.h>
+#include <nettle/sha2.h>
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define FZ_HASH_BATCH_AVX2 1
+#endif
+
+namespace fz {
+
+namespace {
+#ifdef FZ_HASH_BATCH_AVX2
+bool has_avx2()
+{
+	static bool const avx2 = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	}();
+	return avx2;
+}
+
+// With the SHA extensions, Nettle hashes a single SHA-1 or SHA-256 stream faster than
+// the AVX2 code below hashes eight.
+bool has_sha()
+{
+	static bool const sha = []() {
+		unsigned int a{}, b{}, c{}, d{};
+		return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+	}();
+	return sha;
+}
+
+uint32_t const md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+int const md5_shifts[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+uint32_t const sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+uint64_t const sha512_k[80] = {
+	0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
+	0x3956c25bf348b538, 0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
+	0xd807aa98a3030242, 0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+	0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 0xc19bf174cf692694,
+	0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65,
+	0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+	0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4,
+	0xc6e00bf33da88fc2, 0xd5a79147930aa725, 0x06ca6351e003826f, 0x142929670a0e6e70,
+	0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+	0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b,
+	0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30,
+	0xd192e819d6ef5218, 0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+	0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8,
+	0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3,
+	0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+	0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b,
+	0xca273eceea26619c, 0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178,
+	0x06f067aa72176fba, 0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+	0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 0x431d67c49c100d4c,
+	0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817
+};
+
+// Each lane of a vector holds the same word of a different stream. Blocks of
+// eight streams get loaded by transposing 8x8 matrices of 32-bit words,
+// four streams of 64-bit words by transposing 4x4 matrices.
+__attribute__((target("avx2")))
+inline void transpose8(__m256i (&r)[8])
+{
+	__m256i t[8];
+	for (int i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	__m256i u[8];
+	for (int i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; ++i) {
+		r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+__attribute__((target("avx2")))
+inline void transpose4(__m256i (&r)[4])
+{
+	__m256i const t0 = _mm256_unpacklo_epi64(r[0], r[1]);
+	__m256i const t1 = _mm256_unpackhi_epi64(r[0], r[1]);
+	__m256i const t2 = _mm256_unpacklo_epi64(r[2], r[3]);
+	__m256i const t3 = _mm256_unpackhi_epi64(r[2], r[3]);
+	r[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+	r[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+	r[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+	r[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+// Loads the next 64 byte block of eight streams
+__attribute__((target("avx2")))
+inline void load_block8(__m256i (&m)[16], uint8_t const* (&data)[8], bool big_endian)
+{
+	__m256i const swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (int half = 0; half < 2; ++half) {
+		__m256i r[8];
+		for (int l = 0; l < 8; ++l) {
+			r[l] = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data[l] + 32 * half));
+		}
+		transpose8(r);
+		for (int i = 0; i < 8; ++i) {
+			m[8 * half + i] = big_endian ? _mm256_shuffle_epi8(r[i], swap) : r[i];
+		}
+	}
+	for (auto & p : data) {
+		p += 64;
+	}
+}
+
+template<int words>
+__attribute__((target("avx2")))
+inline void load_state8(__m256i (&s)[words], uint32_t* const* states)
+{
+	for (int i = 0; i < words; ++i) {
+		s[i] = _mm256_setr_epi32(static_cast<int>(states[0][i]), static_cast<int>(states[1][i]), static_cast<int>(states[2][i]), static_cast<int>(states[3][i]),
+			static_cast<int>(states[4][i]), static_cast<int>(states[5][i]), static_cast<int>(states[6][i]), static_cast<int>(states[7][i]));
+	}
+}
+
+template<int words>
+__attribute__((target("avx2")))
+inline void store_state8(__m256i const (&s)[words], uint32_t* const* states)
+{
+	for (int i = 0; i < words; ++i) {
+		alignas(32) uint32_t v[8];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(v), s[i]);
+		for (int l = 0; l < 8; ++l) {
+			states[l][i] = v[l];
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotl32(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotr64(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - n));
+}
+
+__attribute__((target("avx2")))
+void md5_blocks_avx2(uint32_t* const* states, uint8_t const* const* in, size_t blocks)
+{
+	uint8_t const* data[8];
+	std::copy(in, in + 8, data);
+
+	__m256i s[4];
+	load_state8(s, states);
+
+	__m256i const ones = _mm256_set1_epi32(-1);
+	for (size_t n = 0; n < blocks; ++n) {
+		__m256i m[16];
+		load_block8(m, data, false);
+
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+#pragma GCC unroll 64
+		for (int i = 0; i < 64; ++i) {
+			__m256i f;
+			int g;
+			if (i < 16) {
+				f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+				g = i;
+			}
+			else if (i < 32) {
+				f = _mm256_xor_si256(c, _mm256_and_si256(d, _mm256_xor_si256(b, c)));
+				g = (5 * i + 1) % 16;
+			}
+			else if (i < 48) {
+				f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+				g = (3 * i + 5) % 16;
+			}
+			else {
+				f = _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, ones)));
+				g = (7 * i) % 16;
+			}
+			f = _mm256_add_epi32(_mm256_add_epi32(f, a), _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(md5_k[i])), m[g]));
+			a = d;
+			d = c;
+			c = b;
+			b = _mm256_add_epi32(b, rotl32(f, md5_shifts[i]));
+		}
+		s[0] = _mm256_add_epi32(s[0], a);
+		s[1] = _mm256_add_epi32(s[1], b);
+		s[2] = _mm256_add_epi32(s[2], c);
+		s[3] = _mm256_add_epi32(s[3], d);
+	}
+
+	store_state8(s, states);
+}
+
+__attribute__((target("avx2")))
+void sha1_blocks_avx2(uint32_t* const* states, uint8_t const* const* in, size_t blocks)
+{
+	uint8_t const* data[8];
+	std::copy(in, in + 8, data);
+
+	__m256i s[5];
+	load_state8(s, states);
+
+	for (size_t n = 0; n < blocks; ++n) {
+		__m256i w[80];
+		load_block8(reinterpret_cast<__m256i (&)[16]>(w), data, true);
+		for (int t = 16; t < 80; ++t) {
+			w[t] = rotl32(_mm256_xor_si256(_mm256_xor_si256(w[t - 3], w[t - 8]), _mm256_xor_si256(w[t - 14], w[t - 16])), 1);
+		}
+
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+#pragma GCC unroll 80
+		for (int t = 0; t < 80; ++t) {
+			__m256i f;
+			uint32_t k;
+			if (t < 20) {
+				f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+				k = 0x5a827999;
+			}
+			else if (t < 40) {
+				f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+				k = 0x6ed9eba1;
+			}
+			else if (t < 60) {
+				f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+				k = 0x8f1bbcdc;
+			}
+			else {
+				f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+				k = 0xca62c1d6;
+			}
+			__m256i const temp = _mm256_add_epi32(_mm256_add_epi32(rotl32(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, w[t]), _mm256_set1_epi32(static_cast<int>(k))));
+			e = d;
+			d = c;
+			c = rotl32(b, 30);
+			b = a;
+			a = temp;
+		}
+		s[0] = _mm256_add_epi32(s[0], a);
+		s[1] = _mm256_add_epi32(s[1], b);
+		s[2] = _mm256_add_epi32(s[2], c);
+		s[3] = _mm256_add_epi32(s[3], d);
+		s[4] = _mm256_add_epi32(s[4], e);
+	}
+
+	store_state8(s, states);
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotr32(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+void sha256_blocks_avx2(uint32_t* const* states, uint8_t const* const* in, size_t blocks)
+{
+	uint8_t const* data[8];
+	std::copy(in, in + 8, data);
+
+	__m256i s[8];
+	load_state8(s, states);
+
+	for (size_t n = 0; n < blocks; ++n) {
+		__m256i w[64];
+		load_block8(reinterpret_cast<__m256i (&)[16]>(w), data, true);
+		for (int t = 16; t < 64; ++t) {
+			__m256i const s0 = _mm256_xor_si256(_mm256_xor_si256(rotr32(w[t - 15], 7), rotr32(w[t - 15], 18)), _mm256_srli_epi32(w[t - 15], 3));
+			__m256i const s1 = _mm256_xor_si256(_mm256_xor_si256(rotr32(w[t - 2], 17), rotr32(w[t - 2], 19)), _mm256_srli_epi32(w[t - 2], 10));
+			w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0), _mm256_add_epi32(w[t - 7], s1));
+		}
+
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+#pragma GCC unroll 64
+		for (int t = 0; t < 64; ++t) {
+			__m256i const S1 = _mm256_xor_si256(_mm256_xor_si256(rotr32(e, 6), rotr32(e, 11)), rotr32(e, 25));
+			__m256i const ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+			__m256i const t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(_mm256_add_epi32(ch, w[t]), _mm256_set1_epi32(static_cast<int>(sha256_k[t]))));
+			__m256i const S0 = _mm256_xor_si256(_mm256_xor_si256(rotr32(a, 2), rotr32(a, 13)), rotr32(a, 22));
+			__m256i const maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi32(t1, _mm256_add_epi32(S0, maj));
+		}
+		s[0] = _mm256_add_epi32(s[0], a);
+		s[1] = _mm256_add_epi32(s[1], b);
+		s[2] = _mm256_add_epi32(s[2], c);
+		s[3] = _mm256_add_epi32(s[3], d);
+		s[4] = _mm256_add_epi32(s[4], e);
+		s[5] = _mm256_add_epi32(s[5], f);
+		s[6] = _mm256_add_epi32(s[6], g);
+		s[7] = _mm256_add_epi32(s[7], h);
+	}
+
+	store_state8(s, states);
+}
+
+__attribute__((target("avx2")))
+void sha512_blocks_avx2(uint64_t* const* states, uint8_t const* const* in, size_t blocks)
+{
+	uint8_t const* data[4];
+	std::copy(in, in + 4, data);
+
+	__m256i s[8];
+	for (int i = 0; i < 8; ++i) {
+		s[i] = _mm256_setr_epi64x(static_cast<long long>(states[0][i]), static_cast<long long>(states[1][i]), static_cast<long long>(states[2][i]), static_cast<long long>(states[3][i]));
+	}
+
+	__m256i const swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	for (size_t n = 0; n < blocks; ++n) {
+		__m256i w[80];
+		for (int q = 0; q < 4; ++q) {
+			__m256i r[4];
+			for (int l = 0; l < 4; ++l) {
+				r[l] = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data[l] + 32 * q));
+			}
+			transpose4(r);
+			for (int i = 0; i < 4; ++i) {
+				w[4 * q + i] = _mm256_shuffle_epi8(r[i], swap);
+			}
+		}
+		for (auto & p : data) {
+			p += 128;
+		}
+		for (int t = 16; t < 80; ++t) {
+			__m256i const s0 = _mm256_xor_si256(_mm256_xor_si256(rotr64(w[t - 15], 1), rotr64(w[t - 15], 8)), _mm256_srli_epi64(w[t - 15], 7));
+			__m256i const s1 = _mm256_xor_si256(_mm256_xor_si256(rotr64(w[t - 2], 19), rotr64(w[t - 2], 61)), _mm256_srli_epi64(w[t - 2], 6));
+			w[t] = _mm256_add_epi64(_mm256_add_epi64(w[t - 16], s0), _mm256_add_epi64(w[t - 7], s1));
+		}
+
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+#pragma GCC unroll 80
+		for (int t = 0; t < 80; ++t) {
+			__m256i const S1 = _mm256_xor_si256(_mm256_xor_si256(rotr64(e, 14), rotr64(e, 18)), rotr64(e, 41));
+			__m256i const ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+			__m256i const t1 = _mm256_add_epi64(_mm256_add_epi64(h, S1), _mm256_add_epi64(_mm256_add_epi64(ch, w[t]), _mm256_set1_epi64x(static_cast<long long>(sha512_k[t]))));
+			__m256i const S0 = _mm256_xor_si256(_mm256_xor_si256(rotr64(a, 28), rotr64(a, 34)), rotr64(a, 39));
+			__m256i const maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi64(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi64(t1, _mm256_add_epi64(S0, maj));
+		}
+		s[0] = _mm256_add_epi64(s[0], a);
+		s[1] = _mm256_add_epi64(s[1], b);
+		s[2] = _mm256_add_epi64(s[2], c);
+		s[3] = _mm256_add_epi64(s[3], d);
+		s[4] = _mm256_add_epi64(s[4], e);
+		s[5] = _mm256_add_epi64(s[5], f);
+		s[6] = _mm256_add_epi64(s[6], g);
+		s[7] = _mm256_add_epi64(s[7], h);
+	}
+
+	for (int i = 0; i < 8; ++i) {
+		alignas(32) uint64_t v[4];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(v), s[i]);
+		for (int l = 0; l < 4; ++l) {
+			states[l][i] = v[l];
+		}
+	}
+}
+#endif
+
+// Nettle's contexts do the buffering and padding. Whole blocks of multiple
+// streams get processed in parallel by updating the state and block count
+// of the contexts directly.
+struct md5_traits final
+{
+	typedef md5_ctx ctx;
+	typedef uint32_t word;
+	static constexpr size_t block_size = MD5_BLOCK_SIZE;
+	static constexpr size_t digest_size = MD5_DIGEST_SIZE;
+	static constexpr size_t lanes = 8;
+
+	static void init(ctx & c) { nettle_md5_init(&c); }
+	static void update(ctx & c, size_t size, uint8_t const* data) { nettle_md5_update(&c, size, data); }
+	static void digest(ctx & c, uint8_t* out) { nettle_md5_digest(&c, digest_size, out); }
+	static void add_blocks(ctx & c, size_t n) { c.count += n; }
+
+#ifdef FZ_HASH_BATCH_AVX2
+	static bool parallel() { return has_avx2(); }
+	static void blocks(word* const* states, uint8_t const* const* data, size_t n) { md5_blocks_avx2(states, data, n); }
+#endif
+};
+
+struct sha1_traits final
+{
+	typedef sha1_ctx ctx;
+	typedef uint32_t word;
+	static constexpr size_t block_size = SHA1_BLOCK_SIZE;
+	static constexpr size_t digest_size = SHA1_DIGEST_SIZE;
+	static constexpr size_t lanes = 8;
+
+	static void init(ctx & c) { nettle_sha1_init(&c); }
+	static void update(ctx & c, size_t size, uint8_t const* data) { nettle_sha1_update(&c, size, data); }
+	static void digest(ctx & c, uint8_t* out) { nettle_sha1_digest(&c, digest_size, out); }
+	static void add_blocks(ctx & c, size_t n) { c.count += n; }
+
+#ifdef FZ_HASH_BATCH_AVX2
+	static bool parallel() { return has_avx2() && !has_sha(); }
+	static void blocks(word* const* states, uint8_t const* const* data, size_t n) { sha1_blocks_avx2(states, data, n); }
+#endif
+};
+
+struct sha256_traits final
+{
+	typedef sha256_ctx ctx;
+	typedef uint32_t word;
+	static constexpr size_t block_size = SHA256_BLOCK_SIZE;
+	static constexpr size_t digest_size = SHA256_DIGEST_SIZE;
+	static constexpr size_t lanes = 8;
+
+	static void init(ctx & c) { nettle_sha256_init(&c); }
+	static void update(ctx & c, size_t size, uint8_t const* data) { nettle_sha256_update(&c, size, data); }
+	static void digest(ctx & c, uint8_t* out) { nettle_sha256_digest(&c, digest_size, out); }
+	static void add_blocks(ctx & c, size_t n) { c.count += n; }
+
+#ifdef FZ_HASH_BATCH_AVX2
+	static bool parallel() { return has_avx2() && !has_sha(); }
+	static void blocks(word* const* states, uint8_t const* const* data, size_t n) { sha256_blocks_avx2(states, data, n); }
+#endif
+};
+
+struct sha512_traits final
+{
+	typedef sha512_ctx ctx;
+	typedef uint64_t word;
+	static constexpr size_t block_size = SHA512_BLOCK_SIZE;
+	static constexpr size_t digest_size = SHA512_DIGEST_SIZE;
+	static constexpr size_t lanes = 4;
+
+	static void init(ctx & c) { nettle_sha512_init(&c); }
+	static void update(ctx & c, size_t size, uint8_t const* data) { nettle_sha512_update(&c, size, data); }
+	static void digest(ctx & c, uint8_t* out) { nettle_sha512_digest(&c, digest_size, out); }
+	static void add_blocks(ctx & c, size_t n) {
+		c.count_low += n;
+		if (c.count_low < n) {
+			++c.count_high;
+		}
+	}
+
+#ifdef FZ_HASH_BATCH_AVX2
+	static bool parallel() { return has_avx2(); }
+	static void blocks(word* const* states, uint8_t const* const* data, size_t n) { sha512_blocks_avx2(states, data, n); }
+#endif
+};
+}
+
+class hash_accumulator_batch::impl
+{
+public:
+	virtual ~impl() = default;
+
+	virtual size_t size() const = 0;
+	virtual void reinit() = 0;
+	virtual void update(std::basic_string_view<uint8_t> const* data, size_t count) = 0;
+	virtual void update(size_t stream, uint8_t const* data, size_t size) = 0;
+	virtual std::vector<uint8_t> digest(size_t stream) = 0;
+};
+
+namespace {
+template<typename Traits>
+class hash_batch_impl final : public hash_accumulator_batch::impl
+{
+public:
+	explicit hash_batch_impl(size_t streams)
+		: ctxs_(streams)
+	{
+		reinit();
+	}
+
+	virtual size_t size() const override
+	{
+		return ctxs_.size();
+	}
+
+	virtual void reinit() override
+	{
+		for (auto & c : ctxs_) {
+			Traits::init(c);
+		}
+	}
+
+	virtual void update(std::basic_string_view<uint8_t> const* data, size_t count) override;
+
+	virtual void update(size_t stream, uint8_t const* data, size_t size) override
+	{
+		Traits::update(ctxs_[stream], size, data);
+	}
+
+	virtual std::vector<uint8_t> digest(size_t stream) override
+	{
+		std::vector<uint8_t> ret;
+		ret.resize(Traits::digest_size);
+		Traits::digest(ctxs_[stream], ret.data());
+		return ret;
+	}
+
+private:
+	struct job final
+	{
+		typename Traits::ctx* ctx_;
+		uint8_t const* data_;
+		size_t blocks_;
+	};
+
+	struct tail final
+	{
+		typename Traits::ctx* ctx_;
+		uint8_t const* data_;
+		size_t size_;
+	};
+
+#ifdef FZ_HASH_BATCH_AVX2
+	void process_parallel();
+#endif
+
+	std::vector<typename Traits::ctx> ctxs_;
+	std::vector<job> jobs_;
+	std::vector<tail> tails_;
+};
+
+template<typename Traits>
+void hash_batch_impl<Traits>::update(std::basic_string_view<uint8_t> const* data, size_t count)
+{
+	jobs_.clear();
+	for (size_t i = 0; i < count && i < ctxs_.size(); ++i) {
+		auto & c = ctxs_[i];
+		uint8_t const* p = data[i].data();
+		size_t size = data[i].size();
+
+		// Complete a partially filled block first
+		if (c.index && size) {
+			size_t const fill = std::min(size, Traits::block_size - c.index);
+			Traits::update(c, fill, p);
+			p += fill;
+			size -= fill;
+		}
+		size_t const blocks = size / Traits::block_size;
+		size_t const rest = size % Traits::block_size;
+		if (blocks) {
+			jobs_.push_back({&c, p, blocks});
+			if (rest) {
+				tails_.push_back({&c, p + blocks * Traits::block_size, rest});
+			}
+		}
+		else if (rest) {
+			Traits::update(c, rest, p);
+		}
+	}
+
+#ifdef FZ_HASH_BATCH_AVX2
+	if (jobs_.size() > 1 && Traits::parallel()) {
+		process_parallel();
+	}
+#endif
+	for (auto const& j : jobs_) {
+		Traits::update(*j.ctx_, j.blocks_ * Traits::block_size, j.data_);
+	}
+
+	// Buffer what is left after the whole blocks
+	for (auto const& t : tails_) {
+		Traits::update(*t.ctx_, t.size_, t.data_);
+	}
+	tails_.clear();
+}
+
+#ifdef FZ_HASH_BATCH_AVX2
+template<typename Traits>
+void hash_batch_impl<Traits>::process_parallel()
+{
+	typename Traits::word dummy[8]{};
+	while (jobs_.size() > 1) {
+		// Process the streams with the most data together, until the shortest of them is done
+		size_t const n = std::min(Traits::lanes, jobs_.size());
+		std::partial_sort(jobs_.begin(), jobs_.begin() + n, jobs_.end(), [](job const& a, job const& b) { return a.blocks_ > b.blocks_; });
+		size_t const blocks = jobs_[n - 1].blocks_;
+
+		// Unused lanes hash the data of the first lane into a state that is discarded
+		typename Traits::word* states[Traits::lanes];
+		uint8_t const* data[Traits::lanes];
+		for (size_t l = 0; l < Traits::lanes; ++l) {
+			states[l] = l < n ? jobs_[l].ctx_->state : dummy;
+			data[l] = l < n ? jobs_[l].data_ : jobs_[0].data_;
+		}
+		Traits::blocks(states, data, blocks);
+
+		for (size_t l = 0; l < n; ++l) {
+			auto & j = jobs_[l];
+			Traits::add_blocks(*j.ctx_, blocks);
+			j.data_ += blocks * Traits::block_size;
+			j.blocks_ -= blocks;
+		}
+		jobs_.erase(std::remove_if(jobs_.begin(), jobs_.end(), [](job const& j) { return !j.blocks_; }), jobs_.end());
+	}
+}
+#endif
+}
+
+namespace {
+// For algorithms without parallel implementation
+class hash_batch_sequential final : public hash_accumulator_batch::impl
+{
+public:
+	hash_batch_sequential(hash_algorithm algorithm, size_t streams)
+	{
+		accumulators_.reserve(streams);
+		for (size_t i = 0; i < streams; ++i) {
+			accumulators_.emplace_back(std::make_unique<hash_accumulator>(algorithm));
+		}
+	}
+
+	virtual size_t size() const override
+	{
+		return accumulators_.size();
+	}
+
+	virtual void reinit() override
+	{
+		for (auto & acc : accumulators_) {
+			acc->reinit();
+		}
+	}
+
+	virtual void update(std::basic_string_view<uint8_t> const* data, size_t count) override
+	{
+		for (size_t i = 0; i < count && i < accumulators_.size(); ++i) {
+			accumulators_[i]->update(data[i]);
+		}
+	}
+
+	virtual void update(size_t stream, uint8_t const* data, size_t size) override
+	{
+		accumulators_[stream]->update(data, size);
+	}
+
+	virtual std::vector<uint8_t> digest(size_t stream) override
+	{
+		return accumulators_[stream]->digest();
+	}
+
+private:
+	std::vector<std::unique_ptr<hash_accumulator>> accumulators_;
+};
+}
+
+hash_accumulator_batch::hash_accumulator_batch(hash_algorithm algorithm, size_t streams)
+{
+	switch (algorithm) {
+	case hash_algorithm::md5:
+		impl_ = std::make_unique<hash_batch_impl<md5_traits>>(streams);
+		break;
+	case hash_algorithm::sha1:
+		impl_ = std::make_unique<hash_batch_impl<sha1_traits>>(streams);
+		break;
+	case hash_algorithm::sha256:
+		impl_ = std::make_unique<hash_batch_impl<sha256_traits>>(streams);
+		break;
+	case hash_algorithm::sha512:
+		impl_ = std::make_unique<hash_batch_impl<sha512_traits>>(streams);
+		break;
+	default:
+		impl_ = std::make_unique<hash_batch_sequential>(algorithm, streams);
+		break;
+	}
+}
+
+hash_accumulator_batch::~hash_accumulator_batch()
+{
+}
+
+size_t hash_accumulator_batch::size() const
+{
+	return impl_->size();
+}
+
+void hash_accumulator_batch::reinit()
+{
+	impl_->reinit();
+}
+
+void hash_accumulator_batch::update(std::vector<std::basic_string_view<uint8_t>> const& data)
+{
+	impl_->update(data.data(), data.size());
+}
+
+void hash_accumulator_batch::update(size_t stream, uint8_t const* data, size_t size)
+{
+	if (stream < impl_->size() && size) {
+		impl_->update(stream, data, size);
+	}
+}
+
+std::vector<uint8_t> hash_accumulator_batch::digest(size_t stream)
+{
+	if (stream >= impl_->size()) {
+		return {};
+	}
+	return impl_->digest(stream);
+}
+
+std::vector<std::vector<uint8_t>> hash_batch(hash_algorithm algorithm, std::vector<std::basic_string_view<uint8_t>> const& inputs)
+{
+	hash_accumulator_batch acc(algorithm, inputs.size());
+	acc.update(inputs);
+
+	std::vector<std::vector<uint8_t>> ret;
+	ret.reserve(inputs.size());
+	for (size_t i = 0; i < inputs.size(); ++i) {
+		ret.emplace_back(acc.digest(i));
+	}
+	return ret;
+}
+
+std::vector<std::vector<uint8_t>> hash_batch(hash_algorithm algorithm, std::vector<std::string_view> const& inputs)
+{
+	std::vector<std::basic_string_view<uint8_t>> views;
+	views.reserve(inputs.size());
+	for (auto const& in : inputs) {
+		views.emplace_back(reinterpret_cast<uint8_t const*>(in.data()), in.size());
+	}
+	return hash_batch(algorithm, views);
+}
+
+}
@@ -1,5 +1,7 @@
 #include "libfilezilla/hostname_lookup.hpp"
 
+#include "resolver_cache.hpp"
+
 #ifdef FZ_WINDOWS
 #include "libfilezilla/glue/windows.hpp"
 #include <winsock2.h>
@@ -16,8 +18,226 @@
 #include <netdb.h>
 #endif
 
+#if HAVE_GETADDRINFO_A
+#include <signal.h>
+#endif
+
 namespace fz {
 
+int convert_msw_error_code(int error);
+
+namespace {
+int to_family(address_type family)
+{
+	switch (family) {
+	case address_type::ipv4:
+		return AF_INET;
+	case address_type::ipv6:
+		return AF_INET6;
+	default:
+		return AF_UNSPEC;
+	}
+}
+
+std::vector<std::string> to_strings(int & res, std::vector<resolved_address> const& resolved)
+{
+	std::vector<std::string> addrs;
+	if (res) {
+#ifdef FZ_WINDOWS
+		res = convert_msw_error_code(res);
+#endif
+	}
+	else {
+		for (auto const& a : resolved) {
+			auto s = socket::address_to_string(reinterpret_cast<sockaddr const*>(a.storage_), static_cast<int>(a.size_), false);
+			if (!s.empty()) {
+				addrs.emplace_back(std::move(s));
+			}
+		}
+	}
+	return addrs;
+}
+
+void filter_hostname_events(fz::hostname_lookup* lookup, fz::event_handler* handler)
+{
+	auto filter = [&](event_loop::Events::value_type const& ev) -> bool {
+		if (ev.first != handler) {
+			return false;
+		}
+		else if (ev.second->derived_type() != hostname_lookup_event::type()) {
+			return false;
+		}
+		return std::get<0>(static_cast<hostname_lookup_event const&>(*ev.second).v_) == lookup;
+	};
+
+	handler->get_event_loop().filter_events(filter);
+}
+}
+
+#if HAVE_GETADDRINFO_A
+// Lookups are multiplexed onto the resolver's own small set of worker threads
+// instead of blocking a thread each, queued lookups can be cancelled.
+namespace {
+// Guards the association between requests and their owners
+mutex& async_mutex()
+{
+	static mutex m{false};
+	return m;
+}
+}
+
+class hostname_lookup::impl
+{
+public:
+	impl(hostname_lookup * parent, event_handler* h)
+		: parent_(parent), handler_(h)
+	{
+	}
+
+	struct request final
+	{
+		gaicb cb_{};
+		addrinfo hints_{};
+		std::string host_;
+		int family_{};
+
+		// Null if the lookup has been abandoned, or for prefetches
+		impl* owner_{};
+	};
+
+	// Must be called with the async mutex held
+	static request* start(std::string const& host, int family, impl* owner);
+	void abandon();
+
+	static void on_resolved(sigval v);
+
+	hostname_lookup* parent_;
+	event_handler* handler_{};
+	request* pending_{};
+};
+
+hostname_lookup::impl::request* hostname_lookup::impl::start(std::string const& host, int family, impl* owner)
+{
+	auto req = new request;
+	req->host_ = host;
+	req->family_ = family;
+	req->owner_ = owner;
+	req->hints_.ai_family = family;
+	req->hints_.ai_socktype = SOCK_STREAM;
+#ifdef AI_IDN
+	req->hints_.ai_flags |= AI_IDN;
+#endif
+	req->cb_.ar_name = req->host_.c_str();
+	req->cb_.ar_request = &req->hints_;
+
+	sigevent sev{};
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = &on_resolved;
+	sev.sigev_value.sival_ptr = req;
+
+	gaicb* list[1] = {&req->cb_};
+	if (getaddrinfo_a(GAI_NOWAIT, list, 1, &sev)) {
+		delete req;
+		return nullptr;
+	}
+	return req;
+}
+
+void hostname_lookup::impl::abandon()
+{
+	if (pending_) {
+		if (gai_cancel(&pending_->cb_) == EAI_CANCELED) {
+			// No notification happens for cancelled requests
+			delete pending_;
+		}
+		else {
+			pending_->owner_ = nullptr;
+		}
+		pending_ = nullptr;
+	}
+}
+
+void hostname_lookup::impl::on_resolved(sigval v)
+{
+	auto req = static_cast<request*>(v.sival_ptr);
+
+	int res = gai_error(&req->cb_);
+	std::vector<resolved_address> resolved;
+	cache_resolved_host(req->host_, req->family_, res, req->cb_.ar_result, resolved);
+	if (req->cb_.ar_result) {
+		freeaddrinfo(req->cb_.ar_result);
+	}
+	auto addrs = to_strings(res, resolved);
+
+	scoped_lock l(async_mutex());
+	if (req->owner_) {
+		req->owner_->pending_ = nullptr;
+		req->owner_->handler_->send_event<hostname_lookup_event>(req->owner_->parent_, res, std::move(addrs));
+	}
+	delete req;
+}
+
+hostname_lookup::hostname_lookup(thread_pool&, event_handler& evt_handler)
+	: impl_(new impl(this, &evt_handler))
+{
+}
+
+bool hostname_lookup::lookup(native_string const& host, address_type family)
+{
+	if (host.empty()) {
+		return false;
+	}
+
+	scoped_lock l(async_mutex());
+	if (impl_->pending_) {
+		return false;
+	}
+
+	std::string const h = fz::to_string(host);
+	int const f = to_family(family);
+
+	int res{};
+	std::vector<resolved_address> resolved;
+	if (find_cached_host(h, f, res, resolved)) {
+		auto addrs = to_strings(res, resolved);
+		impl_->handler_->send_event<hostname_lookup_event>(this, res, std::move(addrs));
+		return true;
+	}
+
+	impl_->pending_ = impl::start(h, f, impl_);
+	return impl_->pending_ != nullptr;
+}
+
+bool hostname_lookup::prefetch(thread_pool&, native_string const& host, address_type family)
+{
+	if (host.empty()) {
+		return false;
+	}
+
+	if (!resolver_cache_enabled()) {
+		return false;
+	}
+
+	scoped_lock l(async_mutex());
+	return impl::start(fz::to_string(host), to_family(family), nullptr) != nullptr;
+}
+
+hostname_lookup::~hostname_lookup()
+{
+	scoped_lock l(async_mutex());
+	filter_hostname_events(this, impl_->handler_);
+	impl_->abandon();
+	delete impl_;
+}
+
+void hostname_lookup::reset()
+{
+	scoped_lock l(async_mutex());
+	filter_hostname_events(this, impl_->handler_);
+	impl_->abandon();
+}
+
+#else
 class hostname_lookup::impl
 {
 public:
@@ -28,7 +248,7 @@ public:
 
 	bool spawn() {
 		if (!thread_) {
-			thread_ = pool_.spawn([this](){ entry(); });
+			thread_ = pool_.spawn([this](){ entry(); }, "hostname lookup");
 		}
 		return thread_.operator bool();
 	}
@@ -61,8 +281,6 @@ void hostname_lookup::impl::entry()
 	delete this;
 }
 
-int convert_msw_error_code(int error);
-
 void hostname_lookup::impl::do_lookup(scoped_lock& l)
 {
 	if (host_.empty()) {
@@ -71,52 +289,16 @@ void hostname_lookup::impl::do_lookup(scoped_lock& l)
 
 	l.unlock();
 
-	addrinfo hints{};
-	switch (family_) {
-	case address_type::ipv4:
-		hints.ai_family = AF_INET;
-		break;
-	case address_type::ipv6:
-		hints.ai_family = AF_INET6;
-		break;
-	default:
-		hints.ai_family = AF_UNSPEC;
-		break;
-	}
-	hints.ai_socktype = SOCK_STREAM;
-#ifdef AI_IDN
-	hints.ai_flags |= AI_IDN;
-#endif
-
-	addrinfo* addressList{};
-	int res = getaddrinfo(host_.c_str(), nullptr, &hints, &addressList);
+	std::vector<resolved_address> resolved;
+	int res = resolve_host(host_, to_family(family_), resolved);
 
 	l.lock();
 
 	if (!thread_) {
-		if (!res) {
-			freeaddrinfo(addressList);
-		}
 		return;
 	}
 
-	std::vector<std::string> addrs;
-	if (res) {
-#ifdef FZ_WINDOWS
-		res = convert_msw_error_code(res);
-#endif
-	}
-	else {
-		for (addrinfo* addr = addressList; addr && !res; addr = addr->ai_next) {
-			auto s = socket::address_to_string(addr->ai_addr, addr->ai_addrlen, false);
-			if (!s.empty()) {
-				addrs.emplace_back(std::move(s));
-			}
-		}
-	}
-
-	freeaddrinfo(addressList);
-
+	auto addrs = to_strings(res, resolved);
 	handler_->send_event<hostname_lookup_event>(parent_, res, std::move(addrs));
 	host_.clear();
 }
@@ -147,21 +329,25 @@ bool hostname_lookup::lookup(native_string const& host, address_type family)
 	return true;
 }
 
-namespace {
-void filter_hostname_events(fz::hostname_lookup* lookup, fz::event_handler* handler)
+bool hostname_lookup::prefetch(thread_pool& pool, native_string const& host, address_type family)
 {
-	auto filter = [&](event_loop::Events::value_type const& ev) -> bool {
-		if (ev.first != handler) {
-			return false;
-		}
-		else if (ev.second->derived_type() != hostname_lookup_event::type()) {
-			return false;
-		}
-		return std::get<0>(static_cast<hostname_lookup_event const&>(*ev.second).v_) == lookup;
-	};
+	if (host.empty()) {
+		return false;
+	}
 
-	handler->event_loop_.filter_events(filter);
-}
+	if (!resolver_cache_enabled()) {
+		return false;
+	}
+
+	auto task = pool.spawn([h = fz::to_string(host), f = to_family(family)]() {
+		std::vector<resolved_address> resolved;
+		resolve_host(h, f, resolved);
+	});
+	if (!task) {
+		return false;
+	}
+	task.detach();
+	return true;
 }
 
 hostname_lookup::~hostname_lookup()
@@ -194,4 +380,6 @@ void hostname_lookup::reset()
 	}
 }
 
+#endif
+
 }
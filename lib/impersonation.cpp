@@ -3,7 +3,10 @@
 #if FZ_UNIX || FZ_MAC
 
 #include "libfilezilla/buffer.hpp"
+#include "libfilezilla/mutex.hpp"
 
+#include <list>
+#include <map>
 #include <optional>
 #include <tuple>
 
@@ -233,19 +236,169 @@ bool check_auth(native_string const& username, native_string const& password)
 }
 }
 
-impersonation_token::impersonation_token(native_string const& username, native_string const& password)
+namespace {
+// What gets looked up about a user through NSS, never credentials
+struct user_info final
+{
+	native_string home_;
+	uid_t uid_{};
+	gid_t gid_{};
+	std::vector<gid_t> sup_groups_;
+};
+
+template<typename Value>
+class ttl_cache final
+{
+public:
+	std::optional<Value> find(native_string const& key)
+	{
+		auto it = entries_.find(key);
+		if (it == entries_.end()) {
+			return {};
+		}
+		if (!(monotonic_clock::coarse_now() < it->second.expiry_)) {
+			lru_.erase(it->second.lru_);
+			entries_.erase(it);
+			return {};
+		}
+		lru_.splice(lru_.begin(), lru_, it->second.lru_);
+		return it->second.value_;
+	}
+
+	void store(native_string const& key, Value const& value, duration const& ttl, size_t max)
+	{
+		auto [it, inserted] = entries_.try_emplace(key);
+		if (inserted) {
+			lru_.push_front(it);
+			it->second.lru_ = lru_.begin();
+		}
+		else {
+			lru_.splice(lru_.begin(), lru_, it->second.lru_);
+		}
+		it->second.value_ = value;
+		it->second.expiry_ = monotonic_clock::coarse_now() + ttl;
+		trim(max);
+	}
+
+	void erase(native_string const& key)
+	{
+		auto it = entries_.find(key);
+		if (it != entries_.end()) {
+			lru_.erase(it->second.lru_);
+			entries_.erase(it);
+		}
+	}
+
+	void trim(size_t max)
+	{
+		while (entries_.size() > max) {
+			entries_.erase(lru_.back());
+			lru_.pop_back();
+		}
+	}
+
+private:
+	struct entry;
+	typedef std::map<native_string, entry> entries;
+	struct entry final
+	{
+		Value value_;
+		monotonic_clock expiry_;
+		typename std::list<typename entries::iterator>::iterator lru_;
+	};
+
+	entries entries_;
+
+	// Most recently used first
+	std::list<typename entries::iterator> lru_;
+};
+
+struct lookup_cache final
+{
+	mutex mtx_{false};
+
+	duration ttl_;
+	size_t max_entries_{};
+
+	ttl_cache<user_info> users_;
+	ttl_cache<gid_t> groups_;
+};
+
+lookup_cache& get_cache()
 {
+	static lookup_cache cache;
+	return cache;
+}
+
+// Failed lookups are not cached, newly created accounts are usable right away.
+std::optional<user_info> get_user_info(native_string const& username)
+{
+	auto & cache = get_cache();
+	{
+		scoped_lock l(cache.mtx_);
+		if (cache.max_entries_) {
+			auto info = cache.users_.find(username);
+			if (info) {
+				return info;
+			}
+		}
+	}
+
 	auto pwd = get_passwd(username);
-	if (pwd.pwd_) {
+	if (!pwd.pwd_) {
+		return {};
+	}
+
+	user_info info;
+	if (pwd.pwd_->pw_dir) {
+		info.home_ = pwd.pwd_->pw_dir;
+	}
+	info.uid_ = pwd.pwd_->pw_uid;
+	info.gid_ = pwd.pwd_->pw_gid;
+	info.sup_groups_ = get_supplementary(username, pwd.pwd_->pw_gid);
+
+	scoped_lock l(cache.mtx_);
+	if (cache.max_entries_) {
+		cache.users_.store(username, info, cache.ttl_, cache.max_entries_);
+	}
+	return info;
+}
+
+std::optional<gid_t> get_cached_group(native_string const& gname)
+{
+	auto & cache = get_cache();
+	{
+		scoped_lock l(cache.mtx_);
+		if (cache.max_entries_) {
+			auto gid = cache.groups_.find(gname);
+			if (gid) {
+				return gid;
+			}
+		}
+	}
+
+	auto gid = get_group(gname);
+	if (gid) {
+		scoped_lock l(cache.mtx_);
+		if (cache.max_entries_) {
+			cache.groups_.store(gname, *gid, cache.ttl_, cache.max_entries_);
+		}
+	}
+	return gid;
+}
+}
+
+impersonation_token::impersonation_token(native_string const& username, native_string const& password)
+{
+	auto info = get_user_info(username);
+	if (info) {
 		if (check_auth(username, password)) {
 			impl_ = std::make_unique<impersonation_token_impl>();
 			impl_->name_ = username;
-			if (pwd.pwd_->pw_dir) {
-				impl_->home_ = pwd.pwd_->pw_dir;
-			}
-			impl_->uid_ = pwd.pwd_->pw_uid;
-			impl_->gid_ = pwd.pwd_->pw_gid;
-			impl_->sup_groups_ = get_supplementary(username, pwd.pwd_->pw_gid);
+			impl_->home_ = std::move(info->home_);
+			impl_->uid_ = info->uid_;
+			impl_->gid_ = info->gid_;
+			impl_->sup_groups_ = std::move(info->sup_groups_);
 		}
 	}
 }
@@ -253,30 +406,51 @@ impersonation_token::impersonation_token(native_string const& username, native_s
 impersonation_token::impersonation_token(native_string const& username, impersonation_flag flag, native_string const& group)
 {
 	if (flag == impersonation_flag::pwless) {
-		auto pwd = get_passwd(username);
-		if (pwd.pwd_) {
+		auto info = get_user_info(username);
+		if (info) {
 			impl_ = std::make_unique<impersonation_token_impl>();
 			impl_->name_ = username;
-			if (pwd.pwd_->pw_dir) {
-				impl_->home_ = pwd.pwd_->pw_dir;
-			}
-			impl_->uid_ = pwd.pwd_->pw_uid;
+			impl_->home_ = std::move(info->home_);
+			impl_->uid_ = info->uid_;
 			if (group.empty()) {
-				impl_->gid_ = pwd.pwd_->pw_gid;
+				impl_->gid_ = info->gid_;
 			}
 			else {
-				auto gid = get_group(group);
+				auto gid = get_cached_group(group);
 				if (!gid) {
 					impl_.reset();
 					return;
 				}
 				impl_->gid_ = *gid;
 			}
-			impl_->sup_groups_ = get_supplementary(username, pwd.pwd_->pw_gid);
+			impl_->sup_groups_ = std::move(info->sup_groups_);
 		}
 	}
 }
 
+void impersonation_token::set_cache(duration const& ttl, size_t max_entries)
+{
+	auto & cache = get_cache();
+	scoped_lock l(cache.mtx_);
+	cache.ttl_ = ttl;
+	cache.max_entries_ = ttl ? max_entries : 0;
+	cache.users_.trim(cache.max_entries_);
+	cache.groups_.trim(cache.max_entries_);
+}
+
+void impersonation_token::flush_cache(native_string const& username)
+{
+	auto & cache = get_cache();
+	scoped_lock l(cache.mtx_);
+	if (username.empty()) {
+		cache.users_.trim(0);
+		cache.groups_.trim(0);
+	}
+	else {
+		cache.users_.erase(username);
+	}
+}
+
 native_string impersonation_token::username() const
 {
 	return impl_ ? impl_->name_ : native_string();
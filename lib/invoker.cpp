@@ -16,7 +16,7 @@ thread_invoker::~thread_invoker()
 void thread_invoker::operator()(fz::event_base const& ev)
 {
 	if (ev.derived_type() == invoker_event::type()) {
-		auto const& cb = std::get<0>(static_cast<invoker_event const&>(ev).v_);
+		auto & cb = std::get<0>(static_cast<invoker_event const&>(ev).v_);
 		if (cb) {
 			cb();
 		}
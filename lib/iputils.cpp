@@ -1,5 +1,6 @@
 #include "libfilezilla/iputils.hpp"
 #include "libfilezilla/encode.hpp"
+#include "libfilezilla/util.hpp"
 
 #if FZ_WINDOWS
 #include "libfilezilla/socket.hpp"
@@ -98,6 +99,11 @@ OutString do_get_ipv6_long_form(String const& short_address)
 
 	size_t right_segments{};
 
+	if (start + 1 == end && short_address[start] == ':') {
+		// Nothing after trailing ::
+		start = end;
+	}
+
 	// Right half, after possible ::
 	while (left_segments + right_segments < 8 && start < end) {
 		--end;
@@ -298,6 +304,333 @@ address_type get_address_type(std::wstring_view const& address)
 	return do_get_address_type(address);
 }
 
+namespace {
+template<typename String>
+void parse_ip_address(String const& address, uint64_t & hi, uint64_t & lo, address_type & type)
+{
+	auto const long_form = do_get_ipv6_long_form(address);
+	if (!long_form.empty()) {
+		for (size_t i = 0; i < 8; ++i) {
+			auto const* group = long_form.data() + i * 5;
+			uint64_t const v = (hex_char_to_int(group[0]) << 12) | (hex_char_to_int(group[1]) << 8) | (hex_char_to_int(group[2]) << 4) | hex_char_to_int(group[3]);
+			(i < 4 ? hi : lo) |= v << (48 - 16 * (i % 4));
+		}
+		type = address_type::ipv6;
+	}
+	else if (do_get_address_type(address) == address_type::ipv4) {
+		// Already validated
+		uint64_t v{};
+		uint64_t segment{};
+		for (auto const& c : address) {
+			if (c == '.') {
+				v = (v << 8) | segment;
+				segment = 0;
+			}
+			else {
+				segment = segment * 10 + static_cast<uint64_t>(c - '0');
+			}
+		}
+		hi = ((v << 8) | segment) << 32;
+		type = address_type::ipv4;
+	}
+}
+
+unsigned int address_bits(address_type type)
+{
+	return type == address_type::ipv6 ? 128 : 32;
+}
+
+// Bits are counted from the most significant one
+unsigned int get_bit(uint64_t hi, uint64_t lo, unsigned int bit)
+{
+	return static_cast<unsigned int>(bit < 64 ? (hi >> (63 - bit)) & 1 : (lo >> (127 - bit)) & 1);
+}
+
+// Returns the number of leading bits both have in common, at most max
+unsigned int common_prefix(uint64_t hi1, uint64_t lo1, uint64_t hi2, uint64_t lo2, unsigned int max)
+{
+	unsigned int n = 128;
+	if (hi1 != hi2) {
+		n = 63 - static_cast<unsigned int>(bitscan_reverse(hi1 ^ hi2));
+	}
+	else if (lo1 != lo2) {
+		n = 127 - static_cast<unsigned int>(bitscan_reverse(lo1 ^ lo2));
+	}
+	return n < max ? n : max;
+}
+}
+
+ip_address::ip_address(std::string_view const& address)
+{
+	parse_ip_address(address, hi_, lo_, type_);
+}
+
+ip_address::ip_address(std::wstring_view const& address)
+{
+	parse_ip_address(address, hi_, lo_, type_);
+}
+
+ip_address::ip_address(std::basic_string_view<uint8_t> const& bytes)
+{
+	if (bytes.size() == 4) {
+		for (size_t i = 0; i < 4; ++i) {
+			hi_ |= uint64_t(bytes[i]) << (56 - 8 * i);
+		}
+		type_ = address_type::ipv4;
+	}
+	else if (bytes.size() == 16) {
+		for (size_t i = 0; i < 8; ++i) {
+			hi_ |= uint64_t(bytes[i]) << (56 - 8 * i);
+			lo_ |= uint64_t(bytes[i + 8]) << (56 - 8 * i);
+		}
+		type_ = address_type::ipv6;
+	}
+}
+
+std::vector<uint8_t> ip_address::bytes() const
+{
+	std::vector<uint8_t> ret;
+	if (type_ == address_type::ipv4) {
+		for (size_t i = 0; i < 4; ++i) {
+			ret.push_back(static_cast<uint8_t>(hi_ >> (56 - 8 * i)));
+		}
+	}
+	else if (type_ == address_type::ipv6) {
+		for (size_t i = 0; i < 16; ++i) {
+			ret.push_back(static_cast<uint8_t>((i < 8 ? hi_ : lo_) >> (56 - 8 * (i % 8))));
+		}
+	}
+	return ret;
+}
+
+std::string ip_address::to_string() const
+{
+	std::string ret;
+	if (type_ == address_type::ipv4) {
+		for (size_t i = 0; i < 4; ++i) {
+			if (i) {
+				ret += '.';
+			}
+			ret += fz::to_string((hi_ >> (56 - 8 * i)) & 0xff);
+		}
+	}
+	else if (type_ == address_type::ipv6) {
+		unsigned int groups[8];
+		for (size_t i = 0; i < 8; ++i) {
+			groups[i] = static_cast<unsigned int>(((i < 4 ? hi_ : lo_) >> (48 - 16 * (i % 4))) & 0xffff);
+		}
+
+		// Only the first of the longest runs of at least two zero groups gets shortened, see RFC 5952
+		size_t zeros_start{};
+		size_t zeros{};
+		for (size_t i = 0; i < 8; ) {
+			size_t run{};
+			while (i + run < 8 && !groups[i + run]) {
+				++run;
+			}
+			if (run > zeros && run > 1) {
+				zeros_start = i;
+				zeros = run;
+			}
+			i += run ? run : 1;
+		}
+
+		for (size_t i = 0; i < 8; ++i) {
+			if (zeros && i == zeros_start) {
+				ret += "::";
+				i += zeros - 1;
+				continue;
+			}
+			if (i && ret.back() != ':') {
+				ret += ':';
+			}
+			bool leading = true;
+			for (int shift = 12; shift >= 0; shift -= 4) {
+				int const d = (groups[i] >> shift) & 0xf;
+				if (d || !leading || !shift) {
+					ret += int_to_hex_char<char>(d);
+					leading = false;
+				}
+			}
+		}
+	}
+	return ret;
+}
+
+ip_address ip_address::unmapped() const
+{
+	if (type_ == address_type::ipv6 && !hi_ && (lo_ >> 32) == 0xffff) {
+		ip_address ret;
+		ret.hi_ = lo_ << 32;
+		ret.type_ = address_type::ipv4;
+		return ret;
+	}
+	return *this;
+}
+
+ip_address ip_address::masked(unsigned int prefix_length) const
+{
+	ip_address ret = *this;
+	if (prefix_length < 64) {
+		ret.hi_ &= ~(~uint64_t(0) >> prefix_length);
+		ret.lo_ = 0;
+	}
+	else if (prefix_length < 128) {
+		ret.lo_ &= ~(~uint64_t(0) >> (prefix_length - 64));
+	}
+	return ret;
+}
+
+bool ip_address::is_routable() const
+{
+	if (type_ == address_type::ipv4) {
+		auto const v = hi_ >> 32;
+		return
+			(v >> 24) != 127 &&    // 127.0.0.0/8
+			(v >> 24) != 10 &&     // 10.0.0.0/8
+			(v >> 20) != 0xac1 &&  // 172.16.0.0/12
+			(v >> 16) != 0xc0a8 && // 192.168.0.0/16
+			(v >> 16) != 0xa9fe;   // 169.254.0.0/16
+	}
+	else if (type_ == address_type::ipv6) {
+		if (!hi_) {
+			if (lo_ <= 1) {
+				// ::/128 and ::1/128
+				return false;
+			}
+			if ((lo_ >> 32) == 0xffff) {
+				return unmapped().is_routable();
+			}
+			return true;
+		}
+		return
+			(hi_ >> 54) != 0x3fa && // fe80::/10
+			(hi_ >> 57) != 0x7e;    // fc00::/7
+	}
+	return false;
+}
+
+std::size_t ip_address::hash() const noexcept
+{
+	uint64_t h = hi_ * 0x9e3779b97f4a7c15ull;
+	h ^= lo_ + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	h ^= static_cast<uint64_t>(type_);
+	return static_cast<std::size_t>(h);
+}
+
+bool cidr_set::add(ip_address const& network, unsigned int prefix_length)
+{
+	if (!network || prefix_length > address_bits(network.type_)) {
+		return false;
+	}
+
+	auto const a = network.masked(prefix_length);
+	auto & nodes = nodes_[a.type_ == address_type::ipv6];
+
+	node const leaf{a.hi_, a.lo_, {}, static_cast<uint8_t>(prefix_length), true};
+	if (nodes.empty()) {
+		nodes.push_back(leaf);
+		return true;
+	}
+
+	uint32_t i = 0;
+	while (true) {
+		node & n = nodes[i];
+		unsigned int const common = common_prefix(n.hi_, n.lo_, a.hi_, a.lo_, n.length_ < prefix_length ? n.length_ : prefix_length);
+		if (common < n.length_) {
+			if (common == prefix_length) {
+				// The new network contains the entire subtree, which becomes unreachable
+				n = leaf;
+			}
+			else {
+				// Split at the first differing bit
+				uint32_t const moved = static_cast<uint32_t>(nodes.size());
+				nodes.push_back(n);
+				nodes.push_back(leaf);
+
+				unsigned int const bit = get_bit(a.hi_, a.lo_, common);
+				node & branch = nodes[i];
+				branch.length_ = static_cast<uint8_t>(common);
+				branch.terminal_ = false;
+				branch.children_[bit] = moved + 1;
+				branch.children_[bit ^ 1] = moved;
+			}
+			return true;
+		}
+
+		if (n.terminal_) {
+			// Already covered
+			return true;
+		}
+
+		if (n.length_ == prefix_length) {
+			n = leaf;
+			return true;
+		}
+
+		unsigned int const bit = get_bit(a.hi_, a.lo_, n.length_);
+		if (!n.children_[bit]) {
+			n.children_[bit] = static_cast<uint32_t>(nodes.size());
+			nodes.push_back(leaf);
+			return true;
+		}
+		i = n.children_[bit];
+	}
+}
+
+bool cidr_set::add(std::string_view const& cidr)
+{
+	auto const pos = cidr.find('/');
+	ip_address const network(cidr.substr(0, pos));
+	if (!network) {
+		return false;
+	}
+
+	unsigned int prefix_length = address_bits(network.type());
+	if (pos != std::string_view::npos) {
+		auto const length = cidr.substr(pos + 1);
+		if (length.empty() || length.size() > 3 || length.find_first_not_of("0123456789") != std::string_view::npos) {
+			return false;
+		}
+		prefix_length = fz::to_integral<unsigned int>(length);
+	}
+
+	return add(network, prefix_length);
+}
+
+bool cidr_set::contains(ip_address const& address) const
+{
+	auto const a = address.unmapped();
+	if (!a) {
+		return false;
+	}
+
+	auto const& nodes = nodes_[a.type_ == address_type::ipv6];
+	if (nodes.empty()) {
+		return false;
+	}
+
+	// Only terminal nodes need to be compared in full: If the address is not within the
+	// prefix of a node, it is not within the prefix of any of the node's descendants either.
+	uint32_t i = 0;
+	while (true) {
+		node const& n = nodes[i];
+		if (n.terminal_) {
+			return common_prefix(n.hi_, n.lo_, a.hi_, a.lo_, n.length_) == n.length_;
+		}
+		i = n.children_[get_bit(a.hi_, a.lo_, n.length_)];
+		if (!i) {
+			return false;
+		}
+	}
+}
+
+void cidr_set::clear()
+{
+	nodes_[0].clear();
+	nodes_[1].clear();
+}
+
 
 std::optional<std::vector<network_interface>> FZ_PUBLIC_SYMBOL get_network_interfaces()
 {
@@ -1,6 +1,19 @@
 #include "libfilezilla/buffer.hpp"
+#include "libfilezilla/buffer_chain.hpp"
 #include "libfilezilla/encode.hpp"
 #include "libfilezilla/json.hpp"
+#include "libfilezilla/util.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <limits>
+
+// The NEON kernels have not been run on aarch64 yet, so the scalar code is used unless FZ_USE_NEON is defined.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+#include <arm_neon.h>
+#endif
 
 #include "string.h"
 
@@ -137,35 +150,109 @@ void json::clear()
 }
 
 namespace {
-void json_append_escaped(std::string & out, std::string const& s)
+// The character following the backslash for characters that need escaping, 0 otherwise
+struct escape_table final
 {
-	for (auto & c : s) {
-		switch (c) {
-		case '\r':
-			out += "\\r";
-			break;
-		case '"':
-			out += "\\\"";
-			break;
-		case '\\':
-			out += "\\\\";
-			break;
-		case '\n':
-			out += "\\n";
-			break;
-		case '\t':
-			out += "\\t";
-			break;
-		case '\b':
-			out += "\\b";
-			break;
-		case '\f':
-			out += "\\f";
-			break;
-		default:
-			out += c;
+	constexpr escape_table()
+	{
+		t_['\r'] = 'r';
+		t_['"'] = '"';
+		t_['\\'] = '\\';
+		t_['\n'] = 'n';
+		t_['\t'] = 't';
+		t_['\b'] = 'b';
+		t_['\f'] = 'f';
+	}
+
+	char t_[256]{};
+};
+constexpr escape_table escapes;
+
+class string_writer final
+{
+public:
+	explicit string_writer(std::string & s)
+		: s_(s)
+	{}
+
+	void append(std::string_view const& v) { s_ += v; }
+	void append(char c) { s_ += c; }
+	void pad(size_t n) { s_.append(n, ' '); }
+
+private:
+	std::string & s_;
+};
+
+class buffer_writer final
+{
+public:
+	explicit buffer_writer(buffer & b)
+		: b_(b)
+	{}
+
+	void append(std::string_view const& v) { b_.append(v); }
+	void append(char c) { b_.append(static_cast<unsigned char>(c)); }
+	void pad(size_t n) { b_.append(n, ' '); }
+
+private:
+	buffer & b_;
+};
+
+// Fills whole segments and hands them to the chain, which adopts them without copying
+class chain_writer final
+{
+public:
+	explicit chain_writer(buffer_chain & c)
+		: c_(c)
+	{}
+
+	~chain_writer()
+	{
+		if (!b_.empty()) {
+			c_.append(std::move(b_));
+		}
+	}
+
+	void append(std::string_view const& v) {
+		b_.append(v);
+		flush();
+	}
+	void append(char c) {
+		b_.append(static_cast<unsigned char>(c));
+		flush();
+	}
+	void pad(size_t n) {
+		b_.append(n, ' ');
+		flush();
+	}
+
+private:
+	void flush() {
+		if (b_.size() >= buffer_chain::segment_size) {
+			c_.append(std::move(b_));
+			b_ = buffer();
+		}
+	}
+
+	buffer_chain & c_;
+	buffer b_;
+};
+
+template<typename Writer>
+void json_append_escaped(Writer & out, std::string_view const& s)
+{
+	// Copy runs of characters not needing escaping in bulk
+	size_t start{};
+	for (size_t i = 0; i < s.size(); ++i) {
+		char const e = escapes.t_[static_cast<unsigned char>(s[i])];
+		if (e) {
+			out.append(s.substr(start, i - start));
+			char const seq[2] = {'\\', e};
+			out.append(std::string_view(seq, 2));
+			start = i + 1;
 		}
 	}
+	out.append(s.substr(start));
 }
 }
 
@@ -176,13 +263,32 @@ std::string json::to_string(bool pretty, size_t depth) const
 }
 
 void json::to_string(std::string & ret, bool pretty, size_t depth) const
+{
+	string_writer out(ret);
+	write(out, pretty, depth);
+}
+
+void json::to_string(buffer & ret, bool pretty, size_t depth) const
+{
+	buffer_writer out(ret);
+	write(out, pretty, depth);
+}
+
+void json::to_string(buffer_chain & ret, bool pretty, size_t depth) const
+{
+	chain_writer out(ret);
+	write(out, pretty, depth);
+}
+
+template<typename Writer>
+void json::write(Writer & out, bool pretty, size_t depth) const
 {
 	switch (type()) {
 	case json_type::object: {
-		ret += '{';
+		out.append('{');
 		if (pretty) {
-			ret += '\n';
-			ret.append(depth * 2 + 2, ' ');
+			out.append('\n');
+			out.pad(depth * 2 + 2);
 		}
 		bool first{true};
 		for (auto const& c : *std::get_if<std::size_t(json_type::object)>(&value_)) {
@@ -193,32 +299,32 @@ void json::to_string(std::string & ret, bool pretty, size_t depth) const
 				first = false;
 			}
 			else {
-				ret += ',';
+				out.append(',');
 				if (pretty) {
-					ret += '\n';
-					ret.append(depth * 2 + 2, ' ');
+					out.append('\n');
+					out.pad(depth * 2 + 2);
 				}
 			}
-			ret += '"';
-			json_append_escaped(ret, c.first);
-			ret += "\":";
+			out.append('"');
+			json_append_escaped(out, c.first);
+			out.append(std::string_view("\":"));
 			if (pretty) {
-				ret += ' ';
+				out.append(' ');
 			}
-			c.second.to_string(ret, pretty, depth + 1);
+			c.second.write(out, pretty, depth + 1);
 		}
 		if (pretty) {
-			ret += '\n';
-			ret.append(depth * 2, ' ');
+			out.append('\n');
+			out.pad(depth * 2);
 		}
-		ret += '}';
+		out.append('}');
 		break;
 	}
 	case json_type::array: {
-		ret += '[';
+		out.append('[');
 		if (pretty) {
-			ret += '\n';
-			ret.append(depth * 2 + 2, ' ');
+			out.append('\n');
+			out.pad(depth * 2 + 2);
 		}
 		bool first = true;
 		for (auto const& c : *std::get_if<std::size_t(json_type::array)>(&value_)) {
@@ -226,39 +332,39 @@ void json::to_string(std::string & ret, bool pretty, size_t depth) const
 				first = false;
 			}
 			else {
-				ret += ',';
+				out.append(',');
 				if (pretty) {
-					ret += '\n';
-					ret.append(depth * 2 + 2, ' ');
+					out.append('\n');
+					out.pad(depth * 2 + 2);
 				}
 			}
 			if (!c) {
-				ret += "null";
+				out.append(std::string_view("null"));
 			}
 			else {
-				c.to_string(ret, pretty, depth + 1);
+				c.write(out, pretty, depth + 1);
 			}
 		}
 		if (pretty) {
-			ret += '\n';
-			ret.append(depth * 2, ' ');
+			out.append('\n');
+			out.pad(depth * 2);
 		}
-		ret += ']';
+		out.append(']');
 		break;
 	}
 	case json_type::boolean:
-		ret += *std::get_if<std::size_t(json_type::boolean)>(&value_) ? "true" : "false";
+		out.append(std::string_view(*std::get_if<std::size_t(json_type::boolean)>(&value_) ? "true" : "false"));
 		break;
 	case json_type::number:
-		ret += *std::get_if<std::size_t(json_type::number)>(&value_);
+		out.append(std::get_if<std::size_t(json_type::number)>(&value_)->text_);
 		break;
 	case json_type::null:
-		ret += "null";
+		out.append(std::string_view("null"));
 		break;
 	case json_type::string:
-		ret += '"';
-		json_append_escaped(ret, *std::get_if<std::size_t(json_type::string)>(&value_));
-		ret += '"';
+		out.append('"');
+		json_append_escaped(out, *std::get_if<std::size_t(json_type::string)>(&value_));
+		out.append('"');
 		break;
 	case json_type::none:
 		break;
@@ -281,6 +387,111 @@ json json::parse(buffer const& b, size_t max_depth)
 }
 
 namespace {
+// Finding the end of strings, or the next escape sequence in them, dominates parsing string-heavy
+// input. Look at whole blocks at once where possible.
+char const* find_string_special_scalar(char const* p, char const* end)
+{
+	while (p < end && *p != '"' && *p != '\\' && *p) {
+		++p;
+	}
+	return p;
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+char const* find_string_special_sse2(char const* p, char const* end)
+{
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const backslash = _mm_set1_epi8('\\');
+	__m128i const zero = _mm_setzero_si128();
+	while (end - p >= 16) {
+		__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+		__m128i const m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)), _mm_cmpeq_epi8(v, zero));
+		int const mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return p + bitscan(static_cast<unsigned int>(mask));
+		}
+		p += 16;
+	}
+	return find_string_special_scalar(p, end);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__((target("avx2")))
+char const* find_string_special_avx2(char const* p, char const* end)
+{
+	__m256i const quote = _mm256_set1_epi8('"');
+	__m256i const backslash = _mm256_set1_epi8('\\');
+	__m256i const zero = _mm256_setzero_si256();
+	while (end - p >= 32) {
+		__m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+		__m256i const m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)), _mm256_cmpeq_epi8(v, zero));
+		unsigned int const mask = static_cast<unsigned int>(_mm256_movemask_epi8(m));
+		if (mask) {
+			return p + bitscan(mask);
+		}
+		p += 32;
+	}
+	return find_string_special_sse2(p, end);
+}
+
+char const* find_string_special_long(char const* p, char const* end)
+{
+	typedef char const* (*impl_t)(char const*, char const*);
+	static impl_t const impl = []() -> impl_t {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return &find_string_special_avx2;
+		}
+		return &find_string_special_sse2;
+	}();
+	return impl(p, end);
+}
+#else
+char const* find_string_special_long(char const* p, char const* end)
+{
+	return find_string_special_sse2(p, end);
+}
+#endif
+
+char const* find_string_special(char const* p, char const* end)
+{
+	// Most strings are short, only go through dispatch for longer ones
+	if (end - p >= 16) {
+		__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+		__m128i const m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+		int const mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return p + bitscan(static_cast<unsigned int>(mask));
+		}
+		return find_string_special_long(p + 16, end);
+	}
+	return find_string_special_scalar(p, end);
+}
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+char const* find_string_special(char const* p, char const* end)
+{
+	uint8x16_t const quote = vdupq_n_u8('"');
+	uint8x16_t const backslash = vdupq_n_u8('\\');
+	uint8x16_t const zero = vdupq_n_u8(0);
+	while (end - p >= 16) {
+		uint8x16_t const v = vld1q_u8(reinterpret_cast<uint8_t const*>(p));
+		uint8x16_t const m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)), vceqq_u8(v, zero));
+		// Narrow to 4 bits per byte to get a scalar mask
+		uint64_t const mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (mask) {
+			return p + (bitscan(mask) >> 2);
+		}
+		p += 16;
+	}
+	return find_string_special_scalar(p, end);
+}
+#else
+char const* find_string_special(char const* p, char const* end)
+{
+	return find_string_special_scalar(p, end);
+}
+#endif
+
 void skip_ws(char const*& p, char const* end)
 {
 	while (p < end) {
@@ -300,12 +511,21 @@ void skip_ws(char const*& p, char const* end)
 
 // Leading " has already been consumed
 // Consumes trailing "
-std::pair<std::string, bool> json_unescape_string(char const*& p, char const* end, bool allow_null)
+// Appends to output, on failure output is left in an unspecified state
+bool json_unescape_append(std::string & ret, char const*& p, char const* end, bool allow_null)
 {
-	std::string ret;
-
 	bool in_escape{};
 	while (p < end) {
+		if (!in_escape) {
+			// Copy everything up to the next quote, backslash or null byte in one go
+			char const* special = find_string_special(p, end);
+			ret.append(p, special);
+			p = special;
+			if (p == end) {
+				break;
+			}
+		}
+
 		char c = *(p++);
 		if (in_escape) {
 			in_escape = false;
@@ -337,12 +557,12 @@ std::pair<std::string, bool> json_unescape_string(char const*& p, char const* en
 				case 'u': {
 					uint32_t u{};
 					if (end - p < 4) {
-						return {};
+						return false;
 					}
 					for (size_t i = 0; i < 4; ++i) {
 						int h = hex_char_to_int(*(p++));
 						if (h == -1) {
-							return {};
+							return false;
 						}
 						u <<= 4;
 						u += static_cast<uint32_t>(h);
@@ -350,41 +570,41 @@ std::pair<std::string, bool> json_unescape_string(char const*& p, char const* en
 					if (u >= 0xd800u && u <= 0xdbffu) {
 						// High Surrogate, look for partner
 						if (end - p < 6) {
-							return {};
+							return false;
 						}
 						else if (*(p++) != '\\') {
-							return {};
+							return false;
 						}
 						else if (*(p++) != 'u') {
-							return {};
+							return false;
 						}
 						uint32_t low{};
 						for (size_t i = 0; i < 4; ++i) {
 							int h = hex_char_to_int(*(p++));
 							if (h == -1) {
-								return {};
+								return false;
 							}
 							low <<= 4;
 							low += static_cast<uint32_t>(h);
 						}
 						if (low < 0xdc00u || low > 0xdfffu) {
 							// Not a Low Surrogate
-							return {};
+							return false;
 						}
 						u = (u & 0x3ffu) << 10;
 						u += low & 0x3ffu;
 						u += 0x10000u;
 						if (u > 0x10ffffu) {
 							// Too large
-							return {};
+							return false;
 						}
 					}
 					else if (u >= 0xdc00u && u <= 0xdfffu) {
 						// Stand-alone Low Surrogate, forbidden.
-						return {};
+						return false;
 					}
 					if (!u && !allow_null) {
-						return {};
+						return false;
 					}
 
 					if (u <= 0x7f) {
@@ -408,24 +628,31 @@ std::pair<std::string, bool> json_unescape_string(char const*& p, char const* en
 					break;
 				}
 				default:
-					return {};
+					return false;
 			}
 		}
 		else if (c == '"') {
-			return {ret, true};
+			return true;
 		}
 		else if (c == '\\') {
 			in_escape = true;
 		}
 		else if (!c && !allow_null) {
-			return {};
+			return false;
 		}
 		else {
 			ret += c;
 		}
 	}
 
-	return {};
+	return false;
+}
+
+std::pair<std::string, bool> json_unescape_string(char const*& p, char const* end, bool allow_null)
+{
+	std::string ret;
+	bool const r = json_unescape_append(ret, p, end, allow_null);
+	return {std::move(ret), r};
 }
 }
 
@@ -613,23 +840,20 @@ char get_radix() {
 	}();
 	return radix;
 }
-}
 
-double json::number_value_double() const
+double json_to_double(std::string_view const& s)
 {
-	std::string const *s{};
-
-	if (auto *v = std::get_if<std::size_t(json_type::number)>(&value_)) {
-		s = v;
-	}
-	else if (auto *v = std::get_if<std::size_t(json_type::string)>(&value_)) {
-		s = v;
-	}
-	else {
-		return {};
+#if defined(__cpp_lib_to_chars)
+	// Locale-independent and without copying. Anything it doesn't accept, e.g. hexadecimal
+	// numbers in strings or out of range values, goes through strtod as before.
+	double parsed{};
+	auto const r = std::from_chars(s.data(), s.data() + s.size(), parsed);
+	if (r.ec == std::errc() && r.ptr == s.data() + s.size()) {
+		return parsed;
 	}
+#endif
 
-	std::string v = *s;
+	std::string v(s);
 
 	size_t pos = v.find('.');
 	if (pos != std::string::npos) {
@@ -645,42 +869,65 @@ double json::number_value_double() const
 	return d;
 }
 
-uint64_t json::number_value_integer() const
+bool json_is_integral(std::string_view const& v)
 {
-	std::string const *s{};
-
-	if (auto *v = std::get_if<std::size_t(json_type::number)>(&value_)) {
-		s = v;
-	}
-	else if (auto *v = std::get_if<std::size_t(json_type::string)>(&value_)) {
-		s = v;
-	}
-	else {
-		return {};
-	}
-
-
-	std::string const& v = *s;
-	bool floating{};
-
 	size_t i = 0;
 	if (!v.empty() && v[0] == '-') {
 		++i;
 	}
 	for (; i < v.size(); ++i) {
 		if (v[i] < '0' || v[i] > '9') {
-			floating = true;
+			return false;
 		}
 	}
+	return true;
+}
 
+uint64_t json_to_integer(std::string_view const& v)
+{
 	// Only go through floating point if needed, so that large 64bit integers stay exact
-	if (floating) {
-		return static_cast<uint64_t>(number_value_double());
+	if (!json_is_integral(v)) {
+		return static_cast<uint64_t>(json_to_double(v));
 	}
 	else {
 		return to_integral<uint64_t>(v);
 	}
 }
+}
+
+json::parsed_number::parsed_number(std::string && text)
+	: text_(std::move(text))
+	, double_(json_to_double(text_))
+{
+	if (!json_is_integral(text_)) {
+		integer_ = static_cast<uint64_t>(double_);
+	}
+	else {
+		integer_ = to_integral<uint64_t>(text_);
+	}
+}
+
+double json::number_value_double() const
+{
+	if (auto *v = std::get_if<std::size_t(json_type::number)>(&value_)) {
+		return v->double_;
+	}
+	else if (auto *v = std::get_if<std::size_t(json_type::string)>(&value_)) {
+		return json_to_double(*v);
+	}
+	return {};
+}
+
+uint64_t json::number_value_integer() const
+{
+	if (auto *v = std::get_if<std::size_t(json_type::number)>(&value_)) {
+		return v->integer_;
+	}
+	else if (auto *v = std::get_if<std::size_t(json_type::string)>(&value_)) {
+		return json_to_integer(*v);
+	}
+	return {};
+}
 
 bool json::bool_value() const
 {
@@ -699,7 +946,7 @@ std::string json::string_value() const
 		return *v;
 	}
 	if (auto *v = std::get_if<std::size_t(json_type::number)>(&value_)) {
-		return *v;
+		return v->text_;
 	}
 	if (auto *v = std::get_if<std::size_t(json_type::boolean)>(&value_)) {
 		return *v ? "true" : "false";
@@ -730,4 +977,882 @@ json& json::operator=(json && j) noexcept
 	return *this;
 }
 
+
+namespace {
+// First character has already been checked to be a digit or minus sign
+bool scan_number(char const*& p, char const* end)
+{
+	auto const digits = [&]() {
+		while (p < end && *p >= '0' && *p <= '9') {
+			++p;
+		}
+	};
+	auto const after_digit = [&]() {
+		return p[-1] >= '0' && p[-1] <= '9';
+	};
+
+	++p;
+	digits();
+	if (p < end && *p == '.') {
+		if (!after_digit()) {
+			return false;
+		}
+		++p;
+		digits();
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		if (!after_digit()) {
+			return false;
+		}
+		++p;
+		if (p < end && (*p == '+' || *p == '-')) {
+			++p;
+		}
+		digits();
+	}
+	return after_digit();
+}
+}
+
+json_document json_document::parse(std::string_view const& s, size_t max_depth)
+{
+	json_document doc;
+	if (s.empty() || s.size() > std::numeric_limits<uint32_t>::max()) {
+		return doc;
+	}
+
+	doc.text_ = s;
+
+	// Children of all unfinished objects and arrays
+	std::vector<member> member_stack;
+	std::vector<uint32_t> element_stack;
+
+	char const* p = doc.text_.data();
+	uint32_t root{};
+	if (!doc.parse_value(p, max_depth, root, member_stack, element_stack)) {
+		return json_document();
+	}
+
+	doc.unescaped_.shrink_to_fit();
+	doc.nodes_.shrink_to_fit();
+	doc.members_.shrink_to_fit();
+	doc.elements_.shrink_to_fit();
+
+	return doc;
+}
+
+json_document json_document::parse(buffer const& b, size_t max_depth)
+{
+	return parse(b.to_view(), max_depth);
+}
+
+bool json_document::parse_string(char const*& p, uint32_t & offset, uint32_t & size, bool & unescaped)
+{
+	char const* const end = text_.data() + text_.size();
+
+	// Most strings have no escape sequences and can be referred to in place
+	char const* start = p;
+	p = find_string_special(p, end);
+	if (p < end && *p == '"') {
+		offset = static_cast<uint32_t>(start - text_.data());
+		size = static_cast<uint32_t>(p - start);
+		unescaped = false;
+		++p;
+		return true;
+	}
+
+	p = start;
+	offset = static_cast<uint32_t>(unescaped_.size());
+	if (!json_unescape_append(unescaped_, p, end, false)) {
+		return false;
+	}
+	size = static_cast<uint32_t>(unescaped_.size() - offset);
+	unescaped = true;
+	return true;
+}
+
+bool json_document::parse_value(char const*& p, size_t max_depth, uint32_t & out, std::vector<member> & member_stack, std::vector<uint32_t> & element_stack)
+{
+	if (!max_depth) {
+		return false;
+	}
+
+	char const* const end = text_.data() + text_.size();
+
+	skip_ws(p, end);
+	if (p == end) {
+		return false;
+	}
+
+	node n;
+	if (*p == '"') {
+		++p;
+		n.type_ = json_type::string;
+		if (!parse_string(p, n.offset_, n.size_, n.unescaped_)) {
+			return false;
+		}
+	}
+	else if (*p == '{') {
+		++p;
+
+		size_t const first = member_stack.size();
+		while (true) {
+			skip_ws(p, end);
+			if (p == end) {
+				return false;
+			}
+			if (*p == '}') {
+				++p;
+				break;
+			}
+
+			if (member_stack.size() != first) {
+				if (*(p++) != ',') {
+					return false;
+				}
+				skip_ws(p, end);
+				if (p == end) {
+					return false;
+				}
+				if (*p == '}') {
+					++p;
+					break;
+				}
+			}
+
+			if (*(p++) != '"') {
+				return false;
+			}
+			member m;
+			if (!parse_string(p, m.name_offset_, m.name_size_, m.unescaped_)) {
+				return false;
+			}
+
+			skip_ws(p, end);
+			if (p == end || *(p++) != ':') {
+				return false;
+			}
+
+			if (!parse_value(p, max_depth - 1, m.value_, member_stack, element_stack)) {
+				return false;
+			}
+			member_stack.push_back(m);
+		}
+
+		auto const begin = member_stack.begin() + first;
+		std::sort(begin, member_stack.end(), [this](member const& a, member const& b) { return name(a) < name(b); });
+		if (std::adjacent_find(begin, member_stack.end(), [this](member const& a, member const& b) { return name(a) == name(b); }) != member_stack.end()) {
+			return false;
+		}
+
+		n.type_ = json_type::object;
+		n.offset_ = static_cast<uint32_t>(members_.size());
+		n.size_ = static_cast<uint32_t>(member_stack.size() - first);
+		members_.insert(members_.end(), begin, member_stack.end());
+		member_stack.resize(first);
+	}
+	else if (*p == '[') {
+		++p;
+
+		size_t const first = element_stack.size();
+		while (true) {
+			skip_ws(p, end);
+			if (p == end) {
+				return false;
+			}
+			if (*p == ']') {
+				++p;
+				break;
+			}
+
+			if (element_stack.size() != first) {
+				if (*(p++) != ',') {
+					return false;
+				}
+				skip_ws(p, end);
+				if (p == end) {
+					return false;
+				}
+				if (*p == ']') {
+					++p;
+					break;
+				}
+			}
+
+			uint32_t v{};
+			if (!parse_value(p, max_depth - 1, v, member_stack, element_stack)) {
+				return false;
+			}
+			element_stack.push_back(v);
+		}
+
+		n.type_ = json_type::array;
+		n.offset_ = static_cast<uint32_t>(elements_.size());
+		n.size_ = static_cast<uint32_t>(element_stack.size() - first);
+		elements_.insert(elements_.end(), element_stack.begin() + first, element_stack.end());
+		element_stack.resize(first);
+	}
+	else if ((*p >= '0' && *p <= '9') || *p == '-') {
+		char const* start = p;
+		if (!scan_number(p, end)) {
+			return false;
+		}
+		n.type_ = json_type::number;
+		n.offset_ = static_cast<uint32_t>(start - text_.data());
+		n.size_ = static_cast<uint32_t>(p - start);
+	}
+	else if (end - p >= 4 && !memcmp(p, "null", 4)) {
+		n.type_ = json_type::null;
+		p += 4;
+	}
+	else if (end - p >= 4 && !memcmp(p, "true", 4)) {
+		n.type_ = json_type::boolean;
+		n.offset_ = 1;
+		p += 4;
+	}
+	else if (end - p >= 5 && !memcmp(p, "false", 5)) {
+		n.type_ = json_type::boolean;
+		p += 5;
+	}
+	else {
+		return false;
+	}
+
+	// Children precede their parents, the last node is the root
+	out = static_cast<uint32_t>(nodes_.size());
+	nodes_.push_back(n);
+	return true;
+}
+
+json_value json_document::root() const
+{
+	if (nodes_.empty()) {
+		return {};
+	}
+	return json_value(this, static_cast<uint32_t>(nodes_.size() - 1));
+}
+
+size_t json_document::memory_usage() const
+{
+	return text_.capacity() + unescaped_.capacity() + nodes_.capacity() * sizeof(node) +
+		members_.capacity() * sizeof(member) + elements_.capacity() * sizeof(uint32_t);
+}
+
+json_type json_value::type() const
+{
+	if (!doc_) {
+		return json_type::none;
+	}
+	return doc_->nodes_[node_].type_;
+}
+
+std::string_view json_value::string_view() const
+{
+	if (type() == json_type::string || type() == json_type::number) {
+		auto const& n = doc_->nodes_[node_];
+		return doc_->string(n.offset_, n.size_, n.unescaped_);
+	}
+	return {};
+}
+
+std::string json_value::string_value() const
+{
+	if (type() == json_type::boolean) {
+		return doc_->nodes_[node_].offset_ ? "true" : "false";
+	}
+	return std::string(string_view());
+}
+
+bool json_value::bool_value() const
+{
+	if (type() == json_type::boolean) {
+		return doc_->nodes_[node_].offset_ != 0;
+	}
+	if (type() == json_type::string) {
+		return string_view() == "true";
+	}
+	return false;
+}
+
+double json_value::number_value_double() const
+{
+	if (type() == json_type::string || type() == json_type::number) {
+		return json_to_double(string_view());
+	}
+	return {};
+}
+
+uint64_t json_value::number_value_integer() const
+{
+	if (type() == json_type::string || type() == json_type::number) {
+		return json_to_integer(string_view());
+	}
+	return {};
+}
+
+json_value json_value::operator[](std::string_view const& name) const
+{
+	if (type() != json_type::object) {
+		return {};
+	}
+
+	auto const& n = doc_->nodes_[node_];
+	auto const begin = doc_->members_.cbegin() + n.offset_;
+	auto const end = begin + n.size_;
+	auto it = std::lower_bound(begin, end, name, [this](json_document::member const& m, std::string_view const& name) { return doc_->name(m) < name; });
+	if (it != end && doc_->name(*it) == name) {
+		return json_value(doc_, it->value_);
+	}
+	return {};
+}
+
+json_value json_value::operator[](size_t i) const
+{
+	if (type() != json_type::array) {
+		return {};
+	}
+
+	auto const& n = doc_->nodes_[node_];
+	if (i >= n.size_) {
+		return {};
+	}
+	return json_value(doc_, doc_->elements_[n.offset_ + i]);
+}
+
+size_t json_value::children() const
+{
+	if (type() == json_type::object || type() == json_type::array) {
+		return doc_->nodes_[node_].size_;
+	}
+	return 0;
+}
+
+std::string json_value::to_string(bool pretty, size_t depth) const
+{
+	std::string ret;
+	to_string(ret, pretty, depth);
+	return ret;
+}
+
+void json_value::to_string(std::string & ret, bool pretty, size_t depth) const
+{
+	switch (type()) {
+	case json_type::object:
+	case json_type::array: {
+		bool const object = type() == json_type::object;
+		ret += object ? '{' : '[';
+		if (pretty) {
+			ret += '\n';
+			ret.append(depth * 2 + 2, ' ');
+		}
+		auto const& n = doc_->nodes_[node_];
+		for (uint32_t i = 0; i < n.size_; ++i) {
+			if (i) {
+				ret += ',';
+				if (pretty) {
+					ret += '\n';
+					ret.append(depth * 2 + 2, ' ');
+				}
+			}
+			if (object) {
+				auto const& m = doc_->members_[n.offset_ + i];
+				ret += '"';
+				string_writer out(ret);
+				json_append_escaped(out, doc_->name(m));
+				ret += "\":";
+				if (pretty) {
+					ret += ' ';
+				}
+				json_value(doc_, m.value_).to_string(ret, pretty, depth + 1);
+			}
+			else {
+				json_value(doc_, doc_->elements_[n.offset_ + i]).to_string(ret, pretty, depth + 1);
+			}
+		}
+		if (pretty) {
+			ret += '\n';
+			ret.append(depth * 2, ' ');
+		}
+		ret += object ? '}' : ']';
+		break;
+	}
+	case json_type::boolean:
+		ret += bool_value() ? "true" : "false";
+		break;
+	case json_type::number:
+		ret += string_view();
+		break;
+	case json_type::null:
+		ret += "null";
+		break;
+	case json_type::string: {
+		ret += '"';
+		string_writer out(ret);
+		json_append_escaped(out, string_view());
+		ret += '"';
+		break;
+	}
+	case json_type::none:
+		break;
+	}
+}
+
+json json_value::to_json() const
+{
+	json j;
+	switch (type()) {
+	case json_type::object: {
+		auto & children = j.value_.emplace<std::size_t(json_type::object)>();
+		auto const& n = doc_->nodes_[node_];
+		for (uint32_t i = 0; i < n.size_; ++i) {
+			auto const& m = doc_->members_[n.offset_ + i];
+			children.emplace_hint(children.end(), doc_->name(m), json_value(doc_, m.value_).to_json());
+		}
+		break;
+	}
+	case json_type::array: {
+		auto & children = j.value_.emplace<std::size_t(json_type::array)>();
+		auto const& n = doc_->nodes_[node_];
+		children.reserve(n.size_);
+		for (uint32_t i = 0; i < n.size_; ++i) {
+			children.emplace_back(json_value(doc_, doc_->elements_[n.offset_ + i]).to_json());
+		}
+		break;
+	}
+	case json_type::string:
+		j.value_.emplace<std::size_t(json_type::string)>(string_view());
+		break;
+	case json_type::number:
+		j.value_.emplace<std::size_t(json_type::number)>(std::string(string_view()));
+		break;
+	case json_type::boolean:
+		j.value_ = bool_value();
+		break;
+	case json_type::null:
+		j.value_ = nullptr;
+		break;
+	case json_type::none:
+		break;
+	}
+	return j;
+}
+
+
+json_stream_parser::json_stream_parser(json_stream_handler & handler, size_t max_depth)
+	: handler_(handler)
+	, max_depth_(max_depth)
+{
+}
+
+void json_stream_parser::reset()
+{
+	state_ = state::value;
+	stack_.clear();
+	pending_.clear();
+	escape_ = false;
+	escaped_ = false;
+	literal_ = nullptr;
+}
+
+bool json_stream_parser::fail()
+{
+	state_ = state::failed;
+	return false;
+}
+
+bool json_stream_parser::feed(buffer const& b)
+{
+	return feed(b.to_view());
+}
+
+bool json_stream_parser::feed(std::string_view const& data)
+{
+	char const* p = data.data();
+	char const* const end = p + data.size();
+
+	while (p < end) {
+		switch (state_) {
+		case state::value:
+		case state::array_first:
+		case state::array_next:
+		case state::object_first:
+		case state::object_next:
+		case state::colon:
+		case state::done: {
+			skip_ws(p, end);
+			if (p == end) {
+				break;
+			}
+			char const c = *(p++);
+			switch (state_) {
+			case state::value:
+				begin_value(c);
+				break;
+			case state::array_first:
+				if (c == ']') {
+					end_container(false);
+				}
+				else {
+					begin_value(c);
+				}
+				break;
+			case state::array_next:
+				if (c == ',') {
+					// Like json::parse, tolerate trailing commas
+					state_ = state::array_first;
+				}
+				else if (c == ']') {
+					end_container(false);
+				}
+				else {
+					fail();
+				}
+				break;
+			case state::object_first:
+				if (c == '}') {
+					end_container(true);
+				}
+				else if (c == '"') {
+					state_ = state::string;
+					name_ = true;
+				}
+				else {
+					fail();
+				}
+				break;
+			case state::object_next:
+				if (c == ',') {
+					state_ = state::object_first;
+				}
+				else if (c == '}') {
+					end_container(true);
+				}
+				else {
+					fail();
+				}
+				break;
+			case state::colon:
+				if (c == ':') {
+					state_ = state::value;
+				}
+				else {
+					fail();
+				}
+				break;
+			default:
+				fail();
+				break;
+			}
+			if (state_ == state::number) {
+				// Numbers have no delimiters, scan them including their first character
+				--p;
+			}
+			break;
+		}
+		case state::string: {
+			char const* start = p;
+			while (p < end) {
+				if (escape_) {
+					escape_ = false;
+					++p;
+					continue;
+				}
+				p = find_string_special(p, end);
+				if (p == end) {
+					break;
+				}
+				char const c = *p;
+				if (c == '\\') {
+					escape_ = true;
+					escaped_ = true;
+				}
+				else if (c == '"') {
+					break;
+				}
+				else {
+					// Null byte, let unescaping reject it
+					escaped_ = true;
+				}
+				++p;
+			}
+			if (p == end) {
+				pending_.append(start, p);
+				break;
+			}
+
+			// Including the closing quote
+			++p;
+			if (pending_.empty()) {
+				end_string(std::string_view(start, p - start));
+			}
+			else {
+				pending_.append(start, p);
+				end_string(pending_);
+			}
+			break;
+		}
+		case state::number: {
+			char const* start = p;
+			while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) {
+				++p;
+			}
+			if (p == end) {
+				pending_.append(start, p);
+				break;
+			}
+			if (pending_.empty()) {
+				end_number(std::string_view(start, p - start));
+			}
+			else {
+				pending_.append(start, p);
+				end_number(pending_);
+			}
+			break;
+		}
+		case state::literal:
+			while (p < end && literal_[literal_pos_]) {
+				if (*(p++) != literal_[literal_pos_++]) {
+					return fail();
+				}
+			}
+			if (!literal_[literal_pos_]) {
+				if (*literal_ == 'n') {
+					end_value(handler_.on_null());
+				}
+				else {
+					end_value(handler_.on_boolean(*literal_ == 't'));
+				}
+			}
+			break;
+		case state::failed:
+			return false;
+		}
+	}
+
+	return state_ != state::failed;
+}
+
+bool json_stream_parser::finish()
+{
+	if (state_ == state::number) {
+		end_number(pending_);
+	}
+	if (state_ != state::done) {
+		return fail();
+	}
+	return true;
+}
+
+bool json_stream_parser::begin_value(char c)
+{
+	if (stack_.size() >= max_depth_) {
+		return fail();
+	}
+
+	if (c == '{') {
+		stack_.push_back(true);
+		state_ = state::object_first;
+		if (!handler_.on_object_begin()) {
+			return fail();
+		}
+	}
+	else if (c == '[') {
+		stack_.push_back(false);
+		state_ = state::array_first;
+		if (!handler_.on_array_begin()) {
+			return fail();
+		}
+	}
+	else if (c == '"') {
+		state_ = state::string;
+		name_ = false;
+	}
+	else if ((c >= '0' && c <= '9') || c == '-') {
+		state_ = state::number;
+	}
+	else if (c == 'n' || c == 't' || c == 'f') {
+		state_ = state::literal;
+		literal_ = (c == 'n') ? "null" : ((c == 't') ? "true" : "false");
+		literal_pos_ = 1;
+	}
+	else {
+		return fail();
+	}
+	return true;
+}
+
+bool json_stream_parser::end_container(bool object)
+{
+	stack_.pop_back();
+	return end_value(object ? handler_.on_object_end() : handler_.on_array_end());
+}
+
+bool json_stream_parser::end_value(bool cont)
+{
+	if (!cont) {
+		return fail();
+	}
+	if (stack_.empty()) {
+		state_ = state::done;
+	}
+	else {
+		state_ = stack_.back() ? state::object_next : state::array_next;
+	}
+	return true;
+}
+
+bool json_stream_parser::end_string(std::string_view raw)
+{
+	std::string_view v = raw.substr(0, raw.size() - 1);
+	if (escaped_) {
+		unescaped_.clear();
+		char const* p = raw.data();
+		if (!json_unescape_append(unescaped_, p, raw.data() + raw.size(), false)) {
+			return fail();
+		}
+		v = unescaped_;
+	}
+
+	bool cont;
+	if (name_) {
+		cont = handler_.on_name(v);
+		state_ = state::colon;
+	}
+	else {
+		cont = handler_.on_string(v);
+	}
+
+	pending_.clear();
+	escaped_ = false;
+
+	if (name_) {
+		if (!cont) {
+			return fail();
+		}
+		return true;
+	}
+	return end_value(cont);
+}
+
+bool json_stream_parser::end_number(std::string_view v)
+{
+	char const* p = v.data();
+	char const* const end = p + v.size();
+	if (!scan_number(p, end) || p != end) {
+		return fail();
+	}
+
+	bool const cont = handler_.on_number(v);
+	pending_.clear();
+	return end_value(cont);
+}
+
+
+json_pointer::json_pointer(std::string_view const& pointer)
+{
+	if (pointer.empty()) {
+		return;
+	}
+	if (pointer[0] != '/') {
+		valid_ = false;
+		return;
+	}
+
+	size_t start = 1;
+	while (true) {
+		size_t end = pointer.find('/', start);
+		if (end == std::string_view::npos) {
+			end = pointer.size();
+		}
+
+		auto & t = tokens_.emplace_back();
+		auto const raw = pointer.substr(start, end - start);
+		t.name_.reserve(raw.size());
+		for (size_t i = 0; i < raw.size(); ++i) {
+			if (raw[i] != '~') {
+				t.name_ += raw[i];
+			}
+			else if (i + 1 < raw.size() && (raw[i + 1] == '0' || raw[i + 1] == '1')) {
+				t.name_ += raw[++i] == '0' ? '~' : '/';
+			}
+			else {
+				valid_ = false;
+				tokens_.clear();
+				return;
+			}
+		}
+
+		// No leading zeros allowed
+		if (!t.name_.empty() && (t.name_[0] != '0' || t.name_.size() == 1)) {
+			t.index_ = to_integral<size_t>(t.name_, std::string::npos);
+		}
+
+		if (end == pointer.size()) {
+			break;
+		}
+		start = end + 1;
+	}
+}
+
+json const& json_pointer::get(json const& j) const
+{
+	static json const nil;
+	if (!valid_) {
+		return nil;
+	}
+
+	json const* cur = &j;
+	for (auto const& t : tokens_) {
+		if (auto *m = std::get_if<std::size_t(json_type::object)>(&cur->value_)) {
+			auto it = m->find(t.name_);
+			if (it == m->end()) {
+				return nil;
+			}
+			cur = &it->second;
+		}
+		else if (auto *a = std::get_if<std::size_t(json_type::array)>(&cur->value_)) {
+			if (t.index_ >= a->size()) {
+				return nil;
+			}
+			cur = &(*a)[t.index_];
+		}
+		else {
+			return nil;
+		}
+	}
+	return *cur;
+}
+
+json_value json_pointer::get(json_value const& v) const
+{
+	if (!valid_) {
+		return {};
+	}
+
+	json_value cur = v;
+	for (auto const& t : tokens_) {
+		if (cur.is_object()) {
+			cur = cur[std::string_view(t.name_)];
+		}
+		else if (cur.is_array() && t.index_ != std::string::npos) {
+			cur = cur[t.index_];
+		}
+		else {
+			return {};
+		}
+	}
+	return cur;
+}
+
+json* json_pointer::find(json & j) const
+{
+	if (!valid_) {
+		return nullptr;
+	}
+	auto const& found = get(static_cast<json const&>(j));
+	if (!found) {
+		return nullptr;
+	}
+	return const_cast<json*>(&found);
+}
 }
@@ -1,11 +1,15 @@
 #include "libfilezilla/encode.hpp"
 #include "libfilezilla/hash.hpp"
 #include "libfilezilla/jws.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/thread_pool.hpp"
 #include "libfilezilla/util.hpp"
 #include <nettle/ecdsa.h>
 #include <nettle/ecc-curve.h>
 
+#include <list>
 #include <memory.h>
+#include <unordered_map>
 
 namespace fz {
 namespace {
@@ -51,7 +55,7 @@ std::pair<json, json> create_jwk()
 	json jpriv;
 	jpriv["kty"] = "EC";
 	jpriv["crv"] = "P-256";
-	jpriv["d"] = fz::base64_encode(to_string(d), base64_type::url, false);
+	jpriv["d"] = fz::base64_encode(to_string(d, 32), base64_type::url, false);
 
 	mpz_clear(d);
 
@@ -63,8 +67,8 @@ std::pair<json, json> create_jwk()
 	json jpub;
 	jpub["kty"] = "EC";
 	jpub["crv"] = "P-256";
-	jpub["x"] = fz::base64_encode(to_string(x), base64_type::url, false);
-	jpub["y"] = fz::base64_encode(to_string(y), base64_type::url, false);
+	jpub["x"] = fz::base64_encode(to_string(x, 32), base64_type::url, false);
+	jpub["y"] = fz::base64_encode(to_string(y, 32), base64_type::url, false);
 
 	mpz_clear(x);
 	mpz_clear(y);
@@ -75,7 +79,63 @@ std::pair<json, json> create_jwk()
 	return {jpriv, jpub};
 }
 
-json jws_sign_flattened(json const& priv, json const& payload, json const& extra_protected)
+namespace {
+// Decodes a base64url-encoded coordinate of a P-256 point
+bool decode_coordinate(json const& v, std::string & out)
+{
+	out = fz::base64_decode_s(v.string_value());
+	return out.size() == 32;
+}
+
+std::string compute_thumbprint(std::string const& x, std::string const& y)
+{
+	// RFC 7638: Required members only, in lexicographic order, without whitespace
+	std::string canonical = "{\"crv\":\"P-256\",\"kty\":\"EC\",\"x\":\"";
+	canonical += fz::base64_encode(x, base64_type::url, false);
+	canonical += "\",\"y\":\"";
+	canonical += fz::base64_encode(y, base64_type::url, false);
+	canonical += "\"}";
+
+	return fz::base64_encode(fz::sha256(canonical), base64_type::url, false);
+}
+}
+
+std::string jwk_thumbprint(json const& jwk)
+{
+	std::string x, y;
+	if (jwk["kty"].string_value() != "EC" || jwk["crv"].string_value() != "P-256" || !decode_coordinate(jwk["x"], x) || !decode_coordinate(jwk["y"], y)) {
+		return {};
+	}
+	return compute_thumbprint(x, y);
+}
+
+class jwk_signing_key::impl final
+{
+public:
+	impl(ecc_curve const* curve)
+	{
+		nettle_ecc_scalar_init(&key_, curve);
+	}
+
+	~impl()
+	{
+		nettle_ecc_scalar_clear(&key_);
+	}
+
+	impl(impl const&) = delete;
+	impl& operator=(impl const&) = delete;
+
+	// Only derives the public key if asked to, it costs about as much as a signature
+	static std::shared_ptr<impl> create(json const& priv, json const& protected_header, bool with_public);
+
+	ecc_scalar key_;
+	std::string encoded_prot_;
+
+	json public_jwk_;
+	std::string thumbprint_;
+};
+
+std::shared_ptr<jwk_signing_key::impl> jwk_signing_key::impl::create(json const& priv, json const& protected_header, bool with_public)
 {
 	auto const ds = fz::base64_decode_s(priv["d"].string_value());
 	if (priv["kty"].string_value() != "EC" || priv["crv"].string_value() != "P-256"|| ds.empty()) {
@@ -91,38 +151,91 @@ json jws_sign_flattened(json const& priv, json const& payload, json const& extra
 	mpz_init(d);
 	nettle_mpz_set_str_256_u(d, ds.size(), reinterpret_cast<uint8_t const*>(ds.c_str()));
 
-	ecc_scalar key;
-	nettle_ecc_scalar_init(&key, curve);
-	if (!nettle_ecc_scalar_set(&key, d)) {
-		mpz_clear(d);
-		nettle_ecc_scalar_clear(&key);
+	auto key = std::make_shared<impl>(curve);
+	bool const valid = nettle_ecc_scalar_set(&key->key_, d) != 0;
+	mpz_clear(d);
+	if (!valid) {
 		return {};
 	}
-	mpz_clear(d);
 
-	auto encoded_payload = fz::base64_encode(payload.to_string(), fz::base64_type::url, false);
+	if (with_public) {
+		ecc_point pub;
+		nettle_ecc_point_init(&pub, curve);
+		nettle_ecc_point_mul_g(&pub, &key->key_);
+
+		mpz_t x, y;
+		mpz_init(x);
+		mpz_init(y);
+		nettle_ecc_point_get(&pub, x, y);
+		std::string const xs = to_string(x, 32);
+		std::string const ys = to_string(y, 32);
+		mpz_clear(x);
+		mpz_clear(y);
+		nettle_ecc_point_clear(&pub);
+
+		key->public_jwk_["kty"] = "EC";
+		key->public_jwk_["crv"] = "P-256";
+		key->public_jwk_["x"] = fz::base64_encode(xs, base64_type::url, false);
+		key->public_jwk_["y"] = fz::base64_encode(ys, base64_type::url, false);
+		key->thumbprint_ = compute_thumbprint(xs, ys);
+	}
 
 	json prot;
-	if (extra_protected.type() == json_type::object) {
-		prot = extra_protected;
+	if (protected_header.type() == json_type::object) {
+		prot = protected_header;
 	}
 	prot["alg"] = "ES256";
+	key->encoded_prot_ = base64_encode(prot.to_string(), fz::base64_type::url, false);
+
+	return key;
+}
+
+jwk_signing_key jwk_signing_key::from_jwk(json const& priv, json const& protected_header)
+{
+	jwk_signing_key ret;
+	ret.impl_ = impl::create(priv, protected_header, true);
+	return ret;
+}
+
+json const& jwk_signing_key::public_jwk() const
+{
+	static json const empty;
+	return impl_ ? impl_->public_jwk_ : empty;
+}
+
+std::string const& jwk_signing_key::thumbprint() const
+{
+	static std::string const empty;
+	return impl_ ? impl_->thumbprint_ : empty;
+}
+
+json jws_sign_flattened(json const& priv, json const& payload, json const& extra_protected)
+{
+	jwk_signing_key key;
+	key.impl_ = jwk_signing_key::impl::create(priv, extra_protected, false);
+	return jws_sign_flattened(key, payload);
+}
 
-	auto encoded_prot = base64_encode(prot.to_string(), fz::base64_type::url, false);
+json jws_sign_flattened(jwk_signing_key const& key, json const& payload)
+{
+	if (!key) {
+		return {};
+	}
+	auto const& k = *key.impl_;
+
+	auto encoded_payload = fz::base64_encode(payload.to_string(), fz::base64_type::url, false);
 
 	fz::hash_accumulator acc(fz::hash_algorithm::sha256);
-	acc << encoded_prot << "." << encoded_payload;
+	acc << k.encoded_prot_ << "." << encoded_payload;
 	auto digest = acc.digest();
 
-
 	struct dsa_signature sig;
 	nettle_dsa_signature_init(&sig);
 
-	nettle_ecdsa_sign(&key, nullptr, rnd, digest.size(), digest.data(), &sig);
-	nettle_ecc_scalar_clear(&key);
+	nettle_ecdsa_sign(&k.key_, nullptr, rnd, digest.size(), digest.data(), &sig);
 
 	json ret;
-	ret["protected"] = std::move(encoded_prot);
+	ret["protected"] = k.encoded_prot_;
 	ret["payload"] = std::move(encoded_payload);
 	ret["signature"] = fz::base64_encode(to_string(sig.r, 32) + to_string(sig.s, 32), base64_type::url, false);
 
@@ -130,4 +243,253 @@ json jws_sign_flattened(json const& priv, json const& payload, json const& extra
 
 	return ret;
 }
+
+std::vector<json> jws_sign_flattened(jwk_signing_key const& key, std::vector<json> const& payloads, thread_pool & pool)
+{
+	std::vector<json> ret(payloads.size());
+	if (!key) {
+		return ret;
+	}
+
+	auto sign = [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			ret[i] = jws_sign_flattened(key, payloads[i]);
+		}
+	};
+
+	// Each signature takes a while, small chunks keep the workers evenly busy
+	size_t const chunk = 8;
+
+	std::vector<pooled_task> tasks;
+	tasks.reserve((payloads.size() + chunk - 1) / chunk);
+	for (size_t i = 0; i < payloads.size(); i += chunk) {
+		size_t const end = std::min(payloads.size(), i + chunk);
+		auto task = pool.submit([&sign, i, end] { sign(i, end); });
+		if (task) {
+			tasks.emplace_back(std::move(task));
+		}
+		else {
+			sign(i, end);
+		}
+	}
+	for (auto & task : tasks) {
+		task.join();
+	}
+
+	return ret;
+}
+
+class jwk_verification_key::impl final
+{
+public:
+	impl(ecc_curve const* curve)
+	{
+		nettle_ecc_point_init(&pub_, curve);
+	}
+
+	~impl()
+	{
+		nettle_ecc_point_clear(&pub_);
+	}
+
+	impl(impl const&) = delete;
+	impl& operator=(impl const&) = delete;
+
+	ecc_point pub_;
+	std::string thumbprint_;
+};
+
+jwk_verification_key jwk_verification_key::from_jwk(json const& jwk)
+{
+	jwk_verification_key ret;
+
+	std::string xs, ys;
+	if (jwk["kty"].string_value() != "EC" || jwk["crv"].string_value() != "P-256" || !decode_coordinate(jwk["x"], xs) || !decode_coordinate(jwk["y"], ys)) {
+		return ret;
+	}
+
+	auto curve = nettle_get_secp_256r1();
+	if (!curve) {
+		return ret;
+	}
+
+	mpz_t x, y;
+	mpz_init(x);
+	mpz_init(y);
+	nettle_mpz_set_str_256_u(x, xs.size(), reinterpret_cast<uint8_t const*>(xs.c_str()));
+	nettle_mpz_set_str_256_u(y, ys.size(), reinterpret_cast<uint8_t const*>(ys.c_str()));
+
+	auto key = std::make_shared<impl>(curve);
+	// Fails if the point is not on the curve
+	bool const valid = nettle_ecc_point_set(&key->pub_, x, y) != 0;
+
+	mpz_clear(x);
+	mpz_clear(y);
+
+	if (valid) {
+		key->thumbprint_ = compute_thumbprint(xs, ys);
+		ret.impl_ = std::move(key);
+	}
+
+	return ret;
+}
+
+std::string const& jwk_verification_key::thumbprint() const
+{
+	static std::string const empty;
+	return impl_ ? impl_->thumbprint_ : empty;
+}
+
+bool jws_verify_flattened(json const& jws, jwk_verification_key const& pub, json * payload)
+{
+	if (!pub) {
+		return false;
+	}
+
+	auto const& encoded_prot = jws["protected"].string_value();
+	auto const& encoded_payload = jws["payload"].string_value();
+	auto const sig = fz::base64_decode_s(jws["signature"].string_value());
+	if (encoded_prot.empty() || sig.size() != 64) {
+		return false;
+	}
+
+	auto const prot = json::parse(fz::base64_decode_s(encoded_prot));
+	if (prot["alg"].string_value() != "ES256") {
+		return false;
+	}
+
+	fz::hash_accumulator acc(fz::hash_algorithm::sha256);
+	acc << encoded_prot << "." << encoded_payload;
+	auto digest = acc.digest();
+
+	struct dsa_signature signature;
+	nettle_dsa_signature_init(&signature);
+	nettle_mpz_set_str_256_u(signature.r, 32, reinterpret_cast<uint8_t const*>(sig.c_str()));
+	nettle_mpz_set_str_256_u(signature.s, 32, reinterpret_cast<uint8_t const*>(sig.c_str() + 32));
+
+	bool const valid = nettle_ecdsa_verify(&pub.impl_->pub_, digest.size(), digest.data(), &signature) != 0;
+	nettle_dsa_signature_clear(&signature);
+
+	if (valid && payload) {
+		if (encoded_payload.empty()) {
+			*payload = json();
+		}
+		else {
+			*payload = json::parse(fz::base64_decode_s(encoded_payload));
+			if (!*payload) {
+				return false;
+			}
+		}
+	}
+
+	return valid;
+}
+
+bool jws_verify_flattened(json const& jws, json const& pub, json * payload)
+{
+	return jws_verify_flattened(jws, jwk_verification_key::from_jwk(pub), payload);
+}
+
+
+class jwk_cache::impl final
+{
+public:
+	explicit impl(size_t max_entries)
+		: max_entries_(max_entries)
+	{}
+
+	jwk_verification_key find(std::string const& thumbprint);
+	void add(jwk_verification_key const& key);
+
+	mutable mutex mtx_{false};
+
+	size_t const max_entries_;
+
+	struct entry final
+	{
+		jwk_verification_key key_;
+		std::list<std::string>::iterator lru_;
+	};
+	std::unordered_map<std::string, entry> entries_;
+
+	// Thumbprints, most recently used first
+	std::list<std::string> lru_;
+};
+
+jwk_verification_key jwk_cache::impl::find(std::string const& thumbprint)
+{
+	auto it = entries_.find(thumbprint);
+	if (it == entries_.end()) {
+		return {};
+	}
+	lru_.splice(lru_.begin(), lru_, it->second.lru_);
+	return it->second.key_;
+}
+
+void jwk_cache::impl::add(jwk_verification_key const& key)
+{
+	if (!max_entries_ || entries_.find(key.thumbprint()) != entries_.end()) {
+		return;
+	}
+
+	while (entries_.size() >= max_entries_) {
+		entries_.erase(lru_.back());
+		lru_.pop_back();
+	}
+
+	lru_.push_front(key.thumbprint());
+	entries_[key.thumbprint()] = entry{key, lru_.begin()};
+}
+
+jwk_cache::jwk_cache(size_t max_entries)
+	: impl_(std::make_unique<impl>(max_entries))
+{
+}
+
+jwk_cache::~jwk_cache()
+{
+}
+
+jwk_verification_key jwk_cache::get(json const& jwk)
+{
+	auto const tp = jwk_thumbprint(jwk);
+	if (tp.empty()) {
+		return {};
+	}
+
+	{
+		scoped_lock l(impl_->mtx_);
+		auto key = impl_->find(tp);
+		if (key) {
+			return key;
+		}
+	}
+
+	// Parse without holding the lock
+	auto key = jwk_verification_key::from_jwk(jwk);
+	if (key) {
+		scoped_lock l(impl_->mtx_);
+		impl_->add(key);
+	}
+	return key;
+}
+
+jwk_verification_key jwk_cache::find(std::string_view const& thumbprint)
+{
+	scoped_lock l(impl_->mtx_);
+	return impl_->find(std::string(thumbprint));
+}
+
+void jwk_cache::clear()
+{
+	scoped_lock l(impl_->mtx_);
+	impl_->entries_.clear();
+	impl_->lru_.clear();
+}
+
+size_t jwk_cache::size() const
+{
+	scoped_lock l(impl_->mtx_);
+	return impl_->entries_.size();
+}
 }
@@ -0,0 +1,195 @@
+#include "libfilezilla/key_derivation.hpp"
+#include "libfilezilla/hash.hpp"
+#include "libfilezilla/thread_pool.hpp"
+#include "libfilezilla/util.hpp"
+
+namespace fz {
+
+namespace {
+void put_u64(hmac_accumulator & acc, uint64_t v)
+{
+	uint8_t buf[8];
+	for (size_t i = 0; i < 8; ++i) {
+		buf[i] = static_cast<uint8_t>(v >> (56 - 8 * i));
+	}
+	acc.update(buf, 8);
+}
+}
+
+key_derivation_cache::key_derivation_cache(size_t max_entries, duration const& lifetime)
+	: max_entries_(max_entries)
+	, lifetime_(lifetime)
+	, secret_(random_bytes(32))
+{
+}
+
+key_derivation_cache::~key_derivation_cache()
+{
+	clear();
+}
+
+std::vector<uint8_t> key_derivation_cache::lookup_key(std::basic_string_view<uint8_t> const& password, std::basic_string_view<uint8_t> const& salt, size_t length, unsigned int iterations) const
+{
+	// Length-prefixing the salt keeps the boundary to the password unambiguous
+	hmac_accumulator acc(hash_algorithm::sha256, secret_);
+	put_u64(acc, iterations);
+	put_u64(acc, length);
+	put_u64(acc, salt.size());
+	acc.update(salt);
+	acc.update(password);
+	return acc.digest();
+}
+
+std::vector<uint8_t> key_derivation_cache::pbkdf2_hmac_sha256(std::basic_string_view<uint8_t> const& password, std::basic_string_view<uint8_t> const& salt, size_t length, unsigned int iterations)
+{
+	if (!max_entries_ || password.empty() || !length) {
+		return fz::pbkdf2_hmac_sha256(password, salt, length, iterations);
+	}
+
+	auto key = lookup_key(password, salt, length, iterations);
+	{
+		scoped_lock l(mtx_);
+		auto it = entries_.find(key);
+		if (it != entries_.end()) {
+			if (it->second.expiry_ > monotonic_clock::now()) {
+				return it->second.derived_;
+			}
+			entries_.erase(it);
+		}
+	}
+
+	// Derive without holding the lock, other derivations need not wait for this one.
+	auto derived = fz::pbkdf2_hmac_sha256(password, salt, length, iterations);
+	if (derived.empty()) {
+		return derived;
+	}
+
+	scoped_lock l(mtx_);
+	auto const now = monotonic_clock::now();
+	if (entries_.size() >= max_entries_) {
+		for (auto it = entries_.begin(); it != entries_.end(); ) {
+			if (it->second.expiry_ <= now) {
+				it = entries_.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+	while (entries_.size() >= max_entries_) {
+		auto oldest = entries_.begin();
+		for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+			if (it->second.expiry_ < oldest->second.expiry_) {
+				oldest = it;
+			}
+		}
+		entries_.erase(oldest);
+	}
+	entries_[std::move(key)] = entry{derived, now + lifetime_};
+
+	return derived;
+}
+
+void key_derivation_cache::clear()
+{
+	scoped_lock l(mtx_);
+	for (auto & e : entries_) {
+		std::fill(e.second.derived_.begin(), e.second.derived_.end(), 0);
+	}
+	entries_.clear();
+}
+
+size_t key_derivation_cache::size() const
+{
+	scoped_lock l(mtx_);
+	return entries_.size();
+}
+
+
+class key_derivation::impl final
+{
+public:
+	impl(key_derivation & parent, thread_pool & pool, event_handler & handler, key_derivation_cache * cache)
+		: parent_(parent)
+		, pool_(pool)
+		, handler_(handler)
+		, cache_(cache)
+	{}
+
+	void entry(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations);
+	void stop();
+
+	key_derivation & parent_;
+	thread_pool & pool_;
+	event_handler & handler_;
+	key_derivation_cache * cache_;
+
+	mutex mtx_{false};
+	async_task task_;
+	bool discard_{};
+};
+
+void key_derivation::impl::entry(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations)
+{
+	// Both keys are derived from the same PBKDF2 output, a cache holding a
+	// single entry suffices to only run it once.
+	key_derivation_cache local(1);
+	key_derivation_cache * cache = cache_ ? cache_ : &local;
+
+	auto sym = symmetric_key::from_password(password, salt, iterations, cache);
+	auto priv = private_key::from_password(password, salt, iterations, cache);
+
+	scoped_lock l(mtx_);
+	if (!discard_) {
+		handler_.send_event<key_derivation_event>(&parent_, std::move(sym), std::move(priv));
+	}
+}
+
+void key_derivation::impl::stop()
+{
+	scoped_lock l(mtx_);
+	discard_ = true;
+	l.unlock();
+	task_.join();
+
+	auto filter = [&](event_loop::Events::value_type const& ev) -> bool {
+		if (ev.first != &handler_) {
+			return false;
+		}
+		else if (ev.second->derived_type() != key_derivation_event::type()) {
+			return false;
+		}
+		return std::get<0>(static_cast<key_derivation_event const&>(*ev.second).v_) == &parent_;
+	};
+	handler_.get_event_loop().filter_events(filter);
+}
+
+key_derivation::key_derivation(thread_pool & pool, event_handler & handler, key_derivation_cache * cache)
+	: impl_(std::make_unique<impl>(*this, pool, handler, cache))
+{
+}
+
+key_derivation::~key_derivation()
+{
+	impl_->stop();
+}
+
+bool key_derivation::derive(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations)
+{
+	// The previous task has sent its event, reap it.
+	impl_->task_.join();
+
+	scoped_lock l(impl_->mtx_);
+	impl_->discard_ = false;
+	impl_->task_ = impl_->pool_.spawn([this, password, salt, iterations]() {
+		impl_->entry(password, salt, iterations);
+	});
+	return impl_->task_.operator bool();
+}
+
+void key_derivation::reset()
+{
+	impl_->stop();
+}
+
+}
@@ -0,0 +1,99 @@
+#include "libfilezilla/keyed_rate_limiter.hpp"
+
+#include <algorithm>
+
+namespace fz {
+
+keyed_rate_limiter::keyed_rate_limiter(rate_limiter & parent, size_t max_keys)
+	: parent_(parent)
+	, max_keys_(max_keys ? max_keys : 1)
+{
+}
+
+keyed_rate_limiter::~keyed_rate_limiter()
+{
+	// Limiters still referenced elsewhere stay in the parent until released
+	scoped_lock l(mtx_);
+	limiters_.clear();
+	overflow_.reset();
+}
+
+std::shared_ptr<rate_limiter> keyed_rate_limiter::create()
+{
+	auto limiter = std::make_shared<rate_limiter>();
+	limiter->set_limits(limits_[direction::inbound], limits_[direction::outbound]);
+	parent_.add(limiter.get());
+	return limiter;
+}
+
+std::shared_ptr<rate_limiter> keyed_rate_limiter::get(std::string_view key)
+{
+	scoped_lock l(mtx_);
+
+	std::string k(key);
+	auto it = limiters_.find(k);
+	if (it != limiters_.end()) {
+		return it->second;
+	}
+
+	++misses_;
+	if (limiters_.size() >= max_keys_ && misses_ >= std::max(size_t(1), max_keys_ / 16)) {
+		evict();
+		misses_ = 0;
+	}
+
+	if (limiters_.size() < max_keys_) {
+		auto limiter = create();
+		limiters_.emplace(std::move(k), limiter);
+		return limiter;
+	}
+
+	if (!overflow_) {
+		overflow_ = create();
+	}
+	return overflow_;
+}
+
+void keyed_rate_limiter::set_limits(rate::type download_limit, rate::type upload_limit)
+{
+	scoped_lock l(mtx_);
+	limits_[direction::inbound] = download_limit;
+	limits_[direction::outbound] = upload_limit;
+
+	for (auto & it : limiters_) {
+		it.second->set_limits(download_limit, upload_limit);
+	}
+	if (overflow_) {
+		overflow_->set_limits(download_limit, upload_limit);
+	}
+}
+
+void keyed_rate_limiter::purge()
+{
+	scoped_lock l(mtx_);
+	evict();
+	if (overflow_ && overflow_.use_count() == 1) {
+		overflow_.reset();
+	}
+}
+
+void keyed_rate_limiter::evict()
+{
+	// With the mutex held, no new references to limiters only referenced by the map can appear
+	for (auto it = limiters_.begin(); it != limiters_.end(); ) {
+		if (it->second.use_count() == 1) {
+			it = limiters_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+size_t keyed_rate_limiter::size() const
+{
+	scoped_lock l(mtx_);
+	return limiters_.size();
+}
+
+}
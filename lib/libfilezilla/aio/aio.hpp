@@ -1,18 +1,44 @@
 #ifndef LIBFILEZILLA_AIO_HEADER
 #define LIBFILEZILLA_AIO_HEADER
 
+#include "../buffer.hpp"
 #include "../event.hpp"
 #include "../mutex.hpp"
 #include "../nonowning_buffer.hpp"
 
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
 #include <tuple>
+#include <vector>
 
 namespace fz {
 
 class aio_buffer_pool;
+class buffer_lease;
 
 /**
- * A buffer leased from aio_buffer_pool
+ * \brief The origin of buffer leases, receives the buffers back once released.
+ *
+ * Usually this is an \ref aio_buffer_pool, but leases can also refer to memory
+ * owned by something else, such as a file mapping.
+ */
+class FZ_PUBLIC_SYMBOL buffer_lease_source
+{
+protected:
+	virtual ~buffer_lease_source() = default;
+
+	/// Creates a lease of the passed buffer, which is handed back to release()
+	buffer_lease lease(nonowning_buffer b);
+
+	virtual void release(nonowning_buffer && b) = 0;
+
+	friend class buffer_lease;
+};
+
+/**
+ * A buffer leased from an aio_buffer_pool or another buffer_lease_source
  *
  * The owner of the buffer_lease has exclusive access to the buffer until
  * the buffer_lease is released back into the pool. Ownership can be moved.
@@ -32,7 +58,7 @@ public:
 	buffer_lease(buffer_lease const&) = delete;
 	buffer_lease& operator=(buffer_lease const&) = delete;
 
-	explicit operator bool() const { return pool_ != nullptr; }
+	explicit operator bool() const { return source_ != nullptr; }
 
 	// operator. would be nice
 	nonowning_buffer const* operator->() const { return &buffer_; }
@@ -45,15 +71,21 @@ public:
 	nonowning_buffer buffer_;
 private:
 	friend class aio_buffer_pool;
-	buffer_lease(nonowning_buffer b, aio_buffer_pool* pool)
+	friend class buffer_lease_source;
+	buffer_lease(nonowning_buffer b, buffer_lease_source* source)
 	    : buffer_(b)
-	    , pool_(pool)
+	    , source_(source)
 	{
 	}
 
-	aio_buffer_pool* pool_{};
+	buffer_lease_source* source_{};
 };
 
+inline buffer_lease buffer_lease_source::lease(nonowning_buffer b)
+{
+	return buffer_lease(b, this);
+}
+
 class aio_waitable;
 
 /**
@@ -100,14 +132,26 @@ protected:
 	void add_waiter(aio_waiter & h);
 	void add_waiter(event_handler & h);
 
-	///
-	void signal_availibility();
+	/**
+	 * \brief Wakes up to count waiters in a single pass.
+	 *
+	 * Waiters are woken in the order they started waiting, no matter whether they
+	 * are an aio_waiter or an event_handler.
+	 */
+	void signal_availibility(size_t count = 1);
 
 private:
+	struct waiter final
+	{
+		aio_waiter* waiter_{};
+		event_handler* handler_{};
+	};
+
 	mutex m_;
-	std::vector<aio_waiter*> waiting_;
-	std::vector<event_handler*> waiting_handlers_;
-	aio_waiter* active_signalling_{};
+	std::deque<waiter> waiting_;
+
+	// Waiters whose on_buffer_availability is being called without holding m_
+	std::vector<aio_waiter*> active_signalling_;
 };
 
 struct aio_buffer_event_type{};
@@ -115,12 +159,100 @@ typedef simple_event<aio_buffer_event_type, aio_waitable const*> aio_buffer_even
 
 class logger_interface;
 
+/// \brief Usage statistics of an \ref fz::aio_buffer_pool "aio_buffer_pool", \sa aio_buffer_pool::get_stats
+struct aio_buffer_pool_stats final
+{
+	/// Number of buffers currently allocated, leased or not
+	size_t buffers{};
+
+	/// Number of outstanding leases
+	size_t leased{};
+
+	/// Highest number of leases outstanding at the same time
+	size_t peak_leased{};
+
+	/// Number of times get_buffer could not return a buffer and the caller had to wait
+	uint64_t waits{};
+
+	/// Total time between a get_buffer call that had to wait and the next successful one by the same waiter
+	duration wait_time;
+
+	/// Number of times the pool could not grow due to the memory limit
+	uint64_t limited{};
+};
+
+/// Whether to back the memory of an \ref fz::aio_buffer_pool with huge pages
+enum class aio_huge_pages
+{
+	/// Regular pages
+	none,
+
+	/// Advise the system to use transparent huge pages where supported
+	transparent,
+
+	/**
+	 * \brief Use explicitly reserved huge pages, such as hugetlbfs on Linux or large pages on Windows.
+	 *
+	 * Falls back to regular pages if none are available. On Windows, this requires the
+	 * SeLockMemoryPrivilege.
+	 */
+	hugetlb
+};
+
+/// NUMA placement of the memory of an \ref fz::aio_buffer_pool
+enum class aio_numa_policy
+{
+	/// The system's default, usually the node of the thread first touching the memory
+	none,
+
+	/// Allocate from the listed nodes
+	bind,
+
+	/// Interleave across the listed nodes, or across all nodes if none are listed
+	interleave
+};
+
+/// Parameters of an \ref fz::aio_buffer_pool
+struct aio_buffer_pool_options final
+{
+	size_t buffer_count{1};
+
+	/// If 0, a suitable default is picked
+	size_t buffer_size{};
+
+	bool use_shm{};
+
+#if FZ_MAC
+	/// On macOS, if using sandboxing, you need to pass an application group identifier.
+	std::string application_group_id;
+#endif
+
+	aio_huge_pages huge_pages{aio_huge_pages::none};
+
+	/**
+	 * \brief Placement of the pool's memory.
+	 *
+	 * Applied on Linux and Windows. Windows can only bind to the first listed node and
+	 * does not support interleaving.
+	 */
+	aio_numa_policy numa_policy{aio_numa_policy::none};
+	std::vector<unsigned int> numa_nodes;
+};
+
 /**
  * \brief A buffer pool for use with async readers/writers
  *
  * Can use shared memory, see \ref shared_memory_info()
+ *
+ * By default the pool holds a fixed number of buffers. Unless using shared memory,
+ * it can be made elastic using \ref set_max_buffer_count: if all buffers are leased,
+ * additional buffers get allocated on demand. Surplus buffers are freed again once
+ * more buffers are idle than leased.
+ *
+ * Huge pages and NUMA placement as per \ref aio_buffer_pool_options apply to the
+ * initial buffers, including those in shared memory.
  */
-class FZ_PUBLIC_SYMBOL aio_buffer_pool final : public aio_waitable
+class FZ_PUBLIC_SYMBOL aio_buffer_pool final : public aio_waitable, public buffer_lease_source
 {
 public:
 	// If buffer_size is 0, it picks a suitable default
@@ -130,6 +262,8 @@ public:
 #else
 	aio_buffer_pool(logger_interface & logger, size_t buffer_count = 1, size_t buffer_size = 0, bool use_shm = false);
 #endif
+	aio_buffer_pool(logger_interface & logger, aio_buffer_pool_options const& options);
+
 	~aio_buffer_pool() noexcept;
 
 	operator bool() const {
@@ -141,12 +275,32 @@ public:
 	 *
 	 * If waiting, do not call get_buffer again until after waiter/handler got signalled.
 	 *
-	 * If a buffer becomes available and there are multiple waiters, the order in
-	 * waiters are signaled is undefined.
+	 * If buffers become available and there are multiple waiters, they are signalled
+	 * in the order they started waiting.
 	 */
 	buffer_lease get_buffer(aio_waiter & h);
 	buffer_lease get_buffer(event_handler & h);
 
+	/**
+	 * \brief Turns a lease of this pool into an fz::buffer without copying the data.
+	 *
+	 * The memory returns to the pool once the buffer no longer uses it, be it on destruction
+	 * or if the buffer needs to grow beyond the size of the lease. Like leases, such buffers
+	 * must not outlive the pool.
+	 *
+	 * Returns an empty buffer if the lease does not belong to this pool.
+	 */
+	buffer adopt(buffer_lease && lease);
+
+	/**
+	 * \brief Releases multiple leases at once and clears the list.
+	 *
+	 * Cheaper than releasing the leases one by one: The pool is locked only once and
+	 * as many waiters as buffers were returned get signalled in a single pass.
+	 * Leases of other sources in the list are released as usual.
+	 */
+	void release_leases(std::list<buffer_lease> & leases);
+
 	logger_interface & logger() const { return logger_; }
 
 #if FZ_WINDOWS
@@ -180,24 +334,84 @@ public:
 	 */
 	std::tuple<shm_handle, uint8_t const*, size_t> shared_memory_info() const;
 
+	/// The number of buffers the pool has been created with, at the same time its minimum size.
 	size_t buffer_count() const { return buffer_count_; }
 
+	/// The capacity of each buffer
+	size_t buffer_size() const { return buffer_size_; }
+
+	/** \brief Allows the pool to grow up to the given number of buffers.
+	 *
+	 * Returns false if the pool uses shared memory, such pools cannot grow.
+	 */
+	bool set_max_buffer_count(size_t max);
+
+	/** \brief Limits the memory used by all elastic pools for growing beyond their initial size.
+	 *
+	 * Unlimited by default.
+	 */
+	static void set_memory_limit(uint64_t octets);
+
+	aio_buffer_pool_stats get_stats() const;
+
 private:
-	friend class buffer_lease;
-	void release(nonowning_buffer && b);
+	virtual void release(nonowning_buffer && b) override;
+
+	// Returns the buffer to the pool, call with mtx_ held
+	void do_release(nonowning_buffer & b);
+
+	bool try_get_buffer(buffer_lease & lease, void const* waiter);
+
+	// Returns the start of the buffer p points into, or nullptr if it is not from this pool
+	uint8_t* buffer_start(uint8_t* p) const;
+
+	bool create_shm(aio_buffer_pool_options const& options, bool hugetlb);
+	bool map_memory(bool hugetlb, aio_buffer_pool_options const& options);
+	void unmap_memory();
+	void apply_memory_policy(aio_buffer_pool_options const& options);
+
+	class lease_allocator final : public buffer_allocator
+	{
+	public:
+		explicit lease_allocator(aio_buffer_pool & pool)
+			: pool_(pool)
+		{}
+
+		virtual unsigned char* allocate(size_t & capacity) override;
+		virtual void deallocate(unsigned char* p, size_t capacity) noexcept override;
+
+	private:
+		aio_buffer_pool & pool_;
+	};
 
 	logger_interface & logger_;
+	lease_allocator lease_allocator_{*this};
 
 	mutable mutex mtx_;
 
 	uint64_t memory_size_{};
 	uint8_t* memory_{};
 
+	// If allocated with new[], memory_ points to the first page boundary within
+	uint8_t* allocation_{};
+
+	// Whether memory_ is a mapping rather than allocated with new[]
+	bool mapped_{};
+
 	std::vector<nonowning_buffer> buffers_;
 
 	shm_handle shm_{shm_handle_default};
 
 	size_t const buffer_count_{};
+	size_t buffer_size_{};
+	size_t buffer_stride_{};
+
+	// Buffers allocated beyond buffer_count_, maps start of the buffer to the allocated memory
+	std::map<uint8_t*, uint8_t*> extra_buffers_;
+	size_t max_buffer_count_{};
+
+	aio_buffer_pool_stats stats_;
+	std::vector<std::pair<void const*, monotonic_clock>> waiting_since_;
 };
 
 enum class aio_result
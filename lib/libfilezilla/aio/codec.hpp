@@ -0,0 +1,125 @@
+#ifndef LIBFILEZILLA_AIO_CODEC_HEADER
+#define LIBFILEZILLA_AIO_CODEC_HEADER
+
+#include "reader.hpp"
+#include "writer.hpp"
+
+#include <memory>
+
+/** \file
+ * \brief Adapters transforming data on the fly, e.g. for compression or encryption
+ */
+
+namespace fz {
+
+/**
+ * \brief Transforms a stream of data
+ *
+ * Implementations need not be thread-safe, the adapters only ever call them from one thread at a time.
+ */
+class FZ_PUBLIC_SYMBOL stream_codec
+{
+public:
+	virtual ~stream_codec() = default;
+
+	/// True once the end of the stream has been reached and all output has been produced
+	virtual bool done() const = 0;
+
+	/** \brief Runs the codec
+	 *
+	 * Consumes data from in and produces data in out, both lengths get updated to
+	 * the consumed and produced amounts. If finish is set, no further input follows.
+	 *
+	 * Returns false on corrupt or truncated input.
+	 */
+	virtual bool process(uint8_t const* in, size_t & in_len, uint8_t* out, size_t & out_len, bool finish) = 0;
+};
+
+/**
+ * \brief Runs a codec on the data of another reader
+ *
+ * Wraps an opened reader. A thread from the thread pool runs the codec on the buffers
+ * obtained from the wrapped reader, filling buffers from the same pool. While the
+ * consumer processes one buffer, the next one gets filled, so that the codec
+ * overlaps the I/O.
+ *
+ * In addition to the buffers used by the wrapped reader, the pool needs to have
+ * max_buffers + 1 buffers available for the adapter.
+ *
+ * As the size of the resulting data is not known in advance, the reader is not seekable.
+ */
+class FZ_PUBLIC_SYMBOL codec_reader : public threaded_reader
+{
+public:
+	/** \brief Constructs the reader.
+	 *
+	 * The passed \c thread_pool needs to live longer than the reader. Fails if no codec is passed.
+	 */
+	codec_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, thread_pool & tpool, std::unique_ptr<stream_codec> && codec, size_t max_buffers = 2) noexcept;
+	virtual ~codec_reader() noexcept;
+
+	virtual datetime mtime() const override;
+
+private:
+	virtual void do_close(scoped_lock & l) override;
+	virtual bool do_seek(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	void entry();
+
+	std::unique_ptr<reader_base> reader_;
+	std::unique_ptr<stream_codec> codec_;
+	thread_pool & thread_pool_;
+
+	// Set while waiting for the wrapped reader
+	bool reader_waiting_{};
+};
+
+/**
+ * \brief Runs a codec on data before passing it to another writer
+ *
+ * Wraps an opened writer. Buffers added to this writer are processed by a thread from
+ * the thread pool which passes the output on to the wrapped writer using buffers from
+ * the same pool. Adding the next buffer overlaps processing the previous one.
+ *
+ * In addition to the buffers used by the wrapped writer, the pool needs to have
+ * one buffer available for the adapter.
+ *
+ * Finalizing the adapter flushes the codec and then finalizes the wrapped writer.
+ */
+class FZ_PUBLIC_SYMBOL codec_writer : public threaded_writer, protected aio_waiter
+{
+public:
+	/** \brief Constructs the writer.
+	 *
+	 * The passed \c thread_pool needs to live longer than the writer. Fails if no codec is passed.
+	 */
+	codec_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, thread_pool & tpool, std::unique_ptr<stream_codec> && codec, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 2) noexcept;
+	virtual ~codec_writer() noexcept;
+
+	virtual bool set_mtime(datetime const& t) override;
+
+private:
+	virtual void do_close(scoped_lock & l) override;
+	virtual aio_result continue_finalize(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	void entry();
+
+	// Passes the output buffer to the wrapped writer
+	bool flush_output(scoped_lock & l);
+
+	std::unique_ptr<writer_base> writer_;
+	std::unique_ptr<stream_codec> codec_;
+
+	buffer_lease output_;
+
+	// Set while waiting for the wrapped writer
+	bool writer_waiting_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef LIBFILEZILLA_AIO_COMPRESSION_HEADER
+#define LIBFILEZILLA_AIO_COMPRESSION_HEADER
+
+#include "codec.hpp"
+
+/** \file
+ * \brief Adapters compressing or decompressing data on the fly
+ *
+ * The data is in the zlib format (RFC 1950), as used by the MODE Z transfer mode of FTP.
+ *
+ * The compression stages are only functional if libfilezilla has been built with zlib,
+ * otherwise the adapters fail with an error.
+ */
+
+namespace fz {
+
+enum class compression_mode
+{
+	compress,
+	decompress
+};
+
+/**
+ * \brief Compresses or decompresses the data of another reader
+ *
+ * See \ref codec_reader for how the data is processed.
+ */
+class FZ_PUBLIC_SYMBOL compression_reader final : public codec_reader
+{
+public:
+	/** \brief Constructs the reader.
+	 *
+	 * The passed \c thread_pool needs to live longer than the reader.
+	 *
+	 * When compressing, \c level ranges from 1 (fastest) to 9 (smallest), -1 selects
+	 * the codec's default.
+	 */
+	compression_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, thread_pool & tpool, compression_mode mode, int level = -1, size_t max_buffers = 2) noexcept;
+};
+
+/**
+ * \brief Compresses or decompresses data before passing it to another writer
+ *
+ * See \ref codec_writer for how the data is processed.
+ */
+class FZ_PUBLIC_SYMBOL compression_writer final : public codec_writer
+{
+public:
+	/** \brief Constructs the writer.
+	 *
+	 * The passed \c thread_pool needs to live longer than the writer.
+	 *
+	 * When compressing, \c level ranges from 1 (fastest) to 9 (smallest), -1 selects
+	 * the codec's default.
+	 */
+	compression_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, thread_pool & tpool, compression_mode mode, int level = -1, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 2) noexcept;
+};
+
+}
+
+#endif
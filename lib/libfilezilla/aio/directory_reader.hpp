@@ -0,0 +1,86 @@
+#ifndef LIBFILEZILLA_AIO_DIRECTORY_READER_HEADER
+#define LIBFILEZILLA_AIO_DIRECTORY_READER_HEADER
+
+#include "aio.hpp"
+#include "../local_filesys.hpp"
+#include "../thread_pool.hpp"
+
+#include <list>
+#include <vector>
+
+/** \file
+ * \brief Reading directories without blocking the caller
+ */
+
+namespace fz {
+
+/**
+ * \brief Lists a directory in a thread from a thread pool
+ *
+ * Enumerating a directory with millions of entries, in particular on network file systems,
+ * can take a long time. The directory reader does so in the background and hands out the
+ * entries in batches, like \ref reader_base hands out buffers.
+ *
+ * At most max_batches batches are held at any time, reading pauses until the consumer
+ * has taken a batch, so memory stays bounded no matter the size of the directory.
+ */
+class FZ_PUBLIC_SYMBOL directory_reader final : public aio_waitable
+{
+public:
+	/**
+	 * \brief Starts reading the directory.
+	 *
+	 * The passed \c thread_pool needs to live longer than the reader. See
+	 * \ref local_filesys::begin_find_files and \ref local_filesys::get_next_files for
+	 * the meaning of the other parameters.
+	 */
+	directory_reader(thread_pool & pool, native_string const& path, dir_entry_fields fields = dir_entry_fields::type,
+		bool dirs_only = false, bool query_symlink_targets = true, size_t max_batches = 4, size_t batch_size = 1024);
+
+	/// Stops reading, waiting for the thread if needed
+	virtual ~directory_reader();
+
+	directory_reader(directory_reader const&) = delete;
+	directory_reader& operator=(directory_reader const&) = delete;
+
+	/** \brief Gets the next batch of entries.
+	 *
+	 * If it returns aio_result::ok, the contents of \c entries get replaced with the next
+	 * batch. If \c entries is empty on aio_result::ok, the end of the directory has been reached.
+	 *
+	 * If aio_result::error is returned, the directory could not be read, \sa error
+	 *
+	 * After getting aio_result::wait, do not call get_entries again until after the passed
+	 * waiter got on_buffer_availability() invoked, or the handler received an \ref aio_buffer_event.
+	 */
+	aio_result get_entries(std::vector<local_filesys::dir_entry> & entries, aio_waiter & h);
+	aio_result get_entries(std::vector<local_filesys::dir_entry> & entries, event_handler & h);
+
+	/// The result of opening the directory
+	result error() const;
+
+private:
+	aio_result do_get_entries(scoped_lock & l, std::vector<local_filesys::dir_entry> & entries);
+
+	void entry(native_string const& path, dir_entry_fields fields, bool dirs_only, bool query_symlink_targets);
+
+	mutable mutex mtx_;
+	condition cond_;
+	async_task task_;
+
+	size_t const max_batches_;
+	size_t const batch_size_;
+
+	std::list<std::vector<local_filesys::dir_entry>> batches_;
+
+	// A consumed batch, kept so that its memory can be reused
+	std::vector<local_filesys::dir_entry> spare_;
+
+	result result_{result::ok};
+	bool eof_{};
+	bool quit_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef LIBFILEZILLA_AIO_ENCRYPTION_HEADER
+#define LIBFILEZILLA_AIO_ENCRYPTION_HEADER
+
+#include "codec.hpp"
+#include "../encryption.hpp"
+
+/** \file
+ * \brief Adapters encrypting or decrypting data on the fly
+ *
+ * The data is in the chunked format of \ref stream_encryptor.
+ */
+
+namespace fz {
+
+enum class encryption_mode
+{
+	encrypt,
+	decrypt
+};
+
+/**
+ * \brief Encrypts or decrypts the data of another reader
+ *
+ * See \ref codec_reader for how the data is processed.
+ *
+ * When decrypting, the plaintext of each chunk is only handed out once the chunk has
+ * been authenticated. If the data has been truncated or modified, reading fails with
+ * an error. As with \ref stream_decryptor, the plaintext is only known to be complete
+ * once the end of the data has been reached without error.
+ */
+class FZ_PUBLIC_SYMBOL encryption_reader final : public codec_reader
+{
+public:
+	/// The passed \c thread_pool needs to live longer than the reader.
+	encryption_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, thread_pool & tpool, symmetric_key const& key, encryption_mode mode, size_t max_buffers = 2) noexcept;
+};
+
+/**
+ * \brief Encrypts or decrypts data before passing it to another writer
+ *
+ * See \ref codec_writer for how the data is processed.
+ *
+ * When decrypting, finalizing fails if the data has been truncated. Data written
+ * to the wrapped writer before has been authenticated.
+ */
+class FZ_PUBLIC_SYMBOL encryption_writer final : public codec_writer
+{
+public:
+	/// The passed \c thread_pool needs to live longer than the writer.
+	encryption_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, thread_pool & tpool, symmetric_key const& key, encryption_mode mode, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 2) noexcept;
+};
+
+}
+
+#endif
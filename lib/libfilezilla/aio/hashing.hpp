@@ -0,0 +1,123 @@
+#ifndef LIBFILEZILLA_AIO_HASHING_HEADER
+#define LIBFILEZILLA_AIO_HASHING_HEADER
+
+#include "reader.hpp"
+#include "writer.hpp"
+#include "../hash.hpp"
+#include "../tree_hash.hpp"
+
+#include <memory>
+#include <vector>
+
+/** \file
+ * \brief Adapters hashing the data passing through readers and writers
+ */
+
+namespace fz {
+
+/**
+ * \brief Hashes all data read from another reader
+ *
+ * Wraps an opened reader and feeds each buffer into one accumulator per passed
+ * hash algorithm before handing it on, so that data can be checksummed while
+ * being transferred without a second pass.
+ *
+ * Seeking seeks the wrapped reader and restarts hashing. Offsets are those of the
+ * wrapped reader, pass the offset the wrapped reader got opened at to the constructor.
+ */
+class FZ_PUBLIC_SYMBOL hashing_reader final : public reader_base
+{
+public:
+	hashing_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, std::vector<hash_algorithm> const& algorithms, uint64_t offset = 0);
+	virtual ~hashing_reader() noexcept;
+
+	virtual bool seekable() const override;
+	virtual datetime mtime() const override;
+
+	/** \brief Returns the digest of all data read.
+	 *
+	 * Only available once the wrapped reader has reached eof, returns an empty
+	 * digest before or if the index is out of range.
+	 */
+	std::vector<uint8_t> digest(size_t index = 0) const;
+
+private:
+	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
+	virtual bool do_seek(scoped_lock & l) override;
+	virtual void do_close(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	std::unique_ptr<reader_base> reader_;
+
+	std::vector<std::unique_ptr<hash_accumulator>> accumulators_;
+	std::vector<std::vector<uint8_t>> digests_;
+};
+
+/**
+ * \brief Feeds all data read from another reader into a tree hash
+ *
+ * Several readers opened at different ranges of the same file can share a single
+ * \ref tree_hash_accumulator, each range being consumed by a different thread. The
+ * ranges should start at multiples of \ref tree_hash_accumulator::chunk_size.
+ *
+ * Not seekable, data cannot be removed from the accumulator once added.
+ */
+class FZ_PUBLIC_SYMBOL tree_hashing_reader final : public reader_base
+{
+public:
+	/// Pass the offset the wrapped reader got opened at. The accumulator needs to live longer than the reader.
+	tree_hashing_reader(aio_buffer_pool & pool, std::unique_ptr<reader_base> && reader, tree_hash_accumulator & acc, uint64_t offset = 0);
+	virtual ~tree_hashing_reader() noexcept;
+
+	virtual datetime mtime() const override;
+
+private:
+	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
+	virtual void do_close(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	std::unique_ptr<reader_base> reader_;
+	tree_hash_accumulator & acc_;
+	uint64_t offset_{};
+};
+
+/**
+ * \brief Hashes all data written to another writer
+ *
+ * Wraps an opened writer and feeds each buffer into one accumulator per passed
+ * hash algorithm before handing it on.
+ */
+class FZ_PUBLIC_SYMBOL hashing_writer final : public writer_base, protected aio_waiter
+{
+public:
+	hashing_writer(std::wstring_view name, aio_buffer_pool & pool, std::unique_ptr<writer_base> && writer, std::vector<hash_algorithm> const& algorithms);
+	virtual ~hashing_writer() noexcept;
+
+	virtual aio_result preallocate(uint64_t size) override;
+	virtual bool set_mtime(datetime const& t) override;
+
+	/** \brief Returns the digest of all data written.
+	 *
+	 * Only available once finalize has returned aio_result::ok, returns an empty
+	 * digest before or if the index is out of range.
+	 */
+	std::vector<uint8_t> digest(size_t index = 0);
+
+private:
+	virtual aio_result do_add_buffer(scoped_lock & l, buffer_lease && b) override;
+	virtual aio_result do_finalize(scoped_lock & l) override;
+	virtual void do_close(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	std::unique_ptr<writer_base> writer_;
+
+	std::vector<std::unique_ptr<hash_accumulator>> accumulators_;
+	std::vector<std::vector<uint8_t>> digests_;
+};
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef LIBFILEZILLA_AIO_MMAP_READER_HEADER
+#define LIBFILEZILLA_AIO_MMAP_READER_HEADER
+
+#include "reader.hpp"
+
+#include <list>
+#include <unordered_map>
+
+/** \file
+ * \brief Readers handing out views into memory-mapped files
+ */
+
+namespace fz {
+
+/// \private
+class file_mapping;
+
+/**
+ * \brief Cache of read-only file mappings, shared by \ref mmap_reader_factory instances
+ *
+ * Mappings are keyed by path, modification time and size, a modified file gets mapped anew.
+ * Up to max_mappings mappings are kept for reuse. Mappings still used by readers or by
+ * buffer leases remain valid even if evicted from the cache.
+ *
+ * The cache must outlive all factories using it.
+ */
+class FZ_PUBLIC_SYMBOL mmap_cache final
+{
+public:
+	explicit mmap_cache(size_t max_mappings = 64);
+	~mmap_cache();
+
+	mmap_cache(mmap_cache const&) = delete;
+	mmap_cache& operator=(mmap_cache const&) = delete;
+
+	/// Number of cached mappings
+	size_t size() const;
+
+	/// Evicts all mappings
+	void clear();
+
+private:
+	friend class mmap_reader_factory;
+
+	// Returns a referenced mapping, or nullptr on error
+	file_mapping* get(native_string const& path, logger_interface & logger);
+
+	mutable mutex mtx_;
+
+	size_t const max_mappings_{};
+
+	// Most recently used first
+	std::list<file_mapping*> lru_;
+	std::unordered_map<native_string, std::list<file_mapping*>::iterator> mappings_;
+};
+
+/**
+ * \brief Reads a file by handing out views into a shared, read-only mapping of it
+ *
+ * Unlike \ref file_reader, no data gets copied and no thread is needed. The buffer pool
+ * is not used, the returned leases refer to the mapping directly.
+ *
+ * The returned buffers are read-only, modifying them results in a crash.
+ *
+ * If the file gets truncated while mapped, accessing the data past its new end results in
+ * SIGBUS. Only use this reader on files that are not modified in place.
+ */
+class FZ_PUBLIC_SYMBOL mmap_reader final : public reader_base
+{
+public:
+	virtual ~mmap_reader() noexcept;
+
+	virtual bool seekable() const override { return true; }
+
+	virtual datetime mtime() const override;
+
+	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
+
+private:
+	friend class mmap_reader_factory;
+	mmap_reader(std::wstring const& name, aio_buffer_pool & pool, file_mapping & mapping, size_t chunk_size) noexcept;
+
+	virtual void do_close(scoped_lock & l) override;
+	virtual bool do_seek(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	// Tells the system about the data needed next
+	void advise(uint64_t offset);
+
+	file_mapping* mapping_{};
+	size_t const chunk_size_{};
+
+	// End of the range already advised as needed
+	uint64_t advised_{};
+};
+
+/**
+ * \brief Factory for \sa mmap_reader
+ *
+ * The size of the views handed out by the readers is given by chunk_size.
+ */
+class FZ_PUBLIC_SYMBOL mmap_reader_factory final : public reader_factory
+{
+public:
+	mmap_reader_factory(std::wstring const& file, mmap_cache & cache, size_t chunk_size = 1024 * 1024);
+
+	virtual std::unique_ptr<reader_base> open(aio_buffer_pool & pool, uint64_t offset = 0, uint64_t size = reader_base::nosize, size_t max_buffers = 0) override;
+	virtual std::unique_ptr<reader_factory> clone() const override;
+
+	virtual bool seekable() const override { return true; }
+
+	virtual uint64_t size() const override;
+	virtual datetime mtime() const override;
+
+	/// The readers do not use any buffers from the pool
+	virtual size_t min_buffer_usage() const override { return 0; }
+
+private:
+	mmap_cache & cache_;
+	size_t const chunk_size_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef LIBFILEZILLA_AIO_PARALLEL_READER_HEADER
+#define LIBFILEZILLA_AIO_PARALLEL_READER_HEADER
+
+#include "reader.hpp"
+
+#include <map>
+
+/** \file
+ * \brief Readers reading multiple parts of a file concurrently
+ */
+
+namespace fz {
+
+/**
+ * \brief Reads a file using multiple threads
+ *
+ * The range to read is split into blocks the size of the pool's buffers. Up to \c threads
+ * threads from the thread pool read the blocks concurrently using positional reads,
+ * with at most max_buffers blocks being read or waiting to be consumed. The consumer
+ * still receives the blocks in order.
+ *
+ * Useful with devices that need many outstanding requests to reach their full
+ * throughput, such as NVMe drives. For regular disks, prefer \ref file_reader.
+ */
+class FZ_PUBLIC_SYMBOL parallel_file_reader final : public reader_base
+{
+public:
+	/** \brief Constructs the reader.
+	 *
+	 * The passed \c thread_pool needs to live longer than the reader. The
+	 * size of the file needs to be known.
+	 */
+	parallel_file_reader(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, size_t threads, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 8) noexcept;
+
+	virtual ~parallel_file_reader() noexcept;
+
+	virtual bool seekable() const override { return true; }
+
+	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
+
+private:
+	virtual void do_close(scoped_lock & l) override;
+	virtual bool do_seek(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	void entry(condition & cond);
+
+	void wakeup(scoped_lock & l);
+	void stop(scoped_lock & l);
+
+	file file_;
+	thread_pool & thread_pool_;
+
+	struct worker final
+	{
+		condition cond_;
+		async_task task_;
+	};
+	std::list<worker> workers_;
+	size_t const threads_{};
+
+	bool quit_{};
+
+	// Blocks are counted from start_offset_ on
+	uint64_t block_size_{};
+	uint64_t block_count_{};
+	uint64_t next_block_{};
+	uint64_t next_delivery_{};
+
+	// Blocks read but not yet consumed, by number
+	std::map<uint64_t, buffer_lease> ready_;
+};
+
+/// Factory for \sa parallel_file_reader
+class FZ_PUBLIC_SYMBOL parallel_file_reader_factory final : public reader_factory
+{
+public:
+	parallel_file_reader_factory(std::wstring const& file, thread_pool & tpool, size_t threads = 4);
+
+	/// If max_buffers is 0, preferred_buffer_count() is used
+	virtual std::unique_ptr<reader_base> open(aio_buffer_pool & pool, uint64_t offset = 0, uint64_t size = reader_base::nosize, size_t max_buffers = 0) override;
+	virtual std::unique_ptr<reader_factory> clone() const override;
+
+	virtual bool seekable() const override { return true; }
+
+	virtual uint64_t size() const override;
+	virtual	datetime mtime() const override;
+
+	virtual bool multiple_buffer_usage() const override { return true; }
+
+	/// Enough buffers to keep each thread busy while the consumer processes blocks
+	virtual size_t preferred_buffer_count() const override { return threads_ * 2; }
+
+private:
+	thread_pool & thread_pool_;
+	size_t const threads_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef LIBFILEZILLA_AIO_PROCESS_IO_HEADER
+#define LIBFILEZILLA_AIO_PROCESS_IO_HEADER
+
+#include "reader.hpp"
+#include "writer.hpp"
+
+/** \file
+ * \brief Transferring data to and from a child process through shared memory
+ *
+ * The parent uses a \ref process_reader or \ref process_writer together with an
+ * \ref aio_buffer_pool using shared memory, the child a \ref process_buffer_peer.
+ * Only the location of the buffers within the shared memory is passed over the
+ * process's pipes, the data itself is never copied.
+ *
+ * Typical use is doing file I/O in a helper process running under a different user,
+ * see \ref impersonation_token:
+ * - Create the pool with shared memory
+ * - Spawn the child, passing the descriptor from \ref aio_buffer_pool::shared_memory_info
+ *   and the size of the mapping, e.g. as \c extra_fds and on the command line.
+ *   On Windows, use DuplicateHandle to give the child access to the mapping.
+ * - In the child, create a \ref process_buffer_peer and call \ref process_buffer_peer::serve
+ * - In the parent, create a reader or writer using the \ref process
+ *
+ * \warning The child has write access to the entire pool, see
+ * \ref aio_buffer_pool::shared_memory_info
+ */
+
+namespace fz {
+
+class process;
+
+/**
+ * \brief Reads data the child process puts into buffers of a shared memory pool
+ *
+ * A thread from the thread pool hands empty buffers to the child, which fills them.
+ * Up to max_buffers buffers are being filled or waiting to be consumed at any time.
+ *
+ * The process must be spawned with redirected I/O and must not be used for anything
+ * else while the reader exists. Closing the reader waits for the child to return
+ * the buffers it is filling.
+ */
+class FZ_PUBLIC_SYMBOL process_reader final : public threaded_reader
+{
+public:
+	process_reader(std::wstring_view name, aio_buffer_pool & pool, process & p, thread_pool & tpool, size_t max_buffers = 4) noexcept;
+	virtual ~process_reader() noexcept;
+
+private:
+	virtual void do_close(scoped_lock & l) override;
+	virtual bool do_seek(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	void entry();
+
+	process & process_;
+	thread_pool & thread_pool_;
+
+	uint8_t const* base_{};
+	size_t shm_size_{};
+
+	// Buffers passed to the child, in order
+	std::list<buffer_lease> pending_;
+};
+
+/**
+ * \brief Hands buffers of a shared memory pool to the child process for writing
+ *
+ * The buffers need to be leased from the pool passed to the constructor. Each buffer
+ * is kept until the child has processed it. Finalizing waits for the child to
+ * confirm that it has processed all data.
+ *
+ * The process must be spawned with redirected I/O and must not be used for anything
+ * else while the writer exists.
+ */
+class FZ_PUBLIC_SYMBOL process_writer final : public threaded_writer
+{
+public:
+	process_writer(std::wstring_view name, aio_buffer_pool & pool, process & p, thread_pool & tpool, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 4) noexcept;
+	virtual ~process_writer() noexcept;
+
+private:
+	virtual aio_result do_add_buffer(scoped_lock & l, buffer_lease && b) override;
+	virtual aio_result continue_finalize(scoped_lock & l) override;
+
+	void entry();
+
+	process & process_;
+
+	uint8_t const* base_{};
+	size_t shm_size_{};
+
+	// Number of buffers at the front of buffers_ passed to the child
+	size_t sent_{};
+};
+
+/**
+ * \brief Child side of \ref process_reader and \ref process_writer
+ *
+ * Maps the shared memory of the parent's pool and serves the requests the parent
+ * sends over the child's standard input.
+ */
+class FZ_PUBLIC_SYMBOL process_buffer_peer final
+{
+public:
+	/// Pass the descriptor or handle and the size as returned by \ref aio_buffer_pool::shared_memory_info in the parent
+	process_buffer_peer(aio_buffer_pool::shm_handle shm, size_t size);
+	~process_buffer_peer();
+
+	process_buffer_peer(process_buffer_peer const&) = delete;
+	process_buffer_peer& operator=(process_buffer_peer const&) = delete;
+
+	explicit operator bool() const { return memory_ != nullptr; }
+
+	/** \brief Serves requests from the parent until it is done
+	 *
+	 * Reads from the file into the buffers passed by a \ref process_reader,
+	 * writes the buffers passed by a \ref process_writer to the file.
+	 *
+	 * Returns false if communication with the parent failed.
+	 */
+	bool serve(file & f);
+
+private:
+	uint8_t* memory_{};
+	size_t size_{};
+};
+
+}
+
+#endif
@@ -6,6 +6,7 @@
 #include "../thread_pool.hpp"
 
 #include <list>
+#include <memory>
 
 namespace fz {
 
@@ -54,6 +55,17 @@ public:
 	std::pair<aio_result, buffer_lease> get_buffer(aio_waiter & h);
 	std::pair<aio_result, buffer_lease> get_buffer(event_handler & h);
 
+	/** \brief Gets up to max buffers with data at once, appending them to the passed vector.
+	 *
+	 * Same semantics as get_buffer: aio_result::ok with nothing appended means eof.
+	 * If fewer buffers are ready, only these are returned. Errors and eof are then
+	 * reported by the next call.
+	 *
+	 * Locks the reader only once. Threaded readers wake up their thread at most once.
+	 */
+	aio_result get_buffers(std::vector<buffer_lease> & buffers, size_t max, aio_waiter & h);
+	aio_result get_buffers(std::vector<buffer_lease> & buffers, size_t max, event_handler & h);
+
 	bool error() const;
 
 protected:
@@ -82,6 +94,9 @@ protected:
 
 	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) = 0;
 
+	/// The default implementation calls do_get_buffer until no more buffers are ready
+	virtual aio_result do_get_buffers(scoped_lock & l, std::vector<buffer_lease> & buffers, size_t max);
+
 	/// When this gets called, buffers_ has already been cleared and the waiters have been removed.
 	/// start_offset_, size_ and remaining_ have already been set.
 	virtual bool do_seek(scoped_lock &) {
@@ -200,6 +215,7 @@ private:
 	std::unique_ptr<reader_factory> impl_;
 };
 
+class file_handle_cache;
 class thread_pool;
 
 /// Base class for threaded readers
@@ -210,6 +226,9 @@ public:
 	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
 
 protected:
+	/// Takes all ready buffers at once, do_get_buffer is only called if there are none
+	virtual aio_result do_get_buffers(scoped_lock & l, std::vector<buffer_lease> & buffers, size_t max) override;
+
 	void wakeup(scoped_lock & l) {
 		cond_.signal(l);
 	}
@@ -220,6 +239,23 @@ protected:
 	bool quit_{};
 };
 
+enum class file_reader_flags : unsigned {
+	/// Bypass the system's file cache, \sa file::direct
+	direct = 0x01,
+
+	/// For data read only once: Evicts data behind the read position from the system's file cache
+	drop_behind = 0x02,
+
+	/// Holes in sparse files are not read from disk, zeros are returned for them instead
+	sparse = 0x04
+};
+inline bool operator&(file_reader_flags lhs, file_reader_flags rhs) {
+	return (static_cast<std::underlying_type_t<file_reader_flags>>(lhs) & static_cast<std::underlying_type_t<file_reader_flags>>(rhs)) != 0;
+}
+inline file_reader_flags operator|(file_reader_flags lhs, file_reader_flags rhs) {
+	return static_cast<file_reader_flags>(static_cast<std::underlying_type_t<file_reader_flags>>(lhs) | static_cast<std::underlying_type_t<file_reader_flags>>(rhs));
+}
+
 /// File reader
 class FZ_PUBLIC_SYMBOL file_reader final : public threaded_reader
 {
@@ -227,14 +263,27 @@ public:
 	/** \brief Constructs file reader.
 	 *
 	 * The passed \c thread_pool needs to live longer than the reader.
+	 *
+	 * If \ref file_reader_flags::direct is set, the file needs to be opened with \ref file::direct.
+	 * Reads then only use whole blocks at aligned offsets, which requires the pool's
+	 * buffers to be at least \ref file::direct_io_alignment large.
+	 *
+	 * Otherwise the system is told to read ahead of the current position. The readahead
+	 * window grows whenever the consumer has to wait for data.
+	 *
+	 * Reads are positional and do not change the file's position, so the same file
+	 * can be shared by any number of readers, \sa file_handle_cache
 	 */
-	file_reader(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 4) noexcept;
-	file_reader(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 4) noexcept;
+	file_reader(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 4, file_reader_flags flags = {}) noexcept;
+	file_reader(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 4, file_reader_flags flags = {}) noexcept;
+	file_reader(std::wstring_view name, aio_buffer_pool & pool, std::shared_ptr<file> const& f, thread_pool & tpool, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 4, file_reader_flags flags = {}) noexcept;
 
 	virtual ~file_reader() noexcept;
 
 	virtual bool seekable() const override;
 
+	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
+
 private:
 	virtual void do_close(scoped_lock & l) override;
 	virtual bool do_seek(scoped_lock & l) override;
@@ -243,15 +292,49 @@ private:
 
 	void entry();
 
-	file file_;
+	// Advises the system about the data needed next and, if requested, the data no longer needed.
+	// Returns false if the reader got closed or failed in the meantime.
+	bool give_hints(scoped_lock & l);
+
+	// Reads at pos_, filling holes with zeros in sparse mode
+	int64_t read(uint8_t* p, size_t len);
+
+	std::shared_ptr<file> file_;
 	thread_pool & thread_pool_;
+
+	bool const direct_{};
+	bool const drop_behind_{};
+	bool const sparse_{};
+
+	// In direct mode, the number of bytes read before start_offset_ due to alignment
+	size_t skip_{};
+
+	// Offset in the file of the next read
+	uint64_t pos_{};
+
+	// Size of the readahead window, end of the range already advised as needed, and start
+	// of the range not yet evicted from the system's cache.
+	uint64_t readahead_{};
+	uint64_t advised_{};
+	uint64_t dropped_{};
+
+	// In sparse mode, whether pos_ is in a hole, and the end of the hole or data region.
+	bool in_hole_{};
+	uint64_t region_end_{};
 };
 
 /// Factory for \sa file_reader
 class FZ_PUBLIC_SYMBOL file_reader_factory final : public reader_factory
 {
 public:
-	file_reader_factory(std::wstring const& file, thread_pool & tpool);
+	/**
+	 * \brief Creates the factory
+	 *
+	 * If a cache is passed, the readers share the cached handles instead of opening the file
+	 * themselves. The cache is not used with \ref file_reader_flags::direct. The cache must
+	 * outlive the factory, its clones and the readers opened from them.
+	 */
+	file_reader_factory(std::wstring const& file, thread_pool & tpool, file_reader_flags flags = {}, file_handle_cache * cache = nullptr);
 
 	virtual std::unique_ptr<reader_base> open(aio_buffer_pool & pool, uint64_t offset = 0, uint64_t size = reader_base::nosize, size_t max_buffers = 4) override;
 	virtual std::unique_ptr<reader_factory> clone() const override;
@@ -266,16 +349,22 @@ public:
 	virtual size_t preferred_buffer_count() const override { return 4; }
 private:
 	thread_pool & thread_pool_;
+	file_reader_flags flags_{};
+	file_handle_cache * cache_{};
 };
 
 /**
  * Does not own the data, uses just one buffer.
  * The memory pointed to by the view must live longer than the reader.
+ *
+ * If zero_copy is set, the buffer pool is not used. The returned leases instead refer to
+ * the viewed memory directly, they must not outlive it. Such buffers are read-only,
+ * do not modify them.
  */
 class FZ_PUBLIC_SYMBOL view_reader final : public reader_base
 {
 public:
-	view_reader(std::wstring && name, aio_buffer_pool & pool, std::string_view data) noexcept;
+	view_reader(std::wstring && name, aio_buffer_pool & pool, std::string_view data, bool zero_copy = false) noexcept;
 
 	virtual ~view_reader() noexcept;
 
@@ -290,6 +379,7 @@ private:
 	virtual void on_buffer_availability(aio_waitable const* w) override;
 
 	std::string_view const view_;
+	bool const zero_copy_{};
 };
 
 /**
@@ -300,13 +390,15 @@ private:
 class FZ_PUBLIC_SYMBOL view_reader_factory final : public reader_factory
 {
 public:
-	view_reader_factory(std::wstring && name, std::string_view const& view)
+	view_reader_factory(std::wstring && name, std::string_view const& view, bool zero_copy = false)
 	    : reader_factory(std::move(name))
 	    , view_(view)
+	    , zero_copy_(zero_copy)
 	{}
-	view_reader_factory(std::wstring const& name, std::string_view const& view)
+	view_reader_factory(std::wstring const& name, std::string_view const& view, bool zero_copy = false)
 	    : reader_factory(name)
 	    , view_(view)
+	    , zero_copy_(zero_copy)
 	{}
 
 	virtual std::unique_ptr<reader_base> open(aio_buffer_pool & pool, uint64_t offset = 0, uint64_t size = reader_base::nosize, size_t max_buffers = 1) override;
@@ -318,14 +410,24 @@ public:
 
 private:
 	std::string_view const view_;
+	bool const zero_copy_{};
 };
 
-/// String reader, keeps a copy of the string.
+/// \private
+class string_reader_data;
+
+/**
+ * String reader, keeps a copy of the string.
+ *
+ * If zero_copy is set, the buffer pool is not used. The returned leases instead refer to
+ * the string directly and keep it alive, they may outlive the reader. Such buffers are
+ * read-only, do not modify them.
+ */
 class FZ_PUBLIC_SYMBOL string_reader final : public reader_base
 {
 public:
-	string_reader(std::wstring && name, aio_buffer_pool & pool, std::string const& data) noexcept;
-	string_reader(std::wstring && name, aio_buffer_pool & pool, std::string && data) noexcept;
+	string_reader(std::wstring && name, aio_buffer_pool & pool, std::string const& data, bool zero_copy = false) noexcept;
+	string_reader(std::wstring && name, aio_buffer_pool & pool, std::string && data, bool zero_copy = false) noexcept;
 
 	virtual ~string_reader() noexcept;
 
@@ -339,20 +441,23 @@ private:
 
 	virtual void on_buffer_availability(aio_waitable const* w) override;
 
-	std::string const data_;
+	string_reader_data* data_{};
+	bool const zero_copy_{};
 };
 
 /// Factory for \sa string_reader, keeps a copy of the string.
 class FZ_PUBLIC_SYMBOL string_reader_factory final : public reader_factory
 {
 public:
-	string_reader_factory(std::wstring const& name, std::string const& data)
+	string_reader_factory(std::wstring const& name, std::string const& data, bool zero_copy = false)
 	    : reader_factory(name)
 	    , data_(data)
+	    , zero_copy_(zero_copy)
 	{}
-	string_reader_factory(std::wstring && name, std::string && data)
+	string_reader_factory(std::wstring && name, std::string && data, bool zero_copy = false)
 	    : reader_factory(std::move(name))
 	    , data_(std::move(data))
+	    , zero_copy_(zero_copy)
 	{}
 
 	virtual std::unique_ptr<reader_base> open(aio_buffer_pool & pool, uint64_t offset = 0, uint64_t size = reader_base::nosize, size_t max_buffers = 1) override;
@@ -364,6 +469,7 @@ public:
 
 private:
 	std::string const data_;
+	bool const zero_copy_{};
 };
 
 }
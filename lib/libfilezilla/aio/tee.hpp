@@ -0,0 +1,100 @@
+#ifndef LIBFILEZILLA_AIO_TEE_HEADER
+#define LIBFILEZILLA_AIO_TEE_HEADER
+
+#include "reader.hpp"
+#include "writer.hpp"
+
+#include <vector>
+
+/** \file
+ * \brief Copying the data of one reader to multiple writers
+ */
+
+namespace fz {
+
+class tee;
+
+/// \private
+struct tee_event_type{};
+
+/// Sent to the handler passed to \ref tee once it has completed
+typedef simple_event<tee_event_type, tee const*> tee_event;
+
+/**
+ * \brief Feeds the data of one reader into multiple writers
+ *
+ * A thread from the thread pool reads the buffers from the reader and passes each
+ * to all writers. The writers share the buffer, nothing gets copied. The buffer
+ * returns to the pool once the last writer has released it. Writers must not
+ * modify the data of the buffers they get.
+ *
+ * The next buffer gets read only once all writers are ready for it, so the slowest
+ * writer determines the speed at which the data gets transferred.
+ *
+ * If a writer fails, it is closed and the remaining writers continue to receive the
+ * data. Once all data has been read, all writers are finalized.
+ */
+class FZ_PUBLIC_SYMBOL tee final : protected aio_waiter
+{
+public:
+	/** \brief Starts the transfer.
+	 *
+	 * The passed \c thread_pool needs to live longer than the tee. If a handler is
+	 * passed, it receives a \ref tee_event once all writers have finished.
+	 */
+	tee(thread_pool & tpool, std::unique_ptr<reader_base> && reader, std::vector<std::unique_ptr<writer_base>> && writers, event_handler * handler = nullptr);
+
+	/// Stops the transfer if it is still running
+	virtual ~tee() noexcept;
+
+	tee(tee const&) = delete;
+	tee& operator=(tee const&) = delete;
+
+	/// Whether the transfer has completed
+	bool done() const;
+
+	/** \brief Result of each writer
+	 *
+	 * aio_result::ok if the writer got all the data and has been finalized,
+	 * aio_result::error if it or the reader failed, or aio_result::wait
+	 * if the transfer is still running.
+	 */
+	std::vector<aio_result> results() const;
+
+	/// Valid until the tee gets destroyed
+	writer_base * writer(size_t index) const;
+
+private:
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	void entry();
+
+	// Passes the buffer to all writers that still accept data
+	void distribute(scoped_lock & l, buffer_lease && b);
+	void finalize(scoped_lock & l);
+	void fail(scoped_lock & l, size_t index);
+
+	mutable mutex mtx_;
+	condition cond_;
+	async_task task_;
+
+	std::unique_ptr<reader_base> reader_;
+	bool reader_waiting_{};
+
+	struct branch final
+	{
+		std::unique_ptr<writer_base> writer_;
+		aio_result result_{aio_result::wait};
+		bool waiting_{};
+	};
+	std::vector<branch> branches_;
+
+	event_handler * handler_{};
+
+	bool quit_{};
+	bool done_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef LIBFILEZILLA_AIO_URING_HEADER
+#define LIBFILEZILLA_AIO_URING_HEADER
+
+/** \file
+ * \brief Declares \ref fz::uring_engine and the readers and writers using it.
+ */
+
+#include "reader.hpp"
+#include "writer.hpp"
+
+#include <memory>
+
+namespace fz {
+
+/// \private
+class uring_engine_impl;
+
+/**
+ * \brief A completion-based I/O engine using io_uring on Linux and I/O completion ports on Windows.
+ *
+ * Unlike \ref file_reader and \ref file_writer, which block a pooled thread per open file,
+ * the readers and writers created with an engine submit their reads and writes to the kernel
+ * in batches and get notified from a single completion thread. Multiple operations per file
+ * are kept in flight, up to the number of buffers the reader or writer is allowed to use.
+ *
+ * On Windows, files are read and written with overlapped I/O, they need to be opened with
+ * \ref file::overlapped. The factories take care of that. Syncing to disk has no overlapped
+ * equivalent, it is done in a thread from the pool.
+ *
+ * If io_uring is unavailable, be it due to the platform, the kernel version or a sandbox
+ * disallowing it, \ref available returns false and the factories fall back to creating
+ * the classic threaded readers and writers.
+ *
+ * The engine must outlive all readers and writers created with it.
+ */
+class FZ_PUBLIC_SYMBOL uring_engine final
+{
+public:
+	/**
+	 * \brief Creates the ring and spawns the completion thread from the pool.
+	 *
+	 * \param pool Provides the completion thread, and the threads for the fallback readers and writers.
+	 * \param entries Size of the submission queue. Further operations are queued internally.
+	 *                On Windows, the number of completions dequeued at once.
+	 */
+	explicit uring_engine(thread_pool & pool, unsigned int entries = 256);
+	~uring_engine();
+
+	uring_engine(uring_engine const&) = delete;
+	uring_engine& operator=(uring_engine const&) = delete;
+
+	/// Whether io_uring is actually used
+	bool available() const;
+
+	thread_pool& pool() { return pool_; }
+
+private:
+	friend class uring_file_reader;
+	friend class uring_file_writer;
+
+	thread_pool & pool_;
+	std::unique_ptr<uring_engine_impl> impl_;
+};
+
+/**
+ * \brief File reader using an \ref uring_engine
+ *
+ * Keeps up to max_buffers reads in flight.
+ */
+class FZ_PUBLIC_SYMBOL uring_file_reader final : public reader_base
+{
+public:
+	/** \brief Constructs the reader.
+	 *
+	 * The engine must be \ref uring_engine::available "available".
+	 * On Windows, the file must have been opened with \ref file::overlapped.
+	 */
+	uring_file_reader(std::wstring const& name, aio_buffer_pool & pool, file && f, uring_engine & engine, uint64_t offset = 0, uint64_t size = nosize, size_t max_buffers = 4) noexcept;
+	virtual ~uring_file_reader() noexcept;
+
+	virtual bool seekable() const override;
+
+private:
+	class read_request;
+	class refill_request;
+	friend class read_request;
+	friend class refill_request;
+
+	virtual std::pair<aio_result, buffer_lease> do_get_buffer(scoped_lock & l) override;
+	virtual void do_close(scoped_lock & l) override;
+	virtual bool do_seek(scoped_lock & l) override;
+
+	virtual void on_buffer_availability(aio_waitable const* w) override;
+
+	void submit_reads(scoped_lock & l);
+	void on_read(read_request & r, int res);
+	void on_refill();
+	void drain(scoped_lock & l);
+
+	file file_;
+	uring_engine & engine_;
+
+	// Reads in order of their offsets, completed ones get moved to buffers_ once all prior reads are done.
+	std::list<std::unique_ptr<read_request>> requests_;
+	std::unique_ptr<refill_request> refill_request_;
+	size_t in_flight_{};
+	condition cond_;
+
+	uint64_t next_offset_{};
+	uint64_t unrequested_{};
+	bool refill_pending_{};
+	bool quit_{};
+};
+
+/// Factory for \sa uring_file_reader, falls back to \sa file_reader if the engine is not available
+class FZ_PUBLIC_SYMBOL uring_file_reader_factory final : public reader_factory
+{
+public:
+	uring_file_reader_factory(std::wstring const& file, uring_engine & engine);
+
+	virtual std::unique_ptr<reader_base> open(aio_buffer_pool & pool, uint64_t offset = 0, uint64_t size = reader_base::nosize, size_t max_buffers = 4) override;
+	virtual std::unique_ptr<reader_factory> clone() const override;
+
+	virtual bool seekable() const override { return true; }
+
+	virtual uint64_t size() const override;
+	virtual	datetime mtime() const override;
+
+	virtual bool multiple_buffer_usage() const override { return true; }
+
+	virtual size_t preferred_buffer_count() const override { return 4; }
+private:
+	uring_engine & engine_;
+};
+
+/**
+ * \brief File writer using an \ref uring_engine
+ *
+ * Each added buffer is immediately submitted as a write at its position in the file,
+ * up to max_buffers writes are kept in flight.
+ */
+class FZ_PUBLIC_SYMBOL uring_file_writer final : public writer_base
+{
+public:
+	/** \brief Constructs the writer, writing starts at the current position of the file.
+	 *
+	 * The engine must be \ref uring_engine::available "available".
+	 * On Windows, the file must have been opened with \ref file::overlapped.
+	 */
+	uring_file_writer(std::wstring const& name, aio_buffer_pool & pool, file && f, uring_engine & engine, bool fsync = false, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 4) noexcept;
+	virtual ~uring_file_writer() override;
+
+	virtual aio_result preallocate(uint64_t size) override;
+
+	virtual bool set_mtime(datetime const&) override;
+
+private:
+	class write_request;
+	class fsync_request;
+	friend class write_request;
+	friend class fsync_request;
+
+	virtual aio_result do_add_buffer(scoped_lock & l, buffer_lease && b) override;
+	virtual aio_result do_finalize(scoped_lock & l) override;
+	virtual void do_close(scoped_lock & l) override;
+
+	void on_write(write_request & r, int res);
+	void on_fsync(int res);
+	void complete_finalize(scoped_lock & l);
+
+	file file_;
+	uring_engine & engine_;
+
+	std::list<std::unique_ptr<write_request>> requests_;
+	std::unique_ptr<fsync_request> fsync_request_;
+	size_t in_flight_{};
+	condition cond_;
+
+	uint64_t next_offset_{};
+
+	bool fsync_{};
+	bool preallocated_{};
+};
+
+/// Factory for \sa uring_file_writer, falls back to \sa file_writer if the engine is not available
+class FZ_PUBLIC_SYMBOL uring_file_writer_factory final : public writer_factory
+{
+public:
+	uring_file_writer_factory(std::wstring const& file, uring_engine & engine, file_writer_flags = {});
+
+	virtual std::unique_ptr<writer_base> open(aio_buffer_pool & pool, uint64_t offset, writer_base::progress_cb_t progress_cb = nullptr, size_t max_buffers = 0) override;
+	virtual std::unique_ptr<writer_factory> clone() const override;
+
+	virtual bool offsetable() const override { return true; }
+
+	virtual uint64_t size() const override;
+	virtual datetime mtime() const override;
+
+	virtual bool set_mtime(datetime const&) override;
+
+	virtual bool multiple_buffer_usage() const override { return true; }
+
+	virtual size_t preferred_buffer_count() const override { return 4; }
+
+private:
+	uring_engine & engine_;
+	file_writer_flags flags_;
+};
+
+}
+
+#endif
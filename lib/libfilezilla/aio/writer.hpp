@@ -2,6 +2,7 @@
 #define LIBFILEZILLA_AIO_WRITER_HEADER
 
 #include "aio.hpp"
+#include "../buffer.hpp"
 #include "../file.hpp"
 #include "../thread_pool.hpp"
 
@@ -9,6 +10,8 @@
 
 namespace fz {
 
+class buffer_chain;
+
 /** \brief Base class for all readers
  *
  * All readers have a name describing them for logging purposes.
@@ -39,6 +42,17 @@ public:
 	aio_result add_buffer(buffer_lease && b, aio_waiter & h);
 	aio_result add_buffer(buffer_lease && b, event_handler & h);
 
+	/** \brief Passes several buffers at once, in order
+	 *
+	 * Removes the buffers the writer has taken from the front of the vector. Same semantics as
+	 * add_buffer: On aio_result::wait, pass the remaining buffers, if any, once the waiter got
+	 * on_buffer_availability() invoked.
+	 *
+	 * Locks the writer only once. Threaded writers wake up their thread at most once.
+	 */
+	aio_result add_buffers(std::vector<buffer_lease> & buffers, aio_waiter & h);
+	aio_result add_buffers(std::vector<buffer_lease> & buffers, event_handler & h);
+
 	/** \brief Finalizes the writer
 	 *
 	 * If aio_result::ok is returned, all pending data has been written out.
@@ -73,6 +87,9 @@ protected:
 	virtual aio_result do_add_buffer(scoped_lock & l, buffer_lease && b) = 0;
 	virtual aio_result do_finalize(scoped_lock & l) = 0;
 
+	/// Calls do_add_buffer for each buffer until the writer cannot take more
+	aio_result do_add_buffers(scoped_lock & l, std::vector<buffer_lease> & buffers);
+
 	writer_base(std::wstring && name, aio_buffer_pool & pool, progress_cb_t && progress_cb, size_t max_buffers) noexcept
 	    : buffer_pool_(pool)
 	    , name_(name)
@@ -192,6 +209,7 @@ private:
 
 
 class thread_pool;
+class fsync_coordinator;
 
 /// Base class for threaded writer
 class FZ_PUBLIC_SYMBOL threaded_writer : public writer_base
@@ -218,12 +236,53 @@ protected:
 	bool quit_{};
 };
 
-/// File writer
+enum class file_writer_flags : unsigned {
+	fsync = 0x01,
+	permissions_current_user_only = 0x02,
+	permissions_current_user_and_admins_only = 0x04,
+
+	/// Bypass the system's page cache, \sa file::direct
+	direct = 0x08,
+
+	/// Runs of zeros are not written but turned into holes, making the file sparse
+	sparse = 0x10,
+
+	/**
+	 * \brief Small buffers are merged into larger writes
+	 *
+	 * Buffers with less than 64 KiB of data are copied aside and their leases returned right
+	 * away. The collected data gets written once there are 1 MiB, in writes ending at a
+	 * multiple of 4 KiB in the file, once it has waited for 100 milliseconds, or before
+	 * a larger buffer or on finalization. Ignored in direct and sparse mode.
+	 */
+	coalesce = 0x20
+};
+inline bool operator&(file_writer_flags lhs, file_writer_flags rhs) {
+	return (static_cast<std::underlying_type_t<file_writer_flags>>(lhs) & static_cast<std::underlying_type_t<file_writer_flags>>(rhs)) != 0;
+}
+inline file_writer_flags operator|(file_writer_flags lhs, file_writer_flags rhs) {
+	return static_cast<file_writer_flags>(static_cast<std::underlying_type_t<file_writer_flags>>(lhs) | static_cast<std::underlying_type_t<file_writer_flags>>(rhs));
+}
+
+/** \brief File writer
+ *
+ * If \ref file_writer_flags::direct is set, the file should have been opened with
+ * \ref file::direct. Data is then written in multiples of \ref file::direct_io_alignment,
+ * either straight from suitably aligned buffers or through an internal staging area. If writing starts at an unaligned
+ * position, the file must be opened for reading as well, the partial block preceding the
+ * position gets rewritten.
+ *
+ * If \ref file_writer_flags::sparse is set, aligned blocks consisting entirely of zeros
+ * are skipped, leaving holes in the file. Ignored in direct mode.
+ *
+ * If fsync is set and a \ref fsync_coordinator is passed, the data gets flushed to disk
+ * together with that of other writers using the same coordinator.
+ */
 class FZ_PUBLIC_SYMBOL file_writer final : public threaded_writer
 {
 public:
-	file_writer(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync = false, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 4) noexcept;
-	file_writer(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync = false, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 4) noexcept;
+	file_writer(std::wstring && name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync = false, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 4, file_writer_flags flags = {}, fsync_coordinator * coordinator = nullptr) noexcept;
+	file_writer(std::wstring_view name, aio_buffer_pool & pool, file && f, thread_pool & tpool, bool fsync = false, progress_cb_t && progress_cb = nullptr, size_t max_buffers = 4, file_writer_flags flags = {}, fsync_coordinator * coordinator = nullptr) noexcept;
 
 	virtual ~file_writer() override;
 
@@ -236,32 +295,46 @@ protected:
 	virtual aio_result continue_finalize(scoped_lock & l) override;
 
 private:
+	void init(thread_pool & tpool);
 
 	void entry();
 
+	// Writes the staged data padded to the alignment, then trims the file to its real size
+	bool flush_tail();
+
+	// Writes out the coalesced data, if partial only up to a block boundary. Returns false if the writer needs to stop.
+	bool flush_coalesced(scoped_lock & l, bool partial);
+
 	file file_;
 
 	bool fsync_{};
 	bool preallocated_{};
-};
+	bool const direct_{};
+	bool const sparse_{};
+	bool const coalesce_{};
 
-enum class file_writer_flags : unsigned {
-	fsync = 0x01,
-	permissions_current_user_only = 0x02,
-	permissions_current_user_and_admins_only = 0x04
+	// In sparse and coalescing mode, the current offset in the file. Whether the last data was skipped in sparse mode.
+	uint64_t pos_{};
+	bool trailing_hole_{};
+
+	// Small buffers merged in coalescing mode, and since when the oldest data has been waiting
+	buffer coalesced_;
+	monotonic_clock coalesced_since_;
+
+	fsync_coordinator * const coordinator_{};
+
+	// Aligned staging area for direct mode
+	std::unique_ptr<uint8_t[]> staging_memory_;
+	uint8_t* staging_{};
+	size_t staged_{};
 };
-inline bool operator&(file_writer_flags lhs, file_writer_flags rhs) {
-	return (static_cast<std::underlying_type_t<file_writer_flags>>(lhs) & static_cast<std::underlying_type_t<file_writer_flags>>(rhs)) != 0;
-}
-inline file_writer_flags operator|(file_writer_flags lhs, file_writer_flags rhs) {
-	return static_cast<file_writer_flags>(static_cast<std::underlying_type_t<file_writer_flags>>(lhs) | static_cast<std::underlying_type_t<file_writer_flags>>(rhs));
-}
 
 /// Factory for \sa file_writer
 class FZ_PUBLIC_SYMBOL file_writer_factory final : public writer_factory
 {
 public:
-	file_writer_factory(std::wstring const& file, thread_pool & tpool, file_writer_flags = {});
+	/// If given, the coordinator is used by writers opened with \ref file_writer_flags::fsync, it must outlive them.
+	file_writer_factory(std::wstring const& file, thread_pool & tpool, file_writer_flags = {}, fsync_coordinator * coordinator = nullptr);
 
 	virtual std::unique_ptr<writer_base> open(aio_buffer_pool & pool, uint64_t offset, writer_base::progress_cb_t progress_cb = nullptr, size_t max_buffers = 0) override;
 	virtual std::unique_ptr<writer_factory> clone() const override;
@@ -280,6 +353,7 @@ public:
 private:
 	thread_pool & thread_pool_;
 	file_writer_flags flags_{};
+	fsync_coordinator * coordinator_{};
 };
 
 /** A simple buffer writer.
@@ -287,19 +361,29 @@ private:
  * The buffer must live longer than the writer. Note that there is no
  * synchronization. Never open two writers for the same buffer in different
  * threads, or access the buffer from any other thread while there is a writer.
+ *
+ * Data gets appended either to a contiguous buffer or to a \ref buffer_chain.
+ * The former reallocates as it grows unless preallocate() has been called
+ * with the expected size, the latter never moves data once written, which
+ * is preferable for large amounts of data of unknown size.
  */
 class FZ_PUBLIC_SYMBOL buffer_writer final : public writer_base
 {
 public:
 	buffer_writer(buffer & buffer, std::wstring const& name, aio_buffer_pool & pool, size_t size_limit, progress_cb_t && progress_cb = nullptr);
+	buffer_writer(buffer_chain & chain, std::wstring const& name, aio_buffer_pool & pool, size_t size_limit, progress_cb_t && progress_cb = nullptr);
 
+	/// Reserves space for size more octets in the buffer. Fails if size exceeds the limit.
 	virtual aio_result preallocate(uint64_t size) override;
 
 private:
 	virtual aio_result do_add_buffer(scoped_lock & l, buffer_lease && b) override;
 	virtual aio_result do_finalize(scoped_lock &) override { return error_ ? aio_result::error : aio_result::ok; }
 
-	buffer & buffer_;
+	size_t size() const;
+
+	buffer * buffer_{};
+	buffer_chain * chain_{};
 	size_t size_limit_{};
 };
 
@@ -312,14 +396,24 @@ private:
 class FZ_PUBLIC_SYMBOL buffer_writer_factory final : public writer_factory
 {
 public:
-	buffer_writer_factory(buffer & b, std::wstring const& name, size_t size_limit);
+	/** \brief Creates the factory
+	 *
+	 * If the size_hint is known, the opened writers preallocate that much space
+	 * in the buffer, so that it does not get reallocated while data is written.
+	 */
+	buffer_writer_factory(buffer & b, std::wstring const& name, size_t size_limit, uint64_t size_hint = aio_base::nosize);
+
+	/// Opened writers collect the data in the chain, it never gets reallocated.
+	buffer_writer_factory(buffer_chain & c, std::wstring const& name, size_t size_limit);
 
 	virtual std::unique_ptr<writer_base> open(aio_buffer_pool & pool, uint64_t offset, writer_base::progress_cb_t progress_cb = nullptr, size_t max_buffers = 0) override;
 	virtual std::unique_ptr<writer_factory> clone() const override;
 
 private:
-	buffer & buffer_;
+	buffer * buffer_{};
+	buffer_chain * chain_{};
 	size_t size_limit_{};
+	uint64_t size_hint_{aio_base::nosize};
 };
 
 }
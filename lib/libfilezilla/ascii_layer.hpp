@@ -22,19 +22,40 @@ public:
 	virtual int read(void *buffer, unsigned int size, int& error) override;
 	virtual int write(void const* buffer, unsigned int size, int& error) override;
 
+	/// Converts all buffers at once, \sa write
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) override;
+
 	virtual int shutdown() override;
 
 	virtual void set_event_handler(event_handler* handler, fz::socket_event_flag retrigger_block = fz::socket_event_flag{}) override;
 
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const override;
+
+	/// Releases the conversion buffer if it is empty
+	virtual void hibernate() override;
+
+	/**
+	 * \brief See socket_interface::cork
+	 *
+	 * While corked, written data is converted into the conversion buffer and only passed on
+	 * once 64 KiB have accumulated or on uncork.
+	 */
+	virtual void cork() override;
+	virtual int uncork() override;
+
 private:
 	virtual void operator()(fz::event_base const& ev) override;
 	void on_socket_event(socket_event_source* s, socket_event_flag t, int error);
 
+	// Passes the conversion buffer on to the next layer. Returns 0 once empty, otherwise EAGAIN or an error
+	int flush_buffer();
+
 	std::optional<uint8_t> tmp_read_;
 	buffer buffer_;
 	bool was_cr_{};
 	bool write_blocked_by_send_buffer_{};
 	bool waiting_read_{};
+	bool corked_{};
 };
 }
 
@@ -0,0 +1,75 @@
+#ifndef LIBFILEZILLA_ASYNC_LOGGER_HEADER
+#define LIBFILEZILLA_ASYNC_LOGGER_HEADER
+
+#include "logger.hpp"
+
+#include <memory>
+
+/** \file
+ * \brief A logger passing messages to another logger from a background thread
+ */
+
+namespace fz {
+
+class thread_pool;
+
+/**
+ * \brief Decouples logging from writing the log
+ *
+ * Messages are put into a bounded lock-free queue. A thread from the pool passes them on
+ * to the target logger in batches.
+ *
+ * Messages with a format string wrapped in \ref FZ_FORMAT are not formatted by the logging
+ * thread, only their arguments get captured into a \ref deferred_log_message. Formatting
+ * then happens on the background thread, directly into UTF-8 if the target prefers it.
+ * Other messages get formatted on the logging thread as usual.
+ * Threads logging at high rates, e.g. event loops with debug logging enabled, thus never wait
+ * for the I/O done by the target.
+ *
+ * The log levels of the async_logger decide what gets logged, those of the target are ignored.
+ *
+ * Messages from a single thread reach the target in the order they have been logged.
+ */
+class FZ_PUBLIC_SYMBOL async_logger final : public logger_interface
+{
+public:
+	/// What to do if the queue is full
+	enum class overflow_policy
+	{
+		/// Wait until there is space in the queue
+		block,
+
+		/// Discard the message, only counted in \ref dropped
+		drop,
+
+		/// Discard the message, once there is space again a message with the number of discarded messages gets logged
+		count
+	};
+
+	/**
+	 * \brief Creates the logger and starts the background thread
+	 *
+	 * Both target and pool need to outlive the async_logger. The capacity is rounded up to a power of two.
+	 */
+	async_logger(logger_interface & target, thread_pool & pool, size_t capacity = 8192, overflow_policy policy = overflow_policy::count);
+
+	/// Passes all queued messages to the target before returning
+	virtual ~async_logger();
+
+	virtual void do_log(logmsg::type t, std::wstring && msg) override;
+	virtual void do_log_deferred(logmsg::type t, deferred_log_message && msg) override;
+
+	/// Waits until all messages logged before the call have been passed to the target, e.g. before shutting down.
+	void flush();
+
+	/// Total number of discarded messages
+	uint64_t dropped() const;
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
+
+}
+
+#endif
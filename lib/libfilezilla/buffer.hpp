@@ -12,6 +12,31 @@
 
 namespace fz {
 
+/**
+ * \brief Interface for supplying the memory backing a \ref fz::buffer
+ *
+ * Allows buffers belonging to a connection to come from a per-connection arena,
+ * or from a shared pool such as \ref fz::slab_buffer_allocator.
+ *
+ * Implementations need to be thread-safe if buffers using them are used from
+ * multiple threads. The allocator must outlive all buffers using it.
+ */
+class FZ_PUBLIC_SYMBOL buffer_allocator
+{
+public:
+	virtual ~buffer_allocator() = default;
+
+	/** \brief Allocates memory for at least capacity bytes.
+	 *
+	 * The allocator may increase capacity to the actually usable size of the returned memory.
+	 * Must not return nullptr, throw std::bad_alloc instead.
+	 */
+	virtual unsigned char* allocate(size_t & capacity) = 0;
+
+	/// Releases memory obtained from allocate, capacity being the adjusted value.
+	virtual void deallocate(unsigned char* p, size_t capacity) noexcept = 0;
+};
+
 /**
  * \brief The buffer class is a simple buffer where data can be appended at the end and consumed at the front.
  * Think of it as a deque with contiguous storage.
@@ -22,21 +47,44 @@ namespace fz {
  * In general, copying/moving data around is expensive and allocations are even more expensive. Using this
  * class helps to limit both to the bare minimum.
  *
+ * Small payloads of up to inline_capacity bytes, such as a single command or reply line, are stored
+ * inside the buffer object itself and do not cause any allocation. As a consequence, moving a buffer
+ * that uses its inline storage copies the data and invalidates pointers into it.
+ *
+ * Larger storage is obtained using new[], unless a \ref fz::buffer_allocator is passed. Moves
+ * carry over the allocator, copies use new[] like std::pmr containers do.
  */
 class FZ_PUBLIC_SYMBOL buffer final
 {
 public:
 	typedef unsigned char value_type;
 
+	/// Number of bytes that can be stored without allocating memory
+	static constexpr size_t inline_capacity = 88;
+
 	buffer() noexcept = default;
 
 	/// Initially reserves the passed capacity
 	explicit buffer(size_t capacity);
 
+	/// Obtains storage exceeding the inline capacity from the passed allocator
+	explicit buffer(buffer_allocator & allocator) noexcept
+		: allocator_(&allocator)
+	{}
+
+	buffer(size_t capacity, buffer_allocator & allocator);
+
+	/** \brief Adopts memory previously obtained from the allocator, without copying.
+	 *
+	 * The memory holds size bytes of data starting at the passed offset. Once no longer
+	 * needed, it is passed back to allocator.deallocate along with the capacity.
+	 */
+	buffer(unsigned char* data, size_t capacity, size_t offset, size_t size, buffer_allocator & allocator);
+
 	buffer(buffer const& buf);
 	buffer(buffer && buf) noexcept;
 
-	~buffer() { delete[] data_; }
+	~buffer() { release(); }
 
 	buffer& operator=(buffer const& buf);
 	buffer& operator=(buffer && buf) noexcept;
@@ -134,6 +182,17 @@ public:
 	size_t capacity() const { return capacity_; }
 	void reserve(size_t capacity);
 
+	/** \brief Releases memory not needed for the current contents.
+	 *
+	 * Contents fitting into the inline storage get moved there, freeing all allocated
+	 * memory. Memory obtained from an allocator goes back to it. Useful for buffers of
+	 * connections that are idle for a long time, they grow again on demand.
+	 */
+	void shrink_to_fit();
+
+	/// Number of bytes allocated outside the buffer object
+	size_t heap_size() const { return is_inline() ? 0 : capacity_; }
+
 	void resize(size_t size);
 
 	/// Gets element at offset i. Does not do bounds checking
@@ -147,17 +206,38 @@ public:
 	}
 
 	std::string_view to_view() const;
+
+	/// Returns the allocator, or nullptr if using new[]
+	buffer_allocator* get_allocator() const { return allocator_; }
+
 private:
+	bool is_inline() const { return data_ == inline_; }
+	void release() {
+		if (!is_inline()) {
+			deallocate(data_, capacity_);
+		}
+	}
+
+	unsigned char* allocate(size_t & cap);
+	void deallocate(unsigned char* p, size_t cap) noexcept;
+
+	// Replaces storage with an allocation of at least cap bytes, preserving contents
+	void reallocate(size_t cap);
+
+	// Takes over the contents of a buffer, leaving it empty using its inline storage
+	void steal(buffer & buf) noexcept;
 
 	// Invariants:
 	//   size_ <= capacity_
 	//   data_ <= pos_
 	//   pos_ <= data_ + capacity_
 	//   pos_ + size_ <= data_ + capacity_
-	unsigned char* data_{};
-	unsigned char* pos_{};
+	unsigned char* data_{inline_};
+	unsigned char* pos_{inline_};
 	size_t size_{};
-	size_t capacity_{};
+	size_t capacity_{inline_capacity};
+	buffer_allocator* allocator_{};
+	unsigned char inline_[inline_capacity];
 };
 
 }
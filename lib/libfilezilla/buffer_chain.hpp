@@ -0,0 +1,117 @@
+#ifndef LIBFILEZILLA_BUFFER_CHAIN_HEADER
+#define LIBFILEZILLA_BUFFER_CHAIN_HEADER
+
+#include "buffer.hpp"
+
+#include <deque>
+#include <memory>
+#include <string_view>
+
+/** \file
+* \brief Declares fz::buffer_chain
+*/
+
+namespace fz {
+
+class nonowning_buffer;
+class socket_interface;
+struct socket_const_iovec;
+
+/**
+ * \brief A sequence of reference-counted buffer segments
+ *
+ * Unlike with \ref buffer, appending never moves data already in the chain. Appended
+ * data gets copied into fixed-size segments, whereas whole buffers and chains are
+ * adopted without copying. Copies and slices of a chain share its segments.
+ *
+ * A segment is never modified once shared, new data only gets appended to a segment
+ * referenced by a single chain.
+ *
+ * Chains are consumed without flattening them first: \ref write_to passes the segments to
+ * \ref socket_interface::writev, which for \ref tls_layer gathers them into records, and
+ * \ref consume_into fills the leased buffers passed to aio writers.
+ */
+class FZ_PUBLIC_SYMBOL buffer_chain final
+{
+public:
+	/// The size of the segments allocated for copied data
+	static constexpr size_t segment_size = 16 * 1024;
+
+	buffer_chain() = default;
+
+	buffer_chain(buffer_chain const&) = default;
+	buffer_chain& operator=(buffer_chain const&) = default;
+
+	buffer_chain(buffer_chain && c) noexcept;
+	buffer_chain& operator=(buffer_chain && c) noexcept;
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	/// The number of segments the chain currently references
+	size_t segments() const { return views_.size(); }
+
+	void append(unsigned char const* data, size_t len);
+	void append(std::string_view const& str);
+
+	/// Adopts the buffer's data without copying, unless it is small.
+	void append(buffer && b);
+
+	/// Moves the segments of the passed chain to the end of this one, leaving it empty.
+	void append(buffer_chain && c);
+
+	/// Appends the segments of the passed chain, sharing them.
+	void append(buffer_chain const& c);
+
+	/// Returns a chain sharing the given range with this chain, clamped to its size.
+	buffer_chain slice(size_t offset, size_t len) const;
+
+	/// Removes up to n octets from the front, returning them as chain of their own.
+	buffer_chain split(size_t n);
+
+	/// Undefined if consumed > size()
+	void consume(size_t consumed);
+
+	void clear();
+
+	/**
+	 * \brief Describes the front of the chain
+	 *
+	 * Fills up to max iovecs with the chain's data in order and returns the number filled.
+	 */
+	size_t get_iovecs(socket_const_iovec * iovecs, size_t max) const;
+
+	/// Copies up to len octets, starting at the given offset, to out. Returns the amount copied.
+	size_t copy_to(unsigned char* out, size_t len, size_t offset = 0) const;
+
+	/**
+	 * \brief Writes the front of the chain to the socket, consuming what has been written.
+	 *
+	 * Uses a single call to \ref socket_interface::writev and has the same semantics.
+	 */
+	int write_to(socket_interface & s, int & error);
+
+	/// Moves as much as fits into the unused capacity of the passed buffer, returns the amount moved.
+	size_t consume_into(nonowning_buffer & b);
+
+	/// Returns a copy of the data in a single contiguous buffer
+	buffer flatten() const;
+
+private:
+	struct view
+	{
+		std::shared_ptr<buffer> segment_;
+		size_t offset_{};
+		size_t size_{};
+
+		// Set for segments allocated by the chain itself, only those get appended to.
+		bool owned_{};
+	};
+
+	std::deque<view> views_;
+	size_t size_{};
+};
+
+}
+
+#endif
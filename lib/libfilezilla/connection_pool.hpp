@@ -0,0 +1,196 @@
+#ifndef LIBFILEZILLA_CONNECTION_POOL_HEADER
+#define LIBFILEZILLA_CONNECTION_POOL_HEADER
+
+/** \file
+ * \brief Reuse of established outgoing connections
+ *
+ * Declares the \ref fz::connection_pool class.
+ */
+
+#include "event_handler.hpp"
+#include "mutex.hpp"
+#include "socket.hpp"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace fz {
+class logger_interface;
+class thread_pool;
+class tls_layer;
+class tls_system_trust_store;
+
+/// Identifies interchangeable connections in a \ref connection_pool
+struct FZ_PUBLIC_SYMBOL connection_pool_key final
+{
+	native_string host;
+	unsigned int port{};
+
+	/// If set, connections use TLS
+	bool tls{};
+
+	/**
+	 * \brief If not empty, the server certificate must match it, in DER or PEM.
+	 *
+	 * Otherwise the certificate gets verified using the system trust store passed to the pool.
+	 * \sa tls_layer::client_handshake
+	 */
+	std::vector<uint8_t> required_certificate;
+
+	/**
+	 * \brief Free-form description of any further setup of the connections
+	 *
+	 * Connections whose setup function configures them differently, e.g. with another
+	 * client certificate or ALPN, must use different profiles.
+	 */
+	std::string profile;
+
+	bool operator<(connection_pool_key const& op) const;
+	bool operator==(connection_pool_key const& op) const;
+};
+
+/**
+ * \brief An outgoing connection handed out by a \ref connection_pool
+ *
+ * Consists of the socket and, if the key asks for TLS, a \ref tls_layer on top of it.
+ */
+class FZ_PUBLIC_SYMBOL pooled_connection final
+{
+public:
+	~pooled_connection();
+
+	pooled_connection(pooled_connection const&) = delete;
+	pooled_connection& operator=(pooled_connection const&) = delete;
+
+	/// The topmost layer, to be used for reading and writing
+	socket_interface& top();
+
+	socket& get_socket() { return *socket_; }
+
+	/// Returns nullptr for connections without TLS
+	tls_layer* get_tls_layer() { return tls_.get(); }
+
+	connection_pool_key const& key() const { return key_; }
+
+	/**
+	 * \brief Whether the connection has been used before
+	 *
+	 * Reused connections are already established, their handler gets no connection event.
+	 */
+	bool reused() const { return reused_; }
+
+private:
+	friend class connection_pool;
+
+	explicit pooled_connection(connection_pool_key const& key);
+
+	connection_pool_key const key_;
+
+	std::unique_ptr<socket> socket_;
+	std::unique_ptr<tls_layer> tls_;
+
+	monotonic_clock idle_since_;
+	bool reused_{};
+};
+
+/**
+ * \brief Keeps established outgoing connections for reuse
+ *
+ * When talking to the same few servers over and over, each new connection pays for resolving
+ * the name, the TCP handshake and the TLS handshake. Instead of closing connections that are
+ * no longer needed, release them to the pool. Acquiring a connection with the same key then
+ * returns an idle connection right away.
+ *
+ * Only release connections in a state in which they can be used for another request of the
+ * protocol spoken, in particular with no unread data pending.
+ *
+ * While idle, connections are watched by the pool. Connections closed by the server or
+ * receiving unexpected data get discarded, as do connections idle for longer than the idle
+ * timeout. If a key has more idle connections than allowed, the least recently used one
+ * gets closed.
+ *
+ * New TLS connections resume the session of the most recently released connection with
+ * the same key.
+ *
+ * The pool itself is thread-safe. Like any layer, the \ref tls_layer of a connection is
+ * not, use it only from handlers running in the event loop passed to the pool.
+ */
+class FZ_PUBLIC_SYMBOL connection_pool final : protected event_handler
+{
+public:
+	/**
+	 * \brief Called for new connections prior to connecting
+	 *
+	 * Can be used to set socket flags or configure the TLS layer, which is nullptr if the key
+	 * does not use TLS. Has to configure connections the same way for equal keys.
+	 */
+	typedef std::function<void(socket & s, tls_layer * tls)> setup_function;
+
+	/**
+	 * \param loop Runs the TLS layers and watches idle connections.
+	 * \param pool Used by the sockets.
+	 * \param logger Used by the TLS layers.
+	 * \param trust_store Used to verify servers if the key has no required certificate. May be nullptr if unused.
+	 * \param max_idle Maximum number of idle connections per key
+	 * \param idle_timeout Idle connections get closed after this time
+	 */
+	connection_pool(event_loop & loop, thread_pool & pool, logger_interface & logger, tls_system_trust_store * trust_store = nullptr,
+		size_t max_idle = 8, duration const& idle_timeout = duration::from_minutes(1));
+	virtual ~connection_pool();
+
+	connection_pool(connection_pool const&) = delete;
+	connection_pool& operator=(connection_pool const&) = delete;
+
+	/**
+	 * \brief Returns a connection for the given key
+	 *
+	 * If there is an idle connection, it is returned with the passed handler as its new
+	 * event handler. Otherwise a new connection gets established, once done the handler
+	 * receives a connection event, or with TLS, after the handshake.
+	 *
+	 * Returns nullptr with error set if a new connection could not be started.
+	 */
+	std::unique_ptr<pooled_connection> acquire(connection_pool_key const& key, event_handler * handler, int & error, setup_function const& setup = setup_function());
+
+	/**
+	 * \brief Returns a connection to the pool
+	 *
+	 * Connections that are not established get closed right away.
+	 */
+	void release(std::unique_ptr<pooled_connection> && conn);
+
+	/// Number of idle connections over all keys
+	size_t idle_count() const;
+
+	/// Closes all idle connections
+	void clear();
+
+private:
+	virtual void operator()(event_base const& ev) override;
+	void on_socket_event(socket_event_source * source, socket_event_flag type, int error);
+	void on_timer(timer_id const&);
+
+	void remember_session(pooled_connection & conn);
+
+	thread_pool & pool_;
+	logger_interface & logger_;
+	tls_system_trust_store * const trust_store_;
+
+	size_t const max_idle_;
+	duration const idle_timeout_;
+
+	mutable mutex mtx_{false};
+
+	// Most recently released last
+	std::map<connection_pool_key, std::vector<std::unique_ptr<pooled_connection>>> idle_;
+
+	// Parameters of the most recent TLS session for each key
+	std::map<connection_pool_key, std::vector<uint8_t>> sessions_;
+
+	timer_id timer_{};
+};
+}
+
+#endif
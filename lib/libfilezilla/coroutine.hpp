@@ -0,0 +1,542 @@
+#ifndef LIBFILEZILLA_COROUTINE_HEADER
+#define LIBFILEZILLA_COROUTINE_HEADER
+
+/** \file
+ * \brief Coroutine support for event handlers, \ref fz::co_task and \ref fz::coroutine_handler
+ *
+ * Only available if the including code is compiled with C++20 coroutine support,
+ * the library itself does not need to be built as C++20. If available,
+ * FZ_HAVE_COROUTINES is defined.
+ */
+
+#include "libfilezilla.hpp"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && __has_include(<coroutine>)
+#define FZ_HAVE_COROUTINES 1
+
+#include "event_handler.hpp"
+#include "hostname_lookup.hpp"
+#include "socket.hpp"
+#include "aio/reader.hpp"
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+
+namespace fz {
+
+template<typename T = void>
+class co_task;
+
+namespace detail {
+/// \private
+class co_promise_base
+{
+public:
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct final_awaiter
+	{
+		bool await_ready() noexcept { return false; }
+
+		template<typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			// Symmetric transfer to whoever awaited the task
+			auto c = h.promise().continuation_;
+			return c ? c : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() noexcept {
+		exception_ = std::current_exception();
+	}
+
+	std::coroutine_handle<> continuation_;
+	std::exception_ptr exception_;
+};
+
+/// \private
+template<typename T>
+class co_promise final : public co_promise_base
+{
+public:
+	co_task<T> get_return_object() noexcept;
+
+	template<typename U>
+	void return_value(U && v) {
+		value_.emplace(std::forward<U>(v));
+	}
+
+	T result() {
+		if (exception_) {
+			std::rethrow_exception(exception_);
+		}
+		return std::move(*value_);
+	}
+
+	std::optional<T> value_;
+};
+
+/// \private
+template<>
+class co_promise<void> final : public co_promise_base
+{
+public:
+	co_task<void> get_return_object() noexcept;
+
+	void return_void() noexcept {}
+
+	void result() {
+		if (exception_) {
+			std::rethrow_exception(exception_);
+		}
+	}
+};
+}
+
+/**
+ * \brief A lazily started coroutine returning a T
+ *
+ * A co_task does nothing until it is either awaited by another coroutine, or
+ * passed to \ref coroutine_handler::spawn. Destroying a co_task destroys the
+ * coroutine, even if it has not yet completed.
+ *
+ * Exceptions escaping the coroutine are rethrown when it is awaited.
+ */
+template<typename T>
+class co_task final
+{
+public:
+	typedef detail::co_promise<T> promise_type;
+
+	co_task() noexcept = default;
+	explicit co_task(std::coroutine_handle<promise_type> h) noexcept
+		: h_(h)
+	{}
+
+	~co_task() {
+		if (h_) {
+			h_.destroy();
+		}
+	}
+
+	co_task(co_task const&) = delete;
+	co_task& operator=(co_task const&) = delete;
+
+	co_task(co_task && op) noexcept
+		: h_(std::exchange(op.h_, {}))
+	{}
+
+	co_task& operator=(co_task && op) noexcept {
+		if (this != &op) {
+			if (h_) {
+				h_.destroy();
+			}
+			h_ = std::exchange(op.h_, {});
+		}
+		return *this;
+	}
+
+	explicit operator bool() const { return static_cast<bool>(h_); }
+
+	bool done() const { return !h_ || h_.done(); }
+
+	/// \private
+	bool await_ready() const noexcept { return done(); }
+
+	/// \private
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+		h_.promise().continuation_ = c;
+		return h_;
+	}
+
+	/// \private
+	T await_resume() {
+		return h_.promise().result();
+	}
+
+private:
+	friend class coroutine_handler;
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+template<typename T>
+co_task<T> co_promise<T>::get_return_object() noexcept
+{
+	return co_task<T>(std::coroutine_handle<co_promise<T>>::from_promise(*this));
+}
+
+inline co_task<void> co_promise<void>::get_return_object() noexcept
+{
+	return co_task<void>(std::coroutine_handle<co_promise<void>>::from_promise(*this));
+}
+}
+
+/**
+ * \brief An event handler running coroutines in its event loop's thread
+ *
+ * Coroutines spawned on the handler are always resumed from within the handler's
+ * callback, so they are serialized like all other callbacks of an event handler.
+ * The awaitables returned by the member functions must only be awaited by
+ * coroutines running on this handler.
+ *
+ * Use it as event handler for sockets, lookups and buffer pools used by the coroutines:
+ * \code
+ *	fz::co_task<> echo(fz::coroutine_handler & h, fz::socket & s)
+ *	{
+ *		s.set_event_handler(&h);
+ *		while (true) {
+ *			auto [flag, error] = co_await h.wait_socket(&s, fz::socket_event_flag::read);
+ *			if (error) {
+ *				co_return;
+ *			}
+ *			...
+ *		}
+ *	}
+ *
+ *	fz::coroutine_handler h(loop);
+ *	h.spawn(echo(h, s));
+ * \endcode
+ *
+ * Socket events no coroutine is waiting for are kept until a coroutine waits for them.
+ * Other events nobody waits for are discarded.
+ */
+class coroutine_handler final : public event_handler
+{
+private:
+	/// \private
+	class waiter
+	{
+	public:
+		virtual ~waiter() = default;
+
+		// Returns true if the event is the one waited for
+		virtual bool consume(event_base const& ev) = 0;
+
+		std::coroutine_handle<> handle_;
+		bool registered_{};
+	};
+
+public:
+	explicit coroutine_handler(event_loop & loop)
+		: event_handler(loop)
+	{}
+
+	virtual ~coroutine_handler()
+	{
+		remove_handler();
+
+		// Destroying the coroutines also removes their waiters
+		tasks_.clear();
+	}
+
+	/// Starts the task in the loop's thread. Can be called from any thread.
+	void spawn(co_task<void> && t) {
+		if (t.h_) {
+			send_event(new start_event(std::exchange(t.h_, {})));
+		}
+	}
+
+	/// Number of spawned coroutines that have not yet completed. Only to be called in the loop's thread.
+	size_t active_tasks() const { return tasks_.size(); }
+
+	/// \private
+	class sleep_awaiter final : public waiter
+	{
+	public:
+		sleep_awaiter(coroutine_handler & h, duration const& d)
+			: h_(h)
+			, d_(d)
+		{}
+
+		~sleep_awaiter() {
+			if (registered_) {
+				h_.remove_waiter(*this);
+				h_.stop_timer(id_);
+			}
+		}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> c) {
+			id_ = h_.add_timer(d_, true);
+			handle_ = c;
+			h_.add_waiter(*this);
+		}
+		void await_resume() noexcept {}
+
+		virtual bool consume(event_base const& ev) override {
+			return same_type<timer_event>(ev) && std::get<0>(static_cast<timer_event const&>(ev).v_) == id_;
+		}
+
+	private:
+		coroutine_handler & h_;
+		duration const d_;
+		timer_id id_{};
+	};
+
+	/// Suspends the coroutine for the given duration
+	sleep_awaiter sleep(duration const& d) {
+		return sleep_awaiter(*this, d);
+	}
+
+	/// \private
+	class socket_awaiter final : public waiter
+	{
+	public:
+		socket_awaiter(coroutine_handler & h, socket_event_source * source, socket_event_flag flags)
+			: h_(h)
+			, source_(source)
+			, flags_(flags)
+		{}
+
+		~socket_awaiter() {
+			if (registered_) {
+				h_.remove_waiter(*this);
+			}
+		}
+
+		bool await_ready() {
+			for (auto it = h_.socket_events_.begin(); it != h_.socket_events_.end(); ++it) {
+				if (std::get<0>(*it) == source_ && (std::get<1>(*it) & flags_)) {
+					result_ = {std::get<1>(*it), std::get<2>(*it)};
+					h_.socket_events_.erase(it);
+					return true;
+				}
+			}
+			return false;
+		}
+		void await_suspend(std::coroutine_handle<> c) {
+			handle_ = c;
+			h_.add_waiter(*this);
+		}
+		std::pair<socket_event_flag, int> await_resume() noexcept { return result_; }
+
+		virtual bool consume(event_base const& ev) override {
+			if (!same_type<socket_event>(ev)) {
+				return false;
+			}
+			auto const& v = static_cast<socket_event const&>(ev).v_;
+			if (std::get<0>(v) != source_ || !(std::get<1>(v) & flags_)) {
+				return false;
+			}
+			result_ = {std::get<1>(v), std::get<2>(v)};
+			return true;
+		}
+
+	private:
+		coroutine_handler & h_;
+		socket_event_source * const source_;
+		socket_event_flag const flags_;
+		std::pair<socket_event_flag, int> result_{};
+	};
+
+	/**
+	 * \brief Waits for a socket event from the given source
+	 *
+	 * Returns the flag and error of the first socket event matching any of the given flags.
+	 * The usual socket semantics apply, e.g. after a read event, the next one only arrives
+	 * after read has failed with EAGAIN.
+	 */
+	socket_awaiter wait_socket(socket_event_source * source, socket_event_flag flags) {
+		return socket_awaiter(*this, source, flags);
+	}
+
+	/// \private
+	template<typename T, typename Pred>
+	class event_awaiter final : public waiter
+	{
+	public:
+		event_awaiter(coroutine_handler & h, Pred && pred)
+			: h_(h)
+			, pred_(std::move(pred))
+		{}
+
+		~event_awaiter() {
+			if (registered_) {
+				h_.remove_waiter(*this);
+			}
+		}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> c) {
+			handle_ = c;
+			h_.add_waiter(*this);
+		}
+		typename T::tuple_type await_resume() { return std::move(*v_); }
+
+		virtual bool consume(event_base const& ev) override {
+			if (!same_type<T>(ev)) {
+				return false;
+			}
+			auto const& v = static_cast<T const&>(ev).v_;
+			if (!std::apply(pred_, v)) {
+				return false;
+			}
+			v_.emplace(v);
+			return true;
+		}
+
+	private:
+		coroutine_handler & h_;
+		Pred pred_;
+		std::optional<typename T::tuple_type> v_;
+	};
+
+	/**
+	 * \brief Waits for an event of type T for which the predicate returns true
+	 *
+	 * The predicate is called with the values of the event, the awaitable returns a tuple of them.
+	 * T must be a \ref simple_event.
+	 */
+	template<typename T, typename Pred>
+	event_awaiter<T, std::decay_t<Pred>> wait_event(Pred && pred) {
+		return event_awaiter<T, std::decay_t<Pred>>(*this, std::decay_t<Pred>(std::forward<Pred>(pred)));
+	}
+
+	/**
+	 * \brief Looks up the host and waits for the result
+	 *
+	 * The lookup must have been created with this handler. Returns the error code
+	 * and the addresses, \sa hostname_lookup_event
+	 */
+	co_task<std::pair<int, std::vector<std::string>>> lookup(hostname_lookup & l, native_string const& host, address_type family = address_type::unknown) {
+		if (!l.lookup(host, family)) {
+			co_return std::pair<int, std::vector<std::string>>{host.empty() ? EINVAL : EBUSY, {}};
+		}
+		auto [source, error, addresses] = co_await wait_event<hostname_lookup_event>([&l](hostname_lookup* s, int, std::vector<std::string> const&) {
+			return s == &l;
+		});
+		co_return std::pair<int, std::vector<std::string>>{error, std::move(addresses)};
+	}
+
+	/// Waits until a buffer can be obtained from the pool
+	co_task<buffer_lease> get_buffer(aio_buffer_pool & pool) {
+		while (true) {
+			buffer_lease b = pool.get_buffer(*this);
+			if (b) {
+				co_return b;
+			}
+			co_await wait_event<aio_buffer_event>([&pool](aio_waitable const* w) {
+				return w == &pool;
+			});
+		}
+	}
+
+	/// Waits until the reader has a buffer or an error, never returns aio_result::wait
+	co_task<std::pair<aio_result, buffer_lease>> get_buffer(reader_base & reader) {
+		aio_waitable const* const waitable = &reader;
+		while (true) {
+			auto r = reader.get_buffer(*this);
+			if (r.first != aio_result::wait) {
+				co_return r;
+			}
+			co_await wait_event<aio_buffer_event>([waitable](aio_waitable const* w) {
+				return w == waitable;
+			});
+		}
+	}
+
+private:
+	/// \private
+	class start_event final : public event_base
+	{
+	public:
+		explicit start_event(std::coroutine_handle<detail::co_promise<void>> h)
+			: h_(h)
+		{}
+
+		virtual ~start_event() {
+			if (h_) {
+				h_.destroy();
+			}
+		}
+
+		static size_t type() {
+			static size_t const v = get_unique_type_id(typeid(start_event*));
+			return v;
+		}
+
+		virtual size_t derived_type() const override {
+			return type();
+		}
+
+		mutable std::coroutine_handle<detail::co_promise<void>> h_;
+	};
+
+	void add_waiter(waiter & w) {
+		w.registered_ = true;
+		waiters_.push_back(&w);
+	}
+
+	void remove_waiter(waiter & w) {
+		for (size_t i = 0; i < waiters_.size(); ++i) {
+			if (waiters_[i] == &w) {
+				waiters_.erase(waiters_.begin() + i);
+				break;
+			}
+		}
+		w.registered_ = false;
+	}
+
+	virtual void operator()(event_base const& ev) override {
+		if (ev.derived_type() == start_event::type()) {
+			auto const& e = static_cast<start_event const&>(ev);
+			tasks_.emplace_back(std::exchange(e.h_, {}));
+			tasks_.back().h_.resume();
+			reap();
+			return;
+		}
+
+		for (size_t i = 0; i < waiters_.size(); ++i) {
+			auto * w = waiters_[i];
+			if (w->consume(ev)) {
+				waiters_.erase(waiters_.begin() + i);
+				w->registered_ = false;
+				w->handle_.resume();
+				reap();
+				return;
+			}
+		}
+
+		if (same_type<socket_event>(ev)) {
+			socket_events_.emplace_back(static_cast<socket_event const&>(ev).v_);
+		}
+	}
+
+	// Destroys completed coroutines, rethrowing escaped exceptions in the loop's thread
+	void reap() {
+		for (size_t i = 0; i < tasks_.size(); ) {
+			if (tasks_[i].done()) {
+				std::exception_ptr e = tasks_[i].h_.promise().exception_;
+				tasks_.erase(tasks_.begin() + i);
+				if (e) {
+					std::rethrow_exception(e);
+				}
+			}
+			else {
+				++i;
+			}
+		}
+	}
+
+	std::vector<waiter*> waiters_;
+	std::deque<std::tuple<socket_event_source*, socket_event_flag, int>> socket_events_;
+	std::vector<co_task<void>> tasks_;
+};
+
+}
+
+#endif
+
+#endif
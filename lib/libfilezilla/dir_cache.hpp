@@ -0,0 +1,73 @@
+#ifndef LIBFILEZILLA_DIR_CACHE_HEADER
+#define LIBFILEZILLA_DIR_CACHE_HEADER
+
+#include "local_filesys.hpp"
+
+#include <memory>
+#include <vector>
+
+/** \file
+ * \brief Caching directory listings until the directories change
+ */
+
+namespace fz {
+
+class dir_cache_impl;
+class thread_pool;
+
+/**
+ * \brief Caches the listings of local directories.
+ *
+ * Listings are read using \ref local_filesys with all \ref dir_entry_fields, following
+ * symbolic links. Repeatedly listing the same directory then only needs a lookup.
+ *
+ * On Linux, cached directories are watched using inotify and their listings are dropped
+ * as soon as an entry in them gets created, removed, renamed, written to or has its
+ * attributes changed. As only the directories themselves are watched, the modification
+ * time of subdirectories can be outdated.
+ *
+ * On other platforms, listings are cached for at most \c max_age, by default they are
+ * not cached at all.
+ *
+ * Once the listings in the cache hold more than \c max_entries entries in total, the
+ * least recently used ones get evicted.
+ *
+ * All functions are thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL dir_cache final
+{
+public:
+	/// Shared by the cache and all callers that got it, never modified
+	typedef std::shared_ptr<std::vector<local_filesys::dir_entry> const> listing;
+
+	/// The thread pool provides the thread receiving the change notifications. It must outlive the cache.
+	explicit dir_cache(thread_pool & pool, size_t max_entries = 1024 * 1024, duration const& max_age = duration());
+	~dir_cache();
+
+	dir_cache(dir_cache const&) = delete;
+	dir_cache& operator=(dir_cache const&) = delete;
+
+	/**
+	 * \brief Gets the listing of the directory
+	 *
+	 * Either from the cache or, if not cached, by reading the directory.
+	 * Returns the result of \ref local_filesys::begin_find_files in the latter case.
+	 */
+	result get(native_string const& path, listing & out);
+
+	/// Drops the cached listing of the directory, if any
+	void invalidate(native_string const& path);
+
+	/// Drops all cached listings
+	void clear();
+
+	/// Whether change notifications are used to invalidate the cache
+	bool watching() const;
+
+private:
+	std::unique_ptr<dir_cache_impl> impl_;
+};
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include "libfilezilla.hpp"
 
 #include <string>
+#include <type_traits>
 #include <vector>
 
 /** \file
@@ -36,20 +37,49 @@ int hex_char_to_int(Char c)
 	return -1;
 }
 
+/**
+ * \brief Decodes len hex characters into out, which needs room for len / 2 bytes.
+ *
+ * Returns the end of the decoded data, or nullptr if len is odd or the input is not valid hex.
+ * On failure, the contents of out are unspecified.
+ */
+FZ_PUBLIC_SYMBOL unsigned char* hex_decode_to(unsigned char* out, char const* in, size_t len);
+
+/// \brief Decodes hex and appends the result to the buffer. On invalid input, returns false and leaves the buffer unchanged.
+bool FZ_PUBLIC_SYMBOL hex_decode_append(fz::buffer& result, std::string_view const& in);
+
+/// \private
+template<typename T, typename = void>
+struct is_contiguous_bytes : std::false_type {};
+
+/// \private
+template<typename T>
+struct is_contiguous_bytes<T, std::void_t<decltype(std::declval<T&>().data()), decltype(std::declval<T&>().resize(0))>>
+	: std::bool_constant<std::is_pointer_v<decltype(std::declval<T&>().data())> && sizeof(typename T::value_type) == 1>
+{};
+
 /// \private
 template<typename OutString, typename String>
 OutString hex_decode_impl(String const& in)
 {
 	OutString ret;
 	if (!(in.size() % 2)) {
-		ret.reserve(in.size() / 2);
-		for (size_t i = 0; i < in.size(); i += 2) {
-			int high = hex_char_to_int(in[i]);
-			int low = hex_char_to_int(in[i + 1]);
-			if (high == -1 || low == -1) {
+		if constexpr (sizeof(typename String::value_type) == 1 && is_contiguous_bytes<OutString>::value) {
+			ret.resize(in.size() / 2);
+			if (!hex_decode_to(reinterpret_cast<unsigned char*>(ret.data()), in.data(), in.size())) {
 				return OutString();
 			}
-			ret.push_back(static_cast<typename OutString::value_type>((high << 4) + low));
+		}
+		else {
+			ret.reserve(in.size() / 2);
+			for (size_t i = 0; i < in.size(); i += 2) {
+				int high = hex_char_to_int(in[i]);
+				int low = hex_char_to_int(in[i + 1]);
+				if (high == -1 || low == -1) {
+					return OutString();
+				}
+				ret.push_back(static_cast<typename OutString::value_type>((high << 4) + low));
+			}
 		}
 	}
 
@@ -85,15 +115,28 @@ Char int_to_hex_char(int d)
 	}
 }
 
+/// \brief Hex-encodes len bytes into out, which needs room for 2 * len characters. Returns the end of the output.
+FZ_PUBLIC_SYMBOL char* hex_encode_to(char* out, unsigned char const* in, size_t len, bool lowercase = true);
+
+/// \brief Hex-encodes input and appends it to result
+void FZ_PUBLIC_SYMBOL hex_encode_append(std::string& result, std::string_view const& in, bool lowercase = true);
+void FZ_PUBLIC_SYMBOL hex_encode_append(fz::buffer& result, std::string_view const& in, bool lowercase = true);
+
 template<typename String, typename InString, bool Lowercase = true>
 String hex_encode(InString const& data)
 {
 	static_assert(sizeof(typename InString::value_type) == 1, "Input must be a container of 8 bit values");
 	String ret;
-	ret.reserve(data.size() * 2);
-	for (auto const& c : data) {
-		ret.push_back(int_to_hex_char<typename String::value_type, Lowercase>(static_cast<unsigned char>(c) >> 4));
-		ret.push_back(int_to_hex_char<typename String::value_type, Lowercase>(static_cast<unsigned char>(c) & 0xf));
+	if constexpr (is_contiguous_bytes<String>::value && std::is_pointer_v<decltype(data.data())>) {
+		ret.resize(data.size() * 2);
+		hex_encode_to(reinterpret_cast<char*>(ret.data()), reinterpret_cast<unsigned char const*>(data.data()), data.size(), Lowercase);
+	}
+	else {
+		ret.reserve(data.size() * 2);
+		for (auto const& c : data) {
+			ret.push_back(int_to_hex_char<typename String::value_type, Lowercase>(static_cast<unsigned char>(c) >> 4));
+			ret.push_back(int_to_hex_char<typename String::value_type, Lowercase>(static_cast<unsigned char>(c) & 0xf));
+		}
 	}
 
 	return ret;
@@ -122,6 +165,16 @@ std::string FZ_PUBLIC_SYMBOL base64_encode(fz::buffer const& in, base64_type typ
  * individually decoded.
  */
 void FZ_PUBLIC_SYMBOL base64_encode_append(std::string& result, std::string_view const& in, base64_type type = base64_type::standard, bool pad = true);
+void FZ_PUBLIC_SYMBOL base64_encode_append(fz::buffer& result, std::string_view const& in, base64_type type = base64_type::standard, bool pad = true);
+
+/// \brief Size of len bytes encoded as base64
+constexpr size_t base64_encoded_size(size_t len, bool pad = true)
+{
+	return pad ? (len + 2) / 3 * 4 : (len * 4 + 2) / 3;
+}
+
+/// \brief Base64-encodes len bytes into out, which needs room for \ref base64_encoded_size characters. Returns the end of the output.
+FZ_PUBLIC_SYMBOL char* base64_encode_to(char* out, unsigned char const* in, size_t len, base64_type type = base64_type::standard, bool pad = true);
 
 /**
  * \brief Decodes base64, ignores whitespace. Returns empty string on invalid input.
@@ -135,6 +188,74 @@ std::string FZ_PUBLIC_SYMBOL base64_decode_s(std::string_view const& in);
 std::string FZ_PUBLIC_SYMBOL base64_decode_s(std::wstring_view const& in);
 std::string FZ_PUBLIC_SYMBOL base64_decode_s(fz::buffer const& in);
 
+/// \brief Decodes base64 like \ref base64_decode and appends the result to the buffer. On invalid input, returns false and leaves the buffer unchanged.
+bool FZ_PUBLIC_SYMBOL base64_decode_append(fz::buffer& result, std::string_view const& in);
+
+/**
+ * \brief Base64-encodes data that arrives in chunks.
+ *
+ * The output is the same as if all input had been passed to a single \ref base64_encode call.
+ */
+class FZ_PUBLIC_SYMBOL base64_encoder final
+{
+public:
+	explicit base64_encoder(base64_type type = base64_type::standard, bool pad = true);
+
+	/// Encodes the next chunk and appends it to out. Up to two bytes are held back until more input arrives.
+	void encode(std::string_view const& in, std::string& out);
+	void encode(std::string_view const& in, fz::buffer& out);
+
+	/// Encodes the bytes held back, if any. Afterwards the encoder can be used for new input.
+	void finalize(std::string& out);
+	void finalize(fz::buffer& out);
+
+private:
+	template<typename Out>
+	void do_encode(std::string_view const& in, Out& out);
+
+	template<typename Out>
+	void do_finalize(Out& out);
+
+	base64_type const type_;
+	bool const pad_;
+	unsigned char pending_[3]{};
+	size_t pending_size_{};
+};
+
+/**
+ * \brief Decodes base64 that arrives in chunks.
+ *
+ * Accepts the same input as \ref base64_decode, no matter how it is split into chunks.
+ */
+class FZ_PUBLIC_SYMBOL base64_decoder final
+{
+public:
+	/**
+	 * \brief Decodes the next chunk and appends the result to out.
+	 *
+	 * An incomplete group of characters at the end of the chunk is kept for the next call.
+	 * On invalid input, returns false without appending anything. All further calls fail until
+	 * the decoder is reset.
+	 */
+	bool decode(std::string_view const& in, fz::buffer& out);
+
+	/**
+	 * \brief Decodes the incomplete group kept from the last chunk, if any.
+	 *
+	 * Returns false if the input as a whole was invalid. Resets the decoder.
+	 */
+	bool finalize(fz::buffer& out);
+
+	/// Discards all state, the decoder can then be used for new input
+	void reset();
+
+private:
+	unsigned char group_[4]{};
+	size_t size_{};
+	bool padded_{};
+	bool failed_{};
+};
+
 
 /**
  * \brief Alphabet variations for base32
@@ -176,6 +297,9 @@ std::string FZ_PUBLIC_SYMBOL base32_decode_s(fz::buffer const& in, base32_type t
 std::string FZ_PUBLIC_SYMBOL percent_encode(std::string_view const& s, bool keep_slashes = false);
 std::string FZ_PUBLIC_SYMBOL percent_encode(std::wstring_view const& s, bool keep_slashes = false);
 
+/// \brief Percent-encodes string like \ref percent_encode and appends the result
+void FZ_PUBLIC_SYMBOL percent_encode_append(std::string& result, std::string_view const& s, bool keep_slashes = false);
+
 /**
  * \brief Percent-encodes wide-character. Non-ASCII characters are converted to UTF-8 before they are encoded.
  *
@@ -193,6 +317,13 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL percent_decode(std::wstring_view const& s,
 std::string FZ_PUBLIC_SYMBOL percent_decode_s(std::string_view const& s, bool allow_embedded_null = false);
 std::string FZ_PUBLIC_SYMBOL percent_decode_s(std::wstring_view const& s, bool allow_embedded_null = false);
 
+/**
+ * \brief Percent-decodes string in place.
+ *
+ * If the string cannot be decoded, it is cleared and false is returned.
+ */
+bool FZ_PUBLIC_SYMBOL percent_decode_inplace(std::string& s, bool allow_embedded_null = false);
+
 }
 
 #endif
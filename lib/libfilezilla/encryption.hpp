@@ -12,11 +12,15 @@
 
 #include "libfilezilla.hpp"
 
+#include <memory>
 #include <vector>
 #include <string>
 
 namespace fz {
 
+class buffer;
+class key_derivation_cache;
+
 /** \brief Represents a X25519 public key with associated salt
  *
  * \sa private_key
@@ -77,11 +81,12 @@ public:
 	/** \brief Derives a symmetric key using PBKDF2-SHA256 from the given password and salt.
 	 *
 	 * \param iterations cannot be smaller than min_iterations
+	 * \param cache If passed, a recent derivation with the same parameters is reused. \sa key_derivation for deriving asynchronously.
 	 */
-	static private_key from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations);
-	static private_key from_password(std::string_view const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations)
+	static private_key from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations, key_derivation_cache * cache = nullptr);
+	static private_key from_password(std::string_view const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations, key_derivation_cache * cache = nullptr)
 	{
-		return from_password(std::vector<uint8_t>(password.begin(), password.end()), salt, iterations);
+		return from_password(std::vector<uint8_t>(password.begin(), password.end()), salt, iterations, cache);
 	}
 
 	explicit operator bool() const {
@@ -188,11 +193,12 @@ public:
 	/** \brief Derives a symmetric key using PBKDF2-SHA256 from the given password and salt.
 	 *
 	 * \param iterations cannot be smaller than min_iterations
+	 * \param cache If passed, a recent derivation with the same parameters is reused. \sa key_derivation for deriving asynchronously.
 	 */
-	static symmetric_key from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations);
-	static symmetric_key from_password(std::string_view const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations)
+	static symmetric_key from_password(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations, key_derivation_cache * cache = nullptr);
+	static symmetric_key from_password(std::string_view const& password, std::vector<uint8_t> const& salt, unsigned int iterations = min_iterations, key_derivation_cache * cache = nullptr)
 	{
-		return from_password(std::vector<uint8_t>(password.begin(), password.end()), salt, iterations);
+		return from_password(std::vector<uint8_t>(password.begin(), password.end()), salt, iterations, cache);
 	}
 
 	explicit operator bool() const {
@@ -213,6 +219,9 @@ public:
 	std::vector<uint8_t> const& key() const;
 
 	static size_t encryption_overhead();
+
+	/// Number of octets of the encryption overhead that precede the encrypted data
+	static size_t encryption_prefix_size();
 private:
 	std::vector<uint8_t> key_;
 	std::vector<uint8_t> salt_;
@@ -271,5 +280,157 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL decrypt(std::vector<uint8_t> const& cipher
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL decrypt(std::string_view const& cipher, symmetric_key const& key, std::string_view const& authenticated_data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL decrypt(uint8_t const* cipher, size_t size, symmetric_key const& key, uint8_t const* authenticated_data, size_t authenticated_data_size);
 
+/** \brief Encrypts the plaintext using the given symmetric key into caller-supplied memory.
+ *
+ * Same as \ref encrypt(uint8_t const*, size_t, symmetric_key const&, uint8_t const*, size_t), but
+ * writes the ciphertext of size + symmetric_key::encryption_overhead() octets to out
+ * instead of allocating it. Plain and out must not overlap.
+ *
+ * Returns false if the key is invalid.
+ */
+bool FZ_PUBLIC_SYMBOL encrypt_into(uint8_t const* plain, size_t size, symmetric_key const& key, uint8_t* out, uint8_t const* authenticated_data = nullptr, size_t authenticated_data_size = 0);
+
+/// Appends the ciphertext to the buffer
+bool FZ_PUBLIC_SYMBOL encrypt(uint8_t const* plain, size_t size, symmetric_key const& key, buffer & out, uint8_t const* authenticated_data = nullptr, size_t authenticated_data_size = 0);
+
+/** \brief Encrypts in place, without copying the plaintext
+ *
+ * The memory pointed to by data needs to start with symmetric_key::encryption_prefix_size() octets reserved
+ * for the nonce, followed by the plaintext of the given size, followed by room for the remaining
+ * encryption overhead. Afterwards it holds the complete ciphertext of size + symmetric_key::encryption_overhead()
+ * octets as returned by \ref encrypt.
+ */
+bool FZ_PUBLIC_SYMBOL encrypt_in_place(uint8_t* data, size_t size, symmetric_key const& key, uint8_t const* authenticated_data = nullptr, size_t authenticated_data_size = 0);
+
+/** \brief Decrypts the ciphertext using the given symmetric key into caller-supplied memory.
+ *
+ * Writes the plaintext of size - symmetric_key::encryption_overhead() octets to out. Cipher and out
+ * must not overlap. On failure, returns false and the contents of out are unspecified.
+ */
+bool FZ_PUBLIC_SYMBOL decrypt_into(uint8_t const* cipher, size_t size, symmetric_key const& key, uint8_t* out, uint8_t const* authenticated_data = nullptr, size_t authenticated_data_size = 0);
+
+/// Appends the plaintext to the buffer, leaves the buffer unchanged on failure
+bool FZ_PUBLIC_SYMBOL decrypt(uint8_t const* cipher, size_t size, symmetric_key const& key, buffer & out, uint8_t const* authenticated_data = nullptr, size_t authenticated_data_size = 0);
+
+/** \brief Decrypts in place, without copying the ciphertext
+ *
+ * On success, the plaintext of size - symmetric_key::encryption_overhead() octets starts at
+ * data + symmetric_key::encryption_prefix_size().
+ */
+bool FZ_PUBLIC_SYMBOL decrypt_in_place(uint8_t* data, size_t size, symmetric_key const& key, uint8_t const* authenticated_data = nullptr, size_t authenticated_data_size = 0);
+
+/** \brief Encrypts a stream of data of arbitrary size using the given symmetric key.
+ *
+ * Unlike \ref encrypt, the data does not need to be held in memory as a whole. The plaintext
+ * is split into chunks, each chunk is encrypted and authenticated on its own. This allows
+ * \ref stream_decryptor to hand out the plaintext of a chunk as soon as it is complete.
+ *
+ * \par Format:
+ *
+ * Let \e M be the key portion and S be the salt portion of the key parameter.
+ *
+ * - First a random nonce \e N is created from which an AES key \e K is derived:\n
+ *   <tt>K := SHA256(S || 5 || M || N)</tt>
+ * - The plaintext is split into chunks \e P_0 to \e P_n. All but the last chunk contain exactly
+ *   chunk_size octets, the last chunk contains less than chunk_size octets. It is empty
+ *   if the size of the plaintext is a multiple of chunk_size.
+ * - Each chunk is encrypted into \e C_i and authentication tag \e T_i using\n
+ *   <tt>C_i, T_i := AES256-GCM(K, IV_i, P_i)</tt>\n
+ *   with <tt>IV_i := BE64(i) || BE32(F)</tt>, where \e F is 1 for the last chunk and 0 otherwise.
+ * - The ciphertext is\n
+ *   <tt>N || C_0 || T_0 || ... || C_n || T_n</tt>
+ *
+ * As the last chunk is marked as such, removing chunks from the end is detected, as is
+ * reordering, removing or duplicating chunks.
+ */
+class FZ_PUBLIC_SYMBOL stream_encryptor final
+{
+public:
+	/// Sizes in octets
+	enum : size_t {
+		chunk_size = 65536,
+		header_size = symmetric_key::salt_size,
+		tag_size = 16,
+		encrypted_chunk_size = chunk_size + tag_size
+	};
+
+	explicit stream_encryptor(symmetric_key const& key);
+	~stream_encryptor();
+
+	stream_encryptor(stream_encryptor const&) = delete;
+	stream_encryptor& operator=(stream_encryptor const&) = delete;
+
+	/// False if the key is invalid or if the stream has already been finalized
+	explicit operator bool() const;
+
+	/// Returns the size of the ciphertext for a plaintext of the given size
+	static uint64_t encrypted_size(uint64_t plain_size);
+
+	/** \brief Encrypts the passed data, appending the ciphertext to out
+	 *
+	 * Data not filling a complete chunk is kept until more data is passed or until the
+	 * stream is finalized.
+	 */
+	bool encrypt(uint8_t const* data, size_t size, buffer & out);
+
+	/// Encrypts the kept data as the last chunk. Afterwards, no further data can be encrypted.
+	bool finalize(buffer & out);
+
+	/** \brief Replaces the plaintext in the buffer by the ciphertext, finalizing the stream if final is set
+	 *
+	 * Works in place unless a partial chunk is kept from a previous call, that is, as long
+	 * as all previous calls passed a multiple of chunk_size octets. As the ciphertext is
+	 * larger, reserve enough capacity in the buffer to avoid a reallocation.
+	 */
+	bool encrypt(buffer & data, bool final = false);
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
+
+/** \brief Decrypts a stream encrypted by \ref stream_encryptor using the given symmetric key.
+ *
+ * The plaintext of each chunk is handed out once the chunk has been authenticated. Only
+ * \ref finalize confirms though that the stream is complete. Until finalize has succeeded,
+ * the data may have been truncated.
+ *
+ * Once an operation has failed, all further operations fail.
+ */
+class FZ_PUBLIC_SYMBOL stream_decryptor final
+{
+public:
+	explicit stream_decryptor(symmetric_key const& key);
+	~stream_decryptor();
+
+	stream_decryptor(stream_decryptor const&) = delete;
+	stream_decryptor& operator=(stream_decryptor const&) = delete;
+
+	/// False if the key is invalid, decryption has failed or the stream has already been finalized
+	explicit operator bool() const;
+
+	/** \brief Decrypts the passed data, appending the plaintext to out
+	 *
+	 * Returns false if a chunk cannot be authenticated. Data not filling a complete chunk
+	 * is kept until more data is passed or until the stream is finalized.
+	 */
+	bool decrypt(uint8_t const* data, size_t size, buffer & out);
+
+	/// Decrypts the last chunk. Returns false if it is missing or cannot be authenticated.
+	bool finalize(buffer & out);
+
+	/** \brief Replaces the ciphertext in the buffer by the plaintext, finalizing the stream if final is set
+	 *
+	 * Works in place unless a partial chunk is kept from a previous call, that is, as long as
+	 * all previous calls passed the header followed by a multiple of encrypted_chunk_size octets.
+	 * The buffer is cleared on failure.
+	 */
+	bool decrypt(buffer & data, bool final = false);
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
+
 }
 #endif
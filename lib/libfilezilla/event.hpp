@@ -3,8 +3,11 @@
 
 #include "libfilezilla.hpp"
 
+#include <atomic>
+#include <new>
 #include <tuple>
 #include <typeinfo>
+#include <utility>
 
 /** \file
  * \brief Declares event_base and simple_event<>
@@ -12,6 +15,35 @@
 
 namespace fz {
 
+class event_base;
+class event_handler;
+
+/// \private
+class event_queue_link final
+{
+public:
+	event_queue_link() = default;
+
+	// Copying an event never copies its queue membership
+	event_queue_link(event_queue_link const&) noexcept {}
+	event_queue_link& operator=(event_queue_link const&) noexcept { return *this; }
+
+private:
+	friend class event_loop;
+
+	std::atomic<event_base*> next_{};
+	event_handler* handler_{};
+
+	// Once in a lane, the entry referring to the event and the neighbours in
+	// the list of the handler's pending events. Guarded by the loop's mutex.
+	std::pair<event_handler*, event_base*>* entry_{};
+	event_base* handler_prev_{};
+	event_base* handler_next_{};
+
+	// Steady clock nanoseconds, only set if the loop is instrumented
+	int64_t sent_{};
+};
+
 /**
 \brief Common base class for all events.
 
@@ -46,6 +78,44 @@ public:
 	done in \ref fz::simple_event "simple_event".
 	*/
 	virtual size_t derived_type() const = 0;
+
+	/**
+	 * \brief Allows coalescing of queued events.
+	 *
+	 * If an event returns a non-null key, and an event of the same type with the
+	 * same key is still queued for the same handler, the new event is not queued.
+	 * Instead, \ref merge is called on the queued event and the new event is deleted.
+	 *
+	 * \sa coalescing_event
+	 */
+	virtual void const* coalesce_key() const { return nullptr; }
+
+	/// Merges a newer event of the same type and key into this still queued event.
+	virtual void merge(event_base const&) {}
+
+	/**
+	 * \brief Events are allocated from thread-caching free lists.
+	 *
+	 * Each thread keeps freed events in free lists, one per size class, so that
+	 * frequently sent event types get recycled without involving the global
+	 * allocator. As events are usually created in one thread and freed in the
+	 * event loop's thread, surplus blocks are handed between threads in batches.
+	 *
+	 * Large events directly use the global allocator.
+	 *
+	 * \sa get_event_allocation_stats
+	 */
+	static void* operator new(size_t size);
+	static void operator delete(void* p, size_t size) noexcept;
+
+	static void* operator new(size_t size, std::align_val_t align);
+	static void operator delete(void* p, size_t size, std::align_val_t align) noexcept;
+
+private:
+	friend class event_loop;
+
+	// Intrusive link for the event loop's lock-free queue
+	event_queue_link link_;
 };
 
 /**
@@ -53,6 +123,24 @@ public:
  */
 size_t FZ_PUBLIC_SYMBOL get_unique_type_id(std::type_info const& id);
 
+/// \brief Counters of the event allocator, summed over all threads.
+struct event_allocation_stats final
+{
+	/// Number of events allocated through \ref event_base::operator new
+	uint64_t allocations{};
+
+	/// Number of allocations served from a free list without calling the global allocator
+	uint64_t cache_hits{};
+};
+
+/**
+ * \brief Returns the counters of the event allocator.
+ *
+ * The hit rate is cache_hits / allocations. The counters are updated without
+ * synchronization, the returned values may lag slightly behind concurrent allocations.
+ */
+event_allocation_stats FZ_PUBLIC_SYMBOL get_event_allocation_stats();
+
 /**
 \brief This is the recommended event class.
 
@@ -98,6 +186,50 @@ public:
 	mutable tuple_type v_;
 };
 
+/**
+\brief An event carrying a source and flags that coalesces while queued.
+
+If an event with the same source is still queued for the same handler, the flags
+of the new event get merged into the queued event using operator| instead of
+queuing another event. This keeps queues short for chatty sources that only
+need to notify about state changes.
+
+Can be used with \ref dispatch like \ref fz::simple_event "simple_event".
+*/
+template<typename UniqueType, typename Source, typename Flags>
+class coalescing_event final : public event_base
+{
+public:
+	typedef UniqueType unique_type;
+	typedef std::tuple<Source*, Flags> tuple_type;
+
+	coalescing_event(Source* source, Flags flags)
+		: v_(source, flags)
+	{
+	}
+
+	/// \brief Returns a unique id for the type such that can be used directly in derived_type.
+	inline static size_t type() {
+		static size_t const v = get_unique_type_id(typeid(UniqueType*));
+		return v;
+	}
+
+	/// \brief Simply returns \ref type()
+	virtual size_t derived_type() const override {
+		return type();
+	}
+
+	virtual void const* coalesce_key() const override {
+		return std::get<0>(v_);
+	}
+
+	virtual void merge(event_base const& ev) override {
+		std::get<1>(v_) = std::get<1>(v_) | std::get<1>(static_cast<coalescing_event const&>(ev).v_);
+	}
+
+	mutable tuple_type v_;
+};
+
 /// Used as lightweight RTTI alternative during \ref dispatch
 /// \return true iff T& t = ...; t.derived_type() == ev.derived_type()
 template<typename T>
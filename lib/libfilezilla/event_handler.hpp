@@ -3,6 +3,10 @@
 
 #include "event_loop.hpp"
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 /** \file
  * \brief Declares the \ref fz::event_handler "event_handler" class.
  */
@@ -86,12 +90,12 @@ public:
 	 */
 	template<typename T, typename... Args>
 	void send_event(Args&&... args) {
-		event_loop_.send_event(this, new T(std::forward<Args>(args)...));
+		loop_.load()->send_event(this, new T(std::forward<Args>(args)...));
 	}
 
 	template<typename T>
 	void send_event(T* evt) {
-		event_loop_.send_event(this, evt);
+		loop_.load()->send_event(this, evt);
 	}
 
 	/** \brief Adds a timer, returns the timer id.
@@ -109,9 +113,14 @@ public:
 	 *
 	 * Timers take precedence over other queued events.
 	 *
+	 * If slack is given, the timer may fire up to that much later than requested. The loop then rounds
+	 * the deadline up to a coarse granularity that is shared with other timers, so that timers with
+	 * nearby deadlines fire together in one wakeup. Use it for timeouts that need not be precise,
+	 * such as idle or keepalive timers. Slack is applied to each period of periodic timers.
+	 *
 	 * \note High-frequency timers doing heavy processing can starve other timers and queued events.
 	 */
-	timer_id add_timer(monotonic_clock const &deadline, duration const& interval = {});
+	timer_id add_timer(monotonic_clock const &deadline, duration const& interval = {}, duration const& slack = {});
 
 	/** \brief Adds a timer, returns the timer id.
 	 *
@@ -127,9 +136,11 @@ public:
 	 *
 	 * Timers take precedence over other queued events.
 	 *
+	 * See \ref add_timer(monotonic_clock const&, duration const&, duration const&) for the meaning of slack.
+	 *
 	 * \note High-frequency timers doing heavy processing can starve other timers and queued events.
 	 */
-	timer_id add_timer(duration const& interval, bool one_shot);
+	timer_id add_timer(duration const& interval, bool one_shot, duration const& slack = {});
 
 	/** Stops the given timer.
 	 *
@@ -142,23 +153,52 @@ public:
 	 * It behaves as-if the two following calls were made in sequence:
 	 *
 	 *     stop_timer(id);
-	 *     return add_timer(deadline, interval);
+	 *     return add_timer(deadline, interval, slack);
 	 */
-	timer_id stop_add_timer(timer_id id, monotonic_clock const& deadline, duration const& interval = {});
+	timer_id stop_add_timer(timer_id id, monotonic_clock const& deadline, duration const& interval = {}, duration const& slack = {});
 
 	/** Stops the given timer, then adds a new one. Returns the timer id of the newly added timer.
 	 *
 	 * It behaves as-if the two following calls were made in sequence:
 	 *
 	 *     stop_timer(id);
-	 *     return add_timer(interval, one_shot);
+	 *     return add_timer(interval, one_shot, slack);
+	 */
+	timer_id stop_add_timer(timer_id id, duration const& interval, bool one_shot, duration const& slack = {});
+
+	/** \brief Sets the priority with which the handler's events get dispatched.
+	 *
+	 * Applies to events queued after the call, \sa event_priority. Can be called from any thread.
 	 */
-	timer_id stop_add_timer(timer_id id, duration const& interval, bool one_shot);
+	void set_priority(event_priority priority) { priority_ = priority; }
 
+	event_priority get_priority() const { return priority_; }
+
+	/** \brief Returns the loop the handler currently runs on.
+	 *
+	 * Differs from \ref event_loop_ once the handler has been migrated using
+	 * \ref event_loop_group::migrate
+	 */
+	event_loop & get_event_loop() const { return *loop_; }
+
+	/// The loop the handler has been created with, \sa get_event_loop
 	event_loop & event_loop_;
 private:
 	friend class event_loop;
-	bool removing_{};
+
+	std::atomic<event_loop*> loop_;
+
+	std::atomic<bool> removing_{};
+
+	// Number of threads currently inside event_loop::send_event for this handler
+	std::atomic<int> sending_{};
+
+	std::atomic<event_priority> priority_{event_priority::normal};
+
+	// The handler's events in the lanes of its loop and the ids of its timers,
+	// so that removing the handler need not look at anything else. Guarded by the loop's mutex.
+	event_base* pending_head_{};
+	std::vector<timer_id> timers_;
 };
 
 /** \brief Dispatch for simple_event<> based events to simple functors
@@ -212,12 +252,77 @@ bool dispatch(event_base const& ev, H* h, F&& f)
 	return same;
 }
 
+/** \private
+ * Maps the dense ids returned by get_unique_type_id to the position of the type in the list.
+ * Built once per list of types on first use. Types registered later get larger ids, they
+ * cannot be in the list.
+ */
+template<typename... Ts>
+class dispatch_table final
+{
+public:
+	static constexpr uint8_t none = 0xff;
+	static_assert(sizeof...(Ts) < none, "Too many event types");
+
+	static dispatch_table const& get()
+	{
+		static dispatch_table const table;
+		return table;
+	}
+
+	size_t find(size_t id) const
+	{
+		return id < size_ ? indices_[id] : none;
+	}
+
+private:
+	dispatch_table()
+	{
+		size_t const ids[]{Ts::type()...};
+		for (auto id : ids) {
+			if (id >= size_) {
+				size_ = id + 1;
+			}
+		}
+		indices_ = std::make_unique<uint8_t[]>(size_);
+		std::fill(indices_.get(), indices_.get() + size_, none);
+
+		// Backwards, so that the first of duplicate types wins like in the linear dispatch
+		for (size_t i = sizeof...(Ts); i-- > 0;) {
+			indices_[ids[i]] = static_cast<uint8_t>(i);
+		}
+	}
+
+	std::unique_ptr<uint8_t[]> indices_;
+	size_t size_{};
+};
+
+/// \private
+template<typename... Ts, typename H, typename... Fs, size_t... I>
+void dispatch_indexed(size_t index, event_base const& ev, H* h, std::index_sequence<I...> const&, Fs const&... fs)
+{
+	typedef std::tuple<Fs const&...> functions;
+	typedef void (*thunk)(event_base const&, H*, functions const&);
+	static constexpr thunk thunks[]{
+		[](event_base const& ev, H* h, functions const& fs) {
+			typedef std::tuple_element_t<I, std::tuple<Ts...>> T;
+			apply(h, std::get<I>(fs), static_cast<T const&>(ev).v_);
+		}...
+	};
+	thunks[index](ev, h, functions(fs...));
+}
+
+/// \private
+constexpr size_t dispatch_table_threshold = 4;
+
 /** \brief Compound dispatch for simple_event<> based events
  *
- * Calls the simple dispatch for each passed type and tries the next one if it didn't match.
- *
+ * With few types, calls the simple dispatch for each passed type and tries the next one if it didn't match.
  * Order the passed types in decreasing usage frequency for maximum performance.
  *
+ * With \ref dispatch_table_threshold or more types, the event's type is looked up in a table
+ * instead, so that the cost does not depend on the number of types.
+ *
  * \tparam T the event type, a simple_event<> instantiation
  * \tparam Ts additional event types
  *
@@ -233,11 +338,21 @@ bool dispatch(event_base const& ev, H* h, F&& f)
 template<typename T, typename ... Ts, typename H, typename F, typename ... Fs>
 bool dispatch(event_base const& ev, H* h, F&& f, Fs&& ... fs)
 {
-	if (dispatch<T>(ev, h, std::forward<F>(f))) {
+	if constexpr (sizeof...(Ts) + 1 >= dispatch_table_threshold) {
+		size_t const index = dispatch_table<T, Ts...>::get().find(ev.derived_type());
+		if (index == dispatch_table<T, Ts...>::none) {
+			return false;
+		}
+		dispatch_indexed<T, Ts...>(index, ev, h, std::index_sequence_for<T, Ts...>(), f, fs...);
 		return true;
 	}
+	else {
+		if (dispatch<T>(ev, h, std::forward<F>(f))) {
+			return true;
+		}
 
-	return dispatch<Ts...>(ev, h, std::forward<Fs>(fs)...);
+		return dispatch<Ts...>(ev, h, std::forward<Fs>(fs)...);
+	}
 }
 
 }
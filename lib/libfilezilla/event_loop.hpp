@@ -7,9 +7,12 @@
 #include "time.hpp"
 #include "thread.hpp"
 
+#include <atomic>
 #include <deque>
 #include <functional>
+#include <map>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 /** \file
@@ -20,12 +23,76 @@ namespace fz {
 
 class async_task;
 class event_handler;
+class logger_interface;
 class thread_pool;
 
+/// \brief A histogram of durations with power-of-two microsecond buckets, \sa event_loop_stats
+struct FZ_PUBLIC_SYMBOL latency_histogram final
+{
+	static constexpr size_t bucket_count = 32;
+
+	/// Bucket 0 counts values below 1us, bucket i values in [2^(i-1), 2^i) us. The last bucket also counts all larger values.
+	uint64_t buckets[bucket_count]{};
+
+	uint64_t count{};
+	uint64_t total_us{};
+	uint64_t max_us{};
+
+	void add(uint64_t us);
+
+	/// Returns the upper bound in microseconds of the bucket containing the given percentile, p is in [0, 1].
+	uint64_t percentile(double p) const;
+};
+
+/// \brief Instrumentation data for one event type, \sa event_loop_stats
+struct event_type_stats final
+{
+	/// Time between sending the event and its dispatch. For timers, the time since the deadline.
+	latency_histogram queue_delay;
+
+	/// Time spent in the event handler
+	latency_histogram run_time;
+};
+
+/// \brief Snapshot of the instrumentation data of an \ref event_loop, \sa event_loop::enable_instrumentation
+struct event_loop_stats final
+{
+	/// Number of events waiting to be dispatched.
+	size_t pending{};
+
+	/// Largest number of events waiting to be dispatched at once.
+	size_t peak_pending{};
+
+	/// Number of dispatches that took longer than the slow handler threshold.
+	uint64_t slow{};
+
+	/// Keyed by event type as returned by event_base::derived_type.
+	std::map<size_t, event_type_stats> types;
+};
+
+/** \brief Dispatch priority of the events of an \ref event_handler, \sa event_handler::set_priority
+ *
+ * Events of higher priority get dispatched first. Within a priority, events are dispatched in the
+ * order they have been sent. To prevent starvation, events of lower priorities still get dispatched
+ * every now and then while events of higher priorities are waiting.
+ */
+enum class event_priority : uint8_t
+{
+	/// E.g. control connections and replies that need to go out quickly
+	high,
+
+	normal,
+
+	/// E.g. bulk data transfers, see also \ref event_loop::set_bulk_budget
+	bulk
+};
+
 /** \brief A threaded event loop that supports sending events and timers
  *
  * Timers have precedence over queued events. Too many or too frequent timers can starve processing queued events.
  *
+ * Queued events are dispatched according to the \ref event_priority of their handlers.
+ *
  * If the deadlines of multiple timers have expired, they get processed in an unspecified order.
  *
  * \sa event_handler for a complete usage example.
@@ -38,12 +105,23 @@ public:
 	/// Spawns a thread and starts the loop
 	event_loop();
 
+	/** \brief Spawns a thread with the given placement and starts the loop
+	 *
+	 * Pinning a busy loop to a CPU, or to the CPUs of one NUMA node, keeps its data in the
+	 * caches close to it. Loops taking their thread from a pool use the placement of the pool.
+	 */
+	explicit event_loop(thread_placement const& placement);
+
 	/// Takes a thread from the pool and starts the loop
 	explicit event_loop(thread_pool & pool);
 
 	enum loop_option
 	{
-		threadless
+		/// The loop does not run until \ref run is called
+		threadless,
+
+		/// The loop is driven by the caller's own poll loop, \sa process
+		embedded
 	};
 	explicit event_loop(loop_option);
 
@@ -78,45 +156,233 @@ public:
 	void run();
 
 	bool running() const;
+
+#ifdef FZ_WINDOWS
+	/** \brief The wakeup handle of an embedded loop
+	 *
+	 * A manual-reset event object that gets signalled whenever \ref process needs to be called.
+	 * Returns nullptr if the loop is not embedded.
+	 */
+	void* wakeup_handle() const;
+#else
+	/** \brief The wakeup descriptor of an embedded loop
+	 *
+	 * Becomes readable whenever \ref process needs to be called: if events have been sent, a timer
+	 * with an earlier deadline has been added or the loop has been stopped. Only poll it, do not
+	 * read from it. Returns -1 if the loop is not embedded or the descriptor could not be created.
+	 */
+	int wakeup_fd() const;
+#endif
+
+	/** \brief Processes the ready events and expired timers of an embedded loop
+	 *
+	 * Lets a loop created with the \ref embedded option run inside the caller's own poll loop
+	 * instead of in a thread of its own. Never blocks, handlers are invoked from the calling thread.
+	 * Sending events from other threads is still allowed.
+	 *
+	 * A typical host loop polls the \ref wakeup_fd along with its own descriptors, with the
+	 * timeout set to the time until \ref next_deadline, and calls this function after each poll.
+	 *
+	 * If max_dispatches is non-zero, at most that many events and timers are dispatched. If there
+	 * is more to do, the wakeup descriptor stays readable. Otherwise all events sent prior to and
+	 * during the call get dispatched.
+	 *
+	 * Does nothing if the loop is not embedded, if it has been stopped or if called from within
+	 * a handler of the loop.
+	 *
+	 * Returns the number of dispatched events and timers.
+	 */
+	size_t process(size_t max_dispatches = 0);
+
+	/** \brief The deadline of the earliest timer of an embedded loop
+	 *
+	 * Empty if there are no timers. Query it after \ref process returns, it may have changed while
+	 * processing without waking up the loop.
+	 */
+	monotonic_clock next_deadline() const;
+
+	/** \brief Whether the calling thread is the loop's thread, currently dispatching an event or timer to the handler.
+	 *
+	 * If so, other handlers of the loop can safely be invoked directly.
+	 */
+	bool dispatching(event_handler const& handler) const;
+
+	/// Number of handlers currently using this loop
+	size_t handler_count() const { return handlers_; }
+
+	/** \brief Enables or disables collecting instrumentation data.
+	 *
+	 * When enabled, the loop records queue depth as well as queueing delay and
+	 * handler run time histograms for each event type.
+	 *
+	 * If slow_threshold is positive and a logger is passed, dispatches taking longer
+	 * than the threshold are logged as \ref logmsg::debug_warning from the loop's thread.
+	 * The logger must outlive the loop or instrumentation being disabled.
+	 *
+	 * When disabled, the only overhead is an atomic load per sent event.
+	 * Collected data is kept when disabling, \sa reset_stats
+	 */
+	void enable_instrumentation(bool enable, duration const& slow_threshold = {}, logger_interface * logger = nullptr);
+
+	/** \brief Bounds how long bulk events can hold the loop
+	 *
+	 * While busy dispatching events, expired timers are only noticed with the resolution of the
+	 * coarse clock. Once bulk events have been dispatched for longer than the budget in total,
+	 * the loop checks the timers against the precise clock. Defaults to 5 milliseconds.
+	 */
+	void set_bulk_budget(duration const& budget);
+
+	/// Returns a snapshot of the collected instrumentation data
+	event_loop_stats get_stats() const;
+
+	/// Clears the collected instrumentation data
+	void reset_stats();
+
 private:
 	friend class event_handler;
+	friend class event_loop_group;
 
 	void FZ_PRIVATE_SYMBOL remove_handler(event_handler* handler);
 
-	timer_id FZ_PRIVATE_SYMBOL add_timer(event_handler* handler, monotonic_clock const& deadline, duration const& interval);
-	void FZ_PRIVATE_SYMBOL stop_timer(timer_id id);
-	timer_id FZ_PRIVATE_SYMBOL stop_add_timer(timer_id id, event_handler* handler, monotonic_clock const& deadline, duration const& interval);
+	timer_id FZ_PRIVATE_SYMBOL add_timer(event_handler* handler, monotonic_clock const& deadline, duration const& interval, duration const& slack);
+	void FZ_PRIVATE_SYMBOL stop_timer(event_handler* handler, timer_id id);
+	timer_id FZ_PRIVATE_SYMBOL stop_add_timer(timer_id id, event_handler* handler, monotonic_clock const& deadline, duration const& interval, duration const& slack);
 
 	void send_event(event_handler* handler, event_base* evt);
 
+	// Moves an idle handler with all its pending events to the target loop
+	bool FZ_PRIVATE_SYMBOL migrate(event_handler & handler, event_loop & target);
+
+	// Intrusive lock-free multi-producer queue of sent events. Consumers must
+	// hold sync_, events get moved into the lanes of pending_events_ in batches.
+	void FZ_PRIVATE_SYMBOL push_event(event_base* evt);
+	FZ_PRIVATE_SYMBOL event_base* pop_event();
+
+	// Moves all queued events into pending_events_. If complete is set, also waits
+	// for producers that are in the middle of pushing an event.
+	void FZ_PRIVATE_SYMBOL drain_queue(scoped_lock & l, bool complete);
+
+	static FZ_PRIVATE_SYMBOL event_base* make_queue_stub();
+
+	// Index of the queued events that can be coalesced, keyed by
+	// handler, event type and coalescing key. Guarded by sync_.
+	struct coalesce_key final
+	{
+		event_handler* handler_;
+		size_t type_;
+		void const* key_;
+
+		bool operator==(coalesce_key const& op) const {
+			return handler_ == op.handler_ && type_ == op.type_ && key_ == op.key_;
+		}
+	};
+	struct coalesce_key_hash final
+	{
+		size_t operator()(coalesce_key const& k) const {
+			return std::hash<void const*>()(k.handler_) ^ (std::hash<size_t>()(k.type_) * 31) ^ (std::hash<void const*>()(k.key_) * 131);
+		}
+	};
+
+	// Appends the event to its lane and to the handler's list of pending events
+	void FZ_PRIVATE_SYMBOL enqueue_event(size_t lane, event_handler* handler, event_base* evt);
+
+	// Adds the event to, respectively takes it off, the handler's list of pending events
+	static void FZ_PRIVATE_SYMBOL link_event(event_handler* handler, event_base* evt);
+	static void FZ_PRIVATE_SYMBOL unlink_event(event_handler* handler, event_base* evt);
+
+	// After erasing from the middle of a lane, the events need to be told where their entries went
+	static void FZ_PRIVATE_SYMBOL relink_lane(Events & lane);
+
+	// Removes the event from the coalescing index if it is indexed
+	void FZ_PRIVATE_SYMBOL unindex_event(event_handler* handler, event_base* evt);
+
+	struct instrumentation;
+
+	// Records one dispatch. Times are steady clock nanoseconds, sent may be zero if unknown.
+	void FZ_PRIVATE_SYMBOL record_dispatch(scoped_lock & l, event_handler* handler, size_t type, int64_t sent, int64_t start);
+
 	// Process the next (if any) event. Returns true if an event has been processed
 	bool FZ_PRIVATE_SYMBOL process_event(scoped_lock & l);
 
+	// Returns the lane of the next event to dispatch, priority_count if there is none
+	size_t FZ_PRIVATE_SYMBOL next_lane();
+
+	size_t FZ_PRIVATE_SYMBOL pending_count() const;
+
 	// Process timers. Returns true if a timer has been triggered
-	bool FZ_PRIVATE_SYMBOL process_timers(scoped_lock & l, monotonic_clock& now);
+	bool FZ_PRIVATE_SYMBOL process_timers(scoped_lock & l, monotonic_clock const& now);
 
 	void FZ_PRIVATE_SYMBOL entry();
 
+	// Wakes up the loop, be it waiting for the condition or embedded into a poll loop
+	void FZ_PRIVATE_SYMBOL wakeup(scoped_lock & l);
+
 	struct FZ_PRIVATE_SYMBOL timer_data final
 	{
 		event_handler* handler_{};
 		timer_id id_{};
 		monotonic_clock deadline_;
 		duration interval_{};
+		duration slack_{};
+
+		// Position of id_ in the handler's list of timers
+		size_t handler_pos_{};
 	};
 
-	timer_id FZ_PRIVATE_SYMBOL setup_timer(scoped_lock &lock, timer_data &d, event_handler* handler, monotonic_clock const& deadline, duration const& interval);
+	timer_id FZ_PRIVATE_SYMBOL setup_timer(scoped_lock &lock, timer_data &d, event_handler* handler, monotonic_clock const& deadline, duration const& interval, duration const& slack);
+
+	// The timers form a binary min-heap ordered by deadline, timer_index_
+	// maps the ids to their position in the heap.
+	void FZ_PRIVATE_SYMBOL push_timer(timer_data && d);
+	void FZ_PRIVATE_SYMBOL remove_timer(size_t pos);
+	void FZ_PRIVATE_SYMBOL sift_timer(size_t pos);
+	bool FZ_PRIVATE_SYMBOL sift_timer_up(size_t pos);
+	void FZ_PRIVATE_SYMBOL sift_timer_down(size_t pos);
+	void FZ_PRIVATE_SYMBOL swap_timers(size_t a, size_t b);
+
+	// Sets deadline_ to the earliest deadline, wakes up the loop if it got earlier.
+	void FZ_PRIVATE_SYMBOL update_deadline(scoped_lock & lock);
 
 	typedef std::vector<timer_data> Timers;
 
-	Events pending_events_;
+	std::unique_ptr<event_base> queue_stub_{make_queue_stub()};
+	std::atomic<event_base*> queue_head_{queue_stub_.get()};
+	event_base* queue_tail_{queue_stub_.get()};
+
+	// Set while the loop is about to wait or waiting for the condition
+	std::atomic<bool> sleeping_{};
+
+	// One lane per event_priority. Removing a handler only clears the entries of its
+	// events, such tombstones get dropped once they reach the front of their lane.
+	static constexpr size_t priority_count = 3;
+	Events pending_events_[priority_count];
+	size_t tombstones_{};
+
+	// Number of dispatches since the lane has last been served while it had events
+	size_t passed_over_[priority_count]{};
+
+	// Time spent dispatching bulk events since the timers have last been checked precisely
+	int64_t bulk_budget_ns_{5000000};
+	int64_t bulk_ns_{};
+
+	// Set once the bulk budget has been exceeded
+	bool recheck_{};
+
+	std::unordered_map<coalesce_key, event_base*, coalesce_key_hash> coalescing_;
 	Timers timers_;
+	std::unordered_map<timer_id, size_t> timer_index_;
 
 	mutable mutex sync_;
 	condition cond_;
 
 	event_handler * active_handler_{};
 
+	std::atomic<size_t> handlers_{};
+
+	// Read without lock by senders to decide whether to timestamp events
+	std::atomic<bool> instrumented_{};
+	std::unique_ptr<instrumentation> instrumentation_;
+
 	monotonic_clock deadline_;
 
 	timer_id next_timer_id_{};
@@ -128,6 +394,17 @@ private:
 
 	bool quit_{};
 	bool threadless_{};
+
+	// Embedded loops get woken up through a descriptor, or an event object on Windows.
+	// Only one wakeup is outstanding at a time, processing clears it.
+	bool embedded_{};
+	bool processing_{};
+	bool wakeup_pending_{};
+#ifdef FZ_WINDOWS
+	void* wakeup_handle_{};
+#else
+	int wakeup_fds_[2]{-1, -1};
+#endif
 };
 
 }
@@ -0,0 +1,88 @@
+#ifndef LIBFILEZILLA_EVENT_LOOP_GROUP_HEADER
+#define LIBFILEZILLA_EVENT_LOOP_GROUP_HEADER
+
+#include "event_loop.hpp"
+
+/** \file
+ * \brief Declares \ref fz::event_loop_group, spreading event handlers over multiple loops
+ */
+
+namespace fz {
+
+class event_handler;
+class thread_pool;
+
+/**
+ * \brief Owns a number of event loops to spread event handlers across multiple cores.
+ *
+ * Each loop runs in its own thread, so handlers on different loops run concurrently.
+ * Each individual handler is still only ever called from one thread at a time.
+ *
+ * Handlers are assigned to a loop simply by creating them with the loop returned by
+ * \ref assign. Handlers that interact directly with each other without using events
+ * should be placed on the same loop, e.g. by using the keyed overload of \ref assign.
+ *
+ * \sa event_handler
+ */
+class FZ_PUBLIC_SYMBOL event_loop_group final
+{
+public:
+	/// How \ref assign picks a loop for a new handler
+	enum class policy
+	{
+		/// Cycles through the loops
+		round_robin,
+
+		/// Picks the loop with the fewest handlers
+		least_loaded
+	};
+
+	/**
+	 * \brief Creates the loops, each spawning its own thread.
+	 *
+	 * If loops is 0, the number of CPUs is used.
+	 */
+	explicit event_loop_group(size_t loops = 0, policy p = policy::round_robin);
+
+	/// Creates the loops, taking their threads from the pool.
+	explicit event_loop_group(thread_pool & pool, size_t loops = 0, policy p = policy::round_robin);
+
+	~event_loop_group();
+
+	event_loop_group(event_loop_group const&) = delete;
+	event_loop_group& operator=(event_loop_group const&) = delete;
+
+	size_t size() const { return loops_.size(); }
+
+	event_loop & operator[](size_t i) { return *loops_[i]; }
+
+	/// Returns the loop a new handler should be created with, according to the policy
+	event_loop & assign();
+
+	/// Returns a loop by hashing the key, the same key always results in the same loop
+	event_loop & assign(size_t key);
+
+	/**
+	 * \brief Moves a handler to a different loop.
+	 *
+	 * After migration, the handler's callback is only called from the target loop. Pending
+	 * events are moved along, preserving their order. Afterwards, \ref event_handler::get_event_loop
+	 * returns the target loop.
+	 *
+	 * The handler must be idle: Fails if the handler is currently in its callback or has timers,
+	 * as timer ids are not portable between loops. Must not be called concurrently with
+	 * \ref event_handler::remove_handler for the same handler.
+	 *
+	 * \return true on success or if the handler already is on the target loop.
+	 */
+	bool migrate(event_handler & handler, event_loop & target);
+
+private:
+	std::vector<std::unique_ptr<event_loop>> loops_;
+	std::atomic<size_t> next_{};
+	policy policy_;
+};
+
+}
+
+#endif
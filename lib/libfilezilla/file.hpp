@@ -17,6 +17,7 @@
 namespace fz {
 
 class datetime;
+class path_builder;
 
 /** \brief Lean class for file access
  *
@@ -72,11 +73,34 @@ public:
 		 *
 		 * Does not modify permissions if the file already exists.
 		 */
-		 current_user_and_admins_only = 0x8
+		 current_user_and_admins_only = 0x8,
+
+		/**
+		 * Bypass the system's file cache, also evaluated when reading.
+		 *
+		 * Reads and writes then need to use offsets, sizes and memory addresses that
+		 * are multiples of \ref direct_io_alignment.
+		 *
+		 * If the file system does not support unbuffered access, the file is opened normally.
+		 */
+		direct = 0x10,
+
+		/**
+		 * Windows only, opens the file for overlapped I/O, also evaluated when reading.
+		 *
+		 * Needed for files used with an I/O completion port, see \ref uring_engine.
+		 * The read and write functions of this class cannot be used on such files,
+		 * all other functions can. Ignored on other platforms.
+		 */
+		overlapped = 0x20
 	};
 
+	/// Alignment required by files opened with \ref direct
+	static constexpr size_t direct_io_alignment = 4096;
+
 	file() = default;
 	file(native_string const& f, mode m, creation_flags d = existing);
+	file(path_builder const& f, mode m, creation_flags d = existing);
 
 
 	/** \brief Creates file from descriptor
@@ -97,6 +121,7 @@ public:
 	explicit operator bool() const { return opened(); }
 
 	result open(native_string const& f, mode m, creation_flags d = existing);
+	result open(path_builder const& f, mode m, creation_flags d = existing);
 
 	void close();
 
@@ -148,6 +173,42 @@ public:
 	 */
 	bool truncate();
 
+	/** \brief Allocates disk space for the given range without changing the size of the file.
+	 *
+	 * Reserving the space for data that is going to be written reduces fragmentation.
+	 *
+	 * \return false if the space could not be allocated or if the system does not support it.
+	 */
+	bool allocate(int64_t offset, int64_t length);
+
+	/** \brief Deallocates the disk space of the given range, turning it into a hole.
+	 *
+	 * Afterwards the range reads as zeros. The size of the file does not change.
+	 *
+	 * \return false if the space could not be deallocated or if the system does not support it.
+	 */
+	bool punch_hole(int64_t offset, int64_t length);
+
+	/** \brief Gets the offset of the first data at or after the given offset.
+	 *
+	 * If the system cannot detect holes, all of the file is treated as data.
+	 *
+	 * \return -1 if there is only a hole following the offset, or on error.
+	 *
+	 * \note The position of the file pointer is undefined afterwards.
+	 */
+	int64_t next_data(int64_t offset);
+
+	/** \brief Gets the offset of the first hole at or after the given offset.
+	 *
+	 * The end of the file counts as hole.
+	 *
+	 * \return -1 on error
+	 *
+	 * \note The position of the file pointer is undefined afterwards.
+	 */
+	int64_t next_hole(int64_t offset);
+
 	/** \brief Read data from file
 	 *
 	 * Reading from file advances the file pointer with the number of octets read.
@@ -163,6 +224,29 @@ public:
 	 */
 	int64_t read(void *buf, int64_t count);
 
+	/** \brief Read data from the given offset in the file
+	 *
+	 * Like \ref read, but reads at the passed offset. Does not change the file
+	 * pointer on *nix, on MSW the file pointer is undefined afterwards.
+	 *
+	 * Can be called concurrently from multiple threads.
+	 */
+	int64_t read_at(void *buf, int64_t count, int64_t offset);
+
+	/// A memory region to read into, \sa readv_at
+	struct read_segment final {
+		void* buf{};
+		size_t size{};
+	};
+
+	/** \brief Vectored read from the given offset in the file
+	 *
+	 * Fills the passed segments in order with data starting at the given offset.
+	 * Same semantics as \ref read_at, fewer octets than the total size of the segments
+	 * may be read.
+	 */
+	int64_t readv_at(read_segment const* segments, size_t count, int64_t offset);
+
 	/** \brief Write data to file
 	 *
 	 * Writing to file advances the file pointer with the number of octets written
@@ -175,6 +259,29 @@ public:
 	 */
 	int64_t write(void const* buf, int64_t count);
 
+	/** \brief Write data at the given offset in the file
+	 *
+	 * Like \ref write, but writes at the passed offset. Does not change the file
+	 * pointer on *nix, on MSW the file pointer is undefined afterwards.
+	 *
+	 * Can be called concurrently from multiple threads.
+	 */
+	int64_t write_at(void const* buf, int64_t count, int64_t offset);
+
+	/// A memory region to write from, \sa writev_at
+	struct write_segment final {
+		void const* buf{};
+		size_t size{};
+	};
+
+	/** \brief Vectored write at the given offset in the file
+	 *
+	 * Writes the passed segments in order starting at the given offset.
+	 * Same semantics as \ref write_at, fewer octets than the total size of the segments
+	 * may be written.
+	 */
+	int64_t writev_at(write_segment const* segments, size_t count, int64_t offset);
+
 	/** \brief Ensure data is flushed to disk
 	 *
 	 * \return true Data has been flushed to disk.
@@ -188,7 +295,30 @@ public:
 	 */
 	bool set_modification_time(datetime const& t);
 
+	/// Access patterns that can be announced using \ref advise
+	enum access_advice {
+		/// The data will be accessed sequentially, the system may read ahead aggressively
+		sequential,
+
+		/// The data will be needed soon, the system may start reading it
+		willneed,
+
+		/// The data will not be needed again, the system may evict it from its cache
+		dontneed
+	};
+
+	/** \brief Gives the system a hint about how the given range of the file is going to be accessed
+	 *
+	 * A length of 0 extends the range to the end of the file.
+	 *
+	 * \return false if the hint could not be given, for example because the system does not support it.
+	 *         This does not affect the file in any way.
+	 */
+	bool advise(int64_t offset, int64_t length, access_advice advice);
+
 private:
+	result FZ_PRIVATE_SYMBOL do_open(native_string::value_type const* f, mode m, creation_flags d);
+
 #ifdef FZ_WINDOWS
 	HANDLE fd_{INVALID_HANDLE_VALUE};
 #else
@@ -201,6 +331,7 @@ private:
  * \return true iff the file has been removed or did not exist to begin with.
  */
 bool FZ_PUBLIC_SYMBOL remove_file(native_string const& name);
+bool FZ_PUBLIC_SYMBOL remove_file(path_builder const& name);
 
 inline file::creation_flags operator|(file::creation_flags lhs, file::creation_flags rhs) {
 	return static_cast<file::creation_flags>(static_cast<unsigned int>(lhs) | rhs);
@@ -0,0 +1,96 @@
+#ifndef LIBFILEZILLA_FILE_HANDLE_CACHE_HEADER
+#define LIBFILEZILLA_FILE_HANDLE_CACHE_HEADER
+
+/** \file
+ * \brief A cache of open read-only file handles
+ *
+ * Declares \ref fz::file_handle_cache
+ */
+
+#include "file.hpp"
+#include "mutex.hpp"
+
+#include <list>
+#include <map>
+#include <memory>
+
+namespace fz {
+
+/**
+ * \brief Keeps recently used files open for reading
+ *
+ * When serving the same few files over and over, opening them can be the dominant cost,
+ * in particular on network file systems. The cache hands out shared handles instead,
+ * which are meant to be used with positional reads like \ref file::read_at only, so
+ * that any number of readers can use the same handle concurrently.
+ *
+ * Before handing out a cached handle, the cache checks that the file at the path is
+ * still the same and unmodified, by comparing device, inode, size and the modification
+ * and status change times. On Windows only size and modification time are compared.
+ * Modified files get opened anew.
+ *
+ * At most max_handles handles are kept, the least recently used ones get closed first.
+ * Handles still in use by readers stay open until the last reader is done with them.
+ *
+ * Thread-safe.
+ * \sa file_reader_factory
+ */
+class FZ_PUBLIC_SYMBOL file_handle_cache final
+{
+public:
+	explicit file_handle_cache(size_t max_handles = 64);
+	~file_handle_cache();
+
+	file_handle_cache(file_handle_cache const&) = delete;
+	file_handle_cache& operator=(file_handle_cache const&) = delete;
+
+	/// Returns an open handle to the file, nullptr if it cannot be opened
+	std::shared_ptr<file> open(native_string const& path);
+
+	/// Drops the handle for the path, e.g. after changing the file in ways not detectable by its metadata
+	void invalidate(native_string const& path);
+
+	/// Drops all handles
+	void clear();
+
+	/// Number of cached handles
+	size_t size() const;
+
+	/// Number of calls to \ref open served from, respectively not served from the cache
+	uint64_t hits() const;
+	uint64_t misses() const;
+
+	/// \private
+	struct identity final
+	{
+		uint64_t dev{};
+		uint64_t ino{};
+		int64_t size{};
+		int64_t mtime{};
+		int64_t ctime{};
+
+		bool operator==(identity const& op) const;
+	};
+
+private:
+	struct entry final
+	{
+		native_string path_;
+		std::shared_ptr<file> file_;
+		identity id_;
+	};
+
+	size_t const max_handles_;
+
+	mutable mutex mtx_{false};
+
+	// Most recently used first
+	std::list<entry> lru_;
+	std::map<native_string, std::list<entry>::iterator> index_;
+
+	uint64_t hits_{};
+	uint64_t misses_{};
+};
+}
+
+#endif
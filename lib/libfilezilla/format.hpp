@@ -1,10 +1,12 @@
 #ifndef LIBFILEZILLA_FORMAT_HEADER
 #define LIBFILEZILLA_FORMAT_HEADER
 
+#include "buffer.hpp"
 #include "encode.hpp"
 #include "string.hpp"
 
 #include <cstdlib>
+#include <tuple>
 #include <type_traits>
 
 #ifdef LFZ_FORMAT_DEBUG
@@ -37,7 +39,7 @@ struct field final {
 	char flags{};
 	char type{};
 
-	explicit operator bool() const { return type != 0; }
+	explicit constexpr operator bool() const { return type != 0; }
 };
 
 template<typename Arg>
@@ -51,91 +53,146 @@ bool is_negative([[maybe_unused]] Arg && v)
 	}
 }
 
-// Converts integral type to desired string type...
-// ... basic case: simple unsigned value
-template<typename String, bool Unsigned, typename Arg>
-typename std::enable_if_t<std::is_integral_v<std::decay_t<Arg>> && !std::is_enum_v<std::decay_t<Arg>>, String> integral_to_string(field const& f, Arg && arg)
+// Lets the append functions write into an fz::buffer
+class buffer_appender final
 {
-	std::decay_t<Arg> v = arg;
+public:
+	typedef char value_type;
 
-	char lead{};
+	explicit buffer_appender(buffer & b)
+		: buffer_(b)
+	{}
 
-	format_assert(!Unsigned || !std::is_signed_v<std::decay_t<Arg>> || arg >= 0);
+	buffer_appender& operator+=(char c) {
+		buffer_.append(static_cast<unsigned char>(c));
+		return *this;
+	}
 
-	if (is_negative(arg)) {
-		lead = '-';
+	buffer_appender& operator+=(std::string_view const& s) {
+		buffer_.append(s);
+		return *this;
 	}
-	else if (f.flags & always_sign) {
-		lead = '+';
+
+	void append(size_t n, char c) {
+		buffer_.append(n, static_cast<unsigned char>(c));
 	}
-	else if (f.flags & pad_blank) {
-		lead = ' ';
+
+	void append(char const* s, size_t n) {
+		buffer_.append(reinterpret_cast<unsigned char const*>(s), n);
 	}
 
-	// max decimal digits in b-bit integer is floor((b-1) * log_10(2)) + 1 < b * 0.5 + 1
-	typename String::value_type buf[sizeof(v) * 4 + 1];
-	auto *const end = buf + sizeof(v) * 4 + 1;
-	auto *p = end;
+	void append(char const* begin, char const* end) {
+		append(begin, static_cast<size_t>(end - begin));
+	}
 
-	do {
-		int const mod = std::abs(static_cast<int>(v % 10));
-		*(--p) = '0' + mod;
-		v /= 10;
-	} while (v);
+private:
+	buffer & buffer_;
+};
 
-	auto width = f.width;
-	if (f.flags & with_width) {
-		if (lead && width > 0) {
-			--width;
-		}
+// The string type arguments get converted to for an output
+template<typename Out>
+struct string_type
+{
+	typedef Out type;
+};
 
-		String ret;
+template<>
+struct string_type<buffer_appender>
+{
+	typedef std::string type;
+};
 
-		if (f.flags & pad_0) {
-			if (lead) {
-				ret += lead;
-			}
-			if (static_cast<size_t>(end - p) < width) {
-				ret.append(width - (end - p), '0');
-			}
-			ret.append(p, end);
+template<typename Out>
+using string_type_t = typename string_type<Out>::type;
+
+template<typename String>
+void append_padded(String & out, field const& f, std::basic_string_view<typename String::value_type> const& s)
+{
+	if (f.flags & with_width && s.size() < f.width) {
+		if (f.flags & left_align) {
+			out += s;
+			out.append(f.width - s.size(), ' ');
 		}
 		else {
-			if (static_cast<size_t>(end - p) < width && !(f.flags & left_align)) {
-				ret.append(width - (end - p), ' ');
-			}
-			if (lead) {
-				ret += lead;
-			}
-			ret.append(p, end);
-			if (static_cast<size_t>(end - p) < width && f.flags & left_align) {
-				ret.append(width - (end - p), ' ');
-			}
+			out.append(f.width - s.size(), (f.flags & pad_0) ? '0' : ' ');
+			out += s;
 		}
-
-		return ret;
 	}
 	else {
-		if (lead) {
-			*(--p) = lead;
-		}
-		return String(p, end);
+		out += s;
 	}
 }
 
-// ... for strongly typed enums
+// Appends integral type as decimal number
 template<typename String, bool Unsigned, typename Arg>
-typename std::enable_if_t<std::is_enum_v<std::decay_t<Arg>>, String> integral_to_string(field const& f, Arg && arg)
+void append_integral(String & out, field const& f, Arg && arg)
 {
-	return integral_to_string<String, Unsigned>(f, static_cast<std::underlying_type_t<std::decay_t<Arg>>>(arg));
-}
+	if constexpr (std::is_enum_v<std::decay_t<Arg>>) {
+		// Special handling for enum, cast to underlying type
+		append_integral<String, Unsigned>(out, f, static_cast<std::underlying_type_t<std::decay_t<Arg>>>(arg));
+	}
+	else if constexpr (std::is_integral_v<std::decay_t<Arg>>) {
+		typedef std::conditional_t<std::is_same_v<std::decay_t<Arg>, bool>, unsigned char, std::decay_t<Arg>> value_type;
+		value_type const v = arg;
 
-// ... assert otherwise
-template<typename String, bool Unsigned, typename Arg>
-typename std::enable_if_t<!std::is_integral_v<std::decay_t<Arg>> && !std::is_enum_v<std::decay_t<Arg>>, String> integral_to_string(field const&, Arg &&)
-{
-	format_assert(0);
-	return String();
+		char lead{};
+
+		format_assert(!Unsigned || !std::is_signed_v<std::decay_t<Arg>> || arg >= 0);
+
+		if (is_negative(arg)) {
+			lead = '-';
+		}
+		else if (f.flags & always_sign) {
+			lead = '+';
+		}
+		else if (f.flags & pad_blank) {
+			lead = ' ';
+		}
+
+		// Room for the digits and the lead
+		typename String::value_type buf[max_integral_chars<value_type>];
+		auto *const end = buf + max_integral_chars<value_type>;
+		auto *p = write_digits_backwards(end, unsigned_abs(v));
+		size_t const digits = static_cast<size_t>(end - p);
+
+		if (f.flags & with_width) {
+			auto width = f.width;
+			if (lead && width > 0) {
+				--width;
+			}
+
+			if (f.flags & pad_0) {
+				if (lead) {
+					out += lead;
+				}
+				if (digits < width) {
+					out.append(width - digits, '0');
+				}
+				out.append(p, end);
+			}
+			else {
+				if (digits < width && !(f.flags & left_align)) {
+					out.append(width - digits, ' ');
+				}
+				if (lead) {
+					out += lead;
+				}
+				out.append(p, end);
+				if (digits < width && f.flags & left_align) {
+					out.append(width - digits, ' ');
+				}
+			}
+		}
+		else {
+			if (lead) {
+				*(--p) = lead;
+			}
+			out.append(p, end);
+		}
+	}
+	else {
+		format_assert(0);
+	}
 }
 
 template<typename String, class Arg, typename = void>
@@ -161,207 +218,179 @@ struct argument
 	};
 };
 
-// Converts integral type to hex string with desired string type
+// Writes the hex digits backwards, ending before end. Returns the first digit.
+template<bool Lowercase, typename Char, typename U>
+Char* write_hex_backwards(Char* end, U v) noexcept
+{
+	do {
+		*(--end) = fz::int_to_hex_char<Char, Lowercase>(v & 0xf);
+		v >>= 4;
+	} while (v);
+	return end;
+}
+
+// Appends integral type as hex number
 template<typename String, bool Lowercase, typename Arg>
-String integral_to_hex_string(Arg && arg) noexcept
+void append_hex(String & out, field const& f, Arg && arg)
 {
 	if constexpr (std::is_enum_v<std::decay_t<Arg>>) {
 		// Special handling for enum, cast to underlying type
-		return integral_to_hex_string<String, Lowercase>(static_cast<std::underlying_type_t<std::decay_t<Arg>>>(arg));
+		append_hex<String, Lowercase>(out, f, static_cast<std::underlying_type_t<std::decay_t<Arg>>>(arg));
 	}
-	else if constexpr (std::is_signed_v<std::decay_t<Arg>>) {
-		return integral_to_hex_string<String, Lowercase>(static_cast<std::make_unsigned_t<std::decay_t<Arg>>>(arg));
+	else if constexpr (std::is_integral_v<std::decay_t<Arg>> && std::is_signed_v<std::decay_t<Arg>>) {
+		append_hex<String, Lowercase>(out, f, static_cast<std::make_unsigned_t<std::decay_t<Arg>>>(arg));
 	}
 	else if constexpr (std::is_integral_v<std::decay_t<Arg>>) {
-		std::decay_t<Arg> v = arg;
-		typename String::value_type buf[sizeof(v) * 2];
-		auto* const end = buf + sizeof(v) * 2;
-		auto* p = end;
-
-		do {
-			*(--p) = fz::int_to_hex_char<typename String::value_type, Lowercase>(v & 0xf);
-			v >>= 4;
-		} while (v);
-
-		return String(p, end);
+		typename String::value_type buf[sizeof(arg) * 2];
+		auto* const end = buf + sizeof(arg) * 2;
+		auto* const p = write_hex_backwards<Lowercase>(end, arg);
+		append_padded(out, f, {p, static_cast<size_t>(end - p)});
 	}
 	else {
 		format_assert(0);
-		return String();
 	}
 }
 
-// Converts pointer to hex string
+// Appends pointer as hex number
 template<typename String, typename Arg>
-String pointer_to_string(Arg&& arg) noexcept
+void append_pointer(String & out, field const& f, Arg && arg)
 {
 	if constexpr (std::is_pointer_v<std::decay_t<Arg>>) {
-		return String({'0', 'x'}) + integral_to_hex_string<String, true>(reinterpret_cast<uintptr_t>(arg));
+		typename String::value_type buf[sizeof(uintptr_t) * 2 + 2];
+		auto* const end = buf + sizeof(uintptr_t) * 2 + 2;
+		auto* p = write_hex_backwards<true>(end, reinterpret_cast<uintptr_t>(arg));
+		*(--p) = 'x';
+		*(--p) = '0';
+		append_padded(out, f, {p, static_cast<size_t>(end - p)});
 	}
 	else {
 		format_assert(0);
-		return String();
 	}
 }
 
 template<typename String, typename Arg>
-String char_to_string(Arg&& arg)
+void append_char(String & out, Arg && arg)
 {
 	if constexpr (std::is_integral_v<std::decay_t<Arg>>) {
-		return String({static_cast<typename String::value_type>(static_cast<unsigned char>(arg))});
+		out += static_cast<typename String::value_type>(static_cast<unsigned char>(arg));
 	}
 	else {
 		format_assert(0);
-		return String();
-	}
-}
-
-
-template<typename String>
-void pad_arg(String& s, field const& f)
-{
-	if (f.flags & with_width && s.size() < f.width) {
-		if (f.flags & left_align) {
-			s += String(f.width - s.size(), ' ');
-		}
-		else {
-			s = String(f.width - s.size(), (f.flags & pad_0) ? '0' : ' ') + s;
-		}
 	}
 }
 
 template<typename String, typename Arg>
-String format_arg(field const& f, Arg&& arg)
+void append_arg(String & out, field const& f, Arg && arg)
 {
-	String ret;
 	if (f.type == 's') {
-		if constexpr (std::is_same_v<String, std::decay_t<Arg>>) {
-			ret = arg;
+		if constexpr (std::is_convertible_v<Arg, std::basic_string_view<typename String::value_type>>) {
+			// Same character type, no conversion needed
+			append_padded(out, f, std::forward<Arg>(arg));
 		}
-		else if constexpr (has_toString<String, Arg>::value) {
+		else if constexpr (has_toString<string_type_t<String>, Arg>::value) {
 			// Converts argument to string
 			// if toString(arg) is valid expression
-			ret = toString<String>(std::forward<Arg>(arg));
+			append_padded(out, f, toString<string_type_t<String>>(std::forward<Arg>(arg)));
 		}
 		else {
 			// Otherwise assert
 			format_assert(0);
 		}
-		pad_arg(ret, f);
 	}
 	else if (f.type == 'd' || f.type == 'i') {
-		ret = integral_to_string<String, false>(f, std::forward<Arg>(arg));
+		append_integral<String, false>(out, f, std::forward<Arg>(arg));
 	}
 	else if (f.type == 'u') {
-		ret = integral_to_string<String, true>(f, std::forward<Arg>(arg));
+		append_integral<String, true>(out, f, std::forward<Arg>(arg));
 	}
 	else if (f.type == 'x') {
-		ret = integral_to_hex_string<String, true>(std::forward<Arg>(arg));
-		pad_arg(ret, f);
+		append_hex<String, true>(out, f, std::forward<Arg>(arg));
 	}
 	else if (f.type == 'X') {
-		ret = integral_to_hex_string<String, false>(std::forward<Arg>(arg));
-		pad_arg(ret, f);
+		append_hex<String, false>(out, f, std::forward<Arg>(arg));
 	}
 	else if (f.type == 'p') {
-		ret = pointer_to_string<String>(std::forward<Arg>(arg));
-		pad_arg(ret, f);
+		append_pointer(out, f, std::forward<Arg>(arg));
 	}
 	else if (f.type == 'c') {
-		ret = char_to_string<String>(std::forward<Arg>(arg));
+		append_char(out, std::forward<Arg>(arg));
 	}
 	else {
 		format_assert(0);
 	}
-	return ret;
 }
 
 template<typename String, typename... Args>
-String extract_arg(field const&, size_t)
-{
-	return String();
-}
-
-
-template<typename String, typename Arg, typename... Args>
-String extract_arg(field const& f, size_t arg_n, Arg&& arg, Args&&...args)
+void append_nth_arg(String & out, field const& f, size_t arg_n, Args&&... args)
 {
-	String ret;
-
-	if (!arg_n) {
-		ret = format_arg<String>(f, std::forward<Arg>(arg));
-	}
-	else {
-		ret = extract_arg<String>(f, arg_n - 1, std::forward<Args>(args)...);
-	}
-
-	return ret;
+	size_t i{};
+	((i++ == arg_n ? append_arg(out, f, std::forward<Args>(args)) : void()), ...);
 }
 
-template<typename InString, typename OutString>
-field get_field(InString const& fmt, typename InString::size_type & pos, size_t& arg_n, OutString & ret)
+// Parses the field starting at the % at pos, leaves pos after the field.
+// A literal percent sign yields the type '%', malformed fields no type.
+template<typename Char>
+constexpr field parse_field(std::basic_string_view<Char> const& fmt, size_t & pos, size_t & arg_n)
 {
 	field f;
 	if (++pos >= fmt.size()) {
-		format_assert(0);
 		return f;
 	}
 
 	// Get literal percent out of the way
 	if (fmt[pos] == '%') {
-		ret += '%';
+		f.type = '%';
 		++pos;
 		return f;
 	}
 
-parse_start:
 	while (true) {
-		if (fmt[pos] == '0') {
-			f.flags |= pad_0;
-		}
-		else if (fmt[pos] == ' ') {
-			f.flags |= pad_blank;
-		}
-		else if (fmt[pos] == '-') {
-			f.flags &= ~pad_0;
-			f.flags |= left_align;
-		}
-		else if (fmt[pos] == '+') {
-			f.flags &= ~pad_blank;
-			f.flags |= always_sign;
+		while (true) {
+			if (fmt[pos] == '0') {
+				f.flags |= pad_0;
+			}
+			else if (fmt[pos] == ' ') {
+				f.flags |= pad_blank;
+			}
+			else if (fmt[pos] == '-') {
+				f.flags &= ~pad_0;
+				f.flags |= left_align;
+			}
+			else if (fmt[pos] == '+') {
+				f.flags &= ~pad_blank;
+				f.flags |= always_sign;
+			}
+			else {
+				break;
+			}
+			if (++pos >= fmt.size()) {
+				return field();
+			}
 		}
-		else {
-			break;
+
+		// Field width
+		while (fmt[pos] >= '0' && fmt[pos] <= '9') {
+			f.flags |= with_width;
+			f.width *= 10;
+			f.width += fmt[pos] - '0';
+			if (++pos >= fmt.size()) {
+				return field();
+			}
 		}
-		if (++pos >= fmt.size()) {
-			format_assert(0);
-			return f;
+		if (f.width > 10000) {
+			f.width = 10000;
 		}
-	}
 
-	// Field width
-	while (fmt[pos] >= '0' && fmt[pos] <= '9') {
-		f.flags |= with_width;
-		f.width *= 10;
-		f.width += fmt[pos] - '0';
-		if (++pos >= fmt.size()) {
-			format_assert(0);
-			return f;
+		if (fmt[pos] != '$') {
+			break;
 		}
-	}
-	if (f.width > 10000) {
-		format_assert(0);
-		f.width = 10000;
-	}
 
-	if (fmt[pos] == '$') {
 		// Positional argument, start over
 		arg_n = f.width - 1;
+		f = field();
 		if (++pos >= fmt.size()) {
-			format_assert(0);
 			return f;
 		}
-		goto parse_start;
 	}
 
 	// Ignore length modifier
@@ -369,8 +398,7 @@ parse_start:
 		auto c = fmt[pos];
 		if (c == 'h' || c == 'l' || c == 'L' || c == 'j' || c == 'z' || c == 't') {
 			if (++pos >= fmt.size()) {
-				format_assert(0);
-				return f;
+				return field();
 			}
 		}
 		else {
@@ -399,37 +427,240 @@ constexpr bool check_arguments(std::index_sequence<Is...>)
 	return (check_argument<String, Args, Is>() && ...);
 }
 
-template<typename InString, typename CharType = typename InString::value_type, typename OutString = std::basic_string<CharType>, typename... Args>
-OutString do_sprintf(InString const& fmt, Args&&... args)
+template<typename Out, typename Char, typename... Args>
+void do_sprintf_append(Out & out, std::basic_string_view<Char> const& fmt, Args&&... args)
 {
-	OutString ret;
-
 	// Find % characters
-	typename InString::size_type start = 0, pos;
+	size_t start = 0, pos;
 
 	size_t arg_n{};
-	while ((pos = fmt.find('%', start)) != InString::npos) {
+	while ((pos = fmt.find('%', start)) != std::basic_string_view<Char>::npos) {
 
 		// Copy segment preceding the %
-		ret += fmt.substr(start, pos - start);
+		out += fmt.substr(start, pos - start);
 
-		field f = detail::get_field(fmt, pos, arg_n, ret);
-		if (f) {
+		field f = detail::parse_field(fmt, pos, arg_n);
+		if (f.type == '%') {
+			out += '%';
+		}
+		else if (f) {
 			format_assert(arg_n < sizeof...(args));
-			ret += detail::extract_arg<OutString>(f, arg_n++, std::forward<Args>(args)...);
+			detail::append_nth_arg(out, f, arg_n++, std::forward<Args>(args)...);
+		}
+		else {
+			format_assert(0);
 		}
 
 		start = pos;
 	}
 
 	// Copy remainder of string
-	ret += fmt.substr(start);
+	out += fmt.substr(start);
+}
+
+template<typename Char, typename... Args>
+std::basic_string<Char> do_sprintf(std::basic_string_view<Char> const& fmt, Args&&... args)
+{
+	std::basic_string<Char> ret;
+	do_sprintf_append(ret, fmt, std::forward<Args>(args)...);
+	return ret;
+}
+
+// Format strings parsed at compile time, see FZ_FORMAT
+struct format_string_tag {};
+
+template<typename T>
+constexpr bool is_format_string_v = std::is_base_of_v<format_string_tag, std::decay_t<T>>;
+
+template<typename Char, size_t N>
+constexpr std::basic_string_view<Char> make_format_view(Char const (&fmt)[N])
+{
+	return {fmt, N - 1};
+}
+
+struct format_item final
+{
+	// The literal text preceding the field
+	size_t literal_start{};
+	size_t literal_size{};
+
+	field f;
+	size_t arg{};
+};
+
+template<size_t N>
+struct parsed_format final
+{
+	format_item items[N]{};
+	size_t count{};
+	bool valid{true};
+	bool ascii{true};
+};
+
+template<typename Char>
+constexpr size_t count_format_items(std::basic_string_view<Char> const& fmt)
+{
+	size_t ret{1};
+	for (auto const& c : fmt) {
+		if (c == '%') {
+			++ret;
+		}
+	}
+	return ret;
+}
+
+template<size_t N, typename Char>
+constexpr parsed_format<N> parse_format(std::basic_string_view<Char> const& fmt)
+{
+	parsed_format<N> ret{};
+	for (auto const& c : fmt) {
+		if (static_cast<std::make_unsigned_t<Char>>(c) > 127) {
+			ret.ascii = false;
+		}
+	}
+
+	size_t start{};
+	size_t arg_n{};
+	size_t pos{};
+	while ((pos = fmt.find('%', start)) != std::basic_string_view<Char>::npos) {
+		auto & item = ret.items[ret.count++];
+		item.literal_start = start;
+		item.literal_size = pos - start;
+
+		field const f = parse_field(fmt, pos, arg_n);
+		if (f.type == '%') {
+			// Keep the percent sign in the literal
+			++item.literal_size;
+		}
+		else if (f) {
+			item.f = f;
+			item.arg = arg_n++;
+		}
+		else {
+			ret.valid = false;
+		}
+		start = pos;
+	}
+
+	auto & item = ret.items[ret.count++];
+	item.literal_start = start;
+	item.literal_size = fmt.size() - start;
 
 	return ret;
 }
+
+template<typename Format>
+inline constexpr auto parsed_format_v = parse_format<count_format_items(Format::value())>(Format::value());
+
+template<typename String, typename Arg>
+constexpr bool can_format(char type)
+{
+	typedef std::decay_t<Arg> A;
+	switch (type) {
+	case 's':
+		return std::is_convertible_v<Arg, std::basic_string_view<typename String::value_type>> || has_toString<string_type_t<String>, Arg>::value;
+	case 'd':
+	case 'i':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+		return std::is_integral_v<A> || std::is_enum_v<A>;
+	case 'p':
+		return std::is_pointer_v<A>;
+	default:
+		return false;
+	}
+}
+
+template<typename Format, typename String, typename... Args>
+constexpr bool format_types_match()
+{
+	auto const& parsed = parsed_format_v<Format>;
+	for (size_t i = 0; i < parsed.count; ++i) {
+		auto const& item = parsed.items[i];
+		if (item.f) {
+			if constexpr (sizeof...(Args) == 0) {
+				return false;
+			}
+			else {
+				bool const ok[] = {can_format<String, Args>(item.f.type)...};
+				if (item.arg >= sizeof...(Args) || !ok[item.arg]) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+template<typename Format, typename String, size_t I, typename Tuple>
+void append_format_item(String & out, Tuple && args)
+{
+	constexpr auto const& item = parsed_format_v<Format>.items[I];
+	constexpr auto fmt = Format::value();
+	if constexpr (std::is_same_v<typename decltype(fmt)::value_type, typename String::value_type>) {
+		out.append(fmt.data() + item.literal_start, item.literal_size);
+	}
+	else {
+		// ASCII only, widen character by character
+		for (size_t i = 0; i < item.literal_size; ++i) {
+			out += static_cast<typename String::value_type>(fmt[item.literal_start + i]);
+		}
+	}
+	if constexpr (static_cast<bool>(item.f)) {
+		append_arg(out, item.f, std::get<item.arg>(std::forward<Tuple>(args)));
+	}
+}
+
+template<typename Format, typename String, typename Tuple, size_t... Is>
+void append_format_items(String & out, Tuple && args, std::index_sequence<Is...>)
+{
+	(append_format_item<Format, String, Is>(out, std::forward<Tuple>(args)), ...);
+}
+
+// Formats into out, which can be of another character type than the format string.
+template<typename Out, typename Format, typename... Args>
+void do_sprintf_compiled_append(Out & out, Format const&, Args&&... args)
+{
+	constexpr auto const& parsed = parsed_format_v<Format>;
+	static_assert(parsed.valid, "Malformed fz::sprintf() format string");
+	static_assert(format_types_match<Format, Out, Args...>(), "fz::sprintf() arguments do not match the format string");
+
+	constexpr auto fmt = Format::value();
+	if constexpr (!std::is_same_v<typename decltype(fmt)::value_type, typename Out::value_type> && !parsed.ascii) {
+		// Needs conversion according to the locale
+		string_type_t<Out> const converted = toString<string_type_t<Out>>(fmt);
+		do_sprintf_append(out, std::basic_string_view<typename Out::value_type>(converted), std::forward<Args>(args)...);
+	}
+	else {
+		append_format_items<Format>(out, std::forward_as_tuple(std::forward<Args>(args)...), std::make_index_sequence<parsed.count>());
+	}
+}
+
+template<typename OutString, typename Format, typename... Args>
+OutString do_sprintf_compiled(Format const& fmt, Args&&... args)
+{
+	OutString ret;
+	ret.reserve(Format::value().size() + sizeof...(Args) * 16);
+	do_sprintf_compiled_append(ret, fmt, std::forward<Args>(args)...);
+	return ret;
+}
 }
 /// \endcond
 
+/**
+ * \brief Wraps a string literal into a format string parsed at compile time.
+ *
+ * The result can be passed to \ref fz::sprintf and \ref logger_interface::log.
+ */
+#define FZ_FORMAT(fmt) [] { \
+	struct format_string final : fz::detail::format_string_tag { \
+		static constexpr auto value() { return fz::detail::make_format_view(fmt); } \
+	}; \
+	return format_string{}; \
+}()
+
 /** \brief A simple type-safe sprintf replacement
 *
 * Only partially implements the format specifiers for the printf family of C functions:
@@ -468,6 +699,79 @@ std::wstring sprintf(std::wstring_view const& fmt, Args&&... args)
 	return detail::do_sprintf(fmt, std::forward<Args>(args)...);
 }
 
+/**
+ * \brief Formats using a format string parsed at compile time.
+ *
+ * Pass the format string literal wrapped in \ref FZ_FORMAT:
+ *
+ * \code
+ * std::string s = fz::sprintf(FZ_FORMAT("%s: %d bytes"), name, size);
+ * \endcode
+ *
+ * Supports the same format specifiers as the other overloads, but avoids parsing the
+ * format string on every call and writes the output directly into the result.
+ *
+ * Malformed format strings, references to missing arguments and arguments not matching
+ * their specifiers fail to compile.
+ */
+template<typename Format, typename... Args, typename std::enable_if_t<detail::is_format_string_v<Format>, int> = 0>
+auto sprintf(Format const& fmt, Args&&... args)
+{
+	typedef std::basic_string<typename decltype(Format::value())::value_type> String;
+	return detail::do_sprintf_compiled<String>(fmt, std::forward<Args>(args)...);
+}
+
+/**
+ * \brief Like \ref sprintf, but appends to an existing string.
+ *
+ * Reuses the capacity of \c out, the fields are formatted directly into it.
+ */
+template<typename... Args>
+void sprintf_append(std::string & out, std::string_view const& fmt, Args&&... args)
+{
+	detail::check_arguments<std::string, Args...>(std::index_sequence_for<Args...>());
+
+	detail::do_sprintf_append(out, fmt, std::forward<Args>(args)...);
+}
+
+template<typename... Args>
+void sprintf_append(std::wstring & out, std::wstring_view const& fmt, Args&&... args)
+{
+	detail::check_arguments<std::wstring, Args...>(std::index_sequence_for<Args...>());
+
+	detail::do_sprintf_append(out, fmt, std::forward<Args>(args)...);
+}
+
+/// Appends to a buffer, string arguments are converted as if formatting into a std::string
+template<typename... Args>
+void sprintf_append(buffer & out, std::string_view const& fmt, Args&&... args)
+{
+	detail::check_arguments<std::string, Args...>(std::index_sequence_for<Args...>());
+
+	detail::buffer_appender appender(out);
+	detail::do_sprintf_append(appender, fmt, std::forward<Args>(args)...);
+}
+
+/// Appends using a format string parsed at compile time, see \ref FZ_FORMAT
+template<typename Format, typename... Args, typename std::enable_if_t<detail::is_format_string_v<Format>, int> = 0>
+void sprintf_append(std::string & out, Format const& fmt, Args&&... args)
+{
+	detail::do_sprintf_compiled_append(out, fmt, std::forward<Args>(args)...);
+}
+
+template<typename Format, typename... Args, typename std::enable_if_t<detail::is_format_string_v<Format>, int> = 0>
+void sprintf_append(std::wstring & out, Format const& fmt, Args&&... args)
+{
+	detail::do_sprintf_compiled_append(out, fmt, std::forward<Args>(args)...);
+}
+
+template<typename Format, typename... Args, typename std::enable_if_t<detail::is_format_string_v<Format>, int> = 0>
+void sprintf_append(buffer & out, Format const& fmt, Args&&... args)
+{
+	detail::buffer_appender appender(out);
+	detail::do_sprintf_compiled_append(appender, fmt, std::forward<Args>(args)...);
+}
+
 }
 
 #endif
@@ -0,0 +1,77 @@
+#ifndef LIBFILEZILLA_FSYNC_COORDINATOR_HEADER
+#define LIBFILEZILLA_FSYNC_COORDINATOR_HEADER
+
+#include "file.hpp"
+#include "mutex.hpp"
+#include "time.hpp"
+
+#include <vector>
+
+/** \file
+ * \brief Declares fz::fsync_coordinator
+ */
+
+namespace fz {
+
+/// \brief Statistics about an \ref fsync_coordinator, \sa fsync_coordinator::get_stats
+struct fsync_coordinator_stats final
+{
+	/// Number of files passed to sync()
+	uint64_t requests{};
+
+	/// Number of batches the requests have been grouped into
+	uint64_t batches{};
+
+	/// Number of system calls flushing data to disk
+	uint64_t flushes{};
+};
+
+/**
+ * \brief Batches flushing data of many files to disk
+ *
+ * Syncing each file on its own serializes the disk if many small files get written.
+ * Instead, calls to \ref sync from multiple threads are grouped: The first caller waits
+ * for the given latency for further files to arrive, then flushes the entire batch.
+ * On Linux, multiple files of a batch residing on the same file system are flushed
+ * using a single call to syncfs.
+ *
+ * Can be shared by any number of \ref file_writer instances, see
+ * \ref file_writer_factory. Must outlive all users.
+ */
+class FZ_PUBLIC_SYMBOL fsync_coordinator final
+{
+public:
+	explicit fsync_coordinator(duration const& latency = duration::from_milliseconds(10));
+
+	fsync_coordinator(fsync_coordinator const&) = delete;
+	fsync_coordinator& operator=(fsync_coordinator const&) = delete;
+
+	/** \brief Flushes the file's data to disk
+	 *
+	 * Blocks until the data is durable, which takes at most the latency passed to the
+	 * constructor plus the time needed to flush the batch.
+	 *
+	 * \return false if the data could not be flushed.
+	 */
+	bool sync(file & f);
+
+	fsync_coordinator_stats get_stats() const;
+
+private:
+	struct request;
+
+	void flush(std::vector<request*> const& batch);
+
+	mutable mutex mtx_;
+
+	duration const latency_;
+
+	std::vector<request*> pending_;
+	bool leader_{};
+
+	fsync_coordinator_stats stats_;
+};
+
+}
+
+#endif
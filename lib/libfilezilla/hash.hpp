@@ -7,6 +7,7 @@
 
 #include "libfilezilla.hpp"
 
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -18,7 +19,13 @@ enum class hash_algorithm
 	md5, // insecure
 	sha1, // insecure
 	sha256,
-	sha512
+	sha512,
+
+	/// Not cryptographic, for detecting accidental corruption only. Digest is the CRC in big-endian order.
+	crc32c,
+
+	/// Not cryptographic, for detecting accidental corruption only. 64-bit XXH3 with seed 0, digest in big-endian order.
+	xxh3
 };
 
 /// Accumulator for hashing large amounts of data
@@ -49,6 +56,25 @@ public:
 		return digest();
 	}
 
+	/**
+	 * \brief Exports the intermediate state
+	 *
+	 * Allows storing the state, e.g. alongside a partially transferred file, so that hashing
+	 * can be continued later on without processing the data hashed so far once more.
+	 *
+	 * The format does not depend on the platform or on the version of Nettle.
+	 */
+	std::vector<uint8_t> export_state() const;
+
+	/**
+	 * \brief Continues from a state returned by \ref export_state
+	 *
+	 * Returns false and leaves the accumulator unchanged if the state is malformed or
+	 * belongs to a different algorithm.
+	 */
+	bool import_state(std::basic_string_view<uint8_t> const& state);
+	bool import_state(std::vector<uint8_t> const& state);
+
 	template<typename T>
 	hash_accumulator& operator<<(T && in) {
 		update(std::forward<T>(in));
@@ -60,6 +86,53 @@ private:
 	impl* impl_;
 };
 
+/**
+ * \brief Hashes multiple independent streams of data at once
+ *
+ * Each stream behaves like its own \ref hash_accumulator. If a call to update passes
+ * whole blocks of data for several streams, the blocks of up to eight streams (four with
+ * SHA-512) get hashed together in the lanes of AVX2 registers.
+ *
+ * SHA-1 and SHA-256 are only hashed in parallel if the CPU lacks the SHA extensions, with
+ * these a single stream is faster than eight. Streams of CRC-32C and XXH3 are always hashed
+ * one after another.
+ *
+ * Useful for verifying many files at once: Read a chunk of each file and pass them together.
+ */
+class FZ_PUBLIC_SYMBOL hash_accumulator_batch final
+{
+public:
+	/// Creates the given number of initialized streams
+	hash_accumulator_batch(hash_algorithm algorithm, size_t streams);
+	~hash_accumulator_batch();
+
+	hash_accumulator_batch(hash_accumulator_batch const&) = delete;
+	hash_accumulator_batch& operator=(hash_accumulator_batch const&) = delete;
+
+	/// Returns the number of streams
+	size_t size() const;
+
+	/// Reinitializes all streams
+	void reinit();
+
+	/// Passes data[i] to stream i. May contain fewer entries than there are streams.
+	void update(std::vector<std::basic_string_view<uint8_t>> const& data);
+
+	/// Passes data to a single stream
+	void update(size_t stream, uint8_t const* data, size_t size);
+
+	/// Returns the raw digest of the stream and reinitializes it
+	std::vector<uint8_t> digest(size_t stream);
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
+
+/// Returns the digests of each of the inputs, computed using \ref hash_accumulator_batch
+std::vector<std::vector<uint8_t>> FZ_PUBLIC_SYMBOL hash_batch(hash_algorithm algorithm, std::vector<std::basic_string_view<uint8_t>> const& inputs);
+std::vector<std::vector<uint8_t>> FZ_PUBLIC_SYMBOL hash_batch(hash_algorithm algorithm, std::vector<std::string_view> const& inputs);
+
 /** \brief Standard MD5
  *
  * Insecure, avoid using this
@@ -71,6 +144,20 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL md5(std::vector<uint8_t> const& data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL sha256(std::string_view const& data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL sha256(std::vector<uint8_t> const& data);
 
+/**
+ * \brief CRC-32C (Castagnoli), as used by iSCSI, SCTP, ext4 and many storage services
+ *
+ * Pass a previously returned CRC to continue it with more data.
+ *
+ * Uses the CRC32 instructions of SSE 4.2 and ARMv8 if available.
+ */
+uint32_t FZ_PUBLIC_SYMBOL crc32c(std::string_view const& data, uint32_t crc = 0);
+uint32_t FZ_PUBLIC_SYMBOL crc32c(std::basic_string_view<uint8_t> const& data, uint32_t crc = 0);
+
+/// \brief The 64-bit variant of the XXH3 hash, with seed 0
+uint64_t FZ_PUBLIC_SYMBOL xxh3_64(std::string_view const& data);
+uint64_t FZ_PUBLIC_SYMBOL xxh3_64(std::basic_string_view<uint8_t> const& data);
+
 /** \brief Standard HMAC using SHA1
  *
  * While HMAC-SHA1 (as opposed to plain SHA1) is still considered secure in 2021, avoid using this for new things
@@ -86,6 +173,69 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL hmac_sha256(std::vector<uint8_t> const& ke
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL hmac_sha256(std::vector<uint8_t> const& key, std::string_view const& data);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL hmac_sha256(std::string_view const& key, std::vector<uint8_t> const& data);
 
+/**
+ * \brief Keyed HMAC that can be reused for many messages
+ *
+ * The padded inner and outer keys are hashed only once on construction, afterwards each
+ * message only costs hashing the message itself plus a single block for the outer hash.
+ * Use this instead of \ref hmac_sha256 and friends when computing many MACs with the same key,
+ * e.g. when validating tokens or signed URLs.
+ *
+ * Supports MD5, SHA-1, SHA-256 and SHA-512. With any other algorithm the digest is empty.
+ *
+ * An instance must not be used by multiple threads at once. Give each thread its own
+ * instance using \ref clone instead.
+ */
+class FZ_PUBLIC_SYMBOL hmac_accumulator final
+{
+public:
+	hmac_accumulator(hash_algorithm algorithm, std::basic_string_view<uint8_t> const& key);
+	hmac_accumulator(hash_algorithm algorithm, std::string_view const& key);
+	hmac_accumulator(hash_algorithm algorithm, std::vector<uint8_t> const& key);
+	~hmac_accumulator();
+
+	hmac_accumulator(hmac_accumulator const&) = delete;
+	hmac_accumulator& operator=(hmac_accumulator const&) = delete;
+
+	hmac_accumulator(hmac_accumulator &&) noexcept;
+	hmac_accumulator& operator=(hmac_accumulator &&) noexcept;
+
+	/**
+	 * \brief Returns a new accumulator with the same key, without any data added
+	 *
+	 * Only reads the precomputed keys, which never change. It is safe to call this from
+	 * any thread, even while another thread is using this instance.
+	 */
+	hmac_accumulator clone() const;
+
+	/// Discards all data added since the last digest, keeping the key
+	void reinit();
+
+	void update(std::string_view const& data);
+	void update(std::basic_string_view<uint8_t> const& data);
+	void update(std::vector<uint8_t> const& data);
+	void update(uint8_t const* data, size_t size);
+
+	/// Returns the MAC of the data added and reinitializes the accumulator for the next message
+	std::vector<uint8_t> digest();
+
+	/// Compares the MAC of the data added to the passed MAC in constant time, then reinitializes the accumulator
+	bool verify(std::basic_string_view<uint8_t> const& mac);
+	bool verify(std::vector<uint8_t> const& mac);
+
+	template<typename T>
+	hmac_accumulator& operator<<(T && in) {
+		update(std::forward<T>(in));
+		return *this;
+	}
+
+	class impl;
+private:
+	explicit hmac_accumulator(std::unique_ptr<impl> && impl);
+
+	std::unique_ptr<impl> impl_;
+};
+
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL pbkdf2_hmac_sha256(std::basic_string_view<uint8_t> const& password, std::basic_string_view<uint8_t> const& salt, size_t length, unsigned int iterations);
 
 template <typename PasswordContainer, typename SaltContainer,
@@ -10,6 +10,14 @@
 #include "event_handler.hpp"
 
 namespace fz {
+class thread_pool;
+
+/**
+ * \brief Resolves hostnames asynchronously
+ *
+ * Lookups, as well as the lookups done by \ref socket::connect, can be served from a
+ * process-wide cache, \sa set_cache
+ */
 class FZ_PUBLIC_SYMBOL hostname_lookup
 {
 public:
@@ -31,6 +39,31 @@ public:
 
 	void reset();
 
+	/**
+	 * \brief Configures the process-wide resolver cache
+	 *
+	 * The cache is shared by all instances of hostname_lookup and by \ref socket::connect.
+	 * Successful lookups get cached for the given ttl, lookups failing because the name does
+	 * not exist for the negative_ttl. Transient failures are never cached. The system resolver
+	 * does not expose the TTLs of the DNS records, pick values below the TTLs used by the
+	 * names of interest.
+	 *
+	 * If full, the least recently used entries get evicted. Passing zero durations disables
+	 * the cache, which is the default.
+	 */
+	static void set_cache(duration const& ttl, duration const& negative_ttl = duration::from_seconds(5), size_t max_entries = 1000);
+
+	/// Removes all entries from the resolver cache
+	static void flush_cache();
+
+	/**
+	 * \brief Resolves the host in the background to populate the resolver cache
+	 *
+	 * Useful shortly before connecting to a known host, or to refresh entries before they
+	 * expire. Does nothing and returns false if the cache is disabled.
+	 */
+	static bool prefetch(thread_pool& pool, native_string const& host, address_type family = address_type::unknown);
+
 private:
 	class impl;
 	impl* impl_{};
@@ -6,6 +6,7 @@
 */
 
 #include "string.hpp"
+#include "time.hpp"
 
 #include <memory>
 #include <functional>
@@ -63,6 +64,24 @@ public:
 	/// For std::hash
 	std::size_t hash() const noexcept;
 
+#if !FZ_WINDOWS
+	/**
+	 * \brief Configures the process-wide cache of user and group information
+	 *
+	 * Creating a token looks up the user, its supplementary groups and possibly a group by name.
+	 * Depending on the system's name service configuration, this may involve slow queries to
+	 * a directory service. If enabled, successful lookups are cached for the given ttl, keyed
+	 * by name. Credentials are never cached, they get checked each time.
+	 *
+	 * If full, the least recently used entries get evicted. Passing a zero ttl disables the
+	 * cache, which is the default.
+	 */
+	static void set_cache(duration const& ttl, size_t max_entries = 1000);
+
+	/// Removes the cached information of the user, or everything if no name is given
+	static void flush_cache(native_string const& username = {});
+#endif
+
 private:
 	friend class impersonation_token_impl;
 	std::unique_ptr<impersonation_token_impl> impl_;
@@ -6,6 +6,9 @@
  */
 
 #include "event_handler.hpp"
+#include "unique_function.hpp"
+
+#include <memory>
 
 namespace fz {
 
@@ -13,7 +16,7 @@ namespace fz {
 struct invoker_event_type{};
 
 /// \private
-typedef simple_event<invoker_event_type, std::function<void()>> invoker_event;
+typedef simple_event<invoker_event_type, unique_function<void()>> invoker_event;
 
 /// \private
 class FZ_PUBLIC_SYMBOL thread_invoker final : public event_handler
@@ -29,9 +32,10 @@ public:
 template<typename... Args>
 std::function<void(Args...)> do_make_invoker(event_loop& loop, std::function<void(Args...)> && f)
 {
-	return [handler = thread_invoker(loop), f](Args&&... args) mutable {
+	// Shared, so that invoking does not copy the function
+	return [handler = thread_invoker(loop), f = std::make_shared<std::function<void(Args...)> const>(std::move(f))](Args&&... args) mutable {
 		auto cb = [f, targs = std::make_tuple(std::forward<Args>(args)...)] {
-			std::apply(f, targs);
+			std::apply(*f, targs);
 		};
 		handler.send_event<invoker_event>(std::move(cb));
 	};
@@ -58,7 +62,7 @@ auto make_invoker(event_loop& loop, F && f)
 template<typename F>
 auto make_invoker(event_handler& h, F && f)
 {
-	return do_make_invoker(h.event_loop_, decltype(get_func_type(&F::operator()))(std::forward<F>(f)));
+	return do_make_invoker(h.get_event_loop(), decltype(get_func_type(&F::operator()))(std::forward<F>(f)));
 }
 
 
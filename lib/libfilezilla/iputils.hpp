@@ -3,9 +3,11 @@
 
 #include "libfilezilla.hpp"
 #include <optional>
+#include <string_view>
+#include <vector>
 
 /** \file
- * \brief Various functions to deal with IP address strings
+ * \brief Various functions to deal with IP address strings, and binary IP addresses
  */
 
 namespace fz {
@@ -50,6 +52,143 @@ enum class address_type
 address_type FZ_PUBLIC_SYMBOL get_address_type(std::string_view const& address);
 address_type FZ_PUBLIC_SYMBOL get_address_type(std::wstring_view const& address);
 
+/**
+ * \brief A binary IPv4 or IPv6 address
+ *
+ * Cheap to copy, compare and hash, use it instead of address strings when addresses
+ * need to be looked up often, for example in a \ref cidr_set.
+ */
+class FZ_PUBLIC_SYMBOL ip_address final
+{
+public:
+	/// Creates an invalid address
+	ip_address() = default;
+
+	/// Parses the address, the result is invalid if the string is not an IPv4 or IPv6 address
+	explicit ip_address(std::string_view const& address);
+	explicit ip_address(std::wstring_view const& address);
+
+	/// Takes 4 or 16 bytes in network byte order, the result is invalid on other sizes
+	explicit ip_address(std::basic_string_view<uint8_t> const& bytes);
+
+	explicit operator bool() const {
+		return type_ != address_type::unknown;
+	}
+
+	/// Either address_type::ipv4, address_type::ipv6 or address_type::unknown if invalid
+	address_type type() const {
+		return type_;
+	}
+
+	/// Returns the address in network byte order, 4 bytes for IPv4 and 16 for IPv6
+	std::vector<uint8_t> bytes() const;
+
+	/// Returns the address as string, IPv6 addresses in their shortest form
+	std::string to_string() const;
+
+	/// For IPv4-mapped IPv6 addresses such as ::ffff:10.0.0.1, returns the IPv4 address. Otherwise returns a copy.
+	ip_address unmapped() const;
+
+	/// Returns a copy with all but the first prefix_length bits set to zero
+	ip_address masked(unsigned int prefix_length) const;
+
+	/// Binary equivalent of \ref is_routable_address
+	bool is_routable() const;
+
+	bool operator==(ip_address const& op) const {
+		return type_ == op.type_ && hi_ == op.hi_ && lo_ == op.lo_;
+	}
+
+	bool operator!=(ip_address const& op) const {
+		return !(*this == op);
+	}
+
+	/// Orders IPv4 addresses before IPv6 addresses
+	bool operator<(ip_address const& op) const {
+		if (type_ != op.type_) {
+			return type_ < op.type_;
+		}
+		if (hi_ != op.hi_) {
+			return hi_ < op.hi_;
+		}
+		return lo_ < op.lo_;
+	}
+
+	/// For std::hash
+	std::size_t hash() const noexcept;
+
+private:
+	friend class cidr_set;
+
+	// The address as 128bit big-endian number split into two halves.
+	// IPv4 addresses are in the upper 32 bits of hi_.
+	uint64_t hi_{};
+	uint64_t lo_{};
+	address_type type_{address_type::unknown};
+};
+
+/**
+ * \brief A set of IP networks
+ *
+ * Efficiently tests whether an address lies in any of the networks, e.g. to
+ * implement allow and deny lists.
+ *
+ * The networks are stored in a compressed binary trie, one for each address family. Each node
+ * holds a whole run of prefix bits, so lookups take time linear in the prefix length, regardless
+ * of the number of networks.
+ *
+ * Not thread-safe for modification, concurrent calls to contains are fine.
+ */
+class FZ_PUBLIC_SYMBOL cidr_set final
+{
+public:
+	/**
+	 * \brief Adds a network.
+	 *
+	 * Host bits of the address are ignored. Returns false if the address is invalid or if the
+	 * prefix length exceeds the address length.
+	 */
+	bool add(ip_address const& network, unsigned int prefix_length);
+
+	/**
+	 * \brief Adds a network in CIDR notation, e.g. 10.0.0.0/8 or 2001:db8::/32
+	 *
+	 * An address without a prefix length is added as a single host.
+	 */
+	bool add(std::string_view const& cidr);
+
+	/**
+	 * \brief Tests whether the address is in any of the networks.
+	 *
+	 * IPv4-mapped IPv6 addresses are matched against the IPv4 networks.
+	 */
+	bool contains(ip_address const& address) const;
+
+	bool empty() const {
+		return nodes_[0].empty() && nodes_[1].empty();
+	}
+
+	void clear();
+
+private:
+	struct node
+	{
+		uint64_t hi_;
+		uint64_t lo_;
+
+		// Indexes into nodes_, 0 if there is no child as the root cannot be a child
+		uint32_t children_[2];
+
+		uint8_t length_;
+
+		// Set if the prefix of this node has been added, not just a branching point
+		bool terminal_;
+	};
+
+	// IPv4 and IPv6
+	std::vector<node> nodes_[2];
+};
+
 struct FZ_PUBLIC_SYMBOL network_interface
 {
 	native_string name;
@@ -60,4 +199,18 @@ struct FZ_PUBLIC_SYMBOL network_interface
 std::optional<std::vector<network_interface>> FZ_PUBLIC_SYMBOL get_network_interfaces();
 }
 
+namespace std {
+
+/// \private
+template <>
+struct hash<fz::ip_address>
+{
+	std::size_t operator()(fz::ip_address const& op) const noexcept
+	{
+		return op.hash();
+	}
+};
+
+}
+
 #endif
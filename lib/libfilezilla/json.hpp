@@ -9,6 +9,7 @@
 #include <map>
 #include <type_traits>
 #include <variant>
+#include <vector>
 
 namespace fz {
 
@@ -24,6 +25,8 @@ enum class json_type {
 };
 
 class buffer;
+class buffer_chain;
+class json_value;
 
 /** \brief json parser/builder
  */
@@ -103,7 +106,10 @@ public:
 	/// Sets type to number and assigns value
 	template<typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<bool, typename std::decay_t<T>>, int> = 0>
 	json& operator=(T n) {
-		value_.emplace<std::size_t(json_type::number)>(fz::to_string(n));
+		auto & v = value_.emplace<std::size_t(json_type::number)>();
+		v.text_ = fz::to_string(n);
+		v.integer_ = static_cast<uint64_t>(n);
+		v.double_ = static_cast<double>(n);
 		return *this;
 	}
 
@@ -149,6 +155,18 @@ public:
 	 */
 	void to_string(std::string & ret, bool pretty = false, size_t depth = 0) const;
 
+	/** \brief Serializes JSON structure, appending to the buffer
+	 *
+	 * Produces the same output as the other overloads, without an intermediate string.
+	 */
+	void to_string(fz::buffer & ret, bool pretty = false, size_t depth = 0) const;
+
+	/** \brief Serializes JSON structure, appending to the chain
+	 *
+	 * The output is assembled in segments the chain adopts without copying.
+	 */
+	void to_string(fz::buffer_chain & ret, bool pretty = false, size_t depth = 0) const;
+
 	/** \brief Parses JSON structure from input.
 	 *
 	 * Returns none if there is any null-byte in the input
@@ -156,9 +174,37 @@ public:
 	static json parse(std::string_view const& v, size_t max_depth = 20);
 	static json parse(fz::buffer const& b, size_t max_depth = 20);
 
+	/** \brief Serializes the value as CBOR (RFC 8949), appending to the buffer
+	 *
+	 * Integral numbers fitting into 64 bits are encoded as integers, other numbers as
+	 * floating point values of the smallest size not losing precision.
+	 *
+	 * Children of objects with none type are ignored.
+	 * Children of arrays with none type are encoded as null.
+	 * A value of none type produces no output.
+	 */
+	void to_cbor(fz::buffer & out) const;
+
+	/** \brief Parses a single CBOR data item
+	 *
+	 * Follows the recommendations of RFC 8949 for converting CBOR to JSON: Tags are ignored,
+	 * byte strings become base64url-encoded strings, and undefined, NaN and infinities become null.
+	 * Maps must only have text strings as keys, which must be unique. Text strings are assumed to
+	 * be valid UTF-8.
+	 *
+	 * Returns none on invalid input, or if there is data after the item.
+	 * \sa cbor_decoder
+	 */
+	static json parse_cbor(std::string_view const& v, size_t max_depth = 20);
+	static json parse_cbor(fz::buffer const& b, size_t max_depth = 20);
+
 	void clear();
 
 private:
+	friend class cbor_decoder;
+	friend class json_pointer;
+	friend class json_value;
+
 	uint64_t number_value_integer() const;
 	double number_value_double() const;
 
@@ -166,6 +212,21 @@ private:
 	void FZ_PRIVATE_SYMBOL set_type(json_type t);
 
 	static json FZ_PRIVATE_SYMBOL parse(char const*& p, char const* end, size_t max_depth);
+	static json FZ_PRIVATE_SYMBOL parse_cbor(unsigned char const*& p, unsigned char const* end, size_t max_depth);
+
+	template<typename Writer>
+	void FZ_PRIVATE_SYMBOL write(Writer & out, bool pretty, size_t depth) const;
+
+	/// Numbers keep their textual form for exact output, their values are converted once up front
+	struct parsed_number final
+	{
+		parsed_number() = default;
+		explicit parsed_number(std::string && text);
+
+		std::string text_;
+		uint64_t integer_{};
+		double double_{};
+	};
 
 	typedef std::variant<
 		std::monostate,                           // json_type::none
@@ -173,12 +234,361 @@ private:
 		std::map<std::string, json, std::less<>>, // json_type::object
 		std::vector<json>,                        // json_type::array
 		std::string,                              // json_type::string,
-		std::string,                              // json_type::number,
+		parsed_number,                            // json_type::number,
 		bool                                      // json_type::boolean
 	> value_type;
 	value_type value_;
 };
 
+class json_document;
+
+/** \brief Read-only view of a value inside a \ref json_document
+ *
+ * Offers the same accessors as a const \ref json. Values are cheap to copy, they are
+ * merely a reference into the document. They become invalid once the document gets
+ * moved or destroyed.
+ */
+class FZ_PUBLIC_SYMBOL json_value final
+{
+public:
+	json_value() noexcept = default;
+
+	json_type type() const;
+
+	/// Returns string, number and boolean values as string
+	std::string string_value() const;
+
+	/// Returns string, number and boolean values as wstring
+	std::wstring wstring_value() const {
+		return fz::to_wstring_from_utf8(string_value());
+	}
+
+	/// Returns string and number values without copying them. Stays valid as long as the document.
+	std::string_view string_view() const;
+
+	/// Returns number and string values as the passed integer type
+	template<typename T, std::enable_if_t<std::is_integral_v<typename std::decay_t<T>>, int> = 0>
+	T number_value() const {
+		return static_cast<T>(number_value_integer());
+	}
+
+	/// Returns number and string values as the passed floating point type
+	template<typename T, std::enable_if_t<std::is_floating_point_v<typename std::decay_t<T>>, int> = 0>
+	T number_value() const {
+		return static_cast<T>(number_value_double());
+	}
+
+	/// Returns boolean and string values as bool
+	bool bool_value() const;
+
+	/// If object, get the value with the given name. Returns none if not object or name doesn't exist
+	json_value operator[](std::string_view const& name) const;
+
+	/// If array, get the value with the given index. Returns none if not array or index doesn't exist
+	json_value operator[](size_t i) const;
+
+	/// For arrays and objects, returns the number of elements
+	size_t children() const;
+
+	explicit operator bool() const { return type() != json_type::none; }
+
+	bool has_non_null_value() const {
+		return type() != fz::json_type::none && type() != fz::json_type::null;
+	}
+
+	bool is_null() const { return type() == fz::json_type::null; }
+	bool is_object() const { return type() == fz::json_type::object; }
+	bool is_array() const { return type() == fz::json_type::array; }
+	bool is_number() const { return type() == fz::json_type::number; }
+	bool is_boolean() const { return type() == fz::json_type::boolean; }
+
+	/// Serializes the value, producing the same output as \ref json::to_string
+	std::string to_string(bool pretty = false, size_t depth = 0) const;
+
+	/// Serializes the value, does not clear output string
+	void to_string(std::string & ret, bool pretty = false, size_t depth = 0) const;
+
+	/// Creates a modifiable copy of the value
+	json to_json() const;
+
+private:
+	friend class json_document;
+
+	json_value(json_document const* doc, uint32_t node)
+		: doc_(doc)
+		, node_(node)
+	{}
+
+	uint64_t number_value_integer() const;
+	double number_value_double() const;
+
+	json_document const* doc_{};
+	uint32_t node_{};
+};
+
+/** \brief Compact, read-only JSON DOM
+ *
+ * Unlike \ref json, which needs at least one allocation per value, a document keeps
+ * a copy of the input text and stores all values in a few flat arrays. Strings and
+ * numbers refer to the text unless they contain escape sequences, object members are
+ * kept sorted by name for binary search.
+ *
+ * Accepts the same input as \ref json::parse.
+ */
+class FZ_PUBLIC_SYMBOL json_document final
+{
+public:
+	json_document() noexcept = default;
+	json_document(json_document &&) noexcept = default;
+	json_document& operator=(json_document &&) noexcept = default;
+
+	json_document(json_document const&) = delete;
+	json_document& operator=(json_document const&) = delete;
+
+	/** \brief Parses JSON structure from input.
+	 *
+	 * On failure, the root is of type none.
+	 */
+	static json_document parse(std::string_view const& v, size_t max_depth = 20);
+	static json_document parse(fz::buffer const& b, size_t max_depth = 20);
+
+	/// The top-level value of the document
+	json_value root() const;
+
+	explicit operator bool() const { return !nodes_.empty(); }
+
+	/// Approximate number of bytes allocated by the document
+	size_t memory_usage() const;
+
+private:
+	friend class json_value;
+
+	struct node final
+	{
+		json_type type_{};
+
+		// Whether the string is in unescaped_ rather than text_
+		bool unescaped_{};
+
+		// Strings and numbers: Length
+		// Objects and arrays: Number of children
+		uint32_t size_{};
+
+		// Strings and numbers: Offset into text_ or unescaped_
+		// Objects: Index of the first member in members_
+		// Arrays: Index of the first element in elements_
+		// Booleans: The value
+		uint32_t offset_{};
+	};
+
+	struct member final
+	{
+		uint32_t name_offset_{};
+		uint32_t name_size_{};
+		uint32_t value_{};
+		bool unescaped_{};
+	};
+
+	std::string_view string(uint32_t offset, uint32_t size, bool unescaped) const {
+		return std::string_view((unescaped ? unescaped_ : text_).data() + offset, size);
+	}
+	std::string_view name(member const& m) const {
+		return string(m.name_offset_, m.name_size_, m.unescaped_);
+	}
+
+	bool FZ_PRIVATE_SYMBOL parse_value(char const*& p, size_t max_depth, uint32_t & out, std::vector<member> & member_stack, std::vector<uint32_t> & element_stack);
+	bool FZ_PRIVATE_SYMBOL parse_string(char const*& p, uint32_t & offset, uint32_t & size, bool & unescaped);
+
+	std::string text_;
+	std::string unescaped_;
+	std::vector<node> nodes_;
+	std::vector<member> members_;
+	std::vector<uint32_t> elements_;
+};
+
+/** \brief A precompiled JSON Pointer (RFC 6901)
+ *
+ * Splits and unescapes the path once, so that looking up deeply nested values does
+ * not need to construct any strings, unlike chained calls to \ref json::operator[].
+ *
+ * Example: json_pointer("/servers/0/name") refers to the name of the first server.
+ */
+class FZ_PUBLIC_SYMBOL json_pointer final
+{
+public:
+	/// The empty pointer, refers to the whole value
+	json_pointer() = default;
+
+	/// Parses the pointer. If it is not valid, e.g. not starting with a slash, the result is invalid too.
+	explicit json_pointer(std::string_view const& pointer);
+
+	explicit operator bool() const { return valid_; }
+
+	/// Returns the referenced value, or a value of type none if it does not exist or the pointer is invalid
+	json const& get(json const& j) const;
+	json_value get(json_value const& v) const;
+
+	/// Returns the referenced value, or nullptr if it does not exist. Unlike the non-const json::operator[], never inserts values.
+	json* find(json & j) const;
+
+	/// Number of reference tokens
+	size_t size() const { return tokens_.size(); }
+
+private:
+	struct token final
+	{
+		std::string name_;
+
+		// If the token is a valid array index
+		size_t index_{std::string::npos};
+	};
+
+	std::vector<token> tokens_;
+	bool valid_{true};
+};
+
+/** \brief Receives the events of a \ref json_stream_parser
+ *
+ * All callbacks return whether to continue parsing, the default implementations ignore the event.
+ * Passed strings are only valid for the duration of the callback.
+ */
+class FZ_PUBLIC_SYMBOL json_stream_handler
+{
+public:
+	virtual ~json_stream_handler() = default;
+
+	virtual bool on_object_begin() { return true; }
+	virtual bool on_object_end() { return true; }
+	virtual bool on_array_begin() { return true; }
+	virtual bool on_array_end() { return true; }
+
+	/// Inside objects, called with the name of each member before its value
+	virtual bool on_name(std::string_view const&) { return true; }
+
+	virtual bool on_string(std::string_view const&) { return true; }
+
+	/// Numbers are passed in their textual form, see \ref json::number_value for conversion
+	virtual bool on_number(std::string_view const&) { return true; }
+
+	virtual bool on_boolean(bool) { return true; }
+	virtual bool on_null() { return true; }
+};
+
+/** \brief Incremental, event-based JSON parser
+ *
+ * Accepts the input in arbitrarily split chunks, e.g. the buffers obtained from an
+ * \ref reader_base, and passes the contained values to a \ref json_stream_handler
+ * as soon as they are complete, without building a tree. Memory usage is bounded by
+ * the nesting depth and the size of the largest string or number.
+ *
+ * Accepts the same syntax as \ref json::parse, except that the input must consist
+ * of exactly one value and that duplicate names in objects are not detected.
+ */
+class FZ_PUBLIC_SYMBOL json_stream_parser final
+{
+public:
+	/// The handler needs to outlive the parser
+	explicit json_stream_parser(json_stream_handler & handler, size_t max_depth = 20);
+
+	/** \brief Parses the next chunk of input
+	 *
+	 * Returns false if the input is invalid or the handler aborted parsing.
+	 * All further calls fail then until \ref reset is called.
+	 */
+	bool feed(std::string_view const& data);
+	bool feed(fz::buffer const& b);
+
+	/// Signals the end of input, returns whether a complete value has been parsed
+	bool finish();
+
+	/// Prepares the parser for a new input
+	void reset();
+
+	bool failed() const { return state_ == state::failed; }
+
+private:
+	enum class state : unsigned char {
+		value,        // Expecting any value
+		array_first,  // Expecting a value or the end of the array
+		array_next,   // Expecting a comma or the end of the array
+		object_first, // Expecting a name or the end of the object
+		object_next,  // Expecting a comma or the end of the object
+		colon,
+		string,
+		number,
+		literal,
+		done,
+		failed
+	};
+
+	bool FZ_PRIVATE_SYMBOL begin_value(char c);
+	bool FZ_PRIVATE_SYMBOL end_container(bool object);
+	bool FZ_PRIVATE_SYMBOL end_value(bool cont);
+	bool FZ_PRIVATE_SYMBOL end_string(std::string_view raw);
+	bool FZ_PRIVATE_SYMBOL end_number(std::string_view v);
+	bool FZ_PRIVATE_SYMBOL fail();
+
+	json_stream_handler & handler_;
+	size_t const max_depth_;
+
+	state state_{state::value};
+
+	// For each open container whether it is an object
+	std::vector<bool> stack_;
+
+	// The part of the current string or number seen in previous chunks
+	std::string pending_;
+	std::string unescaped_;
+	bool name_{};
+	bool escape_{};
+	bool escaped_{};
+
+	char const* literal_{};
+	size_t literal_pos_{};
+};
+
+/** \brief Incremental decoder for sequences of CBOR data items (RFC 8742)
+ *
+ * Meant for messages exchanged through pipes or sockets: Append the received data to a
+ * buffer and call \ref decode until it returns none. Every byte is only examined once
+ * to find the end of an item, no matter how many chunks the item arrives in.
+ *
+ * Decodes items the same way as \ref json::parse_cbor.
+ */
+class FZ_PUBLIC_SYMBOL cbor_decoder final
+{
+public:
+	explicit cbor_decoder(size_t max_depth = 20);
+
+	/** \brief Decodes the next data item at the front of the buffer
+	 *
+	 * On success, the item gets consumed from the buffer. Returns none if the buffer does
+	 * not yet hold a complete item, or if the input is invalid, \sa failed.
+	 *
+	 * Between calls, data may only be appended to the buffer.
+	 */
+	json decode(fz::buffer & in);
+
+	/// Once failed, all further calls to decode fail until \ref reset is called
+	bool failed() const { return failed_; }
+
+	/// Prepares the decoder for a new input
+	void reset();
+
+private:
+	void FZ_PRIVATE_SYMBOL item_done();
+
+	size_t const max_depth_;
+
+	// For each open array or map the number of items still expected, or unknown_length
+	std::vector<uint64_t> stack_;
+
+	// Size of the well-formed prefix of the current item examined so far
+	size_t scanned_{};
+	bool complete_{};
+	bool failed_{};
+};
+
 template <bool isconst>
 struct json_array_iterator final {
 	using json_ref_t = std::conditional_t<isconst, json const&, json &>;
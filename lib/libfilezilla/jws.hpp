@@ -7,8 +7,13 @@
 
 #include "json.hpp"
 
+#include <memory>
+#include <vector>
+
 namespace fz {
 
+class thread_pool;
+
 /** \brief Creates a JWK pair
  *
  * Using EC key type with P-256 as algorithm.
@@ -28,6 +33,136 @@ std::pair<json, json> FZ_PUBLIC_SYMBOL create_jwk();
  * Does not use the JWS Unprotected Header.
  */
 json FZ_PUBLIC_SYMBOL jws_sign_flattened(json const& priv, json const& payload, json const& extra_protected = {});
+
+/** \brief A parsed private JWK, for signing many JWS with the same key
+ *
+ * Parsing a JWK imports the private key, derives the public key and its thumbprint, and
+ * encodes the protected header once. Keep the parsed key around instead of passing the JWK
+ * to jws_sign_flattened each time.
+ *
+ * Only supports EC keys using P-256. Signature algorithm is ES256.
+ *
+ * Copies are cheap, they share the parsed key. It can be used by multiple threads at once.
+ */
+class FZ_PUBLIC_SYMBOL jwk_signing_key final
+{
+public:
+	/** \brief Parses the private JWK
+	 *
+	 * Any values passed through an object in protected_header are included in the JWS protected
+	 * headers of all signatures made with the key.
+	 *
+	 * Returns an invalid key if the JWK is malformed or not supported.
+	 */
+	static jwk_signing_key from_jwk(json const& priv, json const& protected_header = {});
+
+	explicit operator bool() const {
+		return impl_ != nullptr;
+	}
+
+	/// The public key belonging to the private key
+	json const& public_jwk() const;
+
+	/// The \ref jwk_thumbprint of the public key
+	std::string const& thumbprint() const;
+
+	class impl;
+private:
+	friend json jws_sign_flattened(json const& priv, json const& payload, json const& extra_protected);
+	friend json jws_sign_flattened(jwk_signing_key const& key, json const& payload);
+
+	std::shared_ptr<impl const> impl_;
+};
+
+/// Same as the other overload, with the protected header of the parsed key
+json FZ_PUBLIC_SYMBOL jws_sign_flattened(jwk_signing_key const& key, json const& payload);
+
+/** \brief Signs many payloads at once
+ *
+ * The signatures are distributed across the workers of the thread pool, see
+ * \ref thread_pool::submit. Blocks until all are done, do not call from within one
+ * of the pool's workers.
+ *
+ * Returns the signatures in the order of the payloads. If the key is invalid, all are
+ * empty.
+ */
+std::vector<json> FZ_PUBLIC_SYMBOL jws_sign_flattened(jwk_signing_key const& key, std::vector<json> const& payloads, thread_pool & pool);
+
+/** \brief Computes the JWK Thumbprint as per RFC 7638
+ *
+ * Only supports EC keys. Returns the base64url-encoded SHA-256 thumbprint without padding,
+ * or an empty string if the key is not supported.
+ */
+std::string FZ_PUBLIC_SYMBOL jwk_thumbprint(json const& jwk);
+
+/** \brief A parsed public JWK, for verifying JWS signatures
+ *
+ * Parsing a JWK decodes the coordinates and checks that they are a point on the curve. Keep
+ * the parsed key around when verifying many signatures made with the same key.
+ *
+ * Only supports EC keys using P-256.
+ *
+ * Copies are cheap, they share the parsed key. It can be used by multiple threads at once.
+ */
+class FZ_PUBLIC_SYMBOL jwk_verification_key final
+{
+public:
+	/// Returns an invalid key if the JWK is malformed or not supported
+	static jwk_verification_key from_jwk(json const& jwk);
+
+	explicit operator bool() const {
+		return impl_ != nullptr;
+	}
+
+	/// The \ref jwk_thumbprint of the key
+	std::string const& thumbprint() const;
+
+	class impl;
+private:
+	friend bool jws_verify_flattened(json const& jws, jwk_verification_key const& pub, json * payload);
+
+	std::shared_ptr<impl const> impl_;
+};
+
+/** \brief Verifies a JWS in the flattened JSON representation
+ *
+ * Only supports the ES256 signature algorithm.
+ *
+ * Returns true iff the signature is valid. If so and if payload is not null, it receives the
+ * decoded payload. An empty payload, as used by ACME for POST-as-GET, yields an empty json.
+ */
+bool FZ_PUBLIC_SYMBOL jws_verify_flattened(json const& jws, jwk_verification_key const& pub, json * payload = nullptr);
+bool FZ_PUBLIC_SYMBOL jws_verify_flattened(json const& jws, json const& pub, json * payload = nullptr);
+
+/** \brief Bounded cache of parsed JWKs, keyed by thumbprint
+ *
+ * Useful when verifying tokens from a number of recurring signers. If full, the least
+ * recently used key gets evicted.
+ *
+ * Thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL jwk_cache final
+{
+public:
+	explicit jwk_cache(size_t max_entries = 64);
+	~jwk_cache();
+
+	jwk_cache(jwk_cache const&) = delete;
+	jwk_cache& operator=(jwk_cache const&) = delete;
+
+	/// Returns the parsed key, parsing it only if not yet cached
+	jwk_verification_key get(json const& jwk);
+
+	/// Looks up a key by its thumbprint, e.g. if used as key identifier. Returns an invalid key if not cached.
+	jwk_verification_key find(std::string_view const& thumbprint);
+
+	void clear();
+	size_t size() const;
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
 }
 
 #endif
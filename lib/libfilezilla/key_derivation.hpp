@@ -0,0 +1,120 @@
+#ifndef LIBFILEZILLA_KEY_DERIVATION_HEADER
+#define LIBFILEZILLA_KEY_DERIVATION_HEADER
+
+/** \file
+ * \brief Caching and asynchronous derivation of keys from passwords
+ */
+
+#include "libfilezilla.hpp"
+#include "encryption.hpp"
+#include "event_handler.hpp"
+#include "mutex.hpp"
+#include "time.hpp"
+
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace fz {
+
+/**
+ * \brief Bounded cache for the results of PBKDF2
+ *
+ * Key derivation from passwords is deliberately slow. If the same password gets derived
+ * repeatedly within a short time, e.g. when a client logs in over several connections,
+ * the cache avoids repeating the work.
+ *
+ * The entries are looked up by an HMAC of password, salt, iterations and length, keyed with
+ * a secret generated randomly for each cache. The cache does not contain the passwords
+ * themselves, nor unsalted hashes of them.
+ *
+ * Entries expire after the lifetime passed to the constructor. If the cache is full,
+ * the oldest entry gets evicted.
+ *
+ * Thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL key_derivation_cache final
+{
+public:
+	explicit key_derivation_cache(size_t max_entries = 64, duration const& lifetime = duration::from_minutes(5));
+	~key_derivation_cache();
+
+	key_derivation_cache(key_derivation_cache const&) = delete;
+	key_derivation_cache& operator=(key_derivation_cache const&) = delete;
+
+	/// Same as the free \ref fz::pbkdf2_hmac_sha256 function, but uses the cached result if possible
+	std::vector<uint8_t> pbkdf2_hmac_sha256(std::basic_string_view<uint8_t> const& password, std::basic_string_view<uint8_t> const& salt, size_t length, unsigned int iterations);
+
+	/// Removes all entries
+	void clear();
+
+	/// Returns the number of entries, including expired ones not yet removed
+	size_t size() const;
+
+private:
+	std::vector<uint8_t> lookup_key(std::basic_string_view<uint8_t> const& password, std::basic_string_view<uint8_t> const& salt, size_t length, unsigned int iterations) const;
+
+	size_t const max_entries_;
+	duration const lifetime_;
+	std::vector<uint8_t> const secret_;
+
+	mutable mutex mtx_{false};
+
+	struct entry final
+	{
+		std::vector<uint8_t> derived_;
+		monotonic_clock expiry_;
+	};
+	std::map<std::vector<uint8_t>, entry> entries_;
+};
+
+/**
+ * \brief Derives keys from passwords in a thread pool
+ *
+ * Derivation takes tens of milliseconds by design, too long to block an event loop.
+ * The result gets sent as \ref key_derivation_event to the event handler.
+ *
+ * Both the \ref symmetric_key and the \ref private_key corresponding to password and salt
+ * are derived, as returned by their from_password functions. Deriving both costs no more
+ * than deriving one of them.
+ */
+class FZ_PUBLIC_SYMBOL key_derivation final
+{
+public:
+	/// If a cache is passed, it needs to live longer than the key_derivation.
+	key_derivation(thread_pool & pool, event_handler & handler, key_derivation_cache * cache = nullptr);
+
+	/// Waits for a running derivation to finish, its result is discarded.
+	~key_derivation();
+
+	key_derivation(key_derivation const&) = delete;
+	key_derivation& operator=(key_derivation const&) = delete;
+
+	/**
+	 * \brief Starts deriving the keys
+	 *
+	 * If the function returns true, wait for the \ref key_derivation_event before calling it again.
+	 * Invalid parameters yield invalid keys in the event.
+	 */
+	bool derive(std::vector<uint8_t> const& password, std::vector<uint8_t> const& salt, unsigned int iterations = symmetric_key::min_iterations);
+	bool derive(std::string_view const& password, std::vector<uint8_t> const& salt, unsigned int iterations = symmetric_key::min_iterations) {
+		return derive(std::vector<uint8_t>(password.begin(), password.end()), salt, iterations);
+	}
+
+	/// Waits for a running derivation and discards its result, pending events get removed
+	void reset();
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
+
+/// \private
+struct key_derivation_event_type{};
+
+/// Result of \ref key_derivation
+typedef simple_event<key_derivation_event_type, key_derivation*, symmetric_key, private_key> key_derivation_event;
+
+}
+
+#endif
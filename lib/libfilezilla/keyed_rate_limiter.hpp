@@ -0,0 +1,81 @@
+#ifndef LIBFILEZILLA_KEYED_RATE_LIMITER_HEADER
+#define LIBFILEZILLA_KEYED_RATE_LIMITER_HEADER
+
+/** \file
+ * \brief Per-key rate limits, e.g. per IP address or per user
+ */
+
+#include "rate_limiter.hpp"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace fz {
+
+/**
+ * \brief A collection of rate limiters, one per key
+ *
+ * Lazily creates a \ref rate_limiter for each key, such as an IP address or a user name,
+ * and adds it to the parent limiter. All limiters of the collection share the same limits.
+ *
+ * Limiters are handed out as shared pointers, pass them to
+ * \ref compound_rate_limited_layer::add_limiter which keeps them alive while in use.
+ * Limiters not referenced outside of the collection are idle and get evicted once the
+ * number of keys reaches the maximum, or when calling \ref purge.
+ *
+ * Memory is bounded: If there are already max_keys limiters in use, e.g. during a scan
+ * from many distinct addresses, new keys share a single overflow limiter instead of
+ * getting their own. Removing the idle limiters takes time linear in the number of keys,
+ * it is done at most once for every max_keys / 16 new keys to amortize the cost.
+ *
+ * Thread-safe. The parent limiter needs to outlive the collection and all limiters
+ * handed out.
+ */
+class FZ_PUBLIC_SYMBOL keyed_rate_limiter final
+{
+public:
+	explicit keyed_rate_limiter(rate_limiter & parent, size_t max_keys = 10000);
+	~keyed_rate_limiter();
+
+	keyed_rate_limiter(keyed_rate_limiter const&) = delete;
+	keyed_rate_limiter& operator=(keyed_rate_limiter const&) = delete;
+
+	/// Returns the limiter for the key, creating it if needed. Never returns null.
+	std::shared_ptr<rate_limiter> get(std::string_view key);
+
+	/// Sets the limits of each limiter in the collection, \sa rate_limiter::set_limits
+	void set_limits(rate::type download_limit, rate::type upload_limit);
+
+	/// Removes all idle limiters.
+	void purge();
+
+	/// Returns the number of keys which have their own limiter
+	size_t size() const;
+
+private:
+	std::shared_ptr<rate_limiter> create();
+
+	// Removes the limiters not referenced outside of the collection
+	void evict();
+
+	mutable mutex mtx_{false};
+
+	rate_limiter & parent_;
+	size_t const max_keys_;
+
+	rate::type limits_[2]{rate::unlimited, rate::unlimited};
+
+	std::unordered_map<std::string, std::shared_ptr<rate_limiter>> limiters_;
+
+	// Shared by all keys that do not fit
+	std::shared_ptr<rate_limiter> overflow_;
+
+	// New keys since the last eviction
+	size_t misses_{};
+};
+
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef LIBFILEZILLA_LISTEN_SOCKET_GROUP_HEADER
+#define LIBFILEZILLA_LISTEN_SOCKET_GROUP_HEADER
+
+/** \file
+ * \brief Declares \ref fz::listen_socket_group
+ */
+
+#include "socket.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace fz {
+
+class reactor;
+
+/**
+ * \brief Listens on a single address and port using multiple listen sockets
+ *
+ * Each shard is a \ref listen_socket with its own event handler, typically one per
+ * \ref event_loop, so that accepting connections is spread across multiple threads.
+ *
+ * Where supported, each shard gets its own descriptor bound with SO_REUSEPORT, letting the
+ * kernel distribute incoming connections. Elsewhere, the shards share a single descriptor
+ * and whichever shard is first to accept gets the connection. On Windows, only a single
+ * shard is used.
+ *
+ * Handlers should use \ref listen_socket::accept_pending to drain all pending connections
+ * on each connection event.
+ */
+class FZ_PUBLIC_SYMBOL listen_socket_group final
+{
+public:
+	/// Creates one shard for each of the handlers
+	listen_socket_group(thread_pool & pool, std::vector<event_handler*> const& handlers);
+
+	/// Creates one shard for each of the handlers, waiting for events through the reactor
+	listen_socket_group(reactor & r, std::vector<event_handler*> const& handlers);
+
+	~listen_socket_group();
+
+	listen_socket_group(listen_socket_group const&) = delete;
+	listen_socket_group& operator=(listen_socket_group const&) = delete;
+
+	/// Binds all shards to the given local IP, \sa socket_base::bind
+	bool bind(std::string const& address);
+
+	/**
+	 * \brief Starts listening on all shards.
+	 *
+	 * If no port is given, the operating system picks one for the first shard and the
+	 * others use the same.
+	 *
+	 * On success, shards that could not be used get removed.
+	 */
+	int listen(address_type family, int port = 0);
+
+	/// The number of shards
+	size_t size() const { return shards_.size(); }
+
+	listen_socket& operator[](size_t i) { return *shards_[i]; }
+
+	/// Whether the kernel distributes connections across separate descriptors
+	bool reuse_port() const { return reuse_port_; }
+
+	int local_port(int& error) const;
+
+private:
+	std::vector<std::unique_ptr<listen_socket>> shards_;
+	bool reuse_port_{};
+};
+
+}
+
+#endif
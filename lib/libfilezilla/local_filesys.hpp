@@ -11,11 +11,33 @@
 #include <dirent.h>
 #endif
 
+#include <functional>
+#include <type_traits>
+#include <vector>
+
 /** \file
  * \brief Declares local_filesys class to enumerate local files and query their metadata such as type, size and modification time.
  */
 namespace fz {
 
+class path_builder;
+
+/// Metadata \ref local_filesys::get_next_files queries in addition to the name
+enum class dir_entry_fields : unsigned {
+	none = 0x0,
+	type = 0x1,
+	size = 0x2,
+	mtime = 0x4,
+	mode = 0x8,
+	all = 0xf
+};
+inline bool operator&(dir_entry_fields lhs, dir_entry_fields rhs) {
+	return (static_cast<std::underlying_type_t<dir_entry_fields>>(lhs) & static_cast<std::underlying_type_t<dir_entry_fields>>(rhs)) != 0;
+}
+inline dir_entry_fields operator|(dir_entry_fields lhs, dir_entry_fields rhs) {
+	return static_cast<dir_entry_fields>(static_cast<std::underlying_type_t<dir_entry_fields>>(lhs) | static_cast<std::underlying_type_t<dir_entry_fields>>(rhs));
+}
+
 /**
  * \brief This class can be used to enumerate the contents of local directories and to query
  * the metadata of files.
@@ -60,6 +82,7 @@ public:
 	///
 	/// Can optionally follow symbolic links.
 	static type get_file_type(native_string const& path, bool follow_links = false);
+	static type get_file_type(path_builder const& path, bool follow_links = false);
 
 	/**
 	 * \brief Gets the info for the passed arguments.
@@ -70,9 +93,11 @@ public:
 	 * The returned type can only be \c type::link if \c follow_links is \c false.
 	 */
 	static type get_file_info(native_string const& path, bool &is_link, int64_t* size, datetime* modification_time, int* mode, bool follow_links = true);
+	static type get_file_info(path_builder const& path, bool &is_link, int64_t* size, datetime* modification_time, int* mode, bool follow_links = true);
 
 	/// Gets size of file, returns -1 on error.
 	static int64_t get_size(native_string const& path, bool *is_link = nullptr);
+	static int64_t get_size(path_builder const& path, bool *is_link = nullptr);
 
 	/// \brief Begins enumerating a directory.
 	///
@@ -109,6 +134,33 @@ public:
 	 */
 	bool get_next_file(native_string& name, bool &is_link, type & t, int64_t* size, datetime* modification_time, int* mode);
 
+	/// A directory entry as returned by \ref get_next_files
+	struct dir_entry final
+	{
+		native_string name;
+		type t{unknown};
+		bool is_link{};
+		int64_t size{-1};
+		datetime mtime;
+		int mode{};
+	};
+
+	/**
+	 * \brief Gets the next batch of files in the directory. Call until it returns false.
+	 *
+	 * Replaces the contents of \c entries with up to \c max_entries entries. Returns false once
+	 * the end of the directory has been reached.
+	 *
+	 * Only the requested fields are queried, the others keep their default values. The type and
+	 * whether an entry is a link are filled in whenever the directory listing itself provides them.
+	 * Where possible, the listing is read in large chunks and files only get stat'ed if the
+	 * requested fields make it necessary, making this considerably faster than \ref get_next_file
+	 * for large directories.
+	 *
+	 * Do not mix calls to get_next_file and get_next_files during the same enumeration.
+	 */
+	bool get_next_files(std::vector<dir_entry> & entries, size_t max_entries = 1024, dir_entry_fields fields = dir_entry_fields::all);
+
 	/// Ends enumerating files. Automatically called in the destructor.
 	void end_find_files();
 
@@ -119,13 +171,17 @@ public:
 	static native_string get_link_target(native_string const& path);
 
 private:
+	std::vector<unsigned char> buffer_;
 #ifdef FZ_WINDOWS
 	bool FZ_PRIVATE_SYMBOL check_buffer();
-	std::vector<unsigned char> buffer_;
 	unsigned char* cur_{};
 	HANDLE dir_{INVALID_HANDLE_VALUE};
 #else
 	DIR* dir_{};
+
+	// Unprocessed part of buffer_ in get_next_files
+	size_t buffer_pos_{};
+	size_t buffer_len_{};
 #endif
 
 	// State for directory enumeration
@@ -187,6 +243,29 @@ result FZ_PUBLIC_SYMBOL remove_dir(native_string const& absolute_path);
  */
 result FZ_PUBLIC_SYMBOL rename_file(native_string const& source, native_string const& dest, bool allow_copy = true);
 
+/**
+ * \brief Reports the progress of \ref copy_file
+ *
+ * Gets called with the number of octets copied so far and the size of the file.
+ * Return false to cancel the copy.
+ */
+typedef std::function<bool(int64_t copied, int64_t size)> copy_progress_callback;
+
+/**
+ * \brief Copies a file
+ *
+ * If the target file exists, it is overwritten.
+ *
+ * Avoids copying the data through userspace where possible. If the filesystem supports it,
+ * the copy shares the data blocks of the source (FICLONE on Linux, clonefile on macOS).
+ * Otherwise Linux copies in the kernel using copy_file_range, which on network file systems
+ * can also happen on the server. On Windows, CopyFileEx is used, which does the same for
+ * SMB shares.
+ *
+ * If the copy fails or gets cancelled, the partially written target file is removed.
+ */
+result FZ_PUBLIC_SYMBOL copy_file(native_string const& source, native_string const& dest, copy_progress_callback const& progress = {});
+
 }
 
 #endif
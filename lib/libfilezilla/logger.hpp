@@ -8,6 +8,9 @@
 #include "format.hpp"
 
 #include <atomic>
+#include <cstddef>
+#include <new>
+#include <tuple>
 
 namespace fz {
 namespace logmsg
@@ -39,6 +42,272 @@ namespace logmsg
 	};
 }
 
+/// \cond
+namespace detail {
+inline bool is_ascii(std::string_view const& s)
+{
+	for (auto const c : s) {
+		if (static_cast<unsigned char>(c) >= 0x80) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Converts from the locale's encoding to UTF-8. ASCII is the same in both.
+inline std::string native_to_utf8(std::string_view const& s)
+{
+	if (is_ascii(s)) {
+		return std::string(s);
+	}
+	return fz::to_utf8(s);
+}
+
+// A narrow string argument in the locale's encoding, as UTF-8
+class utf8_log_arg final
+{
+public:
+	explicit utf8_log_arg(std::string_view const& s)
+	{
+		if (is_ascii(s)) {
+			view_ = s;
+		}
+		else {
+			converted_ = fz::to_utf8(s);
+			view_ = converted_;
+		}
+	}
+
+	utf8_log_arg(utf8_log_arg const&) = delete;
+	utf8_log_arg& operator=(utf8_log_arg const&) = delete;
+
+	operator std::string_view() const {
+		return view_;
+	}
+
+private:
+	std::string converted_;
+	std::string_view view_;
+};
+
+// Prepares a log argument for formatting into Out. If Utf8 is set, narrow strings are in UTF-8,
+// otherwise in the locale's encoding.
+template<typename Out, bool Utf8, typename Arg>
+decltype(auto) log_arg(Arg const& arg)
+{
+	if constexpr (std::is_convertible_v<Arg const&, std::string_view>) {
+		if constexpr (std::is_same_v<Out, std::wstring>) {
+			if constexpr (Utf8) {
+				return fz::to_wstring_from_utf8(std::string_view(arg));
+			}
+			else {
+				return arg;
+			}
+		}
+		else if constexpr (Utf8) {
+			return std::string_view(arg);
+		}
+		else {
+			return utf8_log_arg(std::string_view(arg));
+		}
+	}
+	else if constexpr (std::is_convertible_v<Arg const&, std::wstring_view> && std::is_same_v<Out, std::string>) {
+		return fz::to_utf8(std::wstring_view(arg));
+	}
+	else {
+		return arg;
+	}
+}
+
+// Formats a log message into UTF-8
+template<bool Utf8, typename Format, typename... Args>
+std::string format_log_utf8(Format const& fmt, Args const&... args)
+{
+	if constexpr (!parsed_format_v<Format>.ascii) {
+		// Literal text of the format string is in the locale's encoding
+		return fz::to_utf8(do_sprintf_compiled<std::wstring>(fmt, log_arg<std::wstring, Utf8>(args)...));
+	}
+	else {
+		return do_sprintf_compiled<std::string>(fmt, log_arg<std::string, Utf8>(args)...);
+	}
+}
+
+// How log arguments are stored in a deferred_log_message
+template<typename Arg>
+auto capture_log_arg(Arg && arg)
+{
+	typedef std::decay_t<Arg> A;
+	if constexpr (std::is_convertible_v<Arg, std::string_view>) {
+		return std::string(std::forward<Arg>(arg));
+	}
+	else if constexpr (std::is_convertible_v<Arg, std::wstring_view>) {
+		return std::wstring(std::forward<Arg>(arg));
+	}
+	else if constexpr (std::is_trivially_copyable_v<A>) {
+		return A(arg);
+	}
+	else {
+		// Cannot be kept around cheaply, convert right away
+		return toString<std::wstring>(std::forward<Arg>(arg));
+	}
+}
+}
+/// \endcond
+
+/**
+ * \brief A log message whose formatting has been deferred
+ *
+ * Created by \ref logger_interface::log and \ref logger_interface::log_u for format strings
+ * wrapped in \ref FZ_FORMAT if the logger has asked for it by setting
+ * \ref logger_interface::deferred_formatting_.
+ *
+ * Instead of the formatted message, it holds a compact record of the arguments: Trivially
+ * copyable arguments such as integers are stored by value, strings are copied once. The
+ * format string itself is part of the type and needs no storage. Small records are stored
+ * inline without allocating memory.
+ *
+ * Formatting can then happen later on, e.g. on a background thread, see \ref async_logger.
+ * Note that narrow character pointers are captured as strings, so they cannot be used
+ * with the %p specifier.
+ */
+class deferred_log_message final
+{
+public:
+	deferred_log_message() noexcept = default;
+
+	~deferred_log_message() {
+		reset();
+	}
+
+	deferred_log_message(deferred_log_message && op) noexcept {
+		take(op);
+	}
+
+	deferred_log_message& operator=(deferred_log_message && op) noexcept {
+		if (this != &op) {
+			reset();
+			take(op);
+		}
+		return *this;
+	}
+
+	/**
+	 * \brief Captures the arguments.
+	 *
+	 * If Utf8 is set, narrow string arguments are in UTF-8, otherwise they are in the locale's encoding.
+	 */
+	template<bool Utf8, typename Format, typename... Args>
+	static deferred_log_message capture(Format const&, Args&&... args)
+	{
+		typedef std::tuple<decltype(detail::capture_log_arg(std::forward<Args>(args)))...> record;
+
+		deferred_log_message ret;
+		ret.ops_ = &ops_for<Utf8, Format, record>::ops;
+		if constexpr (fits_inline<record>()) {
+			ret.data_ = new (ret.storage_) record(detail::capture_log_arg(std::forward<Args>(args))...);
+		}
+		else {
+			ret.data_ = new record(detail::capture_log_arg(std::forward<Args>(args))...);
+		}
+		return ret;
+	}
+
+	explicit operator bool() const {
+		return ops_ != nullptr;
+	}
+
+	/// Identifies the format string, messages sharing format string and argument types have the same id
+	void const* format_id() const {
+		return ops_;
+	}
+
+	/// Formats the message the same way as \ref logger_interface::log would have
+	std::wstring format() const {
+		return ops_ ? ops_->format(data_) : std::wstring();
+	}
+
+	/// Formats the message into UTF-8, without converting to std::wstring first
+	std::string format_utf8() const {
+		return ops_ ? ops_->format_utf8(data_) : std::string();
+	}
+
+private:
+	static constexpr size_t inline_size = 64;
+
+	template<typename Record>
+	static constexpr bool fits_inline() {
+		return sizeof(Record) <= inline_size && alignof(Record) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Record>;
+	}
+
+	struct operations final
+	{
+		std::wstring (*format)(void const*);
+		std::string (*format_utf8)(void const*);
+
+		// Null for records on the heap
+		void (*move)(void* dst, void* src) noexcept;
+
+		void (*destroy)(void*) noexcept;
+	};
+
+	template<bool Utf8, typename Format, typename Record>
+	struct ops_for final
+	{
+		static std::wstring format(void const* p) {
+			return std::apply([](auto const&... args) {
+				return detail::do_sprintf_compiled<std::wstring>(Format{}, detail::log_arg<std::wstring, Utf8>(args)...);
+			}, *static_cast<Record const*>(p));
+		}
+
+		static std::string format_utf8(void const* p) {
+			return std::apply([](auto const&... args) {
+				return detail::format_log_utf8<Utf8>(Format{}, args...);
+			}, *static_cast<Record const*>(p));
+		}
+
+		static void move(void* dst, void* src) noexcept {
+			new (dst) Record(std::move(*static_cast<Record*>(src)));
+			static_cast<Record*>(src)->~Record();
+		}
+
+		static void destroy(void* p) noexcept {
+			if constexpr (fits_inline<Record>()) {
+				static_cast<Record*>(p)->~Record();
+			}
+			else {
+				delete static_cast<Record*>(p);
+			}
+		}
+
+		static constexpr operations ops{&format, &format_utf8, fits_inline<Record>() ? &move : nullptr, &destroy};
+	};
+
+	void reset() noexcept {
+		if (ops_) {
+			ops_->destroy(data_);
+			ops_ = nullptr;
+			data_ = nullptr;
+		}
+	}
+
+	void take(deferred_log_message & op) noexcept {
+		ops_ = op.ops_;
+		if (ops_ && ops_->move) {
+			ops_->move(storage_, op.data_);
+			data_ = storage_;
+		}
+		else {
+			data_ = op.data_;
+		}
+		op.ops_ = nullptr;
+		op.data_ = nullptr;
+	}
+
+	operations const* ops_{};
+	void* data_{};
+	alignas(std::max_align_t) unsigned char storage_[inline_size];
+};
+
 /**
  * \brief Abstract interface for logging strings.
  *
@@ -61,7 +330,28 @@ public:
 	virtual void do_log(logmsg::type t, std::wstring && msg) = 0;
 
 	/**
-	 * The \arg fmt argument is a format string suitable for fz::sprintf
+	 * \brief Receives messages in UTF-8
+	 *
+	 * Only called if \ref prefers_utf8_ is set. Override it if the log ends up in UTF-8 anyhow,
+	 * e.g. in a file or on a Unix terminal, to avoid converting to std::wstring and back.
+	 *
+	 * The default implementation converts the message and passes it to \ref do_log.
+	 */
+	virtual void do_log_utf8(logmsg::type t, std::string && msg);
+
+	/**
+	 * \brief Receives messages whose formatting has been deferred
+	 *
+	 * Only called if \ref deferred_formatting_ is set, for messages with a format string
+	 * wrapped in \ref FZ_FORMAT.
+	 *
+	 * The default implementation formats the message and passes it to \ref do_log_utf8
+	 * or \ref do_log.
+	 */
+	virtual void do_log_deferred(logmsg::type t, deferred_log_message && msg);
+
+	/**
+	 * The \arg fmt argument is a format string suitable for fz::sprintf, or one wrapped in \ref FZ_FORMAT
 	 *
 	 * Assumes that all narrow string arguments are in the locale's current encoding.
 	 */
@@ -69,13 +359,26 @@ public:
 	void log(logmsg::type t, String&& fmt, Args&& ...args)
 	{
 		if (should_log(t)) {
-			std::wstring formatted = fz::sprintf(fz::to_wstring(std::forward<String>(fmt)), args...);
-			do_log(t, std::move(formatted));
+			if constexpr (detail::is_format_string_v<String>) {
+				if (deferred_formatting_) {
+					do_log_deferred(t, deferred_log_message::capture<false>(fmt, std::forward<Args>(args)...));
+				}
+				else if (prefers_utf8_) {
+					do_log_utf8(t, detail::format_log_utf8<false>(fmt, args...));
+				}
+				else {
+					do_log(t, detail::do_sprintf_compiled<std::wstring>(fmt, args...));
+				}
+			}
+			else {
+				std::wstring formatted = fz::sprintf(fz::to_wstring(std::forward<String>(fmt)), args...);
+				do_log(t, std::move(formatted));
+			}
 		}
 	}
 
 	/**
-	 * The \arg fmt argument is a format string suitable for fz::sprintf
+	 * The \arg fmt argument is a format string suitable for fz::sprintf, or one wrapped in \ref FZ_FORMAT
 	 *
 	 * Assumes that all narrow string arguments, excluding the format string, are in UTF-8
 	 */
@@ -83,8 +386,21 @@ public:
 	void log_u(logmsg::type t, String&& fmt, Args const& ...args)
 	{
 		if (should_log(t)) {
-			std::wstring formatted = fz::sprintf(fz::to_wstring(std::forward<String>(fmt)), assume_strings_are_utf8(args)...);
-			do_log(t, std::move(formatted));
+			if constexpr (detail::is_format_string_v<String>) {
+				if (deferred_formatting_) {
+					do_log_deferred(t, deferred_log_message::capture<true>(fmt, args...));
+				}
+				else if (prefers_utf8_) {
+					do_log_utf8(t, detail::format_log_utf8<true>(fmt, args...));
+				}
+				else {
+					do_log(t, detail::do_sprintf_compiled<std::wstring>(fmt, assume_strings_are_utf8(args)...));
+				}
+			}
+			else {
+				std::wstring formatted = fz::sprintf(fz::to_wstring(std::forward<String>(fmt)), assume_strings_are_utf8(args)...);
+				do_log(t, std::move(formatted));
+			}
 		}
 	}
 
@@ -93,6 +409,12 @@ public:
 	void log_raw(logmsg::type t, String&& msg)
 	{
 		if (should_log(t)) {
+			if constexpr (std::is_convertible_v<String, std::string_view>) {
+				if (prefers_utf8_) {
+					do_log_utf8(t, detail::native_to_utf8(msg));
+					return;
+				}
+			}
 			std::wstring formatted = fz::to_wstring(std::forward<String>(msg));
 			do_log(t, std::move(formatted));
 		}
@@ -136,6 +458,12 @@ public:
 protected:
 	std::atomic<uint64_t> level_{logmsg::status | logmsg::error | logmsg::command | logmsg::reply};
 
+	/// Set in the constructor of loggers overriding \ref do_log_utf8
+	bool prefers_utf8_{};
+
+	/// Set in the constructor of loggers that want to format messages themselves, see \ref do_log_deferred
+	bool deferred_formatting_{};
+
 private:
 	std::wstring assume_strings_are_utf8(std::string_view const& arg) {
 		return fz::to_wstring_from_utf8(arg);
@@ -173,7 +501,10 @@ null_logger FZ_PUBLIC_SYMBOL & get_null_logger();
 class FZ_PUBLIC_SYMBOL stdout_logger final : public logger_interface
 {
 public:
+	stdout_logger();
+
 	virtual void do_log(logmsg::type, std::wstring &&) override;
+	virtual void do_log_utf8(logmsg::type, std::string &&) override;
 };
 
 
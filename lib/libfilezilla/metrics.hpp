@@ -0,0 +1,219 @@
+#ifndef LIBFILEZILLA_METRICS_HEADER
+#define LIBFILEZILLA_METRICS_HEADER
+
+/** \file
+ * \brief A registry of metrics that can be exposed in the OpenMetrics text format
+ *
+ * Declares \ref fz::metrics_registry and the metric types it holds.
+ */
+
+#include "libfilezilla.hpp"
+#include "mutex.hpp"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace fz {
+
+class aio_buffer_pool;
+class buffer;
+class event_loop;
+class rate_limit_manager;
+class thread_pool;
+
+/// Name/value pairs identifying one metric of a family, e.g. {{"direction", "inbound"}}
+typedef std::vector<std::pair<std::string, std::string>> metric_labels;
+
+/// \private
+constexpr size_t metric_shards = 16;
+
+/**
+ * \brief A monotonically increasing counter
+ *
+ * Updates are lock-free and sharded per thread, so that threads updating the same counter
+ * do not contend for a cache line. Reading sums up the shards.
+ */
+class FZ_PUBLIC_SYMBOL metric_counter final
+{
+public:
+	metric_counter() = default;
+	metric_counter(metric_counter const&) = delete;
+	metric_counter& operator=(metric_counter const&) = delete;
+
+	void add(uint64_t v = 1);
+
+	uint64_t value() const;
+
+private:
+	struct alignas(64) shard final
+	{
+		std::atomic<uint64_t> v_{};
+	};
+	shard shards_[metric_shards];
+};
+
+/// \brief A value that can go up and down, e.g. the number of open connections. Updates are lock-free.
+class FZ_PUBLIC_SYMBOL metric_gauge final
+{
+public:
+	metric_gauge() = default;
+	metric_gauge(metric_gauge const&) = delete;
+	metric_gauge& operator=(metric_gauge const&) = delete;
+
+	void set(int64_t v) { v_.store(v, std::memory_order_relaxed); }
+	void add(int64_t v) { v_.fetch_add(v, std::memory_order_relaxed); }
+	void sub(int64_t v) { v_.fetch_sub(v, std::memory_order_relaxed); }
+
+	int64_t value() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<int64_t> v_{};
+};
+
+/**
+ * \brief Counts observations into buckets with fixed upper bounds
+ *
+ * Like \ref metric_counter, updates are lock-free and sharded per thread.
+ */
+class FZ_PUBLIC_SYMBOL metric_histogram final
+{
+public:
+	/// The upper bounds of the buckets, in increasing order. An implicit last bucket takes all larger values.
+	explicit metric_histogram(std::vector<uint64_t> const& bounds);
+	~metric_histogram();
+
+	metric_histogram(metric_histogram const&) = delete;
+	metric_histogram& operator=(metric_histogram const&) = delete;
+
+	void observe(uint64_t v);
+
+	std::vector<uint64_t> const& bounds() const { return bounds_; }
+
+	/// Counts per bucket, not cumulative. Has one more entry than there are bounds.
+	std::vector<uint64_t> counts() const;
+
+	/// Sum of all observed values
+	uint64_t sum() const;
+
+private:
+	std::vector<uint64_t> const bounds_;
+
+	// Per shard, the bucket counts followed by the sum, padded to whole cache lines
+	size_t stride_{};
+	std::atomic<uint64_t>* values_{};
+};
+
+/**
+ * \brief Receives the values reported by collectors, \sa metrics_registry::add_collector
+ *
+ * Counters passed here are reported with the _total suffix, do not include it in the name.
+ */
+class FZ_PUBLIC_SYMBOL metrics_sink
+{
+public:
+	virtual ~metrics_sink() = default;
+
+	virtual void counter(std::string_view name, std::string_view help, metric_labels const& labels, uint64_t value) = 0;
+	virtual void gauge(std::string_view name, std::string_view help, metric_labels const& labels, int64_t value) = 0;
+};
+
+/**
+ * \brief A central place for metrics of all kinds of subsystems
+ *
+ * Metrics are grouped into families by name, the metrics of a family differ by their labels.
+ * Names must consist of letters, digits, underscores and colons and must not start with a digit.
+ * Counter names must not end in _total, it is appended on exposition.
+ *
+ * Metrics created through the registry live as long as the registry. Updating them is lock-free,
+ * creating them and writing the exposition take a lock.
+ *
+ * Subsystems that keep statistics of their own, such as \ref event_loop or \ref thread_pool,
+ * can be reported by collectors, which are invoked whenever the exposition is written.
+ * See \ref add_event_loop_metrics and the other functions below for ready-made collectors.
+ */
+class FZ_PUBLIC_SYMBOL metrics_registry final
+{
+public:
+	/// Gets called with a sink to report current values to
+	typedef std::function<void(metrics_sink & sink)> collector;
+
+	metrics_registry();
+	~metrics_registry();
+
+	metrics_registry(metrics_registry const&) = delete;
+	metrics_registry& operator=(metrics_registry const&) = delete;
+
+	/**
+	 * \brief Returns the counter with the given name and labels, creating it if needed.
+	 *
+	 * Returns nullptr if the name is invalid or already used by a metric of a different type.
+	 */
+	metric_counter* counter(std::string_view name, std::string_view help, metric_labels const& labels = {});
+
+	/// \sa counter
+	metric_gauge* gauge(std::string_view name, std::string_view help, metric_labels const& labels = {});
+
+	/**
+	 * \brief Returns the histogram with the given name and labels, creating it if needed.
+	 *
+	 * All histograms of a family use the bounds passed when creating the first one.
+	 * Returns nullptr if the name is invalid or already used by a metric of a different type.
+	 */
+	metric_histogram* histogram(std::string_view name, std::string_view help, std::vector<uint64_t> const& bounds, metric_labels const& labels = {});
+
+	/**
+	 * \brief Adds a collector, returns an id to remove it again.
+	 *
+	 * Collectors are called while the registry is locked, they must not call into the registry.
+	 * Metrics reported by collectors must not clash with metrics created through the registry.
+	 */
+	size_t add_collector(collector && c);
+	void remove_collector(size_t id);
+
+	/**
+	 * \brief Appends the current values of all metrics to the buffer in the OpenMetrics text format.
+	 *
+	 * Serve it with the content type application/openmetrics-text; version=1.0.0; charset=utf-8
+	 */
+	void write_openmetrics(buffer & out) const;
+
+private:
+	struct family;
+
+	// Returns the family, creating it if needed. nullptr on invalid names or type mismatch.
+	family* get_family(std::string_view name, std::string_view help, int type, std::vector<uint64_t> const* bounds);
+
+	mutable mutex mtx_{false};
+	std::map<std::string, std::unique_ptr<family>, std::less<>> families_;
+	std::map<size_t, collector> collectors_;
+	size_t next_collector_{};
+};
+
+/**
+ * \brief Reports the statistics of an event loop, \sa event_loop::get_stats
+ *
+ * Per-type statistics are only available if instrumentation is enabled on the loop.
+ * The loop must outlive the collector. Returns the id of the collector.
+ */
+size_t FZ_PUBLIC_SYMBOL add_event_loop_metrics(metrics_registry & registry, event_loop & loop, metric_labels const& labels = {});
+
+/// \brief Reports the statistics and, if enabled, the accounting of a thread pool, \sa add_event_loop_metrics
+size_t FZ_PUBLIC_SYMBOL add_thread_pool_metrics(metrics_registry & registry, thread_pool & pool, metric_labels const& labels = {});
+
+/// \brief Reports the process-wide TLS statistics, \sa get_tls_stats
+size_t FZ_PUBLIC_SYMBOL add_tls_metrics(metrics_registry & registry, metric_labels const& labels = {});
+
+/// \brief Reports the statistics of a rate limit manager, \sa add_event_loop_metrics
+size_t FZ_PUBLIC_SYMBOL add_rate_limit_metrics(metrics_registry & registry, rate_limit_manager & mgr, metric_labels const& labels = {});
+
+/// \brief Reports the statistics of a buffer pool, \sa add_event_loop_metrics
+size_t FZ_PUBLIC_SYMBOL add_aio_buffer_pool_metrics(metrics_registry & registry, aio_buffer_pool & pool, metric_labels const& labels = {});
+}
+
+#endif
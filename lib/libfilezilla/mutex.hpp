@@ -52,6 +52,29 @@ class FZ_PUBLIC_SYMBOL mutex final
 {
 public:
 	explicit mutex(bool recursive = true);
+
+	/// \private
+	struct adaptive_tag final {};
+
+	/// Pass to the constructor to create an adaptive mutex
+	static constexpr adaptive_tag adaptive{};
+
+	/**
+	 * \brief Creates a non-recursive mutex that spins for a bounded time on contention before sleeping
+	 *
+	 * For critical sections that are held only very briefly, such as queue manipulations, going to sleep
+	 * and getting woken up costs more than waiting for the owner to release the mutex.
+	 *
+	 * With glibc, this is a PTHREAD_MUTEX_ADAPTIVE_NP mutex, the spin count can be tuned through the
+	 * glibc.pthread.mutex_spin_count tunable. On Windows, the critical section gets a spin count.
+	 * Elsewhere it is the same as a non-recursive mutex.
+	 *
+	 * Spinning only helps if the owner is running on another CPU, on single-CPU systems it is wasted time.
+	 *
+	 * It can be used with \ref condition like any other mutex.
+	 */
+	explicit mutex(adaptive_tag);
+
 	~mutex();
 
 	mutex(mutex const&) = delete;
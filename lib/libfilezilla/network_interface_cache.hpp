@@ -0,0 +1,79 @@
+#ifndef LIBFILEZILLA_NETWORK_INTERFACE_CACHE_HEADER
+#define LIBFILEZILLA_NETWORK_INTERFACE_CACHE_HEADER
+
+#include "event.hpp"
+#include "iputils.hpp"
+#include "time.hpp"
+
+#include <memory>
+#include <vector>
+
+/** \file
+ * \brief Caching the list of network interfaces until it changes
+ */
+
+namespace fz {
+
+class event_handler;
+class network_interface_cache;
+class network_interface_cache_impl;
+class thread_pool;
+
+/// \private
+struct network_interfaces_changed_event_type{};
+
+/// Sent to subscribed handlers after the network interfaces or their addresses have changed
+typedef simple_event<network_interfaces_changed_event_type, network_interface_cache*> network_interfaces_changed_event;
+
+/**
+ * \brief Caches the result of \ref get_network_interfaces
+ *
+ * Getting the interfaces then is just a copy of a shared pointer as long as nothing changes.
+ *
+ * On Linux, a netlink socket is used to get notified about added and removed interfaces
+ * and addresses, dropping the cached interfaces on every change. Subscribed event handlers
+ * receive a \ref network_interfaces_changed_event in that case.
+ *
+ * On other platforms, the interfaces are cached for at most \c max_age, by default they are
+ * not cached at all, and no events are sent.
+ *
+ * All functions are thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL network_interface_cache final
+{
+public:
+	/// Shared by the cache and all callers that got it, never modified
+	typedef std::shared_ptr<std::vector<network_interface> const> interfaces;
+
+	/// The thread pool provides the thread receiving the change notifications. It must outlive the cache.
+	explicit network_interface_cache(thread_pool & pool, duration const& max_age = duration());
+	~network_interface_cache();
+
+	network_interface_cache(network_interface_cache const&) = delete;
+	network_interface_cache& operator=(network_interface_cache const&) = delete;
+
+	/// Returns the network interfaces, either from the cache or by enumerating them. Null on failure.
+	interfaces get();
+
+	/// Drops the cached interfaces
+	void invalidate();
+
+	/**
+	 * \brief Sends a \ref network_interfaces_changed_event to the handler on every change
+	 *
+	 * Events that have already been sent are not removed when unsubscribing, but
+	 * \ref event_handler::remove_handler takes care of them.
+	 */
+	void subscribe(event_handler & handler);
+	void unsubscribe(event_handler & handler);
+
+	/// Whether change notifications are used to invalidate the cache
+	bool watching() const;
+
+private:
+	std::unique_ptr<network_interface_cache_impl> impl_;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef LIBFILEZILLA_PATH_BUILDER_HEADER
+#define LIBFILEZILLA_PATH_BUILDER_HEADER
+
+#include "string.hpp"
+
+/** \file
+* \brief Declares fz::path_builder
+*/
+
+namespace fz {
+
+/**
+ * \brief Builds native paths without allocating for each step
+ *
+ * Components are joined with the native separator and converted to the native encoding
+ * directly into the builder's storage. Typical paths fit into the inline storage and
+ * need no allocation at all, longer ones allocate once as they grow. The storage is
+ * kept by \ref truncate and \ref clear, so a builder can be reused, e.g. for all files
+ * in a directory.
+ *
+ * The result is always null-terminated and can be passed to the overloads of
+ * \ref file::open, \ref remove_file and \ref local_filesys accepting a path_builder
+ * without another copy.
+ */
+class FZ_PUBLIC_SYMBOL path_builder final
+{
+public:
+	using value_type = native_string::value_type;
+
+	/// Long enough for most paths, including Windows' traditional MAX_PATH
+	static constexpr size_t inline_capacity = 264;
+
+	path_builder() noexcept = default;
+	explicit path_builder(native_string_view const& path);
+
+	path_builder(path_builder const& op);
+	path_builder& operator=(path_builder const& op);
+
+	path_builder(path_builder && op) noexcept;
+	path_builder& operator=(path_builder && op) noexcept;
+
+	~path_builder();
+
+	/**
+	 * \brief Appends a path component
+	 *
+	 * Inserts a separator unless the builder is empty or already ends with one. Leading
+	 * separators of the component are skipped in that case.
+	 *
+	 * Returns false and leaves the builder unchanged if the component cannot be
+	 * represented in the native encoding.
+	 */
+	bool join(std::string_view const& component);
+	bool join(std::wstring_view const& component);
+
+	/// Appends without adding a separator, e.g. for file extensions. Same error semantics as join.
+	bool append(std::string_view const& s);
+	bool append(std::wstring_view const& s);
+
+	/// Shortens the path to the given size, which must not be larger than the current size.
+	void truncate(size_t size);
+
+	/// Clears the path, but retains the storage
+	void clear() { truncate(0); }
+
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	value_type const* c_str() const { return data_; }
+	native_string_view view() const { return native_string_view(data_, size_); }
+
+	/// Returns a copy of the path
+	native_string str() const { return native_string(data_, size_); }
+
+private:
+	// Makes room for n more characters and the terminator, returns the end of the path
+	value_type* grow(size_t n);
+
+	bool FZ_PRIVATE_SYMBOL convert(std::string_view const& s);
+	bool FZ_PRIVATE_SYMBOL convert(std::wstring_view const& s);
+
+	value_type* data_{inline_};
+	size_t size_{};
+	size_t capacity_{inline_capacity};
+	value_type inline_[inline_capacity]{};
+};
+
+}
+
+#endif
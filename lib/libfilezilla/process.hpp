@@ -13,9 +13,13 @@
 #include <vector>
 
 namespace fz {
+class buffer;
 class event_handler;
 class impersonation_token;
+class reactor;
 class thread_pool;
+struct socket_iovec;
+struct socket_const_iovec;
 
 
 /** \brief The type of a process event
@@ -69,6 +73,16 @@ public:
 	 */
 	process(thread_pool & pool, event_handler & handler);
 
+	/** \brief Like the other non-blocking constructor, but waits on the pipes using the reactor
+	 *
+	 * Instead of a thread for each process, the reactor's threads wait on the pipes of all
+	 * processes using it. Falls back to a thread from the reactor's pool if the reactor does
+	 * not multiplex or if the I/O is not redirected.
+	 *
+	 * The reactor must outlive the process.
+	 */
+	process(reactor & r, event_handler & handler);
+
 	/// If process still running, calls process::kill()
 	~process();
 	process(process const&) = delete;
@@ -159,6 +173,42 @@ public:
 		return write(s.data(), s.size());
 	}
 
+	/** \brief Reads up to max octets, appending them to the buffer
+	 *
+	 * The buffer grows as needed. Return values are those of \ref read, including 0 on EOF.
+	 */
+	rwresult read(buffer & buf, size_t max = 64 * 1024);
+
+	/** \brief Like read, but scattering the data over multiple buffers
+	 *
+	 * Uses a single readv system call, on Windows the buffers are filled one after another.
+	 * Buffers beyond the 64th are ignored.
+	 */
+	rwresult readv(socket_iovec const* buffers, size_t count);
+
+	/// Like write, but gathering the data from multiple buffers, see readv
+	rwresult writev(socket_const_iovec const* buffers, size_t count);
+
+#ifndef FZ_WINDOWS
+	/** \brief Moves up to len octets of the process' output directly to the descriptor
+	 *
+	 * On Linux this uses splice, the data never gets copied to userspace. The descriptor
+	 * can be a socket, a file or a pipe. Elsewhere it fails with ENOSYS.
+	 *
+	 * \return 0 on EOF
+	 * \return wouldblock if either side would block. If the process is non-blocking and
+	 *         its output was the side that would block, a process_event with the read flag follows.
+	 *         Otherwise the descriptor blocked and the caller needs to wait for it.
+	 */
+	rwresult splice_to(int fd, size_t len);
+
+	/** \brief Moves up to len octets from the descriptor directly into the process' input
+	 *
+	 * Same as splice_to, with the write flag in case the process' input is blocking.
+	 */
+	rwresult splice_from(int fd, size_t len);
+#endif
+
 #if FZ_WINDOWS
 	/** \brief
 	 * Returns the HANDLE of the process
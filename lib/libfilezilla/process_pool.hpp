@@ -0,0 +1,138 @@
+#ifndef LIBFILEZILLA_PROCESS_POOL_HEADER
+#define LIBFILEZILLA_PROCESS_POOL_HEADER
+
+/** \file
+ * \brief A pool of warm worker processes, e.g. one set per impersonated user
+ */
+
+#include "event.hpp"
+#include "impersonation.hpp"
+#include "time.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fz {
+
+class event_handler;
+class event_loop;
+class process_pool_impl;
+class thread_pool;
+
+struct process_pool_options final
+{
+	/// Number of workers per impersonation token that are kept running even if idle
+	size_t min_workers{1};
+
+	/// Maximum number of workers per impersonation token
+	size_t max_workers{4};
+
+	/// Number of requests a worker is handed at once before spawning another worker, if possible
+	size_t max_pending{1};
+
+	/// Workers in excess of min_workers quit after having been idle this long
+	duration idle_timeout{duration::from_seconds(60)};
+
+	/// Responses exceeding this size are treated as protocol violation, the worker gets killed
+	size_t max_response_size{16 * 1024 * 1024};
+};
+
+/// \private
+struct process_pool_response_event_type{};
+
+/**
+ * \brief The response to a request submitted to a \ref process_pool
+ *
+ * The arguments are the request id as returned by \ref process_pool::submit, an error code
+ * and the response. The error code is zero on success. If the worker has quit before
+ * responding, it is EPIPE.
+ */
+typedef simple_event<process_pool_response_event_type, uint64_t, int, std::string> process_pool_response_event;
+
+/**
+ * \brief Keeps worker processes running and dispatches requests to them
+ *
+ * Creating a process, dynamically linking it and initializing it, can take considerable time.
+ * The pool instead keeps a set of warm workers running for each impersonation token and
+ * reuses them for any number of requests.
+ *
+ * Requests and responses are opaque octet strings. They are exchanged through the worker's stdin
+ * and stdout, each prefixed by a 12 octet header: The 64bit request id and the 32bit length of the
+ * payload, in network byte order. A request with id 0 and empty payload asks the worker to quit.
+ * Workers implement their side of the protocol by calling \ref serve_process_pool_requests.
+ *
+ * Requests are passed to the worker with the fewest pending requests. If all workers are
+ * busy with \c max_pending requests, another worker is spawned unless there are already
+ * \c max_workers. Idle workers in excess of \c min_workers quit after the idle timeout.
+ *
+ * All functions are thread-safe.
+ */
+class FZ_PUBLIC_SYMBOL process_pool final
+{
+public:
+	/**
+	 * \brief Creates the pool, workers are spawned lazily.
+	 *
+	 * \param loop Used to talk to the workers. Must outlive the pool.
+	 * \param pool Used by the workers' \ref process instances. Must outlive the pool.
+	 * \param cmd The worker program
+	 * \param args The arguments passed to each worker
+	 */
+	process_pool(event_loop & loop, thread_pool & pool, native_string const& cmd, std::vector<native_string> const& args = {}, process_pool_options const& options = {});
+
+	/// Kills all workers, pending requests do not receive a response.
+	~process_pool();
+
+	process_pool(process_pool const&) = delete;
+	process_pool& operator=(process_pool const&) = delete;
+
+	/**
+	 * \brief Submits a request to a worker running under the user of the impersonation token
+	 *
+	 * Pass a null token for workers running as the current user. Tokens are compared by value,
+	 * equal tokens share their workers.
+	 *
+	 * Once the response has arrived, it is sent to the handler as \ref process_pool_response_event.
+	 *
+	 * \return The request id, or 0 if no worker could be spawned.
+	 */
+	uint64_t submit(std::shared_ptr<impersonation_token const> const& token, std::string_view const& request, event_handler & handler);
+
+	/**
+	 * \brief Spawns min_workers for the impersonation token in advance
+	 *
+	 * Returns false if not all could be spawned.
+	 */
+	bool prewarm(std::shared_ptr<impersonation_token const> const& token);
+
+	/**
+	 * \brief Discards the responses of all requests submitted by the handler
+	 *
+	 * Must be called before destroying a handler with requests still pending.
+	 */
+	void cancel(event_handler & handler);
+
+	/// Returns the number of running workers, for all impersonation tokens
+	size_t worker_count() const;
+
+private:
+	std::unique_ptr<process_pool_impl> impl_;
+};
+
+/**
+ * \brief Serves the requests of a \ref process_pool in a worker process
+ *
+ * Reads requests from stdin, passes each to the handler and writes its return value back to
+ * stdout as response. Returns true once the pool asks the worker to quit or stdin has been
+ * closed, false on errors.
+ *
+ * Nothing else may be written to stdout while serving requests.
+ */
+bool FZ_PUBLIC_SYMBOL serve_process_pool_requests(std::function<std::string(std::string_view const& request)> const& handler);
+
+}
+
+#endif
@@ -14,6 +14,8 @@ namespace fz {
  * \brief A rate-limited socket layer.
  *
  * This socket layer is a bucket that can be added to a \sa rate_limiter.
+ *
+ * To avoid bursts at the start of each period, enable pacing using \sa rate_limit_manager::set_pacing.
  */
 class FZ_PUBLIC_SYMBOL rate_limited_layer final : public socket_layer, private bucket
 {
@@ -24,8 +26,28 @@ public:
 	virtual int read(void* buffer, unsigned int size, int& error) override;
 	virtual int write(void const* buffer, unsigned int size, int& error) override;
 
+	/// Passes the buffers, limited to the available amount, to the next layer's readv
+	virtual int readv(socket_iovec const* buffers, size_t count, int& error) override;
+
+	/// Passes the buffers, limited to the available amount, to the next layer's writev
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) override;
+
+	/// Passes the file range, limited to the available amount, to the next layer's send_file
+	virtual int send_file(file & f, uint64_t offset, unsigned int size, int& error) override;
+
 	virtual void set_event_handler(event_handler* handler, socket_event_flag retrigger_block = socket_event_flag{}) override;
 
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const override {
+		usage.push_back({"rate_limited_layer", sizeof(rate_limited_layer), 0});
+		next_layer_.get_memory_usage(usage);
+	}
+
+	/// \sa bucket_base::set_share
+	using bucket::set_share;
+
+	/// \sa bucket_base::set_priority
+	using bucket::set_priority;
+
 protected:
 	virtual void wakeup(direction::type d) override;
 };
@@ -42,11 +64,19 @@ public:
 	virtual ~compound_rate_limited_layer();
 
 	void add_limiter(rate_limiter * limiter);
+
+	/// Keeps the limiter alive until it gets removed or the layer is destroyed, \sa keyed_rate_limiter
+	void add_limiter(std::shared_ptr<rate_limiter> const& limiter);
+
 	void remove_limiter(rate_limiter * limiter);
 
 	virtual int read(void* buffer, unsigned int size, int& error) override;
 	virtual int write(void const* buffer, unsigned int size, int& error) override;
 
+	virtual int readv(socket_iovec const* buffers, size_t count, int& error) override;
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) override;
+	virtual int send_file(file & f, uint64_t offset, unsigned int size, int& error) override;
+
 	virtual socket_state get_state() const override {
 		return next_layer_.get_state();
 	}
@@ -61,11 +91,17 @@ public:
 
 	virtual void set_event_handler(event_handler* handler, fz::socket_event_flag retrigger_block = socket_event_flag{}) override;
 
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const override;
+
 protected:
 	class crll_bucket;
 	friend class crll_bucket;
 	std::vector<std::unique_ptr<crll_bucket>> buckets_;
 
+	// Returns the smallest amount available from the buckets, zero if any needs to be waited for
+	rate::type available(direction::type d);
+	void consume(direction::type d, rate::type amount);
+
 	fz::mutex mtx_{false};
 };
 
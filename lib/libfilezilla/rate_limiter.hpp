@@ -5,8 +5,9 @@
  * \brief Classes for rate-limiting
  *
  * Rate-limiting is done using token buckets with hierarchical limits.
- * Rate is distributed fairly between buckets, with any overflow
- * distributed between buckets still having capacity.
+ * Rate is distributed fairly between buckets according to their shares,
+ * with any overflow distributed between buckets still having capacity,
+ * buckets with higher priority first.
  */
 
 #include "event_handler.hpp"
@@ -31,6 +32,48 @@ enum type : size_t {
 }
 
 class rate_limiter;
+class bucket;
+
+/**
+ * \brief Counters of a \ref bucket, a \ref rate_limiter or a \ref rate_limit_manager
+ *
+ * The counters of a limiter are the sums of those of the buckets currently in its tree,
+ * plus its own counter of wasted tokens. Those of the manager are the sums of those of its
+ * limiters. All arrays are indexed by direction.
+ *
+ * \sa bucket::get_stats, rate_limiter::get_stats, rate_limit_manager::get_stats
+ */
+struct FZ_PUBLIC_SYMBOL rate_limit_stats final
+{
+	/// Tokens added to buckets by distributions, including overflow
+	rate::type granted[2]{};
+
+	/// Tokens consumed from buckets
+	rate::type consumed[2]{};
+
+	/// Tokens discarded by limiters as no bucket below had capacity for them
+	rate::type wasted[2]{};
+
+	/// Number of times buckets ran out of tokens, including waits for the next pacing step
+	uint64_t waits[2]{};
+
+	/// Number of times waiting buckets got woken up
+	uint64_t wakeups[2]{};
+
+	/// Total time buckets have spent waiting until woken up
+	duration wait_time[2];
+
+	/// Number of buckets currently waiting
+	size_t waiting[2]{};
+
+	/// Number of buckets
+	size_t buckets{};
+
+	/// Number of token distributions, only set by the manager
+	uint64_t distributions{};
+
+	rate_limit_stats& operator+=(rate_limit_stats const& op);
+};
 
 /**
  * \brief Context for rate_limiters
@@ -59,6 +102,42 @@ public:
 	/// Burst tolerance, a multiplier to bucket size, helps achieving the average rate on bursty connections.
 	void set_burst_tolerance(rate::type tolerance);
 
+	/**
+	 * \brief Sets how often per second tokens get distributed
+	 *
+	 * Higher frequencies make transfers less bursty at the expense of more frequent wakeups
+	 * and distributions, each of which locks the tree of limiters. Clamped to the range
+	 * from 1 to 50, the default is 5.
+	 */
+	void set_frequency(int frequency);
+
+	/// Returns the number of token distributions per second
+	int frequency() const { return frequency_; }
+
+	/**
+	 * \brief Spreads the tokens of each distribution over the distribution period
+	 *
+	 * Without pacing, buckets can use the tokens of a distribution all at once and then
+	 * have to wait for the next distribution, which makes transfers alternate between
+	 * bursting and stalling. With pacing, the tokens added by a distribution become available
+	 * in equal steps over the period. Tokens saved up in earlier periods remain available
+	 * right away.
+	 *
+	 * Buckets waiting for the next step get woken up by a separate timer that only locks
+	 * the waiting buckets, not the tree.
+	 *
+	 * Disabled by default.
+	 */
+	void set_pacing(bool pacing);
+
+	/**
+	 * \brief Returns the combined counters of all limiters
+	 *
+	 * Counters are kept all the time, the overhead is negligible. Briefly locks each
+	 * limiter and bucket in turn.
+	 */
+	rate_limit_stats get_stats();
+
 private:
 	friend class rate_limiter;
 	friend class bucket_base;
@@ -71,6 +150,11 @@ private:
 
 	void FZ_PRIVATE_SYMBOL process(rate_limiter* limiter, bool locked);
 
+	void FZ_PRIVATE_SYMBOL on_pacing_timer();
+
+	// Milliseconds since start_
+	int64_t FZ_PRIVATE_SYMBOL elapsed() const;
+
 	std::atomic<int> activity_{2};
 	mutex mtx_{false};
 	std::vector<rate_limiter*> limiters_;
@@ -78,6 +162,22 @@ private:
 	std::atomic<timer_id> timer_{};
 
 	std::atomic<rate::type> burst_tolerance_{1};
+
+	std::atomic<int> frequency_{5};
+
+	std::atomic<uint64_t> distributions_{};
+
+	monotonic_clock const start_;
+
+	// Time of the last distribution, relative to start_
+	std::atomic<int64_t> distribution_time_{};
+
+	std::atomic<bool> pacing_{};
+
+	// Buckets waiting for the next pacing step
+	mutex pacing_mtx_{false};
+	std::vector<bucket*> paced_;
+	std::atomic<timer_id> pacing_timer_{};
 };
 
 /// Base class for buckets
@@ -93,6 +193,29 @@ public:
 	 */
 	virtual void remove_bucket();
 
+	/**
+	 * \brief Sets the share of tokens relative to the siblings
+	 *
+	 * A bucket or limiter with a share of 2 gets twice as many tokens as a sibling with
+	 * a share of 1, the share of a limiter applies to each of its buckets. Overflow is
+	 * distributed according to the shares as well.
+	 *
+	 * Clamped to the range from 1 to 1000, the default is 1.
+	 */
+	void set_share(size_t share);
+
+	/**
+	 * \brief Sets the priority class
+	 *
+	 * Overflow, the tokens not needed by saturated siblings, goes to unsaturated
+	 * siblings with the highest priority first. Only once these are saturated, siblings
+	 * with lower priority get the remaining overflow. The regular share of tokens does
+	 * not depend on the priority, so lower priorities never starve.
+	 *
+	 * The default priority is 0.
+	 */
+	void set_priority(int priority);
+
 protected:
 	friend class rate_limiter;
 
@@ -158,6 +281,29 @@ protected:
 	 */
 	virtual void unlock_tree() { mtx_.unlock(); }
 
+	/**
+	 * \brief Marks the bucket as idle if it does not need any tokens
+	 *
+	 * Idle buckets are skipped during token distribution until they get used again.
+	 *
+	 * Must only be called with a locked mutex
+	 */
+	virtual bool try_idle() { return false; }
+
+	/**
+	 * \brief Makes idle buckets take part in the next token distribution
+	 *
+	 * Needed after changes affecting the bucket sizes, such as changed limits.
+	 */
+	virtual void reactivate() {}
+
+	/**
+	 * \brief Lets an idle bucket take part in token distribution again
+	 *
+	 * Must only be called with a locked mutex
+	 */
+	void wake();
+
 	/**
 	 * \brief Gather unspent tokens during removal to repay debt
 	 *
@@ -165,10 +311,27 @@ protected:
 	 */
 	virtual std::array<rate::type, 2> gather_unspent_for_removal() = 0;
 
+	/**
+	 * \brief Adds the counters of the bucket or of the tree to the passed stats
+	 *
+	 * Locks the mutexes of self and of the children in turn.
+	 */
+	virtual void add_stats(rate_limit_stats & stats) = 0;
+
 	mutex mtx_{false};
 	rate_limit_manager * mgr_{};
 	void * parent_{};
+
+	// Protected by the mutex of the parent
 	size_t idx_{static_cast<size_t>(-1)};
+
+	// The share accounted for by the parent while idle, protected by the mutex of the parent
+	size_t idle_share_{};
+
+	size_t share_{1};
+	int priority_{};
+
+	bool idle_{};
 };
 
 /**
@@ -208,6 +371,9 @@ public:
 	/// Returns current limit
 	rate::type limit(direction::type const d);
 
+	/// Returns the counters of all buckets in the tree, \sa rate_limit_stats
+	rate_limit_stats get_stats();
+
 private:
 	friend class bucket_base;
 	friend class rate_limit_manager;
@@ -226,14 +392,34 @@ private:
 
 	virtual void FZ_PRIVATE_SYMBOL unlock_tree() override;
 
+	virtual void FZ_PRIVATE_SYMBOL reactivate() override;
+
 	void FZ_PRIVATE_SYMBOL pay_debt(direction::type const d);
 
+	void FZ_PRIVATE_SYMBOL swap_buckets(size_t a, size_t b);
+	void FZ_PRIVATE_SYMBOL remove_child(bucket_base * bucket);
+
 	virtual std::array<rate::type, 2> FZ_PRIVATE_SYMBOL gather_unspent_for_removal() override;
 
+	virtual void FZ_PRIVATE_SYMBOL add_stats(rate_limit_stats & stats) override;
+
+	// The first active_ buckets take part in token distribution, the others are idle
 	std::vector<bucket_base*> buckets_;
+	size_t active_{};
+
 	std::vector<size_t> scratch_buffer_;
 	size_t weight_{};
 
+	// Combined share of the idle buckets
+	size_t idle_weight_{};
+
+	// Idle buckets that have been used again. Has its own mutex, buckets add themselves
+	// while locked, which must not wait for the tree.
+	mutex wake_mtx_{false};
+	std::vector<bucket_base*> woken_;
+
+	std::atomic<bool> reactivate_{};
+
 	struct FZ_PRIVATE_SYMBOL data_t {
 		rate::type limit_{rate::unlimited};
 		rate::type merged_tokens_{};
@@ -241,6 +427,7 @@ private:
 		rate::type debt_{};
 		rate::type unused_capacity_{};
 		rate::type carry_{};
+		rate::type wasted_{};
 		size_t unsaturated_{};
 	};
 	data_t data_[2];
@@ -271,6 +458,9 @@ public:
 	 */
 	void consume(direction::type const d, rate::type amount);
 
+	/// Returns the counters of this bucket, \sa rate_limit_stats
+	rate_limit_stats get_stats();
+
 protected:
 	/**
 	 * \brief Called in response to unlock_tree if tokens have become available
@@ -279,7 +469,7 @@ protected:
 	 */
 	virtual void wakeup(direction::type /*d*/) {}
 
-	/// Call with the bucket_base mutex lock.
+	/// Call with the bucket_base mutex lock. Also true if waiting for the next pacing step.
 	bool waiting(scoped_lock & l, direction::type d);
 
 private:
@@ -291,15 +481,56 @@ private:
 
 	virtual void unlock_tree() override;
 
+	virtual bool try_idle() override;
+
 	virtual std::array<rate::type, 2> gather_unspent_for_removal() override;
 
+	virtual void add_stats(rate_limit_stats & stats) override;
+
+	// Starts the wait if not already waiting
+	void start_wait(direction::type const d);
+
+	// Ends the wait and calls wakeup
+	void end_wait(direction::type const d);
+
+	// Returns the tokens available with pacing
+	rate::type paced(direction::type const d);
+
+	friend class rate_limit_manager;
+	void wake_paced();
+
 	struct data_t {
 		rate::type available_{rate::unlimited};
 		rate::type overflow_multiplier_{1};
 		rate::type bucket_size_{rate::unlimited};
+
+		// Tokens added by the last distribution
+		rate::type added_{};
+
 		bool waiting_{};
+		bool paced_waiting_{};
+
+		// Set if held back by pacing since the last distribution
+		bool paced_{};
+
 		bool unsaturated_{};
 	} data_[2];
+
+	// Kept when the bucket gets removed
+	struct counters_t {
+		rate::type granted_{};
+		rate::type consumed_{};
+		uint64_t waits_{};
+		uint64_t wakeups_{};
+		duration wait_time_;
+		monotonic_clock wait_start_;
+	} counters_[2];
+
+	// Manager in whose list of paced buckets this bucket is
+	rate_limit_manager * paced_mgr_{};
+
+	// Set on consumption, buckets only become idle after a distribution period without use
+	bool used_{};
 };
 
 }
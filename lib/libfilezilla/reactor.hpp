@@ -0,0 +1,71 @@
+#ifndef LIBFILEZILLA_REACTOR_HEADER
+#define LIBFILEZILLA_REACTOR_HEADER
+
+/** \file
+ * \brief Declares \ref fz::reactor, a shared I/O multiplexer for sockets
+ */
+
+#include "libfilezilla.hpp"
+
+#include <memory>
+
+namespace fz {
+
+class thread_pool;
+
+/// \private
+class reactor_impl;
+
+/**
+ * \brief A small set of threads multiplexing readiness notifications for many sockets.
+ *
+ * By default, each \ref fz::socket and \ref fz::listen_socket waits for readiness in a
+ * dedicated thread taken from the \ref fz::thread_pool. With a large number of connections,
+ * this results in a large number of threads.
+ *
+ * Sockets created with a reactor instead register their descriptor with one of the
+ * reactor's threads, which waits on the descriptors of all its sockets at once using
+ * epoll. Outgoing connections still use a pooled thread for name resolution and the
+ * connection attempt, the thread is returned to the pool once the connection is established.
+ *
+ * The semantics of the socket events sent to event handlers is unchanged.
+ *
+ * Likewise, the pipes of a \ref fz::process created with a reactor are waited on by the reactor.
+ *
+ * On platforms without a supported multiplexing mechanism, sockets created with a reactor
+ * silently fall back to using a thread each, \sa multiplexing.
+ *
+ * The reactor must outlive all sockets created with it.
+ */
+class FZ_PUBLIC_SYMBOL reactor final
+{
+public:
+	/**
+	 * \brief Creates the reactor and spawns its threads from the pool.
+	 *
+	 * \param pool The pool from which the reactor threads get spawned. Sockets using this reactor
+	 *             also use this pool for connection attempts.
+	 * \param threads The number of reactor threads. Sockets are distributed among them in a round-robin fashion.
+	 */
+	explicit reactor(thread_pool & pool, size_t threads = 1);
+	~reactor();
+
+	reactor(reactor const&) = delete;
+	reactor& operator=(reactor const&) = delete;
+
+	/// Whether sockets actually get multiplexed, false if unsupported or if the threads could not be created.
+	bool multiplexing() const;
+
+	thread_pool& pool() { return pool_; }
+
+private:
+	friend class process;
+	friend class socket_thread;
+
+	thread_pool & pool_;
+	std::unique_ptr<reactor_impl> impl_;
+};
+
+}
+
+#endif
@@ -14,11 +14,17 @@
 
 namespace fz {
 
+class thread_pool;
+
 /** \brief Recursively deletes directories.
  *
  * Behavior varies by platform. On Windows, SHFileOperation is used if shell32.dll is loadable.
  *
  * The generic implementation manually traverse the directory tree on other platforms.
+ * On POSIX systems it works relative to directory descriptors using openat and unlinkat,
+ * so that paths do not get resolved again for every entry, and it never follows symbolic links.
+ * Passing a \ref thread_pool makes it use a \ref tree_walker, processing multiple
+ * directories concurrently. This is considerably faster on network file systems.
  */
 class FZ_PUBLIC_SYMBOL recursive_remove
 {
@@ -35,6 +41,12 @@ public:
 	/// \brief Removes given directories
 	bool remove(std::list<native_string> dirsToVisit);
 
+	/// \brief Removes given directory, processing up to max_parallel directories concurrently
+	bool remove(native_string const& path, thread_pool & pool, size_t max_parallel = 8);
+
+	/// \brief Removes given directories, processing up to max_parallel directories concurrently
+	bool remove(std::list<native_string> dirsToVisit, thread_pool & pool, size_t max_parallel = 8);
+
 protected:
 	/// \brief Can be overridden to ask the user for a confirmation.
 	///
@@ -48,6 +60,11 @@ protected:
 	/// The default implementation allows undo and suppresses any GUI output.
 	virtual void adjust_shfileop(SHFILEOPSTRUCT & op);
 #endif
+
+private:
+#ifdef FZ_WINDOWS
+	bool FZ_PRIVATE_SYMBOL remove_shfileop(std::list<native_string> & dirsToVisit, bool & success);
+#endif
 };
 
 }
@@ -2,11 +2,15 @@
 #define LIBFILEZILLA_RWMUTEX_HEADER
 
 /** \file
- * \brief Thread synchronization primitives: rwmutex, scoped_read_lock and scoped_write_lock
+ * \brief Thread synchronization primitives: rwmutex, scoped_read_lock and scoped_write_lock,
+ * as well as the reader-biased biased_rwmutex
  */
 #include "libfilezilla.hpp"
 #include "time.hpp"
 
+#include <atomic>
+#include <memory>
+
 #ifdef FZ_WINDOWS
 #include "glue/windows.hpp"
 #else
@@ -269,6 +273,96 @@ private:
 	bool locked_{ true };
 };
 
+
+/**
+ * \brief Reader-biased rw mutex for data that is read very often and written rarely
+ *
+ * With rwmutex, every reader modifies the same shared counter, its cache line bouncing between
+ * the CPUs. biased_rwmutex instead has a reader count per CPU, each in its own cache line.
+ * Readers only touch the count of the CPU they are running on, unless a writer is active.
+ *
+ * In turn, writers are expensive: They need to wait until the readers in all slots are gone.
+ *
+ * Like rwmutex, it is neither recursive, nor can read locks be upgraded to write locks.
+ */
+class FZ_PUBLIC_SYMBOL biased_rwmutex final
+{
+public:
+	biased_rwmutex();
+	~biased_rwmutex();
+
+	biased_rwmutex(biased_rwmutex const&) = delete;
+	biased_rwmutex& operator=(biased_rwmutex const&) = delete;
+
+	/**
+	 * \brief Beware, manual locking isn't exception safe, use scoped_biased_read_lock
+	 *
+	 * Returns the slot that needs to be passed to unlock_read. Threads can migrate
+	 * between CPUs while holding the lock.
+	 */
+	size_t lock_read();
+	void unlock_read(size_t slot);
+
+	/// Beware, manual locking isn't exception safe, use scoped_biased_write_lock
+	void lock_write();
+	void unlock_write();
+
+private:
+	struct slot;
+
+	std::unique_ptr<slot[]> slots_;
+	size_t slot_mask_{};
+
+	std::atomic<bool> writer_{};
+
+	// Held by the writer, serializes writers and blocks readers while a writer is active
+	rwmutex gate_;
+};
+
+/// Scoped read lock for \ref biased_rwmutex
+class FZ_PUBLIC_SYMBOL scoped_biased_read_lock final
+{
+public:
+	explicit scoped_biased_read_lock(biased_rwmutex& m)
+		: m_(m)
+		, slot_(m.lock_read())
+	{}
+
+	~scoped_biased_read_lock()
+	{
+		m_.unlock_read(slot_);
+	}
+
+	scoped_biased_read_lock(scoped_biased_read_lock const&) = delete;
+	scoped_biased_read_lock& operator=(scoped_biased_read_lock const&) = delete;
+
+private:
+	biased_rwmutex & m_;
+	size_t const slot_;
+};
+
+/// Scoped write lock for \ref biased_rwmutex
+class FZ_PUBLIC_SYMBOL scoped_biased_write_lock final
+{
+public:
+	explicit scoped_biased_write_lock(biased_rwmutex& m)
+		: m_(m)
+	{
+		m_.lock_write();
+	}
+
+	~scoped_biased_write_lock()
+	{
+		m_.unlock_write();
+	}
+
+	scoped_biased_write_lock(scoped_biased_write_lock const&) = delete;
+	scoped_biased_write_lock& operator=(scoped_biased_write_lock const&) = delete;
+
+private:
+	biased_rwmutex & m_;
+};
+
 }
 
 #endif
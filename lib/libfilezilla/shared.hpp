@@ -1,10 +1,18 @@
 #ifndef LIBFILEZILLA_SHARED_HEADER
 #define LIBFILEZILLA_SHARED_HEADER
 
+#include "mutex.hpp"
+
+#include <atomic>
 #include <memory>
+#include <thread>
+#include <type_traits>
+
+#include <string.h>
 
 /** \file
-* \brief Declares the shared_optional and shared_value template classes.
+* \brief Declares the shared_optional and shared_value template classes,
+* as well as seqlock and shared_snapshot for read-mostly data.
 */
 namespace fz {
 
@@ -175,6 +183,204 @@ template<typename T, bool Init> const T* shared_optional<T, Init>::operator->()
 	return data_.get();
 }
 
+
+/**
+ * \brief Holds a small, trivially copyable value that is read far more often than written
+ *
+ * Readers do not write to shared memory, so they do not bounce cache lines between CPUs.
+ * They only retry if a write was in progress concurrently. Writers are serialized among
+ * themselves.
+ *
+ * The value is stored as sequence of atomic words, so this is only suited for small types,
+ * e.g. a handful of counters, limits or flags that need to be read consistently as a whole.
+ */
+template<typename T>
+class seqlock final
+{
+	static_assert(std::is_trivially_copyable_v<T>, "seqlock requires trivially copyable types");
+	static_assert(std::is_default_constructible_v<T>, "seqlock requires default-constructible types");
+
+public:
+	seqlock() noexcept
+		: seqlock(T{})
+	{}
+
+	explicit seqlock(T const& v) noexcept
+	{
+		size_t buf[word_count]{};
+		memcpy(buf, &v, sizeof(T));
+		for (size_t i = 0; i < word_count; ++i) {
+			words_[i].store(buf[i], std::memory_order_relaxed);
+		}
+	}
+
+	seqlock(seqlock const&) = delete;
+	seqlock& operator=(seqlock const&) = delete;
+
+	/// Returns a consistent copy of the value
+	T load() const noexcept
+	{
+		size_t buf[word_count];
+		while (true) {
+			size_t const seq = seq_.load(std::memory_order_acquire);
+			if (!(seq & 1)) {
+				for (size_t i = 0; i < word_count; ++i) {
+					buf[i] = words_[i].load(std::memory_order_relaxed);
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (seq_.load(std::memory_order_relaxed) == seq) {
+					break;
+				}
+			}
+			else {
+				// Writer may have been preempted
+				std::this_thread::yield();
+			}
+		}
+
+		T ret;
+		memcpy(&ret, buf, sizeof(T));
+		return ret;
+	}
+
+	void store(T const& v) noexcept
+	{
+		size_t buf[word_count]{};
+		memcpy(buf, &v, sizeof(T));
+
+		size_t seq = seq_.load(std::memory_order_relaxed);
+		while ((seq & 1) || !seq_.compare_exchange_weak(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+			if (seq & 1) {
+				std::this_thread::yield();
+				seq = seq_.load(std::memory_order_relaxed);
+			}
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (size_t i = 0; i < word_count; ++i) {
+			words_[i].store(buf[i], std::memory_order_relaxed);
+		}
+		seq_.store(seq + 2, std::memory_order_release);
+	}
+
+private:
+	static constexpr size_t word_count = (sizeof(T) + sizeof(size_t) - 1) / sizeof(size_t);
+
+	// Odd while a write is in progress
+	std::atomic<size_t> seq_{};
+	std::atomic<size_t> words_[word_count];
+};
+
+/**
+ * \brief Publishes immutable versions of read-mostly data, such as configuration
+ *
+ * Writers publish a complete new version, readers get the current version as shared pointer
+ * to const. A version stays alive as long as it is referenced, so readers are never
+ * disturbed by updates.
+ *
+ * \ref load takes a lock. For frequent reads, each thread should use its own \ref reader.
+ * It caches the current version and only checks an atomic version counter on access,
+ * which does not involve writes to shared memory unless a new version has been published.
+ * Superseded versions get released once the last reader has moved on.
+ *
+ * All members of shared_snapshot are thread-safe, instances of reader must not be used
+ * concurrently.
+ */
+template<typename T>
+class shared_snapshot final
+{
+public:
+	shared_snapshot()
+		: shared_snapshot(std::make_shared<T const>())
+	{}
+
+	explicit shared_snapshot(std::shared_ptr<T const> v)
+		: current_(std::move(v))
+	{}
+
+	shared_snapshot(shared_snapshot const&) = delete;
+	shared_snapshot& operator=(shared_snapshot const&) = delete;
+
+	/// Returns the current version
+	std::shared_ptr<T const> load() const
+	{
+		scoped_lock l(mtx_);
+		return current_;
+	}
+
+	/// Replaces the current version
+	void publish(std::shared_ptr<T const> v)
+	{
+		{
+			scoped_lock l(mtx_);
+			current_.swap(v);
+			version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		// v now holds the previous version, if unreferenced it gets freed outside the lock
+	}
+
+	void publish(T const& v)
+	{
+		publish(std::make_shared<T const>(v));
+	}
+
+	/**
+	 * \brief Copies the current version, applies the function to the copy and publishes the result
+	 *
+	 * Concurrent updates are serialized, none get lost.
+	 */
+	template<typename F>
+	void update(F && f)
+	{
+		scoped_lock l(update_mtx_);
+		auto v = std::make_shared<T>(*load());
+		std::forward<F>(f)(*v);
+		publish(std::move(v));
+	}
+
+	/// Caches the current version for a single thread
+	class reader final
+	{
+	public:
+		explicit reader(shared_snapshot const& s)
+			: snapshot_(s)
+		{
+			refresh();
+		}
+
+		/// Returns the current version, refreshed if a new version has been published
+		std::shared_ptr<T const> const& get()
+		{
+			if (snapshot_.version_.load(std::memory_order_acquire) != version_) {
+				refresh();
+			}
+			return data_;
+		}
+
+		T const& operator*() { return *get(); }
+		T const* operator->() { return get().get(); }
+
+	private:
+		void refresh()
+		{
+			scoped_lock l(snapshot_.mtx_);
+			data_ = snapshot_.current_;
+			version_ = snapshot_.version_.load(std::memory_order_relaxed);
+		}
+
+		shared_snapshot const& snapshot_;
+		std::shared_ptr<T const> data_;
+		size_t version_{};
+	};
+
+private:
+	mutable mutex mtx_{mutex::adaptive};
+	mutex update_mtx_{false};
+
+	std::shared_ptr<T const> current_;
+	std::atomic<size_t> version_{};
+};
+
 }
 
 #endif
@@ -14,6 +14,9 @@
 
 namespace fz {
 
+class buffer;
+class thread_pool;
+
 /** \brief Represents a public key to verify messages signed using Ed25519.
  *
  * \sa private_signing_key
@@ -66,7 +69,7 @@ public:
 	}
 
 	/// Gets the public key corresponding to the private key
-	public_verification_key pubkey() const;
+	public_verification_key const& pubkey() const;
 
 	std::vector<uint8_t> const& data() const {
 		return key_;
@@ -76,7 +79,12 @@ public:
 	static private_signing_key from_base64(std::string_view const& base64);
 
 private:
+	void derive_pubkey();
+
 	std::vector<uint8_t> key_;
+
+	// Derived once, deriving it is as expensive as signing
+	public_verification_key pub_;
 };
 
 enum {
@@ -88,6 +96,12 @@ std::vector<uint8_t> FZ_PUBLIC_SYMBOL sign(std::vector<uint8_t> const& message,
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL sign(std::string_view const& message, private_signing_key const& priv, bool include_message = true);
 std::vector<uint8_t> FZ_PUBLIC_SYMBOL sign(uint8_t const* message, size_t const size, private_signing_key const& priv, bool include_message = true);
 
+/// Appends the signature to the buffer, preceded by the message if include_message is set
+bool FZ_PUBLIC_SYMBOL sign(uint8_t const* message, size_t const size, private_signing_key const& priv, buffer & out, bool include_message = true);
+
+/// Writes the detached signature of signature_size octets to caller-supplied memory
+bool FZ_PUBLIC_SYMBOL sign_into(uint8_t const* message, size_t const size, private_signing_key const& priv, uint8_t* signature);
+
 /// Verify a message with attached signature. Returns true iff it has been signed by the private key corresponding to the passed public key
 bool FZ_PUBLIC_SYMBOL verify(std::vector<uint8_t> const& message, public_verification_key const& pub);
 bool FZ_PUBLIC_SYMBOL verify(std::string_view const& message, public_verification_key const& pub);
@@ -98,6 +112,32 @@ bool FZ_PUBLIC_SYMBOL verify(std::vector<uint8_t> const& message, std::vector<ui
 bool FZ_PUBLIC_SYMBOL verify(std::string_view const& message, std::string_view const& signature, public_verification_key const& pub);
 bool FZ_PUBLIC_SYMBOL verify(uint8_t const* message, size_t const message_size, uint8_t const* signature, size_t const sig_size, public_verification_key const& pub);
 
+/// A message with detached signature, to be checked by \ref verify_batch
+struct signature_check final
+{
+	uint8_t const* message{};
+	size_t message_size{};
+
+	/// Needs to point to signature_size octets
+	uint8_t const* signature{};
+
+	public_verification_key const* pub{};
+
+	/// Set by \ref verify_batch
+	bool valid{};
+};
+
+/**
+ * \brief Verifies many detached signatures
+ *
+ * Sets the valid member of each check, returns true iff all of them are valid.
+ *
+ * If a thread pool is passed, the checks are split into chunks that are submitted to the
+ * workers of the pool, see \ref thread_pool::submit. The calling thread takes part in the work.
+ * Useful for checking many signed tokens at once, each signature takes tens of microseconds.
+ */
+bool FZ_PUBLIC_SYMBOL verify_batch(std::vector<signature_check> & checks, thread_pool * pool = nullptr);
+
 }
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef LIBFILEZILLA_SLAB_ALLOCATOR_HEADER
+#define LIBFILEZILLA_SLAB_ALLOCATOR_HEADER
+
+#include "buffer.hpp"
+#include "mutex.hpp"
+
+#include <vector>
+
+/** \file
+* \brief Declares fz::slab_buffer_allocator
+*/
+
+namespace fz {
+
+/**
+ * \brief A \ref buffer_allocator keeping released memory for reuse
+ *
+ * Allocations are rounded up to power-of-two size classes, starting at min_slab_size.
+ * Memory released through deallocate is kept per size class, up to max_cached bytes
+ * in total, and handed out again by subsequent allocations.
+ *
+ * Create one per connection to get a per-connection arena, or share a single instance
+ * between many buffers; all functions are thread-safe.
+ *
+ * If huge_pages is set, slabs of at least huge_page_size are aligned accordingly and,
+ * where supported, backed by transparent huge pages. This is meant for bulk data.
+ */
+class FZ_PUBLIC_SYMBOL slab_buffer_allocator final : public buffer_allocator
+{
+public:
+	static constexpr size_t min_slab_size = 4096;
+	static constexpr size_t max_slab_size = 64 * 1024 * 1024;
+	static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+	explicit slab_buffer_allocator(size_t max_cached = 64 * 1024 * 1024, bool huge_pages = false);
+	virtual ~slab_buffer_allocator() noexcept;
+
+	slab_buffer_allocator(slab_buffer_allocator const&) = delete;
+	slab_buffer_allocator& operator=(slab_buffer_allocator const&) = delete;
+
+	virtual unsigned char* allocate(size_t & capacity) override;
+	virtual void deallocate(unsigned char* p, size_t capacity) noexcept override;
+
+	/// Returns the amount of memory currently kept for reuse
+	size_t cached() const;
+
+	/// Frees all memory kept for reuse
+	void trim();
+
+private:
+	unsigned char* allocate_slab(size_t size);
+	void free_slab(unsigned char* p, size_t size) noexcept;
+
+	mutable mutex mtx_;
+
+	std::vector<std::vector<unsigned char*>> free_;
+	size_t cached_{};
+
+	size_t const max_cached_{};
+	bool const huge_pages_{};
+};
+
+}
+
+#endif
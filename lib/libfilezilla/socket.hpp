@@ -4,16 +4,19 @@
 /** \file
  * \brief Socket classes for networking
  *
- * Declares the \ref fz::socket and \ref fz::listen_socket classes,
+ * Declares the \ref fz::socket, \ref fz::listen_socket and \ref fz::datagram_socket classes,
  * alongside supporting classes to handle socket events.
  */
 
 #include "libfilezilla.hpp"
 
+#include "buffer.hpp"
 #include "event_handler.hpp"
 #include "iputils.hpp"
+#include "time.hpp"
 
 #include <memory>
+#include <vector>
 
 #include <errno.h>
 
@@ -21,7 +24,8 @@
 struct sockaddr;
 
 namespace fz {
-class buffer;
+class file;
+class reactor;
 class thread_pool;
 
 /** \brief The type of a socket event
@@ -212,6 +216,7 @@ protected:
 	friend class socket_thread;
 
 	socket_base(thread_pool& pool, event_handler* evt_handler, socket_event_source* ev_source);
+	socket_base(reactor& r, event_handler* evt_handler, socket_event_source* ev_source);
 	virtual ~socket_base() = default;
 
 	int close();
@@ -220,6 +225,7 @@ protected:
 	void detach_thread(scoped_lock & l);
 
 	thread_pool & thread_pool_;
+	reactor * reactor_{};
 	event_handler* evt_handler_;
 
 	socket_thread* socket_thread_{};
@@ -286,8 +292,12 @@ class FZ_PUBLIC_SYMBOL listen_socket final : public socket_base, public socket_e
 {
 	friend class socket_base;
 	friend class socket_thread;
+	friend class listen_socket_group;
 public:
 	listen_socket(thread_pool& pool, event_handler* evt_handler);
+
+	/// Waits for incoming connections using the passed \ref fz::reactor. Accepted sockets use the same reactor.
+	listen_socket(reactor& r, event_handler* evt_handler);
 	virtual ~listen_socket();
 
 	listen_socket(listen_socket const&) = delete;
@@ -313,12 +323,162 @@ public:
 	 */
 	socket_descriptor fast_accept(int& error);
 
+	/**
+	 * \brief Accepts up to max pending connections at once
+	 *
+	 * Unlike calling accept in a loop, waiting for further connections is re-armed only once
+	 * after draining, and where supported the sockets are accepted in non-blocking mode right away.
+	 *
+	 * If no socket is returned, error contains the reason, EAGAIN if no connection was pending.
+	 */
+	std::vector<std::unique_ptr<socket>> accept_pending(int& error, size_t max = 64, fz::event_handler * handler = nullptr);
+
 	listen_socket_state get_state() const;
 
 	void set_event_handler(event_handler* pEvtHandler);
 
+	/**
+	 * \brief Enables TCP Fast Open for incoming connections
+	 *
+	 * Clients presenting a cookie from an earlier connection can send data along with the SYN,
+	 * which is readable as soon as the connection is accepted. The queue length limits the number
+	 * of pending connections that have not yet completed the handshake. Zero disables it.
+	 *
+	 * Must be called prior to listen. If the system does not support it or has it disabled,
+	 * connections are accepted as usual.
+	 */
+	void set_fast_open(int queue_length) { fast_open_queue_length_ = queue_length; }
+
 private:
+	// Only call while locked
+	socket_t FZ_PRIVATE_SYMBOL do_accept(int& error, bool nonblocking);
+
+	// Listens on a duplicate of the other socket's descriptor, both sockets then accept from the same queue.
+	int FZ_PRIVATE_SYMBOL listen_shared(listen_socket const& other);
+
+	int FZ_PRIVATE_SYMBOL start_listening();
+
 	listen_socket_state state_{};
+
+	// If set prior to listen, the socket gets bound with the option allowing the kernel
+	// to distribute connections across multiple sockets listening on the same port.
+	bool reuse_port_{};
+
+	int fast_open_queue_length_{};
+};
+
+/**
+ * \brief Address of a datagram peer
+ *
+ * Fixed-size storage, avoids allocations when receiving large numbers of datagrams.
+ */
+class FZ_PUBLIC_SYMBOL datagram_address final
+{
+public:
+	datagram_address() = default;
+
+	/// Creates an address from an IPv4 or IPv6 address literal. Returns an empty address on failure.
+	static datagram_address from_ip(std::string const& ip, unsigned int port);
+
+	std::string ip(bool strip_zone_index = false) const;
+
+	/// \return -1 on error
+	int port() const;
+
+	address_type family() const;
+
+	explicit operator bool() const { return size_ != 0; }
+
+	bool operator==(datagram_address const& rhs) const;
+	bool operator!=(datagram_address const& rhs) const { return !(*this == rhs); }
+
+private:
+	friend class datagram_socket;
+
+	// Large enough for sockaddr_storage
+	alignas(8) unsigned char storage_[128]{};
+	unsigned int size_{};
+};
+
+/// A single datagram and the peer it has been received from or is to be sent to.
+struct datagram
+{
+	buffer data;
+	datagram_address peer;
+};
+
+/**
+ * \brief Non-blocking UDP socket sending and receiving datagrams in batches
+ *
+ * Sends read and write socket events the same way as \ref socket, a read event is sent
+ * once datagrams can be received after a call to receive has failed with EAGAIN,
+ * likewise for write events and send.
+ */
+class FZ_PUBLIC_SYMBOL datagram_socket final : public socket_base, public socket_event_source
+{
+	friend class socket_base;
+	friend class socket_thread;
+public:
+	datagram_socket(thread_pool& pool, event_handler* evt_handler);
+
+	/// Waits for events using the passed \ref fz::reactor instead of a thread of its own.
+	datagram_socket(reactor& r, event_handler* evt_handler);
+	virtual ~datagram_socket();
+
+	datagram_socket(datagram_socket const&) = delete;
+	datagram_socket& operator=(datagram_socket const&) = delete;
+
+	/**
+	 * \brief Opens the socket.
+	 *
+	 * Binds to the given port, or a port picked by the operating system if zero, on the
+	 * address passed to bind, or on any address if not bound.
+	 *
+	 * Returns 0 on success, an error code otherwise. Once open, the socket waits for
+	 * datagrams to receive, a read event is sent when there are any.
+	 */
+	int open(address_type family, int port = 0);
+
+	/**
+	 * \brief Receives multiple datagrams
+	 *
+	 * Fills up to count of the passed datagrams, using a single recvmmsg system call where
+	 * available. Each datagram's data is replaced with up to max_size octets, longer datagrams
+	 * are truncated. Buffers retain their capacity, so reusing the same datagrams for
+	 * subsequent calls avoids allocations.
+	 *
+	 * Returns the number of datagrams received or -1 on error. If the error is EAGAIN,
+	 * wait for the next read event.
+	 */
+	int receive(datagram * datagrams, size_t count, size_t max_size, int& error);
+
+	/**
+	 * \brief Sends multiple datagrams
+	 *
+	 * Sends the datagrams in order, using a single sendmmsg system call where available.
+	 * On Linux, consecutive datagrams of equal size to the same peer are handed to the
+	 * kernel as a single segmentation offload (UDP_SEGMENT) send.
+	 *
+	 * Returns the number of datagrams sent, which may be fewer than count, or -1 on error.
+	 * If the error is EAGAIN, wait for the next write event.
+	 */
+	int send(datagram const* datagrams, size_t count, int& error);
+
+	/// Changes the associated event handler, pending events are rewritten to the new handler.
+	void set_event_handler(event_handler* pEvtHandler);
+
+	bool is_open() const;
+
+	/// Closes the socket, it can be opened again afterwards.
+	void close();
+
+private:
+	int FZ_PRIVATE_SYMBOL do_send(datagram const* datagrams, size_t count, int& error);
+
+	bool open_{};
+
+	// Whether UDP_SEGMENT can be used, cleared if the kernel rejects it
+	bool gso_{true};
 };
 
 
@@ -350,6 +510,63 @@ enum class socket_state : unsigned char
 	failed
 };
 
+/**
+ * \brief A region of memory to read into, \sa socket_interface::readv
+ */
+struct socket_iovec
+{
+	void* data{};
+	unsigned int size{};
+};
+
+/**
+ * \brief A region of memory to write from, \sa socket_interface::writev
+ */
+struct socket_const_iovec
+{
+	void const* data{};
+	unsigned int size{};
+};
+
+/**
+ * \brief Statistics of a connected socket, \sa socket::get_stats
+ */
+struct socket_stats
+{
+	/// Octets read from and written to the socket by this process
+	uint64_t bytes_read{};
+	uint64_t bytes_written{};
+
+	/// Whether the following transport statistics are available
+	bool transport_stats{};
+
+	/// Smoothed round-trip time and its variance as estimated by the transport, in microseconds
+	uint64_t rtt{};
+	uint64_t rtt_variance{};
+
+	/// Number of retransmitted segments
+	uint64_t retransmits{};
+
+	/// Congestion window in octets
+	uint64_t congestion_window{};
+
+	/// Octets sent but not yet acknowledged
+	uint64_t bytes_in_flight{};
+};
+
+/// Memory used by a socket or layer, \sa socket_interface::get_memory_usage
+struct socket_memory_usage final
+{
+	/// E.g. "socket" or "tls_layer"
+	char const* name_{};
+
+	/// Combined size of the objects making up the socket or layer
+	size_t object_size_{};
+
+	/// Memory allocated on the heap for buffers and other state, excluding memory held by third-party libraries
+	size_t heap_size_{};
+};
+
 /**
  * \brief Interface for sockets
  *
@@ -364,6 +581,46 @@ public:
 	virtual int read(void* buffer, unsigned int size, int& error) = 0;
 	virtual int write(void const* buffer, unsigned int size, int& error) = 0;
 
+	/**
+	 * \brief Scatter read, fills the passed buffers in order.
+	 *
+	 * Same semantics as read, returns the total number of octets read, which
+	 * may be fewer than the combined size of the buffers.
+	 */
+	virtual int readv(socket_iovec const* buffers, size_t count, int& error) = 0;
+
+	/**
+	 * \brief Gather write, writes the passed buffers in order.
+	 *
+	 * Same semantics as write, returns the total number of octets written, which
+	 * may be fewer than the combined size of the buffers.
+	 */
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) = 0;
+
+	/**
+	 * \brief Sends data from a file, avoiding copies through userspace where possible.
+	 *
+	 * Sends up to size octets from the file, starting at the passed offset. Does not
+	 * use or modify the file's position.
+	 *
+	 * Same semantics as write, returns the number of octets sent, which may be fewer than
+	 * requested. Returns 0 if there is no data in the file at the offset.
+	 *
+	 * Layers transforming the data fail with EOPNOTSUPP, in which case the data needs
+	 * to be read and written instead.
+	 */
+	virtual int send_file(file & f, uint64_t offset, unsigned int size, int& error) = 0;
+
+	/**
+	 * \brief Reads directly into a buffer, appending up to max octets.
+	 *
+	 * Same semantics as read, returns the number of octets appended.
+	 *
+	 * The default implementation reserves room for min(max, 64 KiB) octets and calls read.
+	 * Implementations that know how much data is available reserve just as much as needed.
+	 */
+	virtual int read_into(buffer & buf, size_t max, int& error);
+
 	template<typename T, std::enable_if_t<std::is_signed_v<T>, int> = 0>
 	int read(void* buffer, T size, int& error)
 	{
@@ -426,6 +683,49 @@ public:
 	/// \see socket_layer::shutdown_read
 	virtual int shutdown_read() = 0;
 
+	/**
+	 * \brief Appends the memory usage of this socket or layer and of all layers below it.
+	 *
+	 * Useful to audit the per-connection cost of servers with many connections.
+	 * The default implementation reports nothing.
+	 */
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const;
+
+	/**
+	 * \brief Releases memory not needed while the connection is idle.
+	 *
+	 * Empty buffers get released and are recreated on demand once there is data again.
+	 * Call it for connections not expected to transfer data for a while, e.g. idle
+	 * control connections, and after having handled all pending socket events.
+	 *
+	 * Layers pass the call on to the layers below them. The default implementation
+	 * does nothing.
+	 */
+	virtual void hibernate() {}
+
+	/**
+	 * \brief Holds back partially filled segments and records until uncork is called.
+	 *
+	 * Protocols often write a single logical message using several small writes, e.g. a
+	 * status line, headers and a body. Cork before the first and uncork after the last write
+	 * to have the message leave in as few TCP segments and TLS records as possible.
+	 *
+	 * Writes behave as usual while corked, but layers may buffer what gets written instead
+	 * of passing it on right away. Corking does not nest, a single uncork releases everything.
+	 * Always uncork after having written the message, or it may be delayed by up to 200ms.
+	 *
+	 * Layers cork themselves and the layers below them. The default implementation does nothing.
+	 */
+	virtual void cork() {}
+
+	/**
+	 * \brief Passes on everything held back since cork.
+	 *
+	 * Returns 0 on success, an error code otherwise. Data that cannot be sent right away gets
+	 * sent once the socket is writable again, like data buffered by a successful write.
+	 */
+	virtual int uncork() { return 0; }
+
 protected:
 	socket_interface() = delete;
 
@@ -447,12 +747,16 @@ class FZ_PUBLIC_SYMBOL socket final : public socket_base, public socket_interfac
 	friend class socket_thread;
 public:
 	socket(thread_pool& pool, event_handler* evt_handler);
+
+	/// Creates a socket that waits for events using the passed \ref fz::reactor instead of a thread of its own.
+	socket(reactor& r, event_handler* evt_handler);
 	virtual ~socket();
 
 	socket(socket const&) = delete;
 	socket& operator=(socket const&) = delete;
 
 	static std::unique_ptr<socket> from_descriptor(socket_descriptor && desc, thread_pool & pool, int & error, fz::event_handler * handler = nullptr);
+	static std::unique_ptr<socket> from_descriptor(socket_descriptor && desc, reactor & r, int & error, fz::event_handler * handler = nullptr);
 
 	socket_state get_state() const override;
 	bool is_connected() const {
@@ -509,6 +813,23 @@ public:
 	 */
 	virtual int write(void const* buffer, unsigned int size, int& error) override;
 
+	/// Like read, but using a single readv-style system call for all buffers.
+	virtual int readv(socket_iovec const* buffers, size_t count, int& error) override;
+
+	/// Sized to the amount of data the system has already received, \sa socket_interface::read_into
+	virtual int read_into(buffer & buf, size_t max, int& error) override;
+
+	/// Like write, but using a single writev-style system call for all buffers.
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) override;
+
+	/**
+	 * \brief See socket_interface::send_file
+	 *
+	 * Uses sendfile on Linux. Elsewhere, or if the file does not support it, the data is read
+	 * into a temporary buffer, sent, and what has not been sent is read again on the next call.
+	 */
+	virtual int send_file(file & f, uint64_t offset, unsigned int size, int& error) override;
+
 	/**
 	* \brief Returns remote address of a connected socket
 	*
@@ -526,6 +847,45 @@ public:
 	*/
 	virtual int peer_port(int& error) const override;
 
+	/**
+	 * \brief Returns transfer statistics
+	 *
+	 * The octet counters are kept by this class. Transport statistics come from TCP_INFO,
+	 * or SIO_TCP_INFO on Windows, and are only set if the socket is connected and the
+	 * platform supports it. Cheap enough to call for every completed transfer.
+	 */
+	socket_stats get_stats() const;
+
+	/// Reports the socket itself and its internal state shared with the reactor
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const override;
+
+	/**
+	 * \brief See socket_interface::cork
+	 *
+	 * Uses TCP_CORK on Linux and TCP_NOPUSH on the BSDs and macOS. Does nothing on other systems
+	 * or if the socket is not connected.
+	 */
+	virtual void cork() override;
+	virtual int uncork() override;
+
+	/**
+	 * \brief Enables or disables adaptive buffer sizing
+	 *
+	 * While transferring data, the socket periodically estimates the bandwidth-delay product
+	 * of each direction from the round-trip time and throughput, and grows its send and
+	 * receive buffers towards it. Buffers never shrink and are only grown beyond what the
+	 * kernel picked on its own, up to 32 MiB each.
+	 *
+	 * Memory for grown buffers is taken from a budget shared by all sockets,
+	 * \sa set_adaptive_buffer_budget
+	 *
+	 * Do not combine with \ref set_buffer_sizes.
+	 */
+	void set_adaptive_buffer_sizes(bool enable);
+
+	/// Sets the memory budget shared by all sockets with adaptive buffer sizing, 256 MiB by default.
+	static void set_adaptive_buffer_budget(uint64_t octets);
+
 	/**
 	 * On a connected socket, gets the ideal send buffer size or
 	 * -1 if it cannot be determined.
@@ -556,7 +916,24 @@ public:
 		flag_nodelay = 0x01,
 
 		/// flag_keepalive enables TCP keepalive.
-		flag_keepalive = 0x02
+		flag_keepalive = 0x02,
+
+		/**
+		 * \brief flag_fast_open enables TCP Fast Open on the next call to connect.
+		 *
+		 * Once the socket has a cookie from an earlier connection to the same server, connecting
+		 * completes right away and the SYN is only sent with the data of the first write, saving
+		 * a round trip. Without a cookie, or if the system or the server does not support it,
+		 * connecting proceeds as usual.
+		 *
+		 * Only use it for protocols where the client sends first: If a cookie is present,
+		 * nothing is sent to the server before the first write. Errors connecting to the
+		 * server are then reported by the first write or read instead of the connection event,
+		 * and no further addresses of the host are tried.
+		 *
+		 * Currently only supported on Linux.
+		 */
+		flag_fast_open = 0x04
 	};
 
 	int flags() const { return flags_; }
@@ -574,6 +951,20 @@ public:
 	 */
 	void set_keepalive_interval(duration const& d);
 
+	/**
+	 * \brief Sets the delay between connection attempts if a host resolves to multiple addresses.
+	 *
+	 * Following RFC 8305 (Happy Eyeballs), if an attempt has not completed after the delay, an
+	 * attempt to the next address is started in parallel. Address families are tried alternately.
+	 * The first attempt to succeed is used, the others are closed.
+	 *
+	 * The default delay is 250 milliseconds. A delay of zero disables parallel attempts, each
+	 * attempt then has to fail before the next address is tried.
+	 *
+	 * Takes effect on the next call to connect.
+	 */
+	void set_connection_attempt_delay(duration const& d);
+
 	virtual int shutdown_read() override { return 0; }
 
 	socket_t get_descriptor();
@@ -611,12 +1002,35 @@ public:
 private:
 	friend class socket_base;
 	friend class listen_socket;
+	friend class tls_layer_impl;
+
+	static std::unique_ptr<socket> FZ_PRIVATE_SYMBOL adopt_descriptor(std::unique_ptr<socket> && s, socket_descriptor && desc, int & error, fz::event_handler * handler, bool nonblocking = false);
+
+	// Kernel TLS support for tls_layer_impl, errno-style. Record types are those of the TLS record layer, 23 is application data.
+	int FZ_PRIVATE_SYMBOL set_tls_offload(bool receive, void const* crypto_info, unsigned int size);
+	int FZ_PRIVATE_SYMBOL send_tls_record(unsigned char type, void const* buffer, unsigned int size, int& error);
+	int FZ_PRIVATE_SYMBOL read_tls_record(unsigned char & type, void* buffer, unsigned int size, int& error);
+
 	native_string host_;
 
 	duration keepalive_interval_;
+	duration connection_attempt_delay_;
+
+	void FZ_PRIVATE_SYMBOL add_transferred(uint64_t & counter, int octets);
+	void FZ_PRIVATE_SYMBOL adapt_buffer_sizes();
+
+	uint64_t bytes_read_{};
+	uint64_t bytes_written_{};
+
+	// Adaptive buffer sizing, indexed by receive and send
+	monotonic_clock sample_start_;
+	uint64_t sample_octets_[2]{};
+	uint64_t adaptive_reserved_[2]{};
+	bool adaptive_buffers_{};
 
 	int flags_{};
 	socket_state state_{};
+	bool corked_{};
 };
 
 /**
@@ -663,6 +1077,20 @@ public:
 	/// The next layer further down. Usually another layer or the actual socket.
 	socket_interface& next() { return next_layer_; }
 
+	/**
+	 * \brief Default implementation, calls read for the first non-empty buffer.
+	 *
+	 * Reading into the following buffers could result in an error that cannot be
+	 * reported as data already got read, layers able to avoid this should override it.
+	 */
+	virtual int readv(socket_iovec const* buffers, size_t count, int& error) override;
+
+	/// Default implementation, calls write for the first non-empty buffer. \sa readv
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) override;
+
+	/// Default implementation, fails with EOPNOTSUPP. Layers not transforming the data may pass it on to the next layer.
+	virtual int send_file(file & f, uint64_t offset, unsigned int size, int& error) override;
+
 	/**
 	 * \brief Check that all layers further down also have reached EOF.
 	 *
@@ -698,6 +1126,26 @@ public:
 		return next_layer_.get_state();
 	}
 
+	/// Default implementation, reports the next layer only. Layers with state of their own should override it.
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const override {
+		next_layer_.get_memory_usage(usage);
+	}
+
+	/// Default implementation, passes the call on to the next layer
+	virtual void hibernate() override {
+		next_layer_.hibernate();
+	}
+
+	/// Default implementation, passes the call on to the next layer. Layers that buffer written data should override it.
+	virtual void cork() override {
+		next_layer_.cork();
+	}
+
+	/// Default implementation, passes the call on to the next layer
+	virtual int uncork() override {
+		return next_layer_.uncork();
+	}
+
 protected:
 	/**
 	 * Call in a derived classes handler for fz::socket_event. Results in
@@ -706,6 +1154,18 @@ protected:
 	 */
 	void forward_socket_event(socket_event_source* source, socket_event_flag t, int error);
 
+	/**
+	 * \brief Signals a socket event of this layer to the event handler passed to socket_layer.
+	 *
+	 * For layers that are event handlers themselves: Pass the layer's own handler as current.
+	 * If called while current handles an event of the next layer, the event handler gets
+	 * invoked directly if it runs on the same event loop. Readiness changes of the socket then
+	 * travel through the whole stack of layers as a single event. Otherwise the event gets sent.
+	 *
+	 * Do not access the layer after calling this function, the handler might have destroyed it.
+	 */
+	void signal_socket_event(event_handler & current, socket_event_flag t, int error);
+
 	/**
 	 * Call in a derived classes handler for fz::hostaddress_event. Results in
 	 * a call to operator()(fz::event_base const&) on the event handler passed
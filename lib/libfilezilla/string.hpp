@@ -4,6 +4,10 @@
 #include "libfilezilla.hpp"
 
 #include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <iterator>
+#include <limits>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -114,6 +118,17 @@ std::wstring FZ_PUBLIC_SYMBOL str_tolower_ascii(std::wstring_view const& s);
 std::string FZ_PUBLIC_SYMBOL str_toupper_ascii(std::string_view const& s);
 std::wstring FZ_PUBLIC_SYMBOL str_toupper_ascii(std::wstring_view const& s);
 
+/** \brief Locale-insensitive search for the first difference ignoring case
+ *
+ * Returns the index of the first character that differs between the strings after
+ * applying \ref tolower_ascii to both, or the size of the shorter string if there is
+ * no such character.
+ *
+ * Compares blocks of characters at once where the CPU supports it.
+ */
+size_t FZ_PUBLIC_SYMBOL mismatch_insensitive_ascii(std::string_view const& a, std::string_view const& b);
+size_t FZ_PUBLIC_SYMBOL mismatch_insensitive_ascii(std::wstring_view const& a, std::wstring_view const& b);
+
 /** \brief Comparator to be used for std::map for case-insensitive keys
  *
  * Comparison is done locale-agnostic.
@@ -123,11 +138,22 @@ struct FZ_PUBLIC_SYMBOL less_insensitive_ascii final
 {
 	template<typename T>
 	bool operator()(T const& lhs, T const& rhs) const {
-		return std::lexicographical_compare(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend(),
-		    [](typename T::value_type const& a, typename T::value_type const& b) {
-			    return tolower_ascii(a) < tolower_ascii(b);
-		    }
-		);
+		if constexpr (std::is_convertible_v<T const&, std::string_view> || std::is_convertible_v<T const&, std::wstring_view>) {
+			std::basic_string_view<typename T::value_type> const a = lhs;
+			std::basic_string_view<typename T::value_type> const b = rhs;
+			size_t const i = mismatch_insensitive_ascii(a, b);
+			if (i < a.size() && i < b.size()) {
+				return tolower_ascii(a[i]) < tolower_ascii(b[i]);
+			}
+			return a.size() < b.size();
+		}
+		else {
+			return std::lexicographical_compare(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend(),
+			    [](typename T::value_type const& a, typename T::value_type const& b) {
+				    return tolower_ascii(a) < tolower_ascii(b);
+			    }
+			);
+		}
 	}
 };
 
@@ -137,19 +163,11 @@ struct FZ_PUBLIC_SYMBOL less_insensitive_ascii final
  */
 inline bool equal_insensitive_ascii(std::string_view a, std::string_view b)
 {
-	return std::equal(a.cbegin(), a.cend(), b.cbegin(), b.cend(),
-	    [](auto const& a, auto const& b) {
-		    return tolower_ascii(a) == tolower_ascii(b);
-	    }
-	);
+	return a.size() == b.size() && mismatch_insensitive_ascii(a, b) == a.size();
 }
 inline bool equal_insensitive_ascii(std::wstring_view a, std::wstring_view b)
 {
-	return std::equal(a.cbegin(), a.cend(), b.cbegin(), b.cend(),
-	    [](auto const& a, auto const& b) {
-		    return tolower_ascii(a) == tolower_ascii(b);
-	    }
-	);
+	return a.size() == b.size() && mismatch_insensitive_ascii(a, b) == a.size();
 }
 
 /** \brief Converts from std::string in system encoding into std::wstring
@@ -339,6 +357,217 @@ inline auto FZ_PUBLIC_SYMBOL strtok_view(std::wstring_view const& tokens, wchar_
 	return strtok_view(tokens, std::wstring_view(&delim, 1), ignore_empty);
 }
 
+/**
+ * \brief Tokenizes a string lazily, without allocating.
+ *
+ * Iterating yields the same tokens as \ref strtok_view returns, with the same meaning of
+ * \c delims and \c ignore_empty:
+ * \code
+ * for (auto token : fz::strtokenizer(line, ' ')) {
+ *     ...
+ * }
+ * \endcode
+ *
+ * With a single delimiter, the next one is found using memchr or wmemchr.
+ *
+ * \warning The tokens are views into the string passed in, mind its lifetime. Unless
+ * there is just one, the delimiters are referenced as well.
+ */
+template<typename Char>
+class basic_strtokenizer final
+{
+public:
+	typedef std::basic_string_view<Char> view_type;
+
+	basic_strtokenizer(view_type const& tokens, view_type const& delims, bool const ignore_empty = true)
+		: tokens_(tokens)
+		, delims_(delims)
+		, ignore_empty_(ignore_empty)
+	{
+		if (delims_.size() == 1) {
+			single_ = true;
+			delim_ = delims_[0];
+		}
+		else if constexpr (sizeof(Char) == 1) {
+			for (auto const& c : delims_) {
+				auto const v = static_cast<unsigned char>(c);
+				delim_set_[v / 64] |= uint64_t(1) << (v % 64);
+			}
+		}
+	}
+
+	basic_strtokenizer(view_type const& tokens, Char const delim, bool const ignore_empty = true)
+		: tokens_(tokens)
+		, ignore_empty_(ignore_empty)
+		, single_(true)
+		, delim_(delim)
+	{}
+
+	class iterator final
+	{
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef view_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef view_type const* pointer;
+		typedef view_type const& reference;
+
+		/// The end iterator
+		iterator() = default;
+
+		reference operator*() const { return token_; }
+		pointer operator->() const { return &token_; }
+
+		iterator& operator++() {
+			advance();
+			return *this;
+		}
+
+		iterator operator++(int) {
+			iterator ret = *this;
+			advance();
+			return ret;
+		}
+
+		bool operator==(iterator const& op) const { return owner_ == op.owner_ && pos_ == op.pos_; }
+		bool operator!=(iterator const& op) const { return !(*this == op); }
+
+	private:
+		friend class basic_strtokenizer;
+
+		explicit iterator(basic_strtokenizer const* owner)
+			: owner_(owner)
+		{
+			advance();
+		}
+
+		void advance() {
+			auto const& s = owner_->tokens_;
+			while (pos_ < s.size()) {
+				size_t const start = pos_;
+				size_t const end = owner_->find(start);
+				if (end == view_type::npos) {
+					token_ = s.substr(start);
+					pos_ = s.size();
+					return;
+				}
+				pos_ = end + 1;
+				if (end > start || !owner_->ignore_empty_) {
+					token_ = s.substr(start, end - start);
+					return;
+				}
+			}
+			*this = iterator();
+		}
+
+		basic_strtokenizer const* owner_{};
+
+		// Where the remainder after the current token starts
+		size_t pos_{};
+		view_type token_;
+	};
+
+	iterator begin() const { return iterator(this); }
+	iterator end() const { return iterator(); }
+
+private:
+	size_t find(size_t pos) const {
+		if (single_) {
+			return tokens_.find(delim_, pos);
+		}
+		if constexpr (sizeof(Char) == 1) {
+			for (size_t i = pos; i < tokens_.size(); ++i) {
+				auto const v = static_cast<unsigned char>(tokens_[i]);
+				if (delim_set_[v / 64] & (uint64_t(1) << (v % 64))) {
+					return i;
+				}
+			}
+			return view_type::npos;
+		}
+		else {
+			return tokens_.find_first_of(delims_, pos);
+		}
+	}
+
+	view_type const tokens_;
+	view_type const delims_;
+	bool const ignore_empty_;
+
+	bool single_{};
+	Char delim_{};
+
+	// For narrow strings with multiple delimiters, a bitmap of the delimiters
+	uint64_t delim_set_[4]{};
+};
+
+typedef basic_strtokenizer<char> strtokenizer;
+typedef basic_strtokenizer<wchar_t> wstrtokenizer;
+
+/// \private
+namespace detail {
+inline constexpr char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+// Writes the digits backwards, two at a time, ending before end. Returns the first digit.
+template<typename Char, typename U>
+Char* write_digits_backwards(Char* end, U v) noexcept
+{
+	static_assert(std::is_unsigned_v<U>);
+	while (v >= 100) {
+		size_t const r = static_cast<size_t>(v % 100) * 2;
+		v /= 100;
+		*--end = static_cast<Char>(digit_pairs[r + 1]);
+		*--end = static_cast<Char>(digit_pairs[r]);
+	}
+	if (v >= 10) {
+		size_t const r = static_cast<size_t>(v) * 2;
+		*--end = static_cast<Char>(digit_pairs[r + 1]);
+		*--end = static_cast<Char>(digit_pairs[r]);
+	}
+	else {
+		*--end = static_cast<Char>('0' + v);
+	}
+	return end;
+}
+
+template<typename T>
+std::make_unsigned_t<T> unsigned_abs(T v) noexcept
+{
+	typedef std::make_unsigned_t<T> U;
+	if constexpr (std::is_signed_v<T>) {
+		return v < 0 ? static_cast<U>(U(0) - static_cast<U>(v)) : static_cast<U>(v);
+	}
+	else {
+		return v;
+	}
+}
+}
+
+/// The maximum number of characters \ref integral_to_chars writes for type T
+template<typename T>
+constexpr size_t max_integral_chars = std::numeric_limits<T>::digits10 + 2;
+
+/**
+ * \brief Writes the decimal representation of an integer, without allocating.
+ *
+ * Negative numbers are prefixed by a minus sign. There is no terminating null.
+ *
+ * \param out Must have room for at least \ref max_integral_chars<T> characters.
+ * \return Pointer past the last character written.
+ */
+template<typename Char, typename T, typename std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>, int> = 0>
+Char* integral_to_chars(Char* out, T const value) noexcept
+{
+	Char buf[max_integral_chars<T>];
+	Char* const end = buf + max_integral_chars<T>;
+	Char* p = detail::write_digits_backwards(end, detail::unsigned_abs(value));
+	if constexpr (std::is_signed_v<T>) {
+		if (value < 0) {
+			*--p = '-';
+		}
+	}
+	return std::copy(p, end, out);
+}
+
 /// \private
 template<typename T, typename String>
 T to_integral_impl(String const& s, T const errorval = T())
@@ -350,33 +579,65 @@ T to_integral_impl(String const& s, T const errorval = T())
 		return static_cast<T>(to_integral_impl<std::underlying_type_t<T>>(s, static_cast<std::underlying_type_t<T>>(errorval)));
 	}
 	else {
-		T ret{};
-		auto it = s.cbegin();
-		if (it != s.cend() && (*it == '-' || *it == '+')) {
-			++it;
+		typedef std::make_unsigned_t<T> U;
+
+		auto p = s.data();
+		auto const end = p + s.size();
+		bool const negative = p != end && *p == '-';
+		if (p != end && (*p == '-' || *p == '+')) {
+			++p;
 		}
 
-		if (it == s.cend()) {
+		if (p == end) {
 			return errorval;
 		}
 
-		for (; it != s.cend(); ++it) {
-			auto const& c = *it;
-			if (c < '0' || c > '9') {
+		U v{};
+		if constexpr (std::is_same_v<std::decay_t<decltype(*p)>, char>) {
+			auto const res = std::from_chars(p, end, v);
+			if (res.ec != std::errc() || res.ptr != end) {
 				return errorval;
 			}
-			ret *= 10;
-			ret += c - '0';
+		}
+		else {
+			// The first digits10 digits cannot overflow
+			auto const unchecked = (end - p > std::numeric_limits<U>::digits10) ? p + std::numeric_limits<U>::digits10 : end;
+			for (; p != unchecked; ++p) {
+				unsigned int const d = static_cast<unsigned int>(*p) - '0';
+				if (d > 9) {
+					return errorval;
+				}
+				v = static_cast<U>(v * 10 + d);
+			}
+			for (; p != end; ++p) {
+				unsigned int const d = static_cast<unsigned int>(*p) - '0';
+				if (d > 9 || v > (std::numeric_limits<U>::max() - d) / 10) {
+					return errorval;
+				}
+				v = static_cast<U>(v * 10 + d);
+			}
 		}
 
-		if (!s.empty() && s.front() == '-') {
-			ret *= static_cast<T>(-1);
+		if constexpr (std::is_signed_v<T>) {
+			if (negative) {
+				if (v > static_cast<U>(std::numeric_limits<T>::max()) + 1u) {
+					return errorval;
+				}
+				return static_cast<T>(U(0) - v);
+			}
+			else if (v > static_cast<U>(std::numeric_limits<T>::max())) {
+				return errorval;
+			}
+			return static_cast<T>(v);
+		}
+		else {
+			// Negative values wrap around
+			return negative ? static_cast<T>(U(0) - v) : v;
 		}
-		return ret;
 	}
 }
 
-/// Converts string to integral type T. If string is not convertible, errorval is returned.
+/// Converts string to integral type T. If string is not convertible or out of range, errorval is returned.
 template<typename T>
 T to_integral(std::string_view const& s, T const errorval = T()) {
 	return to_integral_impl<T>(s, errorval);
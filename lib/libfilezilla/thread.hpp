@@ -4,6 +4,8 @@
 #include "libfilezilla.hpp"
 
 #include <functional>
+#include <string>
+#include <vector>
 
 #if !defined(FZ_WINDOWS) || !(defined(__MINGW32__) || defined(__MINGW64__))
 #include <thread>
@@ -15,6 +17,37 @@
 
 namespace fz {
 
+/** \brief Where a thread runs and how it is called
+ *
+ * \sa thread::run, thread_pool::set_placement, set_thread_placement
+ */
+struct FZ_PUBLIC_SYMBOL thread_placement final
+{
+	/** \brief Name of the thread, as shown by debuggers and profilers
+	 *
+	 * On Linux, only the first 15 characters are used. Not set if empty.
+	 */
+	std::string name;
+
+	/// Indexes of the CPUs the thread may run on. If empty, the thread may run on any CPU.
+	std::vector<unsigned int> cpus;
+
+	explicit operator bool() const { return !name.empty() || !cpus.empty(); }
+};
+
+/** \brief Applies the placement to the calling thread
+ *
+ * Returns false if the CPU affinity could not be set, e.g. if unsupported by the platform
+ * or if none of the CPUs are available to the process. Failing to set the name is not an error.
+ */
+bool FZ_PUBLIC_SYMBOL set_thread_placement(thread_placement const& placement);
+
+/** \brief Returns the CPUs of each NUMA node
+ *
+ * On systems without NUMA or where the topology cannot be determined, all CPUs form a single node.
+ */
+std::vector<std::vector<unsigned int>> FZ_PUBLIC_SYMBOL get_numa_nodes();
+
 /** \brief Spawns and represents a new thread of execution
  *
  * This is a replacement of std::thread. Unfortunately std::thread isn't implemented
@@ -47,6 +80,13 @@ public:
 	 */
 	bool run(std::function<void()> && f);
 
+	/** \brief Start the thread with the given placement.
+	 *
+	 * The placement is applied by the new thread before calling the function, the
+	 * thread still runs if it cannot be applied.
+	 */
+	bool run(std::function<void()> && f, thread_placement const& placement);
+
 	/** \brief Join the thread
 	 *
 	 * join blocks until the spawn thread has quit.
@@ -3,9 +3,15 @@
 
 #include "libfilezilla.hpp"
 #include "mutex.hpp"
+#include "thread.hpp"
+#include "unique_function.hpp"
 
+#include <deque>
 #include <functional>
+#include <map>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 /** \file
@@ -49,40 +55,221 @@ private:
 	async_task_impl* impl_{};
 };
 
+/// \private
+class pooled_task_impl;
+
+/** \brief Lightweight handle for tasks submitted with \ref thread_pool::submit
+ *
+ * Has the same join and detach semantics as \ref async_task, but does not occupy
+ * a thread of its own while waiting to be run.
+ */
+class FZ_PUBLIC_SYMBOL pooled_task final {
+public:
+	pooled_task() = default;
+
+	/// If task has not been detached, calls join
+	~pooled_task();
+
+	pooled_task(pooled_task const&) = delete;
+	pooled_task& operator=(pooled_task const&) = delete;
+
+	pooled_task(pooled_task && other) noexcept;
+	pooled_task& operator=(pooled_task && other) noexcept;
+
+	/** \brief Wait for the task to finish.
+	 *
+	 * If no worker has started the task yet, it is run in the calling thread.
+	 */
+	void join();
+
+	/// Check whether it's a submitted, unjoined task.
+	explicit operator bool() const { return impl_ != nullptr; }
+
+	/// Detach from the task, it still gets run.
+	void detach();
+
+private:
+	friend class thread_pool;
+
+	pooled_task_impl* impl_{};
+};
+
 /// \private
 class pooled_thread_impl;
 
+/// \private
+class task_scheduler;
+
+/// \brief Statistics about the threads of a \ref fz::thread_pool "thread_pool", \sa thread_pool::get_stats
+struct thread_pool_stats final
+{
+	/// Number of threads currently alive, including idle ones
+	size_t threads{};
+
+	/// Number of threads waiting for a task
+	size_t idle{};
+
+	/// Number of spawned tasks waiting for a thread
+	size_t queued{};
+
+	/// Highest number of threads alive at the same time
+	size_t peak{};
+};
+
+/// \brief Time spent running spawned tasks, \sa thread_pool_accounting
+struct thread_pool_usage final
+{
+	/// Number of tasks that have finished
+	uint64_t tasks{};
+
+	/// CPU time used by the tasks, in microseconds. Zero if the platform cannot measure it.
+	uint64_t cpu_us{};
+
+	/// Wall-clock time taken by the tasks, in microseconds. The difference to the CPU time is spent waiting.
+	uint64_t wall_us{};
+};
+
+/** \brief Snapshot of the accounting data of a \ref fz::thread_pool "thread_pool", \sa thread_pool::enable_accounting
+ *
+ * Times include those of tasks that are still running.
+ */
+struct thread_pool_accounting final
+{
+	/// Keyed by the category passed to \ref thread_pool::spawn, tasks spawned without one have an empty category
+	std::map<std::string, thread_pool_usage> categories;
+
+	/// One entry per thread currently alive
+	std::vector<thread_pool_usage> threads;
+};
+
 /** \brief A dumb thread-pool for asynchronous tasks
  *
  * If there are no idle threads, threads are created on-demand if spawning an asynchronous task.
  * Once an asynchronous task finishes, the corresponding thread is kept idle until the pool is
- * destroyed.
+ * destroyed, or until the idle timeout has elapsed.
  *
- * Any number of tasks can be run concurrently.
+ * Unless limited with \ref set_max_threads, any number of tasks can be run concurrently.
+ *
+ * In addition, short tasks can be submitted to a fixed number of workers. Each worker has
+ * its own task queue, idle workers steal tasks from the queues of the other workers.
+ * Tasks submitted from within a worker are queued with that worker.
  */
 class FZ_PUBLIC_SYMBOL thread_pool final
 {
 public:
 	thread_pool();
+
+	/** \brief Creates a pool with the given number of workers for \ref submit
+	 *
+	 * If workers is 0, the number of CPUs is used.
+	 */
+	explicit thread_pool(size_t workers);
+
 	~thread_pool();
 
 	thread_pool(thread_pool const&) = delete;
 	thread_pool& operator=(thread_pool const&) = delete;
 
-	/// Spawns a new asynchronous task.
-	async_task spawn(std::function<void()> const& f);
-	async_task spawn(std::function<void()> && f);
+	/** \brief Spawns a new asynchronous task.
+	 *
+	 * The category is only used to attribute the time spent by the task if accounting is enabled.
+	 */
+	async_task spawn(unique_function<void()> && f, std::string_view category = {});
+
+	/** \brief Submits a short task to the workers.
+	 *
+	 * Unlike with \ref spawn, the number of concurrently running tasks is bounded
+	 * by the number of workers, so the task should not block for long. The workers
+	 * are started when the first task is submitted.
+	 *
+	 * Tasks still queued when the pool is destroyed are run before the destructor returns.
+	 */
+	pooled_task submit(unique_function<void()> && f);
+
+	/** \brief Limits the number of threads used by \ref spawn
+	 *
+	 * If the limit is reached and there are no idle threads, spawned tasks are queued
+	 * and run in FIFO order once threads become available. Returned tasks can be joined
+	 * and detached as usual while queued.
+	 *
+	 * 0, the default, means unlimited.
+	 *
+	 * \warning Tasks waiting on the completion of other spawned tasks can deadlock
+	 * if the limit is too low.
+	 */
+	void set_max_threads(size_t max);
+
+	/** \brief Lets idle threads terminate after the given time
+	 *
+	 * Only applies to threads that become idle after the timeout has been set.
+	 * A zero duration, the default, keeps idle threads alive until the pool is destroyed.
+	 */
+	void set_idle_timeout(duration const& timeout);
+
+	/** \brief Sets where the threads of the pool run and how they are called
+	 *
+	 * Applies to threads created afterwards. Threads used by \ref spawn get the placement as-is,
+	 * the workers used by \ref submit get their index appended to the name. The workers are
+	 * created on the first submit, so set the placement before.
+	 *
+	 * If numa_workers is set, the workers are split into one group per NUMA node, each restricted
+	 * to the CPUs of its node, or to those of its node in the placement if it restricts the CPUs.
+	 * Idle workers steal tasks from the workers of their own group first.
+	 *
+	 * \sa get_numa_nodes
+	 */
+	void set_placement(thread_placement const& placement, bool numa_workers = false);
+
+	thread_pool_stats get_stats() const;
+
+	/** \brief Enables or disables accounting of the time spent by spawned tasks.
+	 *
+	 * When enabled, each task measures its CPU and wall-clock time, aggregated by thread and by
+	 * the category passed to \ref spawn. Tasks started before enabling are not accounted.
+	 * Tasks submitted to the workers are not accounted either.
+	 *
+	 * Collected data is kept when disabling, \sa reset_accounting
+	 */
+	void enable_accounting(bool enable);
+
+	/// Returns a snapshot of the accounting data
+	thread_pool_accounting get_accounting() const;
+
+	/// Clears the accounting data
+	void reset_accounting();
 
 private:
 	pooled_thread_impl* get_or_create_thread();
+	task_scheduler* get_scheduler();
+
+	// Hands the oldest queued task to the thread, returns false if there is none
+	bool dequeue(pooled_thread_impl & t, scoped_lock & l);
+
+	// Called by a thread terminating itself after the idle timeout
+	void reap(pooled_thread_impl * t);
 
 	friend class async_task;
 	friend class pooled_thread_impl;
 
 	std::vector<pooled_thread_impl*> threads_;
 	std::vector<pooled_thread_impl*> idle_;
-	mutex m_{false};
+	std::vector<pooled_thread_impl*> reaped_;
+	std::deque<async_task_impl*> queue_;
+	mutable mutex m_{false};
 	bool quit_{};
+
+	size_t max_threads_{};
+	size_t peak_threads_{};
+	duration idle_timeout_;
+
+	thread_placement placement_;
+	bool numa_workers_{};
+
+	bool accounting_{};
+	std::map<std::string, thread_pool_usage> categories_;
+
+	size_t workers_{};
+	std::unique_ptr<task_scheduler> scheduler_;
 };
 
 }
@@ -0,0 +1,66 @@
+#ifndef LIBFILEZILLA_THROTTLED_LOGGER_HEADER
+#define LIBFILEZILLA_THROTTLED_LOGGER_HEADER
+
+#include "logger.hpp"
+#include "time.hpp"
+
+#include <memory>
+
+/** \file
+ * \brief A logger bounding the number of repeated messages
+ */
+
+namespace fz {
+
+/**
+ * \brief Keeps the cost of logging bounded under pathological load
+ *
+ * Passes messages on to a target logger, but only up to a limit of similar messages per
+ * time window. Further similar messages in the same window are suppressed, once the window
+ * has passed a summary with the number of suppressed messages and the last suppressed
+ * message gets logged instead.
+ *
+ * Messages with a format string wrapped in \ref FZ_FORMAT are similar if they share the
+ * format string, regardless of their arguments. These are neither formatted if suppressed
+ * nor if skipped by sampling. Any other messages are similar if their text is identical.
+ *
+ * In addition, sampling can be enabled for individual message types, so that only every
+ * n-th message of that type gets passed on.
+ *
+ * The log levels of the throttled_logger decide what gets logged, those of the target are ignored.
+ */
+class FZ_PUBLIC_SYMBOL throttled_logger final : public logger_interface
+{
+public:
+	/**
+	 * \brief Creates the logger
+	 *
+	 * The target needs to outlive the throttled_logger.
+	 * Passes on at most max_per_window similar messages per window.
+	 */
+	throttled_logger(logger_interface & target, duration const& window = duration::from_seconds(1), size_t max_per_window = 10);
+
+	/// Logs the summaries of the current window
+	virtual ~throttled_logger();
+
+	virtual void do_log(logmsg::type t, std::wstring && msg) override;
+	virtual void do_log_deferred(logmsg::type t, deferred_log_message && msg) override;
+
+	/**
+	 * \brief Only passes on every n-th message of the given types
+	 *
+	 * Skipped messages are counted in the summaries. 0 and 1 disable sampling.
+	 */
+	void set_sampling(logmsg::type t, unsigned int n);
+
+	/// Logs the summaries of the current window right away and starts a new window
+	void flush();
+
+	class impl;
+private:
+	std::unique_ptr<impl> impl_;
+};
+
+}
+
+#endif
@@ -225,6 +225,11 @@ public:
 	FILETIME get_filetime() const;
 #endif
 
+	/// Size of the buffer needed by the formatting functions writing to caller-supplied memory
+	enum {
+		max_formatted_size = 32
+	};
+
 	/**
 	 * Returns date in the format specified in RFC 822, updated by RFC 1123.
 	 *
@@ -233,6 +238,37 @@ public:
 	 */
 	std::string get_rfc822() const;
 
+	/**
+	 * \brief Writes the date in the format specified in RFC 822, updated by RFC 1123, without allocating
+	 *
+	 * out needs to hold at least max_formatted_size characters. Returns the length of the
+	 * written string, which is not null-terminated, or 0 if the timestamp is empty.
+	 */
+	size_t get_rfc822(char* out) const;
+
+	/**
+	 * Returns the timestamp in UTC in the format specified in RFC 3339, with milliseconds if
+	 * the accuracy is milliseconds.
+	 *
+	 * \par Examples:
+	 * \li 1994-11-06T08:49:37Z
+	 * \li 1994-11-06T08:49:37.123Z
+	 */
+	std::string get_rfc3339() const;
+	size_t get_rfc3339(char* out) const; ///< \sa get_rfc822(char*) const
+
+	/**
+	 * Returns the timestamp in UTC in the format used by the MDTM and MFMT commands of FTP as
+	 * specified in RFC 3659, with milliseconds if the accuracy is milliseconds. \ref set
+	 * parses the result.
+	 *
+	 * \par Examples:
+	 * \li 19941106084937
+	 * \li 19941106084937.123
+	 */
+	std::string get_mdtm() const;
+	size_t get_mdtm(char* out) const; ///< \sa get_rfc822(char*) const
+
 	/**
 	 * Parses a date in the format specified in RFC 822, either original or updated by RFC 1123.
 	 * Also supports RFC 850 and ANSI C asctime formats.
@@ -432,6 +468,18 @@ public:
 		return monotonic_clock(clock_type::now());
 	}
 
+	/**
+	 * \brief Gets the current point in time with a resolution of a few milliseconds
+	 *
+	 * Considerably cheaper than \ref now on Linux, where it reads CLOCK_MONOTONIC_COARSE.
+	 * It is never ahead of \ref now, but typically lags behind by a few milliseconds.
+	 * On other platforms it is the same as \ref now.
+	 *
+	 * Use it in hot paths where millisecond precision does not matter, e.g. for statistics,
+	 * rate measurements and idle timeouts.
+	 */
+	static monotonic_clock coarse_now();
+
 	explicit operator bool() const {
 		return t_ != clock_type::time_point();
 	}
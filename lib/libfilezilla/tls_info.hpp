@@ -7,13 +7,20 @@
 
 #include "time.hpp"
 
+#include <memory>
+
 namespace fz {
 class logger_interface;
 
 /**
  * \brief Represents all relevant information of a X.509 certificate as used by TLS.
+ *
+ * Certificates obtained from a TLS session or loaded through \ref load_certificates only
+ * extract their validity period up front. All other fields, including the fingerprints,
+ * are extracted from the raw certificate on first access, which is thread-safe. Copies
+ * share the extracted fields.
  */
-class x509_certificate final
+class FZ_PUBLIC_SYMBOL x509_certificate final
 {
 public:
 	/// A subject name, typically a DNS hostname
@@ -57,6 +64,11 @@ public:
 	    std::vector<subject_name> && alt_subject_names,
 		bool const self_Signed);
 
+	/// Creates a certificate from its DER encoding, the remaining fields get extracted on first access
+	x509_certificate(
+		std::vector<uint8_t> && rawdata,
+		fz::datetime const& activation_time, fz::datetime const& expiration_time,
+		bool const self_signed);
 
 	/// The raw, DER-encoded X.509 certificate
 	std::vector<uint8_t> get_raw_data() const { return raw_cert_; }
@@ -64,34 +76,34 @@ public:
 	fz::datetime const& get_activation_time() const { return activation_time_; }
 	fz::datetime const& get_expiration_time() const { return expiration_time_; }
 
-	std::string const& get_serial() const { return serial_; }
+	std::string const& get_serial() const;
 
 	/// The public key algorithm used by the certificate
-	std::string const& get_pubkey_algorithm() const { return pkalgoname_; }
+	std::string const& get_pubkey_algorithm() const;
 
 	/// The number of bits of the public key algorithm
-	unsigned int get_pubkey_bits() const { return pkalgobits_; }
+	unsigned int get_pubkey_bits() const;
 
 	/// The algorithm used for signing, typically the public key algorithm combined with a hash
-	std::string const& get_signature_algorithm() const { return signalgoname_; }
+	std::string const& get_signature_algorithm() const;
 
 	/// Gets fingerprint as hex-encoded sha256
-	std::string const& get_fingerprint_sha256() const { return fingerprint_sha256_; }
+	std::string const& get_fingerprint_sha256() const;
 
 	/// Gets fingerprint as hex-encoded sha1
-	std::string const& get_fingerprint_sha1() const { return fingerprint_sha1_; }
+	std::string const& get_fingerprint_sha1() const;
 
 	/** \brief Gets the subject of the certificate as RDN as described in RFC4514
 	 *
 	 * Never use the CN field to compare it against a hostname, that's what the SANs are for.
 	 */
-	std::string const& get_subject() const { return subject_; }
+	std::string const& get_subject() const;
 
 	/// Gets the issuer of the certificate as RDN as described in RFC4514
-	std::string const& get_issuer() const { return issuer_; }
+	std::string const& get_issuer() const;
 
 	/// Gets the alternative subject names (SANSs) of the certificated, usually hostnames
-	std::vector<subject_name> const& get_alt_subject_names() const { return alt_subject_names_; }
+	std::vector<subject_name> const& get_alt_subject_names() const;
 
 	explicit operator bool() const { return !raw_cert_.empty(); }
 
@@ -99,24 +111,18 @@ public:
 	bool self_signed() const { return self_signed_; }
 
 private:
+	friend class tls_layer_impl;
+
+	struct details;
+	details const& get_details() const;
+
 	fz::datetime activation_time_;
 	fz::datetime expiration_time_;
 
 	std::vector<uint8_t> raw_cert_;
 
-	std::string serial_;
-	std::string pkalgoname_;
-	unsigned int pkalgobits_{};
-
-	std::string signalgoname_;
-
-	std::string fingerprint_sha256_;
-	std::string fingerprint_sha1_;
-
-	std::string issuer_;
-	std::string subject_;
-
-	std::vector<subject_name> alt_subject_names_;
+	// Shared by all copies, filled in on first access
+	std::shared_ptr<details> details_;
 
 	bool self_signed_{};
 };
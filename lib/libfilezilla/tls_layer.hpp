@@ -7,8 +7,14 @@
 
 #include "socket.hpp"
 
+#include <map>
+
 namespace fz {
+class buffer;
 class logger_interface;
+class thread_pool;
+class tls_ocsp_cache;
+class tls_session_cache;
 class tls_system_trust_store;
 class tls_session_info;
 
@@ -46,6 +52,84 @@ inline tls_server_flags operator|(tls_server_flags lhs, tls_server_flags rhs) {
 	return static_cast<tls_server_flags>(static_cast<std::underlying_type_t<tls_server_flags>>(lhs) | static_cast<std::underlying_type_t<tls_server_flags>>(rhs));
 }
 
+/// Which directions of a TLS session are handled by the kernel, see \ref tls_layer::set_kernel_offload
+enum class tls_offload : unsigned int
+{
+	none = 0,
+
+	/// Records are encrypted by the kernel
+	send = 0x1,
+
+	/// Records are decrypted by the kernel
+	receive = 0x2,
+
+	duplex = send | receive
+};
+
+inline bool operator&(tls_offload lhs, tls_offload rhs) {
+	return (static_cast<std::underlying_type_t<tls_offload>>(lhs) & static_cast<std::underlying_type_t<tls_offload>>(rhs)) != 0;
+}
+inline tls_offload operator|(tls_offload lhs, tls_offload rhs) {
+	return static_cast<tls_offload>(static_cast<std::underlying_type_t<tls_offload>>(lhs) | static_cast<std::underlying_type_t<tls_offload>>(rhs));
+}
+
+/**
+ * \brief Handshake and record layer counters of TLS layers
+ *
+ * See \ref tls_layer::get_stats for the counters of a single layer and \ref get_tls_stats
+ * for the sum over all layers of the process.
+ *
+ * All times are in microseconds.
+ */
+struct FZ_PUBLIC_SYMBOL tls_stats final
+{
+	/// Number of successfully completed handshakes, including resumed ones
+	uint64_t handshakes{};
+
+	/// Number of completed handshakes that resumed a previous session
+	uint64_t resumed_handshakes{};
+
+	/// Number of handshakes that failed
+	uint64_t failed_handshakes{};
+
+	/// Time from starting the handshake until GnuTLS has completed it, includes waiting for the peer
+	uint64_t handshake_time{};
+
+	/// Time spent inside GnuTLS while handshaking, which is mostly key exchange and signatures
+	uint64_t handshake_cpu_time{};
+
+	/// Client only, time from completing the handshake until the certificate has been trusted
+	uint64_t verification_time{};
+
+	/// Number of octets of plaintext that got encrypted, including those encrypted by the kernel
+	uint64_t bytes_encrypted{};
+
+	/// Number of octets of plaintext that got decrypted, including those decrypted by the kernel
+	uint64_t bytes_decrypted{};
+
+	/// Number of records sent by GnuTLS, records sent by the kernel are not counted
+	uint64_t records_sent{};
+
+	/// Number of records the socket could not immediately take, they got retried from the send buffer
+	uint64_t send_retries{};
+
+	/// Number of writes that failed with EAGAIN as the send buffer was still being retried
+	uint64_t blocked_writes{};
+
+	/// Number of completed handshakes per negotiated cipher, as returned by \ref tls_layer::get_cipher
+	std::map<std::string, uint64_t> ciphers;
+
+	tls_stats& operator+=(tls_stats const& op);
+};
+
+/**
+ * \brief Returns the counters of all TLS layers of the process
+ *
+ * Counts of layers still connected are included. The counters are updated without
+ * synchronization, the returned values may lag slightly behind concurrent layers.
+ */
+tls_stats FZ_PUBLIC_SYMBOL get_tls_stats();
+
 
 /**
  * \brief A Transport Layer Security (TLS) layer
@@ -113,6 +197,83 @@ public:
 	 */
 	bool server_handshake(std::vector<uint8_t> const& session_to_resume = {}, std::string_view const& preamble = {}, tls_server_flags flags = {});
 
+	/** \brief Shares session tickets and cached sessions with other server layers
+	 *
+	 * Needs to be called prior to \ref server_handshake. The cache must outlive the layer.
+	 * Sessions stored in the cache can be resumed without passing their parameters to server_handshake.
+	 */
+	void set_session_cache(tls_session_cache * cache);
+
+	/** \brief Staples OCSP responses for the certificate into the handshake
+	 *
+	 * Server only, needs to be called prior to \ref server_handshake. The certificate chain
+	 * must include the issuer of the certificate. The cache must outlive the layer.
+	 * See \ref tls_ocsp_cache for details.
+	 */
+	void set_ocsp_cache(tls_ocsp_cache * cache);
+
+	/** \brief Accepts up to max_size octets of TLS 1.3 early data (0-RTT) from resuming clients
+	 *
+	 * Server only, needs to be called prior to \ref server_handshake. Has no effect without
+	 * a session cache, see \ref set_session_cache, as the cache protects against early data
+	 * being replayed within its anti-replay window. Tickets issued by the layer permit clients
+	 * to send early data in future connections.
+	 *
+	 * Early data can still be replayed to servers not sharing the cache, and it is not covered
+	 * by forward secrecy. Check \ref early_data_size and only act on early data if it consists
+	 * of idempotent commands.
+	 *
+	 * Passing 0 disables early data, which is the default.
+	 */
+	void set_max_early_data(size_t max_size);
+
+	/** \brief Sends data as TLS 1.3 early data (0-RTT) when resuming a session
+	 *
+	 * Client only, needs to be called prior to \ref client_handshake, which must be passed
+	 * the parameters of a session whose ticket permits early data.
+	 *
+	 * After the handshake, check \ref early_data_accepted. If the server did not accept
+	 * the early data, it has not been delivered and needs to be written again.
+	 */
+	void set_early_data(std::string_view const& data);
+
+	/// After a successful handshake, returns whether early data has been accepted by the server
+	bool early_data_accepted() const;
+
+	/** \brief Returns the number of octets that have been received as early data
+	 *
+	 * Server only. After a successful handshake, the first early_data_size() octets
+	 * returned by \ref read are the early data sent by the client.
+	 */
+	size_t early_data_size() const;
+
+	/** \brief Runs the CPU-heavy handshake steps on the pool instead of the event loop
+	 *
+	 * The key exchange and signing take place while GnuTLS processes handshake messages,
+	 * bursts of incoming connections thus stall the loop. With a pool, each handshake step
+	 * gets submitted to its workers, the result is posted back to the loop. The events
+	 * sent to the owner do not change.
+	 *
+	 * Applies to handshake steps started afterwards. The pool must outlive the layer.
+	 * The layers below must tolerate being read from and written to from a worker thread,
+	 * which is the case for \ref fz::socket. Session details must not be queried before
+	 * the handshake has completed.
+	 */
+	void set_handshake_thread_pool(thread_pool * pool);
+
+	/** \brief Dynamic TLS record sizing
+	 *
+	 * If enabled, records are limited to small_size bytes at the start of the connection and after
+	 * it has been idle for idle_timeout. The default fits a record into a single TCP segment on
+	 * typical paths, so the peer can decrypt it as soon as the segment arrives. This reduces the
+	 * latency of interactive exchanges such as control channel replies.
+	 *
+	 * Once ramp_threshold bytes have been sent, full-size records are used for throughput.
+	 *
+	 * As writes are passed on in single records, they return at most the current record size.
+	 */
+	void set_dynamic_record_sizing(bool enable, size_t small_size = 1400, uint64_t ramp_threshold = 1024 * 1024, duration const& idle_timeout = duration::from_seconds(1));
+
 	/// Gets session parameters for resumption
 	std::vector<uint8_t> get_session_parameters() const;
 
@@ -136,6 +297,9 @@ public:
 	/// After a successful handshake, returns whether the session has been resumed.
 	bool resumed_session() const;
 
+	/// Returns the counters of this layer, \sa get_tls_stats
+	tls_stats get_stats() const;
+
 	/// Returns a human-readable list of all TLS ciphers available with the passed priority string
 	static std::string list_tls_ciphers(std::string const& priority);
 
@@ -232,6 +396,22 @@ public:
 	void set_unexpected_eof_cb(std::function<bool()> const& cb);
 	void set_unexpected_eof_cb(std::function<bool()> && cb);
 
+	/** \brief Requests handing off the record layer to the kernel (kTLS) after the handshake
+	 *
+	 * Needs to be called prior to the handshake completing. Only has an effect on Linux if the next layer
+	 * is an \ref fz::socket, the kernel has TLS support and a suitable cipher got negotiated, otherwise
+	 * the layer silently keeps encrypting and decrypting records itself.
+	 *
+	 * With sending offloaded, \ref write and \ref writev pass the plaintext straight to the socket and
+	 * \ref send_file works. In TLS 1.3, receiving is not offloaded for clients, else session tickets
+	 * sent by the server could no longer be processed. Key updates are not supported, receiving one
+	 * on an offloaded session fails the connection.
+	 */
+	void set_kernel_offload(bool enable);
+
+	/// After a successful handshake, returns which directions the kernel handles
+	tls_offload get_kernel_offload() const;
+
 	virtual socket_state get_state() const override;
 
 	virtual int connect(native_string const& host, unsigned int port, address_type family = address_type::unknown) override;
@@ -239,12 +419,50 @@ public:
 	virtual int read(void *buffer, unsigned int size, int& error) override;
 	virtual int write(void const* buffer, unsigned int size, int& error) override;
 
+	/** \brief Writes data from a buffer, consuming what has been written
+	 *
+	 * Unlike the other write functions, which copy the data of an incomplete record,
+	 * the layer takes over buf itself if the socket cannot take more data, leaving it empty.
+	 * Taken over data counts as written. This avoids copying data for bulk transfers.
+	 *
+	 * Returns the number of bytes consumed from buf, or -1 on error.
+	 */
+	int write(buffer & buf, int& error);
+
+	/// Fills the buffers for as long as already decrypted data is available
+	virtual int readv(socket_iovec const* buffers, size_t count, int& error) override;
+
+	/// Sized to the already decrypted data, or to a single record, \sa socket_interface::read_into
+	virtual int read_into(buffer & buf, size_t max, int& error) override;
+
+	/// Small buffers are gathered into a single TLS record
+	virtual int writev(socket_const_iovec const* buffers, size_t count, int& error) override;
+
+	/// Only supported if sending is offloaded to the kernel, fails with EOPNOTSUPP otherwise
+	virtual int send_file(file & f, uint64_t offset, unsigned int size, int& error) override;
+
 	virtual int shutdown() override;
 
 	virtual int shutdown_read() override;
 
 	virtual void set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block = socket_event_flag{}) override;
 
+	/// Memory held by GnuTLS itself is not included
+	virtual void get_memory_usage(std::vector<socket_memory_usage> & usage) const override;
+
+	/// Releases the empty record buffers. Does nothing for the layer itself while a handshake step is running.
+	virtual void hibernate() override;
+
+	/**
+	 * \brief See socket_interface::cork
+	 *
+	 * While corked, written data is collected into records of the maximum size, each sent
+	 * once full. What is left goes out as a final record on uncork. If sending is offloaded
+	 * to the kernel, only the layers below get corked.
+	 */
+	virtual void cork() override;
+	virtual int uncork() override;
+
 private:
 	virtual void FZ_PRIVATE_SYMBOL operator()(event_base const& ev) override;
 
@@ -0,0 +1,76 @@
+#ifndef LIBFILEZILLA_TLS_OCSP_CACHE_HEADER
+#define LIBFILEZILLA_TLS_OCSP_CACHE_HEADER
+
+/** \file
+ * \brief Server-side OCSP stapling
+ *
+ * Declares the \ref fz::tls_ocsp_cache class.
+ */
+
+#include "libfilezilla.hpp"
+#include "time.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fz {
+class thread_pool;
+class tls_ocsp_cache_impl;
+class tls_layer;
+
+/**
+ * \brief Fetches and caches OCSP responses for server certificates
+ *
+ * Clients checking revocation otherwise have to ask the CA's OCSP responder on every connection.
+ * With the cache set, see \ref tls_layer::set_ocsp_cache, server layers staple a cached
+ * OCSP response for their certificate into the handshake instead.
+ *
+ * The first handshake with a certificate registers it with the cache. Its response is then
+ * fetched in the background from the responder named in the certificate. Responses get refreshed
+ * halfway before they expire, failed attempts are retried after the retry interval. Until a valid
+ * response is available, handshakes proceed without stapling. Certificates no longer used by any
+ * handshake between two refreshes are forgotten.
+ *
+ * The certificate chain passed to the layers must include the issuer of the certificate, it is
+ * needed to build the request and to verify the response. Only responses verified to state that
+ * the certificate is good get stapled.
+ *
+ * This class is thread-safe and can be passed concurrently to multiple instances of
+ * \ref fz::tls_layer. It must outlive all layers using it.
+ */
+class FZ_PUBLIC_SYMBOL tls_ocsp_cache final
+{
+public:
+	/**
+	 * \brief Sends an OCSP request to a responder
+	 *
+	 * Needs to POST the DER-encoded request with the content type application/ocsp-request to the
+	 * URL and return the body of the response, or nothing on failure.
+	 *
+	 * Called on a thread of the pool, it may block.
+	 */
+	typedef std::function<std::vector<uint8_t>(std::string const& url, std::vector<uint8_t> const& request)> fetcher;
+
+	/**
+	 * \param pool Provides the thread refreshing the responses. Must outlive the cache.
+	 * \param fetch Sends the requests, see \ref fetcher
+	 * \param retry_interval Time until failed requests are retried
+	 */
+	tls_ocsp_cache(thread_pool & pool, fetcher const& fetch, duration const& retry_interval = duration::from_minutes(5));
+	~tls_ocsp_cache();
+
+	tls_ocsp_cache(tls_ocsp_cache const&) = delete;
+	tls_ocsp_cache& operator=(tls_ocsp_cache const&) = delete;
+
+	/// Number of certificates with a valid response
+	size_t size() const;
+
+private:
+	friend class tls_layer;
+	std::unique_ptr<tls_ocsp_cache_impl> impl_;
+};
+}
+
+#endif
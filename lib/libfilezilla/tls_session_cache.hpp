@@ -0,0 +1,64 @@
+#ifndef LIBFILEZILLA_TLS_SESSION_CACHE_HEADER
+#define LIBFILEZILLA_TLS_SESSION_CACHE_HEADER
+
+/** \file
+ * \brief Server-side cache for TLS session resumption
+ *
+ * Declares the \ref fz::tls_session_cache class.
+ */
+
+#include "libfilezilla.hpp"
+#include "time.hpp"
+
+#include <memory>
+
+namespace fz {
+class tls_session_cache_impl;
+class tls_layer;
+
+/**
+ * \brief Shared state for resuming TLS sessions on the server
+ *
+ * Without a cache, each server-side \ref fz::tls_layer has its own session ticket key and
+ * can only resume sessions whose parameters got passed to \ref tls_layer::server_handshake.
+ *
+ * Server layers referencing the same cache share the ticket key as well as a session
+ * database of bounded capacity, so clients can resume sessions established over any
+ * connection using the cache, e.g. all connections accepted by a listener.
+ *
+ * The ticket key gets replaced after the rotation interval. Tickets issued with a previous
+ * key can no longer be used, clients then perform a full handshake.
+ *
+ * For layers accepting TLS 1.3 early data, the cache also remembers the ClientHellos carrying
+ * early data within the anti-replay window, so that early data cannot be replayed to any of them.
+ *
+ * This class is thread-safe and can be passed concurrently to multiple instances of
+ * \ref fz::tls_layer. It must outlive all layers using it.
+ */
+class FZ_PUBLIC_SYMBOL tls_session_cache final
+{
+public:
+	/**
+	 * \param capacity Maximum number of sessions in the database, the oldest get evicted first.
+	 * \param ttl Time after which sessions and tickets are no longer resumed.
+	 * \param key_rotation Interval after which a new ticket key gets generated.
+	 */
+	explicit tls_session_cache(size_t capacity = 10000, duration const& ttl = duration::from_hours(2), duration const& key_rotation = duration::from_hours(12));
+	~tls_session_cache();
+
+	tls_session_cache(tls_session_cache const&) = delete;
+	tls_session_cache& operator=(tls_session_cache const&) = delete;
+
+	/// Number of sessions currently in the database
+	size_t size() const;
+
+	/// Removes all sessions from the database and generates a new ticket key
+	void clear();
+
+private:
+	friend class tls_layer;
+	std::unique_ptr<tls_session_cache_impl> impl_;
+};
+}
+
+#endif
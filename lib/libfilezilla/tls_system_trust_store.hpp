@@ -8,8 +8,11 @@
  */
 
 #include "libfilezilla.hpp"
+#include "time.hpp"
 
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace fz {
 class thread_pool;
@@ -25,13 +28,50 @@ class tls_layer_impl;
  * Use it as shared resource that is loaded asynchronously.
  * This class is thread-safe and can be passed concurrently to
  * multiple instances of \ref fz::tls_layer.
+ *
+ * Chains completed using the trust store are cached, keyed by the fingerprint
+ * of the certificate they were extended from, so that peers sending the same
+ * incomplete chain do not need to be looked up again.
  */
 class FZ_PUBLIC_SYMBOL tls_system_trust_store final
 {
 public:
-	tls_system_trust_store(thread_pool& pool);
+	/** \brief Creates a trust store
+	 *
+	 * Unless lazy is set, loading starts immediately. Otherwise it is deferred until
+	 * the store is first passed to a \ref fz::tls_layer or used for verification.
+	 *
+	 * The pool must outlive the trust store.
+	 */
+	explicit tls_system_trust_store(thread_pool& pool, bool lazy = false);
 	~tls_system_trust_store();
 
+	tls_system_trust_store(tls_system_trust_store const&) = delete;
+	tls_system_trust_store& operator=(tls_system_trust_store const&) = delete;
+
+	/** \brief Returns the process-wide trust store
+	 *
+	 * The returned store is lazily loaded and shared by all callers for as long as
+	 * any reference to it exists. Once the last reference is gone, the store is
+	 * freed and the next call creates a new one.
+	 *
+	 * The pool is only used if a new store gets created, it must outlive that store.
+	 */
+	static std::shared_ptr<tls_system_trust_store> get_shared(thread_pool& pool);
+
+	/** \brief Remembers successful verifications for up to max_age
+	 *
+	 * Clients reconnecting to the same server again and again otherwise build and verify
+	 * the same chain on every handshake. With the cache, a chain that has been verified
+	 * for a hostname is trusted right away if the server sends the very same chain again.
+	 *
+	 * Results are cached no longer than all certificates of the trust path are valid.
+	 * Revocation lists are not consulted again while a result is cached.
+	 *
+	 * A max_age of zero, the default, disables the cache and drops all cached results.
+	 */
+	void set_verification_cache(duration const& max_age);
+
 private:
 	friend class tls_layer_impl;
 	std::unique_ptr<tls_system_trust_store_impl> impl_;
@@ -4,6 +4,7 @@
 #include "libfilezilla.hpp"
 
 #include <string>
+#include <string_view>
 
 /** \file
  * \brief Functions to translate strings
@@ -25,6 +26,29 @@ void FZ_PUBLIC_SYMBOL set_translators(
  */
 std::wstring FZ_PUBLIC_SYMBOL translate(char const* const source);
 std::wstring FZ_PUBLIC_SYMBOL translate(char const* const singular, char const * const plural, int64_t n);
+
+/** \brief Like \ref translate, but caches the translations.
+ *
+ * Avoids calling the translator and allocating for strings translated over and over.
+ * The cache is keyed by the address of the source strings, pass string literals or
+ * other strings of static storage duration.
+ *
+ * The returned views remain valid for the lifetime of the program.
+ *
+ * For the plural variant, counts of 200 and more share the entry of the count
+ * with the same last two digits in the range [100, 200). This matches the plural
+ * rules of all common languages.
+ *
+ * Thread-safe.
+ */
+std::wstring_view FZ_PUBLIC_SYMBOL translate_view(char const* const source);
+std::wstring_view FZ_PUBLIC_SYMBOL translate_view(char const* const singular, char const* const plural, int64_t n);
+
+/** \brief Makes \ref translate_view translate anew, e.g. after changing the language.
+ *
+ * Called by \ref set_translators. Views returned previously remain valid.
+ */
+void FZ_PUBLIC_SYMBOL reset_translation_cache();
 }
 
 // Sadly xgettext cannot be used with namespaces
@@ -0,0 +1,134 @@
+#ifndef LIBFILEZILLA_TREE_HASH_HEADER
+#define LIBFILEZILLA_TREE_HASH_HEADER
+
+/** \file
+ * \brief SHA-256 tree hashes, which can be computed in parallel
+ */
+
+#include "libfilezilla.hpp"
+#include "mutex.hpp"
+
+#include <array>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace fz {
+
+class hash_accumulator;
+class thread_pool;
+
+/**
+ * \brief Accumulator for SHA-256 tree hashes
+ *
+ * The data is split into chunks of \ref chunk_size octets. The leaves of the tree are the
+ * SHA-256 digests of the chunks, each inner node is the SHA-256 digest of the concatenated
+ * digests of its two children. A node without sibling is moved up a level unchanged.
+ * This is the tree hash used by Amazon S3 Glacier.
+ *
+ * As the chunks are hashed independently, data can be added in any order and from
+ * multiple threads at once, for example by several readers each reading a different
+ * range of a file. Within a chunk, the data needs to be added in order though, so
+ * concurrently added ranges should start at multiples of the chunk size.
+ *
+ * The digests of the individual chunks can be used to verify parts of the data,
+ * e.g. before resuming a transfer, see \ref tree_hash_combine.
+ */
+class FZ_PUBLIC_SYMBOL tree_hash_accumulator final
+{
+public:
+	static constexpr size_t chunk_size = 1024 * 1024;
+	static constexpr size_t digest_size = 32;
+
+	typedef std::array<uint8_t, digest_size> chunk_digest;
+
+	/// If a thread pool is passed, its workers hash the chunks of large updates in parallel
+	explicit tree_hash_accumulator(thread_pool * pool = nullptr);
+	~tree_hash_accumulator();
+
+	tree_hash_accumulator(tree_hash_accumulator const&) = delete;
+	tree_hash_accumulator& operator=(tree_hash_accumulator const&) = delete;
+
+	void reinit();
+
+	/**
+	 * \brief Adds data at the given offset
+	 *
+	 * Can be called concurrently from multiple threads, the ranges must not overlap.
+	 *
+	 * Returns false, putting the accumulator into a failed state, if the data does not
+	 * continue the data already added to a partially filled chunk.
+	 */
+	bool update(uint64_t offset, uint8_t const* data, size_t size);
+
+	/// Adds data after the end of all data added so far
+	bool update(uint8_t const* data, size_t size);
+	bool update(std::string_view const& data) {
+		return update(reinterpret_cast<uint8_t const*>(data.data()), data.size());
+	}
+
+	/**
+	 * \brief Returns the root digest of all data added
+	 *
+	 * Returns an empty digest if the accumulator has failed or if there are gaps in the data.
+	 * Further data must not be added afterwards without calling \ref reinit first.
+	 */
+	std::vector<uint8_t> digest();
+
+	/**
+	 * \brief Returns the digests of the complete chunks at the start of the data
+	 *
+	 * Stops at the first chunk that is missing or not yet complete.
+	 */
+	std::vector<chunk_digest> chunk_digests() const;
+
+private:
+	bool update_partial(uint64_t index, size_t offset, uint8_t const* data, size_t size);
+	void add_chunks(uint64_t first, uint8_t const* data, size_t count);
+
+	thread_pool * const pool_{};
+
+	mutable mutex mtx_{false};
+
+	struct partial_chunk final
+	{
+		std::unique_ptr<hash_accumulator> acc_;
+		size_t filled_{};
+		bool busy_{};
+	};
+	std::map<uint64_t, partial_chunk> partial_;
+
+	std::vector<chunk_digest> chunks_;
+	std::vector<bool> have_;
+
+	uint64_t end_{};
+	bool failed_{};
+};
+
+/**
+ * \brief Computes the root of a tree hash from the digests of its chunks
+ *
+ * Returns the SHA-256 digest of no data if there are no chunks.
+ *
+ * Also computes the digest of a range of the data starting at a multiple of a power of
+ * two number of chunks, as long as it covers at most that many chunks.
+ */
+std::vector<uint8_t> FZ_PUBLIC_SYMBOL tree_hash_combine(std::vector<tree_hash_accumulator::chunk_digest> const& chunks);
+
+/// Computes the tree hash of data in memory, in parallel if a thread pool is passed
+std::vector<uint8_t> FZ_PUBLIC_SYMBOL tree_hash(std::string_view const& data, thread_pool * pool = nullptr);
+std::vector<uint8_t> FZ_PUBLIC_SYMBOL tree_hash(std::basic_string_view<uint8_t> const& data, thread_pool * pool = nullptr);
+
+/**
+ * \brief Computes the tree hash of a file
+ *
+ * The chunks get read using positional reads and hashed by up to \c threads tasks spawned in
+ * the thread pool. Returns an empty digest if the file cannot be opened or read.
+ *
+ * If passed, the digests of the chunks are stored in \c chunks.
+ */
+std::vector<uint8_t> FZ_PUBLIC_SYMBOL tree_hash_file(native_string const& path, thread_pool & pool, size_t threads = 4, std::vector<tree_hash_accumulator::chunk_digest> * chunks = nullptr);
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef LIBFILEZILLA_TREE_WALKER_HEADER
+#define LIBFILEZILLA_TREE_WALKER_HEADER
+
+#include "local_filesys.hpp"
+
+#include <functional>
+#include <vector>
+
+/** \file
+ * \brief Walking directory trees with multiple directories being read concurrently
+ */
+
+namespace fz {
+
+class thread_pool;
+
+/**
+ * \brief Walks local directory trees, reading multiple directories concurrently.
+ *
+ * On network file systems, the latency of each operation dominates the time it takes
+ * to traverse a tree. The walker hides it by reading up to \c max_parallel directories
+ * at the same time, each in a thread from the passed pool.
+ *
+ * The callbacks are called from the pool's threads, possibly concurrently, but never
+ * concurrently for the same directory. Subdirectories are only read once the callback
+ * for their parent has returned.
+ */
+class FZ_PUBLIC_SYMBOL tree_walker final
+{
+public:
+	/** \brief Gets called once per directory after it has been read completely.
+	 *
+	 * Receives the path of the directory and its entries. Return false to abort the walk.
+	 */
+	typedef std::function<bool(native_string const& path, std::vector<local_filesys::dir_entry> const& entries)> entries_cb_t;
+
+	/** \brief Gets called once a directory and all its subdirectories have been processed.
+	 *
+	 * Parents get left after their children. Return false to abort the walk.
+	 */
+	typedef std::function<bool(native_string const& path)> leave_cb_t;
+
+	/// The thread pool needs to live longer than the walker
+	explicit tree_walker(thread_pool & pool, size_t max_parallel = 8);
+
+	tree_walker(tree_walker const&) = delete;
+	tree_walker& operator=(tree_walker const&) = delete;
+
+	/**
+	 * \brief Walks the trees below the passed directories, returns once done.
+	 *
+	 * \param fields Fields queried for the entries in addition to the type
+	 * \param follow_links Whether to descend into symbolic links to directories.
+	 *        If set, the caller needs to deal with loops.
+	 *
+	 * Returns false if aborted by a callback, or if a directory could not be read.
+	 * Unreadable directories are still passed to the leave callback.
+	 */
+	bool walk(std::vector<native_string> const& roots, entries_cb_t const& on_entries, leave_cb_t const& on_leave = nullptr,
+		dir_entry_fields fields = dir_entry_fields::type, bool follow_links = false);
+
+private:
+	thread_pool & pool_;
+	size_t const max_parallel_;
+};
+
+}
+
+#endif
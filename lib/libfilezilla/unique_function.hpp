@@ -0,0 +1,185 @@
+#ifndef LIBFILEZILLA_UNIQUE_FUNCTION_HEADER
+#define LIBFILEZILLA_UNIQUE_FUNCTION_HEADER
+
+/** \file
+ * \brief Declares \ref fz::unique_function, a move-only std::function replacement
+ */
+
+#include "libfilezilla.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace fz {
+
+template<typename Signature>
+class unique_function;
+
+/// \private
+template<typename T>
+struct is_nullable_callable : std::bool_constant<std::is_pointer_v<T> || std::is_member_pointer_v<T>> {};
+
+/// \private
+template<typename Signature>
+struct is_nullable_callable<std::function<Signature>> : std::true_type {};
+
+/// \private
+template<typename Signature>
+struct is_nullable_callable<unique_function<Signature>> : std::true_type {};
+
+/**
+ * \brief Move-only wrapper for callables with small buffer optimization
+ *
+ * Unlike std::function, the callable does not need to be copyable, so it can capture
+ * move-only types such as std::unique_ptr or \ref buffer. Callables of up to
+ * \ref inline_size bytes that can be moved without throwing are stored inline
+ * and never allocate. Larger callables are stored on the heap.
+ *
+ * Empty function pointers and std::functions result in an empty unique_function.
+ * Calling an empty unique_function is undefined.
+ */
+template<typename R, typename... Args>
+class unique_function<R(Args...)> final
+{
+public:
+	/// Size of callables that get stored without allocation, e.g. a lambda capturing up to seven pointers
+	static constexpr size_t inline_size = 7 * sizeof(void*);
+
+	unique_function() noexcept = default;
+	unique_function(std::nullptr_t) noexcept {}
+
+	template<typename F, typename D = std::decay_t<F>, typename = std::enable_if_t<!std::is_same_v<D, unique_function> && std::is_invocable_r_v<R, D&, Args...>>>
+	unique_function(F && f)
+	{
+		if constexpr (is_nullable_callable<D>::value) {
+			if (!f) {
+				return;
+			}
+		}
+		if constexpr (stored_inline<D>) {
+			new (storage_) D(std::forward<F>(f));
+		}
+		else {
+			*reinterpret_cast<D**>(storage_) = new D(std::forward<F>(f));
+		}
+		ops_ = &ops_for<D>;
+	}
+
+	unique_function(unique_function && op) noexcept
+	{
+		if (op.ops_) {
+			op.ops_->move(storage_, op.storage_);
+			ops_ = op.ops_;
+			op.ops_ = nullptr;
+		}
+	}
+
+	unique_function& operator=(unique_function && op) noexcept
+	{
+		if (this != &op) {
+			reset();
+			if (op.ops_) {
+				op.ops_->move(storage_, op.storage_);
+				ops_ = op.ops_;
+				op.ops_ = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	unique_function& operator=(std::nullptr_t) noexcept
+	{
+		reset();
+		return *this;
+	}
+
+	unique_function(unique_function const&) = delete;
+	unique_function& operator=(unique_function const&) = delete;
+
+	~unique_function()
+	{
+		reset();
+	}
+
+	explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+	R operator()(Args... args)
+	{
+		return ops_->invoke(storage_, std::forward<Args>(args)...);
+	}
+
+private:
+	struct ops final
+	{
+		R (*invoke)(void* storage, Args&&... args);
+
+		// Move-constructs into dst and destroys src
+		void (*move)(void* dst, void* src) noexcept;
+		void (*destroy)(void* storage) noexcept;
+	};
+
+	template<typename D>
+	static constexpr bool stored_inline = sizeof(D) <= inline_size && alignof(D) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<D>;
+
+	template<typename D>
+	static D& target(void* storage) noexcept
+	{
+		if constexpr (stored_inline<D>) {
+			return *std::launder(reinterpret_cast<D*>(storage));
+		}
+		else {
+			return **reinterpret_cast<D**>(storage);
+		}
+	}
+
+	template<typename D>
+	static R invoke(void* storage, Args&&... args)
+	{
+		return std::invoke(target<D>(storage), std::forward<Args>(args)...);
+	}
+
+	template<typename D>
+	static void move(void* dst, void* src) noexcept
+	{
+		if constexpr (stored_inline<D>) {
+			D& s = target<D>(src);
+			new (dst) D(std::move(s));
+			s.~D();
+		}
+		else {
+			*reinterpret_cast<D**>(dst) = *reinterpret_cast<D**>(src);
+		}
+	}
+
+	template<typename D>
+	static void destroy(void* storage) noexcept
+	{
+		if constexpr (stored_inline<D>) {
+			target<D>(storage).~D();
+		}
+		else {
+			delete *reinterpret_cast<D**>(storage);
+		}
+	}
+
+	template<typename D>
+	static constexpr ops ops_for{&invoke<D>, &move<D>, &destroy<D>};
+
+	void reset() noexcept
+	{
+		if (ops_) {
+			ops_->destroy(storage_);
+			ops_ = nullptr;
+		}
+	}
+
+	alignas(std::max_align_t) unsigned char storage_[inline_size];
+	ops const* ops_{};
+};
+
+}
+
+#endif
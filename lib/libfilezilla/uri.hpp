@@ -9,10 +9,14 @@
 
 /** \file
  * \brief Declares fz::uri for (de)composing URIs.
+ *
+ * fz::uri_view and fz::query_string_view split URIs and query strings without copying.
  */
 
 namespace fz {
 
+class uri_view;
+
 /**
  * \brief The uri class is used to decompose URIs into their individual components.
  *
@@ -24,6 +28,9 @@ public:
 	uri() noexcept = default;
 	explicit uri(std::string_view const& in);
 
+	/// Percent-decodes the components of the view like \ref parse does. Empty if they cannot be decoded.
+	explicit uri(uri_view const& in);
+
 	void clear();
 
 	/**
@@ -99,6 +106,54 @@ public:
 
 	bool operator!=(uri const& arg) const { return !(*this == arg); }
 
+private:
+	bool FZ_PRIVATE_SYMBOL assign(uri_view const& in);
+};
+
+/**
+ * \brief Splits URIs into components without copying or decoding them.
+ *
+ * For when only some parts of a URI are of interest, e.g. when routing requests.
+ * The components are views into the parsed string, which needs to outlive the uri_view.
+ * They stay percent-encoded, the decoded_* functions decode them on demand.
+ *
+ * Components absent from the input are null views. Components that are present but
+ * empty, like the query in "/path?", are empty views into the input.
+ */
+class FZ_PUBLIC_SYMBOL uri_view final
+{
+public:
+	uri_view() noexcept = default;
+	explicit uri_view(std::string_view const& in);
+
+	void clear();
+
+	/**
+	 * \brief Splits uri into components, same as \ref uri::parse
+	 *
+	 * Only the structure gets validated. Invalid percent-encoding is only detected when
+	 * decoding the components.
+	 */
+	bool parse(std::string_view in);
+
+	/// \brief Percent-decoded components. Empty if the component is not validly encoded.
+	std::string decoded_user() const;
+	std::string decoded_pass() const;
+	std::string decoded_host() const;
+	std::string decoded_path() const;
+
+	bool empty() const { return host_.empty() && path_.empty(); }
+	explicit operator bool() const { return !empty(); }
+
+	std::string_view scheme_;
+	std::string_view user_;
+	std::string_view pass_;
+	std::string_view host_;
+	unsigned short port_{};
+	std::string_view path_;
+	std::string_view query_;
+	std::string_view fragment_;
+
 private:
 	bool FZ_PRIVATE_SYMBOL parse_authority(std::string_view authority);
 };
@@ -130,6 +185,80 @@ private:
 	std::map<std::string, std::string, less_insensitive_ascii> segments_;
 };
 
+/**
+ * \brief Iterates over the key-value pairs of a query string without copying it.
+ *
+ * The segments are views into the raw query string, which needs to outlive the view,
+ * and are not percent-decoded.
+ */
+class FZ_PUBLIC_SYMBOL query_string_view final
+{
+public:
+	struct segment final
+	{
+		std::string_view key_;
+
+		/// Null view if the segment has no equals sign
+		std::string_view value_;
+	};
+
+	class const_iterator final
+	{
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef segment value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef segment const* pointer;
+		typedef segment reference;
+
+		const_iterator() = default;
+
+		segment operator*() const;
+
+		const_iterator& operator++() {
+			++it_;
+			return *this;
+		}
+
+		bool operator==(const_iterator const& op) const { return it_ == op.it_; }
+		bool operator!=(const_iterator const& op) const { return it_ != op.it_; }
+
+	private:
+		friend class query_string_view;
+		explicit const_iterator(strtokenizer::iterator const& it)
+			: it_(it)
+		{}
+
+		strtokenizer::iterator it_;
+	};
+
+	explicit query_string_view(std::string_view const& raw);
+
+	query_string_view(query_string_view const& op) : query_string_view(op.raw_) {}
+	query_string_view& operator=(query_string_view const&) = delete;
+
+	const_iterator begin() const { return const_iterator(tokens_.begin()); }
+	const_iterator end() const { return const_iterator(tokens_.end()); }
+
+	/// Whether \ref query_string would accept the raw string
+	bool valid() const;
+
+	/**
+	 * \brief Looks up the percent-decoded value of a key.
+	 *
+	 * Keys are compared like in \ref query_string: after decoding, ignoring ASCII case.
+	 * If a key appears multiple times, the last value counts.
+	 * Returns false if the key is not found or its value is not validly encoded.
+	 */
+	bool get(std::string_view const& key, std::string& value) const;
+
+	std::string_view const& raw() const { return raw_; }
+
+private:
+	std::string_view const raw_;
+	strtokenizer const tokens_;
+};
+
 }
 
 #endif
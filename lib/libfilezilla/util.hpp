@@ -35,6 +35,10 @@ void FZ_PUBLIC_SYMBOL yield();
 int64_t FZ_PUBLIC_SYMBOL random_number(int64_t min, int64_t max);
 
 /** \brief Get random uniformly distributed bytes
+ *
+ * The bytes come from a per-thread ChaCha20 generator, which is seeded from the
+ * operating system's random source and reseeded after every MiB of output, as well as
+ * in the child after fork(). Small requests thus usually need no system call.
  *
  * If generation of random bytes fails, the program is aborted.
  */
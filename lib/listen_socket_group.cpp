@@ -0,0 +1,91 @@
+#include "libfilezilla/listen_socket_group.hpp"
+
+#include <errno.h>
+
+namespace fz {
+
+listen_socket_group::listen_socket_group(thread_pool & pool, std::vector<event_handler*> const& handlers)
+{
+	for (auto * handler : handlers) {
+		shards_.emplace_back(std::make_unique<listen_socket>(pool, handler));
+	}
+}
+
+listen_socket_group::listen_socket_group(reactor & r, std::vector<event_handler*> const& handlers)
+{
+	for (auto * handler : handlers) {
+		shards_.emplace_back(std::make_unique<listen_socket>(r, handler));
+	}
+}
+
+listen_socket_group::~listen_socket_group()
+{
+}
+
+bool listen_socket_group::bind(std::string const& address)
+{
+	for (auto & shard : shards_) {
+		if (!shard->bind(address)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int listen_socket_group::listen(address_type family, int port)
+{
+	if (shards_.empty()) {
+		return EINVAL;
+	}
+
+	auto & first = *shards_.front();
+	first.reuse_port_ = shards_.size() > 1;
+	int res = first.listen(family, port);
+	if (res) {
+		return res;
+	}
+	reuse_port_ = first.reuse_port_;
+
+	if (reuse_port_) {
+		int error;
+		port = first.local_port(error);
+		if (port == -1) {
+			reuse_port_ = false;
+		}
+		else {
+			// Bind the others to exactly the same address family as the first
+			family = first.address_family();
+		}
+	}
+
+	size_t listening = 1;
+	for (size_t i = 1; i < shards_.size(); ++i) {
+		auto & shard = *shards_[i];
+		if (reuse_port_) {
+			shard.reuse_port_ = true;
+			res = shard.listen(family, port);
+		}
+		else {
+			res = shard.listen_shared(first);
+		}
+		if (res) {
+			break;
+		}
+		++listening;
+	}
+
+	shards_.resize(listening);
+
+	return 0;
+}
+
+int listen_socket_group::local_port(int& error) const
+{
+	if (shards_.empty()) {
+		error = ENOTSOCK;
+		return -1;
+	}
+	return shards_.front()->local_port(error);
+}
+
+}
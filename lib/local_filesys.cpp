@@ -2,6 +2,7 @@
 
 #include "libfilezilla/buffer.hpp"
 #include "libfilezilla/file.hpp"
+#include "libfilezilla/path_builder.hpp"
 
 #ifdef FZ_WINDOWS
 #include "libfilezilla/glue/dll.hpp"
@@ -11,12 +12,22 @@
 #include <errno.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if HAVE_FCLONEFILEAT
+#include <sys/clonefile.h>
+#endif
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
 #include <utime.h>
 #endif
 
+#include <atomic>
+
 namespace fz {
 
 namespace {
@@ -41,10 +52,10 @@ local_filesys::~local_filesys()
 
 namespace {
 #ifdef FZ_WINDOWS
-bool IsNameSurrogateReparsePoint(std::wstring const& file)
+bool IsNameSurrogateReparsePoint(wchar_t const* file)
 {
 	WIN32_FIND_DATA data;
-	HANDLE hFind = FindFirstFile(file.c_str(), &data);
+	HANDLE hFind = FindFirstFile(file, &data);
 	if (hFind != INVALID_HANDLE_VALUE) {
 		FindClose(hFind);
 		return IsReparseTagNameSurrogate(data.dwReserved0);
@@ -58,11 +69,11 @@ bool is_drive_letter(wchar_t c)
 }
 #endif
 
-local_filesys::type do_get_file_type(native_string const& path, bool follow_links)
+local_filesys::type do_get_file_type(native_string::value_type const* path, bool follow_links)
 {
 
 #ifdef FZ_WINDOWS
-	DWORD attributes = GetFileAttributes(path.c_str());
+	DWORD attributes = GetFileAttributes(path);
 	if (attributes == INVALID_FILE_ATTRIBUTES) {
 		return local_filesys::unknown;
 	}
@@ -75,7 +86,7 @@ local_filesys::type do_get_file_type(native_string const& path, bool follow_link
 		}
 
 		// Follow the reparse point
-		HANDLE hFile = CreateFile(path.c_str(), FILE_READ_ATTRIBUTES | FILE_READ_EA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+		HANDLE hFile = CreateFile(path, FILE_READ_ATTRIBUTES | FILE_READ_EA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
 		if (hFile == INVALID_HANDLE_VALUE) {
 			return local_filesys::unknown;
 		}
@@ -93,7 +104,7 @@ local_filesys::type do_get_file_type(native_string const& path, bool follow_link
 	return is_dir ? local_filesys::dir : local_filesys::file;
 #else
 	struct stat buf;
-	int result = lstat(path.c_str(), &buf);
+	int result = lstat(path, &buf);
 	if (result) {
 		return local_filesys::unknown;
 	}
@@ -104,7 +115,7 @@ local_filesys::type do_get_file_type(native_string const& path, bool follow_link
 			return local_filesys::link;
 		}
 
-		result = stat(path.c_str(), &buf);
+		result = stat(path, &buf);
 		if (result) {
 			return local_filesys::unknown;
 		}
@@ -120,21 +131,35 @@ local_filesys::type do_get_file_type(native_string const& path, bool follow_link
 }
 }
 
-local_filesys::type local_filesys::get_file_type(native_string const& path, bool follow_links)
+namespace {
+// Calls f with the null-terminated path, removing a trailing separator. Only copies the path if needed.
+template<typename F>
+auto with_normalized_path(native_string_view const& path, native_string::value_type const* c_str, F && f)
 {
 #ifdef FZ_WINDOWS
 	if (path.size() == 6 && path[0] == '\\' && path[1] == '\\' && path[2] == '?' && path[3] == '\\' && is_drive_letter(path[4]) && path[5] == ':') {
-		return do_get_file_type(path + L"\\", follow_links);
+		return f((native_string(path) + L"\\").c_str());
 	}
-	if (path.size() == 7 && path[0] == '\\' && path[1] == '\\' && path[2] == '?' && path[3] == '\\' && is_drive_letter(path[4]) && path[5] == ':' && is_separator(path[6])) {
-		return do_get_file_type(path, follow_links);
+	if (path.size() == 7 && path[0] == '\\' && path[1] == '\\' && path[2] == '?' && path[3] == '\\' && is_drive_letter(path[4]) && path[5] == ':' && local_filesys::is_separator(path[6])) {
+		return f(c_str);
 	}
 #endif
-	if (path.size() > 1 && is_separator(path.back())) {
-		return do_get_file_type(path.substr(0, path.size() - 1), follow_links);
+	if (path.size() > 1 && local_filesys::is_separator(path.back())) {
+		return f(native_string(path.substr(0, path.size() - 1)).c_str());
 	}
 
-	return do_get_file_type(path, follow_links);
+	return f(c_str);
+}
+}
+
+local_filesys::type local_filesys::get_file_type(native_string const& path, bool follow_links)
+{
+	return with_normalized_path(path, path.c_str(), [&](native_string::value_type const* p) { return do_get_file_type(p, follow_links); });
+}
+
+local_filesys::type local_filesys::get_file_type(path_builder const& path, bool follow_links)
+{
+	return with_normalized_path(path.view(), path.c_str(), [&](native_string::value_type const* p) { return do_get_file_type(p, follow_links); });
 }
 
 namespace {
@@ -228,13 +253,13 @@ local_filesys::type get_file_info_at(char const* path, DIR* dir, bool &is_link,
 }
 #endif
 
-local_filesys::type do_get_file_info(native_string const& path, bool& is_link, int64_t* size, datetime* modification_time, int* mode, bool follow_links)
+local_filesys::type do_get_file_info(native_string::value_type const* path, bool& is_link, int64_t* size, datetime* modification_time, int* mode, bool follow_links)
 {
 #ifdef FZ_WINDOWS
 	is_link = false;
 
 	WIN32_FILE_ATTRIBUTE_DATA data;
-	if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &data)) {
+	if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data)) {
 		if (size) {
 			*size = -1;
 		}
@@ -271,7 +296,7 @@ local_filesys::type do_get_file_info(native_string const& path, bool& is_link, i
 			return local_filesys::link;
 		}
 
-		HANDLE hFile = is_dir ? INVALID_HANDLE_VALUE : CreateFile(path.c_str(), FILE_READ_ATTRIBUTES | FILE_READ_EA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		HANDLE hFile = is_dir ? INVALID_HANDLE_VALUE : CreateFile(path, FILE_READ_ATTRIBUTES | FILE_READ_EA, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
 		if (hFile != INVALID_HANDLE_VALUE) {
 			BY_HANDLE_FILE_INFORMATION info{};
 			int ret = GetFileInformationByHandle(hFile, &info);
@@ -347,26 +372,23 @@ local_filesys::type do_get_file_info(native_string const& path, bool& is_link, i
 			return lstat(path, &buf);
 		}
 	};
-	return get_file_info_impl(do_stat, path.c_str(), nullptr, is_link, size, modification_time, mode, follow_links);
+	return get_file_info_impl(do_stat, path, nullptr, is_link, size, modification_time, mode, follow_links);
 #endif
 }
 }
 
 local_filesys::type local_filesys::get_file_info(native_string const& path, bool &is_link, int64_t* size, datetime* modification_time, int *mode, bool follow_links)
 {
-#ifdef FZ_WINDOWS
-	if (path.size() == 6 && path[0] == '\\' && path[1] == '\\' && path[2] == '?' && path[3] == '\\' && is_drive_letter(path[4]) && path[5] == ':') {
-		return do_get_file_info(path + L"\\", is_link, size, modification_time, mode, follow_links);
-	}
-	if (path.size() == 7 && path[0] == '\\' && path[1] == '\\' && path[2] == '?' && path[3] == '\\' && is_drive_letter(path[4]) && path[5] == ':' && is_separator(path[6])) {
-		return do_get_file_info(path, is_link, size, modification_time, mode, follow_links);
-	}
-#endif
-	if (path.size() > 1 && is_separator(path.back())) {
-		return do_get_file_info(path.substr(0, path.size() - 1), is_link, size, modification_time, mode, follow_links);
-	}
+	return with_normalized_path(path, path.c_str(), [&](native_string::value_type const* p) {
+		return do_get_file_info(p, is_link, size, modification_time, mode, follow_links);
+	});
+}
 
-	return do_get_file_info(path, is_link, size, modification_time, mode, follow_links);
+local_filesys::type local_filesys::get_file_info(path_builder const& path, bool &is_link, int64_t* size, datetime* modification_time, int *mode, bool follow_links)
+{
+	return with_normalized_path(path.view(), path.c_str(), [&](native_string::value_type const* p) {
+		return do_get_file_info(p, is_link, size, modification_time, mode, follow_links);
+	});
 }
 
 result local_filesys::begin_find_files(native_string path, bool dirs_only, bool query_symlink_targets)
@@ -484,6 +506,9 @@ void local_filesys::end_find_files()
 		closedir(dir_);
 		dir_ = nullptr;
 	}
+	buffer_.clear();
+	buffer_pos_ = 0;
+	buffer_len_ = 0;
 #endif
 }
 
@@ -831,6 +856,257 @@ bool local_filesys::get_next_file(native_string& name, bool &is_link, local_file
 #endif
 }
 
+namespace {
+#ifndef FZ_WINDOWS
+// What the directory listing tells about an entry without stat'ing it
+enum class listed_type
+{
+	unknown,
+	dir,
+	link,
+	other
+};
+
+// Stats the entry, using statx where available to only query the needed fields
+bool stat_entry(int fd, char const* name, bool follow, dir_entry_fields fields, mode_t & m, int64_t & size, int64_t & mtime)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+	static std::atomic<bool> no_statx{};
+	if (!no_statx) {
+		unsigned int mask = STATX_TYPE;
+		if (fields & dir_entry_fields::size) {
+			mask |= STATX_SIZE;
+		}
+		if (fields & dir_entry_fields::mtime) {
+			mask |= STATX_MTIME;
+		}
+		if (fields & dir_entry_fields::mode) {
+			mask |= STATX_MODE;
+		}
+
+		struct statx buf{};
+		if (!statx(fd, name, follow ? 0 : AT_SYMLINK_NOFOLLOW, mask, &buf)) {
+			m = buf.stx_mode;
+			size = static_cast<int64_t>(buf.stx_size);
+			mtime = buf.stx_mtime.tv_sec;
+			return true;
+		}
+		int const err = errno;
+		if (err == ENOSYS) {
+			no_statx = true;
+		}
+		else if (err != EPERM) {
+			// EPERM may be a sandbox disallowing statx, try again with fstatat
+			return false;
+		}
+	}
+#else
+	(void)fields;
+#endif
+
+	struct stat buf{};
+	if (fstatat(fd, name, &buf, follow ? 0 : AT_SYMLINK_NOFOLLOW)) {
+		return false;
+	}
+	m = buf.st_mode;
+	size = buf.st_size;
+	mtime = buf.st_mtime;
+	return true;
+}
+
+// Fills in the entry, returns false if it is to be skipped
+bool fill_entry(local_filesys::dir_entry & e, int fd, char const* name, listed_type lt, dir_entry_fields fields, bool dirs_only, bool follow)
+{
+	bool const need_type = dirs_only || (fields & dir_entry_fields::type);
+	bool const need_stat = (fields & (dir_entry_fields::size | dir_entry_fields::mtime | dir_entry_fields::mode)) ||
+		(need_type && (lt == listed_type::unknown || (lt == listed_type::link && follow)));
+
+	if (dirs_only && (lt == listed_type::other || (lt == listed_type::link && !follow))) {
+		return false;
+	}
+
+	e.name = name;
+	e.is_link = lt == listed_type::link;
+	e.size = -1;
+	e.mtime = datetime();
+	e.mode = 0;
+	switch (lt) {
+	case listed_type::dir:
+		e.t = local_filesys::dir;
+		break;
+	case listed_type::link:
+		e.t = follow ? local_filesys::unknown : local_filesys::link;
+		break;
+	case listed_type::other:
+		e.t = local_filesys::file;
+		break;
+	default:
+		e.t = local_filesys::unknown;
+		break;
+	}
+
+	if (need_stat) {
+		mode_t m{};
+		int64_t size{};
+		int64_t mtime{};
+
+		// If the listing already says it is a link, stat the target right away
+		bool ok = stat_entry(fd, name, follow && lt == listed_type::link, fields, m, size, mtime);
+#ifdef S_ISLNK
+		if (ok && S_ISLNK(m)) {
+			e.is_link = true;
+			if (follow) {
+				ok = stat_entry(fd, name, true, fields, m, size, mtime);
+			}
+		}
+#endif
+		if (!ok) {
+			// Like get_next_file, e.g. in case of permission denied or dangling links
+			e.t = (lt == listed_type::dir) ? local_filesys::dir : local_filesys::file;
+			e.is_link = false;
+		}
+		else {
+#ifdef S_ISLNK
+			if (S_ISLNK(m)) {
+				e.t = local_filesys::link;
+			}
+			else
+#endif
+			e.t = S_ISDIR(m) ? local_filesys::dir : local_filesys::file;
+
+			if (fields & dir_entry_fields::mtime) {
+				e.mtime = datetime(static_cast<time_t>(mtime), datetime::seconds);
+			}
+			if (fields & dir_entry_fields::mode) {
+				e.mode = static_cast<int>(m & 0777);
+			}
+			if ((fields & dir_entry_fields::size) && e.t == local_filesys::file) {
+				e.size = size;
+			}
+		}
+	}
+
+	return !dirs_only || e.t == local_filesys::dir;
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+// As returned by the getdents64 system call
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+#endif
+
+#if HAVE_STRUCT_DIRENT_D_TYPE || (defined(__linux__) && defined(SYS_getdents64))
+listed_type to_listed_type(unsigned char d_type)
+{
+	switch (d_type) {
+	case DT_DIR:
+		return listed_type::dir;
+	case DT_LNK:
+		return listed_type::link;
+	case DT_UNKNOWN:
+		return listed_type::unknown;
+	default:
+		return listed_type::other;
+	}
+}
+#endif
+#endif
+}
+
+bool local_filesys::get_next_files(std::vector<dir_entry> & entries, size_t max_entries, dir_entry_fields fields)
+{
+	entries.clear();
+	if (!max_entries) {
+		max_entries = 1;
+	}
+
+#ifdef FZ_WINDOWS
+	// The listing contains all fields, fetch it in larger chunks.
+	if (!cur_ && buffer_.size() < 256 * 1024 && dir_ != INVALID_HANDLE_VALUE) {
+		buffer_.resize(256 * 1024);
+	}
+
+	bool const need_info = fields & (dir_entry_fields::size | dir_entry_fields::mtime | dir_entry_fields::mode);
+	while (entries.size() < max_entries) {
+		dir_entry e;
+		bool ok;
+		if (need_info) {
+			ok = get_next_file(e.name, e.is_link, e.t,
+				(fields & dir_entry_fields::size) ? &e.size : nullptr,
+				(fields & dir_entry_fields::mtime) ? &e.mtime : nullptr,
+				(fields & dir_entry_fields::mode) ? &e.mode : nullptr);
+		}
+		else {
+			ok = get_next_file(e.name, e.is_link, e.t, nullptr, nullptr, nullptr);
+		}
+		if (!ok) {
+			break;
+		}
+		entries.emplace_back(std::move(e));
+	}
+#else
+	if (!dir_) {
+		return false;
+	}
+
+	int const fd = dirfd(dir_);
+	dir_entry e;
+
+#if defined(__linux__) && defined(SYS_getdents64)
+	// Bypass readdir, read the listing in large chunks
+	if (buffer_.empty()) {
+		buffer_.resize(128 * 1024);
+	}
+	while (entries.size() < max_entries) {
+		if (buffer_pos_ >= buffer_len_) {
+			long const r = syscall(SYS_getdents64, fd, buffer_.data(), buffer_.size());
+			if (r <= 0) {
+				break;
+			}
+			buffer_pos_ = 0;
+			buffer_len_ = static_cast<size_t>(r);
+		}
+
+		auto const& entry = *reinterpret_cast<linux_dirent64 const*>(buffer_.data() + buffer_pos_);
+		buffer_pos_ += entry.d_reclen;
+
+		char const* name = entry.d_name;
+		if (!name[0] || !strcmp(name, ".") || !strcmp(name, "..")) {
+			continue;
+		}
+		if (fill_entry(e, fd, name, to_listed_type(entry.d_type), fields, dirs_only_, query_symlink_targets_)) {
+			entries.push_back(e);
+		}
+	}
+#else
+	struct dirent* entry;
+	while (entries.size() < max_entries && (entry = readdir(dir_))) {
+		char const* name = entry->d_name;
+		if (!name[0] || !strcmp(name, ".") || !strcmp(name, "..")) {
+			continue;
+		}
+#if HAVE_STRUCT_DIRENT_D_TYPE
+		listed_type const lt = to_listed_type(entry->d_type);
+#else
+		// Solaris doesn't have d_type
+		listed_type const lt = listed_type::unknown;
+#endif
+		if (fill_entry(e, fd, name, lt, fields, dirs_only_, query_symlink_targets_)) {
+			entries.push_back(e);
+		}
+	}
+#endif
+#endif
+
+	return !entries.empty();
+}
+
 datetime local_filesys::get_modification_time(native_string const& path)
 {
 	datetime mtime;
@@ -883,6 +1159,18 @@ int64_t local_filesys::get_size(native_string const& path, bool* is_link)
 	return ret;
 }
 
+int64_t local_filesys::get_size(path_builder const& path, bool* is_link)
+{
+	int64_t ret = -1;
+	bool tmp{};
+	type t = get_file_info(path, is_link ? *is_link : tmp, &ret, nullptr, nullptr);
+	if (t != file) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
 native_string local_filesys::get_link_target(native_string const& path)
 {
 	native_string target;
@@ -1121,56 +1409,171 @@ result remove_dir(native_string const& absolute_path)
 	return {result::ok};
 }
 
-#ifndef FZ_WINDOWS
 namespace {
-static result do_copy(native_string const& source, native_string const& dest, bool & dest_opened)
+#ifdef FZ_WINDOWS
+DWORD CALLBACK copy_progress_routine(LARGE_INTEGER size, LARGE_INTEGER copied, LARGE_INTEGER, LARGE_INTEGER, DWORD, DWORD, HANDLE, HANDLE, LPVOID data)
 {
-	fz::file in(source, fz::file::reading, fz::file::existing);
-
-	if (!in.opened()) {
-		// TODO error codes
-		return {result::other};
+	auto const& progress = *static_cast<copy_progress_callback const*>(data);
+	return progress(copied.QuadPart, size.QuadPart) ? PROGRESS_CONTINUE : PROGRESS_CANCEL;
+}
+#else
+result copy_error(int err)
+{
+	switch (err) {
+	case EPERM:
+	case EACCES:
+		return {result::noperm, err};
+	case ENOSPC:
+	case EDQUOT:
+		return {result::nospace, err};
+	case ENOTDIR:
+		return {result::nodir, err};
+	case ENOENT:
+	case EISDIR:
+		return {result::nofile, err};
+	default:
+		return {result::other, err};
 	}
+}
 
-	fz::file out(dest, fz::file::writing, fz::file::empty);
-	if (!out.opened()) {
-		// TODO error codes
-		return {result::other};
+// Copies the contents of in to the empty out
+result copy_data(file & in, file & out, int64_t size, copy_progress_callback const& progress)
+{
+	int64_t copied{};
+	auto report = [&]() {
+		return !progress || progress(copied, size);
+	};
+
+#if defined(__linux__) && defined(FICLONE)
+	// Reflink, shares the data blocks
+	if (!ioctl(out.fd(), FICLONE, in.fd())) {
+		copied = size;
+		return report() ? result{result::ok} : result{result::other, ECANCELED};
 	}
+#endif
 
-	dest_opened = true;
+#if HAVE_COPY_FILE_RANGE
+	while (true) {
+		ssize_t r = copy_file_range(in.fd(), nullptr, out.fd(), nullptr, 16 * 1024 * 1024, 0);
+		if (r < 0) {
+			int const err = errno;
+			if (err == EINTR) {
+				continue;
+			}
+			if (!copied && (err == EXDEV || err == ENOSYS || err == EINVAL || err == EOPNOTSUPP || err == EBADF)) {
+				// Not supported for this pair of files, copy through userspace instead
+				break;
+			}
+			return copy_error(err);
+		}
+		else if (!r) {
+			if (copied || !size) {
+				return {result::ok};
+			}
+			// Some pseudo-filesystems report no data, copy through userspace instead
+			break;
+		}
+		copied += r;
+		if (!report()) {
+			return {result::other, ECANCELED};
+		}
+	}
+#endif
 
-	fz::buffer buffer;
+	buffer buf;
 	while (true) {
-		if (buffer.empty()) {
-			auto read = in.read(buffer.get(64 * 1024), 64 * 1024);
+		if (buf.empty()) {
+			auto read = in.read(buf.get(256 * 1024), 256 * 1024);
 			if (read < 0) {
-				return {result::other};
-			}
-			else if (read) {
-				buffer.add(read);
+				return copy_error(errno);
 			}
-			else {
-				if (buffer.empty()) {
-					return {result::ok};
-				}
+			else if (!read) {
+				return {result::ok};
 			}
+			buf.add(static_cast<size_t>(read));
 		}
-		auto written = out.write(buffer.get(), buffer.size());
+		auto written = out.write(buf.get(), static_cast<int64_t>(buf.size()));
 		if (written <= 0) {
-			return {result::other};
+			return copy_error(written < 0 ? errno : ENOSPC);
+		}
+		buf.consume(static_cast<size_t>(written));
+		copied += written;
+		if (!report()) {
+			return {result::other, ECANCELED};
 		}
+	}
+}
 
-		buffer.consume(written);
+result do_copy(native_string const& source, native_string const& dest, copy_progress_callback const& progress, bool sync)
+{
+	file in(source, file::reading, file::existing);
+	if (!in.opened()) {
+		return copy_error(errno);
 	}
-	if (!out.fsync()) {
-		return {result::other};
+
+	struct stat buf{};
+	if (fstat(in.fd(), &buf)) {
+		return copy_error(errno);
 	}
+	if (!S_ISREG(buf.st_mode)) {
+		return {result::nofile, EISDIR};
+	}
+	int64_t const size = static_cast<int64_t>(buf.st_size);
 
-	return {result::ok};
+#if HAVE_FCLONEFILEAT
+	// Only works if the target does not exist yet
+	if (!fclonefileat(in.fd(), AT_FDCWD, dest.c_str(), 0)) {
+		if (progress && !progress(size, size)) {
+			unlink(dest.c_str());
+			return {result::other, ECANCELED};
+		}
+		return {result::ok};
+	}
+#endif
+
+	file out(dest, file::writing, file::empty);
+	if (!out.opened()) {
+		return copy_error(errno);
+	}
+
+	auto ret = copy_data(in, out, size, progress);
+	if (ret && sync && !out.fsync()) {
+		ret = copy_error(errno);
+	}
+	if (!ret) {
+		out.close();
+		unlink(dest.c_str());
+	}
+	return ret;
 }
+#endif
 }
+
+result copy_file(native_string const& source, native_string const& dest, copy_progress_callback const& progress)
+{
+#ifdef FZ_WINDOWS
+	BOOL res = CopyFileExW(source.c_str(), dest.c_str(), progress ? copy_progress_routine : nullptr, progress ? const_cast<copy_progress_callback*>(&progress) : nullptr, nullptr, 0);
+	if (res) {
+		return {result::ok};
+	}
+
+	DWORD const err = GetLastError();
+	switch (err) {
+		case ERROR_FILE_NOT_FOUND:
+			return {result::nofile, err};
+		case ERROR_PATH_NOT_FOUND:
+			return {result::nodir, err};
+		case ERROR_ACCESS_DENIED:
+			return {result::noperm, err};
+		case ERROR_DISK_FULL:
+			return {result::nospace, err};
+		default:
+			return {result::other, err};
+	}
+#else
+	return do_copy(source, dest, progress, false);
 #endif
+}
 
 result rename_file(native_string const& source, native_string const& dest, bool allow_copy)
 {
@@ -1224,12 +1627,9 @@ result rename_file(native_string const& source, native_string const& dest, bool
 		return {result::other, err};
 	}
 
-	bool dest_opened{};
-	auto ret = do_copy(source, dest, dest_opened);
+	// The source gets removed next, make sure the copy is durable
+	auto ret = do_copy(source, dest, {}, true);
 	if (!ret) {
-		if (dest_opened) {
-			unlink(dest.c_str());
-		}
 		return ret;
 	}
 
@@ -1272,7 +1672,14 @@ local_filesys::local_filesys(local_filesys && op) noexcept
 	op.cur_ = nullptr;
 	op.dir_ = INVALID_HANDLE_VALUE;
 #else
+	buffer_ = std::move(op.buffer_);
+	buffer_pos_ = op.buffer_pos_;
+	buffer_len_ = op.buffer_len_;
 	dir_ = op.dir_;
+
+	op.buffer_.clear();
+	op.buffer_pos_ = 0;
+	op.buffer_len_ = 0;
 	op.dir_ = nullptr;
 #endif
 	dirs_only_ = op.dirs_only_;
@@ -1300,7 +1707,14 @@ local_filesys& local_filesys::operator=(local_filesys && op) noexcept
 		op.cur_ = nullptr;
 		op.dir_ = INVALID_HANDLE_VALUE;
 #else
+		buffer_ = std::move(op.buffer_);
+		buffer_pos_ = op.buffer_pos_;
+		buffer_len_ = op.buffer_len_;
 		dir_ = op.dir_;
+
+		op.buffer_.clear();
+		op.buffer_pos_ = 0;
+		op.buffer_len_ = 0;
 		op.dir_ = nullptr;
 #endif
 		dirs_only_ = op.dirs_only_;
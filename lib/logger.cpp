@@ -6,16 +6,56 @@
 
 namespace fz {
 
+void logger_interface::do_log_utf8(logmsg::type t, std::string && msg)
+{
+	do_log(t, fz::to_wstring_from_utf8(msg));
+}
+
+void logger_interface::do_log_deferred(logmsg::type t, deferred_log_message && msg)
+{
+	if (prefers_utf8_) {
+		do_log_utf8(t, msg.format_utf8());
+	}
+	else {
+		do_log(t, msg.format());
+	}
+}
+
 null_logger& get_null_logger()
 {
 	static null_logger log;
 	return log;
 }
 
-void stdout_logger::do_log(logmsg::type t, std::wstring && msg)
+namespace {
+void print_prefix(logmsg::type t)
 {
 	auto now = fz::datetime::now();
-	std::cout << now.format("%Y-%m-%dT%H:%M:%S.", fz::datetime::utc) << fz::sprintf("%03d", now.get_milliseconds()) << "Z " << (1 + bitscan(static_cast<uint64_t>(t))) << " " << fz::to_string(msg) << std::endl;
+	std::cout << now.format("%Y-%m-%dT%H:%M:%S.", fz::datetime::utc) << fz::sprintf("%03d", now.get_milliseconds()) << "Z " << (1 + bitscan(static_cast<uint64_t>(t))) << " ";
 }
 }
 
+stdout_logger::stdout_logger()
+{
+#if !FZ_WINDOWS
+	prefers_utf8_ = true;
+#endif
+}
+
+void stdout_logger::do_log(logmsg::type t, std::wstring && msg)
+{
+	print_prefix(t);
+	std::cout << fz::to_string(msg) << std::endl;
+}
+
+void stdout_logger::do_log_utf8(logmsg::type t, std::string && msg)
+{
+	print_prefix(t);
+	if (detail::is_ascii(msg)) {
+		std::cout << msg << std::endl;
+	}
+	else {
+		std::cout << fz::to_string(fz::to_wstring_from_utf8(msg)) << std::endl;
+	}
+}
+}
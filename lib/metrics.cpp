@@ -0,0 +1,493 @@
+#include "libfilezilla/metrics.hpp"
+#include "libfilezilla/aio/aio.hpp"
+#include "libfilezilla/buffer.hpp"
+#include "libfilezilla/event_loop.hpp"
+#include "libfilezilla/rate_limiter.hpp"
+#include "libfilezilla/thread_pool.hpp"
+#include "libfilezilla/tls_layer.hpp"
+
+namespace fz {
+
+namespace {
+enum metric_type {
+	type_counter,
+	type_gauge,
+	type_histogram
+};
+
+char const* const type_names[] = {"counter", "gauge", "histogram"};
+
+// Each thread sticks to one shard, threads get distributed round-robin
+size_t shard_index()
+{
+	static std::atomic<size_t> next{};
+	thread_local size_t const index = next++ % metric_shards;
+	return index;
+}
+
+bool is_valid_name(std::string_view name, bool colon)
+{
+	if (name.empty() || (name[0] >= '0' && name[0] <= '9')) {
+		return false;
+	}
+	for (auto const c : name) {
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || (colon && c == ':'))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void append_escaped(std::string & out, std::string_view in)
+{
+	for (auto const c : in) {
+		if (c == '\\') {
+			out += "\\\\";
+		}
+		else if (c == '"') {
+			out += "\\\"";
+		}
+		else if (c == '\n') {
+			out += "\\n";
+		}
+		else {
+			out += c;
+		}
+	}
+}
+
+// Formats the labels including the braces, empty string if there are none.
+// Returns false on invalid label names.
+bool format_labels(std::string & out, metric_labels const& labels, std::string_view le = {})
+{
+	if (labels.empty() && le.empty()) {
+		return true;
+	}
+
+	out += '{';
+	bool first = true;
+	for (auto const& label : labels) {
+		if (!is_valid_name(label.first, false) || label.first == "le") {
+			return false;
+		}
+		if (!first) {
+			out += ',';
+		}
+		first = false;
+		out += label.first;
+		out += "=\"";
+		append_escaped(out, label.second);
+		out += '"';
+	}
+	if (!le.empty()) {
+		if (!first) {
+			out += ',';
+		}
+		out += "le=\"";
+		out += le;
+		out += '"';
+	}
+	out += '}';
+	return true;
+}
+
+// Collects the samples per family, so that each family is written in one piece
+class exposition final : public metrics_sink
+{
+public:
+	struct family final
+	{
+		int type_{};
+		std::string help_;
+		std::string samples_;
+	};
+
+	virtual void counter(std::string_view name, std::string_view help, metric_labels const& labels, uint64_t value) override
+	{
+		add(name, help, labels, type_counter, "_total", std::to_string(value));
+	}
+
+	virtual void gauge(std::string_view name, std::string_view help, metric_labels const& labels, int64_t value) override
+	{
+		add(name, help, labels, type_gauge, {}, std::to_string(value));
+	}
+
+	// Returns nullptr on invalid names or a type mismatch
+	family* get(std::string_view name, std::string_view help, int type)
+	{
+		if (!is_valid_name(name, true)) {
+			return nullptr;
+		}
+		auto it = families_.find(name);
+		if (it == families_.end()) {
+			it = families_.emplace(std::string(name), family()).first;
+			it->second.type_ = type;
+			it->second.help_ = help;
+		}
+		else if (it->second.type_ != type) {
+			return nullptr;
+		}
+		return &it->second;
+	}
+
+	void add(std::string_view name, std::string_view help, metric_labels const& labels, int type, std::string_view suffix, std::string const& value)
+	{
+		auto * f = get(name, help, type);
+		if (!f) {
+			return;
+		}
+		std::string line(name);
+		line += suffix;
+		if (!format_labels(line, labels)) {
+			return;
+		}
+		line += ' ';
+		line += value;
+		line += '\n';
+		f->samples_ += line;
+	}
+
+	void write(buffer & out) const
+	{
+		for (auto const& f : families_) {
+			std::string header = "# TYPE ";
+			header += f.first;
+			header += ' ';
+			header += type_names[f.second.type_];
+			header += '\n';
+			if (!f.second.help_.empty()) {
+				header += "# HELP ";
+				header += f.first;
+				header += ' ';
+				append_escaped(header, f.second.help_);
+				header += '\n';
+			}
+			out.append(header);
+			out.append(f.second.samples_);
+		}
+		out.append("# EOF\n");
+	}
+
+private:
+	std::map<std::string, family, std::less<>> families_;
+};
+}
+
+void metric_counter::add(uint64_t v)
+{
+	shards_[shard_index()].v_.fetch_add(v, std::memory_order_relaxed);
+}
+
+uint64_t metric_counter::value() const
+{
+	uint64_t ret{};
+	for (auto const& s : shards_) {
+		ret += s.v_.load(std::memory_order_relaxed);
+	}
+	return ret;
+}
+
+metric_histogram::metric_histogram(std::vector<uint64_t> const& bounds)
+	: bounds_(bounds)
+{
+	// Buckets plus the sum, rounded up to whole cache lines so that shards do not share any
+	size_t const per_line = 64 / sizeof(std::atomic<uint64_t>);
+	stride_ = (bounds_.size() + 2 + per_line - 1) / per_line * per_line;
+	values_ = new std::atomic<uint64_t>[stride_ * metric_shards]();
+}
+
+metric_histogram::~metric_histogram()
+{
+	delete [] values_;
+}
+
+void metric_histogram::observe(uint64_t v)
+{
+	size_t bucket = 0;
+	while (bucket < bounds_.size() && v > bounds_[bucket]) {
+		++bucket;
+	}
+
+	auto * shard = values_ + shard_index() * stride_;
+	shard[bucket].fetch_add(1, std::memory_order_relaxed);
+	shard[bounds_.size() + 1].fetch_add(v, std::memory_order_relaxed);
+}
+
+std::vector<uint64_t> metric_histogram::counts() const
+{
+	std::vector<uint64_t> ret(bounds_.size() + 1);
+	for (size_t s = 0; s < metric_shards; ++s) {
+		auto const* shard = values_ + s * stride_;
+		for (size_t i = 0; i < ret.size(); ++i) {
+			ret[i] += shard[i].load(std::memory_order_relaxed);
+		}
+	}
+	return ret;
+}
+
+uint64_t metric_histogram::sum() const
+{
+	uint64_t ret{};
+	for (size_t s = 0; s < metric_shards; ++s) {
+		ret += values_[s * stride_ + bounds_.size() + 1].load(std::memory_order_relaxed);
+	}
+	return ret;
+}
+
+struct metrics_registry::family final
+{
+	int type_{};
+	std::string help_;
+	std::vector<uint64_t> bounds_;
+
+	// Keyed by the formatted labels, only the map matching the type is used
+	std::map<std::string, std::unique_ptr<metric_counter>> counters_;
+	std::map<std::string, std::unique_ptr<metric_gauge>> gauges_;
+	std::map<std::string, std::unique_ptr<metric_histogram>> histograms_;
+};
+
+metrics_registry::metrics_registry()
+{
+}
+
+metrics_registry::~metrics_registry()
+{
+}
+
+metrics_registry::family* metrics_registry::get_family(std::string_view name, std::string_view help, int type, std::vector<uint64_t> const* bounds)
+{
+	if (!is_valid_name(name, true)) {
+		return nullptr;
+	}
+
+	auto it = families_.find(name);
+	if (it == families_.end()) {
+		auto f = std::make_unique<family>();
+		f->type_ = type;
+		f->help_ = help;
+		if (bounds) {
+			f->bounds_ = *bounds;
+		}
+		it = families_.emplace(std::string(name), std::move(f)).first;
+	}
+	else if (it->second->type_ != type) {
+		return nullptr;
+	}
+	return it->second.get();
+}
+
+metric_counter* metrics_registry::counter(std::string_view name, std::string_view help, metric_labels const& labels)
+{
+	std::string key;
+	if (!format_labels(key, labels)) {
+		return nullptr;
+	}
+
+	scoped_lock l(mtx_);
+	auto * f = get_family(name, help, type_counter, nullptr);
+	if (!f) {
+		return nullptr;
+	}
+	auto & m = f->counters_[key];
+	if (!m) {
+		m = std::make_unique<metric_counter>();
+	}
+	return m.get();
+}
+
+metric_gauge* metrics_registry::gauge(std::string_view name, std::string_view help, metric_labels const& labels)
+{
+	std::string key;
+	if (!format_labels(key, labels)) {
+		return nullptr;
+	}
+
+	scoped_lock l(mtx_);
+	auto * f = get_family(name, help, type_gauge, nullptr);
+	if (!f) {
+		return nullptr;
+	}
+	auto & m = f->gauges_[key];
+	if (!m) {
+		m = std::make_unique<metric_gauge>();
+	}
+	return m.get();
+}
+
+metric_histogram* metrics_registry::histogram(std::string_view name, std::string_view help, std::vector<uint64_t> const& bounds, metric_labels const& labels)
+{
+	std::string key;
+	if (!format_labels(key, labels)) {
+		return nullptr;
+	}
+
+	scoped_lock l(mtx_);
+	auto * f = get_family(name, help, type_histogram, &bounds);
+	if (!f) {
+		return nullptr;
+	}
+	auto & m = f->histograms_[key];
+	if (!m) {
+		m = std::make_unique<metric_histogram>(f->bounds_);
+	}
+	return m.get();
+}
+
+size_t metrics_registry::add_collector(collector && c)
+{
+	scoped_lock l(mtx_);
+	size_t const id = ++next_collector_;
+	collectors_[id] = std::move(c);
+	return id;
+}
+
+void metrics_registry::remove_collector(size_t id)
+{
+	scoped_lock l(mtx_);
+	collectors_.erase(id);
+}
+
+void metrics_registry::write_openmetrics(buffer & out) const
+{
+	exposition e;
+
+	scoped_lock l(mtx_);
+	for (auto const& f : families_) {
+		auto * ef = e.get(f.first, f.second->help_, f.second->type_);
+		if (!ef) {
+			continue;
+		}
+
+		for (auto const& m : f.second->counters_) {
+			ef->samples_ += f.first + "_total" + m.first + ' ' + std::to_string(m.second->value()) + '\n';
+		}
+		for (auto const& m : f.second->gauges_) {
+			ef->samples_ += f.first + m.first + ' ' + std::to_string(m.second->value()) + '\n';
+		}
+		for (auto const& m : f.second->histograms_) {
+			auto const counts = m.second->counts();
+
+			// The label set needs to be extended by the bucket bound
+			std::string labels = m.first;
+			if (!labels.empty()) {
+				labels.back() = ',';
+			}
+			else {
+				labels = "{";
+			}
+
+			uint64_t cumulative{};
+			for (size_t i = 0; i < counts.size(); ++i) {
+				cumulative += counts[i];
+				std::string const le = i < f.second->bounds_.size() ? std::to_string(f.second->bounds_[i]) : std::string("+Inf");
+				ef->samples_ += f.first + "_bucket" + labels + "le=\"" + le + "\"} " + std::to_string(cumulative) + '\n';
+			}
+			ef->samples_ += f.first + "_count" + m.first + ' ' + std::to_string(cumulative) + '\n';
+			ef->samples_ += f.first + "_sum" + m.first + ' ' + std::to_string(m.second->sum()) + '\n';
+		}
+	}
+
+	for (auto const& c : collectors_) {
+		c.second(e);
+	}
+
+	e.write(out);
+}
+
+namespace {
+metric_labels with_label(metric_labels labels, std::string const& name, std::string const& value)
+{
+	labels.emplace_back(name, value);
+	return labels;
+}
+}
+
+size_t add_event_loop_metrics(metrics_registry & registry, event_loop & loop, metric_labels const& labels)
+{
+	return registry.add_collector([&loop, labels](metrics_sink & sink) {
+		auto const stats = loop.get_stats();
+		sink.gauge("fz_event_loop_handlers", "Number of handlers using the loop", labels, static_cast<int64_t>(loop.handler_count()));
+		sink.gauge("fz_event_loop_pending_events", "Number of events waiting to be dispatched", labels, static_cast<int64_t>(stats.pending));
+		sink.gauge("fz_event_loop_peak_pending_events", "Largest number of events waiting at once", labels, static_cast<int64_t>(stats.peak_pending));
+		sink.counter("fz_event_loop_slow_dispatches", "Dispatches exceeding the slow handler threshold", labels, stats.slow);
+		for (auto const& t : stats.types) {
+			auto const type_labels = with_label(labels, "type", std::to_string(t.first));
+			sink.counter("fz_event_loop_dispatches", "Dispatched events and timers by event type", type_labels, t.second.run_time.count);
+			sink.counter("fz_event_loop_run_time_microseconds", "Time spent in handlers by event type", type_labels, t.second.run_time.total_us);
+			sink.counter("fz_event_loop_queue_delay_microseconds", "Time events waited for dispatch by event type", type_labels, t.second.queue_delay.total_us);
+		}
+	});
+}
+
+size_t add_thread_pool_metrics(metrics_registry & registry, thread_pool & pool, metric_labels const& labels)
+{
+	return registry.add_collector([&pool, labels](metrics_sink & sink) {
+		auto const stats = pool.get_stats();
+		sink.gauge("fz_thread_pool_threads", "Number of threads alive, including idle ones", labels, static_cast<int64_t>(stats.threads));
+		sink.gauge("fz_thread_pool_idle_threads", "Number of threads waiting for a task", labels, static_cast<int64_t>(stats.idle));
+		sink.gauge("fz_thread_pool_queued_tasks", "Number of spawned tasks waiting for a thread", labels, static_cast<int64_t>(stats.queued));
+		sink.gauge("fz_thread_pool_peak_threads", "Highest number of threads alive at once", labels, static_cast<int64_t>(stats.peak));
+
+		auto const accounting = pool.get_accounting();
+		for (auto const& c : accounting.categories) {
+			auto const category_labels = with_label(labels, "category", c.first);
+			sink.counter("fz_thread_pool_tasks", "Finished tasks by category", category_labels, c.second.tasks);
+			sink.counter("fz_thread_pool_cpu_microseconds", "CPU time of tasks by category", category_labels, c.second.cpu_us);
+			sink.counter("fz_thread_pool_wall_microseconds", "Wall-clock time of tasks by category", category_labels, c.second.wall_us);
+		}
+	});
+}
+
+size_t add_tls_metrics(metrics_registry & registry, metric_labels const& labels)
+{
+	return registry.add_collector([labels](metrics_sink & sink) {
+		auto const stats = get_tls_stats();
+		sink.counter("fz_tls_handshakes", "Completed handshakes, including resumed ones", labels, stats.handshakes);
+		sink.counter("fz_tls_resumed_handshakes", "Completed handshakes resuming a session", labels, stats.resumed_handshakes);
+		sink.counter("fz_tls_failed_handshakes", "Failed handshakes", labels, stats.failed_handshakes);
+		sink.counter("fz_tls_handshake_time_microseconds", "Time taken by handshakes", labels, stats.handshake_time);
+		sink.counter("fz_tls_handshake_cpu_time_microseconds", "Time spent in GnuTLS while handshaking", labels, stats.handshake_cpu_time);
+		sink.counter("fz_tls_verification_time_microseconds", "Time taken to trust certificates", labels, stats.verification_time);
+		sink.counter("fz_tls_encrypted_bytes", "Octets of plaintext encrypted", labels, stats.bytes_encrypted);
+		sink.counter("fz_tls_decrypted_bytes", "Octets of plaintext decrypted", labels, stats.bytes_decrypted);
+		sink.counter("fz_tls_records_sent", "Records sent by GnuTLS", labels, stats.records_sent);
+		sink.counter("fz_tls_send_retries", "Records retried from the send buffer", labels, stats.send_retries);
+		sink.counter("fz_tls_blocked_writes", "Writes blocked by pending retries", labels, stats.blocked_writes);
+		for (auto const& c : stats.ciphers) {
+			sink.counter("fz_tls_cipher_handshakes", "Completed handshakes by cipher", with_label(labels, "cipher", c.first), c.second);
+		}
+	});
+}
+
+size_t add_rate_limit_metrics(metrics_registry & registry, rate_limit_manager & mgr, metric_labels const& labels)
+{
+	return registry.add_collector([&mgr, labels](metrics_sink & sink) {
+		auto const stats = mgr.get_stats();
+		sink.gauge("fz_rate_limit_buckets", "Number of buckets", labels, static_cast<int64_t>(stats.buckets));
+		sink.counter("fz_rate_limit_distributions", "Number of token distributions", labels, stats.distributions);
+		for (size_t d = 0; d < 2; ++d) {
+			auto const dl = with_label(labels, "direction", d == direction::inbound ? "inbound" : "outbound");
+			sink.counter("fz_rate_limit_granted_tokens", "Tokens added to buckets", dl, stats.granted[d]);
+			sink.counter("fz_rate_limit_consumed_tokens", "Tokens consumed from buckets", dl, stats.consumed[d]);
+			sink.counter("fz_rate_limit_wasted_tokens", "Tokens discarded for lack of capacity", dl, stats.wasted[d]);
+			sink.counter("fz_rate_limit_waits", "Times buckets ran out of tokens", dl, stats.waits[d]);
+			sink.counter("fz_rate_limit_wakeups", "Times waiting buckets got woken up", dl, stats.wakeups[d]);
+			sink.counter("fz_rate_limit_wait_time_milliseconds", "Time buckets spent waiting", dl, static_cast<uint64_t>(stats.wait_time[d].get_milliseconds()));
+			sink.gauge("fz_rate_limit_waiting_buckets", "Number of buckets currently waiting", dl, static_cast<int64_t>(stats.waiting[d]));
+		}
+	});
+}
+
+size_t add_aio_buffer_pool_metrics(metrics_registry & registry, aio_buffer_pool & pool, metric_labels const& labels)
+{
+	return registry.add_collector([&pool, labels](metrics_sink & sink) {
+		auto const stats = pool.get_stats();
+		sink.gauge("fz_aio_buffers", "Number of buffers allocated", labels, static_cast<int64_t>(stats.buffers));
+		sink.gauge("fz_aio_leased_buffers", "Number of outstanding leases", labels, static_cast<int64_t>(stats.leased));
+		sink.gauge("fz_aio_peak_leased_buffers", "Highest number of leases outstanding at once", labels, static_cast<int64_t>(stats.peak_leased));
+		sink.counter("fz_aio_buffer_waits", "Times callers had to wait for a buffer", labels, stats.waits);
+		sink.counter("fz_aio_buffer_wait_time_milliseconds", "Time callers waited for buffers", labels, static_cast<uint64_t>(stats.wait_time.get_milliseconds()));
+		sink.counter("fz_aio_limited", "Times the pool could not grow due to the memory limit", labels, stats.limited);
+	});
+}
+}
@@ -201,6 +201,16 @@ pthread_mutexattr_t* get_mutex_attributes(bool recursive)
 	}
 }
 
+pthread_mutexattr_t* get_adaptive_mutex_attributes()
+{
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+	static pthread_mutexattr_t *attr = init_mutexattr<PTHREAD_MUTEX_ADAPTIVE_NP>();
+	return attr;
+#else
+	return get_mutex_attributes(false);
+#endif
+}
+
 pthread_condattr_t* init_condattr()
 {
 #if HAVE_CLOCK_GETTIME && HAVE_DECL_PTHREAD_CONDATTR_SETCLOCK
@@ -234,6 +244,23 @@ mutex::mutex(bool recursive)
 #endif
 }
 
+mutex::mutex(adaptive_tag)
+{
+#ifdef FZ_WINDOWS
+	// Same as the heap manager's spin count, roughly the cost of a context switch
+	InitializeCriticalSectionEx(&m_, 4000, CRITICAL_SECTION_NO_DEBUG_INFO);
+#else
+	pthread_mutex_init(&m_, get_adaptive_mutex_attributes());
+#endif
+#ifdef LFZ_DEBUG_MUTEXES
+	[[maybe_unused]] static bool init = [this]() {
+		debug::mutex_offset = reinterpret_cast<unsigned char*>(&m_) - reinterpret_cast<unsigned char*>(this);
+		return true;
+	}();
+	h_ = std::make_shared<mutex_debug>(this);
+#endif
+}
+
 mutex::~mutex()
 {
 #ifdef FZ_WINDOWS
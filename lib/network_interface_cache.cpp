@@ -0,0 +1,229 @@
+#include "libfilezilla/network_interface_cache.hpp"
+#include "libfilezilla/event_handler.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#if defined(__linux__)
+#include "unix/poller.hpp"
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include <errno.h>
+
+namespace fz {
+
+class network_interface_cache_impl final
+{
+public:
+	network_interface_cache_impl(network_interface_cache & parent, thread_pool & pool, duration const& max_age);
+	~network_interface_cache_impl();
+
+	network_interface_cache::interfaces get();
+	void invalidate();
+
+	void subscribe(event_handler & handler);
+	void unsubscribe(event_handler & handler);
+
+	bool watching() const { return netlink_fd_ != -1; }
+
+private:
+#if defined(__linux__)
+	void run();
+	void process_notifications(scoped_lock & l);
+
+	poller poller_;
+	async_task task_;
+	bool quit_{};
+#endif
+
+	mutex mtx_{false};
+
+	network_interface_cache & parent_;
+	duration const max_age_;
+	int netlink_fd_{-1};
+
+	network_interface_cache::interfaces interfaces_;
+	monotonic_clock stored_;
+
+	// Incremented on invalidation, tells readers not to store what they have read
+	uint64_t generation_{};
+
+	std::vector<event_handler*> handlers_;
+};
+
+network_interface_cache_impl::network_interface_cache_impl(network_interface_cache & parent, thread_pool & pool, duration const& max_age)
+	: parent_(parent)
+	, max_age_(max_age)
+{
+#if defined(__linux__)
+	netlink_fd_ = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if (netlink_fd_ != -1) {
+		sockaddr_nl sa{};
+		sa.nl_family = AF_NETLINK;
+		sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+		if (!bind(netlink_fd_, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) && !poller_.init()) {
+			task_ = pool.spawn([this]{ run(); });
+		}
+		if (!task_) {
+			close(netlink_fd_);
+			netlink_fd_ = -1;
+		}
+	}
+#else
+	(void)pool;
+#endif
+}
+
+network_interface_cache_impl::~network_interface_cache_impl()
+{
+#if defined(__linux__)
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		if (task_) {
+			poller_.interrupt(l);
+		}
+	}
+	task_.join();
+
+	if (netlink_fd_ != -1) {
+		close(netlink_fd_);
+	}
+#endif
+}
+
+network_interface_cache::interfaces network_interface_cache_impl::get()
+{
+	scoped_lock l(mtx_);
+	if (interfaces_) {
+		if (netlink_fd_ != -1 || monotonic_clock::now() - stored_ < max_age_) {
+			return interfaces_;
+		}
+		interfaces_.reset();
+	}
+
+	uint64_t const generation = generation_;
+
+	l.unlock();
+	network_interface_cache::interfaces data;
+	auto enumerated = get_network_interfaces();
+	if (enumerated) {
+		data = std::make_shared<std::vector<network_interface>>(std::move(*enumerated));
+	}
+	l.lock();
+
+	if (data && generation_ == generation && (netlink_fd_ != -1 || max_age_)) {
+		interfaces_ = data;
+		stored_ = monotonic_clock::now();
+	}
+
+	return data;
+}
+
+void network_interface_cache_impl::invalidate()
+{
+	scoped_lock l(mtx_);
+	++generation_;
+	interfaces_.reset();
+}
+
+void network_interface_cache_impl::subscribe(event_handler & handler)
+{
+	scoped_lock l(mtx_);
+	if (std::find(handlers_.cbegin(), handlers_.cend(), &handler) == handlers_.cend()) {
+		handlers_.push_back(&handler);
+	}
+}
+
+void network_interface_cache_impl::unsubscribe(event_handler & handler)
+{
+	scoped_lock l(mtx_);
+	handlers_.erase(std::remove(handlers_.begin(), handlers_.end(), &handler), handlers_.end());
+}
+
+#if defined(__linux__)
+void network_interface_cache_impl::run()
+{
+	scoped_lock l(mtx_);
+	while (!quit_) {
+		pollfd fds[2]{};
+		fds[0].fd = netlink_fd_;
+		fds[0].events = POLLIN;
+		if (!poller_.wait(fds, 1, l)) {
+			break;
+		}
+		if (quit_) {
+			break;
+		}
+		if (fds[0].revents) {
+			process_notifications(l);
+		}
+	}
+}
+
+void network_interface_cache_impl::process_notifications(scoped_lock &)
+{
+	// The content does not matter, any notification means that something has changed.
+	// Read errors such as ENOBUFS mean notifications got lost, which also needs invalidation.
+	bool changed{};
+	alignas(nlmsghdr) char buf[16 * 1024];
+	while (true) {
+		ssize_t r = recv(netlink_fd_, buf, sizeof(buf), 0);
+		if (r > 0 || (r < 0 && errno == ENOBUFS)) {
+			changed = true;
+		}
+		else if (r >= 0 || errno != EINTR) {
+			break;
+		}
+	}
+
+	if (changed) {
+		++generation_;
+		interfaces_.reset();
+		for (auto * handler : handlers_) {
+			handler->send_event<network_interfaces_changed_event>(&parent_);
+		}
+	}
+}
+#endif
+
+
+network_interface_cache::network_interface_cache(thread_pool & pool, duration const& max_age)
+	: impl_(std::make_unique<network_interface_cache_impl>(*this, pool, max_age))
+{
+}
+
+network_interface_cache::~network_interface_cache()
+{
+}
+
+network_interface_cache::interfaces network_interface_cache::get()
+{
+	return impl_->get();
+}
+
+void network_interface_cache::invalidate()
+{
+	impl_->invalidate();
+}
+
+void network_interface_cache::subscribe(event_handler & handler)
+{
+	impl_->subscribe(handler);
+}
+
+void network_interface_cache::unsubscribe(event_handler & handler)
+{
+	impl_->unsubscribe(handler);
+}
+
+bool network_interface_cache::watching() const
+{
+	return impl_->watching();
+}
+
+}
@@ -0,0 +1,243 @@
+#include "libfilezilla/path_builder.hpp"
+
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cwchar>
+#include <limits>
+
+#include <string.h>
+
+namespace fz {
+
+namespace {
+#ifdef FZ_WINDOWS
+path_builder::value_type const local_separator = '\\';
+#else
+path_builder::value_type const local_separator = '/';
+#endif
+
+template<typename Char>
+bool is_separator(Char c)
+{
+#ifdef FZ_WINDOWS
+	return c == '\\' || c == '/';
+#else
+	return c == '/';
+#endif
+}
+}
+
+path_builder::path_builder(native_string_view const& path)
+{
+	append(path);
+}
+
+path_builder::path_builder(path_builder const& op)
+{
+	append(op.view());
+}
+
+path_builder& path_builder::operator=(path_builder const& op)
+{
+	if (this != &op) {
+		clear();
+		append(op.view());
+	}
+	return *this;
+}
+
+path_builder::path_builder(path_builder && op) noexcept
+{
+	*this = std::move(op);
+}
+
+path_builder& path_builder::operator=(path_builder && op) noexcept
+{
+	if (this != &op) {
+		if (op.data_ == op.inline_) {
+			clear();
+			// Fits, as the inline storage is the smallest there is
+			memcpy(data_, op.data_, (op.size_ + 1) * sizeof(value_type));
+			size_ = op.size_;
+		}
+		else {
+			if (data_ != inline_) {
+				delete [] data_;
+			}
+			data_ = op.data_;
+			size_ = op.size_;
+			capacity_ = op.capacity_;
+			op.data_ = op.inline_;
+			op.capacity_ = inline_capacity;
+		}
+		op.clear();
+	}
+	return *this;
+}
+
+path_builder::~path_builder()
+{
+	if (data_ != inline_) {
+		delete [] data_;
+	}
+}
+
+path_builder::value_type* path_builder::grow(size_t n)
+{
+	if (capacity_ - size_ <= n) {
+		if (n >= std::numeric_limits<size_t>::max() / sizeof(value_type) / 2 - size_) {
+			std::abort();
+		}
+		size_t const capacity = std::max(capacity_ * 2, size_ + n + 1);
+		value_type* d = new value_type[capacity];
+		memcpy(d, data_, (size_ + 1) * sizeof(value_type));
+		if (data_ != inline_) {
+			delete [] data_;
+		}
+		data_ = d;
+		capacity_ = capacity;
+	}
+	return data_ + size_;
+}
+
+void path_builder::truncate(size_t size)
+{
+	if (size < size_) {
+		size_ = size;
+		data_[size_] = 0;
+	}
+}
+
+bool path_builder::convert(std::string_view const& s)
+{
+	if (s.empty()) {
+		return true;
+	}
+#ifdef FZ_WINDOWS
+	value_type* out = grow(s.size());
+	size_t i{};
+	for (; i < s.size() && !(s[i] & 0x80); ++i) {
+		out[i] = static_cast<value_type>(s[i]);
+	}
+	size_ += i;
+	if (i < s.size()) {
+		// Same conversion as to_native
+		char const* in = s.data() + i;
+		int const in_len = static_cast<int>(s.size() - i);
+		int const len = MultiByteToWideChar(CP_ACP, MB_ERR_INVALID_CHARS, in, in_len, nullptr, 0);
+		if (len <= 0) {
+			truncate(size_ - i);
+			return false;
+		}
+		out = grow(static_cast<size_t>(len));
+		MultiByteToWideChar(CP_ACP, MB_ERR_INVALID_CHARS, in, in_len, out, len);
+		size_ += static_cast<size_t>(len);
+	}
+#else
+	memcpy(grow(s.size()), s.data(), s.size());
+	size_ += s.size();
+#endif
+	data_[size_] = 0;
+	return true;
+}
+
+bool path_builder::convert(std::wstring_view const& s)
+{
+	if (s.empty()) {
+		return true;
+	}
+#ifdef FZ_WINDOWS
+	memcpy(grow(s.size()), s.data(), s.size() * sizeof(value_type));
+	size_ += s.size();
+#else
+	value_type* out = grow(s.size());
+	size_t i{};
+	for (; i < s.size() && s[i] >= 0 && s[i] < 0x80; ++i) {
+		out[i] = static_cast<value_type>(s[i]);
+	}
+	size_ += i;
+	if (i < s.size()) {
+		// Same conversion as to_native, except that paths cannot contain null characters
+		std::mbstate_t ps{};
+		wchar_t const* in = s.data() + i;
+		size_t const len = (s.find(wchar_t{}, i) == std::wstring_view::npos) ? wcsnrtombs(nullptr, &in, s.size() - i, 0, &ps) : static_cast<size_t>(-1);
+		if (len == static_cast<size_t>(-1)) {
+			truncate(size_ - i);
+			return false;
+		}
+		out = grow(len);
+		in = s.data() + i;
+		ps = std::mbstate_t{};
+		wcsnrtombs(out, &in, s.size() - i, len, &ps);
+		size_ += len;
+	}
+#endif
+	data_[size_] = 0;
+	return true;
+}
+
+bool path_builder::append(std::string_view const& s)
+{
+	return convert(s);
+}
+
+bool path_builder::append(std::wstring_view const& s)
+{
+	return convert(s);
+}
+
+namespace {
+template<typename View>
+View skip_separators(View s)
+{
+	size_t i{};
+	while (i < s.size() && is_separator(s[i])) {
+		++i;
+	}
+	return s.substr(i);
+}
+}
+
+bool path_builder::join(std::string_view const& component)
+{
+	if (empty()) {
+		return convert(component);
+	}
+
+	size_t const old = size_;
+	auto const c = skip_separators(component);
+	if (!c.empty() && !is_separator(data_[size_ - 1])) {
+		*grow(1) = local_separator;
+		++size_;
+	}
+	if (!convert(c)) {
+		truncate(old);
+		return false;
+	}
+	return true;
+}
+
+bool path_builder::join(std::wstring_view const& component)
+{
+	if (empty()) {
+		return convert(component);
+	}
+
+	size_t const old = size_;
+	auto const c = skip_separators(component);
+	if (!c.empty() && !is_separator(data_[size_ - 1])) {
+		*grow(1) = local_separator;
+		++size_;
+	}
+	if (!convert(c)) {
+		truncate(old);
+		return false;
+	}
+	return true;
+}
+
+}
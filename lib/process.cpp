@@ -1,6 +1,8 @@
 #include "libfilezilla/event_handler.hpp"
 #include "libfilezilla/impersonation.hpp"
 #include "libfilezilla/process.hpp"
+#include "libfilezilla/reactor.hpp"
+#include "libfilezilla/socket.hpp"
 #include "libfilezilla/thread_pool.hpp"
 #include "libfilezilla/util.hpp"
 
@@ -381,7 +383,7 @@ public:
 			return false;
 		};
 
-		handler_->event_loop_.filter_events(process_event_filter);
+		handler_->get_event_loop().filter_events(process_event_filter);
 	}
 
 	template<typename Out, typename In>
@@ -574,6 +576,46 @@ public:
 		}
 	}
 
+	// There is no vectored I/O on pipes, the buffers are handled one at a time
+	// until a transfer falls short.
+	rwresult readv(socket_iovec const* buffers, size_t count)
+	{
+		size_t total{};
+		for (size_t i = 0; i < count; ++i) {
+			if (!buffers[i].size) {
+				continue;
+			}
+			rwresult r = read(buffers[i].data, buffers[i].size);
+			if (!r) {
+				return total ? rwresult{total} : r;
+			}
+			total += r.value_;
+			if (r.value_ < buffers[i].size) {
+				break;
+			}
+		}
+		return rwresult{total};
+	}
+
+	rwresult writev(socket_const_iovec const* buffers, size_t count)
+	{
+		size_t total{};
+		for (size_t i = 0; i < count; ++i) {
+			if (!buffers[i].size) {
+				continue;
+			}
+			rwresult r = write(buffers[i].data, buffers[i].size);
+			if (!r) {
+				return total ? rwresult{total} : r;
+			}
+			total += r.value_;
+			if (r.value_ < buffers[i].size) {
+				break;
+			}
+		}
+		return rwresult{total};
+	}
+
 	HANDLE handle() const { return process_handle_; }
 
 private:
@@ -602,14 +644,17 @@ private:
 
 #else
 
+#include "libfilezilla/buffer.hpp"
 #include "libfilezilla/glue/unix.hpp"
 #include "libfilezilla/mutex.hpp"
+#include "reactor_impl.hpp"
 #include "unix/poller.hpp"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <string.h>
 #include <unistd.h>
@@ -618,6 +663,14 @@ private:
 #include <memory>
 #include <vector>
 
+// glibc implements posix_spawn using vfork semantics, avoiding the cost of copying the page
+// tables of large processes. Since 2.29, dup2 file actions with identical descriptors clear
+// FD_CLOEXEC, which is needed to pass the extra descriptors.
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define FZ_USE_POSIX_SPAWN 1
+#include <spawn.h>
+#endif
+
 #if FZ_MAC
 #include "libfilezilla/local_filesys.hpp"
 
@@ -697,6 +750,99 @@ void get_argv(native_string const& cmd, std::vector<native_string>::const_iterat
 
 std::atomic<unsigned int> forkblocks_{};
 mutex forkblock_mtx_;
+
+#if FZ_USE_POSIX_SPAWN
+// Returns the pid of the child, or -1 on failure.
+// If redirect is given, it holds the descriptors for stdin, stdout and stderr.
+pid_t spawn_without_fork(native_string const& cmd, std::vector<char*> const& argV, int const* redirect, std::vector<int> const& extra_fds)
+{
+	posix_spawn_file_actions_t actions;
+	if (posix_spawn_file_actions_init(&actions)) {
+		return -1;
+	}
+
+	bool ok = true;
+	if (redirect) {
+		for (int i = 0; i < 3; ++i) {
+			ok &= !posix_spawn_file_actions_adddup2(&actions, redirect[i], i);
+		}
+	}
+	for (int fd : extra_fds) {
+		// Clears FD_CLOEXEC
+		ok &= !posix_spawn_file_actions_adddup2(&actions, fd, fd);
+	}
+
+	pid_t pid = -1;
+	if (ok) {
+		// Still needed so that no descriptor without FD_CLOEXEC leaks into the child, but
+		// as posix_spawn only returns after the exec, it is held briefly.
+		scoped_lock fbl(forkblock_mtx_);
+		if (posix_spawn(&pid, cmd.c_str(), &actions, nullptr, argV.data(), environ)) {
+			pid = -1;
+		}
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	return pid;
+}
+#endif
+
+// Further buffers are left for the next call
+size_t const max_iovecs = 64;
+
+template<typename Buffer>
+size_t to_iovecs(Buffer const* buffers, size_t count, iovec * out)
+{
+	if (count > max_iovecs) {
+		count = max_iovecs;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		out[i].iov_base = const_cast<void*>(static_cast<void const*>(buffers[i].data));
+		out[i].iov_len = buffers[i].size;
+	}
+	return count;
+}
+
+#ifdef __linux__
+bool poll_now(int fd, short events)
+{
+	pollfd pfd{};
+	pfd.fd = fd;
+	pfd.events = events;
+	int r;
+	do {
+		r = poll(&pfd, 1, 0);
+	} while (r == -1 && errno == EINTR);
+	return r > 0;
+}
+
+// Splicing into a socket or pipe without reader raises SIGPIPE. Block it in this
+// thread for the duration of the call and discard it if we caused it.
+ssize_t splice_nosignal(int in_fd, int out_fd, size_t len, unsigned int flags)
+{
+	sigset_t pipe_set;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+
+	sigset_t old_set;
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+	bool const was_blocked = sigismember(&old_set, SIGPIPE) == 1;
+
+	ssize_t r = splice(in_fd, nullptr, out_fd, nullptr, len, flags);
+
+	if (!was_blocked) {
+		int const error = errno;
+		if (r == -1 && error == EPIPE) {
+			timespec const ts{};
+			sigtimedwait(&pipe_set, nullptr, &ts);
+		}
+		pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+		errno = error;
+	}
+
+	return r;
+}
+#endif
 }
 
 class process::impl
@@ -713,11 +859,144 @@ public:
 	{
 	}
 
+	impl(process & p, reactor & r, event_handler & handler)
+		: process_(p)
+		, pool_(&r.pool())
+		, handler_(&handler)
+		, reactor_(&r)
+	{
+	}
+
 	~impl()
 	{
 		kill();
 	}
 
+	// Registered with a reactor shard, one for each pipe. Gets deleted by the
+	// shard, so it can outlive the process if an event is still being delivered.
+	class pipe_client final : public reactor_client
+	{
+	public:
+		pipe_client(impl & i, process_event_flag flag)
+			: impl_(&i)
+			, flag_(flag)
+		{}
+
+		virtual void on_reactor_event(int revents) override
+		{
+			scoped_lock l(mutex_);
+			if (impl_) {
+				impl_->on_pipe_event(flag_, revents);
+			}
+		}
+
+		// Once this returns, the process is no longer accessed
+		void detach()
+		{
+			scoped_lock l(mutex_);
+			impl_ = nullptr;
+		}
+
+	private:
+		mutex mutex_{false};
+		impl * impl_;
+		process_event_flag const flag_;
+	};
+
+	void on_pipe_event(process_event_flag flag, int revents)
+	{
+		scoped_lock l(mutex_);
+		if (flag == process_event_flag::read) {
+			if (waiting_read_ && (revents & (POLLIN|POLLHUP|POLLERR))) {
+				waiting_read_ = false;
+				handler_->send_event<process_event>(&process_, process_event_flag::read);
+			}
+		}
+		else if (waiting_write_ && (revents & (POLLOUT|POLLHUP|POLLERR))) {
+			waiting_write_ = false;
+			handler_->send_event<process_event>(&process_, process_event_flag::write);
+		}
+	}
+
+	// Only call while locked, after the pipes have been set up.
+	bool register_pipes(scoped_lock &)
+	{
+		if (out_.read_ != -1) {
+			read_client_ = new pipe_client(*this, process_event_flag::read);
+			if (shard_->add(*read_client_, out_.read_, waiting_read_ ? POLLIN : 0)) {
+				return false;
+			}
+		}
+		if (in_.write_ != -1) {
+			// Only hangups get reported until armed
+			write_client_ = new pipe_client(*this, process_event_flag::write);
+			if (shard_->add(*write_client_, in_.write_, waiting_write_ ? POLLOUT : 0)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Must not be called while locked
+	void unregister_pipes()
+	{
+		auto unregister = [this](pipe_client *& c, int fd) {
+			if (c) {
+				shard_->remove(fd);
+				c->detach();
+				shard_->retire(c);
+				c = nullptr;
+			}
+		};
+		unregister(read_client_, out_.read_);
+		unregister(write_client_, in_.write_);
+		shard_ = nullptr;
+	}
+
+	// Only call while locked, after the child has been spawned
+	void start_waiting(scoped_lock & l)
+	{
+		if (!shard_ || register_pipes(l)) {
+			return;
+		}
+
+		// Fall back to a thread
+		l.unlock();
+		unregister_pipes();
+		l.lock();
+		start_thread(l);
+	}
+
+	// Only call while locked
+	bool start_thread(scoped_lock &)
+	{
+		if (poller_.init() != 0) {
+			return false;
+		}
+		task_ = pool_->spawn([this]() { thread_entry(); });
+		return static_cast<bool>(task_);
+	}
+
+	// Only call while locked. Waits for the pipe to become ready again.
+	void wait_for(process_event_flag flag, scoped_lock & l)
+	{
+		if (flag == process_event_flag::read) {
+			waiting_read_ = true;
+			if (read_client_) {
+				shard_->arm(*read_client_, out_.read_, POLLIN);
+				return;
+			}
+		}
+		else {
+			waiting_write_ = true;
+			if (write_client_) {
+				shard_->arm(*write_client_, in_.write_, POLLOUT);
+				return;
+			}
+		}
+		poller_.interrupt(l);
+	}
+
 	impl(impl const&) = delete;
 	impl& operator=(impl const&) = delete;
 
@@ -794,12 +1073,11 @@ public:
 
 		scoped_lock l(mutex_);
 		if (handler_) {
-			if (poller_.init() != 0) {
-				kill();
-				return false;
+			// Without multiplexing or redirection, fall back to a thread
+			if (reactor_ && redirect_mode == io_redirection::redirect) {
+				shard_ = reactor_->impl_->get_shard();
 			}
-			task_ = pool_->spawn([this]() { thread_entry(); });
-			if (!task_) {
+			if (!shard_ && !start_thread(l)) {
 				kill();
 				return false;
 			}
@@ -808,6 +1086,22 @@ public:
 			waiting_read_ = false;
 		}
 
+#if FZ_USE_POSIX_SPAWN
+		if (!it || !*it) {
+			int const redirect[3]{in_.read_, out_.write_, err_.write_};
+			pid_t const pid = spawn_without_fork(cmd, argV, (redirect_mode != io_redirection::none) ? redirect : nullptr, extra_fds);
+			if (pid < 0) {
+				kill();
+				return false;
+			}
+			pid_ = pid;
+			finish_spawn(redirect_mode);
+			start_waiting(l);
+			return true;
+		}
+#endif
+
+		// Impersonation needs to happen in the child
 		scoped_lock fbl(forkblock_mtx_);
 		pid_t pid = fork();
 		if (pid < 0) {
@@ -863,30 +1157,37 @@ public:
 
 			fbl.unlock();
 
-			// Close unneeded descriptors
-			if (redirect_mode != io_redirection::none) {
-				reset_fd(in_.read_);
-				reset_fd(out_.write_);
-				reset_fd(err_.write_);
-				if (redirect_mode == io_redirection::closeall) {
-					reset_fd(in_.write_);
-					reset_fd(out_.read_);
-					reset_fd(err_.read_);
-				}
-				else {
-					if (handler_) {
-						set_nonblocking(in_.write_);
-						set_nonblocking(out_.read_);
-						set_nonblocking(err_.read_);
+			finish_spawn(redirect_mode);
+			start_waiting(l);
+		}
 
-						waiting_read_ = true;
-						waiting_write_ = false;
-					}
+		return true;
+	}
+
+	// In the parent after the child has been created
+	void finish_spawn(io_redirection redirect_mode)
+	{
+		// Close unneeded descriptors
+		if (redirect_mode != io_redirection::none) {
+			reset_fd(in_.read_);
+			reset_fd(out_.write_);
+			reset_fd(err_.write_);
+			if (redirect_mode == io_redirection::closeall) {
+				reset_fd(in_.write_);
+				reset_fd(out_.read_);
+				reset_fd(err_.read_);
+			}
+			else {
+				if (handler_) {
+					set_nonblocking(in_.write_);
+					set_nonblocking(out_.read_);
+					set_nonblocking(err_.read_);
+
+					waiting_read_ = true;
+					waiting_write_ = false;
 				}
 			}
 		}
-
-		return true;
 	}
 
 	void remove_pending_events()
@@ -905,7 +1206,7 @@ public:
 			return false;
 		};
 
-		handler_->event_loop_.filter_events(process_event_filter);
+		handler_->get_event_loop().filter_events(process_event_filter);
 	}
 
 	bool do_waitpid(bool wait = false)
@@ -964,6 +1265,9 @@ public:
 	bool kill(bool force = true, duration const& timeout = {})
 	{
 		if (handler_) {
+			if (shard_) {
+				unregister_pipes();
+			}
 			{
 				scoped_lock l(mutex_);
 				quit_ = true;
@@ -1014,19 +1318,30 @@ public:
 			if (err == EAGAIN && !handler_) {
 				continue;
 			}
-			switch (err) {
-			case EAGAIN:
-				{
-					scoped_lock l(mutex_);
-					waiting_read_ = true;
-					poller_.interrupt(l);
-				}
-				return rwresult{rwresult::wouldblock, err};
-			case EIO:
-				return rwresult{rwresult::other, err};
-			default:
-				return rwresult{rwresult::invalid, err};
+			return read_error(err);
+		}
+	}
+
+	rwresult readv(socket_iovec const* buffers, size_t count)
+	{
+#if DEBUG_SOCKETEVENTS
+		assert(!waiting_read_);
+#endif
+		iovec bufs[max_iovecs];
+		size_t const n = to_iovecs(buffers, count, bufs);
+		while (true) {
+			ssize_t r = ::readv(out_.read_, bufs, static_cast<int>(n));
+			int const err = errno;
+			if (r >= 0) {
+				return rwresult{static_cast<size_t>(r)};
 			}
+			if (err == EINTR) {
+				continue;
+			}
+			if (err == EAGAIN && !handler_) {
+				continue;
+			}
+			return read_error(err);
 		}
 	}
 
@@ -1046,25 +1361,143 @@ public:
 			if (errno == EAGAIN && !handler_) {
 				continue;
 			}
+			return write_error(errno);
+		}
+	}
+
+	rwresult writev(socket_const_iovec const* buffers, size_t count)
+	{
+#if DEBUG_SOCKETEVENTS
+		assert(!waiting_write_);
+#endif
+		iovec bufs[max_iovecs];
+		size_t const n = to_iovecs(buffers, count, bufs);
+		while (true) {
+			ssize_t written = ::writev(in_.write_, bufs, static_cast<int>(n));
+			if (written >= 0) {
+				return rwresult{static_cast<size_t>(written)};
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN && !handler_) {
+				continue;
+			}
+			return write_error(errno);
+		}
+	}
+
+	rwresult splice_to(int fd, size_t len)
+	{
+#ifdef __linux__
+#if DEBUG_SOCKETEVENTS
+		assert(!waiting_read_);
+#endif
+		// Without a handler, only the descriptor may be non-blocking
+		unsigned int const flags = SPLICE_F_MOVE | (handler_ ? SPLICE_F_NONBLOCK : 0);
+		while (true) {
+			ssize_t r = splice_nosignal(out_.read_, fd, len, flags);
 			int const err = errno;
-			switch (err) {
-			case EAGAIN:
-				{
-					scoped_lock l(mutex_);
-					waiting_read_ = true;
-					poller_.interrupt(l);
-				}
-				return rwresult{rwresult::wouldblock, err};
-			case EIO:
-				return rwresult{rwresult::other, err};
-			case ENOSPC:
-				return rwresult{rwresult::nospace, err};
-			default:
-				return rwresult{rwresult::invalid, err};
+			if (r >= 0) {
+				return rwresult{static_cast<size_t>(r)};
+			}
+			if (err == EINTR) {
+				continue;
 			}
+			if (err == EAGAIN && handler_ && !poll_now(out_.read_, POLLIN)) {
+				return read_error(err);
+			}
+			return splice_error(err);
+		}
+#else
+		(void)fd;
+		(void)len;
+		return rwresult{rwresult::invalid, ENOSYS};
+#endif
+	}
+
+	rwresult splice_from(int fd, size_t len)
+	{
+#ifdef __linux__
+#if DEBUG_SOCKETEVENTS
+		assert(!waiting_write_);
+#endif
+		unsigned int const flags = SPLICE_F_MOVE | (handler_ ? SPLICE_F_NONBLOCK : 0);
+		while (true) {
+			ssize_t r = splice_nosignal(fd, in_.write_, len, flags);
+			int const err = errno;
+			if (r >= 0) {
+				return rwresult{static_cast<size_t>(r)};
+			}
+			if (err == EINTR) {
+				continue;
+			}
+			if (err == EAGAIN && handler_ && !poll_now(in_.write_, POLLOUT)) {
+				return write_error(err);
+			}
+			return splice_error(err);
+		}
+#else
+		(void)fd;
+		(void)len;
+		return rwresult{rwresult::invalid, ENOSYS};
+#endif
+	}
+
+private:
+	rwresult read_error(int err)
+	{
+		switch (err) {
+		case EAGAIN:
+			{
+				scoped_lock l(mutex_);
+				wait_for(process_event_flag::read, l);
+			}
+			return rwresult{rwresult::wouldblock, err};
+		case EIO:
+			return rwresult{rwresult::other, err};
+		default:
+			return rwresult{rwresult::invalid, err};
+		}
+	}
+
+	rwresult write_error(int err)
+	{
+		switch (err) {
+		case EAGAIN:
+			{
+				scoped_lock l(mutex_);
+				wait_for(process_event_flag::write, l);
+			}
+			return rwresult{rwresult::wouldblock, err};
+		case EIO:
+			return rwresult{rwresult::other, err};
+		case ENOSPC:
+			return rwresult{rwresult::nospace, err};
+		default:
+			return rwresult{rwresult::invalid, err};
+		}
+	}
+
+	// The other descriptor is blocking, the caller needs to wait for it.
+	static rwresult splice_error(int err)
+	{
+		switch (err) {
+		case EAGAIN:
+			return rwresult{rwresult::wouldblock, err};
+		case ENOSPC:
+			return rwresult{rwresult::nospace, err};
+		case EINVAL:
+		case EBADF:
+		case ESPIPE:
+			return rwresult{rwresult::invalid, err};
+		default:
+			return rwresult{rwresult::other, err};
 		}
 	}
 
+public:
+
 	process & process_;
 
 	thread_pool * pool_{};
@@ -1075,6 +1508,12 @@ public:
 
 	poller poller_;
 
+	// Set if the pipes are waited on by a reactor instead of a thread
+	reactor * reactor_{};
+	reactor_shard * shard_{};
+	pipe_client * read_client_{};
+	pipe_client * write_client_{};
+
 	pipe in_;
 	pipe out_;
 	pipe err_;
@@ -1098,6 +1537,15 @@ process::process(thread_pool & pool, event_handler & handler)
 {
 }
 
+process::process(reactor & r, event_handler & handler)
+#ifdef FZ_WINDOWS
+	: impl_(new impl(*this, r.pool(), handler))
+#else
+	: impl_(new impl(*this, r, handler))
+#endif
+{
+}
+
 process::~process()
 {
 	delete impl_;
@@ -1166,6 +1614,40 @@ rwresult process::write(void const* buffer, size_t len)
 	return impl_ ? impl_->write(buffer, len) : rwresult{rwresult::invalid};
 }
 
+rwresult process::read(buffer & buf, size_t max)
+{
+	if (!impl_) {
+		return rwresult{rwresult::invalid, 0};
+	}
+	rwresult r = impl_->read(buf.get(max), max);
+	if (r) {
+		buf.add(r.value_);
+	}
+	return r;
+}
+
+rwresult process::readv(socket_iovec const* buffers, size_t count)
+{
+	return impl_ ? impl_->readv(buffers, count) : rwresult{rwresult::invalid, 0};
+}
+
+rwresult process::writev(socket_const_iovec const* buffers, size_t count)
+{
+	return impl_ ? impl_->writev(buffers, count) : rwresult{rwresult::invalid, 0};
+}
+
+#ifndef FZ_WINDOWS
+rwresult process::splice_to(int fd, size_t len)
+{
+	return impl_ ? impl_->splice_to(fd, len) : rwresult{rwresult::invalid, 0};
+}
+
+rwresult process::splice_from(int fd, size_t len)
+{
+	return impl_ ? impl_->splice_from(fd, len) : rwresult{rwresult::invalid, 0};
+}
+#endif
+
 #if FZ_WINDOWS
 HANDLE process::handle() const
 {
@@ -0,0 +1,534 @@
+#include "libfilezilla/process_pool.hpp"
+#include "libfilezilla/buffer.hpp"
+#include "libfilezilla/event_handler.hpp"
+#include "libfilezilla/process.hpp"
+
+#include <map>
+#include <unordered_map>
+
+#include <errno.h>
+
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#else
+#include <unistd.h>
+#endif
+
+namespace fz {
+
+namespace {
+size_t const header_size = 12;
+
+// Writes are split so that the size fits into the process API
+size_t const max_chunk_size = 64 * 1024;
+
+void append_header(buffer & buf, uint64_t id, uint32_t size)
+{
+	unsigned char* p = buf.get(header_size);
+	for (size_t i = 0; i < 8; ++i) {
+		p[i] = static_cast<unsigned char>(id >> (56 - 8 * i));
+	}
+	for (size_t i = 0; i < 4; ++i) {
+		p[8 + i] = static_cast<unsigned char>(size >> (24 - 8 * i));
+	}
+	buf.add(header_size);
+}
+
+void parse_header(unsigned char const* p, uint64_t & id, uint32_t & size)
+{
+	id = 0;
+	for (size_t i = 0; i < 8; ++i) {
+		id = (id << 8) | p[i];
+	}
+	size = 0;
+	for (size_t i = 8; i < 12; ++i) {
+		size = (size << 8) | p[i];
+	}
+}
+
+// Null tokens, i.e. no impersonation, first
+struct token_less final
+{
+	bool operator()(std::shared_ptr<impersonation_token const> const& lhs, std::shared_ptr<impersonation_token const> const& rhs) const
+	{
+		if (!lhs || !rhs) {
+			return !lhs && rhs;
+		}
+		return *lhs < *rhs;
+	}
+};
+}
+
+class process_pool_impl final : public event_handler
+{
+public:
+	process_pool_impl(event_loop & loop, thread_pool & pool, native_string const& cmd, std::vector<native_string> const& args, process_pool_options const& options);
+	virtual ~process_pool_impl();
+
+	uint64_t submit(std::shared_ptr<impersonation_token const> const& token, std::string_view const& request, event_handler & handler);
+	bool prewarm(std::shared_ptr<impersonation_token const> const& token);
+	void cancel(event_handler & handler);
+	size_t worker_count() const;
+
+private:
+	struct worker;
+	typedef std::vector<std::unique_ptr<worker>> worker_list;
+
+	struct worker final
+	{
+		worker(thread_pool & pool, event_handler & handler)
+			: process_(pool, handler)
+		{}
+
+		process process_;
+		worker_list * group_{};
+
+		buffer send_;
+		buffer recv_;
+
+		// Null handlers for cancelled requests
+		std::unordered_map<uint64_t, event_handler*> pending_;
+
+		monotonic_clock idle_since_;
+		bool write_blocked_{};
+		bool quitting_{};
+	};
+
+	virtual void operator()(event_base const& ev) override;
+	void on_process_event(process * p, process_event_flag flag);
+	void on_timer(timer_id);
+
+	worker* spawn(std::shared_ptr<impersonation_token const> const& token, worker_list & group);
+
+	// These may remove the worker if it has quit
+	void flush(worker & w);
+	void read(worker & w);
+
+	void remove(worker & w);
+
+	mutable mutex mtx_{false};
+
+	thread_pool & pool_;
+	native_string const cmd_;
+	std::vector<native_string> const args_;
+	process_pool_options const options_;
+
+	std::map<std::shared_ptr<impersonation_token const>, worker_list, token_less> groups_;
+	std::unordered_map<process*, worker*> workers_;
+
+	uint64_t next_id_{1};
+};
+
+process_pool_impl::process_pool_impl(event_loop & loop, thread_pool & pool, native_string const& cmd, std::vector<native_string> const& args, process_pool_options const& options)
+	: event_handler(loop)
+	, pool_(pool)
+	, cmd_(cmd)
+	, args_(args)
+	, options_(options)
+{
+	if (options_.idle_timeout > duration()) {
+		// The sweep need not be precise
+		add_timer(options_.idle_timeout / 2, false, options_.idle_timeout / 4);
+	}
+}
+
+process_pool_impl::~process_pool_impl()
+{
+	remove_handler();
+
+	scoped_lock l(mtx_);
+	workers_.clear();
+
+	// Kills the processes
+	groups_.clear();
+}
+
+process_pool_impl::worker* process_pool_impl::spawn(std::shared_ptr<impersonation_token const> const& token, worker_list & group)
+{
+	auto w = std::make_unique<worker>(pool_, *this);
+
+	bool spawned{};
+	if (token) {
+#if FZ_WINDOWS || FZ_UNIX
+		spawned = w->process_.spawn(*token, cmd_, args_);
+#endif
+	}
+	else {
+		spawned = w->process_.spawn(cmd_, args_);
+	}
+	if (!spawned) {
+		return nullptr;
+	}
+
+	w->group_ = &group;
+	w->idle_since_ = monotonic_clock::now();
+	workers_[&w->process_] = w.get();
+	group.emplace_back(std::move(w));
+	return group.back().get();
+}
+
+uint64_t process_pool_impl::submit(std::shared_ptr<impersonation_token const> const& token, std::string_view const& request, event_handler & handler)
+{
+	if (request.size() > 0xffffffffu) {
+		return 0;
+	}
+
+	scoped_lock l(mtx_);
+
+	auto & group = groups_[token];
+
+	worker* best{};
+	size_t live{};
+	for (auto & w : group) {
+		if (!w->quitting_) {
+			++live;
+			if (!best || w->pending_.size() < best->pending_.size()) {
+				best = w.get();
+			}
+		}
+	}
+	if (!best || (best->pending_.size() >= options_.max_pending && live < options_.max_workers)) {
+		if (auto w = spawn(token, group)) {
+			best = w;
+		}
+	}
+	if (!best) {
+		if (group.empty()) {
+			groups_.erase(token);
+		}
+		return 0;
+	}
+
+	uint64_t const id = next_id_++;
+	best->pending_.emplace(id, &handler);
+	append_header(best->send_, id, static_cast<uint32_t>(request.size()));
+	best->send_.append(request);
+	if (!best->write_blocked_) {
+		flush(*best);
+	}
+
+	return id;
+}
+
+bool process_pool_impl::prewarm(std::shared_ptr<impersonation_token const> const& token)
+{
+	scoped_lock l(mtx_);
+
+	auto & group = groups_[token];
+
+	size_t live{};
+	for (auto & w : group) {
+		if (!w->quitting_) {
+			++live;
+		}
+	}
+	for (; live < options_.min_workers; ++live) {
+		if (!spawn(token, group)) {
+			if (group.empty()) {
+				groups_.erase(token);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+void process_pool_impl::cancel(event_handler & handler)
+{
+	scoped_lock l(mtx_);
+	for (auto & it : workers_) {
+		for (auto & pending : it.second->pending_) {
+			if (pending.second == &handler) {
+				pending.second = nullptr;
+			}
+		}
+	}
+}
+
+size_t process_pool_impl::worker_count() const
+{
+	scoped_lock l(mtx_);
+	return workers_.size();
+}
+
+void process_pool_impl::operator()(event_base const& ev)
+{
+	dispatch<process_event, timer_event>(ev, this,
+		&process_pool_impl::on_process_event,
+		&process_pool_impl::on_timer);
+}
+
+void process_pool_impl::on_process_event(process * p, process_event_flag flag)
+{
+	scoped_lock l(mtx_);
+
+	auto it = workers_.find(p);
+	if (it == workers_.end()) {
+		return;
+	}
+
+	auto & w = *it->second;
+	if (flag == process_event_flag::write) {
+		w.write_blocked_ = false;
+		flush(w);
+	}
+	else {
+		read(w);
+	}
+}
+
+void process_pool_impl::on_timer(timer_id)
+{
+	scoped_lock l(mtx_);
+
+	auto const now = monotonic_clock::now();
+	for (auto & group : groups_) {
+		size_t live{};
+		for (auto & w : group.second) {
+			if (!w->quitting_) {
+				++live;
+			}
+		}
+
+		// Collect first, flushing may remove workers from the group
+		std::vector<worker*> idle;
+		for (auto & w : group.second) {
+			if (live <= options_.min_workers) {
+				break;
+			}
+			if (!w->quitting_ && w->pending_.empty() && now - w->idle_since_ >= options_.idle_timeout) {
+				idle.push_back(w.get());
+				--live;
+			}
+		}
+
+		for (auto * w : idle) {
+			// Asks the worker to quit, it gets removed once it has closed its end of the pipes
+			w->quitting_ = true;
+			append_header(w->send_, 0, 0);
+			if (!w->write_blocked_) {
+				flush(*w);
+			}
+		}
+	}
+
+	for (auto it = groups_.begin(); it != groups_.end(); ) {
+		if (it->second.empty()) {
+			it = groups_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+void process_pool_impl::flush(worker & w)
+{
+	while (!w.send_.empty()) {
+		size_t const chunk = w.send_.size() < max_chunk_size ? w.send_.size() : max_chunk_size;
+		rwresult r = w.process_.write(w.send_.get(), chunk);
+		if (!r) {
+			if (r.error_ == rwresult::wouldblock) {
+				w.write_blocked_ = true;
+			}
+			else {
+				remove(w);
+			}
+			return;
+		}
+		w.send_.consume(r.value_);
+	}
+}
+
+void process_pool_impl::read(worker & w)
+{
+	while (true) {
+		rwresult r = w.process_.read(w.recv_, max_chunk_size);
+		if (!r) {
+			if (r.error_ != rwresult::wouldblock) {
+				remove(w);
+			}
+			return;
+		}
+		if (!r.value_) {
+			remove(w);
+			return;
+		}
+
+		while (w.recv_.size() >= header_size) {
+			uint64_t id;
+			uint32_t size;
+			parse_header(w.recv_.get(), id, size);
+			if (size > options_.max_response_size) {
+				remove(w);
+				return;
+			}
+			if (w.recv_.size() < header_size + size) {
+				break;
+			}
+
+			auto it = w.pending_.find(id);
+			if (it != w.pending_.end()) {
+				if (it->second) {
+					it->second->send_event<process_pool_response_event>(id, 0, std::string(reinterpret_cast<char const*>(w.recv_.get() + header_size), size));
+				}
+				w.pending_.erase(it);
+				if (w.pending_.empty()) {
+					w.idle_since_ = monotonic_clock::now();
+				}
+			}
+			w.recv_.consume(header_size + size);
+		}
+	}
+}
+
+void process_pool_impl::remove(worker & w)
+{
+	for (auto const& pending : w.pending_) {
+		if (pending.second) {
+			pending.second->send_event<process_pool_response_event>(pending.first, EPIPE, std::string());
+		}
+	}
+
+	workers_.erase(&w.process_);
+
+	// Destroying the worker kills the process
+	auto & group = *w.group_;
+	for (auto it = group.begin(); it != group.end(); ++it) {
+		if (it->get() == &w) {
+			group.erase(it);
+			break;
+		}
+	}
+}
+
+
+process_pool::process_pool(event_loop & loop, thread_pool & pool, native_string const& cmd, std::vector<native_string> const& args, process_pool_options const& options)
+	: impl_(std::make_unique<process_pool_impl>(loop, pool, cmd, args, options))
+{
+}
+
+process_pool::~process_pool()
+{
+}
+
+uint64_t process_pool::submit(std::shared_ptr<impersonation_token const> const& token, std::string_view const& request, event_handler & handler)
+{
+	return impl_->submit(token, request, handler);
+}
+
+bool process_pool::prewarm(std::shared_ptr<impersonation_token const> const& token)
+{
+	return impl_->prewarm(token);
+}
+
+void process_pool::cancel(event_handler & handler)
+{
+	impl_->cancel(handler);
+}
+
+size_t process_pool::worker_count() const
+{
+	return impl_->worker_count();
+}
+
+
+namespace {
+// Returns the number of octets read, which is less than requested on EOF and errors
+size_t read_stdin(unsigned char * p, size_t size, bool & error)
+{
+	size_t done{};
+	while (done < size) {
+#ifdef FZ_WINDOWS
+		DWORD r{};
+		DWORD const chunk = static_cast<DWORD>(size - done < max_chunk_size ? size - done : max_chunk_size);
+		if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), p + done, chunk, &r, nullptr)) {
+			error = GetLastError() != ERROR_BROKEN_PIPE;
+			break;
+		}
+#else
+		ssize_t r = ::read(STDIN_FILENO, p + done, size - done);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error = true;
+			break;
+		}
+#endif
+		if (!r) {
+			break;
+		}
+		done += static_cast<size_t>(r);
+	}
+	return done;
+}
+
+bool write_stdout(unsigned char const* p, size_t size)
+{
+	while (size) {
+#ifdef FZ_WINDOWS
+		DWORD written{};
+		DWORD const chunk = static_cast<DWORD>(size < max_chunk_size ? size : max_chunk_size);
+		if (!WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), p, chunk, &written, nullptr)) {
+			return false;
+		}
+#else
+		ssize_t written = ::write(STDOUT_FILENO, p, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+#endif
+		p += written;
+		size -= static_cast<size_t>(written);
+	}
+	return true;
+}
+}
+
+bool serve_process_pool_requests(std::function<std::string(std::string_view const& request)> const& handler)
+{
+	std::string request;
+	buffer out;
+	while (true) {
+		unsigned char header[header_size];
+		bool error{};
+		size_t r = read_stdin(header, header_size, error);
+		if (!r && !error) {
+			// The pool has closed the pipe
+			return true;
+		}
+		if (r != header_size) {
+			return false;
+		}
+
+		uint64_t id;
+		uint32_t size;
+		parse_header(header, id, size);
+		if (!id) {
+			return true;
+		}
+
+		request.resize(size);
+		if (size && read_stdin(reinterpret_cast<unsigned char*>(request.data()), size, error) != size) {
+			return false;
+		}
+
+		std::string const response = handler(request);
+		if (response.size() > 0xffffffffu) {
+			return false;
+		}
+
+		out.clear();
+		append_header(out, id, static_cast<uint32_t>(response.size()));
+		out.append(response);
+		if (!write_stdout(out.get(), out.size())) {
+			return false;
+		}
+	}
+}
+
+}
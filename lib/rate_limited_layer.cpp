@@ -8,8 +8,42 @@ bool FZ_PRIVATE_SYMBOL has_pending_event(event_handler * handler, socket_event_s
 }
 #endif
 
+#include <algorithm>
+
 namespace fz {
 
+namespace {
+// Further buffers are left for the next call
+size_t const max_iovecs = 64;
+
+// Returns buffers limited to max octets in total. If buffers need to be truncated,
+// they get copied into tmp. Updates count accordingly.
+template<typename Buffer>
+Buffer const* limit_iovecs(Buffer const* buffers, size_t & count, rate::type max, Buffer * tmp)
+{
+	if (max == rate::unlimited) {
+		return buffers;
+	}
+
+	rate::type total{};
+	for (size_t i = 0; i < count; ++i) {
+		if (buffers[i].size >= max - total) {
+			if (i >= max_iovecs) {
+				count = max_iovecs;
+				return buffers;
+			}
+			std::copy(buffers, buffers + i + 1, tmp);
+			tmp[i].size = static_cast<unsigned int>(max - total);
+			count = i + 1;
+			return tmp;
+		}
+		total += buffers[i].size;
+	}
+
+	return buffers;
+}
+}
+
 rate_limited_layer::rate_limited_layer(event_handler* handler, socket_interface& next_layer, rate_limiter * limiter)
 	: socket_layer(handler, next_layer, true)
 {
@@ -93,6 +127,77 @@ int rate_limited_layer::write(void const* buffer, unsigned int size, int& error)
 	return written;
 }
 
+int rate_limited_layer::readv(socket_iovec const* buffers, size_t count, int& error)
+{
+#if DEBUG_SOCKETEVENTS
+	assert(!has_pending_event(event_handler_, this, socket_event_flag::read));
+	assert(!has_pending_event(event_handler_, &next_layer_, socket_event_flag::read));
+#endif
+
+	auto const max = available(direction::inbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+
+	socket_iovec tmp[max_iovecs];
+	auto const* limited = limit_iovecs(buffers, count, max, tmp);
+
+	int read = next_layer_.readv(limited, count, error);
+	if (read > 0 && max != rate::unlimited) {
+		consume(direction::inbound, read);
+	}
+
+	return read;
+}
+
+int rate_limited_layer::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+#if DEBUG_SOCKETEVENTS
+	assert(!has_pending_event(event_handler_, this, socket_event_flag::write));
+	assert(!has_pending_event(event_handler_, &next_layer_, socket_event_flag::write));
+#endif
+
+	auto const max = available(direction::outbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+
+	socket_const_iovec tmp[max_iovecs];
+	auto const* limited = limit_iovecs(buffers, count, max, tmp);
+
+	int written = next_layer_.writev(limited, count, error);
+	if (written > 0 && max != rate::unlimited) {
+		consume(direction::outbound, written);
+	}
+
+	return written;
+}
+
+int rate_limited_layer::send_file(file & f, uint64_t offset, unsigned int size, int& error)
+{
+#if DEBUG_SOCKETEVENTS
+	assert(!has_pending_event(event_handler_, this, socket_event_flag::write));
+	assert(!has_pending_event(event_handler_, &next_layer_, socket_event_flag::write));
+#endif
+
+	auto const max = available(direction::outbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+	if (max < size) {
+		size = static_cast<unsigned int>(max);
+	}
+
+	int written = next_layer_.send_file(f, offset, size, error);
+	if (written > 0 && max != rate::unlimited) {
+		consume(direction::outbound, written);
+	}
+
+	return written;
+}
 
 void rate_limited_layer::set_event_handler(event_handler* handler, fz::socket_event_flag retrigger_block)
 {
@@ -119,6 +224,11 @@ public:
 		, limiter_(limiter)
 	{}
 
+	virtual ~crll_bucket()
+	{
+		remove_bucket();
+	}
+
 	virtual void wakeup(direction::type d) override
 	{
 		if (!waiting_[d].exchange(false)) {
@@ -140,6 +250,9 @@ public:
 	compound_rate_limited_layer & parent_;
 	rate_limiter const& limiter_;
 
+	// Set if the layer keeps the limiter alive
+	std::shared_ptr<rate_limiter> owned_;
+
 	rate::type max_{};
 
 	std::atomic<bool> waiting_[2]{};
@@ -175,6 +288,20 @@ void compound_rate_limited_layer::add_limiter(rate_limiter* limiter)
 	limiter->add(buckets_.back().get());
 }
 
+void compound_rate_limited_layer::add_limiter(std::shared_ptr<rate_limiter> const& limiter)
+{
+	if (!limiter) {
+		return;
+	}
+
+	add_limiter(limiter.get());
+	for (auto & b : buckets_) {
+		if (&b->limiter_ == limiter.get()) {
+			b->owned_ = limiter;
+		}
+	}
+}
+
 void compound_rate_limited_layer::remove_limiter(rate_limiter* limiter)
 {
 	for (auto & b : buckets_) {
@@ -190,23 +317,42 @@ void compound_rate_limited_layer::remove_limiter(rate_limiter* limiter)
 	}
 }
 
-int compound_rate_limited_layer::read(void* buffer, unsigned int size, int& error)
+rate::type compound_rate_limited_layer::available(direction::type d)
 {
 	rate::type max = rate::unlimited;
 	for (auto & b : buckets_) {
-		b->waiting_[direction::inbound] = true;
-		b->max_ = b->available(direction::inbound);
+		b->waiting_[d] = true;
+		b->max_ = b->available(d);
 		if (!b->max_) {
-			error = EAGAIN;
-			return -1;
+			return 0;
 		}
-		b->waiting_[direction::inbound] = false;
+		b->waiting_[d] = false;
 
 		if (b->max_ < max) {
 			max = b->max_;
 		}
 	}
 
+	return max;
+}
+
+void compound_rate_limited_layer::consume(direction::type d, rate::type amount)
+{
+	for (auto & b : buckets_) {
+		if (b->max_ != rate::unlimited) {
+			b->consume(d, amount);
+		}
+	}
+}
+
+int compound_rate_limited_layer::read(void* buffer, unsigned int size, int& error)
+{
+	rate::type const max = available(direction::inbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+
 	static_assert(sizeof(size) <= sizeof(max));
 	if (max < static_cast<std::decay_t<decltype(max)>>(size)) {
 		size = static_cast<unsigned int>(max);
@@ -214,11 +360,7 @@ int compound_rate_limited_layer::read(void* buffer, unsigned int size, int& erro
 
 	int read = next_layer_.read(buffer, size, error);
 	if (read > 0) {
-		for (auto & b : buckets_) {
-			if (b->max_ != rate::unlimited) {
-				b->consume(direction::inbound, read);
-			}
-		}
+		consume(direction::inbound, read);
 	}
 
 	return read;
@@ -227,19 +369,10 @@ int compound_rate_limited_layer::read(void* buffer, unsigned int size, int& erro
 
 int compound_rate_limited_layer::write(void const* buffer, unsigned int size, int& error)
 {
-	rate::type max = rate::unlimited;
-	for (auto & b : buckets_) {
-		b->waiting_[direction::outbound] = true;
-		b->max_ = b->available(direction::outbound);
-		if (!b->max_) {
-			error = EAGAIN;
-			return -1;
-		}
-		b->waiting_[direction::outbound] = false;
-
-		if (b->max_ < max) {
-			max = b->max_;
-		}
+	rate::type const max = available(direction::outbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
 	}
 
 	static_assert(sizeof(size) <= sizeof(max));
@@ -249,11 +382,64 @@ int compound_rate_limited_layer::write(void const* buffer, unsigned int size, in
 
 	int written = next_layer_.write(buffer, size, error);
 	if (written > 0) {
-		for (auto & b : buckets_) {
-			if (b->max_ != rate::unlimited) {
-				b->consume(direction::outbound, written);
-			}
-		}
+		consume(direction::outbound, written);
+	}
+
+	return written;
+}
+
+int compound_rate_limited_layer::readv(socket_iovec const* buffers, size_t count, int& error)
+{
+	rate::type const max = available(direction::inbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+
+	socket_iovec tmp[max_iovecs];
+	auto const* limited = limit_iovecs(buffers, count, max, tmp);
+
+	int read = next_layer_.readv(limited, count, error);
+	if (read > 0) {
+		consume(direction::inbound, read);
+	}
+
+	return read;
+}
+
+int compound_rate_limited_layer::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+	rate::type const max = available(direction::outbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+
+	socket_const_iovec tmp[max_iovecs];
+	auto const* limited = limit_iovecs(buffers, count, max, tmp);
+
+	int written = next_layer_.writev(limited, count, error);
+	if (written > 0) {
+		consume(direction::outbound, written);
+	}
+
+	return written;
+}
+
+int compound_rate_limited_layer::send_file(file & f, uint64_t offset, unsigned int size, int& error)
+{
+	rate::type const max = available(direction::outbound);
+	if (!max) {
+		error = EAGAIN;
+		return -1;
+	}
+	if (max < size) {
+		size = static_cast<unsigned int>(max);
+	}
+
+	int written = next_layer_.send_file(f, offset, size, error);
+	if (written > 0) {
+		consume(direction::outbound, written);
 	}
 
 	return written;
@@ -275,4 +461,15 @@ void compound_rate_limited_layer::set_event_handler(event_handler* handler, fz::
 	socket_layer::set_event_handler(handler, retrigger_block);
 }
 
+void compound_rate_limited_layer::get_memory_usage(std::vector<socket_memory_usage> & usage) const
+{
+	socket_memory_usage u;
+	u.name_ = "compound_rate_limited_layer";
+	u.object_size_ = sizeof(compound_rate_limited_layer);
+	u.heap_size_ = buckets_.capacity() * sizeof(std::unique_ptr<crll_bucket>) + buckets_.size() * sizeof(crll_bucket);
+	usage.push_back(u);
+
+	next_layer_.get_memory_usage(usage);
+}
+
 }
@@ -1,17 +1,21 @@
 #include "libfilezilla/rate_limiter.hpp"
 #include "libfilezilla/util.hpp"
 
+#include <algorithm>
 #include <array>
+#include <limits>
 
 #include <assert.h>
 
 /*
   Rate limiting machinery based on token buckets with hierarchical limits.
   - Hierarchical: Limits can be nested
-  - Fairness: All buckets get a fair share of tokens
-  - No waste, excess tokens distributed fairly to buckets with spare capacity
+  - Fairness: All buckets get a fair share of tokens, weighted by their shares
+  - No waste, excess tokens distributed fairly to buckets with spare capacity,
+    by priority class
   - Complexity:
-	- Token distribution in O(n)
+	- Token distribution in O(n) for buckets in use, idle buckets are accounted
+	  for in aggregate
 	- Adding/removing buckets/limiters in O(1)
   - No uneeded wakeups during periods of idleness
   - Thread-safe
@@ -19,13 +23,36 @@
 namespace fz {
 
 namespace {
-auto const delay = duration::from_milliseconds(200);
-int const frequency = 5;
+// Number of steps in which pacing makes the tokens of a distribution available
+int64_t const pacing_steps = 8;
+
 std::array<direction::type, 2> directions { direction::inbound, direction::outbound };
+
+rate::type scale(rate::type tokens, size_t share)
+{
+	return (tokens == rate::unlimited) ? rate::unlimited : tokens * share;
+}
+}
+
+rate_limit_stats& rate_limit_stats::operator+=(rate_limit_stats const& op)
+{
+	for (size_t i = 0; i < 2; ++i) {
+		granted[i] += op.granted[i];
+		consumed[i] += op.consumed[i];
+		wasted[i] += op.wasted[i];
+		waits[i] += op.waits[i];
+		wakeups[i] += op.wakeups[i];
+		wait_time[i] += op.wait_time[i];
+		waiting[i] += op.waiting[i];
+	}
+	buckets += op.buckets;
+	distributions += op.distributions;
+	return *this;
 }
 
 rate_limit_manager::rate_limit_manager(event_loop & loop)
 	: event_handler(loop)
+	, start_(monotonic_clock::coarse_now())
 {
 }
 
@@ -42,7 +69,14 @@ void rate_limit_manager::operator()(event_base const& ev)
 
 void rate_limit_manager::on_timer(timer_id const& id)
 {
+	if (id == pacing_timer_) {
+		on_pacing_timer();
+		return;
+	}
+
 	scoped_lock l(mtx_);
+	distribution_time_ = elapsed();
+	distributions_.fetch_add(1, std::memory_order_relaxed);
 	if (++activity_ == 2) {
 		timer_id expected = id;
 		if (timer_.compare_exchange_strong(expected, 0)) {
@@ -57,12 +91,82 @@ void rate_limit_manager::on_timer(timer_id const& id)
 
 void rate_limit_manager::record_activity()
 {
-	if (activity_.exchange(0) == 2) {
-		timer_id old = timer_.exchange(add_timer(duration::from_milliseconds(1000 / frequency), false));
+	// Called on every consume, only write if needed to keep the cache line shared
+	if (activity_.load(std::memory_order_relaxed) && activity_.exchange(0) == 2) {
+		timer_id old = timer_.exchange(add_timer(duration::from_milliseconds(1000 / frequency_), false));
 		stop_timer(old);
 	}
 }
 
+int64_t rate_limit_manager::elapsed() const
+{
+	return (monotonic_clock::coarse_now() - start_).get_milliseconds();
+}
+
+void rate_limit_manager::set_frequency(int frequency)
+{
+	if (frequency < 1) {
+		frequency = 1;
+	}
+	else if (frequency > 50) {
+		frequency = 50;
+	}
+	if (frequency_.exchange(frequency) != frequency) {
+		// Restart the timer with the new interval if it is running
+		timer_id old = timer_.exchange(0);
+		if (old) {
+			stop_timer(old);
+			activity_ = 2;
+			record_activity();
+		}
+	}
+}
+
+void rate_limit_manager::set_pacing(bool pacing)
+{
+	pacing_ = pacing;
+}
+
+void rate_limit_manager::on_pacing_timer()
+{
+	int64_t const step = std::max(int64_t(1), 1000 / frequency_ / pacing_steps);
+
+	scoped_lock l(pacing_mtx_);
+	pacing_timer_ = 0;
+
+	// Lock order is bucket before pacing_mtx_, only try to lock the buckets
+	for (size_t i = 0; i < paced_.size(); ) {
+		auto * b = paced_[i];
+		if (b->mtx_.try_lock()) {
+			b->paced_mgr_ = nullptr;
+			b->wake_paced();
+			b->mtx_.unlock();
+			paced_[i] = paced_.back();
+			paced_.pop_back();
+		}
+		else {
+			++i;
+		}
+	}
+
+	if (!paced_.empty()) {
+		pacing_timer_ = add_timer(duration::from_milliseconds(step), true);
+	}
+}
+
+rate_limit_stats rate_limit_manager::get_stats()
+{
+	rate_limit_stats stats;
+
+	scoped_lock l(mtx_);
+	for (auto * limiter : limiters_) {
+		limiter->add_stats(stats);
+	}
+	stats.distributions = distributions_.load(std::memory_order_relaxed);
+
+	return stats;
+}
+
 void rate_limit_manager::add(rate_limiter* limiter)
 {
 	if (!limiter) {
@@ -124,13 +228,18 @@ void rate_limit_manager::set_burst_tolerance(rate::type tolerance)
 	else if (tolerance > 10) {
 		tolerance = 10;
 	}
-	burst_tolerance_ = tolerance;
+	if (burst_tolerance_.exchange(tolerance) != tolerance) {
+		scoped_lock l(mtx_);
+		for (auto * limiter : limiters_) {
+			limiter->reactivate();
+		}
+	}
 }
 
 void bucket_base::remove_bucket()
 {
 	scoped_lock l(mtx_);
-	while (idx_ != size_t(-1) && parent_) {
+	while (parent_) {
 		if (parent_ == mgr_) {
 			if (mgr_->mtx_.try_lock()) {
 				auto * other = mgr_->limiters_.back();
@@ -147,13 +256,7 @@ void bucket_base::remove_bucket()
 		else {
 			auto * parent = reinterpret_cast<rate_limiter*>(parent_);
 			if (parent->mtx_.try_lock()) {
-				auto * other = parent->buckets_.back();
-				if (other != this) {
-					scoped_lock ol(other->mtx_);
-					other->idx_ = idx_;
-					parent->buckets_[idx_] = other;
-				}
-				parent->buckets_.pop_back();
+				parent->remove_child(this);
 				std::array<rate::type, 2> unspent = gather_unspent_for_removal();
 				for (size_t i = 0; i < 2; ++i) {
 					parent->data_[i].debt_ -= std::min(parent->data_[i].debt_, unspent[i]);
@@ -170,6 +273,42 @@ void bucket_base::remove_bucket()
 	}
 	parent_ = nullptr;
 	idx_ = size_t(-1);
+	idle_ = false;
+}
+
+void bucket_base::set_share(size_t share)
+{
+	if (share < 1) {
+		share = 1;
+	}
+	else if (share > 1000) {
+		share = 1000;
+	}
+
+	scoped_lock l(mtx_);
+	share_ = share;
+	if (idle_) {
+		// Takes effect in the next distribution
+		wake();
+	}
+}
+
+void bucket_base::set_priority(int priority)
+{
+	scoped_lock l(mtx_);
+	priority_ = priority;
+}
+
+void bucket_base::wake()
+{
+	idle_ = false;
+
+	// Only buckets in a rate_limiter ever become idle
+	if (parent_ && parent_ != mgr_) {
+		auto * parent = reinterpret_cast<rate_limiter*>(parent_);
+		scoped_lock l(parent->wake_mtx_);
+		parent->woken_.push_back(this);
+	}
 }
 
 void bucket_base::set_mgr_recursive(rate_limit_manager * mgr)
@@ -191,8 +330,14 @@ rate_limiter::~rate_limiter()
 		for (auto * bucket : buckets_) {
 			bucket->parent_ = nullptr;
 			bucket->idx_ = size_t(-1);
+			bucket->idle_ = false;
 		}
 		buckets_.clear();
+		active_ = 0;
+		idle_weight_ = 0;
+
+		scoped_lock wl(wake_mtx_);
+		woken_.clear();
 	}
 
 	remove_bucket();
@@ -226,6 +371,7 @@ bool rate_limiter::do_set_limit(direction::type const d, rate::type limit)
 	}
 
 	data.limit_ = limit;
+	reactivate_ = true;
 
 	size_t weight = weight_ ? weight_ : 1;
 	if (data.limit_ != rate::unlimited) {
@@ -255,7 +401,9 @@ void rate_limiter::add(bucket_base* bucket)
 	bucket->set_mgr_recursive(mgr_);
 	bucket->parent_ = this;
 	bucket->idx_ = buckets_.size();
+	bucket->idle_ = false;
 	buckets_.push_back(bucket);
+	swap_buckets(bucket->idx_, active_++);
 
 	bool active{};
 	bucket->update_stats(active);
@@ -267,6 +415,7 @@ void rate_limiter::add(bucket_base* bucket)
 	if (!bucket_weight) {
 		bucket_weight = 1;
 	}
+	bucket_weight *= bucket->share_;
 	weight_ += bucket_weight;
 
 	for (auto const& d : directions) {
@@ -278,7 +427,7 @@ void rate_limiter::add(bucket_base* bucket)
 		else {
 			tokens = data.merged_tokens_ / (bucket_weight * 2);
 		}
-		bucket->add_tokens(d, tokens, tokens);
+		bucket->add_tokens(d, scale(tokens, bucket->share_), scale(tokens, bucket->share_));
 		bucket->distribute_overflow(d, 0);
 
 		if (tokens != rate::unlimited) {
@@ -292,19 +441,90 @@ void rate_limiter::add(bucket_base* bucket)
 void rate_limiter::lock_tree()
 {
 	mtx_.lock();
-	for (auto * bucket : buckets_) {
-		bucket->lock_tree();
+
+	{
+		scoped_lock l(wake_mtx_);
+		for (auto * bucket : woken_) {
+			if (bucket->idx_ >= active_) {
+				idle_weight_ -= bucket->idle_share_;
+				swap_buckets(bucket->idx_, active_++);
+			}
+		}
+		woken_.clear();
+	}
+
+	if (reactivate_.exchange(false)) {
+		active_ = buckets_.size();
+		idle_weight_ = 0;
+		for (auto * bucket : buckets_) {
+			bucket->reactivate();
+		}
+	}
+
+	for (size_t i = 0; i < active_; ++i) {
+		buckets_[i]->lock_tree();
+		buckets_[i]->idle_ = false;
 	}
 }
 
 void rate_limiter::unlock_tree()
 {
-	for (auto * bucket : buckets_) {
+	for (size_t i = active_; i-- > 0; ) {
+		auto * bucket = buckets_[i];
+		bool const idle = bucket->try_idle();
+		if (idle) {
+			bucket->idle_share_ = bucket->share_;
+			idle_weight_ += bucket->idle_share_;
+		}
 		bucket->unlock_tree();
+		if (idle) {
+			swap_buckets(i, --active_);
+		}
 	}
 	mtx_.unlock();
 }
 
+void rate_limiter::reactivate()
+{
+	reactivate_ = true;
+}
+
+void rate_limiter::swap_buckets(size_t a, size_t b)
+{
+	if (a != b) {
+		std::swap(buckets_[a], buckets_[b]);
+		buckets_[a]->idx_ = a;
+		buckets_[b]->idx_ = b;
+	}
+}
+
+void rate_limiter::remove_child(bucket_base * bucket)
+{
+	size_t idx = bucket->idx_;
+
+	// Idle buckets that have been used again are queued until the next distribution
+	bool const queued = idx >= active_ && !bucket->idle_;
+
+	if (idx >= active_) {
+		idle_weight_ -= bucket->idle_share_;
+	}
+	else {
+		swap_buckets(idx, --active_);
+		idx = active_;
+	}
+	swap_buckets(idx, buckets_.size() - 1);
+	buckets_.pop_back();
+
+	if (queued) {
+		scoped_lock l(wake_mtx_);
+		auto it = std::find(woken_.begin(), woken_.end(), bucket);
+		if (it != woken_.end()) {
+			*it = woken_.back();
+			woken_.pop_back();
+		}
+	}
+}
+
 void rate_limiter::pay_debt(direction::type const d)
 {
 	auto & data = data_[d];
@@ -324,6 +544,9 @@ rate::type rate_limiter::add_tokens(direction::type const d, rate::type tokens,
 	scratch_buffer_.clear();
 	
 	auto & data = data_[d];
+
+	// Overflow left over from the previous distribution is lost
+	data.wasted_ += data.overflow_;
 	data.overflow_ = 0;
 
 	if (!weight_) {
@@ -332,6 +555,8 @@ rate::type rate_limiter::add_tokens(direction::type const d, rate::type tokens,
 		return (tokens == rate::unlimited) ? 0 : tokens;
 	}
 
+	rate::type const frequency = mgr_ ? static_cast<rate::type>(mgr_->frequency_) : 5;
+
 	rate::type merged_limit = limit;
 	if (data.limit_ != rate::unlimited) {
 		rate::type my_limit = (data.carry_ + data.limit_) / weight_;
@@ -370,8 +595,14 @@ rate::type rate_limiter::add_tokens(direction::type const d, rate::type tokens,
 		}
 	}
 
-	for (size_t i = 0; i < buckets_.size(); ++i) {
-		rate::type overflow = buckets_[i]->add_tokens(d, data.merged_tokens_, merged_limit);
+	if (merged_limit != rate::unlimited) {
+		// Idle buckets are full, all their tokens overflow
+		data.overflow_ += data.merged_tokens_ * idle_weight_;
+	}
+
+	for (size_t i = 0; i < active_; ++i) {
+		size_t const share = buckets_[i]->share_;
+		rate::type overflow = buckets_[i]->add_tokens(d, scale(data.merged_tokens_, share), scale(merged_limit, share));
 		if (overflow) {
 			data.overflow_ += overflow;
 		}
@@ -412,18 +643,31 @@ rate::type rate_limiter::distribute_overflow(direction::type const d, rate::type
 	rate::type remaining = overflow_sum;
 
 	while (true) {
-		data.unsaturated_ = 0;
+		// Only the highest priority class of unsaturated buckets gets overflow
+		int priority = std::numeric_limits<int>::min();
+		for (auto idx : scratch_buffer_) {
+			priority = std::max(priority, buckets_[idx]->priority_);
+		}
+
+		size_t unsaturated{};
 		for (auto idx : scratch_buffer_) {
-			data.unsaturated_ += buckets_[idx]->unsaturated(d);
+			auto const& bucket = *buckets_[idx];
+			if (bucket.priority_ == priority) {
+				unsaturated += bucket.unsaturated(d) * bucket.share_;
+			}
 		}
 
-		rate::type const extra_tokens = data.unsaturated_ ? (remaining / data.unsaturated_) : 0;
-		if (data.unsaturated_) {
-			remaining %= data.unsaturated_;
+		rate::type const extra_tokens = unsaturated ? (remaining / unsaturated) : 0;
+		if (unsaturated) {
+			remaining %= unsaturated;
 		}
 		for (size_t i = 0; i < scratch_buffer_.size(); ) {
 			auto & bucket = *buckets_[scratch_buffer_[i]];
-			rate::type sub_overflow = bucket.distribute_overflow(d, extra_tokens);
+			if (bucket.priority_ != priority) {
+				++i;
+				continue;
+			}
+			rate::type sub_overflow = bucket.distribute_overflow(d, extra_tokens * bucket.unsaturated(d) * bucket.share_);
 			if (sub_overflow || !bucket.unsaturated(d)) {
 				remaining += sub_overflow;
 				scratch_buffer_[i] = scratch_buffer_.back();
@@ -436,7 +680,7 @@ rate::type rate_limiter::distribute_overflow(direction::type const d, rate::type
 		if (!extra_tokens) {
 			data.unsaturated_ = 0;
 			for (auto idx : scratch_buffer_) {
-				data.unsaturated_ += buckets_[idx]->unsaturated(d);
+				data.unsaturated_ += buckets_[idx]->unsaturated(d) * buckets_[idx]->share_;
 			}
 			break;
 		}
@@ -457,15 +701,18 @@ rate::type rate_limiter::distribute_overflow(direction::type const d, rate::type
 
 void rate_limiter::update_stats(bool & active)
 {
-	weight_ = 0;
-
 	data_[0].unsaturated_ = 0;
 	data_[1].unsaturated_ = 0;
-	for (size_t i = 0; i < buckets_.size(); ++i) {
-		buckets_[i]->update_stats(active);
-		weight_ += buckets_[i]->weight();
+
+	// Idle buckets are leaves with a weight of their share and are saturated
+	weight_ = idle_weight_;
+
+	for (size_t i = 0; i < active_; ++i) {
+		auto & bucket = *buckets_[i];
+		bucket.update_stats(active);
+		weight_ += bucket.weight() * bucket.share_;
 		for (auto const d : directions) {
-			data_[d].unsaturated_ += buckets_[i]->unsaturated(d);
+			data_[d].unsaturated_ += bucket.unsaturated(d) * bucket.share_;
 		}
 	}
 }
@@ -490,6 +737,24 @@ std::array<rate::type, 2> rate_limiter::gather_unspent_for_removal()
 	return ret;
 }
 
+rate_limit_stats rate_limiter::get_stats()
+{
+	rate_limit_stats stats;
+	add_stats(stats);
+	return stats;
+}
+
+void rate_limiter::add_stats(rate_limit_stats & stats)
+{
+	scoped_lock l(mtx_);
+	for (auto const d : directions) {
+		stats.wasted[d] += data_[d].wasted_;
+	}
+	for (auto * bucket : buckets_) {
+		bucket->add_stats(stats);
+	}
+}
+
 bucket::~bucket()
 {
 	remove_bucket();
@@ -498,12 +763,29 @@ bucket::~bucket()
 void bucket::remove_bucket()
 {
 	bucket_base::remove_bucket();
+
+	{
+		scoped_lock l(mtx_);
+		if (paced_mgr_) {
+			scoped_lock pl(paced_mgr_->pacing_mtx_);
+			auto & paced = paced_mgr_->paced_;
+			auto it = std::find(paced.begin(), paced.end(), this);
+			if (it != paced.end()) {
+				*it = paced.back();
+				paced.pop_back();
+			}
+			paced_mgr_ = nullptr;
+		}
+	}
+
 	data_[0] = data_[1] = data_t{};
+	used_ = false;
 }
 
 rate::type bucket::add_tokens(direction::type const d, rate::type tokens, rate::type limit)
 {
 	auto & data = data_[d];
+	data.added_ = 0;
 	if (limit == rate::unlimited) {
 		data.bucket_size_ = rate::unlimited;
 		data.available_ = rate::unlimited;
@@ -516,6 +798,8 @@ rate::type bucket::add_tokens(direction::type const d, rate::type tokens, rate::
 		}
 		if (data.available_ == rate::unlimited) {
 			data.available_ = tokens;
+			data.added_ = tokens;
+			counters_[d].granted_ += tokens;
 			return 0;
 		}
 		else if (data.bucket_size_ < data.available_) {
@@ -535,6 +819,8 @@ rate::type bucket::add_tokens(direction::type const d, rate::type tokens, rate::
 			rate::type added = std::min(tokens, capacity);
 			rate::type ret = tokens - added;
 			data.available_ += added;
+			data.added_ = added;
+			counters_[d].granted_ += added;
 			return ret;
 		}
 	}
@@ -559,6 +845,8 @@ rate::type bucket::distribute_overflow(direction::type const d, rate::type token
 	rate::type added = std::min(tokens, capacity);
 	rate::type ret = tokens - added;
 	data.available_ += added;
+	data.added_ += added;
+	counters_[d].granted_ += added;
 	return ret;
 }
 
@@ -566,14 +854,77 @@ void bucket::unlock_tree()
 {
 	for (auto const& d : directions) {
 		auto & data = data_[d];
-		if (data.waiting_ && data.available_) {
-			data.waiting_ = false;
-			wakeup(static_cast<direction::type>(d));
+		if ((data.waiting_ || data.paced_waiting_) && data.available_) {
+			end_wait(d);
 		}
 	}
 	bucket_base::unlock_tree();
 }
 
+void bucket::wake_paced()
+{
+	for (auto const& d : directions) {
+		if (data_[d].paced_waiting_) {
+			end_wait(d);
+		}
+	}
+}
+
+void bucket::start_wait(direction::type const d)
+{
+	auto & data = data_[d];
+	if (!data.waiting_ && !data.paced_waiting_) {
+		auto & counters = counters_[d];
+		++counters.waits_;
+		counters.wait_start_ = monotonic_clock::coarse_now();
+	}
+}
+
+void bucket::end_wait(direction::type const d)
+{
+	auto & data = data_[d];
+	data.waiting_ = false;
+	data.paced_waiting_ = false;
+
+	auto & counters = counters_[d];
+	++counters.wakeups_;
+	counters.wait_time_ += monotonic_clock::coarse_now() - counters.wait_start_;
+
+	wakeup(d);
+}
+
+rate::type bucket::paced(direction::type const d)
+{
+	auto & data = data_[d];
+
+	int64_t const period = 1000 / mgr_->frequency_;
+	int64_t const step = std::max(int64_t(1), period / pacing_steps);
+	int64_t const elapsed = std::max(int64_t(0), mgr_->elapsed() - mgr_->distribution_time_);
+	int64_t const released = (elapsed / step + 1) * step;
+	if (released >= period) {
+		return data.available_;
+	}
+
+	// Part of the tokens added by the last distribution are held back
+	rate::type const reserve = data.added_ / period * (period - released) + data.added_ % period * (period - released) / period;
+	if (data.available_ > reserve) {
+		return data.available_ - reserve;
+	}
+
+	start_wait(d);
+	data.paced_waiting_ = true;
+	data.paced_ = true;
+	if (!paced_mgr_) {
+		paced_mgr_ = mgr_;
+		scoped_lock l(mgr_->pacing_mtx_);
+		mgr_->paced_.push_back(this);
+		if (!mgr_->pacing_timer_) {
+			mgr_->pacing_timer_ = mgr_->add_timer(duration::from_milliseconds(step - elapsed % step), true);
+		}
+	}
+	return 0;
+}
+
 void bucket::update_stats(bool & active)
 {
 	for (auto const& d : directions) {
@@ -586,12 +937,15 @@ void bucket::update_stats(bool & active)
 				data.overflow_multiplier_ /= 2;
 			}
 			else {
-				data.unsaturated_ = data.waiting_;
-				if (data.waiting_) {
+				// Buckets held back by pacing want more tokens as well
+				bool const hungry = data.waiting_ || data.paced_;
+				data.unsaturated_ = hungry;
+				if (hungry) {
 					active = true;
 				}
 			}
 		}
+		data.paced_ = false;
 	}
 }
 
@@ -604,11 +958,18 @@ rate::type bucket::available(direction::type const d)
 	scoped_lock l(mtx_);
 	auto & data = data_[d];
 	if (!data.available_) {
+		start_wait(d);
 		data.waiting_ = true;
+		if (idle_) {
+			wake();
+		}
 		if (mgr_) {
 			mgr_->record_activity();
 		}
 	}
+	else if (data.added_ && data.available_ != rate::unlimited && mgr_ && mgr_->pacing_) {
+		return paced(d);
+	}
 	return data.available_;
 }
 
@@ -623,6 +984,11 @@ void bucket::consume(direction::type const d, rate::type amount)
 	scoped_lock l(mtx_);
 	auto & data = data_[d];
 	if (data.available_ != rate::unlimited) {
+		counters_[d].consumed_ += amount;
+		used_ = true;
+		if (idle_) {
+			wake();
+		}
 		if (mgr_) {
 			mgr_->record_activity();
 		}
@@ -648,13 +1014,59 @@ std::array<rate::type, 2> bucket::gather_unspent_for_removal()
 	return ret;
 }
 
+rate_limit_stats bucket::get_stats()
+{
+	rate_limit_stats stats;
+	add_stats(stats);
+	return stats;
+}
+
+void bucket::add_stats(rate_limit_stats & stats)
+{
+	scoped_lock l(mtx_);
+	for (auto const d : directions) {
+		auto const& counters = counters_[d];
+		stats.granted[d] += counters.granted_;
+		stats.consumed[d] += counters.consumed_;
+		stats.waits[d] += counters.waits_;
+		stats.wakeups[d] += counters.wakeups_;
+		stats.wait_time[d] += counters.wait_time_;
+		if (data_[d].waiting_ || data_[d].paced_waiting_) {
+			++stats.waiting[d];
+		}
+	}
+	++stats.buckets;
+}
+
+bool bucket::try_idle()
+{
+	if (used_) {
+		used_ = false;
+		return false;
+	}
+
+	for (auto const& d : directions) {
+		auto const& data = data_[d];
+		if (data.waiting_ || data.paced_waiting_ || data.unsaturated_ || data.overflow_multiplier_ != 1) {
+			return false;
+		}
+		if (data.available_ != rate::unlimited && data.available_ < data.bucket_size_) {
+			return false;
+		}
+	}
+	data_[0].added_ = 0;
+	data_[1].added_ = 0;
+	idle_ = true;
+	return true;
+}
+
 bool bucket::waiting(scoped_lock &, direction::type d)
 {
 	if (d != direction::inbound && d != direction::outbound) {
 		return false;
 	}
 
-	return data_[d].waiting_;
+	return data_[d].waiting_ || data_[d].paced_waiting_;
 }
 
 }
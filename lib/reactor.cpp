@@ -0,0 +1,282 @@
+#include "libfilezilla/libfilezilla.hpp"
+
+#include "reactor_impl.hpp"
+
+#if FZ_REACTOR_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+
+namespace fz {
+
+#if FZ_REACTOR_EPOLL
+namespace {
+uint32_t to_epoll(int events)
+{
+	uint32_t ret = EPOLLONESHOT;
+	if (events & POLLIN) {
+		ret |= EPOLLIN;
+	}
+	if (events & POLLOUT) {
+		ret |= EPOLLOUT;
+	}
+	return ret;
+}
+
+int from_epoll(uint32_t events)
+{
+	int ret{};
+	if (events & EPOLLIN) {
+		ret |= POLLIN;
+	}
+	if (events & EPOLLOUT) {
+		ret |= POLLOUT;
+	}
+	if (events & EPOLLERR) {
+		ret |= POLLERR;
+	}
+	if (events & EPOLLHUP) {
+		ret |= POLLHUP;
+	}
+	return ret;
+}
+}
+
+reactor_shard::~reactor_shard()
+{
+	stop();
+	if (epoll_fd_ != -1) {
+		::close(epoll_fd_);
+	}
+	if (event_fd_ != -1) {
+		::close(event_fd_);
+	}
+}
+
+bool reactor_shard::init(thread_pool & pool)
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ == -1) {
+		return false;
+	}
+
+	event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (event_fd_ == -1) {
+		return false;
+	}
+
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev)) {
+		return false;
+	}
+
+	thread_ = pool.spawn([this]{ entry(); });
+	return static_cast<bool>(thread_);
+}
+
+int reactor_shard::add(reactor_client & c, int fd, int events)
+{
+	epoll_event ev{};
+	ev.events = to_epoll(events);
+	ev.data.ptr = &c;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) {
+		return errno;
+	}
+	return 0;
+}
+
+int reactor_shard::arm(reactor_client & c, int fd, int events)
+{
+	epoll_event ev{};
+	ev.events = to_epoll(events);
+	ev.data.ptr = &c;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev)) {
+		return errno;
+	}
+	return 0;
+}
+
+int reactor_shard::remove(int fd)
+{
+	epoll_event ev{};
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, &ev)) {
+		return errno;
+	}
+	return 0;
+}
+
+void reactor_shard::retire(reactor_client * c)
+{
+	if (!c) {
+		return;
+	}
+
+	scoped_lock l(mutex_);
+	if (thread_ && !quit_) {
+		retired_.push_back(c);
+		l.unlock();
+		signal();
+	}
+	else {
+		l.unlock();
+		delete c;
+	}
+}
+
+void reactor_shard::signal()
+{
+	uint64_t tmp = 1;
+	int ret;
+	do {
+		ret = write(event_fd_, &tmp, 8);
+	} while (ret == -1 && errno == EINTR);
+}
+
+void reactor_shard::stop()
+{
+	scoped_lock l(mutex_);
+	if (!thread_) {
+		return;
+	}
+	quit_ = true;
+	l.unlock();
+
+	signal();
+	thread_.join();
+}
+
+void reactor_shard::entry()
+{
+	epoll_event events[64];
+
+	std::vector<reactor_client*> retired;
+	for (;;) {
+		bool quit;
+		{
+			scoped_lock l(mutex_);
+			retired.swap(retired_);
+			quit = quit_;
+		}
+
+		// Everything that got retired before this iteration has been removed from the
+		// epoll set before we are going to wait again, and all previously returned events
+		// have been processed. Thus it is now safe to delete these clients.
+		for (auto * c : retired) {
+			delete c;
+		}
+		retired.clear();
+
+		if (quit) {
+			break;
+		}
+
+		int n = epoll_wait(epoll_fd_, events, sizeof(events) / sizeof(epoll_event), -1);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			auto * c = static_cast<reactor_client*>(events[i].data.ptr);
+			if (!c) {
+				uint64_t tmp;
+				int damn_spurious_warning = read(event_fd_, &tmp, 8);
+				(void)damn_spurious_warning;
+			}
+			else {
+				c->on_reactor_event(from_epoll(events[i].events));
+			}
+		}
+	}
+}
+
+reactor_impl::reactor_impl(thread_pool & pool, size_t threads)
+{
+	for (size_t i = 0; i < threads; ++i) {
+		auto shard = std::make_unique<reactor_shard>();
+		if (!shard->init(pool)) {
+			break;
+		}
+		shards_.emplace_back(std::move(shard));
+	}
+}
+
+#else
+
+reactor_shard::~reactor_shard()
+{
+}
+
+bool reactor_shard::init(thread_pool &)
+{
+	return false;
+}
+
+int reactor_shard::add(reactor_client &, int, int)
+{
+	return ENOSYS;
+}
+
+int reactor_shard::arm(reactor_client &, int, int)
+{
+	return ENOSYS;
+}
+
+int reactor_shard::remove(int)
+{
+	return ENOSYS;
+}
+
+void reactor_shard::retire(reactor_client * c)
+{
+	delete c;
+}
+
+void reactor_shard::stop()
+{
+}
+
+reactor_impl::reactor_impl(thread_pool &, size_t)
+{
+}
+
+#endif
+
+reactor_impl::~reactor_impl()
+{
+	shards_.clear();
+}
+
+reactor_shard* reactor_impl::get_shard()
+{
+	if (shards_.empty()) {
+		return nullptr;
+	}
+
+	return shards_[next_++ % shards_.size()].get();
+}
+
+reactor::reactor(thread_pool & pool, size_t threads)
+	: pool_(pool)
+	, impl_(std::make_unique<reactor_impl>(pool, threads ? threads : 1))
+{
+}
+
+reactor::~reactor()
+{
+}
+
+bool reactor::multiplexing() const
+{
+	return !impl_->shards_.empty();
+}
+
+}
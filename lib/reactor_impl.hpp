@@ -0,0 +1,82 @@
+#ifndef LIBFILEZILLA_REACTOR_IMPL_HEADER
+#define LIBFILEZILLA_REACTOR_IMPL_HEADER
+
+#include "libfilezilla/reactor.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#include <atomic>
+#include <vector>
+
+#if !FZ_WINDOWS && defined(HAVE_EPOLL) && defined(HAVE_EVENTFD)
+#define FZ_REACTOR_EPOLL 1
+#endif
+
+namespace fz {
+
+/// Interface for objects whose descriptors get waited on by a reactor shard
+class reactor_client
+{
+public:
+	virtual ~reactor_client() = default;
+
+	// Called in the shard's thread. revents is a combination of POLLIN, POLLOUT, POLLERR and POLLHUP.
+	// The registration is disarmed until arm is called again.
+	virtual void on_reactor_event(int revents) = 0;
+};
+
+// A single reactor thread with its own epoll descriptor
+class reactor_shard final
+{
+public:
+	reactor_shard() = default;
+	~reactor_shard();
+
+	reactor_shard(reactor_shard const&) = delete;
+	reactor_shard& operator=(reactor_shard const&) = delete;
+
+	bool init(thread_pool & pool);
+
+	// Registrations are one-shot, events are POLLIN and/or POLLOUT.
+	// All three return zero on success, else errno.
+	int add(reactor_client & c, int fd, int events);
+	int arm(reactor_client & c, int fd, int events);
+	int remove(int fd);
+
+	// Deletes the client in the shard's thread once it is guaranteed that
+	// no more events for it can be delivered. The client's descriptor must
+	// have been removed prior to calling this.
+	void retire(reactor_client * c);
+
+	void stop();
+
+private:
+	void entry();
+	void signal();
+
+	int epoll_fd_{-1};
+	int event_fd_{-1};
+
+	mutex mutex_{false};
+	std::vector<reactor_client*> retired_;
+	bool quit_{};
+
+	async_task thread_;
+};
+
+class reactor_impl final
+{
+public:
+	reactor_impl(thread_pool & pool, size_t threads);
+	~reactor_impl();
+
+	// Returns nullptr if multiplexing is unavailable
+	reactor_shard* get_shard();
+
+	std::vector<std::unique_ptr<reactor_shard>> shards_;
+	std::atomic<size_t> next_{};
+};
+
+}
+
+#endif
@@ -1,13 +1,23 @@
 #include "libfilezilla/file.hpp"
 #include "libfilezilla/local_filesys.hpp"
 #include "libfilezilla/recursive_remove.hpp"
+#include "libfilezilla/tree_walker.hpp"
 
 #if FZ_WINDOWS
 #include "libfilezilla/glue/dll.hpp"
 #else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
 namespace fz {
 
 bool recursive_remove::remove(const native_string& path)
@@ -21,17 +31,10 @@ bool recursive_remove::remove(const native_string& path)
 extern "C" {
 typedef int (STDAPICALLTYPE *shfileop_t)(LPSHFILEOPSTRUCTW);
 }
-#endif
 
-bool recursive_remove::remove(std::list<native_string> dirsToVisit)
+// Returns false if SHFileOperation is unavailable
+bool recursive_remove::remove_shfileop(std::list<native_string> & dirsToVisit, bool & success)
 {
-	bool success = true;
-
-	// Under Windows use SHFileOperation to delete files and directories.
-	// Under other systems, we have to recurse into subdirectories manually
-	// to delete all contents.
-
-#ifdef FZ_WINDOWS
 	shdlls& dlls = shdlls::get();
 	static auto const shfileop = reinterpret_cast<shfileop_t>(dlls.shell32_["SHFileOperationW"]);
 	if (shfileop) {
@@ -74,6 +77,221 @@ bool recursive_remove::remove(std::list<native_string> dirsToVisit)
 			}
 		}
 		delete [] pBuffer;
+		return true;
+	}
+	return false;
+}
+#endif
+
+#if !FZ_WINDOWS
+namespace {
+// Ancestors beyond this depth get closed while descending and reopened through ".."
+size_t const max_open_dirs = 64;
+
+int const dir_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+struct dir_frame final
+{
+	int fd{-1};
+	dev_t dev{};
+	ino_t ino{};
+
+	// Name in the parent directory
+	std::string name;
+
+	std::vector<std::string> subdirs;
+	size_t next{};
+};
+
+bool open_frame(dir_frame & frame, int parent_fd)
+{
+	frame.fd = openat(parent_fd, frame.name.c_str(), dir_flags);
+	if (frame.fd == -1) {
+		return false;
+	}
+	struct stat buf{};
+	if (fstat(frame.fd, &buf)) {
+		close(frame.fd);
+		frame.fd = -1;
+		return false;
+	}
+	frame.dev = buf.st_dev;
+	frame.ino = buf.st_ino;
+	return true;
+}
+
+// Enumerates the whole directory before deleting its files, see the comment in
+// the generic implementation. Subdirectories are remembered for descending.
+bool process_dir(dir_frame & frame)
+{
+	int const fd = dup(frame.fd);
+	if (fd == -1) {
+		return false;
+	}
+	DIR* dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return false;
+	}
+
+	std::vector<std::string> files;
+	while (dirent* entry = readdir(dir)) {
+		char const* name = entry->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) {
+			continue;
+		}
+
+		bool is_dir{};
+#ifdef DT_DIR
+		if (entry->d_type != DT_UNKNOWN) {
+			is_dir = entry->d_type == DT_DIR;
+		}
+		else
+#endif
+		{
+			struct stat buf{};
+			is_dir = !fstatat(frame.fd, name, &buf, AT_SYMLINK_NOFOLLOW) && S_ISDIR(buf.st_mode);
+		}
+
+		if (is_dir) {
+			frame.subdirs.emplace_back(name);
+		}
+		else {
+			files.emplace_back(name);
+		}
+	}
+	closedir(dir);
+
+	bool success = true;
+	for (auto const& file : files) {
+		if (unlinkat(frame.fd, file.c_str(), 0) && errno != ENOENT) {
+			success = false;
+		}
+	}
+	return success;
+}
+
+// Removes the directory with the given name in the parent directory, including its contents.
+// Works relative to directory descriptors, so that paths need not be resolved over and over,
+// and never follows symbolic links.
+bool remove_tree(int parent_fd, std::string const& name)
+{
+	bool success = true;
+
+	std::vector<dir_frame> frames;
+	frames.emplace_back();
+	frames.back().name = name;
+	if (!open_frame(frames.back(), parent_fd)) {
+		return false;
+	}
+	if (!process_dir(frames.back())) {
+		success = false;
+	}
+
+	while (!frames.empty()) {
+		auto & top = frames.back();
+		if (top.next < top.subdirs.size()) {
+			dir_frame child;
+			child.name = std::move(top.subdirs[top.next++]);
+			if (!open_frame(child, top.fd)) {
+				// Might have been replaced by something other than a directory meanwhile
+				if (errno != ENOTDIR && errno != ELOOP) {
+					success = false;
+				}
+				else if (unlinkat(top.fd, child.name.c_str(), 0) && errno != ENOENT) {
+					success = false;
+				}
+				continue;
+			}
+			frames.push_back(std::move(child));
+			if (!process_dir(frames.back())) {
+				success = false;
+			}
+
+			if (frames.size() > max_open_dirs) {
+				auto & ancestor = frames[frames.size() - max_open_dirs - 1];
+				if (ancestor.fd != -1) {
+					close(ancestor.fd);
+					ancestor.fd = -1;
+				}
+			}
+			continue;
+		}
+
+		dir_frame done = std::move(top);
+		frames.pop_back();
+
+		int dir_fd = parent_fd;
+		if (!frames.empty()) {
+			auto & parent = frames.back();
+			if (parent.fd == -1) {
+				// Make sure to get back to the very same directory
+				parent.fd = openat(done.fd, "..", dir_flags);
+				struct stat buf{};
+				if (parent.fd == -1 || fstat(parent.fd, &buf) || buf.st_dev != parent.dev || buf.st_ino != parent.ino) {
+					close(done.fd);
+					for (auto & f : frames) {
+						if (f.fd != -1) {
+							close(f.fd);
+						}
+					}
+					return false;
+				}
+			}
+			dir_fd = parent.fd;
+		}
+		close(done.fd);
+
+		if (unlinkat(dir_fd, done.name.c_str(), AT_REMOVEDIR)) {
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+bool remove_path(native_string const& path)
+{
+	struct stat buf{};
+	if (lstat(path.c_str(), &buf)) {
+		return errno == ENOENT;
+	}
+	if (!S_ISDIR(buf.st_mode)) {
+		return remove_file(path);
+	}
+
+	// Cannot remove a directory through one of its own or its parent's entries
+	auto const pos = path.rfind('/');
+	std::string const name = (pos == native_string::npos) ? path : path.substr(pos + 1);
+	if (name.empty() || name == "." || name == "..") {
+		return false;
+	}
+
+	if (pos == native_string::npos) {
+		return remove_tree(AT_FDCWD, path);
+	}
+
+	int const parent_fd = open(pos ? path.substr(0, pos).c_str() : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (parent_fd == -1) {
+		return false;
+	}
+	bool const ret = remove_tree(parent_fd, name);
+	close(parent_fd);
+	return ret;
+}
+}
+#endif
+
+bool recursive_remove::remove(std::list<native_string> dirsToVisit)
+{
+	bool success = true;
+
+	// Under Windows use SHFileOperation to delete files and directories.
+	// Under other systems, we have to recurse into subdirectories manually
+	// to delete all contents.
+
+#ifdef FZ_WINDOWS
+	if (remove_shfileop(dirsToVisit, success)) {
 		return success;
 	}
 #endif
@@ -87,6 +305,14 @@ bool recursive_remove::remove(std::list<native_string> dirsToVisit)
 		}
 	}
 
+#if !FZ_WINDOWS
+	for (auto const& dir : dirsToVisit) {
+		if (!dir.empty() && !remove_path(dir)) {
+			success = false;
+		}
+	}
+	return success;
+#else
 	// Remember the directories to delete after recursing into them
 	std::list<native_string> dirsToDelete;
 
@@ -155,6 +381,100 @@ bool recursive_remove::remove(std::list<native_string> dirsToVisit)
 	}
 
 	return success;
+#endif
+}
+
+bool recursive_remove::remove(native_string const& path, thread_pool & pool, size_t max_parallel)
+{
+	std::list<native_string> paths;
+	paths.push_back(path);
+	return remove(paths, pool, max_parallel);
+}
+
+bool recursive_remove::remove(std::list<native_string> dirsToVisit, thread_pool & pool, size_t max_parallel)
+{
+	bool success = true;
+
+#ifdef FZ_WINDOWS
+	if (remove_shfileop(dirsToVisit, success)) {
+		return success;
+	}
+#endif
+	if (!confirm()) {
+		return false;
+	}
+
+	std::vector<native_string> roots;
+	for (auto& dir : dirsToVisit) {
+		if (dir.size() > 1 && local_filesys::is_separator(dir.back())) {
+			dir.pop_back();
+		}
+		if (dir.empty()) {
+			continue;
+		}
+
+		if (local_filesys::get_file_type(dir) != local_filesys::dir) {
+			if (!remove_file(dir)) {
+				success = false;
+			}
+			continue;
+		}
+		roots.push_back(dir);
+	}
+
+	if (roots.empty()) {
+		return success;
+	}
+
+	// The callbacks run concurrently
+	std::atomic<bool> failed{};
+
+	// Files get deleted only after their directory has been enumerated completely,
+	// see the comment in the serial implementation above.
+	auto const on_entries = [&failed](native_string const& path, std::vector<local_filesys::dir_entry> const& entries) {
+#if !FZ_WINDOWS
+		if (std::all_of(entries.cbegin(), entries.cend(), [](auto const& e) { return e.t == local_filesys::dir; })) {
+			return true;
+		}
+
+		// Resolve the directory only once
+		int const fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1) {
+			failed = true;
+			return true;
+		}
+		for (auto const& e : entries) {
+			if (e.t != local_filesys::dir) {
+				if (unlinkat(fd, e.name.c_str(), 0) && errno != ENOENT) {
+					failed = true;
+				}
+			}
+		}
+		close(fd);
+#else
+		for (auto const& e : entries) {
+			if (e.t != local_filesys::dir) {
+				if (!remove_file(path + local_filesys::path_separator + e.name)) {
+					failed = true;
+				}
+			}
+		}
+#endif
+		return true;
+	};
+	auto const on_leave = [&failed](native_string const& path) {
+		if (!remove_dir(path)) {
+			failed = true;
+		}
+		return true;
+	};
+
+	tree_walker walker(pool, max_parallel);
+	if (!walker.walk(roots, on_entries, on_leave)) {
+		success = false;
+	}
+
+	return success && !failed;
 }
 
 #ifdef FZ_WINDOWS
@@ -0,0 +1,202 @@
+#include "resolver_cache.hpp"
+
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+#include "libfilezilla/hostname_lookup.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/socket.hpp"
+#include "libfilezilla/time.hpp"
+
+#ifndef FZ_WINDOWS
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+#include <list>
+#include <map>
+
+#include <string.h>
+
+namespace fz {
+
+namespace {
+struct cache_entry;
+typedef std::map<std::pair<std::string, int>, cache_entry> cache_entries;
+
+struct cache_entry final
+{
+	int error_{};
+	std::vector<resolved_address> addresses_;
+	monotonic_clock expiry_;
+
+	std::list<cache_entries::iterator>::iterator lru_;
+};
+
+struct resolver_cache final
+{
+	void trim(size_t max)
+	{
+		while (entries_.size() > max) {
+			entries_.erase(lru_.back());
+			lru_.pop_back();
+		}
+	}
+
+	mutex mtx_{false};
+
+	duration ttl_;
+	duration negative_ttl_;
+	size_t max_entries_{};
+
+	cache_entries entries_;
+
+	// Most recently used first
+	std::list<cache_entries::iterator> lru_;
+};
+
+resolver_cache& get_cache()
+{
+	static resolver_cache cache;
+	return cache;
+}
+
+// Only cache errors stating that the name does not exist, not transient failures
+bool is_negative(int error)
+{
+	if (error == EAI_NONAME) {
+		return true;
+	}
+#ifdef EAI_NODATA
+	if (error == EAI_NODATA) {
+		return true;
+	}
+#endif
+	return false;
+}
+}
+
+bool find_cached_host(std::string const& host, int family, int & error, std::vector<resolved_address> & out)
+{
+	auto & cache = get_cache();
+	scoped_lock l(cache.mtx_);
+	if (!cache.max_entries_) {
+		return false;
+	}
+
+	auto it = cache.entries_.find(std::make_pair(host, family));
+	if (it == cache.entries_.end()) {
+		return false;
+	}
+
+	auto & entry = it->second;
+	if (!(monotonic_clock::coarse_now() < entry.expiry_)) {
+		cache.lru_.erase(entry.lru_);
+		cache.entries_.erase(it);
+		return false;
+	}
+
+	cache.lru_.splice(cache.lru_.begin(), cache.lru_, entry.lru_);
+	out = entry.addresses_;
+	error = entry.error_;
+	return true;
+}
+
+void cache_resolved_host(std::string const& host, int family, int error, addrinfo const* list, std::vector<resolved_address> & out)
+{
+	out.clear();
+	if (!error) {
+		for (addrinfo const* addr = list; addr; addr = addr->ai_next) {
+			if (!addr->ai_addr || addr->ai_addrlen > sizeof(resolved_address::storage_)) {
+				continue;
+			}
+			auto & a = out.emplace_back();
+			memcpy(a.storage_, addr->ai_addr, addr->ai_addrlen);
+			a.size_ = static_cast<unsigned int>(addr->ai_addrlen);
+			a.family_ = addr->ai_family;
+			a.protocol_ = addr->ai_protocol;
+		}
+	}
+
+	if (!error || is_negative(error)) {
+		auto & cache = get_cache();
+		scoped_lock l(cache.mtx_);
+		duration const& ttl = error ? cache.negative_ttl_ : cache.ttl_;
+		if (cache.max_entries_ && ttl) {
+			auto [it, inserted] = cache.entries_.try_emplace(std::make_pair(host, family));
+			auto & entry = it->second;
+			if (inserted) {
+				cache.lru_.push_front(it);
+				entry.lru_ = cache.lru_.begin();
+				cache.trim(cache.max_entries_);
+			}
+			else {
+				// Another thread resolved the same name meanwhile
+				cache.lru_.splice(cache.lru_.begin(), cache.lru_, entry.lru_);
+			}
+			entry.error_ = error;
+			entry.addresses_ = out;
+			entry.expiry_ = monotonic_clock::coarse_now() + ttl;
+		}
+	}
+}
+
+int resolve_host(std::string const& host, int family, std::vector<resolved_address> & out)
+{
+	int error{};
+	if (find_cached_host(host, family, error, out)) {
+		return error;
+	}
+
+#ifdef FZ_WINDOWS
+	// Lookups do not need a socket to exist
+	static winsock_initializer init;
+#endif
+
+	addrinfo hints{};
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_IDN
+	hints.ai_flags |= AI_IDN;
+#endif
+
+	addrinfo* addressList{};
+	error = getaddrinfo(host.c_str(), nullptr, &hints, &addressList);
+	cache_resolved_host(host, family, error, addressList, out);
+	if (!error) {
+		freeaddrinfo(addressList);
+	}
+
+	return error;
+}
+
+bool resolver_cache_enabled()
+{
+	auto & cache = get_cache();
+	scoped_lock l(cache.mtx_);
+	return cache.max_entries_ != 0;
+}
+
+void hostname_lookup::set_cache(duration const& ttl, duration const& negative_ttl, size_t max_entries)
+{
+	auto & cache = get_cache();
+	scoped_lock l(cache.mtx_);
+
+	cache.ttl_ = ttl;
+	cache.negative_ttl_ = negative_ttl;
+	cache.max_entries_ = (ttl || negative_ttl) ? max_entries : 0;
+	cache.trim(cache.max_entries_);
+}
+
+void hostname_lookup::flush_cache()
+{
+	auto & cache = get_cache();
+	scoped_lock l(cache.mtx_);
+	cache.trim(0);
+}
+
+}
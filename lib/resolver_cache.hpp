@@ -0,0 +1,43 @@
+#ifndef LIBFILEZILLA_RESOLVER_CACHE_HEADER
+#define LIBFILEZILLA_RESOLVER_CACHE_HEADER
+
+#include "libfilezilla/libfilezilla.hpp"
+
+#include <string>
+#include <vector>
+
+struct addrinfo;
+
+namespace fz {
+
+/// An address returned by the resolver, without the port
+struct resolved_address final
+{
+	// Large enough for sockaddr_storage
+	alignas(8) unsigned char storage_[128]{};
+	unsigned int size_{};
+	int family_{};
+	int protocol_{};
+};
+
+/**
+ * Resolves the host for stream sockets using getaddrinfo, unless the process-wide cache,
+ * if enabled, holds a result that has not yet expired.
+ *
+ * family is one of AF_UNSPEC, AF_INET and AF_INET6.
+ *
+ * Returns zero or the error code returned by getaddrinfo.
+ */
+int resolve_host(std::string const& host, int family, std::vector<resolved_address> & out);
+
+/// Returns true and sets error and out if the cache holds a result that has not yet expired
+bool find_cached_host(std::string const& host, int family, int & error, std::vector<resolved_address> & out);
+
+/// Converts the result of getaddrinfo and puts it into the cache, if enabled
+void cache_resolved_host(std::string const& host, int family, int error, addrinfo const* list, std::vector<resolved_address> & out);
+
+bool resolver_cache_enabled();
+
+}
+
+#endif
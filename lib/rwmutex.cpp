@@ -0,0 +1,91 @@
+#include "libfilezilla/rwmutex.hpp"
+
+#ifdef FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include <thread>
+
+namespace fz {
+
+struct alignas(64) biased_rwmutex::slot final
+{
+	std::atomic<size_t> readers_{};
+};
+
+namespace {
+size_t current_cpu()
+{
+#ifdef FZ_WINDOWS
+	return GetCurrentProcessorNumber();
+#elif defined(__linux__)
+	int const cpu = sched_getcpu();
+	if (cpu >= 0) {
+		return static_cast<size_t>(cpu);
+	}
+#endif
+	// Spread threads over the slots instead
+	static thread_local size_t const id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+	return id;
+}
+}
+
+biased_rwmutex::biased_rwmutex()
+{
+	size_t const cpus = std::thread::hardware_concurrency();
+	size_t count = 1;
+	while (count < cpus && count < 256) {
+		count *= 2;
+	}
+	slots_ = std::make_unique<slot[]>(count);
+	slot_mask_ = count - 1;
+}
+
+biased_rwmutex::~biased_rwmutex() = default;
+
+size_t biased_rwmutex::lock_read()
+{
+	while (true) {
+		size_t const s = current_cpu() & slot_mask_;
+		auto & readers = slots_[s].readers_;
+
+		// Pairs with the writer setting writer_ before looking at the slots, one of the two
+		// is guaranteed to see the other.
+		readers.fetch_add(1, std::memory_order_seq_cst);
+		if (!writer_.load(std::memory_order_seq_cst)) {
+			return s;
+		}
+		readers.fetch_sub(1, std::memory_order_release);
+
+		// Wait for the writer to finish
+		gate_.lock_read();
+		gate_.unlock_read();
+	}
+}
+
+void biased_rwmutex::unlock_read(size_t slot)
+{
+	slots_[slot].readers_.fetch_sub(1, std::memory_order_release);
+}
+
+void biased_rwmutex::lock_write()
+{
+	gate_.lock_write();
+	writer_.store(true, std::memory_order_seq_cst);
+	for (size_t i = 0; i <= slot_mask_; ++i) {
+		while (slots_[i].readers_.load(std::memory_order_seq_cst)) {
+			std::this_thread::yield();
+		}
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void biased_rwmutex::unlock_write()
+{
+	writer_.store(false, std::memory_order_release);
+	gate_.unlock_write();
+}
+
+}
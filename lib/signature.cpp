@@ -1,6 +1,8 @@
 #include "libfilezilla/signature.hpp"
 
+#include "libfilezilla/buffer.hpp"
 #include "libfilezilla/encode.hpp"
+#include "libfilezilla/thread_pool.hpp"
 #include "libfilezilla/util.hpp"
 
 #include <nettle/eddsa.h>
@@ -31,6 +33,7 @@ private_signing_key private_signing_key::generate()
 	private_signing_key ret;
 
 	ret.key_ = fz::random_bytes(key_size);
+	ret.derive_pubkey();
 	return ret;
 }
 
@@ -48,21 +51,21 @@ private_signing_key private_signing_key::from_base64(std::string_view const& bas
 	if (raw.size() == key_size) {
 		auto p = reinterpret_cast<uint8_t const*>(raw.data());
 		ret.key_.assign(p, p + key_size);
+		ret.derive_pubkey();
 	}
 
 	return ret;
 }
 
-public_verification_key private_signing_key::pubkey() const
+void private_signing_key::derive_pubkey()
 {
-	public_verification_key ret;
-
-	if (*this) {
-		ret.key_.resize(public_verification_key::key_size);
-		nettle_ed25519_sha512_public_key(ret.key_.data(), key_.data());
-	}
+	pub_.key_.resize(public_verification_key::key_size);
+	nettle_ed25519_sha512_public_key(pub_.key_.data(), key_.data());
+}
 
-	return ret;
+public_verification_key const& private_signing_key::pubkey() const
+{
+	return pub_;
 }
 
 
@@ -70,8 +73,7 @@ std::vector<uint8_t> sign(uint8_t const* message, size_t const size, private_sig
 {
 	std::vector<uint8_t> ret;
 
-	auto const pub = priv.pubkey();
-	if (priv && pub && size) {
+	if (priv && size) {
 		size_t retsize = signature_size;
 		size_t offset{};
 		if (include_message) {
@@ -82,12 +84,36 @@ std::vector<uint8_t> sign(uint8_t const* message, size_t const size, private_sig
 		}
 		ret.resize(retsize);
 
-		nettle_ed25519_sha512_sign(pub.key_.data(), priv.data().data(), size, message, ret.data() + offset);
+		sign_into(message, size, priv, ret.data() + offset);
 	}
 
 	return ret;
 }
 
+bool sign(uint8_t const* message, size_t const size, private_signing_key const& priv, buffer & out, bool include_message)
+{
+	if (!priv || !size) {
+		return false;
+	}
+
+	if (include_message) {
+		out.append(message, size);
+	}
+	sign_into(message, size, priv, out.get(signature_size));
+	out.add(signature_size);
+	return true;
+}
+
+bool sign_into(uint8_t const* message, size_t const size, private_signing_key const& priv, uint8_t* signature)
+{
+	auto const& pub = priv.pubkey().key_;
+	if (!priv || !size || !signature) {
+		return false;
+	}
+	nettle_ed25519_sha512_sign(pub.data(), priv.data().data(), size, message, signature);
+	return true;
+}
+
 std::vector<uint8_t> sign(std::vector<uint8_t> const& message, private_signing_key const& priv, bool include_message)
 {
 	return sign(message.data(), message.size(), priv, include_message);
@@ -108,6 +134,48 @@ bool verify(uint8_t const* message, size_t const message_size, uint8_t const* si
 	return nettle_ed25519_sha512_verify(pub.key_.data(), message_size, message, signature) == 1;
 }
 
+namespace {
+bool verify_range(signature_check * begin, signature_check * end)
+{
+	bool ret = true;
+	for (auto it = begin; it != end; ++it) {
+		it->valid = it->pub && *it->pub && verify(it->message, it->message_size, it->signature, signature_size, *it->pub);
+		ret &= it->valid;
+	}
+	return ret;
+}
+}
+
+bool verify_batch(std::vector<signature_check> & checks, thread_pool * pool)
+{
+	// Large enough to make the overhead of a task negligible
+	size_t const chunk_size = 16;
+
+	signature_check * const begin = checks.data();
+	signature_check * const end = begin + checks.size();
+	if (!pool || checks.size() <= chunk_size) {
+		return verify_range(begin, end);
+	}
+
+	std::vector<pooled_task> tasks;
+	tasks.reserve((checks.size() - 1) / chunk_size);
+	for (auto it = begin + chunk_size; it < end; it += chunk_size) {
+		auto chunk_end = (end - it > static_cast<ptrdiff_t>(chunk_size)) ? it + chunk_size : end;
+		tasks.emplace_back(pool->submit([it, chunk_end]() { verify_range(it, chunk_end); }));
+	}
+	verify_range(begin, begin + chunk_size);
+
+	// Runs chunks no worker has picked up yet
+	bool ret = true;
+	for (auto & task : tasks) {
+		task.join();
+	}
+	for (auto const& check : checks) {
+		ret &= check.valid;
+	}
+	return ret;
+}
+
 bool verify(std::vector<uint8_t> const& message, std::vector<uint8_t> const& signature, public_verification_key const& pub)
 {
 	return verify(message.data(), message.size(), signature.data(), signature.size(), pub);
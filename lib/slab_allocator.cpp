@@ -0,0 +1,143 @@
+#include "libfilezilla/slab_allocator.hpp"
+#include "libfilezilla/util.hpp"
+
+#ifndef FZ_WINDOWS
+#include <sys/mman.h>
+#endif
+
+#include <new>
+
+namespace fz {
+
+namespace {
+size_t const slab_classes = bitscan_reverse(slab_buffer_allocator::max_slab_size / slab_buffer_allocator::min_slab_size) + 1;
+}
+
+slab_buffer_allocator::slab_buffer_allocator(size_t max_cached, bool huge_pages)
+	: free_(slab_classes)
+	, max_cached_(max_cached)
+	, huge_pages_(huge_pages)
+{
+}
+
+slab_buffer_allocator::~slab_buffer_allocator() noexcept
+{
+	trim();
+}
+
+unsigned char* slab_buffer_allocator::allocate(size_t & capacity)
+{
+	if (capacity > max_slab_size) {
+		// Too large to be cached, only round up to a suitable granularity
+		size_t const granularity = huge_pages_ ? huge_page_size : min_slab_size;
+		if (capacity % granularity) {
+			capacity += granularity - capacity % granularity;
+		}
+		return allocate_slab(capacity);
+	}
+
+	size_t size = min_slab_size;
+	size_t idx = 0;
+	while (size < capacity) {
+		size *= 2;
+		++idx;
+	}
+	capacity = size;
+
+	{
+		scoped_lock l(mtx_);
+		auto & slabs = free_[idx];
+		if (!slabs.empty()) {
+			unsigned char* p = slabs.back();
+			slabs.pop_back();
+			cached_ -= size;
+			return p;
+		}
+	}
+
+	return allocate_slab(size);
+}
+
+void slab_buffer_allocator::deallocate(unsigned char* p, size_t capacity) noexcept
+{
+	if (!p) {
+		return;
+	}
+
+	if (capacity <= max_slab_size) {
+		scoped_lock l(mtx_);
+		if (cached_ + capacity <= max_cached_) {
+			auto & slabs = free_[bitscan_reverse(capacity / min_slab_size)];
+			try {
+				slabs.push_back(p);
+				cached_ += capacity;
+				return;
+			}
+			catch (std::bad_alloc const&) {
+			}
+		}
+	}
+
+	free_slab(p, capacity);
+}
+
+size_t slab_buffer_allocator::cached() const
+{
+	scoped_lock l(mtx_);
+	return cached_;
+}
+
+void slab_buffer_allocator::trim()
+{
+	std::vector<std::vector<unsigned char*>> slabs(slab_classes);
+	{
+		scoped_lock l(mtx_);
+		slabs.swap(free_);
+		cached_ = 0;
+	}
+
+	for (size_t i = 0; i < slabs.size(); ++i) {
+		for (auto * p : slabs[i]) {
+			free_slab(p, min_slab_size << i);
+		}
+	}
+}
+
+unsigned char* slab_buffer_allocator::allocate_slab(size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+	if (huge_pages_ && size >= huge_page_size) {
+		// Over-allocate so that the slab can be aligned to a huge page boundary,
+		// then return the excess.
+		size_t const mapped = size + huge_page_size;
+		void* m = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		auto * start = static_cast<unsigned char*>(m);
+		size_t const head = (huge_page_size - reinterpret_cast<uintptr_t>(start) % huge_page_size) % huge_page_size;
+		if (head) {
+			munmap(start, head);
+		}
+		munmap(start + head + size, huge_page_size - head);
+
+		unsigned char* p = start + head;
+		madvise(p, size, MADV_HUGEPAGE);
+		return p;
+	}
+#endif
+	return new unsigned char[size];
+}
+
+void slab_buffer_allocator::free_slab(unsigned char* p, size_t size) noexcept
+{
+#if defined(MADV_HUGEPAGE)
+	if (huge_pages_ && size >= huge_page_size) {
+		munmap(p, size);
+		return;
+	}
+#endif
+	delete[] p;
+}
+
+}
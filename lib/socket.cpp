@@ -11,9 +11,14 @@
 
 #include "libfilezilla/socket.hpp"
 
+#include "libfilezilla/file.hpp"
 #include "libfilezilla/mutex.hpp"
 #include "libfilezilla/thread_pool.hpp"
 
+#include "reactor_impl.hpp"
+#include "resolver_cache.hpp"
+#include "tracepoints.hpp"
+
 #ifndef FZ_WINDOWS
   #include "libfilezilla/glue/unix.hpp"
   #include "libfilezilla/process.hpp"
@@ -21,25 +26,40 @@
 
   #define mutex mutex_override // Sadly on some platforms system headers include conflicting names
   #include <sys/types.h>
+  #include <sys/ioctl.h>
   #include <sys/socket.h>
+  #include <sys/uio.h>
   #include <netdb.h>
+  #ifdef __linux__
+	#include <sys/sendfile.h>
+	#include <signal.h>
+  #endif
   #include <fcntl.h>
   #include <unistd.h>
   #include <arpa/inet.h>
   #include <netinet/in.h>
   #include <netinet/tcp.h>
+  #ifdef __linux__
+	#include <netinet/udp.h>
+  #endif
   #if !defined(MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
 	#include <signal.h>
   #endif
   #undef mutex
-  #if HAVE_TCP_INFO
-	#include <atomic>
+  #if HAVE_KTLS
+	#include <linux/tls.h>
+	#ifndef SOL_TLS
+	  #define SOL_TLS 282
+	#endif
   #endif
 #endif
 
 #include <assert.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+
 // Fixups needed on FreeBSD
 #if !defined(EAI_ADDRFAMILY) && defined(EAI_FAMILY)
   #define EAI_ADDRFAMILY EAI_FAMILY
@@ -50,6 +70,14 @@
 #define AI_NUMERICSERV 0
 #endif
 
+// Option for the kernel to distribute incoming connections across sockets listening on
+// the same port. Plain SO_REUSEPORT only balances the load on Linux.
+#if defined(SO_REUSEPORT_LB)
+  #define FZ_REUSEPORT_OPTION SO_REUSEPORT_LB
+#elif defined(SO_REUSEPORT) && defined(__linux__)
+  #define FZ_REUSEPORT_OPTION SO_REUSEPORT
+#endif
+
 #define WAIT_CONNECT 0x01
 #define WAIT_READ	 0x02
 #define WAIT_WRITE	 0x04
@@ -88,6 +116,33 @@ int get_rcv_wscale(int fd) {
 }
 
 #endif
+
+// Memory available to all sockets in adaptive buffer sizing mode
+std::atomic<uint64_t> adaptive_buffer_budget{256 * 1024 * 1024};
+std::atomic<uint64_t> adaptive_buffer_used{};
+
+bool reserve_adaptive_buffer(uint64_t size)
+{
+	uint64_t used = adaptive_buffer_used.load(std::memory_order_relaxed);
+	do {
+		if (used + size > adaptive_buffer_budget.load(std::memory_order_relaxed)) {
+			return false;
+		}
+	} while (!adaptive_buffer_used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+	return true;
+}
+
+void release_adaptive_buffer(uint64_t size)
+{
+	adaptive_buffer_used.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// Octets transferred between samples and the minimum sampling period
+uint64_t const adaptive_sample_octets = 256 * 1024;
+duration const adaptive_sample_period = duration::from_milliseconds(200);
+
+// Upper limit for a single buffer in adaptive mode
+uint64_t const adaptive_buffer_max = 32 * 1024 * 1024;
 }
 
 void remove_socket_events(event_handler * handler, socket_event_source const* const source)
@@ -109,7 +164,7 @@ void remove_socket_events(event_handler * handler, socket_event_source const* co
 		return false;
 	};
 
-	handler->event_loop_.filter_events(socket_event_filter);
+	handler->get_event_loop().filter_events(socket_event_filter);
 }
 
 socket_event_flag change_socket_event_handler(event_handler * old_handler, event_handler * new_handler, socket_event_source const* const source, socket_event_flag remove)
@@ -156,7 +211,7 @@ socket_event_flag change_socket_event_handler(event_handler * old_handler, event
 		return false;
 	};
 
-	old_handler->event_loop_.filter_events(socket_event_filter);
+	old_handler->get_event_loop().filter_events(socket_event_filter);
 	return ret;
 }
 
@@ -179,7 +234,7 @@ bool FZ_PRIVATE_SYMBOL has_pending_event(event_handler * handler, socket_event_s
 		return false;
 	};
 
-	handler->event_loop_.filter_events(socket_event_filter);
+	handler->get_event_loop().filter_events(socket_event_filter);
 
 	return ret;
 }
@@ -256,6 +311,20 @@ int last_socket_error()
 }
 #endif
 
+// With TCP Fast Open, the first write on a socket without a cookie for the server
+// only sends the SYN and fails with EINPROGRESS. Wait for the socket to become
+// writable like any other time the send buffer is full.
+int last_send_error()
+{
+	int err = last_socket_error();
+#ifdef TCP_FASTOPEN_CONNECT
+	if (err == EINPROGRESS) {
+		err = EAGAIN;
+	}
+#endif
+	return err;
+}
+
 #ifdef FZ_WINDOWS
 int set_nonblocking(socket::socket_t fd)
 {
@@ -312,6 +381,25 @@ int do_set_flags(socket::socket_t fd, int flags, int flags_mask, duration const&
 	return 0;
 }
 
+int do_set_cork(socket::socket_t fd, bool enable)
+{
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+	int const value = enable ? 1 : 0;
+#ifdef TCP_CORK
+	int res = setsockopt(fd, IPPROTO_TCP, TCP_CORK, (const char*)&value, sizeof(value));
+#else
+	int res = setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, (const char*)&value, sizeof(value));
+#endif
+	if (res != 0) {
+		return last_socket_error();
+	}
+#else
+	(void)fd;
+	(void)enable;
+#endif
+	return 0;
+}
+
 int do_set_buffer_sizes(socket::socket_t fd, int size_read, int size_write)
 {
 	int ret = 0;
@@ -379,11 +467,12 @@ winsock_initializer::~winsock_initializer()
 }
 #endif
 
-class socket_thread final
+class socket_thread final : public reactor_client
 {
 	friend class socket_base;
 	friend class socket;
 	friend class listen_socket;
+	friend class datagram_socket;
 public:
 	explicit socket_thread(socket_base* base)
 		: socket_(base)
@@ -397,7 +486,7 @@ public:
 		}
 	}
 
-	~socket_thread()
+	virtual ~socket_thread()
 	{
 		thread_.join();
 		close_socket_fds(fds_to_close_);
@@ -445,19 +534,30 @@ public:
 
 	int start()
 	{
-		if (thread_) {
+		if (thread_ || shard_) {
 			scoped_lock l(mutex_);
 			waiting_ = 0;
 			wakeup_thread(l);
 			return 0;
 		}
 
+		if (host_.empty()) {
+			// Nothing to resolve or connect, the reactor can wait for events right away
+			scoped_lock l(mutex_);
+			if (register_with_reactor(l)) {
+				return 0;
+			}
+		}
+
 		int res = create_sync();
 		if (res) {
 			return res;
 		}
 
-		thread_ = socket_->thread_pool_.spawn([this]() { entry(); });
+		// Hold the lock until thread_ is assigned. Otherwise, on fast connections, the
+		// handler could try to wake up the thread before it is known to be running.
+		scoped_lock l(mutex_);
+		thread_ = socket_->thread_pool_.spawn([this]() { entry(); }, "socket");
 
 		if (!thread_) {
 			return EMFILE;
@@ -475,6 +575,11 @@ public:
 
 	void wakeup_thread(scoped_lock & l)
 	{
+		if (shard_) {
+			update_registration(l);
+			return;
+		}
+
 		if (!thread_ || quit_) {
 			return;
 		}
@@ -482,6 +587,63 @@ public:
 		poller_.interrupt(l);
 	}
 
+	// Only call while locked
+	bool register_with_reactor(scoped_lock &)
+	{
+#ifndef FZ_WINDOWS
+		if (!socket_ || !socket_->reactor_ || socket_->fd_ == -1) {
+			return false;
+		}
+
+		reactor_shard* shard = socket_->reactor_->impl_->get_shard();
+		if (!shard || shard->add(*this, socket_->fd_, poll_events())) {
+			return false;
+		}
+
+		shard_ = shard;
+		registered_fd_ = socket_->fd_;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Only call while locked. Re-arms the one-shot registration
+	// with the reactor, or removes it once the socket got closed.
+	void update_registration(scoped_lock &)
+	{
+#ifndef FZ_WINDOWS
+		if (!socket_ || socket_->fd_ == -1 || socket_->fd_ != registered_fd_) {
+			if (registered_fd_ != -1) {
+				shard_->remove(registered_fd_);
+				registered_fd_ = -1;
+			}
+			close_socket_fds(fds_to_close_);
+			return;
+		}
+
+		if (waiting_) {
+			shard_->arm(*this, registered_fd_, poll_events());
+		}
+#endif
+	}
+
+	virtual void on_reactor_event(int revents) override
+	{
+#ifndef FZ_WINDOWS
+		scoped_lock l(mutex_);
+		if (should_quit() || socket_->fd_ == -1 || socket_->fd_ != registered_fd_) {
+			return;
+		}
+
+		handle_revents(revents);
+		send_events();
+		update_registration(l);
+#else
+		(void)revents;
+#endif
+	}
+
 protected:
 	static socket::socket_t create_socket_fd(addrinfo const& addr)
 	{
@@ -517,35 +679,38 @@ protected:
 		return fd;
 	}
 
-	int try_connect_host(addrinfo & addr, sockaddr_u const& bindAddr, scoped_lock & l)
+	// Creates a socket for the address and starts connecting it. Returns the descriptor,
+	// or -1 if the attempt failed right away. Error is EINPROGRESS while still connecting.
+	socket::socket_t start_connect(addrinfo const& addr, sockaddr_u const& bindAddr, int & error)
 	{
-		if (socket_->evt_handler_) {
-			socket_->evt_handler_->send_event<hostaddress_event>(socket_->ev_source_, socket::address_to_string(addr.ai_addr, addr.ai_addrlen));
-		}
-
-		socket_->fd_ = create_socket_fd(addr);
-		if (socket_->fd_ == -1) {
-			if (socket_->evt_handler_) {
-				socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, addr.ai_next ? socket_event_flag::connection_next : socket_event_flag::connection, last_socket_error());
-			}
-
-			return 0;
+		socket::socket_t fd = create_socket_fd(addr);
+		if (fd == -1) {
+			error = last_socket_error();
+			return fd;
 		}
 
 		if (bindAddr.sockaddr_.sa_family != AF_UNSPEC && bindAddr.sockaddr_.sa_family == addr.ai_family) {
-			(void)::bind(socket_->fd_, &bindAddr.sockaddr_, sizeof(bindAddr));
+			(void)::bind(fd, &bindAddr.sockaddr_, sizeof(bindAddr));
 		}
 
 		auto* s = static_cast<socket*>(socket_);
-		do_set_flags(socket_->fd_, s->flags_, s->flags_, s->keepalive_interval_);
-		do_set_buffer_sizes(socket_->fd_, socket_->buffer_sizes_[0], socket_->buffer_sizes_[1]);
+		do_set_flags(fd, s->flags_, s->flags_, s->keepalive_interval_);
+		do_set_buffer_sizes(fd, socket_->buffer_sizes_[0], socket_->buffer_sizes_[1]);
+
+#ifdef TCP_FASTOPEN_CONNECT
+		if (s->flags_ & socket::flag_fast_open) {
+			// Falls back to a regular connect if not possible
+			int const enable = 1;
+			(void)setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable));
+		}
+#endif
 
-		int res = ::connect(socket_->fd_, addr.ai_addr, addr.ai_addrlen);
+		int res = ::connect(fd, addr.ai_addr, addr.ai_addrlen);
 		if (res == -1) {
 #ifdef FZ_WINDOWS
 			// Map to POSIX error codes
-			int error = WSAGetLastError();
-			if (error == WSAEWOULDBLOCK) {
+			int wsa_error = WSAGetLastError();
+			if (wsa_error == WSAEWOULDBLOCK) {
 				res = EINPROGRESS;
 			}
 			else {
@@ -556,58 +721,164 @@ protected:
 #endif
 		}
 
-		while (res == EINPROGRESS) {
-			bool wait_successful;
-			do {
-				wait_successful = do_wait(WAIT_CONNECT, l);
-				if ((triggered_ & WAIT_CONNECT)) {
-					break;
-				}
-			} while (wait_successful);
+		error = res;
+		if (res && res != EINPROGRESS) {
+			close_socket_fd(fd);
+		}
+		return fd;
+	}
 
-			if (!wait_successful) {
-				if (socket_) {
-					close_socket_fd(socket_->fd_);
-				}
-				return -1;
-			}
-			triggered_ &= ~WAIT_CONNECT;
+	// Only call while locked
+	void connection_established(socket::socket_t fd, int family)
+	{
+		socket_->fd_ = fd;
+		static_cast<socket*>(socket_)->state_ = socket_state::connected;
+		if (socket_->family_ == AF_UNSPEC) {
+			socket_->family_ = family;
+		}
+#if HAVE_TCP_INFO
+		if (socket_->buffer_sizes_[0] == -1 && !unmodified_rcv_wscale) {
+			unmodified_rcv_wscale = get_rcv_wscale(socket_->fd_);
+		}
+		else if (socket_->buffer_sizes_[0] != -1 && !modified_rcv_wscale) {
+			modified_rcv_wscale = get_rcv_wscale(socket_->fd_);
+		}
+#endif
 
-			res = triggered_errors_[0];
+		if (socket_->evt_handler_) {
+			socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, socket_event_flag::connection, 0);
 		}
 
-		if (res) {
-			if (socket_->evt_handler_) {
-				socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, addr.ai_next ? socket_event_flag::connection_next : socket_event_flag::connection, res);
+		// We're now interested in all the other nice events
+		waiting_ |= WAIT_READ;
+	}
+
+	// Only call while locked
+	bool connect_aborted() const
+	{
+		// Either close() was called, or close() followed by connect()
+		return should_quit() || static_cast<socket*>(socket_)->state_ != socket_state::connecting || !host_.empty();
+	}
+
+	/* Tries the addresses in order. As per RFC 8305, if an attempt has not completed
+	 * after the delay, the next attempt is started while the previous ones keep going.
+	 * The first attempt to succeed wins, all others get closed. A failed attempt starts
+	 * the next one right away. Without delay, each attempt has to fail before the next one
+	 * gets started.
+	 *
+	 * Returns 1 on success, 0 if all attempts failed, -1 if aborted.
+	 */
+	int race_connect(std::vector<addrinfo*> const& addrs, sockaddr_u const& bindAddr, duration const& delay, scoped_lock & l)
+	{
+		struct attempt
+		{
+			socket::socket_t fd_;
+			addrinfo const* addr_;
+		};
+		std::vector<attempt> attempts;
+
+		auto close_attempts = [&attempts]() {
+			for (auto & a : attempts) {
+				close_socket_fd(a.fd_);
 			}
+			attempts.clear();
+		};
 
-			close_socket_fd(socket_->fd_);
-		}
-		else {
-			static_cast<socket*>(socket_)->state_ = socket_state::connected;
-			if (socket_->family_ == AF_UNSPEC) {
-				socket_->family_ = addr.ai_family;
+		size_t next{};
+		auto failed = [&](int error, size_t pending) {
+			if (socket_->evt_handler_) {
+				bool const more = next < addrs.size() || pending;
+				socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, more ? socket_event_flag::connection_next : socket_event_flag::connection, error);
 			}
-#if HAVE_TCP_INFO
-			if (socket_->buffer_sizes_[0] == -1 && !unmodified_rcv_wscale) {
-				unmodified_rcv_wscale = get_rcv_wscale(socket_->fd_);
+		};
+
+		monotonic_clock next_start;
+		for (;;) {
+			auto now = monotonic_clock::now();
+			while (next < addrs.size() && (attempts.empty() || (delay && now >= next_start))) {
+				addrinfo const& addr = *addrs[next++];
+				if (socket_->evt_handler_) {
+					socket_->evt_handler_->send_event<hostaddress_event>(socket_->ev_source_, socket::address_to_string(addr.ai_addr, addr.ai_addrlen));
+				}
+
+				int error;
+				socket::socket_t fd = start_connect(addr, bindAddr, error);
+				if (!error) {
+					close_attempts();
+					connection_established(fd, addr.ai_family);
+					return 1;
+				}
+				if (fd == -1) {
+					failed(error, attempts.size());
+				}
+				else {
+					attempts.push_back({fd, &addr});
+					next_start = now + delay;
+				}
 			}
-			else if (socket_->buffer_sizes_[0] != -1 && !modified_rcv_wscale) {
-				modified_rcv_wscale = get_rcv_wscale(socket_->fd_);
+
+			if (attempts.empty()) {
+				return 0;
 			}
-#endif
 
-			if (socket_->evt_handler_) {
-				socket_->evt_handler_->send_event<socket_event>(socket_->ev_source_, socket_event_flag::connection, 0);
+			duration timeout;
+			if (delay && next < addrs.size()) {
+				timeout = std::max(next_start - now, duration::from_milliseconds(1));
 			}
 
-			// We're now interested in all the other nice events
-			waiting_ |= WAIT_READ;
+#ifdef FZ_WINDOWS
+			std::vector<pollinfo> fds(attempts.size());
+			for (size_t i = 0; i < attempts.size(); ++i) {
+				fds[i].fd_ = attempts[i].fd_;
+				fds[i].events_ = FD_CONNECT;
+			}
+			bool res = poller_.wait(fds.data(), fds.size(), l, timeout);
+#else
+			std::vector<pollfd> fds(attempts.size() + 1);
+			for (size_t i = 0; i < attempts.size(); ++i) {
+				fds[i].fd = attempts[i].fd_;
+				fds[i].events = POLLOUT;
+			}
+			bool res = poller_.wait(fds.data(), attempts.size(), l, timeout);
+#endif
+			if (!res || connect_aborted()) {
+				close_attempts();
+				return -1;
+			}
 
-			return 1;
+			size_t remaining{};
+			for (size_t i = 0; i < attempts.size(); ++i) {
+				auto & a = attempts[i];
+#ifdef FZ_WINDOWS
+				if (!(fds[i].result_.lNetworkEvents & FD_CONNECT)) {
+					attempts[remaining++] = a;
+					continue;
+				}
+				int error = convert_msw_error_code(fds[i].result_.iErrorCode[FD_CONNECT_BIT]);
+#else
+				if (!(fds[i].revents & (POLLOUT|POLLERR|POLLHUP))) {
+					attempts[remaining++] = a;
+					continue;
+				}
+				int error;
+				socklen_t len = sizeof(error);
+				if (getsockopt(a.fd_, SOL_SOCKET, SO_ERROR, &error, &len)) {
+					error = errno;
+				}
+#endif
+				if (!error) {
+					socket::socket_t const fd = a.fd_;
+					int const family = a.addr_->ai_family;
+					a.fd_ = -1;
+					close_attempts();
+					connection_established(fd, family);
+					return 1;
+				}
+				close_socket_fd(a.fd_);
+				failed(error, remaining + attempts.size() - i - 1);
+			}
+			attempts.resize(remaining);
 		}
-
-		return 0;
 	}
 
 	// Only call while locked
@@ -640,25 +911,17 @@ protected:
 			}
 		}
 
-		addrinfo hints{};
-		hints.ai_family = socket_->family_;
+		int const family = socket_->family_;
 
 		l.unlock();
 
-		hints.ai_socktype = SOCK_STREAM;
-#ifdef AI_IDN
-		hints.ai_flags |= AI_IDN;
-#endif
-
-		addrinfo *addressList{};
-		int res = getaddrinfo(host.c_str(), port.c_str(), &hints, &addressList);
+		// Possibly served from the resolver cache
+		std::vector<resolved_address> resolved;
+		int res = resolve_host(host, family, resolved);
 
 		l.lock();
 
 		if (should_quit()) {
-			if (!res && addressList) {
-				freeaddrinfo(addressList);
-			}
 			return false;
 		}
 
@@ -667,9 +930,6 @@ protected:
 		// afterwards, state is back at connecting.
 		// In either case, we need to abort this connection attempt.
 		if (static_cast<socket*>(socket_)->state_ != socket_state::connecting || !host_.empty()) {
-			if (!res && addressList) {
-				freeaddrinfo(addressList);
-			}
 			return false;
 		}
 
@@ -686,11 +946,42 @@ protected:
 			return false;
 		}
 
-		res = 0;
-		for (addrinfo *addr = addressList; addr && !res; addr = addr->ai_next) {
-			res = try_connect_host(*addr, bindAddr, l);
+		uint16_t const port_number = htons(fz::to_integral<uint16_t>(port));
+		std::vector<addrinfo> infos(resolved.size());
+		for (size_t i = 0; i < resolved.size(); ++i) {
+			auto & a = resolved[i];
+			auto & info = infos[i];
+			info.ai_family = a.family_;
+			info.ai_socktype = SOCK_STREAM;
+			info.ai_protocol = a.protocol_;
+			info.ai_addr = reinterpret_cast<sockaddr*>(a.storage_);
+			info.ai_addrlen = a.size_;
+			if (a.family_ == AF_INET) {
+				reinterpret_cast<sockaddr_in*>(a.storage_)->sin_port = port_number;
+			}
+			else if (a.family_ == AF_INET6) {
+				reinterpret_cast<sockaddr_in6*>(a.storage_)->sin6_port = port_number;
+			}
 		}
-		freeaddrinfo(addressList);
+
+		// Interleave the address families as per RFC 8305, starting with the preferred
+		// family of the first address, so that a broken family cannot stall the others.
+		std::vector<addrinfo*> addrs;
+		std::vector<addrinfo*> others;
+		for (auto & info : infos) {
+			addrinfo* addr = &info;
+			if (addr->ai_family == infos.front().ai_family) {
+				addrs.push_back(addr);
+			}
+			else {
+				others.push_back(addr);
+			}
+		}
+		for (size_t i = 0; i < others.size(); ++i) {
+			addrs.insert(addrs.begin() + std::min(2 * i + 1, addrs.size()), others[i]);
+		}
+
+		res = race_connect(addrs, bindAddr, static_cast<socket*>(socket_)->connection_attempt_delay_, l);
 		if (res == 1) {
 			return true;
 		}
@@ -781,61 +1072,75 @@ protected:
 #else
 			pollfd fds[2]{};
 			fds[0].fd = socket_->fd_;
-			fds[0].events = 0;
+			fds[0].events = poll_events();
 
-			if (waiting_ & (WAIT_READ|WAIT_ACCEPT)) {
-				fds[0].events |= POLLIN;
-			}
-			if (waiting_ & (WAIT_WRITE | WAIT_CONNECT)) {
-				fds[0].events |= POLLOUT;
-			}
 			bool res = poller_.wait(fds, 1, l);
 
 			if (!res || should_quit() || socket_->fd_ == -1) {
 				return false;
 			}
 
-			int const revents = fds[0].revents;
-			if (waiting_ & WAIT_CONNECT) {
-				if (revents & (POLLOUT|POLLERR|POLLHUP)) {
-					int error;
-					socklen_t len = sizeof(error);
-					int getsockopt_res = getsockopt(socket_->fd_, SOL_SOCKET, SO_ERROR, &error, &len);
-					if (getsockopt_res) {
-						error = errno;
-					}
-					triggered_ |= WAIT_CONNECT;
-					triggered_errors_[0] = error;
-					waiting_ &= ~WAIT_CONNECT;
-				}
+			handle_revents(fds[0].revents);
+
+			if (triggered_ || !waiting_) {
+				return true;
 			}
-			else if (waiting_ & WAIT_ACCEPT) {
-				if (revents & POLLIN) {
-					triggered_ |= WAIT_ACCEPT;
-					waiting_ &= ~WAIT_ACCEPT;
+#endif
+		}
+	}
+
+#ifndef FZ_WINDOWS
+	// The poll events corresponding to what we are waiting for
+	short poll_events() const
+	{
+		short events{};
+		if (waiting_ & (WAIT_READ|WAIT_ACCEPT)) {
+			events |= POLLIN;
+		}
+		if (waiting_ & (WAIT_WRITE | WAIT_CONNECT)) {
+			events |= POLLOUT;
+		}
+		return events;
+	}
+
+	// Call only while locked
+	void handle_revents(int const revents)
+	{
+		if (waiting_ & WAIT_CONNECT) {
+			if (revents & (POLLOUT|POLLERR|POLLHUP)) {
+				int error;
+				socklen_t len = sizeof(error);
+				int getsockopt_res = getsockopt(socket_->fd_, SOL_SOCKET, SO_ERROR, &error, &len);
+				if (getsockopt_res) {
+					error = errno;
 				}
+				triggered_ |= WAIT_CONNECT;
+				triggered_errors_[0] = error;
+				waiting_ &= ~WAIT_CONNECT;
 			}
-			else {
-				if (waiting_ & WAIT_READ) {
-					if (revents & (POLLIN|POLLHUP|POLLERR)) {
-						triggered_ |= WAIT_READ;
-						waiting_ &= ~WAIT_READ;
-					}
-				}
-				if (waiting_ & WAIT_WRITE) {
-					if (revents & (POLLOUT|POLLERR|POLLHUP)) {
-						triggered_ |= WAIT_WRITE;
-						waiting_ &= ~WAIT_WRITE;
-					}
+		}
+		else if (waiting_ & WAIT_ACCEPT) {
+			if (revents & POLLIN) {
+				triggered_ |= WAIT_ACCEPT;
+				waiting_ &= ~WAIT_ACCEPT;
+			}
+		}
+		else {
+			if (waiting_ & WAIT_READ) {
+				if (revents & (POLLIN|POLLHUP|POLLERR)) {
+					triggered_ |= WAIT_READ;
+					waiting_ &= ~WAIT_READ;
 				}
 			}
-
-			if (triggered_ || !waiting_) {
-				return true;
+			if (waiting_ & WAIT_WRITE) {
+				if (revents & (POLLOUT|POLLERR|POLLHUP)) {
+					triggered_ |= WAIT_WRITE;
+					waiting_ &= ~WAIT_WRITE;
+				}
 			}
-#endif
 		}
 	}
+#endif
 
 	void send_events()
 	{
@@ -883,7 +1188,8 @@ protected:
 				break;
 			}
 
-			if (dynamic_cast<listen_socket*>(socket_)) {
+			if (!dynamic_cast<socket*>(socket_)) {
+				// Listen and datagram sockets only wait for events
 				while (idle_loop(l)) {
 					if (socket_->fd_ == -1) {
 						waiting_ = 0;
@@ -900,6 +1206,11 @@ protected:
 					if (!do_connect(l)) {
 						continue;
 					}
+					if (register_with_reactor(l)) {
+						// Connection is established, the reactor takes over from here
+						// and this thread goes back into the pool.
+						return;
+					}
 				}
 
 				while (idle_loop(l)) {
@@ -943,6 +1254,10 @@ protected:
 
 	poller poller_;
 
+	// Set once waiting is done by the reactor
+	reactor_shard* shard_{};
+	socket::socket_t registered_fd_{-1};
+
 	// The socket events we are waiting for
 	int waiting_{};
 
@@ -965,6 +1280,12 @@ socket_base::socket_base(thread_pool& pool, event_handler* evt_handler, socket_e
 	buffer_sizes_[1] = -1;
 }
 
+socket_base::socket_base(reactor& r, event_handler* evt_handler, socket_event_source* ev_source)
+	: socket_base(r.pool(), evt_handler, ev_source)
+{
+	reactor_ = &r;
+}
+
 void socket_base::detach_thread(scoped_lock & l)
 {
 	if (!socket_thread_) {
@@ -972,7 +1293,17 @@ void socket_base::detach_thread(scoped_lock & l)
 	}
 
 	socket_thread_->set_socket(nullptr, l);
-	if (socket_thread_->quit_) {
+	if (socket_thread_->shard_) {
+		// Events may still be in flight in the reactor, let it delete the
+		// socket_thread once that is no longer the case.
+		auto thread = socket_thread_;
+		socket_thread_ = nullptr;
+		thread->quit_ = true;
+		thread->update_registration(l);
+		l.unlock();
+		thread->shard_->retire(thread);
+	}
+	else if (socket_thread_->quit_) {
 		socket_thread_->wakeup_thread(l);
 		l.unlock();
 		delete socket_thread_;
@@ -1015,8 +1346,9 @@ int socket_base::close()
 
 	if (dynamic_cast<socket*>(this)) {
 		static_cast<socket*>(this)->state_ = socket_state::closed;
+		static_cast<socket*>(this)->corked_ = false;
 	}
-	else {
+	else if (dynamic_cast<listen_socket*>(this)) {
 		static_cast<listen_socket*>(this)->state_ = listen_socket_state{};
 	}
 
@@ -1219,6 +1551,12 @@ listen_socket::listen_socket(thread_pool & pool, event_handler* evt_handler)
 {
 }
 
+listen_socket::listen_socket(reactor & r, event_handler* evt_handler)
+	: socket_base(r, evt_handler, this)
+	, socket_event_source(this)
+{
+}
+
 listen_socket::~listen_socket()
 {
 	if (state_ != listen_socket_state{}) {
@@ -1304,6 +1642,17 @@ int listen_socket::listen(address_type family, int port)
 				setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char const*>(&enable), sizeof(enable));
 			}
 
+			if (reuse_port_) {
+#ifdef FZ_REUSEPORT_OPTION
+				int enable = 1;
+				if (setsockopt(fd_, SOL_SOCKET, FZ_REUSEPORT_OPTION, reinterpret_cast<char const*>(&enable), sizeof(enable))) {
+					reuse_port_ = false;
+				}
+#else
+				reuse_port_ = false;
+#endif
+			}
+
 			res = ::bind(fd_, addr->ai_addr, addr->ai_addrlen);
 			if (!res) {
 				break;
@@ -1318,6 +1667,13 @@ int listen_socket::listen(address_type family, int port)
 		}
 	}
 
+#ifdef TCP_FASTOPEN
+	if (fast_open_queue_length_ > 0) {
+		// Not fatal, connections get accepted without it
+		(void)setsockopt(fd_, IPPROTO_TCP, TCP_FASTOPEN, reinterpret_cast<char const*>(&fast_open_queue_length_), sizeof(fast_open_queue_length_));
+	}
+#endif
+
 	int res = ::listen(fd_, 64);
 	if (res) {
 		res = last_socket_error();
@@ -1325,6 +1681,33 @@ int listen_socket::listen(address_type family, int port)
 		return res;
 	}
 
+	return start_listening();
+}
+
+int listen_socket::listen_shared(listen_socket const& other)
+{
+	if (state_ != listen_socket_state{}) {
+		return EALREADY;
+	}
+	if (other.fd_ == -1) {
+		return EBADF;
+	}
+
+#ifdef FZ_WINDOWS
+	return EOPNOTSUPP;
+#else
+	fd_ = fcntl(other.fd_, F_DUPFD_CLOEXEC, 0);
+	if (fd_ == -1) {
+		return errno;
+	}
+	family_ = other.family_;
+
+	return start_listening();
+#endif
+}
+
+int listen_socket::start_listening()
+{
 	state_ = listen_socket_state::listening;
 
 	socket_thread_->waiting_ = WAIT_ACCEPT;
@@ -1345,7 +1728,13 @@ std::unique_ptr<socket> listen_socket::accept(int &error, fz::event_handler * ha
 		return std::unique_ptr<socket>();
 	}
 
-	auto ret = socket::from_descriptor(std::move(desc), thread_pool_, error, handler);
+	std::unique_ptr<socket> ret;
+	if (reactor_) {
+		ret = socket::from_descriptor(std::move(desc), *reactor_, error, handler);
+	}
+	else {
+		ret = socket::from_descriptor(std::move(desc), thread_pool_, error, handler);
+	}
 	if (!ret) {
 		error = ENOMEM;
 	}
@@ -1366,29 +1755,86 @@ socket_descriptor listen_socket::fast_accept(int &error)
 		socket_thread_->waiting_ |= WAIT_ACCEPT;
 		socket_thread_->wakeup_thread(l);
 
-#if HAVE_ACCEPT4
-		fd = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
-		if (fd == -1 && errno == ENOSYS)
-#endif
-		{
-#if !defined(FZ_WINDOWS)
-			forkblock b;
+		fd = do_accept(error, false);
+	}
+
+	return socket_descriptor(fd);
+}
+
+listen_socket::socket_t listen_socket::do_accept(int& error, bool nonblocking)
+{
+	socket_t fd;
+
+#if HAVE_ACCEPT4
+	fd = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+	if (fd == -1 && errno == ENOSYS)
 #endif
-			fd = ::accept(fd_, nullptr, nullptr);
+	{
 #if !defined(FZ_WINDOWS)
-			set_cloexec(fd);
+		forkblock b;
+#endif
+		fd = ::accept(fd_, nullptr, nullptr);
+#if !defined(FZ_WINDOWS)
+		set_cloexec(fd);
 #endif
+		if (nonblocking && fd != -1) {
+			set_nonblocking(fd);
 		}
+	}
 
-		if (fd == -1) {
-			error = errno;
+	if (fd == -1) {
+		error = errno;
+	}
+	else {
+		do_set_buffer_sizes(fd, buffer_sizes_[0], buffer_sizes_[1]);
+	}
+
+	return fd;
+}
+
+std::vector<std::unique_ptr<socket>> listen_socket::accept_pending(int& error, size_t max, fz::event_handler * handler)
+{
+	std::vector<std::unique_ptr<socket>> ret;
+	if (!socket_thread_) {
+		error = ENOTSOCK;
+		return ret;
+	}
+
+	std::vector<socket_descriptor> descriptors;
+	{
+		scoped_lock l(socket_thread_->mutex_);
+		for (size_t i = 0; i < max; ++i) {
+			socket_t fd = do_accept(error, true);
+			if (fd == -1) {
+				break;
+			}
+			descriptors.emplace_back(fd);
 		}
+
+		// Connections arriving from now on will trigger a new event
+		socket_thread_->waiting_ |= WAIT_ACCEPT;
+		socket_thread_->wakeup_thread(l);
 	}
 
-	if (fd != -1) {
-		do_set_buffer_sizes(fd, buffer_sizes_[0], buffer_sizes_[1]);
+	ret.reserve(descriptors.size());
+	for (auto & desc : descriptors) {
+		std::unique_ptr<socket> s;
+		if (reactor_) {
+			s = std::make_unique<socket>(*reactor_, nullptr);
+		}
+		else {
+			s = std::make_unique<socket>(thread_pool_, nullptr);
+		}
+		s = socket::adopt_descriptor(std::move(s), std::move(desc), error, handler, true);
+		if (s) {
+			ret.emplace_back(std::move(s));
+		}
 	}
-	return socket_descriptor(fd);
+	if (!ret.empty()) {
+		error = 0;
+	}
+
+	return ret;
 }
 
 listen_socket_state listen_socket::get_state() const
@@ -1403,14 +1849,90 @@ listen_socket_state listen_socket::get_state() const
 
 
 
-socket::socket(thread_pool & pool, event_handler* evt_handler)
+static_assert(sizeof(sockaddr_storage) <= 128, "datagram_address storage too small");
+
+datagram_address datagram_address::from_ip(std::string const& ip, unsigned int port)
+{
+	datagram_address ret;
+	if (port > 65535) {
+		return ret;
+	}
+
+	addrinfo hints{};
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	addrinfo* addressList{};
+	int res = getaddrinfo(ip.c_str(), fz::to_string(port).c_str(), &hints, &addressList);
+	if (!res && addressList) {
+		if (addressList->ai_addr && addressList->ai_addrlen <= sizeof(ret.storage_)) {
+			memcpy(ret.storage_, addressList->ai_addr, addressList->ai_addrlen);
+			ret.size_ = static_cast<unsigned int>(addressList->ai_addrlen);
+		}
+		freeaddrinfo(addressList);
+	}
+
+	return ret;
+}
+
+std::string datagram_address::ip(bool strip_zone_index) const
+{
+	if (!size_) {
+		return std::string();
+	}
+
+	return socket_base::address_to_string(reinterpret_cast<sockaddr const*>(storage_), static_cast<int>(size_), false, strip_zone_index);
+}
+
+int datagram_address::port() const
+{
+	sockaddr_u addr{};
+	memcpy(&addr.storage, storage_, size_);
+
+	switch (addr.sockaddr_.sa_family) {
+	case AF_INET:
+		return ntohs(addr.in4.sin_port);
+	case AF_INET6:
+		return ntohs(addr.in6.sin6_port);
+	default:
+		return -1;
+	}
+}
+
+address_type datagram_address::family() const
+{
+	sockaddr_u addr{};
+	memcpy(&addr.storage, storage_, size_);
+
+	switch (addr.sockaddr_.sa_family) {
+	case AF_INET:
+		return address_type::ipv4;
+	case AF_INET6:
+		return address_type::ipv6;
+	default:
+		return address_type::unknown;
+	}
+}
+
+bool datagram_address::operator==(datagram_address const& rhs) const
+{
+	return size_ == rhs.size_ && !memcmp(storage_, rhs.storage_, size_);
+}
+
+
+datagram_socket::datagram_socket(thread_pool & pool, event_handler* evt_handler)
 	: socket_base(pool, evt_handler, this)
-	, socket_interface(this)
-	, keepalive_interval_(duration::from_hours(2))
+	, socket_event_source(this)
 {
 }
 
-socket::~socket()
+datagram_socket::datagram_socket(reactor & r, event_handler* evt_handler)
+	: socket_base(r, evt_handler, this)
+	, socket_event_source(this)
+{
+}
+
+datagram_socket::~datagram_socket()
 {
 	close();
 
@@ -1418,178 +1940,1202 @@ socket::~socket()
 	detach_thread(l);
 }
 
-std::unique_ptr<socket> socket::from_descriptor(socket_descriptor && desc, thread_pool & pool, int & error, fz::event_handler * handler)
+void datagram_socket::close()
 {
-	if (!desc) {
-		error = ENOTSOCK;
-		return nullptr;
+	if (open_) {
+		socket_base::close();
+		open_ = false;
 	}
+}
 
-	socket_t fd = desc.detach();
+bool datagram_socket::is_open() const
+{
+	return open_;
+}
 
-#if defined(SO_NOSIGPIPE) && !defined(MSG_NOSIGNAL)
-	// We do not want SIGPIPE if writing to socket.
-	const int value = 1;
-	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(int));
+void datagram_socket::set_event_handler(event_handler* pEvtHandler)
+{
+	if (!socket_thread_) {
+		return;
+	}
+
+	scoped_lock l(socket_thread_->mutex_);
+
+	if (evt_handler_ == pEvtHandler) {
+		return;
+	}
+
+	change_socket_event_handler(evt_handler_, pEvtHandler, ev_source_, fz::socket_event_flag{});
+
+	evt_handler_ = pEvtHandler;
+}
+
+int datagram_socket::open(address_type family, int port)
+{
+	if (!socket_thread_) {
+		return ENOTSOCK;
+	}
+
+	if (open_) {
+		return EALREADY;
+	}
+
+	if (port < 0 || port > 65535) {
+		return EINVAL;
+	}
+
+	switch (family)
+	{
+	case address_type::unknown:
+		family_ = AF_UNSPEC;
+		break;
+	case address_type::ipv4:
+		family_ = AF_INET;
+		break;
+	case address_type::ipv6:
+		family_ = AF_INET6;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	addrinfo hints = {};
+	hints.ai_family = family_;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+
+	std::string portstring = fz::to_string(port);
+
+	addrinfo* addressList = nullptr;
+
+	int res = getaddrinfo(socket_thread_->bind_.empty() ? nullptr : socket_thread_->bind_.c_str(), portstring.c_str(), &hints, &addressList);
+	if (res) {
+#ifdef FZ_WINDOWS
+		return convert_msw_error_code(res);
+#else
+		return res;
 #endif
+	}
 
-	set_nonblocking(fd);
+	for (addrinfo* addr = addressList; addr; addr = addr->ai_next) {
+		fd_ = socket_thread::create_socket_fd(*addr);
+		res = last_socket_error();
 
-	auto pSocket = std::make_unique<socket>(pool, nullptr);
-	if (!pSocket->socket_thread_) {
-		error = ENOMEM;
-		pSocket.reset();
+		if (fd_ == -1) {
+			continue;
+		}
+
+		if (addr->ai_family == AF_INET6) {
+			int enable = 1;
+			setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char const*>(&enable), sizeof(enable));
+		}
+
+		res = ::bind(fd_, addr->ai_addr, addr->ai_addrlen);
+		if (!res) {
+			family_ = addr->ai_family;
+			break;
+		}
+
+		res = last_socket_error();
+		close_socket_fd(fd_);
+	}
+	freeaddrinfo(addressList);
+	if (fd_ == -1) {
+		return res;
 	}
-	else {
-		pSocket->state_ = socket_state::connected;
-		pSocket->fd_ = fd;
-		fd = -1;
-		pSocket->host_ = to_native(pSocket->peer_ip());
-		pSocket->evt_handler_ = handler;
-		pSocket->socket_thread_->waiting_ = WAIT_READ;
 
-		sockaddr_u addr;
-		socklen_t addr_len = sizeof(addr);
-		if (!getsockname(pSocket->fd_, &addr.sockaddr_, &addr_len)) {
-			pSocket->family_ = addr.sockaddr_.sa_family;
+	do_set_buffer_sizes(fd_, buffer_sizes_[0], buffer_sizes_[1]);
+
+	open_ = true;
+	socket_thread_->waiting_ = WAIT_READ;
+
+	if (socket_thread_->start()) {
+		open_ = false;
+		close_socket_fd(fd_);
+		return EMFILE;
+	}
+
+	return 0;
+}
+
+namespace {
+// Datagrams handled by a single recvmmsg/sendmmsg call
+size_t const max_datagram_batch = 64;
+
+#ifdef UDP_SEGMENT
+// Limits for a single segmentation offload send
+size_t const max_gso_segments = 64;
+size_t const max_gso_size = 65000;
+#endif
+}
+
+int datagram_socket::receive(datagram * datagrams, size_t count, size_t max_size, int& error)
+{
+	if (!socket_thread_ || !open_) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+	if (!count) {
+		error = 0;
+		return 0;
+	}
+
+	count = std::min(count, max_datagram_batch);
+	if (max_size > static_cast<size_t>(std::numeric_limits<int>::max())) {
+		max_size = static_cast<size_t>(std::numeric_limits<int>::max());
+	}
+
+	int res{};
+#if HAVE_RECVMMSG
+	mmsghdr msgs[max_datagram_batch];
+	iovec iovs[max_datagram_batch];
+	for (size_t i = 0; i < count; ++i) {
+		auto & d = datagrams[i];
+		d.data.clear();
+		iovs[i].iov_base = d.data.get(max_size);
+		iovs[i].iov_len = max_size;
+
+		msgs[i] = mmsghdr{};
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = d.peer.storage_;
+		msgs[i].msg_hdr.msg_namelen = sizeof(d.peer.storage_);
+	}
+
+	do {
+		res = recvmmsg(fd_, msgs, static_cast<unsigned int>(count), 0, nullptr);
+	} while (res == -1 && errno == EINTR);
+
+	for (int i = 0; i < res; ++i) {
+		datagrams[i].data.add(msgs[i].msg_len);
+		datagrams[i].peer.size_ = msgs[i].msg_hdr.msg_namelen;
+	}
+#else
+	for (size_t i = 0; i < count; ++i) {
+		auto & d = datagrams[i];
+		d.data.clear();
+		socklen_t len = sizeof(d.peer.storage_);
+		int r = recvfrom(fd_, reinterpret_cast<char*>(d.data.get(max_size)), static_cast<int>(max_size), 0, reinterpret_cast<sockaddr*>(d.peer.storage_), &len);
+		if (r == -1) {
+#ifdef FZ_WINDOWS
+			// Truncated datagram
+			if (WSAGetLastError() == WSAEMSGSIZE) {
+				r = static_cast<int>(max_size);
+			}
+			else
+#endif
+			{
+				if (!i) {
+					res = -1;
+				}
+				break;
+			}
 		}
-		if (pSocket->socket_thread_->start()) {
-			error = ENOMEM;
-			pSocket.reset();
+		d.data.add(static_cast<size_t>(r));
+		d.peer.size_ = static_cast<unsigned int>(len);
+		++res;
+	}
+#endif
+
+	if (res == -1) {
+		error = last_socket_error();
+		if (error == EAGAIN) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_READ)) {
+				socket_thread_->waiting_ |= WAIT_READ;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+	}
+
+	return res;
+}
+
+int datagram_socket::send(datagram const* datagrams, size_t count, int& error)
+{
+	if (!socket_thread_ || !open_) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+	if (!count) {
+		error = 0;
+		return 0;
+	}
+
+	int res = do_send(datagrams, std::min(count, max_datagram_batch), error);
+	if (res == -1) {
+		if (error == EAGAIN) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+				socket_thread_->waiting_ |= WAIT_WRITE;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+	}
+
+	return res;
+}
+
+int datagram_socket::do_send(datagram const* datagrams, size_t count, int& error)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+
+#if HAVE_SENDMMSG
+	mmsghdr msgs[max_datagram_batch];
+	iovec iovs[max_datagram_batch];
+
+	// Index of the first datagram of each message
+	size_t first[max_datagram_batch + 1];
+
+#ifdef UDP_SEGMENT
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		cmsghdr align;
+	} control[max_datagram_batch];
+#endif
+
+	size_t n{};
+	for (size_t i = 0; i < count; ) {
+		auto const& d = datagrams[i];
+		first[n] = i;
+
+		msgs[n] = mmsghdr{};
+		auto & hdr = msgs[n].msg_hdr;
+		hdr.msg_name = const_cast<unsigned char*>(d.peer.storage_);
+		hdr.msg_namelen = d.peer.size_;
+		hdr.msg_iov = &iovs[i];
+
+		iovs[i].iov_base = const_cast<unsigned char*>(d.data.get());
+		iovs[i].iov_len = d.data.size();
+		++i;
+
+#ifdef UDP_SEGMENT
+		// Coalesce further datagrams of the same size to the same peer, only the last may be shorter.
+		size_t const segment = d.data.size();
+		size_t total = segment;
+		if (gso_ && segment) {
+			while (i < count && i - first[n] < max_gso_segments) {
+				auto const& next = datagrams[i];
+				size_t const size = next.data.size();
+				if (!size || size > segment || total + size > max_gso_size || next.peer != d.peer) {
+					break;
+				}
+				iovs[i].iov_base = const_cast<unsigned char*>(next.data.get());
+				iovs[i].iov_len = size;
+				total += size;
+				++i;
+				if (size < segment) {
+					break;
+				}
+			}
+		}
+		if (i - first[n] > 1) {
+			hdr.msg_control = control[n].buf;
+			hdr.msg_controllen = sizeof(control[n].buf);
+			cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+			cm->cmsg_level = IPPROTO_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t const gso_size = static_cast<uint16_t>(segment);
+			memcpy(CMSG_DATA(cm), &gso_size, sizeof(uint16_t));
+		}
+#endif
+		hdr.msg_iovlen = i - first[n];
+		++n;
+	}
+	first[n] = count;
+
+	int res;
+	do {
+		res = sendmmsg(fd_, msgs, static_cast<unsigned int>(n), flags);
+	} while (res == -1 && errno == EINTR);
+
+	if (res == -1) {
+		error = last_socket_error();
+#ifdef UDP_SEGMENT
+		if (gso_ && (error == EIO || error == EINVAL) && msgs[0].msg_hdr.msg_controllen) {
+			// Segmentation offload not supported
+			gso_ = false;
+			return do_send(datagrams, count, error);
+		}
+#endif
+		return -1;
+	}
+
+	return static_cast<int>(first[res]);
+#else
+	int res{};
+	for (size_t i = 0; i < count; ++i) {
+		auto const& d = datagrams[i];
+		int r = sendto(fd_, reinterpret_cast<char const*>(d.data.get()), static_cast<int>(d.data.size()), flags, reinterpret_cast<sockaddr const*>(d.peer.storage_), d.peer.size_);
+		if (r == -1) {
+			if (!i) {
+				error = last_socket_error();
+				res = -1;
+			}
+			break;
+		}
+		++res;
+	}
+	return res;
+#endif
+}
+
+
+socket::socket(thread_pool & pool, event_handler* evt_handler)
+	: socket_base(pool, evt_handler, this)
+	, socket_interface(this)
+	, keepalive_interval_(duration::from_hours(2))
+	, connection_attempt_delay_(duration::from_milliseconds(250))
+{
+}
+
+socket::socket(reactor & r, event_handler* evt_handler)
+	: socket_base(r, evt_handler, this)
+	, socket_interface(this)
+	, keepalive_interval_(duration::from_hours(2))
+	, connection_attempt_delay_(duration::from_milliseconds(250))
+{
+}
+
+socket::~socket()
+{
+	close();
+
+	release_adaptive_buffer(adaptive_reserved_[0] + adaptive_reserved_[1]);
+
+	scoped_lock l(socket_thread_->mutex_);
+	detach_thread(l);
+}
+
+std::unique_ptr<socket> socket::from_descriptor(socket_descriptor && desc, thread_pool & pool, int & error, fz::event_handler * handler)
+{
+	if (!desc) {
+		error = ENOTSOCK;
+		return nullptr;
+	}
+
+	return adopt_descriptor(std::make_unique<socket>(pool, nullptr), std::move(desc), error, handler);
+}
+
+std::unique_ptr<socket> socket::from_descriptor(socket_descriptor && desc, reactor & r, int & error, fz::event_handler * handler)
+{
+	if (!desc) {
+		error = ENOTSOCK;
+		return nullptr;
+	}
+
+	return adopt_descriptor(std::make_unique<socket>(r, nullptr), std::move(desc), error, handler);
+}
+
+std::unique_ptr<socket> socket::adopt_descriptor(std::unique_ptr<socket> && pSocket, socket_descriptor && desc, int & error, fz::event_handler * handler, bool nonblocking)
+{
+	socket_t fd = desc.detach();
+
+#if defined(SO_NOSIGPIPE) && !defined(MSG_NOSIGNAL)
+	// We do not want SIGPIPE if writing to socket.
+	const int value = 1;
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &value, sizeof(int));
+#endif
+
+	if (!nonblocking) {
+		set_nonblocking(fd);
+	}
+
+	if (!pSocket->socket_thread_) {
+		error = ENOMEM;
+		pSocket.reset();
+	}
+	else {
+		pSocket->state_ = socket_state::connected;
+		pSocket->fd_ = fd;
+		fd = -1;
+		pSocket->host_ = to_native(pSocket->peer_ip());
+		pSocket->evt_handler_ = handler;
+		pSocket->socket_thread_->waiting_ = WAIT_READ;
+
+		sockaddr_u addr;
+		socklen_t addr_len = sizeof(addr);
+		if (!getsockname(pSocket->fd_, &addr.sockaddr_, &addr_len)) {
+			pSocket->family_ = addr.sockaddr_.sa_family;
+		}
+		if (pSocket->socket_thread_->start()) {
+			error = ENOMEM;
+			pSocket.reset();
+		}
+	}
+	close_socket_fd(fd);
+
+	return std::move(pSocket);
+}
+
+int socket::connect(native_string const& host, unsigned int port, address_type family)
+{
+	if (state_ != socket_state{}) {
+		return EISCONN;
+	}
+
+	if (port < 1 || port > 65535) {
+		return EINVAL;
+	}
+
+	if (host.empty()) {
+		return EINVAL;
+	}
+
+	int af{};
+
+	switch (family)
+	{
+	case address_type::unknown:
+		af = AF_UNSPEC;
+		break;
+	case address_type::ipv4:
+		af = AF_INET;
+		break;
+	case address_type::ipv6:
+		af = AF_INET6;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	family_ = af;
+	state_ = socket_state::connecting;
+
+	host_ = host;
+	port_ = port;
+	int res = socket_thread_->connect(to_utf8(host_), port_);
+	if (res) {
+		state_ = socket_state::failed;
+		return res;
+	}
+
+	return 0;
+}
+
+socket_state socket::get_state() const
+{
+	if (!socket_thread_) {
+		return socket_state{};
+	}
+
+	scoped_lock l(socket_thread_->mutex_);
+	return state_;
+}
+
+int socket::read(void* buffer, unsigned int size, int& error)
+{
+	if (!socket_thread_) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	{
+		scoped_lock l(socket_thread_->mutex_);
+		assert(!(socket_thread_->waiting_ & WAIT_READ));
+		assert(!has_pending_event(evt_handler_, this, socket_event_flag::read));
+	}
+#endif
+
+	int res = recv(fd_, (char*)buffer, size, 0);
+
+	if (res == -1) {
+		error = last_socket_error();
+		if (error == EAGAIN) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_READ)) {
+				socket_thread_->waiting_ |= WAIT_READ;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+		add_transferred(bytes_read_, res);
+	}
+
+	FZ_TRACE3(socket_read, this, res, error);
+	return res;
+}
+
+int socket::write(void const* buffer, unsigned int size, int& error)
+{
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+
+#if DEBUG_SOCKETEVENTS
+	if (socket_thread_) {
+		scoped_lock l(socket_thread_->mutex_);
+		assert(!(socket_thread_->waiting_ & WAIT_WRITE));
+		assert(!has_pending_event(evt_handler_, this, socket_event_flag::write | socket_event_flag::connection));
+	}
+#endif
+
+	int res = send(fd_, (const char*)buffer, size, flags);
+
+	if (res == -1) {
+		error = last_send_error();
+		if (error == EAGAIN) {
+			scoped_lock l (socket_thread_->mutex_);
+
+#if DEBUG_SOCKETEVENTS
+			assert(!(socket_thread_->waiting_ & WAIT_WRITE));
+			assert(!has_pending_event(evt_handler_, this, socket_event_flag::write | socket_event_flag::connection));
+#endif
+			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+				socket_thread_->waiting_ |= WAIT_WRITE;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+		add_transferred(bytes_written_, res);
+	}
+
+	FZ_TRACE3(socket_write, this, res, error);
+	return res;
+}
+
+namespace {
+#ifdef FZ_WINDOWS
+using native_iovec = WSABUF;
+#else
+using native_iovec = iovec;
+#endif
+
+// Further buffers are left for the next call
+size_t const max_iovecs = 64;
+
+// Converts the buffers, limiting their total size to what can be returned.
+template<typename Buffer>
+size_t to_native_iovecs(Buffer const* buffers, size_t count, native_iovec * out)
+{
+	if (count > max_iovecs) {
+		count = max_iovecs;
+	}
+
+	unsigned int left = static_cast<unsigned int>(std::numeric_limits<int>::max());
+	size_t n{};
+	for (; n < count && left; ++n) {
+		unsigned int const size = std::min(buffers[n].size, left);
+		left -= size;
+#ifdef FZ_WINDOWS
+		out[n].buf = const_cast<char*>(static_cast<char const*>(buffers[n].data));
+		out[n].len = size;
+#else
+		out[n].iov_base = const_cast<void*>(static_cast<void const*>(buffers[n].data));
+		out[n].iov_len = size;
+#endif
+	}
+	return n;
+}
+}
+
+int socket::readv(socket_iovec const* buffers, size_t count, int& error)
+{
+	if (!socket_thread_) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	{
+		scoped_lock l(socket_thread_->mutex_);
+		assert(!(socket_thread_->waiting_ & WAIT_READ));
+		assert(!has_pending_event(evt_handler_, this, socket_event_flag::read));
+	}
+#endif
+
+	native_iovec bufs[max_iovecs];
+	size_t const n = to_native_iovecs(buffers, count, bufs);
+
+#ifdef FZ_WINDOWS
+	DWORD received{};
+	DWORD flags{};
+	int res = WSARecv(fd_, bufs, static_cast<DWORD>(n), &received, &flags, nullptr, nullptr);
+	if (!res) {
+		res = static_cast<int>(received);
+	}
+#else
+	msghdr msg{};
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = n;
+	int res = static_cast<int>(recvmsg(fd_, &msg, 0));
+#endif
+
+	if (res == -1) {
+		error = last_socket_error();
+		if (error == EAGAIN) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_READ)) {
+				socket_thread_->waiting_ |= WAIT_READ;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+		add_transferred(bytes_read_, res);
+	}
+
+	FZ_TRACE3(socket_read, this, res, error);
+	return res;
+}
+
+namespace {
+// Used if the amount of available data is not known
+size_t const default_read_size = 64 * 1024;
+
+// Used if nothing has been received yet
+size_t const small_read_size = 1024;
+
+int read_into_buffer(socket_interface & s, buffer & buf, size_t size, int& error)
+{
+	size = std::min(size, static_cast<size_t>(std::numeric_limits<int>::max()));
+	int res = s.read(buf.get(size), static_cast<unsigned int>(size), error);
+	if (res > 0) {
+		buf.add(static_cast<size_t>(res));
+	}
+	return res;
+}
+}
+
+int socket_interface::read_into(buffer & buf, size_t max, int& error)
+{
+	if (!max) {
+		error = EINVAL;
+		return -1;
+	}
+
+	return read_into_buffer(*this, buf, std::min(max, default_read_size), error);
+}
+
+void socket_interface::get_memory_usage(std::vector<socket_memory_usage> &) const
+{
+}
+
+int socket::read_into(buffer & buf, size_t max, int& error)
+{
+	if (!max) {
+		error = EINVAL;
+		return -1;
+	}
+
+	// If nothing has been received yet, the read most likely fails with EAGAIN or signals EOF
+	size_t size = default_read_size;
+#ifdef FZ_WINDOWS
+	u_long available{};
+	if (!ioctlsocket(fd_, FIONREAD, &available)) {
+		size = available ? static_cast<size_t>(available) : small_read_size;
+	}
+#else
+	int available{};
+	if (!ioctl(fd_, FIONREAD, &available) && available >= 0) {
+		size = available ? static_cast<size_t>(available) : small_read_size;
+	}
+#endif
+
+	return read_into_buffer(*this, buf, std::min(size, max), error);
+}
+
+int socket::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+	if (!socket_thread_) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	{
+		scoped_lock l(socket_thread_->mutex_);
+		assert(!(socket_thread_->waiting_ & WAIT_WRITE));
+		assert(!has_pending_event(evt_handler_, this, socket_event_flag::write | socket_event_flag::connection));
+	}
+#endif
+
+	native_iovec bufs[max_iovecs];
+	size_t const n = to_native_iovecs(buffers, count, bufs);
+
+#ifdef FZ_WINDOWS
+	DWORD sent{};
+	int res = WSASend(fd_, bufs, static_cast<DWORD>(n), &sent, 0, nullptr, nullptr);
+	if (!res) {
+		res = static_cast<int>(sent);
+	}
+#else
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;
+#else
+	const int flags = 0;
+#endif
+	msghdr msg{};
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = n;
+	int res = static_cast<int>(sendmsg(fd_, &msg, flags));
+#endif
+
+	if (res == -1) {
+		error = last_send_error();
+		if (error == EAGAIN) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+				socket_thread_->waiting_ |= WAIT_WRITE;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+		add_transferred(bytes_written_, res);
+	}
+
+	FZ_TRACE3(socket_write, this, res, error);
+	return res;
+}
+
+namespace {
+// Reads from the given offset, without regard for the file position
+int64_t read_at(file & f, uint64_t offset, void* buffer, size_t size)
+{
+#ifdef FZ_WINDOWS
+	OVERLAPPED ov{};
+	ov.Offset = static_cast<DWORD>(offset);
+	ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD read{};
+	if (!ReadFile(f.fd(), buffer, static_cast<DWORD>(size), &read, &ov)) {
+		return (GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1;
+	}
+	return static_cast<int64_t>(read);
+#else
+	ssize_t r;
+	do {
+		r = pread(f.fd(), buffer, size, static_cast<off_t>(offset));
+	} while (r == -1 && errno == EINTR);
+	return r;
+#endif
+}
+
+#ifdef __linux__
+// Unlike send, sendfile has no MSG_NOSIGNAL. Block SIGPIPE in this thread
+// for the duration of the call and discard it if we caused it.
+ssize_t sendfile_nosignal(int out_fd, int in_fd, off_t * offset, size_t count)
+{
+	sigset_t pipe_set;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+
+	sigset_t old_set;
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+	bool const was_blocked = sigismember(&old_set, SIGPIPE) == 1;
+
+	ssize_t r;
+	do {
+		r = sendfile(out_fd, in_fd, offset, count);
+	} while (r == -1 && errno == EINTR);
+
+	if (!was_blocked) {
+		int const error = errno;
+		if (r == -1 && error == EPIPE) {
+			timespec const ts{};
+			sigtimedwait(&pipe_set, nullptr, &ts);
 		}
+		pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+		errno = error;
 	}
-	close_socket_fd(fd);
 
-	return pSocket;
+	return r;
+}
+#endif
 }
 
-int socket::connect(native_string const& host, unsigned int port, address_type family)
+int socket::send_file(file & f, uint64_t offset, unsigned int size, int& error)
 {
-	if (state_ != socket_state{}) {
-		return EISCONN;
+	if (!socket_thread_) {
+		error = ENOTCONN;
+		return -1;
 	}
-
-	if (port < 1 || port > 65535) {
-		return EINVAL;
+	if (!f) {
+		error = EBADF;
+		return -1;
 	}
 
-	if (host.empty()) {
-		return EINVAL;
+#if DEBUG_SOCKETEVENTS
+	{
+		scoped_lock l(socket_thread_->mutex_);
+		assert(!(socket_thread_->waiting_ & WAIT_WRITE));
+		assert(!has_pending_event(evt_handler_, this, socket_event_flag::write | socket_event_flag::connection));
 	}
+#endif
 
-	int af{};
+	if (size > static_cast<unsigned int>(std::numeric_limits<int>::max())) {
+		size = static_cast<unsigned int>(std::numeric_limits<int>::max());
+	}
 
-	switch (family)
-	{
-	case address_type::unknown:
-		af = AF_UNSPEC;
-		break;
-	case address_type::ipv4:
-		af = AF_INET;
-		break;
-	case address_type::ipv6:
-		af = AF_INET6;
-		break;
-	default:
-		return EINVAL;
+	int res = -1;
+	bool copy = true;
+#ifdef __linux__
+	off_t off = static_cast<off_t>(offset);
+	ssize_t const sent = sendfile_nosignal(fd_, f.fd(), &off, size);
+	if (sent >= 0) {
+		res = static_cast<int>(sent);
+		copy = false;
 	}
+	else {
+		error = last_send_error();
+		// Only fall back if the file does not support sendfile
+		copy = error == EINVAL || error == ENOSYS;
+	}
+#endif
 
-	family_ = af;
-	state_ = socket_state::connecting;
+	if (copy) {
+		size_t const chunk = std::min(static_cast<size_t>(size), static_cast<size_t>(256 * 1024));
+		auto buffer = std::make_unique<uint8_t[]>(chunk);
+		int64_t const read = read_at(f, offset, buffer.get(), chunk);
+		if (read <= 0) {
+			error = read ? EIO : 0;
+			return read ? -1 : 0;
+		}
 
-	host_ = host;
-	port_ = port;
-	int res = socket_thread_->connect(to_utf8(host_), port_);
-	if (res) {
-		state_ = socket_state::failed;
-		return res;
+#ifdef MSG_NOSIGNAL
+		const int flags = MSG_NOSIGNAL;
+#else
+		const int flags = 0;
+#endif
+		res = send(fd_, reinterpret_cast<char const*>(buffer.get()), static_cast<int>(read), flags);
+		if (res == -1) {
+			error = last_send_error();
+		}
 	}
 
-	return 0;
+	if (res == -1) {
+		if (error == EAGAIN) {
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+				socket_thread_->waiting_ |= WAIT_WRITE;
+				socket_thread_->wakeup_thread(l);
+			}
+		}
+	}
+	else {
+		error = 0;
+		add_transferred(bytes_written_, res);
+	}
+
+	FZ_TRACE3(socket_write, this, res, error);
+	return res;
 }
 
-socket_state socket::get_state() const
+int socket::set_tls_offload(bool receive, void const* crypto_info, unsigned int size)
 {
+#if HAVE_KTLS
 	if (!socket_thread_) {
-		return socket_state{};
+		return ENOTCONN;
 	}
 
-	scoped_lock l(socket_thread_->mutex_);
-	return state_;
+	// Attaching the ULP fails with EEXIST if already done for the other direction
+	if (setsockopt(fd_, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0 && errno != EEXIST) {
+		return errno;
+	}
+	if (setsockopt(fd_, SOL_TLS, receive ? TLS_RX : TLS_TX, crypto_info, size) != 0) {
+		return errno;
+	}
+	return 0;
+#else
+	(void)receive;
+	(void)crypto_info;
+	(void)size;
+	return EOPNOTSUPP;
+#endif
 }
 
-int socket::read(void* buffer, unsigned int size, int& error)
+int socket::send_tls_record(unsigned char type, void const* buffer, unsigned int size, int& error)
 {
+#if HAVE_KTLS
 	if (!socket_thread_) {
 		error = ENOTCONN;
 		return -1;
 	}
 
-#if DEBUG_SOCKETEVENTS
-	{
-		scoped_lock l(socket_thread_->mutex_);
-		assert(!(socket_thread_->waiting_ & WAIT_READ));
-		assert(!has_pending_event(evt_handler_, this, socket_event_flag::read));
-	}
-#endif
+	union {
+		char buf[CMSG_SPACE(sizeof(type))];
+		cmsghdr header;
+	} control{}; // For alignment reasons
+	iovec iov{const_cast<void*>(buffer), size};
 
-	int res = recv(fd_, (char*)buffer, size, 0);
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(type));
+	memcpy(CMSG_DATA(cmsg), &type, sizeof(type));
+
+	int res;
+	do {
+		res = static_cast<int>(sendmsg(fd_, &msg, MSG_NOSIGNAL));
+	} while (res == -1 && errno == EINTR);
 
 	if (res == -1) {
-		error = last_socket_error();
+		error = errno;
 		if (error == EAGAIN) {
 			scoped_lock l(socket_thread_->mutex_);
-			if (!(socket_thread_->waiting_ & WAIT_READ)) {
-				socket_thread_->waiting_ |= WAIT_READ;
+			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
+				socket_thread_->waiting_ |= WAIT_WRITE;
 				socket_thread_->wakeup_thread(l);
 			}
 		}
 	}
 	else {
 		error = 0;
+		add_transferred(bytes_written_, res);
 	}
 
+	FZ_TRACE3(socket_write, this, res, error);
 	return res;
-}
-
-int socket::write(void const* buffer, unsigned int size, int& error)
-{
-#ifdef MSG_NOSIGNAL
-	const int flags = MSG_NOSIGNAL;
 #else
-	const int flags = 0;
+	(void)type;
+	(void)buffer;
+	(void)size;
+	error = EOPNOTSUPP;
+	return -1;
 #endif
+}
 
-#if DEBUG_SOCKETEVENTS
-	if (socket_thread_) {
-		scoped_lock l(socket_thread_->mutex_);
-		assert(!(socket_thread_->waiting_ & WAIT_WRITE));
-		assert(!has_pending_event(evt_handler_, this, socket_event_flag::write | socket_event_flag::connection));
+int socket::read_tls_record(unsigned char & type, void* buffer, unsigned int size, int& error)
+{
+#if HAVE_KTLS
+	if (!socket_thread_) {
+		error = ENOTCONN;
+		return -1;
 	}
-#endif
 
-	int res = send(fd_, (const char*)buffer, size, flags);
+	union {
+		char buf[CMSG_SPACE(sizeof(type))];
+		cmsghdr header;
+	} control{}; // For alignment reasons
+	iovec iov{buffer, size};
+
+	msghdr msg{};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	int res;
+	do {
+		res = static_cast<int>(recvmsg(fd_, &msg, 0));
+	} while (res == -1 && errno == EINTR);
 
 	if (res == -1) {
-		error = last_socket_error();
+		error = errno;
 		if (error == EAGAIN) {
-			scoped_lock l (socket_thread_->mutex_);
-
-#if DEBUG_SOCKETEVENTS
-			assert(!(socket_thread_->waiting_ & WAIT_WRITE));
-			assert(!has_pending_event(evt_handler_, this, socket_event_flag::write | socket_event_flag::connection));
-#endif
-			if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
-				socket_thread_->waiting_ |= WAIT_WRITE;
+			scoped_lock l(socket_thread_->mutex_);
+			if (!(socket_thread_->waiting_ & WAIT_READ)) {
+				socket_thread_->waiting_ |= WAIT_READ;
 				socket_thread_->wakeup_thread(l);
 			}
 		}
+		return -1;
 	}
-	else {
-		error = 0;
+
+	// Without control message it is application data
+	type = 23;
+	cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+		memcpy(&type, CMSG_DATA(cmsg), sizeof(type));
 	}
 
+	error = 0;
+	add_transferred(bytes_read_, res);
 	return res;
+#else
+	(void)type;
+	(void)buffer;
+	(void)size;
+	error = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+void socket::set_adaptive_buffer_sizes(bool enable)
+{
+	adaptive_buffers_ = enable;
+	sample_start_ = monotonic_clock();
+}
+
+void socket::set_adaptive_buffer_budget(uint64_t octets)
+{
+	adaptive_buffer_budget = octets;
+}
+
+void socket::add_transferred(uint64_t & counter, int octets)
+{
+	counter += static_cast<uint64_t>(octets);
+	if (adaptive_buffers_ && bytes_read_ + bytes_written_ - sample_octets_[0] - sample_octets_[1] >= adaptive_sample_octets) {
+		adapt_buffer_sizes();
+	}
+}
+
+void socket::adapt_buffer_sizes()
+{
+	auto const now = monotonic_clock::coarse_now();
+	if (!sample_start_) {
+		sample_start_ = now;
+		sample_octets_[0] = bytes_read_;
+		sample_octets_[1] = bytes_written_;
+		return;
+	}
+
+	auto const elapsed = now - sample_start_;
+	if (elapsed < adaptive_sample_period) {
+		return;
+	}
+
+	uint64_t rtt{};
+	if (fd_ != -1) {
+		rtt = get_stats().rtt;
+	}
+
+	if (rtt) {
+		uint64_t const transferred[2] = { bytes_read_ - sample_octets_[0], bytes_written_ - sample_octets_[1] };
+		int const options[2] = { SO_RCVBUF, SO_SNDBUF };
+		for (int i = 0; i < 2; ++i) {
+			// Twice the bandwidth-delay product gives the window room to grow
+			uint64_t target = transferred[i] * rtt / static_cast<uint64_t>(elapsed.get_milliseconds()) / 1000 * 2;
+			target = std::min((target + 0xffff) & ~uint64_t(0xffff), adaptive_buffer_max);
+			if (target <= adaptive_reserved_[i]) {
+				continue;
+			}
+
+			// The kernel may already have grown the buffer on its own
+			int current{};
+			socklen_t len = sizeof(current);
+			if (getsockopt(fd_, SOL_SOCKET, options[i], reinterpret_cast<char*>(&current), &len) || target <= static_cast<uint64_t>(current)) {
+				continue;
+			}
+
+			uint64_t const delta = target - adaptive_reserved_[i];
+			if (!reserve_adaptive_buffer(delta)) {
+				continue;
+			}
+
+			// Once connected, the window scale factor is fixed. Unlike before
+			// connecting, setting the buffer size cannot reduce it anymore.
+			int const size = static_cast<int>(target);
+			if (setsockopt(fd_, SOL_SOCKET, options[i], reinterpret_cast<char const*>(&size), sizeof(size))) {
+				release_adaptive_buffer(delta);
+				continue;
+			}
+			adaptive_reserved_[i] = target;
+		}
+	}
+
+	sample_start_ = now;
+	sample_octets_[0] = bytes_read_;
+	sample_octets_[1] = bytes_written_;
+}
+
+namespace {
+size_t string_heap_size(std::string const& s)
+{
+	// Strings fitting into the small string buffer do not allocate
+	return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+}
+
+void socket::get_memory_usage(std::vector<socket_memory_usage> & usage) const
+{
+	socket_memory_usage u;
+	u.name_ = "socket";
+	u.object_size_ = sizeof(socket);
+	if (socket_thread_) {
+		u.object_size_ += sizeof(socket_thread);
+
+		scoped_lock l(socket_thread_->mutex_);
+		u.heap_size_ += string_heap_size(socket_thread_->host_);
+		u.heap_size_ += string_heap_size(socket_thread_->port_);
+		u.heap_size_ += string_heap_size(socket_thread_->bind_);
+		u.heap_size_ += socket_thread_->fds_to_close_.capacity() * sizeof(socket_t);
+	}
+	usage.push_back(u);
+}
+
+void socket::cork()
+{
+	if (fd_ != -1 && !corked_) {
+		corked_ = !do_set_cork(fd_, true);
+	}
+}
+
+int socket::uncork()
+{
+	if (!corked_) {
+		return 0;
+	}
+	corked_ = false;
+	if (fd_ == -1) {
+		return 0;
+	}
+	return do_set_cork(fd_, false);
+}
+
+socket_stats socket::get_stats() const
+{
+	socket_stats stats;
+	stats.bytes_read = bytes_read_;
+	stats.bytes_written = bytes_written_;
+
+	if (!socket_thread_ || fd_ == -1) {
+		return stats;
+	}
+
+#if HAVE_TCP_INFO
+	tcp_info i{};
+	socklen_t len = sizeof(tcp_info);
+	if (!getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &i, &len)) {
+		stats.transport_stats = true;
+		stats.rtt = i.tcpi_rtt;
+		stats.rtt_variance = i.tcpi_rttvar;
+		stats.retransmits = i.tcpi_total_retrans;
+		stats.congestion_window = static_cast<uint64_t>(i.tcpi_snd_cwnd) * i.tcpi_snd_mss;
+		stats.bytes_in_flight = static_cast<uint64_t>(i.tcpi_unacked) * i.tcpi_snd_mss;
+	}
+#elif defined(FZ_WINDOWS) && defined(SIO_TCP_INFO)
+	DWORD version{};
+	TCP_INFO_v0 i{};
+	DWORD len{};
+	if (!WSAIoctl(fd_, SIO_TCP_INFO, &version, sizeof(version), &i, sizeof(i), &len, nullptr, nullptr)) {
+		stats.transport_stats = true;
+		stats.rtt = i.RttUs;
+		stats.retransmits = i.BytesRetrans && i.Mss ? (i.BytesRetrans + i.Mss - 1) / i.Mss : 0;
+		stats.congestion_window = i.Cwnd;
+		stats.bytes_in_flight = i.BytesInFlight;
+	}
+#endif
+
+	return stats;
 }
 
 std::string socket::peer_ip(bool strip_zone_index) const
@@ -1730,6 +3276,16 @@ void socket::set_keepalive_interval(duration const& d)
 	}
 }
 
+void socket::set_connection_attempt_delay(duration const& d)
+{
+	if (!socket_thread_ || d < duration()) {
+		return;
+	}
+
+	scoped_lock l(socket_thread_->mutex_);
+	connection_attempt_delay_ = d;
+}
+
 void socket::set_flags(int flags, bool enable)
 {
 	if (!socket_thread_) {
@@ -1786,7 +3342,10 @@ int socket::read_fd(fz::buffer & buf, int &fd, int & error)
 	}
 
 	int res = fz::read_fd(fd_, buf, fd, error);
-	if (res == -1 && error == EAGAIN) {
+	if (res > 0) {
+		add_transferred(bytes_read_, res);
+	}
+	else if (res == -1 && error == EAGAIN) {
 		scoped_lock l(socket_thread_->mutex_);
 		if (!(socket_thread_->waiting_ & WAIT_READ)) {
 			socket_thread_->waiting_ |= WAIT_READ;
@@ -1816,7 +3375,10 @@ int socket::send_fd(fz::buffer & buf, int fd, int & error)
 	}
 
 	int res = fz::send_fd(fd_, buf, fd, error);
-	if (res == -1 && error == EAGAIN) {
+	if (res > 0) {
+		add_transferred(bytes_written_, res);
+	}
+	else if (res == -1 && error == EAGAIN) {
 		scoped_lock l(socket_thread_->mutex_);
 		if (!(socket_thread_->waiting_ & WAIT_WRITE)) {
 			socket_thread_->waiting_ |= WAIT_WRITE;
@@ -1863,6 +3425,29 @@ void socket_layer::forward_socket_event(socket_event_source* source, socket_even
 	}
 }
 
+namespace {
+// The layer that got invoked directly by socket_layer::signal_socket_event in this thread
+thread_local event_handler const* directly_invoked_layer{};
+}
+
+void socket_layer::signal_socket_event(event_handler & current, socket_event_flag t, int error)
+{
+	if (!event_handler_) {
+		return;
+	}
+
+	auto & loop = current.get_event_loop();
+	if ((directly_invoked_layer == &current || loop.dispatching(current)) && &event_handler_->get_event_loop() == &loop) {
+		auto const previous = directly_invoked_layer;
+		directly_invoked_layer = event_handler_;
+		(*event_handler_)(socket_event(this, t, error));
+		directly_invoked_layer = previous;
+	}
+	else {
+		event_handler_->send_event<socket_event>(this, t, error);
+	}
+}
+
 void socket_layer::forward_hostaddress_event(socket_event_source* source, std::string const& address)
 {
 	if (event_handler_) {
@@ -1881,6 +3466,36 @@ int socket_layer::shutdown_read()
 	return next_layer_.shutdown_read();
 }
 
+int socket_layer::readv(socket_iovec const* buffers, size_t count, int& error)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (buffers[i].size) {
+			return read(buffers[i].data, buffers[i].size, error);
+		}
+	}
+
+	error = 0;
+	return 0;
+}
+
+int socket_layer::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (buffers[i].size) {
+			return write(buffers[i].data, buffers[i].size, error);
+		}
+	}
+
+	error = 0;
+	return 0;
+}
+
+int socket_layer::send_file(file &, uint64_t, unsigned int, int& error)
+{
+	error = EOPNOTSUPP;
+	return -1;
+}
+
 socket_base::socket_t socket::get_descriptor()
 {
 	if (!socket_thread_) {
@@ -1,20 +1,24 @@
 #include "libfilezilla/buffer.hpp"
 #include "libfilezilla/string.hpp"
+#include "libfilezilla/util.hpp"
 
 #ifdef FZ_WINDOWS
 #include <string.h>
 
 #include "libfilezilla/glue/windows.hpp"
 #else
-#include <iconv.h>
 #include <strings.h>
-
-#include <memory>
-#include <type_traits>
 #endif
 
 #include <cstdlib>
 
+// The NEON kernels have not been run on aarch64 yet, so the scalar code is used unless FZ_USE_NEON is defined.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+#include <arm_neon.h>
+#endif
+
 static_assert('a' + 25 == 'z', "We only support systems running with an ASCII-based character set. Sorry, no EBCDIC.");
 
 // char may be unsigned, yielding stange results if subtracting characters. To work around it, expect a particular order of characters.
@@ -106,12 +110,226 @@ std::wstring::value_type toupper_ascii(std::wstring::value_type c)
 }
 
 namespace {
+// The case conversion and comparison functions are used on hot paths, e.g. for HTTP
+// headers and query strings. Process blocks of characters at once where possible,
+// with the scalar loops handling the tails and other platforms.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+template<typename Char>
+__m128i simd_set1(int v)
+{
+	if constexpr (sizeof(Char) == 1) {
+		return _mm_set1_epi8(static_cast<char>(v));
+	}
+	else if constexpr (sizeof(Char) == 2) {
+		return _mm_set1_epi16(static_cast<short>(v));
+	}
+	else {
+		return _mm_set1_epi32(v);
+	}
+}
+
+template<typename Char>
+__m128i simd_cmpeq(__m128i a, __m128i b)
+{
+	if constexpr (sizeof(Char) == 1) {
+		return _mm_cmpeq_epi8(a, b);
+	}
+	else if constexpr (sizeof(Char) == 2) {
+		return _mm_cmpeq_epi16(a, b);
+	}
+	else {
+		return _mm_cmpeq_epi32(a, b);
+	}
+}
+
+// Signed, like the comparisons in tolower_ascii for signed char and wchar_t types
+template<typename Char>
+__m128i simd_cmpgt(__m128i a, __m128i b)
+{
+	if constexpr (sizeof(Char) == 1) {
+		return _mm_cmpgt_epi8(a, b);
+	}
+	else if constexpr (sizeof(Char) == 2) {
+		return _mm_cmpgt_epi16(a, b);
+	}
+	else {
+		return _mm_cmpgt_epi32(a, b);
+	}
+}
+
+// Applies tolower_ascii or toupper_ascii to each character
+template<typename Char, bool lower>
+__m128i simd_case(__m128i v)
+{
+	int const first = lower ? 'A' : 'a';
+	int const last = lower ? 'Z' : 'z';
+	__m128i const in_range = _mm_and_si128(simd_cmpgt<Char>(v, simd_set1<Char>(first - 1)), simd_cmpgt<Char>(simd_set1<Char>(last + 1), v));
+
+	// Toggling the 0x20 bit converts in either direction
+	__m128i ret = _mm_xor_si128(v, _mm_and_si128(in_range, simd_set1<Char>(0x20)));
+	if constexpr (sizeof(Char) > 1) {
+		// Dotted and dotless i
+		__m128i const i = _mm_or_si128(simd_cmpeq<Char>(v, simd_set1<Char>(0x130)), simd_cmpeq<Char>(v, simd_set1<Char>(0x131)));
+		ret = _mm_or_si128(_mm_andnot_si128(i, ret), _mm_and_si128(i, simd_set1<Char>(lower ? 'i' : 'I')));
+	}
+	return ret;
+}
+
+template<typename Char, bool lower>
+size_t case_ascii_blocks(Char const* in, Char* out, size_t n)
+{
+	size_t constexpr step = 16 / sizeof(Char);
+	size_t i{};
+	for (; i + step <= n; i += step) {
+		__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), simd_case<Char, lower>(v));
+	}
+	return i;
+}
+
+template<typename Char>
+size_t mismatch_blocks(Char const* a, Char const* b, size_t n)
+{
+	size_t constexpr step = 16 / sizeof(Char);
+	size_t i{};
+	for (; i + step <= n; i += step) {
+		__m128i const va = simd_case<Char, true>(_mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i)));
+		__m128i const vb = simd_case<Char, true>(_mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i)));
+		unsigned int const mask = ~static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))) & 0xffffu;
+		if (mask) {
+			return i + static_cast<size_t>(bitscan(mask)) / sizeof(Char);
+		}
+	}
+	return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Only for narrow strings, where long inputs are common enough to make it worthwhile
+__attribute__((target("avx2")))
+inline __m256i case_avx2(__m256i v, bool lower)
+{
+	__m256i const in_range = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lower ? 'A' - 1 : 'a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(lower ? 'Z' + 1 : 'z' + 1), v));
+	return _mm256_xor_si256(v, _mm256_and_si256(in_range, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+size_t case_ascii_blocks_avx2(char const* in, char* out, size_t n, bool lower)
+{
+	size_t i{};
+	for (; i + 32 <= n; i += 32) {
+		__m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(in + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), case_avx2(v, lower));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+size_t mismatch_blocks_avx2(char const* a, char const* b, size_t n)
+{
+	size_t i{};
+	for (; i + 32 <= n; i += 32) {
+		__m256i const va = case_avx2(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i)), true);
+		__m256i const vb = case_avx2(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + i)), true);
+		unsigned int const mask = ~static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+		if (mask) {
+			return i + static_cast<size_t>(bitscan(mask));
+		}
+	}
+	return i;
+}
+
+bool has_avx2()
+{
+	static bool const avx2 = []() {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+	}();
+	return avx2;
+}
+
+#define FZ_STRING_AVX2 1
+#endif
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+// Only narrow strings, wide strings use the scalar loops
+template<typename Char, bool lower>
+size_t case_ascii_blocks(Char const* in, Char* out, size_t n)
+{
+	if constexpr (sizeof(Char) != 1) {
+		return 0;
+	}
+	else {
+		int8x16_t const first = vdupq_n_s8(lower ? 'A' : 'a');
+		int8x16_t const last = vdupq_n_s8(lower ? 'Z' : 'z');
+		uint8x16_t const bit = vdupq_n_u8(0x20);
+		size_t i{};
+		for (; i + 16 <= n; i += 16) {
+			int8x16_t const v = vld1q_s8(reinterpret_cast<int8_t const*>(in + i));
+			uint8x16_t const in_range = vandq_u8(vcgeq_s8(v, first), vcleq_s8(v, last));
+			uint8x16_t const r = veorq_u8(vreinterpretq_u8_s8(v), vandq_u8(in_range, bit));
+			vst1q_u8(reinterpret_cast<uint8_t*>(out + i), r);
+		}
+		return i;
+	}
+}
+
+template<typename Char>
+size_t mismatch_blocks(Char const* a, Char const* b, size_t n)
+{
+	if constexpr (sizeof(Char) != 1) {
+		return 0;
+	}
+	else {
+		int8x16_t const first = vdupq_n_s8('A');
+		int8x16_t const last = vdupq_n_s8('Z');
+		uint8x16_t const bit = vdupq_n_u8(0x20);
+		auto const lower = [&](int8x16_t v) {
+			uint8x16_t const in_range = vandq_u8(vcgeq_s8(v, first), vcleq_s8(v, last));
+			return veorq_u8(vreinterpretq_u8_s8(v), vandq_u8(in_range, bit));
+		};
+
+		size_t i{};
+		for (; i + 16 <= n; i += 16) {
+			uint8x16_t const va = lower(vld1q_s8(reinterpret_cast<int8_t const*>(a + i)));
+			uint8x16_t const vb = lower(vld1q_s8(reinterpret_cast<int8_t const*>(b + i)));
+			if (vminvq_u8(vceqq_u8(va, vb)) != 0xff) {
+				// Let the scalar loop find the exact position
+				break;
+			}
+		}
+		return i;
+	}
+}
+#else
+template<typename Char, bool lower>
+size_t case_ascii_blocks(Char const*, Char*, size_t)
+{
+	return 0;
+}
+
+template<typename Char>
+size_t mismatch_blocks(Char const*, Char const*, size_t)
+{
+	return 0;
+}
+#endif
+
 template<typename Out, bool lower, typename String>
 Out str_case_ascii_impl(String const& s)
 {
 	Out ret;
 	ret.resize(s.size());
-	for (size_t i = 0; i < s.size(); ++i) {
+
+	size_t i{};
+#ifdef FZ_STRING_AVX2
+	if constexpr (sizeof(typename String::value_type) == 1) {
+		if (s.size() >= 64 && has_avx2()) {
+			i = case_ascii_blocks_avx2(s.data(), ret.data(), s.size(), lower);
+		}
+	}
+#endif
+	i += case_ascii_blocks<typename String::value_type, lower>(s.data() + i, ret.data() + i, s.size() - i);
+
+	for (; i < s.size(); ++i) {
 		if constexpr (lower) {
 			ret[i] = tolower_ascii(s[i]);
 		}
@@ -121,6 +339,39 @@ Out str_case_ascii_impl(String const& s)
 	}
 	return ret;
 }
+
+template<typename String>
+size_t mismatch_insensitive_ascii_impl(String const& a, String const& b)
+{
+	size_t const n = std::min(a.size(), b.size());
+
+	size_t i{};
+#ifdef FZ_STRING_AVX2
+	if constexpr (sizeof(typename String::value_type) == 1) {
+		if (n >= 64 && has_avx2()) {
+			i = mismatch_blocks_avx2(a.data(), b.data(), n);
+		}
+	}
+#endif
+	i += mismatch_blocks(a.data() + i, b.data() + i, n - i);
+
+	for (; i < n; ++i) {
+		if (tolower_ascii(a[i]) != tolower_ascii(b[i])) {
+			break;
+		}
+	}
+	return i;
+}
+}
+
+size_t mismatch_insensitive_ascii(std::string_view const& a, std::string_view const& b)
+{
+	return mismatch_insensitive_ascii_impl(a, b);
+}
+
+size_t mismatch_insensitive_ascii(std::wstring_view const& a, std::wstring_view const& b)
+{
+	return mismatch_insensitive_ascii_impl(a, b);
 }
 
 std::string str_tolower_ascii(std::string_view const& s)
@@ -143,11 +394,304 @@ std::wstring str_toupper_ascii(std::wstring_view const& s)
 	return str_case_ascii_impl<std::wstring, false>(s);
 }
 
+namespace {
+// Conversions are dominated by ASCII text, e.g. paths and log messages. Convert it
+// in blocks, the other characters one at a time.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+// Converts the leading ASCII characters in blocks, returns how many have been converted
+size_t widen_ascii(char const* in, wchar_t* out, size_t n)
+{
+	__m128i const zero = _mm_setzero_si128();
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i));
+		if (_mm_movemask_epi8(v)) {
+			break;
+		}
+		__m128i const lo = _mm_unpacklo_epi8(v, zero);
+		__m128i const hi = _mm_unpackhi_epi8(v, zero);
+		if constexpr (sizeof(wchar_t) == 2) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lo);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), hi);
+		}
+		else {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 12), _mm_unpackhi_epi16(hi, zero));
+		}
+	}
+	return i;
+}
+
+size_t narrow_ascii(wchar_t const* in, char* out, size_t n)
+{
+	__m128i const zero = _mm_setzero_si128();
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		__m128i r;
+		if constexpr (sizeof(wchar_t) == 2) {
+			__m128i const a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i));
+			__m128i const b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i + 8));
+			__m128i const high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(static_cast<short>(0xff80)));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xffff) {
+				break;
+			}
+			r = _mm_packus_epi16(a, b);
+		}
+		else {
+			__m128i const a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i));
+			__m128i const b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i + 4));
+			__m128i const c = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i + 8));
+			__m128i const d = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + i + 12));
+			__m128i const high = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), _mm_set1_epi32(~0x7f));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(high, zero)) != 0xffff) {
+				break;
+			}
+			r = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), r);
+	}
+	return i;
+}
+#elif defined(FZ_USE_NEON) && ((defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64))
+size_t widen_ascii(char const* in, wchar_t* out, size_t n)
+{
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t const v = vld1q_u8(reinterpret_cast<uint8_t const*>(in + i));
+		if (vmaxvq_u8(v) >= 0x80) {
+			break;
+		}
+		uint16x8_t const lo = vmovl_u8(vget_low_u8(v));
+		uint16x8_t const hi = vmovl_u8(vget_high_u8(v));
+		if constexpr (sizeof(wchar_t) == 2) {
+			vst1q_u16(reinterpret_cast<uint16_t*>(out + i), lo);
+			vst1q_u16(reinterpret_cast<uint16_t*>(out + i + 8), hi);
+		}
+		else {
+			vst1q_u32(reinterpret_cast<uint32_t*>(out + i), vmovl_u16(vget_low_u16(lo)));
+			vst1q_u32(reinterpret_cast<uint32_t*>(out + i + 4), vmovl_u16(vget_high_u16(lo)));
+			vst1q_u32(reinterpret_cast<uint32_t*>(out + i + 8), vmovl_u16(vget_low_u16(hi)));
+			vst1q_u32(reinterpret_cast<uint32_t*>(out + i + 12), vmovl_u16(vget_high_u16(hi)));
+		}
+	}
+	return i;
+}
+
+size_t narrow_ascii(wchar_t const* in, char* out, size_t n)
+{
+	size_t i{};
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t r;
+		if constexpr (sizeof(wchar_t) == 2) {
+			uint16x8_t const a = vld1q_u16(reinterpret_cast<uint16_t const*>(in + i));
+			uint16x8_t const b = vld1q_u16(reinterpret_cast<uint16_t const*>(in + i + 8));
+			if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80) {
+				break;
+			}
+			r = vcombine_u8(vmovn_u16(a), vmovn_u16(b));
+		}
+		else {
+			uint32x4_t const a = vld1q_u32(reinterpret_cast<uint32_t const*>(in + i));
+			uint32x4_t const b = vld1q_u32(reinterpret_cast<uint32_t const*>(in + i + 4));
+			uint32x4_t const c = vld1q_u32(reinterpret_cast<uint32_t const*>(in + i + 8));
+			uint32x4_t const d = vld1q_u32(reinterpret_cast<uint32_t const*>(in + i + 12));
+			if (vmaxvq_u32(vorrq_u32(vorrq_u32(a, b), vorrq_u32(c, d))) >= 0x80) {
+				break;
+			}
+			uint16x8_t const lo = vcombine_u16(vmovn_u32(a), vmovn_u32(b));
+			uint16x8_t const hi = vcombine_u16(vmovn_u32(c), vmovn_u32(d));
+			r = vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+		}
+		vst1q_u8(reinterpret_cast<uint8_t*>(out + i), r);
+	}
+	return i;
+}
+#else
+size_t widen_ascii(char const*, wchar_t*, size_t)
+{
+	return 0;
+}
+
+size_t narrow_ascii(wchar_t const*, char*, size_t)
+{
+	return 0;
+}
+#endif
+
+// ASCII is the same in all supported system encodings, it needs no conversion
+bool widen_if_ascii(std::string_view const& in, std::wstring & out)
+{
+	out.resize(in.size());
+	for (size_t i = widen_ascii(in.data(), out.data(), in.size()); i < in.size(); ++i) {
+		if (static_cast<unsigned char>(in[i]) >= 0x80) {
+			return false;
+		}
+		out[i] = static_cast<wchar_t>(in[i]);
+	}
+	return true;
+}
+
+bool narrow_if_ascii(std::wstring_view const& in, std::string & out)
+{
+	out.resize(in.size());
+	for (size_t i = narrow_ascii(in.data(), out.data(), in.size()); i < in.size(); ++i) {
+		if (in[i] < 0 || in[i] >= 0x80) {
+			return false;
+		}
+		out[i] = static_cast<char>(in[i]);
+	}
+	return true;
+}
+
+#ifndef FZ_WINDOWS
+// Strict UTF-8 decoding: Rejects overlong forms, surrogates, code points beyond
+// U+10FFFF and truncated sequences.
+bool utf8_to_wide(char const* in, size_t len, std::wstring & ret)
+{
+	// Never more code units than octets
+	ret.resize(len);
+	wchar_t* const out = ret.data();
+
+	size_t i{};
+	size_t o{};
+	while (i < len) {
+		size_t const ascii = widen_ascii(in + i, out + o, len - i);
+		i += ascii;
+		o += ascii;
+		// After a block with non-ASCII characters, continue with the next block
+		size_t const stop = std::min(len, i + 16);
+		while (i < stop) {
+			unsigned char const c = static_cast<unsigned char>(in[i]);
+			if (c < 0x80) {
+				out[o++] = c;
+				++i;
+				continue;
+			}
+
+			size_t n;
+			uint32_t cp;
+			if (c >= 0xc2 && c <= 0xdf) {
+				n = 1;
+				cp = c & 0x1fu;
+			}
+			else if ((c & 0xf0u) == 0xe0) {
+				n = 2;
+				cp = c & 0x0fu;
+			}
+			else if (c >= 0xf0 && c <= 0xf4) {
+				n = 3;
+				cp = c & 0x07u;
+			}
+			else {
+				return false;
+			}
+			if (len - i <= n) {
+				return false;
+			}
+			for (size_t k = 1; k <= n; ++k) {
+				unsigned char const b = static_cast<unsigned char>(in[i + k]);
+				if ((b & 0xc0u) != 0x80) {
+					return false;
+				}
+				cp = (cp << 6) | (b & 0x3fu);
+			}
+			if (n == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) {
+				return false;
+			}
+			if (n == 3 && (cp < 0x10000 || cp > 0x10ffff)) {
+				return false;
+			}
+			i += n + 1;
+
+			if constexpr (sizeof(wchar_t) == 2) {
+				if (cp >= 0x10000) {
+					cp -= 0x10000;
+					out[o++] = static_cast<wchar_t>(0xd800 + (cp >> 10));
+					out[o++] = static_cast<wchar_t>(0xdc00 + (cp & 0x3ff));
+					continue;
+				}
+			}
+			out[o++] = static_cast<wchar_t>(cp);
+		}
+	}
+
+	ret.resize(o);
+	return true;
+}
+
+// Rejects surrogates, unless properly paired in UTF-16, and anything beyond U+10FFFF
+bool wide_to_utf8(wchar_t const* in, size_t len, std::string & ret)
+{
+	ret.resize(len * (sizeof(wchar_t) == 2 ? 3 : 4));
+	char* const out = ret.data();
+
+	size_t i{};
+	size_t o{};
+	while (i < len) {
+		size_t const ascii = narrow_ascii(in + i, out + o, len - i);
+		i += ascii;
+		o += ascii;
+		// After a block with non-ASCII characters, continue with the next block
+		size_t const stop = std::min(len, i + 16);
+		while (i < stop) {
+			uint32_t cp;
+			if constexpr (sizeof(wchar_t) == 2) {
+				cp = static_cast<uint16_t>(in[i]);
+				if (cp >= 0xd800 && cp <= 0xdbff) {
+					uint32_t const low = (i + 1 < len) ? static_cast<uint16_t>(in[i + 1]) : 0;
+					if (low < 0xdc00 || low > 0xdfff) {
+						return false;
+					}
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+					++i;
+				}
+				else if (cp >= 0xdc00 && cp <= 0xdfff) {
+					return false;
+				}
+			}
+			else {
+				cp = static_cast<uint32_t>(in[i]);
+				if ((cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+					return false;
+				}
+			}
+			++i;
+
+			if (cp < 0x80) {
+				out[o++] = static_cast<char>(cp);
+			}
+			else if (cp < 0x800) {
+				out[o++] = static_cast<char>(0xc0u | (cp >> 6));
+				out[o++] = static_cast<char>(0x80u | (cp & 0x3fu));
+			}
+			else if (cp < 0x10000) {
+				out[o++] = static_cast<char>(0xe0u | (cp >> 12));
+				out[o++] = static_cast<char>(0x80u | ((cp >> 6) & 0x3fu));
+				out[o++] = static_cast<char>(0x80u | (cp & 0x3fu));
+			}
+			else {
+				out[o++] = static_cast<char>(0xf0u | (cp >> 18));
+				out[o++] = static_cast<char>(0x80u | ((cp >> 12) & 0x3fu));
+				out[o++] = static_cast<char>(0x80u | ((cp >> 6) & 0x3fu));
+				out[o++] = static_cast<char>(0x80u | (cp & 0x3fu));
+			}
+		}
+	}
+
+	ret.resize(o);
+	return true;
+}
+#endif
+}
+
 std::wstring to_wstring(std::string_view const& in)
 {
 	std::wstring ret;
 
-	if (!in.empty()) {
+	if (!in.empty() && !widen_if_ascii(in, ret)) {
+		ret.clear();
 #if FZ_WINDOWS
 		char const* const in_p = in.data();
 		size_t const len = in.size();
@@ -203,87 +747,6 @@ std::wstring to_wstring(std::string_view const& in)
 	return ret;
 }
 
-#ifndef FZ_WINDOWS
-// On some platforms, e.g. NetBSD, the second argument to iconv is const.
-// Depending which one is used, declare iconv_second_arg_type as either char* or char const*
-extern "C" typedef size_t (*iconv_prototype_with_const)(iconv_t, char const**, size_t *, char**, size_t *);
-typedef std::conditional<std::is_same_v<decltype(&iconv), iconv_prototype_with_const>, char const*, char*>::type iconv_second_arg_type;
-
-namespace {
-// On some platforms, e.g. those derived from SunOS, iconv does not understand "WCHAR_T", so we
-// need to guess an encoding.
-// On other platforms, WCHAR_T results in iconv() doing endless loops, such as OS X.
-char const* calc_wchar_t_encoding()
-{
-	auto try_encoding = [](char const* const encoding) -> bool {
-		iconv_t cd = iconv_open(encoding, "UTF-8");
-		if (cd == reinterpret_cast<iconv_t>(-1)) {
-			return false;
-		}
-		iconv_close(cd);
-		return true;
-	};
-
-	// Explicitly specify endianess, otherwise we'll get a BOM prefixed to everything
-	int const i = 1;
-	char const* p = reinterpret_cast<char const*>(&i);
-	bool const little_endian = p[0] == 1;
-
-	if (sizeof(wchar_t) == 4) {
-		if (little_endian && try_encoding("UTF-32LE")) {
-			return "UTF-32LE";
-		}
-		if (!little_endian && try_encoding("UTF-32BE")) {
-			return "UTF-32BE";
-		}
-	}
-	else if (sizeof(wchar_t) == 2) {
-		if (little_endian && try_encoding("UTF-16LE")) {
-			return "UTF-16LE";
-		}
-		if (!little_endian && try_encoding("UTF-16BE")) {
-			return "UTF-16BE";
-		}
-	}
-
-	// Oh dear...
-	// WCHAR_T is our last, best hope.
-	return "WCHAR_T";
-}
-
-char const* wchar_t_encoding()
-{
-	static char const* const encoding = calc_wchar_t_encoding();
-	return encoding;
-}
-
-class iconv_t_holder
-{
-public:
-	iconv_t_holder(char const* to, char const* from)
-	{
-		cd = iconv_open(to, from);
-	}
-
-	~iconv_t_holder()
-	{
-		if (cd != reinterpret_cast<iconv_t>(-1)) {
-			iconv_close(cd);
-		}
-	}
-
-	explicit operator bool() const {
-		return cd != reinterpret_cast<iconv_t>(-1);
-	}
-
-	iconv_t_holder(iconv_t_holder const&) = delete;
-	iconv_t_holder& operator=(iconv_t_holder const&) = delete;
-
-	iconv_t cd{reinterpret_cast<iconv_t>(-1)};
-};
-}
-#endif
-
 std::wstring to_wstring_from_utf8(std::string_view const& in)
 {
 	return to_wstring_from_utf8(in.data(), in.size());
@@ -308,21 +771,8 @@ std::wstring to_wstring_from_utf8(char const* s, size_t len)
 			MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, in_p, static_cast<int>(len), out_p, out_len);
 		}
 #else
-		static thread_local iconv_t_holder holder(wchar_t_encoding(), "UTF-8");
-
-		if (holder && iconv(holder.cd, nullptr, nullptr, nullptr, nullptr) != static_cast<size_t>(-1)) {
-			auto in_p = const_cast<iconv_second_arg_type>(s);
-			size_t out_len = len * sizeof(wchar_t) * 2;
-			auto out_buf = std::make_unique<char[]>(out_len);
-			char* out_p = out_buf.get();
-
-			size_t r = iconv(holder.cd, &in_p, &len, &out_p, &out_len);
-
-			if (r != static_cast<size_t>(-1)) {
-				ret.assign(reinterpret_cast<wchar_t*>(out_buf.get()), reinterpret_cast<wchar_t*>(out_p));
-			}
-
-			// Our buffer should big enough as well, so we can ignore errors such as E2BIG.
+		if (!utf8_to_wide(s, len, ret)) {
+			ret.clear();
 		}
 #endif
 	}
@@ -334,7 +784,8 @@ std::string to_string(std::wstring_view const& in)
 {
 	std::string ret;
 
-	if (!in.empty()) {
+	if (!in.empty() && !narrow_if_ascii(in, ret)) {
+		ret.clear();
 #if FZ_WINDOWS
 		wchar_t const* const in_p = in.data();
 		BOOL usedDefault = FALSE;
@@ -409,23 +860,8 @@ std::string FZ_PUBLIC_SYMBOL to_utf8(std::wstring_view const& in)
 			WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, in_p, static_cast<int>(in.size()), out_p, len, nullptr, nullptr);
 		}
 #else
-		static thread_local iconv_t_holder holder("UTF-8", wchar_t_encoding());
-
-		if (holder && iconv(holder.cd, nullptr, nullptr, nullptr, nullptr) != static_cast<size_t>(-1)) {
-			auto in_p = reinterpret_cast<iconv_second_arg_type>(const_cast<wchar_t*>(in.data()));
-			size_t in_len = in.size() * sizeof(wchar_t);
-
-			size_t out_len = in.size() * 4;
-			auto out_buf = std::make_unique<char[]>(out_len);
-			char* out_p = out_buf.get();
-
-			size_t r = iconv(holder.cd, &in_p, &in_len, &out_p, &out_len);
-
-			if (r != static_cast<size_t>(-1)) {
-				ret.assign(out_buf.get(), out_p);
-			}
-
-			// Our buffer should big enough as well, so we can ignore errors such as E2BIG.
+		if (!wide_to_utf8(in.data(), in.size(), ret)) {
+			ret.clear();
 		}
 #endif
 	}
@@ -502,29 +938,13 @@ bool replace_substrings(std::wstring& in, wchar_t find, wchar_t replacement)
 
 
 namespace {
-template<typename Ret, typename String>
-std::vector<Ret> strtok_impl(String && s, String && delims, bool const ignore_empty)
+template<typename Ret, typename Char>
+std::vector<Ret> strtok_impl(std::basic_string_view<Char> const& s, std::basic_string_view<Char> const& delims, bool const ignore_empty)
 {
 	std::vector<Ret> ret;
-
-	typename std::decay_t<String>::size_type start{}, pos{};
-
-	do {
-		pos = s.find_first_of(delims, start);
-
-		// Not found, we're at ends;
-		if (pos == std::decay_t<String>::npos) {
-			if (start < s.size()) {
-				ret.emplace_back(s.substr(start));
-			}
-		}
-		else if (pos > start || !ignore_empty) {
-			// Non-empty substring
-			ret.emplace_back(s.substr(start, pos - start));
-		}
-		start = pos + 1;
-	} while (pos != std::decay_t<String>::npos);
-
+	for (auto const& token : basic_strtokenizer<Char>(s, delims, ignore_empty)) {
+		ret.emplace_back(token);
+	}
 	return ret;
 }
 }
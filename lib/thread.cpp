@@ -1,16 +1,178 @@
 #include "libfilezilla/thread.hpp"
+#include "libfilezilla/string.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <thread>
 
-#if defined(FZ_WINDOWS) && (defined(__MINGW32__) || defined(__MINGW64__))
-#define USE_CUSTOM_THREADS 1
+#if FZ_WINDOWS
 #include "libfilezilla/glue/windows.hpp"
+#if defined(__MINGW32__) || defined(__MINGW64__)
+#define USE_CUSTOM_THREADS 1
 #include <process.h>
 #endif
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 namespace fz {
 
+namespace {
+#if defined(__linux__)
+std::string read_small_file(char const* path)
+{
+	std::string ret;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		char buf[4096];
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r > 0) {
+			ret.assign(buf, static_cast<size_t>(r));
+		}
+		close(fd);
+	}
+	return ret;
+}
+
+// Format is a list of ranges, e.g. 0-3,6
+std::vector<unsigned int> parse_cpu_list(std::string_view list)
+{
+	std::vector<unsigned int> ret;
+	for (auto const& range : strtok_view(list, ",")) {
+		auto const dash = range.find('-');
+		unsigned int const first = to_integral<unsigned int>(range.substr(0, dash));
+		unsigned int const last = dash == std::string_view::npos ? first : to_integral<unsigned int>(range.substr(dash + 1));
+		for (unsigned int cpu = first; cpu <= last; ++cpu) {
+			ret.push_back(cpu);
+		}
+	}
+	return ret;
+}
+#endif
+
+#if FZ_WINDOWS
+void set_thread_name(std::string const& name)
+{
+	// SetThreadDescription needs Windows 10 1607 or later
+	typedef HRESULT (WINAPI *set_description_t)(HANDLE, PCWSTR);
+	static auto const set_description = reinterpret_cast<set_description_t>(reinterpret_cast<void(*)()>(
+		GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription")));
+	if (set_description) {
+		set_description(GetCurrentThread(), to_wstring_from_utf8(name).c_str());
+	}
+}
+#elif FZ_MAC
+void set_thread_name(std::string const& name)
+{
+	pthread_setname_np(name.c_str());
+}
+#elif defined(__linux__)
+void set_thread_name(std::string const& name)
+{
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+}
+#else
+void set_thread_name(std::string const&)
+{
+}
+#endif
+}
+
+bool set_thread_placement(thread_placement const& placement)
+{
+	if (!placement.name.empty()) {
+		set_thread_name(placement.name);
+	}
+
+	if (placement.cpus.empty()) {
+		return true;
+	}
+
+#if FZ_WINDOWS
+	// Only the first processor group is supported
+	DWORD_PTR mask{};
+	for (auto const cpu : placement.cpus) {
+		if (cpu < sizeof(DWORD_PTR) * 8) {
+			mask |= DWORD_PTR(1) << cpu;
+		}
+	}
+	return mask && SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto const cpu : placement.cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	// macOS only has affinity hints, no hard pinning
+	return false;
+#endif
+}
+
+std::vector<std::vector<unsigned int>> get_numa_nodes()
+{
+	std::vector<std::vector<unsigned int>> ret;
+
+#if FZ_WINDOWS
+	ULONG highest{};
+	if (GetNumaHighestNodeNumber(&highest)) {
+		for (ULONG node = 0; node <= highest; ++node) {
+			ULONGLONG mask{};
+			if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask) || !mask) {
+				continue;
+			}
+			std::vector<unsigned int> cpus;
+			for (unsigned int cpu = 0; cpu < 64; ++cpu) {
+				if (mask & (ULONGLONG(1) << cpu)) {
+					cpus.push_back(cpu);
+				}
+			}
+			ret.emplace_back(std::move(cpus));
+		}
+	}
+#elif defined(__linux__)
+	auto const nodes = parse_cpu_list(trimmed(read_small_file("/sys/devices/system/node/online")));
+	for (auto const node : nodes) {
+		std::string const path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+		auto cpus = parse_cpu_list(trimmed(read_small_file(path.c_str())));
+		if (!cpus.empty()) {
+			ret.emplace_back(std::move(cpus));
+		}
+	}
+#endif
+
+	if (ret.empty()) {
+		unsigned int const count = std::max(1u, std::thread::hardware_concurrency());
+		ret.emplace_back();
+		for (unsigned int cpu = 0; cpu < count; ++cpu) {
+			ret.back().push_back(cpu);
+		}
+	}
+
+	return ret;
+}
+
+bool thread::run(std::function<void()> && f, thread_placement const& placement)
+{
+	if (!placement) {
+		return run(std::move(f));
+	}
+
+	return run([f = std::move(f), placement]() {
+		set_thread_placement(placement);
+		f();
+	});
+}
+
 bool thread::joinable() const
 {
 	return impl_ != nullptr;
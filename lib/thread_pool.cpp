@@ -1,15 +1,101 @@
 #include "libfilezilla/thread_pool.hpp"
 #include "libfilezilla/thread.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#if FZ_WINDOWS
+#include "libfilezilla/glue/windows.hpp"
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
 
 namespace fz {
 
+namespace {
+uint64_t steady_us()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Reads the CPU time of a thread from any thread
+class cpu_clock final
+{
+public:
+	cpu_clock() = default;
+	cpu_clock(cpu_clock const&) = delete;
+	cpu_clock& operator=(cpu_clock const&) = delete;
+
+#if FZ_WINDOWS
+	~cpu_clock()
+	{
+		if (handle_) {
+			CloseHandle(handle_);
+		}
+	}
+
+	// Must be called by the thread to measure
+	void init()
+	{
+		handle_ = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, false, GetCurrentThreadId());
+	}
+
+	uint64_t get_us() const
+	{
+		FILETIME creation, exit, kernel, user;
+		if (!handle_ || !GetThreadTimes(handle_, &creation, &exit, &kernel, &user)) {
+			return 0;
+		}
+		uint64_t const k = (uint64_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+		uint64_t const u = (uint64_t(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+		return (k + u) / 10;
+	}
+
+private:
+	HANDLE handle_{};
+#else
+	void init()
+	{
+		valid_ = !pthread_getcpuclockid(pthread_self(), &id_);
+	}
+
+	uint64_t get_us() const
+	{
+		timespec ts{};
+		if (!valid_ || clock_gettime(id_, &ts)) {
+			return 0;
+		}
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000 + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+	}
+
+private:
+	clockid_t id_{};
+	bool valid_{};
+#endif
+};
+}
+
 class pooled_thread_impl;
 class async_task_impl final
 {
 public:
+	explicit async_task_impl(thread_pool & pool)
+		: pool_(pool)
+	{}
+
+	thread_pool & pool_;
 	pooled_thread_impl * thread_{};
+
+	// Only used while the task is queued
+	unique_function<void()> f_;
+	std::string category_;
+	condition* waiter_{};
+	bool detached_{};
 };
 
 class pooled_thread_impl final
@@ -25,27 +111,58 @@ public:
 		thread_.join();
 	}
 
-	bool run()
+	bool run(thread_placement const& placement)
 	{
-		return thread_.run([this] { entry(); });
+		return thread_.run([this] { entry(); }, placement);
 	}
 
 	virtual void entry() {
+		cpu_clock_.init();
+
 		scoped_lock l(m_);
 		while (!quit_) {
-			thread_cond_.wait(l);
+			if (!f_) {
+				if (pool_.idle_timeout_ > duration()) {
+					if (!thread_cond_.wait(l, pool_.idle_timeout_) && !f_ && !quit_) {
+						pool_.reap(this);
+						break;
+					}
+				}
+				else {
+					thread_cond_.wait(l);
+				}
+			}
 
-			if (f_) {
+			while (f_) {
+				accounted_ = pool_.accounting_;
+				if (accounted_) {
+					start_wall_ = steady_us();
+					start_cpu_ = cpu_clock_.get_us();
+				}
 				l.unlock();
 				f_();
 				l.lock();
+				if (accounted_) {
+					accounted_ = false;
+					thread_pool_usage u;
+					u.tasks = 1;
+					u.wall_us = steady_us() - start_wall_;
+					u.cpu_us = cpu_clock_.get_us() - start_cpu_;
+					add_usage(usage_, u);
+					add_usage(pool_.categories_[category_], u);
+				}
+				category_.clear();
 				task_ = nullptr;
-				f_ = std::function<void()>();
-				pool_.idle_.emplace_back(this);
+				f_ = nullptr;
 				if (task_waiting_) {
 					task_waiting_ = false;
 					task_cond_.signal(l);
 				}
+
+				// Queued tasks also get run during shutdown, so that joining them cannot hang
+				if (!pool_.dequeue(*this, l)) {
+					pool_.idle_.emplace_back(this);
+				}
 			}
 		}
 	}
@@ -56,9 +173,27 @@ public:
 		thread_cond_.signal(l);
 	}
 
+	static void add_usage(thread_pool_usage & to, thread_pool_usage const& u)
+	{
+		to.tasks += u.tasks;
+		to.cpu_us += u.cpu_us;
+		to.wall_us += u.wall_us;
+	}
+
+	// Usage of the current task so far, zero if it is not accounted
+	thread_pool_usage running_usage() const
+	{
+		thread_pool_usage ret;
+		if (accounted_) {
+			ret.wall_us = steady_us() - start_wall_;
+			ret.cpu_us = cpu_clock_.get_us() - start_cpu_;
+		}
+		return ret;
+	}
+
 	thread thread_;
 	async_task_impl* task_{};
-	std::function<void()> f_{};
+	unique_function<void()> f_{};
 	mutex & m_;
 	condition thread_cond_;
 
@@ -67,10 +202,375 @@ public:
 	thread_pool& pool_;
 
 	bool task_waiting_{};
+
+	// Accounting, guarded by the pool's mutex
+	std::string category_;
+	thread_pool_usage usage_;
+	bool accounted_{};
+	uint64_t start_wall_{};
+	uint64_t start_cpu_{};
+	cpu_clock cpu_clock_;
+private:
+	bool quit_{};
+};
+
+class pooled_task_impl final
+{
+public:
+	enum state : int {
+		pending,
+		running,
+		done
+	};
+
+	explicit pooled_task_impl(unique_function<void()> && f)
+		: f_(std::move(f))
+	{}
+
+	// Runs the task unless it has already been claimed by someone else
+	void try_run();
+
+	void release()
+	{
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	unique_function<void()> f_;
+
+	// One reference held by the handle, one by the queue
+	std::atomic<int> refs_{2};
+	std::atomic<int> state_{pending};
+
+	// Set by a joining thread before blocking, guarded by join_mutex()
+	std::atomic<bool> has_waiter_{};
+	condition* waiter_{};
+};
+
+namespace {
+// Only needed when a join actually has to block
+mutex& join_mutex()
+{
+	static mutex m{false};
+	return m;
+}
+}
+
+void pooled_task_impl::try_run()
+{
+	int expected = pending;
+	if (!state_.compare_exchange_strong(expected, running)) {
+		return;
+	}
+
+	f_();
+	f_ = nullptr;
+
+	state_ = done;
+	if (has_waiter_) {
+		scoped_lock l(join_mutex());
+		if (waiter_) {
+			waiter_->signal(l);
+		}
+	}
+}
+
+class task_scheduler final
+{
+public:
+	task_scheduler(size_t workers, thread_placement const& placement, bool numa_workers);
+	~task_scheduler();
+
+	bool started() const { return !workers_.empty(); }
+
+	void submit(pooled_task_impl* t);
+
 private:
+	// Bounded ring of tasks. The owning worker works on the back,
+	// other workers steal from the front.
+	class task_deque final
+	{
+	public:
+		bool push_back(pooled_task_impl* t)
+		{
+			scoped_lock l(m_);
+			if (size_ == capacity) {
+				return false;
+			}
+			ring_[(head_ + size_++) % capacity] = t;
+			return true;
+		}
+
+		pooled_task_impl* pop_back()
+		{
+			scoped_lock l(m_);
+			if (!size_) {
+				return nullptr;
+			}
+			return ring_[(head_ + --size_) % capacity];
+		}
+
+		pooled_task_impl* pop_front()
+		{
+			scoped_lock l(m_);
+			if (!size_) {
+				return nullptr;
+			}
+			auto * t = ring_[head_];
+			head_ = (head_ + 1) % capacity;
+			--size_;
+			return t;
+		}
+
+	private:
+		static size_t const capacity = 1024;
+
+		mutex m_{false};
+		pooled_task_impl* ring_[capacity];
+		size_t head_{};
+		size_t size_{};
+	};
+
+	struct worker final
+	{
+		task_scheduler* owner_{};
+		size_t index_{};
+		task_deque deque_;
+
+		// Indexes of the other workers in the order they get stolen from
+		std::vector<size_t> victims_;
+
+		thread thread_;
+		condition cond_;
+		bool woken_{};
+	};
+
+	void entry(worker & w);
+	pooled_task_impl* find_task(worker & w);
+
+	std::vector<std::unique_ptr<worker>> workers_;
+	std::atomic<size_t> next_{};
+
+	// Fallback for tasks not fitting into the deques
+	mutex overflow_m_{false};
+	std::vector<pooled_task_impl*> overflow_;
+
+	std::atomic<size_t> queued_{};
+	std::atomic<size_t> sleepers_{};
+
+	mutex sleep_m_{false};
+	std::vector<worker*> idle_;
 	bool quit_{};
+
+	static thread_local worker* current_worker_;
 };
 
+thread_local task_scheduler::worker* task_scheduler::current_worker_{};
+
+task_scheduler::task_scheduler(size_t workers, thread_placement const& placement, bool numa_workers)
+{
+	// Each group of workers shares a set of CPUs
+	std::vector<std::vector<unsigned int>> groups;
+	if (numa_workers) {
+		for (auto & node : get_numa_nodes()) {
+			if (!placement.cpus.empty()) {
+				node.erase(std::remove_if(node.begin(), node.end(), [&](unsigned int cpu) {
+					return std::find(placement.cpus.cbegin(), placement.cpus.cend(), cpu) == placement.cpus.cend();
+				}), node.end());
+			}
+			if (!node.empty()) {
+				groups.emplace_back(std::move(node));
+			}
+		}
+	}
+	if (groups.empty()) {
+		groups.emplace_back(placement.cpus);
+	}
+
+	workers_.reserve(workers);
+	for (size_t i = 0; i < workers; ++i) {
+		auto w = std::make_unique<worker>();
+		w->owner_ = this;
+		w->index_ = workers_.size();
+
+		// Worker i belongs to group i % groups.size(). Steal from the own group first.
+		for (int own = 1; own >= 0; --own) {
+			for (size_t j = 1; j < workers; ++j) {
+				size_t const victim = (i + j) % workers;
+				if ((victim % groups.size() == i % groups.size()) == static_cast<bool>(own)) {
+					w->victims_.push_back(victim);
+				}
+			}
+		}
+
+		thread_placement p;
+		if (!placement.name.empty()) {
+			p.name = placement.name + std::to_string(i);
+		}
+		p.cpus = groups[i % groups.size()];
+
+		auto * ptr = w.get();
+		workers_.emplace_back(std::move(w));
+		if (!ptr->thread_.run([this, ptr] { entry(*ptr); }, p)) {
+			workers_.pop_back();
+			break;
+		}
+	}
+}
+
+task_scheduler::~task_scheduler()
+{
+	{
+		scoped_lock l(sleep_m_);
+		quit_ = true;
+		for (auto * w : idle_) {
+			w->woken_ = true;
+			w->cond_.signal(l);
+		}
+		idle_.clear();
+	}
+
+	for (auto & w : workers_) {
+		w->thread_.join();
+	}
+}
+
+void task_scheduler::submit(pooled_task_impl* t)
+{
+	worker* w = current_worker_;
+	if (!w || w->owner_ != this) {
+		w = workers_[next_++ % workers_.size()].get();
+	}
+
+	if (!w->deque_.push_back(t)) {
+		scoped_lock l(overflow_m_);
+		overflow_.push_back(t);
+	}
+
+	// Pairs with the sleepers_ increment and queued_ check in entry
+	++queued_;
+	if (sleepers_) {
+		scoped_lock l(sleep_m_);
+		if (!idle_.empty()) {
+			auto * sleeper = idle_.back();
+			idle_.pop_back();
+			sleeper->woken_ = true;
+			sleeper->cond_.signal(l);
+		}
+	}
+}
+
+pooled_task_impl* task_scheduler::find_task(worker & w)
+{
+	auto * t = w.deque_.pop_back();
+	if (t) {
+		return t;
+	}
+
+	for (size_t victim : w.victims_) {
+		if (victim >= workers_.size()) {
+			// Failed to start
+			continue;
+		}
+		t = workers_[victim]->deque_.pop_front();
+		if (t) {
+			return t;
+		}
+	}
+
+	scoped_lock l(overflow_m_);
+	if (!overflow_.empty()) {
+		t = overflow_.back();
+		overflow_.pop_back();
+	}
+	return t;
+}
+
+void task_scheduler::entry(worker & w)
+{
+	current_worker_ = &w;
+
+	while (true) {
+		auto * t = find_task(w);
+		if (t) {
+			--queued_;
+			t->try_run();
+			t->release();
+			continue;
+		}
+
+		scoped_lock l(sleep_m_);
+		++sleepers_;
+		if (queued_) {
+			// A task got submitted while looking for one
+			--sleepers_;
+			continue;
+		}
+		if (quit_) {
+			--sleepers_;
+			break;
+		}
+
+		idle_.push_back(&w);
+		while (!w.woken_) {
+			w.cond_.wait(l);
+		}
+		w.woken_ = false;
+		--sleepers_;
+	}
+
+	current_worker_ = nullptr;
+}
+
+pooled_task::pooled_task(pooled_task && other) noexcept
+{
+	std::swap(impl_, other.impl_);
+}
+
+pooled_task& pooled_task::operator=(pooled_task && other) noexcept
+{
+	std::swap(impl_, other.impl_);
+	return *this;
+}
+
+pooled_task::~pooled_task()
+{
+	join();
+}
+
+void pooled_task::join()
+{
+	if (!impl_) {
+		return;
+	}
+
+	impl_->try_run();
+
+	if (impl_->state_ != pooled_task_impl::done) {
+		// Pairs with the state_ store and has_waiter_ check in try_run
+		impl_->has_waiter_ = true;
+
+		condition cond;
+		scoped_lock l(join_mutex());
+		impl_->waiter_ = &cond;
+		while (impl_->state_ != pooled_task_impl::done) {
+			cond.wait(l);
+		}
+		impl_->waiter_ = nullptr;
+	}
+
+	impl_->release();
+	impl_ = nullptr;
+}
+
+void pooled_task::detach()
+{
+	if (impl_) {
+		impl_->release();
+		impl_ = nullptr;
+	}
+}
 
 async_task::async_task(async_task && other) noexcept
 {
@@ -91,7 +591,16 @@ async_task::~async_task()
 void async_task::join()
 {
 	if (impl_) {
-		scoped_lock l(impl_->thread_->m_);
+		scoped_lock l(impl_->pool_.m_);
+		if (!impl_->thread_) {
+			// Still queued, wait until a thread picks it up
+			condition cond;
+			impl_->waiter_ = &cond;
+			while (!impl_->thread_) {
+				cond.wait(l);
+			}
+			impl_->waiter_ = nullptr;
+		}
 		if (impl_->thread_->task_ == impl_) {
 			impl_->thread_->task_waiting_ = true;
 			impl_->thread_->task_cond_.wait(l);
@@ -104,7 +613,13 @@ void async_task::join()
 void async_task::detach()
 {
 	if (impl_) {
-		scoped_lock l(impl_->thread_->m_);
+		scoped_lock l(impl_->pool_.m_);
+		if (!impl_->thread_) {
+			// Deleted once dequeued
+			impl_->detached_ = true;
+			impl_ = nullptr;
+			return;
+		}
 		if (impl_->thread_->task_ == impl_) {
 			impl_->thread_->task_ = nullptr;
 		}
@@ -117,8 +632,14 @@ thread_pool::thread_pool()
 {
 }
 
+thread_pool::thread_pool(size_t workers)
+	: workers_(workers)
+{
+}
+
 thread_pool::~thread_pool()
 {
+	std::unique_ptr<task_scheduler> scheduler;
 	std::vector<pooled_thread_impl*> threads;
 	{
 		scoped_lock l(m_);
@@ -127,11 +648,146 @@ thread_pool::~thread_pool()
 			thread->quit(l);
 		}
 		threads.swap(threads_);
+		scheduler.swap(scheduler_);
 	}
 
+	// Runs the remaining tasks
+	scheduler.reset();
+
 	for (auto thread : threads) {
 		delete thread;
 	}
+
+	scoped_lock l(m_);
+	for (auto thread : reaped_) {
+		delete thread;
+	}
+	reaped_.clear();
+}
+
+void thread_pool::set_max_threads(size_t max)
+{
+	scoped_lock l(m_);
+	max_threads_ = max;
+
+	while (!queue_.empty() && !quit_) {
+		auto *t = get_or_create_thread();
+		if (!t) {
+			break;
+		}
+		if (!dequeue(*t, l)) {
+			idle_.emplace_back(t);
+			break;
+		}
+		t->thread_cond_.signal(l);
+	}
+}
+
+void thread_pool::set_idle_timeout(duration const& timeout)
+{
+	scoped_lock l(m_);
+	idle_timeout_ = timeout;
+}
+
+void thread_pool::set_placement(thread_placement const& placement, bool numa_workers)
+{
+	scoped_lock l(m_);
+	placement_ = placement;
+	numa_workers_ = numa_workers;
+}
+
+thread_pool_stats thread_pool::get_stats() const
+{
+	scoped_lock l(m_);
+
+	thread_pool_stats ret;
+	ret.threads = threads_.size();
+	ret.idle = idle_.size();
+	ret.queued = queue_.size();
+	ret.peak = peak_threads_;
+	return ret;
+}
+
+void thread_pool::enable_accounting(bool enable)
+{
+	scoped_lock l(m_);
+	accounting_ = enable;
+}
+
+thread_pool_accounting thread_pool::get_accounting() const
+{
+	scoped_lock l(m_);
+
+	thread_pool_accounting ret;
+	ret.categories = categories_;
+	for (auto const* t : threads_) {
+		auto const running = t->running_usage();
+		auto usage = t->usage_;
+		pooled_thread_impl::add_usage(usage, running);
+		ret.threads.push_back(usage);
+		if (t->accounted_) {
+			pooled_thread_impl::add_usage(ret.categories[t->category_], running);
+		}
+	}
+	return ret;
+}
+
+void thread_pool::reset_accounting()
+{
+	scoped_lock l(m_);
+	categories_.clear();
+	for (auto * t : threads_) {
+		t->usage_ = thread_pool_usage();
+		if (t->accounted_) {
+			// Only account the remainder of running tasks
+			t->start_wall_ = steady_us();
+			t->start_cpu_ = t->cpu_clock_.get_us();
+		}
+	}
+}
+
+bool thread_pool::dequeue(pooled_thread_impl & t, scoped_lock & l)
+{
+	if (queue_.empty()) {
+		return false;
+	}
+
+	auto * impl = queue_.front();
+	queue_.pop_front();
+
+	t.f_ = std::move(impl->f_);
+	t.category_ = std::move(impl->category_);
+	if (impl->detached_) {
+		delete impl;
+	}
+	else {
+		impl->thread_ = &t;
+		t.task_ = impl;
+		if (impl->waiter_) {
+			impl->waiter_->signal(l);
+		}
+	}
+	return true;
+}
+
+void thread_pool::reap(pooled_thread_impl * t)
+{
+	for (size_t i = 0; i < idle_.size(); ++i) {
+		if (idle_[i] == t) {
+			idle_.erase(idle_.begin() + i);
+			break;
+		}
+	}
+	for (size_t i = 0; i < threads_.size(); ++i) {
+		if (threads_[i] == t) {
+			threads_[i] = threads_.back();
+			threads_.pop_back();
+			break;
+		}
+	}
+
+	// Cannot join itself, gets deleted later
+	reaped_.push_back(t);
 }
 
 pooled_thread_impl* thread_pool::get_or_create_thread()
@@ -140,14 +796,26 @@ pooled_thread_impl* thread_pool::get_or_create_thread()
 		return {};
 	}
 
+	// Threads that reaped themselves have left their entry function already
+	for (auto thread : reaped_) {
+		delete thread;
+	}
+	reaped_.clear();
+
 	pooled_thread_impl *t{};
 	if (idle_.empty()) {
+		if (max_threads_ && threads_.size() >= max_threads_) {
+			return {};
+		}
 		t = new pooled_thread_impl(*this);
-		if (!t->run()) {
+		if (!t->run(placement_)) {
 			delete t;
 			return {};
 		}
 		threads_.emplace_back(t);
+		if (threads_.size() > peak_threads_) {
+			peak_threads_ = threads_.size();
+		}
 	}
 	else {
 		t = idle_.back();
@@ -156,7 +824,7 @@ pooled_thread_impl* thread_pool::get_or_create_thread()
 	return t;
 }
 
-async_task thread_pool::spawn(std::function<void()> const& f)
+async_task thread_pool::spawn(unique_function<void()> && f, std::string_view category)
 {
 	if (!f) {
 		return {};
@@ -164,40 +832,74 @@ async_task thread_pool::spawn(std::function<void()> const& f)
 
 	scoped_lock l(m_);
 
+	async_task ret;
+
 	auto *t = get_or_create_thread();
 	if (!t) {
-		return {};
+		if (quit_ || !max_threads_ || threads_.size() < max_threads_) {
+			return {};
+		}
+
+		// Saturated, queue the task until a thread becomes available
+		ret.impl_ = new async_task_impl(*this);
+		ret.impl_->f_ = std::move(f);
+		if (accounting_) {
+			ret.impl_->category_ = category;
+		}
+		queue_.push_back(ret.impl_);
+		return ret;
 	}
 
-	async_task ret;
-	ret.impl_ = new async_task_impl;
+	ret.impl_ = new async_task_impl(*this);
 	ret.impl_->thread_ = t;
 	t->task_ = ret.impl_;
-	t->f_ = f;
+	t->f_ = std::move(f);
+	if (accounting_) {
+		t->category_ = category;
+	}
 	t->thread_cond_.signal(l);
 
 	return ret;
 }
 
-async_task thread_pool::spawn(std::function<void()> && f)
+task_scheduler* thread_pool::get_scheduler()
+{
+	scoped_lock l(m_);
+	if (quit_) {
+		return nullptr;
+	}
+
+	if (!scheduler_) {
+		size_t workers = workers_;
+		if (!workers) {
+			workers = std::thread::hardware_concurrency();
+			if (!workers) {
+				workers = 1;
+			}
+		}
+		scheduler_ = std::make_unique<task_scheduler>(workers, placement_, numa_workers_);
+	}
+
+	if (!scheduler_->started()) {
+		return nullptr;
+	}
+	return scheduler_.get();
+}
+
+pooled_task thread_pool::submit(unique_function<void()> && f)
 {
 	if (!f) {
 		return {};
 	}
 
-	scoped_lock l(m_);
-
-	auto *t = get_or_create_thread();
-	if (!t) {
+	auto * scheduler = get_scheduler();
+	if (!scheduler) {
 		return {};
 	}
 
-	async_task ret;
-	ret.impl_ = new async_task_impl;
-	ret.impl_->thread_ = t;
-	t->task_ = ret.impl_;
-	t->f_ = std::move(f);
-	t->thread_cond_.signal(l);
+	pooled_task ret;
+	ret.impl_ = new pooled_task_impl(std::move(f));
+	scheduler->submit(ret.impl_);
 
 	return ret;
 }
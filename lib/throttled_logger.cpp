@@ -0,0 +1,206 @@
+#include "libfilezilla/throttled_logger.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/util.hpp"
+
+#include <atomic>
+#include <unordered_map>
+
+namespace fz {
+
+namespace {
+// Limits the memory used if there are lots of distinct messages, further ones are not throttled
+size_t const max_entries = 1024;
+}
+
+class throttled_logger::impl final
+{
+public:
+	impl(logger_interface & target, duration const& window, size_t max_per_window)
+		: target_(target)
+		, window_(window)
+		, max_per_window_(max_per_window)
+		, start_(monotonic_clock::coarse_now())
+	{
+		for (size_t i = 0; i < 64; ++i) {
+			rates_[i].store(0, std::memory_order_relaxed);
+			counters_[i].store(0, std::memory_order_relaxed);
+			skipped_[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	struct entry final
+	{
+		logmsg::type type_{};
+		size_t passed_{};
+		uint64_t suppressed_{};
+
+		// Last suppressed message, only one of the two is set
+		std::wstring last_;
+		deferred_log_message last_deferred_;
+	};
+
+	typedef std::unordered_map<uint64_t, entry> entries;
+
+	bool sample(logmsg::type t);
+
+	// Returns whether the message is to be passed on, otherwise it has been taken.
+	// If the window has passed, its entries are moved to old.
+	bool account(logmsg::type t, uint64_t key, std::wstring & msg, deferred_log_message & deferred, entries & old, bool & rollover);
+
+	// Logs the summaries of a past window
+	void report(entries & old);
+
+	logger_interface & target_;
+	duration const window_;
+	size_t const max_per_window_;
+
+	std::atomic<unsigned int> rates_[64];
+	std::atomic<uint64_t> counters_[64];
+	std::atomic<uint64_t> skipped_[64];
+
+	mutex mtx_{false};
+	monotonic_clock start_;
+	entries entries_;
+};
+
+bool throttled_logger::impl::sample(logmsg::type t)
+{
+	size_t const i = static_cast<size_t>(bitscan(static_cast<uint64_t>(t)));
+	unsigned int const rate = rates_[i].load(std::memory_order_relaxed);
+	if (rate <= 1) {
+		return true;
+	}
+	if (!(counters_[i].fetch_add(1, std::memory_order_relaxed) % rate)) {
+		return true;
+	}
+	skipped_[i].fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+bool throttled_logger::impl::account(logmsg::type t, uint64_t key, std::wstring & msg, deferred_log_message & deferred, entries & old, bool & rollover)
+{
+	key ^= static_cast<uint64_t>(t) * 0x9e3779b97f4a7c15ull;
+
+	scoped_lock l(mtx_);
+
+	auto const now = monotonic_clock::coarse_now();
+	if (now - start_ >= window_) {
+		old.swap(entries_);
+		start_ = now;
+		rollover = true;
+	}
+
+	auto it = entries_.find(key);
+	if (it == entries_.end()) {
+		if (entries_.size() >= max_entries) {
+			return true;
+		}
+		it = entries_.emplace(key, entry()).first;
+		it->second.type_ = t;
+	}
+
+	entry & e = it->second;
+	if (e.passed_ < max_per_window_) {
+		++e.passed_;
+		return true;
+	}
+
+	++e.suppressed_;
+	if (deferred) {
+		e.last_deferred_ = std::move(deferred);
+	}
+	else {
+		e.last_ = std::move(msg);
+	}
+	return false;
+}
+
+void throttled_logger::impl::report(entries & old)
+{
+	for (auto & it : old) {
+		entry & e = it.second;
+		if (e.suppressed_) {
+			std::wstring const last = e.last_deferred_ ? e.last_deferred_.format() : std::move(e.last_);
+			target_.do_log(e.type_, fz::sprintf(L"%u similar messages have been suppressed, the last one was: %s", e.suppressed_, last));
+		}
+	}
+	old.clear();
+
+	for (size_t i = 0; i < 64; ++i) {
+		if (skipped_[i].load(std::memory_order_relaxed)) {
+			uint64_t const skipped = skipped_[i].exchange(0, std::memory_order_relaxed);
+			if (skipped) {
+				target_.do_log(static_cast<logmsg::type>(1ull << i), fz::sprintf(L"%u messages have been skipped by sampling", skipped));
+			}
+		}
+	}
+}
+
+throttled_logger::throttled_logger(logger_interface & target, duration const& window, size_t max_per_window)
+	: impl_(std::make_unique<impl>(target, window, max_per_window))
+{
+	deferred_formatting_ = true;
+}
+
+throttled_logger::~throttled_logger()
+{
+	flush();
+}
+
+void throttled_logger::do_log(logmsg::type t, std::wstring && msg)
+{
+	if (!impl_->sample(t)) {
+		return;
+	}
+
+	impl::entries old;
+	bool rollover{};
+	deferred_log_message none;
+	bool const pass = impl_->account(t, std::hash<std::wstring>{}(msg), msg, none, old, rollover);
+	if (rollover) {
+		impl_->report(old);
+	}
+	if (pass) {
+		impl_->target_.do_log(t, std::move(msg));
+	}
+}
+
+void throttled_logger::do_log_deferred(logmsg::type t, deferred_log_message && msg)
+{
+	if (!impl_->sample(t)) {
+		return;
+	}
+
+	impl::entries old;
+	bool rollover{};
+	std::wstring none;
+	bool const pass = impl_->account(t, reinterpret_cast<uintptr_t>(msg.format_id()), none, msg, old, rollover);
+	if (rollover) {
+		impl_->report(old);
+	}
+	if (pass) {
+		impl_->target_.do_log_deferred(t, std::move(msg));
+	}
+}
+
+void throttled_logger::set_sampling(logmsg::type t, unsigned int n)
+{
+	for (size_t i = 0; i < 64; ++i) {
+		if (static_cast<uint64_t>(t) & (1ull << i)) {
+			impl_->rates_[i].store(n, std::memory_order_relaxed);
+		}
+	}
+}
+
+void throttled_logger::flush()
+{
+	impl::entries old;
+	{
+		scoped_lock l(impl_->mtx_);
+		old.swap(impl_->entries_);
+		impl_->start_ = monotonic_clock::coarse_now();
+	}
+	impl_->report(old);
+}
+
+}
@@ -5,8 +5,10 @@
 #ifndef FZ_WINDOWS
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #endif
 
+#include <string.h>
 #include <wchar.h>
 
 //#include <cassert>
@@ -14,6 +16,108 @@
 
 namespace fz {
 
+namespace {
+// Conversion between days since 1970-01-01 and the proleptic Gregorian calendar,
+// see Howard Hinnant's "chrono-Compatible Low-Level Date Algorithms".
+int64_t days_from_civil(int64_t y, int64_t m, int64_t d)
+{
+	y -= m <= 2;
+	int64_t const era = (y >= 0 ? y : y - 399) / 400;
+	int64_t const yoe = y - era * 400;
+	int64_t const doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	int64_t const doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+struct civil_time final
+{
+	int64_t year;
+	int month; // 1-12
+	int day;
+	int wday; // 0 is Sunday
+	int hour;
+	int minute;
+	int second;
+	int millisecond;
+};
+
+civil_time civil_from_ms(int64_t t)
+{
+	civil_time ret;
+
+	int64_t ms = t % 86400000;
+	int64_t days = t / 86400000;
+	if (ms < 0) {
+		ms += 86400000;
+		--days;
+	}
+	ret.millisecond = static_cast<int>(ms % 1000);
+	ret.second = static_cast<int>(ms / 1000 % 60);
+	ret.minute = static_cast<int>(ms / 60000 % 60);
+	ret.hour = static_cast<int>(ms / 3600000);
+
+	ret.wday = static_cast<int>((days % 7 + 11) % 7); // 1970-01-01 was a Thursday
+
+	int64_t const z = days + 719468;
+	int64_t const era = (z >= 0 ? z : z - 146096) / 146097;
+	int64_t const doe = z - era * 146097;
+	int64_t const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int64_t const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int64_t const mp = (5 * doy + 2) / 153;
+	ret.day = static_cast<int>(doy - (153 * mp + 2) / 5 + 1);
+	ret.month = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+	ret.year = yoe + era * 400 + (ret.month <= 2);
+
+	return ret;
+}
+
+// Same result as timegm, including normalization of out-of-range fields,
+// without the overhead of the C library. Month is 0-based.
+bool ms_from_utc_fields(int64_t & out, int64_t year, int64_t month, int64_t day, int64_t hour, int64_t minute, int64_t second)
+{
+	year += month / 12;
+	month %= 12;
+	if (month < 0) {
+		month += 12;
+		--year;
+	}
+	// Keep the arithmetic far away from overflow
+	if (year < -1000000 || year > 1000000) {
+		return false;
+	}
+
+	int64_t const days = days_from_civil(year, month + 1, 1) + day - 1;
+	out = (((days * 24 + hour) * 60 + minute) * 60 + second) * 1000;
+	return true;
+}
+
+template<typename C>
+C* put_digits(C* out, int64_t v, int count)
+{
+	for (int i = count - 1; i >= 0; --i) {
+		out[i] = static_cast<C>('0' + v % 10);
+		v /= 10;
+	}
+	return out + count;
+}
+
+template<typename C>
+bool get_digits(C const* in, int count, int & v)
+{
+	v = 0;
+	for (int i = 0; i < count; ++i) {
+		if (in[i] < '0' || in[i] > '9') {
+			return false;
+		}
+		v = v * 10 + (in[i] - '0');
+	}
+	return true;
+}
+
+char const months[][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+char const wdays[][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+}
+
 datetime::datetime(zone z, int year, int month, int day, int hour, int minute, int second, int millisecond)
 {
 	set(z, year, month, day, hour, minute, second, millisecond);
@@ -109,7 +213,7 @@ bool do_set(datetime& dt, String const& str, datetime::zone z)
 	}
 
 	datetime::accuracy a = datetime::days;
-	int64_t ms{};
+	int ms{};
 	if (parse(it, end, 2, t.tm_hour, 0)) {
 		a = datetime::hours;
 		if (parse(it, end, 2, t.tm_min, 0)) {
@@ -122,6 +226,16 @@ bool do_set(datetime& dt, String const& str, datetime::zone z)
 			}
 		}
 	}
+
+	if (a == datetime::days || z == datetime::utc) {
+		// Skip the C library, same as set(tm&) uses timegm here
+		return dt.set(datetime::utc, t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+			a >= datetime::hours ? t.tm_hour : -1,
+			a >= datetime::minutes ? t.tm_min : -1,
+			a >= datetime::seconds ? t.tm_sec : -1,
+			a >= datetime::milliseconds ? ms : -1);
+	}
+
 	bool success = dt.set(t, a, z);
 	if (success) {
 		dt += duration::from_milliseconds(ms);
@@ -396,6 +510,15 @@ bool datetime::set(zone z, int year, int month, int day, int hour, int minute, i
 	return set(st, a, z);
 #else
 
+	if (a == days || z == utc) {
+		int64_t t;
+		if (ms_from_utc_fields(t, year, int64_t(month) - 1, day, hour, minute, second)) {
+			t_ = t + millisecond;
+			a_ = a;
+			return true;
+		}
+	}
+
 	tm t{};
 	t.tm_isdst = -1;
 	t.tm_year = year - 1900;
@@ -747,7 +870,15 @@ tm datetime::get_tm(zone z) const
 		gmtime_r(&t, &ret);
 	}
 	else {
-		localtime_r(&t, &ret);
+		// Typically called for the current time, e.g. when formatting log lines. Converting to
+		// local time takes a global lock in the C library, remember the last second converted.
+		thread_local time_t cached_time{-1};
+		thread_local tm cached_tm{};
+		if (t != cached_time || t == -1) {
+			localtime_r(&t, &cached_tm);
+			cached_time = t;
+		}
+		ret = cached_tm;
 	}
 #endif
 	return ret;
@@ -779,28 +910,149 @@ FILETIME datetime::get_filetime() const
 #endif
 
 std::string datetime::get_rfc822() const
+{
+	char buf[max_formatted_size];
+	return std::string(buf, get_rfc822(buf));
+}
+
+size_t datetime::get_rfc822(char* out) const
+{
+	if (empty()) {
+		return 0;
+	}
+
+	auto const c = civil_from_ms(t_);
+	if (c.year < 0 || c.year > 9999) {
+		return 0;
+	}
+
+	// Sun, 06 Nov 1994 08:49:37 GMT
+	char* p = out;
+	memcpy(p, wdays[c.wday], 3);
+	p[3] = ',';
+	p[4] = ' ';
+	p = put_digits(p + 5, c.day, 2);
+	*p++ = ' ';
+	memcpy(p, months[c.month - 1], 3);
+	p[3] = ' ';
+	p = put_digits(p + 4, c.year, 4);
+	*p++ = ' ';
+	p = put_digits(p, c.hour, 2);
+	*p++ = ':';
+	p = put_digits(p, c.minute, 2);
+	*p++ = ':';
+	p = put_digits(p, c.second, 2);
+	memcpy(p, " GMT", 4);
+	return p + 4 - out;
+}
+
+std::string datetime::get_rfc3339() const
+{
+	char buf[max_formatted_size];
+	return std::string(buf, get_rfc3339(buf));
+}
+
+size_t datetime::get_rfc3339(char* out) const
 {
 	if (empty()) {
-		return std::string();
+		return 0;
 	}
-	tm const t = get_tm(datetime::zone::utc);
-	if (t.tm_wday < 0 || t.tm_wday > 6 || t.tm_mon < 0 || t.tm_mon > 11) {
-		return std::string();
+
+	auto const c = civil_from_ms(t_);
+	if (c.year < 0 || c.year > 9999) {
+		return 0;
+	}
+
+	// 1994-11-06T08:49:37.123Z
+	char* p = put_digits(out, c.year, 4);
+	*p++ = '-';
+	p = put_digits(p, c.month, 2);
+	*p++ = '-';
+	p = put_digits(p, c.day, 2);
+	*p++ = 'T';
+	p = put_digits(p, c.hour, 2);
+	*p++ = ':';
+	p = put_digits(p, c.minute, 2);
+	*p++ = ':';
+	p = put_digits(p, c.second, 2);
+	if (a_ == milliseconds) {
+		*p++ = '.';
+		p = put_digits(p, c.millisecond, 3);
+	}
+	*p++ = 'Z';
+	return p - out;
+}
+
+std::string datetime::get_mdtm() const
+{
+	char buf[max_formatted_size];
+	return std::string(buf, get_mdtm(buf));
+}
+
+size_t datetime::get_mdtm(char* out) const
+{
+	if (empty()) {
+		return 0;
 	}
 
-	static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-	static const char* wdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	auto const c = civil_from_ms(t_);
+	if (c.year < 0 || c.year > 9999) {
+		return 0;
+	}
 
-	return sprintf("%s, %02d %s %d %02d:%02d:%02d GMT", wdays[t.tm_wday], t.tm_mday, months[t.tm_mon], t.tm_year + 1900,
-		t.tm_hour, t.tm_min, t.tm_sec);
+	// 19941106084937.123
+	char* p = put_digits(out, c.year, 4);
+	p = put_digits(p, c.month, 2);
+	p = put_digits(p, c.day, 2);
+	p = put_digits(p, c.hour, 2);
+	p = put_digits(p, c.minute, 2);
+	p = put_digits(p, c.second, 2);
+	if (a_ == milliseconds) {
+		*p++ = '.';
+		p = put_digits(p, c.millisecond, 3);
+	}
+	return p - out;
 }
 
 using namespace std::literals;
 
 namespace {
+// The fixed-length format preferred by RFC 7231, e.g. Sun, 06 Nov 1994 08:49:37 GMT
+template<typename String>
+bool set_imf_fixdate(datetime& dt, String const& str)
+{
+	auto const* p = str.data();
+	if (str.size() != 29 || p[3] != ',' || p[4] != ' ' || p[7] != ' ' || p[11] != ' ' || p[16] != ' ' ||
+		p[19] != ':' || p[22] != ':' || p[25] != ' ' || p[26] != 'G' || p[27] != 'M' || p[28] != 'T')
+	{
+		return false;
+	}
+
+	int month = 0;
+	for (int i = 0; i < 12; ++i) {
+		if (p[8] == months[i][0] && p[9] == months[i][1] && p[10] == months[i][2]) {
+			month = i + 1;
+			break;
+		}
+	}
+
+	int day, year, hour, minute, second;
+	if (!month || !get_digits(p + 5, 2, day) || !get_digits(p + 12, 4, year) || year < 1000 ||
+		!get_digits(p + 17, 2, hour) || !get_digits(p + 20, 2, minute) || !get_digits(p + 23, 2, second))
+	{
+		return false;
+	}
+
+	return dt.set(datetime::utc, year, month, day, hour, minute, second);
+}
+
 template<typename String>
 bool do_set_rfc822(datetime& dt, String const& str)
 {
+	if (set_imf_fixdate(dt, str)) {
+		return true;
+	}
+
 	auto const tokens = strtok_view(str, fzS(typename String::value_type, ", :-"));
 	if (tokens.size() >= 7) {
 		auto getMonth = [](auto const& m) {
@@ -882,9 +1134,78 @@ bool datetime::set_rfc822(std::wstring_view const& str)
 }
 
 namespace {
+// Handles the common YYYY-MM-DDTHH:MM:SS[.fraction](Z|+HH:MM|-HH:MM) by position
+template<typename String>
+bool set_rfc3339_fixed(fz::datetime& dt, String const& str)
+{
+	auto const* p = str.data();
+	if (str.size() < 20 || p[4] != '-' || p[7] != '-' || (p[10] != 'T' && p[10] != 't' && p[10] != ' ') || p[13] != ':' || p[16] != ':') {
+		return false;
+	}
+
+	int year, month, day, hour, minute, second;
+	if (!get_digits(p, 4, year) || !get_digits(p + 5, 2, month) || !get_digits(p + 8, 2, day) ||
+		!get_digits(p + 11, 2, hour) || !get_digits(p + 14, 2, minute) || !get_digits(p + 17, 2, second))
+	{
+		return false;
+	}
+	if (year < 1000) {
+		year += 1900;
+	}
+
+	size_t pos = 19;
+	int ms = -1;
+	if (p[pos] == '.') {
+		++pos;
+		size_t const start = pos;
+		ms = 0;
+		while (pos < str.size() && p[pos] >= '0' && p[pos] <= '9') {
+			if (pos - start < 3) {
+				ms = ms * 10 + (p[pos] - '0');
+			}
+			++pos;
+		}
+		if (pos == start) {
+			return false;
+		}
+		for (size_t i = pos - start; i < 3; ++i) {
+			ms *= 10;
+		}
+	}
+
+	int offset{};
+	if (pos + 1 == str.size() && (p[pos] == 'Z' || p[pos] == 'z')) {
+	}
+	else if (pos + 6 == str.size() && (p[pos] == '+' || p[pos] == '-') && p[pos + 3] == ':') {
+		int oh, om;
+		if (!get_digits(p + pos + 1, 2, oh) || !get_digits(p + pos + 4, 2, om)) {
+			return false;
+		}
+		offset = oh * 60 + om;
+		if (p[pos] == '+') {
+			offset = -offset;
+		}
+	}
+	else {
+		return false;
+	}
+
+	if (!dt.set(fz::datetime::utc, year, month, day, hour, minute, second, ms)) {
+		return false;
+	}
+	if (offset) {
+		dt += fz::duration::from_minutes(offset);
+	}
+	return true;
+}
+
 template<typename String>
 bool do_set_rfc3339(fz::datetime& dt, String str)
 {
+	if (set_rfc3339_fixed(dt, str)) {
+		return true;
+	}
+
 	if (str.size() < 19) {
 		dt.clear();
 		return false;
@@ -975,4 +1296,43 @@ bool datetime::set_rfc3339(std::wstring_view const& str)
 	return do_set_rfc3339(*this, str);
 }
 
+
+namespace {
+class coarse_clock final
+{
+public:
+	coarse_clock()
+	{
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+		timespec res{};
+		timespec ts{};
+		if (!clock_getres(CLOCK_MONOTONIC_COARSE, &res) && !res.tv_sec && res.tv_nsec <= 10000000 && !clock_gettime(CLOCK_MONOTONIC_COARSE, &ts)) {
+			// Only usable if it is based on the same clock as steady_clock
+			auto const diff = std::chrono::steady_clock::now().time_since_epoch() - (std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec));
+			usable_ = diff >= std::chrono::nanoseconds(0) && diff < std::chrono::seconds(1);
+		}
+#endif
+	}
+
+	bool usable_{};
+};
+
+coarse_clock const& get_coarse_clock()
+{
+	static coarse_clock const c;
+	return c;
+}
+}
+
+monotonic_clock monotonic_clock::coarse_now()
+{
+#if defined(__linux__) && defined(CLOCK_MONOTONIC_COARSE)
+	if (get_coarse_clock().usable_) {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return monotonic_clock(clock_type::time_point(std::chrono::duration_cast<clock_type::duration>(std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec))));
+	}
+#endif
+	return now();
+}
 }
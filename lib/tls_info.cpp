@@ -17,17 +17,20 @@ x509_certificate::x509_certificate(
 	: activation_time_(activation_time)
 	, expiration_time_(expiration_time)
 	, raw_cert_(rawData)
-	, serial_(serial)
-	, pkalgoname_(pkalgoname)
-	, pkalgobits_(bits)
-	, signalgoname_(signalgoname)
-	, fingerprint_sha256_(fingerprint_sha256)
-	, fingerprint_sha1_(fingerprint_sha1)
-	, issuer_(issuer)
-	, subject_(subject)
-	, alt_subject_names_(alt_subject_names)
+	, details_(std::make_shared<details>())
 	, self_signed_(self_signed)
 {
+	std::call_once(details_->once_, [&]() {
+		details_->serial_ = serial;
+		details_->pkalgoname_ = pkalgoname;
+		details_->pkalgobits_ = bits;
+		details_->signalgoname_ = signalgoname;
+		details_->fingerprint_sha256_ = fingerprint_sha256;
+		details_->fingerprint_sha1_ = fingerprint_sha1;
+		details_->issuer_ = issuer;
+		details_->subject_ = subject;
+		details_->alt_subject_names_ = alt_subject_names;
+	});
 }
 
 x509_certificate::x509_certificate(
@@ -44,20 +47,93 @@ x509_certificate::x509_certificate(
 	bool const self_signed)
 	: activation_time_(activation_time)
 	, expiration_time_(expiration_time)
-	, raw_cert_(rawData)
-	, serial_(serial)
-	, pkalgoname_(pkalgoname)
-	, pkalgobits_(bits)
-	, signalgoname_(signalgoname)
-	, fingerprint_sha256_(fingerprint_sha256)
-	, fingerprint_sha1_(fingerprint_sha1)
-	, issuer_(issuer)
-	, subject_(subject)
-	, alt_subject_names_(alt_subject_names)
+	, raw_cert_(std::move(rawData))
+	, details_(std::make_shared<details>())
+	, self_signed_(self_signed)
+{
+	std::call_once(details_->once_, [&]() {
+		details_->serial_ = serial;
+		details_->pkalgoname_ = pkalgoname;
+		details_->pkalgobits_ = bits;
+		details_->signalgoname_ = signalgoname;
+		details_->fingerprint_sha256_ = fingerprint_sha256;
+		details_->fingerprint_sha1_ = fingerprint_sha1;
+		details_->issuer_ = issuer;
+		details_->subject_ = subject;
+		details_->alt_subject_names_ = std::move(alt_subject_names);
+	});
+}
+
+x509_certificate::x509_certificate(
+	std::vector<uint8_t> && rawData,
+	datetime const& activation_time, datetime const& expiration_time,
+	bool const self_signed)
+	: activation_time_(activation_time)
+	, expiration_time_(expiration_time)
+	, raw_cert_(std::move(rawData))
+	, details_(std::make_shared<details>())
 	, self_signed_(self_signed)
 {
 }
 
+x509_certificate::details const& x509_certificate::get_details() const
+{
+	if (!details_) {
+		static details const empty;
+		return empty;
+	}
+
+	std::call_once(details_->once_, [this]() {
+		tls_layer_impl::extract_cert_details(raw_cert_, *details_);
+	});
+	return *details_;
+}
+
+std::string const& x509_certificate::get_serial() const
+{
+	return get_details().serial_;
+}
+
+std::string const& x509_certificate::get_pubkey_algorithm() const
+{
+	return get_details().pkalgoname_;
+}
+
+unsigned int x509_certificate::get_pubkey_bits() const
+{
+	return get_details().pkalgobits_;
+}
+
+std::string const& x509_certificate::get_signature_algorithm() const
+{
+	return get_details().signalgoname_;
+}
+
+std::string const& x509_certificate::get_fingerprint_sha256() const
+{
+	return get_details().fingerprint_sha256_;
+}
+
+std::string const& x509_certificate::get_fingerprint_sha1() const
+{
+	return get_details().fingerprint_sha1_;
+}
+
+std::string const& x509_certificate::get_subject() const
+{
+	return get_details().subject_;
+}
+
+std::string const& x509_certificate::get_issuer() const
+{
+	return get_details().issuer_;
+}
+
+std::vector<x509_certificate::subject_name> const& x509_certificate::get_alt_subject_names() const
+{
+	return get_details().alt_subject_names_;
+}
+
 tls_session_info::tls_session_info(std::string const& host, unsigned int port,
 		std::string const& protocol,
 		std::string const& key_exchange,
@@ -1,4 +1,6 @@
 #include "libfilezilla/tls_layer.hpp"
+#include "libfilezilla/tls_ocsp_cache.hpp"
+#include "libfilezilla/tls_session_cache.hpp"
 #include "tls_layer_impl.hpp"
 
 namespace fz {
@@ -13,6 +15,8 @@ tls_layer::tls_layer(event_loop& event_loop, event_handler* evt_handler, socket_
 
 tls_layer::~tls_layer()
 {
+	// A running handshake task still posts its result
+	impl_->join_handshake_task();
 	remove_handler();
 }
 
@@ -41,6 +45,31 @@ int tls_layer::write(void const* buffer, unsigned int size, int& error)
 	return impl_->write(buffer, size, error);
 }
 
+int tls_layer::readv(socket_iovec const* buffers, size_t count, int& error)
+{
+	return impl_->readv(buffers, count, error);
+}
+
+int tls_layer::read_into(buffer & buf, size_t max, int& error)
+{
+	return impl_->read_into(buf, max, error);
+}
+
+int tls_layer::write(buffer & buf, int& error)
+{
+	return impl_->write(buf, error);
+}
+
+int tls_layer::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+	return impl_->writev(buffers, count, error);
+}
+
+int tls_layer::send_file(file & f, uint64_t offset, unsigned int size, int& error)
+{
+	return impl_->send_file(f, offset, size, error);
+}
+
 int tls_layer::shutdown()
 {
 	return impl_->shutdown();
@@ -86,6 +115,11 @@ bool tls_layer::resumed_session() const
 	return impl_->resumed_session();
 }
 
+tls_stats tls_layer::get_stats() const
+{
+	return impl_ ? impl_->stats_ : tls_stats();
+}
+
 std::string tls_layer::list_tls_ciphers(std::string const& priority)
 {
 	return tls_layer_impl::list_tls_ciphers(priority);
@@ -141,6 +175,36 @@ int tls_layer::shutdown_read()
 	return impl_->shutdown_read();
 }
 
+void tls_layer::get_memory_usage(std::vector<socket_memory_usage> & usage) const
+{
+	socket_memory_usage u;
+	u.name_ = "tls_layer";
+	u.object_size_ = sizeof(tls_layer) + sizeof(tls_layer_impl);
+	u.heap_size_ = impl_->heap_size();
+	usage.push_back(u);
+
+	next_layer_.get_memory_usage(usage);
+}
+
+void tls_layer::hibernate()
+{
+	impl_->hibernate();
+	next_layer_.hibernate();
+}
+
+void tls_layer::cork()
+{
+	impl_->cork();
+	next_layer_.cork();
+}
+
+int tls_layer::uncork()
+{
+	int res = impl_->uncork();
+	int const next = next_layer_.uncork();
+	return res ? res : next;
+}
+
 void tls_layer::set_event_handler(event_handler* pEvtHandler, fz::socket_event_flag retrigger_block)
 {
 	return impl_->set_event_handler(pEvtHandler, retrigger_block);
@@ -225,4 +289,68 @@ void tls_layer::set_unexpected_eof_cb(std::function<bool()> && cb)
 		impl_->set_unexpected_eof_cb(std::move(cb));
 	}
 }
+
+void tls_layer::set_session_cache(tls_session_cache * cache)
+{
+	if (impl_) {
+		impl_->set_session_cache(cache ? cache->impl_.get() : nullptr);
+	}
+}
+
+void tls_layer::set_ocsp_cache(tls_ocsp_cache * cache)
+{
+	if (impl_) {
+		impl_->set_ocsp_cache(cache ? cache->impl_.get() : nullptr);
+	}
+}
+
+void tls_layer::set_max_early_data(size_t max_size)
+{
+	if (impl_) {
+		impl_->set_max_early_data(max_size);
+	}
+}
+
+void tls_layer::set_early_data(std::string_view const& data)
+{
+	if (impl_) {
+		impl_->set_early_data(data);
+	}
+}
+
+bool tls_layer::early_data_accepted() const
+{
+	return impl_ ? impl_->early_data_accepted() : false;
+}
+
+size_t tls_layer::early_data_size() const
+{
+	return impl_ ? impl_->early_data_size_ : 0;
+}
+
+void tls_layer::set_handshake_thread_pool(thread_pool * pool)
+{
+	if (impl_) {
+		impl_->set_handshake_thread_pool(pool);
+	}
+}
+
+void tls_layer::set_dynamic_record_sizing(bool enable, size_t small_size, uint64_t ramp_threshold, duration const& idle_timeout)
+{
+	if (impl_) {
+		impl_->set_dynamic_record_sizing(enable, small_size, ramp_threshold, idle_timeout);
+	}
+}
+
+void tls_layer::set_kernel_offload(bool enable)
+{
+	if (impl_) {
+		impl_->set_kernel_offload(enable);
+	}
+}
+
+tls_offload tls_layer::get_kernel_offload() const
+{
+	return impl_ ? impl_->get_kernel_offload() : tls_offload::none;
+}
 }
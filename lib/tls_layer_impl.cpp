@@ -1,20 +1,31 @@
 #include "libfilezilla/tls_layer.hpp"
 #include "tls_layer_impl.hpp"
 #include "libfilezilla/tls_info.hpp"
+#include "tls_ocsp_cache_impl.hpp"
+#include "tls_session_cache_impl.hpp"
 #include "tls_system_trust_store_impl.hpp"
+#include "tracepoints.hpp"
 
 #include "libfilezilla/file.hpp"
+#include "libfilezilla/hash.hpp"
 #include "libfilezilla/iputils.hpp"
+#include "libfilezilla/mutex.hpp"
 #include "libfilezilla/translate.hpp"
 #include "libfilezilla/util.hpp"
 
 #include <gnutls/x509.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <set>
 
 #include <string.h>
 
+#if HAVE_KTLS
+#include <linux/tls.h>
+#endif
+
 using namespace std::literals;
 
 #if DEBUG_SOCKETEVENTS
@@ -66,7 +77,7 @@ void remove_verification_events(event_handler* handler, tls_layer const* const s
 		return false;
 	};
 
-	handler->event_loop_.filter_events(event_filter);
+	handler->get_event_loop().filter_events(event_filter);
 }
 
 extern "C" ssize_t c_push_function(gnutls_transport_ptr_t ptr, const void* data, size_t len)
@@ -74,6 +85,11 @@ extern "C" ssize_t c_push_function(gnutls_transport_ptr_t ptr, const void* data,
 	return ((tls_layer_impl*)ptr)->push_function(data, len);
 }
 
+extern "C" ssize_t c_vec_push_function(gnutls_transport_ptr_t ptr, giovec_t const* iov, int iovcnt)
+{
+	return ((tls_layer_impl*)ptr)->vec_push_function(iov, iovcnt);
+}
+
 extern "C" ssize_t c_pull_function(gnutls_transport_ptr_t ptr, void* data, size_t len)
 {
 	return ((tls_layer_impl*)ptr)->pull_function(data, len);
@@ -132,6 +148,10 @@ public:
 		tls->session_db_data_.resize(data.size);
 		memcpy(tls->session_db_data_.data(), data.data, data.size);
 
+		if (tls->session_cache_) {
+			tls->session_cache_->store(std::vector<uint8_t>(tls->session_db_key_), std::vector<uint8_t>(tls->session_db_data_));
+		}
+
 		return 0;
 	}
 
@@ -145,12 +165,24 @@ public:
 			return {};
 		}
 
+		std::vector<uint8_t> cached;
+		std::vector<uint8_t> const* data{};
 		if (key.size == tls->session_db_key_.size() && !memcmp(tls->session_db_key_.data(), key.data, key.size)) {
+			data = &tls->session_db_data_;
+		}
+		else if (tls->session_cache_) {
+			cached = tls->session_cache_->retrieve(std::vector<uint8_t>(key.data, key.data + key.size));
+			if (!cached.empty()) {
+				data = &cached;
+			}
+		}
+
+		if (data) {
 			gnutls_datum_t d{};
-			d.data = reinterpret_cast<unsigned char*>(gnutls_malloc(tls->session_db_data_.size()));
+			d.data = reinterpret_cast<unsigned char*>(gnutls_malloc(data->size()));
 			if (d.data) {
-				d.size = tls->session_db_data_.size();
-				memcpy(d.data, tls->session_db_data_.data(), d.size);
+				d.size = data->size();
+				memcpy(d.data, data->data(), d.size);
 			}
 			return d;
 		}
@@ -158,6 +190,41 @@ public:
 		return gnutls_datum_t{};
 	}
 
+	static int remove_session(void *ptr, gnutls_datum_t key)
+	{
+		auto* tls = reinterpret_cast<tls_layer_impl*>(ptr);
+		if (!tls || !key.size) {
+			return 0;
+		}
+
+		if (tls->session_cache_) {
+			tls->session_cache_->remove(std::vector<uint8_t>(key.data, key.data + key.size));
+		}
+
+		return 0;
+	}
+
+	static int ocsp_status(void *ptr, gnutls_datum_t *ocsp_response)
+	{
+		auto* tls = reinterpret_cast<tls_layer_impl*>(ptr);
+		if (!tls || !tls->ocsp_cache_) {
+			return GNUTLS_E_NO_CERTIFICATE_STATUS;
+		}
+
+		auto const response = tls->ocsp_cache_->get(tls->ocsp_certificate_);
+		if (response.empty()) {
+			return GNUTLS_E_NO_CERTIFICATE_STATUS;
+		}
+
+		ocsp_response->data = reinterpret_cast<unsigned char*>(gnutls_malloc(response.size()));
+		if (!ocsp_response->data) {
+			return GNUTLS_E_MEMORY_ERROR;
+		}
+		ocsp_response->size = response.size();
+		memcpy(ocsp_response->data, response.data(), response.size());
+		return 0;
+	}
+
 	static void verify_output_cb(gnutls_x509_crt_t cert, gnutls_x509_crt_t issuer, gnutls_x509_crl_t crl, unsigned int verification_output)
 	{
 		if (verify_output_cb_) {
@@ -183,6 +250,16 @@ extern "C" gnutls_datum_t db_retr_func(void *ptr, gnutls_datum_t key)
 {
 	return tls_layerCallbacks::retrieve_session(ptr, key);
 }
+
+extern "C" int db_remove_func(void *ptr, gnutls_datum_t key)
+{
+	return tls_layerCallbacks::remove_session(ptr, key);
+}
+extern "C" int ocsp_status_func(gnutls_session_t, void *ptr, gnutls_datum_t *ocsp_response)
+{
+	return tls_layerCallbacks::ocsp_status(ptr, ocsp_response);
+}
+
 extern "C" int c_verify_output_cb(gnutls_x509_crt_t cert, gnutls_x509_crt_t issuer, gnutls_x509_crl_t crl, unsigned int verification_output)
 {
 	tls_layerCallbacks::verify_output_cb(cert, issuer, crl, verification_output);
@@ -253,24 +330,89 @@ void clone_cert(gnutls_x509_crt_t in, gnutls_x509_crt_t &out)
 }
 }
 
+namespace {
+class gnutls_initializer final
+{
+public:
+	gnutls_initializer()
+		: res_(gnutls_global_init())
+	{}
+
+	~gnutls_initializer()
+	{
+		if (!res_) {
+			gnutls_global_deinit();
+		}
+	}
+
+	int const res_;
+};
+}
+
+int init_gnutls()
+{
+	// Anything using GnuTLS calls this first, so it gets destroyed last
+	static gnutls_initializer init;
+	return init.res_;
+}
+
 tls_layer_impl::tls_layer_impl(tls_layer& layer, tls_system_trust_store* systemTrustStore, logger_interface & logger)
 	: tls_layer_(layer)
 	, logger_(logger)
 	, system_trust_store_(systemTrustStore)
 {
+	if (system_trust_store_) {
+		// Lazily loaded stores are going to be needed soon
+		system_trust_store_->impl_->prepare();
+	}
 }
 
 tls_layer_impl::~tls_layer_impl()
 {
+	join_handshake_task();
 	deinit();
 }
 
+void tls_layer_impl::join_handshake_task()
+{
+	if (handshake_task_) {
+		handshake_task_.join();
+	}
+}
+
+size_t tls_layer_impl::heap_size() const
+{
+	size_t ret = send_buffer_.heap_size() + gather_buffer_.heap_size() + cork_buffer_.heap_size() + preamble_.heap_size() + early_data_.heap_size();
+	ret += ticket_key_.capacity() + session_db_key_.capacity() + session_db_data_.capacity();
+	ret += required_certificate_.capacity() + ocsp_certificate_.capacity();
+	ret += alpn_.capacity() * sizeof(std::string);
+	for (auto const& alpn : alpn_) {
+		ret += alpn.capacity();
+	}
+	ret += hostname_.capacity() * sizeof(native_string::value_type);
+	return ret;
+}
+
+void tls_layer_impl::hibernate()
+{
+	// The buffers may be in use by the pool thread
+	if (handshake_task_running_) {
+		return;
+	}
+
+	for (buffer * b : {&send_buffer_, &gather_buffer_, &cork_buffer_, &preamble_, &early_data_}) {
+		if (b->empty()) {
+			b->shrink_to_fit();
+		}
+	}
+}
+
 bool tls_layer_impl::init()
 {
 	// This function initializes GnuTLS
 	if (!initialized_) {
 		initialized_ = true;
-		int res = gnutls_global_init();
+		int res = init_gnutls();
 		if (res) {
 			log_error(res, L"gnutls_global_init");
 			deinit();
@@ -403,6 +545,9 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 	}
 
 	if (!client) {
+		if (session_cache_) {
+			ticket_key_ = session_cache_->ticket_key();
+		}
 		if (ticket_key_.empty()) {
 			datum_holder h;
 			res = gnutls_session_ticket_key_generate(&h);
@@ -433,12 +578,18 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 	// implies expiration of some cache, it also governs
 	// the actual session lifetime, independend whether the
 	// session is cached or not.
-	gnutls_db_set_cache_expiration(session_, 100000000);
+	// With a session cache, its TTL applies instead.
+	int expiration = 100000000;
+	if (session_cache_ && !client) {
+		expiration = static_cast<int>(std::clamp(session_cache_->ttl_.get_seconds(), static_cast<int64_t>(1), static_cast<int64_t>(expiration)));
+	}
+	gnutls_db_set_cache_expiration(session_, expiration);
 
 	if (!client) {
 		gnutls_db_set_ptr(session_, this);
 		gnutls_db_set_store_function(session_, &db_store_func);
 		gnutls_db_set_retrieve_function(session_, &db_retr_func);
+		gnutls_db_set_remove_function(session_, &db_remove_func);
 	}
 
 	std::string prio = ciphers;
@@ -485,6 +636,7 @@ bool tls_layer_impl::init_session(bool client, int extra_flags)
 
 	// Setup transport functions
 	gnutls_transport_set_push_function(session_, c_push_function);
+	gnutls_transport_set_vec_push_function(session_, c_vec_push_function);
 	gnutls_transport_set_pull_function(session_, c_pull_function);
 	gnutls_transport_set_ptr(session_, (gnutls_transport_ptr_t)this);
 
@@ -505,10 +657,7 @@ void tls_layer_impl::deinit()
 		cert_credentials_ = nullptr;
 	}
 
-	if (initialized_) {
-		initialized_ = false;
-		gnutls_global_deinit();
-	}
+	initialized_ = false;
 
 	ticket_key_.clear();
 
@@ -601,6 +750,13 @@ ssize_t tls_layer_impl::push_function(void const* data, size_t len)
 #if TLSDEBUG
 	logger_.log(logmsg::debug_debug, L"tls_layer_impl::push_function(%d)", len);
 #endif
+	if (ktls_ & tls_offload::send) {
+		// The kernel has the keys now, anything GnuTLS would like to send, e.g. a key update, cannot be sent
+		logger_.log(logmsg::error, fztranslate("Cannot send TLS record, sending has been offloaded to the kernel"));
+		socket_error_ = EOPNOTSUPP;
+		gnutls_transport_set_errno(session_, EOPNOTSUPP);
+		return -1;
+	}
 	if (!can_write_to_socket_) {
 		gnutls_transport_set_errno(session_, EAGAIN);
 		return -1;
@@ -628,6 +784,52 @@ ssize_t tls_layer_impl::push_function(void const* data, size_t len)
 	return written;
 }
 
+ssize_t tls_layer_impl::vec_push_function(giovec_t const* iov, int iovcnt)
+{
+#if TLSDEBUG
+	logger_.log(logmsg::debug_debug, L"tls_layer_impl::vec_push_function(%d)", iovcnt);
+#endif
+	if (ktls_ & tls_offload::send) {
+		logger_.log(logmsg::error, fztranslate("Cannot send TLS record, sending has been offloaded to the kernel"));
+		socket_error_ = EOPNOTSUPP;
+		gnutls_transport_set_errno(session_, EOPNOTSUPP);
+		return -1;
+	}
+	if (!can_write_to_socket_) {
+		gnutls_transport_set_errno(session_, EAGAIN);
+		return -1;
+	}
+
+	// Further buffers are left to the next call
+	socket_const_iovec bufs[64];
+	size_t count = std::min(sizeof(bufs) / sizeof(bufs[0]), static_cast<size_t>(iovcnt));
+	for (size_t i = 0; i < count; ++i) {
+		bufs[i].data = iov[i].iov_base;
+		bufs[i].size = static_cast<unsigned int>(std::min(iov[i].iov_len, static_cast<size_t>(std::numeric_limits<unsigned int>::max())));
+	}
+
+	int error;
+	int written = tls_layer_.next_layer_.writev(bufs, count, error);
+
+	if (written < 0) {
+		can_write_to_socket_ = false;
+		if (error != EAGAIN) {
+			socket_error_ = error;
+		}
+		gnutls_transport_set_errno(session_, error);
+#if TLSDEBUG
+		logger_.log(logmsg::debug_debug, L"  returning -1 due to %d", error);
+#endif
+		return -1;
+	}
+
+#if TLSDEBUG
+	logger_.log(logmsg::debug_debug, L"  returning %d", written);
+#endif
+
+	return written;
+}
+
 ssize_t tls_layer_impl::pull_function(void* data, size_t len)
 {
 #if TLSDEBUG
@@ -668,9 +870,10 @@ ssize_t tls_layer_impl::pull_function(void* data, size_t len)
 
 void tls_layer_impl::operator()(event_base const& ev)
 {
-	dispatch<socket_event, hostaddress_event>(ev, this
+	dispatch<socket_event, hostaddress_event, tls_handshake_result_event>(ev, this
 		, &tls_layer_impl::on_socket_event
-		, &tls_layer_impl::forward_hostaddress_event);
+		, &tls_layer_impl::forward_hostaddress_event
+		, &tls_layer_impl::on_handshake_task_result);
 }
 
 void tls_layer_impl::forward_hostaddress_event(socket_event_source* source, std::string const& address)
@@ -689,6 +892,19 @@ void tls_layer_impl::on_socket_event(socket_event_source* s, socket_event_flag t
 		return;
 	}
 
+	if (handshake_task_running_) {
+		if (error) {
+			deferred_error_ = error;
+		}
+		else if (t == socket_event_flag::read) {
+			deferred_read_ = true;
+		}
+		else {
+			deferred_write_ = true;
+		}
+		return;
+	}
+
 	if (error) {
 		socket_error_ = error;
 		deinit();
@@ -736,9 +952,7 @@ void tls_layer_impl::on_read()
 		assert(!debug_can_read_);
 		debug_can_read_ = true;
 #endif
-		if (tls_layer_.event_handler_) {
-			tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::read, 0);
-		}
+		tls_layer_.signal_socket_event(tls_layer_, socket_event_flag::read, 0);
 	}
 }
 
@@ -763,9 +977,7 @@ void tls_layer_impl::on_send()
 
 		res = continue_shutdown();
 		if (res != EAGAIN) {
-			if (tls_layer_.event_handler_) {
-				tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::write, res);
-			}
+			tls_layer_.signal_socket_event(tls_layer_, socket_event_flag::write, res);
 		}
 	}
 	else if (state_ == socket_state::connected) {
@@ -778,7 +990,7 @@ int tls_layer_impl::continue_write()
 	while (!send_buffer_.empty()) {
 		ssize_t res = GNUTLS_E_AGAIN;
 		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
-			res = gnutls_record_send(session_, send_buffer_.get(), send_buffer_.size());
+			res = gnutls_record_send(session_, send_buffer_.get(), std::min(send_buffer_.size(), record_size()));
 		}
 
 		if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
@@ -796,6 +1008,7 @@ int tls_layer_impl::continue_write()
 			return ECONNABORTED;
 		}
 
+		on_record_sent(static_cast<size_t>(res));
 		send_buffer_.consume(static_cast<size_t>(res));
 	}
 
@@ -825,20 +1038,180 @@ int tls_layer_impl::continue_write()
 			assert(!debug_can_write_);
 			debug_can_write_ = true;
 #endif
-			if (tls_layer_.event_handler_) {
-				tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::write, 0);
-			}
+			// Last thing done in on_send, nothing accesses the layer afterwards
+			tls_layer_.signal_socket_event(tls_layer_, socket_event_flag::write, 0);
 		}
 	}
 
 	return 0;
 }
 
+namespace {
+int64_t steady_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct global_tls_stats final
+{
+	std::atomic<uint64_t> handshakes_{};
+	std::atomic<uint64_t> resumed_handshakes_{};
+	std::atomic<uint64_t> failed_handshakes_{};
+	std::atomic<uint64_t> handshake_time_{};
+	std::atomic<uint64_t> handshake_cpu_time_{};
+	std::atomic<uint64_t> verification_time_{};
+	std::atomic<uint64_t> bytes_encrypted_{};
+	std::atomic<uint64_t> bytes_decrypted_{};
+	std::atomic<uint64_t> records_sent_{};
+	std::atomic<uint64_t> send_retries_{};
+	std::atomic<uint64_t> blocked_writes_{};
+
+	mutex mtx_{false};
+	std::map<std::string, uint64_t> ciphers_;
+};
+
+global_tls_stats& global_stats()
+{
+	static global_tls_stats s;
+	return s;
+}
+
+void add(std::atomic<uint64_t> & counter, uint64_t v)
+{
+	counter.fetch_add(v, std::memory_order_relaxed);
+}
+}
+
+tls_stats& tls_stats::operator+=(tls_stats const& op)
+{
+	handshakes += op.handshakes;
+	resumed_handshakes += op.resumed_handshakes;
+	failed_handshakes += op.failed_handshakes;
+	handshake_time += op.handshake_time;
+	handshake_cpu_time += op.handshake_cpu_time;
+	verification_time += op.verification_time;
+	bytes_encrypted += op.bytes_encrypted;
+	bytes_decrypted += op.bytes_decrypted;
+	records_sent += op.records_sent;
+	send_retries += op.send_retries;
+	blocked_writes += op.blocked_writes;
+	for (auto const& c : op.ciphers) {
+		ciphers[c.first] += c.second;
+	}
+	return *this;
+}
+
+tls_stats get_tls_stats()
+{
+	auto & s = global_stats();
+
+	tls_stats ret;
+	ret.handshakes = s.handshakes_.load(std::memory_order_relaxed);
+	ret.resumed_handshakes = s.resumed_handshakes_.load(std::memory_order_relaxed);
+	ret.failed_handshakes = s.failed_handshakes_.load(std::memory_order_relaxed);
+	ret.handshake_time = s.handshake_time_.load(std::memory_order_relaxed);
+	ret.handshake_cpu_time = s.handshake_cpu_time_.load(std::memory_order_relaxed);
+	ret.verification_time = s.verification_time_.load(std::memory_order_relaxed);
+	ret.bytes_encrypted = s.bytes_encrypted_.load(std::memory_order_relaxed);
+	ret.bytes_decrypted = s.bytes_decrypted_.load(std::memory_order_relaxed);
+	ret.records_sent = s.records_sent_.load(std::memory_order_relaxed);
+	ret.send_retries = s.send_retries_.load(std::memory_order_relaxed);
+	ret.blocked_writes = s.blocked_writes_.load(std::memory_order_relaxed);
+
+	scoped_lock l(s.mtx_);
+	ret.ciphers = s.ciphers_;
+	return ret;
+}
+
+void tls_layer_impl::on_record_sent(size_t size)
+{
+	++stats_.records_sent;
+	add(global_stats().records_sent_, 1);
+	on_encrypted(size);
+}
+
+void tls_layer_impl::on_encrypted(size_t size)
+{
+	stats_.bytes_encrypted += size;
+	add(global_stats().bytes_encrypted_, size);
+}
+
+void tls_layer_impl::on_decrypted(size_t size)
+{
+	stats_.bytes_decrypted += size;
+	add(global_stats().bytes_decrypted_, size);
+}
+
+void tls_layer_impl::on_send_retry()
+{
+	++stats_.send_retries;
+	add(global_stats().send_retries_, 1);
+}
+
+void tls_layer_impl::on_blocked_write()
+{
+	++stats_.blocked_writes;
+	add(global_stats().blocked_writes_, 1);
+}
+
+void tls_layer_impl::add_handshake_cpu_time()
+{
+	stats_.handshake_cpu_time += handshake_cpu_time_;
+	add(global_stats().handshake_cpu_time_, handshake_cpu_time_);
+	handshake_cpu_time_ = 0;
+}
+
+void tls_layer_impl::on_handshake_completed()
+{
+	auto & s = global_stats();
+
+	uint64_t const handshake_time = static_cast<uint64_t>(handshake_end_ - handshake_start_);
+	uint64_t const verification_time = server_ ? 0 : static_cast<uint64_t>(steady_us() - handshake_end_);
+	stats_.handshake_time += handshake_time;
+	stats_.verification_time += verification_time;
+	add(s.handshake_time_, handshake_time);
+	add(s.verification_time_, verification_time);
+
+	++stats_.handshakes;
+	add(s.handshakes_, 1);
+	if (resumed_session()) {
+		++stats_.resumed_handshakes;
+		add(s.resumed_handshakes_, 1);
+	}
+
+	std::string const cipher = get_cipher();
+	++stats_.ciphers[cipher];
+
+	FZ_TRACE3(tls_handshake_finish, this, true, resumed_session());
+
+	scoped_lock l(s.mtx_);
+	++s.ciphers_[cipher];
+}
+
+void tls_layer_impl::on_handshake_failed()
+{
+	++stats_.failed_handshakes;
+	add(global_stats().failed_handshakes_, 1);
+
+	FZ_TRACE3(tls_handshake_finish, this, false, false);
+}
+
 bool tls_layer_impl::resumed_session() const
 {
 	return gnutls_session_is_resumed(session_) != 0;
 }
 
+bool tls_layer_impl::early_data_accepted() const
+{
+	return session_ && (gnutls_session_get_flags(session_) & GNUTLS_SFLAGS_EARLY_DATA);
+}
+
+void tls_layer_impl::set_early_data(std::string_view const& data)
+{
+	early_data_.clear();
+	early_data_.append(data);
+}
+
 bool tls_layer_impl::client_handshake(std::vector<uint8_t> const& session_to_resume, native_string const& session_hostname, std::vector<uint8_t> const& required_certificate, event_handler *const verification_handler)
 {
 	logger_.log(logmsg::debug_verbose, L"tls_layer_impl::client_handshake()");
@@ -850,11 +1223,14 @@ bool tls_layer_impl::client_handshake(std::vector<uint8_t> const& session_to_res
 
 	server_ = false;
 
-	if (!init() || !init_session(true)) {
+	int const extra_flags = early_data_.empty() ? 0 : GNUTLS_ENABLE_EARLY_DATA;
+	if (!init() || !init_session(true, extra_flags)) {
 		return false;
 	}
 
 	state_ = socket_state::connecting;
+	handshake_start_ = steady_us();
+	FZ_TRACE2(tls_handshake_start, this, server_);
 
 	if (!required_certificate.empty()) {
 		std::string_view v(reinterpret_cast<char const*>(required_certificate.data()), required_certificate.size());
@@ -884,14 +1260,23 @@ bool tls_layer_impl::client_handshake(std::vector<uint8_t> const& session_to_res
 		if (res) {
 			logger_.log(logmsg::debug_info, L"gnutls_session_set_data failed: %d. Going to reinitialize session.", res);
 			deinit_session();
-			if (!init_session(true)) {
+			if (!init_session(true, extra_flags)) {
 				return false;
 			}
 		}
 		else {
 			logger_.log(logmsg::debug_info, L"Trying to resume existing TLS session.");
+
+			if (!early_data_.empty()) {
+				// Limited by the ticket, fails if it does not permit early data
+				ssize_t sent = gnutls_record_send_early_data(session_, early_data_.get(), early_data_.size());
+				if (sent < 0) {
+					logger_.log(logmsg::debug_info, L"Not sending early data: %s", gnutls_strerror(static_cast<int>(sent)));
+				}
+			}
 		}
 	}
+	early_data_.clear();
 
 	if (logger_.should_log(logmsg::debug_debug)) {
 		gnutls_handshake_set_hook_function(session_, GNUTLS_HANDSHAKE_ANY, GNUTLS_HOOK_BOTH, &handshake_hook_func);
@@ -969,11 +1354,35 @@ bool tls_layer_impl::server_handshake(std::vector<uint8_t> const& session_to_res
 	if (flags & tls_server_flags::no_auto_ticket) {
 		extra_flags |= GNUTLS_NO_AUTO_SEND_TICKET;
 	}
+	gnutls_anti_replay_t anti_replay{};
+	if (max_early_data_ && session_cache_) {
+		anti_replay = session_cache_->anti_replay();
+		if (anti_replay) {
+			extra_flags |= GNUTLS_ENABLE_EARLY_DATA;
+		}
+	}
 	if (!init() || !init_session(false, extra_flags)) {
 		return false;
 	}
 
+	if (ocsp_cache_ && !enable_ocsp_stapling()) {
+		deinit();
+		return false;
+	}
+
+	if (anti_replay) {
+		gnutls_anti_replay_enable(session_, anti_replay);
+		int res = gnutls_record_set_max_early_data_size(session_, max_early_data_);
+		if (res) {
+			log_error(res, L"gnutls_record_set_max_early_data_size");
+			deinit();
+			return false;
+		}
+	}
+
 	state_ = socket_state::connecting;
+	handshake_start_ = steady_us();
+	FZ_TRACE2(tls_handshake_start, this, server_);
 
 	if (logger_.should_log(logmsg::debug_debug)) {
 		gnutls_handshake_set_hook_function(session_, GNUTLS_HANDSHAKE_ANY, GNUTLS_HOOK_BOTH, &handshake_hook_func);
@@ -993,6 +1402,26 @@ bool tls_layer_impl::server_handshake(std::vector<uint8_t> const& session_to_res
 	return continue_handshake() == EAGAIN;
 }
 
+bool tls_layer_impl::enable_ocsp_stapling()
+{
+	gnutls_datum_t cert{};
+	gnutls_datum_t issuer{};
+	if (gnutls_certificate_get_crt_raw(cert_credentials_, 0, 0, &cert) || gnutls_certificate_get_crt_raw(cert_credentials_, 0, 1, &issuer)) {
+		logger_.log(logmsg::debug_warning, L"Not stapling OCSP responses, the certificate chain does not contain the issuer");
+		return true;
+	}
+
+	ocsp_certificate_.assign(cert.data, cert.data + cert.size);
+	ocsp_cache_->add(ocsp_certificate_, std::vector<uint8_t>(issuer.data, issuer.data + issuer.size));
+
+	int res = gnutls_certificate_set_ocsp_status_request_function2(cert_credentials_, 0, &ocsp_status_func, this);
+	if (res) {
+		log_error(res, L"gnutls_certificate_set_ocsp_status_request_function2");
+		return false;
+	}
+	return true;
+}
+
 int tls_layer_impl::continue_handshake()
 {
 	logger_.log(logmsg::debug_verbose, L"tls_layer_impl::continue_handshake()");
@@ -1018,6 +1447,25 @@ int tls_layer_impl::continue_handshake()
 		preamble_.consume(static_cast<size_t>(written));
 	}
 
+	if (handshake_pool_) {
+		if (!handshake_task_running_) {
+			handshake_task_running_ = true;
+			handshake_task_ = handshake_pool_->submit([this]() {
+				int res = do_handshake();
+				tls_layer_.send_event<tls_handshake_result_event>(res);
+			});
+		}
+		return EAGAIN;
+	}
+
+	int res = do_handshake();
+	add_handshake_cpu_time();
+	return on_handshake_result(res);
+}
+
+int tls_layer_impl::do_handshake()
+{
+	int64_t const start = steady_us();
 	int res = gnutls_handshake(session_);
 	while (res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) {
 		if (!(gnutls_record_get_direction(session_) ? can_write_to_socket_ : can_read_from_socket_)) {
@@ -1025,9 +1473,52 @@ int tls_layer_impl::continue_handshake()
 		}
 		res = gnutls_handshake(session_);
 	}
+	handshake_cpu_time_ += static_cast<uint64_t>(steady_us() - start);
+	return res;
+}
+
+void tls_layer_impl::on_handshake_task_result(int res)
+{
+	handshake_task_running_ = false;
+	add_handshake_cpu_time();
+
+	if (deferred_read_) {
+		deferred_read_ = false;
+		can_read_from_socket_ = true;
+	}
+	if (deferred_write_) {
+		deferred_write_ = false;
+		can_write_to_socket_ = true;
+	}
+
+	if (!session_ || state_ != socket_state::connecting) {
+		return;
+	}
+
+	if (deferred_error_) {
+		socket_error_ = deferred_error_;
+		deferred_error_ = 0;
+		failure(0, true);
+		return;
+	}
+
+	if ((res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) && !socket_error_) {
+		// The socket became ready again while the task was running
+		if (gnutls_record_get_direction(session_) ? can_write_to_socket_ : can_read_from_socket_) {
+			continue_handshake();
+			return;
+		}
+	}
+
+	on_handshake_result(res);
+}
+
+int tls_layer_impl::on_handshake_result(int res)
+{
 	if (!res) {
 		logger_.log(logmsg::debug_info, L"TLS Handshake successful");
 		handshake_successful_ = true;
+		handshake_end_ = steady_us();
 
 		if (resumed_session()) {
 			logger_.log(logmsg::debug_info, L"TLS Session resumed");
@@ -1044,10 +1535,15 @@ int tls_layer_impl::continue_handshake()
 			return verify_certificate();
 		}
 		else {
+			if (early_data_accepted()) {
+				receive_early_data();
+			}
+			on_handshake_completed();
+			enable_kernel_offload();
 			state_ = socket_state::connected;
 
 #if DEBUG_SOCKETEVENTS
-			if (can_read_from_socket_) {
+			if (can_read_from_socket_ || !early_data_.empty()) {
 				assert(!debug_can_read_);
 				debug_can_read_ = true;
 			}
@@ -1056,7 +1552,7 @@ int tls_layer_impl::continue_handshake()
 #endif
 			if (tls_layer_.event_handler_) {
 				tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::connection, 0);
-				if (can_read_from_socket_) {
+				if (can_read_from_socket_ || !early_data_.empty()) {
 					tls_layer_.event_handler_->send_event<socket_event>(&tls_layer_, socket_event_flag::read, 0);
 				}
 			}
@@ -1074,54 +1570,420 @@ int tls_layer_impl::continue_handshake()
 		res = GNUTLS_E_PUSH_ERROR;
 	}
 
-	failure(res, true);
-
-	return socket_error_ ? socket_error_ : ECONNABORTED;
+	failure(res, true);
+
+	return socket_error_ ? socket_error_ : ECONNABORTED;
+}
+
+void tls_layer_impl::receive_early_data()
+{
+	while (true) {
+		size_t const size = std::max(max_early_data_, size_t(1024));
+		ssize_t res = gnutls_record_recv_early_data(session_, early_data_.get(size), size);
+		if (res <= 0) {
+			if (res < 0 && res != GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE) {
+				log_error(static_cast<int>(res), L"gnutls_record_recv_early_data", logmsg::debug_warning);
+			}
+			break;
+		}
+		early_data_.add(static_cast<size_t>(res));
+	}
+	early_data_size_ = early_data_.size();
+	on_decrypted(early_data_size_);
+	if (early_data_size_) {
+		logger_.log(logmsg::debug_info, L"Received %u bytes of early data", early_data_size_);
+	}
+}
+
+int tls_layer_impl::read(void *buffer, unsigned int len, int& error)
+{
+	if (state_ == socket_state::connecting) {
+		error = EAGAIN;
+		return -1;
+	}
+	else if (state_ != socket_state::connected && state_ != socket_state::shutting_down && state_ != socket_state::shut_down) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	assert(debug_can_read_);
+	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::read));
+#endif
+
+	if (!early_data_.empty()) {
+		size_t const n = std::min(static_cast<size_t>(len), early_data_.size());
+		memcpy(buffer, early_data_.get(), n);
+		early_data_.consume(n);
+		error = 0;
+		return static_cast<int>(n);
+	}
+
+	if (ktls_ & tls_offload::receive) {
+		int res = ktls_read(buffer, len, error);
+		if (res > 0) {
+			on_decrypted(static_cast<size_t>(res));
+		}
+		return res;
+	}
+
+	int res = do_call_gnutls_record_recv(buffer, len);
+	if (res >= 0) {
+		on_decrypted(static_cast<size_t>(res));
+		error = 0;
+		return res;
+	}
+	else if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
+#if DEBUG_SOCKETEVENTS
+		debug_can_read_ = false;
+#endif
+		error = EAGAIN;
+	}
+	else {
+		failure(res, false, L"gnutls_record_recv");
+		error = socket_error_ ? socket_error_ : ECONNABORTED;
+	}
+
+	return -1;
+}
+
+int tls_layer_impl::write(void const* buffer, unsigned int len, int& error)
+{
+//	for(size_t i = 0; i < 20; ++i) {logger_.log(logmsg::error, "Why not Zoidberg?");}
+	if (state_ == socket_state::connecting) {
+		error = EAGAIN;
+		return -1;
+	}
+	else if (state_ == socket_state::shutting_down || state_ == socket_state::shut_down) {
+		error = ESHUTDOWN;
+		return -1;
+	}
+	else if (state_ != socket_state::connected) {
+		error = ENOTCONN;
+		return -1;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	assert(debug_can_write_);
+	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::write));
+#endif
+
+	if (ktls_ & tls_offload::send) {
+		return on_ktls_write(tls_layer_.next_layer_.write(buffer, len, error), error);
+	}
+
+	if (!send_buffer_.empty() || send_new_ticket_) {
+		on_blocked_write();
+		write_blocked_by_send_buffer_ = true;
+#if DEBUG_SOCKETEVENTS
+		debug_can_write_ = false;
+#endif
+		error = EAGAIN;
+		return -1;
+	}
+
+	if (corked_) {
+		// Collect the data into full records. Once a record is full, it is sent
+		// right away as usual, anything less waits for uncork.
+		size_t const max = gnutls_record_get_max_size(session_);
+		size_t const take = std::min(static_cast<size_t>(len), max - cork_buffer_.size());
+		cork_buffer_.append(reinterpret_cast<unsigned char const*>(buffer), take);
+		if (cork_buffer_.size() >= max) {
+			int res = flush_cork();
+			if (res) {
+				error = res;
+				return -1;
+			}
+		}
+		error = 0;
+		return static_cast<int>(take);
+	}
+
+	size_t const record = record_size();
+	if (len > record) {
+		len = static_cast<unsigned int>(record);
+	}
+
+	ssize_t res = gnutls_record_send(session_, buffer, len);
+
+	while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+		res = gnutls_record_send(session_, nullptr, 0);
+	}
+
+	if (res >= 0) {
+		on_record_sent(static_cast<size_t>(res));
+		ramp_sent_ += static_cast<uint64_t>(res);
+		error = 0;
+		return static_cast<int>(res);
+	}
+
+	if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
+		if (!socket_error_) {
+			// Unfortunately we can't return EAGAIN here as GnuTLS has already consumed some data.
+			// With our semantics, EAGAIN means nothing has been handed off yet.
+			// Thus remember up to gnutls_record_get_max_size bytes from the input.
+			unsigned int max = static_cast<unsigned int>(gnutls_record_get_max_size(session_));
+			if (len > max) {
+				len = max;
+			}
+			send_buffer_.append(reinterpret_cast<unsigned char const*>(buffer), len);
+			on_send_retry();
+			ramp_sent_ += len;
+			return static_cast<int>(len);
+		}
+
+		// GnuTLS has a writev() emulation that ignores trailing errors if
+		// at least some data got sent
+		res = GNUTLS_E_PUSH_ERROR;
+	}
+
+	failure(static_cast<int>(res), false, L"gnutls_record_send");
+	error = socket_error_ ? socket_error_ : ECONNABORTED;
+	return -1;
+}
+
+int tls_layer_impl::write(buffer & buf, int& error)
+{
+	if (buf.empty()) {
+		error = 0;
+		return 0;
+	}
+
+	unsigned int const max = static_cast<unsigned int>(std::numeric_limits<int>::max());
+	if (state_ != socket_state::connected || (ktls_ & tls_offload::send) || !send_buffer_.empty() || send_new_ticket_ || corked_) {
+		// Nothing to take over
+		int written = write(buf.get(), static_cast<unsigned int>(std::min(buf.size(), static_cast<size_t>(max))), error);
+		if (written > 0) {
+			buf.consume(static_cast<size_t>(written));
+		}
+		return written;
+	}
+
+#if DEBUG_SOCKETEVENTS
+	assert(debug_can_write_);
+	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::write));
+#endif
+
+	return send_records(buf, error);
+}
+
+int tls_layer_impl::send_records(buffer & buf, int& error)
+{
+	unsigned int const max = static_cast<unsigned int>(std::numeric_limits<int>::max());
+	unsigned int total{};
+	while (!buf.empty() && total < max) {
+		size_t const record = std::min({buf.size(), record_size(), static_cast<size_t>(max - total)});
+		ssize_t res = gnutls_record_send(session_, buf.get(), record);
+		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
+			res = gnutls_record_send(session_, nullptr, 0);
+		}
+
+		if (res >= 0) {
+			on_record_sent(static_cast<size_t>(res));
+			buf.consume(static_cast<size_t>(res));
+			total += static_cast<unsigned int>(res);
+			ramp_sent_ += static_cast<uint64_t>(res);
+			continue;
+		}
+
+		if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
+			if (!socket_error_) {
+				// GnuTLS has consumed a record it could not yet send. As in write, retrying needs
+				// the data, so keep the remainder of the buffer, starting with that record.
+				on_send_retry();
+				if (buf.size() <= max - total) {
+					total += static_cast<unsigned int>(buf.size());
+					ramp_sent_ += buf.size();
+					send_buffer_ = std::move(buf);
+				}
+				else {
+					send_buffer_.append(buf.get(), record);
+					buf.consume(record);
+					total += static_cast<unsigned int>(record);
+					ramp_sent_ += record;
+				}
+				error = 0;
+				return static_cast<int>(total);
+			}
+
+			res = GNUTLS_E_PUSH_ERROR;
+		}
+
+		failure(static_cast<int>(res), false, L"gnutls_record_send");
+		error = socket_error_ ? socket_error_ : ECONNABORTED;
+		return -1;
+	}
+
+	error = 0;
+	return static_cast<int>(total);
+}
+
+int tls_layer_impl::flush_cork()
+{
+	if (cork_buffer_.empty() || state_ != socket_state::connected) {
+		return 0;
+	}
+
+	if (!send_buffer_.empty() || send_new_ticket_) {
+		// Goes out after what is already waiting
+		send_buffer_.append(cork_buffer_);
+		cork_buffer_.clear();
+		return 0;
+	}
+
+	int error;
+	if (send_records(cork_buffer_, error) < 0) {
+		return error;
+	}
+	return 0;
+}
+
+int tls_layer_impl::uncork()
+{
+	corked_ = false;
+	return flush_cork();
+}
+
+size_t tls_layer_impl::record_size()
+{
+	size_t const max = gnutls_record_get_max_size(session_);
+	if (!dynamic_record_sizing_) {
+		return max;
+	}
+
+	auto const now = monotonic_clock::coarse_now();
+	if (!last_send_ || (now - last_send_) > record_idle_timeout_) {
+		ramp_sent_ = 0;
+	}
+	last_send_ = now;
+
+	if (ramp_sent_ < ramp_threshold_) {
+		return std::min(max, small_record_size_);
+	}
+	return max;
+}
+
+void tls_layer_impl::set_dynamic_record_sizing(bool enable, size_t small_size, uint64_t ramp_threshold, duration const& idle_timeout)
+{
+	dynamic_record_sizing_ = enable;
+	small_record_size_ = std::max(small_size, static_cast<size_t>(1));
+	ramp_threshold_ = ramp_threshold;
+	record_idle_timeout_ = idle_timeout;
+}
+
+int tls_layer_impl::readv(socket_iovec const* buffers, size_t count, int& error)
+{
+	int total{};
+	for (size_t i = 0; i < count; ++i) {
+		auto * p = static_cast<uint8_t*>(buffers[i].data);
+		unsigned int left = buffers[i].size;
+		while (left) {
+			// Continue only with data that has already been received and decrypted, reading
+			// from the socket could fail after data has already been returned to the caller.
+			if (total && early_data_.empty() && !gnutls_record_check_pending(session_)) {
+				error = 0;
+				return total;
+			}
+
+			unsigned int const max = static_cast<unsigned int>(std::numeric_limits<int>::max() - total);
+			int r = read(p, std::min(left, max), error);
+			if (r <= 0) {
+				if (total) {
+					error = 0;
+					return total;
+				}
+				return r;
+			}
+			total += r;
+			p += r;
+			left -= static_cast<unsigned int>(r);
+			if (total == std::numeric_limits<int>::max()) {
+				return total;
+			}
+		}
+	}
+
+	error = 0;
+	return total;
 }
 
-int tls_layer_impl::read(void *buffer, unsigned int len, int& error)
+int tls_layer_impl::read_into(buffer & buf, size_t max, int& error)
 {
-	if (state_ == socket_state::connecting) {
-		error = EAGAIN;
+	if (!max) {
+		error = EINVAL;
 		return -1;
 	}
-	else if (state_ != socket_state::connected && state_ != socket_state::shutting_down && state_ != socket_state::shut_down) {
-		error = ENOTCONN;
-		return -1;
+
+	// A single read returns at most what is left of the current record
+	size_t size = early_data_.size();
+	if (session_ && !size) {
+		if (!(ktls_ & tls_offload::receive)) {
+			size = gnutls_record_check_pending(session_);
+		}
+		if (!size) {
+			size = gnutls_record_get_max_size(session_);
+		}
+	}
+	if (!size) {
+		size = 16 * 1024;
+	}
+	size = std::min({size, max, static_cast<size_t>(std::numeric_limits<int>::max())});
+
+	int res = read(buf.get(size), static_cast<unsigned int>(size), error);
+	if (res > 0) {
+		buf.add(static_cast<size_t>(res));
 	}
+	return res;
+}
 
+int tls_layer_impl::writev(socket_const_iovec const* buffers, size_t count, int& error)
+{
+	if ((ktls_ & tls_offload::send) && state_ == socket_state::connected) {
 #if DEBUG_SOCKETEVENTS
-	assert(debug_can_read_);
-	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::read));
+		assert(debug_can_write_);
+		assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::write));
 #endif
+		return on_ktls_write(tls_layer_.next_layer_.writev(buffers, count, error), error);
+	}
 
-	int res = do_call_gnutls_record_recv(buffer, len);
-	if (res >= 0) {
+	size_t first{};
+	while (first < count && !buffers[first].size) {
+		++first;
+	}
+	if (first == count) {
 		error = 0;
-		return res;
+		return 0;
 	}
-	else if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
-#if DEBUG_SOCKETEVENTS
-		debug_can_read_ = false;
-#endif
-		error = EAGAIN;
+
+	// Gather small buffers so that they do not each require a record of their own
+	size_t const max = record_size();
+	if (first + 1 == count || buffers[first].size >= max) {
+		return write(buffers[first].data, buffers[first].size, error);
 	}
-	else {
-		failure(res, false, L"gnutls_record_recv");
-		error = socket_error_ ? socket_error_ : ECONNABORTED;
+
+	gather_buffer_.clear();
+	for (size_t i = first; i < count && gather_buffer_.size() < max; ++i) {
+		size_t const size = std::min(static_cast<size_t>(buffers[i].size), max - gather_buffer_.size());
+		gather_buffer_.append(reinterpret_cast<uint8_t const*>(buffers[i].data), size);
 	}
 
-	return -1;
+	return write(gather_buffer_.get(), static_cast<unsigned int>(gather_buffer_.size()), error);
 }
 
-int tls_layer_impl::write(void const* buffer, unsigned int len, int& error)
+namespace {
+// TLS record content types
+unsigned char const record_type_alert = 21;
+unsigned char const record_type_handshake = 22;
+unsigned char const record_type_application_data = 23;
+}
+
+int tls_layer_impl::send_file(file & f, uint64_t offset, unsigned int size, int& error)
 {
-//	for(size_t i = 0; i < 20; ++i) {logger_.log(logmsg::error, "Why not Zoidberg?");}
-	if (state_ == socket_state::connecting) {
-		error = EAGAIN;
+	if (!(ktls_ & tls_offload::send)) {
+		error = EOPNOTSUPP;
 		return -1;
 	}
-	else if (state_ == socket_state::shutting_down || state_ == socket_state::shut_down) {
+	if (state_ == socket_state::shutting_down || state_ == socket_state::shut_down) {
 		error = ESHUTDOWN;
 		return -1;
 	}
@@ -1135,47 +1997,125 @@ int tls_layer_impl::write(void const* buffer, unsigned int len, int& error)
 	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::write));
 #endif
 
-	if (!send_buffer_.empty() || send_new_ticket_) {
-		write_blocked_by_send_buffer_ = true;
+	return on_ktls_write(tls_layer_.next_layer_.send_file(f, offset, size, error), error);
+}
+
+int tls_layer_impl::on_ktls_write(int written, int& error)
+{
+	if (written > 0) {
+		on_encrypted(static_cast<size_t>(written));
+	}
+	else if (written < 0) {
+		if (error == EAGAIN) {
+			// Once the socket becomes writable again, continue_write forwards the write event
+			can_write_to_socket_ = false;
+			write_blocked_by_send_buffer_ = true;
 #if DEBUG_SOCKETEVENTS
-		debug_can_write_ = false;
+			debug_can_write_ = false;
 #endif
-		error = EAGAIN;
-		return -1;
-	}
-
-	ssize_t res = gnutls_record_send(session_, buffer, len);
-
-	while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
-		res = gnutls_record_send(session_, nullptr, 0);
+		}
+		else {
+			socket_error_ = error;
+			failure(0, false);
+		}
 	}
+	return written;
+}
 
-	if (res >= 0) {
+int tls_layer_impl::ktls_read(void *buffer, unsigned int len, int& error)
+{
+	if (ktls_closed_ || !len) {
 		error = 0;
-		return static_cast<int>(res);
+		return 0;
 	}
 
-	if (res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) {
-		if (!socket_error_) {
-			// Unfortunately we can't return EAGAIN here as GnuTLS has already consumed some data.
-			// With our semantics, EAGAIN means nothing has been handed off yet.
-			// Thus remember up to gnutls_record_get_max_size bytes from the input.
-			unsigned int max = static_cast<unsigned int>(gnutls_record_get_max_size(session_));
-			if (len > max) {
-				len = max;
+	for (;;) {
+		unsigned char type{};
+		int r = ktls_socket_->read_tls_record(type, buffer, len, error);
+		if (r < 0) {
+			if (error == EAGAIN) {
+				can_read_from_socket_ = false;
+#if DEBUG_SOCKETEVENTS
+				debug_can_read_ = false;
+#endif
 			}
-			send_buffer_.append(reinterpret_cast<unsigned char const*>(buffer), len);
-			return static_cast<int>(len);
+			else {
+				socket_error_ = error;
+				failure(0, false);
+			}
+			return -1;
 		}
 
-		// GnuTLS has a writev() emulation that ignores trailing errors if
-		// at least some data got sent
-		res = GNUTLS_E_PUSH_ERROR;
-	}
+		if (type == record_type_application_data) {
+			if (!r) {
+				socket_eof_ = true;
+				failure(GNUTLS_E_PREMATURE_TERMINATION, false, L"recvmsg");
+				error = ECONNABORTED;
+				return -1;
+			}
+			return r;
+		}
 
-	failure(static_cast<int>(res), false, L"gnutls_record_send");
-	error = socket_error_ ? socket_error_ : ECONNABORTED;
-	return -1;
+		// The kernel hands out control records as they are, parse just enough of them to act on
+		if (type != ktls_control_type_) {
+			ktls_control_type_ = type;
+			ktls_control_size_ = 0;
+			ktls_skip_ = 0;
+		}
+
+		auto const* p = static_cast<unsigned char const*>(buffer);
+		auto const* const end = p + r;
+		while (p != end) {
+			if (ktls_skip_) {
+				size_t const n = std::min(ktls_skip_, static_cast<size_t>(end - p));
+				ktls_skip_ -= n;
+				p += n;
+				continue;
+			}
+
+			ktls_control_[ktls_control_size_++] = *p++;
+			if (type == record_type_alert) {
+				if (ktls_control_size_ < 2) {
+					continue;
+				}
+				ktls_control_size_ = 0;
+
+				if (ktls_control_[1] == GNUTLS_A_CLOSE_NOTIFY) {
+					ktls_closed_ = true;
+					error = 0;
+					return 0;
+				}
+				char const* name = gnutls_alert_get_name(static_cast<gnutls_alert_description_t>(ktls_control_[1]));
+				if (ktls_control_[0] == GNUTLS_AL_FATAL) {
+					logger_.log(logmsg::error, server_ ? fztranslate("Received TLS alert from the client: %s (%d)") : fztranslate("Received TLS alert from the server: %s (%d)"), name ? name : "unknown", ktls_control_[1]);
+					failure(0, false);
+					error = ECONNABORTED;
+					return -1;
+				}
+				logger_.log(logmsg::debug_warning, L"Ignoring TLS warning alert %d", ktls_control_[1]);
+			}
+			else if (type == record_type_handshake) {
+				if (ktls_control_size_ < 4) {
+					continue;
+				}
+				ktls_control_size_ = 0;
+
+				if (ktls_control_[0] != GNUTLS_HANDSHAKE_NEW_SESSION_TICKET) {
+					logger_.log(logmsg::error, fztranslate("Received unsupported TLS handshake message %d after offloading to the kernel"), ktls_control_[0]);
+					failure(0, false);
+					error = ECONNABORTED;
+					return -1;
+				}
+				ktls_skip_ = (static_cast<size_t>(ktls_control_[1]) << 16) | (static_cast<size_t>(ktls_control_[2]) << 8) | ktls_control_[3];
+			}
+			else {
+				logger_.log(logmsg::error, fztranslate("Received unexpected TLS record of type %d"), type);
+				failure(0, false);
+				error = ECONNABORTED;
+				return -1;
+			}
+		}
+	}
 }
 
 void tls_layer_impl::failure(int code, bool send_close, std::wstring const& function)
@@ -1203,6 +2143,9 @@ void tls_layer_impl::failure(int code, bool send_close, std::wstring const& func
 	}
 
 	auto const oldState = state_;
+	if (oldState == socket_state::connecting) {
+		on_handshake_failed();
+	}
 
 	deinit();
 
@@ -1234,6 +2177,12 @@ int tls_layer_impl::shutdown()
 		return ENOTCONN;
 	}
 
+	corked_ = false;
+	int res = flush_cork();
+	if (res) {
+		return res;
+	}
+
 	state_ = socket_state::shutting_down;
 
 	if (!send_buffer_.empty() || send_new_ticket_) {
@@ -1248,6 +2197,21 @@ int tls_layer_impl::continue_shutdown()
 {
 	logger_.log(logmsg::debug_verbose, L"tls_layer_impl::continue_shutdown()");
 
+	if (!sent_closure_alert_ && (ktls_ & tls_offload::send)) {
+		unsigned char const alert[2]{GNUTLS_AL_WARNING, GNUTLS_A_CLOSE_NOTIFY};
+		int error;
+		int res = ktls_socket_->send_tls_record(record_type_alert, alert, sizeof(alert), error);
+		if (res < 0) {
+			if (error == EAGAIN) {
+				can_write_to_socket_ = false;
+				return EAGAIN;
+			}
+			socket_error_ = error;
+			failure(0, false);
+			return error;
+		}
+		sent_closure_alert_ = true;
+	}
 	if (!sent_closure_alert_) {
 		int res = gnutls_bye(session_, GNUTLS_SHUT_WR);
 		while ((res == GNUTLS_E_INTERRUPTED || res == GNUTLS_E_AGAIN) && can_write_to_socket_) {
@@ -1297,6 +2261,8 @@ void tls_layer_impl::set_verification_result(bool trusted)
 	verification_handler_ = nullptr;
 
 	if (trusted) {
+		on_handshake_completed();
+		enable_kernel_offload();
 		state_ = socket_state::connected;
 
 #if DEBUG_SOCKETEVENTS
@@ -1349,6 +2315,40 @@ bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificat
 		return false;
 	}
 
+	datum_holder der;
+	if (gnutls_x509_crt_export2(cert, GNUTLS_X509_FMT_DER, &der) != GNUTLS_E_SUCCESS || !der.data || !der.size) {
+		if (logger) {
+			logger->log(logmsg::error, L"gnutls_x509_crt_export2");
+		}
+		return false;
+	}
+
+	// Everything else is only extracted if the application asks for it
+	out = x509_certificate(
+		std::vector<uint8_t>(der.data, der.data + der.size),
+		activation_time, expiration_time,
+		last ? gnutls_x509_crt_check_issuer(cert, cert) : false);
+
+	return true;
+}
+
+void tls_layer_impl::extract_cert_details(std::vector<uint8_t> const& raw, x509_certificate::details & out)
+{
+	init_gnutls();
+
+	gnutls_x509_crt_t cert{};
+	if (gnutls_x509_crt_init(&cert)) {
+		return;
+	}
+
+	gnutls_datum_t d;
+	d.data = const_cast<unsigned char*>(raw.data());
+	d.size = static_cast<unsigned int>(raw.size());
+	if (gnutls_x509_crt_import(cert, &d, GNUTLS_X509_FMT_DER)) {
+		gnutls_x509_crt_deinit(cert);
+		return;
+	}
+
 	// Get the serial number of the certificate
 	unsigned char buffer[40];
 	size_t size = sizeof(buffer);
@@ -1357,103 +2357,47 @@ bool tls_layer_impl::extract_cert(gnutls_x509_crt_t const& cert, x509_certificat
 		size = 0;
 	}
 
-	auto serial = bin2hex(buffer, size);
+	out.serial_ = bin2hex(buffer, size);
 
-	unsigned int pk_bits;
-	int pkAlgo = gnutls_x509_crt_get_pk_algorithm(cert, &pk_bits);
-	std::string pk_algo_name;
+	int pkAlgo = gnutls_x509_crt_get_pk_algorithm(cert, &out.pkalgobits_);
 	if (pkAlgo >= 0) {
 		char const* pAlgo = gnutls_pk_algorithm_get_name((gnutls_pk_algorithm_t)pkAlgo);
 		if (pAlgo) {
-			pk_algo_name = pAlgo;
+			out.pkalgoname_ = pAlgo;
 		}
 	}
 
 	int signAlgo = gnutls_x509_crt_get_signature_algorithm(cert);
-	std::string signAlgoName;
 	if (signAlgo >= 0) {
 		char const* pAlgo = gnutls_sign_algorithm_get_name((gnutls_sign_algorithm_t)signAlgo);
 		if (pAlgo) {
-			signAlgoName = pAlgo;
+			out.signalgoname_ = pAlgo;
 		}
 	}
 
-	std::string subject, issuer;
-
 	datum_holder raw_subject;
-	res = gnutls_x509_crt_get_dn3(cert, &raw_subject, 0);
-	if (!res) {
-		subject = raw_subject.to_string_view();
-	}
-	else {
-		if (logger) {
-			logger->log(logmsg::debug_warning, "gnutls_x509_crt_get_dn3 failed with %d", res);
-		}
-	}
-	if (subject.empty()) {
-		if (logger) {
-			logger->log(logmsg::error, fztranslate("Could not get distinguished name of certificate subject, gnutls_x509_get_dn failed"));
-		}
-		return false;
+	if (!gnutls_x509_crt_get_dn3(cert, &raw_subject, 0)) {
+		out.subject_ = raw_subject.to_string_view();
 	}
 
-	std::vector<x509_certificate::subject_name> alt_subject_names = get_cert_subject_alt_names(cert);
+	out.alt_subject_names_ = get_cert_subject_alt_names(cert);
 
 	datum_holder raw_issuer;
-	res = gnutls_x509_crt_get_issuer_dn3(cert, &raw_issuer, 0);
-	if (!res) {
-		issuer = raw_issuer.to_string_view();
-	}
-	else {
-		if (logger) {
-			logger->log(logmsg::debug_warning, "gnutls_x509_crt_get_issuer_dn3 failed with %d", res);
-		}
-	}
-	if (issuer.empty() ) {
-		if (logger) {
-			logger->log(logmsg::error, fztranslate("Could not get distinguished name of certificate issuer, gnutls_x509_get_issuer_dn failed"));
-		}
-		return false;
+	if (!gnutls_x509_crt_get_issuer_dn3(cert, &raw_issuer, 0)) {
+		out.issuer_ = raw_issuer.to_string_view();
 	}
 
-	std::string fingerprint_sha256;
-	std::string fingerprint_sha1;
-
 	unsigned char digest[100];
 	size = sizeof(digest) - 1;
 	if (!gnutls_x509_crt_get_fingerprint(cert, GNUTLS_DIG_SHA256, digest, &size)) {
-		digest[size] = 0;
-		fingerprint_sha256 = bin2hex(digest, size);
+		out.fingerprint_sha256_ = bin2hex(digest, size);
 	}
 	size = sizeof(digest) - 1;
 	if (!gnutls_x509_crt_get_fingerprint(cert, GNUTLS_DIG_SHA1, digest, &size)) {
-		digest[size] = 0;
-		fingerprint_sha1 = bin2hex(digest, size);
-	}
-
-	datum_holder der;
-	if (gnutls_x509_crt_export2(cert, GNUTLS_X509_FMT_DER, &der) != GNUTLS_E_SUCCESS || !der.data || !der.size) {
-		if (logger) {
-			logger->log(logmsg::error, L"gnutls_x509_crt_get_issuer_dn");
-		}
-		return false;
+		out.fingerprint_sha1_ = bin2hex(digest, size);
 	}
-	std::vector<uint8_t> data(der.data, der.data + der.size);
-
-	out = x509_certificate(
-		std::move(data),
-		activation_time, expiration_time,
-		serial,
-		pk_algo_name, pk_bits,
-		signAlgoName,
-		fingerprint_sha256,
-		fingerprint_sha1,
-		issuer,
-		subject,
-		std::move(alt_subject_names),
-		last ? gnutls_x509_crt_check_issuer(cert, cert) : false);
 
-	return true;
+	gnutls_x509_crt_deinit(cert);
 }
 
 
@@ -1574,6 +2518,8 @@ int tls_layer_impl::get_algorithm_warnings() const
 
 int tls_layer_impl::load_certificates(std::string_view const& in, bool pem, gnutls_x509_crt_t *& certs, unsigned int & certs_size, bool & sort)
 {
+	init_gnutls();
+
 	gnutls_datum_t dpem;
 	dpem.data = reinterpret_cast<unsigned char*>(const_cast<char *>(in.data()));
 	dpem.size = in.size();
@@ -1756,8 +2702,32 @@ int tls_layer_impl::verify_certificate()
 
 	std::vector<x509_certificate> system_trust_chain;
 
-	// First, check system trust
+	// Reconnecting to the same server, it usually sends the very same chain again
+	std::string verified_key;
 	if (uses_hostname && system_trust_store_) {
+		unsigned int cert_list_size{};
+		gnutls_datum_t const* cert_list = gnutls_certificate_get_peers(session_, &cert_list_size);
+		if (cert_list && cert_list_size) {
+			hash_accumulator acc(hash_algorithm::sha256);
+			for (unsigned int i = 0; i < cert_list_size; ++i) {
+				acc.update(cert_list[i].data, cert_list[i].size);
+			}
+			verified_key = to_utf8(hostname_);
+			verified_key += '\0';
+			auto const digest = acc.digest();
+			verified_key.append(digest.cbegin(), digest.cend());
+
+			auto cached = system_trust_store_->impl_->get_verified_chain(verified_key);
+			if (cached) {
+				logger_.log(logmsg::debug_verbose, L"Certificate chain has already been verified");
+				system_trust_chain = std::move(*cached);
+				systemTrust = true;
+			}
+		}
+	}
+
+	// First, check system trust
+	if (uses_hostname && system_trust_store_ && !systemTrust) {
 
 		auto lease = system_trust_store_->impl_->lease();
 		auto cred = std::get<0>(lease);
@@ -1827,6 +2797,10 @@ int tls_layer_impl::verify_certificate()
 					system_trust_chain.emplace_back(std::move(*it));
 				}
 				systemTrust = true;
+
+				if (!verified_key.empty()) {
+					system_trust_store_->impl_->cache_verified_chain(verified_key, system_trust_chain);
+				}
 			}
 			logger_.log(logmsg::debug_verbose, L"System trust store decision: %s", systemTrust ? "true"sv : "false"sv);
 		}
@@ -1908,9 +2882,14 @@ int tls_layer_impl::verify_certificate()
 
 		// Lengthen incomplete chains to the root using the trust store.
 		if (!certificates.empty() && !certificates.back().self_signed() && system_trust_store_) {
-			auto lease = system_trust_store_->impl_->lease();
-			auto cred = std::get<0>(lease);
-			if (cred) {
+			std::string const fingerprint = certificates.back().get_fingerprint_sha256();
+			auto cached = system_trust_store_->impl_->get_cached_chain(fingerprint);
+			if (cached) {
+				certificates.insert(certificates.end(), cached->cbegin(), cached->cend());
+			}
+			else if (auto lease = system_trust_store_->impl_->lease(); std::get<0>(lease)) {
+				auto cred = std::get<0>(lease);
+				size_t const sent = certificates.size();
 				gnutls_x509_crt_t cert = certs.certs[certs.certs_size - 1];
 				while (!certificates.back().self_signed()) {
 					gnutls_x509_crt_t issuer{};
@@ -1933,6 +2912,9 @@ int tls_layer_impl::verify_certificate()
 					certificates.push_back(out);
 					cert = issuer;
 				}
+				std::get<1>(lease).unlock();
+
+				system_trust_store_->impl_->cache_chain(fingerprint, std::vector<x509_certificate>(certificates.cbegin() + sent, certificates.cend()));
 			}
 		}
 
@@ -2052,6 +3034,8 @@ std::string tls_layer_impl::get_mac() const
 
 std::string tls_layer_impl::list_tls_ciphers(std::string const& priority)
 {
+	init_gnutls();
+
 	auto list = sprintf("Ciphers for %s:\n", priority.empty() ? ciphers : priority);
 
 	gnutls_priority_t pcache;
@@ -2225,6 +3209,8 @@ std::vector<uint8_t> tls_layer_impl::get_raw_certificate() const
 
 std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames)
 {
+	init_gnutls();
+
 	std::pair<std::string, std::string> ret;
 
 	gnutls_x509_privkey_t priv;
@@ -2357,6 +3343,8 @@ std::pair<std::string, std::string> tls_layer_impl::generate_selfsigned_certific
 
 std::pair<std::string, std::string> tls_layer_impl::generate_csr(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames, bool csr_as_pem)
 {
+	init_gnutls();
+
 	std::pair<std::string, std::string> ret;
 
 	gnutls_x509_privkey_t priv;
@@ -2580,6 +3568,10 @@ int tls_layer_impl::new_session_ticket()
 		return 0;
 	}
 
+	if (ktls_ & tls_offload::send) {
+		return EOPNOTSUPP;
+	}
+
 #if DEBUG_SOCKETEVENTS
 	assert(debug_can_write_);
 	assert(!has_pending_event(tls_layer_.event_handler_, &tls_layer_, socket_event_flag::write));
@@ -2612,4 +3604,125 @@ void tls_layer_impl::set_unexpected_eof_cb(std::function<bool()> && cb)
 	unexpected_eof_cb_ = std::move(cb);
 }
 
+
+#if HAVE_KTLS
+namespace {
+template<typename Info>
+bool fill_aes_gcm_info(Info & info, bool tls13, gnutls_datum_t const& iv, gnutls_datum_t const& key, unsigned char const* seq)
+{
+	if (key.size != sizeof(info.key) || iv.size < sizeof(info.salt) + (tls13 ? sizeof(info.iv) : 0)) {
+		return false;
+	}
+	memcpy(info.key, key.data, sizeof(info.key));
+	memcpy(info.salt, iv.data, sizeof(info.salt));
+	if (tls13) {
+		memcpy(info.iv, iv.data + sizeof(info.salt), sizeof(info.iv));
+	}
+	else {
+		// TLS 1.2 uses the sequence number as explicit nonce
+		memcpy(info.iv, seq, sizeof(info.iv));
+	}
+	memcpy(info.rec_seq, seq, sizeof(info.rec_seq));
+	return true;
+}
+}
+#endif
+
+void tls_layer_impl::enable_kernel_offload()
+{
+	if (!ktls_requested_ || !session_) {
+		return;
+	}
+
+#if HAVE_KTLS
+	ktls_socket_ = dynamic_cast<socket*>(&tls_layer_.next_layer_);
+	if (!ktls_socket_) {
+		logger_.log(logmsg::debug_info, L"Not using kernel TLS, next layer is not a socket");
+		return;
+	}
+
+	if (!send_buffer_.empty() || !cork_buffer_.empty() || send_new_ticket_ || gnutls_record_check_corked(session_) || gnutls_record_check_pending(session_)) {
+		logger_.log(logmsg::debug_info, L"Not using kernel TLS, GnuTLS has buffered data");
+		return;
+	}
+
+	auto const version = gnutls_protocol_get_version(session_);
+	if (version != GNUTLS_TLS1_2 && version != GNUTLS_TLS1_3) {
+		logger_.log(logmsg::debug_info, L"Not using kernel TLS, unsupported protocol version");
+		return;
+	}
+	bool const tls13 = version == GNUTLS_TLS1_3;
+	auto const cipher = gnutls_cipher_get(session_);
+
+	auto offload = [&](bool receive) {
+		gnutls_datum_t mac_key{};
+		gnutls_datum_t iv{};
+		gnutls_datum_t key{};
+		unsigned char seq[8]{};
+		if (gnutls_record_get_state(session_, receive ? 1 : 0, &mac_key, &iv, &key, seq)) {
+			return EINVAL;
+		}
+
+		unsigned short const v = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+		switch (cipher) {
+		case GNUTLS_CIPHER_AES_128_GCM: {
+			tls12_crypto_info_aes_gcm_128 info{};
+			info.info.version = v;
+			info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+			if (!fill_aes_gcm_info(info, tls13, iv, key, seq)) {
+				return EINVAL;
+			}
+			return ktls_socket_->set_tls_offload(receive, &info, sizeof(info));
+		}
+		case GNUTLS_CIPHER_AES_256_GCM: {
+			tls12_crypto_info_aes_gcm_256 info{};
+			info.info.version = v;
+			info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+			if (!fill_aes_gcm_info(info, tls13, iv, key, seq)) {
+				return EINVAL;
+			}
+			return ktls_socket_->set_tls_offload(receive, &info, sizeof(info));
+		}
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		case GNUTLS_CIPHER_CHACHA20_POLY1305: {
+			tls12_crypto_info_chacha20_poly1305 info{};
+			info.info.version = v;
+			info.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+			if (key.size != sizeof(info.key) || iv.size != sizeof(info.iv)) {
+				return EINVAL;
+			}
+			memcpy(info.key, key.data, sizeof(info.key));
+			memcpy(info.iv, iv.data, sizeof(info.iv));
+			memcpy(info.rec_seq, seq, sizeof(info.rec_seq));
+			return ktls_socket_->set_tls_offload(receive, &info, sizeof(info));
+		}
+#endif
+		default:
+			return EOPNOTSUPP;
+		}
+	};
+
+	int res = offload(false);
+	if (res) {
+		logger_.log(logmsg::debug_info, L"Not using kernel TLS: %d", res);
+		return;
+	}
+	ktls_ = tls_offload::send;
+
+	// In TLS 1.3 the server sends session tickets after the handshake, they need to reach GnuTLS.
+	if (!tls13 || server_) {
+		res = offload(true);
+		if (!res) {
+			ktls_ = tls_offload::duplex;
+		}
+		else {
+			logger_.log(logmsg::debug_info, L"Not using kernel TLS for receiving: %d", res);
+		}
+	}
+
+	logger_.log(logmsg::debug_info, L"Using kernel TLS for %s", (ktls_ & tls_offload::receive) ? "sending and receiving"sv : "sending"sv);
+#else
+	logger_.log(logmsg::debug_info, L"Not using kernel TLS, not supported on this platform");
+#endif
+}
 }
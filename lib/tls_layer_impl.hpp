@@ -11,12 +11,16 @@ typedef std::make_signed_t<size_t> ssize_t;
 #include "libfilezilla/buffer.hpp"
 #include "libfilezilla/logger.hpp"
 #include "libfilezilla/socket.hpp"
+#include "libfilezilla/thread_pool.hpp"
 #include "libfilezilla/tls_info.hpp"
 #include "libfilezilla/tls_layer.hpp"
 
+#include <mutex>
 #include <optional>
 
 namespace fz {
+class tls_ocsp_cache_impl;
+class tls_session_cache_impl;
 class tls_system_trust_store;
 class logger_interface;
 
@@ -37,6 +41,29 @@ struct cert_list_holder final
 	unsigned int certs_size{};
 };
 
+// Sent to the layer once a handshake step running in the thread pool has completed
+struct tls_handshake_result_event_type;
+typedef simple_event<tls_handshake_result_event_type, int> tls_handshake_result_event;
+
+struct x509_certificate::details final
+{
+	std::once_flag once_;
+
+	std::string serial_;
+	std::string pkalgoname_;
+	unsigned int pkalgobits_{};
+
+	std::string signalgoname_;
+
+	std::string fingerprint_sha256_;
+	std::string fingerprint_sha1_;
+
+	std::string issuer_;
+	std::string subject_;
+
+	std::vector<x509_certificate::subject_name> alt_subject_names_;
+};
+
 class tls_layer;
 class tls_layer_impl final
 {
@@ -52,6 +79,11 @@ public:
 
 	int read(void *buffer, unsigned int size, int& error);
 	int write(void const* buffer, unsigned int size, int& error);
+	int write(buffer & buf, int& error);
+	int readv(socket_iovec const* buffers, size_t count, int& error);
+	int read_into(buffer & buf, size_t max, int& error);
+	int writev(socket_const_iovec const* buffers, size_t count, int& error);
+	int send_file(file & f, uint64_t offset, unsigned int size, int& error);
 
 	int shutdown();
 
@@ -81,6 +113,7 @@ public:
 	static std::string get_gnutls_version();
 
 	ssize_t push_function(void const* data, size_t len);
+	ssize_t vec_push_function(giovec_t const* iov, int iovcnt);
 	ssize_t pull_function(void* data, size_t len);
 
 	static std::pair<std::string, std::string> generate_selfsigned_certificate(native_string const& password, std::string const& distinguished_name, std::vector<std::string> const& hostnames);
@@ -95,21 +128,60 @@ public:
 
 	static int load_certificates(std::string_view const& in, bool pem, gnutls_x509_crt_t *& certs, unsigned int & certs_size, bool & sort);
 	static bool extract_cert(gnutls_x509_crt_t const& cert, x509_certificate& out, bool last, logger_interface * logger);
+	static void extract_cert_details(std::vector<uint8_t> const& der, x509_certificate::details & out);
 
 	void set_min_tls_ver(tls_ver ver);
 	void set_max_tls_ver(tls_ver ver);
 
 	void set_unexpected_eof_cb(std::function<bool()> && cb);
 
+	void set_session_cache(tls_session_cache_impl * cache) { session_cache_ = cache; }
+
+	void set_ocsp_cache(tls_ocsp_cache_impl * cache) { ocsp_cache_ = cache; }
+
+	void set_max_early_data(size_t max_size) { max_early_data_ = max_size; }
+	void set_early_data(std::string_view const& data);
+	bool early_data_accepted() const;
+
+	void set_handshake_thread_pool(thread_pool * pool) { handshake_pool_ = pool; }
+
+	void set_dynamic_record_sizing(bool enable, size_t small_size, uint64_t ramp_threshold, duration const& idle_timeout);
+	void join_handshake_task();
+
+	void set_kernel_offload(bool enable) { ktls_requested_ = enable; }
+	tls_offload get_kernel_offload() const { return ktls_; }
+
+	size_t heap_size() const;
+	void hibernate();
+
+	void cork() { corked_ = true; }
+	int uncork();
+
 private:
 	bool init();
 	void deinit();
 
 	bool init_session(bool client, int extra_flags = 0);
+
+	void receive_early_data();
+
+	bool enable_ocsp_stapling();
 	void deinit_session();
 
 	int continue_write();
+
+	// Sends the buffer as records, taking over the rest if GnuTLS cannot send right away
+	int send_records(buffer & buf, int& error);
+
+	// Sends what has been collected while corked. Returns 0 on success, an error code otherwise.
+	int flush_cork();
 	int continue_handshake();
+	int do_handshake();
+	void add_handshake_cpu_time();
+	void on_handshake_completed();
+	void on_handshake_failed();
+	int on_handshake_result(int res);
+	void on_handshake_task_result(int res);
 	int continue_shutdown();
 
 	int verify_certificate();
@@ -124,6 +196,13 @@ private:
 
 	int do_call_gnutls_record_recv(void* data, size_t len);
 
+	// Update both the counters of the layer and the process-wide ones
+	void on_record_sent(size_t size);
+	void on_encrypted(size_t size);
+	void on_decrypted(size_t size);
+	void on_send_retry();
+	void on_blocked_write();
+
 	void operator()(event_base const& ev);
 	void on_socket_event(socket_event_source* source, socket_event_flag t, int error);
 	void forward_hostaddress_event(socket_event_source* source, std::string const& address);
@@ -143,6 +222,14 @@ private:
 
 	int new_session_ticket();
 
+	// Maximum amount of plaintext for the next record
+	size_t record_size();
+
+	// Hands the record layer over to the kernel, if requested and possible
+	void enable_kernel_offload();
+	int ktls_read(void *buffer, unsigned int len, int& error);
+	int on_ktls_write(int written, int& error);
+
 	tls_layer& tls_layer_;
 
 	logger_interface & logger_;
@@ -177,6 +264,12 @@ private:
 	// gnutls_record_get_max_size()
 	buffer send_buffer_;
 
+	// Small buffers passed to writev get gathered here to be sent as a single record
+	buffer gather_buffer_;
+
+	// While corked, writes are collected here until there is enough for a full record
+	buffer cork_buffer_;
+
 	// Sent out just before the handshake itself
 	buffer preamble_;
 
@@ -189,6 +282,26 @@ private:
 
 	tls_system_trust_store* system_trust_store_{};
 
+	tls_session_cache_impl* session_cache_{};
+
+	tls_ocsp_cache_impl* ocsp_cache_{};
+	std::vector<uint8_t> ocsp_certificate_;
+
+	size_t max_early_data_{};
+
+	// As client the early data yet to be sent, as server the early data yet to be read
+	buffer early_data_;
+	size_t early_data_size_{};
+
+	// While a handshake step runs in the pool, events from the next layer are deferred
+	// until the result has been posted back, GnuTLS is not thread-safe.
+	thread_pool * handshake_pool_{};
+	pooled_task handshake_task_;
+	bool handshake_task_running_{};
+	bool deferred_read_{};
+	bool deferred_write_{};
+	int deferred_error_{};
+
 	event_handler * verification_handler_{};
 
 	tls_ver min_tls_ver_{tls_ver::v1_0};
@@ -204,6 +317,35 @@ private:
 
 	bool send_new_ticket_{};
 
+	bool corked_{};
+
+	bool dynamic_record_sizing_{};
+	size_t small_record_size_{};
+	uint64_t ramp_threshold_{};
+	duration record_idle_timeout_;
+	uint64_t ramp_sent_{};
+	monotonic_clock last_send_;
+
+	bool ktls_requested_{};
+	tls_offload ktls_{};
+	socket * ktls_socket_{};
+	bool ktls_closed_{};
+
+	// Parsing state of control records read from an offloaded session
+	unsigned char ktls_control_type_{};
+	unsigned char ktls_control_[4]{};
+	size_t ktls_control_size_{};
+	size_t ktls_skip_{};
+
+	tls_stats stats_;
+
+	// In microseconds on the steady clock
+	int64_t handshake_start_{};
+	int64_t handshake_end_{};
+
+	// Accumulated by do_handshake, which may run in the handshake pool
+	uint64_t handshake_cpu_time_{};
+
 #if DEBUG_SOCKETEVENTS
 	bool debug_can_read_{};
 	bool debug_can_write_{};
@@ -212,6 +354,14 @@ private:
 
 std::string read_certificates_file(native_string const& certsfile, logger_interface * logger);
 
+/**
+ * Initializes GnuTLS on first use, thread-safe. Returns the result of gnutls_global_init.
+ *
+ * Call before using GnuTLS, processes not using TLS then do not pay for it, at least
+ * if the implicit initialization of GnuTLS is disabled by setting GNUTLS_NO_IMPLICIT_INIT=1.
+ */
+int init_gnutls();
+
 }
 
 #endif
@@ -0,0 +1,292 @@
+#include "libfilezilla/tls_ocsp_cache.hpp"
+#include "tls_layer_impl.hpp"
+#include "tls_ocsp_cache_impl.hpp"
+
+#include <gnutls/gnutls.h>
+#include <gnutls/ocsp.h>
+#include <gnutls/x509.h>
+
+#include <algorithm>
+
+namespace fz {
+
+namespace {
+// Lifetime of responses without nextUpdate, they have no defined expiry
+duration const default_lifetime = duration::from_hours(1);
+
+// Even long-lived responses get refreshed this often, to pick up revocations
+duration const max_refresh_interval = duration::from_days(1);
+
+class crt_holder final
+{
+public:
+	crt_holder() {
+		if (gnutls_x509_crt_init(&crt_)) {
+			crt_ = nullptr;
+		}
+	}
+
+	~crt_holder() {
+		if (crt_) {
+			gnutls_x509_crt_deinit(crt_);
+		}
+	}
+
+	crt_holder(crt_holder const&) = delete;
+	crt_holder& operator=(crt_holder const&) = delete;
+
+	bool import(std::vector<uint8_t> const& der) {
+		if (!crt_) {
+			return false;
+		}
+		gnutls_datum_t d;
+		d.data = const_cast<unsigned char*>(der.data());
+		d.size = static_cast<unsigned int>(der.size());
+		return !gnutls_x509_crt_import(crt_, &d, GNUTLS_X509_FMT_DER);
+	}
+
+	gnutls_x509_crt_t crt_{};
+};
+
+std::string get_responder(gnutls_x509_crt_t crt)
+{
+	for (unsigned int seq = 0; ; ++seq) {
+		gnutls_datum_t d{};
+		int res = gnutls_x509_crt_get_authority_info_access(crt, seq, GNUTLS_IA_OCSP_URI, &d, nullptr);
+		if (res == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE) {
+			break;
+		}
+		if (!res && d.data) {
+			std::string ret(reinterpret_cast<char const*>(d.data), d.size);
+			gnutls_free(d.data);
+			return ret;
+		}
+		// Some other kind of access method, try the next one
+	}
+	return {};
+}
+
+std::vector<uint8_t> make_request(gnutls_x509_crt_t crt, gnutls_x509_crt_t issuer)
+{
+	std::vector<uint8_t> ret;
+
+	gnutls_ocsp_req_t req;
+	if (gnutls_ocsp_req_init(&req)) {
+		return ret;
+	}
+
+	// No nonce, the response gets reused
+	if (!gnutls_ocsp_req_add_cert(req, GNUTLS_DIG_SHA1, issuer, crt)) {
+		gnutls_datum_t d{};
+		if (!gnutls_ocsp_req_export(req, &d) && d.data) {
+			ret.assign(d.data, d.data + d.size);
+			gnutls_free(d.data);
+		}
+	}
+	gnutls_ocsp_req_deinit(req);
+
+	return ret;
+}
+
+// Returns the expiry of a valid response stating that the certificate is good
+datetime check_response(std::vector<uint8_t> const& response, gnutls_x509_crt_t crt, gnutls_x509_crt_t issuer)
+{
+	datetime ret;
+
+	gnutls_ocsp_resp_t resp;
+	if (gnutls_ocsp_resp_init(&resp)) {
+		return ret;
+	}
+
+	gnutls_datum_t d;
+	d.data = const_cast<unsigned char*>(response.data());
+	d.size = static_cast<unsigned int>(response.size());
+
+	unsigned int verify{};
+	unsigned int status{};
+	time_t this_update{};
+	time_t next_update{};
+	if (!gnutls_ocsp_resp_import(resp, &d) &&
+		gnutls_ocsp_resp_get_status(resp) == GNUTLS_OCSP_RESP_SUCCESSFUL &&
+		!gnutls_ocsp_resp_check_crt(resp, 0, crt) &&
+		!gnutls_ocsp_resp_verify_direct(resp, issuer, &verify, 0) && !verify &&
+		!gnutls_ocsp_resp_get_single(resp, 0, nullptr, nullptr, nullptr, nullptr, &status, &this_update, &next_update, nullptr, nullptr) &&
+		status == GNUTLS_OCSP_CERT_GOOD)
+	{
+		if (next_update == static_cast<time_t>(-1)) {
+			ret = datetime::now() + default_lifetime;
+		}
+		else {
+			ret = datetime(next_update, datetime::seconds);
+		}
+	}
+	gnutls_ocsp_resp_deinit(resp);
+
+	return ret;
+}
+}
+
+tls_ocsp_cache_impl::tls_ocsp_cache_impl(thread_pool & pool, tls_ocsp_cache::fetcher const& fetch, duration const& retry_interval)
+	: pool_(pool)
+	, fetch_(fetch)
+	, retry_interval_(retry_interval)
+{
+	init_gnutls();
+}
+
+tls_ocsp_cache_impl::~tls_ocsp_cache_impl()
+{
+	{
+		scoped_lock l(mtx_);
+		quit_ = true;
+		cond_.signal(l);
+	}
+	task_.join();
+}
+
+void tls_ocsp_cache_impl::add(std::vector<uint8_t> const& cert, std::vector<uint8_t> const& issuer)
+{
+	scoped_lock l(mtx_);
+
+	auto it = entries_.find(cert);
+	if (it != entries_.end()) {
+		it->second.used_ = true;
+		return;
+	}
+
+	auto & e = entries_[cert];
+	e.issuer_ = issuer;
+	e.next_refresh_ = monotonic_clock::now();
+	e.used_ = true;
+
+	if (!task_) {
+		task_ = pool_.spawn([this]{ run(); });
+	}
+	cond_.signal(l);
+}
+
+std::vector<uint8_t> tls_ocsp_cache_impl::get(std::vector<uint8_t> const& cert)
+{
+	scoped_lock l(mtx_);
+
+	auto it = entries_.find(cert);
+	if (it == entries_.end()) {
+		return {};
+	}
+	it->second.used_ = true;
+	if (it->second.response_.empty() || it->second.expiry_ <= datetime::now()) {
+		return {};
+	}
+	return it->second.response_;
+}
+
+size_t tls_ocsp_cache_impl::size() const
+{
+	scoped_lock l(mtx_);
+
+	auto const now = datetime::now();
+	return static_cast<size_t>(std::count_if(entries_.cbegin(), entries_.cend(), [&now](auto const& e) {
+		return !e.second.response_.empty() && now < e.second.expiry_;
+	}));
+}
+
+void tls_ocsp_cache_impl::run()
+{
+	scoped_lock l(mtx_);
+	while (!quit_) {
+		auto next = entries_.end();
+		for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+			if (next == entries_.end() || it->second.next_refresh_ < next->second.next_refresh_) {
+				next = it;
+			}
+		}
+		if (next == entries_.end()) {
+			cond_.wait(l);
+			continue;
+		}
+
+		auto const now = monotonic_clock::now();
+		if (now < next->second.next_refresh_) {
+			cond_.wait(l, next->second.next_refresh_ - now);
+			continue;
+		}
+
+		if (next->second.fetched_ && !next->second.used_) {
+			// Certificate no longer in use
+			entries_.erase(next);
+			continue;
+		}
+		next->second.used_ = false;
+		next->second.fetched_ = true;
+
+		std::vector<uint8_t> const cert = next->first;
+		std::vector<uint8_t> const issuer = next->second.issuer_;
+
+		datetime expiry;
+		monotonic_clock next_refresh;
+		l.unlock();
+		auto response = fetch(cert, issuer, expiry, next_refresh);
+		l.lock();
+
+		auto it = entries_.find(cert);
+		if (it != entries_.end()) {
+			if (!response.empty()) {
+				it->second.response_ = std::move(response);
+				it->second.expiry_ = expiry;
+			}
+			it->second.next_refresh_ = next_refresh;
+		}
+	}
+}
+
+std::vector<uint8_t> tls_ocsp_cache_impl::fetch(std::vector<uint8_t> const& cert, std::vector<uint8_t> const& issuer, datetime & expiry, monotonic_clock & next_refresh)
+{
+	next_refresh = monotonic_clock::now() + retry_interval_;
+
+	crt_holder c;
+	crt_holder i;
+	if (!c.import(cert) || !i.import(issuer)) {
+		return {};
+	}
+
+	std::string const url = get_responder(c.crt_);
+	if (url.empty()) {
+		return {};
+	}
+
+	auto const request = make_request(c.crt_, i.crt_);
+	if (request.empty() || !fetch_) {
+		return {};
+	}
+
+	auto response = fetch_(url, request);
+	if (response.empty()) {
+		return {};
+	}
+
+	expiry = check_response(response, c.crt_, i.crt_);
+	auto const now = datetime::now();
+	if (expiry.empty() || expiry <= now) {
+		return {};
+	}
+
+	// Refresh halfway to expiry
+	next_refresh = monotonic_clock::now() + std::clamp((expiry - now) / 2, retry_interval_, std::max(retry_interval_, max_refresh_interval));
+	return response;
+}
+
+tls_ocsp_cache::tls_ocsp_cache(thread_pool & pool, fetcher const& fetch, duration const& retry_interval)
+	: impl_(std::make_unique<tls_ocsp_cache_impl>(pool, fetch, retry_interval))
+{
+}
+
+tls_ocsp_cache::~tls_ocsp_cache()
+{
+}
+
+size_t tls_ocsp_cache::size() const
+{
+	return impl_->size();
+}
+
+}
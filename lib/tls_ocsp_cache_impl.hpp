@@ -0,0 +1,59 @@
+#ifndef LIBFILEZILLA_TLS_OCSP_CACHE_IMPL_HEADER
+#define LIBFILEZILLA_TLS_OCSP_CACHE_IMPL_HEADER
+
+#include "libfilezilla/tls_ocsp_cache.hpp"
+#include "libfilezilla/mutex.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#include <map>
+#include <vector>
+
+namespace fz {
+
+class tls_ocsp_cache_impl final
+{
+public:
+	tls_ocsp_cache_impl(thread_pool & pool, tls_ocsp_cache::fetcher const& fetch, duration const& retry_interval);
+	~tls_ocsp_cache_impl();
+
+	// Both in DER. Starts fetching the response if the certificate is new.
+	void add(std::vector<uint8_t> const& cert, std::vector<uint8_t> const& issuer);
+
+	// Returns the response for the certificate if there is one that has not expired yet
+	std::vector<uint8_t> get(std::vector<uint8_t> const& cert);
+
+	size_t size() const;
+
+private:
+	struct entry final
+	{
+		std::vector<uint8_t> issuer_;
+		std::vector<uint8_t> response_;
+		datetime expiry_;
+		monotonic_clock next_refresh_;
+		bool fetched_{};
+		bool used_{};
+	};
+
+	void run();
+
+	// Fetches and verifies a response, sets expiry and next_refresh accordingly.
+	// Returns an empty response on failure.
+	std::vector<uint8_t> fetch(std::vector<uint8_t> const& cert, std::vector<uint8_t> const& issuer, datetime & expiry, monotonic_clock & next_refresh);
+
+	thread_pool & pool_;
+	tls_ocsp_cache::fetcher const fetch_;
+	duration const retry_interval_;
+
+	mutable mutex mtx_{false};
+	condition cond_;
+	bool quit_{};
+
+	std::map<std::vector<uint8_t>, entry> entries_;
+
+	// Spawned on first use
+	async_task task_;
+};
+
+}
+#endif
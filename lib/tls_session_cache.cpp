@@ -0,0 +1,191 @@
+#include "libfilezilla/tls_session_cache.hpp"
+#include "tls_layer_impl.hpp"
+#include "tls_session_cache_impl.hpp"
+
+#include <algorithm>
+
+#include <time.h>
+
+namespace fz {
+
+namespace {
+extern "C" int anti_replay_add_func(void* ptr, time_t exp_time, gnutls_datum_t const* key, gnutls_datum_t const*)
+{
+	auto* cache = static_cast<tls_session_cache_impl*>(ptr);
+	if (!cache || !key || !key->data) {
+		return GNUTLS_E_DB_ERROR;
+	}
+	if (!cache->add_client_hello(exp_time, std::vector<uint8_t>(key->data, key->data + key->size))) {
+		return GNUTLS_E_DB_ENTRY_EXISTS;
+	}
+	return 0;
+}
+}
+
+tls_session_cache_impl::tls_session_cache_impl(size_t capacity, duration const& ttl, duration const& key_rotation)
+	: ttl_(ttl)
+	, capacity_(capacity)
+	, key_rotation_(key_rotation)
+{
+	init_gnutls();
+}
+
+tls_session_cache_impl::~tls_session_cache_impl()
+{
+	if (anti_replay_) {
+		gnutls_anti_replay_deinit(anti_replay_);
+	}
+}
+
+bool tls_session_cache_impl::generate_key()
+{
+	gnutls_datum_t k{};
+	if (gnutls_session_ticket_key_generate(&k) || !k.data) {
+		return false;
+	}
+	ticket_key_.assign(k.data, k.data + k.size);
+	gnutls_memset(k.data, 0, k.size);
+	gnutls_free(k.data);
+	key_created_ = monotonic_clock::now();
+	return true;
+}
+
+std::vector<uint8_t> tls_session_cache_impl::ticket_key()
+{
+	scoped_lock l(mtx_);
+	if (ticket_key_.empty() || (monotonic_clock::now() - key_created_) >= key_rotation_) {
+		if (!generate_key()) {
+			return {};
+		}
+	}
+	return ticket_key_;
+}
+
+void tls_session_cache_impl::store(std::vector<uint8_t> && key, std::vector<uint8_t> && data)
+{
+	if (!capacity_) {
+		return;
+	}
+
+	scoped_lock l(mtx_);
+
+	auto it = sessions_.find(key);
+	if (it != sessions_.end()) {
+		erase(it);
+	}
+	while (sessions_.size() >= capacity_) {
+		erase(sessions_.find(order_.front()));
+	}
+
+	order_.push_back(key);
+	auto & e = sessions_[std::move(key)];
+	e.data_ = std::move(data);
+	e.expiry_ = monotonic_clock::now() + ttl_;
+	e.order_ = std::prev(order_.end());
+}
+
+std::vector<uint8_t> tls_session_cache_impl::retrieve(std::vector<uint8_t> const& key)
+{
+	scoped_lock l(mtx_);
+
+	auto it = sessions_.find(key);
+	if (it == sessions_.end()) {
+		return {};
+	}
+	if (it->second.expiry_ <= monotonic_clock::now()) {
+		erase(it);
+		return {};
+	}
+	return it->second.data_;
+}
+
+void tls_session_cache_impl::remove(std::vector<uint8_t> const& key)
+{
+	scoped_lock l(mtx_);
+
+	auto it = sessions_.find(key);
+	if (it != sessions_.end()) {
+		erase(it);
+	}
+}
+
+void tls_session_cache_impl::erase(std::map<std::vector<uint8_t>, entry>::iterator it)
+{
+	order_.erase(it->second.order_);
+	sessions_.erase(it);
+}
+
+size_t tls_session_cache_impl::size() const
+{
+	scoped_lock l(mtx_);
+	return sessions_.size();
+}
+
+void tls_session_cache_impl::clear()
+{
+	scoped_lock l(mtx_);
+	sessions_.clear();
+	order_.clear();
+	ticket_key_.clear();
+	seen_.clear();
+	seen_order_.clear();
+}
+
+gnutls_anti_replay_t tls_session_cache_impl::anti_replay()
+{
+	scoped_lock l(mtx_);
+	if (!anti_replay_) {
+		if (gnutls_anti_replay_init(&anti_replay_)) {
+			anti_replay_ = nullptr;
+			return nullptr;
+		}
+		gnutls_anti_replay_set_ptr(anti_replay_, this);
+		gnutls_anti_replay_set_add_function(anti_replay_, &anti_replay_add_func);
+	}
+	return anti_replay_;
+}
+
+bool tls_session_cache_impl::add_client_hello(time_t expiry, std::vector<uint8_t> && key)
+{
+	scoped_lock l(mtx_);
+
+	time_t const now = time(nullptr);
+	while (!seen_order_.empty() && seen_order_.front().first <= now) {
+		seen_.erase(seen_order_.front().second);
+		seen_order_.pop_front();
+	}
+
+	// If full, rather reject early data than forgetting about seen ClientHellos.
+	// The client then simply sends its data after the handshake.
+	if (seen_.size() >= std::max(capacity_, size_t(1))) {
+		return false;
+	}
+
+	auto const res = seen_.insert(std::move(key));
+	if (!res.second) {
+		return false;
+	}
+	seen_order_.emplace_back(expiry, res.first);
+	return true;
+}
+
+tls_session_cache::tls_session_cache(size_t capacity, duration const& ttl, duration const& key_rotation)
+	: impl_(std::make_unique<tls_session_cache_impl>(capacity, ttl, key_rotation))
+{
+}
+
+tls_session_cache::~tls_session_cache()
+{
+}
+
+size_t tls_session_cache::size() const
+{
+	return impl_->size();
+}
+
+void tls_session_cache::clear()
+{
+	impl_->clear();
+}
+
+}
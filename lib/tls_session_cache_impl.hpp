@@ -0,0 +1,73 @@
+#ifndef LIBFILEZILLA_TLS_SESSION_CACHE_IMPL_HEADER
+#define LIBFILEZILLA_TLS_SESSION_CACHE_IMPL_HEADER
+
+#include "libfilezilla/tls_session_cache.hpp"
+#include "libfilezilla/mutex.hpp"
+
+#include <gnutls/gnutls.h>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace fz {
+
+class tls_session_cache_impl final
+{
+public:
+	tls_session_cache_impl(size_t capacity, duration const& ttl, duration const& key_rotation);
+	~tls_session_cache_impl();
+
+	// Returns the current ticket key, replacing it if it has become too old
+	std::vector<uint8_t> ticket_key();
+
+	void store(std::vector<uint8_t> && key, std::vector<uint8_t> && data);
+	std::vector<uint8_t> retrieve(std::vector<uint8_t> const& key);
+	void remove(std::vector<uint8_t> const& key);
+
+	size_t size() const;
+	void clear();
+
+	// Shared by all sessions accepting early data, created on first use
+	gnutls_anti_replay_t anti_replay();
+
+	// Returns false if the key has been seen before within the anti-replay window
+	bool add_client_hello(time_t expiry, std::vector<uint8_t> && key);
+
+	duration const ttl_;
+
+private:
+	struct entry final
+	{
+		std::vector<uint8_t> data_;
+		monotonic_clock expiry_;
+		std::list<std::vector<uint8_t>>::iterator order_;
+	};
+
+	bool generate_key();
+	void erase(std::map<std::vector<uint8_t>, entry>::iterator it);
+
+	mutable mutex mtx_{false};
+
+	size_t const capacity_;
+	duration const key_rotation_;
+
+	std::vector<uint8_t> ticket_key_;
+	monotonic_clock key_created_;
+
+	std::map<std::vector<uint8_t>, entry> sessions_;
+
+	// Keys of the sessions, oldest first
+	std::list<std::vector<uint8_t>> order_;
+
+	gnutls_anti_replay_t anti_replay_{};
+
+	// ClientHellos with early data seen within the anti-replay window, oldest first
+	std::set<std::vector<uint8_t>> seen_;
+	std::deque<std::pair<time_t, std::set<std::vector<uint8_t>>::iterator>> seen_order_;
+};
+
+}
+#endif
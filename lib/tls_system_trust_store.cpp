@@ -1,11 +1,41 @@
 #include "libfilezilla/tls_system_trust_store.hpp"
+#include "tls_layer_impl.hpp"
 #include "tls_system_trust_store_impl.hpp"
 
 namespace fz {
 
-tls_system_trust_store_impl::tls_system_trust_store_impl(thread_pool& pool)
+namespace {
+// Entries are small, the number of distinct issuers seen in practice is smaller still.
+size_t const max_cached_chains = 1000;
+}
+
+tls_system_trust_store_impl::tls_system_trust_store_impl(thread_pool& pool, bool lazy)
+	: pool_(pool)
+{
+	init_gnutls();
+
+	if (!lazy) {
+		scoped_lock l(mtx_);
+		start(l);
+	}
+}
+
+tls_system_trust_store_impl::~tls_system_trust_store_impl()
+{
+	task_.join();
+
+	if (credentials_) {
+		gnutls_certificate_free_credentials(credentials_);
+	}
+}
+
+void tls_system_trust_store_impl::start(scoped_lock &)
 {
-	task_ = pool.spawn([this]() {
+	if (task_ || loaded_) {
+		return;
+	}
+
+	task_ = pool_.spawn([this]() {
 		gnutls_certificate_credentials_t cred{};
 
 		if (gnutls_certificate_allocate_credentials(&cred) >= 0) {
@@ -17,33 +47,102 @@ tls_system_trust_store_impl::tls_system_trust_store_impl(thread_pool& pool)
 
 		scoped_lock l(mtx_);
 		credentials_ = cred;
+		loaded_ = true;
 		cond_.signal(l);
 	});
+	if (!task_) {
+		// Cannot spawn, there won't be a trust store.
+		loaded_ = true;
+	}
 }
 
-tls_system_trust_store_impl::~tls_system_trust_store_impl()
+void tls_system_trust_store_impl::prepare()
 {
-	task_.join();
-
-	if (credentials_) {
-		gnutls_certificate_free_credentials(credentials_);
-	}
+	scoped_lock l(mtx_);
+	start(l);
 }
 
 std::tuple<gnutls_certificate_credentials_t, scoped_lock> tls_system_trust_store_impl::lease()
 {
 	scoped_lock l(mtx_);
-	if (task_) {
-		cond_.wait(l);
-		task_.join();
+	start(l);
+	if (!loaded_) {
+		while (!loaded_) {
+			cond_.wait(l);
+		}
+		// Pass it on to other threads waiting concurrently
+		cond_.signal(l);
 	}
 
 	return std::make_tuple(credentials_, std::move(l));
 }
 
+std::optional<std::vector<x509_certificate>> tls_system_trust_store_impl::get_cached_chain(std::string const& fingerprint)
+{
+	scoped_lock l(chain_mtx_);
+	auto it = chains_.find(fingerprint);
+	if (it == chains_.end()) {
+		return std::nullopt;
+	}
+	return it->second;
+}
 
-tls_system_trust_store::tls_system_trust_store(thread_pool& pool)
-	: impl_(std::make_unique<tls_system_trust_store_impl>(pool))
+void tls_system_trust_store_impl::cache_chain(std::string const& fingerprint, std::vector<x509_certificate> const& issuers)
+{
+	scoped_lock l(chain_mtx_);
+	if (chains_.size() >= max_cached_chains && chains_.find(fingerprint) == chains_.end()) {
+		chains_.clear();
+	}
+	chains_[fingerprint] = issuers;
+}
+
+void tls_system_trust_store_impl::set_verification_cache(duration const& max_age)
+{
+	scoped_lock l(chain_mtx_);
+	verification_max_age_ = max_age;
+	if (!max_age) {
+		verified_chains_.clear();
+	}
+}
+
+std::optional<std::vector<x509_certificate>> tls_system_trust_store_impl::get_verified_chain(std::string const& key)
+{
+	scoped_lock l(chain_mtx_);
+	auto it = verified_chains_.find(key);
+	if (it == verified_chains_.end()) {
+		return std::nullopt;
+	}
+	if (it->second.expiry_ <= datetime::now()) {
+		verified_chains_.erase(it);
+		return std::nullopt;
+	}
+	return it->second.trust_chain_;
+}
+
+void tls_system_trust_store_impl::cache_verified_chain(std::string const& key, std::vector<x509_certificate> const& trust_chain)
+{
+	scoped_lock l(chain_mtx_);
+	if (!verification_max_age_) {
+		return;
+	}
+
+	// Cached no longer than any certificate in the trust path is valid
+	datetime expiry = datetime::now() + verification_max_age_;
+	for (auto const& cert : trust_chain) {
+		if (cert.get_expiration_time() < expiry) {
+			expiry = cert.get_expiration_time();
+		}
+	}
+
+	if (verified_chains_.size() >= max_cached_chains && verified_chains_.find(key) == verified_chains_.end()) {
+		verified_chains_.clear();
+	}
+	verified_chains_[key] = verified_chain{trust_chain, expiry};
+}
+
+
+tls_system_trust_store::tls_system_trust_store(thread_pool& pool, bool lazy)
+	: impl_(std::make_unique<tls_system_trust_store_impl>(pool, lazy))
 {
 }
 
@@ -51,4 +150,23 @@ tls_system_trust_store::~tls_system_trust_store()
 {
 }
 
+void tls_system_trust_store::set_verification_cache(duration const& max_age)
+{
+	impl_->set_verification_cache(max_age);
+}
+
+std::shared_ptr<tls_system_trust_store> tls_system_trust_store::get_shared(thread_pool& pool)
+{
+	static mutex m;
+	static std::weak_ptr<tls_system_trust_store> shared;
+
+	scoped_lock l(m);
+	auto store = shared.lock();
+	if (!store) {
+		store = std::make_shared<tls_system_trust_store>(pool, true);
+		shared = store;
+	}
+	return store;
+}
+
 }
@@ -10,7 +10,10 @@ typedef std::make_signed_t<size_t> ssize_t;
 #include <gnutls/gnutls.h>
 
 #include "libfilezilla/thread_pool.hpp"
+#include "libfilezilla/tls_info.hpp"
 
+#include <map>
+#include <optional>
 #include <tuple>
 
 namespace fz {
@@ -18,18 +21,47 @@ namespace fz {
 class tls_system_trust_store_impl final
 {
 public:
-	tls_system_trust_store_impl(thread_pool& pool);
+	tls_system_trust_store_impl(thread_pool& pool, bool lazy);
 	~tls_system_trust_store_impl();
 
+	// Starts loading if not yet started
+	void prepare();
+
 	std::tuple<gnutls_certificate_credentials_t, scoped_lock> lease();
 
+	// The issuers completing the chain ending with the certificate with the given fingerprint
+	std::optional<std::vector<x509_certificate>> get_cached_chain(std::string const& fingerprint);
+	void cache_chain(std::string const& fingerprint, std::vector<x509_certificate> const& issuers);
+
+	void set_verification_cache(duration const& max_age);
+
+	// The trust path of a chain that has been verified successfully, keyed by hostname and the chain sent by the peer
+	std::optional<std::vector<x509_certificate>> get_verified_chain(std::string const& key);
+	void cache_verified_chain(std::string const& key, std::vector<x509_certificate> const& trust_chain);
+
 private:
+	void start(scoped_lock &);
+
+	thread_pool & pool_;
+
 	mutex mtx_{false};
 	condition cond_;
 
 	gnutls_certificate_credentials_t credentials_{};
+	bool loaded_{};
 
 	async_task task_;
+
+	mutex chain_mtx_{false};
+	std::map<std::string, std::vector<x509_certificate>> chains_;
+
+	struct verified_chain final
+	{
+		std::vector<x509_certificate> trust_chain_;
+		datetime expiry_;
+	};
+	duration verification_max_age_;
+	std::map<std::string, verified_chain> verified_chains_;
 };
 
 }
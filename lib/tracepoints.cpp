@@ -0,0 +1,27 @@
+#include "tracepoints.hpp"
+
+#if FZ_USE_TRACEPOINTS && FZ_WINDOWS
+
+// {a14d6651-1619-46fb-b033-2a5d202ad252}
+TRACELOGGING_DEFINE_PROVIDER(fz_trace_provider, "libfilezilla",
+	(0xa14d6651, 0x1619, 0x46fb, 0xb0, 0x33, 0x2a, 0x5d, 0x20, 0x2a, 0xd2, 0x52));
+
+namespace fz {
+namespace {
+// Registered for the lifetime of the library
+struct provider_registration final
+{
+	provider_registration() {
+		TraceLoggingRegister(fz_trace_provider);
+	}
+
+	~provider_registration() {
+		TraceLoggingUnregister(fz_trace_provider);
+	}
+};
+
+provider_registration registration;
+}
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef LIBFILEZILLA_TRACEPOINTS_HEADER
+#define LIBFILEZILLA_TRACEPOINTS_HEADER
+
+#include "libfilezilla/libfilezilla.hpp"
+
+// Static tracepoints for production profiling, added with --enable-tracepoints.
+//
+// On Linux and macOS these are USDT probes of the provider libfilezilla, usable with
+// SystemTap, bpftrace or DTrace. On Windows they are TraceLogging events of the ETW
+// provider libfilezilla, {a14d6651-1619-46fb-b033-2a5d202ad252}, with arguments named
+// arg1, arg2 and so on. Without a tracer attached, a probe costs a nop or a check of
+// the provider's enabled flag.
+//
+// All arguments are passed as 64-bit integers, pointers are identities only.
+//
+//   socket_read          socket*, result, error
+//   socket_write         socket*, result, error
+//   event_dispatch       event_loop*, event_handler*, event type
+//   timer_fire           event_loop*, event_handler*, timer id
+//   aio_buffer_lease     aio_buffer_pool*, buffer, leases outstanding
+//   aio_buffer_wait      aio_buffer_pool*, waiter
+//   aio_buffer_release   aio_buffer_pool*, buffer, leases outstanding
+//   tls_handshake_start  tls_layer_impl*, server
+//   tls_handshake_finish tls_layer_impl*, success, resumed
+
+#if FZ_USE_TRACEPOINTS
+
+#include <stdint.h>
+#include <type_traits>
+
+namespace fz::tracing {
+template<typename T>
+int64_t arg(T const& v)
+{
+	if constexpr (std::is_pointer_v<T>) {
+		return static_cast<int64_t>(reinterpret_cast<uintptr_t>(v));
+	}
+	else {
+		return static_cast<int64_t>(v);
+	}
+}
+}
+
+#if FZ_WINDOWS
+
+#include "libfilezilla/glue/windows.hpp"
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(fz_trace_provider);
+
+#define FZ_TRACE2(name, a1, a2) TraceLoggingWrite(fz_trace_provider, #name, \
+	TraceLoggingInt64(fz::tracing::arg(a1), "arg1"), TraceLoggingInt64(fz::tracing::arg(a2), "arg2"))
+#define FZ_TRACE3(name, a1, a2, a3) TraceLoggingWrite(fz_trace_provider, #name, \
+	TraceLoggingInt64(fz::tracing::arg(a1), "arg1"), TraceLoggingInt64(fz::tracing::arg(a2), "arg2"), TraceLoggingInt64(fz::tracing::arg(a3), "arg3"))
+
+#else
+
+#include <sys/sdt.h>
+
+#define FZ_TRACE2(name, a1, a2) DTRACE_PROBE2(libfilezilla, name, fz::tracing::arg(a1), fz::tracing::arg(a2))
+#define FZ_TRACE3(name, a1, a2, a3) DTRACE_PROBE3(libfilezilla, name, fz::tracing::arg(a1), fz::tracing::arg(a2), fz::tracing::arg(a3))
+
+#endif
+
+#else
+
+#define FZ_TRACE2(name, a1, a2) ((void)0)
+#define FZ_TRACE3(name, a1, a2, a3) ((void)0)
+
+#endif
+
+#endif
@@ -1,6 +1,11 @@
 #include "libfilezilla/translate.hpp"
+#include "libfilezilla/rwmutex.hpp"
 #include "libfilezilla/string.hpp"
 
+#include <list>
+#include <map>
+#include <tuple>
+
 namespace fz {
 namespace {
 std::wstring default_translator(char const* const t)
@@ -15,6 +20,61 @@ std::wstring default_translator_pf(char const* const singular, char const* const
 
 std::wstring(*translator)(char const* const) = default_translator;
 std::wstring(*translator_pf)(char const* const singular, char const* const plural, int64_t n) = default_translator_pf;
+
+class translation_cache final
+{
+public:
+	std::wstring_view get(char const* singular, char const* plural, int64_t n)
+	{
+		key const k(singular, plural, plural ? plural_class(n) : 0);
+		{
+			scoped_read_lock l(mtx_);
+			auto it = entries_.find(k);
+			if (it != entries_.end()) {
+				return it->second;
+			}
+		}
+
+		// The translator may be slow, do not block others meanwhile
+		std::wstring translated = plural ? translator_pf(singular, plural, n) : translator(singular);
+
+		scoped_write_lock l(mtx_);
+		return entries_.emplace(k, std::move(translated)).first->second;
+	}
+
+	void reset()
+	{
+		scoped_write_lock l(mtx_);
+		if (!entries_.empty()) {
+			// Moving keeps the nodes, views into the old entries remain valid
+			retired_.emplace_back(std::move(entries_));
+			entries_.clear();
+		}
+	}
+
+private:
+	// Plural rules of gettext look at small counts exactly and otherwise at the
+	// last two digits. Folding large counts keeps the number of entries bounded.
+	static uint64_t plural_class(int64_t n)
+	{
+		auto const u = static_cast<uint64_t>(n);
+		return u < 200 ? u : 100 + u % 100;
+	}
+
+	typedef std::tuple<char const*, char const*, uint64_t> key;
+
+	rwmutex mtx_;
+	std::map<key, std::wstring> entries_;
+
+	// Entries from before the translators changed, views may still refer to them
+	std::list<std::map<key, std::wstring>> retired_;
+};
+
+translation_cache& get_translation_cache()
+{
+	static translation_cache cache;
+	return cache;
+}
 }
 
 void set_translators(
@@ -24,6 +84,7 @@ void set_translators(
 {
 	translator = s ? s : default_translator;
 	translator_pf = pf ? pf : default_translator_pf;
+	reset_translation_cache();
 }
 
 std::wstring translate(char const * const t)
@@ -35,4 +96,19 @@ std::wstring translate(char const * const singular, char const * const plural, i
 {
 	return translator_pf(singular, plural, n);
 }
+
+std::wstring_view translate_view(char const* const source)
+{
+	return get_translation_cache().get(source, nullptr, 0);
+}
+
+std::wstring_view translate_view(char const* const singular, char const* const plural, int64_t n)
+{
+	return get_translation_cache().get(singular, plural, n);
+}
+
+void reset_translation_cache()
+{
+	get_translation_cache().reset();
+}
 }
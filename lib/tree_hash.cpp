@@ -0,0 +1,301 @@
+#include "libfilezilla/tree_hash.hpp"
+#include "libfilezilla/file.hpp"
+#include "libfilezilla/hash.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#include <nettle/sha2.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace fz {
+
+namespace {
+size_t const chunk_size = tree_hash_accumulator::chunk_size;
+
+void hash_chunk(tree_hash_accumulator::chunk_digest & out, uint8_t const* data, size_t size)
+{
+	sha256_ctx ctx;
+	nettle_sha256_init(&ctx);
+	nettle_sha256_update(&ctx, size, data);
+	nettle_sha256_digest(&ctx, out.size(), out.data());
+}
+}
+
+tree_hash_accumulator::tree_hash_accumulator(thread_pool * pool)
+	: pool_(pool)
+{
+}
+
+tree_hash_accumulator::~tree_hash_accumulator()
+{
+}
+
+void tree_hash_accumulator::reinit()
+{
+	scoped_lock l(mtx_);
+	partial_.clear();
+	chunks_.clear();
+	have_.clear();
+	end_ = 0;
+	failed_ = false;
+}
+
+bool tree_hash_accumulator::update(uint8_t const* data, size_t size)
+{
+	uint64_t offset;
+	{
+		scoped_lock l(mtx_);
+		offset = end_;
+	}
+	return update(offset, data, size);
+}
+
+bool tree_hash_accumulator::update(uint64_t offset, uint8_t const* data, size_t size)
+{
+	{
+		scoped_lock l(mtx_);
+		if (failed_) {
+			return false;
+		}
+		if (!size) {
+			return true;
+		}
+		end_ = std::max(end_, offset + size);
+	}
+
+	uint64_t index = offset / chunk_size;
+	size_t const within = static_cast<size_t>(offset % chunk_size);
+	if (within || size < chunk_size) {
+		size_t const n = std::min(size, chunk_size - within);
+		if (!update_partial(index, within, data, n)) {
+			return false;
+		}
+		data += n;
+		size -= n;
+		++index;
+	}
+
+	size_t const full = size / chunk_size;
+	if (full) {
+		add_chunks(index, data, full);
+		data += full * chunk_size;
+		size -= full * chunk_size;
+		index += full;
+	}
+
+	if (size) {
+		return update_partial(index, 0, data, size);
+	}
+
+	scoped_lock l(mtx_);
+	return !failed_;
+}
+
+bool tree_hash_accumulator::update_partial(uint64_t index, size_t offset, uint8_t const* data, size_t size)
+{
+	scoped_lock l(mtx_);
+	if (failed_) {
+		return false;
+	}
+
+	auto & p = partial_[index];
+	if (p.busy_ || p.filled_ != offset || (index < have_.size() && have_[index])) {
+		failed_ = true;
+		return false;
+	}
+	if (!p.acc_) {
+		p.acc_ = std::make_unique<hash_accumulator>(hash_algorithm::sha256);
+	}
+
+	// The map does not invalidate references on insertion
+	p.busy_ = true;
+	l.unlock();
+	p.acc_->update(data, size);
+	l.lock();
+	p.busy_ = false;
+	p.filled_ += size;
+
+	if (p.filled_ == chunk_size) {
+		auto const digest = p.acc_->digest();
+		partial_.erase(index);
+		if (index >= have_.size()) {
+			chunks_.resize(index + 1);
+			have_.resize(index + 1);
+		}
+		std::copy(digest.cbegin(), digest.cend(), chunks_[index].begin());
+		have_[index] = true;
+	}
+	return !failed_;
+}
+
+void tree_hash_accumulator::add_chunks(uint64_t first, uint8_t const* data, size_t count)
+{
+	std::vector<chunk_digest> digests(count);
+	if (pool_ && count > 1) {
+		std::vector<pooled_task> tasks;
+		tasks.reserve(count - 1);
+		for (size_t i = 1; i < count; ++i) {
+			tasks.emplace_back(pool_->submit([&digests, data, i] { hash_chunk(digests[i], data + i * chunk_size, chunk_size); }));
+		}
+		hash_chunk(digests[0], data, chunk_size);
+		for (auto & task : tasks) {
+			task.join();
+		}
+	}
+	else {
+		for (size_t i = 0; i < count; ++i) {
+			hash_chunk(digests[i], data + i * chunk_size, chunk_size);
+		}
+	}
+
+	scoped_lock l(mtx_);
+	if (first + count > have_.size()) {
+		chunks_.resize(first + count);
+		have_.resize(first + count);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		if (have_[first + i] || partial_.count(first + i)) {
+			failed_ = true;
+		}
+		chunks_[first + i] = digests[i];
+		have_[first + i] = true;
+	}
+}
+
+std::vector<uint8_t> tree_hash_accumulator::digest()
+{
+	scoped_lock l(mtx_);
+	if (failed_) {
+		return {};
+	}
+
+	uint64_t const count = (end_ + chunk_size - 1) / chunk_size;
+	if (end_ % chunk_size) {
+		// Finish the last chunk
+		auto it = partial_.find(count - 1);
+		if (it == partial_.end() || it->second.busy_ || it->second.filled_ != end_ % chunk_size) {
+			return {};
+		}
+		auto const digest = it->second.acc_->digest();
+		partial_.erase(it);
+		if (count > have_.size()) {
+			chunks_.resize(count);
+			have_.resize(count);
+		}
+		std::copy(digest.cbegin(), digest.cend(), chunks_[count - 1].begin());
+		have_[count - 1] = true;
+	}
+
+	if (!partial_.empty() || have_.size() != count || std::find(have_.cbegin(), have_.cend(), false) != have_.cend()) {
+		return {};
+	}
+	return tree_hash_combine(chunks_);
+}
+
+std::vector<tree_hash_accumulator::chunk_digest> tree_hash_accumulator::chunk_digests() const
+{
+	scoped_lock l(mtx_);
+	size_t const n = static_cast<size_t>(std::find(have_.cbegin(), have_.cend(), false) - have_.cbegin());
+	return std::vector<chunk_digest>(chunks_.cbegin(), chunks_.cbegin() + n);
+}
+
+std::vector<uint8_t> tree_hash_combine(std::vector<tree_hash_accumulator::chunk_digest> const& chunks)
+{
+	if (chunks.empty()) {
+		tree_hash_accumulator::chunk_digest empty;
+		hash_chunk(empty, nullptr, 0);
+		return std::vector<uint8_t>(empty.cbegin(), empty.cend());
+	}
+
+	auto level = chunks;
+	while (level.size() > 1) {
+		size_t out{};
+		for (size_t i = 0; i + 1 < level.size(); i += 2) {
+			sha256_ctx ctx;
+			nettle_sha256_init(&ctx);
+			nettle_sha256_update(&ctx, level[i].size(), level[i].data());
+			nettle_sha256_update(&ctx, level[i + 1].size(), level[i + 1].data());
+			nettle_sha256_digest(&ctx, level[out].size(), level[out].data());
+			++out;
+		}
+		if (level.size() % 2) {
+			level[out++] = level.back();
+		}
+		level.resize(out);
+	}
+	return std::vector<uint8_t>(level[0].cbegin(), level[0].cend());
+}
+
+std::vector<uint8_t> tree_hash(std::basic_string_view<uint8_t> const& data, thread_pool * pool)
+{
+	tree_hash_accumulator acc(pool);
+	acc.update(0, data.data(), data.size());
+	return acc.digest();
+}
+
+std::vector<uint8_t> tree_hash(std::string_view const& data, thread_pool * pool)
+{
+	return tree_hash(std::basic_string_view<uint8_t>(reinterpret_cast<uint8_t const*>(data.data()), data.size()), pool);
+}
+
+std::vector<uint8_t> tree_hash_file(native_string const& path, thread_pool & pool, size_t threads, std::vector<tree_hash_accumulator::chunk_digest> * chunks)
+{
+	file f(path, file::reading);
+	if (!f.opened()) {
+		return {};
+	}
+	int64_t const size = f.size();
+	if (size < 0) {
+		return {};
+	}
+
+	uint64_t const count = (static_cast<uint64_t>(size) + chunk_size - 1) / chunk_size;
+	std::vector<tree_hash_accumulator::chunk_digest> digests(static_cast<size_t>(count));
+
+	std::atomic<uint64_t> next{};
+	std::atomic<bool> failed{};
+	auto const worker = [&]() {
+		auto buf = std::make_unique<uint8_t[]>(chunk_size);
+		while (!failed) {
+			uint64_t const i = next++;
+			if (i >= count) {
+				break;
+			}
+
+			uint64_t const offset = i * chunk_size;
+			size_t const len = static_cast<size_t>(std::min(static_cast<uint64_t>(chunk_size), static_cast<uint64_t>(size) - offset));
+			size_t read{};
+			while (read < len) {
+				int64_t const r = f.read_at(buf.get() + read, static_cast<int64_t>(len - read), static_cast<int64_t>(offset + read));
+				if (r <= 0) {
+					failed = true;
+					return;
+				}
+				read += static_cast<size_t>(r);
+			}
+			hash_chunk(digests[i], buf.get(), len);
+		}
+	};
+
+	// The calling thread is one of the workers
+	std::vector<async_task> tasks;
+	for (uint64_t i = 1; i < std::min(static_cast<uint64_t>(threads), count); ++i) {
+		tasks.emplace_back(pool.spawn(worker));
+	}
+	worker();
+	for (auto & task : tasks) {
+		task.join();
+	}
+
+	if (failed) {
+		return {};
+	}
+	auto ret = tree_hash_combine(digests);
+	if (chunks) {
+		*chunks = std::move(digests);
+	}
+	return ret;
+}
+
+}
@@ -0,0 +1,222 @@
+#include "libfilezilla/tree_walker.hpp"
+#include "libfilezilla/thread_pool.hpp"
+
+#ifndef FZ_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <deque>
+#include <iterator>
+#include <list>
+
+namespace fz {
+
+namespace {
+struct node final
+{
+	node(native_string && p, node * parent)
+		: path_(std::move(p))
+		, parent_(parent)
+	{}
+
+	native_string const path_;
+	node * const parent_;
+
+	// The directory itself and its unfinished subdirectories
+	size_t pending_{1};
+
+	std::list<node>::iterator self_;
+};
+
+bool read_dir(native_string const& path, bool root, dir_entry_fields fields, bool follow_links, std::vector<local_filesys::dir_entry> & entries)
+{
+	local_filesys fs;
+#ifdef FZ_WINDOWS
+	(void)root;
+	if (!fs.begin_find_files(path, false, follow_links)) {
+		return false;
+	}
+#else
+	// Unless following links, make sure not to end up outside the tree if
+	// a subdirectory got replaced by a link after it was listed.
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (!root && !follow_links) {
+		flags |= O_NOFOLLOW;
+	}
+	int fd = open(path.c_str(), flags);
+	if (fd == -1 || !fs.begin_find_files(fd, false, follow_links)) {
+		return false;
+	}
+#endif
+
+	std::vector<local_filesys::dir_entry> batch;
+	while (fs.get_next_files(batch, 1024, fields | dir_entry_fields::type)) {
+		entries.insert(entries.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+	}
+	return true;
+}
+
+class walk_context final
+{
+public:
+	walk_context(thread_pool & pool, size_t max_parallel, tree_walker::entries_cb_t const& on_entries, tree_walker::leave_cb_t const& on_leave, dir_entry_fields fields, bool follow_links)
+		: pool_(pool)
+		, on_entries_(on_entries)
+		, on_leave_(on_leave)
+		, fields_(fields)
+		, follow_links_(follow_links)
+		, tasks_(max_parallel)
+		, busy_(max_parallel)
+	{}
+
+	bool run(std::vector<native_string> const& roots);
+
+private:
+	void process(node & n, size_t slot);
+
+	// Called once a directory has been processed, leaves it and all parents that are done as well
+	void finish(scoped_lock & l, node * n);
+
+	thread_pool & pool_;
+	tree_walker::entries_cb_t const& on_entries_;
+	tree_walker::leave_cb_t const& on_leave_;
+	dir_entry_fields const fields_;
+	bool const follow_links_;
+
+	mutex mtx_{false};
+	condition cond_;
+
+	std::list<node> nodes_;
+	std::deque<node*> queue_;
+
+	std::vector<async_task> tasks_;
+	std::vector<bool> busy_;
+	size_t running_{};
+
+	bool aborted_{};
+	bool failed_{};
+};
+
+bool walk_context::run(std::vector<native_string> const& roots)
+{
+	scoped_lock l(mtx_);
+	for (auto root : roots) {
+		if (root.size() > 1 && local_filesys::is_separator(root.back())) {
+			root.pop_back();
+		}
+		if (root.empty()) {
+			failed_ = true;
+			continue;
+		}
+		auto & n = nodes_.emplace_back(std::move(root), nullptr);
+		n.self_ = std::prev(nodes_.end());
+		queue_.push_back(&n);
+	}
+
+	while (true) {
+		if (!aborted_ && !queue_.empty() && running_ < tasks_.size()) {
+			node * n = queue_.front();
+			queue_.pop_front();
+
+			size_t slot{};
+			while (busy_[slot]) {
+				++slot;
+			}
+			busy_[slot] = true;
+			++running_;
+
+			l.unlock();
+			// The previous task in this slot has already finished processing, reap it.
+			tasks_[slot].join();
+			tasks_[slot] = pool_.spawn([this, n, slot] { process(*n, slot); });
+			if (!tasks_[slot]) {
+				process(*n, slot);
+			}
+			l.lock();
+			continue;
+		}
+
+		if (!running_) {
+			break;
+		}
+		cond_.wait(l);
+	}
+	l.unlock();
+
+	for (auto & task : tasks_) {
+		task.join();
+	}
+
+	return !aborted_ && !failed_;
+}
+
+void walk_context::process(node & n, size_t slot)
+{
+	std::vector<local_filesys::dir_entry> entries;
+	bool const read = read_dir(n.path_, !n.parent_, fields_, follow_links_, entries);
+	bool const cont = !read || on_entries_(n.path_, entries);
+
+	scoped_lock l(mtx_);
+	if (!read) {
+		failed_ = true;
+	}
+	if (!cont) {
+		aborted_ = true;
+	}
+	if (!aborted_) {
+		for (auto & e : entries) {
+			if (e.t != local_filesys::dir) {
+				continue;
+			}
+
+			auto & child = nodes_.emplace_back(n.path_ + local_filesys::path_separator + e.name, &n);
+			child.self_ = std::prev(nodes_.end());
+			queue_.push_back(&child);
+			++n.pending_;
+		}
+	}
+
+	finish(l, &n);
+
+	busy_[slot] = false;
+	--running_;
+	cond_.signal(l);
+}
+
+void walk_context::finish(scoped_lock & l, node * n)
+{
+	while (n && !--n->pending_) {
+		if (!aborted_ && on_leave_) {
+			l.unlock();
+			bool const cont = on_leave_(n->path_);
+			l.lock();
+			if (!cont) {
+				aborted_ = true;
+			}
+		}
+
+		node * parent = n->parent_;
+		nodes_.erase(n->self_);
+		n = parent;
+	}
+}
+}
+
+tree_walker::tree_walker(thread_pool & pool, size_t max_parallel)
+	: pool_(pool)
+	, max_parallel_(max_parallel ? max_parallel : 1)
+{
+}
+
+bool tree_walker::walk(std::vector<native_string> const& roots, entries_cb_t const& on_entries, leave_cb_t const& on_leave, dir_entry_fields fields, bool follow_links)
+{
+	if (!on_entries) {
+		return false;
+	}
+
+	walk_context ctx(pool_, max_parallel_, on_entries, on_leave, fields, follow_links);
+	return ctx.run(roots);
+}
+
+}
@@ -8,6 +8,9 @@
 #endif
 #include <unistd.h>
 
+#include <algorithm>
+#include <limits>
+
 namespace fz {
 
 poller::~poller()
@@ -61,7 +64,7 @@ bool poller::wait(scoped_lock & l)
 }
 
 // fds must be large enough to hold n+1 entries, but fds[n] must not be filled by caller
-bool poller::wait(struct pollfd *fds, nfds_t n, scoped_lock & l)
+bool poller::wait(struct pollfd *fds, nfds_t n, scoped_lock & l, duration const& timeout)
 {
 #ifdef HAVE_EVENTFD
 	fds[n].fd = event_fd_;
@@ -70,11 +73,16 @@ bool poller::wait(struct pollfd *fds, nfds_t n, scoped_lock & l)
 #endif
 	fds[n].events = POLLIN;
 
+	int ms = -1;
+	if (timeout) {
+		ms = static_cast<int>(std::max(int64_t(0), std::min(timeout.get_milliseconds(), int64_t(std::numeric_limits<int>::max()))));
+	}
+
 	l.unlock();
 
 	int res{};
 	do {
-		res = poll(fds, n + 1, -1);
+		res = poll(fds, n + 1, ms);
 	} while (res == -1 && errno == EINTR);
 
 	l.lock();
@@ -89,7 +97,7 @@ bool poller::wait(struct pollfd *fds, nfds_t n, scoped_lock & l)
 #endif
 		(void)damn_spurious_warning; // We do not care about return value and this is definitely correct!
 	}
-	return res > 0;
+	return res >= 0;
 }
 
 void poller::interrupt(scoped_lock & l)
@@ -3,6 +3,7 @@
 
 #include "../libfilezilla/libfilezilla.hpp"
 #include "../libfilezilla/mutex.hpp"
+#include "../libfilezilla/time.hpp"
 
 #if !FZ_WINDOWS
 
@@ -26,7 +27,8 @@ public:
 	bool wait(scoped_lock & l);
 
 	// fds must be large enough to hold n+1 entries, but fds[n] must not be filled by caller
-	bool wait(struct pollfd *fds, nfds_t n, scoped_lock & l);
+	// If a timeout is given, returns true with no revents set once it expires.
+	bool wait(struct pollfd *fds, nfds_t n, scoped_lock & l, duration const& timeout = duration());
 
 	void interrupt(scoped_lock & l);
 
@@ -17,6 +17,13 @@ uri::uri(std::string_view const& in)
 	}
 }
 
+uri::uri(uri_view const& in)
+{
+	if (!assign(in)) {
+		clear();
+	}
+}
+
 void uri::clear()
 {
 	*this = uri();
@@ -24,100 +31,56 @@ void uri::clear()
 
 bool uri::parse(std::string_view in)
 {
-	// Look for fragment
-	size_t pos = in.find('#');
-	if (pos != std::string::npos) {
-		fragment_ = in.substr(pos + 1);
-		in = in.substr(0, pos);
-	}
-
-	// Look for query
-	pos = in.find('?');
-	if (pos != std::string::npos) {
-		query_ = in.substr(pos + 1);
-		in = in.substr(0, pos);
-	}
+	uri_view v;
+	return v.parse(in) && assign(v);
+}
 
-	// Do we have a scheme?
-	if (!in.empty() && uri_chars::alpha.find(in[0]) != std::string::npos) {
-		size_t scheme_delim = in.find_first_not_of(uri_chars::scheme, 1);
-		if (scheme_delim != std::string::npos && in[scheme_delim] == ':') {
-			scheme_ = in.substr(0, scheme_delim);
-			in = in.substr(scheme_delim + 1);
-		}
+bool uri::assign(uri_view const& in)
+{
+	// Only components present in the input are assigned
+	if (in.fragment_.data()) {
+		fragment_ = in.fragment_;
 	}
-
-	// Do we have authority?
-	if (in.size() >= 2 && in[0] == '/' && in[1] == '/') {
-		size_t auth_delim = in.find('/', 2);
-		std::string_view authority;
-		if (auth_delim != std::string::npos) {
-			authority = in.substr(2, auth_delim - 2);
-			in = in.substr(auth_delim);
-		}
-		else {
-			authority = in.substr(2);
-			in = std::string_view();
-		}
-		if (!parse_authority(authority)) {
-			return false;
-		}
+	if (in.query_.data()) {
+		query_ = in.query_;
 	}
-
-	if (!in.empty()) {
-		path_ = percent_decode_s(in);
-		if (path_.empty()) {
-			return false;
-		}
+	if (in.scheme_.data()) {
+		scheme_ = in.scheme_;
 	}
 
-	return true;
-}
-
-bool uri::parse_authority(std::string_view authority)
-{
-	// Do we have userinfo?
-	size_t pos = authority.find('@');
-	if (pos != std::string::npos) {
-		std::string_view userinfo = authority.substr(0, pos);
-		authority = authority.substr(pos + 1);
-		pos = userinfo.find(':');
-		if (pos != std::string::npos) { // Slight inaccuracy: Empty password isn't handled well
-			user_ = percent_decode_s(userinfo.substr(0, pos));
-			if (user_.empty() && pos != 0) {
+	if (in.host_.data()) {
+		if (in.pass_.data()) {
+			user_ = percent_decode_s(in.user_);
+			if (user_.empty() && !in.user_.empty()) {
 				return false;
 			}
-			pass_ = percent_decode_s(userinfo.substr(pos + 1));
-			if (pass_.empty() && pos + 1 != userinfo.size()) {
+			pass_ = percent_decode_s(in.pass_);
+			if (pass_.empty() && !in.pass_.empty()) {
 				return false;
 			}
 		}
-		else {
-			user_ = userinfo;
+		else if (in.user_.data()) {
+			// Slight inaccuracy: Without password, the user is taken as is
+			user_ = in.user_;
 		}
-	}
 
-	// Do we have port?
-	pos = authority.rfind(':');
-	if (pos != std::string::npos) {
-		if (authority.find_first_not_of(uri_chars::digit, pos + 1) == std::string::npos) {
-			port_ = to_integral<unsigned short>(authority.substr(pos + 1));
-			authority = authority.substr(0, pos);
+		if (in.port_) {
+			port_ = in.port_;
 		}
-	}
 
-	if (!authority.empty() && authority[0] == '[') {
-		if (authority.back() != ']') {
+		host_ = percent_decode_s(in.host_);
+		if (host_.empty() && !in.host_.empty()) {
 			return false;
 		}
-		if (get_address_type(authority) != address_type::ipv6) {
+	}
+
+	if (!in.path_.empty()) {
+		path_ = percent_decode_s(in.path_);
+		if (path_.empty()) {
 			return false;
 		}
 	}
-	host_ = percent_decode_s(authority);
-	if (host_.empty() && !authority.empty()) {
-		return false;
-	}
+
 	return true;
 }
 
@@ -131,7 +94,7 @@ std::string uri::to_string(bool with_query) const
 		ret += "//";
 		ret += get_authority(true);
 	}
-	ret += percent_encode(path_, true);
+	percent_encode_append(ret, path_, true);
 
 	if (with_query) {
 		if (!query_.empty()) {
@@ -161,16 +124,16 @@ std::string uri::get_authority(bool with_userinfo) const
 	std::string ret;
 	if (!host_.empty()) {
 		if (with_userinfo) {
-			ret += percent_encode(user_);
+			percent_encode_append(ret, user_);
 			if (!pass_.empty()) {
 				ret += ":";
-				ret += percent_encode(pass_);
+				percent_encode_append(ret, pass_);
 			}
 			if (!user_.empty() || !pass_.empty()) {
 				ret += "@";
 			}
 		}
-		ret += percent_encode(host_);
+		percent_encode_append(ret, host_);
 		if (port_ != 0) {
 			ret += ":";
 			ret += fz::to_string(port_);
@@ -297,9 +260,9 @@ std::string query_string::to_string(bool encode_slashes) const
 	std::string ret;
 	if (!segments_.empty()) {
 		for (auto const& segment : segments_) {
-			ret += percent_encode(segment.first, !encode_slashes);
+			percent_encode_append(ret, segment.first, !encode_slashes);
 			ret += '=';
-			ret += percent_encode(segment.second, !encode_slashes);
+			percent_encode_append(ret, segment.second, !encode_slashes);
 			ret += '&';
 		}
 		ret.pop_back();
@@ -307,4 +270,203 @@ std::string query_string::to_string(bool encode_slashes) const
 	return ret;
 }
 
+
+uri_view::uri_view(std::string_view const& in)
+{
+	if (!parse(in)) {
+		clear();
+	}
+}
+
+void uri_view::clear()
+{
+	*this = uri_view();
+}
+
+bool uri_view::parse(std::string_view in)
+{
+	clear();
+
+	// Look for fragment
+	size_t pos = in.find('#');
+	if (pos != std::string::npos) {
+		fragment_ = in.substr(pos + 1);
+		in = in.substr(0, pos);
+	}
+
+	// Look for query
+	pos = in.find('?');
+	if (pos != std::string::npos) {
+		query_ = in.substr(pos + 1);
+		in = in.substr(0, pos);
+	}
+
+	// Do we have a scheme?
+	if (!in.empty() && uri_chars::alpha.find(in[0]) != std::string::npos) {
+		size_t scheme_delim = in.find_first_not_of(uri_chars::scheme, 1);
+		if (scheme_delim != std::string::npos && in[scheme_delim] == ':') {
+			scheme_ = in.substr(0, scheme_delim);
+			in = in.substr(scheme_delim + 1);
+		}
+	}
+
+	// Do we have authority?
+	if (in.size() >= 2 && in[0] == '/' && in[1] == '/') {
+		size_t auth_delim = in.find('/', 2);
+		std::string_view authority;
+		if (auth_delim != std::string::npos) {
+			authority = in.substr(2, auth_delim - 2);
+			in = in.substr(auth_delim);
+		}
+		else {
+			authority = in.substr(2);
+			in = in.substr(in.size());
+		}
+		if (!parse_authority(authority)) {
+			return false;
+		}
+	}
+
+	path_ = in;
+
+	return true;
+}
+
+bool uri_view::parse_authority(std::string_view authority)
+{
+	// Do we have userinfo?
+	size_t pos = authority.find('@');
+	if (pos != std::string::npos) {
+		std::string_view userinfo = authority.substr(0, pos);
+		authority = authority.substr(pos + 1);
+		pos = userinfo.find(':');
+		if (pos != std::string::npos) {
+			user_ = userinfo.substr(0, pos);
+			pass_ = userinfo.substr(pos + 1);
+		}
+		else {
+			user_ = userinfo;
+		}
+	}
+
+	// Do we have port?
+	pos = authority.rfind(':');
+	if (pos != std::string::npos) {
+		if (authority.find_first_not_of(uri_chars::digit, pos + 1) == std::string::npos) {
+			port_ = to_integral<unsigned short>(authority.substr(pos + 1));
+			authority = authority.substr(0, pos);
+		}
+	}
+
+	if (!authority.empty() && authority[0] == '[') {
+		if (authority.back() != ']') {
+			return false;
+		}
+		if (get_address_type(authority) != address_type::ipv6) {
+			return false;
+		}
+	}
+	host_ = authority;
+	return true;
+}
+
+std::string uri_view::decoded_user() const
+{
+	return percent_decode_s(user_);
+}
+
+std::string uri_view::decoded_pass() const
+{
+	return percent_decode_s(pass_);
+}
+
+std::string uri_view::decoded_host() const
+{
+	return percent_decode_s(host_);
+}
+
+std::string uri_view::decoded_path() const
+{
+	return percent_decode_s(path_);
+}
+
+
+namespace {
+// Whether the percent-encoded string decodes to the plain one, ignoring ASCII case
+bool decodes_to_insensitive(std::string_view const& encoded, std::string_view const& plain)
+{
+	size_t j{};
+	for (size_t i = 0; i < encoded.size(); ++i, ++j) {
+		if (j == plain.size()) {
+			return false;
+		}
+		char c = encoded[i];
+		if (c == '%') {
+			if (encoded.size() - i < 3) {
+				return false;
+			}
+			int const high = hex_char_to_int(encoded[i + 1]);
+			int const low = hex_char_to_int(encoded[i + 2]);
+			if (high == -1 || low == -1) {
+				return false;
+			}
+			c = static_cast<char>((high << 4) + low);
+			i += 2;
+		}
+		if (!c || tolower_ascii(c) != tolower_ascii(plain[j])) {
+			return false;
+		}
+	}
+	return j == plain.size();
+}
+}
+
+query_string_view::query_string_view(std::string_view const& raw)
+	: raw_(raw)
+	, tokens_(raw_, '&')
+{
+}
+
+query_string_view::segment query_string_view::const_iterator::operator*() const
+{
+	segment ret;
+	std::string_view const& token = *it_;
+	size_t const pos = token.find('=');
+	ret.key_ = token.substr(0, pos);
+	if (pos != std::string_view::npos) {
+		ret.value_ = token.substr(pos + 1);
+	}
+	return ret;
+}
+
+bool query_string_view::valid() const
+{
+	for (auto const& s : *this) {
+		if (s.key_.empty() || percent_decode_s(s.key_).empty()) {
+			return false;
+		}
+		if (!s.value_.empty() && percent_decode_s(s.value_).empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool query_string_view::get(std::string_view const& key, std::string& value) const
+{
+	segment found;
+	bool has{};
+	for (auto const& s : *this) {
+		if (decodes_to_insensitive(s.key_, key)) {
+			found = s;
+			has = true;
+		}
+	}
+	if (!has) {
+		return false;
+	}
+	value = percent_decode_s(found.value_);
+	return !value.empty() || found.value_.empty();
+}
+
 }
@@ -1,12 +1,15 @@
 #include "libfilezilla/util.hpp"
 #include "libfilezilla/time.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <random>
 
 #include <time.h>
 #include <string.h>
 
+#include <nettle/chacha.h>
 #include <nettle/memops.h>
 
 #if FZ_WINDOWS
@@ -24,6 +27,7 @@
 		#include <unistd.h>
 	#endif
 	#include "libfilezilla/file.hpp"
+	#include <pthread.h>
 	#include <stdio.h>
 	#include <sys/stat.h>
 #endif
@@ -137,6 +141,143 @@ struct guaranteed_random_device
 		abort();
 	}
 };
+
+
+void wipe(void* p, size_t size)
+{
+	volatile uint8_t* v = static_cast<volatile uint8_t*>(p);
+	while (size--) {
+		*v++ = 0;
+	}
+}
+
+#if !FZ_WINDOWS
+// Incremented in the child after fork, so that the child does not repeat the parent's output
+std::atomic<unsigned int> fork_generation{};
+
+void on_fork_child()
+{
+	++fork_generation;
+}
+#endif
+
+// Per-thread ChaCha20 keystream generator, seeded from the system source.
+//
+// Uses fast key erasure: every refill of the buffer replaces the key by the first bytes of
+// the keystream, and served bytes get wiped from the buffer, so that a later compromise of
+// the state does not reveal earlier output.
+class drbg final
+{
+public:
+	drbg()
+	{
+#if !FZ_WINDOWS
+		static bool const registered = !pthread_atfork(nullptr, nullptr, &on_fork_child);
+		(void)registered;
+#endif
+	}
+
+	~drbg()
+	{
+		wipe(key_, sizeof(key_));
+		wipe(buffer_, sizeof(buffer_));
+	}
+
+	drbg(drbg const&) = delete;
+	drbg& operator=(drbg const&) = delete;
+
+	void generate(uint8_t* out, size_t size)
+	{
+#if !FZ_WINDOWS
+		unsigned int const generation = fork_generation.load(std::memory_order_relaxed);
+		if (generation != generation_) {
+			generation_ = generation;
+			reseed();
+		}
+#endif
+		while (size) {
+			if (pos_ == sizeof(buffer_)) {
+				refill();
+			}
+			size_t const chunk = std::min(size, sizeof(buffer_) - pos_);
+			memcpy(out, buffer_ + pos_, chunk);
+			wipe(buffer_ + pos_, chunk);
+			pos_ += chunk;
+			out += chunk;
+			size -= chunk;
+		}
+	}
+
+private:
+	void reseed()
+	{
+		guaranteed_random_device rd;
+		for (size_t i = 0; i < sizeof(key_); i += sizeof(guaranteed_random_device::result_type)) {
+			auto v = rd();
+			memcpy(key_ + i, &v, sizeof(v));
+		}
+		served_ = 0;
+
+		// Discard anything generated with the old key
+		wipe(buffer_, sizeof(buffer_));
+		pos_ = sizeof(buffer_);
+	}
+
+	void refill()
+	{
+		if (served_ >= reseed_interval) {
+			reseed();
+		}
+
+		chacha_ctx ctx;
+		uint8_t const nonce[CHACHA_NONCE_SIZE]{};
+		chacha_set_key(&ctx, key_);
+		chacha_set_nonce(&ctx, nonce);
+
+		// The buffer is all zeroes, served bytes got wiped
+		chacha_crypt(&ctx, sizeof(buffer_), buffer_, buffer_);
+		wipe(&ctx, sizeof(ctx));
+
+		memcpy(key_, buffer_, sizeof(key_));
+		wipe(buffer_, sizeof(key_));
+		pos_ = sizeof(key_);
+		served_ += sizeof(buffer_) - sizeof(key_);
+	}
+
+	// Amount of output after which fresh entropy is drawn from the system
+	static constexpr uint64_t reseed_interval = 1024 * 1024;
+
+	uint8_t key_[CHACHA_KEY_SIZE]{};
+	uint8_t buffer_[16 * CHACHA_BLOCK_SIZE]{};
+	size_t pos_{sizeof(buffer_)};
+
+	// Starts at the reseed interval so that the first refill seeds
+	uint64_t served_{reseed_interval};
+#if !FZ_WINDOWS
+	unsigned int generation_{};
+#endif
+};
+
+drbg& get_drbg()
+{
+	thread_local drbg rng;
+	return rng;
+}
+
+struct drbg_device
+{
+	typedef uint64_t result_type;
+
+	constexpr static result_type min() { return std::numeric_limits<result_type>::min(); }
+	constexpr static result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()()
+	{
+		result_type ret;
+		get_drbg().generate(reinterpret_cast<uint8_t*>(&ret), sizeof(ret));
+		return ret;
+	}
+};
 }
 
 int64_t random_number(int64_t min, int64_t max)
@@ -147,7 +288,7 @@ int64_t random_number(int64_t min, int64_t max)
 	}
 
 	std::uniform_int_distribution<int64_t> dist(min, max);
-	guaranteed_random_device rd;
+	drbg_device rd;
 	return dist(rd);
 }
 
@@ -165,17 +306,7 @@ void random_bytes(size_t size, uint8_t* destination)
 		return;
 	}
 
-	guaranteed_random_device rd;
-
-	size_t i;
-	for (i = 0; i + sizeof(guaranteed_random_device::result_type) <= size; i += sizeof(guaranteed_random_device::result_type)) {
-		*reinterpret_cast<guaranteed_random_device::result_type*>(destination + i) = rd();
-	}
-
-	if (i < size) {
-		auto v = rd();
-		memcpy(destination + i, &v, size - i);
-	}
+	get_drbg().generate(destination, size);
 }
 
 
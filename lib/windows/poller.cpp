@@ -1,6 +1,8 @@
 #include "poller.hpp"
 #include "../libfilezilla/mutex.hpp"
 
+#include <algorithm>
+
 namespace fz {
 
 poller::~poller()
@@ -34,15 +36,20 @@ bool poller::wait(scoped_lock & l)
 }
 
 // fds must be large enough to hold n+1 entries, but fds[n] must not be filled by caller
-bool poller::wait(pollinfo* fds, size_t n, scoped_lock& l)
+bool poller::wait(pollinfo* fds, size_t n, scoped_lock& l, duration const& timeout)
 {
+	DWORD ms = INFINITE;
+	if (timeout) {
+		ms = static_cast<DWORD>(std::max(int64_t(0), std::min(timeout.get_milliseconds(), int64_t(INFINITE - 1))));
+	}
+
 	for (size_t i = 0; i < n; ++i) {
 		WSAEventSelect(fds[i].fd_, sync_event_, fds[i].events_);
 	}
 
 	l.unlock();
 	// We intentionally ignore return code
-	DWORD res = WSAWaitForMultipleEvents(1, &sync_event_, false, INFINITE, false);
+	DWORD res = WSAWaitForMultipleEvents(1, &sync_event_, false, ms, false);
 
 	l.lock();
 	signalled_ = false;
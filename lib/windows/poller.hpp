@@ -7,6 +7,7 @@
 
 #include "../libfilezilla/glue/windows.hpp"
 #include "../libfilezilla/mutex.hpp"
+#include "../libfilezilla/time.hpp"
 #include <winsock2.h>
 
 namespace fz {
@@ -34,7 +35,8 @@ public:
 	// Must call locked
 	bool wait(scoped_lock & l);
 
-	bool wait(pollinfo* fds, size_t n, scoped_lock& l);
+	// If a timeout is given, returns true with no network events set once it expires.
+	bool wait(pollinfo* fds, size_t n, scoped_lock& l, duration const& timeout = duration());
 
 	void interrupt(scoped_lock& l);
 
@@ -0,0 +1,17 @@
+AC_DEFUN([CHECK_EPOLL],
+[
+  AC_MSG_CHECKING([for epoll])
+  AC_LINK_IFELSE([
+    AC_LANG_PROGRAM([[
+     #include <sys/epoll.h>
+     ]], [[
+       int fd = epoll_create1(EPOLL_CLOEXEC);
+       return (fd == -1) ? 1 : 0;
+    ]])
+  ], [
+    AC_MSG_RESULT([yes])
+    AC_DEFINE([HAVE_EPOLL], [1], [epoll])
+  ], [
+    AC_MSG_RESULT([no])
+  ])
+])
@@ -0,0 +1,45 @@
+# Checks for getaddrinfo_a, used by fz::hostname_lookup to resolve names asynchronously.
+# Older versions of glibc have it in libanl.
+#
+# CHECK_GETADDRINFO_A([ACTION-IF-LIBANL-NEEDED])
+#
+# Defines HAVE_GETADDRINFO_A if available. If no action is given, adds -lanl to LIBS if needed.
+
+m4_define([_CHECK_GETADDRINFO_A_testbody], [[
+  #include <netdb.h>
+  #include <signal.h>
+
+  int main() {
+    gaicb cb{};
+    gaicb* list[] = {&cb};
+    sigevent sev{};
+    sev.sigev_notify = SIGEV_NONE;
+    return getaddrinfo_a(GAI_NOWAIT, list, 1, &sev) + gai_cancel(&cb) + gai_error(&cb);
+  }
+]])
+
+AC_DEFUN([CHECK_GETADDRINFO_A], [
+
+  AC_LANG_PUSH(C++)
+
+  AC_MSG_CHECKING([for getaddrinfo_a])
+
+  AC_LINK_IFELSE([AC_LANG_SOURCE([_CHECK_GETADDRINFO_A_testbody])],[
+      AC_MSG_RESULT([yes])
+      AC_DEFINE([HAVE_GETADDRINFO_A], [1], [getaddrinfo_a])
+    ],[
+      OLDLIBS="$LIBS"
+      LIBS="$LIBS -lanl"
+      AC_LINK_IFELSE([AC_LANG_SOURCE([_CHECK_GETADDRINFO_A_testbody])],[
+          AC_MSG_RESULT([with -lanl])
+          AC_DEFINE([HAVE_GETADDRINFO_A], [1], [getaddrinfo_a])
+          LIBS="$OLDLIBS"
+          m4_default([$1], [LIBS="$LIBS -lanl"])
+        ],[
+          AC_MSG_RESULT([no])
+          LIBS="$OLDLIBS"
+        ])
+    ])
+
+  AC_LANG_POP
+])
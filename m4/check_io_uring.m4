@@ -0,0 +1,19 @@
+AC_DEFUN([CHECK_IO_URING],
+[
+  AC_MSG_CHECKING([for io_uring])
+  AC_COMPILE_IFELSE([
+    AC_LANG_PROGRAM([[
+     #include <linux/io_uring.h>
+     #include <sys/syscall.h>
+     ]], [[
+       struct io_uring_params p = {0};
+       (void)p;
+       return __NR_io_uring_setup + __NR_io_uring_enter + IORING_OP_READV + IORING_OP_WRITEV + IORING_OP_FSYNC;
+    ]])
+  ], [
+    AC_MSG_RESULT([yes])
+    AC_DEFINE([HAVE_IO_URING], [1], [io_uring])
+  ], [
+    AC_MSG_RESULT([no])
+  ])
+])
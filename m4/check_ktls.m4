@@ -0,0 +1,22 @@
+AC_DEFUN([CHECK_KTLS],
+[
+  AC_MSG_CHECKING([for kernel TLS])
+  AC_COMPILE_IFELSE([
+    AC_LANG_PROGRAM([[
+     #include <sys/types.h>
+     #include <sys/socket.h>
+     #include <netinet/in.h>
+     #include <netinet/tcp.h>
+     #include <linux/tls.h>
+     ]], [[
+       struct tls12_crypto_info_aes_gcm_128 info = {0};
+       (void)info;
+       return TCP_ULP + TLS_TX + TLS_RX + TLS_SET_RECORD_TYPE + TLS_GET_RECORD_TYPE + TLS_1_2_VERSION + TLS_1_3_VERSION + TLS_CIPHER_AES_GCM_256;
+    ]])
+  ], [
+    AC_MSG_RESULT([yes])
+    AC_DEFINE([HAVE_KTLS], [1], [Kernel TLS offload])
+  ], [
+    AC_MSG_RESULT([no])
+  ])
+])
@@ -0,0 +1,1340 @@
+#include "../lib/libfilezilla/aio/compression.hpp"
+#include "../lib/libfilezilla/aio/directory_reader.hpp"
+#include "../lib/libfilezilla/aio/encryption.hpp"
+#include "../lib/libfilezilla/aio/hashing.hpp"
+#include "../lib/libfilezilla/aio/mmap_reader.hpp"
+#include "../lib/libfilezilla/aio/parallel_reader.hpp"
+#include "../lib/libfilezilla/aio/process_io.hpp"
+#include "../lib/libfilezilla/aio/tee.hpp"
+#include "../lib/libfilezilla/aio/uring.hpp"
+#include "../lib/libfilezilla/buffer_chain.hpp"
+#include "../lib/libfilezilla/file_handle_cache.hpp"
+#include "../lib/libfilezilla/fsync_coordinator.hpp"
+#include "../lib/libfilezilla/local_filesys.hpp"
+#include "../lib/libfilezilla/logger.hpp"
+#include "../lib/libfilezilla/process.hpp"
+#include "../lib/libfilezilla/recursive_remove.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include "test_utils.hpp"
+
+#include <list>
+#include <memory>
+#include <string>
+
+#include <string.h>
+
+#ifndef FZ_WINDOWS
+#include <unistd.h>
+#endif
+
+class aio_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(aio_test);
+	CPPUNIT_TEST(test_uring);
+	CPPUNIT_TEST(test_uring_offset);
+	CPPUNIT_TEST(test_adopt_lease);
+	CPPUNIT_TEST(test_elastic_pool);
+	CPPUNIT_TEST(test_waiter_order);
+	CPPUNIT_TEST(test_pool_options);
+	CPPUNIT_TEST(test_mmap_reader);
+	CPPUNIT_TEST(test_zero_copy_readers);
+	CPPUNIT_TEST(test_direct);
+	CPPUNIT_TEST(test_file_reader_hints);
+	CPPUNIT_TEST(test_file_handle_cache);
+	CPPUNIT_TEST(test_parallel_reader);
+	CPPUNIT_TEST(test_fsync_coordinator);
+	CPPUNIT_TEST(test_sparse);
+	CPPUNIT_TEST(test_coalesce);
+	CPPUNIT_TEST(test_batch);
+	CPPUNIT_TEST(test_buffer_writer);
+	CPPUNIT_TEST(test_hashing);
+	CPPUNIT_TEST(test_compression);
+	CPPUNIT_TEST(test_encryption);
+	CPPUNIT_TEST(test_tee);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_directory_reader);
+	CPPUNIT_TEST(test_process_io);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_uring();
+	void test_uring_offset();
+	void test_adopt_lease();
+	void test_elastic_pool();
+	void test_waiter_order();
+	void test_pool_options();
+	void test_mmap_reader();
+	void test_zero_copy_readers();
+	void test_direct();
+	void test_file_reader_hints();
+	void test_file_handle_cache();
+	void test_directory_reader();
+	void test_parallel_reader();
+	void test_fsync_coordinator();
+	void test_sparse();
+	void test_coalesce();
+	void test_batch();
+	void test_buffer_writer();
+	void test_hashing();
+	void test_compression();
+	void test_encryption();
+	void test_tee();
+	void test_process_io();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(aio_test);
+
+namespace {
+class waiter final : public fz::aio_waiter
+{
+public:
+	void wait()
+	{
+		fz::scoped_lock l(m_);
+		cond_.wait(l);
+	}
+
+private:
+	virtual void on_buffer_availability(fz::aio_waitable const*) override
+	{
+		fz::scoped_lock l(m_);
+		cond_.signal(l);
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+};
+
+bool write_all(fz::writer_base & writer, fz::aio_buffer_pool & pool, std::string const& data)
+{
+	waiter w;
+	size_t pos{};
+	while (pos < data.size()) {
+		auto b = pool.get_buffer(w);
+		if (!b) {
+			w.wait();
+			continue;
+		}
+		size_t const n = std::min(data.size() - pos, b->capacity());
+		b->append(reinterpret_cast<uint8_t const*>(data.data() + pos), n);
+		pos += n;
+
+		auto r = writer.add_buffer(std::move(b), w);
+		if (r == fz::aio_result::error) {
+			return false;
+		}
+		else if (r == fz::aio_result::wait) {
+			w.wait();
+		}
+	}
+
+	for (;;) {
+		auto r = writer.finalize(w);
+		if (r == fz::aio_result::ok) {
+			return true;
+		}
+		else if (r == fz::aio_result::error) {
+			return false;
+		}
+		w.wait();
+	}
+}
+
+bool write_all(fz::writer_factory & factory, fz::aio_buffer_pool & pool, std::string const& data, uint64_t offset = 0)
+{
+	auto writer = factory.open(pool, offset, nullptr, 4);
+	return writer && write_all(*writer, pool, data);
+}
+
+bool read_all(fz::reader_base & reader, std::string & out)
+{
+	waiter w;
+	out.clear();
+	for (;;) {
+		auto [r, b] = reader.get_buffer(w);
+		if (r == fz::aio_result::error) {
+			return false;
+		}
+		else if (r == fz::aio_result::wait) {
+			w.wait();
+		}
+		else if (!b) {
+			return true;
+		}
+		else {
+			out.append(reinterpret_cast<char const*>(b->get()), b->size());
+		}
+	}
+}
+
+bool read_all(fz::reader_factory & factory, fz::aio_buffer_pool & pool, std::string & out, uint64_t offset = 0, uint64_t size = fz::aio_base::nosize)
+{
+	auto reader = factory.open(pool, offset, size, 4);
+	return reader && read_all(*reader, out);
+}
+
+std::string make_data(size_t size)
+{
+	std::string data;
+	data.reserve(size);
+	for (size_t i = 0; i < size; ++i) {
+		data += static_cast<char>('a' + (i * 7 + i / 4096) % 26);
+	}
+	return data;
+}
+}
+
+void aio_test::test_uring()
+{
+	fz::thread_pool tpool;
+	fz::uring_engine engine(tpool);
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 4096);
+
+	std::wstring const name = L"aio_test_uring.tmp";
+	std::string const data = make_data(200000);
+
+	fz::uring_file_writer_factory wf(name, engine);
+	CPPUNIT_ASSERT(write_all(wf, pool, data));
+	ASSERT_EQUAL(static_cast<uint64_t>(data.size()), wf.size());
+
+	fz::uring_file_reader_factory rf(name, engine);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	ASSERT_EQUAL(data.size(), read.size());
+	CPPUNIT_ASSERT(data == read);
+
+	// Partial range
+	CPPUNIT_ASSERT(read_all(rf, pool, read, 12345, 54321));
+	CPPUNIT_ASSERT(data.substr(12345, 54321) == read);
+
+	// Reading past the end
+	CPPUNIT_ASSERT(!read_all(rf, pool, read, 0, data.size() + 1));
+
+	// Syncing to disk when finalizing
+	fz::uring_file_writer_factory wf_sync(name, engine, fz::file_writer_flags::fsync);
+	CPPUNIT_ASSERT(write_all(wf_sync, pool, data.substr(0, 100000)));
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data.substr(0, 100000) == read);
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_uring_offset()
+{
+	fz::thread_pool tpool;
+	// Tiny ring, exercises queueing of operations that do not fit
+	fz::uring_engine engine(tpool, 2);
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 4096);
+
+	std::wstring const name = L"aio_test_uring_offset.tmp";
+	std::string const data = make_data(50000);
+
+	fz::uring_file_writer_factory wf(name, engine);
+	CPPUNIT_ASSERT(write_all(wf, pool, data.substr(0, 30000)));
+	CPPUNIT_ASSERT(write_all(wf, pool, data.substr(20000), 20000));
+
+	fz::uring_file_reader_factory rf(name, engine);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_adopt_lease()
+{
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 1, 4096);
+	waiter w;
+
+	auto lease = pool.get_buffer(w);
+	CPPUNIT_ASSERT(lease);
+	lease->append(reinterpret_cast<uint8_t const*>("hello world"), 11);
+	lease->consume(6);
+	uint8_t const* p = lease->get();
+
+	{
+		fz::buffer buf = pool.adopt(std::move(lease));
+		CPPUNIT_ASSERT(!lease);
+		CPPUNIT_ASSERT(buf.get() == p);
+		ASSERT_EQUAL(std::string("world"), std::string(buf.to_view()));
+
+		// Still owned by the buffer
+		CPPUNIT_ASSERT(!pool.get_buffer(w));
+		pool.remove_waiter(w);
+
+		// Growing beyond the lease hands the memory back to the pool
+		buf.append(std::string(5000, 'x'));
+		CPPUNIT_ASSERT(buf.get() != p);
+		ASSERT_EQUAL(size_t(5005), buf.size());
+
+		lease = pool.get_buffer(w);
+		CPPUNIT_ASSERT(lease);
+		buf = pool.adopt(std::move(lease));
+		CPPUNIT_ASSERT(buf.empty());
+	}
+
+	// Destroying the buffer releases it as well
+	lease = pool.get_buffer(w);
+	CPPUNIT_ASSERT(lease);
+}
+
+void aio_test::test_elastic_pool()
+{
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 2, 4096);
+	waiter w;
+
+	std::vector<fz::buffer_lease> leases;
+	leases.emplace_back(pool.get_buffer(w));
+	leases.emplace_back(pool.get_buffer(w));
+	CPPUNIT_ASSERT(!pool.get_buffer(w));
+	pool.remove_waiter(w);
+
+	CPPUNIT_ASSERT(pool.set_max_buffer_count(4));
+	leases.emplace_back(pool.get_buffer(w));
+	leases.emplace_back(pool.get_buffer(w));
+	CPPUNIT_ASSERT(leases[2] && leases[3]);
+	CPPUNIT_ASSERT(!pool.get_buffer(w));
+	pool.remove_waiter(w);
+
+	// Grown buffers are page-aligned like the others and usable for adoption
+	CPPUNIT_ASSERT(reinterpret_cast<uintptr_t>(leases[2]->get()) % 4096 == 0);
+	leases[3]->append(reinterpret_cast<uint8_t const*>("foo"), 3);
+	{
+		fz::buffer buf = pool.adopt(std::move(leases[3]));
+		ASSERT_EQUAL(std::string("foo"), std::string(buf.to_view()));
+	}
+
+	auto stats = pool.get_stats();
+	ASSERT_EQUAL(size_t(4), stats.buffers);
+	ASSERT_EQUAL(size_t(3), stats.leased);
+	ASSERT_EQUAL(size_t(4), stats.peak_leased);
+	ASSERT_EQUAL(uint64_t(2), stats.waits);
+
+	// The pool shrinks back once enough buffers are idle
+	leases.clear();
+	stats = pool.get_stats();
+	ASSERT_EQUAL(size_t(0), stats.leased);
+	CPPUNIT_ASSERT(stats.buffers < 4);
+	CPPUNIT_ASSERT(stats.buffers >= 2);
+
+	// Growth is subject to the global memory limit
+	fz::aio_buffer_pool::set_memory_limit(0);
+	for (size_t i = 0; i < stats.buffers; ++i) {
+		leases.emplace_back(pool.get_buffer(w));
+	}
+	CPPUNIT_ASSERT(!pool.get_buffer(w));
+	pool.remove_waiter(w);
+	ASSERT_EQUAL(uint64_t(1), pool.get_stats().limited);
+	fz::aio_buffer_pool::set_memory_limit(std::numeric_limits<uint64_t>::max());
+	leases.clear();
+
+	fz::aio_buffer_pool shm_pool(fz::get_null_logger(), 1, 4096, true);
+	CPPUNIT_ASSERT(!shm_pool.set_max_buffer_count(4));
+}
+
+namespace {
+class recording_waiter final : public fz::aio_waiter
+{
+public:
+	recording_waiter(std::vector<int> & woken, int id)
+		: woken_(woken)
+		, id_(id)
+	{}
+
+private:
+	virtual void on_buffer_availability(fz::aio_waitable const*) override
+	{
+		woken_.push_back(id_);
+	}
+
+	std::vector<int> & woken_;
+	int const id_;
+};
+}
+
+void aio_test::test_waiter_order()
+{
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 3, 4096);
+	waiter w;
+
+	std::list<fz::buffer_lease> leases;
+	for (int i = 0; i < 3; ++i) {
+		leases.emplace_back(pool.get_buffer(w));
+		CPPUNIT_ASSERT(leases.back());
+	}
+
+	std::vector<int> woken;
+	std::vector<std::unique_ptr<recording_waiter>> waiters;
+	for (int i = 0; i < 4; ++i) {
+		waiters.emplace_back(std::make_unique<recording_waiter>(woken, i));
+		CPPUNIT_ASSERT(!pool.get_buffer(*waiters.back()));
+	}
+
+	// Oldest waiter first
+	leases.pop_front();
+	CPPUNIT_ASSERT(woken == std::vector<int>({0}));
+
+	// One waiter per returned buffer
+	pool.release_leases(leases);
+	CPPUNIT_ASSERT(leases.empty());
+	CPPUNIT_ASSERT(woken == std::vector<int>({0, 1, 2}));
+	ASSERT_EQUAL(size_t(0), pool.get_stats().leased);
+
+	for (auto & rw : waiters) {
+		pool.remove_waiter(*rw);
+	}
+}
+
+void aio_test::test_pool_options()
+{
+	// Falls back to regular pages if huge pages or NUMA are not available
+	for (auto huge : {fz::aio_huge_pages::none, fz::aio_huge_pages::transparent, fz::aio_huge_pages::hugetlb}) {
+		for (auto numa : {fz::aio_numa_policy::none, fz::aio_numa_policy::bind, fz::aio_numa_policy::interleave}) {
+			for (bool shm : {false, true}) {
+				fz::aio_buffer_pool_options options;
+				options.buffer_count = 3;
+				options.buffer_size = 100000;
+				options.use_shm = shm;
+				options.huge_pages = huge;
+				options.numa_policy = numa;
+				if (numa == fz::aio_numa_policy::bind) {
+					options.numa_nodes.push_back(0);
+				}
+
+				fz::aio_buffer_pool pool(fz::get_null_logger(), options);
+				CPPUNIT_ASSERT(pool);
+				ASSERT_EQUAL(size_t(3), pool.buffer_count());
+
+				waiter w;
+				auto lease = pool.get_buffer(w);
+				CPPUNIT_ASSERT(lease);
+				memset(lease->get(100000), 'x', 100000);
+				lease->add(100000);
+				ASSERT_EQUAL(size_t(100000), lease->size());
+
+				auto const info = pool.shared_memory_info();
+				CPPUNIT_ASSERT((std::get<0>(info) != fz::aio_buffer_pool::shm_handle_default) == shm);
+			}
+		}
+	}
+}
+
+void aio_test::test_mmap_reader()
+{
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 1, 4096);
+	fz::mmap_cache cache(1);
+
+	std::wstring const name = L"aio_test_mmap.tmp";
+	std::string const data = make_data(300000);
+	{
+		fz::file f(fz::to_native(name), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write(data.data(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size()));
+	}
+
+	fz::mmap_reader_factory rf(name, cache, 65536);
+	ASSERT_EQUAL(static_cast<uint64_t>(data.size()), rf.size());
+
+	// Buffers come straight from the mapping, the pool does not need any
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+	ASSERT_EQUAL(size_t(1), cache.size());
+
+	CPPUNIT_ASSERT(read_all(rf, pool, read, 12345, 54321));
+	CPPUNIT_ASSERT(data.substr(12345, 54321) == read);
+	CPPUNIT_ASSERT(!read_all(rf, pool, read, 0, data.size() + 1));
+
+	// Leases keep the mapping alive beyond the reader and the cache entry
+	waiter w;
+	fz::buffer_lease lease;
+	{
+		auto reader = rf.open(pool, 100);
+		CPPUNIT_ASSERT(reader);
+		auto r = reader->get_buffer(w);
+		CPPUNIT_ASSERT(r.first == fz::aio_result::ok);
+		lease = std::move(r.second);
+		CPPUNIT_ASSERT(reader->rewind());
+	}
+	cache.clear();
+	ASSERT_EQUAL(size_t(65536), lease->size());
+	CPPUNIT_ASSERT(!memcmp(lease->get(), data.data() + 100, lease->size()));
+	lease.release();
+
+	// Modified files are mapped anew
+	std::string const data2 = make_data(1000) + "modified";
+	{
+		fz::file f(fz::to_native(name), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write(data2.data(), static_cast<int64_t>(data2.size())) == static_cast<int64_t>(data2.size()));
+	}
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data2 == read);
+
+	// Nonexistent files cannot be mapped
+	fz::mmap_reader_factory rf2(name + L"2", cache);
+	CPPUNIT_ASSERT(!rf2.open(pool));
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_zero_copy_readers()
+{
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 1, 4096);
+	std::string const data = make_data(10000);
+
+	// The buffers point into the data, the pool is not used
+	fz::view_reader_factory vf(L"view", data, true);
+	waiter w;
+	auto held = pool.get_buffer(w);
+	CPPUNIT_ASSERT(held);
+
+	auto reader = vf.open(pool, 100);
+	CPPUNIT_ASSERT(reader);
+	auto r = reader->get_buffer(w);
+	CPPUNIT_ASSERT(r.first == fz::aio_result::ok);
+	CPPUNIT_ASSERT(r.second->get() == reinterpret_cast<uint8_t const*>(data.data()) + 100);
+	ASSERT_EQUAL(size_t(4096), r.second->size());
+	r.second.release();
+	reader.reset();
+
+	std::string read;
+	CPPUNIT_ASSERT(read_all(vf, pool, read, 1000, 5000));
+	CPPUNIT_ASSERT(data.substr(1000, 5000) == read);
+
+	// Leases keep the string alive beyond the reader
+	fz::string_reader_factory sf(L"string", data, true);
+	fz::buffer_lease lease;
+	{
+		reader = sf.open(pool, 200);
+		CPPUNIT_ASSERT(reader);
+		r = reader->get_buffer(w);
+		CPPUNIT_ASSERT(r.first == fz::aio_result::ok);
+		lease = std::move(r.second);
+		reader.reset();
+	}
+	ASSERT_EQUAL(size_t(4096), lease->size());
+	CPPUNIT_ASSERT(!memcmp(lease->get(), data.data() + 200, lease->size()));
+	lease.release();
+
+	CPPUNIT_ASSERT(read_all(sf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	// Without zero_copy, the pool's buffer is needed
+	fz::string_reader_factory copying(L"string", data);
+	reader = copying.open(pool);
+	CPPUNIT_ASSERT(reader->get_buffer(w).first == fz::aio_result::wait);
+	reader.reset();
+}
+
+void aio_test::test_direct()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 16384);
+
+	std::wstring const name = L"aio_test_direct.tmp";
+	std::string const data = make_data(200003);
+
+	// Unaligned size, followed by a resumed write at an unaligned offset
+	fz::file_writer_factory wf(name, tpool, fz::file_writer_flags::direct);
+	CPPUNIT_ASSERT(write_all(wf, pool, data.substr(0, 70001)));
+	ASSERT_EQUAL(static_cast<uint64_t>(70001), wf.size());
+	CPPUNIT_ASSERT(write_all(wf, pool, data.substr(5000), 5000));
+	ASSERT_EQUAL(static_cast<uint64_t>(data.size()), wf.size());
+
+	fz::file_reader_factory rf(name, tpool, fz::file_reader_flags::direct);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	CPPUNIT_ASSERT(read_all(rf, pool, read, 12345, 54321));
+	CPPUNIT_ASSERT(data.substr(12345, 54321) == read);
+	CPPUNIT_ASSERT(read_all(rf, pool, read, 8192, data.size() - 8192));
+	CPPUNIT_ASSERT(data.substr(8192) == read);
+	CPPUNIT_ASSERT(!read_all(rf, pool, read, 0, data.size() + 1));
+
+	// Regular readers see the same data
+	fz::file_reader_factory rf2(name, tpool);
+	CPPUNIT_ASSERT(read_all(rf2, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_file_reader_hints()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 16384);
+
+	std::wstring const name = L"aio_test_hints.tmp";
+	std::string const data = make_data(3 * 1024 * 1024 + 17);
+	{
+		fz::file f(fz::to_native(name), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write(data.data(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size()));
+	}
+
+	// Hints never affect the data
+	fz::file_reader_factory rf(name, tpool, fz::file_reader_flags::drop_behind);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	CPPUNIT_ASSERT(read_all(rf, pool, read, 1000000, 1500000));
+	CPPUNIT_ASSERT(data.substr(1000000, 1500000) == read);
+
+	waiter w;
+	auto reader = rf.open(pool, 0, fz::aio_base::nosize, 4);
+	CPPUNIT_ASSERT(reader);
+	CPPUNIT_ASSERT(reader->seek(2000000));
+	read.clear();
+	for (;;) {
+		auto [r, b] = reader->get_buffer(w);
+		CPPUNIT_ASSERT(r != fz::aio_result::error);
+		if (r == fz::aio_result::wait) {
+			w.wait();
+		}
+		else if (!b) {
+			break;
+		}
+		else {
+			read.append(reinterpret_cast<char const*>(b->get()), b->size());
+		}
+	}
+	CPPUNIT_ASSERT(data.substr(2000000) == read);
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_file_handle_cache()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 4096);
+
+	std::wstring const name = L"aio_test_handle_cache.tmp";
+	std::wstring const name2 = L"aio_test_handle_cache2.tmp";
+	std::string const data = make_data(100003);
+	for (auto const& n : {name, name2}) {
+		fz::file f(fz::to_native(n), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write(data.data(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size()));
+	}
+
+	fz::file_handle_cache cache(1);
+
+	auto h = cache.open(fz::to_native(name));
+	CPPUNIT_ASSERT(h && *h);
+	CPPUNIT_ASSERT(h == cache.open(fz::to_native(name)));
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), cache.hits());
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), cache.misses());
+
+	// Concurrent readers share the handle
+	fz::file_reader_factory rf(name, tpool, {}, &cache);
+	auto r1 = rf.open(pool, 0, fz::aio_base::nosize, 2);
+	auto r2 = rf.clone()->open(pool, 50000, fz::aio_base::nosize, 2);
+	CPPUNIT_ASSERT(r1 && r2);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(3), cache.hits());
+	std::string read1, read2;
+	CPPUNIT_ASSERT(read_all(*r1, read1));
+	CPPUNIT_ASSERT(read_all(*r2, read2));
+	CPPUNIT_ASSERT(data == read1);
+	CPPUNIT_ASSERT(data.substr(50000) == read2);
+	r1.reset();
+	r2.reset();
+
+	// Modifications are noticed
+	{
+		fz::file f(fz::to_native(name), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write("changed", 7) == 7);
+	}
+	auto h2 = cache.open(fz::to_native(name));
+	CPPUNIT_ASSERT(h2 && h2 != h);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT_EQUAL(std::string("changed"), read);
+
+	// The least recently used handle gets evicted
+	CPPUNIT_ASSERT(cache.open(fz::to_native(name2)));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), cache.size());
+	CPPUNIT_ASSERT(h2 != cache.open(fz::to_native(name)));
+
+	fz::remove_file(fz::to_native(name));
+	CPPUNIT_ASSERT(!cache.open(fz::to_native(name)));
+	CPPUNIT_ASSERT_EQUAL(size_t(0), cache.size());
+
+	cache.clear();
+	fz::remove_file(fz::to_native(name2));
+}
+
+void aio_test::test_directory_reader()
+{
+#ifndef FZ_WINDOWS
+	fz::thread_pool tpool;
+
+	char cwd[4096];
+	CPPUNIT_ASSERT(getcwd(cwd, sizeof(cwd)));
+	fz::native_string const dir = fz::native_string(cwd) + "/aio_test_dir.tmp";
+	CPPUNIT_ASSERT(fz::mkdir(dir, false));
+	size_t const count = 2500;
+	for (size_t i = 0; i < count; ++i) {
+		fz::file f(dir + fz::local_filesys::path_separator + fz::to_native(fz::to_string(i)), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+	}
+
+	{
+		// Small batches, so that reading has to pause for the consumer
+		fz::directory_reader reader(tpool, dir, fz::dir_entry_fields::type, false, true, 2, 100);
+		waiter w;
+		std::vector<fz::local_filesys::dir_entry> entries;
+		std::vector<bool> seen(count);
+		size_t total{};
+		while (true) {
+			auto r = reader.get_entries(entries, w);
+			CPPUNIT_ASSERT(r != fz::aio_result::error);
+			if (r == fz::aio_result::wait) {
+				w.wait();
+				continue;
+			}
+			if (entries.empty()) {
+				break;
+			}
+			CPPUNIT_ASSERT(entries.size() <= 100);
+			for (auto const& e : entries) {
+				CPPUNIT_ASSERT(e.t == fz::local_filesys::file);
+				size_t const i = fz::to_integral<size_t>(e.name, count);
+				CPPUNIT_ASSERT(i < count && !seen[i]);
+				seen[i] = true;
+				++total;
+			}
+		}
+		CPPUNIT_ASSERT_EQUAL(count, total);
+		CPPUNIT_ASSERT(reader.error());
+	}
+
+	{
+		// Stopping before the end
+		fz::directory_reader reader(tpool, dir, fz::dir_entry_fields::type, false, true, 1, 10);
+	}
+
+	{
+		fz::directory_reader reader(tpool, fz::to_native("aio_test_dir_missing.tmp"));
+		waiter w;
+		std::vector<fz::local_filesys::dir_entry> entries;
+		auto r = reader.get_entries(entries, w);
+		if (r == fz::aio_result::wait) {
+			w.wait();
+			r = reader.get_entries(entries, w);
+		}
+		CPPUNIT_ASSERT(r == fz::aio_result::error);
+		CPPUNIT_ASSERT(!reader.error());
+	}
+
+	fz::recursive_remove rr;
+	rr.remove(dir);
+#endif
+}
+
+void aio_test::test_parallel_reader()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 4096);
+
+	std::wstring const name = L"aio_test_parallel.tmp";
+	std::string const data = make_data(1000003);
+	{
+		fz::file f(fz::to_native(name), fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write(data.data(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size()));
+	}
+
+	// Blocks arrive in order despite being read concurrently
+	fz::parallel_file_reader_factory rf(name, tpool, 4);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	CPPUNIT_ASSERT(read_all(rf, pool, read, 12345, 543210));
+	CPPUNIT_ASSERT(data.substr(12345, 543210) == read);
+
+	CPPUNIT_ASSERT(read_all(rf, pool, read, data.size()));
+	CPPUNIT_ASSERT(read.empty());
+
+	CPPUNIT_ASSERT(!read_all(rf, pool, read, 0, data.size() + 1));
+
+	// More threads than buffers
+	fz::parallel_file_reader_factory rf2(name, tpool, 16);
+	CPPUNIT_ASSERT(read_all(rf2, pool, read, 100));
+	CPPUNIT_ASSERT(data.substr(100) == read);
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_fsync_coordinator()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 16, 4096);
+	fz::fsync_coordinator coordinator(fz::duration::from_milliseconds(500));
+
+	size_t const count = 4;
+	std::string const data = make_data(10000);
+
+	std::vector<fz::async_task> tasks;
+	std::vector<int> results(count);
+	for (size_t i = 0; i < count; ++i) {
+		tasks.emplace_back(tpool.spawn([&, i] {
+			fz::file_writer_factory wf(L"aio_test_fsync" + std::to_wstring(i) + L".tmp", tpool, fz::file_writer_flags::fsync, &coordinator);
+			results[i] = write_all(wf, pool, data) ? 1 : 0;
+		}));
+	}
+	for (auto & t : tasks) {
+		t.join();
+	}
+
+	auto const stats = coordinator.get_stats();
+	ASSERT_EQUAL(uint64_t(count), stats.requests);
+
+	// Concurrent writers share batches
+	CPPUNIT_ASSERT(stats.batches < count);
+	CPPUNIT_ASSERT(stats.flushes <= count);
+
+	fz::file_reader_factory rf(L"aio_test_fsync0.tmp", tpool);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	for (size_t i = 0; i < count; ++i) {
+		CPPUNIT_ASSERT(results[i]);
+		fz::remove_file(fz::to_native(L"aio_test_fsync" + std::to_wstring(i) + L".tmp"));
+	}
+}
+
+void aio_test::test_sparse()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 65536);
+
+	std::wstring const name = L"aio_test_sparse.tmp";
+
+	// Data, a large run of zeros, data, and trailing zeros
+	std::string data = make_data(5000);
+	data += std::string(300000, '\0');
+	data += make_data(10000);
+	data += std::string(200000, '\0');
+
+	fz::file_writer_factory wf(name, tpool, fz::file_writer_flags::sparse);
+	CPPUNIT_ASSERT(write_all(wf, pool, data));
+	ASSERT_EQUAL(static_cast<uint64_t>(data.size()), wf.size());
+
+	fz::file_reader_factory rf(name, tpool);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	fz::file_reader_factory srf(name, tpool, fz::file_reader_flags::sparse);
+	CPPUNIT_ASSERT(read_all(srf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	CPPUNIT_ASSERT(read_all(srf, pool, read, 4000, 320000));
+	CPPUNIT_ASSERT(data.substr(4000, 320000) == read);
+
+	{
+		// Whether holes get reported depends on the file system, but the data must be found
+		fz::file f(fz::to_native(name), fz::file::reading);
+		int64_t const hole = f.next_hole(0);
+		CPPUNIT_ASSERT(hole >= 5000);
+		int64_t const next = f.next_data(hole);
+		CPPUNIT_ASSERT(next == -1 || next <= 305000);
+	}
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_coalesce()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 256 * 1024);
+
+	std::wstring const name = L"aio_test_coalesce.tmp";
+	std::string const data = make_data(3 * 1024 * 1024);
+
+	uint64_t progress{};
+	fz::file_writer_factory wf(name, tpool, fz::file_writer_flags::coalesce);
+	auto writer = wf.open(pool, 0, [&progress](fz::writer_base const*, uint64_t written) { progress += written; }, 4);
+	CPPUNIT_ASSERT(writer);
+
+	waiter w;
+	auto add = [&](size_t pos, size_t n) {
+		for (;;) {
+			auto b = pool.get_buffer(w);
+			if (!b) {
+				w.wait();
+				continue;
+			}
+			b->append(reinterpret_cast<uint8_t const*>(data.data() + pos), n);
+			auto r = writer->add_buffer(std::move(b), w);
+			if (r == fz::aio_result::wait) {
+				w.wait();
+			}
+			return r != fz::aio_result::error;
+		}
+	};
+
+	// Buffers of varying small sizes, now and then a large one
+	size_t pos{};
+	for (size_t i = 0; pos < data.size(); ++i) {
+		size_t const n = std::min(data.size() - pos, (i % 50 == 49) ? size_t(200000) : 100 + (i * 7919) % 3000);
+		CPPUNIT_ASSERT(add(pos, n));
+		pos += n;
+		if (i == 10) {
+			// Small amounts still get written soon
+			fz::sleep(fz::duration::from_milliseconds(500));
+			int64_t const size = fz::local_filesys::get_size(fz::to_native(name));
+			CPPUNIT_ASSERT(size > 0 && static_cast<size_t>(size) <= pos);
+		}
+	}
+
+	for (;;) {
+		auto r = writer->finalize(w);
+		if (r == fz::aio_result::ok) {
+			break;
+		}
+		CPPUNIT_ASSERT(r != fz::aio_result::error);
+		w.wait();
+	}
+	writer.reset();
+	ASSERT_EQUAL(static_cast<uint64_t>(data.size()), progress);
+
+	fz::file_reader_factory rf(name, tpool);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_batch()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 16, 65536);
+
+	std::wstring const in = L"aio_test_batch_in.tmp";
+	std::wstring const out = L"aio_test_batch_out.tmp";
+	std::string const data = make_data(1000000);
+
+	{
+		fz::file_writer_factory wf(in, tpool);
+		auto writer = wf.open(pool, 0, nullptr, 4);
+		CPPUNIT_ASSERT(writer);
+		CPPUNIT_ASSERT(write_all(*writer, pool, data));
+	}
+
+	{
+		fz::file_reader_factory rf(in, tpool);
+		auto reader = rf.open(pool, 0, fz::aio_base::nosize, 8);
+		CPPUNIT_ASSERT(reader);
+		fz::file_writer_factory wf(out, tpool);
+		auto writer = wf.open(pool, 0, nullptr, 4);
+		CPPUNIT_ASSERT(writer);
+
+		waiter w;
+		std::vector<fz::buffer_lease> buffers;
+		bool eof{};
+		while (!eof || !buffers.empty()) {
+			if (!eof && buffers.empty()) {
+				auto r = reader->get_buffers(buffers, 3, w);
+				CPPUNIT_ASSERT(r != fz::aio_result::error);
+				CPPUNIT_ASSERT(buffers.size() <= 3);
+				if (r == fz::aio_result::wait) {
+					CPPUNIT_ASSERT(buffers.empty());
+					w.wait();
+					continue;
+				}
+				eof = buffers.empty();
+			}
+			if (!buffers.empty()) {
+				auto r = writer->add_buffers(buffers, w);
+				CPPUNIT_ASSERT(r != fz::aio_result::error);
+				if (r == fz::aio_result::wait) {
+					w.wait();
+				}
+				else {
+					CPPUNIT_ASSERT(buffers.empty());
+				}
+			}
+		}
+
+		for (;;) {
+			auto r = writer->finalize(w);
+			if (r == fz::aio_result::ok) {
+				break;
+			}
+			CPPUNIT_ASSERT(r != fz::aio_result::error);
+			w.wait();
+		}
+	}
+
+	fz::file_reader_factory rf(out, tpool);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	fz::remove_file(fz::to_native(in));
+	fz::remove_file(fz::to_native(out));
+}
+
+void aio_test::test_buffer_writer()
+{
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 65536);
+	std::string const data = make_data(1000000);
+
+	{
+		// With a size hint, the buffer is reserved once
+		fz::buffer out;
+		fz::buffer_writer_factory f(out, L"out", data.size(), data.size());
+		auto writer = f.open(pool, 0);
+		CPPUNIT_ASSERT(writer);
+		CPPUNIT_ASSERT(out.capacity() >= data.size());
+		unsigned char const* const start = out.get();
+		CPPUNIT_ASSERT(write_all(*writer, pool, data));
+		CPPUNIT_ASSERT(out.get() == start);
+		CPPUNIT_ASSERT(out.to_view() == data);
+	}
+
+	{
+		fz::buffer out;
+		fz::buffer_writer writer(out, L"out", pool, data.size());
+		CPPUNIT_ASSERT(writer.preallocate(data.size() + 1) == fz::aio_result::error);
+		CPPUNIT_ASSERT(writer.preallocate(data.size()) == fz::aio_result::ok);
+		CPPUNIT_ASSERT(out.capacity() >= data.size());
+	}
+
+	{
+		fz::buffer_chain out;
+		fz::buffer_writer_factory f(out, L"out", data.size());
+		auto writer = f.open(pool, 0);
+		CPPUNIT_ASSERT(writer);
+		CPPUNIT_ASSERT(write_all(*writer, pool, data));
+		CPPUNIT_ASSERT(out.segments() > 1);
+		CPPUNIT_ASSERT(out.flatten().to_view() == data);
+	}
+
+	{
+		// Exceeding the limit fails
+		fz::buffer_chain out;
+		fz::buffer_writer writer(out, L"out", pool, data.size() - 1);
+		CPPUNIT_ASSERT(!write_all(writer, pool, data));
+	}
+}
+
+void aio_test::test_hashing()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 65536);
+
+	std::wstring const name = L"aio_test_hashing.tmp";
+	std::string const data = make_data(300000);
+
+	std::vector<fz::hash_algorithm> const algorithms{fz::hash_algorithm::sha256, fz::hash_algorithm::md5, fz::hash_algorithm::crc32c};
+
+	{
+		fz::file_writer_factory wf(name, tpool);
+		fz::hashing_writer writer(name, pool, wf.open(pool, 0, nullptr, 4), algorithms);
+		CPPUNIT_ASSERT(writer.digest().empty());
+		CPPUNIT_ASSERT(write_all(writer, pool, data));
+		CPPUNIT_ASSERT(writer.digest(0) == fz::sha256(data));
+		CPPUNIT_ASSERT(writer.digest(1) == fz::md5(data));
+		CPPUNIT_ASSERT(writer.digest(2) == (fz::hash_accumulator(fz::hash_algorithm::crc32c) << data).digest());
+		CPPUNIT_ASSERT(writer.digest(3).empty());
+	}
+
+	fz::file_reader_factory rf(name, tpool);
+	{
+		fz::hashing_reader reader(pool, rf.open(pool, 0, fz::aio_base::nosize, 4), algorithms);
+		ASSERT_EQUAL(static_cast<uint64_t>(data.size()), reader.size());
+
+		std::string read;
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(data == read);
+		CPPUNIT_ASSERT(reader.digest(0) == fz::sha256(data));
+		CPPUNIT_ASSERT(reader.digest(1) == fz::md5(data));
+
+		// Seeking restarts hashing
+		CPPUNIT_ASSERT(reader.seek(1000, 5000));
+		CPPUNIT_ASSERT(reader.digest().empty());
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(data.substr(1000, 5000) == read);
+		CPPUNIT_ASSERT(reader.digest() == fz::sha256(data.substr(1000, 5000)));
+	}
+
+	{
+		fz::hashing_reader reader(pool, rf.open(pool, 100, fz::aio_base::nosize, 4), algorithms, 100);
+		std::string read;
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(reader.digest() == fz::sha256(data.substr(100)));
+
+		CPPUNIT_ASSERT(reader.rewind());
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(reader.digest() == fz::sha256(data.substr(100)));
+	}
+
+	fz::remove_file(fz::to_native(name));
+
+	// Two ranges of a file read concurrently into the same tree hash
+	std::string const large = make_data(3 * fz::tree_hash_accumulator::chunk_size + 1000);
+	{
+		fz::file_writer_factory wf(name, tpool);
+		CPPUNIT_ASSERT(write_all(wf, pool, large));
+	}
+	{
+		uint64_t const split = 2 * fz::tree_hash_accumulator::chunk_size;
+		fz::tree_hash_accumulator acc;
+		fz::tree_hashing_reader first(pool, rf.open(pool, 0, split, 2), acc);
+		fz::tree_hashing_reader second(pool, rf.open(pool, split, fz::aio_base::nosize, 2), acc, split);
+
+		std::string read1, read2;
+		bool ok2{};
+		auto task = tpool.spawn([&] { ok2 = read_all(second, read2); });
+		CPPUNIT_ASSERT(read_all(first, read1));
+		task.join();
+		CPPUNIT_ASSERT(ok2);
+		CPPUNIT_ASSERT(read1 + read2 == large);
+		CPPUNIT_ASSERT(acc.digest() == fz::tree_hash(large));
+	}
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_compression()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 16384);
+
+	std::wstring const name = L"aio_test_compression.tmp";
+	std::string const data = make_data(500000);
+
+	// Compress while reading
+	std::string compressed;
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, data);
+		fz::compression_reader reader(pool, std::move(source), tpool, fz::compression_mode::compress);
+		CPPUNIT_ASSERT(read_all(reader, compressed));
+	}
+	CPPUNIT_ASSERT(!compressed.empty());
+	CPPUNIT_ASSERT(compressed.size() < data.size() / 4);
+
+	// Decompress while reading
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, compressed);
+		fz::compression_reader reader(pool, std::move(source), tpool, fz::compression_mode::decompress);
+		std::string read;
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(data == read);
+	}
+
+	// Compress while writing to a file, then decompress while writing to memory
+	{
+		fz::file_writer_factory wf(name, tpool);
+		fz::compression_writer writer(name, pool, wf.open(pool, 0, nullptr, 2), tpool, fz::compression_mode::compress, 9);
+		CPPUNIT_ASSERT(write_all(writer, pool, data));
+	}
+	{
+		fz::file_reader_factory rf(name, tpool);
+		std::string read;
+		CPPUNIT_ASSERT(read_all(rf, pool, read));
+		CPPUNIT_ASSERT(read.size() < data.size() / 4);
+
+
+		fz::buffer out;
+		fz::compression_writer writer(name, pool, std::make_unique<fz::buffer_writer>(out, L"out", pool, data.size()), tpool, fz::compression_mode::decompress);
+		CPPUNIT_ASSERT(write_all(writer, pool, read));
+		CPPUNIT_ASSERT(out.to_view() == data);
+	}
+
+	// Truncated and corrupt input
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, compressed.substr(0, compressed.size() / 2));
+		fz::compression_reader reader(pool, std::move(source), tpool, fz::compression_mode::decompress);
+		std::string read;
+		CPPUNIT_ASSERT(!read_all(reader, read));
+	}
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, data);
+		fz::compression_reader reader(pool, std::move(source), tpool, fz::compression_mode::decompress);
+		std::string read;
+		CPPUNIT_ASSERT(!read_all(reader, read));
+	}
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_encryption()
+{
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 8, 16384);
+
+	auto const key = fz::symmetric_key::generate();
+	std::wstring const name = L"aio_test_encryption.tmp";
+	std::string const data = make_data(500000);
+
+	// Encrypt while reading
+	std::string cipher;
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, data);
+		fz::encryption_reader reader(pool, std::move(source), tpool, key, fz::encryption_mode::encrypt);
+		CPPUNIT_ASSERT(read_all(reader, cipher));
+	}
+	CPPUNIT_ASSERT_EQUAL(fz::stream_encryptor::encrypted_size(data.size()), static_cast<uint64_t>(cipher.size()));
+
+	// Decrypt while reading
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, cipher);
+		fz::encryption_reader reader(pool, std::move(source), tpool, key, fz::encryption_mode::decrypt);
+		std::string read;
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(data == read);
+	}
+
+	// Encrypt while writing to a file, then decrypt while writing to memory
+	{
+		fz::file_writer_factory wf(name, tpool);
+		fz::encryption_writer writer(name, pool, wf.open(pool, 0, nullptr, 2), tpool, key, fz::encryption_mode::encrypt);
+		CPPUNIT_ASSERT(write_all(writer, pool, data));
+	}
+	{
+		fz::file_reader_factory rf(name, tpool);
+		std::string read;
+		CPPUNIT_ASSERT(read_all(rf, pool, read));
+		CPPUNIT_ASSERT_EQUAL(cipher.size(), read.size());
+
+		fz::buffer out;
+		fz::encryption_writer writer(name, pool, std::make_unique<fz::buffer_writer>(out, L"out", pool, data.size()), tpool, key, fz::encryption_mode::decrypt);
+		CPPUNIT_ASSERT(write_all(writer, pool, read));
+		CPPUNIT_ASSERT(out.to_view() == data);
+	}
+
+	// Truncated and modified input, wrong key
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, cipher.substr(0, cipher.size() - 100));
+		fz::encryption_reader reader(pool, std::move(source), tpool, key, fz::encryption_mode::decrypt);
+		std::string read;
+		CPPUNIT_ASSERT(!read_all(reader, read));
+	}
+	{
+		std::string modified = cipher;
+		modified[100000] ^= 0x80;
+		fz::buffer out;
+		fz::encryption_writer writer(name, pool, std::make_unique<fz::buffer_writer>(out, L"out", pool, data.size()), tpool, key, fz::encryption_mode::decrypt);
+		CPPUNIT_ASSERT(!write_all(writer, pool, modified));
+	}
+	{
+		auto source = std::make_unique<fz::string_reader>(L"source", pool, cipher);
+		fz::encryption_reader reader(pool, std::move(source), tpool, fz::symmetric_key::generate(), fz::encryption_mode::decrypt);
+		std::string read;
+		CPPUNIT_ASSERT(!read_all(reader, read));
+	}
+
+	fz::remove_file(fz::to_native(name));
+}
+
+void aio_test::test_tee()
+{
+	fz::thread_pool tpool;
+
+	// The writers share the buffers, a small pool suffices
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 2, 16384);
+
+	std::wstring const name1 = L"aio_test_tee1.tmp";
+	std::wstring const name2 = L"aio_test_tee2.tmp";
+	std::string const data = make_data(400000);
+
+	fz::buffer out;
+	fz::buffer small;
+
+	fz::file_writer_factory wf1(name1, tpool);
+	fz::file_writer_factory wf2(name2, tpool);
+
+	std::vector<std::unique_ptr<fz::writer_base>> writers;
+	writers.emplace_back(wf1.open(pool, 0, nullptr, 4));
+	writers.emplace_back(std::make_unique<fz::buffer_writer>(small, L"small", pool, 1000));
+	writers.emplace_back(std::make_unique<fz::buffer_writer>(out, L"out", pool, data.size()));
+	writers.emplace_back(wf2.open(pool, 0, nullptr, 1));
+
+	{
+		fz::tee t(tpool, std::make_unique<fz::string_reader>(L"source", pool, data), std::move(writers));
+		for (int i = 0; i < 1000 && !t.done(); ++i) {
+			fz::sleep(fz::duration::from_milliseconds(10));
+		}
+		CPPUNIT_ASSERT(t.done());
+
+		// The failing writer does not affect the others
+		auto const results = t.results();
+		ASSERT_EQUAL(size_t(4), results.size());
+		CPPUNIT_ASSERT(results[0] == fz::aio_result::ok);
+		CPPUNIT_ASSERT(results[1] == fz::aio_result::error);
+		CPPUNIT_ASSERT(results[2] == fz::aio_result::ok);
+		CPPUNIT_ASSERT(results[3] == fz::aio_result::ok);
+	}
+
+	CPPUNIT_ASSERT(out.to_view() == data);
+
+	fz::file_reader_factory rf1(name1, tpool);
+	fz::file_reader_factory rf2(name2, tpool);
+	std::string read;
+	CPPUNIT_ASSERT(read_all(rf1, pool, read));
+	CPPUNIT_ASSERT(data == read);
+	CPPUNIT_ASSERT(read_all(rf2, pool, read));
+	CPPUNIT_ASSERT(data == read);
+
+	fz::remove_file(fz::to_native(name1));
+	fz::remove_file(fz::to_native(name2));
+}
+
+void aio_test::test_process_io()
+{
+#ifndef FZ_WINDOWS
+	// Built alongside the tests
+	fz::native_string const helper = fz::to_native(L"./aio_peer");
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(helper) == fz::local_filesys::file);
+
+	fz::thread_pool tpool;
+	fz::aio_buffer_pool pool(fz::get_null_logger(), 4, 16384, true);
+	auto const [shm, base, size] = pool.shared_memory_info();
+	CPPUNIT_ASSERT(shm != fz::aio_buffer_pool::shm_handle_default);
+
+	std::wstring const name = L"aio_test_process.tmp";
+	std::string const data = make_data(300000);
+
+	auto args = [&](char const* mode) {
+		return std::vector<fz::native_string>{fz::to_native(fz::to_wstring(shm)), fz::to_native(fz::to_wstring(size)), fz::to_native(name), mode};
+	};
+
+	// The child writes the data to the file
+	{
+		fz::process p;
+		CPPUNIT_ASSERT(p.spawn(helper, args("write"), {shm}));
+		fz::process_writer writer(name, pool, p, tpool);
+		CPPUNIT_ASSERT(write_all(writer, pool, data));
+	}
+
+	// The child reads the file
+	{
+		fz::process p;
+		CPPUNIT_ASSERT(p.spawn(helper, args("read"), {shm}));
+		fz::process_reader reader(name, pool, p, tpool);
+		std::string read;
+		CPPUNIT_ASSERT(read_all(reader, read));
+		CPPUNIT_ASSERT(data == read);
+	}
+
+	// Buffers not in shared memory are refused
+	{
+		fz::aio_buffer_pool local_pool(fz::get_null_logger(), 1, 16384);
+		fz::process p;
+		CPPUNIT_ASSERT(p.spawn(helper, args("write"), {shm}));
+		fz::process_writer writer(name, pool, p, tpool);
+		CPPUNIT_ASSERT(!write_all(writer, local_pool, data));
+	}
+
+	fz::remove_file(fz::to_native(name));
+#endif
+}
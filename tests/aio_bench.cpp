@@ -0,0 +1,448 @@
+#include "../lib/libfilezilla/aio/mmap_reader.hpp"
+#include "../lib/libfilezilla/aio/uring.hpp"
+#include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/file.hpp"
+#include "../lib/libfilezilla/local_filesys.hpp"
+#include "../lib/libfilezilla/logger.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#ifdef FZ_WINDOWS
+#include "../lib/libfilezilla/glue/windows.hpp"
+#else
+#include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Transfers data from a reader to a writer through an aio_buffer_pool.
+//
+// Each pipeline is driven by its own thread, handing the buffers obtained from the
+// reader straight to the writer. Reported are the throughput, the time it takes to
+// get each buffer from the reader, and how often the driving threads got woken up.
+//
+// Usage: aio_bench [--reader=file|direct|mmap|uring|view|string|view-zc|string-zc|all] [--writer=file|direct|uring|buffer|none|all]
+//                  [--size=bytes] [--pipelines=N] [--buffers=N] [--buffer-size=bytes] [--max-buffers=N]
+//
+// --buffers is the size of the pool, by default enough for all pipelines.
+// --max-buffers is passed to the readers and writers, 0 uses their preferred count.
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct options
+{
+	std::string reader{"all"};
+	std::string writer{"none"};
+	uint64_t size{256 * 1024 * 1024};
+	size_t pipelines{1};
+	size_t buffers{};
+	size_t buffer_size{};
+	size_t max_buffers{};
+};
+
+// CPU time consumed by the process so far, in microseconds
+int64_t cpu_time()
+{
+#ifdef FZ_WINDOWS
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+		return 0;
+	}
+	auto const to_us = [](FILETIME const& t) {
+		return static_cast<int64_t>((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) / 10;
+	};
+	return to_us(kernel) + to_us(user);
+#else
+	rusage u{};
+	getrusage(RUSAGE_SELF, &u);
+	auto const to_us = [](timeval const& t) {
+		return static_cast<int64_t>(t.tv_sec) * 1000000 + t.tv_usec;
+	};
+	return to_us(u.ru_utime) + to_us(u.ru_stime);
+#endif
+}
+
+class waiter final : public fz::aio_waiter
+{
+public:
+	void wait()
+	{
+		fz::scoped_lock l(m_);
+		cond_.wait(l);
+		++wakeups_;
+	}
+
+	size_t wakeups() const { return wakeups_; }
+
+private:
+	virtual void on_buffer_availability(fz::aio_waitable const*) override
+	{
+		fz::scoped_lock l(m_);
+		cond_.signal(l);
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+	size_t wakeups_{};
+};
+
+// Shared by all pipelines of a run
+struct context
+{
+	context(options const& o, fz::aio_buffer_pool & p, fz::reader_factory & r, std::vector<std::unique_ptr<fz::writer_factory>> & w)
+		: opts(o)
+		, pool(p)
+		, reader(r)
+		, writers(w)
+	{}
+
+	options const& opts;
+	fz::aio_buffer_pool & pool;
+	fz::reader_factory & reader;
+	std::vector<std::unique_ptr<fz::writer_factory>> & writers;
+
+	fz::mutex m;
+	std::vector<int64_t> latencies;
+	size_t wakeups{};
+	uint64_t transferred{};
+	bool failed{};
+};
+
+void run_pipeline(context & ctx, size_t index)
+{
+	waiter w;
+	std::vector<int64_t> latencies;
+	uint64_t transferred{};
+
+	auto const finish = [&](bool success) {
+		fz::scoped_lock l(ctx.m);
+		if (!success) {
+			ctx.failed = true;
+		}
+		ctx.latencies.insert(ctx.latencies.end(), latencies.cbegin(), latencies.cend());
+		ctx.wakeups += w.wakeups();
+		ctx.transferred += transferred;
+	};
+
+	auto reader = ctx.reader.open(ctx.pool, 0, fz::aio_base::nosize, ctx.opts.max_buffers);
+	std::unique_ptr<fz::writer_base> writer;
+	if (!ctx.writers.empty()) {
+		writer = ctx.writers[index]->open(ctx.pool, 0, nullptr, ctx.opts.max_buffers);
+		if (!writer) {
+			finish(false);
+			return;
+		}
+	}
+	if (!reader) {
+		finish(false);
+		return;
+	}
+
+	for (;;) {
+		auto const start = clock_type::now();
+		fz::aio_result r;
+		fz::buffer_lease b;
+		while (true) {
+			std::tie(r, b) = reader->get_buffer(w);
+			if (r != fz::aio_result::wait) {
+				break;
+			}
+			w.wait();
+		}
+		latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count());
+		if (r == fz::aio_result::error) {
+			finish(false);
+			return;
+		}
+		if (!b) {
+			break;
+		}
+
+		transferred += b->size();
+		if (writer) {
+			r = writer->add_buffer(std::move(b), w);
+			if (r == fz::aio_result::error) {
+				finish(false);
+				return;
+			}
+			else if (r == fz::aio_result::wait) {
+				w.wait();
+			}
+		}
+	}
+
+	if (writer) {
+		for (;;) {
+			auto const r = writer->finalize(w);
+			if (r == fz::aio_result::error) {
+				finish(false);
+				return;
+			}
+			else if (r == fz::aio_result::ok) {
+				break;
+			}
+			w.wait();
+		}
+	}
+
+	finish(transferred == ctx.opts.size);
+}
+
+int64_t percentile(std::vector<int64_t> & v, size_t p)
+{
+	if (v.empty()) {
+		return 0;
+	}
+	size_t const i = std::min(v.size() - 1, v.size() * p / 100);
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+// Holds everything the factories refer to
+struct environment
+{
+	environment(options const& o)
+		: opts(o)
+		, engine(tpool)
+	{}
+
+	options const& opts;
+	fz::thread_pool tpool;
+	fz::uring_engine engine;
+	fz::mmap_cache cache;
+	std::string data;
+	std::wstring source;
+	std::vector<std::wstring> targets;
+	std::vector<fz::buffer> buffers;
+};
+
+std::unique_ptr<fz::reader_factory> make_reader(environment & env, std::string const& type)
+{
+	if (type == "file") {
+		return std::make_unique<fz::file_reader_factory>(env.source, env.tpool);
+	}
+	else if (type == "direct") {
+		return std::make_unique<fz::file_reader_factory>(env.source, env.tpool, fz::file_reader_flags::direct);
+	}
+	else if (type == "mmap") {
+		return std::make_unique<fz::mmap_reader_factory>(env.source, env.cache);
+	}
+	else if (type == "uring") {
+		return std::make_unique<fz::uring_file_reader_factory>(env.source, env.engine);
+	}
+	else if (type == "view") {
+		return std::make_unique<fz::view_reader_factory>(L"view", env.data);
+	}
+	else if (type == "string") {
+		return std::make_unique<fz::string_reader_factory>(L"string", env.data);
+	}
+	else if (type == "view-zc") {
+		return std::make_unique<fz::view_reader_factory>(L"view", env.data, true);
+	}
+	else if (type == "string-zc") {
+		return std::make_unique<fz::string_reader_factory>(L"string", env.data, true);
+	}
+	return {};
+}
+
+std::unique_ptr<fz::writer_factory> make_writer(environment & env, std::string const& type, size_t index)
+{
+	if (type == "file") {
+		return std::make_unique<fz::file_writer_factory>(env.targets[index], env.tpool);
+	}
+	else if (type == "direct") {
+		return std::make_unique<fz::file_writer_factory>(env.targets[index], env.tpool, fz::file_writer_flags::direct);
+	}
+	else if (type == "uring") {
+		return std::make_unique<fz::uring_file_writer_factory>(env.targets[index], env.engine);
+	}
+	else if (type == "buffer") {
+		env.buffers[index].clear();
+		return std::make_unique<fz::buffer_writer_factory>(env.buffers[index], L"buffer", static_cast<size_t>(env.opts.size));
+	}
+	return {};
+}
+
+bool run(environment & env, std::string const& reader_type, std::string const& writer_type)
+{
+	options const& opts = env.opts;
+
+	auto reader = make_reader(env, reader_type);
+	std::vector<std::unique_ptr<fz::writer_factory>> writers;
+	if (writer_type != "none") {
+		for (size_t i = 0; i < opts.pipelines; ++i) {
+			writers.emplace_back(make_writer(env, writer_type, i));
+		}
+	}
+
+	size_t buffers = opts.buffers;
+	if (!buffers) {
+		// Enough for every reader and writer to use as many as it likes
+		size_t per_pipeline = opts.max_buffers ? opts.max_buffers : reader->preferred_buffer_count();
+		if (!writers.empty()) {
+			per_pipeline += opts.max_buffers ? opts.max_buffers : writers.front()->preferred_buffer_count();
+		}
+		buffers = per_pipeline * opts.pipelines;
+	}
+	fz::aio_buffer_pool pool(fz::get_null_logger(), buffers, opts.buffer_size);
+	if (!pool) {
+		std::cerr << "Could not create buffer pool" << std::endl;
+		return false;
+	}
+
+	context ctx(opts, pool, *reader, writers);
+
+	auto const cpu_start = cpu_time();
+	auto const start = clock_type::now();
+
+	std::vector<fz::async_task> tasks;
+	for (size_t i = 0; i < opts.pipelines; ++i) {
+		tasks.emplace_back(env.tpool.spawn([&ctx, i] { run_pipeline(ctx, i); }));
+	}
+	for (auto & t : tasks) {
+		t.join();
+	}
+
+	auto const elapsed = clock_type::now() - start;
+	auto const cpu = cpu_time() - cpu_start;
+
+	std::string const name = reader_type + " -> " + writer_type;
+	if (ctx.failed) {
+		std::cout << name << ": failed" << std::endl;
+		return false;
+	}
+
+	int64_t const us = std::max(int64_t(1), static_cast<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+	uint64_t const total = ctx.transferred;
+
+	std::cout << name << ": " << opts.pipelines << " pipelines, "
+		<< buffers << " buffers of " << pool.buffer_size() << " bytes, "
+		<< (total / (1024 * 1024)) << " MiB in " << (us / 1000) << " ms" << std::endl;
+	std::cout << "  throughput: " << (total * 1000000 / static_cast<uint64_t>(us) / (1024 * 1024)) << " MB/s" << std::endl;
+	std::cout << "  get_buffer: " << ctx.latencies.size() << " buffers, p50 " << percentile(ctx.latencies, 50) / 1000
+		<< " us, p99 " << percentile(ctx.latencies, 99) / 1000 << " us" << std::endl;
+	std::cout << "  wakeups: " << ctx.wakeups;
+	if (!ctx.latencies.empty()) {
+		std::cout << ", " << (ctx.wakeups * 100 / ctx.latencies.size()) << " per 100 buffers";
+	}
+	std::cout << std::endl;
+	if (total) {
+		std::cout << "  cpu: " << (static_cast<uint64_t>(cpu) * 1024 * 1024 * 1024 / total / 1000) << " ms/GB" << std::endl;
+	}
+
+	return true;
+}
+}
+
+int main(int argc, char* argv[])
+{
+	options opts;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg(argv[i]);
+		std::string_view value;
+		auto const pos = arg.find('=');
+		if (pos != std::string_view::npos) {
+			value = arg.substr(pos + 1);
+			arg = arg.substr(0, pos);
+		}
+
+		if (arg == "--reader") {
+			opts.reader = std::string(value);
+		}
+		else if (arg == "--writer") {
+			opts.writer = std::string(value);
+		}
+		else if (arg == "--size") {
+			opts.size = fz::to_integral<uint64_t>(value, opts.size);
+		}
+		else if (arg == "--pipelines") {
+			opts.pipelines = std::max(size_t(1), fz::to_integral<size_t>(value, opts.pipelines));
+		}
+		else if (arg == "--buffers") {
+			opts.buffers = fz::to_integral<size_t>(value, opts.buffers);
+		}
+		else if (arg == "--buffer-size") {
+			opts.buffer_size = fz::to_integral<size_t>(value, opts.buffer_size);
+		}
+		else if (arg == "--max-buffers") {
+			opts.max_buffers = fz::to_integral<size_t>(value, opts.max_buffers);
+		}
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--reader=file|direct|mmap|uring|view|string|view-zc|string-zc|all] [--writer=file|direct|uring|buffer|none|all] [--size=bytes] [--pipelines=N] [--buffers=N] [--buffer-size=bytes] [--max-buffers=N]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<std::string> const all_readers{"file", "direct", "mmap", "uring", "view", "string", "view-zc", "string-zc"};
+	std::vector<std::string> const all_writers{"none", "file", "direct", "uring", "buffer"};
+
+	std::vector<std::string> readers;
+	if (opts.reader == "all") {
+		readers = all_readers;
+	}
+	else if (std::find(all_readers.cbegin(), all_readers.cend(), opts.reader) != all_readers.cend()) {
+		readers.push_back(opts.reader);
+	}
+	else {
+		std::cerr << "Unknown reader: " << opts.reader << std::endl;
+		return 1;
+	}
+
+	std::vector<std::string> writers;
+	if (opts.writer == "all") {
+		writers = all_writers;
+	}
+	else if (std::find(all_writers.cbegin(), all_writers.cend(), opts.writer) != all_writers.cend()) {
+		writers.push_back(opts.writer);
+	}
+	else {
+		std::cerr << "Unknown writer: " << opts.writer << std::endl;
+		return 1;
+	}
+
+	environment env(opts);
+	if (!env.engine.available()) {
+		std::cout << "io_uring unavailable, uring uses the threaded fallback" << std::endl;
+	}
+
+	env.data.resize(static_cast<size_t>(opts.size));
+	for (size_t i = 0; i < env.data.size(); ++i) {
+		env.data[i] = static_cast<char>('a' + (i * 7 + i / 4096) % 26);
+	}
+
+	env.source = L"aio_bench_source.tmp";
+	{
+		fz::file f(fz::to_native(env.source), fz::file::writing, fz::file::empty);
+		if (!f || f.write(env.data.data(), static_cast<int64_t>(env.data.size())) != static_cast<int64_t>(env.data.size())) {
+			std::cerr << "Could not create source file" << std::endl;
+			return 1;
+		}
+	}
+	for (size_t i = 0; i < opts.pipelines; ++i) {
+		env.targets.push_back(L"aio_bench_target" + fz::to_wstring(i) + L".tmp");
+	}
+	env.buffers.resize(opts.pipelines);
+
+	bool ok = true;
+	for (auto const& reader : readers) {
+		for (auto const& writer : writers) {
+			if (!run(env, reader, writer)) {
+				ok = false;
+			}
+		}
+	}
+
+	fz::remove_file(fz::to_native(env.source));
+	for (auto const& target : env.targets) {
+		fz::remove_file(fz::to_native(target));
+	}
+
+	return ok ? 0 : 1;
+}
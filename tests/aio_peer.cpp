@@ -0,0 +1,30 @@
+#include "../lib/libfilezilla/aio/process_io.hpp"
+#include "../lib/libfilezilla/string.hpp"
+
+// Child side of the aio process tests
+//
+// Usage: aio_peer <shm fd> <shm size> <file> read|write
+int main(int argc, char* argv[])
+{
+	if (argc != 5) {
+		return 1;
+	}
+
+#if FZ_WINDOWS
+	auto const shm = reinterpret_cast<fz::aio_buffer_pool::shm_handle>(fz::to_integral<uintptr_t>(std::string_view(argv[1])));
+#else
+	auto const shm = fz::to_integral<int>(std::string_view(argv[1]), -1);
+#endif
+	fz::process_buffer_peer peer(shm, fz::to_integral<size_t>(std::string_view(argv[2])));
+	if (!peer) {
+		return 1;
+	}
+
+	bool const reading = std::string_view(argv[4]) == "read";
+	fz::file f(argv[3], reading ? fz::file::reading : fz::file::writing, reading ? fz::file::existing : fz::file::empty);
+	if (!f) {
+		return 1;
+	}
+
+	return peer.serve(f) ? 0 : 1;
+}
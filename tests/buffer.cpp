@@ -1,4 +1,7 @@
 #include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/buffer_chain.hpp"
+#include "../lib/libfilezilla/nonowning_buffer.hpp"
+#include "../lib/libfilezilla/slab_allocator.hpp"
 
 #include "test_utils.hpp"
 
@@ -9,6 +12,13 @@ class buffer_test final : public CppUnit::TestFixture
 	CPPUNIT_TEST_SUITE(buffer_test);
 	CPPUNIT_TEST(test_simple);
 	CPPUNIT_TEST(test_append);
+	CPPUNIT_TEST(test_inline);
+	CPPUNIT_TEST(test_inline_move);
+	CPPUNIT_TEST(test_shrink_to_fit);
+	CPPUNIT_TEST(test_allocator);
+	CPPUNIT_TEST(test_slab_allocator);
+	CPPUNIT_TEST(test_chain);
+	CPPUNIT_TEST(test_chain_sharing);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -17,6 +27,13 @@ public:
 
 	void test_simple();
 	void test_append();
+	void test_inline();
+	void test_inline_move();
+	void test_shrink_to_fit();
+	void test_allocator();
+	void test_slab_allocator();
+	void test_chain();
+	void test_chain_sharing();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(buffer_test);
@@ -62,3 +79,292 @@ void buffer_test::test_append()
 		CPPUNIT_ASSERT(buf[cap - 5 + i] == static_cast<unsigned char>(i + 5));
 	}
 }
+
+namespace {
+bool stored_inline(fz::buffer const& buf)
+{
+	auto const* p = reinterpret_cast<unsigned char const*>(&buf);
+	return buf.get() >= p && buf.get() < p + sizeof(fz::buffer);
+}
+}
+
+void buffer_test::test_inline()
+{
+	// Typical command and reply lines never leave the inline storage
+	std::string_view const lines[] = {
+		"USER anonymous\r\n",
+		"331 Please specify the password.\r\n",
+		"227 Entering Passive Mode (192,168,100,200,195,80).\r\n",
+		"MLSD /pub/some/directory/of/moderate/length\r\n"
+	};
+
+	fz::buffer buf;
+	for (auto const& line : lines) {
+		buf.append(line);
+		CPPUNIT_ASSERT(stored_inline(buf));
+		ASSERT_EQUAL(fz::buffer::inline_capacity, buf.capacity());
+		ASSERT_EQUAL(std::string(line), std::string(buf.to_view()));
+
+		// Parse the line piecemeal, then reuse the buffer for the next one
+		buf.consume(4);
+		buf.consume(buf.size());
+	}
+
+	fz::buffer reserved(fz::buffer::inline_capacity);
+	CPPUNIT_ASSERT(stored_inline(reserved));
+
+	// Growing beyond the inline storage, including appending from the inline storage itself
+	buf.append(fz::buffer::inline_capacity, 'a');
+	CPPUNIT_ASSERT(stored_inline(buf));
+	buf.append(buf.get(), 10);
+	CPPUNIT_ASSERT(!stored_inline(buf));
+	ASSERT_EQUAL(fz::buffer::inline_capacity + 10, buf.size());
+	ASSERT_EQUAL(std::string(fz::buffer::inline_capacity + 10, 'a'), std::string(buf.to_view()));
+
+	// Copies of small payloads do not allocate, even if the source did
+	buf.consume(buf.size() - 3);
+	fz::buffer copy = buf;
+	CPPUNIT_ASSERT(stored_inline(copy));
+	ASSERT_EQUAL(std::string("aaa"), std::string(copy.to_view()));
+
+	reserved.append("foo");
+	reserved = buf;
+	CPPUNIT_ASSERT(stored_inline(reserved));
+	ASSERT_EQUAL(std::string("aaa"), std::string(reserved.to_view()));
+}
+
+void buffer_test::test_inline_move()
+{
+	fz::buffer buf;
+	buf.append("foobar");
+	buf.consume(3);
+
+	fz::buffer moved(std::move(buf));
+	CPPUNIT_ASSERT(stored_inline(moved));
+	ASSERT_EQUAL(std::string("bar"), std::string(moved.to_view()));
+	CPPUNIT_ASSERT(buf.empty());
+
+	// Moved-from buffers remain usable
+	buf.append("baz");
+	ASSERT_EQUAL(std::string("baz"), std::string(buf.to_view()));
+
+	moved = std::move(buf);
+	ASSERT_EQUAL(std::string("baz"), std::string(moved.to_view()));
+	CPPUNIT_ASSERT(buf.empty());
+
+	// Heap storage is handed over without copying
+	fz::buffer large;
+	large.append(2000, 'x');
+	unsigned char const* p = large.get();
+	moved = std::move(large);
+	CPPUNIT_ASSERT(moved.get() == p);
+	ASSERT_EQUAL(size_t(2000), moved.size());
+	CPPUNIT_ASSERT(large.empty());
+	ASSERT_EQUAL(fz::buffer::inline_capacity, large.capacity());
+
+	fz::buffer large2(std::move(moved));
+	CPPUNIT_ASSERT(large2.get() == p);
+	CPPUNIT_ASSERT(moved.empty());
+	CPPUNIT_ASSERT(stored_inline(moved));
+}
+
+void buffer_test::test_shrink_to_fit()
+{
+	fz::buffer buf;
+	buf.shrink_to_fit();
+	CPPUNIT_ASSERT(stored_inline(buf));
+	ASSERT_EQUAL(size_t(0), buf.heap_size());
+
+	buf.append(5000, 'x');
+	buf.consume(4000);
+	CPPUNIT_ASSERT(buf.heap_size() >= 5000);
+	buf.shrink_to_fit();
+	ASSERT_EQUAL(size_t(1000), buf.heap_size());
+	ASSERT_EQUAL(size_t(1000), buf.size());
+	ASSERT_EQUAL(std::string(1000, 'x'), std::string(buf.to_view()));
+
+	// Small contents move back into the inline storage
+	buf.consume(990);
+	buf.shrink_to_fit();
+	CPPUNIT_ASSERT(stored_inline(buf));
+	ASSERT_EQUAL(size_t(0), buf.heap_size());
+	ASSERT_EQUAL(std::string(10, 'x'), std::string(buf.to_view()));
+
+	// Grows again as needed
+	buf.append(200, 'y');
+	CPPUNIT_ASSERT(!stored_inline(buf));
+	ASSERT_EQUAL(size_t(210), buf.size());
+}
+
+namespace {
+class counting_allocator final : public fz::buffer_allocator
+{
+public:
+	virtual unsigned char* allocate(size_t & capacity) override
+	{
+		++allocations_;
+		outstanding_ += capacity;
+		return new unsigned char[capacity];
+	}
+
+	virtual void deallocate(unsigned char* p, size_t capacity) noexcept override
+	{
+		outstanding_ -= capacity;
+		delete[] p;
+	}
+
+	size_t allocations_{};
+	size_t outstanding_{};
+};
+}
+
+void buffer_test::test_allocator()
+{
+	counting_allocator a;
+	{
+		fz::buffer buf(a);
+		buf.append("foo");
+		ASSERT_EQUAL(size_t(0), a.allocations_);
+
+		buf.append(std::string(200, 'x'));
+		buf.append(std::string(2000, 'y'));
+		ASSERT_EQUAL(size_t(2), a.allocations_);
+		ASSERT_EQUAL(buf.capacity(), a.outstanding_);
+
+		// Moves carry over the allocator
+		fz::buffer moved = std::move(buf);
+		CPPUNIT_ASSERT(moved.get_allocator() == &a);
+		ASSERT_EQUAL(size_t(2203), moved.size());
+
+		// Copies do not
+		fz::buffer copy = moved;
+		CPPUNIT_ASSERT(!copy.get_allocator());
+		ASSERT_EQUAL(size_t(2), a.allocations_);
+
+		fz::buffer reserved(5000, a);
+		ASSERT_EQUAL(size_t(3), a.allocations_);
+		reserved = copy;
+		ASSERT_EQUAL(size_t(3), a.allocations_);
+		CPPUNIT_ASSERT(reserved == moved);
+	}
+	ASSERT_EQUAL(size_t(0), a.outstanding_);
+
+	// Adopting memory from the allocator
+	size_t cap = 100;
+	unsigned char* p = a.allocate(cap);
+	memcpy(p, "foobar", 6);
+	{
+		fz::buffer buf(p, cap, 3, 3, a);
+		ASSERT_EQUAL(std::string("bar"), std::string(buf.to_view()));
+		CPPUNIT_ASSERT(buf.get() == p + 3);
+	}
+	ASSERT_EQUAL(size_t(0), a.outstanding_);
+}
+
+void buffer_test::test_slab_allocator()
+{
+	fz::slab_buffer_allocator a(1024 * 1024);
+
+	unsigned char const* p{};
+	{
+		fz::buffer buf(a);
+		buf.append(std::string(3000, 'x'));
+		ASSERT_EQUAL(fz::slab_buffer_allocator::min_slab_size, buf.capacity());
+		p = buf.get();
+	}
+	ASSERT_EQUAL(fz::slab_buffer_allocator::min_slab_size, a.cached());
+
+	{
+		// The released slab gets reused
+		fz::buffer buf(a);
+		buf.append(std::string(100, 'y'));
+		CPPUNIT_ASSERT(buf.get() == p);
+		ASSERT_EQUAL(size_t(0), a.cached());
+
+		buf.append(std::string(10000, 'z'));
+		ASSERT_EQUAL(size_t(16384), buf.capacity());
+		ASSERT_EQUAL(fz::slab_buffer_allocator::min_slab_size, a.cached());
+	}
+	ASSERT_EQUAL(fz::slab_buffer_allocator::min_slab_size + 16384, a.cached());
+
+	{
+		// Exceeding the cache limit frees memory instead
+		fz::buffer buf(2 * 1024 * 1024, a);
+	}
+	ASSERT_EQUAL(fz::slab_buffer_allocator::min_slab_size + 16384, a.cached());
+
+	a.trim();
+	ASSERT_EQUAL(size_t(0), a.cached());
+
+	fz::slab_buffer_allocator huge(64 * 1024 * 1024, true);
+	{
+		fz::buffer buf(4 * 1024 * 1024, huge);
+		buf.append(std::string(4 * 1024 * 1024, 'h'));
+#ifdef __linux__
+		CPPUNIT_ASSERT(reinterpret_cast<uintptr_t>(buf.get()) % fz::slab_buffer_allocator::huge_page_size == 0);
+#endif
+	}
+	ASSERT_EQUAL(size_t(4 * 1024 * 1024), huge.cached());
+}
+
+void buffer_test::test_chain()
+{
+	fz::buffer_chain c;
+	std::string expected;
+	for (size_t i = 0; i < 5000; ++i) {
+		std::string const s = fz::to_string(i);
+		c.append(s);
+		expected += s;
+	}
+	ASSERT_EQUAL(expected.size(), c.size());
+	ASSERT_EQUAL((expected.size() + fz::buffer_chain::segment_size - 1) / fz::buffer_chain::segment_size, c.segments());
+
+	// Large buffers are adopted as segment
+	fz::buffer b;
+	b.append(std::string(2000, 'x'));
+	c.append(std::move(b));
+	expected += std::string(2000, 'x');
+	c.append("tail");
+	expected += "tail";
+	CPPUNIT_ASSERT(b.empty());
+
+	ASSERT_EQUAL(expected, std::string(c.flatten().to_view()));
+
+	c.consume(10);
+	expected = expected.substr(10);
+
+	auto front = c.split(20000);
+	ASSERT_EQUAL(expected.substr(0, 20000), std::string(front.flatten().to_view()));
+	ASSERT_EQUAL(expected.substr(20000), std::string(c.flatten().to_view()));
+
+	front.append(std::move(c));
+	CPPUNIT_ASSERT(c.empty());
+	ASSERT_EQUAL(expected, std::string(front.flatten().to_view()));
+
+	uint8_t out[100];
+	fz::nonowning_buffer nb(out, sizeof(out));
+	ASSERT_EQUAL(size_t(100), front.consume_into(nb));
+	ASSERT_EQUAL(expected.substr(0, 100), std::string(reinterpret_cast<char const*>(nb.get()), nb.size()));
+	ASSERT_EQUAL(expected.size() - 100, front.size());
+}
+
+void buffer_test::test_chain_sharing()
+{
+	fz::buffer_chain c;
+	c.append("foobar");
+
+	auto s = c.slice(3, 100);
+	ASSERT_EQUAL(std::string("bar"), std::string(s.flatten().to_view()));
+
+	// Shared segments are not appended to
+	c.append("baz");
+	s.append("qux");
+	ASSERT_EQUAL(std::string("foobarbaz"), std::string(c.flatten().to_view()));
+	ASSERT_EQUAL(std::string("barqux"), std::string(s.flatten().to_view()));
+	ASSERT_EQUAL(size_t(2), c.segments());
+
+	fz::buffer_chain copy = c;
+	c.consume(4);
+	ASSERT_EQUAL(std::string("arbaz"), std::string(c.flatten().to_view()));
+	ASSERT_EQUAL(std::string("foobarbaz"), std::string(copy.flatten().to_view()));
+}
@@ -0,0 +1,132 @@
+#include "../lib/libfilezilla/coroutine.hpp"
+
+#ifdef FZ_HAVE_COROUTINES
+
+#include "../lib/libfilezilla/thread_pool.hpp"
+
+#include "test_utils.hpp"
+
+class coroutine_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(coroutine_test);
+	CPPUNIT_TEST(test_task);
+	CPPUNIT_TEST(test_socket);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_task();
+	void test_socket();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(coroutine_test);
+
+namespace {
+struct value_event_type;
+typedef fz::simple_event<value_event_type, int> value_event;
+
+struct done {
+	fz::mutex m_;
+	fz::condition cond_;
+	int result_{};
+
+	void finish(int result) {
+		fz::scoped_lock l(m_);
+		result_ = result;
+		cond_.signal(l);
+	}
+};
+
+fz::co_task<int> twice(fz::coroutine_handler & h, int v)
+{
+	co_await h.sleep(fz::duration::from_milliseconds(1));
+	co_return v * 2;
+}
+
+fz::co_task<> waiter(fz::coroutine_handler & h, done & d)
+{
+	auto [v] = co_await h.wait_event<value_event>([](int v) { return v > 10; });
+	d.finish(co_await twice(h, v));
+}
+}
+
+void coroutine_test::test_task()
+{
+	fz::event_loop loop;
+	fz::coroutine_handler h(loop);
+
+	done d;
+	fz::scoped_lock l(d.m_);
+
+	h.spawn(waiter(h, d));
+	h.send_event<value_event>(5);
+	h.send_event<value_event>(21);
+
+	CPPUNIT_ASSERT(d.cond_.wait(l, fz::duration::from_seconds(10)));
+	CPPUNIT_ASSERT_EQUAL(42, d.result_);
+}
+
+namespace {
+fz::co_task<> accept_one(fz::coroutine_handler & h, fz::listen_socket & server, done & d)
+{
+	auto [flag, error] = co_await h.wait_socket(&server, fz::socket_event_flag::connection);
+	if (error) {
+		d.finish(-1);
+		co_return;
+	}
+
+	auto s = server.accept(error, &h);
+	if (!s) {
+		d.finish(-2);
+		co_return;
+	}
+
+	std::tie(flag, error) = co_await h.wait_socket(s.get(), fz::socket_event_flag::read);
+	if (error) {
+		d.finish(-3);
+		co_return;
+	}
+
+	unsigned char buf[1];
+	int r = s->read(buf, 1, error);
+	d.finish(r == 1 ? buf[0] : -4);
+}
+
+fz::co_task<> connect_and_send(fz::coroutine_handler & h, fz::socket & client, int port)
+{
+	client.connect(fzT("127.0.0.1"), port);
+	auto [flag, error] = co_await h.wait_socket(&client, fz::socket_event_flag::connection);
+	if (!error) {
+		unsigned char const c = 42;
+		client.write(&c, 1, error);
+	}
+}
+}
+
+void coroutine_test::test_socket()
+{
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	fz::coroutine_handler h(loop);
+
+	fz::listen_socket server(pool, &h);
+	CPPUNIT_ASSERT_EQUAL(0, server.listen(fz::address_type::ipv4));
+	int error{};
+	int port = server.local_port(error);
+	CPPUNIT_ASSERT(port > 0);
+
+	fz::socket client(pool, &h);
+
+	done d;
+	fz::scoped_lock l(d.m_);
+
+	h.spawn(accept_one(h, server, d));
+	h.spawn(connect_and_send(h, client, port));
+
+	CPPUNIT_ASSERT(d.cond_.wait(l, fz::duration::from_seconds(10)));
+	CPPUNIT_ASSERT_EQUAL(42, d.result_);
+}
+
+#endif
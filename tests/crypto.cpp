@@ -1,17 +1,40 @@
+#include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/encode.hpp"
 #include "../lib/libfilezilla/encryption.hpp"
+#include "../lib/libfilezilla/event_handler.hpp"
+#include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/file.hpp"
+#include "../lib/libfilezilla/hash.hpp"
+#include "../lib/libfilezilla/jws.hpp"
+#include "../lib/libfilezilla/key_derivation.hpp"
 #include "../lib/libfilezilla/signature.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/tree_hash.hpp"
 #include "../lib/libfilezilla/util.hpp"
 
 #include "test_utils.hpp"
 
 #include <string.h>
 
+#include <thread>
+
 class crypto_test final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(crypto_test);
 	CPPUNIT_TEST(test_encryption);
 	CPPUNIT_TEST(test_encryption_with_password);
+	CPPUNIT_TEST(test_stream_encryption);
 	CPPUNIT_TEST(test_signature);
+	CPPUNIT_TEST(test_encryption_into);
+	CPPUNIT_TEST(test_hash_state);
+	CPPUNIT_TEST(test_hash_batch);
+	CPPUNIT_TEST(test_tree_hash);
+	CPPUNIT_TEST(test_checksums);
+	CPPUNIT_TEST(test_hmac);
+	CPPUNIT_TEST(test_key_derivation);
+	CPPUNIT_TEST(test_signature_batch);
+	CPPUNIT_TEST(test_jws);
+	CPPUNIT_TEST(test_jws_signing_key);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -20,7 +43,18 @@ public:
 
 	void test_encryption();
 	void test_encryption_with_password();
+	void test_stream_encryption();
 	void test_signature();
+	void test_encryption_into();
+	void test_hash_state();
+	void test_hash_batch();
+	void test_tree_hash();
+	void test_checksums();
+	void test_hmac();
+	void test_key_derivation();
+	void test_signature_batch();
+	void test_jws();
+	void test_jws_signing_key();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(crypto_test);
@@ -106,4 +140,748 @@ void crypto_test::test_signature()
 	sig2[5] ^= 0x2c;
 	CPPUNIT_ASSERT(!fz::verify(sig, pub));
 	CPPUNIT_ASSERT(!fz::verify("Hello", sig2v, pub));
+
+	// Test signing without allocation
+	std::string_view const msg = "Hello";
+	auto const* m = reinterpret_cast<uint8_t const*>(msg.data());
+	uint8_t detached[fz::signature_size];
+	CPPUNIT_ASSERT(fz::sign_into(m, msg.size(), priv, detached));
+	CPPUNIT_ASSERT(fz::verify(m, msg.size(), detached, sizeof(detached), pub));
+	CPPUNIT_ASSERT(std::vector<uint8_t>(detached, detached + sizeof(detached)) == fz::sign(msg, priv, false));
+
+	fz::buffer attached;
+	CPPUNIT_ASSERT(fz::sign(m, msg.size(), priv, attached));
+	CPPUNIT_ASSERT(fz::verify(attached.get(), attached.size(), pub));
+	CPPUNIT_ASSERT(!fz::sign(m, msg.size(), fz::private_signing_key(), attached));
+}
+
+void crypto_test::test_encryption_into()
+{
+	auto const key = fz::symmetric_key::generate();
+	std::string_view const plain = "Hello world";
+	std::string_view const ad = "header";
+	auto const* p = reinterpret_cast<uint8_t const*>(plain.data());
+	auto const* a = reinterpret_cast<uint8_t const*>(ad.data());
+	size_t const overhead = fz::symmetric_key::encryption_overhead();
+	size_t const prefix = fz::symmetric_key::encryption_prefix_size();
+
+	// Into caller-supplied memory
+	std::vector<uint8_t> cipher(plain.size() + overhead);
+	CPPUNIT_ASSERT(fz::encrypt_into(p, plain.size(), key, cipher.data(), a, ad.size()));
+	CPPUNIT_ASSERT(fz::decrypt(cipher, key, std::vector<uint8_t>(a, a + ad.size())) == std::vector<uint8_t>(p, p + plain.size()));
+
+	std::vector<uint8_t> out(plain.size());
+	CPPUNIT_ASSERT(fz::decrypt_into(cipher.data(), cipher.size(), key, out.data(), a, ad.size()));
+	CPPUNIT_ASSERT(out == std::vector<uint8_t>(p, p + plain.size()));
+	CPPUNIT_ASSERT(!fz::decrypt_into(cipher.data(), cipher.size(), key, out.data()));
+	CPPUNIT_ASSERT(out == std::vector<uint8_t>(plain.size(), 0));
+
+	// Into buffers
+	fz::buffer buf;
+	buf.append("prefix");
+	CPPUNIT_ASSERT(fz::encrypt(p, plain.size(), key, buf));
+	CPPUNIT_ASSERT_EQUAL(6 + plain.size() + overhead, buf.size());
+	fz::buffer decrypted;
+	CPPUNIT_ASSERT(fz::decrypt(buf.get() + 6, buf.size() - 6, key, decrypted));
+	CPPUNIT_ASSERT(decrypted.to_view() == plain);
+	buf[10] ^= 1;
+	CPPUNIT_ASSERT(!fz::decrypt(buf.get() + 6, buf.size() - 6, key, decrypted));
+	CPPUNIT_ASSERT(decrypted.to_view() == plain);
+
+	// In place, with the overhead reserved around the plaintext
+	std::vector<uint8_t> data(plain.size() + overhead);
+	memcpy(data.data() + prefix, plain.data(), plain.size());
+	CPPUNIT_ASSERT(fz::encrypt_in_place(data.data(), plain.size(), key));
+	CPPUNIT_ASSERT(fz::decrypt(data, key) == std::vector<uint8_t>(p, p + plain.size()));
+	CPPUNIT_ASSERT(fz::decrypt_in_place(data.data(), data.size(), key));
+	CPPUNIT_ASSERT(std::string_view(reinterpret_cast<char const*>(data.data() + prefix), plain.size()) == plain);
+
+	CPPUNIT_ASSERT(!fz::encrypt_in_place(data.data(), plain.size(), fz::symmetric_key()));
+	CPPUNIT_ASSERT(!fz::decrypt_in_place(data.data(), overhead - 1, key));
+}
+
+void crypto_test::test_hash_state()
+{
+	auto const data = fz::random_bytes(1000);
+
+	for (auto const algorithm : {fz::hash_algorithm::md5, fz::hash_algorithm::sha1, fz::hash_algorithm::sha256, fz::hash_algorithm::sha512}) {
+		fz::hash_accumulator full(algorithm);
+		full.update(data);
+		auto const expected = full.digest();
+
+		for (size_t split : {0, 1, 63, 64, 65, 127, 128, 129, 999}) {
+			fz::hash_accumulator first(algorithm);
+			first.update(data.data(), split);
+			auto const state = first.export_state();
+
+			fz::hash_accumulator second(algorithm);
+			second.update(data.data(), 5);
+			CPPUNIT_ASSERT(second.import_state(state));
+			second.update(data.data() + split, data.size() - split);
+			CPPUNIT_ASSERT(second.digest() == expected);
+
+			// Exporting does not change the state
+			first.update(data.data() + split, data.size() - split);
+			CPPUNIT_ASSERT(first.digest() == expected);
+		}
+	}
+
+	fz::hash_accumulator acc(fz::hash_algorithm::sha256);
+	acc.update(data.data(), 100);
+	auto const state = acc.export_state();
+
+	// Malformed or foreign states leave the accumulator untouched
+	fz::hash_accumulator other(fz::hash_algorithm::sha512);
+	CPPUNIT_ASSERT(!other.import_state(state));
+	CPPUNIT_ASSERT(!acc.import_state(std::vector<uint8_t>()));
+	CPPUNIT_ASSERT(!acc.import_state(std::vector<uint8_t>(state.begin(), state.end() - 1)));
+	auto bad = state;
+	bad[0] = 0xff;
+	CPPUNIT_ASSERT(!acc.import_state(bad));
+	acc.update(data.data() + 100, data.size() - 100);
+	CPPUNIT_ASSERT(acc.digest() == fz::sha256(data));
+}
+
+void crypto_test::test_hash_batch()
+{
+	auto const data = fz::random_bytes(64 * 1024);
+
+	for (auto const algorithm : {fz::hash_algorithm::md5, fz::hash_algorithm::sha1, fz::hash_algorithm::sha256, fz::hash_algorithm::sha512}) {
+		for (size_t const streams : {1, 2, 5, 8, 13}) {
+			fz::hash_accumulator_batch batch(algorithm, streams);
+			CPPUNIT_ASSERT_EQUAL(streams, batch.size());
+
+			// Uneven chunks, so that streams differ in length and get out of block alignment
+			std::vector<std::vector<uint8_t>> expected;
+			std::vector<size_t> offsets(streams);
+			for (size_t round = 0; round < 4; ++round) {
+				std::vector<std::basic_string_view<uint8_t>> chunks;
+				for (size_t i = 0; i < streams; ++i) {
+					size_t const size = (i * 977 + round * 331) % 3000;
+					chunks.emplace_back(data.data() + offsets[i], size);
+					offsets[i] += size;
+				}
+				batch.update(chunks);
+			}
+			batch.update(0, data.data(), 7);
+
+			for (size_t i = 0; i < streams; ++i) {
+				fz::hash_accumulator acc(algorithm);
+				acc.update(data.data(), offsets[i]);
+				if (!i) {
+					acc.update(data.data(), 7);
+				}
+				CPPUNIT_ASSERT(batch.digest(i) == acc.digest());
+			}
+
+			// Digest reinitializes the streams
+			std::vector<std::basic_string_view<uint8_t>> inputs;
+			for (size_t i = 0; i < streams; ++i) {
+				inputs.emplace_back(data.data(), 1000 * i + 100);
+			}
+			batch.update(inputs);
+			auto const digests = fz::hash_batch(algorithm, inputs);
+			CPPUNIT_ASSERT_EQUAL(streams, digests.size());
+			for (size_t i = 0; i < streams; ++i) {
+				CPPUNIT_ASSERT(batch.digest(i) == digests[i]);
+
+				fz::hash_accumulator acc(algorithm);
+				acc.update(inputs[i]);
+				CPPUNIT_ASSERT(digests[i] == acc.digest());
+			}
+		}
+	}
+
+	CPPUNIT_ASSERT(fz::hash_batch(fz::hash_algorithm::sha256, std::vector<std::string_view>{"abc"})[0] == fz::sha256("abc"));
+}
+
+namespace {
+std::string make_data(size_t size)
+{
+	std::string data;
+	data.reserve(size);
+	for (size_t i = 0; i < size; ++i) {
+		data += static_cast<char>('a' + (i * 7 + i / 4096) % 26);
+	}
+	return data;
+}
+
+// Straightforward recursive definition, the left subtree covering the largest power of two number of chunks
+std::vector<uint8_t> reference_tree_hash(std::string_view data)
+{
+	size_t const chunk = fz::tree_hash_accumulator::chunk_size;
+	if (data.size() <= chunk) {
+		return fz::sha256(data);
+	}
+	size_t left = chunk;
+	while (left * 2 < data.size()) {
+		left *= 2;
+	}
+	auto l = reference_tree_hash(data.substr(0, left));
+	auto const r = reference_tree_hash(data.substr(left));
+	l.insert(l.end(), r.cbegin(), r.cend());
+	return fz::sha256(l);
+}
+}
+
+void crypto_test::test_tree_hash()
+{
+	size_t const chunk = fz::tree_hash_accumulator::chunk_size;
+	std::string const data = make_data(5 * chunk + 4321);
+
+	CPPUNIT_ASSERT(fz::tree_hash(std::string_view()) == fz::sha256(std::string_view()));
+	CPPUNIT_ASSERT(fz::tree_hash(std::string_view(data).substr(0, 1000)) == fz::sha256(data.substr(0, 1000)));
+	CPPUNIT_ASSERT(fz::hex_encode<std::string>(fz::tree_hash(std::string_view(data).substr(0, 3 * chunk + 12345))) == "a6d0dbf3a6f406989783bae6f5f46b6ae227529dbe6f13f89e0f556872a80935");
+
+	fz::thread_pool pool(4);
+	for (size_t size : {chunk, 2 * chunk, 3 * chunk, 3 * chunk + 1, 5 * chunk + 4321}) {
+		std::string_view const in = std::string_view(data).substr(0, size);
+		auto const expected = reference_tree_hash(in);
+		CPPUNIT_ASSERT(fz::tree_hash(in) == expected);
+		CPPUNIT_ASSERT(fz::tree_hash(in, &pool) == expected);
+
+		// Sequentially in odd pieces
+		fz::tree_hash_accumulator acc;
+		for (size_t i = 0; i < size; i += 100000) {
+			CPPUNIT_ASSERT(acc.update(in.substr(i, 100000)));
+		}
+		CPPUNIT_ASSERT(acc.digest() == expected);
+	}
+
+	// Chunk-aligned ranges, added concurrently and in reverse
+	{
+		auto const* p = reinterpret_cast<uint8_t const*>(data.data());
+		fz::tree_hash_accumulator acc;
+		std::vector<fz::async_task> tasks;
+		for (size_t start : {4 * chunk, 2 * chunk, size_t{0}}) {
+			size_t const end = std::min(start + 2 * chunk, data.size());
+			tasks.emplace_back(pool.spawn([&acc, p, start, end] {
+				for (size_t i = start; i < end; i += 65536) {
+					acc.update(i, p + i, std::min(end - i, size_t{65536}));
+				}
+			}));
+		}
+		for (auto & task : tasks) {
+			task.join();
+		}
+		CPPUNIT_ASSERT_EQUAL(size_t{5}, acc.chunk_digests().size());
+		CPPUNIT_ASSERT(acc.digest() == reference_tree_hash(data));
+
+		// The chunks of an aligned range verify that range
+		auto const chunks = acc.chunk_digests();
+		CPPUNIT_ASSERT(fz::tree_hash_combine({chunks.begin(), chunks.begin() + 4}) == reference_tree_hash(std::string_view(data).substr(0, 4 * chunk)));
+		CPPUNIT_ASSERT(fz::tree_hash_combine({chunks.begin() + 2, chunks.begin() + 4}) == reference_tree_hash(std::string_view(data).substr(2 * chunk, 2 * chunk)));
+	}
+
+	// Gaps and misordered data
+	{
+		auto const* p = reinterpret_cast<uint8_t const*>(data.data());
+		fz::tree_hash_accumulator acc;
+		CPPUNIT_ASSERT(acc.update(chunk, p + chunk, 1000));
+		CPPUNIT_ASSERT(acc.chunk_digests().empty());
+		CPPUNIT_ASSERT(acc.digest().empty());
+
+		acc.reinit();
+		CPPUNIT_ASSERT(acc.update(0, p, 1000));
+		CPPUNIT_ASSERT(!acc.update(2000, p + 2000, 1000));
+		CPPUNIT_ASSERT(!acc.update(1000, p + 1000, 1000));
+		CPPUNIT_ASSERT(acc.digest().empty());
+
+		acc.reinit();
+		CPPUNIT_ASSERT(acc.update(0, p, 1000));
+		CPPUNIT_ASSERT(acc.digest() == fz::sha256(data.substr(0, 1000)));
+	}
+
+	// From a file
+	{
+		fz::native_string const name = fz::to_native(std::string_view("crypto_test_tree_hash.tmp"));
+		{
+			fz::file f(name, fz::file::writing, fz::file::empty);
+			CPPUNIT_ASSERT(f.write(data.data(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size()));
+		}
+		std::vector<fz::tree_hash_accumulator::chunk_digest> chunks;
+		CPPUNIT_ASSERT(fz::tree_hash_file(name, pool, 3, &chunks) == reference_tree_hash(data));
+		CPPUNIT_ASSERT_EQUAL(size_t{6}, chunks.size());
+		CPPUNIT_ASSERT(fz::tree_hash_combine(chunks) == reference_tree_hash(data));
+		fz::remove_file(name);
+
+		CPPUNIT_ASSERT(fz::tree_hash_file(name, pool).empty());
+	}
+}
+
+void crypto_test::test_checksums()
+{
+	CPPUNIT_ASSERT_EQUAL(uint32_t{0}, fz::crc32c(std::string_view()));
+	CPPUNIT_ASSERT_EQUAL(uint32_t{0xe3069283}, fz::crc32c(std::string_view("123456789")));
+	CPPUNIT_ASSERT_EQUAL(uint32_t{0xe3069283}, fz::crc32c(std::string_view("6789"), fz::crc32c(std::string_view("12345"))));
+
+	// Bitwise reference, long enough for the interleaved streams
+	auto const random = fz::random_bytes(100000);
+	for (size_t size : {7, 1000, 30000, 100000}) {
+		uint32_t crc = 0xffffffff;
+		for (size_t i = 0; i < size; ++i) {
+			crc ^= random[i];
+			for (int k = 0; k < 8; ++k) {
+				crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+			}
+		}
+		CPPUNIT_ASSERT_EQUAL(~crc, fz::crc32c(std::basic_string_view<uint8_t>(random.data(), size)));
+	}
+
+	// Covers all the size classes of XXH3
+	std::string const data = make_data(5000);
+	std::pair<size_t, uint64_t> const xxh3_vectors[] = {
+		{0, 0x2d06800538d394c2ull},
+		{1, 0xe6c632b61e964e1full},
+		{3, 0x7ea47a004f34273cull},
+		{4, 0xa02b1fe01d5e8c68ull},
+		{8, 0xae512ee33cb829a3ull},
+		{9, 0x8a413b4d39e87b1dull},
+		{16, 0xdfd4b837b7921abfull},
+		{17, 0x93e37276a1b3d25eull},
+		{100, 0x9ccd9e9174826a99ull},
+		{128, 0xb2750a05a86bd144ull},
+		{129, 0x7944327491a28ad0ull},
+		{240, 0x42b550f096408b23ull},
+		{241, 0x58129d823c648ff5ull},
+		{1024, 0x62efeb73eb589676ull},
+		{1025, 0x8328e4d7340701c7ull},
+		{5000, 0xcbb86756bac732ccull},
+	};
+	for (auto const& [size, expected] : xxh3_vectors) {
+		std::string_view const in = std::string_view(data).substr(0, size);
+		CPPUNIT_ASSERT_EQUAL(expected, fz::xxh3_64(in));
+
+		// Streaming in pieces of various sizes, with the state exported and imported on the way
+		for (size_t piece : {1, 63, 64, 100, 257, 1000}) {
+			fz::hash_accumulator acc(fz::hash_algorithm::xxh3);
+			for (size_t i = 0; i < size; i += piece) {
+				acc.update(in.substr(i, piece));
+				if (i % (3 * piece) == 0) {
+					fz::hash_accumulator other(fz::hash_algorithm::xxh3);
+					CPPUNIT_ASSERT(other.import_state(acc.export_state()));
+					acc.import_state(other.export_state());
+				}
+			}
+			auto const digest = acc.digest();
+			CPPUNIT_ASSERT_EQUAL(size_t{8}, digest.size());
+			uint64_t v{};
+			for (auto const c : digest) {
+				v = (v << 8) | c;
+			}
+			CPPUNIT_ASSERT_EQUAL(expected, v);
+		}
+	}
+
+	fz::hash_accumulator crc(fz::hash_algorithm::crc32c);
+	crc.update(std::string_view("12345"));
+	fz::hash_accumulator resumed(fz::hash_algorithm::crc32c);
+	CPPUNIT_ASSERT(resumed.import_state(crc.export_state()));
+	resumed.update(std::string_view("6789"));
+	CPPUNIT_ASSERT(resumed.digest() == std::vector<uint8_t>({0xe3, 0x06, 0x92, 0x83}));
+}
+
+void crypto_test::test_hmac()
+{
+	// RFC 4231 test case 2
+	std::string const key = "Jefe";
+	std::string const data = "what do ya want for nothing?";
+	auto const expected256 = fz::hex_decode("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+	auto const expected512 = fz::hex_decode("164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea2505549758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737");
+
+	fz::hmac_accumulator hmac(fz::hash_algorithm::sha256, key);
+	hmac << data;
+	CPPUNIT_ASSERT(hmac.digest() == expected256);
+
+	// Reusable after digest, also with incremental updates
+	hmac << data.substr(0, 5) << data.substr(5);
+	CPPUNIT_ASSERT(hmac.digest() == expected256);
+
+	hmac << std::string_view("garbage");
+	hmac.reinit();
+	hmac << data;
+	CPPUNIT_ASSERT(hmac.verify(expected256));
+	hmac << data;
+	CPPUNIT_ASSERT(!hmac.verify(expected512));
+
+	fz::hmac_accumulator hmac512(fz::hash_algorithm::sha512, key);
+	hmac512 << data;
+	CPPUNIT_ASSERT(hmac512.digest() == expected512);
+
+	// Keys longer than the block size get hashed first
+	std::string const long_key(200, 'k');
+	fz::hmac_accumulator hmac1(fz::hash_algorithm::sha1, long_key);
+	hmac1 << data;
+	CPPUNIT_ASSERT(hmac1.digest() == fz::hmac_sha1(long_key, data));
+
+	CPPUNIT_ASSERT(fz::hmac_accumulator(fz::hash_algorithm::crc32c, key).digest().empty());
+
+	// Clones are independent from the original and from each other
+	hmac << std::string_view("pending");
+	std::vector<std::vector<uint8_t>> results(4);
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < results.size(); ++i) {
+		threads.emplace_back([&, i] {
+			auto own = hmac.clone();
+			for (size_t j = 0; j < 1000; ++j) {
+				own << data;
+				results[i] = own.digest();
+			}
+		});
+	}
+	for (auto & t : threads) {
+		t.join();
+	}
+	for (auto const& result : results) {
+		CPPUNIT_ASSERT(result == expected256);
+	}
+	hmac << data;
+	CPPUNIT_ASSERT(hmac.digest() == fz::hmac_sha256(key, "pending" + data));
+}
+
+namespace {
+std::string stream_encrypt(fz::symmetric_key const& key, std::string_view data, size_t piece)
+{
+	fz::stream_encryptor enc(key);
+	fz::buffer out;
+	for (size_t i = 0; i < data.size(); i += piece) {
+		auto const n = std::min(piece, data.size() - i);
+		CPPUNIT_ASSERT(enc.encrypt(reinterpret_cast<uint8_t const*>(data.data() + i), n, out));
+	}
+	CPPUNIT_ASSERT(enc.finalize(out));
+	CPPUNIT_ASSERT(!enc);
+	return std::string(out.to_view());
+}
+
+bool stream_decrypt(fz::symmetric_key const& key, std::string_view data, size_t piece, std::string & plain)
+{
+	fz::stream_decryptor dec(key);
+	fz::buffer out;
+	for (size_t i = 0; i < data.size(); i += piece) {
+		auto const n = std::min(piece, data.size() - i);
+		if (!dec.decrypt(reinterpret_cast<uint8_t const*>(data.data() + i), n, out)) {
+			return false;
+		}
+	}
+	if (!dec.finalize(out)) {
+		return false;
+	}
+	plain = out.to_view();
+	return true;
+}
+}
+
+void crypto_test::test_stream_encryption()
+{
+	auto const key = fz::symmetric_key::generate();
+	size_t const chunk = fz::stream_encryptor::chunk_size;
+
+	for (size_t size : {size_t{0}, size_t{1}, chunk - 1, chunk, chunk + 1, 3 * chunk, 3 * chunk + 12345}) {
+		std::string const data = make_data(size);
+		std::string const cipher = stream_encrypt(key, data, 1000);
+		CPPUNIT_ASSERT_EQUAL(fz::stream_encryptor::encrypted_size(size), static_cast<uint64_t>(cipher.size()));
+		CPPUNIT_ASSERT(stream_encrypt(key, data, 100000) != cipher);
+
+		for (size_t piece : {size_t{1000}, size_t{fz::stream_encryptor::encrypted_chunk_size}, size_t{1000000}}) {
+			std::string plain;
+			CPPUNIT_ASSERT(stream_decrypt(key, cipher, piece, plain));
+			CPPUNIT_ASSERT(plain == data);
+		}
+
+		// In place
+		fz::stream_decryptor dec(key);
+		fz::buffer in;
+		in.append(cipher);
+		CPPUNIT_ASSERT(dec.decrypt(in, true));
+		CPPUNIT_ASSERT(in.to_view() == data);
+
+		// Wrong key
+		std::string plain;
+		CPPUNIT_ASSERT(!stream_decrypt(fz::symmetric_key::generate(), cipher, 1000, plain));
+
+		// Truncated, also at chunk boundaries
+		CPPUNIT_ASSERT(!stream_decrypt(key, cipher.substr(0, cipher.size() - 1), 1000, plain));
+		if (size >= chunk) {
+			CPPUNIT_ASSERT(!stream_decrypt(key, cipher.substr(0, fz::stream_encryptor::header_size + fz::stream_encryptor::encrypted_chunk_size), 1000, plain));
+		}
+
+		// Modified
+		std::string modified = cipher;
+		modified[modified.size() / 2] ^= 1;
+		CPPUNIT_ASSERT(!stream_decrypt(key, modified, 1000, plain));
+	}
+
+	// Chunks swapped
+	{
+		size_t const ec = fz::stream_encryptor::encrypted_chunk_size;
+		std::string const data = make_data(3 * chunk + 10);
+		std::string cipher = stream_encrypt(key, data, chunk);
+		std::string const first = cipher.substr(fz::stream_encryptor::header_size, ec);
+		cipher.replace(fz::stream_encryptor::header_size, ec, cipher.substr(fz::stream_encryptor::header_size + ec, ec));
+		cipher.replace(fz::stream_encryptor::header_size + ec, ec, first);
+		std::string plain;
+		CPPUNIT_ASSERT(!stream_decrypt(key, cipher, 1000, plain));
+	}
+
+	// Buffers processed in place, both with whole chunks and with partial chunks in between
+	for (size_t piece : {chunk, 2 * chunk, size_t{10000}}) {
+		std::string const data = make_data(5 * chunk + 777);
+
+		fz::stream_encryptor enc(key);
+		std::string cipher;
+		for (size_t i = 0; i < data.size(); i += piece) {
+			fz::buffer buf;
+			buf.append(data.substr(i, piece));
+			CPPUNIT_ASSERT(enc.encrypt(buf, i + piece >= data.size()));
+			cipher += buf.to_view();
+		}
+		CPPUNIT_ASSERT(!enc);
+		CPPUNIT_ASSERT_EQUAL(fz::stream_encryptor::encrypted_size(data.size()), static_cast<uint64_t>(cipher.size()));
+
+		fz::stream_decryptor dec(key);
+		std::string plain;
+		size_t const cpiece = piece == chunk ? size_t(fz::stream_encryptor::encrypted_chunk_size) : piece;
+		for (size_t i = 0; i < cipher.size(); i += cpiece) {
+			fz::buffer buf;
+			if (!i && piece == chunk) {
+				// Header and whole chunks
+				buf.append(cipher.substr(0, fz::stream_encryptor::header_size + cpiece));
+				i += fz::stream_encryptor::header_size;
+			}
+			else {
+				buf.append(cipher.substr(i, cpiece));
+			}
+			CPPUNIT_ASSERT(dec.decrypt(buf, i + cpiece >= cipher.size()));
+			plain += buf.to_view();
+		}
+		CPPUNIT_ASSERT(!dec);
+		CPPUNIT_ASSERT(plain == data);
+	}
+}
+
+namespace {
+class derivation_handler final : public fz::event_handler
+{
+public:
+	derivation_handler(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	~derivation_handler()
+	{
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::key_derivation_event>(ev, [this](fz::key_derivation*, fz::symmetric_key const& sym, fz::private_key const& priv) {
+			fz::scoped_lock l(m_);
+			sym_ = sym;
+			priv_ = priv;
+			done_ = true;
+			cond_.signal(l);
+		});
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+	bool done_{};
+	fz::symmetric_key sym_;
+	fz::private_key priv_;
+};
+}
+
+void crypto_test::test_key_derivation()
+{
+	auto const salt = fz::random_bytes(fz::symmetric_key::salt_size);
+
+	auto const sym = fz::symmetric_key::from_password("super secret", salt);
+	auto const priv = fz::private_key::from_password("super secret", salt);
+	CPPUNIT_ASSERT(sym && priv);
+
+	{
+		fz::key_derivation_cache cache(2);
+		CPPUNIT_ASSERT(fz::symmetric_key::from_password("super secret", salt, fz::symmetric_key::min_iterations, &cache) == sym);
+		CPPUNIT_ASSERT_EQUAL(size_t(1), cache.size());
+
+		// Second key type only hits the cache
+		CPPUNIT_ASSERT(fz::private_key::from_password("super secret", salt, fz::private_key::min_iterations, &cache).to_base64() == priv.to_base64());
+		CPPUNIT_ASSERT_EQUAL(size_t(1), cache.size());
+
+		// Different parameters are different entries, bounded by the size
+		CPPUNIT_ASSERT(!(fz::symmetric_key::from_password("other secret", salt, fz::symmetric_key::min_iterations, &cache) == sym));
+		CPPUNIT_ASSERT(!(fz::symmetric_key::from_password("super secret", salt, fz::symmetric_key::min_iterations + 1, &cache) == sym));
+		CPPUNIT_ASSERT_EQUAL(size_t(2), cache.size());
+
+		cache.clear();
+		CPPUNIT_ASSERT_EQUAL(size_t(0), cache.size());
+	}
+
+	{
+		// Expired entries are derived anew
+		fz::key_derivation_cache cache(4, fz::duration::from_milliseconds(1));
+		std::string_view const pw = "secret";
+		auto const p = std::basic_string_view<uint8_t>(reinterpret_cast<uint8_t const*>(pw.data()), pw.size());
+		auto const s = std::basic_string_view<uint8_t>(salt.data(), salt.size());
+		auto const a = cache.pbkdf2_hmac_sha256(p, s, 32, 1000);
+		fz::sleep(fz::duration::from_milliseconds(5));
+		CPPUNIT_ASSERT(cache.pbkdf2_hmac_sha256(p, s, 32, 1000) == a);
+		CPPUNIT_ASSERT(a == fz::pbkdf2_hmac_sha256(p, s, 32, 1000));
+		CPPUNIT_ASSERT_EQUAL(size_t(1), cache.size());
+	}
+
+	fz::thread_pool pool;
+	fz::event_loop loop(pool);
+	derivation_handler handler(loop);
+
+	fz::key_derivation_cache cache;
+	fz::key_derivation kd(pool, handler, &cache);
+	for (int i = 0; i < 2; ++i) {
+		CPPUNIT_ASSERT(kd.derive("super secret", salt));
+
+		fz::scoped_lock l(handler.m_);
+		while (!handler.done_) {
+			CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(30)));
+		}
+		handler.done_ = false;
+		CPPUNIT_ASSERT(handler.sym_ == sym);
+		CPPUNIT_ASSERT(handler.priv_.to_base64() == priv.to_base64());
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(1), cache.size());
+
+	// Results of an abandoned derivation never arrive
+	CPPUNIT_ASSERT(kd.derive("other secret", salt));
+	kd.reset();
+	fz::sleep(fz::duration::from_milliseconds(50));
+	fz::scoped_lock l(handler.m_);
+	CPPUNIT_ASSERT(!handler.done_);
+}
+
+void crypto_test::test_signature_batch()
+{
+	std::vector<fz::private_signing_key> keys;
+	for (size_t i = 0; i < 3; ++i) {
+		keys.push_back(fz::private_signing_key::generate());
+	}
+
+	std::vector<std::vector<uint8_t>> messages;
+	std::vector<std::vector<uint8_t>> signatures;
+	for (size_t i = 0; i < 100; ++i) {
+		messages.push_back(fz::random_bytes(1 + i));
+		signatures.push_back(fz::sign(messages.back(), keys[i % keys.size()], false));
+	}
+
+	std::vector<fz::signature_check> checks;
+	for (size_t i = 0; i < messages.size(); ++i) {
+		checks.push_back({messages[i].data(), messages[i].size(), signatures[i].data(), &keys[i % keys.size()].pubkey()});
+	}
+
+	fz::thread_pool pool(2);
+	CPPUNIT_ASSERT(fz::verify_batch(checks));
+	CPPUNIT_ASSERT(fz::verify_batch(checks, &pool));
+
+	// Wrong key, tampered message, missing key
+	checks[5].pub = &keys[0].pubkey();
+	messages[50][0] ^= 1;
+	checks[99].pub = nullptr;
+	for (auto * p : {static_cast<fz::thread_pool*>(nullptr), &pool}) {
+		CPPUNIT_ASSERT(!fz::verify_batch(checks, p));
+		for (size_t i = 0; i < checks.size(); ++i) {
+			CPPUNIT_ASSERT_EQUAL(i != 5 && i != 50 && i != 99, checks[i].valid);
+		}
+	}
+
+	std::vector<fz::signature_check> empty;
+	CPPUNIT_ASSERT(fz::verify_batch(empty, &pool));
+}
+
+void crypto_test::test_jws()
+{
+	auto const [priv, pub] = fz::create_jwk();
+	CPPUNIT_ASSERT(priv && pub);
+
+	fz::json payload;
+	payload["hello"] = "world";
+	auto const jws = fz::jws_sign_flattened(priv, payload);
+	CPPUNIT_ASSERT(jws);
+
+	fz::json out;
+	CPPUNIT_ASSERT(fz::jws_verify_flattened(jws, pub, &out));
+	CPPUNIT_ASSERT_EQUAL(std::string("world"), out["hello"].string_value());
+
+	auto const key = fz::jwk_verification_key::from_jwk(pub);
+	CPPUNIT_ASSERT(key);
+	CPPUNIT_ASSERT_EQUAL(fz::jwk_thumbprint(pub), key.thumbprint());
+	CPPUNIT_ASSERT_EQUAL(size_t(43), key.thumbprint().size());
+	CPPUNIT_ASSERT(fz::jws_verify_flattened(jws, key));
+
+	auto tampered = jws;
+	tampered["payload"] = fz::base64_encode(std::string("{\"hello\":\"moon\"}"), fz::base64_type::url, false);
+	CPPUNIT_ASSERT(!fz::jws_verify_flattened(tampered, key));
+
+	auto const [priv2, pub2] = fz::create_jwk();
+	CPPUNIT_ASSERT(!fz::jws_verify_flattened(jws, pub2));
+	CPPUNIT_ASSERT(fz::jwk_thumbprint(pub) != fz::jwk_thumbprint(pub2));
+
+	// Not a point on the curve
+	auto bad = pub;
+	bad["x"] = pub2["x"];
+	CPPUNIT_ASSERT(!fz::jwk_verification_key::from_jwk(bad));
+
+	fz::jwk_cache cache(1);
+	auto cached = cache.get(pub);
+	CPPUNIT_ASSERT(cached && cached.thumbprint() == key.thumbprint());
+	CPPUNIT_ASSERT(cache.find(key.thumbprint()));
+	CPPUNIT_ASSERT(cache.get(pub2));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), cache.size());
+	CPPUNIT_ASSERT(!cache.find(key.thumbprint()));
+	CPPUNIT_ASSERT(cache.find(fz::jwk_thumbprint(pub2)));
+	CPPUNIT_ASSERT(!cache.get(bad));
+}
+
+void crypto_test::test_jws_signing_key()
+{
+	auto const [priv, pub] = fz::create_jwk();
+
+	fz::json extra;
+	extra["nonce"] = "abc";
+	auto const key = fz::jwk_signing_key::from_jwk(priv, extra);
+	CPPUNIT_ASSERT(key);
+	CPPUNIT_ASSERT_EQUAL(pub["x"].string_value(), key.public_jwk()["x"].string_value());
+	CPPUNIT_ASSERT_EQUAL(pub["y"].string_value(), key.public_jwk()["y"].string_value());
+	CPPUNIT_ASSERT_EQUAL(fz::jwk_thumbprint(pub), key.thumbprint());
+
+	fz::json payload;
+	payload["hello"] = "world";
+	auto const jws = fz::jws_sign_flattened(key, payload);
+	fz::json out;
+	CPPUNIT_ASSERT(fz::jws_verify_flattened(jws, pub, &out));
+	CPPUNIT_ASSERT_EQUAL(std::string("world"), out["hello"].string_value());
+
+	auto const prot = fz::json::parse(fz::base64_decode_s(jws["protected"].string_value()));
+	CPPUNIT_ASSERT_EQUAL(std::string("abc"), prot["nonce"].string_value());
+	CPPUNIT_ASSERT_EQUAL(std::string("ES256"), prot["alg"].string_value());
+
+	// Same protected header as with the unparsed key
+	CPPUNIT_ASSERT_EQUAL(jws["protected"].string_value(), fz::jws_sign_flattened(priv, payload, extra)["protected"].string_value());
+
+	fz::json bad;
+	bad["kty"] = "EC";
+	bad["crv"] = "P-256";
+	CPPUNIT_ASSERT(!fz::jwk_signing_key::from_jwk(bad));
+	CPPUNIT_ASSERT(!fz::jwk_signing_key::from_jwk(pub));
+	CPPUNIT_ASSERT(!fz::jws_sign_flattened(fz::jwk_signing_key(), payload));
+
+	fz::thread_pool pool(4);
+	std::vector<fz::json> payloads(37);
+	for (size_t i = 0; i < payloads.size(); ++i) {
+		payloads[i]["i"] = static_cast<uint64_t>(i);
+	}
+	auto const signatures = fz::jws_sign_flattened(key, payloads, pool);
+	CPPUNIT_ASSERT_EQUAL(payloads.size(), signatures.size());
+	auto const verification_key = fz::jwk_verification_key::from_jwk(pub);
+	for (size_t i = 0; i < signatures.size(); ++i) {
+		CPPUNIT_ASSERT(fz::jws_verify_flattened(signatures[i], verification_key, &out));
+		CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(i), out["i"].number_value<uint64_t>());
+	}
 }
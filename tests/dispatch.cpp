@@ -8,6 +8,7 @@ class DispatchTest final : public CppUnit::TestFixture
 	CPPUNIT_TEST(testSingle);
 	CPPUNIT_TEST(testArgs);
 	CPPUNIT_TEST(testMultiple);
+	CPPUNIT_TEST(testTable);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -17,6 +18,7 @@ public:
 	void testSingle();
 	void testArgs();
 	void testMultiple();
+	void testTable();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(DispatchTest);
@@ -50,6 +52,12 @@ typedef fz::simple_event<type3> T3;
 
 struct type4;
 typedef fz::simple_event<type4, int, int> T4;
+
+struct type5;
+typedef fz::simple_event<type5> T5;
+
+struct type6;
+typedef fz::simple_event<type6> T6;
 }
 
 void DispatchTest::testSingle()
@@ -104,3 +112,34 @@ void DispatchTest::testMultiple()
 	CPPUNIT_ASSERT_EQUAL(t.a_, 4);
 	CPPUNIT_ASSERT_EQUAL(t.b_, 9);
 }
+
+void DispatchTest::testTable()
+{
+	dispatch_target t;
+
+	T1 const t1{};
+	T2 const t2{};
+	T3 const t3{};
+	T4 const t4(3, 8);
+	T5 const t5{};
+	T6 const t6{};
+
+	// Enough types to go through the dispatch table
+	auto const d = [&t](fz::event_base const& ev) {
+		return fz::dispatch<T1, T2, T3, T4, T2>(ev, &t, &dispatch_target::a, &dispatch_target::b, &dispatch_target::c, &dispatch_target::two, &dispatch_target::a);
+	};
+
+	CPPUNIT_ASSERT(d(t1));
+	CPPUNIT_ASSERT(d(t2));
+	CPPUNIT_ASSERT(d(t3));
+	CPPUNIT_ASSERT(d(t4));
+
+	// Types not in the list, with ids beyond the end of the table
+	CPPUNIT_ASSERT(!d(t5));
+	CPPUNIT_ASSERT(!d(t6));
+
+	// First match wins for duplicates
+	CPPUNIT_ASSERT_EQUAL(t.a_, 4);
+	CPPUNIT_ASSERT_EQUAL(t.b_, 9);
+	CPPUNIT_ASSERT_EQUAL(t.c_, 1);
+}
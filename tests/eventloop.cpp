@@ -1,8 +1,22 @@
 #include "../lib/libfilezilla/event_handler.hpp"
 #include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/event_loop_group.hpp"
+#include "../lib/libfilezilla/logger.hpp"
+#include "../lib/libfilezilla/thread.hpp"
+#include "../lib/libfilezilla/util.hpp"
 
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#ifndef FZ_WINDOWS
+#include <poll.h>
+#endif
+
 class EventloopTest final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(EventloopTest);
@@ -10,6 +24,17 @@ class EventloopTest final : public CppUnit::TestFixture
 	CPPUNIT_TEST(testFilter);
 	CPPUNIT_TEST(testCondition);
 	CPPUNIT_TEST(testTimer);
+	CPPUNIT_TEST(testTimerChurn);
+	CPPUNIT_TEST(testMultiProducer);
+	CPPUNIT_TEST(testCoalescing);
+	CPPUNIT_TEST(testAllocation);
+	CPPUNIT_TEST(testGroup);
+	CPPUNIT_TEST(testMigrate);
+	CPPUNIT_TEST(testInstrumentation);
+	CPPUNIT_TEST(testEmbedded);
+	CPPUNIT_TEST(testTimerSlack);
+	CPPUNIT_TEST(testPriority);
+	CPPUNIT_TEST(testRemoveHandler);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -20,6 +45,17 @@ public:
 	void testFilter();
 	void testCondition();
 	void testTimer();
+	void testTimerChurn();
+	void testMultiProducer();
+	void testCoalescing();
+	void testAllocation();
+	void testGroup();
+	void testMigrate();
+	void testInstrumentation();
+	void testEmbedded();
+	void testTimerSlack();
+	void testPriority();
+	void testRemoveHandler();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(EventloopTest);
@@ -254,3 +290,761 @@ void EventloopTest::testTimer()
 
 	CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(1)));
 }
+
+namespace {
+class churn_handler final : public fz::event_handler
+{
+public:
+	churn_handler(fz::event_loop & l)
+	: fz::event_handler(l)
+	{}
+
+	virtual ~churn_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		CPPUNIT_ASSERT(fz::dispatch<fz::timer_event>(ev, this, &churn_handler::on_timer));
+	}
+
+	void on_timer(fz::timer_id const& id)
+	{
+		fz::scoped_lock l(m_);
+		fired_.insert(id);
+		if (expected_.erase(id) && expected_.empty()) {
+			cond_.signal(l);
+		}
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+
+	std::set<fz::timer_id> expected_;
+	std::set<fz::timer_id> fired_;
+};
+}
+
+void EventloopTest::testTimerChurn()
+{
+	fz::event_loop loop;
+
+	churn_handler handler(loop);
+
+	std::set<fz::timer_id> stopped;
+
+	{
+		fz::scoped_lock l(handler.m_);
+
+		auto const now = fz::monotonic_clock::now();
+		for (int i = 0; i < 1000; ++i) {
+			auto const deadline = now + fz::duration::from_milliseconds(50 + (i * 7919) % 200);
+			fz::timer_id id = handler.add_timer(deadline);
+			CPPUNIT_ASSERT(id);
+			if (i % 3 == 0) {
+				handler.stop_timer(id);
+				stopped.insert(id);
+			}
+			else if (i % 3 == 1) {
+				// Re-arm, the old id becomes invalid
+				fz::timer_id id2 = handler.stop_add_timer(id, deadline + fz::duration::from_milliseconds(10));
+				CPPUNIT_ASSERT(id2 && id2 != id);
+				stopped.insert(id);
+				handler.expected_.insert(id2);
+			}
+			else {
+				handler.expected_.insert(id);
+			}
+		}
+
+		CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(10)));
+		CPPUNIT_ASSERT(handler.expected_.empty());
+	}
+
+	// Give stopped timers a chance to misfire
+	fz::sleep(fz::duration::from_milliseconds(50));
+
+	fz::scoped_lock l(handler.m_);
+	for (auto const& id : stopped) {
+		CPPUNIT_ASSERT(!handler.fired_.count(id));
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(666), handler.fired_.size());
+}
+
+namespace {
+struct producer_event_type;
+typedef fz::simple_event<producer_event_type, size_t, size_t> producer_event;
+
+class producer_handler final : public fz::event_handler
+{
+public:
+	producer_handler(fz::event_loop & l, size_t producers, size_t count)
+	: fz::event_handler(l)
+	, next_(producers)
+	, remaining_(producers * count)
+	{}
+
+	virtual ~producer_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		CPPUNIT_ASSERT(fz::dispatch<producer_event>(ev, this, &producer_handler::on_event));
+	}
+
+	void on_event(size_t producer, size_t seq)
+	{
+		// Events from the same producer arrive in order
+		if (next_[producer] != seq) {
+			ordered_ = false;
+		}
+		next_[producer] = seq + 1;
+
+		if (!--remaining_) {
+			fz::scoped_lock l(m_);
+			cond_.signal(l);
+		}
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+
+	std::vector<size_t> next_;
+	size_t remaining_{};
+	bool ordered_{true};
+};
+}
+
+void EventloopTest::testMultiProducer()
+{
+	size_t const producers = 4;
+	size_t const count = 20000;
+
+	fz::event_loop loop;
+	producer_handler handler(loop, producers, count);
+
+	fz::scoped_lock l(handler.m_);
+
+	std::vector<std::unique_ptr<fz::thread>> threads;
+	for (size_t i = 0; i < producers; ++i) {
+		threads.emplace_back(std::make_unique<fz::thread>());
+		threads.back()->run([&handler, i, count]() {
+			for (size_t seq = 0; seq < count; ++seq) {
+				handler.send_event<producer_event>(i, seq);
+			}
+		});
+	}
+
+	CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(30)));
+	l.unlock();
+
+	for (auto & t : threads) {
+		t->join();
+	}
+
+	CPPUNIT_ASSERT(handler.ordered_);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), handler.remaining_);
+}
+
+namespace {
+struct block_event_type;
+typedef fz::simple_event<block_event_type> block_event;
+
+struct done_event_type;
+typedef fz::simple_event<done_event_type> done_event;
+
+struct coalesce_event_type;
+typedef fz::coalescing_event<coalesce_event_type, void, int> coalesce_event;
+
+class coalesce_handler final : public fz::event_handler
+{
+public:
+	coalesce_handler(fz::event_loop & l)
+	: fz::event_handler(l)
+	{}
+
+	virtual ~coalesce_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		CPPUNIT_ASSERT((fz::dispatch<block_event, coalesce_event, done_event>(ev, this, &coalesce_handler::on_block, &coalesce_handler::on_coalesce, &coalesce_handler::on_done)));
+	}
+
+	void on_block()
+	{
+		{
+			fz::scoped_lock l(m_);
+			entered_.signal(l);
+		}
+		fz::scoped_lock l(release_m_);
+		release_.wait(l);
+	}
+
+	void on_coalesce(void* source, int flags)
+	{
+		received_.emplace_back(source, flags);
+	}
+
+	void on_done()
+	{
+		fz::scoped_lock l(m_);
+		done_.signal(l);
+	}
+
+	fz::mutex m_;
+	fz::condition entered_;
+	fz::condition done_;
+
+	fz::mutex release_m_;
+	fz::condition release_;
+
+	std::vector<std::pair<void*, int>> received_;
+};
+}
+
+void EventloopTest::testCoalescing()
+{
+	fz::event_loop loop;
+	coalesce_handler handler(loop);
+
+	int a{};
+	int b{};
+
+	fz::scoped_lock l(handler.m_);
+
+	// Keep the loop busy so that the following events all stay queued
+	handler.send_event<block_event>();
+	CPPUNIT_ASSERT(handler.entered_.wait(l, fz::duration::from_seconds(30)));
+
+	handler.send_event<coalesce_event>(&a, 1);
+	handler.send_event<coalesce_event>(&b, 8);
+	handler.send_event<coalesce_event>(&a, 2);
+	handler.send_event<coalesce_event>(&a, 4);
+	handler.send_event<done_event>();
+
+	{
+		fz::scoped_lock rl(handler.release_m_);
+		handler.release_.signal(rl);
+	}
+
+	CPPUNIT_ASSERT(handler.done_.wait(l, fz::duration::from_seconds(30)));
+
+	CPPUNIT_ASSERT_EQUAL(size_t(2), handler.received_.size());
+	CPPUNIT_ASSERT(handler.received_[0].first == &a);
+	CPPUNIT_ASSERT_EQUAL(7, handler.received_[0].second);
+	CPPUNIT_ASSERT(handler.received_[1].first == &b);
+	CPPUNIT_ASSERT_EQUAL(8, handler.received_[1].second);
+
+	// Once dispatched, events no longer coalesce
+	handler.received_.clear();
+	handler.send_event<coalesce_event>(&a, 1);
+	handler.send_event<done_event>();
+	CPPUNIT_ASSERT(handler.done_.wait(l, fz::duration::from_seconds(30)));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), handler.received_.size());
+	CPPUNIT_ASSERT_EQUAL(1, handler.received_[0].second);
+}
+
+void EventloopTest::testAllocation()
+{
+	// Recycling within the same thread
+	delete new T1;
+
+	auto const before = fz::get_event_allocation_stats();
+	for (int i = 0; i < 1000; ++i) {
+		delete new T1;
+	}
+	auto const after = fz::get_event_allocation_stats();
+
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1000), after.allocations - before.allocations);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1000), after.cache_hits - before.cache_hits);
+
+	// Events freed in another thread flow back in batches
+	std::vector<fz::event_base*> events;
+	for (int i = 0; i < 1000; ++i) {
+		events.push_back(new producer_event(0, i));
+	}
+
+	fz::thread t;
+	t.run([&events]() {
+		for (auto * ev : events) {
+			delete ev;
+		}
+	});
+	t.join();
+
+	auto const freed = fz::get_event_allocation_stats();
+	for (int i = 0; i < 1000; ++i) {
+		events[i] = new producer_event(0, i);
+	}
+	auto const reused = fz::get_event_allocation_stats();
+	for (auto * ev : events) {
+		delete ev;
+	}
+
+	// All but the last few hundred blocks of the other thread have been handed over
+	CPPUNIT_ASSERT(reused.cache_hits - freed.cache_hits >= 700);
+}
+
+void EventloopTest::testGroup()
+{
+	fz::event_loop_group group(3);
+	CPPUNIT_ASSERT_EQUAL(size_t(3), group.size());
+
+	std::set<fz::event_loop*> loops;
+	for (size_t i = 0; i < group.size(); ++i) {
+		loops.insert(&group.assign());
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(3), loops.size());
+
+	CPPUNIT_ASSERT(&group.assign(42) == &group.assign(42));
+
+	fz::event_loop_group balanced(2, fz::event_loop_group::policy::least_loaded);
+	target t1(balanced.assign());
+	target t2(balanced.assign());
+	CPPUNIT_ASSERT(&t1.get_event_loop() != &t2.get_event_loop());
+	CPPUNIT_ASSERT_EQUAL(size_t(1), balanced[0].handler_count());
+	CPPUNIT_ASSERT_EQUAL(size_t(1), balanced[1].handler_count());
+}
+
+void EventloopTest::testMigrate()
+{
+	fz::event_loop_group group(2);
+
+	size_t const count = 10000;
+	producer_handler handler(group[0], 1, count);
+
+	fz::scoped_lock l(handler.m_);
+
+	size_t seq = 0;
+	for (; seq < count / 2; ++seq) {
+		handler.send_event<producer_event>(0, seq);
+	}
+
+	// Fails while the handler is in its callback
+	while (!group.migrate(handler, group[1])) {
+		fz::yield();
+	}
+	CPPUNIT_ASSERT(&handler.get_event_loop() == &group[1]);
+	CPPUNIT_ASSERT(&handler.event_loop_ == &group[0]);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), group[0].handler_count());
+	CPPUNIT_ASSERT_EQUAL(size_t(1), group[1].handler_count());
+
+	for (; seq < count; ++seq) {
+		handler.send_event<producer_event>(0, seq);
+	}
+
+	CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(30)));
+	l.unlock();
+
+	CPPUNIT_ASSERT(handler.ordered_);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), handler.remaining_);
+
+	// Handlers with timers cannot be migrated
+	fz::timer_id id = handler.add_timer(fz::duration::from_seconds(60), true);
+	CPPUNIT_ASSERT(!group.migrate(handler, group[0]));
+	handler.stop_timer(id);
+
+	// The handler might still be in the callback that signalled the condition
+	while (!group.migrate(handler, group[0])) {
+		fz::yield();
+	}
+	CPPUNIT_ASSERT(&handler.get_event_loop() == &group[0]);
+}
+
+namespace {
+struct slow_event_type;
+typedef fz::simple_event<slow_event_type, int> slow_event;
+
+class slow_handler final : public fz::event_handler
+{
+public:
+	slow_handler(fz::event_loop & l)
+	: fz::event_handler(l)
+	{}
+
+	virtual ~slow_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		CPPUNIT_ASSERT((fz::dispatch<slow_event, T1>(ev, this, &slow_handler::on_slow, &slow_handler::on_done)));
+	}
+
+	void on_slow(int ms)
+	{
+		fz::sleep(fz::duration::from_milliseconds(ms));
+	}
+
+	void on_done()
+	{
+		fz::scoped_lock l(m_);
+		cond_.signal(l);
+	}
+
+	fz::mutex m_;
+	fz::condition cond_;
+};
+
+class counting_logger final : public fz::logger_interface
+{
+public:
+	counting_logger()
+	{
+		enable(fz::logmsg::debug_warning);
+	}
+
+	virtual void do_log(fz::logmsg::type, std::wstring &&) override {
+		++count_;
+	}
+
+	std::atomic<int> count_{};
+};
+}
+
+void EventloopTest::testInstrumentation()
+{
+	fz::event_loop loop;
+	counting_logger logger;
+	loop.enable_instrumentation(true, fz::duration::from_milliseconds(20), &logger);
+
+	slow_handler handler(loop);
+
+	fz::scoped_lock l(handler.m_);
+	handler.send_event<slow_event>(50);
+	for (int i = 0; i < 10; ++i) {
+		handler.send_event<slow_event>(0);
+	}
+	handler.send_event<T1>();
+	CPPUNIT_ASSERT(handler.cond_.wait(l, fz::duration::from_seconds(30)));
+	l.unlock();
+
+	auto stats = loop.get_stats();
+	CPPUNIT_ASSERT(stats.peak_pending >= 1);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), stats.slow);
+	CPPUNIT_ASSERT_EQUAL(1, logger.count_.load());
+
+	auto const& slow = stats.types[slow_event::type()];
+	CPPUNIT_ASSERT_EQUAL(uint64_t(11), slow.run_time.count);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(11), slow.queue_delay.count);
+	CPPUNIT_ASSERT(slow.run_time.max_us >= 50000);
+	CPPUNIT_ASSERT(slow.run_time.percentile(1.0) >= 50000);
+
+	// The events queued behind the slow one waited for it
+	CPPUNIT_ASSERT(slow.queue_delay.max_us >= 40000);
+
+	loop.enable_instrumentation(false);
+	loop.reset_stats();
+	CPPUNIT_ASSERT(loop.get_stats().types.empty());
+}
+
+namespace {
+class embedded_handler final : public fz::event_handler
+{
+public:
+	embedded_handler(fz::event_loop & l)
+	: fz::event_handler(l)
+	{}
+
+	virtual ~embedded_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		// Everything runs in the thread calling process
+		CPPUNIT_ASSERT(event_loop_.dispatching(*this));
+		CPPUNIT_ASSERT((fz::dispatch<T1, fz::timer_event>(ev, this, &embedded_handler::on_t1, &embedded_handler::on_timer)));
+	}
+
+	void on_t1()
+	{
+		++events_;
+	}
+
+	void on_timer(fz::timer_id)
+	{
+		++timers_;
+	}
+
+	int events_{};
+	int timers_{};
+};
+
+#ifndef FZ_WINDOWS
+bool readable(fz::event_loop & loop, fz::duration const& timeout = fz::duration())
+{
+	pollfd p{};
+	p.fd = loop.wakeup_fd();
+	p.events = POLLIN;
+	return poll(&p, 1, static_cast<int>(timeout.get_milliseconds())) == 1;
+}
+#endif
+}
+
+void EventloopTest::testEmbedded()
+{
+#ifndef FZ_WINDOWS
+	fz::event_loop loop(fz::event_loop::embedded);
+	CPPUNIT_ASSERT(loop.running());
+	CPPUNIT_ASSERT(loop.wakeup_fd() != -1);
+
+	embedded_handler handler(loop);
+	CPPUNIT_ASSERT(!readable(loop));
+	CPPUNIT_ASSERT_EQUAL(size_t(0), loop.process());
+
+	// Events sent from other threads wake up the host
+	{
+		fz::thread t;
+		t.run([&handler]{ handler.send_event<T1>(); });
+	}
+	CPPUNIT_ASSERT(readable(loop, fz::duration::from_seconds(10)));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), loop.process());
+	CPPUNIT_ASSERT_EQUAL(1, handler.events_);
+	CPPUNIT_ASSERT(!readable(loop));
+
+	// With a limit, the descriptor stays readable until everything has been processed
+	for (int i = 0; i < 3; ++i) {
+		handler.send_event<T1>();
+	}
+	CPPUNIT_ASSERT(readable(loop));
+	CPPUNIT_ASSERT_EQUAL(size_t(1), loop.process(1));
+	CPPUNIT_ASSERT(readable(loop));
+	CPPUNIT_ASSERT_EQUAL(size_t(2), loop.process());
+	CPPUNIT_ASSERT_EQUAL(4, handler.events_);
+	CPPUNIT_ASSERT(!readable(loop));
+
+	// Timers are driven by the host's poll timeout
+	CPPUNIT_ASSERT(!loop.next_deadline());
+	handler.add_timer(fz::duration::from_milliseconds(50), true);
+	CPPUNIT_ASSERT(readable(loop));
+	CPPUNIT_ASSERT_EQUAL(size_t(0), loop.process());
+	CPPUNIT_ASSERT(loop.next_deadline());
+	while (!handler.timers_) {
+		auto const timeout = loop.next_deadline() - fz::monotonic_clock::now() + fz::duration::from_milliseconds(1);
+		readable(loop, std::max(timeout, fz::duration()));
+		loop.process();
+	}
+	CPPUNIT_ASSERT_EQUAL(1, handler.timers_);
+	CPPUNIT_ASSERT(!loop.next_deadline());
+
+	loop.stop();
+	CPPUNIT_ASSERT(readable(loop));
+	CPPUNIT_ASSERT(!loop.running());
+	handler.send_event<T1>();
+	CPPUNIT_ASSERT_EQUAL(size_t(0), loop.process());
+#endif
+}
+
+namespace {
+class slack_handler final : public fz::event_handler
+{
+public:
+	slack_handler(fz::event_loop & l)
+	: fz::event_handler(l)
+	{}
+
+	virtual ~slack_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		CPPUNIT_ASSERT((fz::dispatch<fz::timer_event>(ev, this, &slack_handler::on_timer)));
+	}
+
+	void on_timer(fz::timer_id id)
+	{
+		fired_[id] = fz::monotonic_clock::now();
+	}
+
+	std::map<fz::timer_id, fz::monotonic_clock> fired_;
+};
+}
+
+void EventloopTest::testTimerSlack()
+{
+	// Embedded, so that the wakeups can be counted
+	fz::event_loop loop(fz::event_loop::embedded);
+	slack_handler handler(loop);
+
+	auto const slack = fz::duration::from_milliseconds(200);
+	auto const start = fz::monotonic_clock::now() + fz::duration::from_milliseconds(20);
+
+	std::map<fz::timer_id, fz::monotonic_clock> requested;
+	for (int i = 0; i < 50; ++i) {
+		auto const deadline = start + fz::duration::from_milliseconds(i);
+		requested[handler.add_timer(deadline, fz::duration(), slack)] = deadline;
+	}
+
+	// Without slack, a timer fires at its deadline
+	auto const precise = start + fz::duration::from_milliseconds(10);
+	auto const precise_id = handler.add_timer(precise);
+
+	int wakeups{};
+	while (handler.fired_.size() < requested.size() + 1) {
+		auto const deadline = loop.next_deadline();
+		CPPUNIT_ASSERT(deadline);
+		auto const now = fz::monotonic_clock::now();
+		if (now < deadline) {
+			fz::sleep(deadline - now + fz::duration::from_milliseconds(1));
+		}
+		if (loop.process()) {
+			++wakeups;
+		}
+	}
+
+	// The deadlines span less than the granularity, that's at most two buckets plus the precise timer
+	CPPUNIT_ASSERT(wakeups <= 3);
+
+	for (auto const& r : requested) {
+		auto const& fired = handler.fired_[r.first];
+		CPPUNIT_ASSERT(fired >= r.second);
+		CPPUNIT_ASSERT(fired - r.second < slack + fz::duration::from_seconds(1));
+	}
+	CPPUNIT_ASSERT(handler.fired_[precise_id] >= precise);
+}
+
+namespace {
+class priority_handler final : public fz::event_handler
+{
+public:
+	priority_handler(fz::event_loop & l, fz::event_priority priority, std::vector<fz::event_priority> & order)
+	: fz::event_handler(l)
+	, order_(order)
+	{
+		set_priority(priority);
+	}
+
+	virtual ~priority_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const&) override {
+		order_.push_back(get_priority());
+	}
+
+	std::vector<fz::event_priority> & order_;
+};
+}
+
+void EventloopTest::testPriority()
+{
+	fz::event_loop loop(fz::event_loop::embedded);
+
+	std::vector<fz::event_priority> order;
+	priority_handler high(loop, fz::event_priority::high, order);
+	priority_handler normal(loop, fz::event_priority::normal, order);
+	priority_handler bulk(loop, fz::event_priority::bulk, order);
+
+	for (int i = 0; i < 100; ++i) {
+		bulk.send_event<T1>();
+	}
+	for (int i = 0; i < 50; ++i) {
+		normal.send_event<T1>();
+	}
+	for (int i = 0; i < 5; ++i) {
+		high.send_event<T1>();
+	}
+
+	CPPUNIT_ASSERT_EQUAL(size_t(155), loop.process());
+	CPPUNIT_ASSERT_EQUAL(size_t(155), order.size());
+
+	// Higher priorities go first
+	for (size_t i = 0; i < 5; ++i) {
+		CPPUNIT_ASSERT(order[i] == fz::event_priority::high);
+	}
+
+	// but bulk events do not starve entirely.
+	auto const last_normal = std::find(order.rbegin(), order.rend(), fz::event_priority::normal).base() - order.begin();
+	auto const bulk_before = std::count(order.begin(), order.begin() + last_normal, fz::event_priority::bulk);
+	CPPUNIT_ASSERT(bulk_before > 0);
+	CPPUNIT_ASSERT(bulk_before <= last_normal / 16);
+
+	// Changed priorities apply to newly sent events
+	order.clear();
+	high.set_priority(fz::event_priority::bulk);
+	high.send_event<T1>();
+	normal.send_event<T1>();
+	CPPUNIT_ASSERT_EQUAL(size_t(2), loop.process());
+	CPPUNIT_ASSERT(order[0] == fz::event_priority::normal);
+}
+
+namespace {
+class counting_handler final : public fz::event_handler
+{
+public:
+	using fz::event_handler::event_handler;
+
+	virtual ~counting_handler()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override {
+		if (ev.derived_type() == fz::timer_event::type()) {
+			++timers_;
+		}
+		else {
+			++events_;
+		}
+	}
+
+	size_t events_{};
+	size_t timers_{};
+};
+}
+
+void EventloopTest::testRemoveHandler()
+{
+	fz::event_loop loop(fz::event_loop::embedded);
+
+	counting_handler keep(loop);
+	auto gone = std::make_unique<counting_handler>(loop);
+	auto other = std::make_unique<counting_handler>(loop);
+	other->set_priority(fz::event_priority::bulk);
+
+	for (int i = 0; i < 100; ++i) {
+		keep.send_event<T1>();
+		gone->send_event<T1>();
+		other->send_event<T1>();
+	}
+	auto const now = fz::monotonic_clock::now();
+	std::vector<fz::timer_id> gone_timers;
+	for (int i = 0; i < 10; ++i) {
+		keep.add_timer(now + fz::duration::from_milliseconds(i));
+		gone_timers.push_back(gone->add_timer(now + fz::duration::from_milliseconds(i), fz::duration::from_milliseconds(1)));
+	}
+	fz::timer_id const rearmed = gone->add_timer(now + fz::duration::from_seconds(60));
+	CPPUNIT_ASSERT(gone->stop_add_timer(rearmed, now + fz::duration::from_seconds(30)));
+
+	// Stopping timers in the middle reorders the handler's own list of timers
+	gone->stop_timer(gone_timers[3]);
+	gone->stop_timer(gone_timers[0]);
+	CPPUNIT_ASSERT(gone->stop_add_timer(gone_timers[9], now + fz::duration::from_seconds(30)));
+
+	// Leaves the events of the other handlers in place
+	gone.reset();
+	CPPUNIT_ASSERT_EQUAL(size_t(200), loop.get_stats().pending);
+
+	// Dispatch some, then remove a handler whose events are all behind others
+	CPPUNIT_ASSERT_EQUAL(size_t(50), loop.process(50));
+	other.reset();
+
+	// Only the remaining handler's one-shot timers are left besides its events
+	fz::sleep(fz::duration::from_milliseconds(20));
+	loop.process();
+	CPPUNIT_ASSERT_EQUAL(size_t(100), keep.events_);
+	CPPUNIT_ASSERT_EQUAL(size_t(10), keep.timers_);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), loop.get_stats().pending);
+	CPPUNIT_ASSERT(!loop.next_deadline());
+
+	// Events queued afterwards are unaffected
+	keep.send_event<T1>();
+	CPPUNIT_ASSERT_EQUAL(size_t(1), loop.process());
+	CPPUNIT_ASSERT_EQUAL(size_t(101), keep.events_);
+}
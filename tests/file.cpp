@@ -0,0 +1,583 @@
+#include "../lib/libfilezilla/dir_cache.hpp"
+#include "../lib/libfilezilla/file.hpp"
+#include "../lib/libfilezilla/local_filesys.hpp"
+#include "../lib/libfilezilla/path_builder.hpp"
+#include "../lib/libfilezilla/recursive_remove.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/tree_walker.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include "test_utils.hpp"
+
+#include <algorithm>
+#include <map>
+#include <string>
+
+#include <string.h>
+
+#ifndef FZ_WINDOWS
+#include <unistd.h>
+#endif
+
+class file_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(file_test);
+	CPPUNIT_TEST(test_positional);
+	CPPUNIT_TEST(test_vectored);
+	CPPUNIT_TEST(test_sparse);
+	CPPUNIT_TEST(test_find_files);
+	CPPUNIT_TEST(test_copy_file);
+	CPPUNIT_TEST(test_path_builder);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_tree_walker);
+	CPPUNIT_TEST(test_dir_cache);
+	CPPUNIT_TEST(test_recursive_remove);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_positional();
+	void test_vectored();
+	void test_sparse();
+	void test_find_files();
+	void test_copy_file();
+	void test_path_builder();
+	void test_tree_walker();
+	void test_dir_cache();
+	void test_recursive_remove();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(file_test);
+
+#ifndef FZ_WINDOWS
+namespace {
+fz::native_string absolute_path(fz::native_string const& name)
+{
+	char cwd[4096];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		return {};
+	}
+	return fz::native_string(cwd) + "/" + name;
+}
+}
+#endif
+
+void file_test::test_positional()
+{
+	fz::native_string const name = fz::to_native(std::string("file_test_positional.tmp"));
+	{
+		fz::file f(name, fz::file::readwrite, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+
+		CPPUNIT_ASSERT(f.write_at("world", 5, 6) == 5);
+		CPPUNIT_ASSERT(f.write_at("hello ", 6, 0) == 6);
+		ASSERT_EQUAL(int64_t(11), f.size());
+
+		char buf[16]{};
+		CPPUNIT_ASSERT(f.read_at(buf, 5, 6) == 5);
+		ASSERT_EQUAL(std::string("world"), std::string(buf, 5));
+
+		CPPUNIT_ASSERT(f.read_at(buf, 16, 0) == 11);
+		ASSERT_EQUAL(std::string("hello world"), std::string(buf, 11));
+
+		// At and past the end
+		CPPUNIT_ASSERT(f.read_at(buf, 16, 11) == 0);
+		CPPUNIT_ASSERT(f.read_at(buf, 16, 100) == 0);
+	}
+	fz::remove_file(name);
+}
+
+void file_test::test_vectored()
+{
+	fz::native_string const name = fz::to_native(std::string("file_test_vectored.tmp"));
+	{
+		fz::file f(name, fz::file::readwrite, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+
+		fz::file::write_segment const out[] = {{"abc", 3}, {"", 0}, {"defgh", 5}};
+		CPPUNIT_ASSERT(f.writev_at(out, 3, 2) == 8);
+		ASSERT_EQUAL(int64_t(10), f.size());
+
+		char a[4]{};
+		char b[3]{};
+		char c[8]{};
+		fz::file::read_segment const in[] = {{a, 4}, {b, 3}, {c, 8}};
+		CPPUNIT_ASSERT(f.readv_at(in, 3, 1) == 9);
+		CPPUNIT_ASSERT(!memcmp(a, "\0abc", 4));
+		CPPUNIT_ASSERT(!memcmp(b, "def", 3));
+		CPPUNIT_ASSERT(!memcmp(c, "gh", 2));
+	}
+	fz::remove_file(name);
+}
+
+void file_test::test_sparse()
+{
+	fz::native_string const name = fz::to_native(std::string("file_test_sparse.tmp"));
+	{
+		fz::file f(name, fz::file::readwrite, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+
+		// Reserving space does not change the size
+		if (f.allocate(0, 1024 * 1024)) {
+			ASSERT_EQUAL(int64_t(0), f.size());
+		}
+
+		std::string const data(256 * 1024, 'x');
+		CPPUNIT_ASSERT(f.write_at(data.data(), static_cast<int64_t>(data.size()), 0) == static_cast<int64_t>(data.size()));
+		CPPUNIT_ASSERT(f.next_data(0) == 0);
+
+		if (f.punch_hole(64 * 1024, 64 * 1024)) {
+			ASSERT_EQUAL(int64_t(data.size()), f.size());
+
+			std::string read(64 * 1024, 'y');
+			CPPUNIT_ASSERT(f.read_at(read.data(), static_cast<int64_t>(read.size()), 64 * 1024) == static_cast<int64_t>(read.size()));
+			CPPUNIT_ASSERT(read == std::string(64 * 1024, '\0'));
+
+			int64_t const hole = f.next_hole(0);
+			CPPUNIT_ASSERT(hole == 64 * 1024 || hole == static_cast<int64_t>(data.size()));
+		}
+
+		// Past the end there is no data
+		CPPUNIT_ASSERT(f.next_data(static_cast<int64_t>(data.size())) == -1);
+		ASSERT_EQUAL(int64_t(data.size()), f.next_hole(static_cast<int64_t>(data.size())));
+	}
+	fz::remove_file(name);
+}
+
+void file_test::test_find_files()
+{
+	fz::native_string const name = fz::to_native(std::string("file_test_find_files.tmp"));
+	{
+		fz::file f(name, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write("hello", 5) == 5);
+	}
+
+	struct info
+	{
+		fz::local_filesys::type t{};
+		bool is_link{};
+		int64_t size{};
+		int mode{};
+	};
+
+	// The batched enumeration must give the same results as the classic one
+	for (bool dirs_only : {false, true}) {
+		std::map<fz::native_string, info> expected;
+		{
+			fz::local_filesys fs;
+			CPPUNIT_ASSERT(fs.begin_find_files(fz::to_native(std::string(".")), dirs_only));
+			fz::native_string n;
+			info i;
+			while (fs.get_next_file(n, i.is_link, i.t, &i.size, nullptr, &i.mode)) {
+				expected[n] = i;
+			}
+		}
+		CPPUNIT_ASSERT(dirs_only || expected.count(name));
+
+		std::map<fz::native_string, info> actual;
+		std::map<fz::native_string, fz::local_filesys::type> names;
+		{
+			fz::local_filesys fs;
+			CPPUNIT_ASSERT(fs.begin_find_files(fz::to_native(std::string(".")), dirs_only));
+			std::vector<fz::local_filesys::dir_entry> entries;
+			while (fs.get_next_files(entries, 3)) {
+				CPPUNIT_ASSERT(entries.size() <= 3);
+				for (auto const& e : entries) {
+					actual[e.name] = info{e.t, e.is_link, e.size, e.mode};
+				}
+			}
+			CPPUNIT_ASSERT(!fs.get_next_files(entries));
+			CPPUNIT_ASSERT(entries.empty());
+
+			// Names only
+			CPPUNIT_ASSERT(fs.begin_find_files(fz::to_native(std::string(".")), dirs_only));
+			while (fs.get_next_files(entries, 1024, fz::dir_entry_fields::none)) {
+				for (auto const& e : entries) {
+					names[e.name] = e.t;
+					CPPUNIT_ASSERT(e.size == -1);
+					CPPUNIT_ASSERT(e.mtime.empty());
+				}
+			}
+		}
+
+		ASSERT_EQUAL(expected.size(), actual.size());
+		ASSERT_EQUAL(expected.size(), names.size());
+		for (auto const& [n, i] : expected) {
+			auto const it = actual.find(n);
+			CPPUNIT_ASSERT(it != actual.cend());
+			CPPUNIT_ASSERT(names.count(n));
+			CPPUNIT_ASSERT(it->second.t == i.t);
+			CPPUNIT_ASSERT(it->second.is_link == i.is_link);
+			ASSERT_EQUAL(i.size, it->second.size);
+			ASSERT_EQUAL(i.mode, it->second.mode);
+			if (dirs_only) {
+				CPPUNIT_ASSERT(i.t == fz::local_filesys::dir);
+			}
+		}
+
+		if (!dirs_only) {
+			CPPUNIT_ASSERT(actual[name].t == fz::local_filesys::file);
+			ASSERT_EQUAL(int64_t(5), actual[name].size);
+		}
+	}
+
+	fz::remove_file(name);
+}
+
+void file_test::test_path_builder()
+{
+	fz::native_string const sep(1, fz::local_filesys::path_separator);
+
+	fz::path_builder p;
+	CPPUNIT_ASSERT(p.empty());
+	CPPUNIT_ASSERT(p.c_str() && !*p.c_str());
+
+	CPPUNIT_ASSERT(p.join(std::string_view("foo")));
+	CPPUNIT_ASSERT(p.join(std::wstring_view(L"bar")));
+	CPPUNIT_ASSERT(p.join(std::string_view("/baz")));
+	CPPUNIT_ASSERT(p.append(std::string_view(".txt")));
+	ASSERT_EQUAL(fzT("foo") + sep + fzT("bar") + sep + fzT("baz.txt"), p.str());
+	CPPUNIT_ASSERT(p.view() == fz::native_string_view(p.c_str()));
+
+	// No doubled separators, empty components add nothing
+	fz::path_builder dir(fz::native_string(fzT("dir")) + sep);
+	CPPUNIT_ASSERT(dir.join(std::string_view("")));
+	CPPUNIT_ASSERT(dir.join(std::string_view("a")));
+	ASSERT_EQUAL(fzT("dir") + sep + fzT("a"), dir.str());
+
+	// Reuse with a common prefix
+	size_t const prefix = dir.size() - 1;
+	dir.truncate(prefix);
+	CPPUNIT_ASSERT(dir.join(std::string_view("b")));
+	ASSERT_EQUAL(fzT("dir") + sep + fzT("b"), dir.str());
+
+	// Grows past the inline storage, copies and moves keep the contents
+	fz::native_string expected = fzT("root");
+	fz::path_builder big(expected);
+	for (size_t i = 0; i < 100; ++i) {
+		CPPUNIT_ASSERT(big.join(std::wstring_view(L"component")));
+		expected += sep + fzT("component");
+	}
+	ASSERT_EQUAL(expected, big.str());
+	fz::path_builder copy(big);
+	ASSERT_EQUAL(expected, copy.str());
+	fz::path_builder moved(std::move(big));
+	ASSERT_EQUAL(expected, moved.str());
+	moved = std::move(dir);
+	ASSERT_EQUAL(fzT("dir") + sep + fzT("b"), moved.str());
+
+#ifndef FZ_WINDOWS
+	// Paths cannot contain null characters
+	fz::path_builder invalid(fzT("a"));
+	CPPUNIT_ASSERT(!invalid.join(std::wstring_view(L"b\xe4\0c", 4)));
+	ASSERT_EQUAL(fz::native_string(fzT("a")), invalid.str());
+#endif
+
+	// Usable with the file functions
+	fz::path_builder name(fzT("."));
+	CPPUNIT_ASSERT(name.join(std::string_view("file_test_path_builder.tmp")));
+	{
+		fz::file f(name, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+		CPPUNIT_ASSERT(f.write("hello", 5) == 5);
+	}
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(name) == fz::local_filesys::file);
+	ASSERT_EQUAL(int64_t(5), fz::local_filesys::get_size(name));
+	CPPUNIT_ASSERT(fz::remove_file(name));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(name) == fz::local_filesys::unknown);
+
+	name.truncate(1);
+	name.append(sep);
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(name) == fz::local_filesys::dir);
+}
+
+void file_test::test_tree_walker()
+{
+#ifndef FZ_WINDOWS
+	fz::native_string const root = absolute_path("file_test_tree.tmp");
+	CPPUNIT_ASSERT(!root.empty());
+
+	// Three levels of three subdirectories, each directory containing two files
+	size_t dirs{};
+	size_t files{};
+	std::vector<fz::native_string> level{root};
+	for (int depth = 0; depth < 4; ++depth) {
+		std::vector<fz::native_string> next;
+		for (auto const& dir : level) {
+			CPPUNIT_ASSERT(fz::mkdir(dir, true));
+			++dirs;
+			for (int i = 0; i < 2; ++i) {
+				fz::file f(dir + "/file" + fz::to_native(fz::to_string(i)), fz::file::writing, fz::file::empty);
+				CPPUNIT_ASSERT(f.write("data", 4) == 4);
+				++files;
+			}
+			if (depth < 3) {
+				for (int i = 0; i < 3; ++i) {
+					next.push_back(dir + "/dir" + fz::to_native(fz::to_string(i)));
+				}
+			}
+		}
+		level = std::move(next);
+	}
+
+	fz::thread_pool pool;
+
+	fz::mutex m;
+	std::map<fz::native_string, size_t> entered;
+	std::vector<fz::native_string> left;
+	size_t seen_files{};
+	auto const on_entries = [&](fz::native_string const& path, std::vector<fz::local_filesys::dir_entry> const& entries) {
+		fz::scoped_lock l(m);
+		entered[path] = entries.size();
+		for (auto const& e : entries) {
+			if (e.t == fz::local_filesys::file) {
+				++seen_files;
+				CPPUNIT_ASSERT(e.size == 4);
+			}
+		}
+		return true;
+	};
+	auto const on_leave = [&](fz::native_string const& path) {
+		fz::scoped_lock l(m);
+		CPPUNIT_ASSERT(entered.count(path));
+		left.push_back(path);
+		return true;
+	};
+
+	fz::tree_walker walker(pool, 4);
+	CPPUNIT_ASSERT(walker.walk({root}, on_entries, on_leave, fz::dir_entry_fields::size));
+	ASSERT_EQUAL(dirs, entered.size());
+	ASSERT_EQUAL(dirs, left.size());
+	ASSERT_EQUAL(files, seen_files);
+
+	// Children are left before their parents
+	for (size_t i = 0; i < left.size(); ++i) {
+		auto const parent = left[i].substr(0, left[i].rfind('/'));
+		auto const it = std::find(left.cbegin(), left.cend(), parent);
+		if (left[i] == root) {
+			CPPUNIT_ASSERT(i + 1 == left.size());
+		}
+		else {
+			CPPUNIT_ASSERT(it != left.cend() && static_cast<size_t>(it - left.cbegin()) > i);
+		}
+	}
+
+	// Aborting
+	size_t calls{};
+	CPPUNIT_ASSERT(!walker.walk({root}, [&](fz::native_string const&, std::vector<fz::local_filesys::dir_entry> const&) {
+		fz::scoped_lock l(m);
+		++calls;
+		return false;
+	}));
+	CPPUNIT_ASSERT(calls == 1);
+
+	fz::recursive_remove r;
+	CPPUNIT_ASSERT(r.remove(root, pool));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(root) == fz::local_filesys::unknown);
+#endif
+}
+
+void file_test::test_dir_cache()
+{
+#ifndef FZ_WINDOWS
+	fz::native_string const root = absolute_path("file_test_dir_cache.tmp");
+	CPPUNIT_ASSERT(fz::mkdir(root, false));
+
+	auto const write = [&](char const* name, std::string const& data) {
+		fz::file f(root + "/" + name, fz::file::writing, fz::file::empty);
+		return f.write(data.c_str(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size());
+	};
+	CPPUNIT_ASSERT(write("a", "foo"));
+
+	fz::thread_pool pool;
+	{
+		fz::dir_cache cache(pool);
+
+		fz::dir_cache::listing l1;
+		CPPUNIT_ASSERT(cache.get(root, l1));
+		CPPUNIT_ASSERT(l1 && l1->size() == 1);
+		ASSERT_EQUAL(int64_t(3), (*l1)[0].size);
+
+		fz::dir_cache::listing l2;
+		CPPUNIT_ASSERT(cache.get(root + "/", l2));
+		CPPUNIT_ASSERT(l2 && l2->size() == 1);
+		CPPUNIT_ASSERT((l1 == l2) == cache.watching());
+
+		// Changes show up once the notifications have been processed
+		auto const wait_for = [&](auto const& pred) {
+			for (int i = 0; i < 500; ++i) {
+				fz::dir_cache::listing l;
+				if (cache.get(root, l) && pred(*l)) {
+					return true;
+				}
+				fz::sleep(fz::duration::from_milliseconds(10));
+			}
+			return false;
+		};
+		CPPUNIT_ASSERT(write("b", "bar"));
+		CPPUNIT_ASSERT(wait_for([](auto const& l) { return l.size() == 2; }));
+
+		CPPUNIT_ASSERT(write("a", "foobar"));
+		CPPUNIT_ASSERT(wait_for([](auto const& l) {
+			for (auto const& e : l) {
+				if (e.name == "a") {
+					return e.size == 6;
+				}
+			}
+			return false;
+		}));
+
+		CPPUNIT_ASSERT(fz::remove_file(root + "/b"));
+		CPPUNIT_ASSERT(wait_for([](auto const& l) { return l.size() == 1; }));
+
+		// Explicit invalidation
+		CPPUNIT_ASSERT(cache.get(root, l1));
+		cache.invalidate(root);
+		CPPUNIT_ASSERT(cache.get(root, l2));
+		CPPUNIT_ASSERT(l1 != l2);
+
+		fz::dir_cache::listing missing;
+		CPPUNIT_ASSERT(!cache.get(root + "/nonexisting", missing));
+		CPPUNIT_ASSERT(!missing);
+	}
+
+	{
+		// Too small to hold the listing
+		fz::dir_cache cache(pool, 1);
+		fz::dir_cache::listing l1;
+		fz::dir_cache::listing l2;
+		CPPUNIT_ASSERT(cache.get(root, l1));
+		CPPUNIT_ASSERT(cache.get(root, l2));
+		CPPUNIT_ASSERT(l1 != l2);
+	}
+
+	fz::recursive_remove r;
+	CPPUNIT_ASSERT(r.remove(root));
+#endif
+}
+
+namespace {
+class refusing_remove final : public fz::recursive_remove
+{
+protected:
+	virtual bool confirm() const override { return false; }
+};
+}
+
+void file_test::test_recursive_remove()
+{
+#ifndef FZ_WINDOWS
+	fz::native_string const root = absolute_path("file_test_remove.tmp");
+	fz::native_string const outside = absolute_path("file_test_remove_outside.tmp");
+	CPPUNIT_ASSERT(fz::mkdir(outside, false));
+	{
+		fz::file f(outside + "/keep", fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+	}
+
+	// Deeper than the number of directories kept open while descending
+	fz::native_string dir = root;
+	for (int depth = 0; depth < 100; ++depth) {
+		CPPUNIT_ASSERT(fz::mkdir(dir, true));
+		for (int i = 0; i < 3; ++i) {
+			fz::file f(dir + "/file" + fz::to_native(fz::to_string(i)), fz::file::writing, fz::file::empty);
+			CPPUNIT_ASSERT(f.opened());
+		}
+		if (depth % 10 == 0) {
+			CPPUNIT_ASSERT(fz::mkdir(dir + "/side", false));
+			CPPUNIT_ASSERT(!symlink(outside.c_str(), (dir + "/link").c_str()));
+		}
+		dir += "/d";
+	}
+
+	refusing_remove refusing;
+	CPPUNIT_ASSERT(!refusing.remove(root));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(root) == fz::local_filesys::dir);
+
+	fz::recursive_remove r;
+	CPPUNIT_ASSERT(r.remove(root + "/"));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(root) == fz::local_filesys::unknown);
+
+	// Symbolic links got removed, not followed
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(outside + "/keep") == fz::local_filesys::file);
+	CPPUNIT_ASSERT(r.remove(outside));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(outside) == fz::local_filesys::unknown);
+
+	// Removing what does not exist is not an error
+	CPPUNIT_ASSERT(r.remove(root));
+
+	// Directories cannot be removed through . or .., be it with or without a slash
+	CPPUNIT_ASSERT(fz::mkdir(root + "/sub", true));
+	{
+		fz::file f(root + "/sub/keep", fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.opened());
+	}
+	CPPUNIT_ASSERT(!r.remove(root + "/sub/."));
+	CPPUNIT_ASSERT(!r.remove(root + "/sub/.."));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(root + "/sub/keep") == fz::local_filesys::file);
+
+	char cwd[4096];
+	CPPUNIT_ASSERT(getcwd(cwd, sizeof(cwd)));
+	CPPUNIT_ASSERT(!chdir((root + "/sub").c_str()));
+	bool const dot = r.remove(fz::native_string("."));
+	bool const dotdot = r.remove(fz::native_string(".."));
+	CPPUNIT_ASSERT(!chdir(cwd));
+	CPPUNIT_ASSERT(!dot);
+	CPPUNIT_ASSERT(!dotdot);
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(root + "/sub/keep") == fz::local_filesys::file);
+
+	CPPUNIT_ASSERT(r.remove(root));
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(root) == fz::local_filesys::unknown);
+#endif
+}
+
+void file_test::test_copy_file()
+{
+	fz::native_string const source = fz::to_native("file_test_copy_source.tmp");
+	fz::native_string const dest = fz::to_native("file_test_copy_dest.tmp");
+
+	std::string data;
+	for (size_t i = 0; i < 1000003; ++i) {
+		data += static_cast<char>(i * 7);
+	}
+	{
+		fz::file f(source, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write(data.data(), static_cast<int64_t>(data.size())) == static_cast<int64_t>(data.size()));
+	}
+	{
+		// Gets overwritten
+		fz::file f(dest, fz::file::writing, fz::file::empty);
+		CPPUNIT_ASSERT(f.write("old", 3) == 3);
+	}
+
+	int64_t last{};
+	auto res = fz::copy_file(source, dest, [&](int64_t copied, int64_t size) {
+		CPPUNIT_ASSERT(copied >= last && copied <= size);
+		CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(data.size()), size);
+		last = copied;
+		return true;
+	});
+	CPPUNIT_ASSERT(res);
+	CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(data.size()), last);
+
+	{
+		fz::file f(dest, fz::file::reading, fz::file::existing);
+		std::string read(data.size() + 1, 0);
+		CPPUNIT_ASSERT_EQUAL(static_cast<int64_t>(data.size()), f.read(read.data(), static_cast<int64_t>(read.size())));
+		read.resize(data.size());
+		CPPUNIT_ASSERT(data == read);
+	}
+
+	// Cancelling removes the target
+	fz::remove_file(dest);
+	res = fz::copy_file(source, dest, [](int64_t, int64_t) { return false; });
+	CPPUNIT_ASSERT(!res);
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(dest) == fz::local_filesys::unknown);
+
+	CPPUNIT_ASSERT(fz::copy_file(fz::to_native("file_test_copy_missing.tmp"), dest).error_ == fz::result::nofile);
+
+	fz::remove_file(source);
+}
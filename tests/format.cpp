@@ -1,4 +1,5 @@
 #include "../lib/libfilezilla/format.hpp"
+#include "../lib/libfilezilla/logger.hpp"
 
 #include "test_utils.hpp"
 /*
@@ -10,6 +11,8 @@ class format_test final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(format_test);
 	CPPUNIT_TEST(test_sprintf);
+	CPPUNIT_TEST(test_sprintf_compiled);
+	CPPUNIT_TEST(test_sprintf_append);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -17,6 +20,8 @@ public:
 	void tearDown() {}
 
 	void test_sprintf();
+	void test_sprintf_compiled();
+	void test_sprintf_append();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(format_test);
@@ -133,3 +138,78 @@ void format_test::test_sprintf()
 	int64_t const neg64 = -42;
 	CPPUNIT_ASSERT_EQUAL(std::string("ffffffffffffffd6"), fz::sprintf("%x", neg64));
 }
+
+namespace {
+enum class color { red, green };
+
+class string_logger final : public fz::logger_interface
+{
+public:
+	virtual void do_log(fz::logmsg::type, std::wstring && msg) override {
+		last_ = std::move(msg);
+	}
+
+	std::wstring last_;
+};
+}
+
+// Compares against the format string getting parsed at runtime
+#define CHECK_COMPILED(fmt, ...) CPPUNIT_ASSERT_EQUAL(fz::sprintf(fmt, __VA_ARGS__), fz::sprintf(FZ_FORMAT(fmt), __VA_ARGS__))
+
+void format_test::test_sprintf_compiled()
+{
+	CPPUNIT_ASSERT_EQUAL(std::string("foo"), fz::sprintf(FZ_FORMAT("foo")));
+	CPPUNIT_ASSERT_EQUAL(std::string(""), fz::sprintf(FZ_FORMAT("")));
+	CPPUNIT_ASSERT_EQUAL(std::string("foo % bar %"), fz::sprintf(FZ_FORMAT("foo %% bar %%")));
+	CPPUNIT_ASSERT_EQUAL(std::wstring(L"foo bar"), fz::sprintf(FZ_FORMAT(L"foo %s"), "bar"));
+
+	CHECK_COMPILED("foo %s", "bar");
+	CHECK_COMPILED("foo %s", L"bar");
+	CHECK_COMPILED("foo %s", std::string("bar"));
+	CHECK_COMPILED("foo %s", std::wstring_view(L"bar"));
+	CHECK_COMPILED("%4s|%-4s|%04s", "a", "b", "c");
+	CHECK_COMPILED("%d %i %u %d", 0, -42, 42u, true);
+	CHECK_COMPILED("%4d|%-4d|%04d|% 4d|%+4d|%+-7d|% 04d", -42, 42, -42, 42, 42, -77, -42);
+	CHECK_COMPILED("%lld %zu %hd", int64_t(-9223372036854775807ll - 1), size_t(12345), short(7));
+	CHECK_COMPILED("%x %X %04x %4X", 2342666, 2342666, 10, int16_t(-42));
+	CHECK_COMPILED("%c%c", 'x', int('y'));
+	CHECK_COMPILED("%d %s", color::green, 1.5);
+	CHECK_COMPILED("%2$s %1$d %2$s", 7, "foo");
+	CHECK_COMPILED("%p", static_cast<void*>(nullptr));
+	CHECK_COMPILED("[%s] %s: %d bytes in %d ms", std::string("GET"), std::string_view("/index.html"), uint64_t(1234567), 42);
+
+	// Positional arguments do not set the width
+	CPPUNIT_ASSERT_EQUAL(std::string("b a"), fz::sprintf("%3$s %1$s", "a", "", "b"));
+	CPPUNIT_ASSERT_EQUAL(std::string("b a"), fz::sprintf(FZ_FORMAT("%3$s %1$s"), "a", "", "b"));
+
+	string_logger logger;
+	logger.log(fz::logmsg::status, FZ_FORMAT("%s %d"), "foo", 42);
+	ASSERT_EQUAL(std::wstring(L"foo 42"), logger.last_);
+	logger.log(fz::logmsg::status, FZ_FORMAT(L"%s %d"), std::wstring(L"bar"), -1);
+	ASSERT_EQUAL(std::wstring(L"bar -1"), logger.last_);
+	logger.log_u(fz::logmsg::status, FZ_FORMAT("%s"), "\xc3\xa4");
+	ASSERT_EQUAL(std::wstring(L"\xe4"), logger.last_);
+}
+
+void format_test::test_sprintf_append()
+{
+	std::string s = "foo";
+	s.reserve(100);
+	auto const* const data = s.data();
+	fz::sprintf_append(s, " %s %04d", "bar", 42);
+	fz::sprintf_append(s, FZ_FORMAT(" %-4s|%x"), L"baz", 255);
+	CPPUNIT_ASSERT_EQUAL(std::string("foo bar 0042 baz |ff"), s);
+	CPPUNIT_ASSERT(data == s.data());
+
+	std::wstring w = L"foo";
+	fz::sprintf_append(w, L" %s %d", "bar", -1);
+	fz::sprintf_append(w, FZ_FORMAT(" %s%%"), 100);
+	ASSERT_EQUAL(std::wstring(L"foo bar -1 100%"), w);
+
+	fz::buffer b;
+	b.append("foo");
+	fz::sprintf_append(b, " %s %5d", std::wstring(L"bar"), 42);
+	fz::sprintf_append(b, FZ_FORMAT(" %c%s"), 'x', std::string_view("yz"));
+	fz::sprintf_append(b, FZ_FORMAT(L" %s"), "wide");
+	CPPUNIT_ASSERT_EQUAL(std::string("foo bar    42 xyz wide"), std::string(b.to_view()));
+}
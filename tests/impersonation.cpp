@@ -0,0 +1,57 @@
+#include "../lib/libfilezilla/impersonation.hpp"
+
+#include "test_utils.hpp"
+
+class impersonation_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(impersonation_test);
+#if FZ_UNIX || FZ_MAC
+	CPPUNIT_TEST(test_cache);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_cache();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(impersonation_test);
+
+#if FZ_UNIX || FZ_MAC
+void impersonation_test::test_cache()
+{
+	fz::native_string const user = fz::current_username();
+	CPPUNIT_ASSERT(!user.empty());
+
+	fz::impersonation_token const uncached(user, fz::impersonation_flag::pwless);
+	CPPUNIT_ASSERT(uncached);
+
+	fz::impersonation_token::set_cache(fz::duration::from_seconds(60), 2);
+
+	// Same result from the directory and from the cache
+	for (int i = 0; i < 2; ++i) {
+		fz::impersonation_token const t(user, fz::impersonation_flag::pwless);
+		CPPUNIT_ASSERT(t);
+		CPPUNIT_ASSERT(t == uncached);
+		ASSERT_EQUAL(uncached.home(), t.home());
+	}
+
+	// Failures are not cached
+	fz::native_string const missing = fzT("fz_test_no_such_user");
+	CPPUNIT_ASSERT(!fz::impersonation_token(missing, fz::impersonation_flag::pwless));
+	CPPUNIT_ASSERT(!fz::impersonation_token(missing, fz::impersonation_flag::pwless));
+	CPPUNIT_ASSERT(!fz::impersonation_token(user, fz::impersonation_flag::pwless, fzT("fz_test_no_such_group")));
+
+	// Credentials are still checked
+	CPPUNIT_ASSERT(!fz::impersonation_token(user, fzT("fz_test_wrong_password")));
+
+	fz::impersonation_token::flush_cache(user);
+	CPPUNIT_ASSERT(fz::impersonation_token(user, fz::impersonation_flag::pwless) == uncached);
+
+	fz::impersonation_token::flush_cache();
+	fz::impersonation_token::set_cache(fz::duration());
+	CPPUNIT_ASSERT(fz::impersonation_token(user, fz::impersonation_flag::pwless) == uncached);
+}
+#endif
@@ -1,17 +1,23 @@
 #include "../lib/libfilezilla/event_handler.hpp"
 #include "../lib/libfilezilla/event_loop.hpp"
 #include "../lib/libfilezilla/invoker.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
 #include "../lib/libfilezilla/time.hpp"
+#include "../lib/libfilezilla/unique_function.hpp"
 
 #include "test_utils.hpp"
 
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <array>
+#include <memory>
+
 class InvokerTest final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(InvokerTest);
 	CPPUNIT_TEST(testInvoker);
 	CPPUNIT_TEST(testInvokerFactory);
+	CPPUNIT_TEST(testUniqueFunction);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -20,6 +26,7 @@ public:
 
 	void testInvoker();
 	void testInvokerFactory();
+	void testUniqueFunction();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(InvokerTest);
@@ -128,3 +135,69 @@ void InvokerTest::testInvokerFactory()
 		ASSERT_EQUAL(1, c);
 	}
 }
+
+namespace {
+struct counted final
+{
+	explicit counted(int & alive)
+		: alive_(&alive)
+	{
+		++*alive_;
+	}
+
+	counted(counted && op) noexcept
+		: alive_(op.alive_)
+	{
+		++*alive_;
+	}
+
+	~counted()
+	{
+		--*alive_;
+	}
+
+	int* alive_;
+};
+}
+
+void InvokerTest::testUniqueFunction()
+{
+	// Move-only captures
+	auto p = std::make_unique<int>(5);
+	fz::unique_function<int(int)> f = [p = std::move(p)](int v) { return *p + v; };
+	CPPUNIT_ASSERT(f);
+	ASSERT_EQUAL(7, f(2));
+
+	fz::unique_function<int(int)> g = std::move(f);
+	CPPUNIT_ASSERT(!f);
+	ASSERT_EQUAL(8, g(3));
+
+	// Empty function pointers and std::functions
+	CPPUNIT_ASSERT(!fz::unique_function<void()>(std::function<void()>()));
+	CPPUNIT_ASSERT(!fz::unique_function<void()>(static_cast<void(*)()>(nullptr)));
+	CPPUNIT_ASSERT(!fz::unique_function<void()>(nullptr));
+
+	// Inline and heap storage both destroy their targets
+	int alive{};
+	{
+		fz::unique_function<void()> small = [c = counted(alive)] {};
+		fz::unique_function<void()> large = [c = counted(alive), pad = std::array<char, 256>()] {};
+		ASSERT_EQUAL(2, alive);
+
+		fz::unique_function<void()> moved = std::move(small);
+		moved = std::move(large);
+		ASSERT_EQUAL(1, alive);
+		moved = nullptr;
+		ASSERT_EQUAL(0, alive);
+
+		small = [c = counted(alive)] {};
+	}
+	ASSERT_EQUAL(0, alive);
+
+	// Move-only tasks in the thread pool
+	fz::thread_pool pool;
+	int result{};
+	auto target = std::make_unique<int*>(&result);
+	pool.spawn([target = std::move(target)] { **target = 42; }).join();
+	ASSERT_EQUAL(42, result);
+}
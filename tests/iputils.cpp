@@ -1,6 +1,11 @@
 #include "../lib/libfilezilla/iputils.hpp"
+#include "../lib/libfilezilla/network_interface_cache.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
 
 #include "test_utils.hpp"
+
+#include <random>
+#include <unordered_set>
 /*
  * This testsuite asserts the correctness of the
  * functions handling IP addresses
@@ -10,6 +15,9 @@ class ip_address_test final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(ip_address_test);
 	CPPUNIT_TEST(test_addresses);
+	CPPUNIT_TEST(test_ip_address);
+	CPPUNIT_TEST(test_cidr_set);
+	CPPUNIT_TEST(test_network_interface_cache);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -17,6 +25,9 @@ public:
 	void tearDown() {}
 
 	void test_addresses();
+	void test_ip_address();
+	void test_cidr_set();
+	void test_network_interface_cache();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(ip_address_test);
@@ -29,6 +40,10 @@ void do_test_address(String const& address, fz::address_type const expected_type
 	ASSERT_EQUAL_DATA(expected_type, fz::get_address_type(address), address);
 	ASSERT_EQUAL_DATA(routable, fz::is_routable_address(address), address);
 	ASSERT_EQUAL_DATA(long_form, fz::get_ipv6_long_form(address), address);
+
+	fz::ip_address const ip(address);
+	ASSERT_EQUAL_DATA(expected_type, ip.type(), address);
+	ASSERT_EQUAL_DATA(routable, ip.is_routable(), address);
 }
 
 void test_address(std::string const& address, fz::address_type const expected_type, bool const routable, std::string const& long_form)
@@ -62,6 +77,8 @@ void ip_address_test::test_addresses()
 	test_address("::0:0:0:0:0:0:0:1",                       fz::address_type::ipv6, false, "0000:0000:0000:0000:0000:0000:0000:0001");
 	test_address("0000:0000:0000:0000:0000:0000:0000:0001", fz::address_type::ipv6, false, "0000:0000:0000:0000:0000:0000:0000:0001");
 	test_address("::",                                      fz::address_type::ipv6, false, "0000:0000:0000:0000:0000:0000:0000:0000");
+	test_address("fe80::",                                  fz::address_type::ipv6, false, "fe80:0000:0000:0000:0000:0000:0000:0000");
+	test_address("1:2:3:4:5:6:7::",                         fz::address_type::ipv6, true,  "0001:0002:0003:0004:0005:0006:0007:0000");
 
 	test_address("[::1]",                                     fz::address_type::ipv6, false, "0000:0000:0000:0000:0000:0000:0000:0001");
 	test_address("[1234::1]",                                 fz::address_type::ipv6, true,  "1234:0000:0000:0000:0000:0000:0000:0001");
@@ -85,6 +102,8 @@ void ip_address_test::test_addresses()
 	test_address("1234:abcde:1234::ef01",             fz::address_type::unknown, false, "");
 	test_address("1234:abcg:1234::ef01",              fz::address_type::unknown, false, "");
 	test_address(":::1",                              fz::address_type::unknown, false, "");
+	test_address("1234:::",                           fz::address_type::unknown, false, "");
+	test_address("1234::ef01::",                      fz::address_type::unknown, false, "");
 	test_address("0:0:0:0:0:0:0:1:2",                 fz::address_type::unknown, false, "");
 	test_address("0:0:0:0:0:0:0:1:2:0:0:0:0:0:0:1:2", fz::address_type::unknown, false, "");
 	test_address("0::0:0:0:0:0:0:1:2:0:0:0:0:0:0:1",  fz::address_type::unknown, false, "");
@@ -170,3 +189,128 @@ void ip_address_test::test_addresses()
 	test_address("::ffff:ac1f:ffff", fz::address_type::ipv6, false, "0000:0000:0000:0000:0000:ffff:ac1f:ffff");
 	test_address("::ffff:ac20:0000", fz::address_type::ipv6, true,  "0000:0000:0000:0000:0000:ffff:ac20:0000");
 }
+
+void ip_address_test::test_ip_address()
+{
+	ASSERT_EQUAL(std::string("10.0.1.255"), fz::ip_address(std::string_view("10.0.1.255")).to_string());
+	ASSERT_EQUAL(std::string("::"), fz::ip_address(std::string_view("0:0::0")).to_string());
+	ASSERT_EQUAL(std::string("::1"), fz::ip_address(std::string_view("[0::1]")).to_string());
+	ASSERT_EQUAL(std::string("2001:db8::1:0:0:1"), fz::ip_address(std::string_view("2001:0DB8:0:0:1:0:0:1")).to_string());
+	ASSERT_EQUAL(std::string("2001:db8:0:1:1:1:1:1"), fz::ip_address(std::string_view("2001:db8::1:1:1:1:1")).to_string());
+	ASSERT_EQUAL(std::string("fe80::"), fz::ip_address(std::wstring_view(L"fe80::")).to_string());
+	CPPUNIT_ASSERT(!fz::ip_address(std::string_view("example.com")));
+	CPPUNIT_ASSERT(!fz::ip_address());
+
+	fz::ip_address const v4(std::string_view("192.168.1.2"));
+	std::vector<uint8_t> const bytes{192, 168, 1, 2};
+	CPPUNIT_ASSERT(v4.bytes() == bytes);
+	CPPUNIT_ASSERT(fz::ip_address(std::basic_string_view<uint8_t>(bytes.data(), bytes.size())) == v4);
+	CPPUNIT_ASSERT(!fz::ip_address(std::basic_string_view<uint8_t>(bytes.data(), 3)));
+
+	ASSERT_EQUAL(std::string("192.168.0.0"), v4.masked(20).to_string());
+	ASSERT_EQUAL(std::string("2001:db8::"), fz::ip_address(std::string_view("2001:db8:1234::1")).masked(32).to_string());
+	ASSERT_EQUAL(std::string("::ffff:c0a8:100"), fz::ip_address(std::string_view("::ffff:c0a8:102")).masked(120).to_string());
+
+	fz::ip_address const mapped(std::string_view("::ffff:c0a8:102"));
+	CPPUNIT_ASSERT(mapped != v4);
+	CPPUNIT_ASSERT(mapped.unmapped() == v4);
+	CPPUNIT_ASSERT(v4.unmapped() == v4);
+
+	CPPUNIT_ASSERT(v4 < mapped);
+	CPPUNIT_ASSERT(fz::ip_address(std::string_view("10.0.0.1")) < v4);
+
+	std::unordered_set<fz::ip_address> set{v4, mapped, mapped.unmapped()};
+	ASSERT_EQUAL(size_t(2), set.size());
+}
+
+void ip_address_test::test_cidr_set()
+{
+	fz::cidr_set set;
+	CPPUNIT_ASSERT(set.empty());
+	CPPUNIT_ASSERT(!set.contains(fz::ip_address(std::string_view("10.0.0.1"))));
+
+	CPPUNIT_ASSERT(set.add("10.0.0.0/8"));
+	CPPUNIT_ASSERT(set.add("192.168.1.7"));
+	CPPUNIT_ASSERT(set.add("2001:db8::/32"));
+	CPPUNIT_ASSERT(!set.add("10.0.0.0/33"));
+	CPPUNIT_ASSERT(!set.add("10.0.0.0/"));
+	CPPUNIT_ASSERT(!set.add("10.0.0.0/-1"));
+	CPPUNIT_ASSERT(!set.add("example.com/8"));
+
+	auto const contains = [&](char const* address) {
+		return set.contains(fz::ip_address(std::string_view(address)));
+	};
+	CPPUNIT_ASSERT(contains("10.255.0.1"));
+	CPPUNIT_ASSERT(!contains("11.0.0.1"));
+	CPPUNIT_ASSERT(contains("192.168.1.7"));
+	CPPUNIT_ASSERT(!contains("192.168.1.6"));
+	CPPUNIT_ASSERT(contains("::ffff:a01:203"));
+	CPPUNIT_ASSERT(contains("2001:db8:ffff::1"));
+	CPPUNIT_ASSERT(!contains("2001:db9::1"));
+	CPPUNIT_ASSERT(!contains("::"));
+
+	// Shorter prefixes supersede longer ones
+	CPPUNIT_ASSERT(set.add("192.168.0.0/16"));
+	CPPUNIT_ASSERT(contains("192.168.1.6"));
+
+	set.clear();
+	CPPUNIT_ASSERT(set.empty());
+	CPPUNIT_ASSERT(!contains("10.255.0.1"));
+
+	CPPUNIT_ASSERT(set.add("::/0"));
+	CPPUNIT_ASSERT(contains("1234::1"));
+	CPPUNIT_ASSERT(!contains("1.2.3.4"));
+
+	// Compare against a linear search, in a small address space to get plenty of overlaps
+	std::mt19937_64 gen(42);
+	for (int round = 0; round < 20; ++round) {
+		fz::cidr_set random_set;
+		std::vector<std::pair<fz::ip_address, unsigned int>> networks;
+		for (int i = 0; i < 200; ++i) {
+			uint8_t const bytes[16] = {0x20, 0x01, static_cast<uint8_t>(gen() & 0x3), static_cast<uint8_t>(gen() & 0xf0), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, static_cast<uint8_t>(gen())};
+			unsigned int const length = static_cast<unsigned int>(gen() % 129);
+			fz::ip_address const network(std::basic_string_view<uint8_t>(bytes, 16));
+			CPPUNIT_ASSERT(random_set.add(network, length));
+			networks.emplace_back(network.masked(length), length);
+		}
+		for (int i = 0; i < 1000; ++i) {
+			uint8_t const bytes[16] = {0x20, 0x01, static_cast<uint8_t>(gen() & 0x3), static_cast<uint8_t>(gen() & 0xf0), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, static_cast<uint8_t>(gen())};
+			fz::ip_address const address(std::basic_string_view<uint8_t>(bytes, 16));
+			bool expected{};
+			for (auto const& n : networks) {
+				if (address.masked(n.second) == n.first) {
+					expected = true;
+					break;
+				}
+			}
+			ASSERT_EQUAL_DATA(expected, random_set.contains(address), address.to_string());
+		}
+	}
+}
+
+void ip_address_test::test_network_interface_cache()
+{
+	fz::thread_pool pool;
+	fz::network_interface_cache cache(pool);
+
+	auto const interfaces = fz::get_network_interfaces();
+	auto const cached = cache.get();
+	ASSERT_EQUAL(interfaces.has_value(), cached != nullptr);
+	if (!cached) {
+		return;
+	}
+	ASSERT_EQUAL(interfaces->size(), cached->size());
+
+	if (cache.watching()) {
+		// Unchanged until something happens
+		CPPUNIT_ASSERT(cache.get() == cached);
+
+		cache.invalidate();
+		auto const refreshed = cache.get();
+		CPPUNIT_ASSERT(refreshed && refreshed != cached);
+		CPPUNIT_ASSERT(cache.get() == refreshed);
+	}
+	else {
+		CPPUNIT_ASSERT(cache.get() != cached);
+	}
+}
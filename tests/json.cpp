@@ -1,12 +1,27 @@
+#include "../lib/libfilezilla/buffer_chain.hpp"
+#include "../lib/libfilezilla/encode.hpp"
 #include "../lib/libfilezilla/json.hpp"
 
 #include "test_utils.hpp"
 
+#include <limits>
+#include <vector>
+
 class json_test final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(json_test);
 	CPPUNIT_TEST(test_surrogate_pair);
 	CPPUNIT_TEST(test_subscript);
+	CPPUNIT_TEST(test_document);
+	CPPUNIT_TEST(test_document_invalid);
+	CPPUNIT_TEST(test_stream);
+	CPPUNIT_TEST(test_stream_invalid);
+	CPPUNIT_TEST(test_number);
+	CPPUNIT_TEST(test_to_buffer);
+	CPPUNIT_TEST(test_long_strings);
+	CPPUNIT_TEST(test_cbor);
+	CPPUNIT_TEST(test_cbor_decoder);
+	CPPUNIT_TEST(test_pointer);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -15,6 +30,16 @@ public:
 
 	void test_surrogate_pair();
 	void test_subscript();
+	void test_document();
+	void test_document_invalid();
+	void test_stream();
+	void test_stream_invalid();
+	void test_number();
+	void test_to_buffer();
+	void test_long_strings();
+	void test_cbor();
+	void test_cbor_decoder();
+	void test_pointer();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(json_test);
@@ -43,3 +68,479 @@ void json_test::test_subscript()
 	CPPUNIT_ASSERT(ja.type() == fz::json_type::array);
 }
 
+
+void json_test::test_document()
+{
+	std::string_view const input = R"({ "b": [1, -2.5e3, "x\"y", null, true, false, {}, []],
+		"a": "\ud83d\ude01", "c": { "z": 18446744073709551615, "y": "plain" }, "": 0 })";
+
+	auto const doc = fz::json_document::parse(input);
+	CPPUNIT_ASSERT(doc);
+	auto const root = doc.root();
+	CPPUNIT_ASSERT(root.is_object());
+	CPPUNIT_ASSERT_EQUAL(size_t(4), root.children());
+
+	auto const b = root["b"];
+	CPPUNIT_ASSERT(b.is_array());
+	CPPUNIT_ASSERT_EQUAL(size_t(8), b.children());
+	CPPUNIT_ASSERT_EQUAL(1, b[0].number_value<int>());
+	CPPUNIT_ASSERT_EQUAL(-2500.0, b[1].number_value<double>());
+	CPPUNIT_ASSERT_EQUAL(std::string("x\"y"), b[2].string_value());
+	CPPUNIT_ASSERT(b[3].is_null());
+	CPPUNIT_ASSERT(b[4].bool_value());
+	CPPUNIT_ASSERT(b[5].is_boolean() && !b[5].bool_value());
+	CPPUNIT_ASSERT(b[6].is_object() && !b[6].children());
+	CPPUNIT_ASSERT(b[7].is_array() && !b[7].children());
+	CPPUNIT_ASSERT(!b[8]);
+
+	CPPUNIT_ASSERT_EQUAL(std::string("\xf0\x9f\x98\x81"), root["a"].string_value());
+	CPPUNIT_ASSERT_EQUAL(uint64_t(18446744073709551615u), root["c"]["z"].number_value<uint64_t>());
+	CPPUNIT_ASSERT(root["c"]["y"].string_view() == "plain");
+	CPPUNIT_ASSERT(root[""].is_number());
+	CPPUNIT_ASSERT(!root["d"]);
+	CPPUNIT_ASSERT(!root[0]);
+	CPPUNIT_ASSERT(!root["c"]["y"]["z"]);
+
+	// Same output as the mutable representation
+	auto const j = fz::json::parse(input);
+	CPPUNIT_ASSERT_EQUAL(j.to_string(), root.to_string());
+	CPPUNIT_ASSERT_EQUAL(j.to_string(true), root.to_string(true));
+	CPPUNIT_ASSERT_EQUAL(j.to_string(), root.to_json().to_string());
+}
+
+void json_test::test_document_invalid()
+{
+	char const* const inputs[] = {
+		"", " ", "{", "[1,", "{\"a\":1,\"a\":2}", "{\"a\" 1}", "[1 2]", "-", "1.", "1e", ".5", "nul", "\"abc", "\"\\u0000\"", "\"\\x\"", "[[[1]]]"
+	};
+	for (auto const& input : inputs) {
+		CPPUNIT_ASSERT(!fz::json::parse(input, 3));
+		auto const doc = fz::json_document::parse(input, 3);
+		CPPUNIT_ASSERT(!doc);
+		CPPUNIT_ASSERT(!doc.root());
+	}
+}
+
+namespace {
+// Rebuilds the tree from the events
+class tree_builder final : public fz::json_stream_handler
+{
+public:
+	bool on_object_begin() override { return begin(fz::json_type::object); }
+	bool on_array_begin() override { return begin(fz::json_type::array); }
+	bool on_object_end() override { stack_.pop_back(); return true; }
+	bool on_array_end() override { stack_.pop_back(); return true; }
+
+	bool on_name(std::string_view const& name) override {
+		name_ = name;
+		return true;
+	}
+
+	bool on_string(std::string_view const& v) override {
+		next() = v;
+		return true;
+	}
+
+	bool on_number(std::string_view const& v) override {
+		// Goes through fz::json to keep the textual form
+		next() = fz::json::parse(v);
+		return true;
+	}
+
+	bool on_boolean(bool v) override {
+		next() = v;
+		return true;
+	}
+
+	bool on_null() override {
+		next() = fz::json(fz::json_type::null);
+		return true;
+	}
+
+	fz::json root_;
+	size_t values_{};
+	size_t abort_after_{size_t(-1)};
+
+private:
+	fz::json& next()
+	{
+		++values_;
+		if (stack_.empty()) {
+			return root_;
+		}
+		auto & parent = *stack_.back();
+		if (parent.is_object()) {
+			return parent[name_];
+		}
+		return parent[parent.children()];
+	}
+
+	bool begin(fz::json_type t)
+	{
+		auto & j = next();
+		j = fz::json(t);
+		stack_.push_back(&j);
+		return values_ < abort_after_;
+	}
+
+	std::vector<fz::json*> stack_;
+	std::string name_;
+};
+}
+
+void json_test::test_stream()
+{
+	std::string_view const input = R"( { "b": [1, -2.5e3, "x\"y", null, true, false, {}, [], ],
+		"a": "\ud83d\ude01", "c": { "z": 18446744073709551615, "y": "plain", }, "": 0 } )";
+	std::string const expected = fz::json::parse(input).to_string();
+
+	{
+		tree_builder b;
+		fz::json_stream_parser parser(b);
+		CPPUNIT_ASSERT(parser.feed(input));
+		CPPUNIT_ASSERT(parser.finish());
+		CPPUNIT_ASSERT_EQUAL(expected, b.root_.to_string());
+	}
+
+	// Split at every possible position
+	for (size_t i = 0; i <= input.size(); ++i) {
+		tree_builder b;
+		fz::json_stream_parser parser(b);
+		CPPUNIT_ASSERT(parser.feed(input.substr(0, i)));
+		CPPUNIT_ASSERT(parser.feed(input.substr(i)));
+		CPPUNIT_ASSERT(parser.finish());
+		CPPUNIT_ASSERT_EQUAL(expected, b.root_.to_string());
+	}
+
+	// A byte at a time, reusing the parser
+	tree_builder b;
+	fz::json_stream_parser parser(b);
+	for (size_t round = 0; round < 2; ++round) {
+		b.root_.clear();
+		parser.reset();
+		for (auto const& c : input) {
+			CPPUNIT_ASSERT(parser.feed(std::string_view(&c, 1)));
+		}
+		CPPUNIT_ASSERT(parser.finish());
+		CPPUNIT_ASSERT_EQUAL(expected, b.root_.to_string());
+	}
+
+	// Top-level numbers end with the input
+	parser.reset();
+	CPPUNIT_ASSERT(parser.feed("12"));
+	CPPUNIT_ASSERT(parser.feed("34"));
+	CPPUNIT_ASSERT(parser.finish());
+	CPPUNIT_ASSERT_EQUAL(1234, b.root_.number_value<int>());
+
+	// Aborted by the handler
+	b.abort_after_ = 3;
+	parser.reset();
+	CPPUNIT_ASSERT(!parser.feed(input));
+	CPPUNIT_ASSERT(parser.failed());
+	CPPUNIT_ASSERT(!parser.feed(" "));
+	CPPUNIT_ASSERT(!parser.finish());
+}
+
+void json_test::test_stream_invalid()
+{
+	char const* const inputs[] = {
+		"", " ", "{", "[1,", "{\"a\" 1}", "[1 2]", "-", "1.", "1e", ".5", "nul", "nulL", "\"abc", "\"\\u0000\"", "\"\\x\"", "[[[1]]]",
+		"1 2", "{} x", "{1:2}", "[\"\\ud83d\"]"
+	};
+	for (auto const& input : inputs) {
+		tree_builder b;
+		fz::json_stream_parser parser(b, 3);
+		parser.feed(input);
+		CPPUNIT_ASSERT(!parser.finish());
+
+		// Byte by byte
+		parser.reset();
+		for (char const* p = input; *p; ++p) {
+			parser.feed(std::string_view(p, 1));
+		}
+		CPPUNIT_ASSERT(!parser.finish());
+	}
+}
+
+void json_test::test_number()
+{
+	// Output keeps the exact input
+	std::string const input = "[1.50,-0,1E+2,18446744073709551615,-9223372036854775808,1e400,0.1]";
+	auto j = fz::json::parse(input);
+	CPPUNIT_ASSERT_EQUAL(input, j.to_string());
+
+	CPPUNIT_ASSERT_EQUAL(1.5, j[0].number_value<double>());
+	CPPUNIT_ASSERT_EQUAL(1, j[0].number_value<int>());
+	CPPUNIT_ASSERT_EQUAL(std::string("1.50"), j[0].string_value());
+	CPPUNIT_ASSERT_EQUAL(0, j[1].number_value<int>());
+	CPPUNIT_ASSERT_EQUAL(100.0, j[2].number_value<double>());
+	CPPUNIT_ASSERT_EQUAL(100, j[2].number_value<int>());
+	CPPUNIT_ASSERT_EQUAL(uint64_t(18446744073709551615u), j[3].number_value<uint64_t>());
+	CPPUNIT_ASSERT_EQUAL(std::numeric_limits<int64_t>::min(), j[4].number_value<int64_t>());
+	CPPUNIT_ASSERT_EQUAL(-9223372036854775808.0, j[4].number_value<double>());
+	CPPUNIT_ASSERT(j[5].number_value<double>() > std::numeric_limits<double>::max());
+	CPPUNIT_ASSERT_EQUAL(0.1, j[6].number_value<double>());
+
+	// Assigned numbers
+	fz::json n;
+	n = -42;
+	CPPUNIT_ASSERT(n.is_number());
+	CPPUNIT_ASSERT_EQUAL(std::string("-42"), n.to_string());
+	CPPUNIT_ASSERT_EQUAL(-42, n.number_value<int>());
+	CPPUNIT_ASSERT_EQUAL(-42.0, n.number_value<double>());
+	n = uint64_t(18446744073709551615u);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(18446744073709551615u), n.number_value<uint64_t>());
+
+	// Copies keep the values
+	fz::json copy = j;
+	CPPUNIT_ASSERT_EQUAL(1.5, copy[0].number_value<double>());
+
+	// Strings still get converted
+	fz::json s;
+	s = "0x1A";
+	CPPUNIT_ASSERT_EQUAL(26.0, s.number_value<double>());
+	s = "12";
+	CPPUNIT_ASSERT_EQUAL(12, s.number_value<int>());
+
+	CPPUNIT_ASSERT_EQUAL(0, fz::json(fz::json_type::number).number_value<int>());
+}
+
+void json_test::test_to_buffer()
+{
+	fz::json j;
+	j["plain"] = "text";
+	j["escaped"] = "\"quoted\"\r\n\ttab\\\b\f end";
+	j["number"] = 42;
+	j["null"] = fz::json(fz::json_type::null);
+	for (size_t i = 0; i < 2000; ++i) {
+		j["array"][i] = std::string(i % 50, 'x') + "\n";
+	}
+	j["array"][2000]["nested"] = true;
+
+	for (bool pretty : {false, true}) {
+		std::string const expected = j.to_string(pretty);
+
+		fz::buffer b;
+		b.append("prefix");
+		j.to_string(b, pretty);
+		CPPUNIT_ASSERT(b.to_view() == "prefix" + expected);
+
+		// Larger than a segment
+		fz::buffer_chain c;
+		c.append(std::string_view("prefix"));
+		j.to_string(c, pretty);
+		CPPUNIT_ASSERT(c.segments() > 1);
+		CPPUNIT_ASSERT(c.flatten().to_view() == "prefix" + expected);
+
+		CPPUNIT_ASSERT(fz::json::parse(expected).to_string(pretty) == expected);
+	}
+}
+
+void json_test::test_long_strings()
+{
+	// Strings are scanned in blocks, place the interesting characters at all positions within them
+	for (size_t len = 0; len < 100; ++len) {
+		for (size_t pos = 0; pos <= len; ++pos) {
+			std::string value(len, 'a');
+			value.insert(pos, "\\n");
+			std::string expected(len, 'a');
+			expected.insert(pos, "\n");
+
+			std::string const input = "[\"" + value + "\",\"" + std::string(len, 'b') + "\"]";
+
+			auto const j = fz::json::parse(input);
+			CPPUNIT_ASSERT_EQUAL(expected, j[0].string_value());
+			CPPUNIT_ASSERT_EQUAL(std::string(len, 'b'), j[1].string_value());
+
+			auto const doc = fz::json_document::parse(input);
+			CPPUNIT_ASSERT_EQUAL(expected, doc.root()[0].string_value());
+			CPPUNIT_ASSERT_EQUAL(std::string(len, 'b'), doc.root()[1].string_value());
+
+			tree_builder b;
+			fz::json_stream_parser parser(b);
+			CPPUNIT_ASSERT(parser.feed(std::string_view(input).substr(0, pos + 3)));
+			CPPUNIT_ASSERT(parser.feed(std::string_view(input).substr(pos + 3)));
+			CPPUNIT_ASSERT(parser.finish());
+			CPPUNIT_ASSERT_EQUAL(expected, b.root_[0].string_value());
+
+			// Unterminated or with a null byte
+			std::string invalid = "\"" + std::string(len, 'a');
+			CPPUNIT_ASSERT(!fz::json::parse(invalid));
+			CPPUNIT_ASSERT(!fz::json_document::parse(invalid));
+			if (len) {
+				invalid[pos ? pos : 1] = 0;
+				invalid += '"';
+				CPPUNIT_ASSERT(!fz::json::parse(invalid));
+				CPPUNIT_ASSERT(!fz::json_document::parse(invalid));
+			}
+		}
+	}
+}
+
+namespace {
+std::string to_cbor(fz::json const& j)
+{
+	fz::buffer b;
+	j.to_cbor(b);
+	return std::string(b.to_view());
+}
+
+fz::json from_hex(std::string_view hex)
+{
+	return fz::json::parse_cbor(fz::hex_decode<std::string>(hex));
+}
+}
+
+void json_test::test_cbor()
+{
+	// Examples from RFC 8949, Appendix A
+	CPPUNIT_ASSERT_EQUAL(std::string("00"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("0"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("1864"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("100"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("1b000000e8d4a51000"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("1000000000000"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("1bffffffffffffffff"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("18446744073709551615"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("3863"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("-100"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("fa3fc00000"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("1.5"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("fb3ff199999999999a"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("1.1"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("f6"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("null"))));
+	CPPUNIT_ASSERT_EQUAL(std::string("6449455446"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("\"IETF\""))));
+	CPPUNIT_ASSERT_EQUAL(std::string("a26161016162820203"), fz::hex_encode<std::string>(to_cbor(fz::json::parse("{\"a\": 1, \"b\": [2, 3]}"))));
+
+	CPPUNIT_ASSERT_EQUAL(std::string("-18446744073709551616"), from_hex("3bffffffffffffffff").string_value());
+	CPPUNIT_ASSERT_EQUAL(std::string("-1000"), from_hex("3903e7").string_value());
+	CPPUNIT_ASSERT_EQUAL(-1000, from_hex("3903e7").number_value<int>());
+	CPPUNIT_ASSERT_EQUAL(65504.0, from_hex("f97bff").number_value<double>());
+	CPPUNIT_ASSERT_EQUAL(-4.1, from_hex("fbc010666666666666").number_value<double>());
+	CPPUNIT_ASSERT(from_hex("f97c00").is_null());
+	CPPUNIT_ASSERT(from_hex("f7").is_null());
+	CPPUNIT_ASSERT_EQUAL(std::string("AQIDBA"), from_hex("c24401020304").string_value());
+	CPPUNIT_ASSERT_EQUAL(std::string("streaming"), from_hex("7f657374726561646d696e67ff").string_value());
+	CPPUNIT_ASSERT_EQUAL(std::string("{\"a\":1,\"b\":[2,3]}"), from_hex("bf61610161629f0203ffff").to_string());
+	CPPUNIT_ASSERT_EQUAL(std::string("[1,[2,3],[4,5]]"), from_hex("9f018202039f0405ffff").to_string());
+
+	// Invalid: truncated, trailing data, non-text keys, duplicate keys, unexpected break, reserved info
+	CPPUNIT_ASSERT(!from_hex("1903"));
+	CPPUNIT_ASSERT(!from_hex("0000"));
+	CPPUNIT_ASSERT(!from_hex("a10102"));
+	CPPUNIT_ASSERT(!from_hex("a2616101616102"));
+	CPPUNIT_ASSERT(!from_hex("ff"));
+	CPPUNIT_ASSERT(!from_hex("1c"));
+	CPPUNIT_ASSERT(!from_hex("7f01ff"));
+	CPPUNIT_ASSERT(!from_hex("9bffffffffffffffff"));
+
+	// Round trip
+	std::string const doc = "{\"active\":true,\"big\":-9223372036854775808,\"e\":1e+300,\"empty\":{},\"list\":[null,false,0.25,\"x\\ny\"],\"name\":\"\xc3\xa4\"}";
+	auto const j = fz::json::parse(doc);
+	CPPUNIT_ASSERT(j);
+	fz::buffer b;
+	j.to_cbor(b);
+	auto const j2 = fz::json::parse_cbor(b);
+	CPPUNIT_ASSERT(j2);
+	CPPUNIT_ASSERT_EQUAL(doc, j2.to_string());
+	CPPUNIT_ASSERT_EQUAL(std::numeric_limits<int64_t>::min(), j2["big"].number_value<int64_t>());
+}
+
+void json_test::test_cbor_decoder()
+{
+	fz::json j;
+	j["data"] = std::string(300, 'x');
+	j["list"][2] = true;
+
+	// A sequence of items, fed byte by byte
+	fz::buffer encoded;
+	for (int i = 0; i < 3; ++i) {
+		j["id"] = i;
+		j.to_cbor(encoded);
+	}
+
+	fz::cbor_decoder decoder;
+	fz::buffer in;
+	std::vector<fz::json> decoded;
+	for (size_t i = 0; i < encoded.size(); ++i) {
+		in.append(encoded[i]);
+		while (auto v = decoder.decode(in)) {
+			decoded.emplace_back(std::move(v));
+		}
+		CPPUNIT_ASSERT(!decoder.failed());
+	}
+	CPPUNIT_ASSERT(in.empty());
+	CPPUNIT_ASSERT_EQUAL(size_t(3), decoded.size());
+	for (int i = 0; i < 3; ++i) {
+		j["id"] = i;
+		CPPUNIT_ASSERT_EQUAL(j.to_string(), decoded[i].to_string());
+	}
+
+	// Indefinite lengths
+	in.clear();
+	in.append(fz::hex_decode("bf61610161629f0203ff"));
+	CPPUNIT_ASSERT(!decoder.decode(in));
+	in.append(fz::hex_decode("ff7f6161"));
+	CPPUNIT_ASSERT_EQUAL(std::string("{\"a\":1,\"b\":[2,3]}"), decoder.decode(in).to_string());
+	CPPUNIT_ASSERT(!decoder.decode(in));
+	in.append(fz::hex_decode("ff"));
+	CPPUNIT_ASSERT_EQUAL(std::string("a"), decoder.decode(in).string_value());
+	CPPUNIT_ASSERT(!decoder.failed());
+
+	// Too deep
+	fz::cbor_decoder shallow(2);
+	in.clear();
+	in.append(fz::hex_decode("818181"));
+	CPPUNIT_ASSERT(!shallow.decode(in));
+	CPPUNIT_ASSERT(shallow.failed());
+
+	// Invalid
+	in.clear();
+	in.append(fz::hex_decode("a10102"));
+	CPPUNIT_ASSERT(!decoder.decode(in));
+	CPPUNIT_ASSERT(decoder.failed());
+	decoder.reset();
+	in.clear();
+	in.append(fz::hex_decode("f5"));
+	CPPUNIT_ASSERT(decoder.decode(in).bool_value());
+}
+
+void json_test::test_pointer()
+{
+	// Example from RFC 6901
+	std::string const doc = "{\"foo\": [\"bar\", \"baz\"], \"\": 0, \"a/b\": 1, \"c%d\": 2, \"e^f\": 3, \"g|h\": 4, "
+		"\"i\\\\j\": 5, \"k\\\"l\": 6, \" \": 7, \"m~n\": 8, \"01\": 9}";
+	auto j = fz::json::parse(doc);
+	CPPUNIT_ASSERT(j);
+	auto const d = fz::json_document::parse(doc);
+	CPPUNIT_ASSERT(d);
+
+	CPPUNIT_ASSERT(&fz::json_pointer("").get(j) == &j);
+	CPPUNIT_ASSERT_EQUAL(std::string("baz"), fz::json_pointer("/foo/1").get(j).string_value());
+	CPPUNIT_ASSERT_EQUAL(std::string("baz"), fz::json_pointer("/foo/1").get(d.root()).string_value());
+
+	std::pair<char const*, int> const members[] = {
+		{"/", 0}, {"/a~1b", 1}, {"/c%d", 2}, {"/e^f", 3}, {"/g|h", 4}, {"/i\\j", 5}, {"/k\"l", 6}, {"/ ", 7}, {"/m~0n", 8}, {"/01", 9}
+	};
+	for (auto const& m : members) {
+		fz::json_pointer const p(m.first);
+		CPPUNIT_ASSERT(p);
+		CPPUNIT_ASSERT_EQUAL(m.second, p.get(j).number_value<int>());
+		CPPUNIT_ASSERT_EQUAL(m.second, p.get(d.root()).number_value<int>());
+	}
+
+	// Missing values and invalid pointers
+	size_t const children = j.children();
+	char const* const missing[] = {"/nope", "/foo/2", "/foo/-", "/foo/01", "/foo/bar", "/a~1b/x"};
+	for (auto const& m : missing) {
+		fz::json_pointer const p(m);
+		CPPUNIT_ASSERT(p);
+		CPPUNIT_ASSERT(!p.get(j));
+		CPPUNIT_ASSERT(!p.get(d.root()));
+		CPPUNIT_ASSERT(!p.find(j));
+	}
+	CPPUNIT_ASSERT_EQUAL(children, j.children());
+	CPPUNIT_ASSERT(!fz::json_pointer("foo"));
+	CPPUNIT_ASSERT(!fz::json_pointer("/a~2"));
+	CPPUNIT_ASSERT(!fz::json_pointer("/a~"));
+	CPPUNIT_ASSERT(!fz::json_pointer("foo").get(j));
+
+	// Modifying through find
+	auto * v = fz::json_pointer("/foo/0").find(j);
+	CPPUNIT_ASSERT(v);
+	*v = "qux";
+	CPPUNIT_ASSERT_EQUAL(std::string("qux"), j["foo"][0].string_value());
+}
@@ -0,0 +1,132 @@
+#include "../lib/libfilezilla/json.hpp"
+#include "../lib/libfilezilla/time.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+// Compares fz::json, fz::json_document and fz::json_stream_parser on a generated payload
+// resembling a typical API response: parse time, the number of
+// allocations needed and the memory held by the parsed structure.
+
+namespace {
+size_t allocations{};
+size_t allocated{};
+
+// Every allocation is prefixed by its size, so that frees can be accounted for
+size_t const header = alignof(std::max_align_t);
+}
+
+void* operator new(size_t size)
+{
+	auto p = static_cast<char*>(std::malloc(size + header));
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	*reinterpret_cast<size_t*>(p) = size;
+	++allocations;
+	allocated += size;
+	return p + header;
+}
+
+void operator delete(void* ptr) noexcept
+{
+	if (ptr) {
+		auto p = static_cast<char*>(ptr) - header;
+		allocated -= *reinterpret_cast<size_t*>(p);
+		std::free(p);
+	}
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	operator delete(ptr);
+}
+
+namespace {
+std::string make_payload(size_t records, size_t text_size)
+{
+	std::string ret = "{\"status\":\"ok\",\"records\":[";
+	for (size_t i = 0; i < records; ++i) {
+		if (i) {
+			ret += ',';
+		}
+		auto const n = std::to_string(i);
+		ret += "\n {\"id\":" + n + ",\"name\":\"record " + n + "\",\"path\":\"/srv/data/" + n + "/file.bin\"";
+		ret += ",\"size\":" + std::to_string(i * 7919) + ",\"ratio\":0." + n + ",\"active\":" + (i % 2 ? "true" : "false");
+		ret += ",\"owner\":null,\"tags\":[\"a\",\"b\",\"c" + n + "\"],\"note\":\"line\\nbreak \\\"quoted\\\"\"";
+		ret += ",\"meta\":{\"created\":1700000000,\"modified\":1700000" + n + ",\"mode\":\"0644\"}";
+		if (text_size) {
+			ret += ",\"description\":\"";
+			for (size_t j = 0; j < text_size; j += 64) {
+				ret += j % 512 ? "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do " : "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed\\n";
+			}
+			ret += '"';
+		}
+		ret += '}';
+	}
+	ret += "\n]}";
+	return ret;
+}
+
+template<typename F>
+void run(char const* what, std::string const& payload, size_t rounds, F && parse)
+{
+	size_t const allocations_before = allocations;
+	size_t const allocated_before = allocated;
+	auto const start = fz::monotonic_clock::now();
+	for (size_t i = 0; i < rounds; ++i) {
+		auto v = parse(payload);
+		if (!v) {
+			std::cerr << what << ": parsing failed" << std::endl;
+			exit(1);
+		}
+	}
+	auto const elapsed = fz::monotonic_clock::now() - start;
+
+	// Once more to measure the memory held by the result
+	size_t const held_allocations_before = allocations;
+	[[maybe_unused]] auto const v = parse(payload);
+	size_t const held_allocations = allocations - held_allocations_before;
+	size_t const held = allocated - allocated_before;
+
+	std::cout << what << ": " << elapsed.get_milliseconds() * 1000 / static_cast<int64_t>(rounds) << " us/parse";
+	if (elapsed.get_milliseconds()) {
+		std::cout << ", " << (static_cast<int64_t>(payload.size() * rounds) / (elapsed.get_milliseconds() * 1000)) << " MB/s";
+	}
+	std::cout << ", " << (held_allocations_before - allocations_before) / rounds << " allocations/parse";
+	std::cout << ", " << held << " bytes in " << held_allocations << " allocations held" << std::endl;
+}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t records = 10000;
+	if (argc > 1) {
+		records = fz::to_integral<size_t>(std::string_view(argv[1]), records);
+	}
+	size_t const rounds = 20;
+
+	// The second payload has fewer records, each with a long text
+	for (size_t text_size : {0, 2048}) {
+		size_t const n = text_size ? records / 10 : records;
+		std::string const payload = make_payload(n, text_size);
+		std::cout << "Payload: " << payload.size() << " bytes, " << n << " records" << std::endl;
+
+		run("json", payload, rounds, [](std::string const& s) { return fz::json::parse(s); });
+		run("json_document", payload, rounds, [](std::string const& s) { return fz::json_document::parse(s); });
+
+		// Fed in chunks as they would come from a reader, with a handler ignoring all events
+		fz::json_stream_handler handler;
+		run("json_stream_parser", payload, rounds, [&handler](std::string const& s) {
+			fz::json_stream_parser parser(handler);
+			for (size_t i = 0; i < s.size(); i += 64 * 1024) {
+				parser.feed(std::string_view(s).substr(i, 64 * 1024));
+			}
+			return parser.finish();
+		});
+	}
+
+	return 0;
+}
@@ -0,0 +1,353 @@
+#include "../lib/libfilezilla/async_logger.hpp"
+#include "../lib/libfilezilla/mutex.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/throttled_logger.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include "test_utils.hpp"
+
+#include <thread>
+#include <vector>
+
+class logger_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(logger_test);
+	CPPUNIT_TEST(test_async);
+	CPPUNIT_TEST(test_async_block);
+	CPPUNIT_TEST(test_async_drop);
+	CPPUNIT_TEST(test_deferred);
+	CPPUNIT_TEST(test_utf8);
+	CPPUNIT_TEST(test_async_deferred);
+	CPPUNIT_TEST(test_throttled);
+	CPPUNIT_TEST(test_sampling);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_async();
+	void test_async_block();
+	void test_async_drop();
+	void test_deferred();
+	void test_utf8();
+	void test_async_deferred();
+	void test_throttled();
+	void test_sampling();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(logger_test);
+
+namespace {
+class collecting_logger final : public fz::logger_interface
+{
+public:
+	virtual void do_log(fz::logmsg::type t, std::wstring && msg) override
+	{
+		if (delay_) {
+			fz::sleep(delay_);
+		}
+		fz::scoped_lock l(m_);
+		messages_.emplace_back(t, std::move(msg));
+	}
+
+	size_t size()
+	{
+		fz::scoped_lock l(m_);
+		return messages_.size();
+	}
+
+	fz::mutex m_;
+	std::vector<std::pair<fz::logmsg::type, std::wstring>> messages_;
+	fz::duration delay_;
+};
+
+class deferring_logger final : public fz::logger_interface
+{
+public:
+	deferring_logger()
+	{
+		deferred_formatting_ = true;
+	}
+
+	virtual void do_log(fz::logmsg::type, std::wstring && msg) override
+	{
+		messages_.emplace_back(std::move(msg));
+	}
+
+	virtual void do_log_deferred(fz::logmsg::type, fz::deferred_log_message && msg) override
+	{
+		deferred_.emplace_back(std::move(msg));
+	}
+
+	std::vector<std::wstring> messages_;
+	std::vector<fz::deferred_log_message> deferred_;
+};
+
+class utf8_logger final : public fz::logger_interface
+{
+public:
+	utf8_logger()
+	{
+		prefers_utf8_ = true;
+	}
+
+	virtual void do_log(fz::logmsg::type, std::wstring && msg) override
+	{
+		messages_.emplace_back(std::move(msg));
+	}
+
+	virtual void do_log_utf8(fz::logmsg::type, std::string && msg) override
+	{
+		fz::scoped_lock l(m_);
+		utf8_.emplace_back(std::move(msg));
+	}
+
+	fz::mutex m_;
+	std::vector<std::wstring> messages_;
+	std::vector<std::string> utf8_;
+};
+}
+
+void logger_test::test_async()
+{
+	fz::thread_pool pool;
+	collecting_logger target;
+
+	size_t const threads = 4;
+	size_t const per_thread = 10000;
+	{
+		fz::async_logger log(target, pool, 64, fz::async_logger::overflow_policy::block);
+		log.set(fz::logmsg::debug_info, false);
+
+		std::vector<std::thread> producers;
+		for (size_t i = 0; i < threads; ++i) {
+			producers.emplace_back([&, i]() {
+				for (size_t j = 0; j < per_thread; ++j) {
+					log.log(fz::logmsg::status, L"%d %d", i, j);
+					log.log(fz::logmsg::debug_info, "filtered");
+				}
+			});
+		}
+		for (auto & t : producers) {
+			t.join();
+		}
+
+		log.flush();
+		CPPUNIT_ASSERT_EQUAL(threads * per_thread, target.size());
+		CPPUNIT_ASSERT_EQUAL(uint64_t(0), log.dropped());
+
+		log.log_raw(fz::logmsg::error, "last");
+	}
+
+	// The destructor drains the queue
+	CPPUNIT_ASSERT_EQUAL(threads * per_thread + 1, target.size());
+	CPPUNIT_ASSERT(target.messages_.back().second == L"last");
+	CPPUNIT_ASSERT_EQUAL(fz::logmsg::error, target.messages_.back().first);
+
+	// Each thread's messages arrive in order
+	std::vector<size_t> next(threads);
+	for (size_t i = 0; i < threads * per_thread; ++i) {
+		auto const& m = target.messages_[i];
+		CPPUNIT_ASSERT_EQUAL(fz::logmsg::status, m.first);
+		auto const space = m.second.find(' ');
+		size_t const thread = fz::to_integral<size_t>(m.second.substr(0, space));
+		size_t const seq = fz::to_integral<size_t>(m.second.substr(space + 1));
+		CPPUNIT_ASSERT(thread < threads);
+		CPPUNIT_ASSERT_EQUAL(next[thread], seq);
+		++next[thread];
+	}
+}
+
+void logger_test::test_async_block()
+{
+	fz::thread_pool pool;
+	collecting_logger target;
+	target.delay_ = fz::duration::from_milliseconds(1);
+
+	fz::async_logger log(target, pool, 4, fz::async_logger::overflow_policy::block);
+	for (int i = 0; i < 50; ++i) {
+		log.log(fz::logmsg::status, L"%d", i);
+	}
+	log.flush();
+	CPPUNIT_ASSERT_EQUAL(size_t(50), target.size());
+	CPPUNIT_ASSERT_EQUAL(uint64_t(0), log.dropped());
+}
+
+void logger_test::test_async_drop()
+{
+	for (auto policy : {fz::async_logger::overflow_policy::drop, fz::async_logger::overflow_policy::count}) {
+		fz::thread_pool pool;
+		collecting_logger target;
+		target.delay_ = fz::duration::from_milliseconds(5);
+
+		uint64_t dropped{};
+		{
+			fz::async_logger log(target, pool, 4, policy);
+			for (int i = 0; i < 50; ++i) {
+				log.log(fz::logmsg::status, L"%d", i);
+			}
+			dropped = log.dropped();
+		}
+		CPPUNIT_ASSERT(dropped > 0);
+
+		size_t logged{};
+		bool reported{};
+		for (auto const& m : target.messages_) {
+			if (m.first == fz::logmsg::status) {
+				++logged;
+			}
+			else {
+				reported = true;
+				CPPUNIT_ASSERT(m.second.find(L"dropped") != std::wstring::npos);
+			}
+		}
+		CPPUNIT_ASSERT_EQUAL(size_t(50), logged + dropped);
+		CPPUNIT_ASSERT_EQUAL(policy == fz::async_logger::overflow_policy::count, reported);
+	}
+}
+
+void logger_test::test_deferred()
+{
+	deferring_logger log;
+
+	{
+		std::string narrow = "narrow";
+		std::wstring wide = L"wide \u00e4";
+		log.log(fz::logmsg::status, FZ_FORMAT("%s %s %d %x"), narrow, wide, -42, 255u);
+		narrow = "changed";
+		wide.clear();
+	}
+	log.log_u(fz::logmsg::status, FZ_FORMAT(L"%s|%5d"), "\xc3\xa4", 7);
+
+	// Too big to be stored inline
+	std::string const big(100, 'x');
+	log.log(fz::logmsg::status, FZ_FORMAT("%s%s%s%c"), big, big, big, 'y');
+
+	// Not using FZ_FORMAT, gets formatted right away
+	log.log(fz::logmsg::status, "%d", 5);
+	log.log(fz::logmsg::debug_debug, FZ_FORMAT("filtered %d"), 5);
+
+	CPPUNIT_ASSERT_EQUAL(size_t(3), log.deferred_.size());
+	CPPUNIT_ASSERT_EQUAL(size_t(1), log.messages_.size());
+	CPPUNIT_ASSERT(log.messages_[0] == L"5");
+
+	// Moving the records around must not invalidate them
+	std::vector<fz::deferred_log_message> moved;
+	for (auto & m : log.deferred_) {
+		moved.emplace_back(std::move(m));
+		CPPUNIT_ASSERT(!m);
+	}
+	log.deferred_.clear();
+
+	CPPUNIT_ASSERT(moved[0].format() == L"narrow wide \u00e4 -42 ff");
+	CPPUNIT_ASSERT_EQUAL(std::string("narrow wide \xc3\xa4 -42 ff"), moved[0].format_utf8());
+	CPPUNIT_ASSERT(moved[1].format() == L"\u00e4|    7");
+	CPPUNIT_ASSERT_EQUAL(std::string("\xc3\xa4|    7"), moved[1].format_utf8());
+	CPPUNIT_ASSERT_EQUAL(big + big + big + "y", moved[2].format_utf8());
+
+	fz::deferred_log_message empty;
+	CPPUNIT_ASSERT(!empty);
+	CPPUNIT_ASSERT(empty.format().empty());
+}
+
+void logger_test::test_utf8()
+{
+	utf8_logger log;
+	log.log(fz::logmsg::status, FZ_FORMAT("%s %d"), std::wstring(L"\u00e4"), 1);
+	log.log_u(fz::logmsg::status, FZ_FORMAT("%s"), std::string("\xc3\xb6"));
+	log.log_raw(fz::logmsg::status, "raw");
+	log.log(fz::logmsg::status, "%d", 2);
+
+	CPPUNIT_ASSERT_EQUAL(size_t(3), log.utf8_.size());
+	CPPUNIT_ASSERT_EQUAL(std::string("\xc3\xa4 1"), log.utf8_[0]);
+	CPPUNIT_ASSERT_EQUAL(std::string("\xc3\xb6"), log.utf8_[1]);
+	CPPUNIT_ASSERT_EQUAL(std::string("raw"), log.utf8_[2]);
+
+	CPPUNIT_ASSERT_EQUAL(size_t(1), log.messages_.size());
+	CPPUNIT_ASSERT(log.messages_[0] == L"2");
+}
+
+void logger_test::test_async_deferred()
+{
+	fz::thread_pool pool;
+	collecting_logger wide;
+	utf8_logger utf8;
+	{
+		fz::async_logger log1(wide, pool);
+		fz::async_logger log2(utf8, pool);
+		for (int i = 0; i < 100; ++i) {
+			std::string const s = fz::to_string(i);
+			log1.log(fz::logmsg::status, FZ_FORMAT("%s-%d"), s, i);
+			log2.log(fz::logmsg::status, FZ_FORMAT(L"%s-%d"), s, i);
+		}
+	}
+
+	CPPUNIT_ASSERT_EQUAL(size_t(100), wide.messages_.size());
+	CPPUNIT_ASSERT_EQUAL(size_t(100), utf8.utf8_.size());
+	for (int i = 0; i < 100; ++i) {
+		CPPUNIT_ASSERT(wide.messages_[i].second == fz::to_wstring(i) + L"-" + fz::to_wstring(i));
+		CPPUNIT_ASSERT_EQUAL(fz::to_string(i) + "-" + fz::to_string(i), utf8.utf8_[i]);
+	}
+}
+
+void logger_test::test_throttled()
+{
+	collecting_logger target;
+	{
+		fz::throttled_logger log(target, fz::duration::from_seconds(3600), 3);
+		for (int i = 0; i < 100; ++i) {
+			log.log(fz::logmsg::error, FZ_FORMAT("Connection %d failed"), i);
+			log.log(fz::logmsg::status, "identical");
+			log.log(fz::logmsg::status, "distinct %d", i % 2);
+		}
+		// Different type, not similar
+		log.log(fz::logmsg::command, "identical");
+		CPPUNIT_ASSERT_EQUAL(size_t(3 + 3 + 6 + 1), target.size());
+	}
+
+	// Destructor logs the summaries
+	CPPUNIT_ASSERT_EQUAL(size_t(3 + 3 + 6 + 1 + 4), target.size());
+
+	size_t found{};
+	for (auto const& m : target.messages_) {
+		if (m.second == L"97 similar messages have been suppressed, the last one was: Connection 99 failed") {
+			CPPUNIT_ASSERT_EQUAL(fz::logmsg::error, m.first);
+			++found;
+		}
+		else if (m.second == L"97 similar messages have been suppressed, the last one was: identical") {
+			++found;
+		}
+		else if (m.second == L"47 similar messages have been suppressed, the last one was: distinct 0" || m.second == L"47 similar messages have been suppressed, the last one was: distinct 1") {
+			++found;
+		}
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(4), found);
+}
+
+void logger_test::test_sampling()
+{
+	collecting_logger target;
+	{
+		fz::throttled_logger log(target, fz::duration::from_seconds(3600), 1000);
+		log.set_sampling(fz::logmsg::status, 10);
+		for (int i = 0; i < 100; ++i) {
+			log.log(fz::logmsg::status, FZ_FORMAT("%d"), i);
+			log.log(fz::logmsg::error, FZ_FORMAT("%d"), i);
+		}
+		CPPUNIT_ASSERT_EQUAL(size_t(110), target.size());
+		std::wstring sampled;
+		for (auto const& m : target.messages_) {
+			if (m.first == fz::logmsg::status) {
+				sampled += m.second + L" ";
+			}
+		}
+		CPPUNIT_ASSERT(sampled == L"0 10 20 30 40 50 60 70 80 90 ");
+
+		log.flush();
+		CPPUNIT_ASSERT_EQUAL(size_t(111), target.size());
+		CPPUNIT_ASSERT(target.messages_.back().second == L"90 messages have been skipped by sampling");
+		CPPUNIT_ASSERT_EQUAL(fz::logmsg::status, target.messages_.back().first);
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(111), target.size());
+}
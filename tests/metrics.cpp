@@ -0,0 +1,155 @@
+#include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/metrics.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+
+#include "test_utils.hpp"
+
+#include <vector>
+
+class metrics_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(metrics_test);
+	CPPUNIT_TEST(test_counter);
+	CPPUNIT_TEST(test_histogram);
+	CPPUNIT_TEST(test_registry);
+	CPPUNIT_TEST(test_openmetrics);
+	CPPUNIT_TEST(test_collector);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_counter();
+	void test_histogram();
+	void test_registry();
+	void test_openmetrics();
+	void test_collector();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(metrics_test);
+
+namespace {
+std::string to_string(fz::metrics_registry const& registry)
+{
+	fz::buffer b;
+	registry.write_openmetrics(b);
+	return std::string(b.to_view());
+}
+}
+
+void metrics_test::test_counter()
+{
+	fz::metric_counter c;
+
+	fz::thread_pool pool;
+	std::vector<fz::async_task> tasks;
+	for (int i = 0; i < 4; ++i) {
+		tasks.emplace_back(pool.spawn([&c]{
+			for (int j = 0; j < 1000; ++j) {
+				c.add();
+			}
+		}));
+	}
+	for (auto & t : tasks) {
+		t.join();
+	}
+	c.add(5);
+
+	CPPUNIT_ASSERT_EQUAL(uint64_t(4005), c.value());
+}
+
+void metrics_test::test_histogram()
+{
+	fz::metric_histogram h({10, 100});
+	h.observe(1);
+	h.observe(10);
+	h.observe(11);
+	h.observe(1000);
+
+	auto const counts = h.counts();
+	CPPUNIT_ASSERT_EQUAL(size_t(3), counts.size());
+	CPPUNIT_ASSERT_EQUAL(uint64_t(2), counts[0]);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), counts[1]);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), counts[2]);
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1022), h.sum());
+}
+
+void metrics_test::test_registry()
+{
+	fz::metrics_registry registry;
+
+	auto * c = registry.counter("requests", "Requests", {{"method", "GET"}});
+	CPPUNIT_ASSERT(c);
+	CPPUNIT_ASSERT(c == registry.counter("requests", "Requests", {{"method", "GET"}}));
+	CPPUNIT_ASSERT(c != registry.counter("requests", "Requests", {{"method", "PUT"}}));
+
+	// Type mismatch
+	CPPUNIT_ASSERT(!registry.gauge("requests", "Requests"));
+
+	// Invalid names
+	CPPUNIT_ASSERT(!registry.gauge("", "Empty"));
+	CPPUNIT_ASSERT(!registry.gauge("1st", "Leading digit"));
+	CPPUNIT_ASSERT(!registry.gauge("a-b", "Dash"));
+	CPPUNIT_ASSERT(!registry.gauge("ok", "Bad label", {{"a b", "c"}}));
+	CPPUNIT_ASSERT(registry.gauge("ns:ok", "Colon"));
+
+	// Bounds of the first histogram of a family are used
+	auto * h = registry.histogram("latency", "Latency", {1, 2}, {{"a", "1"}});
+	CPPUNIT_ASSERT(h);
+	auto * h2 = registry.histogram("latency", "Latency", {5}, {{"a", "2"}});
+	CPPUNIT_ASSERT(h2);
+	CPPUNIT_ASSERT_EQUAL(size_t(2), h2->bounds().size());
+}
+
+void metrics_test::test_openmetrics()
+{
+	fz::metrics_registry registry;
+
+	registry.counter("requests", "Requests served", {{"path", "/a\"b"}})->add(3);
+	registry.gauge("connections", "Open connections")->set(-2);
+	auto * h = registry.histogram("size_bytes", "Sizes", {10, 100});
+	h->observe(5);
+	h->observe(50);
+	h->observe(500);
+
+	std::string const expected =
+		"# TYPE connections gauge\n"
+		"# HELP connections Open connections\n"
+		"connections -2\n"
+		"# TYPE requests counter\n"
+		"# HELP requests Requests served\n"
+		"requests_total{path=\"/a\\\"b\"} 3\n"
+		"# TYPE size_bytes histogram\n"
+		"# HELP size_bytes Sizes\n"
+		"size_bytes_bucket{le=\"10\"} 1\n"
+		"size_bytes_bucket{le=\"100\"} 2\n"
+		"size_bytes_bucket{le=\"+Inf\"} 3\n"
+		"size_bytes_count 3\n"
+		"size_bytes_sum 555\n"
+		"# EOF\n";
+	CPPUNIT_ASSERT_EQUAL(expected, to_string(registry));
+}
+
+void metrics_test::test_collector()
+{
+	fz::metrics_registry registry;
+	fz::thread_pool pool;
+
+	size_t const id = fz::add_thread_pool_metrics(registry, pool, {{"pool", "main"}});
+	CPPUNIT_ASSERT(id);
+
+	auto const collector = registry.add_collector([](fz::metrics_sink & sink) {
+		sink.counter("custom", "Custom", {}, 7);
+	});
+
+	auto s = to_string(registry);
+	CPPUNIT_ASSERT(s.find("# TYPE fz_thread_pool_threads gauge\n") != std::string::npos);
+	CPPUNIT_ASSERT(s.find("fz_thread_pool_threads{pool=\"main\"} ") != std::string::npos);
+	CPPUNIT_ASSERT(s.find("custom_total 7\n") != std::string::npos);
+	CPPUNIT_ASSERT(s.size() >= 6 && s.substr(s.size() - 6) == "# EOF\n");
+
+	registry.remove_collector(id);
+	registry.remove_collector(collector);
+	CPPUNIT_ASSERT_EQUAL(std::string("# EOF\n"), to_string(registry));
+}
@@ -0,0 +1,150 @@
+#include "../lib/libfilezilla/mutex.hpp"
+#include "../lib/libfilezilla/rwmutex.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Compares regular and adaptive mutexes with the short critical sections typical
+// for event queues and buffer handoffs, as well as the read side of the rw mutexes:
+// - lock: All threads increment a shared counter under the lock
+// - handoff: Producers pass items to a single consumer through a queue and a condition
+// - read: All threads take read locks on rwmutex and biased_rwmutex
+//
+// Usage: mutex_bench [threads] [operations per thread]
+//
+// Spinning only pays off if the lock owner is running on another CPU, expect no gain
+// on single-CPU systems.
+
+namespace {
+void report(char const* what, char const* type, size_t n, fz::monotonic_clock const& start)
+{
+	auto const elapsed = fz::monotonic_clock::now() - start;
+	std::cout << what << " (" << type << "): " << n << " operations in " << elapsed.get_milliseconds() << " ms";
+	if (n) {
+		std::cout << ", " << (elapsed.get_milliseconds() * 1000000 / static_cast<int64_t>(n)) << " ns/op";
+	}
+	std::cout << std::endl;
+}
+
+void run_lock(char const* type, fz::mutex & m, fz::thread_pool & pool, size_t threads, size_t ops)
+{
+	size_t counter{};
+
+	auto const start = fz::monotonic_clock::now();
+	std::vector<fz::async_task> tasks;
+	for (size_t t = 0; t < threads; ++t) {
+		tasks.push_back(pool.spawn([&] {
+			for (size_t i = 0; i < ops; ++i) {
+				fz::scoped_lock l(m);
+				++counter;
+			}
+		}));
+	}
+	for (auto & task : tasks) {
+		task.join();
+	}
+	report("lock", type, threads * ops, start);
+
+	if (counter != threads * ops) {
+		std::cerr << "Lost increments" << std::endl;
+		abort();
+	}
+}
+
+template<typename Mutex, typename Lock>
+void run_read(char const* type, Mutex & m, fz::thread_pool & pool, size_t threads, size_t ops)
+{
+	std::atomic<size_t> sum{};
+
+	auto const start = fz::monotonic_clock::now();
+	std::vector<fz::async_task> tasks;
+	for (size_t t = 0; t < threads; ++t) {
+		tasks.push_back(pool.spawn([&] {
+			size_t local{};
+			for (size_t i = 0; i < ops; ++i) {
+				Lock l(m);
+				local += i;
+			}
+			sum += local;
+		}));
+	}
+	for (auto & task : tasks) {
+		task.join();
+	}
+	report("read", type, threads * ops, start);
+}
+
+void run_handoff(char const* type, fz::mutex & m, fz::thread_pool & pool, size_t threads, size_t ops)
+{
+	fz::condition cond;
+	std::deque<size_t> queue;
+	size_t const total = threads * ops;
+
+	auto const start = fz::monotonic_clock::now();
+	std::vector<fz::async_task> tasks;
+	for (size_t t = 0; t < threads; ++t) {
+		tasks.push_back(pool.spawn([&] {
+			for (size_t i = 0; i < ops; ++i) {
+				fz::scoped_lock l(m);
+				queue.push_back(i);
+				cond.signal(l);
+			}
+		}));
+	}
+
+	size_t received{};
+	{
+		fz::scoped_lock l(m);
+		while (received < total) {
+			if (queue.empty()) {
+				cond.wait(l);
+				continue;
+			}
+			queue.pop_front();
+			++received;
+		}
+	}
+	for (auto & task : tasks) {
+		task.join();
+	}
+	report("handoff", type, total, start);
+}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t threads = std::max(2u, std::thread::hardware_concurrency());
+	size_t ops = 1000000;
+	if (argc > 1) {
+		threads = fz::to_integral<size_t>(std::string_view(argv[1]), threads);
+	}
+	if (argc > 2) {
+		ops = fz::to_integral<size_t>(std::string_view(argv[2]), ops);
+	}
+
+	std::cout << threads << " threads, " << std::thread::hardware_concurrency() << " CPUs" << std::endl;
+
+	fz::thread_pool pool;
+	for (int round = 0; round < 2; ++round) {
+		fz::mutex regular(false);
+		fz::mutex adaptive(fz::mutex::adaptive);
+
+		run_lock("regular", regular, pool, threads, ops);
+		run_lock("adaptive", adaptive, pool, threads, ops);
+		run_handoff("regular", regular, pool, threads, ops / 4);
+		run_handoff("adaptive", adaptive, pool, threads, ops / 4);
+
+		fz::rwmutex rw;
+		fz::biased_rwmutex biased;
+		run_read<fz::rwmutex, fz::scoped_read_lock>("rwmutex", rw, pool, threads, ops);
+		run_read<fz::biased_rwmutex, fz::scoped_biased_read_lock>("biased", biased, pool, threads, ops);
+	}
+
+	return 0;
+}
@@ -0,0 +1,383 @@
+#include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/event_handler.hpp"
+#include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/local_filesys.hpp"
+#include "../lib/libfilezilla/process.hpp"
+#include "../lib/libfilezilla/process_pool.hpp"
+#include "../lib/libfilezilla/reactor.hpp"
+#include "../lib/libfilezilla/socket.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include "test_utils.hpp"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <string.h>
+
+#ifndef FZ_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class process_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(process_test);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_redirect);
+	CPPUNIT_TEST(test_extra_fds);
+	CPPUNIT_TEST(test_closeall);
+	CPPUNIT_TEST(test_vectored);
+#ifdef __linux__
+	CPPUNIT_TEST(test_splice);
+#endif
+	CPPUNIT_TEST(test_process_pool);
+	CPPUNIT_TEST(test_reactor);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_redirect();
+	void test_extra_fds();
+	void test_closeall();
+	void test_vectored();
+	void test_splice();
+	void test_process_pool();
+	void test_reactor();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(process_test);
+
+#ifndef FZ_WINDOWS
+namespace {
+std::string read_all(fz::process & p)
+{
+	std::string ret;
+	char buf[1024];
+	while (true) {
+		auto r = p.read(buf, sizeof(buf));
+		if (!r || !r.value_) {
+			break;
+		}
+		ret.append(buf, r.value_);
+	}
+	return ret;
+}
+}
+
+void process_test::test_redirect()
+{
+	fz::process p;
+	CPPUNIT_ASSERT(p.spawn(fzT("/bin/sh"), {fzT("-c"), fzT("read line; echo \"got $line\"")}));
+
+	std::string const line = "hello\n";
+	auto r = p.write(line.c_str(), line.size());
+	CPPUNIT_ASSERT(r && r.value_ == line.size());
+
+	ASSERT_EQUAL(std::string("got hello\n"), read_all(p));
+	CPPUNIT_ASSERT(p.stop(fz::duration::from_seconds(10)));
+}
+
+void process_test::test_extra_fds()
+{
+	int fds[2];
+	CPPUNIT_ASSERT(!pipe(fds));
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	fz::process p;
+	auto const fd = fz::to_native(std::to_string(fds[1]));
+	CPPUNIT_ASSERT(p.spawn(fzT("/bin/sh"), {fzT("-c"), fzT("echo extra >&") + fd}, {fds[1]}));
+	close(fds[1]);
+
+	// Descriptor stays close-on-exec in the parent
+	CPPUNIT_ASSERT(fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+
+	char buf[64]{};
+	ssize_t r = read(fds[0], buf, sizeof(buf) - 1);
+	close(fds[0]);
+	CPPUNIT_ASSERT(r > 0);
+	ASSERT_EQUAL(std::string("extra\n"), std::string(buf, static_cast<size_t>(r)));
+
+	ASSERT_EQUAL(std::string(), read_all(p));
+	CPPUNIT_ASSERT(p.stop(fz::duration::from_seconds(10)));
+}
+
+void process_test::test_closeall()
+{
+	fz::process p;
+	CPPUNIT_ASSERT(p.spawn(fzT("/bin/true"), std::vector<fz::native_string>(), fz::process::io_redirection::closeall));
+	CPPUNIT_ASSERT(p.stop(fz::duration::from_seconds(10)));
+
+	// A program that does not exist either fails to spawn or cannot be read from
+	fz::process missing;
+	if (missing.spawn(fzT("/nonexistent/fz_test_program"))) {
+		ASSERT_EQUAL(std::string(), read_all(missing));
+	}
+}
+
+void process_test::test_vectored()
+{
+	fz::process p;
+	CPPUNIT_ASSERT(p.spawn(fzT("/bin/sh"), {fzT("-c"), fzT("read line; echo \"got $line\"; echo 0123456789")}));
+
+	fz::socket_const_iovec const out[3]{{"hel", 3}, {"", 0}, {"lo\n", 3}};
+	auto r = p.writev(out, 3);
+	CPPUNIT_ASSERT(r && r.value_ == 6);
+
+	// Into a buffer, it grows as needed
+	fz::buffer buf;
+	while (buf.size() < 10) {
+		r = p.read(buf, 4);
+		CPPUNIT_ASSERT(r && r.value_ && r.value_ <= 4);
+	}
+	ASSERT_EQUAL(std::string("got hello\n"), std::string(buf.to_view().substr(0, 10)));
+	buf.consume(10);
+
+	// Scattered over multiple buffers
+	std::string in;
+	while (true) {
+		char a[4], b[3], c[64];
+		fz::socket_iovec const bufs[3]{{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+		r = p.readv(bufs, 3);
+		CPPUNIT_ASSERT(r);
+		if (!r.value_) {
+			break;
+		}
+		std::string data = std::string(a, sizeof(a)) + std::string(b, sizeof(b)) + std::string(c, sizeof(c));
+		in += data.substr(0, r.value_);
+	}
+	ASSERT_EQUAL(std::string("0123456789\n"), std::string(buf.to_view()) + in);
+	CPPUNIT_ASSERT(p.stop(fz::duration::from_seconds(10)));
+}
+
+void process_test::test_splice()
+{
+	int in[2];
+	int out[2];
+	CPPUNIT_ASSERT(!pipe(in));
+	CPPUNIT_ASSERT(!pipe(out));
+
+	std::string const line = "hello\n";
+	CPPUNIT_ASSERT(write(in[1], line.c_str(), line.size()) == static_cast<ssize_t>(line.size()));
+	close(in[1]);
+
+	fz::process p;
+	CPPUNIT_ASSERT(p.spawn(fzT("/bin/sh"), {fzT("-c"), fzT("read line; echo \"got $line\"")}));
+
+	auto r = p.splice_from(in[0], 1024);
+	close(in[0]);
+	CPPUNIT_ASSERT(r && r.value_ == line.size());
+
+	do {
+		r = p.splice_to(out[1], 1024);
+		CPPUNIT_ASSERT(r);
+	} while (r.value_);
+	close(out[1]);
+
+	char buf[64]{};
+	ssize_t const read = ::read(out[0], buf, sizeof(buf));
+	close(out[0]);
+	CPPUNIT_ASSERT(read > 0);
+	ASSERT_EQUAL(std::string("got hello\n"), std::string(buf, static_cast<size_t>(read)));
+	CPPUNIT_ASSERT(p.stop(fz::duration::from_seconds(10)));
+}
+
+namespace {
+class pool_client final : public fz::event_handler
+{
+public:
+	explicit pool_client(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	virtual ~pool_client()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::process_pool_response_event>(ev, this, &pool_client::on_response);
+	}
+
+	void on_response(uint64_t id, int error, std::string const& response)
+	{
+		fz::scoped_lock l(m_);
+		responses_[id] = std::make_pair(error, response);
+		cond_.signal(l);
+	}
+
+	std::pair<int, std::string> wait(uint64_t id)
+	{
+		CPPUNIT_ASSERT(id);
+		fz::scoped_lock l(m_);
+		while (!responses_.count(id)) {
+			CPPUNIT_ASSERT(cond_.wait(l, fz::duration::from_seconds(10)));
+		}
+		return responses_[id];
+	}
+
+private:
+	fz::mutex m_;
+	fz::condition cond_;
+	std::map<uint64_t, std::pair<int, std::string>> responses_;
+};
+
+std::pair<int, std::string> ok(std::string const& response)
+{
+	return std::make_pair(0, response);
+}
+}
+
+void process_test::test_process_pool()
+{
+	// Built alongside the tests
+	fz::native_string const helper = fzT("./process_pool_peer");
+	CPPUNIT_ASSERT(fz::local_filesys::get_file_type(helper) == fz::local_filesys::file);
+
+	fz::thread_pool tpool;
+	fz::event_loop loop(tpool);
+	pool_client c(loop);
+
+	fz::process_pool_options options;
+	options.max_workers = 3;
+	options.idle_timeout = fz::duration::from_milliseconds(300);
+	fz::process_pool pool(loop, tpool, helper, {}, options);
+
+	CPPUNIT_ASSERT(pool.prewarm(nullptr));
+	ASSERT_EQUAL(size_t(1), pool.worker_count());
+
+	// Sequential requests are served by the same worker
+	auto const pid = c.wait(pool.submit(nullptr, "pid", c));
+	ASSERT_EQUAL(0, pid.first);
+	CPPUNIT_ASSERT(pid == c.wait(pool.submit(nullptr, "pid", c)));
+	ASSERT_EQUAL(size_t(1), pool.worker_count());
+
+	// Concurrent requests get more workers spawned
+	std::vector<uint64_t> ids;
+	for (int i = 0; i < 6; ++i) {
+		ids.push_back(pool.submit(nullptr, "sleep", c));
+	}
+	for (auto id : ids) {
+		CPPUNIT_ASSERT(ok("SLEEP") == c.wait(id));
+	}
+	ASSERT_EQUAL(size_t(3), pool.worker_count());
+
+	// Down to min_workers again after the idle timeout
+	for (int i = 0; i < 100 && pool.worker_count() > 1; ++i) {
+		fz::sleep(fz::duration::from_milliseconds(100));
+	}
+	ASSERT_EQUAL(size_t(1), pool.worker_count());
+
+	// Large requests and responses
+	std::string const large(1000000, 'a');
+	CPPUNIT_ASSERT(ok(std::string(large.size(), 'A')) == c.wait(pool.submit(nullptr, large, c)));
+
+	// Pending requests fail if the worker quits, it gets replaced
+	ASSERT_EQUAL(EPIPE, c.wait(pool.submit(nullptr, "crash", c)).first);
+	CPPUNIT_ASSERT(ok("HELLO") == c.wait(pool.submit(nullptr, "hello", c)));
+	CPPUNIT_ASSERT(pid != c.wait(pool.submit(nullptr, "pid", c)));
+
+	pool.cancel(c);
+}
+
+namespace {
+class pipe_client final : public fz::event_handler
+{
+public:
+	explicit pipe_client(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	virtual ~pipe_client()
+	{
+		remove_handler();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::process_event>(ev, this, &pipe_client::on_process_event);
+	}
+
+	void on_process_event(fz::process* p, fz::process_event_flag flag)
+	{
+		if (flag != fz::process_event_flag::read) {
+			return;
+		}
+
+		char buf[1024];
+		while (true) {
+			auto r = p->read(buf, sizeof(buf));
+			if (!r && r.error_ == fz::rwresult::wouldblock) {
+				return;
+			}
+
+			fz::scoped_lock l(m_);
+			if (!r || !r.value_) {
+				++finished_;
+				cond_.signal(l);
+				return;
+			}
+			output_[p].append(buf, r.value_);
+		}
+	}
+
+	bool wait(size_t count)
+	{
+		fz::scoped_lock l(m_);
+		while (finished_ < count) {
+			if (!cond_.wait(l, fz::duration::from_seconds(10))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::string output(fz::process* p)
+	{
+		fz::scoped_lock l(m_);
+		return output_[p];
+	}
+
+private:
+	fz::mutex m_;
+	fz::condition cond_;
+	size_t finished_{};
+	std::map<fz::process*, std::string> output_;
+};
+}
+
+void process_test::test_reactor()
+{
+	fz::thread_pool tpool;
+	fz::event_loop loop(tpool);
+	fz::reactor r(tpool);
+	pipe_client c(loop);
+
+	// All processes share the reactor's thread instead of having one each
+	std::vector<std::unique_ptr<fz::process>> processes;
+	for (int i = 0; i < 20; ++i) {
+		auto p = std::make_unique<fz::process>(r, c);
+		CPPUNIT_ASSERT(p->spawn(fzT("/bin/sh"), {fzT("-c"), fzT("read line; echo \"got $line\"")}));
+
+		std::string const line = "hello " + std::to_string(i) + "\n";
+		auto w = p->write(line.c_str(), line.size());
+		CPPUNIT_ASSERT(w && w.value_ == line.size());
+		processes.push_back(std::move(p));
+	}
+
+	CPPUNIT_ASSERT(c.wait(processes.size()));
+	for (size_t i = 0; i < processes.size(); ++i) {
+		ASSERT_EQUAL("got hello " + std::to_string(i) + "\n", c.output(processes[i].get()));
+		CPPUNIT_ASSERT(processes[i]->stop(fz::duration::from_seconds(10)));
+	}
+	processes.clear();
+}
+#endif
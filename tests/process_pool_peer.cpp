@@ -0,0 +1,36 @@
+#include "../lib/libfilezilla/process_pool.hpp"
+#include "../lib/libfilezilla/string.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include <stdlib.h>
+
+#ifdef FZ_WINDOWS
+#include "../lib/libfilezilla/glue/windows.hpp"
+#else
+#include <unistd.h>
+#endif
+
+// Worker side of the process_pool tests
+//
+// Responds to "pid" with its process id, exits on "crash", answers
+// "sleep" after a short while and echoes everything else in uppercase.
+int main()
+{
+	bool const ok = fz::serve_process_pool_requests([](std::string_view const& request) -> std::string {
+		if (request == "pid") {
+#ifdef FZ_WINDOWS
+			return fz::to_string(GetCurrentProcessId());
+#else
+			return fz::to_string(getpid());
+#endif
+		}
+		if (request == "crash") {
+			exit(1);
+		}
+		if (request == "sleep") {
+			fz::sleep(fz::duration::from_milliseconds(200));
+		}
+		return fz::str_toupper_ascii(request);
+	});
+	return ok ? 0 : 1;
+}
@@ -1,16 +1,24 @@
+#include "../lib/libfilezilla/keyed_rate_limiter.hpp"
 #include "../lib/libfilezilla/rate_limiter.hpp"
 
 #include <array>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string.h>
+#include <vector>
 
 struct handler : public fz::event_handler
 {
-	handler(fz::event_loop & loop)
+	handler(fz::event_loop & loop, int frequency, bool pacing)
 	    : fz::event_handler(loop)
 	    , loop_(loop)
 	    , mgr_(loop)
 	    , start_(fz::monotonic_clock::now())
 	{
+		mgr_.set_frequency(frequency);
+		mgr_.set_pacing(pacing);
 		mgr_.add(&limiter_);
 
 		add_timer(fz::duration::from_milliseconds(10), false);
@@ -68,6 +76,19 @@ struct handler : public fz::event_handler
 				exit(1);
 			}
 
+			auto const stats = mgr_.get_stats();
+			auto const in = fz::direction::inbound;
+			std::cout << "Granted " << stats.granted[in] << ", consumed " << stats.consumed[in] << ", wasted " << stats.wasted[in]
+			          << ", " << stats.waits[in] << " waits, " << stats.wakeups[in] << " wakeups, waited for " << stats.wait_time[in].get_milliseconds() << " ms\n";
+			if (stats.buckets != buckets_.size() || !stats.distributions || stats.consumed[in] < sum || stats.consumed[in] > stats.granted[in] || !stats.waits[in] || !stats.wakeups[in]) {
+				std::cout << "Bad statistics" << std::endl;
+				exit(1);
+			}
+			if (sub_limiter_[0].get_stats().buckets != 2 || buckets_[5].get_stats().consumed[in] < consumed_[5]) {
+				std::cout << "Bad limiter or bucket statistics" << std::endl;
+				exit(1);
+			}
+
 			loop_.stop();
 		}
 
@@ -97,13 +118,206 @@ struct handler : public fz::event_handler
 	fz::monotonic_clock start_;
 };
 
-int main()
+// Greedy buckets with different shares and priorities next to a nearly idle one
+struct weighted_handler : public fz::event_handler
+{
+	weighted_handler(fz::event_loop & loop)
+	    : fz::event_handler(loop)
+	    , loop_(loop)
+	    , mgr_(loop)
+	    , start_(fz::monotonic_clock::now())
+	{
+		mgr_.add(&limiter_);
+
+		add_timer(fz::duration::from_milliseconds(10), false);
+
+		buckets_[1].set_share(2);
+		buckets_[1].set_priority(1);
+		for (auto & b : buckets_) {
+			limiter_.add(&b);
+		}
+		limiter_.set_limits(9000, fz::rate::unlimited);
+	}
+
+	~weighted_handler()
+	{
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const& ev)
+	{
+		fz::dispatch<fz::timer_event>(ev, this, &weighted_handler::on_timer);
+	}
+
+	bool check(size_t i, fz::rate::type expected, int duration)
+	{
+		float ratio = float(consumed_[i]) / (expected * duration);
+		if (ratio < 0.9 || ratio > 1.1) {
+			std::cout << "Bad rate ratio for bucket " << i << ": " << ratio << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	void on_timer(fz::timer_id const&)
+	{
+		auto const now = fz::monotonic_clock::now();
+		int const elapsed = (now - start_).get_seconds();
+
+		int const delay = 3;
+		int const duration = 5;
+		if (elapsed >= delay + duration) {
+			for (size_t i = 0; i < buckets_.size(); ++i) {
+				std::cout << "Bucket " << i << " has rate of " << consumed_[i] / duration << " bytes/s\n";
+			}
+
+			// The limit is split 1:2:1, bucket 2 only uses 100 bytes/s. Its unused share
+			// goes to bucket 1 due to its higher priority.
+			if (!check(0, 2250, duration) || !check(1, 6650, duration)) {
+				exit(1);
+			}
+
+			loop_.stop();
+		}
+
+		for (size_t i = 0; i < buckets_.size(); ++i) {
+			fz::rate::type amount = rates_[i];
+			fz::rate::type available = buckets_[i].available(fz::direction::inbound);
+			if (available != fz::rate::unlimited && available < amount) {
+				amount = available;
+			}
+			if (elapsed >= delay) {
+				consumed_[i] += amount;
+			}
+			buckets_[i].consume(fz::direction::inbound, amount);
+		}
+	}
+
+	fz::event_loop & loop_;
+
+	fz::rate_limit_manager mgr_;
+	fz::rate_limiter limiter_;
+
+	std::array<fz::rate::type, 3> rates_{100000, 100000, 1};
+	std::array<fz::bucket, 3> buckets_;
+	std::array<fz::rate::type, 3> consumed_{};
+
+	fz::monotonic_clock start_;
+};
+
+namespace {
+bool test_keyed()
+{
+	fz::rate_limiter parent;
+	fz::keyed_rate_limiter keyed(parent, 4);
+	keyed.set_limits(1000, 2000);
+
+	auto a = keyed.get("192.0.2.1");
+	if (!a || a != keyed.get("192.0.2.1") || a == keyed.get("192.0.2.2") || a->limit(fz::direction::outbound) != 2000) {
+		std::cout << "Bad keyed limiter" << std::endl;
+		return false;
+	}
+
+	// Only the limiter still in use survives eviction
+	for (int i = 3; i < 100; ++i) {
+		keyed.get("192.0.2." + std::to_string(i));
+	}
+	keyed.purge();
+	if (keyed.size() != 1 || a != keyed.get("192.0.2.1")) {
+		std::cout << "Bad keyed limiter eviction" << std::endl;
+		return false;
+	}
+
+	// Keys that do not fit share a limiter
+	std::vector<std::shared_ptr<fz::rate_limiter>> held;
+	for (int i = 0; i < 6; ++i) {
+		held.push_back(keyed.get("198.51.100." + std::to_string(i)));
+	}
+	if (keyed.size() != 4 || held[3] != held[5] || held[4] != held[5] || held[2] == held[3]) {
+		std::cout << "Bad keyed limiter overflow" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Measures the time it takes to distribute tokens to the given number of buckets, of which
+// only the given share consumes tokens between the distributions.
+void bench(size_t count, size_t active_percent)
 {
 	fz::event_loop loop(fz::event_loop::threadless);
+	fz::rate_limit_manager mgr(loop);
+	fz::rate_limiter limiter;
+	limiter.set_limits(100 * 1024 * 1024, 100 * 1024 * 1024);
+
+	auto buckets = std::make_unique<fz::bucket[]>(count);
+	for (size_t i = 0; i < count; ++i) {
+		limiter.add(&buckets[i]);
+	}
+	mgr.add(&limiter);
 
-	handler h(loop);
+	size_t const active = count * active_percent / 100;
+	int const ticks = 50;
 
-	loop.run();
+	std::chrono::nanoseconds total{};
+	for (int i = 0; i < ticks; ++i) {
+		for (size_t j = 0; j < active; ++j) {
+			auto & b = buckets[(j * 7919 + i) % count];
+			auto const available = b.available(fz::direction::inbound);
+			if (available) {
+				b.consume(fz::direction::inbound, std::min(available, fz::rate::type(1000)));
+			}
+		}
+
+		auto const start = std::chrono::steady_clock::now();
+
+		// Re-adding the limiter distributes the tokens the same way the timer does
+		mgr.add(&limiter);
+
+		total += std::chrono::steady_clock::now() - start;
+	}
+
+	std::cout << count << " buckets, " << active_percent << "% active: " << (total.count() / 1000 / ticks) << " us per distribution\n";
+
+	limiter.remove_bucket();
+	for (size_t i = 0; i < count; ++i) {
+		buckets[i].remove_bucket();
+	}
+}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "bench")) {
+		for (size_t count : {10000, 100000}) {
+			for (size_t active : {0, 1, 10, 100}) {
+				bench(count, active);
+			}
+		}
+		return 0;
+	}
+
+	if (!test_keyed()) {
+		return 1;
+	}
+
+	for (bool pacing : {false, true}) {
+		fz::event_loop loop(fz::event_loop::threadless);
+
+		std::cout << (pacing ? "With pacing at 10 distributions per second\n" : "Without pacing\n");
+		handler h(loop, pacing ? 10 : 5, pacing);
+
+		loop.run();
+	}
+
+	{
+		fz::event_loop loop(fz::event_loop::threadless);
+
+		std::cout << "With shares and priorities\n";
+		weighted_handler h(loop);
+
+		loop.run();
+	}
 
 	return 0;
 }
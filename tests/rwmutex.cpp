@@ -0,0 +1,79 @@
+#include "../lib/libfilezilla/rwmutex.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+
+#include "test_utils.hpp"
+
+#include <atomic>
+#include <vector>
+
+class rwmutex_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(rwmutex_test);
+	CPPUNIT_TEST(test_biased);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_biased();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(rwmutex_test);
+
+void rwmutex_test::test_biased()
+{
+	fz::biased_rwmutex m;
+
+	// Multiple readers at once
+	{
+		fz::scoped_biased_read_lock r1(m);
+		fz::scoped_biased_read_lock r2(m);
+	}
+
+	// Writers exclude readers and other writers. The pair is modified in two steps,
+	// readers must never observe the intermediate state.
+	std::atomic<int> a{};
+	std::atomic<int> b{};
+	std::atomic<int> writers{};
+	std::atomic<bool> stop{};
+	std::atomic<size_t> violations{};
+	std::atomic<size_t> reads{};
+
+	fz::thread_pool pool;
+	std::vector<fz::async_task> tasks;
+	for (int i = 0; i < 3; ++i) {
+		tasks.push_back(pool.spawn([&] {
+			while (!stop) {
+				fz::scoped_biased_read_lock l(m);
+				if (a.load(std::memory_order_relaxed) != b.load(std::memory_order_relaxed) || writers) {
+					++violations;
+				}
+				++reads;
+			}
+		}));
+	}
+	for (int i = 0; i < 2; ++i) {
+		tasks.push_back(pool.spawn([&] {
+			for (int j = 0; j < 2000; ++j) {
+				fz::scoped_biased_write_lock l(m);
+				if (writers++) {
+					++violations;
+				}
+				a.store(a.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				--writers;
+			}
+		}));
+	}
+
+	tasks[3].join();
+	tasks[4].join();
+	stop = true;
+	for (auto & t : tasks) {
+		t.join();
+	}
+
+	ASSERT_EQUAL(size_t(0), violations.load());
+	ASSERT_EQUAL(4000, a.load());
+}
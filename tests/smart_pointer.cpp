@@ -1,5 +1,6 @@
 #include "../lib/libfilezilla/optional.hpp"
 #include "../lib/libfilezilla/shared.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
 
 #include "test_utils.hpp"
 /*
@@ -12,6 +13,8 @@ class smart_pointer_test final : public CppUnit::TestFixture
 	CPPUNIT_TEST_SUITE(smart_pointer_test);
 	CPPUNIT_TEST(test_optional);
 	CPPUNIT_TEST(test_shared);
+	CPPUNIT_TEST(test_seqlock);
+	CPPUNIT_TEST(test_shared_snapshot);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -20,6 +23,8 @@ public:
 
 	void test_optional();
 	void test_shared();
+	void test_seqlock();
+	void test_shared_snapshot();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(smart_pointer_test);
@@ -114,3 +119,91 @@ void smart_pointer_test::test_shared()
 	}
 
 }
+
+namespace {
+struct limits final
+{
+	uint64_t a{};
+	uint64_t b{};
+	uint32_t c{};
+};
+}
+
+void smart_pointer_test::test_seqlock()
+{
+	fz::seqlock<limits> s;
+	ASSERT_EQUAL(uint64_t(0), s.load().a);
+
+	s.store(limits{1, 1, 1});
+	ASSERT_EQUAL(uint32_t(1), s.load().c);
+
+	// Readers never see a partially written value
+	std::atomic<bool> stop{};
+	std::atomic<size_t> torn{};
+	fz::thread_pool pool;
+	std::vector<fz::async_task> tasks;
+	for (int i = 0; i < 2; ++i) {
+		tasks.push_back(pool.spawn([&] {
+			while (!stop) {
+				auto const v = s.load();
+				if (v.a != v.b || v.a != v.c) {
+					++torn;
+				}
+			}
+		}));
+	}
+	for (uint32_t i = 2; i < 100000; ++i) {
+		s.store(limits{i, i, i});
+	}
+	stop = true;
+	for (auto & t : tasks) {
+		t.join();
+	}
+	ASSERT_EQUAL(size_t(0), torn.load());
+	ASSERT_EQUAL(uint64_t(99999), s.load().b);
+}
+
+void smart_pointer_test::test_shared_snapshot()
+{
+	fz::shared_snapshot<std::string> s(std::make_shared<std::string const>("foo"));
+	fz::shared_snapshot<std::string>::reader r(s);
+	ASSERT_EQUAL(std::string("foo"), *r);
+
+	// Old versions stay valid while referenced
+	auto old = s.load();
+	s.publish(std::string("bar"));
+	ASSERT_EQUAL(std::string("foo"), *old);
+	ASSERT_EQUAL(std::string("bar"), *s.load());
+	ASSERT_EQUAL(std::string("bar"), *r);
+
+	// Cached versions are released once the reader has moved on
+	std::weak_ptr<std::string const> weak = s.load();
+	s.publish(std::string("baz"));
+	CPPUNIT_ASSERT(!weak.expired());
+	ASSERT_EQUAL(size_t(3), r->size());
+	CPPUNIT_ASSERT(weak.expired());
+
+	// Concurrent updates do not get lost
+	fz::shared_snapshot<size_t> counter;
+	std::atomic<bool> backwards{};
+	fz::thread_pool pool;
+	std::vector<fz::async_task> tasks;
+	for (int i = 0; i < 4; ++i) {
+		tasks.push_back(pool.spawn([&] {
+			fz::shared_snapshot<size_t>::reader cr(counter);
+			size_t last{};
+			for (int j = 0; j < 1000; ++j) {
+				counter.update([](size_t & v) { ++v; });
+				if (*cr < last) {
+					backwards = true;
+				}
+				last = *cr;
+			}
+		}));
+	}
+	for (auto & t : tasks) {
+		t.join();
+	}
+	CPPUNIT_ASSERT(!backwards);
+	ASSERT_EQUAL(size_t(4000), *counter.load());
+}
@@ -0,0 +1,589 @@
+#include "../lib/libfilezilla/ascii_layer.hpp"
+#include "../lib/libfilezilla/event_handler.hpp"
+#include "../lib/libfilezilla/event_loop.hpp"
+#include "../lib/libfilezilla/logger.hpp"
+#include "../lib/libfilezilla/rate_limited_layer.hpp"
+#include "../lib/libfilezilla/rate_limiter.hpp"
+#include "../lib/libfilezilla/reactor.hpp"
+#include "../lib/libfilezilla/socket.hpp"
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/tls_layer.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#ifdef FZ_WINDOWS
+#include "../lib/libfilezilla/glue/windows.hpp"
+#else
+#include <sys/resource.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <vector>
+
+// Loopback transfers through the socket layers.
+//
+// Each connection first transfers a fixed amount of data from the client to the server,
+// followed by a number of single-byte round trips to measure latency.
+//
+// Usage: socket_bench [--stack=plain|tls|ratelimit|ascii|all] [--connections=N] [--size=bytes]
+//                     [--buffer=bytes] [--pings=N] [--rate=bytes/s] [--reactor]
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct options
+{
+	std::string stack{"all"};
+	size_t connections{4};
+	uint64_t size{64 * 1024 * 1024};
+	size_t buffer{64 * 1024};
+	size_t pings{1000};
+	fz::rate::type rate{fz::rate::unlimited};
+	bool reactor{};
+};
+
+struct logger final : public fz::logger_interface
+{
+	virtual void do_log(fz::logmsg::type, std::wstring &&) override {}
+};
+
+// CPU time consumed by the process so far, in microseconds
+int64_t cpu_time()
+{
+#ifdef FZ_WINDOWS
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+		return 0;
+	}
+	auto const to_us = [](FILETIME const& t) {
+		return static_cast<int64_t>((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) / 10;
+	};
+	return to_us(kernel) + to_us(user);
+#else
+	rusage u{};
+	getrusage(RUSAGE_SELF, &u);
+	auto const to_us = [](timeval const& t) {
+		return static_cast<int64_t>(t.tv_sec) * 1000000 + t.tv_usec;
+	};
+	return to_us(u.ru_utime) + to_us(u.ru_stime);
+#endif
+}
+
+// Shared by all connections of a run
+struct context
+{
+	context(options const& o, std::string const& s, fz::thread_pool & p, std::pair<std::string, std::string> const& c)
+		: opts(o)
+		, stack(s)
+		, pool(p)
+		, cert(c)
+	{}
+
+	options const& opts;
+	std::string stack;
+	fz::thread_pool & pool;
+	fz::reactor * reactor{};
+	fz::rate_limiter * limiter{};
+	std::pair<std::string, std::string> const& cert;
+	std::vector<uint8_t> data;
+
+	fz::mutex m;
+	fz::condition cond;
+	size_t done{};
+	bool failed{};
+
+	clock_type::time_point first_connect{clock_type::time_point::max()};
+	clock_type::time_point last_connected{clock_type::time_point::min()};
+	clock_type::time_point last_received{clock_type::time_point::min()};
+	std::vector<int64_t> handshakes;
+	std::vector<int64_t> rtts;
+
+	void finish(bool success)
+	{
+		fz::scoped_lock l(m);
+		if (!success) {
+			failed = true;
+		}
+		++done;
+		cond.signal(l);
+	}
+};
+
+struct peer : public fz::event_handler
+{
+	peer(fz::event_loop & loop, context & ctx, std::unique_ptr<fz::socket> && s)
+		: fz::event_handler(loop)
+		, ctx_(ctx)
+		, s_(std::move(s))
+		, buffer_(ctx.opts.buffer)
+	{
+	}
+
+	virtual ~peer()
+	{
+		remove_handler();
+		top_ = nullptr;
+		layer_.reset();
+		s_.reset();
+	}
+
+	void build_stack(bool server)
+	{
+		if (ctx_.stack == "tls") {
+			auto tls = std::make_unique<fz::tls_layer>(event_loop_, this, *s_, nullptr, logger_);
+			if (server) {
+				tls->set_certificate(ctx_.cert.first, ctx_.cert.second, fz::native_string());
+				tls->server_handshake();
+			}
+			else {
+				tls->client_handshake(std::vector<uint8_t>(ctx_.cert.second.cbegin(), ctx_.cert.second.cend()));
+			}
+			layer_ = std::move(tls);
+		}
+		else if (ctx_.stack == "ratelimit") {
+			layer_ = std::make_unique<fz::rate_limited_layer>(this, *s_, ctx_.limiter);
+		}
+		else if (ctx_.stack == "ascii") {
+			layer_ = std::make_unique<fz::ascii_layer>(event_loop_, this, *s_);
+		}
+
+		if (layer_) {
+			top_ = layer_.get();
+		}
+		else {
+			s_->set_event_handler(this);
+			top_ = s_.get();
+		}
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::socket_event>(ev, this, &peer::on_socket_event);
+	}
+
+	void on_socket_event(fz::socket_event_source *, fz::socket_event_flag type, int error)
+	{
+		if (finished_) {
+			return;
+		}
+		if (error) {
+			finish(false);
+			return;
+		}
+
+		if (type == fz::socket_event_flag::connection) {
+			on_connected();
+			on_write();
+		}
+		else if (type == fz::socket_event_flag::read) {
+			on_read();
+		}
+		else if (type == fz::socket_event_flag::write) {
+			on_write();
+		}
+	}
+
+	virtual void on_connected() {}
+	virtual void on_read() = 0;
+	virtual void on_write() = 0;
+
+	// Returns false on EAGAIN, fails the connection on other errors
+	bool check(int res, int error)
+	{
+		if (res > 0) {
+			return true;
+		}
+		if (res < 0 && error == EAGAIN) {
+			return false;
+		}
+		finish(false);
+		return false;
+	}
+
+	void finish(bool success)
+	{
+		if (!finished_) {
+			finished_ = true;
+			on_finished(success);
+		}
+	}
+
+	virtual void on_finished(bool success) = 0;
+
+	context & ctx_;
+	logger logger_;
+	std::unique_ptr<fz::socket> s_;
+	std::unique_ptr<fz::socket_layer> layer_;
+	fz::socket_interface * top_{};
+	std::vector<uint8_t> buffer_;
+	bool finished_{};
+};
+
+struct server_peer final : public peer
+{
+	server_peer(fz::event_loop & loop, context & ctx, std::unique_ptr<fz::socket> && s)
+		: peer(loop, ctx, std::move(s))
+	{
+		build_stack(true);
+		if (ctx_.stack != "tls") {
+			// Already connected, data may have arrived before the handler got set.
+			on_read();
+		}
+	}
+
+	virtual void on_read() override
+	{
+		int error;
+		for (;;) {
+			int res = top_->read(buffer_.data(), static_cast<unsigned int>(buffer_.size()), error);
+			if (!check(res, error)) {
+				return;
+			}
+
+			uint64_t const before = received_;
+			received_ += static_cast<uint64_t>(res);
+			if (before < ctx_.opts.size && received_ >= ctx_.opts.size) {
+				auto const now = clock_type::now();
+				fz::scoped_lock l(ctx_.m);
+				ctx_.last_received = std::max(ctx_.last_received, now);
+			}
+			if (received_ > ctx_.opts.size) {
+				// Everything past the transfer is a ping that needs to be echoed
+				pending_echo_ += std::min(received_ - ctx_.opts.size, static_cast<uint64_t>(res));
+				on_write();
+			}
+		}
+	}
+
+	virtual void on_write() override
+	{
+		while (pending_echo_) {
+			int error;
+			auto const n = static_cast<unsigned int>(std::min(pending_echo_, static_cast<uint64_t>(buffer_.size())));
+			std::vector<uint8_t> const echo(n, 'p');
+			int res = top_->write(echo.data(), n, error);
+			if (!check(res, error)) {
+				return;
+			}
+			pending_echo_ -= static_cast<uint64_t>(res);
+		}
+	}
+
+	virtual void on_finished(bool) override
+	{
+		// Only the clients count towards completion. Connections getting closed
+		// once the clients are done is expected, failing during the transfer is not.
+		if (received_ < ctx_.opts.size) {
+			fz::scoped_lock l(ctx_.m);
+			ctx_.failed = true;
+		}
+	}
+
+	uint64_t received_{};
+	uint64_t pending_echo_{};
+};
+
+struct client_peer final : public peer
+{
+	client_peer(fz::event_loop & loop, context & ctx)
+		: peer(loop, ctx, ctx.reactor ? std::make_unique<fz::socket>(*ctx.reactor, nullptr) : std::make_unique<fz::socket>(ctx.pool, nullptr))
+	{
+		build_stack(false);
+	}
+
+	bool connect(fz::native_string const& host, unsigned int port)
+	{
+		connect_start_ = clock_type::now();
+		{
+			fz::scoped_lock l(ctx_.m);
+			ctx_.first_connect = std::min(ctx_.first_connect, connect_start_);
+		}
+		return !top_->connect(host, port);
+	}
+
+	virtual void on_connected() override
+	{
+		auto const now = clock_type::now();
+		fz::scoped_lock l(ctx_.m);
+		ctx_.last_connected = std::max(ctx_.last_connected, now);
+		ctx_.handshakes.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - connect_start_).count());
+	}
+
+	virtual void on_read() override
+	{
+		int error;
+		for (;;) {
+			uint8_t c;
+			int res = top_->read(&c, 1, error);
+			if (!check(res, error)) {
+				return;
+			}
+
+			if (!ping_outstanding_) {
+				finish(false);
+				return;
+			}
+			ping_outstanding_ = false;
+			rtts_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - ping_start_).count());
+			if (rtts_.size() >= ctx_.opts.pings) {
+				{
+					fz::scoped_lock l(ctx_.m);
+					ctx_.rtts.insert(ctx_.rtts.end(), rtts_.cbegin(), rtts_.cend());
+				}
+				finish(true);
+				return;
+			}
+			on_write();
+		}
+	}
+
+	virtual void on_write() override
+	{
+		int error;
+		while (sent_ < ctx_.opts.size) {
+			size_t const offset = static_cast<size_t>(sent_ % ctx_.data.size());
+			auto const n = static_cast<unsigned int>(std::min(static_cast<uint64_t>(ctx_.data.size() - offset), ctx_.opts.size - sent_));
+			int res = top_->write(ctx_.data.data() + offset, n, error);
+			if (!check(res, error)) {
+				return;
+			}
+			sent_ += static_cast<uint64_t>(res);
+		}
+
+		if (!ping_outstanding_ && rtts_.size() < ctx_.opts.pings) {
+			uint8_t const c = 'p';
+			ping_start_ = clock_type::now();
+			int res = top_->write(&c, 1, error);
+			if (!check(res, error)) {
+				return;
+			}
+			ping_outstanding_ = true;
+		}
+		else if (!ctx_.opts.pings && !finished_) {
+			finish(true);
+		}
+	}
+
+	virtual void on_finished(bool success) override
+	{
+		ctx_.finish(success);
+	}
+
+	clock_type::time_point connect_start_;
+	clock_type::time_point ping_start_;
+	uint64_t sent_{};
+	std::vector<int64_t> rtts_;
+	bool ping_outstanding_{};
+};
+
+struct listener final : public fz::event_handler
+{
+	listener(fz::event_loop & loop, context & ctx)
+		: fz::event_handler(loop)
+		, ctx_(ctx)
+		, l_(ctx.reactor ? std::make_unique<fz::listen_socket>(*ctx.reactor, this) : std::make_unique<fz::listen_socket>(ctx.pool, this))
+	{
+		l_->bind("127.0.0.1");
+	}
+
+	virtual ~listener()
+	{
+		remove_handler();
+		peers_.clear();
+	}
+
+	virtual void operator()(fz::event_base const& ev) override
+	{
+		fz::dispatch<fz::socket_event>(ev, this, &listener::on_socket_event);
+	}
+
+	void on_socket_event(fz::socket_event_source *, fz::socket_event_flag type, int error)
+	{
+		if (error || type != fz::socket_event_flag::connection) {
+			return;
+		}
+
+		for (;;) {
+			int error;
+			auto s = l_->accept(error);
+			if (!s) {
+				break;
+			}
+			peers_.emplace_back(std::make_unique<server_peer>(event_loop_, ctx_, std::move(s)));
+		}
+	}
+
+	context & ctx_;
+	std::unique_ptr<fz::listen_socket> l_;
+	std::list<std::unique_ptr<server_peer>> peers_;
+};
+
+int64_t percentile(std::vector<int64_t> & v, size_t p)
+{
+	if (v.empty()) {
+		return 0;
+	}
+	size_t const i = std::min(v.size() - 1, v.size() * p / 100);
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+bool run(std::string const& stack, options const& opts, std::pair<std::string, std::string> const& cert)
+{
+	fz::thread_pool pool;
+	std::unique_ptr<fz::reactor> reactor;
+	if (opts.reactor) {
+		reactor = std::make_unique<fz::reactor>(pool);
+	}
+
+	fz::event_loop server_loop;
+	fz::event_loop client_loop;
+
+	fz::rate_limit_manager mgr(client_loop);
+	fz::rate_limiter limiter(&mgr);
+	limiter.set_limits(opts.rate, opts.rate);
+
+	context ctx(opts, stack, pool, cert);
+	ctx.reactor = reactor.get();
+	ctx.limiter = &limiter;
+
+	// Line-based text so that the ascii layer round-trips it unchanged
+	ctx.data.resize(opts.buffer);
+	for (size_t i = 0; i < ctx.data.size(); ++i) {
+		ctx.data[i] = (i % 80 == 79) ? '\n' : static_cast<uint8_t>('a' + i % 26);
+	}
+
+	listener l(server_loop, ctx);
+	int res = l.l_->listen(fz::address_type::ipv4);
+	int error;
+	int const port = l.l_->local_port(error);
+	if (res || port <= 0) {
+		std::cerr << "Could not listen: " << (res ? res : error) << std::endl;
+		return false;
+	}
+
+	auto const cpu_start = cpu_time();
+	auto const start = clock_type::now();
+
+	std::vector<std::unique_ptr<client_peer>> clients;
+	for (size_t i = 0; i < opts.connections; ++i) {
+		clients.emplace_back(std::make_unique<client_peer>(client_loop, ctx));
+		if (!clients.back()->connect(fz::to_native(std::string_view("127.0.0.1")), static_cast<unsigned int>(port))) {
+			ctx.finish(false);
+		}
+	}
+
+	{
+		fz::scoped_lock lock(ctx.m);
+		while (ctx.done < opts.connections) {
+			ctx.cond.wait(lock);
+		}
+	}
+
+	auto const elapsed = clock_type::now() - start;
+	auto const cpu = cpu_time() - cpu_start;
+
+	bool failed;
+	{
+		fz::scoped_lock lock(ctx.m);
+		failed = ctx.failed;
+	}
+	clients.clear();
+
+	if (failed) {
+		std::cout << stack << ": failed" << std::endl;
+		return false;
+	}
+
+	auto const us = [](clock_type::duration const& d) {
+		return std::max(int64_t(1), static_cast<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+	};
+
+	uint64_t const total = opts.size * opts.connections;
+	int64_t const transfer_us = us(ctx.last_received - ctx.first_connect);
+	int64_t const handshake_us = us(ctx.last_connected - ctx.first_connect);
+
+	std::cout << stack << (opts.reactor ? " (reactor)" : "") << ": "
+		<< opts.connections << " connections, "
+		<< (total / (1024 * 1024)) << " MiB in " << (us(elapsed) / 1000) << " ms" << std::endl;
+	std::cout << "  throughput: " << (total * 1000000 / static_cast<uint64_t>(transfer_us) / (1024 * 1024)) << " MB/s" << std::endl;
+	std::cout << "  handshakes: " << (static_cast<int64_t>(opts.connections) * 1000000 / handshake_us) << "/s"
+		<< ", p50 " << percentile(ctx.handshakes, 50) << " us, p99 " << percentile(ctx.handshakes, 99) << " us" << std::endl;
+	if (!ctx.rtts.empty()) {
+		std::cout << "  latency: p50 " << percentile(ctx.rtts, 50) / 1000 << " us, p99 " << percentile(ctx.rtts, 99) / 1000 << " us" << std::endl;
+	}
+	if (total) {
+		std::cout << "  cpu: " << (static_cast<uint64_t>(cpu) * 1024 * 1024 * 1024 / total / 1000) << " ms/GB" << std::endl;
+	}
+
+	return true;
+}
+}
+
+int main(int argc, char* argv[])
+{
+	options opts;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string_view arg(argv[i]);
+		std::string_view value;
+		auto const pos = arg.find('=');
+		if (pos != std::string_view::npos) {
+			value = arg.substr(pos + 1);
+			arg = arg.substr(0, pos);
+		}
+
+		if (arg == "--stack") {
+			opts.stack = std::string(value);
+		}
+		else if (arg == "--connections") {
+			opts.connections = fz::to_integral<size_t>(value, opts.connections);
+		}
+		else if (arg == "--size") {
+			opts.size = fz::to_integral<uint64_t>(value, opts.size);
+		}
+		else if (arg == "--buffer") {
+			opts.buffer = std::max(size_t(1), fz::to_integral<size_t>(value, opts.buffer));
+		}
+		else if (arg == "--pings") {
+			opts.pings = fz::to_integral<size_t>(value, opts.pings);
+		}
+		else if (arg == "--rate") {
+			opts.rate = fz::to_integral<fz::rate::type>(value, opts.rate);
+		}
+		else if (arg == "--reactor") {
+			opts.reactor = true;
+		}
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--stack=plain|tls|ratelimit|ascii|all] [--connections=N] [--size=bytes] [--buffer=bytes] [--pings=N] [--rate=bytes/s] [--reactor]" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<std::string> stacks;
+	if (opts.stack == "all") {
+		stacks = {"plain", "tls", "ratelimit", "ascii"};
+	}
+	else if (opts.stack == "plain" || opts.stack == "tls" || opts.stack == "ratelimit" || opts.stack == "ascii") {
+		stacks.push_back(opts.stack);
+	}
+	else {
+		std::cerr << "Unknown stack: " << opts.stack << std::endl;
+		return 1;
+	}
+
+	auto const cert = fz::tls_layer::generate_selfsigned_certificate(fz::native_string(), "CN=libfilezilla benchmark", {});
+
+	bool ok = true;
+	for (auto const& stack : stacks) {
+		if (!run(stack, opts, cert)) {
+			ok = false;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+#include "../lib/libfilezilla/buffer.hpp"
+#include "../lib/libfilezilla/process.hpp"
+#include "../lib/libfilezilla/string.hpp"
+#include "../lib/libfilezilla/tls_layer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef FZ_WINDOWS
+#include <sys/resource.h>
+#endif
+
+// Measures what linking libfilezilla costs short-lived processes: the time from spawning
+// the process until main is entered, the time until it has exited, and its peak RSS.
+// Global initialization, if any, happens before main and shows up in the former.
+//
+// Modes:
+// - minimal: Does nothing but report
+// - tls: Lists the TLS ciphers, paying for the lazy initialization of GnuTLS
+//
+// Usage: startup_bench [runs]
+//
+// Set GNUTLS_NO_IMPLICIT_INIT=1 to keep GnuTLS from initializing itself when loaded.
+// Times are taken from the steady clock, which is system-wide on the supported platforms.
+
+namespace {
+int64_t now_us()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t peak_rss_kib()
+{
+#ifdef FZ_WINDOWS
+	return -1;
+#else
+	rusage usage{};
+	if (getrusage(RUSAGE_SELF, &usage)) {
+		return -1;
+	}
+#ifdef FZ_MAC
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+int child(std::string_view mode, int64_t main_entered)
+{
+	if (mode == "tls") {
+		if (fz::tls_layer::list_tls_ciphers({}).empty()) {
+			return 1;
+		}
+	}
+	std::cout << main_entered << " " << peak_rss_kib() << std::endl;
+	return 0;
+}
+
+struct sample final
+{
+	int64_t to_main_{};
+	int64_t to_exit_{};
+	int64_t rss_{};
+};
+
+bool run_child(fz::native_string const& self, char const* mode, sample & s)
+{
+	fz::process p;
+	int64_t const start = now_us();
+	if (!p.spawn(self, {fzT("--child"), fz::to_native(std::string_view(mode))})) {
+		return false;
+	}
+
+	fz::buffer out;
+	for (;;) {
+		auto r = p.read(out);
+		if (!r) {
+			return false;
+		}
+		if (!r.value_) {
+			break;
+		}
+	}
+	p.stop();
+	s.to_exit_ = now_us() - start;
+
+	auto const tokens = fz::strtok_view(out.to_view(), " \r\n");
+	if (tokens.size() != 2) {
+		return false;
+	}
+	s.to_main_ = fz::to_integral<int64_t>(tokens[0]) - start;
+	s.rss_ = fz::to_integral<int64_t>(tokens[1], -1);
+	return true;
+}
+
+int64_t median(std::vector<int64_t> v)
+{
+	std::sort(v.begin(), v.end());
+	return v.empty() ? 0 : v[v.size() / 2];
+}
+
+bool bench(fz::native_string const& self, char const* mode, size_t runs)
+{
+	std::vector<int64_t> to_main;
+	std::vector<int64_t> to_exit;
+	int64_t rss{};
+	for (size_t i = 0; i < runs; ++i) {
+		sample s;
+		if (!run_child(self, mode, s)) {
+			std::cerr << "Could not run child process" << std::endl;
+			return false;
+		}
+		to_main.push_back(s.to_main_);
+		to_exit.push_back(s.to_exit_);
+		rss = std::max(rss, s.rss_);
+	}
+
+	std::cout << mode << ": median time to main " << median(to_main) << " us, to exit " << median(to_exit) << " us";
+	if (rss >= 0) {
+		std::cout << ", peak RSS " << rss << " KiB";
+	}
+	std::cout << std::endl;
+	return true;
+}
+}
+
+int main(int argc, char* argv[])
+{
+	int64_t const main_entered = now_us();
+
+	if (argc > 2 && std::string_view(argv[1]) == "--child") {
+		return child(argv[2], main_entered);
+	}
+
+	size_t runs = 50;
+	if (argc > 1) {
+		runs = std::max(size_t(1), fz::to_integral<size_t>(std::string_view(argv[1]), runs));
+	}
+
+	fz::native_string const self = fz::to_native(std::string_view(argv[0]));
+	if (!bench(self, "minimal", runs) || !bench(self, "tls", runs)) {
+		return 1;
+	}
+	return 0;
+}
@@ -1,7 +1,10 @@
+#include "../lib/libfilezilla/buffer.hpp"
 #include "../lib/libfilezilla/encode.hpp"
 #include "../lib/libfilezilla/string.hpp"
 
 #include "test_utils.hpp"
+
+#include <map>
 /*
  * This testsuite asserts the correctness of the
  * string functions
@@ -15,10 +18,19 @@ class string_test final : public CppUnit::TestFixture
 	CPPUNIT_TEST(test_conversion_utf8);
 	CPPUNIT_TEST(test_conversion_null);
 	CPPUNIT_TEST(test_base64);
+	CPPUNIT_TEST(test_base64_blocks);
+	CPPUNIT_TEST(test_base64_streaming);
+	CPPUNIT_TEST(test_hex);
+	CPPUNIT_TEST(test_percent);
 	CPPUNIT_TEST(test_trim);
 	CPPUNIT_TEST(test_strtok);
+	CPPUNIT_TEST(test_strtokenizer);
+	CPPUNIT_TEST(test_integral);
 	CPPUNIT_TEST(test_startsendswith);
 	CPPUNIT_TEST(test_normalize_hyphens);
+	CPPUNIT_TEST(test_case_insensitive_ascii);
+	CPPUNIT_TEST(test_conversion_utf8_blocks);
+	CPPUNIT_TEST(test_conversion_utf8_invalid);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -30,10 +42,19 @@ public:
 	void test_conversion_utf8();
 	void test_conversion_null();
 	void test_base64();
+	void test_base64_blocks();
+	void test_base64_streaming();
+	void test_hex();
+	void test_percent();
 	void test_trim();
 	void test_strtok();
+	void test_strtokenizer();
+	void test_integral();
 	void test_startsendswith();
 	void test_normalize_hyphens();
+	void test_case_insensitive_ascii();
+	void test_conversion_utf8_blocks();
+	void test_conversion_utf8_invalid();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(string_test);
@@ -163,6 +184,225 @@ void string_test::test_base64()
 	CPPUNIT_ASSERT_EQUAL(std::string(""), fz::base64_decode_s("Zm9vbHM=Zg=="));
 }
 
+namespace {
+std::string make_bytes(size_t n)
+{
+	std::string ret;
+	unsigned int v = 12345;
+	for (size_t i = 0; i < n; ++i) {
+		v = v * 1103515245u + 12345u;
+		ret += static_cast<char>(v >> 16);
+	}
+	return ret;
+}
+
+// Straightforward reference for the vectorized encoder
+std::string base64_reference(std::string const& in, fz::base64_type type, bool pad)
+{
+	std::string const chars = type == fz::base64_type::url
+		? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+		: "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string ret;
+	for (size_t i = 0; i < in.size(); i += 3) {
+		unsigned int v = static_cast<unsigned char>(in[i]) << 16;
+		if (i + 1 < in.size()) {
+			v |= static_cast<unsigned char>(in[i + 1]) << 8;
+		}
+		if (i + 2 < in.size()) {
+			v |= static_cast<unsigned char>(in[i + 2]);
+		}
+		size_t const n = std::min(in.size() - i, size_t(3)) + 1;
+		for (size_t j = 0; j < 4; ++j) {
+			if (j < n) {
+				ret += chars[(v >> (18 - 6 * j)) & 0x3f];
+			}
+			else if (pad) {
+				ret += '=';
+			}
+		}
+	}
+	return ret;
+}
+}
+
+void string_test::test_base64_blocks()
+{
+	for (size_t len = 0; len < 300; ++len) {
+		std::string const data = make_bytes(len);
+		for (auto type : { fz::base64_type::standard, fz::base64_type::url }) {
+			for (bool pad : { true, false }) {
+				std::string const encoded = fz::base64_encode(data, type, pad);
+				CPPUNIT_ASSERT_EQUAL(base64_reference(data, type, pad), encoded);
+				CPPUNIT_ASSERT_EQUAL(fz::base64_encoded_size(len, pad), encoded.size());
+				CPPUNIT_ASSERT_EQUAL(data, fz::base64_decode_s(encoded));
+				CPPUNIT_ASSERT_EQUAL(data, fz::base64_decode_s(fz::to_wstring(encoded)));
+
+				fz::buffer buf;
+				buf.append("x");
+				fz::base64_encode_append(buf, data, type, pad);
+				CPPUNIT_ASSERT(buf.to_view() == "x" + encoded);
+				CPPUNIT_ASSERT(fz::base64_decode_append(buf, encoded));
+				CPPUNIT_ASSERT(buf.to_view() == "x" + encoded + data);
+			}
+		}
+	}
+
+	// Line breaks and invalid characters anywhere within long input
+	std::string const data = make_bytes(500);
+	std::string const encoded = fz::base64_encode(data);
+	std::string wrapped;
+	for (size_t i = 0; i < encoded.size(); i += 76) {
+		wrapped += encoded.substr(i, 76) + "\r\n";
+	}
+	CPPUNIT_ASSERT_EQUAL(data, fz::base64_decode_s(wrapped));
+
+	for (size_t i = 0; i < encoded.size() - 2; ++i) {
+		std::string invalid = encoded;
+		invalid[i] = '!';
+		CPPUNIT_ASSERT_EQUAL(std::string(), fz::base64_decode_s(invalid));
+		invalid[i] = '=';
+		CPPUNIT_ASSERT_EQUAL(std::string(), fz::base64_decode_s(invalid));
+		invalid[i] = '\xc1';
+		CPPUNIT_ASSERT_EQUAL(std::string(), fz::base64_decode_s(invalid));
+
+		fz::buffer buf;
+		buf.append("x");
+		CPPUNIT_ASSERT(!fz::base64_decode_append(buf, invalid));
+		CPPUNIT_ASSERT(buf.to_view() == "x");
+	}
+}
+
+void string_test::test_base64_streaming()
+{
+	std::string const data = make_bytes(200);
+	for (bool pad : { true, false }) {
+		std::string const encoded = fz::base64_encode(data, fz::base64_type::url, pad);
+		for (size_t chunk = 1; chunk < 70; ++chunk) {
+			fz::base64_encoder enc(fz::base64_type::url, pad);
+			fz::base64_encoder enc2(fz::base64_type::url, pad);
+			std::string s;
+			fz::buffer b;
+			for (size_t i = 0; i < data.size(); i += chunk) {
+				enc.encode(std::string_view(data).substr(i, chunk), s);
+				enc2.encode(std::string_view(data).substr(i, chunk), b);
+			}
+			enc.finalize(s);
+			enc2.finalize(b);
+			CPPUNIT_ASSERT_EQUAL(encoded, s);
+			CPPUNIT_ASSERT(b.to_view() == encoded);
+		}
+	}
+
+	// Any split of any input needs to give the same result as decoding all at once
+	std::string const encoded = fz::base64_encode(make_bytes(100));
+	std::string const inputs[] = {
+		encoded, encoded.substr(0, encoded.size() - 2), encoded.substr(0, encoded.size() - 1) + " \n",
+		"Zg", "Zg=", "Zm8", " Zm\n9v\tbA = =\r\n", "Z", "Zg=a", "Zm9vbHM=Zg==", "Zm9vbHM==", "Zm9vb===", "Zm9v!mFy"
+	};
+	fz::base64_decoder dec;
+	for (auto const& in : inputs) {
+		std::string const expected = fz::base64_decode_s(in);
+		bool const valid = !expected.empty();
+		for (size_t first = 0; first <= in.size(); ++first) {
+			for (size_t second = first; second <= in.size(); ++second) {
+				fz::buffer b;
+				bool ok = dec.decode(std::string_view(in).substr(0, first), b);
+				ok = dec.decode(std::string_view(in).substr(first, second - first), b) && ok;
+				ok = dec.decode(std::string_view(in).substr(second), b) && ok;
+				ok = dec.finalize(b) && ok;
+				CPPUNIT_ASSERT_EQUAL(valid, ok);
+				if (ok) {
+					CPPUNIT_ASSERT(b.to_view() == expected);
+				}
+			}
+		}
+	}
+}
+
+void string_test::test_hex()
+{
+	for (size_t len = 0; len < 100; ++len) {
+		std::string const data = make_bytes(len);
+		std::string lower;
+		for (char c : data) {
+			lower += fz::int_to_hex_char(static_cast<unsigned char>(c) >> 4);
+			lower += fz::int_to_hex_char(static_cast<unsigned char>(c) & 0xf);
+		}
+		std::string const upper = fz::str_toupper_ascii(lower);
+
+		CPPUNIT_ASSERT_EQUAL(lower, fz::hex_encode<std::string>(data));
+		CPPUNIT_ASSERT_EQUAL(upper, (fz::hex_encode<std::string, std::string, false>(data)));
+		CPPUNIT_ASSERT(fz::to_wstring(lower) == fz::hex_encode<std::wstring>(data));
+
+		CPPUNIT_ASSERT_EQUAL(data, fz::hex_decode<std::string>(lower));
+		CPPUNIT_ASSERT_EQUAL(data, fz::hex_decode<std::string>(upper));
+		CPPUNIT_ASSERT_EQUAL(data, fz::hex_decode<std::string>(fz::to_wstring(upper)));
+
+		fz::buffer b;
+		fz::hex_encode_append(b, data, false);
+		CPPUNIT_ASSERT(b.to_view() == upper);
+		CPPUNIT_ASSERT(fz::hex_decode_append(b, lower));
+		CPPUNIT_ASSERT(b.to_view() == upper + data);
+
+		for (size_t i = 0; i < lower.size(); ++i) {
+			for (char c : { 'g', 'G', '/', ':', '@', '`', '\0', '\xb0' }) {
+				std::string invalid = lower;
+				invalid[i] = c;
+				CPPUNIT_ASSERT(fz::hex_decode(invalid).empty());
+				CPPUNIT_ASSERT(!fz::hex_decode_append(b, invalid));
+			}
+		}
+		CPPUNIT_ASSERT(b.to_view() == upper + data);
+	}
+	CPPUNIT_ASSERT(fz::hex_decode("abc").empty());
+}
+
+void string_test::test_percent()
+{
+	CPPUNIT_ASSERT_EQUAL(std::string(""), fz::percent_encode(""));
+	CPPUNIT_ASSERT_EQUAL(std::string("Az09-._~"), fz::percent_encode("Az09-._~"));
+	CPPUNIT_ASSERT_EQUAL(std::string("%2Fa%20b%2Fc%25"), fz::percent_encode("/a b/c%"));
+	CPPUNIT_ASSERT_EQUAL(std::string("/a%20b/c%25"), fz::percent_encode("/a b/c%", true));
+	CPPUNIT_ASSERT_EQUAL(std::string("M%C3%B6t%C3%B6rhead%21"), fz::percent_encode("M\xc3\xb6t\xc3\xb6rhead!"));
+	CPPUNIT_ASSERT_EQUAL(std::string("ab"), fz::percent_encode(std::string_view("ab\0cd", 5)));
+	CPPUNIT_ASSERT_EQUAL(std::string("M%C3%B6t%C3%B6rhead"), fz::percent_encode(L"M\u00f6t\u00f6rhead"));
+
+	std::string s = "x=";
+	fz::percent_encode_append(s, "a b");
+	fz::percent_encode_append(s, "/plain");
+	fz::percent_encode_append(s, "/plain", true);
+	CPPUNIT_ASSERT_EQUAL(std::string("x=a%20b%2Fplain/plain"), s);
+
+	CPPUNIT_ASSERT_EQUAL(std::string(""), fz::percent_decode_s(""));
+	CPPUNIT_ASSERT_EQUAL(std::string("plain"), fz::percent_decode_s("plain"));
+	CPPUNIT_ASSERT_EQUAL(std::string("/a b/c%"), fz::percent_decode_s("%2Fa%20b%2fc%25"));
+	CPPUNIT_ASSERT_EQUAL(std::string("/a b/c%"), fz::percent_decode_s(L"%2Fa%20b%2fc%25"));
+	CPPUNIT_ASSERT(fz::percent_decode("%41%42") == std::vector<uint8_t>({'A', 'B'}));
+	for (auto const& invalid : { "%", "a%4", "%4g", "%%41", "%00", "a%zz" }) {
+		CPPUNIT_ASSERT_EQUAL(std::string(""), fz::percent_decode_s(invalid));
+	}
+	CPPUNIT_ASSERT_EQUAL(std::string(""), fz::percent_decode_s(std::string_view("a\0b", 3)));
+	CPPUNIT_ASSERT_EQUAL(std::string("a\0b\0", 4), fz::percent_decode_s(std::string_view("a\0b%00", 6), true));
+
+	s = "%2Fa%20b%2fc%25";
+	CPPUNIT_ASSERT(fz::percent_decode_inplace(s));
+	CPPUNIT_ASSERT_EQUAL(std::string("/a b/c%"), s);
+	s = "nothing to do";
+	CPPUNIT_ASSERT(fz::percent_decode_inplace(s));
+	CPPUNIT_ASSERT_EQUAL(std::string("nothing to do"), s);
+	s = "bad%2";
+	CPPUNIT_ASSERT(!fz::percent_decode_inplace(s));
+	CPPUNIT_ASSERT(s.empty());
+
+	// Round trip of all byte values
+	std::string all;
+	for (int i = 1; i < 256; ++i) {
+		all += static_cast<char>(i);
+	}
+	CPPUNIT_ASSERT_EQUAL(all, fz::percent_decode_s(fz::percent_encode(all)));
+	CPPUNIT_ASSERT_EQUAL(all, fz::percent_decode_s(fz::percent_encode(all, true)));
+}
+
 void string_test::test_trim()
 {
 	CPPUNIT_ASSERT_EQUAL(std::string("foo"), fz::trimmed(std::string("foo")));
@@ -209,6 +449,99 @@ void string_test::test_strtok()
 	CPPUNIT_ASSERT_EQUAL(std::string(""), tokens[7]);
 }
 
+void string_test::test_strtokenizer()
+{
+	std::string const inputs[] = { "", " ", "  ", "a", " a", "a ", "a b", "  a  b  ", "a\tb c\t\td", "\t ab cd\tef gh  ", std::string(100, ' ') + "x" + std::string(50, '\t') };
+	for (auto const& in : inputs) {
+		for (bool ignore_empty : {true, false}) {
+			for (std::string_view delims : {" ", " \t", ""}) {
+				std::vector<std::string_view> tokens;
+				for (auto const& token : fz::strtokenizer(in, delims, ignore_empty)) {
+					tokens.push_back(token);
+				}
+				CPPUNIT_ASSERT(tokens == fz::strtok_view(in, delims, ignore_empty));
+			}
+
+			std::wstring const w = fz::to_wstring(in);
+			std::vector<std::wstring_view> tokens;
+			for (auto const& token : fz::wstrtokenizer(w, L" \t", ignore_empty)) {
+				tokens.push_back(token);
+			}
+			CPPUNIT_ASSERT(tokens == fz::strtok_view(w, L" \t", ignore_empty));
+		}
+	}
+
+	fz::strtokenizer t("CWD /some dir", ' ');
+	auto it = t.begin();
+	CPPUNIT_ASSERT(it != t.end());
+	CPPUNIT_ASSERT(*it == "CWD");
+	CPPUNIT_ASSERT_EQUAL(size_t(5), (++it)->size());
+	CPPUNIT_ASSERT(*++it == "dir");
+	CPPUNIT_ASSERT(++it == t.end());
+	CPPUNIT_ASSERT_EQUAL(std::ptrdiff_t(3), std::distance(t.begin(), t.end()));
+}
+
+namespace {
+template<typename T>
+void check_integral_roundtrip(T v)
+{
+	char buf[fz::max_integral_chars<T>];
+	std::string_view const s(buf, fz::integral_to_chars(buf, v) - buf);
+	CPPUNIT_ASSERT_EQUAL(std::to_string(v), std::string(s));
+	CPPUNIT_ASSERT(fz::to_integral<T>(s) == v);
+
+	wchar_t wbuf[fz::max_integral_chars<T>];
+	std::wstring_view const w(wbuf, fz::integral_to_chars(wbuf, v) - wbuf);
+	CPPUNIT_ASSERT(std::to_wstring(v) == w);
+	CPPUNIT_ASSERT(fz::to_integral<T>(w) == v);
+}
+
+template<typename T>
+void check_integral_limits()
+{
+	for (T v : {T(0), T(1), T(9), T(10), T(99), T(100), T(12345), std::numeric_limits<T>::max(), T(std::numeric_limits<T>::max() / 10), std::numeric_limits<T>::min()}) {
+		check_integral_roundtrip(v);
+		if constexpr (std::is_signed_v<T>) {
+			check_integral_roundtrip(T(-(v / 3)));
+		}
+	}
+
+	// One past the limits
+	std::string max = std::to_string(std::numeric_limits<T>::max());
+	max.back() += 1;
+	CPPUNIT_ASSERT(fz::to_integral<T>(max, T(42)) == T(42));
+	CPPUNIT_ASSERT(fz::to_integral<T>(fz::to_wstring(max), T(42)) == T(42));
+	CPPUNIT_ASSERT(fz::to_integral<T>(max + "0", T(42)) == T(42));
+	CPPUNIT_ASSERT(fz::to_integral<T>(fz::to_wstring(max + "0"), T(42)) == T(42));
+	if constexpr (std::is_signed_v<T>) {
+		std::string min = std::to_string(std::numeric_limits<T>::min());
+		min.back() += 1;
+		CPPUNIT_ASSERT(fz::to_integral<T>(min, T(42)) == T(42));
+		CPPUNIT_ASSERT(fz::to_integral<T>(fz::to_wstring(min), T(42)) == T(42));
+	}
+}
+}
+
+void string_test::test_integral()
+{
+	check_integral_limits<int>();
+	check_integral_limits<unsigned int>();
+	check_integral_limits<int64_t>();
+	check_integral_limits<uint64_t>();
+	check_integral_limits<int16_t>();
+
+	CPPUNIT_ASSERT_EQUAL(42, fz::to_integral<int>("+42"));
+	CPPUNIT_ASSERT_EQUAL(42, fz::to_integral<int>(L"0000000000000000000000042"));
+	CPPUNIT_ASSERT_EQUAL(-1, fz::to_integral<int>("", -1));
+	CPPUNIT_ASSERT_EQUAL(-1, fz::to_integral<int>("-", -1));
+	CPPUNIT_ASSERT_EQUAL(-1, fz::to_integral<int>("+-1", -1));
+	CPPUNIT_ASSERT_EQUAL(-1, fz::to_integral<int>(" 1", -1));
+	CPPUNIT_ASSERT_EQUAL(-1, fz::to_integral<int>(L"1 ", -1));
+	CPPUNIT_ASSERT_EQUAL(-1, fz::to_integral<int>("0x10", -1));
+	CPPUNIT_ASSERT_EQUAL(std::numeric_limits<unsigned int>::max(), fz::to_integral<unsigned int>("-1"));
+	CPPUNIT_ASSERT_EQUAL(true, fz::to_integral<bool>("2"));
+}
+
 void string_test::test_startsendswith()
 {
 	CPPUNIT_ASSERT_EQUAL(false, fz::starts_with(std::string("hello"), std::string("world")));
@@ -237,3 +570,142 @@ void string_test::test_normalize_hyphens()
 	CPPUNIT_ASSERT_EQUAL(std::string("--------"), fz::normalize_hyphens(fz::percent_decode_s("-" "%e2%80%90" "%e2%80%91" "%e2%80%92" "%e2%80%93" "%e2%80%94" "%e2%80%95" "%e2%88%92")));
 	ASSERT_EQUAL(std::wstring(L"--------"), fz::normalize_hyphens(fz::to_wstring_from_utf8(fz::percent_decode_s("-" "%e2%80%90" "%e2%80%91" "%e2%80%92" "%e2%80%93" "%e2%80%94" "%e2%80%95" "%e2%88%92"))));
 }
+
+namespace {
+// Character by character, as the functions used to be implemented
+template<typename String>
+String reference_case(String const& s, bool lower)
+{
+	String ret;
+	for (auto const& c : s) {
+		ret += lower ? fz::tolower_ascii(c) : fz::toupper_ascii(c);
+	}
+	return ret;
+}
+
+template<typename String>
+bool reference_less(String const& a, String const& b)
+{
+	return std::lexicographical_compare(a.cbegin(), a.cend(), b.cbegin(), b.cend(), [](auto const& a, auto const& b) {
+		return fz::tolower_ascii(a) < fz::tolower_ascii(b);
+	});
+}
+
+template<typename String>
+void check_case_insensitive_ascii(typename String::value_type const* alphabet, size_t alphabet_size)
+{
+	// Lengths spanning several blocks, differences at all positions
+	uint64_t seed = 0x1234567;
+	auto const next = [&seed]() {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		return static_cast<size_t>(seed >> 33);
+	};
+	for (size_t len = 0; len < 150; ++len) {
+		String a;
+		for (size_t i = 0; i < len; ++i) {
+			a += alphabet[next() % alphabet_size];
+		}
+		CPPUNIT_ASSERT(fz::str_tolower_ascii(a) == reference_case(a, true));
+		CPPUNIT_ASSERT(fz::str_toupper_ascii(a) == reference_case(a, false));
+
+		String b = fz::str_toupper_ascii(a);
+		CPPUNIT_ASSERT(fz::equal_insensitive_ascii(a, b));
+		CPPUNIT_ASSERT_EQUAL(len, fz::mismatch_insensitive_ascii(a, b));
+		CPPUNIT_ASSERT(!fz::less_insensitive_ascii()(a, b));
+		CPPUNIT_ASSERT(!fz::less_insensitive_ascii()(b, a));
+
+		for (size_t pos = 0; pos < len; ++pos) {
+			String c = b;
+			c[pos] = alphabet[next() % alphabet_size];
+			bool const differs = fz::tolower_ascii(c[pos]) != fz::tolower_ascii(a[pos]);
+			CPPUNIT_ASSERT_EQUAL(differs ? pos : len, fz::mismatch_insensitive_ascii(a, c));
+			CPPUNIT_ASSERT_EQUAL(!differs, fz::equal_insensitive_ascii(a, c));
+			CPPUNIT_ASSERT_EQUAL(reference_less(a, c), fz::less_insensitive_ascii()(a, c));
+			CPPUNIT_ASSERT_EQUAL(reference_less(c, a), fz::less_insensitive_ascii()(c, a));
+		}
+
+		String const prefix = a.substr(0, len / 2);
+		CPPUNIT_ASSERT_EQUAL(prefix.size(), fz::mismatch_insensitive_ascii(prefix, b));
+		CPPUNIT_ASSERT_EQUAL(prefix.size() < len, fz::less_insensitive_ascii()(prefix, b));
+		CPPUNIT_ASSERT(!fz::less_insensitive_ascii()(b, prefix));
+	}
+}
+}
+
+void string_test::test_case_insensitive_ascii()
+{
+	char const narrow[] = "aAzZ@[`{iI09 \x7f\x80\xc4\xff";
+	check_case_insensitive_ascii<std::string>(narrow, sizeof(narrow) - 1);
+
+	wchar_t const wide[] = L"aAzZ@[`{iI09 \x7f\x80\xc4\xff\x130\x131\x1e9e\xfffd";
+	check_case_insensitive_ascii<std::wstring>(wide, sizeof(wide) / sizeof(wchar_t) - 1);
+
+	std::map<std::string, int, fz::less_insensitive_ascii> m;
+	m["Content-Type"] = 1;
+	m["content-length"] = 2;
+	CPPUNIT_ASSERT_EQUAL(1, m["CONTENT-TYPE"]);
+	CPPUNIT_ASSERT_EQUAL(size_t(2), m.size());
+}
+
+void string_test::test_conversion_utf8_blocks()
+{
+	// Non-ASCII characters at all positions in strings spanning several blocks
+	std::wstring const chars[] = { L"\xe4", L"\x20ac", L"\xfffd", L"\x7f", std::wstring(1, 0) };
+	std::string const chars_utf8[] = { "\xc3\xa4", "\xe2\x82\xac", "\xef\xbf\xbd", "\x7f", std::string(1, 0) };
+	for (size_t len = 0; len < 70; ++len) {
+		for (size_t pos = 0; pos <= len; ++pos) {
+			for (size_t c = 0; c < sizeof(chars) / sizeof(chars[0]); ++c) {
+				std::wstring w(len, L'a');
+				w.insert(pos, chars[c]);
+				std::string u(len, 'a');
+				u.insert(pos, chars_utf8[c]);
+
+				ASSERT_EQUAL(u, fz::to_utf8(w));
+				ASSERT_EQUAL(w, fz::to_wstring_from_utf8(u));
+			}
+		}
+		std::string const s(len, 'x');
+		ASSERT_EQUAL(s, fz::to_string(fz::to_wstring(s)));
+	}
+
+	std::wstring const supplementary = fz::to_wstring_from_utf8("a\xf0\x9f\x98\x80z\xf4\x8f\xbf\xbf");
+	if constexpr (sizeof(wchar_t) == 2) {
+		ASSERT_EQUAL(std::wstring(L"a\xd83d\xde00z\xdbff\xdfff"), supplementary);
+	}
+	else {
+		ASSERT_EQUAL(std::wstring(L"a\x1f600z\x10ffff"), supplementary);
+	}
+	ASSERT_EQUAL(std::string("a\xf0\x9f\x98\x80z\xf4\x8f\xbf\xbf"), fz::to_utf8(supplementary));
+}
+
+void string_test::test_conversion_utf8_invalid()
+{
+	char const* const invalid[] = {
+		"\x80", // Lone continuation
+		"a\xc3", // Truncated
+		"\xe2\x82", // Truncated
+		"\xc3\x28", // Bad continuation
+		"\xc0\xaf", // Overlong
+		"\xe0\x80\xaf", // Overlong
+		"\xf0\x80\x80\xaf", // Overlong
+		"\xed\xa0\x80", // Surrogate
+		"\xf4\x90\x80\x80", // Beyond U+10FFFF
+		"\xf8\x88\x80\x80\x80", // Five octets
+		"\xff"
+	};
+	for (auto const& in : invalid) {
+		CPPUNIT_ASSERT(fz::to_wstring_from_utf8(in).empty());
+
+		// Also when preceded by a block of ASCII
+		CPPUNIT_ASSERT(fz::to_wstring_from_utf8(std::string(40, 'a') + in + "b").empty());
+	}
+
+	if constexpr (sizeof(wchar_t) == 2) {
+		CPPUNIT_ASSERT(fz::to_utf8(std::wstring(L"a\xd800")).empty());
+		CPPUNIT_ASSERT(fz::to_utf8(std::wstring(L"a\xdc00z")).empty());
+	}
+	else {
+		CPPUNIT_ASSERT(fz::to_utf8(std::wstring(L"a\xd800z")).empty());
+		CPPUNIT_ASSERT(fz::to_utf8(std::wstring(1, static_cast<wchar_t>(0x110000))).empty());
+	}
+}
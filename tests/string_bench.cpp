@@ -0,0 +1,233 @@
+#include "../lib/libfilezilla/string.hpp"
+#include "../lib/libfilezilla/time.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <vector>
+
+// Measures the ASCII case-insensitive string functions on short strings,
+// like HTTP header names and query string keys, and on long strings.
+// Character by character implementations serve as baseline.
+// Also measures the throughput of the conversions between narrow and wide strings.
+
+namespace {
+size_t volatile sink{};
+
+void report(char const* what, size_t n, size_t bytes, fz::monotonic_clock const& start)
+{
+	auto const elapsed = fz::monotonic_clock::now() - start;
+	std::cout << "  " << what << ": " << (elapsed.get_milliseconds() * 1000000 / static_cast<int64_t>(n)) << " ns/op";
+	if (elapsed.get_milliseconds()) {
+		std::cout << ", " << static_cast<int64_t>(bytes) / (elapsed.get_milliseconds() * 1000) << " MB/s";
+	}
+	std::cout << std::endl;
+}
+
+std::string scalar_tolower(std::string_view const& s)
+{
+	std::string ret;
+	ret.resize(s.size());
+	for (size_t i = 0; i < s.size(); ++i) {
+		ret[i] = fz::tolower_ascii(s[i]);
+	}
+	return ret;
+}
+
+bool scalar_equal(std::string_view const& a, std::string_view const& b)
+{
+	return std::equal(a.cbegin(), a.cend(), b.cbegin(), b.cend(), [](char a, char b) {
+		return fz::tolower_ascii(a) == fz::tolower_ascii(b);
+	});
+}
+
+struct scalar_less final
+{
+	bool operator()(std::string const& a, std::string const& b) const {
+		return std::lexicographical_compare(a.cbegin(), a.cend(), b.cbegin(), b.cend(), [](char a, char b) {
+			return fz::tolower_ascii(a) < fz::tolower_ascii(b);
+		});
+	}
+};
+
+template<typename Less>
+void run_map(char const* what, std::vector<std::string> const& keys, std::vector<std::string> const& lookups, size_t rounds)
+{
+	std::map<std::string, size_t, Less> m;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		m[keys[i]] = i;
+	}
+
+	size_t bytes{};
+	auto const start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& l : lookups) {
+			sink = sink + m.count(l);
+			bytes += l.size();
+		}
+	}
+	report(what, rounds * lookups.size(), bytes, start);
+}
+
+void run(std::vector<std::string> const& keys, size_t rounds)
+{
+	std::vector<std::string> upper;
+	size_t bytes{};
+	for (auto const& k : keys) {
+		upper.push_back(fz::str_toupper_ascii(k));
+		bytes += k.size();
+	}
+
+	auto start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& k : upper) {
+			sink = sink + scalar_tolower(k).size();
+		}
+	}
+	report("tolower, scalar", rounds * keys.size(), rounds * bytes, start);
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& k : upper) {
+			sink = sink + fz::str_tolower_ascii(k).size();
+		}
+	}
+	report("str_tolower_ascii", rounds * keys.size(), rounds * bytes, start);
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < keys.size(); ++i) {
+			sink = sink + scalar_equal(keys[i], upper[i]);
+		}
+	}
+	report("equal, scalar", rounds * keys.size(), rounds * bytes, start);
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < keys.size(); ++i) {
+			sink = sink + fz::equal_insensitive_ascii(keys[i], upper[i]);
+		}
+	}
+	report("equal_insensitive_ascii", rounds * keys.size(), rounds * bytes, start);
+
+	run_map<scalar_less>("map lookup, scalar", keys, upper, rounds);
+	run_map<fz::less_insensitive_ascii>("map lookup, less_insensitive_ascii", keys, upper, rounds);
+}
+
+void run_conversion(std::vector<std::string> const& utf8, size_t rounds, bool locale)
+{
+	std::vector<std::wstring> wide;
+	size_t bytes{};
+	for (auto const& u : utf8) {
+		wide.push_back(fz::to_wstring_from_utf8(u));
+		if (wide.back().empty()) {
+			std::cerr << "Conversion failed" << std::endl;
+			exit(1);
+		}
+		bytes += u.size();
+	}
+
+	auto start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& u : utf8) {
+			sink = sink + fz::to_wstring_from_utf8(u).size();
+		}
+	}
+	report("to_wstring_from_utf8", rounds * utf8.size(), rounds * bytes, start);
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& w : wide) {
+			sink = sink + fz::to_utf8(w).size();
+		}
+	}
+	report("to_utf8", rounds * utf8.size(), rounds * bytes, start);
+
+	if (!locale) {
+		return;
+	}
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& u : utf8) {
+			sink = sink + fz::to_wstring(u).size();
+		}
+	}
+	report("to_wstring", rounds * utf8.size(), rounds * bytes, start);
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (auto const& w : wide) {
+			sink = sink + fz::to_string(w).size();
+		}
+	}
+	report("to_string", rounds * utf8.size(), rounds * bytes, start);
+}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t rounds = 200;
+	if (argc > 1) {
+		rounds = fz::to_integral<size_t>(std::string_view(argv[1]), rounds);
+	}
+
+	// Typical header names and query string keys
+	std::vector<std::string> const headers = {
+		"Accept", "Accept-Encoding", "Accept-Language", "Authorization", "Cache-Control", "Connection",
+		"Content-Length", "Content-Type", "Cookie", "Host", "If-Modified-Since", "If-None-Match",
+		"Origin", "Referer", "Transfer-Encoding", "Upgrade", "User-Agent", "X-Forwarded-For",
+		"X-Forwarded-Proto", "X-Request-Id"
+	};
+	std::vector<std::string> shorts;
+	for (size_t i = 0; i < 50; ++i) {
+		for (auto const& h : headers) {
+			shorts.push_back(h + "-" + std::to_string(i));
+		}
+	}
+	std::cout << "Short strings:" << std::endl;
+	run(shorts, rounds * 10);
+
+	// Long keys sharing a common prefix
+	std::vector<std::string> longs;
+	std::string const prefix(4000, 'x');
+	for (size_t i = 0; i < 100; ++i) {
+		longs.push_back(prefix + "/Path/To/Some/File-" + std::to_string(i));
+	}
+	std::cout << "Long strings:" << std::endl;
+	run(longs, rounds);
+
+	// Paths, and text with a few or many non-ASCII characters.
+	// The locale dependent conversions only get measured on ASCII, as the
+	// locale in the environment may not be able to represent the others.
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < 1000; ++i) {
+		paths.push_back("/home/user/Documents/Projects/libfilezilla/lib/file_" + std::to_string(i) + ".cpp");
+	}
+	std::cout << "Conversion, paths:" << std::endl;
+	run_conversion(paths, rounds, true);
+
+	std::vector<std::string> text;
+	for (size_t i = 0; i < 100; ++i) {
+		std::string t;
+		for (size_t j = 0; j < 20; ++j) {
+			t += "Gr\xc3\xbc\xc3\x9f Gott, sch\xc3\xb6ne Gr\xc3\xbc\xc3\x9f" "e aus M\xc3\xbcnchen. ";
+		}
+		text.push_back(t);
+	}
+	std::cout << "Conversion, Latin text:" << std::endl;
+	run_conversion(text, rounds, false);
+
+	std::vector<std::string> cjk;
+	for (size_t i = 0; i < 100; ++i) {
+		std::string t;
+		for (size_t j = 0; j < 40; ++j) {
+			t += "\xe6\x96\x87\xe4\xbb\xb6\xe5\x90\x8d \xf0\x9f\x93\x81 ";
+		}
+		cjk.push_back(t);
+	}
+	std::cout << "Conversion, CJK text:" << std::endl;
+	run_conversion(cjk, rounds, false);
+
+	return 0;
+}
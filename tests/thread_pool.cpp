@@ -0,0 +1,303 @@
+#include "../lib/libfilezilla/thread_pool.hpp"
+#include "../lib/libfilezilla/util.hpp"
+
+#include "test_utils.hpp"
+
+#include <atomic>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+class thread_pool_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(thread_pool_test);
+	CPPUNIT_TEST(test_spawn);
+	CPPUNIT_TEST(test_submit);
+	CPPUNIT_TEST(test_nested_submit);
+	CPPUNIT_TEST(test_detach);
+	CPPUNIT_TEST(test_max_threads);
+	CPPUNIT_TEST(test_idle_timeout);
+	CPPUNIT_TEST(test_placement);
+	CPPUNIT_TEST(test_accounting);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_spawn();
+	void test_submit();
+	void test_nested_submit();
+	void test_detach();
+	void test_max_threads();
+	void test_idle_timeout();
+	void test_placement();
+	void test_accounting();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(thread_pool_test);
+
+void thread_pool_test::test_spawn()
+{
+	fz::thread_pool pool;
+
+	std::atomic<int> v{};
+	auto task = pool.spawn([&v]{ ++v; });
+	CPPUNIT_ASSERT(task);
+	task.join();
+	CPPUNIT_ASSERT(!task);
+	CPPUNIT_ASSERT_EQUAL(1, v.load());
+}
+
+void thread_pool_test::test_submit()
+{
+	fz::thread_pool pool(4);
+
+	std::atomic<int> v{};
+	std::vector<fz::pooled_task> tasks;
+	for (int i = 0; i < 5000; ++i) {
+		tasks.emplace_back(pool.submit([&v]{ ++v; }));
+		CPPUNIT_ASSERT(tasks.back());
+	}
+	for (auto & t : tasks) {
+		t.join();
+		CPPUNIT_ASSERT(!t);
+	}
+	CPPUNIT_ASSERT_EQUAL(5000, v.load());
+
+	CPPUNIT_ASSERT(!pool.submit(std::function<void()>()));
+}
+
+void thread_pool_test::test_nested_submit()
+{
+	fz::thread_pool pool(2);
+
+	// Joining inside a worker must not deadlock even with all workers busy
+	std::atomic<int> v{};
+	std::vector<fz::pooled_task> tasks;
+	for (int i = 0; i < 8; ++i) {
+		tasks.emplace_back(pool.submit([&pool, &v]{
+			std::vector<fz::pooled_task> inner;
+			for (int j = 0; j < 100; ++j) {
+				inner.emplace_back(pool.submit([&v]{ ++v; }));
+			}
+		}));
+	}
+	tasks.clear();
+	CPPUNIT_ASSERT_EQUAL(800, v.load());
+}
+
+void thread_pool_test::test_detach()
+{
+	std::atomic<int> v{};
+	{
+		fz::thread_pool pool(2);
+		for (int i = 0; i < 100; ++i) {
+			pool.submit([&v]{ fz::yield(); ++v; }).detach();
+		}
+	}
+	// The pool's destructor runs all queued tasks
+	CPPUNIT_ASSERT_EQUAL(100, v.load());
+}
+
+void thread_pool_test::test_max_threads()
+{
+	fz::thread_pool pool;
+	pool.set_max_threads(2);
+
+	std::atomic<bool> go{};
+	std::atomic<int> v{};
+	std::vector<fz::async_task> tasks;
+	for (int i = 0; i < 10; ++i) {
+		tasks.emplace_back(pool.spawn([&go, &v]{
+			while (!go) {
+				fz::yield();
+			}
+			++v;
+		}));
+		CPPUNIT_ASSERT(tasks.back());
+	}
+
+	auto stats = pool.get_stats();
+	CPPUNIT_ASSERT_EQUAL(size_t(2), stats.threads);
+	CPPUNIT_ASSERT_EQUAL(size_t(0), stats.idle);
+	CPPUNIT_ASSERT_EQUAL(size_t(8), stats.queued);
+
+	// Detaching a queued task still runs it
+	tasks.back().detach();
+
+	go = true;
+	for (auto & t : tasks) {
+		t.join();
+	}
+
+	while (v != 10) {
+		fz::yield();
+	}
+
+	stats = pool.get_stats();
+	CPPUNIT_ASSERT_EQUAL(size_t(0), stats.queued);
+	CPPUNIT_ASSERT_EQUAL(size_t(2), stats.peak);
+}
+
+void thread_pool_test::test_idle_timeout()
+{
+	fz::thread_pool pool;
+	pool.set_idle_timeout(fz::duration::from_milliseconds(20));
+
+	pool.spawn([]{}).join();
+	CPPUNIT_ASSERT_EQUAL(size_t(1), pool.get_stats().peak);
+
+	for (int i = 0; i < 500 && pool.get_stats().threads; ++i) {
+		fz::sleep(fz::duration::from_milliseconds(10));
+	}
+	CPPUNIT_ASSERT_EQUAL(size_t(0), pool.get_stats().threads);
+
+	// Reaped threads get replaced on demand
+	std::atomic<int> v{};
+	pool.spawn([&v]{ ++v; }).join();
+	CPPUNIT_ASSERT_EQUAL(1, v.load());
+}
+
+namespace {
+#if defined(__linux__)
+std::string own_name()
+{
+	char name[16]{};
+	pthread_getname_np(pthread_self(), name, sizeof(name));
+	return name;
+}
+
+std::vector<unsigned int> own_cpus()
+{
+	std::vector<unsigned int> ret;
+	cpu_set_t set;
+	if (!sched_getaffinity(0, sizeof(set), &set)) {
+		for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &set)) {
+				ret.push_back(cpu);
+			}
+		}
+	}
+	return ret;
+}
+#endif
+}
+
+void thread_pool_test::test_placement()
+{
+	auto const nodes = fz::get_numa_nodes();
+	CPPUNIT_ASSERT(!nodes.empty());
+	for (auto const& node : nodes) {
+		CPPUNIT_ASSERT(!node.empty());
+	}
+
+#if defined(__linux__)
+	// Pin to a single CPU available to the process
+	auto const available = own_cpus();
+	CPPUNIT_ASSERT(!available.empty());
+
+	fz::thread_placement placement;
+	placement.name = "fz-test";
+	placement.cpus.push_back(available.back());
+
+	fz::thread_pool pool(2);
+	pool.set_placement(placement, true);
+
+	std::string name;
+	std::vector<unsigned int> cpus;
+	pool.spawn([&]{
+		name = own_name();
+		cpus = own_cpus();
+	}).join();
+	CPPUNIT_ASSERT_EQUAL(std::string("fz-test"), name);
+	CPPUNIT_ASSERT(cpus == placement.cpus);
+
+	// Workers get numbered. Joining could run the task in this thread, so wait instead.
+	std::atomic<bool> done{};
+	pool.submit([&]{
+		name = own_name();
+		cpus = own_cpus();
+		done = true;
+	}).detach();
+	while (!done) {
+		fz::yield();
+	}
+	CPPUNIT_ASSERT(name == "fz-test0" || name == "fz-test1");
+	CPPUNIT_ASSERT(cpus == placement.cpus);
+
+	fz::thread t;
+	placement.name = "fz-thread";
+	CPPUNIT_ASSERT(t.run([&]{ name = own_name(); }, placement));
+	t.join();
+	CPPUNIT_ASSERT_EQUAL(std::string("fz-thread"), name);
+#endif
+}
+
+void thread_pool_test::test_accounting()
+{
+	fz::thread_pool pool;
+
+	// Not accounted
+	pool.spawn([]{}, "early").join();
+
+	pool.enable_accounting(true);
+
+	pool.spawn([]{
+		// Burn some CPU
+		auto const start = fz::monotonic_clock::now();
+		while (fz::monotonic_clock::now() - start < fz::duration::from_milliseconds(50)) {
+		}
+	}, "busy").join();
+	pool.spawn([]{ fz::sleep(fz::duration::from_milliseconds(50)); }, "blocked").join();
+	pool.spawn([]{}).join();
+
+	auto accounting = pool.get_accounting();
+	CPPUNIT_ASSERT(accounting.categories.find("early") == accounting.categories.end());
+	CPPUNIT_ASSERT_EQUAL(size_t(3), accounting.categories.size());
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), accounting.categories[""].tasks);
+
+	auto const& busy = accounting.categories["busy"];
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), busy.tasks);
+	CPPUNIT_ASSERT(busy.wall_us >= 50000);
+
+	auto const& blocked = accounting.categories["blocked"];
+	CPPUNIT_ASSERT_EQUAL(uint64_t(1), blocked.tasks);
+	CPPUNIT_ASSERT(blocked.wall_us >= 50000);
+
+#if !FZ_MAC
+	CPPUNIT_ASSERT(busy.cpu_us >= 25000);
+	CPPUNIT_ASSERT(blocked.cpu_us < 25000);
+#endif
+
+	CPPUNIT_ASSERT_EQUAL(pool.get_stats().threads, accounting.threads.size());
+	uint64_t tasks{};
+	for (auto const& t : accounting.threads) {
+		tasks += t.tasks;
+	}
+	CPPUNIT_ASSERT_EQUAL(uint64_t(3), tasks);
+
+	// Running tasks are included
+	std::atomic<bool> quit{};
+	auto task = pool.spawn([&quit]{
+		while (!quit) {
+			fz::sleep(fz::duration::from_milliseconds(1));
+		}
+	}, "running");
+	fz::sleep(fz::duration::from_milliseconds(20));
+	accounting = pool.get_accounting();
+	CPPUNIT_ASSERT_EQUAL(uint64_t(0), accounting.categories["running"].tasks);
+	CPPUNIT_ASSERT(accounting.categories["running"].wall_us >= 10000);
+	quit = true;
+	task.join();
+
+	pool.reset_accounting();
+	accounting = pool.get_accounting();
+	CPPUNIT_ASSERT(accounting.categories.empty());
+	for (auto const& t : accounting.threads) {
+		CPPUNIT_ASSERT_EQUAL(uint64_t(0), t.tasks);
+	}
+}
@@ -13,6 +13,9 @@ class TimeTest final : public CppUnit::TestFixture
 	CPPUNIT_TEST(testAlternateMidnight);
 	CPPUNIT_TEST(testRFC822);
 	CPPUNIT_TEST(testRFC3339);
+	CPPUNIT_TEST(testFixedFormats);
+	CPPUNIT_TEST(testUTCFields);
+	CPPUNIT_TEST(testCoarseClock);
 	CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -26,6 +29,9 @@ public:
 
 	void testRFC822();
 	void testRFC3339();
+	void testFixedFormats();
+	void testUTCFields();
+	void testCoarseClock();
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(TimeTest);
@@ -141,3 +147,86 @@ void TimeTest::testRFC3339()
 	CPPUNIT_ASSERT(t.set_rfc3339(s2));
 	CPPUNIT_ASSERT(t == t2);
 }
+
+void TimeTest::testFixedFormats()
+{
+	fz::datetime const t1(fz::datetime::utc, 1994, 11, 6, 8, 49, 37, 123);
+	fz::datetime const t2(fz::datetime::utc, 1957, 10, 4, 19, 28, 34);
+
+	CPPUNIT_ASSERT_EQUAL(std::string("Sun, 06 Nov 1994 08:49:37 GMT"), t1.get_rfc822());
+	CPPUNIT_ASSERT_EQUAL(std::string("Fri, 04 Oct 1957 19:28:34 GMT"), t2.get_rfc822());
+	CPPUNIT_ASSERT_EQUAL(std::string("1994-11-06T08:49:37.123Z"), t1.get_rfc3339());
+	CPPUNIT_ASSERT_EQUAL(std::string("1957-10-04T19:28:34Z"), t2.get_rfc3339());
+	CPPUNIT_ASSERT_EQUAL(std::string("19941106084937.123"), t1.get_mdtm());
+	CPPUNIT_ASSERT_EQUAL(std::string("19571004192834"), t2.get_mdtm());
+	CPPUNIT_ASSERT(fz::datetime().get_rfc822().empty());
+
+	char buf[fz::datetime::max_formatted_size];
+	CPPUNIT_ASSERT_EQUAL(size_t(29), t1.get_rfc822(buf));
+	CPPUNIT_ASSERT_EQUAL(size_t(0), fz::datetime().get_mdtm(buf));
+
+	// Agree with strftime across a wide range of dates
+	fz::datetime t(fz::datetime::utc, 1601, 1, 1, 0, 0, 0);
+	for (int i = 0; i < 3000; ++i) {
+		CPPUNIT_ASSERT_EQUAL(t.format("%a, %d %b %Y %H:%M:%S GMT", fz::datetime::utc), t.get_rfc822());
+		CPPUNIT_ASSERT_EQUAL(t.format("%Y-%m-%dT%H:%M:%SZ", fz::datetime::utc), t.get_rfc3339());
+		CPPUNIT_ASSERT_EQUAL(t.format("%Y%m%d%H%M%S", fz::datetime::utc), t.get_mdtm());
+
+		fz::datetime parsed;
+		CPPUNIT_ASSERT(parsed.set_rfc822(t.get_rfc822()) && parsed == t);
+		CPPUNIT_ASSERT(parsed.set_rfc3339(t.get_rfc3339()) && parsed == t);
+		CPPUNIT_ASSERT(parsed.set(t.get_mdtm(), fz::datetime::utc) && parsed == t);
+
+		t += fz::duration::from_seconds(86400 * 97 + 3600 * 5 + 61);
+	}
+
+	fz::datetime parsed;
+	CPPUNIT_ASSERT(parsed.set(t1.get_mdtm(), fz::datetime::utc) && parsed == t1);
+	CPPUNIT_ASSERT(parsed.set_rfc3339(t1.get_rfc3339()) && parsed == t1);
+	CPPUNIT_ASSERT(parsed.set_rfc3339("1994-11-06t10:49:37.1234567+02:00") && parsed == t1);
+	CPPUNIT_ASSERT(!parsed.set_rfc3339("1994-11-06T08:49:37+0200"));
+}
+
+void TimeTest::testUTCFields()
+{
+	// Out-of-range fields get normalized just like timegm does it
+	int const fields[][6] = {
+		{2020, 2, 29, 12, 0, 0},
+		{2021, 2, 29, 12, 0, 0},
+		{2021, 13, 1, 0, 0, 0},
+		{2021, 0, 1, 0, 0, 0},
+		{2021, 1, 0, 24, 60, 60},
+		{1900, 3, 1, 0, 0, 0},
+		{2000, 2, 29, 23, 59, 59},
+		{1969, 12, 31, 23, 59, 59},
+		{1583, 1, 1, 0, 0, 0},
+	};
+	for (auto const& f : fields) {
+		fz::datetime const fast(fz::datetime::utc, f[0], f[1], f[2], f[3], f[4], f[5]);
+
+		tm t{};
+		t.tm_year = f[0] - 1900;
+		t.tm_mon = f[1] - 1;
+		t.tm_mday = f[2];
+		t.tm_hour = f[3];
+		t.tm_min = f[4];
+		t.tm_sec = f[5];
+		fz::datetime slow;
+		CPPUNIT_ASSERT(slow.set(t, fz::datetime::seconds, fz::datetime::utc));
+		CPPUNIT_ASSERT(fast == slow);
+	}
+}
+
+void TimeTest::testCoarseClock()
+{
+	for (int i = 0; i < 1000; ++i) {
+		auto const coarse = fz::monotonic_clock::coarse_now();
+		auto const precise = fz::monotonic_clock::now();
+		CPPUNIT_ASSERT(coarse <= precise);
+		CPPUNIT_ASSERT(coarse + fz::duration::from_seconds(1) > precise);
+	}
+
+	auto const start = fz::monotonic_clock::now();
+	fz::sleep(fz::duration::from_milliseconds(100));
+	CPPUNIT_ASSERT(fz::monotonic_clock::coarse_now() > start);
+}
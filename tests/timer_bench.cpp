@@ -0,0 +1,76 @@
+#include "../lib/libfilezilla/event_handler.hpp"
+#include "../lib/libfilezilla/event_loop.hpp"
+
+#include <iostream>
+#include <vector>
+
+// Measures the cost of timer churn with a large number of timers,
+// modelling one idle-timeout timer per connection that gets reset
+// whenever there is activity on the connection.
+
+struct handler final : public fz::event_handler
+{
+	handler(fz::event_loop & loop)
+		: fz::event_handler(loop)
+	{}
+
+	~handler()
+	{
+		remove_handler();
+	}
+
+	void operator()(fz::event_base const&)
+	{
+	}
+};
+
+namespace {
+void report(char const* what, size_t n, fz::monotonic_clock const& start)
+{
+	auto const elapsed = fz::monotonic_clock::now() - start;
+	std::cout << what << ": " << n << " operations in " << elapsed.get_milliseconds() << " ms";
+	if (n) {
+		std::cout << ", " << (elapsed.get_milliseconds() * 1000000 / static_cast<int64_t>(n)) << " ns/op";
+	}
+	std::cout << std::endl;
+}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t timers = 100000;
+	if (argc > 1) {
+		timers = fz::to_integral<size_t>(std::string_view(argv[1]), timers);
+	}
+	size_t const rounds = 10;
+
+	fz::event_loop loop;
+	handler h(loop);
+
+	std::vector<fz::timer_id> ids;
+	ids.reserve(timers);
+
+	auto const base = fz::monotonic_clock::now() + fz::duration::from_hours(1);
+
+	auto start = fz::monotonic_clock::now();
+	for (size_t i = 0; i < timers; ++i) {
+		ids.push_back(h.add_timer(base + fz::duration::from_milliseconds(i % 60000)));
+	}
+	report("add_timer", timers, start);
+
+	start = fz::monotonic_clock::now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < timers; ++i) {
+			ids[i] = h.stop_add_timer(ids[i], base + fz::duration::from_milliseconds((i * 7919 + r) % 60000));
+		}
+	}
+	report("stop_add_timer", timers * rounds, start);
+
+	start = fz::monotonic_clock::now();
+	for (auto id : ids) {
+		h.stop_timer(id);
+	}
+	report("stop_timer", timers, start);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include "../lib/libfilezilla/translate.hpp"
+
+#include "test_utils.hpp"
+
+class translate_test final : public CppUnit::TestFixture
+{
+	CPPUNIT_TEST_SUITE(translate_test);
+	CPPUNIT_TEST(test_cache);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp() {}
+	void tearDown() {}
+
+	void test_cache();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(translate_test);
+
+namespace {
+int calls{};
+std::wstring prefix = L"A";
+
+std::wstring translator(char const* const t)
+{
+	++calls;
+	return prefix + fz::to_wstring(t);
+}
+
+std::wstring translator_pf(char const* const singular, char const* const plural, int64_t n)
+{
+	++calls;
+	return prefix + fz::to_wstring((n % 10 == 1 && n % 100 != 11) ? singular : plural);
+}
+}
+
+void translate_test::test_cache()
+{
+	fz::set_translators(translator, translator_pf);
+
+	char const* const s = "Hello";
+	auto const v = fz::translate_view(s);
+	CPPUNIT_ASSERT(v == L"AHello");
+	CPPUNIT_ASSERT(fz::translate_view(s).data() == v.data());
+	CPPUNIT_ASSERT_EQUAL(1, calls);
+
+	char const* const singular = "%d file";
+	char const* const plural = "%d files";
+	CPPUNIT_ASSERT(fz::translate_view(singular, plural, 1) == L"A%d file");
+	CPPUNIT_ASSERT(fz::translate_view(singular, plural, 2) == L"A%d files");
+	CPPUNIT_ASSERT(fz::translate_view(singular, plural, 11) == L"A%d files");
+	CPPUNIT_ASSERT(fz::translate_view(singular, plural, 121) == L"A%d file");
+	CPPUNIT_ASSERT_EQUAL(5, calls);
+
+	// Shares the entry of 121
+	CPPUNIT_ASSERT(fz::translate_view(singular, plural, 12321) == L"A%d file");
+	CPPUNIT_ASSERT(fz::translate_view(singular, plural, 2) == L"A%d files");
+	CPPUNIT_ASSERT_EQUAL(5, calls);
+
+	// Views survive changing the language
+	prefix = L"B";
+	fz::reset_translation_cache();
+	CPPUNIT_ASSERT(fz::translate_view(s) == L"BHello");
+	CPPUNIT_ASSERT(v == L"AHello");
+	CPPUNIT_ASSERT_EQUAL(6, calls);
+
+	fz::set_translators(nullptr, nullptr);
+	CPPUNIT_ASSERT(fz::translate_view(s) == L"Hello");
+}
@@ -5,10 +5,19 @@
 
 #include <string.h>
 
+#ifndef FZ_WINDOWS
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 class util_test final : public CppUnit::TestFixture
 {
 	CPPUNIT_TEST_SUITE(util_test);
 	CPPUNIT_TEST(test_random);
+	CPPUNIT_TEST(test_random_large);
+#ifndef FZ_WINDOWS
+	CPPUNIT_TEST(test_random_fork);
+#endif
 	CPPUNIT_TEST(test_bitscan);
 	CPPUNIT_TEST_SUITE_END();
 
@@ -17,6 +26,10 @@ public:
 	void tearDown() {}
 
 	void test_random();
+	void test_random_large();
+#ifndef FZ_WINDOWS
+	void test_random_fork();
+#endif
 	void test_bitscan();
 };
 
@@ -31,6 +44,64 @@ void util_test::test_random()
 	CPPUNIT_ASSERT(first != second);
 }
 
+void util_test::test_random_large()
+{
+	// Spans several refills of the generator's buffer and a reseed
+	std::vector<uint8_t> v = fz::random_bytes(3 * 1024 * 1024 + 17);
+
+	size_t counts[256]{};
+	for (auto const c : v) {
+		++counts[c];
+	}
+	size_t const expected = v.size() / 256;
+	for (auto const count : counts) {
+		CPPUNIT_ASSERT(count > expected * 9 / 10 && count < expected * 11 / 10);
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		auto const n = fz::random_number(-3, 3);
+		CPPUNIT_ASSERT(n >= -3 && n <= 3);
+	}
+}
+
+#ifndef FZ_WINDOWS
+void util_test::test_random_fork()
+{
+	// Parent and child must not continue with the same generator state
+	fz::random_bytes(1);
+
+	int fds[2];
+	CPPUNIT_ASSERT(!pipe(fds));
+
+	pid_t const pid = fork();
+	CPPUNIT_ASSERT(pid != -1);
+	if (!pid) {
+		auto const v = fz::random_bytes(32);
+		_exit(write(fds[1], v.data(), v.size()) == 32 ? 0 : 1);
+	}
+	close(fds[1]);
+
+	auto const parent = fz::random_bytes(32);
+
+	std::vector<uint8_t> child(32);
+	size_t got{};
+	while (got < child.size()) {
+		auto const r = read(fds[0], child.data() + got, child.size() - got);
+		if (r <= 0) {
+			break;
+		}
+		got += static_cast<size_t>(r);
+	}
+	close(fds[0]);
+
+	int status{};
+	waitpid(pid, &status, 0);
+
+	CPPUNIT_ASSERT_EQUAL(size_t(32), got);
+	CPPUNIT_ASSERT(parent != child);
+}
+#endif
+
 void util_test::test_bitscan()
 {
 	CPPUNIT_ASSERT(fz::bitscan(12) == 2);